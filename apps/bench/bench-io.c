@@ -0,0 +1,246 @@
+/*
+ * Benchmarks of pipes, file I/O and path lookups.
+ */
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BENCH_PIPE_SIZE		(64 * 1024 * 1024)
+#define BENCH_FILE_SIZE		(16 * 1024 * 1024)
+#define BENCH_TREE_FILES	1000	/* Files to pick from the tree */
+#define BENCH_TREE_DEPTH	32	/* Levels to descend into the tree */
+#define BENCH_TREE_ROUNDS	20	/* Times every file is visited */
+
+static const unsigned int pipe_sizes[] = { 4096, 65536, 0 };
+static const unsigned int block_sizes[] = { 512, 4096, 65536, 1048576, 0 };
+
+int
+bench_pipe(int variant, struct BENCH_RESULT* br)
+{
+	size_t chunk = pipe_sizes[variant];
+	if (chunk == 0)
+		return BENCH_NO_VARIANT;
+
+	int fd[2];
+	if (pipe(fd) < 0)
+		return bench_fail("pipe");
+	char* buf = malloc(chunk);
+	memset(buf, 0x5a, chunk);
+
+	/* The child drains the pipe until we close our end */
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fd[0]);
+		close(fd[1]);
+		free(buf);
+		return bench_fail("fork");
+	}
+	if (pid == 0) {
+		close(fd[1]);
+		while (read(fd[0], buf, chunk) > 0)
+			/* nothing */ ;
+		_exit(0);
+	}
+	close(fd[0]);
+
+	int r = 0;
+	br->param = chunk;
+	br->bytes = (uint64_t)BENCH_PIPE_SIZE * bench_config.scale;
+	br->ops = br->bytes / chunk;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < br->ops; n++) {
+		if (write(fd[1], buf, chunk) != (ssize_t)chunk) {
+			r = bench_fail("write");
+			break;
+		}
+	}
+	close(fd[1]);
+	int status;
+	waitpid(pid, &status, 0);
+	br->ns = bench_now() - start;
+	free(buf);
+	return r;
+}
+
+/* Writes the file in chunk-sized blocks; if br is given, the writes are timed */
+static int
+write_file(const char* path, size_t chunk, struct BENCH_RESULT* br)
+{
+	unlink(path);
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return bench_fail(path);
+	char* buf = malloc(chunk);
+	memset(buf, 0x5a, chunk);
+
+	int r = 0;
+	uint64_t ops = ((uint64_t)BENCH_FILE_SIZE * bench_config.scale) / chunk;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < ops; n++) {
+		if (write(fd, buf, chunk) != (ssize_t)chunk) {
+			r = bench_fail("write");
+			break;
+		}
+	}
+	if (br != NULL) {
+		br->ns = bench_now() - start;
+		br->ops = ops;
+		br->bytes = ops * chunk;
+	}
+	close(fd);
+	free(buf);
+	return r;
+}
+
+int
+bench_write(int variant, struct BENCH_RESULT* br)
+{
+	size_t chunk = block_sizes[variant];
+	if (chunk == 0)
+		return BENCH_NO_VARIANT;
+
+	char path[256];
+	bench_path(path, sizeof(path), "bench.io");
+	br->param = chunk;
+	int r = write_file(path, chunk, br);
+	unlink(path);
+	return r;
+}
+
+int
+bench_read(int variant, struct BENCH_RESULT* br)
+{
+	size_t chunk = block_sizes[variant];
+	if (chunk == 0)
+		return BENCH_NO_VARIANT;
+
+	char path[256];
+	bench_path(path, sizeof(path), "bench.io");
+	if (write_file(path, 65536, NULL) != 0)
+		return -1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		unlink(path);
+		return bench_fail(path);
+	}
+	char* buf = malloc(chunk);
+
+	br->param = chunk;
+	uint64_t start = bench_now();
+	while (1) {
+		ssize_t len = read(fd, buf, chunk);
+		if (len <= 0)
+			break;
+		br->ops++;
+		br->bytes += len;
+	}
+	br->ns = bench_now() - start;
+	close(fd);
+	unlink(path);
+	free(buf);
+	return (br->bytes == (uint64_t)BENCH_FILE_SIZE * bench_config.scale) ? 0 : bench_fail("read");
+}
+
+/*
+ * The lookup benchmarks visit the files of the tree, which is walked once;
+ * every lookup goes through all components of the path, so deeper trees are
+ * more expensive.
+ */
+static char* tree_files[BENCH_TREE_FILES];
+static unsigned int tree_num_files;
+static unsigned int tree_max_depth;
+
+static void
+walk_tree(const char* dir, unsigned int depth)
+{
+	if (depth > BENCH_TREE_DEPTH)
+		return;
+	DIR* d = opendir(dir);
+	if (d == NULL)
+		return;
+
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL && tree_num_files < BENCH_TREE_FILES) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		size_t len = strlen(dir) + strlen(de->d_name) + 2;
+		char* path = malloc(len);
+		snprintf(path, len, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, de->d_name);
+
+		struct stat sb;
+		if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+			walk_tree(path, depth + 1);
+			free(path);
+			continue;
+		}
+		tree_files[tree_num_files++] = path;
+		if (depth > tree_max_depth)
+			tree_max_depth = depth;
+	}
+	closedir(d);
+}
+
+static int
+get_tree(void)
+{
+	if (tree_num_files == 0)
+		walk_tree(bench_config.tree, 1);
+	if (tree_num_files == 0) {
+		fprintf(stderr, "bench: no files in %s\n", bench_config.tree);
+		return -1;
+	}
+	return 0;
+}
+
+int
+bench_open_close(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+	if (get_tree() != 0)
+		return -1;
+
+	br->param = tree_max_depth;
+	uint64_t start = bench_now();
+	for (unsigned int round = 0; round < BENCH_TREE_ROUNDS * bench_config.scale; round++) {
+		for (unsigned int n = 0; n < tree_num_files; n++) {
+			int fd = open(tree_files[n], O_RDONLY);
+			if (fd < 0)
+				return bench_fail(tree_files[n]);
+			close(fd);
+			br->ops++;
+		}
+	}
+	br->ns = bench_now() - start;
+	return 0;
+}
+
+int
+bench_stat(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+	if (get_tree() != 0)
+		return -1;
+
+	br->param = tree_max_depth;
+	uint64_t start = bench_now();
+	for (unsigned int round = 0; round < BENCH_TREE_ROUNDS * bench_config.scale; round++) {
+		for (unsigned int n = 0; n < tree_num_files; n++) {
+			struct stat sb;
+			if (stat(tree_files[n], &sb) < 0)
+				return bench_fail(tree_files[n]);
+			br->ops++;
+		}
+	}
+	br->ns = bench_now() - start;
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,88 @@
+/*
+ * Benchmarks of page faults. Every operation touches a page of a fresh
+ * mapping for the first time; for files, fault-around may map several
+ * pages per fault, which is part of what we measure.
+ */
+#include <stddef.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BENCH_MAPPING_SIZE	(16 * 1024 * 1024)
+
+static int
+touch_pages(char* p, size_t len, int write, struct BENCH_RESULT* br)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	volatile char* v = p;
+	unsigned int sum = 0;
+
+	br->ops = len / page_size;
+	uint64_t start = bench_now();
+	for (size_t offs = 0; offs < len; offs += page_size) {
+		if (write)
+			v[offs] = 1;
+		else
+			sum += v[offs];
+	}
+	br->ns = bench_now() - start;
+	(void)sum;
+	return 0;
+}
+
+int
+bench_fault_anon(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	size_t len = BENCH_MAPPING_SIZE * bench_config.scale;
+	char* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED)
+		return bench_fail("mmap");
+	int r = touch_pages(p, len, 1, br);
+	munmap(p, len);
+	return r;
+}
+
+int
+bench_fault_file(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	/* Write the file first, so that all its pages are cached */
+	char path[256];
+	bench_path(path, sizeof(path), "bench.map");
+	unlink(path);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return bench_fail(path);
+
+	size_t len = BENCH_MAPPING_SIZE * bench_config.scale;
+	char buf[65536];
+	memset(buf, 0x5a, sizeof(buf));
+	for (size_t done = 0; done < len; done += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			close(fd);
+			unlink(path);
+			return bench_fail("write");
+		}
+	}
+
+	int r = -1;
+	char* p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED) {
+		r = touch_pages(p, len, 0, br);
+		munmap(p, len);
+	} else
+		bench_fail("mmap");
+	close(fd);
+	unlink(path);
+	return r;
+}
+
+/* vim:set ts=2 sw=2: */
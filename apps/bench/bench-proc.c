@@ -0,0 +1,190 @@
+/*
+ * Benchmarks of system calls, processes and threads.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BENCH_SYSCALLS		1000000
+#define BENCH_PROCESSES		200
+#define BENCH_SWITCHES		100000
+#define BENCH_THREAD_STACK	65536
+
+extern char** environ;
+
+int
+bench_null_syscall(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	/*
+	 * There is no system call that does nothing at all; closing an invalid
+	 * handle comes closest, as it fails on the first check.
+	 */
+	br->ops = BENCH_SYSCALLS * bench_config.scale;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < br->ops; n++)
+		sys_close(-1);
+	br->ns = bench_now() - start;
+	return 0;
+}
+
+/* Waits for the child and checks that it exited successfully */
+static int
+reap(pid_t pid)
+{
+	int status;
+	if (waitpid(pid, &status, 0) != pid)
+		return bench_fail("waitpid");
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+int
+bench_fork_wait(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	br->ops = BENCH_PROCESSES * bench_config.scale;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < br->ops; n++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			return bench_fail("fork");
+		if (pid == 0)
+			_exit(0);
+		if (reap(pid) != 0)
+			return -1;
+	}
+	br->ns = bench_now() - start;
+	return 0;
+}
+
+int
+bench_fork_exec(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	char* const argv[] = { (char*)bench_config.self, "-x", NULL };
+	br->ops = BENCH_PROCESSES * bench_config.scale;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < br->ops; n++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			return bench_fail("fork");
+		if (pid == 0) {
+			execvp(argv[0], argv);
+			_exit(127);
+		}
+		if (reap(pid) != 0)
+			return -1;
+	}
+	br->ns = bench_now() - start;
+	return 0;
+}
+
+int
+bench_spawn(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	char* const argv[] = { (char*)bench_config.self, "-x", NULL };
+	br->ops = BENCH_PROCESSES * bench_config.scale;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < br->ops; n++) {
+		pid_t pid;
+		if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+			return bench_fail("posix_spawnp");
+		if (reap(pid) != 0)
+			return -1;
+	}
+	br->ns = bench_now() - start;
+	return 0;
+}
+
+/*
+ * Thread ping-pong: 'turn' says who may run; whoever does hands it to the
+ * other thread and sleeps until it gets it back.
+ */
+#define TURN_MAIN	0
+#define TURN_PARTNER	1
+#define TURN_QUIT	2
+
+static int turn;
+static int partner_running;
+
+/*
+ * The partner still needs its stack for a moment after it says it is done,
+ * as it has to call sys_exit(); we alternate between two stacks so that the
+ * next partner never starts on one that may still be in use.
+ */
+static char partner_stack[2][BENCH_THREAD_STACK] __attribute__((aligned(16)));
+static unsigned int partner_runs;
+
+static void
+pass_turn(int to)
+{
+	int woken;
+	__atomic_store_n(&turn, to, __ATOMIC_RELEASE);
+	sys_futex_wake(&turn, 1, &woken);
+}
+
+static void
+wait_while_turn(int value)
+{
+	while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) == value)
+		sys_futex_wait(&turn, value, -1);
+}
+
+static void
+partner(void* arg)
+{
+	while (1) {
+		wait_while_turn(TURN_MAIN);
+		if (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) == TURN_QUIT)
+			break;
+		pass_turn(TURN_MAIN);
+	}
+	__atomic_store_n(&partner_running, 0, __ATOMIC_RELEASE);
+	sys_exit(0);
+}
+
+int
+bench_thread_switch(int variant, struct BENCH_RESULT* br)
+{
+	if (variant > 0)
+		return BENCH_NO_VARIANT;
+
+	/* Wait until the previous partner is done */
+	while (__atomic_load_n(&partner_running, __ATOMIC_ACQUIRE))
+		/* wait */ ;
+
+	/* The partner starts as if it were called, so the return address is missing */
+	char* stack = partner_stack[partner_runs++ % 2];
+	turn = TURN_MAIN;
+	partner_running = 1;
+	if (sys_thread_create(&partner, stack + BENCH_THREAD_STACK - 8, NULL) != ANANAS_ERROR_NONE) {
+		partner_running = 0;
+		return bench_fail("thread_create");
+	}
+
+	br->ops = BENCH_SWITCHES * bench_config.scale;
+	uint64_t start = bench_now();
+	for (uint64_t n = 0; n < br->ops; n++) {
+		pass_turn(TURN_PARTNER);
+		wait_while_turn(TURN_PARTNER);
+	}
+	br->ns = bench_now() - start;
+	pass_turn(TURN_QUIT);
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,177 @@
+/*
+ * Benchmarks of the running system, as seen from userland.
+ *
+ * Usage: bench [-l] [-r rounds] [-s scale] [-d workdir] [-t tree] [name ...]
+ *
+ * Without names, all benchmarks are run. Every benchmark is run 'rounds'
+ * times, and the results are written to stdout as tab-separated lines so
+ * that runs on different kernels or machines can be compared by a script:
+ *
+ *   name  param  ops  best-ns/op  mean-ns/op  ops/s  MB/s
+ *
+ * where ops/s and MB/s are derived from the best round. Lines starting with
+ * '#' are comments; the first describes the system that was measured.
+ * Failures are reported on stderr, and make the exit status non-zero.
+ */
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+#define BENCH_DEFAULT_ROUNDS	5
+
+struct BENCH_CONFIG bench_config = {
+	.self = "bench",
+	.workdir = ".",
+	.tree = "/",
+	.scale = 1
+};
+
+static const struct BENCHMARK benchmarks[] = {
+	{ "null_syscall", "Enter and leave the kernel", &bench_null_syscall },
+	{ "fork_wait", "fork() a child that exits at once, and wait for it", &bench_fork_wait },
+	{ "fork_exec", "fork() and exec() a child that exits at once, and wait for it", &bench_fork_exec },
+	{ "spawn", "posix_spawn() a child that exits at once, and wait for it", &bench_spawn },
+	{ "thread_switch", "Bounce between two threads using futexes (two switches each)", &bench_thread_switch },
+	{ "fault_anon", "Fault in pages of an anonymous mapping", &bench_fault_anon },
+	{ "fault_file", "Fault in pages of a cached file mapping", &bench_fault_file },
+	{ "pipe", "Move data through a pipe to a child, per write size", &bench_pipe },
+	{ "write", "Write a file sequentially, per block size", &bench_write },
+	{ "read", "Read a file sequentially, per block size", &bench_read },
+	{ "open_close", "open() and close() every file in the tree (param is its depth)", &bench_open_close },
+	{ "stat", "stat() every file in the tree (param is its depth)", &bench_stat },
+	{ NULL, NULL, NULL }
+};
+
+uint64_t
+bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000ULL;
+}
+
+int
+bench_fail(const char* what)
+{
+	fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+	return -1;
+}
+
+void
+bench_path(char* buf, size_t len, const char* name)
+{
+	snprintf(buf, len, "%s/%s", bench_config.workdir, name);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench [-l] [-r rounds] [-s scale] [-d workdir] [-t tree] [name ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+static int
+selected(const char* name, int argc, char* argv[])
+{
+	if (argc == 0)
+		return 1;
+	for (int n = 0; n < argc; n++)
+		if (strcmp(argv[n], name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Runs every variant of the benchmark 'rounds' times; returns non-zero on failure */
+static int
+run(const struct BENCHMARK* b, unsigned int rounds)
+{
+	for (int variant = 0; /* nothing */; variant++) {
+		struct BENCH_RESULT best, br;
+		uint64_t total_ns = 0;
+		for (unsigned int round = 0; round < rounds; round++) {
+			memset(&br, 0, sizeof(br));
+			int r = b->func(variant, &br);
+			if (r == BENCH_NO_VARIANT)
+				return 0;
+			if (r != 0) {
+				fprintf(stderr, "bench: %s failed\n", b->name);
+				return 1;
+			}
+			if (br.ns == 0)
+				br.ns = 1;
+			if (round == 0 || br.ns * best.ops < best.ns * br.ops)
+				best = br;
+			total_ns += br.ns;
+		}
+
+		uint64_t ops = (best.ops > 0) ? best.ops : 1;
+		uint64_t best_ps = (best.ns * 1000) / ops;
+		uint64_t mean_ps = (total_ns * 1000) / (ops * rounds);
+		printf("%s\t%u\t%llu\t%llu.%03llu\t%llu.%03llu\t%llu\t%llu\n",
+		 b->name, best.param, (unsigned long long)best.ops,
+		 (unsigned long long)(best_ps / 1000), (unsigned long long)(best_ps % 1000),
+		 (unsigned long long)(mean_ps / 1000), (unsigned long long)(mean_ps % 1000),
+		 (unsigned long long)((ops * 1000000000ULL) / best.ns),
+		 (unsigned long long)((best.bytes * 1000ULL) / best.ns));
+		fflush(stdout);
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	unsigned int rounds = BENCH_DEFAULT_ROUNDS;
+	int list = 0;
+
+	bench_config.self = argv[0];
+	int n = 1;
+	for (/* nothing */; n < argc && argv[n][0] == '-'; n++) {
+		const char* opt = argv[n];
+		if (strcmp(opt, "-x") == 0)
+			return 0; /* child of fork_exec and spawn */
+		if (strcmp(opt, "-l") == 0) {
+			list = 1;
+			continue;
+		}
+		if (n + 1 >= argc)
+			usage();
+		const char* arg = argv[++n];
+		if (strcmp(opt, "-r") == 0)
+			rounds = strtoul(arg, NULL, 10);
+		else if (strcmp(opt, "-s") == 0)
+			bench_config.scale = strtoul(arg, NULL, 10);
+		else if (strcmp(opt, "-d") == 0)
+			bench_config.workdir = arg;
+		else if (strcmp(opt, "-t") == 0)
+			bench_config.tree = arg;
+		else
+			usage();
+	}
+	if (rounds == 0 || bench_config.scale == 0)
+		usage();
+
+	if (list) {
+		for (const struct BENCHMARK* b = benchmarks; b->name != NULL; b++)
+			printf("%s\t%s\n", b->name, b->help);
+		return 0;
+	}
+
+	struct utsname u;
+	if (uname(&u) == 0)
+		printf("# %s %s %s %s\n", u.sysname, u.release, u.version, u.machine);
+	printf("# benchmark\tparam\tops\tbest_ns_per_op\tmean_ns_per_op\tops_per_sec\tmb_per_sec\n");
+	fflush(stdout);
+
+	int failed = 0;
+	for (const struct BENCHMARK* b = benchmarks; b->name != NULL; b++) {
+		if (selected(b->name, argc - n, argv + n))
+			failed |= run(b, rounds);
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,73 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every benchmark measures some operation 'ops' times and stores the time
+ * this took in 'ns'; setup and cleanup are not part of the measurement. If
+ * the operation moves data, 'bytes' is the total amount moved. 'param' is
+ * a benchmark-specific detail (block size, tree depth) that is reported
+ * alongside the result; benchmarks with several variants use it to tell
+ * them apart.
+ */
+struct BENCH_RESULT {
+	uint64_t	ops;
+	uint64_t	bytes;
+	uint64_t	ns;
+	unsigned int	param;
+};
+
+/* Settings shared by all benchmarks */
+struct BENCH_CONFIG {
+	const char*	self;		/* How to execute ourselves */
+	const char*	workdir;	/* Where to create scratch files */
+	const char*	tree;		/* Directory tree to open and stat */
+	unsigned int	scale;		/* Multiplies the amount of work done */
+};
+
+extern struct BENCH_CONFIG bench_config;
+
+/*
+ * Runs a benchmark once. A benchmark with variants is called with variant
+ * 0, 1, ... until it returns BENCH_NO_VARIANT; any other non-zero value
+ * means it failed.
+ */
+typedef int bench_func_t(int variant, struct BENCH_RESULT* br);
+#define BENCH_NO_VARIANT	-2
+
+struct BENCHMARK {
+	const char*	name;
+	const char*	help;
+	bench_func_t*	func;
+};
+
+/* Monotonic time, in nanoseconds */
+uint64_t bench_now(void);
+
+/* Reports a failure of a benchmark along with errno; always returns -1 */
+int bench_fail(const char* what);
+
+/* Builds the path of a scratch file in the work directory */
+void bench_path(char* buf, size_t len, const char* name);
+
+/* bench-proc.c */
+bench_func_t bench_null_syscall;
+bench_func_t bench_fork_wait;
+bench_func_t bench_fork_exec;
+bench_func_t bench_spawn;
+bench_func_t bench_thread_switch;
+
+/* bench-mem.c */
+bench_func_t bench_fault_anon;
+bench_func_t bench_fault_file;
+
+/* bench-io.c */
+bench_func_t bench_pipe;
+bench_func_t bench_write;
+bench_func_t bench_read;
+bench_func_t bench_open_close;
+bench_func_t bench_stat;
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,30 @@
+#!/bin/sh -e
+#
+# Creates ext2, FAT and cramfs images for the VFS benchmarks (see
+# kernel/kern/bench-vfs.cpp) in the current directory. Load one as a module
+# so that it becomes a ramdisk and mount it on /bench (or tell the benchmarks
+# where it is using 'bench_vfs=<path>'); optionally, boot with
+# 'ramdisk_latency=<us>' to simulate a slower disk.
+#
+# Needs genext2fs, mkfs.fat, mtools and mkcramfs.
+#
+T=`mktemp -d`
+trap "rm -rf $T" EXIT
+
+mkdir -p $T/tree/many $T/tree/d/d/d/d/d/d/d/d
+dd if=/dev/urandom of=$T/tree/large bs=1M count=4 2>/dev/null
+echo "deep" > $T/tree/d/d/d/d/d/d/d/d/file
+i=0
+while [ $i -lt 500 ]; do
+	echo $i > $T/tree/many/entry$i
+	i=$((i + 1))
+done
+
+# Leave some room for the benchmarks that create files
+genext2fs -b 16384 -N 2048 -d $T/tree bench.ext2
+
+rm -f bench.fat
+mkfs.fat -C bench.fat 16384 >/dev/null
+mcopy -s -i bench.fat $T/tree/* ::/
+
+mkcramfs $T/tree bench.cramfs >/dev/null
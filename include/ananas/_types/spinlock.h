@@ -3,8 +3,16 @@
 
 #include <machine/atomic.h>
 
+struct LOCK_STATS;
+
+/*
+ * Spinlocks are ticket locks: every locker takes the next ticket and waits
+ * until it is being served, so the lock is handed out in FIFO order.
+ */
 typedef struct {
-	atomic_t		sl_var;
+	atomic_t		sl_next;	/* Next ticket to hand out */
+	atomic_t		sl_serving;	/* Ticket allowed to hold the lock */
+	struct LOCK_STATS*	sl_stats;	/* Statistics (OPTION_LOCK_STATS only) */
 } spinlock_t;
 
 #endif /* __SPINLOCK_H__ */
@@ -26,4 +26,14 @@ static inline int atomic_read(atomic_t* a)
 	return *(volatile int*)&a->value;
 }
 
+/* Adds 'v' to the atomic and returns the previous value */
+static inline int atomic_add(atomic_t* a, int v)
+{
+	int m = v;
+	__asm __volatile(
+		"lock xadd %0, (%1)"
+	: "+r" (m) : "r" (&a->value) : "memory");
+	return m;
+}
+
 #endif /* __AMD64_ATOMIC_H__ */
@@ -0,0 +1,32 @@
+#ifndef __AMD64_FPU_H__
+#define __AMD64_FPU_H__
+
+struct THREAD;
+
+/* Initializes the FPU of the current CPU; must be called on every CPU */
+void fpu_init();
+
+/* Sets up the initial FPU state of a new thread */
+void fpu_thread_init(struct THREAD* t);
+
+/* Gives a cloned thread a copy of the parent's current FPU state */
+void fpu_thread_clone(struct THREAD* t, struct THREAD* parent);
+
+/* Frees the FPU state of a thread */
+void fpu_thread_free(struct THREAD* t);
+
+/* Called by md_thread_switch() with interrupts disabled */
+void fpu_thread_switch(struct THREAD* new_thread, struct THREAD* old_thread);
+
+/* Handles the Device Not Available exception: the thread wants the FPU */
+void fpu_trap();
+
+/*
+ * Allows the kernel to use the FPU/SSE/AVX registers until fpu_kernel_end();
+ * whatever state the current thread had is saved first. Interrupts are
+ * disabled in between, so keep this short.
+ */
+int fpu_kernel_begin();
+void fpu_kernel_end(int state);
+
+#endif /* __AMD64_FPU_H__ */
@@ -73,12 +73,12 @@
 		name[9] = ((addr_t)(x) >> 56) & 0xff; \
 	} while (0);
 
-#define IDT_SET_ENTRY(num, type, ist, handler) do { \
-	extern void* handler; \
-	uint8_t* p = ((uint8_t*)&idt + num * 16); \
+#define IDT_SET_ENTRY_ADDR(num, type, ist, addr) do { \
+	addr_t a = (addr_t)(addr); \
+	uint8_t* p = ((uint8_t*)&idt + (num) * 16); \
 	/* Target Offset 0:15 */ \
-	p[ 0] = (((addr_t)&handler)     ) & 0xff; \
-	p[ 1] = (((addr_t)&handler) >> 8) & 0xff; \
+	p[ 0] = (a     ) & 0xff; \
+	p[ 1] = (a >> 8) & 0xff; \
 	/* Target selector */ \
 	p[ 2] = GDT_SEL_KERNEL_CODE & 0xff; p[3] = (GDT_SEL_KERNEL_CODE >> 8) & 0xff; \
 	/* IST 0:2 */ \
@@ -86,17 +86,22 @@
 	/* Type 8:11, DPL 13:14, Present 15 */ \
 	p[5] = type | (SEG_DPL_SUPERVISOR << 5) | (1 << 7); \
 	/* Target offset 16:31 */ \
-	p[ 6] = (((addr_t)&handler) >> 16) & 0xff; \
-	p[ 7] = (((addr_t)&handler) >> 24) & 0xff; \
+	p[ 6] = (a >> 16) & 0xff; \
+	p[ 7] = (a >> 24) & 0xff; \
 	/* Target offset 32:63 */ \
-	p[ 8] = (((addr_t)&handler) >> 32) & 0xff; \
-	p[ 9] = (((addr_t)&handler) >> 40) & 0xff; \
-	p[10] = (((addr_t)&handler) >> 48) & 0xff; \
-	p[11] = (((addr_t)&handler) >> 56) & 0xff; \
+	p[ 8] = (a >> 32) & 0xff; \
+	p[ 9] = (a >> 40) & 0xff; \
+	p[10] = (a >> 48) & 0xff; \
+	p[11] = (a >> 56) & 0xff; \
 	/* Reserved */ \
 	p[12] = 0; p[13] = 0; p[14] = 0; p[15] = 0; \
 } while (0)
 
+#define IDT_SET_ENTRY(num, type, ist, handler) do { \
+	extern void* handler; \
+	IDT_SET_ENTRY_ADDR(num, type, ist, &handler); \
+} while (0)
+
 #ifndef ASM
 static inline uint64_t
 rdmsr(uint32_t msr)
@@ -119,6 +124,15 @@ wrmsr(uint32_t msr, uint64_t val)
       "c" (msr));
 }
 
+static inline void
+cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+	__asm __volatile(
+		"cpuid\n"
+	: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+	: "a" (leaf), "c" (subleaf));
+}
+
 static inline uint64_t
 read_cr0()
 {
@@ -137,6 +151,24 @@ write_cr0(uint64_t val)
 	: : "a" (val));
 }
 
+static inline uint64_t
+read_cr3()
+{
+	uint64_t r;
+	__asm __volatile(
+		"movq %%cr3, %0\n"
+	: "=a" (r));
+	return r;
+}
+
+static inline void
+write_cr3(uint64_t val)
+{
+	__asm __volatile(
+		"movq %0, %%cr3\n"
+	: : "a" (val) : "memory");
+}
+
 static inline uint64_t
 read_cr4()
 {
@@ -7,6 +7,10 @@
 /* Page size */
 #define PAGE_SIZE		4096
 
+/* Large pages are 2^LARGE_PAGE_ORDER pages, mapped using a single directory entry */
+#define LARGE_PAGE_ORDER	9
+#define LARGE_PAGE_SIZE		(PAGE_SIZE << LARGE_PAGE_ORDER)
+
 /* This is the base address where the kernel should be linked to */
 #define KERNBASE		0xffffffff80000000
 
@@ -28,8 +32,18 @@
 /* Kernel stack size */
 #define KERNEL_STACK_SIZE	0x4000
 
-/* Thread stack size */
-#define THREAD_STACK_SIZE	0x8000
+/* Thread stack size; this is only reserved, pages are backed as it is used */
+#define THREAD_STACK_SIZE	0x40000
 
 /* First thread mapping virtual address */
 #define THREAD_INITIAL_MAPPING_ADDR	1048576
+
+/* Load addresses of position-independent executables and of the runtime linker */
+#define EXEC_DYN_BASE		0x0000010000000000
+#define EXEC_INTERP_BASE	0x0000020000000000
+
+/* Userland addresses lie below this */
+#define USERLAND_END		0x0000800000000000
+
+/* Userland address of the page shared with the kernel; this is the final user page */
+#define SHARED_PAGE_ADDR	0x00007ffffffff000
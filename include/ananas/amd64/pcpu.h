@@ -16,11 +16,14 @@
 	/*									\
 	 * fpu_context is used to refer to the struct that holds the current	\
 	 * FPU context, or NULL if there is none. Being non-NULL means the	\
-	 * current thread is using the FPU and thus the context must be saved.	\
+	 * current thread is using the FPU and thus the context must be saved	\
+	 * when it is switched out.						\
 	 */									\
 	void		*fpu_context;						\
 	/* Per-cpu interrupt tick counter */					\
-	uint32_t	tickcount;
+	uint32_t	tickcount;						\
+	/* Frame of the interrupt being handled, see interrupt_handler() */	\
+	void		*irq_frame;
 
 #define PCPU_TYPE(x) \
 	__typeof(((struct PCPU*)0)->x)
@@ -49,4 +52,27 @@
 		: "r" (p));							\
 } while (0)
 
+/*
+ * Adds to a 32-bit field; this is a single instruction, so unlike a
+ * PCPU_GET() / PCPU_SET() pair it cannot be split by a migration to another
+ * CPU.
+ */
+#define PCPU_ADD(name, val) do {						\
+	static_assert(sizeof(PCPU_TYPE(name)) == 4, "unsupported field size"); \
+	__asm __volatile (							\
+		"addl %1,%%gs:%0"						\
+		: "+m" (*(uint32_t*)PCPU_OFFSET(name))				\
+		: "ri" ((uint32_t)(val))					\
+		: "memory");							\
+} while (0)
+
+/* As PCPU_ADD(), but to the 64-bit value at byte offset 'offset' of the structure */
+#define PCPU_ADD64_AT(offset, val) do {						\
+	__asm __volatile (							\
+		"addq %1,%%gs:%0"						\
+		: "+m" (*(uint64_t*)(addr_t)(offset))				\
+		: "er" ((uint64_t)(val))					\
+		: "memory");							\
+} while (0)
+
 #endif /* __AMD64_PCPU_H__ */
@@ -0,0 +1,17 @@
+#ifndef __AMD64_SHARED_PAGE_H__
+#define __AMD64_SHARED_PAGE_H__
+
+#include <ananas/x86/pvclock.h>
+
+/*
+ * Machine-dependant part of the shared page. If msp_pvclock_valid is set,
+ * the hypervisor keeps msp_pvclock up-to-date and it is the same on every
+ * CPU; the time since boot is then its value minus msp_pvclock_boot.
+ */
+struct MD_SHARED_PAGE {
+	struct PVCLOCK_TIME_INFO msp_pvclock;
+	uint64_t		msp_pvclock_boot;
+	uint32_t		msp_pvclock_valid;
+} __attribute__((aligned(64)));
+
+#endif /* __AMD64_SHARED_PAGE_H__ */
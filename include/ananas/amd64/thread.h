@@ -26,6 +26,7 @@ struct TSS {
 	uint32_t	iomap_base;
 } __attribute__((packed));
 
+/* Legacy region of the FXSAVE/XSAVE area */
 struct FPUREGS {
 	uint16_t	fcw;		/* control word */
 	uint16_t	fsw;		/* status word */
@@ -78,13 +79,37 @@ struct FPUREGS {
 	register_t	md_rip; \
 	register_t	md_cr3; \
 	struct PAGE* md_kstack_page; \
-	struct FPUREGS	md_fpu_ctx __attribute__ ((aligned(16))); \
+	/* Extended FPU state, see fpu.cpp; md_fpu_ctx lies within md_fpu_mem */ \
+	struct FPUREGS*	md_fpu_ctx; \
+	void*		md_fpu_mem; \
+	uint8_t		md_fpu_counter; \
 	void*		md_stack; \
-	void*		md_kstack;
+	void*		md_kstack; \
+	/* Pending TLB invalidations while batching, see md_tlb_batch_begin() */ \
+	unsigned int	md_tlb_batch; \
+	struct VM_SPACE* md_tlb_vs; \
+	addr_t		md_tlb_start; \
+	addr_t		md_tlb_end;
 
 #define md_cpu_relax() \
 	__asm __volatile("hlt")
 
+/* Hints the CPU that we are in a spin-wait loop */
+#define md_cpu_pause() \
+	__asm __volatile("pause")
+
+/* Retrieves a free-running cycle counter */
+static inline uint64_t md_cpu_cycles()
+{
+	uint32_t lo, hi;
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+/* Enables interrupts and halts until the next one; sti delays them until hlt */
+#define md_cpu_idle() \
+	__asm __volatile("sti; hlt")
+
 #endif
 
 #define THREAD_MDFLAG_FULLRESTORE 0x0001 /* Perform a full register restore upon return */
@@ -92,14 +92,35 @@
 #define MSR_FS_BASE		0xc0000100
 #define MSR_GS_BASE		0xc0000101
 #define MSR_KERNEL_GS_BASE	0xc0000102
+#define MSR_TSC_DEADLINE	0x000006e0
 
 /* CR0 specific flags */
+#define CR0_MP			(1 << 1)	/* Monitor coprocessor */
+#define CR0_EM			(1 << 2)	/* Emulate FPU */
 #define CR0_TS			(1 << 3)	/* Task switched */
+#define CR0_NE			(1 << 5)	/* Native FPU error reporting */
 #define CR0_WP      (1 << 16)	/* Write protect */
 
 /* CR4 specific flags */
 #define CR4_OSFXSR		(1 << 9)	/* OS saves/restores SSE state */
 #define CR4_OSXMMEXCPT		(1 << 10)	/* OS will handle SIMD exceptions */
+#define CR4_PGE			(1 << 7)	/* Global pages */
+#define CR4_PCIDE		(1 << 17)	/* Process-context identifiers */
+#define CR4_OSXSAVE		(1 << 18)	/* OS uses XSAVE and XCR0 */
+
+/* CR3 specific flags */
+#define CR3_PCID_MASK		0xfff		/* Process-context identifier */
+#define CR3_NOFLUSH		(1ULL << 63)	/* Keep the PCID's TLB entries */
+
+/* CPUID feature bits */
+#define CPUID_1_ECX_PCID	(1 << 17)	/* leaf 1, %ecx: PCID supported */
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)	/* leaf 1, %ecx: TSC-deadline timer supported */
+#define CPUID_1_ECX_XSAVE	(1 << 26)	/* leaf 1, %ecx: XSAVE supported */
+#define CPUID_1_ECX_AVX		(1 << 28)	/* leaf 1, %ecx: AVX supported */
+#define CPUID_7_EBX_ERMS	(1 << 9)	/* leaf 7, %ebx: enhanced rep movsb/stosb */
+#define CPUID_7_EBX_SMAP	(1 << 20)	/* leaf 7, %ebx: stac/clac supported */
+#define CPUID_7_EDX_FSRM	(1 << 4)	/* leaf 7, %edx: fast short rep movsb */
+#define CPUID_D1_EAX_XSAVEOPT	(1 << 0)	/* leaf 0xd/1, %eax: XSAVEOPT supported */
 
 /*
  * GDT entry selectors, which are the offset in the GDT. We don't use indexes
@@ -120,9 +141,45 @@ void md_map_kernel(vmspace_t* vs);
 /* Maps 'num_pages' at physical address 'phys' to virtual address 'virt' for vmspace 'vs' with flags 'flags' */
 void md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags);
 
+/*
+ * Maps single pages like md_map_pages(), but remembers the last page table
+ * used; mapping many pages close together only walks the tables once per
+ * page table. md_map_cursor_done() must be called to invalidate any mappings
+ * that were replaced.
+ */
+struct MD_MAP_CURSOR {
+	vmspace_t*	mc_vs;
+	addr_t		mc_base;	/* Virtual address mapped by mc_pte */
+	uint64_t*	mc_pte;
+	uint64_t	mc_pte_flags;	/* Extra flags for every entry */
+	addr_t		mc_inval_start, mc_inval_end;
+};
+void md_map_cursor_init(struct MD_MAP_CURSOR* mc, vmspace_t* vs);
+void md_map_cursor_page(struct MD_MAP_CURSOR* mc, addr_t virt, addr_t phys, int flags);
+void md_map_cursor_done(struct MD_MAP_CURSOR* mc);
+
+struct PAGE;
+struct page_list;
+
+/*
+ * Allocates a zeroed page for a page table of a vmspace; md_pt_free_list()
+ * frees all pages of the list, which must not be in use by any CPU.
+ */
+struct PAGE* md_pt_alloc();
+void md_pt_free_list(struct page_list* pages);
+
 /* Unmaps 'num_pages' at virtual address virt for vmspace 'vs' */
 void md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages);
 
+/* Clears the accessed bit of the mapping of virt in vs; returns whether it was set */
+bool md_clear_accessed(vmspace_t* vs, addr_t virt);
+
+/* Handles a TLB shootdown request from another CPU */
+void md_tlb_shootdown_ipi();
+
+/* Marks the current CPU as able to receive TLB shootdowns */
+void md_tlb_cpu_online();
+
 #endif
 
 #endif /* __AMD64_VM_H__ */
@@ -2,6 +2,10 @@
 #define ANANAS_AMD64_VMSPACE_H
 
 #define MD_VMSPACE_FIELDS \
-	uint64_t*	vs_md_pagedir;
+	uint64_t*	vs_md_pagedir; \
+	uint64_t	vs_md_tlb_id;	/* Never reused; identifies cached TLB entries */ \
+	uint32_t	vs_md_tlb_gen;	/* Bumped whenever present mappings change */ \
+	uint32_t	vs_md_cpus;	/* CPUs currently using vs_md_pagedir */ \
+	spinlock_t	vs_md_pt_lock;	/* Protects vs_pages as tables are added */
 
 #endif /* ANANAS_AMD64_VMSPACE_H */
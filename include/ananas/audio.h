@@ -0,0 +1,32 @@
+#ifndef __ANANAS_AUDIO_H__
+#define __ANANAS_AUDIO_H__
+
+#include <ananas/types.h>
+#include <ananas/handle-options.h>
+
+/*
+ * Audio output is played from a ring buffer the hardware reads from directly;
+ * claiming it maps the ring into the caller, who writes samples into it. The
+ * byte offset the hardware will play next is kept up-to-date in memory, which
+ * is mapped as well - so keeping the ring filled needs no system calls.
+ */
+#define HCTL_AUDIO_CLAIM	(_HCTL_DEVICE_FIRST + 0)	/* Obtain and start the output ring */
+struct HCTL_AUDIO_CLAIM_ARG {
+	/* Requested sizes in bytes, 0 for the defaults */
+	size_t		ac_ring_size;
+	size_t		ac_period_size;		/* Position is updated at least this often */
+	/* Filled out on success */
+	void*		ac_ring;		/* Pointer to the ring */
+	const volatile uint32_t*	ac_position;	/* Pointer to the position in the ring */
+	unsigned int	ac_rate;		/* Samples per second */
+	unsigned int	ac_channels;		/* Interleaved channels */
+	unsigned int	ac_bits;		/* Bits per sample */
+};
+#define HCTL_AUDIO_GET_POSITION	(_HCTL_DEVICE_FIRST + 1)	/* Obtain the output position */
+struct HCTL_AUDIO_POSITION_ARG {
+	uint32_t	ap_position;		/* Byte offset in the ring */
+	uint64_t	ap_periods;		/* Periods played since claimed */
+};
+#define HCTL_AUDIO_RELEASE	(_HCTL_DEVICE_FIRST + 2)	/* Stop and release the output ring */
+
+#endif /* __ANANAS_AUDIO_H__ */
@@ -0,0 +1,71 @@
+#ifndef __ANANAS_BENCH_H__
+#define __ANANAS_BENCH_H__
+
+#include <ananas/types.h>
+#include <ananas/init.h>
+#include <ananas/list.h>
+
+/*
+ * In-kernel microbenchmarks. A benchmark performs the given number of
+ * iterations of whatever it measures, and the runner reports the time taken
+ * per iteration. When run on several CPUs, all of them start at the same
+ * time, so shared resources are measured under contention.
+ */
+typedef errorcode_t bench_func_t(unsigned int iterations);
+/* Describes anything besides the time taken that the last run measured */
+typedef void bench_report_t(char* buf, size_t len);
+
+struct BENCHMARK {
+	const char*	b_name;
+	const char*	b_help;
+	unsigned int	b_flags;
+#define BENCH_FLAG_SLEEPS	0x0001	/* May sleep or needs other threads; cannot run from kdb */
+	size_t		b_bytes;	/* Bytes processed per iteration, for the bandwidth (0 if none) */
+	unsigned int	b_iterations;	/* Default number of iterations */
+	bench_func_t*	b_func;
+	bench_report_t*	b_report;	/* Optional */
+
+	LIST_FIELDS(struct BENCHMARK);
+};
+
+errorcode_t bench_register(struct BENCHMARK* b);
+struct BENCHMARK* bench_find(const char* name);
+
+/* Lists all benchmarks, one per line */
+void bench_list(char* buf, size_t len);
+
+/*
+ * Runs the benchmark on num_cpus CPUs at once and describes the outcome in
+ * buf; a single CPU means the benchmark runs on the calling thread. Zero
+ * iterations selects the benchmark's default.
+ */
+errorcode_t bench_run(struct BENCHMARK* b, unsigned int iterations, unsigned int num_cpus, char* buf, size_t len);
+
+/*
+ * Runs the benchmark on 1, 2, ... up to all CPUs in turn, and tabulates the
+ * combined throughput, the speedup over a single CPU and the fairness of
+ * every run in buf.
+ */
+errorcode_t bench_scale(struct BENCHMARK* b, unsigned int iterations, char* buf, size_t len);
+
+#define BENCHMARK(NAME, FLAGS, BYTES, ITERATIONS, HELP) \
+	BENCHMARK_REPORTING(NAME, FLAGS, BYTES, ITERATIONS, HELP, nullptr)
+
+#define BENCHMARK_REPORTING(NAME, FLAGS, BYTES, ITERATIONS, HELP, REPORT) \
+	static bench_func_t bench_func_ ## NAME; \
+	static struct BENCHMARK bench_ ## NAME = { \
+		.b_name = #NAME, \
+		.b_help = (HELP), \
+		.b_flags = (FLAGS), \
+		.b_bytes = (BYTES), \
+		.b_iterations = (ITERATIONS), \
+		.b_func = &bench_func_ ## NAME, \
+		.b_report = (REPORT) \
+	}; \
+	static errorcode_t bench_add_ ## NAME() { \
+		return bench_register(&bench_ ## NAME); \
+	} \
+	INIT_FUNCTION(bench_add_ ## NAME, SUBSYSTEM_KDB, ORDER_MIDDLE); \
+	static errorcode_t bench_func_ ## NAME(unsigned int iterations)
+
+#endif /* __ANANAS_BENCH_H__ */
@@ -2,28 +2,23 @@
 #define __ANANAS_BIO_H__
 
 #include <ananas/types.h>
+#include <ananas/cdefs.h>
 #include <ananas/device.h>
 #include <ananas/list.h>
 #include <machine/param.h>	/* for PAGE_SIZE */
 
-/* Number of buckets used to hash a block number to */
-#define BIO_BUCKET_SIZE		16
-
-/* Number of BIO buffers available */
-#define BIO_NUM_BUFFERS		1024
-
-/* Amount of data available for BIO data, in bytes */
-#define BIO_DATA_SIZE		(512 * 1024)
-
 /* Size of a sector; any BIO block must be a multiple of this */
 #define BIO_SECTOR_SIZE		512
 
+#define BIO_IS_PENDING(bio)	((bio)->flags & BIO_FLAG_PENDING)
 #define BIO_IS_DIRTY(bio)	((bio)->flags & BIO_FLAG_DIRTY)
 #define BIO_IS_READ(bio)	((bio)->flags & BIO_FLAG_READ)
 #define BIO_IS_WRITE(bio)	((bio)->flags & BIO_FLAG_WRITE)
 #define BIO_IS_ERROR(bio)	((bio)->flags & BIO_FLAG_ERROR)
 #define BIO_DATA(bio)		((bio)->data)
 
+struct BIO_PAGE;
+
 /*
  * A basic I/O buffer, the root of all I/O requests. 
  */
@@ -31,6 +26,8 @@ struct BIO {
 	uint32_t  	flags;
 #define BIO_FLAG_PENDING	0x0001	/* Block is pending read */
 #define BIO_FLAG_DIRTY		0x0002	/* I/O needs to be written */
+#define BIO_FLAG_QUEUED		0x0004	/* Handed to the device by the request queue */
+#define BIO_FLAG_QUEUED_WRITE	0x0008	/* ... as part of a write request */
 #define BIO_FLAG_ERROR		0x8000	/* Request failed */
 	Ananas::Device* device;	/* Device I/O'ing from */
 	blocknr_t	  block;	/* Block number to I/O */
@@ -38,26 +35,119 @@ struct BIO {
 	unsigned int	  length;	/* Length in bytes (<= PAGE_SIZE, so int will do) */
 	void*		  data;		/* Pointer to BIO data */
 	semaphore_t       sem;          /* Semaphore for this BIO */
+	unsigned int	  refcount;	/* Number of bio_get() calls not yet bio_free()'d */
+	struct BIO_PAGE*  data_page;	/* Page backing data */
+	int		  dirty_queued;	/* Waiting to be written back */
+	uint64_t	  dirty_since;	/* When it was queued for write-back, in ns */
+	unsigned int	  lru_list;	/* Replacement list we are on */
+	int		  lru_used;	/* Used since it was read */
+	struct BIO*	  io_next;	/* Next bio of the same request, if merged */
+	unsigned int	  io_seq;	/* Request queue clock when queued */
+	uint64_t	  io_start;	/* When it was handed to the device, in ns */
 
 	LIST_FIELDS_IT(struct BIO, chain);	/* Chain queue */
 	LIST_FIELDS_IT(struct BIO, bucket);	/* Bucket queue */
+	LIST_FIELDS_IT(struct BIO, dirty);	/* Dirty queue */
+	LIST_FIELDS_IT(struct BIO, queue);	/* Request queue, by block */
+	LIST_FIELDS_IT(struct BIO, fifo);	/* Request queue, by age */
 };
 
 /* Flags of BIO_READ */
 #define BIO_READ_NODATA		0x0001	/* Caller is not interested in the data */
+#define BIO_READ_ASYNC		0x0002	/* Do not wait for the data; use bio_wait() */
+#define BIO_READ_AHEAD		0x0004	/* Speculative; does not count as use of the buffer */
 
 void bio_set_error(struct BIO* bio);
 void bio_set_available(struct BIO* bio);
+/* Queues the bio to be written back; this happens at some later point */
 void bio_set_dirty(struct BIO* bio);
+
+/* Writes back all dirty bio's of device (of any device if NULL) before returning */
+void bio_sync(Ananas::Device* device);
+/*
+ * Writes back all dirty bio's of device like bio_sync(), and then has the
+ * device commit them to stable storage.
+ */
+errorcode_t bio_commit(Ananas::Device* device);
 struct BIO* bio_get(Ananas::Device* device, blocknr_t block, size_t len, int flags);
 
+/*
+ * Obtains the bio's of num_blocks consecutive blocks of len bytes each,
+ * starting at block. Whatever must be read is submitted at once, so that it
+ * ends up in as few requests as possible.
+ */
+void bio_get_range(Ananas::Device* device, blocknr_t block, unsigned int num_blocks, size_t len, int flags, struct BIO** bios) __hot;
+
 static inline struct BIO* bio_read(Ananas::Device* device, blocknr_t block, size_t len)
 {
 	return bio_get(device, block, len, 0);
 }
 
+/*
+ * Asynchronous reads: the bio is returned as soon as the read is submitted
+ * (BIO_IS_PENDING() tells whether it is still underway), so that many reads
+ * can be in flight at once. Call bio_wait() or bio_wait_all() before touching
+ * the data.
+ */
+static inline struct BIO* bio_read_async(Ananas::Device* device, blocknr_t block, size_t len)
+{
+	return bio_get(device, block, len, BIO_READ_ASYNC);
+}
+
+void bio_wait(struct BIO* bio);
+void bio_wait_all(struct BIO** bios, unsigned int num_bios);
+
+/*
+ * Direct I/O: transfers num_blocks blocks of len bytes each, starting at
+ * block, between the device and data[n] without caching them. Blocks which
+ * happen to be cached are transferred using the cached buffer instead, so
+ * that the cache never disagrees with the disk. Waits until all is done.
+ */
+#define BIO_DIRECT_MAX_BLOCKS	16
+errorcode_t bio_transfer_direct(Ananas::Device* device, blocknr_t block, unsigned int num_blocks, size_t len, void* const* data, bool write);
+
+/*
+ * Request queue; the buffer cache hands bio's to this rather than to the
+ * device. Requests a device gets may chain multiple bio's of adjacent blocks
+ * using io_next; the driver must complete every bio of the chain, in order.
+ */
+void bio_queue_submit(struct BIO** bios, unsigned int num_bios, bool write);
+void bio_queue_complete(struct BIO* bio);
+/*
+ * Flushes the write cache of device, which must not be a slice; callers
+ * arriving while a flush is in progress share the next one.
+ */
+errorcode_t bio_queue_flush(Ananas::Device* device);
+/* Frees the queue of device as it is destroyed; nothing may be queued anymore */
+void bio_queue_destroy(Ananas::Device* device);
+
+/*
+ * Per-device statistics, kept by the request queue. Latencies are measured
+ * from handing a request to the device until its final bio completes; bucket
+ * n counts requests which took less than 2^n microseconds, and the final
+ * bucket takes everything slower.
+ */
+#define BIO_STATS_LATENCY_BUCKETS	24
+
+struct BIO_STATS {
+	uint64_t	bs_requests[2];		/* Read, write requests dispatched */
+	uint64_t	bs_bytes[2];		/* Read, write bytes dispatched */
+	uint64_t	bs_cache_hits;
+	uint64_t	bs_cache_misses;
+	unsigned int	bs_queue_depth;		/* Bio's waiting or in flight */
+	unsigned int	bs_queue_depth_max;
+	uint64_t	bs_latency[2][BIO_STATS_LATENCY_BUCKETS];
+};
+
+/* Accounts for a buffer cache lookup of a block of device */
+void bio_queue_account_lookup(Ananas::Device* device, bool hit);
+/* Obtains a copy of the statistics of device; returns false if it never did any I/O */
+bool bio_queue_get_stats(Ananas::Device* device, struct BIO_STATS* stats);
+
 struct BIO* bio_get_next(Ananas::Device* device);
 void bio_free(struct BIO* bio);
 void bio_dump();
+/* Describes the memory used by the buffer cache */
+void bio_get_status(char* buf, size_t len);
 
 #endif /* __ANANAS_BIO_H__ */
@@ -0,0 +1,36 @@
+#ifndef __ANANAS_BOOTTIME_H__
+#define __ANANAS_BOOTTIME_H__
+
+#include <ananas/types.h>
+
+/*
+ * Boot timeline; records how long every init function, device attach and USB
+ * device enumeration took, so we can see where the time went while booting.
+ * Events keep being recorded after boot (USB devices may come and go) until
+ * the timeline is full.
+ */
+#define BOOTTIME_MAX_EVENTS	256
+#define BOOTTIME_NAME_LENGTH	40
+
+#define BOOTTIME_TYPE_INIT	1	/* INIT_FUNCTION() */
+#define BOOTTIME_TYPE_ATTACH	2	/* IDeviceOperations::Attach() */
+#define BOOTTIME_TYPE_ENUMERATE	3	/* USB device enumeration */
+
+struct BOOTTIME_EVENT {
+	int		be_type;
+	errorcode_t	be_error;
+	uint64_t	be_start;		/* ns since boot */
+	uint64_t	be_duration;		/* ns */
+	char		be_name[BOOTTIME_NAME_LENGTH];
+};
+
+/* Records an event of the given type which started at start_ns and ends now */
+void boottime_record(int type, uint64_t start_ns, errorcode_t err, const char* fmt, ...);
+
+/* Formats event n as a single line; returns false if there is no such event */
+bool boottime_format(unsigned int n, char* line, size_t len);
+
+/* Prints the entire timeline to the console */
+void boottime_print();
+
+#endif /* __ANANAS_BOOTTIME_H__ */
@@ -2,6 +2,7 @@
 #define __BUS_PCI_H__
 
 #include <ananas/device.h>
+#include <ananas/irq.h>
 
 #define PCI_NOVENDOR		0xFFFF
 #define PCI_MAX_BUSSES		256
@@ -21,6 +22,8 @@
 #define  PCI_STAT_FBBC		0x00800000 /* Fast Back-to-back capable */
 #define  PCI_STAT_UDF		0x00400000 /* User Defined Features supported */
 #define  PCI_STAT_66		0x00200000 /* 66MHz Capable */
+#define  PCI_STAT_CL		0x00100000 /* Capabilities List */
+#define  PCI_CMD_ID		0x00000400 /* Interrupt Disable */
 #define  PCI_CMD_BBE		0x00000200 /* Fast Back-to-back enable */
 #define  PCI_CMD_SSE		0x00000100 /* System Error Enable */
 #define  PCI_CMD_WC		0x00000080 /* Wait Cycle Enable */
@@ -36,6 +39,7 @@
 #define PCI_SUBCLASS(x)		(((x) >> 16) & 0xff)
 #define PCI_PROGINT(x)		(((x) >> 8) & 0xff)
 #define PCI_REVISION(x)		((x) & 0xff)
+#define PCI_CLASSREV(c, s, p, r)	(((c) << 24) | ((s) << 16) | ((p) << 8) | (r))
 #define  PCI_CLASS_STORAGE	0x01       /* Mass storage controller */
 #define   PCI_SUBCLASS_SCSI	0x00
 #define   PCI_SUBCLASS_IDE	0x01
@@ -43,6 +47,8 @@
 #define   PCI_SUBCLASS_IPI	0x03
 #define   PCI_SUBCLASS_RAID	0x04
 #define   PCI_SUBCLASS_SATA	0x06
+#define   PCI_SUBCLASS_NVM	0x08
+#define    PCI_PROGINT_NVME	0x02
 #define  PCI_CLASS_NETWORK	0x02       /* Network controller */
 #define   PCI_SUBCLASS_ETHERNET	0x00
 #define   PCI_SUBCLASS_TOKEN	0x01
@@ -108,8 +114,69 @@
 #define _PCI_REG_RESERVED	0x38
 #define PCI_REG_INTERRUPT	0x3c
 
+/* Capabilities; every capability starts with its ID and the offset of the next */
+#define PCI_CAP_ID(x)		((x) & 0xff)
+#define PCI_CAP_NEXT(x)		(((x) >> 8) & 0xfc)
+#define  PCI_CAP_ID_MSI		0x05
+#define  PCI_CAP_ID_VENDOR	0x09
+#define  PCI_CAP_ID_MSIX	0x11
+
+/* MSI capability; the message control register is the upper half of the header */
+#define PCI_MSI_CTRL_EN		0x00010000 /* MSI Enable */
+#define PCI_MSI_CTRL_MMC(x)	(((x) >> 17) & 7) /* Multiple Message Capable (log2) */
+#define PCI_MSI_CTRL_MME(x)	((x) << 20) /* Multiple Message Enable (log2) */
+#define PCI_MSI_CTRL_MME_MASK	0x00700000
+#define PCI_MSI_CTRL_64		0x00800000 /* 64-bit address capable */
+#define PCI_MSI_REG_ADDR	0x04
+#define PCI_MSI_REG_ADDR_HI	0x08
+#define PCI_MSI_REG_DATA_32	0x08 /* data register of 32-bit capabilities */
+#define PCI_MSI_REG_DATA_64	0x0c /* data register of 64-bit capabilities */
+
+/* MSI-X capability */
+#define PCI_MSIX_CTRL_EN	0x80000000 /* MSI-X Enable */
+#define PCI_MSIX_CTRL_FM	0x40000000 /* Function Mask */
+#define PCI_MSIX_CTRL_SIZE(x)	((((x) >> 16) & 0x7ff) + 1) /* Table Size */
+#define PCI_MSIX_REG_TABLE	0x04
+#define  PCI_MSIX_BIR(x)	((x) & 7) /* BAR Indicator */
+#define  PCI_MSIX_OFFSET(x)	((x) & ~7)
+#define PCI_MSIX_ENTRY_SIZE	16
+#define PCI_MSIX_ENTRY_ADDR	0x00
+#define PCI_MSIX_ENTRY_ADDR_HI	0x04
+#define PCI_MSIX_ENTRY_DATA	0x08
+#define PCI_MSIX_ENTRY_CTRL	0x0c
+#define  PCI_MSIX_ENTRY_MASKED	0x00000001
+
 void pci_write_cfg(Ananas::Device& dev, uint32_t reg, uint32_t val, int size);
 uint32_t pci_read_cfg(Ananas::Device& dev, uint32_t reg, int size);
 void pci_enable_busmaster(Ananas::Device& dev, bool on);
+unsigned int pci_find_capability(Ananas::Device& dev, unsigned int id, unsigned int after = 0);
+void* pci_map_bar(Ananas::Device& dev, unsigned int bar, uint64_t offset, size_t length);
+
+/*
+ * Message-signalled interrupts; MSI-X is preferred over MSI. Every vector is
+ * an interrupt of its own, which may be delivered to a CPU of choice - except
+ * for plain MSI, where all vectors go to the CPU that was last registered.
+ */
+#define PCI_MSI_MAX_VECTORS	32
+
+struct PCI_MSI {
+	unsigned int	msi_cap;		/* capability offset */
+	unsigned int	msi_flags;
+#define PCI_MSI_FLAG_MSIX	(1 << 0)	/* uses MSI-X */
+	unsigned int	msi_count;		/* number of vectors */
+	unsigned int	msi_irq[PCI_MSI_MAX_VECTORS];
+	volatile uint32_t* msi_table;		/* MSI-X table */
+};
+
+/*
+ * Allocates up to *num vectors; *num is updated with the number obtained.
+ * Fails if the device or the system cannot do message-signalled interrupts,
+ * in which case the driver should stick to its RT_IRQ resource.
+ */
+errorcode_t pci_msi_alloc(Ananas::Device& dev, struct PCI_MSI& msi, unsigned int* num);
+/* Registers the handler of vector index, delivered to cpu, and enables the vector */
+errorcode_t pci_msi_register(Ananas::Device& dev, struct PCI_MSI& msi, unsigned int index, int cpu, irqfunc_t func, int type, void* context);
+/* Disables all vectors and frees them; handlers must be unregistered first */
+void pci_msi_free(Ananas::Device& dev, struct PCI_MSI& msi);
 
 #endif /* __BUS_PCI_H__ */
@@ -33,6 +33,9 @@
  * This implementation solves the problems by simply working byte-for-byte;
  * this isn't the most efficient approach but it is the easiest. If this
  * proves to be a bottleneck in the future, this approach will need work.
+ *
+ * Callers must serialize all operations on such a buffer; if there is only a
+ * single writer and a single reader, SPSC_RING below needs no locking at all.
  */
 
 #define CBUFFER_DATA_LEFT(cb) \
@@ -89,5 +92,97 @@ do {								\
 	_l;							\
 })
 
+/*
+ * Single-producer, single-consumer ring; one thread (or interrupt handler)
+ * may write while another reads, without any locking. The size must be a
+ * power of two. Head and tail are free-running counters, which are only
+ * reduced to an offset when accessing the buffer; this allows the entire
+ * buffer to be used. The producer publishes data by storing the head with
+ * release semantics and the consumer frees space by doing the same with the
+ * tail; both sides acquire the other's index first.
+ *
+ * Each index is padded to a cache line, so that the producer and consumer do
+ * not invalidate each other's lines on every update. Padding is used rather
+ * than alignment as rings may be embedded in objects allocated using new,
+ * which does not honour extended alignment.
+ */
+#define SPSC_RING_CACHE_LINE 64
+
+struct SPSC_RING_INDEX {
+	size_t ri_value;
+	char ri_pad[SPSC_RING_CACHE_LINE - sizeof(size_t)];
+};
+
+struct SPSC_RING {
+	unsigned char* sr_buffer;
+	size_t sr_size;
+	struct SPSC_RING_INDEX sr_head;	/* Next byte to write; owned by the producer */
+	struct SPSC_RING_INDEX sr_tail;	/* Next byte to read; owned by the consumer */
+};
+
+static inline void
+spsc_ring_init(struct SPSC_RING* sr, void* buf, size_t size)
+{
+	sr->sr_buffer = (unsigned char*)buf;
+	sr->sr_size = size;
+	sr->sr_head.ri_value = 0;
+	sr->sr_tail.ri_value = 0;
+}
+
+/* Number of bytes available for reading; only exact for the consumer */
+static inline size_t
+spsc_ring_data_left(struct SPSC_RING* sr)
+{
+	return __atomic_load_n(&sr->sr_head.ri_value, __ATOMIC_ACQUIRE) - __atomic_load_n(&sr->sr_tail.ri_value, __ATOMIC_RELAXED);
+}
+
+/* Number of bytes available for writing; only exact for the producer */
+static inline size_t
+spsc_ring_space_left(struct SPSC_RING* sr)
+{
+	return sr->sr_size - (__atomic_load_n(&sr->sr_head.ri_value, __ATOMIC_RELAXED) - __atomic_load_n(&sr->sr_tail.ri_value, __ATOMIC_ACQUIRE));
+}
+
+/* Writes up to len bytes; returns the amount written. Producer only */
+static inline size_t
+spsc_ring_write(struct SPSC_RING* sr, const void* data, size_t len)
+{
+	size_t head = __atomic_load_n(&sr->sr_head.ri_value, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&sr->sr_tail.ri_value, __ATOMIC_ACQUIRE);
+	size_t space = sr->sr_size - (head - tail);
+	if (len > space)
+		len = space;
+
+	/* Copy up to the end of the buffer, and whatever remains to its start */
+	size_t offset = head & (sr->sr_size - 1);
+	size_t chunk = sr->sr_size - offset;
+	if (chunk > len)
+		chunk = len;
+	__builtin_memcpy(sr->sr_buffer + offset, data, chunk);
+	__builtin_memcpy(sr->sr_buffer, (const unsigned char*)data + chunk, len - chunk);
+
+	__atomic_store_n(&sr->sr_head.ri_value, head + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+/* Reads up to len bytes; returns the amount read. Consumer only */
+static inline size_t
+spsc_ring_read(struct SPSC_RING* sr, void* data, size_t len)
+{
+	size_t tail = __atomic_load_n(&sr->sr_tail.ri_value, __ATOMIC_RELAXED);
+	size_t head = __atomic_load_n(&sr->sr_head.ri_value, __ATOMIC_ACQUIRE);
+	if (len > head - tail)
+		len = head - tail;
+
+	size_t offset = tail & (sr->sr_size - 1);
+	size_t chunk = sr->sr_size - offset;
+	if (chunk > len)
+		chunk = len;
+	__builtin_memcpy(data, sr->sr_buffer + offset, chunk);
+	__builtin_memcpy((unsigned char*)data + chunk, sr->sr_buffer, len - chunk);
+
+	__atomic_store_n(&sr->sr_tail.ri_value, tail + len, __ATOMIC_RELEASE);
+	return len;
+}
 
 #endif /* __ANANAS_CBUFFER_H__ */
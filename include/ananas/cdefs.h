@@ -20,6 +20,14 @@
 /* Used to indicate that a value is unused */
 #define __unused __attribute__((unused))
 
+/*
+ * Marks a function as frequently or rarely called; hot functions are grouped
+ * together at the start of the kernel text, and calls to cold functions are
+ * treated as unlikely - the code leading up to them is moved out of line.
+ */
+#define __hot __attribute__((hot))
+#define __cold __attribute__((cold))
+
 #ifndef static_assert
 #define STATIC_ASSERT3(line, cond, msg) \
 	typedef char __unused static_assert_failure_in_line_##line[(cond) ? 1 : -1]
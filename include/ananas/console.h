@@ -7,6 +7,13 @@ void console_putchar(int c);
 void console_putstring(const char* s);
 uint8_t console_getchar();
 
+/*
+ * Output is normally queued and written by the console thread; panic and
+ * the kernel debugger switch to writing it directly (these nest).
+ */
+void console_enter_synchronous();
+void console_leave_synchronous();
+
 extern Ananas::Device* console_tty;
 
 namespace Ananas {
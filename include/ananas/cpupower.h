@@ -0,0 +1,48 @@
+#ifndef __ANANAS_CPUPOWER_H__
+#define __ANANAS_CPUPOWER_H__
+
+#include <ananas/types.h>
+
+struct PCPU;
+
+/*
+ * CPU power management. The mode, 'cpu.power_mode' in /ankh/sys, decides how
+ * deep idle CPUs may sleep and how the CPU chooses its frequency:
+ *
+ * - performance: never sleep deeper than C1 and always run at the highest
+ *   frequency, so that wakeups are as fast as can be; for latency-sensitive
+ *   hosts.
+ * - balanced: the CPU raises its frequency under load by itself. Deep
+ *   C-states are only used once every CPU of a physical core is idle, so that
+ *   a busy sibling never shares its core with one that is slow to wake up.
+ * - powersave: as balanced, but the CPU favours saving energy over speed.
+ *
+ * The state of every CPU is listed in /ankh/proc/power.
+ */
+#define CPUPOWER_MODE_PERFORMANCE	0
+#define CPUPOWER_MODE_BALANCED		1
+#define CPUPOWER_MODE_POWERSAVE		2
+
+#define CPUPOWER_MAX_IDLE_STATES	2	/* C1 and the deepest available */
+
+/*
+ * Idles the current CPU until the next interrupt; must be called with
+ * interrupts disabled, which are enabled as the CPU goes to sleep.
+ */
+void cpupower_idle(struct PCPU* pcpu);
+
+/* Describes the power state of CPU n in line; returns false if there is no such CPU */
+bool cpupower_format(unsigned int n, char* line, size_t len);
+
+/*
+ * Machine-dependant part. md_cpupower_probe() returns the number of idle states
+ * usable, where state 0 is C1 (which is always present) and higher states are
+ * deeper. md_cpupower_apply() sets up the frequency policy of the current CPU
+ * for the given mode, and describes the outcome in descr.
+ */
+unsigned int md_cpupower_probe();
+const char* md_cpupower_idle_state_name(unsigned int state);
+void md_cpupower_apply(unsigned int mode, char* descr, size_t len);
+void md_cpu_idle_state(struct PCPU* pcpu, unsigned int state);
+
+#endif /* __ANANAS_CPUPOWER_H__ */
@@ -0,0 +1,40 @@
+#ifndef __DEFERRED_H__
+#define __DEFERRED_H__
+
+#include <ananas/types.h>
+
+/*
+ * Deferred work: something an interrupt handler wants done soon, but not
+ * necessarily right away. Work is queued on the current CPU and run once the
+ * outermost interrupt returns, or by the worker thread of the CPU for work
+ * marked DEFERRED_FLAG_THREAD (or work queued from thread context).
+ *
+ * Work run at interrupt exit runs with interrupts disabled and must neither
+ * sleep nor take locks that are held with interrupts enabled. Work in the
+ * worker thread may take such locks, but should still not sleep as it holds
+ * up everything else queued on that CPU.
+ *
+ * Queueing work which is already queued does nothing; it is dequeued right
+ * before its function is called, so anything queueing it afterwards gets
+ * another run.
+ */
+typedef void (*deferred_func_t)(void* context);
+
+struct DEFERRED_WORK {
+	deferred_func_t		dw_func;
+	void*			dw_context;
+	unsigned int		dw_flags;
+#define DEFERRED_FLAG_THREAD	(1 << 0)	/* only run from the worker thread */
+#define DEFERRED_FLAG_QUEUED	(1 << 1)	/* (internal use only) on a queue */
+	struct DEFERRED_WORK*	dw_next;
+};
+
+void deferred_init(struct DEFERRED_WORK* dw, deferred_func_t func, void* context, unsigned int flags);
+
+/* Returns false if the work was already queued */
+bool deferred_queue(struct DEFERRED_WORK* dw);
+
+/* Called by irq_handler() once the outermost interrupt is done, with interrupts disabled */
+void deferred_run_irq();
+
+#endif /* __DEFERRED_H__ */
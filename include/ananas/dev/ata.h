@@ -5,12 +5,16 @@
 #define ATA_CMD_DMA_READ_EXT		0x25	/* 48 bit DMA */
 #define ATA_CMD_WRITE_SECTORS		0x30	/* 28 bit PIO */
 #define ATA_CMD_DMA_WRITE_EXT		0x35	/* 48 bit DMA */
+#define ATA_CMD_READ_FPDMA_QUEUED	0x60	/* 48 bit NCQ */
+#define ATA_CMD_WRITE_FPDMA_QUEUED	0x61	/* 48 bit NCQ */
 #define ATA_CMD_PACKET			0xa0
 #define ATA_CMD_IDENTIFY_PACKET		0xa1
 #define ATA_CMD_READ_MULTIPLE		0xc4	/* 28 bit DMA */
 #define ATA_CMD_WRITE_MULTIPLE		0xc5	/* 28 bit PIO */
 #define ATA_CMD_DMA_READ_SECTORS	0xc8	/* 28 bit DMA */
 #define ATA_CMD_DMA_WRITE_SECTORS	0xca	/* 28 bit DMA */
+#define ATA_CMD_FLUSH_CACHE		0xe7
+#define ATA_CMD_FLUSH_CACHE_EXT		0xea
 #define ATA_CMD_IDENTIFY		0xec
 
 #define ATAPI_CMD_READ_CAPACITY		0x25
@@ -79,7 +83,9 @@ struct ATA_IDENTIFY {
 	/*  68 */ uint8_t min_pio_xfer[2];
 	/*  69 */ uint8_t reserved1[12];
 	/*  75 */ uint8_t queue_depth[2];
-	/*  76 */ uint8_t reserved2[8];
+	/*  76 */ uint8_t sata_capabilities[2];
+#define ATA_SATACAP_NCQ		(1 <<  8)
+	/*  77 */ uint8_t reserved2[6];
 	/*  80 */ uint8_t major_ata_spec[2];
 #define ATA_SPEC_ATAPI14	(1 << 14)
 #define ATA_SPEC_ATAPI13	(1 << 13)
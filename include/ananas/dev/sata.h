@@ -35,19 +35,26 @@ struct SATA_FIS_H2D {
 	uint8_t h2d_dw4_resvd0;		/* 31..24 */
 } __attribute__((packed));
 
+/*
+ * Maximum number of bio's a single request may chain; physically adjacent bio's
+ * share a PRD entry, so with page-sized bio's a request can move up to 4MB.
+ */
+#define SATA_REQUEST_MAX_BIOS	1024
+
 struct SATA_REQUEST {
 	union {
 		struct SATA_FIS_H2D fis_h2d;
 	} sr_fis;
 	unsigned int	sr_fis_length;	/* FIS length, in bytes */
-	uint16_t	sr_count;	/* request length in bytes */
+	uint32_t	sr_count;	/* request length in bytes */
 	void*		sr_buffer;	/* data buffer, if not NULL */
-	struct BIO*	sr_bio;		/* associated I/O buffer, if not NULL */
+	struct BIO*	sr_bio;		/* associated I/O buffer(s), if not NULL */
 	semaphore_t*	sr_semaphore;		/* Semaphore to signal on completion, if any */
 	uint32_t	sr_flags;
 #define SATA_REQUEST_FLAG_READ	(1 << 0)	/* Read request */
 #define SATA_REQUEST_FLAG_WRITE	(1 << 1)	/* Write request */
 #define SATA_REQUEST_FLAG_ATAPI	(1 << 2)	/* ATAPI request */
+#define SATA_REQUEST_FLAG_NCQ	(1 << 3)	/* Native queued command; tag is the slot used */
 };
 
 /* Signatures per device category */
@@ -56,5 +63,12 @@ struct SATA_REQUEST {
 
 void sata_fis_h2d_make_cmd(struct SATA_FIS_H2D* h2d, uint8_t cmd);
 void sata_fis_h2d_make_cmd_lba48(struct SATA_FIS_H2D* h2d, uint8_t cmd, uint64_t lba, uint32_t count);
+void sata_fis_h2d_make_cmd_fpdma(struct SATA_FIS_H2D* h2d, uint8_t cmd, uint64_t lba, uint32_t count);
+
+/* Sets the tag of a FPDMA QUEUED command */
+static inline void sata_fis_h2d_set_tag(struct SATA_FIS_H2D* h2d, unsigned int tag)
+{
+	h2d->h2d_dw3_count = tag << 3;
+}
 
 #endif /* __ANANAS_SATA_H__ */
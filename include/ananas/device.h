@@ -3,6 +3,7 @@
 
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/eventq.h>
 #include <ananas/list.h>
 #include <ananas/lock.h>
 #include <ananas/init.h>
@@ -14,9 +15,12 @@ typedef struct DRIVER* driver_t;
 typedef struct PROBE* probe_t;
 
 struct BIO;
+struct BIO_QUEUE;
 
 namespace Ananas {
 
+class Device;
+
 namespace USB {
 class USBDevice;
 class Transfer;
@@ -45,12 +49,33 @@ public:
 	{
 		return ananas_make_error(ANANAS_ERROR_UNSUPPORTED);
 	}
+
+	/*
+	 * Returns the HANDLE_EVENT_... that are ready; devices which can block must
+	 * notify d_Events whenever this may have changed.
+	 */
+	virtual unsigned int GetReadyEvents()
+	{
+		return HANDLE_EVENT_READ | HANDLE_EVENT_WRITE;
+	}
 };
 
 class IBIODeviceOperations {
 public:
 	virtual errorcode_t ReadBIO(struct BIO& bio) = 0;
 	virtual errorcode_t WriteBIO(struct BIO& bio) = 0;
+
+	// Number of requests the device can have in flight at once
+	virtual unsigned int GetMaxBIORequests() { return 1; }
+	// Number of bio's a single request may chain; see bio_queue_submit()
+	virtual unsigned int GetMaxBIOsPerRequest() { return 1; }
+	// Devices which are a view of another device (slices) return that device
+	// and translate block into it; the buffer cache uses this to keep a single
+	// copy of every block, no matter through which device it is accessed
+	virtual Device* ResolveBIOBlock(blocknr_t& block) { return nullptr; }
+	// Returns once everything the device completed writing is on stable
+	// storage; devices without a volatile write cache need not do anything
+	virtual errorcode_t FlushCache() { return ananas_success(); }
 };
 
 class IUSBDeviceOperations {
@@ -67,6 +92,8 @@ public:
 	virtual void HandleExplore() = 0;
 };
 
+struct SCSIRequest;
+
 class ISCSIDeviceOperations
 {
 public:
@@ -75,7 +102,34 @@ public:
 		D_Out
 	};
 
-	virtual errorcode_t PerformSCSIRequest(int lun, Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len) = 0;
+	// Queues the request and returns immediately; the transport calls
+	// sr_callback once it completed, which may happen before we return
+	virtual errorcode_t QueueSCSIRequest(SCSIRequest& req) = 0;
+	// Number of requests which may be queued at once
+	virtual unsigned int GetMaxSCSIRequests() { return 1; }
+	// Largest amount of data, in bytes, a single request may transfer
+	virtual unsigned int GetMaxTransferLength() = 0;
+};
+
+struct SCSIRequest
+{
+	typedef void Callback(SCSIRequest& req);
+
+	int sr_lun = 0;
+	ISCSIDeviceOperations::Direction sr_dir = ISCSIDeviceOperations::Direction::D_In;
+	uint8_t sr_cdb[16];
+	size_t sr_cdb_len = 0;
+	void* sr_data = nullptr;
+	size_t sr_data_len = 0;
+	Callback* sr_callback = nullptr;
+	void* sr_context = nullptr;	/* for the owner of the request */
+
+	/* Filled out by the transport */
+	uint32_t sr_tag = 0;
+	size_t sr_data_done = 0;
+	errorcode_t sr_result;
+
+	LIST_FIELDS(SCSIRequest);
 };
 
 class Device;
@@ -125,7 +179,9 @@ public:
 	unsigned int d_Unit = -1;
 	ResourceSet d_ResourceSet;
 	dma_tag_t d_DMA_tag = nullptr;
+	struct BIO_QUEUE* d_BIOQueue = nullptr;
 	semaphore_t d_Waiters;
+	struct EVENT_SOURCE d_Events;
 
 	Device(const Device&) = delete;
 	Device& operator=(const Device&) = delete;
@@ -140,6 +196,7 @@ errorcode_t AttachSingle(Device& device);
 errorcode_t Detach(Device& device);
 Device* AttachChild(Device& bus, const Ananas::ResourceSet& resourceSet);
 void AttachBus(Device& bus);
+void WaitForAttach();
 Device* FindDevice(const char* name);
 Device* FindDevice(dev_t dev);
 Device* CreateDevice(const char* driver, const Ananas::CreateDeviceProperties& cdp);
@@ -43,7 +43,9 @@ errorcode_t dma_tag_create(dma_tag_t parent, Ananas::Device& dev, dma_tag_t* tag
 errorcode_t dma_tag_destroy(dma_tag_t tag);
 
 /*
- * Allocates a buffer intended for DMA to a given device.
+ * Allocates a buffer intended for DMA to a given device; the memory lies
+ * within the tag's address range. Freed buffers are kept by the tag, so
+ * allocating the same size again is cheap.
  *
  * tag: DMA tag in use by the device
  */
@@ -65,10 +67,25 @@ dma_buf_seg_t dma_buf_get_segment(dma_buf_t buf, unsigned int n);
 
 typedef errorcode_t (*dma_load_func_t)(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs);
 
-/* Loads a given buffer to DMA-able addresses for the device */
+/* Flags for dma_buf_load(); these tell which way the data goes if it must be bounced */
+#define DMA_LOAD_FLAG_READ	0x0001	/* Device writes to the data */
+#define DMA_LOAD_FLAG_WRITE	0x0002	/* Device reads from the data */
+
+/*
+ * Loads a given buffer to DMA-able addresses for the device; load is called
+ * with a single segment describing size bytes. If the device can't reach the
+ * data, it is passed a bounce page instead - this is only supported if size
+ * fits in a page. Any buffer loaded must be unloaded once the transfer is done.
+ */
 errorcode_t dma_buf_load(dma_buf_t buf, void* data, dma_size_t size, dma_load_func_t load, void* load_arg, int flags);
 
 /* Loads a BIO buffer to DMA-able addresses for the device */
 errorcode_t dma_buf_load_bio(dma_buf_t buf, struct BIO* bio, dma_load_func_t load, void* load_arg, int flags);
 
+/* Finishes a load of data; if it was bounced, anything the device read is copied to data */
+void dma_buf_unload(dma_buf_t buf, void* data);
+
+/* Finishes a load of a BIO buffer */
+void dma_buf_unload_bio(dma_buf_t buf, struct BIO* bio);
+
 #endif /* __ANANAS_DMA_H__ */
@@ -3,6 +3,7 @@
 
 #include <ananas/error.h>
 #include <ananas/init.h>
+#include <ananas/resourceset.h>
 
 namespace Ananas {
 
@@ -19,6 +20,22 @@ errorcode_t Unregister(const char* name);
 
 } // namespace DriverManager
 
+/*
+ * Drivers may describe which devices they could possibly handle; the driver
+ * manager indexes these so that a new device is only offered to drivers
+ * that stand a chance. A device is a candidate if any entry matches one of
+ * its resources, i.e. (r_Base & dm_Mask) == dm_Value; the table ends with
+ * an entry of type RT_Unused. CreateDevice() still makes the final call.
+ */
+struct DriverMatch {
+	Resource::Type dm_Type;
+	Resource::Base dm_Value;
+	Resource::Base dm_Mask;
+};
+
+/* Maximum number of drivers a single device is offered to */
+#define DRIVER_MAX_CANDIDATES 64
+
 /*
  * Driver has three main purposes:
  *
@@ -42,7 +59,35 @@ public:
 		return nullptr;
 	}
 
+	/* Devices this driver may handle; nullptr means it must see all of them */
+	virtual const DriverMatch* GetMatchTable() const
+	{
+		return nullptr;
+	}
+
+	/*
+	 * Devices of drivers which return true here may be attached by a worker
+	 * thread of the device manager, in parallel with other devices; the
+	 * device is handed to the parent before its Attach() has completed, so
+	 * this is only sensible for devices nobody refers to directly.
+	 */
+	virtual bool CanAttachAsynchronously() const
+	{
+		return false;
+	}
+
+	/*
+	 * Comma-separated list of drivers whose devices must be attached before
+	 * this driver's devices are; this implies asynchronous attach. Devices
+	 * are also not attached before their parent bus is completely probed.
+	 */
+	virtual const char* GetAttachDependencies() const
+	{
+		return nullptr;
+	}
+
 	bool MustProbeOnBus(const Device& bus) const;
+	bool MustAttachAfter(const char* driver) const;
 
 	const char* d_Name;
 	int d_Priority;
@@ -13,6 +13,11 @@ static inline uint32_t _swap32(uint32_t v)
 	return (v >> 24) | ((v >> 16) & 0xff) << 8 | ((v >> 8) & 0xff) << 16 | (v & 0xff) << 24;
 }
 
+static inline uint64_t _swap64(uint64_t v)
+{
+	return (uint64_t)_swap32(v & 0xffffffff) << 32 | _swap32(v >> 32);
+}
+
 #ifdef BIG_ENDIAN
 # define BIG_OR_LITTLE(be, le) (be)
 #elif defined(LITTLE_ENDIAN)
@@ -26,17 +31,17 @@ static inline uint16_t htole16(uint16_t v)
 	return BIG_OR_LITTLE(_swap16(v), v);
 }
 
-static inline uint32_t htole32(uint16_t v)
+static inline uint32_t htole32(uint32_t v)
 {
 	return BIG_OR_LITTLE(_swap32(v), v);
 }
 
-static inline uint32_t htobe16(uint16_t v)
+static inline uint16_t htobe16(uint16_t v)
 {
 	return BIG_OR_LITTLE(v, _swap16(v));
 }
 
-static inline uint32_t htobe32(uint16_t v)
+static inline uint32_t htobe32(uint32_t v)
 {
 	return BIG_OR_LITTLE(v, _swap32(v));
 }
@@ -51,4 +56,14 @@ static inline uint32_t betoh32(uint32_t v)
 	return BIG_OR_LITTLE(v, _swap32(v));
 }
 
+static inline uint64_t htobe64(uint64_t v)
+{
+	return BIG_OR_LITTLE(v, _swap64(v));
+}
+
+static inline uint64_t betoh64(uint64_t v)
+{
+	return BIG_OR_LITTLE(v, _swap64(v));
+}
+
 #endif /* __ANANAS_ENDIAN_H__ */
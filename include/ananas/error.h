@@ -28,6 +28,10 @@
 #define ANANAS_ERROR_CROSS_DEVICE	22		/* Cross device operation */
 #define ANANAS_ERROR_UNSUPPORTED	23		/* Unsupported operation */
 #define ANANAS_ERROR_READ_ONLY		24		/* Writing is prohibited */
+#define ANANAS_ERROR_TIMEOUT		25		/* Operation timed out */
+#define ANANAS_ERROR_BROKEN_PIPE	26		/* Other end of the pipe is gone */
+#define ANANAS_ERROR_TRY_AGAIN		27		/* Condition changed; retry the operation */
+#define ANANAS_ERROR_NO_PROCESS		28		/* Process not found */
 
 static inline errorcode_t ananas_success()
 {
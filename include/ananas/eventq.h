@@ -0,0 +1,59 @@
+#ifndef __ANANAS_EVENTQ_H__
+#define __ANANAS_EVENTQ_H__
+
+#include <ananas/types.h>
+
+/*
+ * Event queues report which of the handles registered with them are ready,
+ * much like epoll(): interest in a handle is registered once using evq_ctl(),
+ * after which evq_wait() returns the ready handles at a cost proportional to
+ * the number of ready handles, not the number of registered ones.
+ *
+ * Reporting is level-triggered: a handle is reported for as long as it is
+ * ready. A cloned process gets an empty event queue.
+ */
+#define HANDLE_EVENT_READ	0x0001	/* Reading will not block */
+#define HANDLE_EVENT_WRITE	0x0002	/* Writing will not block */
+
+/* evq_ctl() operations */
+#define EVQ_CTL_ADD		1
+#define EVQ_CTL_MODIFY		2
+#define EVQ_CTL_DELETE		3	/* event is ignored */
+
+struct HANDLE_EVENT {
+	handleindex_t	he_handle;	/* Ready handle (evq_wait() only) */
+	unsigned int	he_events;	/* HANDLE_EVENT_... */
+	uint64_t	he_user;	/* Copied from evq_ctl() as-is */
+};
+
+#ifdef KERNEL
+#include <ananas/list.h>
+#include <ananas/lock.h>
+
+struct HANDLE;
+struct EVENTQ_WATCH;
+LIST_DEFINE(EVENTQ_WATCH_LIST, struct EVENTQ_WATCH);
+
+/*
+ * Anything whose readiness can change has an event source, which must be
+ * notified whenever it may have become ready; this must be done from thread
+ * context.
+ */
+struct EVENT_SOURCE {
+	spinlock_t			es_lock;
+	struct EVENTQ_WATCH_LIST	es_watches;
+};
+
+void event_source_init(struct EVENT_SOURCE* es);
+void event_source_notify(struct EVENT_SOURCE* es, unsigned int events);
+
+errorcode_t eventq_alloc(process_t* p, handleindex_t* out);
+errorcode_t eventq_control(struct HANDLE* queue, int op, struct HANDLE* handle, handleindex_t index, const struct HANDLE_EVENT* ev);
+/* Stores up to *count ready handles in out; timeout is in ms, or -1 to wait forever */
+errorcode_t eventq_wait(struct HANDLE* queue, struct HANDLE_EVENT* out, int* count, int timeout);
+
+/* Removes all registrations of the handle; called when it is freed */
+void eventq_handle_free(struct HANDLE* handle);
+#endif
+
+#endif /* __ANANAS_EVENTQ_H__ */
@@ -7,8 +7,11 @@
 #include <ananas/init.h>
 
 struct DENTRY;
+struct VFS_INODE;
+struct PROCINFO;
 
-typedef errorcode_t (*exec_handler_t)(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr);
+/* Loads dentry into vs; info is updated to describe the program to the runtime linker, if any */
+typedef errorcode_t (*exec_handler_t)(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, struct PROCINFO* info);
 
 /*
  * Define an executable format.
@@ -39,7 +42,47 @@ LIST_DEFINE(EXEC_FORMATS, struct EXEC_FORMAT);
 	INIT_FUNCTION(register_##handler, SUBSYSTEM_THREAD, ORDER_MIDDLE); \
 	EXIT_FUNCTION(unregister_##handler);
 
-errorcode_t exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr);
+/*
+ * Parsed layout of an executable; this is cached in the inode so that
+ * executing the same file again requires no parsing. Writing to the file
+ * discards the cached image.
+ */
+#define EXEC_IMAGE_MAX_SEGMENTS	16
+#define EXEC_INTERP_LENGTH	64
+
+struct EXEC_SEGMENT {
+	addr_t		es_virt;	/* Virtual address, page-aligned */
+	off_t		es_vskip;	/* Bytes to skip in the first page */
+	size_t		es_vlength;	/* Length of the mapping */
+	off_t		es_doffset;	/* File offset */
+	size_t		es_dlength;	/* Bytes to map from the file */
+	int		es_flags;	/* VM_FLAG_... */
+};
+
+struct EXEC_IMAGE {
+	addr_t		ei_entry;	/* Entry point */
+	bool		ei_relocatable;	/* Position-independent; mapped at a base address */
+	addr_t		ei_phdr;	/* Address of the program headers, or 0 if not mapped */
+	unsigned int	ei_phnum;
+	char		ei_interp[EXEC_INTERP_LENGTH];	/* Runtime linker, if dynamically linked */
+	unsigned int	ei_num_segments;
+	struct EXEC_SEGMENT ei_segment[EXEC_IMAGE_MAX_SEGMENTS];
+};
+
+/* Copies the cached image of the inode, if any, to image */
+bool exec_image_lookup(struct VFS_INODE* inode, struct EXEC_IMAGE* image);
+void exec_image_store(struct VFS_INODE* inode, const struct EXEC_IMAGE* image);
+/* Discards the cached image, if any; inode must be locked */
+void exec_image_purge(struct VFS_INODE* inode);
+/* Maps the image with all its addresses offset by base */
+errorcode_t exec_image_map(vmspace_t* vs, struct DENTRY* dentry, const struct EXEC_IMAGE* image, addr_t base, addr_t* exec_addr);
+/* Populates the memory a freshly executed program is certain to touch */
+void exec_prefault(vmspace_t* vs);
+
+errorcode_t exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, struct PROCINFO* info);
+/* Sets the arguments or environment of a process from a NULL-terminated list */
+errorcode_t exec_set_args(process_t* p, const char** argv);
+errorcode_t exec_set_environment(process_t* p, const char** envp);
 errorcode_t exec_register_format(struct EXEC_FORMAT* ef);
 errorcode_t exec_unregister_format(struct EXEC_FORMAT* ef);
 
@@ -0,0 +1,23 @@
+#ifndef __ANANAS_FUTEX_H__
+#define __ANANAS_FUTEX_H__
+
+#include <ananas/types.h>
+
+/*
+ * Futexes let userland sleep on a 32-bit word in its memory: futex_wait()
+ * only sleeps if the word still holds the expected value, and futex_wake()
+ * wakes threads sleeping on the word. Locks and condition variables can thus
+ * stay in userland until they are contended. Futexes are private to the
+ * vmspace they live in.
+ */
+
+#ifdef KERNEL
+struct VM_SPACE;
+
+/* Sleeps if *addr == value; timeout is in ms, or -1 to wait forever */
+errorcode_t futex_wait(struct VM_SPACE* vs, int* addr, int value, int timeout);
+/* Wakes up to count threads sleeping on addr; the number woken is stored in woken */
+errorcode_t futex_wake(struct VM_SPACE* vs, int* addr, int count, int* woken);
+#endif
+
+#endif /* __ANANAS_FUTEX_H__ */
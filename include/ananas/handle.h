@@ -2,7 +2,7 @@
 #define __SYS_HANDLE_H__
 
 #include <ananas/lock.h>
-#include <ananas/cbuffer.h>
+#include <ananas/eventq.h>
 #include <ananas/list.h>
 #include <ananas/lock.h>
 #include <ananas/vfs/types.h>
@@ -14,33 +14,23 @@ typedef unsigned int handle_event_result_t;
 #define HANDLE_TYPE_UNUSED	0
 #define HANDLE_TYPE_FILE	1
 #define HANDLE_TYPE_PIPE	2
+#define HANDLE_TYPE_EVENTQ	3
+#define HANDLE_TYPE_SHM		4
+#define HANDLE_TYPE_MAX		5	/* one past the last type */
 
 #define HANDLE_VALUE_INVALID	0
 
 struct THREAD;
 struct HANDLE_OPS;
 
-struct HANDLE_PIPE_BUFFER {
-	mutex_t hpb_mutex;
-	refcount_t hpb_read_count;
-	refcount_t hpb_write_count;
-	CBUFFER_FIELDS;
-	char hpb_buffer[1];
-};
+struct PIPE;
+struct SHM;
 
 struct HANDLE_PIPE_INFO {
 	int hpi_flags;
 #define HPI_FLAG_READ	0x0001
 #define HPI_FLAG_WRITE	0x0002
-	struct HANDLE_PIPE_BUFFER* hpi_buffer;
-	/*
-	 * All HANDLE_PIPE_INFO structs that belong to the same buffer are
-	 * in a circular linked list - this is done so that they can be
-	 * woken up once any of them is written/read/closed. This also
-	 * means we need the handle itself. XXX KLUDGE
-	 */
-	struct HANDLE_PIPE_INFO* hpi_next;
-	struct HANDLE* hpi_handle;
+	struct PIPE* hpi_pipe;
 };
 
 struct HANDLE {
@@ -49,16 +39,30 @@ struct HANDLE {
 	process_t* h_process;			/* owning process */
 	mutex_t h_mutex;			/* mutex guarding the handle */
 	struct HANDLE_OPS* h_hops;		/* handle operations */
-	LIST_FIELDS(struct HANDLE);		/* used for the queue structure */
+	handleindex_t h_index;			/* index in the process' handle table */
+	refcount_t h_refcount;			/* references, one of which is the table's */
+
+	/* Event queue registrations of this handle, protected by the event queue code */
+	struct EVENTQ_WATCH_LIST h_watches;
 
-	/* Waiters are those who are waiting on this handle */
 	union {
 		struct VFS_FILE d_vfs_file;
 		struct HANDLE_PIPE_INFO d_pipe;
+		struct EVENTQ* d_eventq;
+		struct SHM* d_shm;
 	} h_data;
 };
 
-LIST_DEFINE(HANDLE_QUEUE, struct HANDLE);
+/*
+ * Per-process handle table; changed with the process lock held, but read
+ * locklessly by handle_lookup() - see handle.cpp.
+ */
+struct HANDLE_TABLE {
+	int htab_size;				/* number of entries */
+	uint64_t htab_full;			/* bit set for each htab_inuse word without free entries */
+	uint64_t* htab_inuse;			/* bit set for each entry in use */
+	struct HANDLE** htab_handle;		/* handles, by index */
+};
 
 /*
  * Handle operations map almost directly to the syscalls invoked on them.
@@ -67,11 +71,20 @@ struct OPEN_OPTIONS;
 struct CREATE_OPTIONS;
 struct SUMMON_OPTIONS;
 struct CLONE_OPTIONS;
+struct iovec;
 typedef errorcode_t (*handle_read_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, void* buf, size_t* len);
 typedef errorcode_t (*handle_write_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, const void* buf, size_t* len);
 typedef errorcode_t (*handle_open_fn)(thread_t* thread, handleindex_t index, struct HANDLE* result, const char* path, int flags, int mode);
 typedef errorcode_t (*handle_free_fn)(process_t* proc, struct HANDLE* handle);
 typedef errorcode_t (*handle_unlink_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle);
+/* Vectored variants of read/write; offset is NULL to use and update the current position */
+typedef errorcode_t (*handle_readv_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len);
+typedef errorcode_t (*handle_writev_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len);
+/*
+ * Stores the events that are currently ready in events, and the source which
+ * announces changes in source (NULL if readiness never changes)
+ */
+typedef errorcode_t (*handle_poll_fn)(struct HANDLE* handle, unsigned int* events, struct EVENT_SOURCE** source);
 typedef errorcode_t (*handle_clone_fn)(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out);
 
 struct HANDLE_OPS {
@@ -81,6 +94,9 @@ struct HANDLE_OPS {
 	handle_free_fn hop_free;
 	handle_unlink_fn hop_unlink;
 	handle_clone_fn hop_clone;
+	handle_readv_fn hop_readv;
+	handle_writev_fn hop_writev;
+	handle_poll_fn hop_poll;
 };
 
 /* Registration of handle types */
@@ -88,17 +104,25 @@ struct HANDLE_TYPE {
 	const char* ht_name;
 	int ht_id;
 	struct HANDLE_OPS* ht_hops;
-	LIST_FIELDS(struct HANDLE_TYPE);
 };
-LIST_DEFINE(HANDLE_TYPES, struct HANDLE_TYPE);
 
 void handle_init();
 errorcode_t handle_alloc(int type, process_t* p, handleindex_t index_from, struct HANDLE** handle_out, handleindex_t* index_out);
 errorcode_t handle_free(struct HANDLE* h);
 errorcode_t handle_free_byindex(process_t* p, handleindex_t index);
+/* Frees all handles of the process and its handle table */
+void handle_free_all(process_t* p);
+/* Returns a reference to the handle, which must be released using handle_deref() */
 errorcode_t handle_lookup(process_t* p, handleindex_t index, int type, struct HANDLE** handle_out);
+void handle_ref(struct HANDLE* h);
+void handle_deref(struct HANDLE* h);
+/* Clones all handles of p_in to the same index in p_out */
+errorcode_t handle_clone_all(process_t* p_in, process_t* p_out);
 errorcode_t handle_clone(process_t* p_in, handleindex_t index, struct CLONE_OPTIONS* opts, process_t* p_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out);
 
+/* Creates a new pipe, returning its read and write handles */
+errorcode_t pipe_alloc(process_t* p, handleindex_t* read_out, handleindex_t* write_out);
+
 /* Only to be used from handle implementation code */
 errorcode_t handle_clone_generic(struct HANDLE* handle, process_t* p_out, struct HANDLE** out, handleindex_t index_out_min, handleindex_t* index);
 errorcode_t handle_register_type(struct HANDLE_TYPE* ht);
@@ -0,0 +1,150 @@
+#ifndef __ANANAS_HASHTABLE_H__
+#define __ANANAS_HASHTABLE_H__
+
+#include <ananas/types.h>
+#include <ananas/lib.h>
+
+/* 2^64 / phi; multiplying by it spreads keys evenly over the upper bits */
+#define HASH_GOLDEN_RATIO_64	0x9e3779b97f4a7c15ULL
+
+namespace Ananas {
+
+/*
+ * Intrusive hash table; items embed a HashLink and are chained per bucket,
+ * so inserting and removing never allocates. Lookups take O(1) as long as
+ * the table is resized when NeedsGrow() says so.
+ *
+ * The bucket array is supplied by the caller, as is any replacement array
+ * on resizing; this allows the table to be protected by a spinlock, as the
+ * memory can be obtained before taking it. Traits must provide:
+ *
+ *   using Key = ...;
+ *   static HashLink<T>& GetLink(T& item);
+ *   static const Key& GetKey(const T& item);
+ *   static unsigned int Hash(const Key& key);
+ *   static bool Equals(const Key& a, const Key& b);
+ *
+ * The table does no locking of its own; this is up to the user.
+ */
+template<typename T> struct HashLink {
+	T* hl_Next = nullptr;
+};
+
+template<typename T, typename Traits> class HashTable
+{
+public:
+	using Key = typename Traits::Key;
+
+	/* Initializes the table using 2^bits buckets */
+	void Init(T** buckets, unsigned int bits)
+	{
+		ht_Bucket = buckets;
+		ht_Bits = bits;
+		ht_Count = 0;
+		for (unsigned int n = 0; n < GetNumBuckets(); n++)
+			ht_Bucket[n] = nullptr;
+	}
+
+	T* Lookup(const Key& key) const
+	{
+		for (T* item = ht_Bucket[BucketFor(key)]; item != nullptr; item = Traits::GetLink(*item).hl_Next)
+			if (Traits::Equals(Traits::GetKey(*item), key))
+				return item;
+		return nullptr;
+	}
+
+	/* Adds an item; the caller must ensure its key is not in use yet */
+	void Insert(T& item)
+	{
+		T*& head = ht_Bucket[BucketFor(Traits::GetKey(item))];
+		Traits::GetLink(item).hl_Next = head;
+		head = &item;
+		ht_Count++;
+	}
+
+	/* Removes an item; returns false if it wasn't in the table */
+	bool Remove(T& item)
+	{
+		for (T** link = &ht_Bucket[BucketFor(Traits::GetKey(item))]; *link != nullptr; link = &Traits::GetLink(**link).hl_Next) {
+			if (*link != &item)
+				continue;
+			*link = Traits::GetLink(item).hl_Next;
+			Traits::GetLink(item).hl_Next = nullptr;
+			ht_Count--;
+			return true;
+		}
+		return false;
+	}
+
+	/*
+	 * Moves all items to a new array of 2^bits buckets; the previous array is
+	 * returned so that the caller can free it.
+	 */
+	T** Resize(T** buckets, unsigned int bits)
+	{
+		T** old_bucket = ht_Bucket;
+		unsigned int old_num = GetNumBuckets();
+		unsigned int count = ht_Count;
+
+		Init(buckets, bits);
+		for (unsigned int n = 0; n < old_num; n++) {
+			T* next;
+			for (T* item = old_bucket[n]; item != nullptr; item = next) {
+				next = Traits::GetLink(*item).hl_Next;
+				Insert(*item);
+			}
+		}
+		KASSERT(ht_Count == count, "lost items while resizing (%u != %u)", ht_Count, count);
+		return old_bucket;
+	}
+
+	/* Whether the chains have become long enough to warrant resizing */
+	bool NeedsGrow() const
+	{
+		return ht_Count > 2 * GetNumBuckets();
+	}
+
+	/* Calls func(T&) on every item; func must not add or remove items */
+	template<typename Func> void ForEach(Func func)
+	{
+		for (unsigned int n = 0; n < GetNumBuckets(); n++)
+			for (T* item = ht_Bucket[n]; item != nullptr; item = Traits::GetLink(*item).hl_Next)
+				func(*item);
+	}
+
+	unsigned int GetCount() const
+	{
+		return ht_Count;
+	}
+
+	unsigned int GetBits() const
+	{
+		return ht_Bits;
+	}
+
+	unsigned int GetNumBuckets() const
+	{
+		return 1U << ht_Bits;
+	}
+
+private:
+	unsigned int BucketFor(const Key& key) const
+	{
+		return Traits::Hash(key) & (GetNumBuckets() - 1);
+	}
+
+	T** ht_Bucket = nullptr;
+	unsigned int ht_Bits = 0;
+	unsigned int ht_Count = 0;
+};
+
+/* Multiplicative hashing; spreads integer and pointer keys over 'bits' bits */
+static inline unsigned int
+HashInteger(uint64_t key, unsigned int bits = 32)
+{
+	return (key * HASH_GOLDEN_RATIO_64) >> (64 - bits);
+}
+
+} // namespace Ananas
+
+#endif /* __ANANAS_HASHTABLE_H__ */
@@ -39,6 +39,7 @@ struct INIT_FUNC {
 	init_func_t		if_func;
 	enum INIT_SUBSYSTEM	if_subsystem;
 	enum INIT_ORDER		if_order;
+	const char*		if_name;
 };
 
 struct EXIT_FUNC {
@@ -55,7 +56,8 @@ struct EXIT_FUNC {
 	static struct INIT_FUNC if_##fn = { \
 		.if_func = fn, \
 		.if_subsystem = subsys, \
-		.if_order = order \
+		.if_order = order, \
+		.if_name = #fn \
 	}; \
 	extern "C" void * const __if_include_##fn __attribute__((section("initfuncs"))) __attribute__((unused)) = &if_##fn
 
@@ -3,6 +3,7 @@
 
 #include <ananas/device.h>
 #include <ananas/list.h>
+#include <ananas/pcpu.h>
 #include <ananas/thread.h>
 
 /* Return values for the IRQ handler */
@@ -35,6 +36,11 @@ struct IRQ_SOURCE {
 	errorcode_t (*is_unmask)(struct IRQ_SOURCE*, int);
 	/* Acknowledge a given interrupt */
 	void (*is_ack)(struct IRQ_SOURCE*, int);
+	/* Flags */
+	unsigned int	is_flags;
+#define IRQ_SOURCE_FLAG_DYNAMIC	(1 << 0)	/* interrupts are handed out by irq_alloc() */
+	/* Deliver a given interrupt to a CPU; NULL if the source can't route */
+	errorcode_t (*is_set_cpu)(struct IRQ_SOURCE*, int, int);
 };
 LIST_DEFINE(IRQ_SOURCES, struct IRQ_SOURCE);
 
@@ -56,12 +62,13 @@ struct IRQ_HANDLER {
 struct IRQ {
 	struct IRQ_SOURCE*	i_source;
 	struct IRQ_HANDLER	i_handler[IRQ_MAX_HANDLERS];
-	unsigned int		i_count;
+	pcpu_counter_t		i_count;
 	unsigned int		i_straycount;
 	unsigned int		i_flags;
-#define IRQ_FLAG_THREAD	(1 << 0)	/* execute this handler from a thread */
-	thread_t		i_thread;
-	semaphore_t		i_semaphore;
+#define IRQ_FLAG_THREAD	(1 << 0)	/* has handlers to run from the ithread */
+#define IRQ_FLAG_ALLOCATED	(1 << 1)	/* handed out by irq_alloc() */
+#define IRQ_FLAG_AFFINITY	(1 << 2)	/* i_cpu was explicitly chosen */
+	int			i_cpu;		/* CPU the interrupt is delivered to */
 };
 
 /*
@@ -78,7 +85,32 @@ void irqsource_unregister(struct IRQ_SOURCE* source);
 #define IRQ_TYPE_TIMER		IRQ_TYPE_ISR
 errorcode_t irq_register(unsigned int no, Ananas::Device* dev, irqfunc_t func, int type, void* context);
 void irq_unregister(unsigned int no, Ananas::Device* dev, irqfunc_t func, void* context);
-void irq_handler(unsigned int no);
+
+/*
+ * CPU affinity: an interrupt nobody asked a specific CPU for is spread over
+ * the CPUs, which happens once irq_balance() is called when all of them are
+ * able to take interrupts - until then, everything goes to the boot CPU.
+ * Passing IRQ_CPU_ANY to irq_set_cpu() hands the interrupt back to this
+ * policy.
+ */
+#define IRQ_CPU_ANY		(-1)
+errorcode_t irq_register_cpu(unsigned int no, Ananas::Device* dev, irqfunc_t func, int type, void* context, int cpu);
+errorcode_t irq_set_cpu(unsigned int no, int cpu);
+int irq_get_cpu(unsigned int no);
+void irq_balance();
+
+/* Describes all interrupts in use, one per line */
+void irq_get_status(char* buf, size_t len);
+
+/*
+ * Allocates count interrupts from a dynamic source, i.e. one that hands out
+ * its interrupts to devices which are able to deliver any of them (such as
+ * message-signalled interrupts.) count must be a power of two; the block is
+ * contiguous and aligned to count.
+ */
+errorcode_t irq_alloc(unsigned int count, unsigned int* first);
+void irq_free(unsigned int first, unsigned int count);
+void irq_handler(unsigned int no) __hot;
 void irq_dump();
 
 #endif /* __IRQ_H__ */
@@ -4,11 +4,29 @@
 #include <ananas/types.h>
 #include <ananas/cdefs.h>
 #include <ananas/stdarg.h>
+#ifdef KERNEL
+#include "options.h"
+#endif
 
 #define KASSERT(x, msg, args...) \
 	if (!(x)) \
 		_panic(__FILE__, __func__, __LINE__, msg, ## args)
 
+/*
+ * KASSERT() is meant for cheap sanity checks and is always present; checks
+ * which cost more than the code they guard (such as scanning a list to see
+ * whether an item is on it) must use KASSERT_EXPENSIVE(), which is compiled
+ * out of kernels with the PERFORMANCE option. The condition is still seen by
+ * the compiler, so helpers used only in such checks needn't be #ifdef'ed.
+ */
+#ifdef OPTION_PERFORMANCE
+#define KASSERT_EXPENSIVE(x, msg, args...) \
+	do { if (0) (void)(x); } while(0)
+#else
+#define KASSERT_EXPENSIVE(x, msg, args...) \
+	KASSERT(x, msg, ## args)
+#endif
+
 #define panic(msg, args...) \
 		_panic(__FILE__, __func__, __LINE__, msg, ##args)
 
@@ -28,7 +46,7 @@ void* memset(void* b, int c, size_t len) __nonnull;
 void vaprintf(const char* fmt, va_list ap);
 int vsnprintf(char* str, size_t len, const char* fmt, va_list ap);
 void kprintf(const char* fmt, ...);
-void _panic(const char* file, const char* func, int line, const char* fmt, ...) __noreturn;
+void _panic(const char* file, const char* func, int line, const char* fmt, ...) __noreturn __cold;
 int sprintf(char* str, const char* fmt, ...);
 int snprintf(char* str, size_t len, const char* fmt, ...);
 char* strdup(const char* s) __nonnull;
@@ -44,11 +62,25 @@ char* strcat(char* dst, const char* src) __nonnull;
 char* strncpy(char* dst, const char* src, size_t n) __nonnull;
 
 int memcmp(const void* s1, const void* s2, size_t len) __nonnull;
+void* memmove(void* dst, const void* src, size_t len) __nonnull;
 
 unsigned long strtoul(const char* ptr, char** endptr, int base);
 
-/* Crude, but our memcpy() should be able to handle overlapping regions */
-#define memmove memcpy
+/*
+ * Capabilities of the CPU which memcpy() and memset() use to pick the
+ * fastest implementation; set once by the machine-dependant code.
+ */
+#define LIB_STRING_ERMS		(1 << 0)	/* 'rep movsb/stosb' are fast */
+#define LIB_STRING_FSRM		(1 << 1)	/* ... even for short lengths */
+extern int lib_string_flags;
+
+/*
+ * Copies or clears len bytes of whole pages; both pointers must be aligned to
+ * 64 bytes and len must be a multiple thereof.
+ */
+#define PAGEMEM_NONTEMPORAL	(1 << 0)	/* Bypass the cache; for memory not used soon */
+void memcpy_pages(void* dst, const void* src, size_t len, int flags) __nonnull;
+void memzero_pages(void* dst, size_t len, int flags) __nonnull;
 
 #ifdef __cplusplus
 } // extern "C"
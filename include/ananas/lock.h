@@ -3,6 +3,7 @@
 
 #include <ananas/list.h>
 #include <ananas/types.h>
+#include <machine/interrupts.h>
 
 /*
  * Spinlocks are simply locks that just keep the CPU busy waiting if they can't
@@ -13,6 +14,11 @@
  * The definition of spinlock_t is in _types/spinlock.h because it's this avoids
  * a circular depency: the waitqueue used spinlocks, but mutexes use the
  * waitqueues, so they can't be declared in this file...
+ *
+ * Spinlocks are fair: they are acquired in the order in which they were
+ * requested. As a consequence, interrupts are always disabled while waiting
+ * for a spinlock - a waiter which is preempted would otherwise block everyone
+ * queued behind it.
  */
 
 struct SEMAPHORE_WAITER {
@@ -24,15 +30,52 @@ LIST_DEFINE(semaphore_wq, struct SEMAPHORE_WAITER);
 
 /*
  * Semaphores are sleepable locks which guard an amount of units of a
- * particular resource.
+ * particular resource. Units are counted atomically, so the lock is only
+ * needed when there are waiters; these are woken in order of priority.
  */
 typedef struct {
-	spinlock_t		sem_lock;
-	unsigned int		sem_count;
+	spinlock_t		sem_lock;	/* Protects sem_wq */
+	unsigned int		sem_count;	/* Atomic */
 	struct semaphore_wq	sem_wq;
+	struct LOCK_STATS*	sem_stats;	/* OPTION_LOCK_STATS only */
 } semaphore_t;
 
-#define SPINLOCK_DEFAULT_INIT { { 0 } }
+#define SPINLOCK_DEFAULT_INIT { { 0 }, { 0 }, NULL }
+
+/*
+ * Lock statistics; these are only kept if OPTION_LOCK_STATS is enabled.
+ * Spinlocks and semaphores are given an entry of their own once they see
+ * contention; mutexes are grouped by name, as there are often many of them
+ * guarding the same kind of thing. All times are in nanoseconds.
+ */
+#define LOCKSTAT_TYPE_SPINLOCK	1
+#define LOCKSTAT_TYPE_MUTEX	2
+#define LOCKSTAT_TYPE_SEMAPHORE	3
+
+struct LOCK_STATS {
+	int			ls_type;	/* LOCKSTAT_TYPE_... */
+	const void*		ls_lock;	/* Lock, unless this is a mutex class */
+	const char*		ls_name;	/* Mutex class name */
+	void*			ls_caller;	/* First contended acquisition, if known */
+	uint64_t		ls_acquisitions;
+	uint64_t		ls_contentions;
+	uint64_t		ls_wait_ns;	/* Total time spent waiting */
+	uint64_t		ls_hold_max_ns;	/* Longest time held */
+	uint64_t		ls_hold_start;	/* Spinlocks only; protected by the lock */
+};
+
+#ifdef KERNEL
+/* Hooks up statistics to a lock; these return NULL if we are out of entries */
+struct LOCK_STATS* lockstat_alloc(int type, const void* lock, void* caller);
+struct LOCK_STATS* lockstat_get_class(const char* name);
+
+/* Accounts for an acquisition; wait_ns is only non-zero if we were contended */
+void lockstat_acquired(struct LOCK_STATS* ls, bool contended, uint64_t wait_ns);
+void lockstat_held(struct LOCK_STATS* ls, uint64_t hold_ns);
+
+/* Formats entry n as a single line; returns false if there is no such entry */
+bool lockstat_format(unsigned int n, char* line, size_t len);
+#endif /* KERNEL */
 
 /*
  * Mutexes are sleepable locks that will suspend the current thread when the
@@ -42,13 +85,39 @@ typedef struct {
 struct MUTEX {
 	const char*		mtx_name;
 	thread_t*		mtx_owner;
+	unsigned int		mtx_owner_cpu;	/* CPU the owner took us on */
 	semaphore_t		mtx_sem;
 	const char*		mtx_fname;
 	int			mtx_line;
+	struct LOCK_STATS*	mtx_stats;	/* OPTION_LOCK_STATS only */
+	uint64_t		mtx_acquired;	/* OPTION_LOCK_STATS only */
+	/* Priority inheritance; protected by spl_pi in lock.cpp */
+	thread_t*		mtx_pi_thread;	/* Owner whose t_pi_mutexes we are on */
+	struct MUTEX*		mtx_pi_next;
+	int			mtx_pi_priority;	/* Best priority lent through us */
 };
 
 typedef struct MUTEX mutex_t;
 
+/*
+ * Reader-writer locks are sleepable locks which can be held by any number of
+ * readers, or by a single writer. Writers take precedence over new readers,
+ * but a writer releasing the lock will let all waiting readers in before the
+ * next writer, so neither can starve.
+ */
+struct RWLOCK {
+	const char*		rw_name;
+	spinlock_t		rw_lock;	/* Protects the fields below */
+	unsigned int		rw_readers;	/* Number of readers holding the lock */
+	thread_t*		rw_writer;	/* Writer holding the lock, if any */
+	unsigned int		rw_waiting_readers;
+	unsigned int		rw_waiting_writers;
+	semaphore_t		rw_read_sem;	/* Signalled to let a reader in */
+	semaphore_t		rw_write_sem;	/* Signalled to let a writer in */
+};
+
+typedef struct RWLOCK rwlock_t;
+
 
 /* Ordinary spinlocks which can be preempted at any time */
 void spinlock_lock(spinlock_t* l);
@@ -69,6 +138,42 @@ void mutex_unlock(mutex_t* mtx);
 void mutex_assert(mutex_t* mtx, int what);
 int mutex_trylock_(mutex_t* mtx, const char* fname, int len);
 #define mutex_trylock(mtx) mutex_trylock_(mtx, __FILE__, __LINE__)
+/* Gives up with ANANAS_ERROR_TIMEOUT if the mutex isn't ours within timeout ns */
+errorcode_t mutex_lock_timeout_(mutex_t* mtx, uint64_t timeout, const char* fname, int line);
+#define mutex_lock_timeout(mtx, timeout) mutex_lock_timeout_(mtx, timeout, __FILE__, __LINE__)
+
+/* Changes the priority of a thread; anything lent to it by mutex waiters stays in effect */
+void mutex_pi_set_priority(thread_t* t, int prio);
+
+/* Reader-writer locks */
+void rwlock_init(rwlock_t* rw, const char* name);
+void rwlock_lock_read(rwlock_t* rw);
+void rwlock_unlock_read(rwlock_t* rw);
+/* Returns non-zero if the lock was taken for reading; fails rather than wait */
+int rwlock_trylock_read(rwlock_t* rw);
+void rwlock_lock_write(rwlock_t* rw);
+void rwlock_unlock_write(rwlock_t* rw);
+#define RWLOCK_WRITE_LOCKED 1
+#define RWLOCK_LOCKED 2 /* by anyone, either for reading or writing */
+void rwlock_assert(rwlock_t* rw, int what);
+
+/*
+ * RCU-style read sections; these are cheap and never block writers, but they
+ * must not sleep. Writers unlink an item, call rcu_synchronize() to wait until
+ * every CPU has left any read section it was in, and can then free the item.
+ * Interrupt handlers are implicitly read sections.
+ */
+static inline register_t rcu_read_lock()
+{
+	return md_interrupts_save_and_disable();
+}
+
+static inline void rcu_read_unlock(register_t state)
+{
+	md_interrupts_restore(state);
+}
+
+void rcu_synchronize();
 
 /* Semaphores */
 void sem_init(semaphore_t* sem, int count);
@@ -76,5 +181,7 @@ void sem_signal(semaphore_t* sem);
 void sem_wait(semaphore_t* sem);
 int sem_trywait(semaphore_t* sem);
 void sem_wait_and_drain(semaphore_t* sem);
+/* Gives up with ANANAS_ERROR_TIMEOUT if not signalled within timeout ns */
+errorcode_t sem_wait_timeout(semaphore_t* sem, uint64_t timeout);
 
 #endif /* __LOCK_H__ */
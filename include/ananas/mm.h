@@ -19,6 +19,8 @@ void operator delete(void* p) throw();
 #endif
 
 void mm_init();
+/* Describes the kmalloc() arena of every CPU, one line per arena */
+void mm_get_status(char* buf, size_t len);
 void kmem_chunk_reserve(addr_t chunk_start, addr_t chunk_end, addr_t reserved_start, addr_t reserved_end, addr_t* out_start, addr_t* out_end);
 
 #endif /* __MM_H__ */
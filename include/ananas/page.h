@@ -5,6 +5,19 @@
 #include <ananas/lock.h>
 
 #define PAGE_NUM_ORDERS 10
+#define PAGE_MAX_NODES 8
+
+/*
+ * Allocations are grouped by mobility: anonymous memory of processes can be
+ * moved elsewhere by page_compact(), everything else stays where it is. Every
+ * block of the largest order holds a single kind if at all possible, so that
+ * pinned kernel allocations do not end up scattered all over memory.
+ */
+#define PAGE_MOBILITY_UNMOVABLE	0
+#define PAGE_MOBILITY_MOVABLE	1
+#define PAGE_NUM_MOBILITIES	2
+
+struct VM_PAGE;
 
 struct PAGE {
 	LIST_FIELDS(struct PAGE);
@@ -14,6 +27,9 @@ struct PAGE {
 
 	/* Owning zone */
 	struct PAGE_ZONE* p_zone;
+
+	/* Anonymous page using us while it can be moved, see vmpage_migrate() */
+	struct VM_PAGE* p_vmpage;
 };
 
 LIST_DEFINE(page_list, struct PAGE);
@@ -24,12 +40,15 @@ struct PAGE_ZONE {
 	/* Lock protecting the zone */
 	spinlock_t z_lock;
 
-	/* Free pages within this zone */
-	struct page_list z_free[PAGE_NUM_ORDERS];
+	/* Free pages within this zone, by the mobility of the block they are in */
+	struct page_list z_free[PAGE_NUM_MOBILITIES][PAGE_NUM_ORDERS];
 
 	/* Total number of pages */
 	unsigned int z_num_pages;
 
+	/* Leading pages which only exist to align the zone; these are never available */
+	unsigned int z_reserved_pages;
+
 	/* Available number of pages */
 	unsigned int z_avail_pages;
 
@@ -41,14 +60,44 @@ struct PAGE_ZONE {
 
 	/* Map with the used bitmap */
 	char* z_bitmap;
+
+	/* Mobility of every block of the largest order */
+	uint8_t* z_block_mobility;
+
+	/* Pages not set up yet, and the first of those not yet claimed, see page_zone_add() */
+	unsigned int z_deferred_pages;
+	unsigned int z_deferred_next;
+
+	/* NUMA node the memory belongs to */
+	unsigned int z_node;
 };
 
 LIST_DEFINE(zone_list, struct PAGE_ZONE);
 
+struct PCPU;
+
 /* Add a chunk of memory to use for page allocation */
 void page_zone_add(addr_t base, size_t length);
 
-/* Allocates a block of 2^order pages */
+/*
+ * NUMA support: the platform code assigns every zone and CPU to a node and
+ * supplies the distances between them; allocations are then made from the
+ * node of the current CPU if possible, falling back to the nearest nodes.
+ * Without this, all memory is considered part of node 0.
+ */
+void page_set_node(addr_t base, size_t length, unsigned int node);
+/* Must be called before the CPU starts allocating pages */
+void page_set_cpu_node(struct PCPU* pcpu, unsigned int node);
+
+/*
+ * Sets the number of nodes and the distances between them; distance[a *
+ * num_nodes + b] is the relative cost of node a accessing memory of node b,
+ * with 10 being local access. If distance is NULL, all remote accesses are
+ * considered equally expensive.
+ */
+void page_set_node_distances(unsigned int num_nodes, const uint8_t* distance);
+
+/* Allocates a block of 2^order unmovable pages */
 struct PAGE* page_alloc_order(int order);
 
 /* Allocates a single page */
@@ -57,6 +106,34 @@ inline static struct PAGE* page_alloc_single() {
 }
 void page_free(struct PAGE* p);
 
+/*
+ * Allocates a block of 2^order pages, aligned to its size in physical memory,
+ * as 2^order individual pages which are freed one by one; returns NULL if no
+ * such block is available. This is meant for anonymous memory, so the pages
+ * are movable.
+ */
+struct PAGE* page_alloc_order_split(int order);
+
+/*
+ * Allocates a block of 2^order pages which lies entirely within
+ * [min_addr, max_addr] in physical memory; returns NULL if there is none.
+ */
+struct PAGE* page_alloc_order_range(int order, addr_t min_addr, addr_t max_addr);
+
+/* Allocates a single unmovable page which is filled with zeroes */
+struct PAGE* page_alloc_zeroed();
+
+/*
+ * As page_alloc_order() and page_alloc_zeroed(), but if memory runs out, these
+ * wait for the page daemon to free some rather than panic; they may sleep, so
+ * they can only be used where a fault could be taken. These are meant for
+ * anonymous memory, so the pages are movable.
+ */
+struct PAGE* page_alloc_order_wait(int order);
+struct PAGE* page_alloc_zeroed_wait();
+/* As page_alloc_order_wait(), but returns NULL once the page daemon cannot free anything */
+struct PAGE* page_alloc_order_try_wait(int order);
+
 /* Retrieves the physical address of page p */
 addr_t page_get_paddr(struct PAGE* p);
 
@@ -74,7 +151,46 @@ struct PAGE* page_alloc_length(size_t length);
 /* Allocates enough pages to hold length bytes and maps it to kernel memory */
 void* page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags);
 
+/* Allocates enough pages within [min_addr, max_addr] to hold length bytes and maps it; returns NULL on failure */
+void* page_alloc_length_mapped_range(size_t length, addr_t min_addr, addr_t max_addr, struct PAGE** p, int vm_flags);
+
 /* Retrieve the page statistics */
 void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages);
 
+/*
+ * Describes every zone and its free blocks per order, one line per zone,
+ * followed by the page totals and allocations made per node
+ */
+void page_get_status(char* buf, size_t len);
+
+/*
+ * Reclaimers are caches which can hand pages back if memory runs out; the
+ * callback is asked to free num_pages pages and returns how many it did. It
+ * may be called from any context, so it must not sleep nor allocate pages.
+ *
+ * Once less than a low watermark of memory is available, the 'pagedaemon'
+ * thread calls the reclaimers until a high watermark is reached again; those
+ * with PAGE_RECLAIMER_F_DAEMON are only called by it, and may sleep.
+ */
+typedef unsigned int (*page_reclaim_fn_t)(unsigned int num_pages);
+
+struct PAGE_RECLAIMER {
+	const char* pr_name;
+	page_reclaim_fn_t pr_func;
+	int pr_flags;
+#define PAGE_RECLAIMER_F_DAEMON	(1 << 0)	/* only called by the page daemon */
+	LIST_FIELDS(struct PAGE_RECLAIMER);
+};
+
+LIST_DEFINE(page_reclaimer_list, struct PAGE_RECLAIMER);
+
+void page_register_reclaimer(struct PAGE_RECLAIMER* pr);
+
+/*
+ * Tries to make a free block of 2^order pages by moving the anonymous pages
+ * in the way elsewhere; returns whether it did. This is done by the allocator
+ * if no such block is left, so it need not be called directly.
+ */
+bool page_compact(int order);
+
 #endif /* __ANANAS_PAGE_H__ */
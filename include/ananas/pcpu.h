@@ -1,10 +1,25 @@
 #include <ananas/types.h>
+#include <ananas/cpupower.h>
+#include <ananas/perfctr.h>
 #include <ananas/thread.h>
+#include <ananas/page.h>
 #include <machine/pcpu.h>
 
 #ifndef __PCPU_H__
 #define __PCPU_H__
 
+/*
+ * Per-CPU counters: every CPU adds to its own slot in its struct PCPU, so
+ * counting needs neither atomic operations nor cache lines bouncing between
+ * CPUs. The slots are only summed as the counter is read, which makes that
+ * relatively costly; this is meant for statistics of frequent events.
+ */
+#define PCPU_NUM_COUNTERS 512
+
+typedef struct {
+	unsigned int pc_slot;	/* 0 (which is shared by all) if not set up yet */
+} pcpu_counter_t;
+
 /* Per-CPU information pointer */
 struct PCPU {
 	MD_PCPU_FIELDS				/* Machine-dependant data */
@@ -12,7 +27,59 @@ struct PCPU {
 	thread_t* curthread;			/* current thread */
 	thread_t* idlethread;			/* idle thread */
 	int nested_irq;				/* number of nested IRQ functions */
-};
+	int preempt_count;			/* preempt_disable() nesting, see ananas/preempt.h */
+	uint64_t preempt_start;			/* OPTION_PREEMPT_STATS: when preemption was disabled */
+	void* preempt_caller;			/* and by whom */
+	uint64_t preempt_max_ns;		/* longest time preemption was disabled */
+	void* preempt_max_caller;		/* who disabled it then */
+
+	/*
+	 * Scheduler per-CPU data; only to be touched by kern/scheduler.cpp. Other
+	 * CPUs take the lock to hand us threads, so it starts a cache line of its
+	 * own rather than share one with the fields above.
+	 */
+	spinlock_t sched_lock __attribute__((aligned(64)));	/* protects the fields below */
+	struct SCHED_RUNQUEUE sched_runqueue;	/* threads runnable on this CPU */
+	unsigned int sched_runqueue_len;	/* number of threads on sched_runqueue */
+	unsigned int sched_balance_ticks;	/* schedule() calls since last balance */
+	unsigned int sched_migrations;		/* number of threads pulled to this CPU */
+	unsigned int sched_core;		/* physical core, see scheduler_set_topology() */
+	unsigned int sched_llc;			/* last-level cache domain */
+	volatile int sched_tickless;		/* idle with the periodic tick stopped */
+	volatile unsigned int rcu_qs_count;	/* quiescent states passed, see rcu_synchronize() */
+	uint64_t sched_switches;		/* context switches made */
+	uint64_t sched_latency[SCHED_LATENCY_BUCKETS];	/* scheduling latency histogram */
+	uint64_t sched_rt_period_start;		/* start of the real-time budget period */
+	uint64_t sched_rt_ns;			/* time used by real-time threads this period */
+	uint64_t sched_rt_last;			/* last time sched_rt_ns was brought up-to-date */
+	int sched_rt_throttled;			/* real-time threads used up their budget */
+	unsigned int sched_rt_throttle_count;	/* number of times that happened */
+
+	/* Per-CPU caches of order-0 pages by mobility; only to be touched by kern/page.cpp */
+	struct page_list page_cache[PAGE_NUM_MOBILITIES];
+	unsigned int page_cache_count[PAGE_NUM_MOBILITIES];
+	unsigned int page_node;			/* NUMA node, see page_set_cpu_node() */
+
+	/* Zeroed page-table pages; only to be touched by the MD mapping code */
+	struct page_list pt_cache;
+	unsigned int pt_cache_count;
+
+	/* Power management; only to be touched by kern/cpupower.cpp */
+	unsigned int power_generation;		/* cpupower mode last applied */
+	volatile int power_idle;		/* set while sleeping */
+	uint64_t power_idle_count[CPUPOWER_MAX_IDLE_STATES];	/* times each idle state was entered */
+	char power_descr[48];			/* frequency policy in effect */
+
+	/* Performance counters; only to be touched by kern/perfctr.cpp */
+	int perfctr_active;			/* counters are programmed */
+	uint64_t perfctr_last[PERFCTR_NUM];	/* values as of the last thread switch */
+
+	/* Our slots of the per-CPU counters, see pcpu_counter_add() */
+	uint64_t counters[PCPU_NUM_COUNTERS] __attribute__((aligned(64)));
+} __attribute__((aligned(64)));	/* so that no CPU shares a cache line with another */
+
+/* Maximum number of CPUs we can keep track of */
+#define PCPU_MAX_CPUS 32
 
 /* Retrieve the size of the machine-dependant structure */
 size_t md_pcpu_get_privdata_length();
@@ -20,7 +87,39 @@ size_t md_pcpu_get_privdata_length();
 /* Introduce a per-cpu structure */
 void pcpu_init(struct PCPU* pcpu);
 
+/* Retrieve the per-cpu structure of a given CPU, or NULL if it doesn't exist */
+struct PCPU* pcpu_get(unsigned int cpuid);
+
+/* Retrieve the number of per-cpu structures introduced so far */
+unsigned int pcpu_get_count();
+
+/* Ask a given CPU to reschedule as soon as possible */
+void md_pcpu_reschedule(struct PCPU* pcpu);
+
+/* Stop or restart the periodic timeslice tick of the current CPU */
+void md_pcpu_tick_stop();
+void md_pcpu_tick_start();
+
 /* Get the current thread */
 #define PCPU_CURTHREAD() PCPU_GET(curthread)
 
+/* Sets up a counter, which starts at zero; counters are never released */
+void pcpu_counter_init(pcpu_counter_t* pc);
+
+/* Returns the sum of the counter over all CPUs */
+uint64_t pcpu_counter_read(const pcpu_counter_t* pc);
+
+/* Adds n to the counter; safe in any context, as it is done by a single instruction */
+static inline void
+pcpu_counter_add(pcpu_counter_t* pc, uint64_t n)
+{
+	PCPU_ADD64_AT(PCPU_OFFSET(counters) + pc->pc_slot * sizeof(uint64_t), n);
+}
+
+static inline void
+pcpu_counter_inc(pcpu_counter_t* pc)
+{
+	pcpu_counter_add(pc, 1);
+}
+
 #endif /* __PCPU_H__ */
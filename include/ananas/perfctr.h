@@ -0,0 +1,57 @@
+#ifndef __ANANAS_PERFCTR_H__
+#define __ANANAS_PERFCTR_H__
+
+#include <ananas/types.h>
+
+/*
+ * Hardware performance counters in counting mode. Once 'cpu.perfctr' in
+ * /ankh/sys is set, every CPU counts the events below and attributes what it
+ * counted to the thread that ran, as it switches away from it; the counts of
+ * all threads are added to those of their process as well. Both user and
+ * kernel mode are counted.
+ *
+ * The counts of the calling thread can be obtained using the perfctr_read
+ * syscall (pid 0), those of a process using its pid or by reading
+ * /ankh/proc/<pid>/perfctr. Not every CPU can count every event; pc_valid
+ * tells which counts mean anything.
+ */
+#define PERFCTR_CYCLES		0	/* Core cycles while not halted */
+#define PERFCTR_INSTRUCTIONS	1	/* Instructions retired */
+#define PERFCTR_LLC_MISSES	2	/* Last-level cache misses */
+#define PERFCTR_BRANCH_MISSES	3	/* Mispredicted branches retired */
+#define PERFCTR_NUM		4
+
+struct PERFCTR_COUNTS {
+	uint64_t	pc_count[PERFCTR_NUM];
+	uint32_t	pc_valid;	/* Bit n is set if pc_count[n] is counted */
+};
+
+#ifdef KERNEL
+struct THREAD;
+struct PROCESS;
+
+/* Called by md_thread_switch() with interrupts disabled, before switching away */
+void perfctr_thread_switch(struct THREAD* old_thread);
+
+/* Retrieves the counts of t, which must be the current thread or not running */
+void perfctr_get_thread(struct THREAD* t, struct PERFCTR_COUNTS* counts);
+/* Retrieves the counts of all threads of p, including those which are gone */
+void perfctr_get_process(struct PROCESS* p, struct PERFCTR_COUNTS* counts);
+
+/* Formats the counts as 'key value' lines */
+void perfctr_format(const struct PERFCTR_COUNTS* counts, char* buf, size_t len);
+
+/*
+ * Machine-dependant part. md_perfctr_probe() returns the PERFCTR_* counters
+ * the CPU can count as a mask, and the width of the counters in bits.
+ * md_perfctr_start() and md_perfctr_stop() program the counters of the current
+ * CPU; md_perfctr_read() stores their raw values in count, which wrap once
+ * they exceed their width.
+ */
+unsigned int md_perfctr_probe(unsigned int* width);
+void md_perfctr_start();
+void md_perfctr_stop();
+void md_perfctr_read(uint64_t* count);
+#endif
+
+#endif /* __ANANAS_PERFCTR_H__ */
@@ -0,0 +1,46 @@
+#ifndef __ANANAS_PREEMPT_H__
+#define __ANANAS_PREEMPT_H__
+
+#include <ananas/types.h>
+#include <ananas/pcpu.h>
+#include "options.h"
+
+/*
+ * The kernel is preemptible: if an interrupt makes a more important thread
+ * runnable, we switch to it once the interrupt is done - even if we were in
+ * the middle of kernel code. Sections that must not be switched away from,
+ * such as anything holding a spinlock, are bracketed by preempt_disable() and
+ * preempt_enable(); these nest using the per-CPU preempt_count. A reschedule
+ * requested within such a section is done by the preempt_enable() ending it.
+ *
+ * preempt_count is saved in the thread when it is switched out, so a thread
+ * which sleeps within such a section gets it back when it resumes.
+ */
+
+#ifdef OPTION_PREEMPT_STATS
+void preempt_stats_begin(void* caller);
+#endif
+
+static inline void
+preempt_disable()
+{
+	PCPU_ADD(preempt_count, 1);
+#ifdef OPTION_PREEMPT_STATS
+	if (PCPU_GET(preempt_count) == 1)
+		preempt_stats_begin(__builtin_return_address(0));
+#endif
+}
+
+/* Ends a preempt_disable() section; reschedules if this was the last one */
+void preempt_enable();
+
+static inline bool
+preempt_disabled()
+{
+	return PCPU_GET(preempt_count) > 0;
+}
+
+/* Restores the preempt_count of the current thread; called on switching */
+void preempt_resume(thread_t* t);
+
+#endif /* __ANANAS_PREEMPT_H__ */
@@ -3,12 +3,18 @@
 
 #include <ananas/list.h>
 #include <ananas/lock.h>
+#include <ananas/perfctr.h>
+#include <ananas/taskstats.h>
 
 struct DENTRY;
 struct PROCINFO;
+struct SYSCALL_RING;
 
-/* Maximum number of handles per process */
-#define PROCESS_MAX_HANDLES 64
+/* Maximum number of handles per process; the handle table grows up to this */
+#define PROCESS_MAX_HANDLES 4096
+
+/* Process ID's are recycled, and are always below this */
+#define PROCESS_MAX_PID 32768
 
 #define PROCESS_STATE_ACTIVE	1
 #define PROCESS_STATE_ZOMBIE	2
@@ -34,12 +40,19 @@ struct PROCESS {
 
 	thread_t* p_mainthread;		/* Main thread */
 
-	struct HANDLE* p_handle[PROCESS_MAX_HANDLES];	/* Handles */
+	struct HANDLE_TABLE* p_handles;	/* Handle table, see handle.cpp */
 
 	struct DENTRY* p_cwd;		/* Current path */
 
+	struct SYSCALL_RING* p_ring;	/* Submission/completion ring, if any */
+
 	struct PROCESS_QUEUE	p_children;	/* Queue of this process' children */
 
+	struct PROCESS* p_hash_next;	/* Next process in the PID hash chain */
+
+	struct TASK_STATS p_stats;	/* Fault and syscall statistics of all threads */
+	struct PERFCTR_COUNTS p_perfctr;	/* Hardware performance counts of all threads */
+
         LIST_FIELDS_IT(struct PROCESS, all);
         LIST_FIELDS_IT(struct PROCESS, children);
 };
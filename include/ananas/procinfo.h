@@ -17,6 +17,13 @@ struct PROCINFO {
 	gid_t		pi_egid;				/* effective group ID */
 	char		pi_args[PROCINFO_ARGS_LENGTH];	/* commandline arguments */
 	char		pi_env[PROCINFO_ENV_LENGTH];		/* environment */
+
+	/* Set by exec; the runtime linker uses these to find the program */
+	addr_t		pi_exec_base;				/* load address of the program */
+	addr_t		pi_phdr;				/* its program headers, or 0 */
+	unsigned int	pi_phnum;				/* number of program headers */
+	addr_t		pi_entry;				/* its entry point */
+	addr_t		pi_interp_base;				/* load address of the runtime linker, or 0 */
 };
 
 #ifndef KERNEL
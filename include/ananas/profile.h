@@ -0,0 +1,45 @@
+#ifndef __ANANAS_PROFILE_H__
+#define __ANANAS_PROFILE_H__
+
+#include <ananas/types.h>
+
+/*
+ * Sampling profiler. Once a rate is set, every CPU samples the context its
+ * timer interrupt came from at that rate and stores the samples in a ring of
+ * its own; the oldest samples are overwritten once the ring is full.
+ */
+#define PROFILE_MAX_DEPTH	8	/* Call chain entries per sample */
+#define PROFILE_RING_SIZE	512	/* Samples per CPU; must be a power of two */
+#define PROFILE_MAX_HZ		10000
+
+#define PROFILE_FLAG_USER	1	/* Sample was taken in userland */
+
+struct PROFILE_SAMPLE {
+	uint64_t	ps_timestamp;
+	pid_t		ps_pid;
+	uint16_t	ps_flags;
+	uint16_t	ps_depth;		/* Number of ps_pc[] entries used */
+	addr_t		ps_pc[PROFILE_MAX_DEPTH];	/* Interrupted address first, then its callers */
+};
+
+/* Samples every CPU hz times per second; 0 stops sampling */
+errorcode_t profile_set_rate(unsigned int hz);
+unsigned int profile_get_rate();
+
+/*
+ * Formats the samples as text lines '<cpu> <pid> <k|u> <pc> <caller> ...' and
+ * copies at most len bytes of it, starting at offset, to buf; returns the
+ * number of bytes copied. Sampling should be stopped while doing this.
+ */
+size_t profile_read(off_t offset, char* buf, size_t len);
+
+/* Called by the timer code from the timer interrupt of the current CPU */
+void profile_interrupt();
+
+/*
+ * Machine-dependant: stores the call chain of the context the current
+ * interrupt came from in pc, and returns the number of entries stored.
+ */
+unsigned int md_profile_callchain(addr_t* pc, unsigned int max, bool& user);
+
+#endif /* __ANANAS_PROFILE_H__ */
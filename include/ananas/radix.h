@@ -0,0 +1,76 @@
+#ifndef __ANANAS_RADIX_H__
+#define __ANANAS_RADIX_H__
+
+#include <ananas/types.h>
+
+/*
+ * Radix tree mapping integer indices to pointers; lookups take a number of
+ * steps that only depends on the magnitude of the largest index in use. An
+ * all-zero RADIX_TREE is a valid, empty tree.
+ *
+ * The tree does no locking of its own; this is up to the user.
+ */
+#define RADIX_BITS_PER_LEVEL	6
+#define RADIX_SLOTS		(1 << RADIX_BITS_PER_LEVEL)
+
+struct RADIX_NODE {
+	void* rn_slot[RADIX_SLOTS];
+	unsigned int rn_count;		/* Number of slots in use */
+};
+
+struct RADIX_TREE {
+	struct RADIX_NODE* rt_root;
+	unsigned int rt_height;		/* Number of levels, including rt_root */
+};
+
+void radix_init(struct RADIX_TREE* rt);
+void* radix_lookup(struct RADIX_TREE* rt, uint64_t index);
+void radix_insert(struct RADIX_TREE* rt, uint64_t index, void* item);
+void* radix_remove(struct RADIX_TREE* rt, uint64_t index);
+
+/* Frees all nodes of the tree; this does not touch the items themselves */
+void radix_clear(struct RADIX_TREE* rt);
+
+#ifdef __cplusplus
+namespace Ananas {
+
+/*
+ * Typed radix tree; this only spares the user from casting. Note that unlike
+ * HashTable and RBTree, the tree allocates its own nodes on insertion.
+ */
+template<typename T> class RadixTree
+{
+public:
+	void Init()
+	{
+		radix_init(&rt_Tree);
+	}
+
+	T* Lookup(uint64_t index)
+	{
+		return static_cast<T*>(radix_lookup(&rt_Tree, index));
+	}
+
+	void Insert(uint64_t index, T& item)
+	{
+		radix_insert(&rt_Tree, index, &item);
+	}
+
+	T* Remove(uint64_t index)
+	{
+		return static_cast<T*>(radix_remove(&rt_Tree, index));
+	}
+
+	void Clear()
+	{
+		radix_clear(&rt_Tree);
+	}
+
+private:
+	struct RADIX_TREE rt_Tree;
+};
+
+} // namespace Ananas
+#endif
+
+#endif /* __ANANAS_RADIX_H__ */
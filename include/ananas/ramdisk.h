@@ -0,0 +1,23 @@
+#ifndef __ANANAS_RAMDISK_H__
+#define __ANANAS_RAMDISK_H__
+
+#include <ananas/types.h>
+
+namespace Ananas {
+class Device;
+}
+
+/*
+ * Registers an image the loader placed at [phys .. phys + length) in physical
+ * memory; it becomes a ramdisk once devices are attached. This is called
+ * before the memory manager is up, so it can only remember the image.
+ */
+void ramdisk_add_boot_image(addr_t phys, size_t length);
+
+/*
+ * Creates a ramdisk of length bytes, which is initially filled with zeroes;
+ * memory is only allocated once it is written to.
+ */
+errorcode_t ramdisk_create(size_t length, Ananas::Device*& device);
+
+#endif /* __ANANAS_RAMDISK_H__ */
@@ -0,0 +1,390 @@
+#ifndef __ANANAS_RBTREE_H__
+#define __ANANAS_RBTREE_H__
+
+#include <ananas/types.h>
+
+namespace Ananas {
+
+/*
+ * Intrusive red-black tree; items embed an RBTreeLink, so inserting and
+ * removing never allocates and takes O(log n). Traits must provide:
+ *
+ *   static RBTreeLink<T>& GetLink(T& item);
+ *   static int Compare(const T& a, const T& b);	// <0, 0, >0 like strcmp()
+ *   static void Augment(T& item);
+ *
+ * Augment() is called whenever the children of an item change, after they
+ * have been brought up-to-date themselves; it can be used to maintain a
+ * summary of the entire subtree in each item, such as the largest end
+ * address of an interval or the largest gap between items. Trees that don't
+ * need this can inherit RBTreeNoAugment<T>. Queries on such summaries walk
+ * the tree using GetRoot(), GetLeft() and GetRight().
+ *
+ * Items with equal keys are allowed; they are kept in insertion order.
+ *
+ * The tree does no locking of its own; this is up to the user.
+ */
+template<typename T> struct RBTreeLink {
+	T* rb_Parent = nullptr;
+	T* rb_Left = nullptr;
+	T* rb_Right = nullptr;
+	bool rb_Red = false;
+};
+
+template<typename T> struct RBTreeNoAugment {
+	static void Augment(T&) { }
+};
+
+template<typename T, typename Traits> class RBTree
+{
+public:
+	void Init()
+	{
+		rb_Root = nullptr;
+		rb_Count = 0;
+	}
+
+	bool IsEmpty() const
+	{
+		return rb_Root == nullptr;
+	}
+
+	unsigned int GetCount() const
+	{
+		return rb_Count;
+	}
+
+	T* GetRoot() const
+	{
+		return rb_Root;
+	}
+
+	static T* GetLeft(T& item)
+	{
+		return L(item).rb_Left;
+	}
+
+	static T* GetRight(T& item)
+	{
+		return L(item).rb_Right;
+	}
+
+	static T* GetParent(T& item)
+	{
+		return L(item).rb_Parent;
+	}
+
+	void Insert(T& item)
+	{
+		RBTreeLink<T>& il = L(item);
+		il.rb_Left = nullptr;
+		il.rb_Right = nullptr;
+		il.rb_Red = true;
+
+		T* parent = nullptr;
+		T** link = &rb_Root;
+		while (*link != nullptr) {
+			parent = *link;
+			link = Traits::Compare(item, *parent) < 0 ? &L(*parent).rb_Left : &L(*parent).rb_Right;
+		}
+		il.rb_Parent = parent;
+		*link = &item;
+		rb_Count++;
+
+		AugmentPath(&item);
+		InsertFixup(&item);
+	}
+
+	void Remove(T& item)
+	{
+		RBTreeLink<T>& il = L(item);
+		T* x;		/* Child that takes the place of what was removed */
+		T* x_parent;	/* Its parent, as x may be nullptr */
+		bool removed_red;
+
+		if (il.rb_Left == nullptr || il.rb_Right == nullptr) {
+			/* At most one child, which takes our place */
+			x = il.rb_Left != nullptr ? il.rb_Left : il.rb_Right;
+			x_parent = il.rb_Parent;
+			removed_red = il.rb_Red;
+			Transplant(item, x);
+		} else {
+			/* Two children; our successor takes our place */
+			T* y = il.rb_Right;
+			while (L(*y).rb_Left != nullptr)
+				y = L(*y).rb_Left;
+			RBTreeLink<T>& yl = L(*y);
+			removed_red = yl.rb_Red;
+			x = yl.rb_Right;
+			if (yl.rb_Parent == &item) {
+				x_parent = y;
+			} else {
+				x_parent = yl.rb_Parent;
+				Transplant(*y, x);
+				yl.rb_Right = il.rb_Right;
+				L(*yl.rb_Right).rb_Parent = y;
+			}
+			Transplant(item, y);
+			yl.rb_Left = il.rb_Left;
+			L(*yl.rb_Left).rb_Parent = y;
+			yl.rb_Red = il.rb_Red;
+		}
+		il.rb_Parent = nullptr;
+		il.rb_Left = nullptr;
+		il.rb_Right = nullptr;
+		rb_Count--;
+
+		AugmentPath(x_parent);
+		if (!removed_red)
+			RemoveFixup(x, x_parent);
+	}
+
+	/*
+	 * Locates an item using cmp(const T&), which must return <0 if the item
+	 * sought sorts before the given item, >0 if it sorts after it and 0 on a
+	 * match.
+	 */
+	template<typename Func> T* Find(Func cmp) const
+	{
+		T* item = rb_Root;
+		while (item != nullptr) {
+			int c = cmp(*item);
+			if (c == 0)
+				return item;
+			item = c < 0 ? L(*item).rb_Left : L(*item).rb_Right;
+		}
+		return nullptr;
+	}
+
+	/* Like Find(), but returns the first item for which cmp() is <= 0 */
+	template<typename Func> T* FindLowerBound(Func cmp) const
+	{
+		T* result = nullptr;
+		T* item = rb_Root;
+		while (item != nullptr) {
+			if (cmp(*item) <= 0) {
+				result = item;
+				item = L(*item).rb_Left;
+			} else
+				item = L(*item).rb_Right;
+		}
+		return result;
+	}
+
+	T* GetFirst() const
+	{
+		return rb_Root != nullptr ? Leftmost(rb_Root) : nullptr;
+	}
+
+	T* GetLast() const
+	{
+		return rb_Root != nullptr ? Rightmost(rb_Root) : nullptr;
+	}
+
+	static T* GetNext(T& item)
+	{
+		if (L(item).rb_Right != nullptr)
+			return Leftmost(L(item).rb_Right);
+		T* cur = &item;
+		T* parent = L(item).rb_Parent;
+		while (parent != nullptr && L(*parent).rb_Right == cur) {
+			cur = parent;
+			parent = L(*parent).rb_Parent;
+		}
+		return parent;
+	}
+
+	static T* GetPrev(T& item)
+	{
+		if (L(item).rb_Left != nullptr)
+			return Rightmost(L(item).rb_Left);
+		T* cur = &item;
+		T* parent = L(item).rb_Parent;
+		while (parent != nullptr && L(*parent).rb_Left == cur) {
+			cur = parent;
+			parent = L(*parent).rb_Parent;
+		}
+		return parent;
+	}
+
+private:
+	static RBTreeLink<T>& L(T& item)
+	{
+		return Traits::GetLink(item);
+	}
+
+	static bool IsRed(T* item)
+	{
+		return item != nullptr && L(*item).rb_Red;
+	}
+
+	static T* Leftmost(T* item)
+	{
+		while (L(*item).rb_Left != nullptr)
+			item = L(*item).rb_Left;
+		return item;
+	}
+
+	static T* Rightmost(T* item)
+	{
+		while (L(*item).rb_Right != nullptr)
+			item = L(*item).rb_Right;
+		return item;
+	}
+
+	/* Recomputes the augmented data of item and everything above it */
+	static void AugmentPath(T* item)
+	{
+		for (/* nothing */; item != nullptr; item = L(*item).rb_Parent)
+			Traits::Augment(*item);
+	}
+
+	/* Puts 'replacement' (which may be nullptr) where 'item' was */
+	void Transplant(T& item, T* replacement)
+	{
+		T* parent = L(item).rb_Parent;
+		if (parent == nullptr)
+			rb_Root = replacement;
+		else if (L(*parent).rb_Left == &item)
+			L(*parent).rb_Left = replacement;
+		else
+			L(*parent).rb_Right = replacement;
+		if (replacement != nullptr)
+			L(*replacement).rb_Parent = parent;
+	}
+
+	void RotateLeft(T& x)
+	{
+		T* y = L(x).rb_Right;
+		L(x).rb_Right = L(*y).rb_Left;
+		if (L(*y).rb_Left != nullptr)
+			L(*L(*y).rb_Left).rb_Parent = &x;
+		Transplant(x, y);
+		L(*y).rb_Left = &x;
+		L(x).rb_Parent = y;
+		Traits::Augment(x);
+		Traits::Augment(*y);
+	}
+
+	void RotateRight(T& x)
+	{
+		T* y = L(x).rb_Left;
+		L(x).rb_Left = L(*y).rb_Right;
+		if (L(*y).rb_Right != nullptr)
+			L(*L(*y).rb_Right).rb_Parent = &x;
+		Transplant(x, y);
+		L(*y).rb_Right = &x;
+		L(x).rb_Parent = y;
+		Traits::Augment(x);
+		Traits::Augment(*y);
+	}
+
+	void InsertFixup(T* z)
+	{
+		while (IsRed(L(*z).rb_Parent)) {
+			T* p = L(*z).rb_Parent;
+			T* g = L(*p).rb_Parent; /* exists, as the root is black */
+			if (p == L(*g).rb_Left) {
+				T* u = L(*g).rb_Right;
+				if (IsRed(u)) {
+					L(*p).rb_Red = false;
+					L(*u).rb_Red = false;
+					L(*g).rb_Red = true;
+					z = g;
+					continue;
+				}
+				if (z == L(*p).rb_Right) {
+					z = p;
+					RotateLeft(*z);
+					p = L(*z).rb_Parent;
+				}
+				L(*p).rb_Red = false;
+				L(*g).rb_Red = true;
+				RotateRight(*g);
+			} else {
+				T* u = L(*g).rb_Left;
+				if (IsRed(u)) {
+					L(*p).rb_Red = false;
+					L(*u).rb_Red = false;
+					L(*g).rb_Red = true;
+					z = g;
+					continue;
+				}
+				if (z == L(*p).rb_Left) {
+					z = p;
+					RotateRight(*z);
+					p = L(*z).rb_Parent;
+				}
+				L(*p).rb_Red = false;
+				L(*g).rb_Red = true;
+				RotateLeft(*g);
+			}
+		}
+		L(*rb_Root).rb_Red = false;
+	}
+
+	void RemoveFixup(T* x, T* x_parent)
+	{
+		while (x != rb_Root && !IsRed(x)) {
+			if (x == L(*x_parent).rb_Left) {
+				T* w = L(*x_parent).rb_Right;
+				if (IsRed(w)) {
+					L(*w).rb_Red = false;
+					L(*x_parent).rb_Red = true;
+					RotateLeft(*x_parent);
+					w = L(*x_parent).rb_Right;
+				}
+				if (!IsRed(L(*w).rb_Left) && !IsRed(L(*w).rb_Right)) {
+					L(*w).rb_Red = true;
+					x = x_parent;
+					x_parent = L(*x).rb_Parent;
+					continue;
+				}
+				if (!IsRed(L(*w).rb_Right)) {
+					L(*L(*w).rb_Left).rb_Red = false;
+					L(*w).rb_Red = true;
+					RotateRight(*w);
+					w = L(*x_parent).rb_Right;
+				}
+				L(*w).rb_Red = L(*x_parent).rb_Red;
+				L(*x_parent).rb_Red = false;
+				L(*L(*w).rb_Right).rb_Red = false;
+				RotateLeft(*x_parent);
+			} else {
+				T* w = L(*x_parent).rb_Left;
+				if (IsRed(w)) {
+					L(*w).rb_Red = false;
+					L(*x_parent).rb_Red = true;
+					RotateRight(*x_parent);
+					w = L(*x_parent).rb_Left;
+				}
+				if (!IsRed(L(*w).rb_Left) && !IsRed(L(*w).rb_Right)) {
+					L(*w).rb_Red = true;
+					x = x_parent;
+					x_parent = L(*x).rb_Parent;
+					continue;
+				}
+				if (!IsRed(L(*w).rb_Left)) {
+					L(*L(*w).rb_Right).rb_Red = false;
+					L(*w).rb_Red = true;
+					RotateLeft(*w);
+					w = L(*x_parent).rb_Left;
+				}
+				L(*w).rb_Red = L(*x_parent).rb_Red;
+				L(*x_parent).rb_Red = false;
+				L(*L(*w).rb_Left).rb_Red = false;
+				RotateRight(*x_parent);
+			}
+			x = rb_Root;
+		}
+		if (x != nullptr)
+			L(*x).rb_Red = false;
+	}
+
+	T* rb_Root = nullptr;
+	unsigned int rb_Count = 0;
+};
+
+} // namespace Ananas
+
+#endif /* __ANANAS_RBTREE_H__ */
@@ -25,6 +25,7 @@ struct Resource {
 		RT_PNP_ID,
 		/* USB-specific */
 		RT_USB_Device,
+		RT_USB_Interface,	/* class << 16 | subclass << 8 | protocol */
 	};
 	typedef uintptr_t Base;
 	typedef size_t Length;
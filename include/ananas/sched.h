@@ -0,0 +1,33 @@
+#ifndef __ANANAS_SCHED_H__
+#define __ANANAS_SCHED_H__
+
+#include <machine/_types.h>
+
+/*
+ * Scheduling policies; SCHED_FIFO and SCHED_RR threads always run before
+ * time-sharing (SCHED_OTHER) threads. A SCHED_FIFO thread runs until it
+ * blocks or something more important comes along, whereas SCHED_RR threads
+ * of the same priority take turns. Together, they may use at most 95% of
+ * every CPU so that a runaway thread can't lock up the system.
+ *
+ * Real-time priorities range from SCHED_RT_PRIORITY_MIN to
+ * SCHED_RT_PRIORITY_MAX; higher is more important.
+ */
+#define SCHED_OTHER	0
+#define SCHED_FIFO	1
+#define SCHED_RR	2
+
+#define SCHED_RT_PRIORITY_MIN	1
+#define SCHED_RT_PRIORITY_MAX	99
+
+/*
+ * Time-sharing threads can be made more or less important than others by
+ * their nice value; lower is more important.
+ */
+#define SCHED_NICE_MIN	-20
+#define SCHED_NICE_MAX	19
+
+/* Set of CPUs a thread may run on; bit n stands for CPU n */
+typedef __uint64_t cpumask_t;
+
+#endif /* __ANANAS_SCHED_H__ */
@@ -2,25 +2,98 @@
 #define __SCHEDULE_H__
 
 #include <ananas/types.h>
+#include <ananas/cdefs.h>
 #include <ananas/list.h>
+#include <ananas/sched.h>
 
 struct SCHED_PRIV {
 	thread_t* sp_thread;	/* Backreference to the thread */
+	int sp_cpu;		/* CPU whose runqueue holds the thread, or -1 */
+	int sp_lastcpu;		/* CPU the thread last ran on, or -1 */
+	int sp_priority;	/* Priority level the thread is queued at */
+
+	/* Accounting; times are in nanoseconds, as derived from the TSC */
+	uint64_t sp_run_ns;		/* Time spent running */
+	uint64_t sp_wait_ns;		/* Time spent runnable, waiting for a CPU */
+	uint64_t sp_last_switch;	/* When it was switched in or became runnable */
+	uint64_t sp_slice_ns;		/* SCHED_RR: time used of the current quantum */
+	unsigned int sp_voluntary;	/* Switched away because it blocked */
+	unsigned int sp_involuntary;	/* Switched away while still runnable */
+
 	LIST_FIELDS(struct SCHED_PRIV);
 };
 
+/*
+ * Scheduling latency histogram buckets; bucket n counts threads which waited
+ * less than 2^n microseconds for a CPU, the final one takes all others.
+ */
+#define SCHED_LATENCY_BUCKETS	20
+
 LIST_DEFINE(SCHEDULER_QUEUE, struct SCHED_PRIV);
 
+/* Number of priority levels; THREAD_PRIORITY_IDLE is the final one */
+#define SCHED_NUM_PRIORITIES	256
+#define SCHED_PRIOMAP_WORDS	(SCHED_NUM_PRIORITIES / 64)
+
+/*
+ * Runqueue; this contains a FIFO queue per priority level along with a bitmap
+ * of the non-empty levels, so that any operation is O(1).
+ */
+struct SCHED_RUNQUEUE {
+	uint64_t rq_priomap[SCHED_PRIOMAP_WORDS];	/* Bit set if level is non-empty */
+	struct SCHEDULER_QUEUE rq_level[SCHED_NUM_PRIORITIES];
+};
+
+struct PCPU;
+
 void scheduler_add(thread_t* t);
 void scheduler_remove(thread_t* t);
 
-void schedule();
+void schedule() __hot;
 #define reschedule schedule
 void scheduler_activate();
 void scheduler_deactivate();
 int scheduler_activated();
 void scheduler_launch();
 
+/* Called by the idle thread; sleeps until there may be something to run */
+void scheduler_idle();
+
+/* Initializes the scheduler-specific part of a per-cpu structure */
+void scheduler_init_pcpu(struct PCPU* pcpu);
+
+/*
+ * Describes where a CPU lies in the topology; CPUs with the same core are
+ * hardware threads sharing one physical core, and CPUs with the same llc
+ * share their last-level cache. By default, every CPU is a core of its own
+ * and all share a cache.
+ */
+void scheduler_set_topology(struct PCPU* pcpu, unsigned int core, unsigned int llc);
+
+/*
+ * Changes the priority of a thread which may already be running or runnable,
+ * requeueing it as needed.
+ */
+void scheduler_set_priority(thread_t* t, int prio);
+
+/*
+ * Changes the scheduling policy of a thread; rt_priority is the real-time
+ * priority for SCHED_FIFO and SCHED_RR, and must be 0 for SCHED_OTHER.
+ */
+errorcode_t scheduler_set_policy(thread_t* t, int policy, int rt_priority);
+
+/* Changes the nice value of a thread, which only matters for SCHED_OTHER */
+errorcode_t scheduler_set_nice(thread_t* t, int nice);
+
+/*
+ * Restricts a thread to the CPUs in a mask, moving it if it is runnable
+ * elsewhere; the mask must contain at least one existing CPU.
+ */
+errorcode_t scheduler_set_affinity(thread_t* t, cpumask_t affinity);
+
+/* Retrieves the scheduling policy of a thread, see scheduler_set_policy() */
+void scheduler_get_policy(thread_t* t, int* policy, int* rt_priority);
+
 /* Initializes the scheduler-specific part for a given thread */
 void scheduler_init_thread(thread_t* t);
 
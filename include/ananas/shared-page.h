@@ -0,0 +1,33 @@
+#ifndef __ANANAS_SHARED_PAGE_H__
+#define __ANANAS_SHARED_PAGE_H__
+
+#include <ananas/types.h>
+#include <machine/param.h>
+#include <machine/shared-page.h>
+
+/*
+ * The kernel maps a single page read-only into every vmspace at
+ * SHARED_PAGE_ADDR; it holds what userland needs to tell the time without a
+ * system call. The time fields are protected by a sequence lock: sp_time_seq
+ * is odd while they are being updated, so readers must retry if it is odd or
+ * changed while they were reading.
+ */
+struct SHARED_PAGE {
+	volatile uint32_t	sp_time_seq;
+	uint32_t		sp_tsc_mhz;	/* TSC ticks per microsecond, 0 if unknown */
+	uint64_t		sp_tsc_boot;	/* TSC value at boot */
+	uint64_t		sp_boot_time;	/* Seconds since the epoch at boot, 0 if unknown */
+	struct MD_SHARED_PAGE	sp_md;		/* Machine-dependant clock information */
+};
+
+#ifdef KERNEL
+/* Physical address of the shared page, or 0 if there is none yet */
+addr_t shared_page_get_phys();
+
+void shared_page_set_time(uint32_t tsc_mhz, uint64_t tsc_boot, uint64_t boot_time);
+
+/* Machine-dependant code fills the page for us */
+void md_shared_page_init(struct SHARED_PAGE& sp);
+#endif
+
+#endif /* __ANANAS_SHARED_PAGE_H__ */
@@ -0,0 +1,35 @@
+#ifndef __ANANAS_SHM_H__
+#define __ANANAS_SHM_H__
+
+#include <ananas/types.h>
+#include <ananas/lock.h>
+#include <ananas/radix.h>
+#include <ananas/vmpage.h>
+
+/*
+ * Shared memory objects are anonymous memory which is referenced by handles
+ * (HANDLE_TYPE_SHM) rather than by a vmspace; every mapping of the object links
+ * to the same pages, much like shared file mappings link to the page cache.
+ * The object lives as long as there are handles or mappings referring to it.
+ */
+struct SHM {
+	mutex_t			shm_mtx;		/* protects the pages */
+	refcount_t		shm_refcount;		/* handles and areas using us */
+	size_t			shm_size;		/* in bytes, a multiple of PAGE_SIZE */
+	struct VM_PAGE_LIST	shm_pages;		/* pages in use */
+	struct RADIX_TREE	shm_page_index;		/* shm_pages, by page number */
+};
+
+/* Creates a new shared memory object of size bytes and a handle to it */
+errorcode_t shm_alloc(process_t* p, size_t size, handleindex_t* out);
+
+void shm_ref(struct SHM* shm);
+void shm_deref(struct SHM* shm);
+
+/*
+ * Returns a link to the page at offset, which must be within the object; the
+ * page is cleared as it is used for the first time.
+ */
+struct VM_PAGE* shm_link_page(struct SHM* shm, off_t offset);
+
+#endif /* __ANANAS_SHM_H__ */
@@ -0,0 +1,73 @@
+#ifndef __ANANAS_SLAB_H__
+#define __ANANAS_SLAB_H__
+
+#include <ananas/types.h>
+#include <ananas/list.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+
+/*
+ * Object caches for fixed-size kernel structures. Objects are carved from
+ * whole pages and kept on per-CPU free lists, so that the common alloc/free
+ * path takes no lock at all; only moving batches of objects between a CPU
+ * and the cache-wide free list requires the cache lock.
+ *
+ * If a constructor is given, it is called once when an object is created;
+ * objects must be handed back to slab_free() in constructed state.
+ *
+ * Slabs whose objects are all on the cache-wide free list are handed back to
+ * the page allocator once it runs short of memory.
+ */
+typedef void (*slab_ctor_t)(void* obj);
+
+struct SLAB {
+	struct PAGE* sl_page;
+	int sl_order;
+	unsigned int sl_num_objects;
+	unsigned int sl_free;		/* Objects on the cache-wide free list */
+	int sl_dying;			/* Being taken apart by the reclaimer */
+	struct SLAB* sl_next;		/* Reclaimer use only */
+};
+
+struct SLAB_OBJECT {
+	struct SLAB_OBJECT* so_next;
+	struct SLAB* so_slab;
+};
+
+struct SLAB_CPU {
+	struct SLAB_OBJECT* sc_free;
+	unsigned int sc_count;
+};
+
+struct SLAB_CACHE {
+	const char* sc_name;
+	size_t sc_size;			/* Object size, in bytes */
+	slab_ctor_t sc_ctor;
+
+	spinlock_t sc_lock;		/* Protects everything below */
+	struct SLAB_OBJECT* sc_free;	/* Cache-wide free objects */
+	unsigned int sc_free_count;
+	unsigned int sc_num_objects;	/* Total number of objects created */
+	unsigned int sc_num_pages;	/* Number of pages in use */
+	int sc_registered;
+
+	struct SLAB_CPU sc_cpu[PCPU_MAX_CPUS];
+	LIST_FIELDS(struct SLAB_CACHE);
+};
+
+LIST_DEFINE(slab_cache_list, struct SLAB_CACHE);
+
+/*
+ * Defines an object cache 'name' for objects of type 'type'; no further
+ * initialization is needed, the cache sets itself up on first use.
+ */
+#define SLAB_CACHE_DEFINE(name, type, ctor) \
+	struct SLAB_CACHE name = { #name, sizeof(type), ctor, SPINLOCK_DEFAULT_INIT }
+
+void* slab_alloc(struct SLAB_CACHE* sc);
+void slab_free(struct SLAB_CACHE* sc, void* obj);
+
+/* Describes every cache in use, one line per cache */
+void slab_get_status(char* buf, size_t len);
+
+#endif /* __ANANAS_SLAB_H__ */
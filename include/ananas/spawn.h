@@ -0,0 +1,35 @@
+#ifndef ANANAS_SPAWN_H
+#define ANANAS_SPAWN_H
+
+/*
+ * spawn() creates a child process which directly executes a new program; this
+ * avoids cloning the vmspace as fork() followed by execve() would do. The
+ * child inherits all handles of the caller, after which the file actions are
+ * applied to the child's handles in order.
+ */
+#define SPAWN_ACTION_CLOSE	1	/* Close sa_handle */
+#define SPAWN_ACTION_DUP2	2	/* Duplicate sa_handle to sa_newhandle */
+#define SPAWN_ACTION_OPEN	3	/* Open sa_path as sa_newhandle */
+
+/* Maximum number of file actions per spawn() */
+#define SPAWN_MAX_ACTIONS	64
+
+struct SPAWN_ACTION {
+	int		sa_op;		/* SPAWN_ACTION_... */
+	handleindex_t	sa_handle;
+	handleindex_t	sa_newhandle;
+	const char*	sa_path;	/* SPAWN_ACTION_OPEN only */
+	int		sa_flags;	/* SPAWN_ACTION_OPEN only */
+	int		sa_mode;	/* SPAWN_ACTION_OPEN only */
+};
+
+struct SPAWN_OPTIONS {
+	size_t		so_size;	/* must be sizeof(SPAWN_OPTIONS) */
+	const char*	so_path;	/* Executable to load */
+	const char**	so_argv;	/* NULL-terminated, may be NULL */
+	const char**	so_envp;	/* NULL-terminated, may be NULL */
+	int		so_num_actions;
+	const struct SPAWN_ACTION* so_actions;
+};
+
+#endif /* ANANAS_SPAWN_H */
@@ -0,0 +1,40 @@
+#ifndef __ANANAS_SWAP_H__
+#define __ANANAS_SWAP_H__
+
+#include <ananas/types.h>
+
+struct VM_PAGE;
+
+/*
+ * Anonymous memory can be swapped out to a block device, which is given by
+ * 'swap=device:size' on the commandline (size in KB), and/or compressed in
+ * memory. Private pages mapped by a single vmspace are kept on an active and
+ * an inactive LRU list; the page daemon ages them using the accessed bits of
+ * their mappings and writes the ones least recently used to swap. They are
+ * read back as they are needed.
+ */
+
+/* Enables swap as given on the commandline, if at all */
+void swap_init();
+
+/* Reads the contents of swapped out page vp back; vp must be locked */
+void swap_in(struct VM_PAGE* vp);
+
+/* Releases the swap slot of vp, whose contents are no longer needed */
+void swap_release(struct VM_PAGE* vp);
+
+/*
+ * Compressed swap cache (OPTION_ZSWAP); pages are tried here before they go
+ * to the swap device, so that most of them need not hit the disk.
+ */
+struct ZSWAP_ENTRY;
+
+/* Sets up the cache, unless disabled with 'zswap_max=0'; returns whether it is in use */
+bool zswap_init();
+/* Stores a compressed copy of the page at data; returns nullptr if it does not compress well or the cache is full */
+struct ZSWAP_ENTRY* zswap_store(const void* data);
+/* Decompresses ze to the page at data, and frees ze */
+void zswap_load(struct ZSWAP_ENTRY* ze, void* data);
+void zswap_free(struct ZSWAP_ENTRY* ze);
+
+#endif /* __ANANAS_SWAP_H__ */
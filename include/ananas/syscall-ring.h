@@ -0,0 +1,74 @@
+#ifndef __ANANAS_SYSCALL_RING_H__
+#define __ANANAS_SYSCALL_RING_H__
+
+#include <ananas/types.h>
+
+struct stat;
+
+/*
+ * A process can set up a single submission/completion ring using OP_RING_SETUP,
+ * which maps a RING_HEADER followed by rh_entries submission and completion
+ * entries. The process fills submission entries, advances rh_sq_tail and uses
+ * OP_RING_SUBMIT to wake the kernel worker, which performs them in order on
+ * behalf of the process and posts a completion for each one. Completions are
+ * consumed by advancing rh_cq_head; OP_RING_WAIT sleeps until at least vo_len
+ * of them are pending.
+ *
+ * Indices run freely and are taken modulo rh_entries, which is a power of two.
+ * The worker stops consuming submissions while the completion ring is full.
+ */
+typedef enum {
+	RING_OP_NOP,
+	RING_OP_READ,		/* sqe_handle, sqe_buf, sqe_len */
+	RING_OP_WRITE,		/* sqe_handle, sqe_buf, sqe_len */
+	RING_OP_OPEN,		/* sqe_path, sqe_flags, sqe_mode */
+	RING_OP_STAT,		/* sqe_path, sqe_stat */
+	RING_OP_CLOSE,		/* sqe_handle */
+} RING_OPERATION;
+
+struct RING_SQE {
+	RING_OPERATION	sqe_op;
+	handleindex_t	sqe_handle;
+	void*		sqe_buf;
+	size_t		sqe_len;
+	const char*	sqe_path;
+	struct stat*	sqe_stat;
+	int		sqe_flags;
+	int		sqe_mode;
+	uint64_t	sqe_user;	/* Copied to the completion as-is */
+};
+
+struct RING_CQE {
+	uint64_t	cqe_user;
+	errorcode_t	cqe_result;
+	handleindex_t	cqe_handle;	/* RING_OP_OPEN: new handle */
+	size_t		cqe_len;	/* RING_OP_READ, RING_OP_WRITE: length transferred */
+};
+
+struct RING_HEADER {
+	uint32_t		rh_entries;
+	uint32_t		rh_sq_offset;	/* Offset of the RING_SQE array */
+	uint32_t		rh_cq_offset;	/* Offset of the RING_CQE array */
+	volatile uint32_t	rh_sq_head;	/* Updated by the kernel */
+	volatile uint32_t	rh_sq_tail;	/* Updated by the process */
+	volatile uint32_t	rh_cq_head;	/* Updated by the process */
+	volatile uint32_t	rh_cq_tail;	/* Updated by the kernel */
+};
+
+#define RING_MAX_ENTRIES	4096
+
+#ifdef KERNEL
+struct VMOP_OPTIONS;
+
+errorcode_t syscall_ring_setup(thread_t* t, struct VMOP_OPTIONS* vo);
+errorcode_t syscall_ring_submit(thread_t* t);
+errorcode_t syscall_ring_wait(thread_t* t, unsigned int min_complete);
+
+/*
+ * Stops the process' ring, if any; if wait is set, this waits until the
+ * worker is done and removes the ring's mapping.
+ */
+void syscall_ring_stop(process_t* p, bool wait);
+#endif
+
+#endif /* __ANANAS_SYSCALL_RING_H__ */
@@ -7,6 +7,33 @@ typedef enum {
 
 	/* Removes a mapping - only va_addr/va_len are used */
 	OP_UNMAP,
+
+	/* Writes shared file mappings back - only va_addr/va_len are used */
+	OP_SYNC,
+
+	/*
+	 * Sets up the syscall ring with va_len entries and maps it; va_addr/va_len
+	 * are updated to describe the mapping (see <ananas/syscall-ring.h>)
+	 */
+	OP_RING_SETUP,
+
+	/* Wakes the ring worker to process new submissions */
+	OP_RING_SUBMIT,
+
+	/* Waits until at least va_len completions are pending */
+	OP_RING_WAIT,
+
+	/*
+	 * Releases the pages backing va_addr/va_len but keeps the mapping; the
+	 * next access yields zeroes, or the file contents for file mappings
+	 */
+	OP_DISCARD,
+
+	/*
+	 * Tells how va_addr/va_len will be used; vo_flags is one of the
+	 * VMOP_ADVICE_... values below
+	 */
+	OP_ADVISE,
 } VMOP_OPERATION;
 
 /* Permissions, can be combined */
@@ -21,6 +48,17 @@ typedef enum {
 /* If set, vo_handle / vo_offset will back the mapping */
 #define VMOP_FLAG_HANDLE	0x0020
 
+/* If set, the mapping is placed at vo_addr, which must not be in use yet */
+#define VMOP_FLAG_FIXED		0x0040
+
+/* OP_ADVISE only */
+#define VMOP_ADVICE_NORMAL	0	/* No particular order */
+#define VMOP_ADVICE_RANDOM	1	/* Random access; don't map or read surrounding pages */
+#define VMOP_ADVICE_SEQUENTIAL	2	/* Sequential access; read ahead aggressively */
+#define VMOP_ADVICE_WILLNEED	3	/* Will be accessed soon; start reading it in */
+#define VMOP_ADVICE_DONTNEED	4	/* Release the pages; as OP_DISCARD */
+#define VMOP_ADVICE_FREE	5	/* Contents no longer needed; as OP_DISCARD */
+
 struct VMOP_OPTIONS {
 	size_t		vo_size;	/* must be sizeof(VMOP_OPTIONS) */
 	VMOP_OPERATION	vo_op;
@@ -4,24 +4,31 @@
 #ifndef __SYSCALL_H__
 #define __SYSCALL_H__
 
-struct SYSCALL_ARGS {
-	register_t	number;
-	register_t	arg1, arg2, arg3, arg4, arg5;
-};
-
 struct HANDLE;
 struct VFS_FILE;
+struct iovec;
 
-register_t syscall(struct SYSCALL_ARGS* args);
+/*
+ * Entry points called by the machine-dependant syscall handler, with the raw
+ * argument registers; syscall_table[] is generated from syscalls.in and
+ * indexed by syscall number, which must be below SYSCALL_COUNT.
+ */
+typedef register_t (*syscall_func_t)(thread_t* curthread, register_t a1, register_t a2, register_t a3, register_t a4, register_t a5);
+extern "C" const syscall_func_t syscall_table[];
+/* Whether the call needs the complete userland register set saved upon entry */
+extern "C" const bool syscall_full_frame[];
+/* Name of every syscall, by number */
+extern const char* const syscall_name[];
+extern "C" register_t syscall_unsupported(thread_t* curthread, register_t a1, register_t a2, register_t a3, register_t a4, register_t a5) __cold;
 
 errorcode_t syscall_get_handle(thread_t* t, handleindex_t handle, struct HANDLE** out);
-errorcode_t syscall_get_file(thread_t* t, handleindex_t handle, struct VFS_FILE** out);
 errorcode_t syscall_map_string(thread_t* t, const void* ptr, const char** out);
 errorcode_t syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** out);
 errorcode_t syscall_fetch_size(thread_t* t, const void* ptr, size_t* out);
 errorcode_t syscall_set_size(thread_t* t, void* ptr, size_t len);
 errorcode_t syscall_set_handleindex(thread_t* t, handleindex_t* ptr, handleindex_t index);
 errorcode_t syscall_fetch_offset(thread_t* t, const void* ptr, off_t* out);
+errorcode_t syscall_map_iovec(thread_t* t, const struct iovec* iov, int iovcnt, int flags, struct iovec* out, size_t* total);
 errorcode_t syscall_set_offset(thread_t* t, void* ptr, off_t len);
 
 #endif /* __SYSCALL_H__ */
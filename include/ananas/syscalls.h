@@ -1,7 +1,12 @@
 #include <ananas/types.h>
 #include <ananas/syscall-vmops.h>
 #include <ananas/stat.h>
+#include <ananas/sched.h>
 
 struct utimbuf;
+struct iovec;
+struct HANDLE_EVENT;
+struct SPAWN_OPTIONS;
+struct PERFCTR_COUNTS;
 
 #include <_gen/syscalls.h>
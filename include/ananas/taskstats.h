@@ -0,0 +1,40 @@
+#ifndef __ANANAS_TASKSTATS_H__
+#define __ANANAS_TASKSTATS_H__
+
+#include <ananas/types.h>
+
+struct PROCESS;
+
+/*
+ * Fault and syscall statistics; every thread keeps its own, and they are
+ * added to those of its process as well so that nothing is lost once a
+ * thread is gone. Statistics of processes which are gone are added to a
+ * system-wide total.
+ */
+#define TASKSTATS_MAX_SYSCALLS	64	/* Must be at least SYSCALL_COUNT */
+
+#define TASKSTATS_FAULT_MINOR	0	/* Page was present or needed no I/O */
+#define TASKSTATS_FAULT_MAJOR	1	/* Page had to be read */
+#define TASKSTATS_FAULT_COW	2	/* Copy-on-write page was copied */
+#define TASKSTATS_NUM_FAULTS	3
+
+struct TASK_STATS {
+	uint64_t	ts_faults[TASKSTATS_NUM_FAULTS];
+	uint64_t	ts_syscalls[TASKSTATS_MAX_SYSCALLS];	/* Number of calls, by syscall number */
+	uint64_t	ts_syscall_ns[TASKSTATS_MAX_SYSCALLS];	/* Time spent, by syscall number */
+};
+
+/* Accounts a fault of the given type to the current thread */
+void taskstats_fault(int type);
+
+/* Accounts a syscall to thread t; its time is added once it completes */
+void taskstats_syscall_enter(thread_t* t, unsigned int nr);
+void taskstats_syscall_leave(thread_t* t, unsigned int nr, uint64_t ns);
+
+/* Adds the statistics of a process which is going away to the system-wide total */
+void taskstats_process_exit(struct PROCESS* p);
+
+/* Formats the statistics as 'key value' lines; syscalls which were never made are skipped */
+void taskstats_format(const struct TASK_STATS* ts, char* buf, size_t len);
+
+#endif /* __ANANAS_TASKSTATS_H__ */
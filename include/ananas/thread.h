@@ -1,11 +1,15 @@
 #include <ananas/types.h>
+#include <ananas/cdefs.h>
 #include <ananas/list.h>
 #include <ananas/vfs.h>
 #include <ananas/limits.h>
 #include <ananas/handle.h>
 #include <ananas/init.h>
 #include <ananas/page.h>
+#include <ananas/perfctr.h>
+#include <ananas/sched.h>
 #include <ananas/schedule.h>
+#include <ananas/taskstats.h>
 #include <machine/thread.h>
 
 #ifndef __THREAD_H__
@@ -43,7 +47,7 @@ struct THREAD {
 #define THREAD_FLAG_ZOMBIE	0x0004	/* Thread has no more resources */
 #define THREAD_FLAG_RESCHEDULE	0x0008	/* Thread desires a reschedule */
 #define THREAD_FLAG_REAPING	0x0010	/* Thread will be reaped (destroyed by idle thread) */
-#define THREAD_FLAG_MALLOC	0x0020	/* Thread is kmalloc()'ed */
+#define THREAD_FLAG_MALLOC	0x0020	/* Thread is dynamically allocated */
 #define THREAD_FLAG_KTHREAD	0x8000	/* Kernel thread */
 
 	struct STACKFRAME* t_frame;
@@ -57,10 +61,22 @@ struct THREAD {
 	struct PROCESS*		t_process;	/* associated process */
 
 	int t_priority;			/* priority (0 highest) */
+#define THREAD_PRIORITY_INTERRUPT	10	/* ithreads; preempts anything but the kernel's own */
+#define THREAD_PRIORITY_RT_FIRST	20	/* SCHED_RT_PRIORITY_MAX */
+#define THREAD_PRIORITY_RT_LAST	(THREAD_PRIORITY_RT_FIRST + SCHED_RT_PRIORITY_MAX - SCHED_RT_PRIORITY_MIN)
 #define THREAD_PRIORITY_DEFAULT	200
 #define THREAD_PRIORITY_IDLE	255
-	int t_affinity;			/* thread CPU */
-#define THREAD_AFFINITY_ANY -1
+	cpumask_t t_affinity;		/* CPUs the thread may run on */
+#define THREAD_AFFINITY_ANY	(~(cpumask_t)0)
+#define THREAD_AFFINITY_CPU(cpu)	((cpumask_t)1 << (cpu))
+	int t_sched_policy;		/* SCHED_... */
+	int t_nice;			/* SCHED_OTHER: offset from THREAD_PRIORITY_DEFAULT */
+
+	/* Priority inheritance; protected by spl_pi in lock.cpp */
+	int t_base_priority;		/* t_priority without anything lent to us */
+	int t_pi_boosted;		/* Non-zero if t_priority was lent to us */
+	struct MUTEX* t_pi_blocked_on;	/* Mutex we are sleeping for */
+	struct MUTEX* t_pi_mutexes;	/* Contended mutexes we hold */
 
 	/* Thread handles */
 	handleindex_t	t_hidx_thread;	/* Handle identifying this thread */
@@ -70,6 +86,17 @@ struct THREAD {
 
 	/* Scheduler specific information */
 	struct SCHED_PRIV t_sched_priv;
+	int t_preempt_count;		/* preempt_count while switched out */
+
+	/* Area of the most recent page fault; only valid if vs_generation matches */
+	struct VM_AREA*	t_fault_area;
+	unsigned int	t_fault_area_gen;
+
+	/* Fault and syscall statistics */
+	struct TASK_STATS t_stats;
+
+	/* Hardware performance counts, see kern/perfctr.cpp */
+	struct PERFCTR_COUNTS t_perfctr;
 
 	LIST_FIELDS(thread_t);
 };
@@ -80,29 +107,36 @@ struct THREAD {
 #define THREAD_IS_ZOMBIE(t) ((t)->t_flags & THREAD_FLAG_ZOMBIE)
 #define THREAD_WANT_RESCHEDULE(t) ((t)->t_flags & THREAD_FLAG_RESCHEDULE)
 #define THREAD_IS_KTHREAD(t) ((t)->t_flags & THREAD_FLAG_KTHREAD)
+#define THREAD_MAY_RUN_ON(t, cpu) (((t)->t_affinity & THREAD_AFFINITY_CPU(cpu)) != 0)
 
 /* Machine-dependant callback to initialize a thread */
 errorcode_t md_thread_init(thread_t* thread, int flags);
 errorcode_t md_kthread_init(thread_t* thread, kthread_func_t func, void* arg);
+/* Makes a kernel thread that has not yet run use the pagetables of vs */
+void md_kthread_set_vmspace(thread_t* thread, struct VM_SPACE* vs);
 
 /* Machine-dependant callback to free thread data */
 void md_thread_free(thread_t* thread);
 
 errorcode_t kthread_init(thread_t* t, const char* name, kthread_func_t func, void* arg);
+/* Allocates a kernel thread which runs in (and holds a reference to) process p */
+errorcode_t kthread_alloc(process_t* p, thread_t** dest, const char* name, kthread_func_t func, void* arg);
 
 #define THREAD_ALLOC_DEFAULT	0	/* Nothing special */
 #define THREAD_ALLOC_CLONE	1	/* Thread is created for cloning */
+#define THREAD_ALLOC_USER_STACK	2	/* Caller provides the userland stack */
 
 errorcode_t thread_alloc(process_t* p, thread_t** dest, const char* name, int flags);
 void thread_ref(thread_t* t);
 void thread_deref(thread_t* t);
 void thread_set_name(thread_t* t, const char* name);
 
-thread_t* md_thread_switch(thread_t* new_thread, thread_t* old_thread);
+thread_t* md_thread_switch(thread_t* new_thread, thread_t* old_thread) __hot;
 void idle_thread(void*);
 
 void md_thread_set_entrypoint(thread_t* thread, addr_t entry);
 void md_thread_set_argument(thread_t* thread, addr_t arg);
+void md_thread_set_stack(thread_t* thread, addr_t sp);
 void* md_thread_map(thread_t* thread, void* to, void* from, size_t length, int flags);
 errorcode_t thread_unmap(thread_t* t, addr_t virt, size_t len);
 void* md_map_thread_memory(thread_t* thread, void* ptr, size_t length, int write);
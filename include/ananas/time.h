@@ -2,5 +2,6 @@
 #define __ANANAS_TIME_H__
 
 void delay(int ms);
+void delay_us(unsigned int us);
 
 #endif /* __ANANAS_TIME_H__ */
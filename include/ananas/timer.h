@@ -1,7 +1,66 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#include <ananas/types.h>
+#include <ananas/list.h>
+
+/*
+ * High-resolution timers. All times are in nanoseconds since boot, as
+ * returned by timer_get_ns(). Each CPU keeps its own timer wheel; a timer is
+ * queued on the CPU which starts it, and its function is called from the timer
+ * interrupt of that CPU - so it must neither sleep nor take locks which are
+ * held with interrupts enabled.
+ */
+typedef void (*timer_func_t)(void* context);
+
+struct TIMER {
+	uint64_t		tm_expires;	/* Absolute expiry time */
+	timer_func_t		tm_func;
+	void*			tm_context;
+	int			tm_cpu;		/* (internal use only) wheel we are on, or -1 */
+	int			tm_slot;	/* (internal use only) level/slot we are in */
+	LIST_FIELDS(struct TIMER);
+};
+LIST_DEFINE(TIMER_LIST, struct TIMER);
+
+/* Timer ticks per second; the scheduler timeslice is a single tick */
+#define HZ			100
+#define TIMER_TICK_NS		(1000000000 / HZ)
+
+void timer_init(struct TIMER* tm, timer_func_t func, void* context);
+
+/* (Re)arms the timer on the current CPU; it fires once timer_get_ns() >= expires */
+void timer_start(struct TIMER* tm, uint64_t expires);
+
+/*
+ * Disarms the timer; returns false if it wasn't pending. Once this returns, the
+ * timer function is not running anywhere, so this must not be called from the
+ * timer function itself.
+ */
+bool timer_cancel(struct TIMER* tm);
+
+uint64_t timer_get_ns();
+
 /* Returns the number of timer ticks since boot */
 uint64_t timer_get_ticks();
 
+/* Called by the machine-dependant code from the timer interrupt of the current CPU */
+void timer_interrupt();
+
+/* Start or stop the timeslice tick of the current CPU */
+void timer_tick_start();
+void timer_tick_stop();
+
+/* Puts the current thread to sleep for at least ns nanoseconds */
+void thread_sleep_ns(uint64_t ns);
+
+/* Machine-dependant hooks */
+uint64_t md_timer_get_ns();
+/*
+ * Requests a timer interrupt on the current CPU at (or somewhat before)
+ * deadline; returns false if the hardware can't do that, in which case
+ * timer_interrupt() must be called periodically instead.
+ */
+bool md_timer_program(uint64_t deadline);
+
 #endif /* __TIMER_H__ */
@@ -47,7 +47,7 @@
 #define TRACE_SUBSYSTEM_MACHDEP	7			/* Machine dependent */
 #define TRACE_SUBSYSTEM_USB	8			/* USB stack */
 #define TRACE_SUBSYSTEM_VM	9			/* VM */
-#define TRACE_SUBSYSTEM_LAST	(TRACE_SUBSYSTEM_MACHDEP)
+#define TRACE_SUBSYSTEM_LAST	10			/* Number of subsystems */
 
 /* Available tracelevels */
 #define TRACE_LEVEL_FUNC	0x0001			/* Function call tracing */
@@ -56,27 +56,90 @@
 #define TRACE_LEVEL_WARN	0x0008			/* Warning */
 #define TRACE_LEVEL_ALL		0xffff			/* Everything */
 
+/*
+ * Every TRACE() in the kernel proper is a tracepoint, which is placed in the
+ * .tracepoints section so that all of them can be found and enabled while
+ * the system runs; a disabled tracepoint costs a single load and a branch
+ * which is predicted as not taken. Modules cannot be found this way; they
+ * use the subsystem masks instead.
+ *
+ * As tracepoints are static variables of their function, TRACE() cannot be
+ * used in inline functions in headers (these would end up in a comdat
+ * section, which conflicts with .tracepoints)
+ */
+struct TRACEPOINT {
+	uint8_t		tp_enabled;	/* Non-zero if this point fires */
+	uint8_t		tp_subsystem;	/* TRACE_SUBSYSTEM_... */
+	uint16_t	tp_level;	/* TRACE_LEVEL_... */
+	uint32_t	tp_line;
+	const char*	tp_file;
+	const char*	tp_func;
+};
+
 #define TRACE_IS_ENABLED(s, l) \
 	(trace_subsystem_mask[TRACE_SUBSYSTEM_##s] & TRACE_LEVEL_##l)
 
-#define TRACE_DO(x...) \
-	tracef(TRACE_FILE_ID, __func__, x)
+#if defined(KERNEL) && !defined(MODULE)
+# define TRACEPOINT_ENABLED(s, l) \
+	__builtin_expect(({ \
+		static struct TRACEPOINT __tracepoint __attribute__((section(".tracepoints"), used)) = { \
+			0, TRACE_SUBSYSTEM_##s, TRACE_LEVEL_##l, __LINE__, __FILE__, __func__ \
+		}; \
+		__atomic_load_n(&__tracepoint.tp_enabled, __ATOMIC_RELAXED); \
+	}), 0)
+#else
+# define TRACEPOINT_ENABLED(s, l) \
+	__builtin_expect(TRACE_IS_ENABLED(s, l), 0)
+#endif
+
+#define TRACE_DO(s,l,x...) \
+	tracef(TRACE_FILE_ID, TRACE_SUBSYSTEM_##s, TRACE_LEVEL_##l, __func__, x)
 	
 #define TRACE(s,l,x...)	 \
-	if (TRACE_IS_ENABLED(s, l)) \
-		TRACE_DO(x)
+	if (TRACEPOINT_ENABLED(s, l)) \
+		TRACE_DO(s,l,x)
 
 #define TRACE_DEV(s,l,dev,fmt,...) \
 	TRACE(s,l, "%s%u: " fmt, dev->name, dev->unit, ## __VA_ARGS__)
 
 #define TRACE_ENABLE(s,l) \
-	trace_subsystem_mask[TRACE_SUBSYSTEM_##s] |= TRACE_LEVEL_##l
+	trace_set_subsystem(TRACE_SUBSYSTEM_##s, trace_subsystem_mask[TRACE_SUBSYSTEM_##s] | TRACE_LEVEL_##l)
 
 #define TRACE_DISABLE(s,l) \
-	trace_subsystem_mask[TRACE_SUBSYSTEM_##s] &= ~TRACE_LEVEL_##l
+	trace_set_subsystem(TRACE_SUBSYSTEM_##s, trace_subsystem_mask[TRACE_SUBSYSTEM_##s] & ~TRACE_LEVEL_##l)
 		
+/*
+ * Trace events are stored as binary records in a ring buffer per CPU; they
+ * are only formatted once someone looks at them. Arguments are kept as-is,
+ * except for strings which are copied as they may be gone by then.
+ */
+#define TRACE_RECORD_ARGS	6
+#define TRACE_RECORD_STRLEN	48
+
+struct TRACE_RECORD {
+	uint64_t	tr_timestamp;	/* ns since boot */
+	const char*	tr_func;
+	const char*	tr_fmt;
+	int32_t		tr_pid;		/* -1 for kernel threads */
+	uint16_t	tr_fileid;	/* TRACE_FILE_ID */
+	uint8_t		tr_subsystem;	/* TRACE_SUBSYSTEM_... */
+	uint8_t		tr_level;	/* TRACE_LEVEL_... */
+	uint64_t	tr_arg[TRACE_RECORD_ARGS];
+	char		tr_str[TRACE_RECORD_STRLEN];	/* %s arguments */
+};
+
 extern void *__traceid_begin, *__traceid_end;
 extern uint32_t trace_subsystem_mask[];
-void tracef(int fileid, const char* func, const char* fmt, ...);
+void tracef(int fileid, int subsystem, int level, const char* func, const char* fmt, ...);
+void trace_format(const struct TRACE_RECORD* tr, char* buf, size_t len);
+
+#ifdef KERNEL
+/* Tracepoint control */
+const char* trace_subsystem_name(int subsystem);
+void trace_set_subsystem(int subsystem, uint32_t mask);
+unsigned int trace_get_num_points();
+struct TRACEPOINT* trace_get_point(unsigned int id);
+void trace_set_point(struct TRACEPOINT* tp, bool enabled);
+#endif /* KERNEL */
 
 #endif /* __ANANAS_TRACE_H__ */
@@ -0,0 +1,70 @@
+#ifndef __ANANAS_TUNABLE_H__
+#define __ANANAS_TUNABLE_H__
+
+#include <ananas/types.h>
+#include <ananas/init.h>
+#include <ananas/list.h>
+
+/*
+ * Tunables are kernel parameters which can be changed while the system runs;
+ * they are listed in /ankh/sys, where every tunable is a file containing its
+ * value. Writing a new value there changes it, provided it lies within the
+ * bounds given. The variable itself is owned by the subsystem, which can
+ * simply read it; the optional notify function is called after it changed.
+ */
+struct TUNABLE;
+
+typedef enum {
+	TUNABLE_TYPE_UINT,
+	TUNABLE_TYPE_BOOL
+} tunable_type_t;
+
+typedef void tunable_notify_t(struct TUNABLE* t);
+
+struct TUNABLE {
+	const char*		t_name;		/* 'subsystem.name' */
+	const char*		t_help;
+	tunable_type_t		t_type;
+	union {
+		unsigned int*	u_uint;
+		bool*		u_bool;
+	} t_value;
+	unsigned int		t_min;		/* Bounds, inclusive (TUNABLE_TYPE_UINT only) */
+	unsigned int		t_max;
+	tunable_notify_t*	t_notify;	/* Optional */
+
+	LIST_FIELDS(struct TUNABLE);
+};
+
+errorcode_t tunable_register(struct TUNABLE* t);
+
+/* Returns the n-th tunable, or nullptr if there are not that many */
+struct TUNABLE* tunable_get(unsigned int n);
+struct TUNABLE* tunable_find(const char* name);
+
+/* Parses value and assigns it if it is acceptable */
+errorcode_t tunable_set(struct TUNABLE* t, const char* value);
+void tunable_format(struct TUNABLE* t, char* buf, size_t len);
+
+#define TUNABLE_UINT(NAME, VAR, MIN, MAX, NOTIFY, HELP) \
+	TUNABLE_DEFINE(NAME, VAR, TUNABLE_TYPE_UINT, u_uint, MIN, MAX, NOTIFY, HELP)
+
+#define TUNABLE_BOOL(NAME, VAR, NOTIFY, HELP) \
+	TUNABLE_DEFINE(NAME, VAR, TUNABLE_TYPE_BOOL, u_bool, 0, 1, NOTIFY, HELP)
+
+#define TUNABLE_DEFINE(NAME, VAR, TYPE, FIELD, MIN, MAX, NOTIFY, HELP) \
+	static struct TUNABLE tunable_ ## VAR = { \
+		.t_name = (NAME), \
+		.t_help = (HELP), \
+		.t_type = (TYPE), \
+		.t_value = { .FIELD = &(VAR) }, \
+		.t_min = (MIN), \
+		.t_max = (MAX), \
+		.t_notify = (NOTIFY) \
+	}; \
+	static errorcode_t tunable_add_ ## VAR() { \
+		return tunable_register(&tunable_ ## VAR); \
+	} \
+	INIT_FUNCTION(tunable_add_ ## VAR, SUBSYSTEM_KDB, ORDER_MIDDLE)
+
+#endif /* __ANANAS_TUNABLE_H__ */
@@ -0,0 +1,15 @@
+#ifndef __ANANAS_UIO_H__
+#define __ANANAS_UIO_H__
+
+#include <machine/_types.h>
+#include <ananas/_types/size.h>
+
+#define IOV_MAX		64	/* Maximum number of buffers per request */
+
+/* A single buffer of a vectored read or write */
+struct iovec {
+	void*	iov_base;
+	size_t	iov_len;
+};
+
+#endif /* __ANANAS_UIO_H__ */
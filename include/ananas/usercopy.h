@@ -0,0 +1,29 @@
+#ifndef __ANANAS_USERCOPY_H__
+#define __ANANAS_USERCOPY_H__
+
+#include <ananas/types.h>
+
+/*
+ * Copying between the kernel and the userland memory of the current vmspace.
+ * The userland range is checked, and userland memory which isn't there makes
+ * the copy fail with BAD_ADDRESS rather than the kernel crash; the copy may
+ * have been partially done by then.
+ *
+ * These should be preferred over mapping userland memory for anything but
+ * bulk data, as the result can be used without having to trust userland.
+ */
+errorcode_t copyin(void* dst, const void* src, size_t len);
+errorcode_t copyout(void* dst, const void* src, size_t len);
+
+/*
+ * Copies a zero-terminated string of at most len bytes, including the
+ * terminator, to dst; fails with BAD_LENGTH if it doesn't fit.
+ */
+errorcode_t copyinstr(char* dst, const void* src, size_t len);
+
+/* Machine-dependant part; these return -1 on a fault, see usercopy.S */
+extern "C" int md_copyin(void* dst, const void* src, size_t len);
+extern "C" int md_copyout(void* dst, const void* src, size_t len);
+extern "C" ssize_t md_copyinstr(char* dst, const void* src, size_t len);
+
+#endif /* __ANANAS_USERCOPY_H__ */
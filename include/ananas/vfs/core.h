@@ -33,6 +33,50 @@ static inline errorcode_t vfs_bread(struct VFS_MOUNTED_FS* fs, blocknr_t block,
 	return vfs_bget(fs, block, bio, 0);
 }
 
+/*
+ * Retrieves num_blocks consecutive blocks, starting at block, to bios; the
+ * blocks are read using as few requests as possible.
+ */
+errorcode_t vfs_bget_range(struct VFS_MOUNTED_FS* fs, blocknr_t block, unsigned int num_blocks, struct BIO** bios, int flags);
+
+/*
+ * Reads num_blocks consecutive blocks, starting at block, to bios.
+ */
+static inline errorcode_t vfs_bread_range(struct VFS_MOUNTED_FS* fs, blocknr_t block, unsigned int num_blocks, struct BIO** bios)
+{
+	return vfs_bget_range(fs, block, num_blocks, bios, 0);
+}
+
+/*
+ * Maps up to num_blocks existing blocks of inode, from block_in onwards, to
+ * the filesystem's device. The blocks are contiguous on the device; the
+ * number of blocks mapped is stored in num_blocks.
+ */
+errorcode_t vfs_block_map_range(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks);
+
+/*
+ * Obtains the page cache page at the page-aligned offset of the dentry's
+ * inode, reading it if needed; the page is returned locked.
+ */
+errorcode_t vfs_pagecache_get(struct DENTRY* dentry, off_t offset, struct VM_PAGE** vp_out);
+/* As vfs_pagecache_get(), but also reports whether the page had to be read */
+errorcode_t vfs_pagecache_get_ex(struct DENTRY* dentry, off_t offset, struct VM_PAGE** vp_out, bool* was_read);
+
+/* Updates the page cache with written data, if the page is present */
+void vfs_pagecache_update(struct VFS_INODE* inode, off_t offset, const void* buf, size_t len);
+
+/*
+ * Starts reading the pages within [offset, end) of the inode that are not yet
+ * cached; this does not wait for any of them, nor does it report errors.
+ */
+void vfs_pagecache_readahead(struct VFS_INODE* inode, off_t offset, off_t end);
+
+/* Writes a page cache page back to the file */
+errorcode_t vfs_pagecache_write(struct DENTRY* dentry, struct VM_PAGE* vmpage);
+
+/* Throws away all page cache pages of the inode */
+void vfs_pagecache_purge(struct VFS_INODE* inode);
+
 errorcode_t vfs_lookup(struct DENTRY* parent, struct DENTRY** destentry, const char* dentry);
 
 bool vfs_is_filesystem_sane(struct VFS_MOUNTED_FS* fs);
@@ -42,12 +86,24 @@ errorcode_t vfs_open(const char* fname, struct DENTRY* cwd, struct VFS_FILE* fil
 errorcode_t vfs_close(struct VFS_FILE* file);
 errorcode_t vfs_read(struct VFS_FILE* file, void* buf, size_t* len);
 errorcode_t vfs_write(struct VFS_FILE* file, const void* buf, size_t* len);
+
+/*
+ * Reads directory entries as vfs_read() does, but returns them as
+ * VFS_DIRENT_PLUS records which include the attributes of each entry.
+ */
+errorcode_t vfs_readdir_plus(struct VFS_FILE* file, void* buf, size_t* len);
 errorcode_t vfs_seek(struct VFS_FILE* file, off_t offset);
 errorcode_t vfs_create(struct DENTRY* parent, struct VFS_FILE* destfile, const char* dentry, int mode);
 errorcode_t vfs_grow(struct VFS_FILE* file, off_t size);
 errorcode_t vfs_unlink(struct VFS_FILE* file);
 errorcode_t vfs_rename(struct VFS_FILE* file, struct DENTRY* parent, const char* dest);
 
+/*
+ * Copies up to len bytes from in to out, both at their current offsets, without
+ * any userland buffer; len is updated with the amount copied.
+ */
+errorcode_t vfs_copy(struct VFS_FILE* in, struct VFS_FILE* out, size_t* len);
+
 /* Filesystem specific functions */
 size_t vfs_filldirent(void** dirents, size_t* size, ino_t inum, const char* name, int namelen);
 
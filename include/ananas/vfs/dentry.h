@@ -2,12 +2,14 @@
 #define __ANANAS_DENTRY_H__
 
 #include <ananas/types.h>
+#include <ananas/cdefs.h>
 #include <ananas/list.h>
 
 struct VFS_MOUNTED_FS;
 
-#define DCACHE_ITEMS_PER_FS	32
 #define DCACHE_MAX_NAME_LEN	255
+#define DCACHE_HASH_SIZE	64	/* Number of hash buckets; must be a power of two */
+#define DCACHE_NEGATIVE_MAX	256	/* Number of negative entries kept around */
 
 struct VFS_MOUNTED_FS;
 
@@ -19,8 +21,13 @@ struct DENTRY {
 	uint32_t d_flags;			/* Item flags */
 #define DENTRY_FLAG_NEGATIVE	0x0001		/* Negative entry; does not exist */
 #define DENTRY_FLAG_ROOT			0x0002		/* Root dentry; must not be removed */
+#define DENTRY_FLAG_REFERENCED	0x0004		/* Looked up since last recycle scan */
+#define DENTRY_FLAG_NEGCACHED	0x0008		/* Held by the negative entry cache */
 	char	d_entry[DCACHE_MAX_NAME_LEN];	/* Entry name */
-	LIST_FIELDS(struct DENTRY);
+	uint32_t d_hash;			/* Hash of d_entry */
+	LIST_FIELDS(struct DENTRY);		/* In-use list */
+	LIST_FIELDS_IT(struct DENTRY, hash);	/* Hash bucket */
+	LIST_FIELDS_IT(struct DENTRY, negative);	/* Negative entry cache */
 };
 
 LIST_DEFINE(DENTRY_QUEUE, struct DENTRY);
@@ -28,10 +35,22 @@ LIST_DEFINE(DENTRY_QUEUE, struct DENTRY);
 struct DENTRY* dcache_create_root_dentry(struct VFS_MOUNTED_FS* fs);
 
 void dcache_dump();
-struct DENTRY* dcache_lookup(struct DENTRY* parent, const char* entry);
+/* Describes the memory used by the dentry cache */
+void dcache_get_status(char* buf, size_t len);
+struct DENTRY* dcache_lookup(struct DENTRY* parent, const char* entry) __hot;
 void dcache_purge_old_entries();
 void dcache_set_inode(struct DENTRY* de, struct VFS_INODE* inode);
 
+/*
+ * Keeps negative entry de around after its final user lets go, so that
+ * repeated lookups of a name which does not exist need not consult the
+ * filesystem. Only the most recent DCACHE_NEGATIVE_MAX entries are kept.
+ */
+void dcache_cache_negative(struct DENTRY* de);
+
+/* Forgets all negative entries of parent; used when names are added to it */
+void dcache_purge_negative(struct DENTRY* parent);
+
 /* Adds a reference to dentry d */
 void dentry_ref(struct DENTRY* d);
 
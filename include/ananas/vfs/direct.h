@@ -0,0 +1,19 @@
+#ifndef __ANANAS_VFS_DIRECT_H__
+#define __ANANAS_VFS_DIRECT_H__
+
+#include <ananas/types.h>
+
+struct VFS_FILE;
+
+/*
+ * Direct I/O is used for files opened with O_DIRECT; data is transferred
+ * between the device and the caller's buffer without passing through the
+ * buffer cache. This only works for userland buffers where the buffer, the
+ * file offset and the length are all aligned to the filesystem block size.
+ */
+bool vfs_direct_possible(struct VFS_FILE* file, const void* buf, size_t len);
+
+errorcode_t vfs_direct_read(struct VFS_FILE* file, void* buf, size_t* len);
+errorcode_t vfs_direct_write(struct VFS_FILE* file, const void* buf, size_t* len);
+
+#endif /* __ANANAS_VFS_DIRECT_H__ */
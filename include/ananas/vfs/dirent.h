@@ -2,6 +2,7 @@
 #define ANANAS_VFS_DIRENT_H
 
 #include <ananas/types.h>
+#include <ananas/stat.h>
 
 /*
  * Directory entry, as returned by the kernel.
@@ -17,4 +18,15 @@ struct VFS_DIRENT {
 };
 #define DE_LENGTH(x) (sizeof(struct VFS_DIRENT) + (x)->de_name_length)
 
+/*
+ * Directory entry along with the attributes of what it refers to, as returned
+ * by readdirplus(). If the attributes could not be obtained, dp_stat is all
+ * zero.
+ */
+struct VFS_DIRENT_PLUS {
+	struct stat	dp_stat;		/* Attributes */
+	struct VFS_DIRENT dp_dirent;		/* Entry; its name is stored directly after it */
+};
+#define DP_LENGTH(x) (__builtin_offsetof(struct VFS_DIRENT_PLUS, dp_dirent) + DE_LENGTH(&(x)->dp_dirent))
+
 #endif // ANANAS_VFS_DIRENT_H
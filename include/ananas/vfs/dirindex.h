@@ -0,0 +1,41 @@
+#ifndef __ANANAS_VFS_DIRINDEX_H__
+#define __ANANAS_VFS_DIRINDEX_H__
+
+#include <ananas/types.h>
+
+struct VFS_INODE;
+struct VFS_DIRINDEX;
+
+/*
+ * Directory indices map names to inode numbers for directories that are too
+ * large to scan on every lookup; they are built the first time such a
+ * directory is scanned, and hang off the directory's inode from then on.
+ */
+#define VFS_DIRINDEX_MIN_ENTRIES	32	/* Directories smaller than this are just scanned */
+
+/*
+ * Looks up name in the index of directory inode; returns NO_FILE if the index
+ * says the name does not exist, or NO_RESOURCE if there is no index.
+ */
+errorcode_t vfs_dirindex_lookup(struct VFS_INODE* inode, const char* name, ino_t* inum);
+
+/* Starts building an index for inode; entries are added by the caller as it scans the directory */
+struct VFS_DIRINDEX* vfs_dirindex_begin(struct VFS_INODE* inode);
+
+/* Adds a scanned entry to di; returns the number of entries collected so far */
+unsigned int vfs_dirindex_collect(struct VFS_DIRINDEX* di, const char* name, unsigned int name_len, ino_t inum);
+
+/*
+ * Completes building di; it is only hooked up to inode if the whole directory
+ * was scanned, it is large enough to be worth it and nothing changed meanwhile.
+ */
+void vfs_dirindex_finish(struct VFS_INODE* inode, struct VFS_DIRINDEX* di, bool complete);
+
+/* Keep the index of inode current; used once a name is created or removed */
+void vfs_dirindex_add(struct VFS_INODE* inode, const char* name, ino_t inum);
+void vfs_dirindex_remove(struct VFS_INODE* inode, const char* name);
+
+/* Throws away the index of inode, if any; the inode must be locked */
+void vfs_dirindex_purge(struct VFS_INODE* inode);
+
+#endif /* __ANANAS_VFS_DIRINDEX_H__ */
@@ -19,11 +19,34 @@ void vfs_ref_inode(struct VFS_INODE* inode);
 
 /* Low-level interface - designed for filesystem use (must not be used otherwise) */
 
-/* Marks an inode as dirty; will trigger the filesystem's 'write_inode' function */
+/*
+ * Marks an inode as dirty; it is queued for the filesystem's 'write_inode'
+ * function, which the write-back thread calls once the system is otherwise
+ * idle. Any further changes made before then are written along with it.
+ */
 void vfs_set_inode_dirty(struct VFS_INODE* inode);
 
+/* Writes the inode back right away, if it is dirty */
+void vfs_sync_inode(struct VFS_INODE* inode);
+
+/* Writes back all dirty inodes of fs, or those of every filesystem if NULL */
+void vfs_sync_inodes(struct VFS_MOUNTED_FS* fs);
+
+/*
+ * Adds inode inum to the cache without a reference, as the filesystem came
+ * across it while reading another inode; fill is called on the prepared,
+ * locked inode to fill it from data, like read_inode would. Nothing happens if
+ * the inode is already cached, or if this would mean evicting another inode or
+ * waiting for the cache - this makes it safe to call from read_inode.
+ * Returns whether the inode was added.
+ */
+typedef errorcode_t (*icache_fill_func_t)(struct VFS_INODE* inode, ino_t inum, const void* data);
+bool vfs_add_speculative_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, icache_fill_func_t fill, const void* data);
+
 /* Internal interface only */
 void vfs_dump_inode(struct VFS_INODE* inode);
+/* Describes the memory used by the inode cache */
+void icache_get_status(char* buf, size_t len);
 
 
 #endif /* __ANANAS_ICACHE_H__ */
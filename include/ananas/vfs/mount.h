@@ -16,6 +16,12 @@ errorcode_t vfs_unmount(const char* path);
 
 void vfs_abandon_device(Ananas::Device& device);
 
+/*
+ * Writes back the dirty inodes and buffers of every mounted filesystem and
+ * commits them to stable storage.
+ */
+errorcode_t vfs_sync_all();
+
 struct VFS_MOUNTED_FS* vfs_get_rootfs();
 
 #endif /* __ANANAS_VFS_MOUNT_H__ */
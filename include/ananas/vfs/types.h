@@ -3,6 +3,7 @@
 
 #include <ananas/list.h>
 #include <ananas/lock.h>
+#include <ananas/radix.h>
 #include <ananas/stat.h> /* for 'struct stat' */
 #include <ananas/vfs/dentry.h> /* for 'struct DENTRY_QUEUE' */
 #include <ananas/vfs/icache.h> /* for 'struct ICACHE_QUEUE' */
@@ -16,6 +17,8 @@ struct DENTRY;
 struct VFS_MOUNTED_FS;
 struct VFS_INODE_OPS;
 struct VFS_FILESYSTEM_OPS;
+struct VFS_DIRINDEX;
+struct EXEC_IMAGE;
 
 #define INODE_LOCK(i) \
 	mutex_lock(&(i)->i_mutex)
@@ -29,12 +32,15 @@ struct VFS_FILESYSTEM_OPS;
  */
 struct VFS_INODE {
 	LIST_FIELDS(struct VFS_INODE);		/* Cache entries */
+	LIST_FIELDS_IT(struct VFS_INODE, hash);	/* Cache hash chain */
+	LIST_FIELDS_IT(struct VFS_INODE, dirty);	/* Write-back queue */
 	mutex_t		i_mutex;		/* Mutex protecting inode */
 	refcount_t	i_refcount;		/* Refcount, must be >=0 */
 	unsigned int	i_flags;		/* Inode flags */
-#define INODE_FLAG_DIRTY	(1 << 0)	/* Needs to be written */
+#define INODE_FLAG_DIRTY	(1 << 0)	/* Queued to be written */
 #define INODE_FLAG_PENDING	(1 << 1)	/* Needs to be filled */
 #define INODE_FLAG_GONE (1 << 2) /* No longer valid */
+#define INODE_FLAG_EXEC_RECENT	(1 << 3)	/* Executed since last eviction scan */
 	struct stat 	i_sb;			/* Inode information */
 	struct VFS_INODE_OPS* i_iops;		/* Inode operations */
 
@@ -43,6 +49,12 @@ struct VFS_INODE {
 	ino_t		i_inum;			/* Inode number */
 
 	struct VM_PAGE_LIST	i_pages;	/* Backing VM pages, if any */
+	struct RADIX_TREE	i_page_index;	/* i_pages, by page number */
+
+	struct VFS_DIRINDEX*	i_dirindex;	/* Name lookup index, if any */
+	unsigned int		i_dirgen;	/* Bumped whenever the directory changes */
+
+	struct EXEC_IMAGE*	i_exec_image;	/* Parsed executable layout, if any */
 };
 
 /*
@@ -59,6 +71,13 @@ struct VFS_FILE {
 	 */
 	struct DENTRY*		f_dentry;
 	Ananas::Device*		f_device;
+	unsigned int		f_flags;
+#define VFS_FILE_FLAG_DIRECT	0x0001		/* Bypass the caches where possible */
+
+	/* Readahead state; see vfs_generic_read() */
+	off_t			f_ra_next;		/* Offset where a sequential read continues */
+	off_t			f_ra_end;		/* Readahead has been started up to here */
+	unsigned int		f_ra_pages;		/* Current readahead window, in pages */
 };
 
 /*
@@ -118,6 +137,12 @@ struct VFS_FILESYSTEM_OPS {
 	 * Writes an inode back to disk; inode is locked.
 	 */
 	errorcode_t (*write_inode)(struct VFS_INODE* inode);
+
+	/*
+	 * Starts reading on-disk inode num, as it will be needed shortly; this
+	 * must not wait for the read to complete. Optional.
+	 */
+	void (*prefetch_inode)(struct VFS_MOUNTED_FS* fs, ino_t num);
 };
 
 struct VFS_INODE_OPS {
@@ -138,6 +163,23 @@ struct VFS_INODE_OPS {
 	 */
 	errorcode_t (*block_map)(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create);
 
+	/*
+	 * Maps a run of the inode's existing blocks, starting at block_in, to the
+	 * block device; block_out is the device block of block_in, and num_blocks
+	 * is updated with how many blocks follow contiguously on the device, up to
+	 * the amount it was set to (at least one). Optional; block_map() is used
+	 * one block at a time if this is not available.
+	 */
+	errorcode_t (*block_map_range)(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks);
+
+	/*
+	 * Fills the page cache page at the page-aligned offset of the inode, for
+	 * filesystems where the data cannot simply be mapped to blocks; anything
+	 * beyond the end of the file must be zeroed. Readahead calls this from
+	 * several threads at once for different pages. Optional.
+	 */
+	errorcode_t (*fill_page)(struct VFS_INODE* inode, off_t offset, void* page);
+
 	/*
 	 * Reads inode data to a buffer, up to len bytes. Must update len on success
 	 * with the amount of data read.
@@ -13,6 +13,8 @@
 #define VM_FLAG_NO_CLONE   (1 << 7)  /* Do not clone mapping */
 #define VM_FLAG_LAZY       (1 << 8)  /* Lazy mapping: page in as needed */
 #define VM_FLAG_ALLOC      (1 << 9)  /* Allocate memory for mapping */
+#define VM_FLAG_STACK      (1 << 10) /* Stack: back in chunks on faults */
+#define VM_FLAG_PINNED     (1 << 11) /* Kernel refers to the area; userland may not unmap it */
 #define VM_FLAG_MD         (1 << 15) /* Machine dependent mapping */
 
 /* Force a specific mapping to be made */
@@ -35,6 +37,14 @@ void md_kmap(addr_t phys, addr_t virt, size_t num_pages, int flags);
 /* Unmaps a piece of kernel memory */
 void md_kunmap(addr_t virt, size_t num_pages);
 
+/*
+ * Defers the TLB invalidations needed by changes to vs' mappings until
+ * md_tlb_batch_end(), which then does them on all CPUs at once. Batches may
+ * nest; only changes to vs made by the current thread are deferred.
+ */
+void md_tlb_batch_begin(vmspace_t* vs);
+void md_tlb_batch_end();
+
 /* Initialize the memory manager */
 void vm_init();
 
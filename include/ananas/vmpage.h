@@ -6,12 +6,19 @@
 #include <ananas/lock.h>
 
 struct PAGE;
+struct ZSWAP_ENTRY;
 
 #define VM_PAGE_FLAG_PRIVATE   (1 << 0)  /* page is private to the process */
 #define VM_PAGE_FLAG_READONLY  (1 << 1)  /* page cannot be modified */
 #define VM_PAGE_FLAG_COW       (1 << 2)  /* page must be copied on write */
 #define VM_PAGE_FLAG_PENDING   (1 << 3)  /* page is pending a read */
 #define VM_PAGE_FLAG_LINK      (1 << 4)  /* link to another page */
+#define VM_PAGE_FLAG_LENT      (1 << 5)  /* page cache page mapped into anonymous memory */
+#define VM_PAGE_FLAG_SWAPPABLE (1 << 6)  /* anonymous page on the LRU lists, see swap.cpp */
+#define VM_PAGE_FLAG_ACTIVE    (1 << 7)  /* on the active rather than the inactive list */
+#define VM_PAGE_FLAG_SWAPPED   (1 << 8)  /* contents live in swap slot vp_swap_slot */
+#define VM_PAGE_FLAG_ZSWAPPED  (1 << 9)  /* with SWAPPED: contents are compressed at vp_zswap */
+#define VM_PAGE_FLAG_MERGED    (1 << 10) /* shared page set up by merge.cpp */
 
 struct VM_PAGE {
 	LIST_FIELDS(struct VM_PAGE);
@@ -21,6 +28,9 @@ struct VM_PAGE {
 	int vp_flags;
 	refcount_t vp_refcount;
 
+	/* Checksum of the contents as last seen by merge.cpp */
+	uint32_t vp_checksum;
+
 	union {
 		/* Backing page, if any */
 		struct PAGE* vp_page;
@@ -35,6 +45,14 @@ struct VM_PAGE {
 	/* Backing inode and offset */
 	struct VFS_INODE* vp_inode;
 	off_t vp_offset;
+
+	/* Swappable pages only: the vmspace mapping us, and our place in the LRU lists */
+	vmspace_t* vp_vmspace;
+	union {
+		unsigned int vp_swap_slot;
+		struct ZSWAP_ENTRY* vp_zswap;
+	};
+	LIST_FIELDS_IT(struct VM_PAGE, lru);
 };
 
 LIST_DEFINE(VM_PAGE_LIST, struct VM_PAGE);
@@ -52,15 +70,60 @@ static inline void vmpage_unlock(struct VM_PAGE* vmpage)
 void vmpage_ref(struct VM_PAGE* vmpage);
 void vmpage_deref(struct VM_PAGE* vmpage);
 
-struct VM_PAGE* vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs);
+/* Returns the inode's page at offs, locked, or nullptr if there is none */
+struct VM_PAGE* vmpage_lookup_inode_locked(struct VFS_INODE* inode, off_t offs);
+/* Removes the page from its inode, if it is still there, and drops the inode's reference */
+void vmpage_detach_inode(struct VFS_INODE* inode, struct VM_PAGE* vmpage);
+/*
+ * Replaces lent page vp, which must be locked, by a copy in the inode so that
+ * the file can be changed without affecting whoever borrowed it; returns the
+ * copy, locked. vp is unlocked. If someone else replaced the page in the
+ * meantime, nullptr is returned and the page must be looked up again.
+ */
+struct VM_PAGE* vmpage_unlend(struct VFS_INODE* inode, struct VM_PAGE* vp);
 struct VM_PAGE* vmpage_create_shared(vmarea_t* va, struct VFS_INODE* inode, off_t offs, int flags);
 struct VM_PAGE* vmpage_create_private(int flags);
+struct VM_PAGE* vmpage_create_private_zeroed(int flags);
+/* As vmpage_create_private(), but backed by the given page */
+struct VM_PAGE* vmpage_create_private_page(struct PAGE* page, int flags);
+/* Returns the backing page; a swapped out page is read back first, so this may sleep */
 struct PAGE* vmpage_get_page(struct VM_PAGE* vp);
 
+/*
+ * Puts private page vp, which is mapped at its vp_vaddr in vs, on the LRU
+ * lists so that it can be swapped out or moved; does nothing if it already
+ * is or if the page is shared. The area mapping it must be locked.
+ */
+void vmpage_activate(vmspace_t* vs, struct VM_PAGE* vp);
+/* Takes vp off the LRU lists; must be done before it leaves its vmspace */
+void vmpage_deactivate(struct VM_PAGE* vp);
+/*
+ * Copies page p, which backs a page on the LRU lists, to p_new and has that
+ * page use p_new instead; the next access maps it again. Returns false if p
+ * is not such a page or it is busy; otherwise, the caller must free p.
+ */
+bool vmpage_migrate(struct PAGE* p, struct PAGE* p_new);
+
 struct VM_PAGE* vmpage_clone(struct VM_PAGE* vp_source);
 struct VM_PAGE* vmpage_link(struct VM_PAGE* vp);
+
+/* Returns a link to the inode's page at offs if it is resident and not lent, or nullptr */
+struct VM_PAGE* vmpage_link_cached(struct VFS_INODE* inode, off_t offs);
 void vmpage_copy(struct VM_PAGE* vp_src, struct VM_PAGE* vp_dst);
 
+/*
+ * Turns private page vp into a copy-on-write link to a new page holding its
+ * backing page; the area mapping it must be locked.
+ */
+void vmpage_make_cow(struct VM_PAGE* vp);
+/*
+ * Gives a copy-on-write page its own, writable copy of the data; fails with
+ * OUT_OF_MEMORY, leaving vp as it was, if no page can be had for the copy.
+ */
+errorcode_t vmpage_promote(struct VM_PAGE* vp);
+/* Called by vmpage_free() as a merged page goes away; see merge.cpp */
+void vmpage_merge_forget(struct VM_PAGE* vp);
+
 void vmpage_dump(struct VM_PAGE* vp, const char* prefix);
 
 #endif // ANANAS_VM_PAGE_H
@@ -3,10 +3,13 @@
 
 #include <ananas/types.h>
 #include <ananas/list.h>
+#include <ananas/radix.h>
 #include <ananas/vmpage.h>
 #include <machine/vmspace.h>
 #include <ananas/page.h>
 
+struct SHM;
+
 /*
  * VM area describes an adjacent mapping though virtual memory. It can be
   backed by an inode in the following way:
@@ -24,7 +27,9 @@
  *       +-------+         |      |
  *                         +------+
  *
- * Note that we'll only fault one page at a time.
+ * Faults are handled a page at a time, but any neighbouring pages which are
+ * already present in the inode will be mapped as well; sequential faults
+ * cause the pages following them to be read ahead.
  *
  */
 struct VM_AREA {
@@ -32,24 +37,51 @@ struct VM_AREA {
 	addr_t			va_virt;		/* userland address */
 	size_t			va_len;			/* length */
 	struct VM_PAGE_LIST	va_pages;		/* backing pages */
+	struct RADIX_TREE	va_page_index;		/* va_pages, by page number within the area */
 	/* dentry-specific mapping fields */
 	struct DENTRY* 		va_dentry;		/* backing dentry, if any */
 	off_t			va_dvskip;		/* number of initial bytes to skip */
 	off_t			va_doffset;		/* dentry offset */
 	size_t			va_dlength;		/* dentry length */
+	off_t			va_last_fault;		/* offset of previous dentry fault, or -1 */
+	addr_t			va_anon_next;		/* page following the previous anonymous fault */
+	int			va_advice;		/* expected access pattern, VM_ADVICE_... */
+	/* shared memory object backing the area, if any; va_doffset is the offset within */
+	struct SHM*		va_shm;
+	mutex_t			va_mutex;		/* protects the pages and their mappings */
+
+	/* Address-ordered tree of areas, see vmspace.cpp */
+	struct VM_AREA*		va_rb_parent;
+	struct VM_AREA*		va_rb_left;
+	struct VM_AREA*		va_rb_right;
+	int			va_rb_red;
+	size_t			va_rb_gap;		/* largest gap before any area in this subtree */
 
 	LIST_FIELDS(struct VM_AREA);
 };
 
 LIST_DEFINE(VM_AREA_LIST, struct VM_AREA);
 
+/* Access patterns, which tune fault-around and readahead of dentry-backed areas */
+#define VM_ADVICE_NORMAL	0
+#define VM_ADVICE_RANDOM	1
+#define VM_ADVICE_SEQUENTIAL	2
+
 /*
  * VM space describes a thread's complete overview of memory.
+ *
+ * vs_lock protects the areas and their placement: anything which adds, removes
+ * or resizes areas holds it for writing. Faults and anything else which merely
+ * looks areas up hold it for reading, and lock the va_mutex of the area whose
+ * pages they change; this way, faults in different areas are resolved
+ * concurrently and only ever wait for mapping changes.
  */
 struct VM_SPACE {
-	mutex_t vs_mutex; /* protects all fields and sub-areas */
+	rwlock_t		vs_lock;
 
-	struct VM_AREA_LIST	vs_areas;
+	struct VM_AREA_LIST	vs_areas;		/* ordered by address */
+	struct VM_AREA*		vs_area_root;		/* tree of vs_areas */
+	unsigned int		vs_generation;		/* incremented when an area is removed */
 
 	/*
 	 * Contains pages allocated to the space that aren't part of a mapping; this
@@ -57,8 +89,6 @@ struct VM_SPACE {
 	 */
 	struct page_list vs_pages;
 
-	addr_t			vs_next_mapping;	/* address of next mapping */
-
 	MD_VMSPACE_FIELDS
 };
 
@@ -70,29 +100,73 @@ void vmspace_destroy(vmspace_t* vs);
 errorcode_t vmspace_mapto(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
 errorcode_t vmspace_mapto_dentry(vmspace_t* vs, addr_t virt, off_t vskip, size_t vlength, struct DENTRY* dentry, off_t doffset, size_t dlength, int flags, vmarea_t** va_out);
 errorcode_t vmspace_map(vmspace_t* vs, addr_t phys, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
+errorcode_t vmspace_map_dentry(vmspace_t* vs, struct DENTRY* dentry, off_t doffset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
+errorcode_t vmspace_mapto_shm(vmspace_t* vs, addr_t virt, struct SHM* shm, off_t offset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
+errorcode_t vmspace_map_shm(vmspace_t* vs, struct SHM* shm, off_t offset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
+/* Writes the resident pages of shared file mappings within the range back to the file */
+errorcode_t vmspace_sync(vmspace_t* vs, addr_t virt, size_t len /* bytes */);
+/* Removes the mappings within the range; areas may lose their end, but cannot be split */
+errorcode_t vmspace_unmap(vmspace_t* vs, addr_t virt, size_t len /* bytes */);
+/* Releases the pages backing the range, but keeps the mappings */
+errorcode_t vmspace_discard(vmspace_t* vs, addr_t virt, size_t len /* bytes */);
+/* Sets the access pattern of all areas within the range */
+errorcode_t vmspace_set_advice(vmspace_t* vs, addr_t virt, size_t len /* bytes */, int advice);
+/* Starts reading the file data of the range into the page cache, without waiting for it */
+errorcode_t vmspace_willneed(vmspace_t* vs, addr_t virt, size_t len /* bytes */);
 errorcode_t vmspace_area_resize(vmspace_t* vs, vmarea_t* va, size_t new_length /* in bytes */);
 errorcode_t vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags);
+void vmspace_map_resident(vmspace_t* vs, vmarea_t* va);
+void vmspace_prefault(vmspace_t* vs, addr_t virt, size_t len, int flags);
 errorcode_t vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags);
 void vmspace_area_free(vmspace_t* vs, vmarea_t* va);
+vmarea_t* vmspace_find_area(vmspace_t* vs, addr_t virt);
+/* Locks the area holding virt without blocking, for the page daemon; returns nullptr on failure */
+vmarea_t* vmspace_trylock_area(vmspace_t* vs, addr_t virt);
+void vmspace_unlock_area(vmspace_t* vs, vmarea_t* va);
+void vmarea_add_page(vmarea_t* va, struct VM_PAGE* vp);
+struct VM_PAGE* vmarea_lookup_page(vmarea_t* va, addr_t virt);
+void vmarea_remove_page(vmarea_t* va, struct VM_PAGE* vp);
+bool vmspace_lend_page(vmspace_t* vs, addr_t virt, struct VM_PAGE* vp);
+struct VM_PAGE* vmspace_borrow_page(vmspace_t* vs, addr_t virt);
 void vmspace_dump(vmspace_t* vs);
 
 /* MD initialization/cleanup bits */
 errorcode_t md_vmspace_init(vmspace_t* vs);
 void md_vmspace_destroy(vmspace_t* vs);
 
-static inline void vmspace_lock(vmspace_t* vs)
+static inline void vmspace_lock_read(vmspace_t* vs)
+{
+	rwlock_lock_read(&vs->vs_lock);
+}
+
+static inline void vmspace_unlock_read(vmspace_t* vs)
+{
+	rwlock_unlock_read(&vs->vs_lock);
+}
+
+static inline void vmspace_lock_write(vmspace_t* vs)
 {
-	mutex_lock(&vs->vs_mutex);
+	rwlock_lock_write(&vs->vs_lock);
 }
 
-static inline void vmspace_unlock(vmspace_t* vs)
+static inline void vmspace_unlock_write(vmspace_t* vs)
 {
-	mutex_unlock(&vs->vs_mutex);
+	rwlock_unlock_write(&vs->vs_lock);
 }
 
 static inline void vmspace_assert_locked(vmspace_t* vs)
 {
-	mutex_assert(&vs->vs_mutex, MTX_LOCKED);
+	rwlock_assert(&vs->vs_lock, RWLOCK_LOCKED);
+}
+
+static inline void vmarea_lock(vmarea_t* va)
+{
+	mutex_lock(&va->va_mutex);
+}
+
+static inline void vmarea_unlock(vmarea_t* va)
+{
+	mutex_unlock(&va->va_mutex);
 }
 
 #endif /* ANANAS_VMSPACE_H */
@@ -37,6 +37,9 @@
 #define  LAPIC_ICR_DEST_ALL_EXC_SELF	(3 << 18)	/* All excluding self */
 #define LAPIC_ICR_HI	0x0310
 #define LAPIC_LVT_TR	0x0320		/* LVT Timer Register */
+#define  LAPIC_LVT_TR_MASKED		(1 << 16)	/* Timer interrupt masked */
+#define  LAPIC_LVT_TR_PERIODIC		(1 << 17)	/* Periodic rather than one-shot */
+#define  LAPIC_LVT_TR_TSC_DEADLINE	(2 << 17)	/* Fire once the TSC reaches IA32_TSC_DEADLINE */
 #define LAPIC_LVT_TSR	0x0330		/* LVT Thermal Sensor Register */
 #define LAPIC_LVT_PMCR	0x0340		/* LVT Performance Monitoring Counters Register */
 #define LAPIC_LVT_LINT0	0x0350		/* LVT LINT0 Register */
@@ -45,5 +48,58 @@
 #define LAPIC_LVT_ICR	0x0380		/* LVT Initial Count Register (Timer) */
 #define LAPIC_LVT_CCR	0x0390		/* LVT Current Count Register (Timer) */
 #define LAPIC_LVT_DCR	0x03e0		/* LVT Divide Confiration Register (Timer) */
+#define  LAPIC_LVT_DCR_DIV16		0x3		/* Divide bus clock by 16 */
+
+/* In x2APIC mode, register 'reg' is MSR LAPIC_X2APIC_MSR(reg) */
+#define LAPIC_X2APIC_MSR(reg)	(0x800 + ((reg) >> 4))
+#define LAPIC_X2APIC_ICR	0x830		/* Interrupt Control Register, 64-bit */
+#define MSR_APIC_BASE		0x1b
+#define  MSR_APIC_BASE_EXTD	(1 << 10)	/* x2APIC mode */
+#define  MSR_APIC_BASE_EN	(1 << 11)	/* APIC global enable */
+#define CPUID_1_ECX_X2APIC	(1 << 21)	/* leaf 1, %ecx: x2APIC supported */
+
+#ifndef ASM
+#include <ananas/types.h>
+#include <machine/macro.h>
+#include <machine/vm.h>
+
+/*
+ * The Local APIC is accessed using the memory mapped at LAPIC_BASE, or - in
+ * x2APIC mode - using MSR's. The latter is faster, especially on virtualized
+ * hosts where every memory access is a VM exit, sends an IPI using a single
+ * write and allows for 32-bit APIC ID's. lapic_init() enables x2APIC mode on
+ * the BSP if available; the AP's follow suit in lapic_init_ap().
+ */
+extern bool lapic_x2apic;
+
+static inline uint32_t
+lapic_read(unsigned int reg)
+{
+	if (lapic_x2apic)
+		return rdmsr(LAPIC_X2APIC_MSR(reg));
+	return *(volatile uint32_t*)(PTOKV(LAPIC_BASE) + reg);
+}
+
+static inline void
+lapic_write(unsigned int reg, uint32_t value)
+{
+	if (lapic_x2apic)
+		wrmsr(LAPIC_X2APIC_MSR(reg), value);
+	else
+		*(volatile uint32_t*)(PTOKV(LAPIC_BASE) + reg) = value;
+}
+
+static inline void
+lapic_eoi()
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t lapic_init();
+void lapic_init_ap(uint32_t lapic_id);
+uint32_t lapic_get_id();
+void lapic_send_ipi(uint32_t lapic_id, uint32_t command);
+void lapic_send_ipi_shorthand(uint32_t command);
+#endif /* ASM */
 
 #endif /* __X86_APIC_H__ */
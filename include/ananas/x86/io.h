@@ -42,6 +42,21 @@ inl(uint16_t port)
 	return a;
 }
 
+/* Transfers count words between port and buf */
+static inline void
+insw(uint16_t port, void* buf, unsigned int count)
+{
+	unsigned long n = count;
+	__asm volatile ("rep insw" : "+D" (buf), "+c" (n) : "d" (port) : "memory");
+}
+
+static inline void
+outsw(uint16_t port, const void* buf, unsigned int count)
+{
+	unsigned long n = count;
+	__asm volatile ("rep outsw" : "+S" (buf), "+c" (n) : "d" (port) : "memory");
+}
+
 static inline uint64_t
 rdtsc()
 {
@@ -2,42 +2,32 @@
 #define __ANANAS_X86_PCIHB_H__
 
 #include <ananas/types.h>
-#include <ananas/x86/io.h>
 
-/* We use PCI configuration mechanism 1 as that is most commonly supported */
+/*
+ * Configuration space is accessed memory-mapped (PCI Express ECAM) if the
+ * MCFG table provides it, which needs no locking and reaches the extended
+ * configuration space (registers 256..4095). Otherwise, we use PCI
+ * configuration mechanism 1 as that is most commonly supported; this only
+ * reaches the first 256 bytes, and reads of anything beyond yield all ones.
+ */
 #define PCI_CFG1_ADDR 0xcf8			/* PCI Configuration Mechanism 1 - address port */
 #define  PCI_CFG1_ADDR_ENABLE (1 << 31)
 #define PCI_CFG1_DATA 0xcfc			/* PCI Configuration Mechanism 1 - data port */
 
-static inline unsigned int
-pci_make_addr(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg)
-{
-	return PCI_CFG1_ADDR_ENABLE | (bus << 16) | (dev << 11) | (func << 8) | reg;
-}
+#define PCI_ECAM_BUS_SHIFT	20
+#define PCI_ECAM_DEV_SHIFT	15
+#define PCI_ECAM_FUNC_SHIFT	12
+#define PCI_ECAM_FUNC_SIZE	(1 << PCI_ECAM_FUNC_SHIFT)	/* Config space per function */
+#define PCI_CFG1_SIZE		256
 
-static inline uint32_t
-pci_read_config(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, int width)
-{
-	outl(PCI_CFG1_ADDR, pci_make_addr(bus, dev, func, reg));
-	switch(width) {
-		case 32: return inl(PCI_CFG1_DATA);
-		case 16: return inw(PCI_CFG1_DATA);
-		case  8: return inb(PCI_CFG1_DATA);
-		default: panic("unsupported width %u", width);
-	}
-}
+uint32_t pci_read_config(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, int width);
+void pci_write_config(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t value, int width);
 
-static void
-pci_write_config(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t value, int width)
-{
-	outl(PCI_CFG1_ADDR, pci_make_addr(bus, dev, func, reg));
-	switch(width) {
-		case 32: outb(PCI_CFG1_DATA, value); break;
-		case 16: outw(PCI_CFG1_DATA, value); break;
-		case  8: outl(PCI_CFG1_DATA, value); break;
-		default: panic("unsupported width %u", width);
-	}
-}
+/*
+ * Yields the message a device must write to deliver interrupt irq to the given
+ * CPU; irq must have been obtained using irq_alloc().
+ */
+errorcode_t pcihb_msi_message(unsigned int irq, int cpu, uint64_t* addr, uint32_t* data);
 
 /* vim:set ts=2 sw=2: */
 
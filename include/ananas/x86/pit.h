@@ -21,6 +21,11 @@
 # define PIT_MODE_BCD		(1 << 0)	/* BCD mode */
 
 void x86_pit_init();
+void x86_pit_stop();
 uint32_t x86_pit_calc_cpuspeed_mhz();
+uint32_t x86_clock_init();
+
+/* Converts nanoseconds since boot to a TSC value */
+uint64_t x86_ns_to_tsc(uint64_t ns);
 
 #endif /* __X86_PIT_H__ */
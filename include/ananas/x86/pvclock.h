@@ -0,0 +1,73 @@
+#ifndef __X86_PVCLOCK_H__
+#define __X86_PVCLOCK_H__
+
+#include <ananas/types.h>
+
+/*
+ * KVM's paravirtualized clock (kvmclock): every CPU registers a structure
+ * which the hypervisor keeps up-to-date with the relation between the TSC and
+ * the time of the virtual machine, even as it is migrated between hosts. This
+ * file is shared with userland, which reads the copy in the shared page.
+ */
+#define CPUID_1_ECX_HYPERVISOR		(1 << 31)
+#define CPUID_KVM_SIGNATURE		0x40000000	/* "KVMKVMKVM\0\0\0" in ebx:ecx:edx */
+#define CPUID_KVM_FEATURES		0x40000001
+#define  KVM_FEATURE_CLOCKSOURCE	(1 << 0)
+#define  KVM_FEATURE_CLOCKSOURCE2	(1 << 3)
+#define  KVM_FEATURE_CLOCKSOURCE_STABLE	(1 << 24)
+#define MSR_KVM_SYSTEM_TIME		0x12
+#define MSR_KVM_SYSTEM_TIME_NEW		0x4b564d01
+#define  MSR_KVM_SYSTEM_TIME_ENABLE	(1 << 0)
+
+struct PVCLOCK_TIME_INFO {
+	volatile uint32_t	pv_version;	/* odd while being updated */
+	uint32_t		pv_pad0;
+	uint64_t		pv_tsc_timestamp;
+	uint64_t		pv_system_time;	/* ns at pv_tsc_timestamp */
+	uint32_t		pv_tsc_to_system_mul;
+	int8_t			pv_tsc_shift;
+	uint8_t			pv_flags;
+#define PVCLOCK_TSC_STABLE_BIT		(1 << 0)	/* all CPU's agree on the time */
+	uint8_t			pv_pad[2];
+};
+
+/* Returns the time of the virtual machine in ns, using the structure of the current CPU */
+static inline uint64_t
+pvclock_read_ns(const volatile struct PVCLOCK_TIME_INFO* pv)
+{
+	uint32_t version, lo, hi;
+	uint64_t ns;
+	do {
+		version = pv->pv_version;
+		/* Don't let the TSC be read before the version */
+		__asm __volatile("lfence\nrdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+		uint64_t delta = ((uint64_t)hi << 32 | lo) - pv->pv_tsc_timestamp;
+		if (pv->pv_tsc_shift < 0)
+			delta >>= -pv->pv_tsc_shift;
+		else
+			delta <<= pv->pv_tsc_shift;
+		ns = pv->pv_system_time + (uint64_t)(((unsigned __int128)delta * pv->pv_tsc_to_system_mul) >> 32);
+		__asm __volatile("" : : : "memory");
+	} while ((version & 1) || version != pv->pv_version);
+	return ns;
+}
+
+#ifdef KERNEL
+struct SHARED_PAGE;
+
+extern bool kvmclock_active;
+
+/* Called on the BSP; registers its clock and returns true if kvmclock is to be used */
+bool kvmclock_init();
+/* Called on every AP before it looks at the time */
+void kvmclock_init_ap();
+/* Returns ns since boot */
+uint64_t kvmclock_get_ns();
+/* Converts ns since boot to a TSC value, as far as the near future is concerned */
+uint64_t kvmclock_ns_to_tsc(uint64_t ns);
+uint32_t kvmclock_get_tsc_khz();
+/* Lets the hypervisor keep the copy in the shared page up-to-date, if userland can use it */
+void kvmclock_shared_page_init(struct SHARED_PAGE& sp);
+#endif
+
+#endif /* __X86_PVCLOCK_H__ */
@@ -0,0 +1,23 @@
+#ifndef __X86_RTC_H__
+#define __X86_RTC_H__
+
+#define RTC_INDEX		0x70		/* CMOS register select */
+#define RTC_DATA		0x71		/* CMOS register data */
+
+#define RTC_REG_SECONDS		0x00
+#define RTC_REG_MINUTES		0x02
+#define RTC_REG_HOURS		0x04
+# define RTC_HOURS_PM		(1 << 7)	/* 12-hour mode: PM */
+#define RTC_REG_DAY		0x07
+#define RTC_REG_MONTH		0x08
+#define RTC_REG_YEAR		0x09
+#define RTC_REG_STATUS_A	0x0a
+# define RTC_STATUS_A_UIP	(1 << 7)	/* Update in progress */
+#define RTC_REG_STATUS_B	0x0b
+# define RTC_STATUS_B_24H	(1 << 1)	/* 24-hour mode */
+# define RTC_STATUS_B_BINARY	(1 << 2)	/* Binary rather than BCD values */
+
+/* Returns the RTC time in seconds since the epoch; the RTC is assumed to be in UTC */
+uint64_t x86_rtc_get_time();
+
+#endif /* __X86_RTC_H__ */
@@ -4,10 +4,33 @@
 #define SIO_REG_DATA	0	/* Data register (R/W) */
 #define SIO_REG_IER	1 	/* Interrupt Enable Register */
 #define SIO_REG_FIFO	2	/* Interrupt Identification and FIFO Registers */
+#define SIO_REG_IIR	2	/* Interrupt Identification Register (read) */
 #define SIO_REG_LCR	3	/* Line Control Register */
 #define SIO_REG_MCR	4	/* Modem Control Register */
 #define SIO_REG_LSR	5	/* Line Status Register */
 #define SIO_REG_MSR	6	/* Modem Status Register */
 #define SIO_REG_SR	7	/* Scratch Register */
 
+/* Interrupt Enable Register bits */
+#define SIO_IER_RDA	0x01	/* Received data available */
+#define SIO_IER_THRE	0x02	/* Transmit holding register empty */
+
+/* Interrupt Identification Register bits */
+#define SIO_IIR_NONE	0x01	/* No interrupt pending */
+#define SIO_IIR_ID_MASK	0x0e
+#define SIO_IIR_THRE	0x02	/* Transmit holding register empty */
+#define SIO_IIR_FIFO	0xc0	/* FIFO enabled and working (16550A) */
+
+/* Modem Control Register bits */
+#define SIO_MCR_DTR	0x01
+#define SIO_MCR_RTS	0x02
+#define SIO_MCR_OUT2	0x08	/* Routes the interrupt to the PIC */
+
+/* Line Status Register bits */
+#define SIO_LSR_DR	0x01	/* Data ready */
+#define SIO_LSR_THRE	0x20	/* Transmit holding register empty */
+
+#define SIO_CLOCK_BAUD	115200	/* Baud rate with a divisor of 1 */
+#define SIO_FIFO_SIZE	16	/* Transmit FIFO of a 16550A */
+
 #endif /* __ANANAS_X86_SIO_H__ */
@@ -4,7 +4,17 @@
 #define SMP_IPI_FIRST		0xf0
 #define SMP_IPI_COUNT		4
 #define SMP_IPI_PANIC		0xf0	/* IPI used to trigger panic situation on other CPU's */
+#define SMP_IPI_TIMER		0xf1	/* Local APIC timer interrupt */
 #define SMP_IPI_SCHEDULE	0xf2	/* IPI used to trigger re-schedule */
+#define SMP_IPI_TLB		0xf3	/* IPI used to request TLB invalidation */
+
+/*
+ * Vectors handed out to message-signalled interrupts; the interrupt number is
+ * the vector itself. Every vector has a stub of X86_MSI_STUB_SIZE bytes.
+ */
+#define X86_MSI_FIRST		0x40
+#define X86_MSI_COUNT		64
+#define X86_MSI_STUB_SIZE	32
 
 #ifndef ASM
 struct X86_CPU {
@@ -50,6 +60,13 @@ void smp_prepare();
 void smp_prepare_config(struct X86_SMP_CONFIG* cfg);
 void smp_panic_others();
 void smp_broadcast_schedule();
+void smp_ipi_schedule_cpu(int cpuid);
+void smp_ipi_tlb_cpu(int cpuid);
+void smp_init_timer();
+void smp_start_timer();
+void smp_stop_timer();
+int smp_has_timer();
+void msi_init();
 #endif
 
 #endif /* __X86_SMP_H__ */
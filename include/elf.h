@@ -182,6 +182,8 @@ typedef struct {
 	Elf64_Half	st_shndx;		/* Section table index */
 	Elf64_Addr	st_value;		/* Symbol value */
 	Elf64_Xword	st_size;		/* Size of object (e.g., common) */
+#define ELF64_ST_BIND(i)   ((i)>>4)
+#define ELF64_ST_TYPE(i)   ((i)&0xf)
 } Elf64_Sym;
 
 typedef struct {
@@ -218,6 +220,16 @@ typedef struct {
 	Elf64_Addr	r_offset;		/* Address of reference */
 	Elf64_Xword	r_info;			/* Symbol index and type of relocation */
 	Elf64_Sxword	r_addend;		/* Constant part of expression */
+#define ELF64_R_SYM(i)		((i)>>32)
+#define ELF64_R_TYPE(i)		((i)&0xffffffffL)
+#define ELF64_R_INFO(s,t)	(((Elf64_Xword)(s)<<32)+((t)&0xffffffffL))
+#define R_X86_64_NONE		0		/* none */
+#define R_X86_64_64		1		/* S + A */
+#define R_X86_64_PC32		2		/* S + A - P */
+#define R_X86_64_COPY		5		/* none */
+#define R_X86_64_GLOB_DAT	6		/* S */
+#define R_X86_64_JUMP_SLOT	7		/* S */
+#define R_X86_64_RELATIVE	8		/* B + A */
 } Elf64_Rela;
 
 typedef struct {
@@ -294,6 +306,7 @@ typedef struct {
 #define DT_INIT_ARRAYSZ	27	/* Size, in bytes, of the array of initialization functions */
 #define DT_FINI_ARRAYSZ	28	/* Size, in bytes, of the array of termination functions */
 #define DT_LOOS		0x60000000 /* Defines a range of dynamic table tags for environment-specific use */
+#define DT_GNU_HASH	0x6ffffef5 /* Address of the GNU-style symbol hash table */
 #define DT_HIOS		0x6fffffff
 #define DT_LOPROC	0x70000000 /* Defines a range of dynamic table tags for processor-specific use */
 #define DT_HIPROC	0x7fffffff
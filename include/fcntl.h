@@ -14,6 +14,7 @@
 #define O_TRUNC		(1 << 6)
 #define O_CLOEXEC	(1 << 7)
 #define O_NONBLOCK	(1 << 8)
+#define O_DIRECT	(1 << 9)
 
 /* Internal use only */
 #define O_DIRECTORY	(1 << 31)
@@ -21,7 +21,7 @@ struct LOADER_MODULE {
 	uint64_t	mod_symtab_size;	/* symbol table length */
 	uint64_t	mod_strtab_addr;	/* string table address (physical) */
 	uint64_t	mod_strtab_size;	/* string table length */
-	struct LOADER_MODULE*	mod_next;	/* pointer to next module */
+	uint64_t	mod_next;		/* next module (physical), 0 if none */
 };
 
 #ifndef KERNEL
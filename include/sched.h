@@ -0,0 +1,34 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <machine/_types.h>
+#include <machine/_stddef.h>
+#include <ananas/_types/pid.h>
+#include <ananas/sched.h>
+
+struct sched_param {
+	int	sched_priority;
+};
+
+/* CPU sets for sched_setaffinity() and sched_getaffinity() */
+#define CPU_SETSIZE	64
+typedef struct {
+	cpumask_t	__bits;
+} cpu_set_t;
+
+#define CPU_ZERO(set)		((set)->__bits = 0)
+#define CPU_SET(cpu, set)	((set)->__bits |= (cpumask_t)1 << (cpu))
+#define CPU_CLR(cpu, set)	((set)->__bits &= ~((cpumask_t)1 << (cpu)))
+#define CPU_ISSET(cpu, set)	(((set)->__bits & ((cpumask_t)1 << (cpu))) != 0)
+
+/* A pid of 0 refers to the calling thread, others to the main thread of that process */
+int	sched_setscheduler(pid_t pid, int policy, const struct sched_param* param);
+int	sched_getscheduler(pid_t pid);
+int	sched_setparam(pid_t pid, const struct sched_param* param);
+int	sched_getparam(pid_t pid, struct sched_param* param);
+int	sched_get_priority_min(int policy);
+int	sched_get_priority_max(int policy);
+int	sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t* mask);
+int	sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t* mask);
+
+#endif /* __SCHED_H__ */
@@ -0,0 +1,35 @@
+#ifndef __SPAWN_H__
+#define __SPAWN_H__
+
+#include <machine/_types.h>
+#include <ananas/_types/mode.h>
+#include <ananas/_types/pid.h>
+
+struct SPAWN_ACTION;
+
+typedef struct {
+	int	__count;
+	int	__alloc;
+	struct SPAWN_ACTION* __actions;
+} posix_spawn_file_actions_t;
+
+/* No attributes are supported yet; flags must be zero */
+typedef struct {
+	short	__flags;
+} posix_spawnattr_t;
+
+int	posix_spawn(pid_t* pid, const char* path, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[]);
+int	posix_spawnp(pid_t* pid, const char* file, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[]);
+
+int	posix_spawn_file_actions_init(posix_spawn_file_actions_t* file_actions);
+int	posix_spawn_file_actions_destroy(posix_spawn_file_actions_t* file_actions);
+int	posix_spawn_file_actions_addclose(posix_spawn_file_actions_t* file_actions, int fildes);
+int	posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t* file_actions, int fildes, int newfildes);
+int	posix_spawn_file_actions_addopen(posix_spawn_file_actions_t* file_actions, int fildes, const char* path, int oflag, mode_t mode);
+
+int	posix_spawnattr_init(posix_spawnattr_t* attr);
+int	posix_spawnattr_destroy(posix_spawnattr_t* attr);
+int	posix_spawnattr_getflags(const posix_spawnattr_t* attr, short* flags);
+int	posix_spawnattr_setflags(posix_spawnattr_t* attr, short flags);
+
+#endif /* __SPAWN_H__ */
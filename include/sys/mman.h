@@ -24,7 +24,16 @@
 #define MCL_CURRENT	(1 << 0)
 #define MCL_FUTURE	(1 << 1)
 
+#define MADV_NORMAL	0
+#define MADV_RANDOM	1
+#define MADV_SEQUENTIAL	2
+#define MADV_WILLNEED	3
+#define MADV_DONTNEED	4	/* Release the pages; the range reads back as zeroes */
+#define MADV_FREE	5	/* Contents no longer needed; same as MADV_DONTNEED */
+
 void* mmap(void*, size_t, int, int, int, off_t);
 int munmap(void*, size_t);
+int msync(void*, size_t, int);
+int madvise(void*, size_t, int);
 
 #endif /* __SYS_MMAN_H__ */
@@ -0,0 +1,13 @@
+#ifndef __SYS_UIO_H__
+#define __SYS_UIO_H__
+
+#include <ananas/uio.h> /* for struct iovec */
+#include <ananas/_types/off.h>
+#include <ananas/_types/ssize.h>
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt);
+ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+
+#endif /* __SYS_UIO_H__ */
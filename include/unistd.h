@@ -31,6 +31,7 @@ ssize_t read(int fd, void* buf, size_t len);
 ssize_t write(int fd, const void* buf, size_t len);
 off_t	lseek(int fd, off_t offset, int whence);
 pid_t	fork(void);
+pid_t	vfork(void);
 int	close(int filedes);
 int	dup(int filedes);
 int	dup2(int filedes, int filedes2);
@@ -38,11 +39,15 @@ int	access(const char* path, int amode);
 uid_t	getuid(void);
 pid_t	getpid(void);
 pid_t	getppid(void);
+int	nice(int incr);
 gid_t	getgid(void);
 uid_t	geteuid(void);
 gid_t	getegid(void);
 int	getgroups(int gidsetsize, gid_t grouplist[]);
 int	fsync(int fildes);
+int	fdatasync(int fildes);
+void	sync(void);
+ssize_t copy_file_range(int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len, unsigned int flags);
 int	link(const char* path1, const char* path2);
 int	chdir(const char* path);
 int	fchdir(int fildes);
@@ -47,35 +47,66 @@ $AWK '
 #   #define SYSCALL_foo 1234
 #   void sys_foo(thread_t* curthread, int a, int b, int c);
 #
+# followed by SYSCALL_COUNT, which is one beyond the highest number in use.
+#
 $AWK '
 	BEGIN {
 		print "/* This file is automatically generated by gen_syscalls.sh - do not edit! */";
 		print "#ifdef KERNEL"
 		print " #define ARG_CURTHREAD thread_t* curthread,"
+		print " #define ARG_CURTHREAD_ONLY thread_t* curthread"
 		print "#else"
 		print " #define ARG_CURTHREAD"
+		print " #define ARG_CURTHREAD_ONLY void"
 		print "#endif"
 	}
 	/^#/ { next; }
 	/^[0-9]+/ {
 		print "#define SYSCALL_" substr($4, 1, index($4, "(") - 1) " "$1;
-		print $3 " sys_" substr($4, 1, index($4, "(")) "ARG_CURTHREAD " substr($0, index($0, "(") + 1, index($0, "}") - index($0, "(") - 1)
+		ARGLIST=substr($0, index($0, "(") + 1, index($0, "}") - index($0, "(") - 1)
+		if (ARGLIST ~ /^[ \t]*\)/)
+			print $3 " sys_" substr($4, 1, index($4, "(")) "ARG_CURTHREAD_ONLY" ARGLIST
+		else
+			print $3 " sys_" substr($4, 1, index($4, "(")) "ARG_CURTHREAD " ARGLIST
+		if ($1 + 1 > COUNT) COUNT = $1 + 1
+	}
+	END {
+		print "#define SYSCALL_COUNT " COUNT
 	}
 ' < $1 > $3
 
 #
 #
-# for the kernel, part 2, generate function calls. i.e.
+# for the kernel, part 2, generate wrappers which cast the raw register values
+# to the proper types, and a table of them indexed by syscall number. i.e.
 #
 #   1234 { void foo(int a, int b, int c); }
-#   4321 { errorcode_t bar(int a); }
+#   4321 { errorcode_t bar(int a); } frame
 #
 # becomes
 #
-#   case 1234: sys_foo(curthread, (int)a->arg1, (int)a->arg2, (int)a->arg3); return ananas_success();
-#   case 4321: return (errorcode_t)sys_bar(curthread, (int)a->arg1);
+#   static register_t
+#   perform_foo(thread_t* curthread, register_t a1, register_t a2, register_t a3, register_t, register_t)
+#   {
+#   	SYSCALL_ACCOUNT(curthread, 1234);
+#   	sys_foo(curthread, (int)a1, (int)a2, (int)a3);
+#   	return ananas_success();
+#   }
+#   (...)
+#   extern "C" const syscall_func_t syscall_table[SYSCALL_COUNT] = { ... };
+#   extern "C" const bool syscall_full_frame[SYSCALL_COUNT] = { ... };
+#   const char* const syscall_name[SYSCALL_COUNT] = { ... };
+#
+# SYSCALL_ACCOUNT() must be defined by the includer. Holes in the numbering
+# are filled with syscall_unsupported. A trailing
+# 'frame' marks syscalls which need the complete userland register set to be
+# saved upon entry; see syscall_handler in the amd64 interrupts.S.
 #
 $AWK '
+	BEGIN {
+		print "/* This file is automatically generated by gen_syscalls.sh - do not edit! */"
+		COUNT = 0
+	}
 	/^#/ { next; }
 	/^[0-9]+/ {
 		# get the function prototype, this is the part between { }
@@ -94,13 +125,48 @@ $AWK '
 			TYPE=""
 			for (i = 1; i < N; i++) TYPE=TYPE " " FIELD[i]
 			gsub(/^ /, "", TYPE)
-			ARGS = ARGS ",(" TYPE ")a->arg" x
+			ARGS = ARGS ", (" TYPE ")a" x
 		}
 
-		print "case "$1": "
-		if ($3 == "void")
-			print "\tsys_" FUNCNAME "(" ARGS "); return ananas_success();"
-		else
+		PARAMS="thread_t* curthread"
+		for (x = 1; x <= 5; x++) {
+			if (x <= numargs)
+				PARAMS = PARAMS ", register_t a" x
+			else
+				PARAMS = PARAMS ", register_t"
+		}
+
+		print "static register_t"
+		print "perform_" FUNCNAME "(" PARAMS ")"
+		print "{"
+		print "\tSYSCALL_ACCOUNT(curthread, " $1 + 0 ");"
+		if ($3 == "void") {
+			print "\tsys_" FUNCNAME "(" ARGS ");"
+			print "\treturn ananas_success();"
+		} else
 			print "\treturn (register_t)sys_" FUNCNAME "(" ARGS ");"
+		print "}"
+		print ""
+
+		FUNC[$1 + 0] = "perform_" FUNCNAME
+		NAME[$1 + 0] = FUNCNAME
+		FRAME[$1 + 0] = ($NF == "frame") ? "true" : "false"
+		if ($1 + 1 > COUNT) COUNT = $1 + 1
+	}
+	END {
+		print "extern \"C\" const syscall_func_t syscall_table[SYSCALL_COUNT] = {"
+		for (n = 0; n < COUNT; n++)
+			print "\t" ((n in FUNC) ? FUNC[n] : "syscall_unsupported") ","
+		print "};"
+		print ""
+		print "extern \"C\" const bool syscall_full_frame[SYSCALL_COUNT] = {"
+		for (n = 0; n < COUNT; n++)
+			print "\t" ((n in FRAME) ? FRAME[n] : "false") ","
+		print "};"
+		print ""
+		print "const char* const syscall_name[SYSCALL_COUNT] = {"
+		for (n = 0; n < COUNT; n++)
+			print "\t\"" ((n in NAME) ? NAME[n] : "?") "\","
+		print "};"
 	}
 ' < $1 > $4
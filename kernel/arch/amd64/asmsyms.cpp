@@ -4,6 +4,7 @@
 #include <machine/thread.h>
 #include <ananas/pcpu.h>
 #include <ananas/syscall.h>
+#include <ananas/syscalls.h>
 #include <ananas/asmsymbols.h>
 #include <ananas/x86/smp.h>
 
@@ -41,13 +42,7 @@ ASM_SYMBOL(PCPU_NESTEDIRQ, offsetof(struct PCPU, nested_irq));
 ASM_SYMBOL(PCPU_SYSCALLRSP, offsetof(struct PCPU, syscall_rsp));
 ASM_SYMBOL(PCPU_RSP0, offsetof(struct PCPU, rsp0));
 
-ASM_SYMBOL(SYSARG_NUM,	offsetof(struct SYSCALL_ARGS, number));
-ASM_SYMBOL(SYSARG_ARG1,	offsetof(struct SYSCALL_ARGS, arg1));
-ASM_SYMBOL(SYSARG_ARG2,	offsetof(struct SYSCALL_ARGS, arg2));
-ASM_SYMBOL(SYSARG_ARG3,	offsetof(struct SYSCALL_ARGS, arg3));
-ASM_SYMBOL(SYSARG_ARG4,	offsetof(struct SYSCALL_ARGS, arg4));
-ASM_SYMBOL(SYSARG_ARG5,	offsetof(struct SYSCALL_ARGS, arg5));
-ASM_SYMBOL(SYSARG_SIZE,	sizeof(struct SYSCALL_ARGS));
+ASM_SYMBOL(SYSCALL_TABLE_SIZE,	SYSCALL_COUNT);
 
 ASM_SYMBOL(SMP_CPU_OFFSET,	offsetof(struct X86_SMP_CONFIG, cfg_cpu));
 ASM_SYMBOL(SMP_NUM_CPUS,	offsetof(struct X86_SMP_CONFIG, cfg_num_cpus));
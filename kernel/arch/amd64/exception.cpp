@@ -1,4 +1,5 @@
 #include <ananas/types.h>
+#include <machine/fpu.h>
 #include <machine/frame.h>
 #include <machine/interrupts.h>
 #include <machine/thread.h>
@@ -16,10 +17,32 @@
 #include <ananas/vmspace.h>
 #include <ananas/lib.h>
 #include <ananas/gdb.h>
+#include <ananas/profile.h>
 #include "options.h"
 
+/* Instructions which may fault on userland memory, and where to continue if they do; see usercopy.S */
+struct EXTABLE_ENTRY {
+	addr_t	ex_insn;
+	addr_t	ex_fixup;
+};
+
+extern const struct EXTABLE_ENTRY __extable_begin, __extable_end;
+
 namespace {
 
+/* Makes a kernel fault at an instruction in the exception table continue at its fixup */
+bool
+extable_fixup(struct STACKFRAME* sf)
+{
+	for (const struct EXTABLE_ENTRY* ex = &__extable_begin; ex < &__extable_end; ex++) {
+		if (ex->ex_insn != sf->sf_rip)
+			continue;
+		sf->sf_rip = ex->ex_fixup;
+		return true;
+	}
+	return false;
+}
+
 int
 map_trapno_to_signal(int trapno)
 {
@@ -54,22 +77,10 @@ exception_nm(struct STACKFRAME* sf)
 	/*
 	 * This is the Device Not Available-exception, which will be triggered if
 	 * an FPU access is made while the task-switched-flag is set. We will
-	 * obtain the FPU state and bind it to the thread.
-	 */
-	thread_t* thread = PCPU_GET(curthread);
-	KASSERT(thread != NULL, "curthread is NULL");
-	PCPU_SET(fpu_context, &thread->md_fpu_ctx);
-
-	/*
-	 * Clear the task-switched-flag; this is what triggered this exception in
-	 * the first place. Afterwards, we can safely restore the FPU context and
-	 * continue. The next instruction will no longer cause an exception, and
-	 * the new context will be saved by the scheduler IRQ.
+	 * obtain the FPU state and bind it to the thread; it is saved once the
+	 * thread is switched out.
 	 */
-	__asm(
-			"clts\n"
-			"frstor (%%rax)\n"
-		: : "a" (&thread->md_fpu_ctx));
+	fpu_trap();
 }
 
 void
@@ -127,7 +138,8 @@ exception_pf(struct STACKFRAME* sf)
 		flags |= VM_FLAG_WRITE;
 	else
 		flags |= VM_FLAG_READ;
-	if ((sf->sf_errnum & EXC_PF_FLAG_P) == 0) { /* page not present */
+	/* Handle non-present pages and writes to read-only pages; these may be copy-on-write */
+	if ((sf->sf_errnum & EXC_PF_FLAG_P) == 0 || (flags & VM_FLAG_WRITE)) {
 		thread_t* curthread = PCPU_GET(curthread);
 		if (curthread != NULL && curthread->t_process != NULL) {
 			errorcode_t err = vmspace_handle_fault(curthread->t_process->p_vmspace, fault_addr, flags);
@@ -136,6 +148,10 @@ exception_pf(struct STACKFRAME* sf)
 		}
 	}
 
+	/* The copy routines deal with userland memory that is not there */
+	if ((sf->sf_cs & 3) != SEG_DPL_USER && extable_fixup(sf))
+		return;
+
 	/* Either not in userland or couldn't be handled; chain through */
 	exception_generic(sf);
 }
@@ -161,21 +177,48 @@ exception(struct STACKFRAME* sf)
 extern "C" void
 interrupt_handler(struct STACKFRAME* sf)
 {
+	/* Interrupts may nest, so restore whatever frame was there before */
+	void* prev_frame = PCPU_GET(irq_frame);
+	PCPU_SET(irq_frame, sf);
 	irq_handler(sf->sf_trapno);
+	PCPU_SET(irq_frame, prev_frame);
 }
 
-extern "C" void
-amd64_syscall(struct STACKFRAME* sf)
+#ifdef OPTION_PROFILE
+unsigned int
+md_profile_callchain(addr_t* pc, unsigned int max, bool& user)
 {
-	struct SYSCALL_ARGS sa;
-	sa.number = sf->sf_rax;
-	sa.arg1 = sf->sf_rdi;
-	sa.arg2 = sf->sf_rsi;
-	sa.arg3 = sf->sf_rdx;
-	sa.arg4 = sf->sf_r10;
-	sa.arg5 = sf->sf_r8;
-	/*sa.arg6 = sf->sf_r9;*/
-	sf->sf_rax = syscall(&sa);
+	auto sf = static_cast<struct STACKFRAME*>(PCPU_GET(irq_frame));
+	if (sf == NULL || max == 0)
+		return 0;
+
+	/* Userland stacks may not be mapped, so we do not venture there */
+	pc[0] = sf->sf_rip;
+	user = sf->sf_cs != GDT_SEL_KERNEL_CODE;
+	if (user)
+		return 1;
+
+	/*
+	 * Follow the %rbp chain, but only as long as it stays within the kernel
+	 * stack of the current thread and moves upwards; anything else means we
+	 * hit code without a frame pointer.
+	 */
+	thread_t* curthread = PCPU_GET(curthread);
+	addr_t stack_lo = (addr_t)curthread->md_kstack;
+	addr_t stack_hi = stack_lo + KERNEL_STACK_SIZE - 2 * sizeof(addr_t);
+	addr_t fp = sf->sf_rbp;
+	unsigned int n = 1;
+	while (n < max && fp >= stack_lo && fp <= stack_hi && (fp & (sizeof(addr_t) - 1)) == 0) {
+		auto frame = reinterpret_cast<addr_t*>(fp);
+		if (frame[1] == 0)
+			break;
+		pc[n++] = frame[1];
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+	return n;
 }
+#endif
 
 /* vim:set ts=2 sw=2: */
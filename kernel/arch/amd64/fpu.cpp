@@ -0,0 +1,237 @@
+/*
+ * FPU/SSE/AVX context handling.
+ *
+ * Saving and restoring the extended state on every context switch is costly,
+ * and most threads never touch it. Instead, we set CR0.TS whenever a thread is
+ * switched in, so its first FPU instruction raises the Device Not Available
+ * exception; only then is its state restored and is the thread marked as the
+ * FPU owner of the CPU. Only the owner's state needs to be saved when it is
+ * switched out.
+ *
+ * Threads which keep using the FPU would take that exception every time they
+ * run, so once a thread has used it for FPU_EAGER_THRESHOLD consecutive
+ * timeslices we restore its state as part of the switch. The counter is
+ * allowed to wrap, which makes us re-check whether eager restoring still pays
+ * off every now and then.
+ *
+ * If the CPU supports it, everything XCR0 covers is handled by XSAVE/XRSTOR,
+ * where XSAVEOPT avoids writing components that weren't changed since they
+ * were restored; otherwise we fall back to FXSAVE/FXRSTOR. Ownership never
+ * survives a context switch, so there is no need to chase state on other
+ * CPUs.
+ */
+#include <ananas/types.h>
+#include <machine/fpu.h>
+#include <machine/interrupts.h>
+#include <machine/macro.h>
+#include <machine/thread.h>
+#include <machine/vm.h>
+#include <ananas/lib.h>
+#include <ananas/mm.h>
+#include <ananas/pcpu.h>
+#include <ananas/thread.h>
+
+/* Consecutive timeslices of FPU use before we restore the state eagerly */
+#define FPU_EAGER_THRESHOLD	5
+
+/* XSAVE/FXSAVE need a 64/16 byte aligned area */
+#define FPU_AREA_ALIGN		64
+
+/* FXSAVE area size, which is also where the XSAVE header starts */
+#define FPU_FXSAVE_SIZE		512
+
+/* XCR0 state components */
+#define XCR0_X87		(1 << 0)
+#define XCR0_SSE		(1 << 1)
+#define XCR0_AVX		(1 << 2)
+
+#define FPU_INIT_FCW		0x37f	/* as set by finit */
+#define FPU_INIT_MXCSR		0x1f80	/* all exceptions masked */
+
+namespace {
+
+bool fpu_use_xsave = false;
+bool fpu_use_xsaveopt = false;
+uint64_t fpu_xcr0 = 0;
+size_t fpu_area_size = FPU_FXSAVE_SIZE;
+
+inline void
+fpu_clts()
+{
+	__asm __volatile("clts");
+}
+
+inline void
+fpu_set_ts()
+{
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+inline void
+fpu_save(struct FPUREGS* area)
+{
+	uint32_t lo = fpu_xcr0 & 0xffffffff, hi = fpu_xcr0 >> 32;
+	if (fpu_use_xsaveopt)
+		__asm __volatile("xsaveopt64 (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else if (fpu_use_xsave)
+		__asm __volatile("xsave64 (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		__asm __volatile("fxsave64 (%0)" : : "r" (area) : "memory");
+}
+
+inline void
+fpu_restore(struct FPUREGS* area)
+{
+	uint32_t lo = fpu_xcr0 & 0xffffffff, hi = fpu_xcr0 >> 32;
+	if (fpu_use_xsave)
+		__asm __volatile("xrstor64 (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		__asm __volatile("fxrstor64 (%0)" : : "r" (area) : "memory");
+}
+
+} // unnamed namespace
+
+void
+fpu_init()
+{
+	/* Native FPU error reporting, no emulation and trap on first use */
+	write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if ((ecx & CPUID_1_ECX_XSAVE) == 0)
+		return; /* FXSAVE it is */
+	bool have_avx = (ecx & CPUID_1_ECX_AVX) != 0;
+
+	/*
+	 * Only enable the components we know to be safe to hand to userland; the
+	 * AVX-512 and supervisor components would need extra care.
+	 */
+	uint32_t xcr0_supported;
+	cpuid(0xd, 0, &xcr0_supported, &ebx, &ecx, &edx);
+	uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+	if (have_avx && (xcr0_supported & XCR0_AVX))
+		xcr0 |= XCR0_AVX;
+
+	write_cr4(read_cr4() | CR4_OSXSAVE);
+	__asm __volatile("xsetbv" : : "c" (0), "a" ((uint32_t)xcr0), "d" ((uint32_t)(xcr0 >> 32)));
+
+	/* %ebx now holds the size needed for the components enabled in XCR0 */
+	cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+	fpu_area_size = ebx;
+	fpu_xcr0 = xcr0;
+	fpu_use_xsave = true;
+
+	cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+	fpu_use_xsaveopt = (eax & CPUID_D1_EAX_XSAVEOPT) != 0;
+}
+
+void
+fpu_thread_init(thread_t* t)
+{
+	t->md_fpu_mem = kmalloc(fpu_area_size + FPU_AREA_ALIGN - 1);
+	t->md_fpu_ctx = reinterpret_cast<struct FPUREGS*>(ROUND_UP((addr_t)t->md_fpu_mem, FPU_AREA_ALIGN));
+	t->md_fpu_counter = 0;
+
+	memset(t->md_fpu_ctx, 0, fpu_area_size);
+	t->md_fpu_ctx->fcw = FPU_INIT_FCW;
+	t->md_fpu_ctx->mxcsr = FPU_INIT_MXCSR;
+	if (fpu_use_xsave) {
+		/* XSTATE_BV: take x87/SSE from the area, the rest from the init state */
+		auto xstate_bv = reinterpret_cast<uint64_t*>((char*)t->md_fpu_ctx + FPU_FXSAVE_SIZE);
+		*xstate_bv = XCR0_X87 | XCR0_SSE;
+	}
+}
+
+void
+fpu_thread_clone(thread_t* t, thread_t* parent)
+{
+	KASSERT(t->md_fpu_ctx != NULL && parent->md_fpu_ctx != NULL, "cloning without fpu state");
+
+	/* The parent may hold newer state in the registers than in its area */
+	int state = md_interrupts_save_and_disable();
+	if (PCPU_GET(fpu_context) == parent->md_fpu_ctx)
+		fpu_save(parent->md_fpu_ctx);
+	memcpy(t->md_fpu_ctx, parent->md_fpu_ctx, fpu_area_size);
+	md_interrupts_restore(state);
+}
+
+void
+fpu_thread_free(thread_t* t)
+{
+	if (t->md_fpu_mem != NULL)
+		kfree(t->md_fpu_mem);
+	t->md_fpu_mem = NULL;
+	t->md_fpu_ctx = NULL;
+}
+
+void
+fpu_thread_switch(thread_t* new_thread, thread_t* old_thread)
+{
+	/* Only the thread we are leaving can own the FPU; CR0.TS is clear if it does */
+	auto owner = static_cast<struct FPUREGS*>(PCPU_GET(fpu_context));
+	if (owner != NULL) {
+		KASSERT(owner == old_thread->md_fpu_ctx, "fpu owned by %p, not the current thread", owner);
+		fpu_save(owner);
+		old_thread->md_fpu_counter++;
+	} else {
+		old_thread->md_fpu_counter = 0;
+	}
+
+	if (new_thread->md_fpu_ctx != NULL && new_thread->md_fpu_counter >= FPU_EAGER_THRESHOLD) {
+		if (owner == NULL)
+			fpu_clts();
+		fpu_restore(new_thread->md_fpu_ctx);
+		PCPU_SET(fpu_context, new_thread->md_fpu_ctx);
+		return;
+	}
+
+	if (owner != NULL) {
+		fpu_set_ts();
+		PCPU_SET(fpu_context, NULL);
+	}
+}
+
+void
+fpu_trap()
+{
+	thread_t* thread = PCPU_GET(curthread);
+	KASSERT(thread != NULL, "curthread is NULL");
+	if (thread->md_fpu_ctx == NULL)
+		panic("thread %p used the fpu without fpu_kernel_begin()", thread);
+
+	/*
+	 * Clear the task-switched-flag; this is what triggered this exception in
+	 * the first place. We must not be switched out between that and taking
+	 * ownership, as the next thread would be able to use our registers.
+	 */
+	int state = md_interrupts_save_and_disable();
+	fpu_clts();
+	fpu_restore(thread->md_fpu_ctx);
+	PCPU_SET(fpu_context, thread->md_fpu_ctx);
+	md_interrupts_restore(state);
+}
+
+int
+fpu_kernel_begin()
+{
+	int state = md_interrupts_save_and_disable();
+	auto owner = static_cast<struct FPUREGS*>(PCPU_GET(fpu_context));
+	if (owner != NULL) {
+		/* The owner will trap and restore once it needs the FPU again */
+		fpu_save(owner);
+		PCPU_SET(fpu_context, NULL);
+	} else {
+		fpu_clts();
+	}
+	return state;
+}
+
+void
+fpu_kernel_end(int state)
+{
+	fpu_set_ts();
+	md_interrupts_restore(state);
+}
+
+/* vim:set ts=2 sw=2: */
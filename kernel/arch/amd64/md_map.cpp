@@ -1,49 +1,355 @@
 #include <ananas/types.h>
 #include <machine/vm.h>
 #include <machine/param.h>
+#include <machine/interrupts.h>
+#include <machine/macro.h>
 #include <ananas/mm.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
 #include <ananas/kmem.h>
 #include <ananas/lib.h>
+#include <ananas/page.h>
 #include <ananas/pcpu.h>
 #include <ananas/process.h>
 #include <ananas/thread.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
+#include <ananas/x86/smp.h>
+#include "options.h"
 
 extern uint64_t* kernel_pagedir;
+extern addr_t direct_map_end;
+
+#define PAGES_PER_LARGE_PAGE	(LARGE_PAGE_SIZE / PAGE_SIZE)
+#define PTE_PAT			(1ULL << 7)	/* PAT bit of a 4KB page; PE_PAT is for large pages */
+
+/*
+ * Page tables of vmspaces come and go with every process, so each CPU keeps a
+ * few zeroed pages around for them. A vmspace which is destroyed hands all its
+ * tables back at once; they are cleared here, as that is cheap while they are
+ * still in the cache, rather than by whoever needs a table next. The cache is
+ * only touched with interrupts disabled, which keeps us on the CPU it belongs
+ * to.
+ */
+#define PT_CACHE_MAX	32
+
+static struct PAGE_RECLAIMER pt_cache_reclaimer;
+
+struct PAGE*
+md_pt_alloc()
+{
+	struct PAGE* p = NULL;
+	register_t state = md_interrupts_save_and_disable();
+	struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+	if (pcpu != NULL && !LIST_EMPTY(&pcpu->pt_cache)) {
+		p = LIST_HEAD(&pcpu->pt_cache);
+		LIST_POP_HEAD(&pcpu->pt_cache);
+		pcpu->pt_cache_count--;
+	}
+	md_interrupts_restore(state);
+	if (p == NULL)
+		p = page_alloc_zeroed();
+	return p;
+}
+
+void
+md_pt_free_list(struct page_list* pages)
+{
+	while (!LIST_EMPTY(pages)) {
+		struct PAGE* p = LIST_HEAD(pages);
+		LIST_POP_HEAD(pages);
+
+		register_t state = md_interrupts_save_and_disable();
+		struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+		bool cached = pcpu != NULL && pcpu->pt_cache_count < PT_CACHE_MAX;
+		if (cached) {
+			memzero_pages(reinterpret_cast<void*>(PTOKV(page_get_paddr(p))), PAGE_SIZE, 0);
+			LIST_PREPEND(&pcpu->pt_cache, p);
+			pcpu->pt_cache_count++;
+		}
+		md_interrupts_restore(state);
+		if (!cached)
+			page_free(p);
+	}
+}
+
+static unsigned int
+pt_cache_reclaim(unsigned int num_pages)
+{
+	/* We can only get at the cache of the current CPU */
+	unsigned int num_freed = 0;
+	while (num_freed < num_pages) {
+		register_t state = md_interrupts_save_and_disable();
+		struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+		struct PAGE* p = NULL;
+		if (pcpu != NULL && !LIST_EMPTY(&pcpu->pt_cache)) {
+			p = LIST_HEAD(&pcpu->pt_cache);
+			LIST_POP_HEAD(&pcpu->pt_cache);
+			pcpu->pt_cache_count--;
+		}
+		md_interrupts_restore(state);
+		if (p == NULL)
+			break;
+		page_free(p);
+		num_freed++;
+	}
+	return num_freed;
+}
+
+static errorcode_t
+pt_cache_init()
+{
+	pt_cache_reclaimer.pr_name = "pagetables";
+	pt_cache_reclaimer.pr_func = pt_cache_reclaim;
+	page_register_reclaimer(&pt_cache_reclaimer);
+	return ananas_success();
+}
+
+INIT_FUNCTION(pt_cache_init, SUBSYSTEM_BIO, ORDER_FIRST);
+
+static struct PAGE*
+pt_alloc(vmspace_t* vs, uint64_t page_flags)
+{
+	KASSERT(vs != NULL || (page_flags & PE_C_G) != 0, "unmapped page while mapping kernel pages?");
+	struct PAGE* p = (page_flags & PE_C_G) ? page_alloc_zeroed() : md_pt_alloc();
+	KASSERT(p != NULL, "out of pages");
+	return p;
+}
+
+/*
+ * If the page isn't mapped globally, it belongs to a thread and we should
+ * administer it there so we can free it once the thread is freed. Faults in
+ * different areas of the vmspace may add tables at the same time.
+ */
+static void
+pt_adopt(vmspace_t* vs, struct PAGE* p, uint64_t page_flags)
+{
+	if (page_flags & PE_C_G)
+		return;
+	spinlock_lock(&vs->vs_md_pt_lock);
+	LIST_APPEND(&vs->vs_pages, p);
+	spinlock_unlock(&vs->vs_md_pt_lock);
+}
 
 static addr_t
 get_nextpage(vmspace_t* vs, uint64_t page_flags)
 {
-	KASSERT(vs != NULL, "unmapped page while mapping kernel pages?");
-	struct PAGE* p = page_alloc_single();
-	KASSERT(p != NULL, "out of pages");
+	struct PAGE* p = pt_alloc(vs, page_flags);
+	pt_adopt(vs, p, page_flags);
 
-	/*
-	 * If the page isn't mapped globally, it belongs to a thread and we should
-	 * administer it there so we can free it once the thread is freed.
-	 */
-	if ((page_flags & PE_C_G) == 0)
-		LIST_APPEND(&vs->vs_pages, p);
+	/* The page is already cleared; we'll access it using the direct map */
+	return page_get_paddr(p) | page_flags;
+}
+
+/*
+ * Returns the entry at *entry, which refers to the next level of tables; one
+ * is added if there is none yet. Faults in different areas of a vmspace can
+ * race to add the same table, as only the pages they map are theirs; whoever
+ * loses simply hands its page back.
+ */
+static uint64_t
+pt_install(vmspace_t* vs, uint64_t* entry, uint64_t page_flags)
+{
+	uint64_t cur = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+	if (cur != 0)
+		return cur;
 
-	/* Map this page in kernel-space XXX How do we clean it up? */
-	addr_t phys = page_get_paddr(p);
-	void* va = kmem_map(phys, PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
-	memset(va, 0, PAGE_SIZE);
-	return phys | page_flags;
+	struct PAGE* p = pt_alloc(vs, page_flags);
+	uint64_t new_entry = page_get_paddr(p) | page_flags;
+	if (!__atomic_compare_exchange_n(entry, &cur, new_entry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		page_free(p);
+		return cur;
+	}
+	pt_adopt(vs, p, page_flags);
+	return new_entry;
 }
 
 static inline uint64_t*
 pt_resolve_addr(uint64_t entry)
 {
 #define ADDR_MASK 0xffffffffff000 /* bits 12 .. 51 */
+#define LARGE_ADDR_MASK 0xfffffffe00000 /* bits 21 .. 51 */
 	return (uint64_t*)(KMEM_DIRECT_VA_START + (entry & ADDR_MASK));
 }
 
+/*
+ * TLB shootdown: once mappings change, every CPU that may have cached the old
+ * ones must invalidate them. For a vmspace, these are the CPUs currently using
+ * it (vs_md_cpus); those which ran it before will flush its PCID once they
+ * switch back, as we bump vs_md_tlb_gen. Kernel mappings are global, so they
+ * concern every CPU.
+ *
+ * Only one shootdown request is in flight at a time; CPUs waiting to send one
+ * handle any request aimed at them meanwhile, so that two CPUs shooting at each
+ * other cannot deadlock.
+ */
+#define TLB_FLUSH_ALL_PAGES	32	/* Flush everything rather than invalidating more pages */
+
+static uint32_t tlb_cpus_online = 1;	/* The BSP */
+
+#ifdef OPTION_SMP
+static struct TLB_SHOOTDOWN {
+	vmspace_t* ts_vs;		/* NULL for kernel mappings */
+	addr_t ts_start, ts_end;
+	uint32_t ts_pending;		/* CPUs which have yet to invalidate */
+} tlb_shootdown_req;
+static uint32_t tlb_shootdown_busy;
+#endif
+
+/* Invalidates [start, end) of vs on the current CPU; interrupts must be disabled */
+static void
+tlb_invalidate_local(vmspace_t* vs, addr_t start, addr_t end)
+{
+	if (vs != NULL && (__atomic_load_n(&vs->vs_md_cpus, __ATOMIC_SEQ_CST) & (1 << PCPU_GET(cpuid))) == 0)
+		return; /* not in use here; it'll be flushed when it is */
+
+	if ((end - start) / PAGE_SIZE > TLB_FLUSH_ALL_PAGES) {
+		if (vs != NULL) {
+			write_cr3(read_cr3()); /* drops all non-global entries of the current PCID */
+		} else {
+			uint64_t cr4 = read_cr4();
+			write_cr4(cr4 & ~CR4_PGE); /* toggling PGE drops everything */
+			write_cr4(cr4);
+		}
+		return;
+	}
+	for (addr_t virt = start; virt < end; virt += PAGE_SIZE)
+		__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
+}
+
 void
-md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
+md_tlb_shootdown_ipi()
+{
+#ifdef OPTION_SMP
+	uint32_t cpu_bit = 1 << PCPU_GET(cpuid);
+	if ((__atomic_load_n(&tlb_shootdown_req.ts_pending, __ATOMIC_ACQUIRE) & cpu_bit) == 0)
+		return; /* already handled while waiting to send our own */
+	tlb_invalidate_local(tlb_shootdown_req.ts_vs, tlb_shootdown_req.ts_start, tlb_shootdown_req.ts_end);
+	__atomic_and_fetch(&tlb_shootdown_req.ts_pending, ~cpu_bit, __ATOMIC_RELEASE);
+#endif
+}
+
+void
+md_tlb_cpu_online()
+{
+	__atomic_or_fetch(&tlb_cpus_online, 1 << PCPU_GET(cpuid), __ATOMIC_SEQ_CST);
+
+	/*
+	 * The AP's come up while the BSP keeps changing kernel mappings; anything
+	 * changed before we were marked online was not shot down here, so drop
+	 * everything we may have picked up.
+	 */
+	register_t state = md_interrupts_save_and_disable();
+	tlb_invalidate_local(NULL, 0, (TLB_FLUSH_ALL_PAGES + 1) * PAGE_SIZE);
+	md_interrupts_restore(state);
+}
+
+/* Invalidates [start, end) of vs on every CPU that may have it cached */
+static void
+tlb_shootdown(vmspace_t* vs, addr_t start, addr_t end)
+{
+	if (vs != NULL)
+		__atomic_add_fetch(&vs->vs_md_tlb_gen, 1, __ATOMIC_SEQ_CST);
+
+	register_t state = md_interrupts_save_and_disable();
+	tlb_invalidate_local(vs, start, end);
+#ifdef OPTION_SMP
+	uint32_t cpu_bit = 1 << PCPU_GET(cpuid);
+	uint32_t targets = __atomic_load_n((vs != NULL) ? &vs->vs_md_cpus : &tlb_cpus_online, __ATOMIC_SEQ_CST) & ~cpu_bit;
+	if (targets != 0) {
+		while (__atomic_exchange_n(&tlb_shootdown_busy, 1, __ATOMIC_ACQUIRE) != 0) {
+			md_tlb_shootdown_ipi();
+			md_cpu_pause();
+		}
+
+		tlb_shootdown_req.ts_vs = vs;
+		tlb_shootdown_req.ts_start = start;
+		tlb_shootdown_req.ts_end = end;
+		__atomic_store_n(&tlb_shootdown_req.ts_pending, targets, __ATOMIC_RELEASE);
+		for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++)
+			if (targets & (1 << n))
+				smp_ipi_tlb_cpu(n);
+		while (__atomic_load_n(&tlb_shootdown_req.ts_pending, __ATOMIC_ACQUIRE) != 0)
+			md_cpu_pause();
+
+		__atomic_store_n(&tlb_shootdown_busy, 0, __ATOMIC_RELEASE);
+	}
+#endif
+	md_interrupts_restore(state);
+}
+
+/* Called once [start, end) of vs has changed; batches the invalidation if possible */
+static void
+tlb_invalidate(vmspace_t* vs, addr_t start, addr_t end)
+{
+	thread_t* curthread = PCPU_GET(curthread);
+	if (curthread != NULL && curthread->md_tlb_batch > 0 && curthread->md_tlb_vs == vs) {
+		if (curthread->md_tlb_start == curthread->md_tlb_end) {
+			curthread->md_tlb_start = start;
+			curthread->md_tlb_end = end;
+		} else {
+			if (curthread->md_tlb_start > start)
+				curthread->md_tlb_start = start;
+			if (curthread->md_tlb_end < end)
+				curthread->md_tlb_end = end;
+		}
+		return;
+	}
+	tlb_shootdown(vs, start, end);
+}
+
+void
+md_tlb_batch_begin(vmspace_t* vs)
+{
+	thread_t* curthread = PCPU_GET(curthread);
+	if (curthread->md_tlb_batch++ > 0) {
+		KASSERT(curthread->md_tlb_vs == vs, "nested batch for different vmspace");
+		return;
+	}
+	curthread->md_tlb_vs = vs;
+	curthread->md_tlb_start = 0;
+	curthread->md_tlb_end = 0;
+}
+
+void
+md_tlb_batch_end()
+{
+	thread_t* curthread = PCPU_GET(curthread);
+	KASSERT(curthread->md_tlb_batch > 0, "not batching");
+	if (--curthread->md_tlb_batch > 0)
+		return;
+	if (curthread->md_tlb_start != curthread->md_tlb_end)
+		tlb_shootdown(curthread->md_tlb_vs, curthread->md_tlb_start, curthread->md_tlb_end);
+	curthread->md_tlb_vs = NULL;
+}
+
+/*
+ * Replaces the large page in *pde by a page table which maps the same memory
+ * using 4KB pages, so that individual pages can be changed.
+ */
+static void
+split_large_page(vmspace_t* vs, uint64_t* pde, addr_t virt, uint64_t pd_flags)
+{
+	uint64_t entry = *pde;
+	addr_t phys = entry & LARGE_ADDR_MASK;
+	uint64_t flags = entry & ~(ADDR_MASK | PE_PS);
+	if (entry & PE_PAT)
+		flags |= PTE_PAT;
+
+	uint64_t new_pde = get_nextpage(vs, pd_flags);
+	uint64_t* pte = pt_resolve_addr(new_pde);
+	for (unsigned int n = 0; n < PAGES_PER_LARGE_PAGE; n++)
+		pte[n] = (phys + n * PAGE_SIZE) | flags;
+
+	/* The translations are unchanged, but the large TLB entry must go */
+	*pde = new_pde;
+	__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
+}
+
+/* Converts VM_FLAG_... to the flags for the mapped pages themselves */
+static inline uint64_t
+pt_flags_for(int flags)
 {
-	/* Flags for the mapped pages themselves */
 	uint64_t pt_flags = 0;
 	if (flags & VM_FLAG_READ)
 		pt_flags |= PE_P;	/* XXX */
@@ -55,16 +361,23 @@ md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flag
 		pt_flags |= PE_PCD | PE_PWT;
 	if ((flags & VM_FLAG_EXECUTE) == 0)
 		pt_flags |= PE_NX;
+	return pt_flags;
+}
+
+void
+md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
+{
+	/* Flags for the mapped pages themselves */
+	uint64_t pt_flags = pt_flags_for(flags);
 
 	/* Flags for the page-directory leading up to the mapped page */
 	uint64_t pd_flags = PE_US | PE_P | PE_RW;
 
 	/* XXX we don't yet strip off bits 52-63 yet */
 	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
-	while(num_pages--) {
-		if (pagedir[(virt >> 39) & 0x1ff] == 0) {
-			pagedir[(virt >> 39) & 0x1ff] = get_nextpage(vs, pd_flags);
-		}
+	addr_t inval_start = 0, inval_end = 0; /* changed present mappings */
+	while(num_pages > 0) {
+		uint64_t pml4e = pt_install(vs, &pagedir[(virt >> 39) & 0x1ff], pd_flags);
 
 		/*
 		 * XXX We only look at the top level pagetable flags to determine whether
@@ -72,41 +385,139 @@ md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flag
 		 *     (KVA, kernel) where this should happen are pre-allocated in startup.c
 		 *     and thus thee is no need to look further...
 		 */
-		if (pagedir[(virt >> 39) & 0x1ff] & PE_C_G) {
+		if (pml4e & PE_C_G) {
 			pd_flags |= PE_C_G;
 			pt_flags |= PE_G;
 		}
 
-		uint64_t* pdpe = pt_resolve_addr(pagedir[(virt >> 39) & 0x1ff]);
-		if (pdpe[(virt >> 30) & 0x1ff] == 0) {
-			pdpe[(virt >> 30) & 0x1ff] = get_nextpage(vs, pd_flags);
+		uint64_t* pdpe = pt_resolve_addr(pml4e);
+		uint64_t* pde = &pt_resolve_addr(pt_install(vs, &pdpe[(virt >> 30) & 0x1ff], pd_flags))[(virt >> 21) & 0x1ff];
+		if (*pde == 0 && ((virt | phys) & (LARGE_PAGE_SIZE - 1)) == 0 && num_pages >= PAGES_PER_LARGE_PAGE) {
+			/*
+			 * Aligned and covering a whole large page; map it as such (if nothing is
+			 * to be present, leave the entry empty so it can still become one)
+			 */
+			if (pt_flags & PE_P)
+				*pde = (uint64_t)phys | pt_flags | PE_PS;
+			virt += LARGE_PAGE_SIZE; phys += LARGE_PAGE_SIZE;
+			num_pages -= PAGES_PER_LARGE_PAGE;
+			continue;
 		}
 
-		uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-		if (pde[(virt >> 21) & 0x1ff] == 0) {
-			pde[(virt >> 21) & 0x1ff] = get_nextpage(vs, pd_flags);
+		if (*pde & PE_PS) {
+			/*
+			 * Already part of a large page; if it maps what we want, skip the rest
+			 * of it - otherwise, it must be split so we can change this page.
+			 */
+			addr_t large_offset = virt & (LARGE_PAGE_SIZE - 1);
+			if ((*pde & LARGE_ADDR_MASK) + large_offset == phys &&
+			    (*pde & ~(LARGE_ADDR_MASK | PE_PS | PE_A | PE_D)) == pt_flags) {
+				size_t n = (LARGE_PAGE_SIZE - large_offset) / PAGE_SIZE;
+				if (n > num_pages)
+					n = num_pages;
+				virt += n * PAGE_SIZE; phys += n * PAGE_SIZE;
+				num_pages -= n;
+				continue;
+			}
+			split_large_page(vs, pde, virt, pd_flags);
 		}
 
-		// Ensure we'll flush the mapping if it was already present - it may be in the TLB
-		uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-		bool need_invalidate = (pte[(virt >> 12) & 0x1ff] & PE_P) != 0;
-		pte[(virt >> 12) & 0x1ff] = (uint64_t)phys | pt_flags;
-		if (need_invalidate)
-			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
+		/*
+		 * Fill as much of this page table as we can before walking the tables
+		 * again. Ensure we'll flush the mappings that were already present - they
+		 * may be in a TLB.
+		 */
+		uint64_t* pte = pt_resolve_addr(pt_install(vs, pde, pd_flags));
+		do {
+			bool need_invalidate = (pte[(virt >> 12) & 0x1ff] & PE_P) != 0;
+			pte[(virt >> 12) & 0x1ff] = (uint64_t)phys | pt_flags;
+			if (need_invalidate) {
+				if (inval_start == inval_end)
+					inval_start = virt;
+				inval_end = virt + PAGE_SIZE;
+			}
 
-		virt += PAGE_SIZE; phys += PAGE_SIZE;
+			virt += PAGE_SIZE; phys += PAGE_SIZE;
+			num_pages--;
+		} while (num_pages > 0 && (virt & (LARGE_PAGE_SIZE - 1)) != 0);
 	}
+	if (inval_start != inval_end)
+		tlb_invalidate(vs, inval_start, inval_end);
+}
+
+/* Returns the page table which maps virt, or NULL if there is none */
+static uint64_t*
+pt_lookup(vmspace_t* vs, addr_t virt)
+{
+	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
+	uint64_t entry = pagedir[(virt >> 39) & 0x1ff];
+	if (entry == 0)
+		return NULL;
+	entry = pt_resolve_addr(entry)[(virt >> 30) & 0x1ff];
+	if (entry == 0)
+		return NULL;
+	entry = pt_resolve_addr(entry)[(virt >> 21) & 0x1ff];
+	if (entry == 0 || (entry & PE_PS))
+		return NULL;
+	return pt_resolve_addr(entry);
 }
 
 void
-md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
+md_map_cursor_init(struct MD_MAP_CURSOR* mc, vmspace_t* vs)
 {
-	thread_t* curthread = PCPU_GET(curthread);
-	int is_cur_vmspace = curthread->t_process != NULL && curthread->t_process->p_vmspace == vs;
+	mc->mc_vs = vs;
+	mc->mc_base = 0;
+	mc->mc_pte = NULL;
+	mc->mc_pte_flags = 0;
+	mc->mc_inval_start = 0;
+	mc->mc_inval_end = 0;
+}
+
+void
+md_map_cursor_page(struct MD_MAP_CURSOR* mc, addr_t virt, addr_t phys, int flags)
+{
+	addr_t base = virt & ~(LARGE_PAGE_SIZE - 1);
+	if (mc->mc_pte == NULL || mc->mc_base != base) {
+		/* Different page table; have md_map_pages() walk and create the tables */
+		md_map_pages(mc->mc_vs, virt, phys, 1, flags);
+		uint64_t* pagedir = (mc->mc_vs != NULL) ? mc->mc_vs->vs_md_pagedir : kernel_pagedir;
+		mc->mc_pte = pt_lookup(mc->mc_vs, virt);
+		mc->mc_pte_flags = (pagedir[(virt >> 39) & 0x1ff] & PE_C_G) ? PE_G : 0;
+		mc->mc_base = base;
+		return;
+	}
+
+	uint64_t* pte = &mc->mc_pte[(virt >> 12) & 0x1ff];
+	bool need_invalidate = (*pte & PE_P) != 0;
+	*pte = (uint64_t)phys | pt_flags_for(flags) | mc->mc_pte_flags;
+	if (!need_invalidate)
+		return;
+	if (mc->mc_inval_start == mc->mc_inval_end) {
+		mc->mc_inval_start = virt;
+		mc->mc_inval_end = virt + PAGE_SIZE;
+	} else {
+		if (mc->mc_inval_start > virt)
+			mc->mc_inval_start = virt;
+		if (mc->mc_inval_end < virt + PAGE_SIZE)
+			mc->mc_inval_end = virt + PAGE_SIZE;
+	}
+}
+
+void
+md_map_cursor_done(struct MD_MAP_CURSOR* mc)
+{
+	if (mc->mc_inval_start != mc->mc_inval_end)
+		tlb_invalidate(mc->mc_vs, mc->mc_inval_start, mc->mc_inval_end);
+	mc->mc_pte = NULL;
+}
 
+void
+md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
+{
 	/* XXX we don't yet strip off bits 52-63 yet */
 	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
-	while(num_pages--) {
+	addr_t inval_start = virt;
+	while(num_pages > 0) {
 		if (pagedir[(virt >> 39) & 0x1ff] == 0) {
 			panic("vs=%p, virt=%p -> l1 not mapped (%p)", vs, virt, pagedir[(virt >> 39) & 0x1ff]);
 		}
@@ -116,35 +527,91 @@ md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
 			panic("vs=%p, virt=%p -> l2 not mapped (%p)", vs, virt, pagedir[(virt >> 30) & 0x1ff]);
 		}
 
-		uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-		if (pde[(virt >> 21) & 0x1ff] == 0) {
+		uint64_t* pde = &pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff])[(virt >> 21) & 0x1ff];
+		if (*pde == 0) {
 			panic("vs=%p, virt=%p -> l3 not mapped (%p)", vs, virt, pagedir[(virt >> 21) & 0x1ff]);
 		}
 
+		if (*pde & PE_PS) {
+			if ((virt & (LARGE_PAGE_SIZE - 1)) == 0 && num_pages >= PAGES_PER_LARGE_PAGE) {
+				/* Removing the entire large page; no need to split it */
+				*pde = 0;
+				virt += LARGE_PAGE_SIZE;
+				num_pages -= PAGES_PER_LARGE_PAGE;
+				continue;
+			}
+
+			uint64_t pd_flags = PE_US | PE_P | PE_RW;
+			if (pagedir[(virt >> 39) & 0x1ff] & PE_C_G)
+				pd_flags |= PE_C_G;
+			split_large_page(vs, pde, virt, pd_flags);
+		}
+
 		/* XXX perhaps we should check if this is actually mapped */
-		uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-		int global = (pte[(virt >> 12) & 0x1ff] & PE_G);
+		uint64_t* pte = pt_resolve_addr(*pde);
 		pte[(virt >> 12) & 0x1ff] = 0;
-		if (global || is_cur_vmspace) {
-			/*
-			 * We just unmapped a global virtual address or something that belongs to
-			 * the current thread; this means we'll have to * explicitely invalidate it.
-			 */
-			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
-		}
 		virt += PAGE_SIZE;
+		num_pages--;
 	}
+	if (virt != inval_start)
+		tlb_invalidate(vs, inval_start, virt);
+}
+
+bool
+md_clear_accessed(vmspace_t* vs, addr_t virt)
+{
+	uint64_t* pagedir = vs->vs_md_pagedir;
+	uint64_t entry = pagedir[(virt >> 39) & 0x1ff];
+	if (entry == 0)
+		return false;
+	entry = pt_resolve_addr(entry)[(virt >> 30) & 0x1ff];
+	if (entry == 0)
+		return false;
+
+	/* A large page only has a single bit; whoever looks first takes it */
+	uint64_t* pe = &pt_resolve_addr(entry)[(virt >> 21) & 0x1ff];
+	if (*pe != 0 && (*pe & PE_PS) == 0)
+		pe = &pt_resolve_addr(*pe)[(virt >> 12) & 0x1ff];
+	if ((*pe & (PE_P | PE_A)) != (PE_P | PE_A))
+		return false;
+
+	/*
+	 * The CPU sets the bit with an atomic update of its own. We skip the TLB
+	 * invalidation: at worst, an access goes unnoticed until the entry is
+	 * evicted from the TLB, which only makes us less accurate.
+	 */
+	__atomic_fetch_and(pe, ~PE_A, __ATOMIC_RELAXED);
+	return true;
+}
+
+static inline bool
+is_direct_mapped(addr_t virt, size_t num_pages)
+{
+	return virt >= KMEM_DIRECT_VA_START && virt < KMEM_DIRECT_VA_END &&
+	 KVTOP(virt) + num_pages * PAGE_SIZE <= direct_map_end;
 }
 
 void
 md_kmap(addr_t phys, addr_t virt, size_t num_pages, int flags)
 {
+	/*
+	 * The direct map is always present and read/write; only if different
+	 * attributes are needed (devices, code) does it need changing.
+	 */
+	if (virt == PTOKV(phys) && is_direct_mapped(virt, num_pages) &&
+	    (flags & (VM_FLAG_DEVICE | VM_FLAG_EXECUTE)) == 0)
+		return;
 	md_map_pages(NULL, virt, phys, num_pages, flags);
 }
 
 void
 md_kunmap(addr_t virt, size_t num_pages)
 {
+	/* Never remove pages from the direct map; just restore the usual attributes */
+	if (is_direct_mapped(virt, num_pages)) {
+		md_map_pages(NULL, virt, KVTOP(virt), num_pages, VM_FLAG_READ | VM_FLAG_WRITE);
+		return;
+	}
 	md_unmap_pages(NULL, virt, num_pages);
 }
 
@@ -156,8 +623,15 @@ vm_init()
 void
 md_map_kernel(vmspace_t* vs)
 {
-	/* We can just copy the entire kernel pagemap over; it's shared with everything else */
-	memcpy(vs->vs_md_pagedir, kernel_pagedir, PAGE_SIZE);
+	/*
+	 * The kernel only lives in the upper half, where startup pre-allocates
+	 * every top-level entry; sharing these by reference keeps the kernel
+	 * mappings the same everywhere without ever copying anything below them.
+	 * The lower half is for userland and starts out empty.
+	 */
+	const unsigned int half = PAGE_SIZE / sizeof(uint64_t) / 2;
+	memset(vs->vs_md_pagedir, 0, half * sizeof(uint64_t));
+	memcpy(&vs->vs_md_pagedir[half], &kernel_pagedir[half], half * sizeof(uint64_t));
 }
 
 /* vim:set ts=2 sw=2: */
@@ -1,4 +1,5 @@
 #include <machine/param.h>
+#include <machine/fpu.h>
 #include <machine/thread.h>
 #include <machine/interrupts.h>
 #include <machine/frame.h>
@@ -14,30 +15,144 @@
 #include <ananas/syscall.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
+#include <ananas/x86/smp.h>
+#include "options.h"
 
 extern void* kernel_pagedir;
+extern bool md_pcid_enabled;
 extern "C" {
 void thread_trampoline();
 }
 
+/*
+ * With process-context identifiers, every CPU keeps the TLB entries of the
+ * last few address spaces it ran; switching back to one of these need not
+ * flush them, unless the address space was changed since (every unmap or
+ * change of a present mapping bumps vs_md_tlb_gen). PCID 0 is used for the
+ * kernel pagedir, which has no mappings but global ones.
+ */
+#define PCID_NUM_SLOTS	8
+
+struct PCID_SLOT {
+	uint64_t ps_tlb_id;
+	uint32_t ps_tlb_gen;
+};
+
+struct PCID_CPU {
+	struct PCID_SLOT pc_slot[PCID_NUM_SLOTS];	/* PCID n + 1 */
+	unsigned int pc_next;				/* Next slot to replace */
+} __attribute__((aligned(64)));
+
+static struct PCID_CPU pcid_cpu[PCPU_MAX_CPUS];
+
+/*
+ * User vmspace whose pagetables each CPU has loaded; the CPU's bit is set in
+ * its vs_md_cpus so that TLB shootdowns know to interrupt us.
+ */
+static vmspace_t* cpu_active_vs[PCPU_MAX_CPUS];
+
+/*
+ * Kernel stacks of threads that are gone are kept in a small per-CPU cache,
+ * so that new threads need not allocate pages and map them every time; only
+ * the stacks that don't fit are given back. The cache is only touched with
+ * interrupts disabled, which keeps us on the CPU it belongs to.
+ */
+#define KSTACK_CACHE_SIZE	8
+
+struct KSTACK_CACHE {
+	unsigned int kc_count;
+	struct {
+		struct PAGE* ks_page;
+		void* ks_stack;
+	} kc_entry[KSTACK_CACHE_SIZE];
+} __attribute__((aligned(64)));
+
+static struct KSTACK_CACHE kstack_cache[PCPU_MAX_CPUS];
+
+/*
+ * Provides t with a kernel stack; we'll grab a few pages for this but we won't
+ * map all of them to ensure we can catch stack underflow and overflow.
+ */
+static void
+md_kstack_alloc(thread_t* t)
+{
+	int state = md_interrupts_save_and_disable();
+	struct KSTACK_CACHE* kc = &kstack_cache[PCPU_GET(cpuid)];
+	if (kc->kc_count > 0) {
+		kc->kc_count--;
+		t->md_kstack_page = kc->kc_entry[kc->kc_count].ks_page;
+		t->md_kstack = kc->kc_entry[kc->kc_count].ks_stack;
+		md_interrupts_restore(state);
+		return;
+	}
+	md_interrupts_restore(state);
+
+	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
+	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+}
+
+static void
+md_kstack_free(thread_t* t)
+{
+	int state = md_interrupts_save_and_disable();
+	struct KSTACK_CACHE* kc = &kstack_cache[PCPU_GET(cpuid)];
+	if (kc->kc_count < KSTACK_CACHE_SIZE) {
+		kc->kc_entry[kc->kc_count].ks_page = t->md_kstack_page;
+		kc->kc_entry[kc->kc_count].ks_stack = t->md_kstack;
+		kc->kc_count++;
+		md_interrupts_restore(state);
+		return;
+	}
+	md_interrupts_restore(state);
+
+	kmem_unmap(t->md_kstack, KERNEL_STACK_SIZE);
+	page_free(t->md_kstack_page);
+}
+
+/* Returns the value to load into %cr3 in order to activate thread t's pagetables */
+static inline uint64_t
+md_thread_get_cr3(thread_t* t)
+{
+	if (!md_pcid_enabled)
+		return t->md_cr3;
+	if (t->t_process == NULL || t->md_cr3 == KVTOP((addr_t)kernel_pagedir))
+		return t->md_cr3 | CR3_NOFLUSH; /* PCID 0 */
+
+	vmspace_t* vs = t->t_process->p_vmspace;
+	uint32_t gen = __atomic_load_n(&vs->vs_md_tlb_gen, __ATOMIC_ACQUIRE);
+	struct PCID_CPU* pc = &pcid_cpu[PCPU_GET(cpuid)];
+	for (unsigned int n = 0; n < PCID_NUM_SLOTS; n++) {
+		struct PCID_SLOT* ps = &pc->pc_slot[n];
+		if (ps->ps_tlb_id != vs->vs_md_tlb_id)
+			continue;
+		if (ps->ps_tlb_gen == gen)
+			return t->md_cr3 | (n + 1) | CR3_NOFLUSH;
+		// Changed since we last ran it; loading without NOFLUSH drops its entries
+		ps->ps_tlb_gen = gen;
+		return t->md_cr3 | (n + 1);
+	}
+
+	// Not seen recently; take over the oldest slot, discarding whatever it had
+	unsigned int n = pc->pc_next;
+	pc->pc_next = (n + 1) % PCID_NUM_SLOTS;
+	pc->pc_slot[n].ps_tlb_id = vs->vs_md_tlb_id;
+	pc->pc_slot[n].ps_tlb_gen = gen;
+	return t->md_cr3 | (n + 1);
+}
+
 errorcode_t
 md_thread_init(thread_t* t, int flags)
 {
 	/* Create a stack if we aren't cloning - otherwise, we'll just copy the parent's stack instead */
 	process_t* proc = t->t_process;
-	if ((flags & THREAD_ALLOC_CLONE) == 0) {
+	if ((flags & (THREAD_ALLOC_CLONE | THREAD_ALLOC_USER_STACK)) == 0) {
 		vmarea_t* va;
-		errorcode_t err = vmspace_mapto(proc->p_vmspace, USERLAND_STACK_ADDR, 0, THREAD_STACK_SIZE, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_ALLOC | VM_FLAG_MD, &va);
+		errorcode_t err = vmspace_mapto(proc->p_vmspace, USERLAND_STACK_ADDR, 0, THREAD_STACK_SIZE, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_ALLOC | VM_FLAG_STACK | VM_FLAG_MD, &va);
 		ANANAS_ERROR_RETURN(err);
 	}
 
-	/*
-	 * Create the kernel stack for this thread; we'll grab a few pages for this
-	 * but we won't map all of them to ensure we can catch stack underflow
-	 * and overflow.
-	 */
-	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
-	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	/* Create the kernel stack for this thread */
+	md_kstack_alloc(t);
 
 	/* Set up a stackframe so that we can return to the kernel code */
 	struct STACKFRAME* sf = (struct STACKFRAME*)((addr_t)t->md_kstack + KERNEL_STACK_SIZE - sizeof(*sf));
@@ -58,8 +173,7 @@ md_thread_init(thread_t* t, int flags)
 	t->t_frame = sf;
 
 	/* Initialize FPU state similar to what finit would do */
-	t->md_fpu_ctx.fcw = 0x37f;
-	t->md_fpu_ctx.ftw = 0xffff;
+	fpu_thread_init(t);
 
 	return ananas_success();
 }
@@ -72,8 +186,7 @@ md_kthread_init(thread_t* t, kthread_func_t kfunc, void* arg)
 	 * stack. We do not differentiate between kernel and userland stacks as
 	 * no kernelthread ever runs userland code.
 	 */
-	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
-	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	md_kstack_alloc(t);
 	t->t_md_flags = THREAD_MDFLAG_FULLRESTORE;
 
 	/* Set up a stackframe so that we can return to the kernel code */
@@ -96,6 +209,13 @@ md_kthread_init(thread_t* t, kthread_func_t kfunc, void* arg)
 	return ananas_success();
 }
 
+void
+md_kthread_set_vmspace(thread_t* t, vmspace_t* vs)
+{
+	KASSERT(THREAD_IS_KTHREAD(t), "not a kernel thread");
+	t->md_cr3 = KVTOP((addr_t)vs->vs_md_pagedir);
+}
+
 void
 md_thread_free(thread_t* t)
 {
@@ -107,8 +227,8 @@ md_thread_free(thread_t* t)
 	 * t->t_pages an will have been freed already (this is why we the thread must
 	 * be a zombie at this point)
 	 */
-	kmem_unmap(t->md_kstack, KERNEL_STACK_SIZE);
-	page_free(t->md_kstack_page);
+	md_kstack_free(t);
+	fpu_thread_free(t);
 }
 
 thread_t*
@@ -127,8 +247,32 @@ md_thread_switch(thread_t* new_thread, thread_t* old_thread)
   tss->rsp0 = new_thread->md_rsp0;
 	PCPU_SET(rsp0, new_thread->md_rsp0);
 
-	/* Activate the new_thread thread's page tables */
-  __asm __volatile("movq %0, %%cr3" : : "r" (new_thread->md_cr3));
+	/*
+	 * Activate the new_thread thread's page tables; if both threads share them,
+	 * there is no need to do anything (and we'll lose no TLB entries)
+	 */
+	if (new_thread->md_cr3 != old_thread->md_cr3) {
+		unsigned int cpuid = PCPU_GET(cpuid);
+		vmspace_t* old_vs = cpu_active_vs[cpuid];
+		vmspace_t* new_vs = NULL;
+		if (new_thread->t_process != NULL && new_thread->md_cr3 != KVTOP((addr_t)kernel_pagedir))
+			new_vs = new_thread->t_process->p_vmspace;
+
+		// Announce ourselves before looking at vs_md_tlb_gen; see tlb_shootdown()
+		if (new_vs != NULL)
+			__atomic_or_fetch(&new_vs->vs_md_cpus, 1 << cpuid, __ATOMIC_SEQ_CST);
+		uint64_t cr3 = md_thread_get_cr3(new_thread);
+		__asm __volatile("movq %0, %%cr3" : : "r" (cr3) : "memory");
+		if (old_vs != NULL && old_vs != new_vs)
+			__atomic_and_fetch(&old_vs->vs_md_cpus, ~(1 << cpuid), __ATOMIC_SEQ_CST);
+		cpu_active_vs[cpuid] = new_vs;
+	}
+
+	/* Account what the performance counters counted to the thread we are leaving */
+	perfctr_thread_switch(old_thread);
+
+	/* Save the FPU state if it was used, and arrange for the new thread to get its own */
+	fpu_thread_switch(new_thread, old_thread);
 
 	/*
 	 * This will only be called from kernel -> kernel transitions, and the
@@ -165,6 +309,10 @@ md_thread_switch(thread_t* new_thread, thread_t* old_thread)
 void*
 md_map_thread_memory(thread_t* thread, void* ptr, size_t length, int write)
 {
+	/* Userland memory is used as-is, but it had better be userland memory */
+	addr_t addr = (addr_t)ptr;
+	if (addr + length < addr || addr + length > USERLAND_END)
+		return NULL;
 	return ptr;
 }
 
@@ -180,6 +328,12 @@ md_thread_set_argument(thread_t* thread, addr_t arg)
 	thread->t_frame->sf_rdi = arg;
 }
 
+void
+md_thread_set_stack(thread_t* thread, addr_t sp)
+{
+	thread->t_frame->sf_rsp = sp;
+}
+
 void
 md_thread_clone(struct THREAD* t, struct THREAD* parent, register_t retval)
 {
@@ -209,6 +363,9 @@ md_thread_clone(struct THREAD* t, struct THREAD* parent, register_t retval)
 
 	/* Update the stack frame with the new return value to the child */
 	sf->sf_rax = retval;
+
+	/* The child continues with the FPU state the parent has right now */
+	fpu_thread_clone(t, parent);
 }
 
 void
@@ -223,4 +380,29 @@ md_setup_post_exec(thread_t* t, addr_t exec_addr)
 	t->md_rip = (addr_t)&thread_trampoline;
 }
 
+void
+md_pcpu_reschedule(struct PCPU* pcpu)
+{
+#ifdef OPTION_SMP
+	smp_ipi_schedule_cpu(pcpu->cpuid);
+#endif
+}
+
+void
+md_pcpu_tick_stop()
+{
+	/* Without SMP, the PIT is our only tick; it must keep running for timekeeping */
+#ifdef OPTION_SMP
+	smp_stop_timer();
+#endif
+}
+
+void
+md_pcpu_tick_start()
+{
+#ifdef OPTION_SMP
+	smp_start_timer();
+#endif
+}
+
 /* vim:set ts=2 sw=2: */
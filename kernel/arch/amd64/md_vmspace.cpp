@@ -3,28 +3,48 @@
 #include <machine/vm.h>
 #include <ananas/error.h>
 #include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/shared-page.h>
 #include <ananas/vm.h>
 #include <ananas/trace.h>
 
 TRACE_SETUP;
 
+static uint64_t md_vmspace_tlb_id;
+
 errorcode_t
 md_vmspace_init(vmspace_t* vs)
 {
-	struct PAGE* pagedir_page;
-	vs->vs_md_pagedir = static_cast<uint64_t*>(page_alloc_single_mapped(&pagedir_page, VM_FLAG_READ | VM_FLAG_WRITE));
-	if (vs->vs_md_pagedir == NULL)
+	vs->vs_md_tlb_id = __atomic_add_fetch(&md_vmspace_tlb_id, 1, __ATOMIC_RELAXED);
+	vs->vs_md_tlb_gen = 0;
+	vs->vs_md_cpus = 0;
+	spinlock_init(&vs->vs_md_pt_lock);
+
+	struct PAGE* pagedir_page = md_pt_alloc();
+	if (pagedir_page == NULL)
 		return ANANAS_ERROR(OUT_OF_MEMORY);
+	vs->vs_md_pagedir = reinterpret_cast<uint64_t*>(PTOKV(page_get_paddr(pagedir_page)));
 	LIST_APPEND(&vs->vs_pages, pagedir_page);
 
-	/* Map the kernel pages in there */
-	memset(vs->vs_md_pagedir, 0, PAGE_SIZE);
+	/* Map the kernel pages in there; this initializes the entire page directory */
 	md_map_kernel(vs);
 
+	/* And the page we share with userland, which it can only read */
+	addr_t shared_phys = shared_page_get_phys();
+	if (shared_phys != 0)
+		md_map_pages(vs, SHARED_PAGE_ADDR, shared_phys, 1, VM_FLAG_READ | VM_FLAG_USER);
+
 	return ananas_success();
 }
 
 void
 md_vmspace_destroy(vmspace_t* vs)
 {
+	/*
+	 * All of vs_pages are page tables, which can go as a whole as no CPU uses
+	 * them anymore. Those which ran the vmspace may still have translations of
+	 * its PCID cached, but these are flushed once the PCID is reused.
+	 */
+	KASSERT(__atomic_load_n(&vs->vs_md_cpus, __ATOMIC_SEQ_CST) == 0, "destroying vmspace %p while in use", vs);
+	md_pt_free_list(&vs->vs_pages);
 }
@@ -1,5 +1,6 @@
 #include <ananas/types.h>
 #include <machine/param.h>
+#include <machine/fpu.h>
 #include <machine/macro.h>
 #include <machine/interrupts.h>
 #include <machine/vm.h>
@@ -8,6 +9,7 @@
 #include <ananas/x86/acpi.h>
 #include <ananas/x86/pic.h>
 #include <ananas/x86/pit.h>
+#include <ananas/x86/pvclock.h>
 #include <ananas/x86/smap.h>
 #include <ananas/x86/smp.h>
 #include <ananas/handle.h>
@@ -20,12 +22,19 @@
 #include <ananas/pcpu.h>
 #include <ananas/mm.h>
 #include <ananas/lib.h>
+#include <ananas/ramdisk.h>
 #include <loader/module.h>
 #include "options.h"
 
 /* Pointer to the page directory level 4 */
 uint64_t* kernel_pagedir;
 
+/* Physical memory below this address is always present in the direct map */
+addr_t direct_map_end;
+
+/* Whether address spaces are tagged using process-context identifiers */
+bool md_pcid_enabled;
+
 /* Global Descriptor Table */
 uint8_t gdt[GDT_NUM_ENTRIES * 16];
 
@@ -48,6 +57,10 @@ struct PHYSMEM_CHUNK {
 };
 static struct PHYSMEM_CHUNK phys[PHYSMEM_NUM_CHUNKS];
 
+/* Physical memory which must be kept out of the zones: the kernel and any ramdisks */
+#define PHYSMEM_NUM_RESERVED 8
+static struct PHYSMEM_CHUNK phys_reserved[PHYSMEM_NUM_RESERVED];
+
 extern "C" void *__entry, *__end, *__rodata_end;
 
 /* CPU clock speed, in MHz */
@@ -103,6 +116,36 @@ map_kernel_pages(addr_t phys, addr_t virt, unsigned int num_pages, addr_t* avail
 #undef ADDR_MASK
 }
 
+/*
+ * Maps length bytes of phys -> virt using large pages with the given flags; page
+ * tables are allocated from *avail as with map_kernel_pages().
+ */
+static void
+map_kernel_large_pages(addr_t phys, addr_t virt, size_t length, addr_t* avail, uint64_t flags)
+{
+#define ADDR_MASK 0xffffffffff000 /* bits 12 .. 51 */
+
+	for (size_t n = 0; n < length; n += LARGE_PAGE_SIZE) {
+		uint64_t* pml4e = &kernel_pagedir[(virt >> 39) & 0x1ff];
+		if (*pml4e == 0) {
+			*pml4e = *avail | PE_RW | PE_P | PE_C_G;
+			*avail += PAGE_SIZE;
+		}
+		uint64_t* p = (uint64_t*)(*pml4e & ADDR_MASK);
+		uint64_t* pdpe = &p[(virt >> 30) & 0x1ff];
+		if (*pdpe == 0) {
+			*pdpe = *avail | PE_RW | PE_P | PE_C_G;
+			*avail += PAGE_SIZE;
+		}
+		uint64_t* q = (uint64_t*)(*pdpe & ADDR_MASK);
+		q[(virt >> 21) & 0x1ff] = phys | flags | PE_PS;
+		virt += LARGE_PAGE_SIZE;
+		phys += LARGE_PAGE_SIZE;
+	}
+
+#undef ADDR_MASK
+}
+
 /*
  * Calculated how many PAGE_SIZE-sized pieces we need to map mem_size bytes - note that this is only
  * accurate if the memory is mapped at address zero (it doesn't consider crossing boundaries)
@@ -122,18 +165,13 @@ calculate_num_pages_required(size_t mem_size, unsigned int* num_pages_needed, un
 	*length_in_pages = num_pte;
 }
 
-struct AVAIL_CTX {
-	addr_t avail_start;
-	addr_t* avail_end;
-};
-
-static uint64_t
-kva_get_flags(void* ctx, addr_t phys, addr_t virt)
+/* As calculate_num_pages_required(), but for mapping mem_size bytes using large pages */
+static inline unsigned int
+calculate_num_large_pages_required(size_t mem_size)
 {
-	struct AVAIL_CTX* actx = static_cast<struct AVAIL_CTX*>(ctx);
-	if (phys >= actx->avail_start && phys <= *actx->avail_end)
-		return PE_G | PE_RW | PE_P;
-	return 0;
+	unsigned int num_pml4e = (mem_size + (1ULL << 39) - 1) >> 39;
+	unsigned int num_pdpe = (mem_size + (1ULL << 30) - 1) >> 30;
+	return num_pml4e + num_pdpe;
 }
 
 static uint64_t
@@ -158,15 +196,15 @@ setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
 {
 #define KMAP_KVA_START KMEM_DIRECT_VA_START
 #define KMAP_KVA_END KMEM_DYNAMIC_VA_END
-	addr_t avail_start = *avail;
 
 	/*
 	 * Taking the overview in machine/vm.h into account, we want to map the
 	 * following regions:
 	 *
 	 * - KMAP_KVA_START .. KMAP_KVA_END: the kernel's KVA
-	 *   This may be mapped as 4KB pages; however, we can lower the estimate if
-	 *   there is less memory available than the total size of this region.
+	 *   This is mapped in full using 2MB pages, so that all memory is always
+	 *   accessible; we can lower the estimate if there is less memory
+	 *   available than the total size of this region.
 	 * - KERNBASE ... KERNEND: the kernel code/data
 	 *   We always map this as 4KB pages to ensure we can benefit most optimally
 	 *   from NX.
@@ -182,9 +220,8 @@ setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
 	if (mem_end < 4UL * 1024 * 1024 * 1024)
 		kmap_kva_end = KMAP_KVA_START + 4UL * 1024 * 1024 * 1024;
 
-	uint64_t kva_size = kmap_kva_end - KMAP_KVA_START;
-	unsigned int kva_pages_needed, kva_size_in_pages;
-	calculate_num_pages_required(kva_size, &kva_pages_needed, &kva_size_in_pages);
+	uint64_t kva_size = ROUND_UP(kmap_kva_end - KMAP_KVA_START, LARGE_PAGE_SIZE);
+	unsigned int kva_pages_needed = calculate_num_large_pages_required(kva_size);
 	addr_t kva_pages = (addr_t)bootstrap_get_pages(avail, kva_pages_needed);
 
 	/* Finally, allocate the kernel pagedir itself */
@@ -221,13 +258,13 @@ setup_paging(addr_t* avail, addr_t mem_end, size_t kernel_size)
 	addr_t dyn_kva_pages = (addr_t)bootstrap_get_pages(avail, dyn_kva_pages_needed);
 
 	/*
-	 * Map the KVA - we will only map what we have used for our page tables, to
-	 * ensure we can change them later as necessary. We explicitly won't map the
-	 * kernel page tables here because we never need to change them.
+	 * Map the KVA; this is the direct map of all memory, including our page
+	 * tables, which is never removed. Single pages which need different
+	 * attributes will cause md_map_pages() to split the large page involved.
 	 */
-	struct AVAIL_CTX actx = { avail_start, avail };
 	addr_t kva_avail_ptr = (addr_t)kva_pages;
-	map_kernel_pages(0, KMAP_KVA_START, kva_size_in_pages, &kva_avail_ptr, kva_get_flags, &actx);
+	map_kernel_large_pages(0, KMAP_KVA_START, kva_size, &kva_avail_ptr, PE_NX | PE_G | PE_RW | PE_P);
+	direct_map_end = kva_size;
 	KASSERT(kva_avail_ptr == (addr_t)kva_pages + kva_pages_needed * PAGE_SIZE, "not all KVA pages used (used %d, expected %d)", (kva_avail_ptr - kva_pages) / PAGE_SIZE, kva_pages);
 
 	/* Now map the kernel itself */
@@ -316,12 +353,45 @@ extern void* syscall_handler;
 
 	/* Enable FPU use; the kernel will save/restore it as needed */
 	write_cr4(read_cr4() | 0x600); /* OSFXSR | OSXMMEXCPT */
+	fpu_init();
 
 	// Enable No-Execute Enable bit XXX we should check to ensure it is supported
 	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | MSR_EFER_NXE);
 
 	// Enable the write-protect bit; this ensures kernel-code can't write to readonly pages
 	write_cr0(read_cr0() | CR0_WP);
+
+	// Tag TLB entries by address space if we can; see md_thread_switch()
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (ecx & CPUID_1_ECX_PCID)
+		write_cr4(read_cr4() | CR4_PCIDE);
+
+	// Let the userland copy routines use stac/clac if they exist; see usercopy.S
+extern int usercopy_smap;
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 7) {
+		cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+		if (ebx & CPUID_7_EBX_SMAP)
+			usercopy_smap = 1;
+	}
+}
+
+static void
+setup_string_functions()
+{
+	/* Let memcpy() and memset() use 'rep movsb/stosb' if the CPU does these quickly */
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < 7)
+		return;
+	cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+	int flags = 0;
+	if (ebx & CPUID_7_EBX_ERMS)
+		flags |= LIB_STRING_ERMS;
+	if (edx & CPUID_7_EDX_FSRM)
+		flags |= LIB_STRING_FSRM;
+	lib_string_flags = flags;
 }
 
 #ifdef OPTION_SMP
@@ -368,6 +438,32 @@ smp_ap_startup(struct X86_CPU* cpu)
 }
 #endif
 
+/* Adds [start .. end) to the physical chunks, minus reserved chunks n and beyond */
+static void
+add_physmem_chunk(addr_t start, addr_t end, int num_reserved, int n, int& phys_idx, addr_t& mem_end)
+{
+	if (n == num_reserved) {
+		// XXX We should check to make sure we don't go beyond phys_... here
+		phys[phys_idx].addr = start;
+		phys[phys_idx].len = end - start;
+		if (mem_end < end)
+			mem_end = end;
+		phys_idx++;
+		return;
+	}
+
+	/* See if this chunk collides with the reserved chunk; if it does, add it in 0 .. 2 slices */
+#define MAX_SLICES 2
+	addr_t slice_start[MAX_SLICES], slice_end[MAX_SLICES];
+	kmem_chunk_reserve(start, end, phys_reserved[n].addr, phys_reserved[n].addr + phys_reserved[n].len, &slice_start[0], &slice_end[0]);
+	for (unsigned int i = 0; i < MAX_SLICES; i++) {
+		KASSERT(slice_start[i] <= slice_end[i], "invalid start/end pair %p/%p", slice_start[i], slice_end[i]);
+		if (slice_start[i] != slice_end[i])
+			add_physmem_chunk(slice_start[i], slice_end[i], num_reserved, n + 1, phys_idx, mem_end);
+	}
+#undef MAX_SLICES
+}
+
 extern "C" void
 md_startup(struct BOOTINFO* bootinfo_ptr)
 {
@@ -453,8 +549,15 @@ md_startup(struct BOOTINFO* bootinfo_ptr)
 
 #ifdef OPTION_SMP
 	IDT_SET_ENTRY(SMP_IPI_SCHEDULE, SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, ipi_schedule);
+	IDT_SET_ENTRY(SMP_IPI_TLB,      SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, ipi_tlb);
 	IDT_SET_ENTRY(SMP_IPI_PANIC,    SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, ipi_panic);
+	IDT_SET_ENTRY(SMP_IPI_TIMER,    SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, lapic_timer);
 	IDT_SET_ENTRY(0xff,             SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, irq_spurious);
+	{
+		extern void* msi_stubs;
+		for (unsigned int n = 0; n < X86_MSI_COUNT; n++)
+			IDT_SET_ENTRY_ADDR(X86_MSI_FIRST + n, SEG_IGATE_TYPE, 0, (addr_t)&msi_stubs + n * X86_MSI_STUB_SIZE);
+	}
 #endif
 
 	/* Ask the PIC to mask everything; we'll initialize when we are ready */
@@ -472,6 +575,8 @@ extern void* bootstrap_stack;
 	 * handle at the moment, but we'll cope with this soon.
 	 */
 	setup_cpu((addr_t)&gdt, (addr_t)&bsp_pcpu);
+	md_pcid_enabled = (read_cr4() & CR4_PCIDE) != 0;
+	setup_string_functions();
 
 	/*
 	 * Determine how much memory we have; we need this in order to pre-allocate
@@ -508,6 +613,29 @@ extern void* bootstrap_stack;
 	addr_t kernel_from = ((addr_t)&__entry - KERNBASE) & ~(PAGE_SIZE - 1);
 	addr_t kernel_to = (((addr_t)&__end - KERNBASE) | (PAGE_SIZE - 1)) + 1;
 
+	/*
+	 * Ramdisks passed by the loader must stay where they are; the ramdisk
+	 * driver picks them up once devices are attached.
+	 */
+	int num_reserved = 0;
+	phys_reserved[num_reserved].addr = kernel_from;
+	phys_reserved[num_reserved].len = kernel_to - kernel_from;
+	num_reserved++;
+	for (addr_t m = bootinfo->bi_modules; m != 0; /* nothing */) {
+		auto mod = reinterpret_cast<struct LOADER_MODULE*>(m);
+		if (mod->mod_type == MOD_RAMDISK && num_reserved < PHYSMEM_NUM_RESERVED) {
+			addr_t mod_from = mod->mod_phys_start_addr & ~(PAGE_SIZE - 1);
+			addr_t mod_to = ((mod->mod_phys_end_addr - 1) | (PAGE_SIZE - 1)) + 1;
+			phys_reserved[num_reserved].addr = mod_from;
+			phys_reserved[num_reserved].len = mod_to - mod_from;
+			num_reserved++;
+#ifdef OPTION_RAMDISK
+			ramdisk_add_boot_image(mod->mod_phys_start_addr, mod->mod_phys_end_addr - mod->mod_phys_start_addr);
+#endif
+		}
+		m = mod->mod_next;
+	}
+
 	/* Now build the memory chunk list */
 	int phys_idx = 0;
 
@@ -517,28 +645,12 @@ extern void* bootstrap_stack;
 		if (smap_entry->type != SMAP_TYPE_MEMORY)
 			continue;
 
-		/* This piece of memory is available; add it */
+		/* This piece of memory is available; add it, minus anything reserved */
 		addr_t base = (addr_t)smap_entry->base_hi << 32 | smap_entry->base_lo;
 		size_t len = (size_t)smap_entry->len_hi << 32 | smap_entry->len_lo;
 		base  = (base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 		len  &= ~(PAGE_SIZE - 1);
-
-		/* See if this chunk collides with our kernel; if it does, add it in 0 .. 2 slices */
-#define MAX_SLICES 2
-		addr_t start[MAX_SLICES], end[MAX_SLICES];
-		kmem_chunk_reserve(base, base + len, kernel_from, kernel_to, &start[0], &end[0]);
-		for (unsigned int n = 0; n < MAX_SLICES; n++) {
-			KASSERT(start[n] <= end[n] && end[n] >= start[n], "invalid start/end pair %p/%p", start[n], end[n]);
-			if (start[n] == end[n])
-				continue;
-			// XXX We should check to make sure we don't go beyond phys_... here
-			phys[phys_idx].addr = start[n];
-			phys[phys_idx].len = end[n] - start[n];
-			if (mem_end < end[n])
-				mem_end = end[n];
-			phys_idx++;
-		}
-#undef MAX_SLICES
+		add_physmem_chunk(base, base + len, num_reserved, 0, phys_idx, mem_end);
 	}
 	KASSERT(phys_idx > 0, "no physical memory chunks");
 
@@ -648,8 +760,17 @@ extern void* bootstrap_stack;
 	 */
 	md_interrupts_enable();
 
-	/* Find out how quick the CPU is; this requires interrupts and will be needed for delay() */
-	md_cpu_clock_mhz = x86_pit_calc_cpuspeed_mhz();
+	/* Find out how quick the CPU is; this may require interrupts and will be needed for delay() */
+	md_cpu_clock_mhz = x86_clock_init();
+
+#ifdef OPTION_SMP
+	/* Calibrate and start our Local APIC timer; this needs the PIT */
+	smp_init_timer();
+
+	/* If the PIT isn't needed to tell the time either, it can go */
+	if (kvmclock_active && smp_has_timer())
+		x86_pit_stop();
+#endif
 
 	/* All done - it's up to the machine-independant code now */
 	mi_startup();
@@ -0,0 +1,128 @@
+/*
+ * NUMA topology; the ACPI SRAT table tells us which memory and CPU's belong
+ * to which proximity domain, and the SLIT table how far these domains are
+ * apart. Domains can be any 32-bit value, so we number them as we encounter
+ * them; these numbers are the nodes the page allocator uses.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/trace.h>
+#include <ananas/x86/smp.h>
+#include "options.h"
+#include "../../dev/acpi/acpica/acpi.h"
+
+TRACE_SETUP;
+
+#ifdef OPTION_SMP
+extern struct X86_SMP_CONFIG smp_config;
+#endif
+
+namespace {
+
+uint32_t node_domain[PAGE_MAX_NODES];
+unsigned int num_nodes = 0;
+
+/* Returns the node of a proximity domain, or -1 if we have too many */
+int
+domain_to_node(uint32_t domain)
+{
+	for (unsigned int n = 0; n < num_nodes; n++)
+		if (node_domain[n] == domain)
+			return n;
+	if (num_nodes == PAGE_MAX_NODES)
+		return -1;
+	node_domain[num_nodes] = domain;
+	return num_nodes++;
+}
+
+void
+set_cpu_node(uint32_t apic_id, int node)
+{
+#ifdef OPTION_SMP
+	/* CPU's are numbered like smp_config.cfg_cpu[], see smp_prepare_config() */
+	for (int n = 0; n < smp_config.cfg_num_cpus; n++) {
+		if (smp_config.cfg_cpu[n].lapic_id != apic_id)
+			continue;
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu != NULL)
+			page_set_cpu_node(pcpu, node);
+	}
+#endif
+}
+
+errorcode_t
+acpi_numa_init()
+{
+	ACPI_TABLE_SRAT* srat;
+	if (ACPI_FAILURE(AcpiGetTable(const_cast<char*>(ACPI_SIG_SRAT), 0, (ACPI_TABLE_HEADER**)&srat)))
+		return ananas_success(); /* no topology; everything is node 0 */
+
+	for (auto sub = reinterpret_cast<ACPI_SUBTABLE_HEADER*>(srat + 1);
+	     reinterpret_cast<char*>(sub + 1) <= reinterpret_cast<char*>(srat) + srat->Header.Length && sub->Length > 0;
+	     sub = reinterpret_cast<ACPI_SUBTABLE_HEADER*>(reinterpret_cast<char*>(sub) + sub->Length)) {
+		switch(sub->Type) {
+			case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+				auto cpu = reinterpret_cast<ACPI_SRAT_CPU_AFFINITY*>(sub);
+				if ((cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY) == 0)
+					break;
+				uint32_t domain = cpu->ProximityDomainLo | (cpu->ProximityDomainHi[0] << 8) |
+				 (cpu->ProximityDomainHi[1] << 16) | (cpu->ProximityDomainHi[2] << 24);
+				int node = domain_to_node(domain);
+				if (node >= 0)
+					set_cpu_node(cpu->ApicId, node);
+				break;
+			}
+			case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+				auto cpu = reinterpret_cast<ACPI_SRAT_X2APIC_CPU_AFFINITY*>(sub);
+				if ((cpu->Flags & ACPI_SRAT_CPU_ENABLED) == 0)
+					break;
+				int node = domain_to_node(cpu->ProximityDomain);
+				if (node >= 0)
+					set_cpu_node(cpu->ApicId, node);
+				break;
+			}
+			case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+				auto mem = reinterpret_cast<ACPI_SRAT_MEM_AFFINITY*>(sub);
+				if ((mem->Flags & ACPI_SRAT_MEM_ENABLED) == 0)
+					break;
+				int node = domain_to_node(mem->ProximityDomain);
+				if (node >= 0)
+					page_set_node(mem->BaseAddress, mem->Length, node);
+				break;
+			}
+		}
+	}
+	if (num_nodes <= 1)
+		return ananas_success();
+
+	/* Obtain the distances between our nodes; without a SLIT, all remote nodes are equal */
+	ACPI_TABLE_SLIT* slit;
+	uint8_t distance[PAGE_MAX_NODES * PAGE_MAX_NODES];
+	if (ACPI_SUCCESS(AcpiGetTable(const_cast<char*>(ACPI_SIG_SLIT), 0, (ACPI_TABLE_HEADER**)&slit))) {
+		uint64_t count = slit->LocalityCount;
+		for (unsigned int from = 0; from < num_nodes; from++) {
+			for (unsigned int to = 0; to < num_nodes; to++) {
+				uint8_t d = from == to ? 10 : 20;
+				if (node_domain[from] < count && node_domain[to] < count)
+					d = slit->Entry[node_domain[from] * count + node_domain[to]];
+				distance[from * num_nodes + to] = d;
+			}
+		}
+		page_set_node_distances(num_nodes, distance);
+	} else
+		page_set_node_distances(num_nodes, NULL);
+
+	kprintf("numa: %u nodes\n", num_nodes);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+/* Must be done before the AP's are launched, as they start allocating right away */
+INIT_FUNCTION(acpi_numa_init, SUBSYSTEM_SMP, ORDER_FIRST);
+
+/* vim:set ts=2 sw=2: */
@@ -2,6 +2,7 @@
 #include <ananas/error.h>
 #include <ananas/lib.h>
 #include <ananas/kmem.h>
+#include <ananas/pcpu.h>
 #include <ananas/trace.h>
 #include <ananas/vm.h>
 #include <ananas/x86/apic.h>
@@ -50,17 +51,8 @@ acpi_smp_init(int* bsp_apic_id)
 	KASSERT(madt->Address == LAPIC_BASE, "lapic base unsupported");
 	char* lapic_base = map_device<char*>(madt->Address);
 	KASSERT((addr_t)lapic_base == PTOKV(madt->Address), "mis-mapped lapic (%p != %p)", lapic_base, PTOKV(madt->Address));
-	/* Fetch our local APIC ID, we need to program it shortly */
-	*bsp_apic_id = (*(volatile uint32_t*)(lapic_base + LAPIC_ID)) >> 24;
-	/* Reset destination format to flat mode */
-	*(volatile uint32_t*)(lapic_base + LAPIC_DF) = 0xffffffff;
-	/* Ensure we are the logical destination of our local APIC */
-	volatile uint32_t* v = (volatile uint32_t*)(lapic_base + LAPIC_LD);
-	*v = (*v & 0x00ffffff) | 1 << (*bsp_apic_id + 24);
-	/* Clear Task Priority register; this enables all LAPIC interrupts */
-	*(volatile uint32_t*)(lapic_base + LAPIC_TPR) &= ~0xff;
-	/* Finally, enable the APIC */
-	*(volatile uint32_t*)(lapic_base + LAPIC_SVR) |= LAPIC_SVR_APIC_EN;
+	/* Enable our local APIC and fetch its ID, we need to program it shortly */
+	*bsp_apic_id = lapic_init();
 	
 	/* First of all, walk through the MADT and just count everything */
 	for (ACPI_SUBTABLE_HEADER* sub = reinterpret_cast<ACPI_SUBTABLE_HEADER*>(madt + 1);
@@ -73,12 +65,25 @@ acpi_smp_init(int* bsp_apic_id)
 					smp_config.cfg_num_cpus++;
 				break;
 			}
+			case ACPI_MADT_TYPE_LOCAL_X2APIC: {
+				/* Used for APIC ID's which do not fit in the entry above */
+				ACPI_MADT_LOCAL_X2APIC* x2apic = (ACPI_MADT_LOCAL_X2APIC*)sub;
+				if ((x2apic->LapicFlags & ACPI_MADT_ENABLED) && lapic_x2apic)
+					smp_config.cfg_num_cpus++;
+				break;
+			}
 			case ACPI_MADT_TYPE_IO_APIC:
 				smp_config.cfg_num_ioapics++;
 				break;
 		}
 	}
 
+	/* We can't keep track of more CPU's than this; the others won't be launched */
+	if (smp_config.cfg_num_cpus > PCPU_MAX_CPUS) {
+		kprintf("smp: only using %d of %d cpu(s)\n", PCPU_MAX_CPUS, smp_config.cfg_num_cpus);
+		smp_config.cfg_num_cpus = PCPU_MAX_CPUS;
+	}
+
 	/*
 	 * ACPI interrupt overrides will only list exceptions; this means we'll
 	 * have to pre-allocate all ISA interrupts and let the overrides
@@ -116,12 +121,29 @@ acpi_smp_init(int* bsp_apic_id)
 				kprintf("lapic, acpi id=%u apicid=%u\n", lapic->ProcessorId, lapic->Id);
 				if ((lapic->LapicFlags & ACPI_MADT_ENABLED) == 0)
 					continue; /* skip disabled CPU's */
+				if (cur_cpu == smp_config.cfg_num_cpus)
+					continue; /* beyond PCPU_MAX_CPUS */
 
 				struct X86_CPU* cpu = &smp_config.cfg_cpu[cur_cpu];
 				cpu->lapic_id = lapic->Id;
 				cur_cpu++;
 				break;
 			}
+			case ACPI_MADT_TYPE_LOCAL_X2APIC: {
+				ACPI_MADT_LOCAL_X2APIC* x2apic = (ACPI_MADT_LOCAL_X2APIC*)sub;
+				kprintf("x2apic, acpi uid=%u apicid=%u\n", x2apic->Uid, x2apic->LocalApicId);
+				if ((x2apic->LapicFlags & ACPI_MADT_ENABLED) == 0)
+					continue; /* skip disabled CPU's */
+				if (!lapic_x2apic)
+					continue; /* cannot address it */
+				if (cur_cpu == smp_config.cfg_num_cpus)
+					continue; /* beyond PCPU_MAX_CPUS */
+
+				struct X86_CPU* cpu = &smp_config.cfg_cpu[cur_cpu];
+				cpu->lapic_id = x2apic->LocalApicId;
+				cur_cpu++;
+				break;
+			}
 			case ACPI_MADT_TYPE_IO_APIC: {
 				ACPI_MADT_IO_APIC* apic = (ACPI_MADT_IO_APIC*)sub;
 				kprintf("ioapic, Id=%x addr=%x base=%u\n", apic->Id, apic->Address, apic->GlobalIrqBase);
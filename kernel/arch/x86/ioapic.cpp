@@ -1,10 +1,16 @@
 #include <ananas/x86/apic.h>
 #include <ananas/x86/ioapic.h>
+#include <ananas/x86/smp.h>
 #include <ananas/lib.h>
 #include <ananas/error.h>
+#include <ananas/trace.h>
 #include <machine/param.h>
 #include <machine/vm.h>
 
+TRACE_SETUP;
+
+extern struct X86_SMP_CONFIG smp_config;
+
 void
 ioapic_write(struct X86_IOAPIC* ioapic, uint32_t reg, uint32_t val)
 {
@@ -39,10 +45,24 @@ ioapic_unmask(struct IRQ_SOURCE* source, int no)
 	return ananas_success();
 }
 
+static errorcode_t
+ioapic_set_cpu(struct IRQ_SOURCE* source, int no, int cpu)
+{
+	if (cpu < 0 || cpu >= smp_config.cfg_num_cpus)
+		return ANANAS_ERROR(BAD_RANGE);
+	if (smp_config.cfg_cpu[cpu].lapic_id > 0xff)
+		return ANANAS_ERROR(BAD_RANGE); /* would need interrupt remapping */
+
+	/* Only the destination lives in the upper half, so we can leave the rest be */
+	struct X86_IOAPIC* ioapic = static_cast<X86_IOAPIC*>(source->is_privdata);
+	ioapic_write(ioapic, IOREDTBL + no * 2 + 1, smp_config.cfg_cpu[cpu].lapic_id << 24);
+	return ananas_success();
+}
+
 void
 ioapic_ack(struct IRQ_SOURCE* source, int no)
 {
-	*(volatile uint32_t*)(PTOKV(LAPIC_BASE) + LAPIC_EOI) = 0;
+	lapic_eoi();
 }
 
 void
@@ -58,6 +78,7 @@ ioapic_register(struct X86_IOAPIC* ioapic, int base)
 	ioapic->ioa_source.is_mask = ioapic_mask;
 	ioapic->ioa_source.is_unmask = ioapic_unmask;
 	ioapic->ioa_source.is_ack = ioapic_ack;
+	ioapic->ioa_source.is_set_cpu = ioapic_set_cpu;
 	irqsource_register(&ioapic->ioa_source);
 }
 
@@ -0,0 +1,161 @@
+/*
+ * KVM paravirtualized clock; see ananas/x86/pvclock.h. If the hypervisor
+ * offers it, it replaces the TSC calibrated against the (emulated, and thus
+ * costly) PIT as the source of timer_get_ns(): it tells us the TSC frequency
+ * right away and stays correct if we are migrated to another host.
+ *
+ * If the clock is marked as stable, all CPU's agree on the time and everyone
+ * reads the structure of the BSP - which lives in the shared page, so that
+ * userland can use it as well. Otherwise, every CPU reads its own.
+ */
+#include <ananas/types.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/shared-page.h>
+#include <ananas/vm.h>
+#include <ananas/x86/io.h>
+#include <ananas/x86/pvclock.h>
+#include <machine/interrupts.h>
+#include <machine/macro.h>
+
+bool kvmclock_active = false;
+
+namespace {
+
+uint32_t kvmclock_msr;
+bool kvmclock_stable;
+struct PAGE* kvmclock_page;
+struct PVCLOCK_TIME_INFO* kvmclock_info;	/* per CPU, indexed by cpuid */
+volatile struct PVCLOCK_TIME_INFO* kvmclock_bsp;	/* the one the BSP registered */
+uint64_t kvmclock_boot_ns;
+uint32_t kvmclock_tsc_khz;
+
+void
+kvmclock_register(unsigned int cpuid)
+{
+	addr_t phys = page_get_paddr(kvmclock_page) + cpuid * sizeof(struct PVCLOCK_TIME_INFO);
+	wrmsr(kvmclock_msr, phys | MSR_KVM_SYSTEM_TIME_ENABLE);
+}
+
+uint64_t
+kvmclock_read()
+{
+	if (kvmclock_stable)
+		return pvclock_read_ns(kvmclock_bsp);
+
+	/* We must not change CPU's while looking at our structure */
+	register_t state = md_interrupts_save_and_disable();
+	uint64_t ns = pvclock_read_ns(&kvmclock_info[PCPU_GET(cpuid)]);
+	md_interrupts_restore(state);
+	return ns;
+}
+
+} // unnamed namespace
+
+bool
+kvmclock_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if ((ecx & CPUID_1_ECX_HYPERVISOR) == 0)
+		return false;
+	cpuid(CPUID_KVM_SIGNATURE, 0, &eax, &ebx, &ecx, &edx);
+	if (ebx != 0x4b4d564b /* KVMK */ || ecx != 0x564b4d56 /* VMKV */ || edx != 0x4d /* M */)
+		return false;
+
+	cpuid(CPUID_KVM_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+	if (eax & KVM_FEATURE_CLOCKSOURCE2)
+		kvmclock_msr = MSR_KVM_SYSTEM_TIME_NEW;
+	else if (eax & KVM_FEATURE_CLOCKSOURCE)
+		kvmclock_msr = MSR_KVM_SYSTEM_TIME;
+	else
+		return false;
+
+	/* A single page holds the structures of all CPU's */
+	static_assert(PCPU_MAX_CPUS * sizeof(struct PVCLOCK_TIME_INFO) <= PAGE_SIZE, "kvmclock structures do not fit");
+	kvmclock_info = static_cast<struct PVCLOCK_TIME_INFO*>(page_alloc_single_mapped(&kvmclock_page, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (kvmclock_info == NULL)
+		return false;
+	memset(kvmclock_info, 0, PAGE_SIZE);
+	kvmclock_register(0);
+
+	/* The hypervisor fills the structure as we register it */
+	volatile struct PVCLOCK_TIME_INFO* pv = &kvmclock_info[0];
+	if (pv->pv_version == 0 || pv->pv_tsc_to_system_mul == 0) {
+		wrmsr(kvmclock_msr, 0);
+		page_free(kvmclock_page);
+		return false;
+	}
+	kvmclock_bsp = pv;
+	kvmclock_stable = (eax & KVM_FEATURE_CLOCKSOURCE_STABLE) && (pv->pv_flags & PVCLOCK_TSC_STABLE_BIT);
+
+	/* ns = (tsc << shift) * mul / 2^32, so there are 10^6 * 2^32 / mul >> shift ticks per ms */
+	uint64_t khz = (1000000ULL << 32) / pv->pv_tsc_to_system_mul;
+	if (pv->pv_tsc_shift < 0)
+		khz <<= -pv->pv_tsc_shift;
+	else
+		khz >>= pv->pv_tsc_shift;
+	kvmclock_tsc_khz = khz;
+
+	kvmclock_boot_ns = pvclock_read_ns(pv);
+	kvmclock_active = true;
+	kprintf("kvmclock: %u kHz TSC%s\n", kvmclock_tsc_khz, kvmclock_stable ? ", stable" : "");
+	return true;
+}
+
+void
+kvmclock_init_ap()
+{
+	if (kvmclock_active)
+		kvmclock_register(PCPU_GET(cpuid));
+}
+
+uint64_t
+kvmclock_get_ns()
+{
+	return kvmclock_read() - kvmclock_boot_ns;
+}
+
+uint64_t
+kvmclock_ns_to_tsc(uint64_t ns)
+{
+	/*
+	 * We go from the current time, which keeps the numbers small; anything
+	 * further than 1000s away is capped, so it fires early and is programmed
+	 * again.
+	 */
+	uint64_t tsc = rdtsc();
+	uint64_t now = kvmclock_get_ns();
+	if (ns <= now)
+		return tsc;
+	uint64_t delta = ns - now;
+	if (delta > 1000ULL * 1000000000ULL)
+		delta = 1000ULL * 1000000000ULL;
+	return tsc + (delta * kvmclock_tsc_khz) / 1000000;
+}
+
+uint32_t
+kvmclock_get_tsc_khz()
+{
+	return kvmclock_tsc_khz;
+}
+
+void
+kvmclock_shared_page_init(struct SHARED_PAGE& sp)
+{
+	/* Userland can't keep to a single CPU, so it can only use a stable clock */
+	if (!kvmclock_active || !kvmclock_stable)
+		return;
+
+	/* The AP's aren't running yet, so only the BSP can be looking at the time */
+	KASSERT(PCPU_GET(cpuid) == 0, "must be called on the BSP");
+	struct MD_SHARED_PAGE& msp = sp.sp_md;
+	addr_t phys = shared_page_get_phys() + ((char*)&msp.msp_pvclock - (char*)&sp);
+	wrmsr(kvmclock_msr, phys | MSR_KVM_SYSTEM_TIME_ENABLE);
+	kvmclock_bsp = &msp.msp_pvclock;
+	msp.msp_pvclock_boot = kvmclock_boot_ns;
+	msp.msp_pvclock_valid = 1;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,105 @@
+/*
+ * Local APIC access; see ananas/x86/apic.h. The mode is chosen once on the
+ * BSP, before any AP is launched, so all CPU's agree on it.
+ */
+#include <ananas/types.h>
+#include <ananas/lib.h>
+#include <ananas/x86/apic.h>
+#include <machine/interrupts.h>
+#include <machine/macro.h>
+#include <machine/thread.h>
+
+bool lapic_x2apic = false;
+
+/* Enables the Local APIC of the current CPU in the chosen mode */
+static void
+lapic_enable(uint32_t lapic_id)
+{
+	if (!lapic_x2apic) {
+		/* Reset destination format to flat mode */
+		lapic_write(LAPIC_DF, 0xffffffff);
+		/* Ensure we are the logical destination of our local APIC */
+		lapic_write(LAPIC_LD, (lapic_read(LAPIC_LD) & 0x00ffffff) | 1 << (lapic_id + 24));
+	}
+	/* Clear Task Priority register; this enables all LAPIC interrupts */
+	lapic_write(LAPIC_TPR, lapic_read(LAPIC_TPR) & ~0xff);
+	/* Finally, enable the APIC */
+	lapic_write(LAPIC_SVR, lapic_read(LAPIC_SVR) | LAPIC_SVR_APIC_EN);
+}
+
+/* Called on the BSP; picks the mode, enables the Local APIC and returns its ID */
+uint32_t
+lapic_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	lapic_x2apic = (ecx & CPUID_1_ECX_X2APIC) != 0;
+	if (lapic_x2apic)
+		wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | MSR_APIC_BASE_EN | MSR_APIC_BASE_EXTD);
+
+	uint32_t lapic_id = lapic_get_id();
+	lapic_enable(lapic_id);
+	kprintf("lapic: %s mode\n", lapic_x2apic ? "x2apic" : "xapic");
+	return lapic_id;
+}
+
+/* Called on every AP, with the ID mp_stub.S found */
+void
+lapic_init_ap(uint32_t lapic_id)
+{
+	if (lapic_x2apic && (rdmsr(MSR_APIC_BASE) & MSR_APIC_BASE_EXTD) == 0)
+		wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | MSR_APIC_BASE_EN | MSR_APIC_BASE_EXTD);
+	lapic_enable(lapic_id);
+}
+
+uint32_t
+lapic_get_id()
+{
+	if (lapic_x2apic)
+		return lapic_read(LAPIC_ID);
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+/* Sends an IPI with the given LAPIC_ICR_... command bits to a single CPU */
+void
+lapic_send_ipi(uint32_t lapic_id, uint32_t command)
+{
+	if (lapic_x2apic) {
+		/*
+		 * A single write does it, but unlike a memory access it is not ordered
+		 * against our earlier stores - which the receiver may depend on.
+		 */
+		__asm __volatile("mfence" : : : "memory");
+		wrmsr(LAPIC_X2APIC_ICR, (uint64_t)lapic_id << 32 | command);
+		return;
+	}
+
+	/*
+	 * The destination and command must be written as a pair, so ensure we will
+	 * not be interrupted between them; also wait for any previous IPI to be sent.
+	 */
+	register_t state = md_interrupts_save_and_disable();
+	while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_STATUS_PENDING)
+		/* wait */ ;
+	lapic_write(LAPIC_ICR_HI, lapic_id << 24);
+	lapic_write(LAPIC_ICR_LO, command);
+	md_interrupts_restore(state);
+}
+
+/* Sends an IPI using a LAPIC_ICR_DEST_... shorthand and waits until it is delivered */
+void
+lapic_send_ipi_shorthand(uint32_t command)
+{
+	if (lapic_x2apic) {
+		/* There is no delivery status in x2APIC mode; the write completes it */
+		__asm __volatile("mfence" : : : "memory");
+		wrmsr(LAPIC_X2APIC_ICR, command);
+		return;
+	}
+
+	lapic_write(LAPIC_ICR_LO, command);
+	while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_STATUS_PENDING)
+		md_cpu_relax();
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,85 @@
+/*
+ * Message-signalled interrupts; a message is a write of the vector to the
+ * local APIC of the destination CPU. This needs the local APIC's to be in
+ * use, which we only do in the SMP case - without it, no vectors are handed
+ * out and devices must stick to their interrupt line.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/irq.h>
+#include <ananas/lib.h>
+#include <ananas/trace.h>
+#include <ananas/x86/apic.h>
+#include <ananas/x86/ioapic.h>
+#include <ananas/x86/pcihb.h>
+#include <ananas/x86/smp.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+#define MSI_ADDR_DEST(id)	((id) << 12)	/* Destination APIC ID */
+#define MSI_DATA_EDGE		(0)		/* Edge triggered */
+#define MSI_DATA_FIXED		(0 << 8)	/* Fixed delivery mode */
+
+#ifdef OPTION_SMP
+extern struct X86_SMP_CONFIG smp_config;
+
+/*
+ * Messages are edge-triggered, so there is no need to mask anything while the
+ * IST runs: a message that arrives in the meantime simply wakes it up again.
+ */
+static errorcode_t
+msi_mask(struct IRQ_SOURCE* source, int no)
+{
+	return ananas_success();
+}
+
+static errorcode_t
+msi_unmask(struct IRQ_SOURCE* source, int no)
+{
+	return ananas_success();
+}
+
+static struct IRQ_SOURCE msi_source = {
+	.is_first = X86_MSI_FIRST,
+	.is_count = X86_MSI_COUNT,
+	.is_mask = msi_mask,
+	.is_unmask = msi_unmask,
+	.is_ack = ioapic_ack,
+	.is_flags = IRQ_SOURCE_FLAG_DYNAMIC
+};
+
+static int msi_active = 0;
+
+void
+msi_init()
+{
+	irqsource_register(&msi_source);
+	msi_active++;
+}
+
+errorcode_t
+pcihb_msi_message(unsigned int irq, int cpu, uint64_t* addr, uint32_t* data)
+{
+	if (!msi_active)
+		return ANANAS_ERROR(NO_RESOURCE);
+	if (irq < X86_MSI_FIRST || irq >= X86_MSI_FIRST + X86_MSI_COUNT)
+		return ANANAS_ERROR(BAD_RANGE);
+	if (cpu < 0 || cpu >= smp_config.cfg_num_cpus)
+		return ANANAS_ERROR(BAD_RANGE);
+	if (smp_config.cfg_cpu[cpu].lapic_id > 0xff)
+		return ANANAS_ERROR(BAD_RANGE); /* would need interrupt remapping */
+
+	*addr = LAPIC_BASE | MSI_ADDR_DEST(smp_config.cfg_cpu[cpu].lapic_id);
+	*data = MSI_DATA_EDGE | MSI_DATA_FIXED | irq;
+	return ananas_success();
+}
+#else
+errorcode_t
+pcihb_msi_message(unsigned int irq, int cpu, uint64_t* addr, uint32_t* data)
+{
+	return ANANAS_ERROR(NO_RESOURCE);
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
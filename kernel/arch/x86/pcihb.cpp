@@ -0,0 +1,144 @@
+/*
+ * PCI configuration space access; see pcihb.h. The ECAM area is located using
+ * the ACPI MCFG table; we only use the allocation for segment 0, as that is
+ * the only segment we enumerate.
+ *
+ * The area is 1MB per bus, most of which is never touched as there are far
+ * fewer devices than there could be; hence, we map it one device (8
+ * functions, 32KB) at a time, as it is first accessed. The ECAM area falls
+ * within the direct map, so mapping a device twice is harmless and a bitmap
+ * of mapped devices suffices, which needs no locking.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/vm.h>
+#include <ananas/x86/io.h>
+#include <ananas/x86/pcihb.h>
+#include <machine/vm.h>
+#include "options.h"
+#ifdef OPTION_ACPI
+#include "../../dev/acpi/acpica/acpi.h"
+#endif
+
+#define PCI_ECAM_MAX_DEVICES	(256 * 32)
+
+static spinlock_t spl_cfg1 = SPINLOCK_DEFAULT_INIT;
+
+static addr_t ecam_phys = 0;	/* Base of the ECAM area, as if it started at bus 0 */
+static unsigned int ecam_bus_first, ecam_bus_last;
+static uint32_t ecam_mapped[PCI_ECAM_MAX_DEVICES / 32];
+
+/* Returns the configuration space register using ECAM, or nullptr if ECAM isn't available for it */
+static inline volatile uint8_t*
+pci_ecam_address(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg)
+{
+	if (ecam_phys == 0 || bus < ecam_bus_first || bus > ecam_bus_last)
+		return nullptr;
+
+	addr_t dev_phys = ecam_phys + (bus << PCI_ECAM_BUS_SHIFT) + (dev << PCI_ECAM_DEV_SHIFT);
+	unsigned int n = bus * 32 + dev;
+	if ((__atomic_load_n(&ecam_mapped[n / 32], __ATOMIC_ACQUIRE) & (1U << (n % 32))) == 0) {
+		void* va = kmem_map(dev_phys, 8 * PCI_ECAM_FUNC_SIZE, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
+		KASSERT((addr_t)va == PTOKV(dev_phys), "ecam not direct-mapped (%p)", va);
+		__atomic_or_fetch(&ecam_mapped[n / 32], 1U << (n % 32), __ATOMIC_RELEASE);
+	}
+	return reinterpret_cast<volatile uint8_t*>(PTOKV(dev_phys + (func << PCI_ECAM_FUNC_SHIFT) + reg));
+}
+
+static inline unsigned int
+pci_make_addr(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg)
+{
+	return PCI_CFG1_ADDR_ENABLE | (bus << 16) | (dev << 11) | (func << 8) | reg;
+}
+
+uint32_t
+pci_read_config(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, int width)
+{
+	volatile uint8_t* p = pci_ecam_address(bus, dev, func, reg);
+	if (p != nullptr) {
+		switch(width) {
+			case 32: return *reinterpret_cast<volatile uint32_t*>(p);
+			case 16: return *reinterpret_cast<volatile uint16_t*>(p);
+			case  8: return *p;
+			default: panic("unsupported width %u", width);
+		}
+	}
+
+	if (reg >= PCI_CFG1_SIZE)
+		return 0xffffffff >> (32 - width);
+
+	/* Selecting the register and accessing it must not be interleaved */
+	uint32_t value;
+	register_t state = spinlock_lock_unpremptible(&spl_cfg1);
+	outl(PCI_CFG1_ADDR, pci_make_addr(bus, dev, func, reg & ~3));
+	switch(width) {
+		case 32: value = inl(PCI_CFG1_DATA); break;
+		case 16: value = inw(PCI_CFG1_DATA + (reg & 2)); break;
+		case  8: value = inb(PCI_CFG1_DATA + (reg & 3)); break;
+		default: panic("unsupported width %u", width);
+	}
+	spinlock_unlock_unpremptible(&spl_cfg1, state);
+	return value;
+}
+
+void
+pci_write_config(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t value, int width)
+{
+	volatile uint8_t* p = pci_ecam_address(bus, dev, func, reg);
+	if (p != nullptr) {
+		switch(width) {
+			case 32: *reinterpret_cast<volatile uint32_t*>(p) = value; break;
+			case 16: *reinterpret_cast<volatile uint16_t*>(p) = value; break;
+			case  8: *p = value; break;
+			default: panic("unsupported width %u", width);
+		}
+		return;
+	}
+
+	if (reg >= PCI_CFG1_SIZE)
+		return;
+
+	register_t state = spinlock_lock_unpremptible(&spl_cfg1);
+	outl(PCI_CFG1_ADDR, pci_make_addr(bus, dev, func, reg & ~3));
+	switch(width) {
+		case 32: outl(PCI_CFG1_DATA, value); break;
+		case 16: outw(PCI_CFG1_DATA + (reg & 2), value); break;
+		case  8: outb(PCI_CFG1_DATA + (reg & 3), value); break;
+		default: panic("unsupported width %u", width);
+	}
+	spinlock_unlock_unpremptible(&spl_cfg1, state);
+}
+
+#ifdef OPTION_ACPI
+static errorcode_t
+pcihb_ecam_init()
+{
+	ACPI_TABLE_MCFG* mcfg;
+	if (ACPI_FAILURE(AcpiGetTable(const_cast<char*>(ACPI_SIG_MCFG), 0, (ACPI_TABLE_HEADER**)&mcfg)))
+		return ananas_success(); /* no ECAM; we'll stick to mechanism 1 */
+
+	for (auto alloc = reinterpret_cast<ACPI_MCFG_ALLOCATION*>(mcfg + 1);
+	     reinterpret_cast<char*>(alloc + 1) <= reinterpret_cast<char*>(mcfg) + mcfg->Header.Length; alloc++) {
+		if (alloc->PciSegment != 0)
+			continue;
+		if (alloc->Address == 0 || alloc->Address >= KMEM_DIRECT_PA_END)
+			continue;
+
+		ecam_bus_first = alloc->StartBusNumber;
+		ecam_bus_last = alloc->EndBusNumber;
+		ecam_phys = alloc->Address;
+		kprintf("pci: using ecam at %p for bus %u-%u\n", ecam_phys, ecam_bus_first, ecam_bus_last);
+		break;
+	}
+	return ananas_success();
+}
+
+/* Must be done before anything attaches, as ACPI and PCI devices both need configuration space access */
+INIT_FUNCTION(pcihb_ecam_init, SUBSYSTEM_DEVICE, ORDER_FIRST);
+#endif
+
+/* vim:set ts=2 sw=2: */
@@ -1,18 +1,22 @@
 #include <ananas/x86/io.h>
 #include <ananas/x86/pit.h>
+#include <ananas/x86/pvclock.h>
+#include <ananas/x86/rtc.h>
 #include <ananas/x86/smp.h> /* XXX */
 #include <ananas/error.h>
 #include <ananas/pcpu.h>
 #include <ananas/irq.h>
 #include <ananas/lib.h>
+#include <ananas/shared-page.h>
+#include <ananas/time.h>
+#include <ananas/timer.h>
 #include <machine/interrupts.h>
+#include <machine/thread.h>
 #include "options.h"
 
 #define IRQ_PIT 0
 #define TIMER_FREQ 1193182
 
-#define HZ 100 /* XXX does not belong here */
-
 extern int md_cpu_clock_mhz;
 static uint64_t tsc_boot_time;
 
@@ -24,31 +28,76 @@ x86_pit_irq(Ananas::Device*, void*)
 		return IRQ_RESULT_PROCESSED;
 
 #ifdef OPTION_SMP
-	smp_broadcast_schedule();
-#else
+	/* If every CPU has its own Local APIC timer, those take care of timers and timeslices */
+	if (smp_has_timer())
+		return IRQ_RESULT_PROCESSED;
+#endif
+
+	/* Without a programmable timer, we can only look at the timer wheel every tick */
+	timer_interrupt();
+
 	/*
 	 * Timeslice is up -> next thread please; we can implement this
 	 * by simply setting the 'want to reschedule' flag.
 	 */
 	thread_t* curthread = PCPU_GET(curthread);
 	curthread->t_flags |= THREAD_FLAG_RESCHEDULE;
-#endif
 
 	return IRQ_RESULT_PROCESSED;
 }
 
-/*
- * Obtains the number of milliseconds that have passed since boot. Because we
- * know the CPU speed in MHz as md_cpu_clock_mhz, it means one second means
- * '1000 * md_cpu_clock_mhz' ticks have passed.
- */
+/* Obtains the number of milliseconds that have passed since boot */
 uint32_t
 x86_get_ms_since_boot()
 {
+	return md_timer_get_ns() / 1000000;
+}
+
+/*
+ * Without kvmclock, we know the CPU speed in MHz as md_cpu_clock_mhz, so
+ * every microsecond means 'md_cpu_clock_mhz' TSC ticks have passed.
+ */
+uint64_t
+md_timer_get_ns()
+{
+	if (kvmclock_active)
+		return kvmclock_get_ns();
+	if (md_cpu_clock_mhz == 0)
+		return 0; /* not yet calibrated */
+
+	/* Split the division to avoid overflowing after a few hours */
 	uint64_t tsc = rdtsc() - tsc_boot_time;
-	return (tsc / 1000) / md_cpu_clock_mhz;
+	return (tsc / md_cpu_clock_mhz) * 1000 + ((tsc % md_cpu_clock_mhz) * 1000) / md_cpu_clock_mhz;
+}
+
+uint64_t
+x86_ns_to_tsc(uint64_t ns)
+{
+	if (kvmclock_active)
+		return kvmclock_ns_to_tsc(ns);
+	return tsc_boot_time + (ns / 1000) * md_cpu_clock_mhz + ((ns % 1000) * md_cpu_clock_mhz) / 1000;
+}
+
+void
+md_shared_page_init(struct SHARED_PAGE& sp)
+{
+	/*
+	 * The TSC calibration is all userland needs to keep time on its own; a
+	 * stable kvmclock is better still, as it survives migration.
+	 */
+	kvmclock_shared_page_init(sp);
+	shared_page_set_time(md_cpu_clock_mhz, tsc_boot_time, x86_rtc_get_time());
 }
 
+#ifndef OPTION_SMP
+bool
+md_timer_program(uint64_t deadline)
+{
+	/* Nothing to program; x86_pit_irq() looks at the timers every tick */
+	return false;
+}
+#endif
+
 void
 x86_pit_init()
 {
@@ -60,6 +109,31 @@ x86_pit_init()
 		panic("cannot register timer irq");
 }
 
+/*
+ * Stops the PIT; once every CPU has its own timer and kvmclock keeps the time,
+ * there is no point in having the hypervisor emulate its interrupts.
+ */
+void
+x86_pit_stop()
+{
+	irq_unregister(IRQ_PIT, NULL, x86_pit_irq, NULL);
+	/* One-shot mode without a count makes it wait forever */
+	outb(PIT_MODE_CMD, PIT_CH_CHAN0 | PIT_MODE_0 | PIT_ACCESS_BOTH);
+}
+
+/*
+ * Picks our clock source and returns the CPU speed in MHz: kvmclock if the
+ * hypervisor offers it, otherwise the TSC calibrated against the PIT.
+ */
+uint32_t
+x86_clock_init()
+{
+	if (!kvmclock_init())
+		return x86_pit_calc_cpuspeed_mhz();
+	tsc_boot_time = rdtsc();
+	return kvmclock_get_tsc_khz() / 1000;
+}
+
 uint32_t
 x86_pit_calc_cpuspeed_mhz()
 {
@@ -88,22 +162,23 @@ x86_pit_calc_cpuspeed_mhz()
 }
 
 void
-delay(int ms)
+delay_us(unsigned int us)
 {
-	/* XXX For now, always delay using the TSC */
-
 	/*
 	 * Delaying using the TSC; we should already have initialized md_cpu_clock_mhz
-	 * by now; this is the number of MHz the CPU clock is running at; so delaying
-	 * one second will take 'md_cpu_clock_mhz * 1000000' ticks. This means
-	 * delaying one millisecond is 1000 times faster, so we'll just have to
-	 * wait 'ms * md_cpu_clock_mhz * 1000' ticks.
+	 * by now; this is the number of MHz the CPU clock is running at, which is
+	 * exactly the number of ticks per microsecond.
 	 */
-	uint64_t delay_in_ticks = ms * md_cpu_clock_mhz * 1000;
-	uint64_t base = rdtsc();
-	uint64_t end = base + delay_in_ticks;
+	uint64_t delay_in_ticks = (uint64_t)us * md_cpu_clock_mhz;
+	uint64_t end = rdtsc() + delay_in_ticks;
 	while (rdtsc() < end)
-		/* wait for it */ ;
+		md_cpu_relax();
+}
+
+void
+delay(int ms)
+{
+	delay_us(ms * 1000);
 }
 
 /* vim:set ts=2 sw=2: */
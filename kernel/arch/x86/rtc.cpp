@@ -0,0 +1,97 @@
+/*
+ * CMOS real-time clock; we only read it once at boot, everything else is
+ * derived from the TSC.
+ */
+#include <ananas/types.h>
+#include <ananas/x86/io.h>
+#include <ananas/x86/rtc.h>
+#include <machine/interrupts.h>
+
+namespace {
+
+struct RTC_TIME {
+	unsigned int rt_sec, rt_min, rt_hour, rt_day, rt_month, rt_year;
+};
+
+inline uint8_t
+rtc_read(uint8_t reg)
+{
+	outb(RTC_INDEX, reg);
+	return inb(RTC_DATA);
+}
+
+void
+rtc_read_time(struct RTC_TIME& rt)
+{
+	/* Values are inconsistent while the RTC updates them */
+	while (rtc_read(RTC_REG_STATUS_A) & RTC_STATUS_A_UIP)
+		/* wait */ ;
+	rt.rt_sec = rtc_read(RTC_REG_SECONDS);
+	rt.rt_min = rtc_read(RTC_REG_MINUTES);
+	rt.rt_hour = rtc_read(RTC_REG_HOURS);
+	rt.rt_day = rtc_read(RTC_REG_DAY);
+	rt.rt_month = rtc_read(RTC_REG_MONTH);
+	rt.rt_year = rtc_read(RTC_REG_YEAR);
+}
+
+inline unsigned int
+rtc_from_bcd(unsigned int v)
+{
+	return (v >> 4) * 10 + (v & 0xf);
+}
+
+/* Days since 1970-01-01 of the given date */
+uint64_t
+rtc_days_since_epoch(unsigned int year, unsigned int month, unsigned int day)
+{
+	static const unsigned int days_before_month[12] = {
+		0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+	};
+
+	uint64_t days = (year - 1970) * 365 + days_before_month[month - 1] + day - 1;
+	/* Leap days of all years before this one, plus this year's if past February */
+	unsigned int y = (month > 2) ? year : year - 1;
+	days += (y / 4 - y / 100 + y / 400) - (1969 / 4 - 1969 / 100 + 1969 / 400);
+	return days;
+}
+
+} // unnamed namespace
+
+uint64_t
+x86_rtc_get_time()
+{
+	/* Read until we get the same values twice, so we don't straddle an update */
+	int state = md_interrupts_save_and_disable();
+	struct RTC_TIME rt, prev;
+	rtc_read_time(rt);
+	do {
+		prev = rt;
+		rtc_read_time(rt);
+	} while (rt.rt_sec != prev.rt_sec || rt.rt_min != prev.rt_min || rt.rt_hour != prev.rt_hour ||
+	         rt.rt_day != prev.rt_day || rt.rt_month != prev.rt_month || rt.rt_year != prev.rt_year);
+	uint8_t status_b = rtc_read(RTC_REG_STATUS_B);
+	md_interrupts_restore(state);
+
+	bool pm = (rt.rt_hour & RTC_HOURS_PM) != 0;
+	rt.rt_hour &= ~RTC_HOURS_PM;
+	if ((status_b & RTC_STATUS_B_BINARY) == 0) {
+		rt.rt_sec = rtc_from_bcd(rt.rt_sec);
+		rt.rt_min = rtc_from_bcd(rt.rt_min);
+		rt.rt_hour = rtc_from_bcd(rt.rt_hour);
+		rt.rt_day = rtc_from_bcd(rt.rt_day);
+		rt.rt_month = rtc_from_bcd(rt.rt_month);
+		rt.rt_year = rtc_from_bcd(rt.rt_year);
+	}
+	if ((status_b & RTC_STATUS_B_24H) == 0)
+		rt.rt_hour = (rt.rt_hour % 12) + (pm ? 12 : 0);
+
+	/* XXX We assume the 21st century, as the century register isn't standardized */
+	unsigned int year = 2000 + rt.rt_year;
+	if (rt.rt_month < 1 || rt.rt_month > 12 || rt.rt_day < 1 || rt.rt_day > 31)
+		return 0; /* nonsense; better to admit we do not know */
+
+	uint64_t days = rtc_days_since_epoch(year, rt.rt_month, rt.rt_day);
+	return ((days * 24 + rt.rt_hour) * 60 + rt.rt_min) * 60 + rt.rt_sec;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -18,7 +18,11 @@
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 #include <ananas/thread.h>
+#include <ananas/time.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
+#include <ananas/x86/pit.h>
+#include <ananas/x86/pvclock.h>
 #include <ananas/vm.h>
 #include "options.h"
 
@@ -41,6 +45,12 @@ struct X86_SMP_CONFIG smp_config;
 static struct PAGE* ap_page;
 static int can_smp_launch = 0;
 extern "C" volatile int num_smp_launched = 1; /* BSP is always launched */
+static int smp_active = 0;
+static uint32_t lapic_timer_count = 0; /* LAPIC timer count per 1/HZ second */
+static bool lapic_tsc_deadline = false; /* LAPIC timer in TSC-deadline mode */
+
+/* Longest one-shot interval we program; the timer code copes with waking up early */
+#define LAPIC_ONESHOT_MAX_NS	(1000ULL * 1000 * 1000)
 
 static struct IRQ_SOURCE ipi_source = {
 	.is_first = SMP_IPI_FIRST,
@@ -50,14 +60,6 @@ static struct IRQ_SOURCE ipi_source = {
 	.is_ack = ioapic_ack
 };
 
-static void
-delay(int n) {
-	while (n-- > 0) {
-		int x = 1000;
-		while (x--);
-	}
-}
-
 uint32_t
 get_num_cpus()
 {
@@ -73,6 +75,67 @@ smp_ipi_schedule(Ananas::Device*, void* context)
 	return IRQ_RESULT_PROCESSED;
 }
 
+static irqresult_t
+smp_ipi_tlb(Ananas::Device*, void* context)
+{
+	md_tlb_shootdown_ipi();
+	return IRQ_RESULT_PROCESSED;
+}
+
+static irqresult_t
+smp_lapic_timer_irq(Ananas::Device*, void* context)
+{
+	/* The timeslice tick is just another timer */
+	timer_interrupt();
+	return IRQ_RESULT_PROCESSED;
+}
+
+/* Puts the Local APIC timer of the current CPU in the mode md_timer_program() expects */
+static void
+smp_setup_timer()
+{
+	lapic_write(LAPIC_LVT_DCR, LAPIC_LVT_DCR_DIV16);
+	lapic_write(LAPIC_LVT_TR, (lapic_tsc_deadline ? LAPIC_LVT_TR_TSC_DEADLINE : 0) | SMP_IPI_TIMER);
+}
+
+bool
+md_timer_program(uint64_t deadline)
+{
+	if (lapic_timer_count == 0)
+		return false; /* x86_pit_irq() looks at the timers every tick */
+
+	if (lapic_tsc_deadline) {
+		/* Deadlines in the past fire right away */
+		wrmsr(MSR_TSC_DEADLINE, x86_ns_to_tsc(deadline));
+		return true;
+	}
+
+	uint64_t now = timer_get_ns();
+	uint64_t delta = (deadline > now) ? deadline - now : 0;
+	if (delta > LAPIC_ONESHOT_MAX_NS)
+		delta = LAPIC_ONESHOT_MAX_NS;
+	uint64_t count = (delta * lapic_timer_count) / (1000000000 / HZ);
+	if (count == 0)
+		count = 1; /* zero would stop the timer */
+	lapic_write(LAPIC_LVT_ICR, (uint32_t)count);
+	return true;
+}
+
+void
+smp_start_timer()
+{
+	if (lapic_timer_count != 0)
+		timer_tick_start();
+}
+
+void
+smp_stop_timer()
+{
+	/* Other timers may still be pending, so the Local APIC timer keeps going */
+	if (lapic_timer_count != 0)
+		timer_tick_stop();
+}
+
 static irqresult_t
 smp_ipi_panic(Ananas::Device*, void* context)
 {
@@ -107,7 +170,7 @@ smp_prepare_config(struct X86_SMP_CONFIG* cfg)
 		 * Each AP needs an own GDT because it contains the pointer to the per-CPU
 		 * data and the TSS must be distinct too.
 		 */
-		char* buf = static_cast<char*>(kmalloc(GDT_SIZE + sizeof(struct TSS) + sizeof(struct PCPU)));
+		char* buf = static_cast<char*>(kmalloc(GDT_SIZE + sizeof(struct TSS) + sizeof(struct PCPU) + __alignof__(struct PCPU) - 1));
 		cpu->gdt = buf;
 extern void* gdt; /* XXX */
 		memcpy(cpu->gdt, &gdt, GDT_SIZE);
@@ -117,7 +180,8 @@ extern void* gdt; /* XXX */
 		cpu->tss = (char*)tss;
 
 		/* Initialize per-CPU data */
-		struct PCPU* pcpu = (struct PCPU*)(buf + GDT_SIZE + sizeof(struct TSS));
+		/* Per-CPU data is aligned to a cache line, so that no two CPUs share one */
+		struct PCPU* pcpu = (struct PCPU*)ROUND_UP((addr_t)(buf + GDT_SIZE + sizeof(struct TSS)), __alignof__(struct PCPU));
 		memset(pcpu, 0, sizeof(struct PCPU));
 		pcpu->cpuid = i;
 		pcpu->tss = (addr_t)cpu->tss;
@@ -156,6 +220,60 @@ smp_prepare()
  * Called on the Boot Strap Processor, in order to prepare the system for
  * multiprocessing.
  */
+/*
+ * Determines which CPU's are hardware threads of the same core, and which
+ * share their last-level cache; both follow from the APIC ID, of which CPUID
+ * tells us how many low bits select the thread within a core (leaf 0xb) and
+ * the CPU within the group sharing each cache (leaf 4). These are the same
+ * for every CPU, so the BSP can do this for everyone.
+ */
+static void
+smp_init_topology()
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	uint32_t max_leaf = eax;
+
+	unsigned int smt_shift = 0, llc_shift = 0;
+	bool have_llc = false;
+	if (max_leaf >= 0xb) {
+		for (uint32_t level = 0; level < 8; level++) {
+			cpuid(0xb, level, &eax, &ebx, &ecx, &edx);
+			unsigned int type = (ecx >> 8) & 0xff;
+			if (type == 0)
+				break;
+			if (type == 1 /* SMT */)
+				smt_shift = eax & 0x1f;
+		}
+	}
+	if (max_leaf >= 4) {
+		unsigned int llc_level = 0;
+		for (uint32_t index = 0; index < 16; index++) {
+			cpuid(4, index, &eax, &ebx, &ecx, &edx);
+			if ((eax & 0x1f) == 0 /* no more caches */)
+				break;
+			unsigned int level = (eax >> 5) & 7;
+			if (level < llc_level)
+				continue;
+			llc_level = level;
+			unsigned int sharing = ((eax >> 14) & 0xfff) + 1;
+			for (llc_shift = 0; (1U << llc_shift) < sharing; llc_shift++)
+				;
+			have_llc = true;
+		}
+	}
+
+	for (int n = 0; n < smp_config.cfg_num_cpus; n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu == NULL)
+			continue;
+		unsigned int apic_id = smp_config.cfg_cpu[n].lapic_id;
+		scheduler_set_topology(pcpu, apic_id >> smt_shift, have_llc ? apic_id >> llc_shift : 0);
+	}
+	kprintf("smp: %u thread(s) per core, %u cpu(s) per last-level cache\n",
+	 1U << smt_shift, have_llc ? 1U << llc_shift : smp_config.cfg_num_cpus);
+}
+
 errorcode_t
 smp_init()
 {
@@ -180,6 +298,7 @@ smp_init()
 		smp_destroy_ap_pagetable();
 		return ANANAS_ERROR(NO_DEVICE);
 	}
+	smp_init_topology();
 
 	/* Program the I/O APIC - we currently just wire all ISA interrupts */
 	for (int i = 0; i < smp_config.cfg_num_ints; i++) {
@@ -196,7 +315,7 @@ smp_init()
 		if (interrupt->dest_no < 0)
 			continue;
 
-		/* XXX For now, route all interrupts to the BSP */
+		/* Route everything to the BSP; irq_balance() moves them once the AP's are up */
 		uint32_t reg = IOREDTBL + (interrupt->dest_no * 2);
 		ioapic_write(interrupt->ioapic, reg, TRIGGER_EDGE | DESTMOD_PHYSICAL | DELMOD_FIXED | (interrupt->source_no + 0x20));
 		ioapic_write(interrupt->ioapic, reg + 1, bsp_apic_id << 24);
@@ -211,6 +330,13 @@ smp_init()
 		panic("can't register ipi");
 	if (ananas_is_failure(irq_register(SMP_IPI_SCHEDULE, NULL, smp_ipi_schedule, IRQ_TYPE_IPI, NULL)))
 		panic("can't register ipi");
+	if (ananas_is_failure(irq_register(SMP_IPI_TLB, NULL, smp_ipi_tlb, IRQ_TYPE_IPI, NULL)))
+		panic("can't register ipi");
+	if (ananas_is_failure(irq_register(SMP_IPI_TIMER, NULL, smp_lapic_timer_irq, IRQ_TYPE_TIMER, NULL)))
+		panic("can't register lapic timer");
+
+	/* Now that the local APIC's are in use, devices can deliver messages to them */
+	msi_init();
 
 	/*
 	 * Initialize the SMP launch variable; every AP will just spin and check this value. We don't
@@ -218,33 +344,110 @@ smp_init()
 	 * that it needs to run.
 	 */
 	can_smp_launch = 0;
+	smp_active++;
 
 	return ananas_success();
 }
 
 /*
- * Called on the Boot Strap Processor, in order to fully launch the AP's.
+ * Called on the Boot Strap Processor once the PIT is running; calibrates the
+ * Local APIC timer against it and starts the timer on the BSP. The AP's start
+ * their own timer once they are launched.
+ */
+void
+smp_init_timer()
+{
+	if (!smp_active)
+		return;
+
+	KASSERT(md_interrupts_save(), "interrupts must be enabled");
+	lapic_write(LAPIC_LVT_DCR, LAPIC_LVT_DCR_DIV16);
+	lapic_write(LAPIC_LVT_TR, LAPIC_LVT_TR_MASKED | SMP_IPI_TIMER);
+
+	/* Let the timer count down from the maximum value for a single PIT tick */
+	uint32_t tickcount = PCPU_GET(tickcount);
+	while (PCPU_GET(tickcount) == tickcount);	/* wait for next tick */
+	lapic_write(LAPIC_LVT_ICR, 0xffffffff);
+	tickcount++;
+	while (PCPU_GET(tickcount) == tickcount);	/* wait for yet another tick */
+	lapic_timer_count = 0xffffffff - lapic_read(LAPIC_LVT_CCR);
+	KASSERT(lapic_timer_count > 0, "lapic timer not running");
+
+	/* TSC-deadline mode saves us from converting to timer counts */
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	lapic_tsc_deadline = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+#if SMP_DEBUG
+	kprintf("lapic timer: %u ticks per %u ms%s\n", lapic_timer_count, 1000 / HZ, lapic_tsc_deadline ? ", tsc-deadline" : "");
+#endif
+
+	smp_setup_timer();
+	smp_start_timer();
+}
+
+/*
+ * Returns whether the CPU's have their own Local APIC timer running; if so,
+ * there is no need for the PIT to drive the timeslices.
+ */
+int
+smp_has_timer()
+{
+	return lapic_timer_count != 0;
+}
+
+/* Sends an IPI to all AP's and waits until the Local APIC has delivered it */
+static void
+smp_ipi_all_aps(uint32_t command)
+{
+	lapic_send_ipi_shorthand(LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | command);
+}
+
+/*
+ * Called on the Boot Strap Processor to wake up the AP's. They all run their
+ * startup code at the same time and join the scheduler once they are done;
+ * we do not wait for them, so the remaining init functions (most notably
+ * device attachment) run while they are coming up.
  */
 static errorcode_t
 smp_launch()
 {
+	if (!smp_active)
+		return ananas_success();
 	can_smp_launch++;
 
 	/*
 	 * Broadcast INIT-SIPI-SIPI-IPI to all AP's; this will wake them up and cause
-	 * them to run the AP entry code.
+	 * them to run the AP entry code. The delays are those prescribed by Intel.
 	 */
-	addr_t lapic_base = PTOKV(LAPIC_BASE);
-	*((volatile uint32_t*)(lapic_base + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_INIT;
+	uint32_t vector = page_get_paddr(ap_page) >> 12;
+	smp_ipi_all_aps(LAPIC_ICR_DELIVERY_INIT);
 	delay(10);
-	*((volatile uint32_t*)(lapic_base + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_SIPI | page_get_paddr(ap_page) >> 12;
-	delay(200);
-	*((volatile uint32_t*)(lapic_base + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_SIPI | page_get_paddr(ap_page) >> 12;
-	delay(200);
+	smp_ipi_all_aps(LAPIC_ICR_DELIVERY_SIPI | vector);
+	delay_us(200);
+	smp_ipi_all_aps(LAPIC_ICR_DELIVERY_SIPI | vector);
+	delay_us(200);
+
+	kprintf("SMP: %d CPU(s) found, launching %d CPU(s)\n", smp_config.cfg_num_cpus, smp_config.cfg_num_cpus - 1);
+	return ananas_success();
+}
+
+INIT_FUNCTION(smp_launch, SUBSYSTEM_SMP, ORDER_MIDDLE);
+
+/*
+ * Called on the Boot Strap Processor once all devices are attached; waits for
+ * the AP's to be up and cleans up after their launch.
+ */
+static errorcode_t
+smp_launch_finish()
+{
+	if (!smp_active)
+		return ananas_success();
 
-	kprintf("SMP: %d CPU(s) found, waiting for %d CPU(s)\n", smp_config.cfg_num_cpus, smp_config.cfg_num_cpus - num_smp_launched);
 	while(num_smp_launched < smp_config.cfg_num_cpus)
-		/* wait for it ... */ ;
+		md_cpu_relax();
+
+	/* Every CPU takes interrupts now; spread the devices over them */
+	irq_balance();
 
 	/* All done - we can throw away the AP code and mappings */
 	page_free(ap_page);
@@ -257,19 +460,47 @@ smp_launch()
 	return ananas_success();
 }
 
-INIT_FUNCTION(smp_launch, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+INIT_FUNCTION(smp_launch_finish, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
 
 void
 smp_panic_others()
 {	
 	if (num_smp_launched > 1)
-		*((volatile uint32_t*)(PTOKV(LAPIC_BASE) + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_PANIC;
+		lapic_send_ipi_shorthand(LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_PANIC);
 }
 
 void
 smp_broadcast_schedule()
 {
-	*((volatile uint32_t*)(PTOKV(LAPIC_BASE) + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_INC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_SCHEDULE;
+	lapic_send_ipi_shorthand(LAPIC_ICR_DEST_ALL_INC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_SCHEDULE);
+}
+
+/*
+ * Sends IPI vector 'ipi' to a single CPU only.
+ */
+static void
+smp_ipi_cpu(int cpuid, int ipi)
+{
+	KASSERT(cpuid >= 0 && cpuid < smp_config.cfg_num_cpus, "invalid cpu %d", cpuid);
+	lapic_send_ipi(smp_config.cfg_cpu[cpuid].lapic_id, LAPIC_ICR_DEST_FIELD | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | ipi);
+}
+
+/*
+ * Sends a reschedule IPI to a single CPU only.
+ */
+void
+smp_ipi_schedule_cpu(int cpuid)
+{
+	smp_ipi_cpu(cpuid, SMP_IPI_SCHEDULE);
+}
+
+/*
+ * Asks a single CPU to handle the pending TLB shootdown request.
+ */
+void
+smp_ipi_tlb_cpu(int cpuid)
+{
+	smp_ipi_cpu(cpuid, SMP_IPI_TLB);
 }
 
 /*
@@ -278,28 +509,30 @@ smp_broadcast_schedule()
 extern "C" void
 mp_ap_startup(uint32_t lapic_id)
 {
+	/* Anything below may look at the time, which may need our own kvmclock */
+	kvmclock_init_ap();
+
 	/* Switch to our idle thread */
 	thread_t* idlethread = PCPU_GET(idlethread);
   PCPU_SET(curthread, idlethread);
   scheduler_add_thread(idlethread);
 
-	/* Reset destination format to flat mode */
-	addr_t lapic_base = PTOKV(LAPIC_BASE);
-	*(volatile uint32_t*)(lapic_base + LAPIC_DF) = 0xffffffff;
-	/* Ensure we are the logical destination of our local APIC */
-	volatile uint32_t* v = (volatile uint32_t*)(lapic_base + LAPIC_LD);
-	*v = (*v & 0x00ffffff) | 1 << (lapic_id + 24);
-	/* Clear Task Priority register; this enables all LAPIC interrupts */
-	*(volatile uint32_t*)(lapic_base + LAPIC_TPR) &= ~0xff;
-	/* Finally, enable the APIC */
-	*(volatile uint32_t*)(lapic_base + LAPIC_SVR) |= LAPIC_SVR_APIC_EN;
+	/* Bring our Local APIC in the same mode as the BSP's */
+	lapic_init_ap(lapic_id);
 
 	/* Wait for it ... */
 	while (!can_smp_launch)
-		/* nothing */ ;
+		md_cpu_relax();
 
 	/* We're up and running! Increment the launched count */
 	__asm("lock incl (num_smp_launched)");
+
+	/* Start our own timer; the BSP has calibrated it for us */
+	smp_setup_timer();
+	smp_start_timer();
+
+	/* From now on, we must take part in kernel TLB shootdowns */
+	md_tlb_cpu_online();
 	
 	/* Enable interrupts and become the idle thread; this doesn't return */
 	md_interrupts_enable();
@@ -0,0 +1,147 @@
+/*
+ * x86 power management, as used by kern/cpupower.cpp. Rather than interpret
+ * the ACPI _CST and _PSS methods, we use what the CPU itself enumerates:
+ *
+ * - Idle states: C1 is entered using hlt. If MONITOR/MWAIT is available and
+ *   CPUID leaf 5 lists deeper C-states, the deepest one is entered using an
+ *   MWAIT hint.
+ * - Frequency: if the CPU supports hardware-controlled P-states (HWP), we
+ *   enable them and set the range and energy/performance preference according
+ *   to the mode; the CPU then raises the frequency under load by itself.
+ *   Without HWP, the frequency is left as the firmware set it up.
+ */
+#include <ananas/types.h>
+#include <ananas/cpupower.h>
+#include <ananas/lib.h>
+#include <ananas/pcpu.h>
+#include <machine/macro.h>
+
+#define CPUID_1_ECX_MONITOR		(1 << 3)
+#define CPUID_MWAIT_LEAF		5
+#define  CPUID_5_ECX_EXTENSIONS		(1 << 0)	/* EDX enumerates the C-states */
+#define  CPUID_5_ECX_INTERRUPT_BREAK	(1 << 1)
+#define CPUID_POWER_LEAF		6
+#define  CPUID_6_EAX_HWP		(1 << 7)
+#define  CPUID_6_EAX_HWP_EPP		(1 << 10)
+
+#define MSR_PM_ENABLE			0x770
+#define  PM_ENABLE_HWP			(1 << 0)
+#define MSR_HWP_CAPABILITIES		0x771
+#define  HWP_CAP_HIGHEST(x)		((x) & 0xff)
+#define  HWP_CAP_GUARANTEED(x)		(((x) >> 8) & 0xff)
+#define  HWP_CAP_EFFICIENT(x)		(((x) >> 16) & 0xff)
+#define  HWP_CAP_LOWEST(x)		(((x) >> 24) & 0xff)
+#define MSR_HWP_REQUEST			0x774
+#define  HWP_REQUEST(min, max, desired, epp) \
+	((uint64_t)(min) | (uint64_t)(max) << 8 | (uint64_t)(desired) << 16 | (uint64_t)(epp) << 24)
+
+/* Energy/performance preference; 0 is all performance, 255 all energy saving */
+#define HWP_EPP_PERFORMANCE		0x00
+#define HWP_EPP_BALANCED		0x80
+#define HWP_EPP_POWERSAVE		0xff
+
+namespace {
+
+bool cpupower_have_hwp;
+bool cpupower_have_epp;
+uint32_t cpupower_mwait_hint;		/* for the deep idle state */
+char cpupower_deep_name[8];
+
+} // unnamed namespace
+
+unsigned int
+md_cpupower_probe()
+{
+	uint32_t max_leaf, eax, ebx, ecx, edx;
+	cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+	if (max_leaf >= CPUID_POWER_LEAF) {
+		cpuid(CPUID_POWER_LEAF, 0, &eax, &ebx, &ecx, &edx);
+		cpupower_have_hwp = (eax & CPUID_6_EAX_HWP) != 0;
+		cpupower_have_epp = (eax & CPUID_6_EAX_HWP_EPP) != 0;
+	}
+
+	/*
+	 * Deep states need MWAIT, and it must be woken by interrupts; we go to
+	 * sleep using 'sti; mwait', which relies on that.
+	 */
+	unsigned int num_states = 1;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if ((ecx & CPUID_1_ECX_MONITOR) && max_leaf >= CPUID_MWAIT_LEAF) {
+		cpuid(CPUID_MWAIT_LEAF, 0, &eax, &ebx, &ecx, &edx);
+		if ((ecx & CPUID_5_ECX_EXTENSIONS) && (ecx & CPUID_5_ECX_INTERRUPT_BREAK)) {
+			/* EDX holds the number of sub-states of C0 .. C7, 4 bits each */
+			for (unsigned int c = 7; c >= 2; c--) {
+				unsigned int num_sub = (edx >> (c * 4)) & 0xf;
+				if (num_sub == 0)
+					continue;
+				cpupower_mwait_hint = (c - 1) << 4 | (num_sub - 1);
+				snprintf(cpupower_deep_name, sizeof(cpupower_deep_name), "C%u", c);
+				num_states = 2;
+				break;
+			}
+		}
+	}
+
+	kprintf("cpupower: idle states C1%s%s, %s\n", (num_states > 1) ? " " : "", (num_states > 1) ? cpupower_deep_name : "",
+	 cpupower_have_hwp ? "hardware-controlled P-states" : "no frequency control");
+	return num_states;
+}
+
+const char*
+md_cpupower_idle_state_name(unsigned int state)
+{
+	return (state == 0) ? "C1" : cpupower_deep_name;
+}
+
+void
+md_cpupower_apply(unsigned int mode, char* descr, size_t len)
+{
+	if (!cpupower_have_hwp) {
+		snprintf(descr, len, "fixed");
+		return;
+	}
+
+	/* Once enabled, HWP stays on until reset; it cannot be turned off again */
+	wrmsr(MSR_PM_ENABLE, PM_ENABLE_HWP);
+	uint64_t caps = rdmsr(MSR_HWP_CAPABILITIES);
+	unsigned int lowest = HWP_CAP_LOWEST(caps), highest = HWP_CAP_HIGHEST(caps);
+
+	/* A desired performance of 0 lets the CPU choose within [min, max] */
+	uint64_t request;
+	switch(mode) {
+		case CPUPOWER_MODE_PERFORMANCE:
+			request = HWP_REQUEST(highest, highest, 0, HWP_EPP_PERFORMANCE);
+			break;
+		case CPUPOWER_MODE_POWERSAVE:
+			request = HWP_REQUEST(lowest, highest, 0, HWP_EPP_POWERSAVE);
+			break;
+		default:
+			request = HWP_REQUEST(lowest, highest, 0, HWP_EPP_BALANCED);
+			break;
+	}
+	if (!cpupower_have_epp)
+		request &= ~HWP_REQUEST(0, 0, 0, 0xff);
+	wrmsr(MSR_HWP_REQUEST, request);
+	snprintf(descr, len, "hwp %u-%u/%u epp %u", (unsigned int)(request & 0xff), (unsigned int)((request >> 8) & 0xff),
+	 HWP_CAP_GUARANTEED(caps), (unsigned int)((request >> 24) & 0xff));
+}
+
+void
+md_cpu_idle_state(struct PCPU* pcpu, unsigned int state)
+{
+	if (state == 0) {
+		md_cpu_idle();
+		return;
+	}
+
+	/*
+	 * We do not actually wait for a write; anything that needs us to wake up
+	 * sends an interrupt. The sti shadow ensures it cannot arrive before we are
+	 * in the mwait.
+	 */
+	__asm __volatile("monitor" : : "a" (&pcpu->power_idle), "c" (0), "d" (0));
+	__asm __volatile("sti; mwait" : : "a" (cpupower_mwait_hint), "c" (0));
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,119 @@
+/*
+ * x86 performance counters, as used by kern/perfctr.cpp. We only support the
+ * architectural performance monitoring that CPUID leaf 0xa enumerates, which
+ * has the events we count at the same encoding on every CPU implementing it;
+ * elsewhere, nothing is counted.
+ *
+ * Counter n of the general-purpose counters counts PERFCTR_* event n, so we
+ * need as many counters as events we want to count.
+ */
+#include <ananas/types.h>
+#include <ananas/lib.h>
+#include <ananas/perfctr.h>
+#include <machine/macro.h>
+
+#define CPUID_PERFMON_LEAF		0xa
+#define  CPUID_A_EAX_VERSION(x)		((x) & 0xff)
+#define  CPUID_A_EAX_NUM_COUNTERS(x)	(((x) >> 8) & 0xff)
+#define  CPUID_A_EAX_WIDTH(x)		(((x) >> 16) & 0xff)
+#define  CPUID_A_EAX_EBX_LENGTH(x)	(((x) >> 24) & 0xff)
+/* In EBX, a set bit means the event is not available */
+#define  CPUID_A_EBX_CORE_CYCLES	0
+#define  CPUID_A_EBX_INSTRUCTIONS	1
+#define  CPUID_A_EBX_LLC_MISSES		4
+#define  CPUID_A_EBX_BRANCH_MISSES	6
+
+#define MSR_PERFEVTSEL(n)		(0x186 + (n))
+#define  PERFEVTSEL_USR			(1 << 16)
+#define  PERFEVTSEL_OS			(1 << 17)
+#define  PERFEVTSEL_EN			(1 << 22)
+#define  PERFEVTSEL_EVENT(event, umask)	((event) | (umask) << 8)
+#define MSR_PERF_GLOBAL_CTRL		0x38f	/* version 2 and later */
+
+namespace {
+
+struct PERFCTR_EVENT {
+	unsigned int	pe_cpuid_bit;
+	uint32_t	pe_evtsel;
+} const perfctr_event[PERFCTR_NUM] = {
+	{ CPUID_A_EBX_CORE_CYCLES, PERFEVTSEL_EVENT(0x3c, 0x00) },
+	{ CPUID_A_EBX_INSTRUCTIONS, PERFEVTSEL_EVENT(0xc0, 0x00) },
+	{ CPUID_A_EBX_LLC_MISSES, PERFEVTSEL_EVENT(0x2e, 0x41) },
+	{ CPUID_A_EBX_BRANCH_MISSES, PERFEVTSEL_EVENT(0xc5, 0x00) },
+};
+
+unsigned int perfctr_version;
+unsigned int perfctr_valid;
+
+inline uint64_t
+rdpmc(uint32_t counter)
+{
+	uint32_t hi, lo;
+	__asm __volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+	return (uint64_t)hi << 32 | lo;
+}
+
+} // unnamed namespace
+
+unsigned int
+md_perfctr_probe(unsigned int* width)
+{
+	*width = 64;
+	uint32_t max_leaf, eax, ebx, ecx, edx;
+	cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+	if (max_leaf < CPUID_PERFMON_LEAF) {
+		kprintf("perfctr: no architectural performance monitoring\n");
+		return 0;
+	}
+
+	cpuid(CPUID_PERFMON_LEAF, 0, &eax, &ebx, &ecx, &edx);
+	perfctr_version = CPUID_A_EAX_VERSION(eax);
+	unsigned int num_counters = CPUID_A_EAX_NUM_COUNTERS(eax);
+	unsigned int ebx_length = CPUID_A_EAX_EBX_LENGTH(eax);
+	if (perfctr_version == 0 || num_counters == 0) {
+		kprintf("perfctr: no architectural performance monitoring\n");
+		return 0;
+	}
+
+	for (unsigned int n = 0; n < PERFCTR_NUM && n < num_counters; n++) {
+		const struct PERFCTR_EVENT& pe = perfctr_event[n];
+		if (pe.pe_cpuid_bit >= ebx_length || (ebx & (1 << pe.pe_cpuid_bit)) != 0)
+			continue;
+		perfctr_valid |= 1 << n;
+	}
+	*width = CPUID_A_EAX_WIDTH(eax);
+	kprintf("perfctr: version %u, %u counters of %u bits, events 0x%x\n", perfctr_version, num_counters, *width,
+	 perfctr_valid);
+	return perfctr_valid;
+}
+
+void
+md_perfctr_start()
+{
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++) {
+		if ((perfctr_valid & (1 << n)) == 0)
+			continue;
+		wrmsr(MSR_PERFEVTSEL(n), perfctr_event[n].pe_evtsel | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+	}
+	/* Firmware may have disabled the counters globally */
+	if (perfctr_version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | perfctr_valid);
+}
+
+void
+md_perfctr_stop()
+{
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++) {
+		if (perfctr_valid & (1 << n))
+			wrmsr(MSR_PERFEVTSEL(n), 0);
+	}
+}
+
+void
+md_perfctr_read(uint64_t* count)
+{
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++)
+		count[n] = (perfctr_valid & (1 << n)) ? rdpmc(n) : 0;
+}
+
+/* vim:set ts=2 sw=2: */
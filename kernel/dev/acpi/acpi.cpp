@@ -83,7 +83,9 @@ ACPI::Attach()
 		return ANANAS_ERROR(NO_DEVICE);
 
 	/*
-	 * Now enumerate through all ACPI devices and see what we can find.
+	 * Now enumerate through all ACPI devices and see what we can find; as we
+	 * are attached by a worker, children that can attach asynchronously are
+	 * queued and picked up by the other workers while we continue the walk.
 	 */
 	AcpiWalkNamespace(ACPI_TYPE_ANY, ACPI_ROOT_OBJECT, ACPI_UINT32_MAX, AttachDevice, NULL, this, NULL);
 
@@ -103,6 +105,7 @@ public:
 	virtual ~ACPIDriver() = default;
 
   const char* GetBussesToProbeOn() const override;
+	bool CanAttachAsynchronously() const override;
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override;
 
 };
@@ -117,6 +120,17 @@ const char* ACPIDriver::GetBussesToProbeOn() const
 	return "corebus";
 }
 
+bool ACPIDriver::CanAttachAsynchronously() const
+{
+	/*
+	 * The static tables the SMP code needs are parsed by acpi_init(); loading
+	 * and evaluating the AML namespace takes a while, and is only needed to
+	 * enumerate devices, so let a worker do it while the rest of the system
+	 * starts up.
+	 */
+	return true;
+}
+
 Ananas::Device* ACPIDriver::CreateDevice(const Ananas::CreateDeviceProperties& cdp)
 {
 	/*
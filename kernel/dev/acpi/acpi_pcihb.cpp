@@ -39,6 +39,15 @@ struct ACPI_PCIHB_Driver : public Ananas::Driver
 		return "acpi";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PNP_ID, 0x0a03, ~(Ananas::Resource::Base)0 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PNP_ID, 0);
@@ -53,6 +53,62 @@ AHCIDevice::OnIRQ()
 	Write(AHCI_REG_IS, is);
 }
 
+/* Used if every port raises a message of its own */
+void
+AHCIDevice::OnPortIRQ(Port& p)
+{
+	unsigned int n = p.p_num;
+	uint32_t pis = Read(AHCI_REG_PxIS(n));
+	Write(AHCI_REG_PxIS(n), pis);
+	p.OnIRQ(pis);
+	Write(AHCI_REG_IS, AHCI_IS_IPS(n));
+}
+
+/*
+ * Hooks up our interrupts; we prefer a message per port so that every port
+ * is serviced by a thread of its own. Port n raises message n, unless the HBA
+ * got fewer messages than it wanted, in which case it reverts to a single
+ * message (MRSM is set) - we use that, or the interrupt line, as a fallback.
+ */
+errorcode_t
+AHCIDevice::SetupIRQ(void* res_irq)
+{
+	unsigned int num_wanted = 0;
+	for (unsigned int n = 0; n < 32; n++)
+		if (ap_pi & AHCI_PI_PI(n))
+			num_wanted = n + 1;
+
+	unsigned int num_msgs = num_wanted;
+	ap_msi_enabled = ananas_is_success(pci_msi_alloc(*this, ap_msi, &num_msgs));
+	if (ap_msi_enabled && num_msgs >= num_wanted) {
+		unsigned int num_registered = 0;
+		errorcode_t err = ananas_success();
+		for (/* nothing */; num_registered < ap_num_ports; num_registered++) {
+			Port* p = ap_port[num_registered];
+			err = pci_msi_register(*this, ap_msi, p->p_num, 0, PortIRQWrapper, IRQ_TYPE_DEFAULT, p);
+			if (ananas_is_failure(err))
+				break;
+		}
+		if (ananas_is_success(err) && (Read(AHCI_REG_GHC) & AHCI_GHC_MRSM) == 0) {
+			Printf("using %u messages", num_msgs);
+			return ananas_success();
+		}
+
+		for (unsigned int i = 0; i < num_registered; i++)
+			irq_unregister(ap_msi.msi_irq[ap_port[i]->p_num], this, PortIRQWrapper, ap_port[i]);
+	}
+	if (ap_msi_enabled) {
+		if (ananas_is_success(pci_msi_register(*this, ap_msi, 0, 0, IRQWrapper, IRQ_TYPE_DEFAULT, NULL)))
+			return ananas_success();
+		pci_msi_free(*this, ap_msi);
+		ap_msi_enabled = false;
+	}
+
+	if (res_irq == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	return irq_register((int)(uintptr_t)res_irq, this, IRQWrapper, IRQ_TYPE_DEFAULT, NULL);
+}
+
 errorcode_t
 AHCIDevice::ResetPort(Port& p)
 {
@@ -126,7 +182,7 @@ AHCIDevice::Attach()
 {
 	char* res_mem = static_cast<char*>(d_ResourceSet.AllocateResource(Ananas::Resource::RT_Memory, 4096));
 	void* res_irq = d_ResourceSet.AllocateResource(Ananas::Resource::RT_IRQ, 0);
-	if (res_mem == NULL || res_irq == NULL)
+	if (res_mem == NULL)
 		return ANANAS_ERROR(NO_RESOURCE);
 
 	/* Enable busmastering; all communication is done by DMA */
@@ -178,9 +234,7 @@ AHCIDevice::Attach()
 
 	uint32_t cap = Read(AHCI_REG_CAP);
 	ap_ncs = AHCI_CAP_NCS(cap) + 1;
-
-	err = irq_register((int)(uintptr_t)res_irq, this, IRQWrapper, IRQ_TYPE_DEFAULT, NULL);
-	ANANAS_ERROR_RETURN(err);
+	ap_sncq = (cap & AHCI_CAP_SNCQ) != 0;
 
 	/* Force all ports into idle mode */
 	int need_wait = 0;
@@ -277,6 +331,10 @@ AHCIDevice::Attach()
 		);
 	}
 
+	/* Hook up our interrupts now that all ports are known */
+	err = SetupIRQ(res_irq);
+	ANANAS_ERROR_RETURN(err);
+
 	/* Enable global AHCI interrupts */
 	Write(AHCI_REG_IS, 0xffffffff);
 	Write(AHCI_REG_GHC, Read(AHCI_REG_GHC) | AHCI_GHC_IE);
@@ -322,6 +380,24 @@ struct AHCI_PCI_Driver : public Ananas::Driver
 		return "pcibus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_ClassRev, PCI_CLASSREV(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, 0, 1), 0xffff00ff },
+			/* The controllers listed by ID in CreateDevice() */
+			{ Ananas::Resource::RT_PCI_VendorID, 0x8086, 0xffff },
+			{ Ananas::Resource::RT_PCI_VendorID, 0x10de, 0xffff },
+			{ Ananas::Resource::RT_PCI_VendorID, 0x1039, 0xffff },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	bool CanAttachAsynchronously() const override
+	{
+		return true;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_ClassRev, 0);
@@ -2,6 +2,7 @@
 #define __ANANAS_AHCIPCI_H__
 
 #include <ananas/types.h>
+#include <ananas/dev/sata.h>
 
 namespace Ananas {
 namespace AHCI {
@@ -264,16 +265,22 @@ struct AHCI_PCI_PRDE {
 #define AHCI_PRDE_DW3_DBC(x)		(x)
 } __attribute__((packed));
 
+/* Maximum number of bytes a single PRD entry can describe */
+#define AHCI_PRDE_MAX_BYTES		(4 * 1024 * 1024)
+
+/*
+ * Number of PRD entries per command table; this covers a request in which no
+ * two bio's are physically adjacent (those that are share a single entry).
+ */
+#define AHCI_CT_MAX_PRD			SATA_REQUEST_MAX_BIOS
+
 /* Command Table */
 struct AHCI_PCI_CT {
 	uint8_t		ct_cfis[64];
 	uint8_t		ct_acmd[16];
 	uint8_t		ct_rsvd[48];
-	/*
-	 * Note that even though AHCI supports multiple PRD's, we only use a
-	 * single one.
-	 */
-	struct		AHCI_PCI_PRDE ct_prd[1];
+	/* sr_buffer requests use only the first PRD */
+	struct		AHCI_PCI_PRDE ct_prd[AHCI_CT_MAX_PRD];
 } __attribute__((packed));
 
 #if AHCI_DEBUG
@@ -7,6 +7,7 @@
 #include <ananas/error.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/dma.h>
 #include <machine/vm.h>
 #include "ahci.h"
 #include "ahci-pci.h"
@@ -25,6 +26,7 @@ Port::Port(const Ananas::CreateDeviceProperties& cdp)
 	p_request_in_use = 0;
 	p_request_active = 0;
 	p_request_valid = 0;
+	p_request_ncq = 0;
 	memset(&p_request, 0, sizeof(p_request));
 }
 
@@ -34,13 +36,18 @@ Port::OnIRQ(uint32_t pis)
 	AHCI_DPRINTF("got irq, pis=%x", pis);
 
 	PORT_LOCK;
+	/*
+	 * Native queued commands are only done once the device clears their bit
+	 * in SACT; their CI bit is cleared as soon as the command is accepted.
+	 */
 	uint32_t ci = p_device.Read(AHCI_REG_PxCI(p_num));
+	uint32_t sact = p_device.Read(AHCI_REG_PxSACT(p_num));
 	for (int i = 0; i < p_device.ap_ncs; i++) {
 		if ((p_request_valid & (1 << i)) == 0)
 			continue;
 
 		/* It's valid; this could be triggered */
-		if ((ci & AHCI_PxCIT_CI(i)) != 0)
+		if ((ci & AHCI_PxCIT_CI(i)) != 0 || (sact & AHCI_PxSACT_DS(i)) != 0)
 			continue; /* no status update here */
 		if ((p_request_active & (1 << i)) == 0) {
 			Printf("got trigger for inactive request %d", i);
@@ -55,16 +62,19 @@ Port::OnIRQ(uint32_t pis)
 		struct SATA_REQUEST* sr = &pr->pr_request;
 		if (sr->sr_semaphore != NULL)
 			sem_signal(sr->sr_semaphore);
-		if (sr->sr_bio != NULL) {
-			if (sr->sr_flags & SATA_REQUEST_FLAG_WRITE)
-				sr->sr_bio->flags &= ~BIO_FLAG_DIRTY;
-			bio_set_available(sr->sr_bio);
+		for (struct BIO* bio = sr->sr_bio; bio != NULL; /* nothing */) {
+			struct BIO* next = bio->io_next; /* bio may be reused once available */
+			dma_buf_unload_bio(pr->pr_dmabuf_ct, bio);
+			bio_set_available(bio);
+			bio = next;
 		}
 
 		/* This request is no longer active nor valid */
 		p_request_active &= ~(1 << i);
+		p_request_ncq &= ~(1 << i);
 		p_request_valid &= ~(1 << i);
 		p_request_in_use &= ~(1 << i);
+		sem_signal(&p_slot_sem);
 	}
 	PORT_UNLOCK;
 }
@@ -73,6 +83,7 @@ errorcode_t
 Port::Attach()
 {
 	int n = p_num;
+	sem_init(&p_slot_sem, p_device.ap_ncs);
 
 	/*
 	 * XXX We should attach ports that do not have anything connected to them;
@@ -136,27 +147,19 @@ Port::Detach()
 void
 Port::Enqueue(void* item)
 {
-	/* Fetch an usable command slot */
-	int n = -1;
-	while (n < 0) {
-		PORT_LOCK;
-		int i = 0;
-		for (/* nothing */; i < p_device.ap_ncs; i++)
-			if ((p_request_in_use & (1 << i)) == 0)
-				break;
-		if (i < p_device.ap_ncs) {
-			p_request_in_use |= 1 << i;
-			n = i;
-		} 
-		PORT_UNLOCK;
-
-		if (n < 0) {
-			/* XXX This is valid, but it'd be odd without any load */
-			Printf("ahciport_enqueue(): out of command slots; retrying (%x)", p_request_in_use);
-
-			/* XXX We should sleep on some wakeup condition - use a semaphore ? */
-		}
-	}
+	/*
+	 * Fetch an usable command slot; the semaphore counts the free slots, so
+	 * once we get past it one is guaranteed to be available.
+	 */
+	sem_wait(&p_slot_sem);
+	PORT_LOCK;
+	int n = 0;
+	for (/* nothing */; n < p_device.ap_ncs; n++)
+		if ((p_request_in_use & (1 << n)) == 0)
+			break;
+	KASSERT(n < p_device.ap_ncs, "no free slot (%x)", p_request_in_use);
+	p_request_in_use |= 1 << n;
+	PORT_UNLOCK;
 
 	/* Enqueue the item and mark it as valid */
 	memcpy(&p_request[n], item, sizeof(struct SATA_REQUEST));
@@ -165,6 +168,83 @@ Port::Enqueue(void* item)
 	PORT_UNLOCK;
 }
 
+/* Fills PRD entry n of ct; returns the number of entries in use */
+unsigned int
+Port::SetPRD(struct AHCI_PCI_CT* ct, unsigned int n, uint64_t data_ptr, uint32_t len)
+{
+	ct->ct_prd[n].prde_dw0 = AHCI_PRDE_DW0_DBA(data_ptr & 0xffffffff);
+	ct->ct_prd[n].prde_dw1 = AHCI_PRDE_DW1_DBAU(data_ptr >> 32);
+	ct->ct_prd[n].prde_dw2 = 0;
+	ct->ct_prd[n].prde_dw3 = AHCI_PRDE_DW3_DBC(len - 1);
+	return n + 1;
+}
+
+namespace {
+
+/* Collects the DMA segments of a request's bio's into PRD entries */
+struct PRD_LOAD {
+	struct AHCI_PCI_CT* pl_ct;
+	unsigned int pl_num_prd;
+	uint32_t pl_len;		/* Length of the bio being loaded */
+};
+
+errorcode_t
+ahci_prd_load(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs)
+{
+	auto pl = static_cast<struct PRD_LOAD*>(ctx);
+	KASSERT(num_segs == 1, "unsupported number of segments %d", num_segs);
+
+	/* If this continues the previous entry, just enlarge that one */
+	if (pl->pl_num_prd > 0) {
+		struct AHCI_PCI_PRDE* prde = &pl->pl_ct->ct_prd[pl->pl_num_prd - 1];
+		uint64_t phys = (uint64_t)prde->prde_dw1 << 32 | prde->prde_dw0;
+		uint32_t len = AHCI_PRDE_DW3_DBC(prde->prde_dw3) + 1;
+		if (phys + len == s->s_phys && len + pl->pl_len <= AHCI_PRDE_MAX_BYTES) {
+			prde->prde_dw3 = AHCI_PRDE_DW3_DBC(len + pl->pl_len - 1);
+			return ananas_success();
+		}
+	}
+
+	KASSERT(pl->pl_num_prd < AHCI_CT_MAX_PRD, "too many PRD entries in request");
+	struct AHCI_PCI_PRDE* prde = &pl->pl_ct->ct_prd[pl->pl_num_prd++];
+	prde->prde_dw0 = AHCI_PRDE_DW0_DBA(s->s_phys & 0xffffffff);
+	prde->prde_dw1 = AHCI_PRDE_DW1_DBAU(s->s_phys >> 32);
+	prde->prde_dw2 = 0;
+	prde->prde_dw3 = AHCI_PRDE_DW3_DBC(pl->pl_len - 1);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+/* Builds the PRD table of the request from the chain of bio's; returns the number of entries in use */
+unsigned int
+Port::LoadBIOs(Request& pr, struct BIO* bio)
+{
+	struct PRD_LOAD pl;
+	pl.pl_ct = pr.pr_ct;
+	pl.pl_num_prd = 0;
+	int load_flags = (pr.pr_request.sr_flags & SATA_REQUEST_FLAG_WRITE) ? DMA_LOAD_FLAG_WRITE : DMA_LOAD_FLAG_READ;
+	for (unsigned int num_bios = 0; bio != NULL; bio = bio->io_next, num_bios++) {
+		KASSERT(num_bios < SATA_REQUEST_MAX_BIOS, "too many bio's in request");
+		pl.pl_len = bio->length;
+		errorcode_t err = dma_buf_load_bio(pr.pr_dmabuf_ct, bio, ahci_prd_load, &pl, load_flags);
+		KASSERT(ananas_is_success(err), "unable to load bio %p, %d", bio, err);
+	}
+	return pl.pl_num_prd;
+}
+
+unsigned int
+Port::GetNumberOfSlots() const
+{
+	return p_device.ap_ncs;
+}
+
+bool
+Port::SupportsNCQ() const
+{
+	return p_device.ap_sncq;
+}
+
 void
 Port::Start()
 {
@@ -176,32 +256,40 @@ Port::Start()
 	 */
 	PORT_LOCK;
 	uint32_t ci = p_request_active;
+	uint32_t ncq = p_request_ncq;
 	for (int i = 0; i < p_device.ap_ncs; i++) {
 		if ((p_request_valid & (1 << i)) == 0)
 			continue;
-		if ((p_request_active & (1 << i)) != 0)
+		if ((ci & (1 << i)) != 0)
 			continue;
 
-		/* Request is valid but not yet active; program it */
+		/*
+		 * Native queued and ordinary commands cannot be outstanding at the same
+		 * time; anything of the other kind must wait until the active commands
+		 * are done.
+		 */
 		Request* pr = &p_request[i];
 		struct SATA_REQUEST* sr = &pr->pr_request;
+		bool is_ncq = (sr->sr_flags & SATA_REQUEST_FLAG_NCQ) != 0;
+		if (is_ncq ? (ci & ~ncq) != 0 : ncq != 0)
+			continue;
 
-		/* XXX use dma for data_ptr */
-		uint64_t data_ptr;
-		if (sr->sr_buffer != NULL)
-			data_ptr = kmem_get_phys(sr->sr_buffer);
-		else
-			data_ptr = kmem_get_phys(BIO_DATA(sr->sr_bio));
+		/* Request is valid but not yet active; program it. The tag is the slot */
+		if (is_ncq) {
+			sata_fis_h2d_set_tag(&sr->sr_fis.fis_h2d, i);
+			ncq |= 1 << i;
+		}
 
-		/* Construct the command table; it will always have 1 PRD entry */
+		/* Construct the command table; the bio's are described by as few PRD entries as possible */
 		struct AHCI_PCI_CT* ct = pr->pr_ct;
-		memset(ct, 0, sizeof(struct AHCI_PCI_CT));
+		memset(ct, 0, __builtin_offsetof(struct AHCI_PCI_CT, ct_prd));
 
-		ct->ct_prd[0].prde_dw0 = AHCI_PRDE_DW0_DBA(data_ptr & 0xffffffff);
-		ct->ct_prd[0].prde_dw1 = AHCI_PRDE_DW1_DBAU(data_ptr >> 32);
-		ct->ct_prd[0].prde_dw2 = 0;
-		ct->ct_prd[0].prde_dw3 = AHCI_PRDE_DW3_I | AHCI_PRDE_DW3_DBC(sr->sr_count - 1);
-		ct->ct_prd[0].prde_dw3 = AHCI_PRDE_DW3_DBC(sr->sr_count - 1);
+		unsigned int num_prd = 0;
+		if (sr->sr_buffer != NULL) {
+			num_prd = SetPRD(ct, 0, kmem_get_phys(sr->sr_buffer), sr->sr_count);
+		} else {
+			num_prd = LoadBIOs(*pr, sr->sr_bio);
+		}
 		/* XXX handle atapi */
 		memcpy(&ct->ct_cfis[0], &sr->sr_fis.fis_h2d, sizeof(struct SATA_FIS_H2D));
 		dma_buf_sync(pr->pr_dmabuf_ct, DMA_SYNC_OUT);
@@ -211,7 +299,7 @@ Port::Start()
 		uint64_t addr_ct = dma_buf_get_segment(pr->pr_dmabuf_ct, 0)->s_phys;
 		memset(cle, 0, sizeof(struct AHCI_PCI_CLE));
 		cle->cle_dw0 =
-		 AHCI_CLE_DW0_PRDTL(1) |
+		 AHCI_CLE_DW0_PRDTL(num_prd) |
 		 AHCI_CLE_DW0_PMP(0) |
 		 AHCI_CLE_DW0_CFL(sr->sr_fis_length / 4);
 		if (sr->sr_flags & SATA_REQUEST_FLAG_WRITE)
@@ -230,12 +318,17 @@ Port::Start()
 		PORT_UNLOCK;
 		return;
 	}
+	uint32_t new_ncq = ncq & ~p_request_ncq;
 	p_request_active = ci;
+	p_request_ncq = ncq;
 	PORT_UNLOCK;
 
 	AHCI_DPRINTF(">> #%d issuing command\n", p_num);
 	DUMP_PORT_STATE(p_num);
 
+	/* Queued commands must be marked in SACT before they are issued */
+	if (new_ncq != 0)
+		p_device.Write(AHCI_REG_PxSACT(p_num), new_ncq);
 	p_device.Write(AHCI_REG_PxCI(p_num), ci);
 }
 
@@ -1,6 +1,7 @@
 #ifndef __ANANAS_AHCI2_H__
 #define __ANANAS_AHCI2_H__
 
+#include <ananas/bus/pci.h>
 #include <ananas/dev/sata.h>
 #include <ananas/irq.h>
 #include <ananas/dma.h>
@@ -42,6 +43,8 @@ public:
 
 	void Enqueue(void* request);
 	void Start();
+	unsigned int GetNumberOfSlots() const;
+	bool SupportsNCQ() const;
 
 	spinlock_t p_lock;
 	AHCIDevice& p_device;		/* [RO] Device we belong to */
@@ -51,12 +54,18 @@ public:
 
 	struct AHCI_PCI_CLE* p_cle;
 	struct AHCI_PCI_RFIS* p_rfis;
+	semaphore_t p_slot_sem;		/* Signalled whenever a command slot frees up */
 	uint32_t p_request_in_use;	/* [RW] Current requests in use */
 	uint32_t p_request_valid;	/* [RW] Requests that can be activated */
 	uint32_t p_request_active;	/* [RW] Requests that are activated */
+	uint32_t p_request_ncq;		/* [RW] Activated requests which are native queued */
 	struct Request p_request[32];
 
 	void OnIRQ(uint32_t pis);
+
+private:
+	unsigned int SetPRD(struct AHCI_PCI_CT* ct, unsigned int n, uint64_t data_ptr, uint32_t len);
+	unsigned int LoadBIOs(Request& pr, struct BIO* bio);
 };
 
 class AHCIDevice : public Ananas::Device, private Ananas::IDeviceOperations
@@ -86,6 +95,7 @@ protected:
 	}
 
 	void OnIRQ();
+	void OnPortIRQ(Port& p);
 
 	static irqresult_t IRQWrapper(Ananas::Device* device, void* context)
 	{
@@ -94,6 +104,14 @@ protected:
 		return IRQ_RESULT_PROCESSED;
 	}
 
+	static irqresult_t PortIRQWrapper(Ananas::Device* device, void* context)
+	{
+		auto ahci = static_cast<AHCIDevice*>(device);
+		ahci->OnPortIRQ(*static_cast<Port*>(context));
+		return IRQ_RESULT_PROCESSED;
+	}
+
+	errorcode_t SetupIRQ(void* res_irq);
 
 	errorcode_t ResetPort(Port& p);
 
@@ -103,8 +121,11 @@ private:
 	addr_t ap_addr;
 	uint32_t ap_pi;
 	unsigned int ap_ncs;
+	bool ap_sncq;
 	unsigned int ap_num_ports;
 	Port** ap_port;
+	struct PCI_MSI ap_msi;
+	bool ap_msi_enabled;
 };
 
 } // namespace AHCI
@@ -1,9 +1,12 @@
 #include <ananas/types.h>
 #include <ananas/bus/pci.h>
 #include <ananas/bio.h>
+#include <ananas/dma.h>
 #include <ananas/driver.h>
+#include <ananas/endian.h>
 #include <ananas/error.h>
 #include <ananas/irq.h>
+#include <ananas/kmem.h>
 #include <ananas/mm.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
@@ -15,35 +18,92 @@
 
 TRACE_SETUP;
 
-#define ATA_FREELIST_LENGTH 16
-
 namespace Ananas {
 namespace ATA {
 
+namespace {
+
+/* Fills the PRDT with the bio's of a DMA request */
+struct ATA_PRDT_LOAD {
+	struct ATAPCI_PRDT*	pl_prdt;
+	unsigned int		pl_num;
+	uint32_t		pl_len;		/* length of the segment being loaded */
+};
+
+errorcode_t
+ata_prdt_load(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs)
+{
+	auto pl = static_cast<struct ATA_PRDT_LOAD*>(ctx);
+	KASSERT(num_segs == 1, "unsupported number of segments %d", num_segs);
+
+	dma_addr_t phys = s->s_phys;
+	for (uint32_t len = pl->pl_len; len > 0; /* nothing */) {
+		uint32_t chunk = ATA_PRDT_BOUNDARY - (phys & (ATA_PRDT_BOUNDARY - 1));
+		if (chunk > len)
+			chunk = len;
+		KASSERT(pl->pl_num < ATA_PCI_NUMPRDT, "prdt overflow");
+		struct ATAPCI_PRDT* prdt = &pl->pl_prdt[pl->pl_num++];
+		prdt->prdt_base = (uint32_t)phys;
+		prdt->prdt_size = chunk & 0xffff; /* 0 means 64KB */
+		phys += chunk;
+		len -= chunk;
+	}
+	return ananas_success();
+}
+
+} // unnamed namespace
+
 void
 ATAController::OnIRQ()
 {
 	int stat = inb(ata_io + ATA_REG_STATUS);
 
-	/* Grab the top request from the queue */
+	/* Grab the request the device is working on; it stays queued until it is done */
 	struct ATA_REQUEST_ITEM* item = NULL;
 	spinlock_lock(&spl_requests);
-	if (!QUEUE_EMPTY(&requests)) {
+	if (ata_active && !ata_handling) {
+		KASSERT(!QUEUE_EMPTY(&requests), "active ata request without queue items");
 		item = QUEUE_HEAD(&requests);
-		QUEUE_POP_HEAD(&requests);
-		KASSERT(item->bio != NULL, "ata queue item without associated bio buffer!");
+		KASSERT(item->bio != NULL || item->done != NULL, "ata queue item without associated bio buffer!");
+		ata_handling = true;
 	}
 	spinlock_unlock(&spl_requests);
 
 	/*
-	 * If there are no requests, just leave -  ATA may give extra interrupts,
-	 * which we should happily ignore as the queue is empty when they arrive.
+	 * If there is no active request, just leave -  ATA may give extra
+	 * interrupts, which we should happily ignore. The same goes if the request
+	 * is being timed out.
 	 */
 	if (item == NULL)
 		return;
 
-	/* If this is an ATAPI command, we may need to send the command bytes at this point */
-	if (item->flags & ATA_ITEM_FLAG_ATAPI) {
+	bool error = false;
+	if (item->flags & ATA_ITEM_FLAG_DMA) {
+		/*
+		 * DMA request; this means we'll have to determine whether the request
+		 * worked and flag the buffers as such - they should have already been
+		 * filled.
+		 */
+		uint32_t dma_io = GetDMAIO();
+		outb(dma_io + ATA_PCI_REG_PRI_COMMAND, 0);
+
+		int dma_stat = inb(dma_io + ATA_PCI_REG_PRI_STATUS);
+		if ((dma_stat & ATA_PCI_STAT_ERROR) || (stat & ATA_STAT_ERR))
+			error = true;
+
+		/* Reset the status bits */
+		outb(dma_io + ATA_PCI_REG_PRI_STATUS, dma_stat);
+
+		/* Release any bounce pages; whatever was read into them is copied to where it belongs */
+		for (struct BIO* bio = item->bio; bio != NULL; bio = bio->io_next)
+			dma_buf_unload_bio(ata_dmabuf_prdt, bio);
+	} else if (stat & ATA_STAT_ERR) {
+		/* Use old-style error checking first */
+		kprintf("ata error %x ==> %x\n", stat, inb(ata_io + 1));
+		error = true;
+	} else if (item->bio == NULL) {
+		/* Non-data command; there is nothing to transfer */
+	} else if (item->flags & ATA_ITEM_FLAG_ATAPI) {
 		/*
 		 * In ATAPI-land, we obtain the number of bytes that could actually be read - this much
 		 * data is waiting for us.
@@ -51,59 +111,140 @@ ATAController::OnIRQ()
 		uint16_t len = (uint16_t)inb(ata_io + ATA_REG_CYL_HI) << 8 |
 		                         inb(ata_io + ATA_REG_CYL_LO);
 		item->bio->length = len;
+		insw(ata_io + ATA_REG_DATA, item->bio->data, len / 2);
+	} else {
+		/*
+		 * PIO request OK; the device interrupts once for every sector, which we
+		 * transfer before updating the buffer status to prevent races.
+		 */
+		auto bio_data = static_cast<uint8_t*>(item->bio->data);
+		if (item->flags & ATA_ITEM_FLAG_READ) {
+			insw(ata_io + ATA_REG_DATA, bio_data + item->offset, SECTOR_SIZE / 2);
+			item->offset += SECTOR_SIZE;
+			if (item->offset < item->bio->length) {
+				Continue(); /* more sectors to come */
+				return;
+			}
+		} else if (item->offset < item->bio->length) {
+			/* Device wants the next sector to write */
+			outsw(ata_io + ATA_REG_DATA, bio_data + item->offset, SECTOR_SIZE / 2);
+			item->offset += SECTOR_SIZE;
+			Continue();
+			return;
+		}
+	}
+
+	/* Current request is done. Sign it off and away it goes */
+	timer_cancel(&ata_timer);
+	Complete(*item, error);
+	Start();
+}
+
+/* The active request is making progress; give it another timeout period to go on */
+void
+ATAController::Continue()
+{
+	spinlock_lock(&spl_requests);
+	ata_handling = false;
+	ata_deadline = timer_get_ns() + ATA_TIMEOUT_NS;
+	spinlock_unlock(&spl_requests);
+	timer_start(&ata_timer, ata_deadline);
+}
+
+/*
+ * Handles a request the device did not finish in time; we won't get any IRQ's
+ * if the request errors out, so we have to reset the channel and fail it.
+ */
+void
+ATAController::OnTimeout()
+{
+	/* The timer may have fired right before the request completed or progressed */
+	struct ATA_REQUEST_ITEM* item = NULL;
+	spinlock_lock(&spl_requests);
+	bool resetting = ata_resetting;
+	if (!resetting && ata_active && !ata_handling && timer_get_ns() >= ata_deadline) {
+		item = QUEUE_HEAD(&requests);
+		ata_handling = true;
 	}
+	spinlock_unlock(&spl_requests);
+	if (resetting) {
+		PollReset();
+		return;
+	}
+	if (item == NULL)
+		return;
 
+	Printf("unit %d: request timed out (status %x), resetting", item->unit, ReadStatus());
 	if (item->flags & ATA_ITEM_FLAG_DMA) {
-		/*
-		 * DMA request; this means we'll have to determine whether the request worked and
-		 * flag the buffer as such - it should have already been filled.
-		 */
-		uint32_t dma_io = ata_dma_io;
-		if (d_Unit > 0)
-			dma_io += 8; /* XXX crude */
+		uint32_t dma_io = GetDMAIO();
 		outb(dma_io + ATA_PCI_REG_PRI_COMMAND, 0);
+		outb(dma_io + ATA_PCI_REG_PRI_STATUS, inb(dma_io + ATA_PCI_REG_PRI_STATUS));
+		for (struct BIO* bio = item->bio; bio != NULL; bio = bio->io_next)
+			dma_buf_unload_bio(ata_dmabuf_prdt, bio);
+	}
 
-		stat = inb(dma_io + ATA_PCI_REG_PRI_STATUS);
-		if (stat & ATA_PCI_STAT_ERROR)
-			bio_set_error(item->bio);
+	/* Software reset of the channel; SRST must be held for at least 5us */
+	outb(ata_io_alt + ATA_REG_DEVCONTROL, ATA_DCR_SRST);
+	for (int i = 0; i < 100; i++)
+		(void)ReadStatus();
+	outb(ata_io_alt + ATA_REG_DEVCONTROL, 0);
 
-		/* Reset the status bits */
-		outb(dma_io + ATA_PCI_REG_PRI_STATUS, stat);
-	} else {
-		/* Use old-style error checking first */
-		if (stat & ATA_STAT_ERR) {
-			kprintf("ata error %x ==> %x\n", stat, inb(ata_io + 1));
-			bio_set_error(item->bio);
-			spinlock_lock(&spl_freelist);
-			QUEUE_ADD_TAIL(&freelist, item);
-			spinlock_unlock(&spl_freelist);
-			return;
-		}
+	/* The device may stay busy for quite a while; hold off new requests until it is done */
+	spinlock_lock(&spl_requests);
+	ata_resetting = true;
+	spinlock_unlock(&spl_requests);
+	Complete(*item, true);
+	PollReset();
+}
 
-		/*
-		 * PIO request OK - fill the bio data XXX need to port 'rep insw'. We do
-		 * this before updating the buffer status to prevent races.
-		 */
-		if (item->flags & ATA_ITEM_FLAG_READ) {
-			auto bio_data = static_cast<uint8_t*>(item->bio->data);
-			for(int count = 0; count < item->bio->length / 2; count++) {
-				uint16_t data = inw(ata_io + ATA_REG_DATA);
-				*bio_data++ = data & 0xff;
-				*bio_data++ = data >> 8;
-			}
-		}
+/* Starts the next request once the channel is out of reset; until then, the timer polls */
+void
+ATAController::PollReset()
+{
+	if (ReadStatus() & ATA_STAT_BSY) {
+		timer_start(&ata_timer, timer_get_ns() + ATA_RESET_POLL_NS);
+		return;
+	}
 
-		if (item->flags & ATA_ITEM_FLAG_WRITE) {
-			/* Write completed - bio is no longer dirty XXX errors? */
-			item->bio->flags &= ~BIO_FLAG_DIRTY;
-		}
+	spinlock_lock(&spl_requests);
+	ata_resetting = false;
+	spinlock_unlock(&spl_requests);
+	Start();
+}
+
+/*
+ * Completes the active request, so that the next one can be started; the
+ * caller must have dealt with ata_timer, as we may be called on its behalf.
+ */
+void
+ATAController::Complete(struct ATA_REQUEST_ITEM& item, bool error)
+{
+	spinlock_lock(&spl_requests);
+	KASSERT(ata_active && QUEUE_HEAD(&requests) == &item, "completing inactive request");
+	QUEUE_POP_HEAD(&requests);
+	ata_active = false;
+	ata_handling = false;
+	spinlock_unlock(&spl_requests);
+
+	for (struct BIO* bio = item.bio; bio != NULL; /* nothing */) {
+		struct BIO* next = bio->io_next; /* bio may be reused once available */
+		if (error)
+			bio_set_error(bio);
+		else
+			bio_set_available(bio);
+		bio = next;
 	}
 
-	/* Current request is done. Sign it off and away it goes */
-	bio_set_available(item->bio);
+	/* Non-data commands have someone waiting for them */
+	semaphore_t* done = item.done;
+	if (done != NULL)
+		*item.failed = error;
+
 	spinlock_lock(&spl_freelist);
-	QUEUE_ADD_TAIL(&freelist, item);
+	QUEUE_ADD_TAIL(&freelist, &item);
 	spinlock_unlock(&spl_freelist);
+	if (done != NULL)
+		sem_signal(done);
 }
 
 uint8_t
@@ -112,6 +253,21 @@ ATAController::ReadStatus()
 	return inb(ata_io_alt + ATA_REG_ALTSTATUS);
 }
 
+/* Waits until the device has accepted the command and wants data */
+errorcode_t
+ATAController::WaitForDRQ()
+{
+	while (ReadStatus() & ATA_STAT_BSY)
+		/* nothing */ ;
+	while (1) {
+		uint8_t status = ReadStatus();
+		if (status & ATA_STAT_ERR)
+			return ANANAS_ERROR(IO);
+		if (status & ATA_STAT_DRQ)
+			return ananas_success();
+	}
+}
+
 /*
  * This handles identification of a master/slave device on a given ata bus. It
  * will attempt both the ATA IDENTIFY and ATAPI IDENTIFY commands.
@@ -221,13 +377,11 @@ ATAController::Identify(int unit, ATA_IDENTIFY& identify)
 		return 0;
 	}
 
-	/* Grab the result of the identification command XXX implement insw() */
-	char* buf = (char*)&identify;
-	for (int count = 0; count < SECTOR_SIZE; ) {
-		uint16_t x = inw(ata_io + ATA_REG_DATA);
-		buf[count++] = x >> 8;
-		buf[count++] = x & 0xff;
-	}
+	/* Grab the result of the identification command; its words are kept big-endian */
+	insw(ata_io + ATA_REG_DATA, &identify, SECTOR_SIZE / 2);
+	auto p = reinterpret_cast<uint16_t*>(&identify);
+	for (unsigned int n = 0; n < SECTOR_SIZE / 2; n++, p++)
+		*p = betoh16(*p);
 
 	/* Chop off the trailing spaces off the identity */
 	for (int i = sizeof(identify.model) - 1; i > 0; i--) {
@@ -243,88 +397,31 @@ ATAController::Identify(int unit, ATA_IDENTIFY& identify)
 		inb(ata_io + 0x206); inb(ata_io + 0x206);  \
 		inb(ata_io + 0x206); inb(ata_io + 0x206);
 
+/* Issues an ATAPI command and sends its command bytes */
 void
-ATAController::StartPIO(struct ATA_REQUEST_ITEM& item)
+ATAController::SendPacket(struct ATA_REQUEST_ITEM& item, bool dma)
 {
-	if (item.command != ATA_CMD_PACKET) {
-		/* Feed the request to the drive - disk */
-		outb(ata_io + ATA_REG_DEVICEHEAD, 0xe0 | (item.unit ? 0x10 : 0) | ((item.lba >> 24) & 0xf));
-		outb(ata_io + ATA_REG_SECTORCOUNT, item.count);
-		outb(ata_io + ATA_REG_SECTORNUM, item.lba & 0xff);
-		outb(ata_io + ATA_REG_CYL_LO, (item.lba >> 8) & 0xff);
-		outb(ata_io + ATA_REG_CYL_HI, (item.lba >> 16) & 0xff);
-		outb(ata_io + ATA_REG_COMMAND, item.command);
-
-		/* If we need to write data, do so */
-		if (item.flags & ATA_ITEM_FLAG_WRITE) {
-			/* Wait until the command is accepted */
-			while (ReadStatus() & ATA_STAT_BSY)
-				/* nothing */ ;
-			while (1) {
-				uint8_t status = ReadStatus();
-				if (status & ATA_STAT_ERR) {
-					/* Got an error - this means the request cannot be completed */
-					bio_set_error(item.bio);
-					return;
-				}
-				if (status & ATA_STAT_DRQ)
-					break;
-			}
-
-			/* XXX We really need outsw() or similar */
-			auto bio_data = static_cast<uint8_t*>(item.bio->data);
-			for(int i = 0; i < item.bio->length; i += 2) {
-				uint16_t v = bio_data[0] | (uint16_t)bio_data[1] << 8;
-				outw(ata_io + ATA_REG_DATA, v);
-				bio_data += 2;
-			}
-		}
-	} else {
-		/* Feed the request to the device - ATAPI */
-		outb(ata_io + ATA_REG_DEVICEHEAD, item.unit << 4);
-		ATA_DELAY(); ATA_DELAY();
-		outb(ata_io + ATA_REG_FEATURES, 0); /* no DMA yet! */
-		outb(ata_io + ATA_REG_CYL_LO, item.count & 0xff); /* note: in bytes! */
-		outb(ata_io + ATA_REG_CYL_HI, item.count >> 8);
-		outb(ata_io + ATA_REG_COMMAND, item.command);
-
-		/* Wait until the command is accepted */
-		while (ReadStatus() & ATA_STAT_BSY)
-			/* nothing */ ;
-		while (1) {
-			uint8_t status = ReadStatus();
-			if (status & ATA_STAT_ERR) {
-				/* Got an error - this means the request cannot be completed */
-				bio_set_error(item.bio);
-				return;
-			}
-			if (status & ATA_STAT_DRQ)
-				break;
-		}
-		for (unsigned int i = 0; i < 6; i++) {
-			/* XXX We really need outsw() */
-			outw(ata_io + ATA_REG_DATA, *(uint16_t*)(&item.atapi_command[i * 2]));
-		}
-	}
+	outb(ata_io + ATA_REG_DEVICEHEAD, item.unit << 4);
+	ATA_DELAY(); ATA_DELAY();
+	outb(ata_io + ATA_REG_FEATURES, dma ? 1 : 0);
+	outb(ata_io + ATA_REG_CYL_LO, item.count & 0xff); /* note: in bytes! */
+	outb(ata_io + ATA_REG_CYL_HI, item.count >> 8);
+	outb(ata_io + ATA_REG_COMMAND, item.command);
+
+	/* If this fails, the device interrupts and we'll fail the request there */
+	if (ananas_is_failure(WaitForDRQ()))
+		return;
+	outsw(ata_io + ATA_REG_DATA, item.atapi_command, sizeof(item.atapi_command) / 2);
 }
 
 void
-ATAController::StartDMA(struct ATA_REQUEST_ITEM& item)
+ATAController::StartPIO(struct ATA_REQUEST_ITEM& item)
 {
-	struct ATAPCI_PRDT* prdt = &ata_prdt[0];
-	KASSERT(((addr_t)prdt & 3) == 0, "prdt not dword-aligned");
-
-	uint32_t dma_io = ata_dma_io;
-	if (d_Unit > 0)
-		dma_io += 8; /* XXX crude */
-
-	/* XXX For now, we assume a single request per go */
-	prdt->prdt_base = (addr_t)KVTOP((addr_t)BIO_DATA(item.bio)); /* XXX 32 bit */
-	prdt->prdt_size = item.bio->length | ATA_PRDT_EOT;
-
-	/* Program the DMA parts of the PCI bus */
-	outl(dma_io + ATA_PCI_REG_PRI_PRDT, (uint32_t)KVTOP((addr_t)prdt)); /* XXX 32 bit */
-	outb(dma_io + ATA_PCI_REG_PRI_STATUS, ATA_PCI_STAT_IRQ | ATA_PCI_STAT_ERROR);
+	if (item.command == ATA_CMD_PACKET) {
+		/* Feed the request to the device - ATAPI */
+		SendPacket(item, false);
+		return;
+	}
 
 	/* Feed the request to the drive - disk */
 	outb(ata_io + ATA_REG_DEVICEHEAD, 0xe0 | (item.unit ? 0x10 : 0) | ((item.lba >> 24) & 0xf));
@@ -332,47 +429,100 @@ ATAController::StartDMA(struct ATA_REQUEST_ITEM& item)
 	outb(ata_io + ATA_REG_SECTORNUM, item.lba & 0xff);
 	outb(ata_io + ATA_REG_CYL_LO, (item.lba >> 8) & 0xff);
 	outb(ata_io + ATA_REG_CYL_HI, (item.lba >> 16) & 0xff);
-	outb(ata_io + ATA_REG_COMMAND, ATA_CMD_DMA_READ_SECTORS);
+	outb(ata_io + ATA_REG_COMMAND, item.command);
 
-	/* Go! */
-	uint32_t cmd = ATA_PCI_CMD_START;
+	/*
+	 * If we need to write data, hand over the first sector; the device
+	 * interrupts whenever it wants the next one.
+	 */
+	if (item.flags & ATA_ITEM_FLAG_WRITE) {
+		if (ananas_is_failure(WaitForDRQ()))
+			return; /* device interrupts with the error */
+		outsw(ata_io + ATA_REG_DATA, item.bio->data, SECTOR_SIZE / 2);
+		item.offset = SECTOR_SIZE;
+	}
+}
+
+void
+ATAController::StartDMA(struct ATA_REQUEST_ITEM& item)
+{
+	/*
+	 * Describe every bio of the request in the PRDT; the controller can only
+	 * reach the first 4GB, anything above it is bounced by the DMA code.
+	 */
+	struct ATA_PRDT_LOAD pl;
+	pl.pl_prdt = ata_prdt;
+	pl.pl_num = 0;
+	int load_flags = (item.flags & ATA_ITEM_FLAG_READ) ? DMA_LOAD_FLAG_READ : DMA_LOAD_FLAG_WRITE;
+	unsigned int n = 0;
+	for (struct BIO* bio = item.bio; bio != NULL; bio = bio->io_next, n++) {
+		KASSERT(n < ATA_MAX_BIOS_PER_REQUEST, "too many bio's in request");
+		pl.pl_len = bio->length;
+		errorcode_t err = dma_buf_load_bio(ata_dmabuf_prdt, bio, ata_prdt_load, &pl, load_flags);
+		KASSERT(ananas_is_success(err), "unable to load bio %p, %d", bio, err);
+	}
+	pl.pl_prdt[pl.pl_num - 1].prdt_size |= ATA_PRDT_EOT;
+
+	/* Program the DMA parts of the PCI bus */
+	uint32_t dma_io = GetDMAIO();
+	uint32_t cmd = 0;
 	if (item.flags & ATA_ITEM_FLAG_READ)
 		cmd |= ATA_PCI_CMD_RW;
+	outl(dma_io + ATA_PCI_REG_PRI_PRDT, (uint32_t)dma_buf_get_segment(ata_dmabuf_prdt, 0)->s_phys);
+	outb(dma_io + ATA_PCI_REG_PRI_STATUS, ATA_PCI_STAT_IRQ | ATA_PCI_STAT_ERROR);
 	outb(dma_io + ATA_PCI_REG_PRI_COMMAND, cmd);
+
+	if (item.command == ATA_CMD_PACKET) {
+		/* Feed the request to the device - ATAPI */
+		SendPacket(item, true);
+	} else {
+		/* Feed the request to the drive - disk */
+		outb(ata_io + ATA_REG_DEVICEHEAD, 0xe0 | (item.unit ? 0x10 : 0) | ((item.lba >> 24) & 0xf));
+		outb(ata_io + ATA_REG_SECTORCOUNT, item.count); /* 256 wraps to 0, which is what we want */
+		outb(ata_io + ATA_REG_SECTORNUM, item.lba & 0xff);
+		outb(ata_io + ATA_REG_CYL_LO, (item.lba >> 8) & 0xff);
+		outb(ata_io + ATA_REG_CYL_HI, (item.lba >> 16) & 0xff);
+		outb(ata_io + ATA_REG_COMMAND, item.command);
+	}
+
+	/* Go! */
+	outb(dma_io + ATA_PCI_REG_PRI_COMMAND, cmd | ATA_PCI_CMD_START);
 }
 
 void
 ATAController::Start()
 {
 	/*
-	 * Fetch the first request from the queue - note that we do not
-	 * remove it; ata_irq() does that for us.
+	 * Hand the first request of the queue to the device, unless it is still
+	 * busy with one - OnIRQ() calls us again once it is done. Note that we do
+	 * not remove the request; Complete() does that for us.
 	 */
 	spinlock_lock(&spl_requests);
-	KASSERT(!QUEUE_EMPTY(&requests), "ata_start() with empty queue");
-	/* XXX only do a single item now */
+	if (ata_active || ata_resetting || QUEUE_EMPTY(&requests)) {
+		spinlock_unlock(&spl_requests);
+		return;
+	}
 	struct ATA_REQUEST_ITEM* item = QUEUE_HEAD(&requests);
+	ata_active = true;
+	ata_deadline = timer_get_ns() + ATA_TIMEOUT_NS;
 	spinlock_unlock(&spl_requests);
 
 	KASSERT(item->unit >= 0 && item->unit <= 1, "corrupted item number");
-	KASSERT(item->count > 0, "corrupted count number");
+	KASSERT(item->count > 0 || item->bio == NULL, "corrupted count number");
 
+	/* Now, we must wait for the IRQ to handle it - or for OnTimeout() to give up */
+	timer_start(&ata_timer, ata_deadline);
 	if (item->flags & ATA_ITEM_FLAG_DMA)
 		StartDMA(*item);
 	else
 		StartPIO(*item);
-
-	/*
-	 * Now, we must wait for the IRQ to handle it. XXX there should be a timeout
-	 * on the items as we won't get any IRQ's if the request errors out.
-	 */
 }
 
 void
 ATAController::Enqueue(void* request)
 {
 	struct ATA_REQUEST_ITEM* item = (struct ATA_REQUEST_ITEM*)request;
-	KASSERT(item->bio != NULL, "ata_enqueue(): request without bio data buffer");
+	KASSERT(item->bio != NULL || item->done != NULL, "ata_enqueue(): request without bio data buffer");
 
 	/*
 	 * Grab an item from our freelist and use it to store the request; this ensures the caller doesn't need to
@@ -385,6 +535,7 @@ ATAController::Enqueue(void* request)
 	spinlock_unlock(&spl_freelist);
 
 	memcpy(newitem, request, sizeof(struct ATA_REQUEST_ITEM));
+	newitem->offset = 0;
 	spinlock_lock(&spl_requests);
 	QUEUE_ADD_TAIL(&requests, newitem);
 	spinlock_unlock(&spl_requests);
@@ -419,12 +570,24 @@ ATAController::Attach()
 
 	QUEUE_INIT(&requests);
 	spinlock_init(&spl_requests);
+	timer_init(&ata_timer, TimerWrapper, this);
+	deferred_init(&ata_timeout_work, TimeoutWrapper, this, DEFERRED_FLAG_THREAD);
 
 	/* Ensure there's something living at the I/O addresses */
 	if (inb(ata_io + ATA_REG_STATUS) == 0xff)
 		return ANANAS_ERROR(NO_DEVICE);
 
-	errorcode_t err = irq_register(irq, this, IRQWrapper, IRQ_TYPE_DEFAULT, NULL);
+	/*
+	 * Set up what DMA requests need; the PRDT must be dword-aligned and may
+	 * not cross a 64KB boundary, which a page-aligned allocation takes care of.
+	 */
+	errorcode_t err = dma_tag_create(d_Parent->d_DMA_tag, *this, &d_DMA_tag, 1, 0, DMA_ADDR_MAX_32BIT, DMA_SEGS_MAX_ANY, DMA_SEGS_MAX_SIZE);
+	ANANAS_ERROR_RETURN(err);
+	err = dma_buf_alloc(d_DMA_tag, ATA_PCI_NUMPRDT * sizeof(struct ATAPCI_PRDT), &ata_dmabuf_prdt);
+	ANANAS_ERROR_RETURN(err);
+	ata_prdt = static_cast<struct ATAPCI_PRDT*>(dma_buf_get_segment(ata_dmabuf_prdt, 0)->s_virt);
+
+	err = irq_register(irq, this, IRQWrapper, IRQ_TYPE_DEFAULT, NULL);
 	ANANAS_ERROR_RETURN(err);
 
 	/* Initialize a freelist of request items */
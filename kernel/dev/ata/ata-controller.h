@@ -1,11 +1,22 @@
 #ifndef ANANAS_ATA_CONTROLLER_H
 #define ANANAS_ATA_CONTROLLER_H
 
+#include <ananas/deferred.h>
 #include <ananas/device.h>
 #include <ananas/dev/ata.h>
+#include <ananas/dma.h>
 #include <ananas/irq.h>
+#include <ananas/timer.h>
 #include "ata.h"
 
+/* Request items of a channel; these are shared by both of its units */
+#define ATA_FREELIST_LENGTH	16
+#define ATA_UNIT_MAX_REQUESTS	(ATA_FREELIST_LENGTH / 2)
+
+/* Time the device gets to interrupt us before we give up on a request */
+#define ATA_TIMEOUT_NS		(10ULL * 1000 * 1000 * 1000)
+#define ATA_RESET_POLL_NS	(10ULL * 1000 * 1000)
+
 namespace Ananas {
 namespace ATA {
 
@@ -36,10 +47,34 @@ protected:
 		return IRQ_RESULT_PROCESSED;
 	}
 
+	void OnTimeout();
+
+	static void TimerWrapper(void* context)
+	{
+		/* Runs from the timer interrupt; the actual work needs our locks */
+		auto ata = static_cast<ATAController*>(context);
+		deferred_queue(&ata->ata_timeout_work);
+	}
+
+	static void TimeoutWrapper(void* context)
+	{
+		static_cast<ATAController*>(context)->OnTimeout();
+	}
+
 	uint8_t ReadStatus();
+	errorcode_t WaitForDRQ();
 	int Identify(int unit, ATA_IDENTIFY& identify);
+	void SendPacket(struct ATA_REQUEST_ITEM& item, bool dma);
 	void StartPIO(struct ATA_REQUEST_ITEM& item);
 	void StartDMA(struct ATA_REQUEST_ITEM& item);
+	void Complete(struct ATA_REQUEST_ITEM& item, bool error);
+	void PollReset();
+	void Continue();
+
+	uint32_t GetDMAIO() const
+	{
+		return ata_dma_io + ((d_Unit > 0) ? 8 : 0); /* XXX crude */
+	}
 
 private:
 	uint32_t ata_io;
@@ -48,10 +83,18 @@ private:
 
 	spinlock_t spl_requests;
 	struct ATA_REQUEST_QUEUE requests;
+	bool ata_active = false;	/* head of requests is handed to the device */
+	bool ata_handling = false;	/* OnIRQ() or OnTimeout() is busy with the head */
+	bool ata_resetting = false;	/* channel is coming out of reset; start nothing */
+	uint64_t ata_deadline;		/* when the active request times out */
+	struct TIMER ata_timer;
+	struct DEFERRED_WORK ata_timeout_work;
 	spinlock_t spl_freelist;
 	struct ATA_REQUEST_QUEUE freelist;
 
-	struct ATAPCI_PRDT ata_prdt[ATA_PCI_NUMPRDT] __attribute__((aligned(4)));
+	/* Used by the active DMA request */
+	dma_buf_t ata_dmabuf_prdt;
+	struct ATAPCI_PRDT* ata_prdt;
 };
 
 } // namespace ATA
@@ -14,8 +14,6 @@
 
 TRACE_SETUP;
 
-#define ATA_FREELIST_LENGTH 16
-
 namespace Ananas {
 namespace ATA {
 
@@ -87,6 +85,15 @@ struct ATAPCI_Driver : public Ananas::Driver
 		return "pcibus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_ClassRev, PCI_CLASSREV(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, 0), 0xffff0000 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_ClassRev, 0);
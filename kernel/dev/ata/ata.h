@@ -1,5 +1,7 @@
 #include <ananas/queue.h>
 #include <ananas/device.h>
+#include <ananas/lock.h>
+#include <machine/param.h>	/* for PAGE_SIZE */
 
 #ifndef __ATA_H__
 #define __ATA_H__
@@ -35,7 +37,10 @@ struct ATA_REQUEST_ITEM {
 #define ATA_ITEM_FLAG_ATAPI	(1 << 2)	/* ATAPI request */
 #define ATA_ITEM_FLAG_DMA	(1 << 3)	/* Use DMA */
 	uint64_t	lba;		/* start LBA */
-	struct BIO*	bio;		/* associated I/O buffer */
+	struct BIO*	bio;		/* associated I/O buffer; DMA requests may chain more using io_next */
+	semaphore_t*	done;		/* non-data commands (bio is NULL): signalled on completion */
+	bool*		failed;		/* non-data commands: set if the command failed */
+	uint32_t	offset;		/* PIO: bytes transferred so far */
 	/* if command = ATA_CMD_PACKET, this is an ATAPI command and we need to send 6 command words */
 	uint8_t		atapi_command[12];
 	QUEUE_FIELDS(struct ATA_REQUEST_ITEM);
@@ -68,6 +73,12 @@ struct ATAPCI_PRDT {
 #define ATA_PRDT_EOT		(1 << 31)		/* End Of Transfer */
 } __attribute__((packed));
 
-#define ATA_PCI_NUMPRDT		8
+#define ATA_PRDT_BOUNDARY	65536			/* Entries may not cross this */
+
+/* Every bio takes at most two entries, as none is larger than a page */
+#define ATA_PCI_NUMPRDT		(2 * ATA_MAX_BIOS_PER_REQUEST)
+
+/* Bio's a DMA request may chain; this keeps it within the 256 sectors a command can do */
+#define ATA_MAX_BIOS_PER_REQUEST	((256 * 512) / PAGE_SIZE)
 
 #endif /* __ATA_H__ */
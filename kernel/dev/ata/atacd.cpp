@@ -34,6 +34,11 @@ ATACD::Attach()
 
 	Printf("<%s>", ata_identify.model);
 
+	if (ATA_GET_WORD(ata_identify.capabilities1) & ATA_CAP_DMA) {
+		ata_flags |= ATACD_FLAG_DMA;
+		Printf("using DMA transfers");
+	}
+
 	return ananas_success();
 }
 
@@ -57,6 +62,8 @@ ATACD::ReadBIO(struct BIO& bio)
 	item.bio = &bio;
 	item.command = ATA_CMD_PACKET;
 	item.flags = ATA_ITEM_FLAG_READ | ATA_ITEM_FLAG_ATAPI;
+	if (ata_flags & ATACD_FLAG_DMA)
+		item.flags |= ATA_ITEM_FLAG_DMA;
 	item.atapi_command[0] = ATAPI_CMD_READ_SECTORS;
 	item.atapi_command[2] = (bio.io_block >> 24) & 0xff;
 	item.atapi_command[3] = (bio.io_block >> 16) & 0xff;
@@ -75,6 +82,12 @@ ATACD::WriteBIO(struct BIO& bio)
 	return ANANAS_ERROR(READ_ONLY);
 }
 
+unsigned int
+ATACD::GetMaxBIORequests()
+{
+	return ATA_UNIT_MAX_REQUESTS;
+}
+
 struct ATACD_Driver : public Ananas::Driver
 {
 	ATACD_Driver()
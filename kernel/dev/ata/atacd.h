@@ -28,6 +28,7 @@ public:
 
 	errorcode_t ReadBIO(struct BIO& bio) override;
 	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
 
 	void SetIdentify(const ATA_IDENTIFY& identify)
 	{
@@ -37,6 +38,8 @@ public:
 private:
 	int ata_unit;
 	ATA_IDENTIFY ata_identify;
+	uint32_t ata_flags = 0;
+#define ATACD_FLAG_DMA	(1 << 0)
 };
 
 } // namespace ATA
@@ -44,7 +44,7 @@ ATADisk::Attach()
 	 disk_size / ((1024UL * 1024UL) / 512UL));
 
 	/* XXX We should check the registers to see if DMA support is configured */
-	if(true) {
+	if (ATA_GET_WORD(disk_identify.capabilities1) & ATA_CAP_DMA) {
 		disk_flags |= ATADISK_FLAG_DMA;
 		Printf("using DMA transfers");
 	}
@@ -69,24 +69,39 @@ ATADisk::Detach()
 	return ananas_success();
 }
 
-errorcode_t
-ATADisk::ReadBIO(struct BIO& bio)
+/* Sets up a read or write request for the chain of bio's starting at bio */
+void
+ATADisk::MakeRequest(struct ATA_REQUEST_ITEM& item, struct BIO& bio, bool write)
 {
-	struct ATA_REQUEST_ITEM item;
-	KASSERT(bio.length > 0, "invalid length");
-	KASSERT(bio.length % 512 == 0, "invalid length"); /* XXX */
+	uint32_t len = 0;
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next) {
+		KASSERT(b->length > 0, "invalid length");
+		KASSERT(b->length % 512 == 0, "invalid length"); /* XXX */
+		len += b->length;
+	}
 
 	/* XXX boundary check */
 	item.unit = disk_unit;
+	item.done = NULL;
 	item.lba = bio.io_block;
-	item.count = bio.length / 512;
+	item.count = len / 512;
 	item.bio = &bio;
-	item.command = ATA_CMD_READ_SECTORS;
-	item.flags = ATA_ITEM_FLAG_READ;
-	if (disk_flags & ATADISK_FLAG_DMA)
-		item.flags |= ATA_ITEM_FLAG_DMA;
-	EnqueueAndStart(d_Parent, item);
+	if (disk_flags & ATADISK_FLAG_DMA) {
+		item.command = write ? ATA_CMD_DMA_WRITE_SECTORS : ATA_CMD_DMA_READ_SECTORS;
+		item.flags = ATA_ITEM_FLAG_DMA;
+	} else {
+		item.command = write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS;
+		item.flags = 0;
+	}
+	item.flags |= write ? ATA_ITEM_FLAG_WRITE : ATA_ITEM_FLAG_READ;
+}
 
+errorcode_t
+ATADisk::ReadBIO(struct BIO& bio)
+{
+	struct ATA_REQUEST_ITEM item;
+	MakeRequest(item, bio, false);
+	EnqueueAndStart(d_Parent, item);
 	return ananas_success();
 }
 
@@ -94,23 +109,46 @@ errorcode_t
 ATADisk::WriteBIO(struct BIO& bio)
 {
 	struct ATA_REQUEST_ITEM item;
-	KASSERT(bio.length > 0, "invalid length");
-	KASSERT(bio.length % 512 == 0, "invalid length"); /* XXX */
+	MakeRequest(item, bio, true);
+	EnqueueAndStart(d_Parent, item);
+	return ananas_success();
+}
 
-	/* XXX boundary check */
+errorcode_t
+ATADisk::FlushCache()
+{
+	struct ATA_REQUEST_ITEM item;
+	memset(&item, 0, sizeof(item));
+	uint16_t features = ATA_GET_WORD(disk_identify.features2);
+	if (features & ATA_FEAT2_FLCACHE_EXT)
+		item.command = ATA_CMD_FLUSH_CACHE_EXT;
+	else if (features & ATA_FEAT2_FLCACHE)
+		item.command = ATA_CMD_FLUSH_CACHE;
+	else
+		return ananas_success(); /* nothing to flush with; assume the disk writes through */
+
+	semaphore_t sem;
+	sem_init(&sem, 0);
+	bool failed = false;
 	item.unit = disk_unit;
-	item.lba = bio.io_block;
-	item.count = bio.length / 512;
-	item.bio = &bio;
-	item.command = ATA_CMD_WRITE_SECTORS;
-	item.flags = ATA_ITEM_FLAG_WRITE;
-#ifdef NOTYET
-	if (disk_flags & ATADISK_FLAG_DMA)
-		item.flags |= ATA_ITEM_FLAG_DMA;
-#endif
+	item.done = &sem;
+	item.failed = &failed;
 	EnqueueAndStart(d_Parent, item);
+	sem_wait(&sem);
+	return failed ? ANANAS_ERROR(IO) : ananas_success();
+}
 
-	return ananas_success();
+unsigned int
+ATADisk::GetMaxBIORequests()
+{
+	return ATA_UNIT_MAX_REQUESTS;
+}
+
+unsigned int
+ATADisk::GetMaxBIOsPerRequest()
+{
+	/* PIO requests transfer only a single bio */
+	return (disk_flags & ATADISK_FLAG_DMA) ? ATA_MAX_BIOS_PER_REQUEST : 1;
 }
 
 namespace {
@@ -2,6 +2,7 @@
 #define ANANAS_ATA_DISK_H
 
 #include <ananas/dev/ata.h>
+#include "ata.h"
 
 namespace Ananas {
 namespace ATA {
@@ -27,6 +28,9 @@ public:
 
 	errorcode_t ReadBIO(struct BIO& bio) override;
 	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
+	unsigned int GetMaxBIOsPerRequest() override;
+	errorcode_t FlushCache() override;
 
 	void SetIdentify(const ATA_IDENTIFY& identify)
 	{
@@ -34,6 +38,8 @@ public:
 	}
 
 private:
+	void MakeRequest(struct ATA_REQUEST_ITEM& item, struct BIO& bio, bool write);
+
 	ATA_IDENTIFY disk_identify;
 	int disk_unit;
 	uint64_t disk_size;	/* in sectors */
@@ -4,6 +4,7 @@
 #include <ananas/driver.h>
 #include <ananas/error.h>
 #include <ananas/irq.h>
+#include <ananas/kmem.h>
 #include <ananas/page.h>
 #include <ananas/time.h>
 #include <ananas/mm.h>
@@ -49,11 +50,13 @@ public:
 	errorcode_t IssueVerb(uint32_t verb, uint32_t* resp, uint32_t* resp_ex) override;
 
 	uint16_t GetAndClearStateChange() override;
-	errorcode_t OpenStream(int tag, int dir, uint16_t fmt, int num_pages, Context* context) override;
+	errorcode_t OpenStream(int tag, int dir, uint16_t fmt, size_t ring_size, size_t period_size, Context* context) override;
 	errorcode_t CloseStream(Context context) override;
 	errorcode_t StartStreams(int num, Context* context) override;
 	errorcode_t StopStreams(int num, Context* context) override;
-	void* GetStreamDataPointer(Context context, int page) override;
+	void* GetStreamRing(Context context, addr_t& phys, size_t& length) override;
+	uint32_t GetStreamPosition(Context context) override;
+	addr_t GetStreamPositionAddress(Context context) override;
 
 private:
 	void OnIRQ();
@@ -70,6 +73,7 @@ private:
 	int hda_corb_size;
 	int hda_rirb_size;
 	struct PAGE* hda_page;
+	struct PAGE* hda_dpl_page;	/* DMA position buffer */
 	uint32_t* hda_corb;
 	uint64_t* hda_rirb;
 	int hda_rirb_rp;
@@ -156,10 +160,17 @@ HDAPCIDevice::GetAndClearStateChange()
 }
 
 errorcode_t
-HDAPCIDevice::OpenStream(int tag, int dir, uint16_t fmt, int num_pages, Context* context)
+HDAPCIDevice::OpenStream(int tag, int dir, uint16_t fmt, size_t ring_size, size_t period_size, Context* context)
 {
 	KASSERT(dir == HDF_DIR_OUT, "unsupported direction %d", dir);
 
+	/* Every period gets a BDL entry; the hardware needs at least two of them */
+	if (period_size == 0 || (period_size % HDA_PCI_BDL_ALIGN) != 0 || (ring_size % period_size) != 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	unsigned int num_periods = ring_size / period_size;
+	if (num_periods < 2 || num_periods > HDA_PCI_BDL_MAX_ENTRIES)
+		return ANANAS_ERROR(BAD_LENGTH);
+
 	/*
 	 * First step is to figure out an available stream descriptor;
 	 * we'll start using the native ones (in/out) and revert to a
@@ -199,32 +210,37 @@ HDAPCIDevice::OpenStream(int tag, int dir, uint16_t fmt, int num_pages, Context*
 	if (ss < 0)
 		return ANANAS_ERROR(NO_SPACE);
 
+	/* The BDL and stream registers only take 32 bit addresses for now */
+	struct PAGE* ring_page;
+	void* ring = page_alloc_length_mapped_range(ring_size, 0, 0xffffffff, &ring_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
+	if (ring == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+
 	/* Claim the stream# */
 	hda_ss_avail &= ~(1 << ss);
 
 	/* Setup the stream structure */
-	auto s = static_cast<struct HDA_PCI_STREAM*>(kmalloc(sizeof(struct HDA_PCI_STREAM) + sizeof(struct HDA_PCI_STREAM_PAGE) * num_pages));
+	auto s = static_cast<struct HDA_PCI_STREAM*>(kmalloc(sizeof(struct HDA_PCI_STREAM)));
 	s->s_ss = ss;
+	s->s_ring_size = ring_size;
+	s->s_ring = ring;
+	s->s_ring_page = ring_page;
 	s->s_bdl = static_cast<struct HDA_PCI_BDL_ENTRY*>(page_alloc_single_mapped(&s->s_bdl_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE));
-	s->s_num_pages = num_pages;
 	hda_stream[ss] = s;
 	*context = s;
 
-	/* Create a page-chain for the same data and place it in the BDL */
+	/* Split the ring in periods; we want an interrupt once each of them is done */
 	struct HDA_PCI_BDL_ENTRY* bdl = s->s_bdl;
-	struct HDA_PCI_STREAM_PAGE* sp = &s->s_page[0];
-	for (int n = 0; n < num_pages; n++, bdl++, sp++) {
-		/* XXX use dma system here */
-		sp->sp_ptr = page_alloc_single_mapped(&sp->sp_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
-		bdl->bdl_addr = page_get_paddr(sp->sp_page);
-		bdl->bdl_length = PAGE_SIZE;
-		// XXX only give IRQ on each buffer half
-		bdl->bdl_flags = (n == (num_pages/ 2) || n == (num_pages - 1) ? BDL_FLAG_IOC : 0);
+	addr_t ring_paddr = page_get_paddr(ring_page);
+	for (unsigned int n = 0; n < num_periods; n++, bdl++) {
+		bdl->bdl_addr = ring_paddr + n * period_size;
+		bdl->bdl_length = period_size;
+		bdl->bdl_flags = BDL_FLAG_IOC;
 	}
 
 	/* All set; time to set the stream itself up */
-	HDA_WRITE_4(HDA_REG_xSDnCBL(ss), num_pages * PAGE_SIZE);
-	HDA_WRITE_4(HDA_REG_xSDnLVI(ss), num_pages - 1);
+	HDA_WRITE_4(HDA_REG_xSDnCBL(ss), ring_size);
+	HDA_WRITE_4(HDA_REG_xSDnLVI(ss), num_periods - 1);
 	HDA_WRITE_2(HDA_REG_xSDnFMT(ss), fmt);
 	HDA_WRITE_4(HDA_REG_xSDnBDPL(ss), page_get_paddr(s->s_bdl_page));
 	HDA_WRITE_4(HDA_REG_xSDnBDPU(ss), 0); // XXX
@@ -248,11 +264,10 @@ HDAPCIDevice::CloseStream(void* context)
 	KASSERT((hda_ss_avail & (1 << s->s_ss)) == 0, "closing unused stream?");
 	KASSERT((HDA_READ_4(HDA_REG_xSDnCTL(s->s_ss)) & HDA_SDnCTL_RUN) == 0, "closing running stream");
 
-	/* Free all stream subpages */
-	for (int n = 0; n < s->s_num_pages; n++)
-		page_free(s->s_page[n].sp_page);
-
-	/* Free the BDL page */
+	/* Free the ring and the BDL page */
+	kmem_unmap(s->s_ring, s->s_ring_size);
+	page_free(s->s_ring_page);
+	kmem_unmap(s->s_bdl, PAGE_SIZE);
 	page_free(s->s_bdl_page);
 
 	/* Free the stream and the context */
@@ -350,11 +365,27 @@ HDAPCIDevice::StopStreams(int num, void** context)
 }
 
 void*
-HDAPCIDevice::GetStreamDataPointer(void* context, int page)
+HDAPCIDevice::GetStreamRing(void* context, addr_t& phys, size_t& length)
+{
+	auto s = static_cast<struct HDA_PCI_STREAM*>(context);
+	phys = page_get_paddr(s->s_ring_page);
+	length = s->s_ring_size;
+	return s->s_ring;
+}
+
+uint32_t
+HDAPCIDevice::GetStreamPosition(void* context)
+{
+	auto s = static_cast<struct HDA_PCI_STREAM*>(context);
+	return HDA_READ_4(HDA_REG_xSDnLPIB(s->s_ss));
+}
+
+addr_t
+HDAPCIDevice::GetStreamPositionAddress(void* context)
 {
+	/* The controller stores the position of every stream in its own 8-byte slot */
 	auto s = static_cast<struct HDA_PCI_STREAM*>(context);
-	KASSERT(page >= 0 && page < s->s_num_pages, "page out of range");
-	return s->s_page[page].sp_ptr;
+	return page_get_paddr(hda_dpl_page) + s->s_ss * 8;
 }
 
 errorcode_t
@@ -466,6 +497,18 @@ HDAPCIDevice::Attach()
 	HDA_WRITE_4(HDA_REG_RIRBU, 0); // XXX
 	hda_rirb_rp = 0;
 
+	/*
+	 * Have the controller keep the position of every stream in memory; this is
+	 * cheaper to read than the LPIB registers, and can be mapped to userland.
+	 */
+	void* dpl = page_alloc_length_mapped_range(PAGE_SIZE, 0, 0xffffffff, &hda_dpl_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
+	if (dpl == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	memset(dpl, 0, PAGE_SIZE);
+	kmem_unmap(dpl, PAGE_SIZE);
+	HDA_WRITE_4(HDA_REG_DPUBASE, 0);
+	HDA_WRITE_4(HDA_REG_DPLBASE, page_get_paddr(hda_dpl_page) | HDA_DPLBASE_DPBE);
+
 	/* Kick the CORB and RIRB into action */
 	HDA_WRITE_1(HDA_REG_CORBCTL, HDA_READ_1(HDA_REG_CORBCTL) | (HDA_CORBCTL_CORBRUN | HDA_CORBCTL_CMEIE));
 	HDA_WRITE_1(HDA_REG_RIRBCTL, HDA_READ_1(HDA_REG_RIRBCTL) | (HDA_RIRBCTL_RIRBDMAEN /* | HDA_RIRBCTL_RINTCTL */));
@@ -504,6 +547,22 @@ struct HDAPCI_Driver : public Ananas::Driver
 		return "pcibus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_VendorID, 0x8086, 0xffff },
+			{ Ananas::Resource::RT_PCI_VendorID, 0x10de, 0xffff },
+			{ Ananas::Resource::RT_PCI_VendorID, 0x1039, 0xffff },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	bool CanAttachAsynchronously() const override
+	{
+		return true;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_VendorID, 0);
@@ -80,7 +80,7 @@
 # define HDA_ICS_ICB		(1 << 0)		/* immediate command busy */
 #define HDA_REG_DPLBASE		0x70
 # define HDA_DPLBASE_DPLBASE(x)	(((x) >> 7))		/* dma position lower base address */
-# define HDA_DPLBASE_DPBE	(0 << 0)		/* dma position buffer enable */
+# define HDA_DPLBASE_DPBE	(1 << 0)		/* dma position buffer enable */
 #define HDA_REG_DPUBASE		0x74
 #define HDA_REG_xSDnCTL(n)	(0x80 + ((n) * 0x20))	/* {input,output,bidirectional} stream control n */
 #define  HDA_SDnCTL_STRM(x)	((x) << 20)		/* stream number */
@@ -120,22 +120,25 @@ struct HDA_PCI_BDL_ENTRY {
 #define BDL_FLAG_IOC	1
 } __attribute__((packed));
 
+#define HDA_PCI_BDL_MAX_ENTRIES	256	/* BDL fits in a single page */
+#define HDA_PCI_BDL_ALIGN	128	/* BDL entries must be a multiple of this */
+
 struct HDA_PCI_STREAM;
 
 struct HDA_PCI_PRIVDATA {
 };
 
-struct HDA_PCI_STREAM_PAGE {
-	struct PAGE* sp_page;
-	void* sp_ptr;
-};
-
+/*
+ * A stream plays from (or records to) a single physically contiguous ring;
+ * every period of the ring has its own BDL entry, which interrupts once done.
+ */
 struct HDA_PCI_STREAM {
 	int s_ss;			/* Stream# in use */
-	int s_num_pages;
+	size_t s_ring_size;		/* Ring length, in bytes */
+	void* s_ring;			/* Ring, mapped in kernel memory */
+	struct PAGE* s_ring_page;	/* Pages for the ring */
 	struct HDA_PCI_BDL_ENTRY* s_bdl;	/* BDL entries */
 	struct PAGE* s_bdl_page;	/* Page for the BDL */
-	struct HDA_PCI_STREAM_PAGE s_page[0];
 };
 
 #endif /* __ANANAS_HDAPCI_H__ */
@@ -3,53 +3,27 @@
 #include <ananas/error.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
+#include <ananas/process.h>
 #include <ananas/trace.h>
+#include <ananas/vm.h>
+#include <ananas/vmspace.h>
 #include <machine/param.h>
 #include "hda.h"
 
-#include "hda-pci.h" // XXX
-#include <ananas/thread.h>
-
 TRACE_SETUP;
 
 namespace Ananas {
 namespace HDA {
 
-#define DEMO_PLAY 0
-
-#if DEMO_PLAY
-static unsigned int cur_stream_offset = 0;
-static unsigned int cur_buffer = 0;
-
-static uint8_t* play_buf = NULL;
-static unsigned int play_buf_size = (64 * PAGE_SIZE);
-static unsigned int play_buf_filled = 0;
-static semaphore_t play_sem;
-static mutex_t play_mtx;
-
-void sys_play(thread_t* t, const void* buf, size_t len)
-{
-	mutex_lock(&play_mtx);
-	while(len > 0) {
-		unsigned int size_left = play_buf_size - play_buf_filled;
-		if (size_left == 0) {
-			/* No space left in our play buffer -> block */
-			mutex_unlock(&play_mtx);
-			sem_wait_and_drain(&play_sem);
-			mutex_lock(&play_mtx);
-		}
+/* Output ring sizes if the claimer does not care */
+#define HDA_DEFAULT_RING_SIZE	(16 * PAGE_SIZE)
+#define HDA_DEFAULT_PERIOD_SIZE	(PAGE_SIZE)
 
-		/* Copy as much to our play buffer as we can */
-		unsigned int chunk_len = len;
-		if (chunk_len > size_left)
-			chunk_len = size_left;
-		memcpy(&play_buf[play_buf_filled], buf, chunk_len);
-		play_buf_filled += chunk_len;
-		len -= chunk_len;
-	}
-	mutex_unlock(&play_mtx);
-}
-#endif
+/* We always play 48.0kHz, 16-bit stereo */
+#define HDA_OUTPUT_RATE		48000
+#define HDA_OUTPUT_CHANNELS	2
+#define HDA_OUTPUT_BITS		16
+#define HDA_OUTPUT_FORMAT	(STREAM_TYPE_PCM | STREAM_BASE_48_0 | STREAM_MULT_x1 | STREAM_DIV_1 | STREAM_BITS_16 | STREAM_CHANNELS(HDA_OUTPUT_CHANNELS - 1))
 
 RoutingPlan::~RoutingPlan()
 {
@@ -64,31 +38,12 @@ PinGroup::~PinGroup()
 void
 HDADevice::OnStreamIRQ(IHDAFunctions::Context ctx)
 {
-#if DEMO_PLAY
-	auto s = static_cast<HDA_PCI_STREAM*>(ctx);
-
-	/* Fill the other half of the play buffer with new data */
-	int num_pages = s->s_num_pages;
-	for (unsigned int n = 0; n < num_pages / 2; n++) {
-		auto ptr = static_cast<uint8_t*>(hdaFunctions->GetStreamDataPointer(ctx, n + (cur_buffer * num_pages / 2)));
-
-		mutex_lock(&play_mtx);
-		if (play_buf_filled > 0) {
-			int chunk_len = PAGE_SIZE;
-			if (chunk_len > play_buf_filled)
-				chunk_len = play_buf_filled;
-			memcpy(ptr, play_buf, chunk_len);
-			memmove(&play_buf[0], &play_buf[chunk_len], play_buf_filled - chunk_len);
-			play_buf_filled -= chunk_len;
-
-			/* Unblock anyone attempting to fill the buffer, we have spots now */
-			sem_signal(&play_sem);
-		}
-		mutex_unlock(&play_mtx);
-	}
-
-	cur_buffer ^= 1;
-#endif
+	/*
+	 * The claimer writes to the ring directly and tracks the position itself,
+	 * so there is nothing to copy here; just count the completed periods.
+	 */
+	if (ctx == hda_out_ctx)
+		__atomic_add_fetch(&hda_out_periods, 1, __ATOMIC_RELAXED);
 }
 
 errorcode_t
@@ -111,84 +66,165 @@ HDADevice::Attach()
 		ANANAS_ERROR_RETURN(err);
 	}
 
-#if DEMO_PLAY
+	mutex_init(&hda_mtx, "hda");
+	return ananas_success();
+}
+
+/* Must be called with hda_mtx held */
+errorcode_t
+HDADevice::ClaimOutput(process_t& proc, struct HCTL_AUDIO_CLAIM_ARG& arg)
+{
+	if (hda_out_ctx != nullptr)
+		return ANANAS_ERROR(NO_RESOURCE);
+
 	AFG* afg = hda_afg;
 	if (afg == NULL || LIST_EMPTY(&afg->afg_outputs))
 		return ANANAS_ERROR(NO_DEVICE); /* XXX can this happen? */
 
-	/* Let's play something! */
 	Output* o = NULL;
 	LIST_FOREACH(&afg->afg_outputs, ao, Output) {
 		/* XXX We specifically look for a 2-channel only output - this is wrong, but VirtualBox
 		 *     dies if we try to use 2-channels for a 7.1-output. Need to look into this XXX
 		 */
-		if (ao->o_channels == 2) {
+		if (ao->o_channels == HDA_OUTPUT_CHANNELS) {
 			o = ao;
 			break;
 		}
 	}
-	if (o == NULL) {
-		kprintf("cannot find 2-channel output, aborting\n");
-		return ananas_success();
-	}
+	if (o == NULL)
+		return ANANAS_ERROR(NO_DEVICE);
 
 	RoutingPlan* rp;
 	errorcode_t err = RouteOutput(*afg, o->o_channels, *o, &rp);
-	if (ananas_is_failure(err))
-		return err;
-
-	IHDAFunctions::Context contexts[10]; /* XXX */
-	int num_contexts = 0;
+	ANANAS_ERROR_RETURN(err);
 
-	int tag = 0;
-	for (int n = 0; n < rp->rp_num_nodes; n++) {
+	/* Hook every converter in the plan up to the same stream, so they all play the ring */
+	const int tag = 1;
+	for (int n = 0; ananas_is_success(err) && n < rp->rp_num_nodes; n++) {
 		if (rp->rp_node[n]->GetType() != NT_AudioOut)
 			continue;
-		auto ao = static_cast<Node_AudioOut&>(*rp->rp_node[n]);
-
-		tag++; /* XXX */
+		auto& ao = static_cast<Node_AudioOut&>(*rp->rp_node[n]);
 
-		/* hook stream up to output 2 */
 		uint32_t r;
 		err = hdaFunctions->IssueVerb(HDA_MAKE_VERB_NODE(ao, HDA_MAKE_PAYLOAD_ID12(HDA_CODEC_CMD_SETCONVCONTROL,
 		 HDA_CODEC_CONVCONTROL_STREAM(tag) | HDA_CODEC_CONVCONTROL_CHANNEL(0)
 		)), &r, NULL);
-		ANANAS_ERROR_RETURN(err);
+		if (ananas_is_success(err))
+			err = hdaFunctions->IssueVerb(HDA_MAKE_VERB_NODE(ao, HDA_MAKE_PAYLOAD_ID4(HDA_CODEC_CMD_SET_CONV_FORMAT, HDA_OUTPUT_FORMAT)), &r, NULL);
+	}
+	delete rp;
+	ANANAS_ERROR_RETURN(err);
 
-		/* set stream format: 48.0Hz, 16-bit stereo  */
-		int stream_fmt = STREAM_TYPE_PCM | STREAM_BASE_48_0 | STREAM_MULT_x1 | STREAM_DIV_1 | STREAM_BITS_16 | STREAM_CHANNELS(1);
-		err = hdaFunctions->IssueVerb(HDA_MAKE_VERB_NODE(ao, HDA_MAKE_PAYLOAD_ID4(HDA_CODEC_CMD_SET_CONV_FORMAT, stream_fmt)), &r, NULL);
-		ANANAS_ERROR_RETURN(err);
+	size_t ring_size = (arg.ac_ring_size != 0) ? ROUND_UP(arg.ac_ring_size, PAGE_SIZE) : HDA_DEFAULT_RING_SIZE;
+	size_t period_size = (arg.ac_period_size != 0) ? arg.ac_period_size : HDA_DEFAULT_PERIOD_SIZE;
+	IHDAFunctions::Context ctx;
+	err = hdaFunctions->OpenStream(tag, HDF_DIR_OUT, HDA_OUTPUT_FORMAT, ring_size, period_size, &ctx);
+	ANANAS_ERROR_RETURN(err);
 
-		/* open a stream to play things */
-		IHDAFunctions::Context ctx;
-		int num_pages = 64;
-		err = hdaFunctions->OpenStream(tag, HDF_DIR_OUT, stream_fmt, num_pages, &ctx);
-		ANANAS_ERROR_RETURN(err);
+	/* Start with silence */
+	addr_t ring_phys;
+	size_t ring_len;
+	memset(hdaFunctions->GetStreamRing(ctx, ring_phys, ring_len), 0, ring_len);
 
-		/* Fill the stream with silence */
-		cur_stream_offset = 0;
-		for (unsigned int n = 0; n < num_pages; n++) {
-			auto ptr = static_cast<uint8_t*>(hdaFunctions->GetStreamDataPointer(ctx, n));
-			for (unsigned int m = 0; m < PAGE_SIZE; m++) {
-				*ptr++ = 0x80;
-			}
-		}
-		contexts[num_contexts++] = ctx;
+	/* Hand the ring and the position to the claimer; these are the very pages the hardware uses */
+	vmarea_t* va_ring;
+	err = vmspace_map(proc.p_vmspace, ring_phys, ring_len, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE, &va_ring);
+	if (ananas_is_failure(err)) {
+		hdaFunctions->CloseStream(ctx);
+		return err;
+	}
+	addr_t pos_phys = hdaFunctions->GetStreamPositionAddress(ctx);
+	vmarea_t* va_pos;
+	err = vmspace_map(proc.p_vmspace, pos_phys & ~(PAGE_SIZE - 1), PAGE_SIZE, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_DEVICE, &va_pos);
+	if (ananas_is_failure(err)) {
+		vmspace_unmap(proc.p_vmspace, va_ring->va_virt, va_ring->va_len);
+		hdaFunctions->CloseStream(ctx);
+		return err;
 	}
 
-	play_buf = static_cast<uint8_t*>(kmalloc(PAGE_SIZE * 64));
-	memset(play_buf, 0x80, PAGE_SIZE * 64);
+	hda_out_ctx = ctx;
+	hda_out_ring_va = va_ring->va_virt;
+	hda_out_ring_len = va_ring->va_len;
+	hda_out_pos_va = va_pos->va_virt;
+	hda_out_periods = 0;
+	process_ref(&proc);
+	hda_out_proc = &proc;
+
+	err = hdaFunctions->StartStreams(1, &hda_out_ctx);
+	if (ananas_is_failure(err)) {
+		ReleaseOutput();
+		return err;
+	}
 
-	mutex_init(&play_mtx, "play");
-	sem_init(&play_sem, 0);
+	arg.ac_ring = reinterpret_cast<void*>(hda_out_ring_va);
+	arg.ac_position = reinterpret_cast<const volatile uint32_t*>(hda_out_pos_va + (pos_phys & (PAGE_SIZE - 1)));
+	arg.ac_ring_size = ring_len;
+	arg.ac_period_size = period_size;
+	arg.ac_rate = HDA_OUTPUT_RATE;
+	arg.ac_channels = HDA_OUTPUT_CHANNELS;
+	arg.ac_bits = HDA_OUTPUT_BITS;
+	return ananas_success();
+}
 
-	err = hdaFunctions->StartStreams(num_contexts, contexts);
-	ANANAS_ERROR_RETURN(err);
-#endif
+/* Must be called with hda_mtx held */
+errorcode_t
+HDADevice::ReleaseOutput()
+{
+	if (hda_out_ctx == nullptr)
+		return ANANAS_ERROR(BAD_OPERATION);
+
+	/* Stop the hardware before the pages go away */
+	hdaFunctions->StopStreams(1, &hda_out_ctx);
+	vmspace_unmap(hda_out_proc->p_vmspace, hda_out_ring_va, hda_out_ring_len);
+	vmspace_unmap(hda_out_proc->p_vmspace, hda_out_pos_va, PAGE_SIZE);
+	hdaFunctions->CloseStream(hda_out_ctx);
+	hda_out_ctx = nullptr;
+
+	process_deref(hda_out_proc);
+	hda_out_proc = nullptr;
 	return ananas_success();
 }
 
+errorcode_t
+HDADevice::DeviceControl(process_t* proc, unsigned int op, void* buffer, size_t len)
+{
+	errorcode_t err;
+	switch(op) {
+		case HCTL_AUDIO_CLAIM: {
+			if (buffer == NULL || len != sizeof(struct HCTL_AUDIO_CLAIM_ARG))
+				return ANANAS_ERROR(BAD_LENGTH);
+			mutex_lock(&hda_mtx);
+			err = ClaimOutput(*proc, *static_cast<struct HCTL_AUDIO_CLAIM_ARG*>(buffer));
+			mutex_unlock(&hda_mtx);
+			return err;
+		}
+		case HCTL_AUDIO_GET_POSITION: {
+			if (buffer == NULL || len != sizeof(struct HCTL_AUDIO_POSITION_ARG))
+				return ANANAS_ERROR(BAD_LENGTH);
+			auto arg = static_cast<struct HCTL_AUDIO_POSITION_ARG*>(buffer);
+			mutex_lock(&hda_mtx);
+			if (hda_out_ctx != nullptr) {
+				arg->ap_position = hdaFunctions->GetStreamPosition(hda_out_ctx);
+				arg->ap_periods = __atomic_load_n(&hda_out_periods, __ATOMIC_RELAXED);
+				err = ananas_success();
+			} else
+				err = ANANAS_ERROR(BAD_OPERATION);
+			mutex_unlock(&hda_mtx);
+			return err;
+		}
+		case HCTL_AUDIO_RELEASE: {
+			mutex_lock(&hda_mtx);
+			if (hda_out_proc == proc)
+				err = ReleaseOutput();
+			else
+				err = ANANAS_ERROR(BAD_OPERATION);
+			mutex_unlock(&hda_mtx);
+			return err;
+		}
+	}
+	return ANANAS_ERROR(BAD_OPERATION);
+}
+
 errorcode_t
 HDADevice::Detach()
 {
@@ -3,7 +3,9 @@
 
 #include <ananas/list.h>
 #include <ananas/types.h>
+#include <ananas/audio.h>
 #include <ananas/device.h>
+#include <ananas/lock.h>
 
 namespace Ananas {
 namespace HDA {
@@ -240,11 +242,17 @@ public:
 	typedef void* Context;
 	virtual errorcode_t IssueVerb(uint32_t verb, uint32_t* resp, uint32_t* resp_ex) = 0;
 	virtual uint16_t GetAndClearStateChange() = 0;
-	virtual errorcode_t OpenStream(int tag, int dir, uint16_t fmt, int num_pages, Context* context) = 0;
+	/* Streams use a ring of ring_size bytes, which interrupts after every period_size bytes */
+	virtual errorcode_t OpenStream(int tag, int dir, uint16_t fmt, size_t ring_size, size_t period_size, Context* context) = 0;
 	virtual errorcode_t CloseStream(Context context) = 0;
 	virtual errorcode_t StartStreams(int num, Context* context) = 0;
 	virtual errorcode_t StopStreams(int num, Context* context) = 0;
-	virtual void* GetStreamDataPointer(Context context, int page) = 0;
+	/* Returns the ring in kernel memory; it is physically contiguous */
+	virtual void* GetStreamRing(Context context, addr_t& phys, size_t& length) = 0;
+	/* Returns the byte offset in the ring the hardware is at */
+	virtual uint32_t GetStreamPosition(Context context) = 0;
+	/* Returns the physical address where the hardware keeps the position up-to-date */
+	virtual addr_t GetStreamPositionAddress(Context context) = 0;
 };
 
 enum HDANodeType {
@@ -442,6 +450,7 @@ public:
 
 	errorcode_t Attach() override;
 	errorcode_t Detach() override;
+	errorcode_t DeviceControl(process_t* proc, unsigned int op, void* buffer, size_t len) override;
 
 	void OnStreamIRQ(IHDAFunctions::Context ctx);
 
@@ -461,10 +470,22 @@ protected:
 
 	errorcode_t RouteOutput(AFG& afg, int channels, Output& o, RoutingPlan** rp);
 
+	errorcode_t ClaimOutput(process_t& proc, struct HCTL_AUDIO_CLAIM_ARG& arg);
+	errorcode_t ReleaseOutput();
+
 private:
 	IHDAFunctions* hdaFunctions = nullptr;
 
 	AFG* hda_afg;	/* XXX we support at most 1 AFG per device */
+
+	/* Output ring, while claimed by a process; protected by hda_mtx */
+	mutex_t hda_mtx;
+	IHDAFunctions::Context hda_out_ctx = nullptr;
+	process_t* hda_out_proc = nullptr;
+	addr_t hda_out_ring_va;		/* Ring, mapped in hda_out_proc */
+	size_t hda_out_ring_len;
+	addr_t hda_out_pos_va;		/* Position page, mapped in hda_out_proc */
+	uint64_t hda_out_periods = 0;	/* Periods completed; updated from the IRQ */
 };
 
 
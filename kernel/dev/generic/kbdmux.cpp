@@ -1,3 +1,5 @@
+#include <ananas/types.h>
+#include <ananas/cbuffer.h>
 #include <ananas/device.h>
 #include <ananas/driver.h>
 #include <ananas/console.h>
@@ -33,11 +35,14 @@ public:
 
 	void OnInput(uint8_t ch);
 
-	/* We must use a spinlock here as kbdmux_on_input() can be called from IRQ context */
+	/*
+	 * Input is only read by the TTY, so the ring needs no lock there; there
+	 * can be multiple keyboards, so writers must be serialized - we must use a
+	 * spinlock for this as kbdmux_on_input() can be called from IRQ context.
+	 */
 	spinlock_t kbd_lock;
 	char kbd_buffer[KBDMUX_BUFFER_SIZE];
-	int kbd_buffer_readpos = 0;
-	int kbd_buffer_writepos = 0;
+	struct SPSC_RING kbd_ring;
 };
 
 KeyboardMux* kbdmux_instance = NULL; // XXX KLUDGE
@@ -47,9 +52,7 @@ KeyboardMux::OnInput(uint8_t ch)
 {
 	/* Add the data to our buffer */
 	register_t state = spinlock_lock_unpremptible(&kbd_lock);
-	/* XXX we should protect against buffer overruns */
-	kbd_buffer[kbd_buffer_writepos] = ch;
-	kbd_buffer_writepos = (kbd_buffer_writepos + 1) % KBDMUX_BUFFER_SIZE;
+	spsc_ring_write(&kbd_ring, &ch, sizeof(ch)); /* drops the key if full */
 	spinlock_unlock_unpremptible(&kbd_lock, state);
 
 	/* XXX signal consumers - this is a hack */
@@ -61,19 +64,7 @@ KeyboardMux::OnInput(uint8_t ch)
 errorcode_t
 KeyboardMux::Read(void* data, size_t& len, off_t off)
 {
-	size_t returned = 0, left = len;
-
-	register_t state = spinlock_lock_unpremptible(&kbd_lock);
-	while (left-- > 0) {
-		if (kbd_buffer_readpos == kbd_buffer_writepos)
-			break;
-
-		*(uint8_t*)(static_cast<uint8_t*>(data) + returned++) = kbd_buffer[kbd_buffer_readpos];
-		kbd_buffer_readpos = (kbd_buffer_readpos + 1) % KBDMUX_BUFFER_SIZE;
-	}
-	spinlock_unlock_unpremptible(&kbd_lock, state);
-
-	len = returned;
+	len = spsc_ring_read(&kbd_ring, data, len);
 	return ananas_success();
 }
 
@@ -83,6 +74,7 @@ KeyboardMux::Attach()
 	KASSERT(kbdmux_instance == NULL, "multiple kbdmux");
 	kbdmux_instance = this;
 	spinlock_init(&kbd_lock);
+	spsc_ring_init(&kbd_ring, kbd_buffer, sizeof(kbd_buffer));
 
 	return ananas_success();
 }
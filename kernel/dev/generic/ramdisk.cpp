@@ -0,0 +1,359 @@
+/*
+ * Memory-backed block devices.
+ *
+ * A ramdisk either holds an image the loader left in memory, or is created
+ * empty with a given size (using 'ramdisk=size_in_kb' on the commandline at
+ * boot, or ramdisk_create() later on). Empty ramdisks only get pages once they
+ * are written to; reading anything else yields zeroes.
+ *
+ * All I/O is just copying memory, so bio's are completed before we return -
+ * unless 'ramdisk_latency=microseconds' is given, in which case every request
+ * is completed by a timer once that much time has passed. This makes the
+ * ramdisk behave like a slower device (requests still overlap, up to
+ * RAMDISK_MAX_REQUESTS), which is what the buffer cache and filesystems are
+ * usually faced with.
+ */
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/cmdline.h>
+#include <ananas/device.h>
+#include <ananas/driver.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/ramdisk.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+#include <mbr.h>
+
+TRACE_SETUP;
+
+/* Maximum number of images the loader can pass */
+#define RAMDISK_MAX_BOOT_IMAGES	4
+
+/* Largest chain of bio's we take in a single request */
+#define RAMDISK_MAX_BIOS	64
+
+/* Number of requests we can have in flight at once */
+#define RAMDISK_MAX_REQUESTS	16
+
+namespace {
+
+struct BootImage {
+	addr_t bi_phys;
+	size_t bi_length;
+} ramdisk_boot_image[RAMDISK_MAX_BOOT_IMAGES];
+unsigned int ramdisk_num_boot_images = 0;
+
+/* Time every request takes to complete; zero completes them immediately */
+uint64_t ramdisk_latency_ns = 0;
+
+/* A request which is waiting for its latency to pass */
+struct DelayedRequest {
+	struct TIMER dr_timer;
+	struct BIO* dr_bio;
+	bool dr_busy;
+};
+
+class RAMDisk : public Ananas::Device, private Ananas::IDeviceOperations, private Ananas::IBIODeviceOperations
+{
+public:
+	using Device::Device;
+	virtual ~RAMDisk() = default;
+
+	IDeviceOperations& GetDeviceOperations() override
+	{
+		return *this;
+	}
+
+	IBIODeviceOperations* GetBIODeviceOperations() override
+	{
+		return this;
+	}
+
+	/* Must be called before attaching; phys is zero for an empty ramdisk */
+	void SetBacking(addr_t phys, size_t length)
+	{
+		rd_phys = phys;
+		rd_length = length;
+	}
+
+	errorcode_t Attach() override;
+	errorcode_t Detach() override;
+
+	errorcode_t ReadBIO(struct BIO& bio) override;
+	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
+	unsigned int GetMaxBIOsPerRequest() override;
+
+private:
+	errorcode_t Transfer(struct BIO& bio, bool write);
+	char* GetPage(unsigned int n, bool write);
+	void Delay(struct BIO& bio);
+	static void OnDelayExpired(void* context);
+
+	addr_t rd_phys = 0;
+	size_t rd_length = 0;
+	unsigned int rd_num_pages = 0;
+	char** rd_page_va = nullptr;	/* mapped pages, nullptr if not yet written */
+	struct PAGE** rd_page = nullptr;	/* pages we allocated, if empty */
+	mutex_t rd_mtx;			/* protects allocating pages */
+	struct DelayedRequest rd_delayed[RAMDISK_MAX_REQUESTS];
+};
+
+errorcode_t
+RAMDisk::Attach()
+{
+	if (rd_length == 0 || (rd_length % BIO_SECTOR_SIZE) != 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	mutex_init(&rd_mtx, "ramdisk");
+	for (auto& dr: rd_delayed)
+		timer_init(&dr.dr_timer, &OnDelayExpired, &dr);
+	rd_num_pages = (rd_length + PAGE_SIZE - 1) / PAGE_SIZE;
+	rd_page_va = new char*[rd_num_pages];
+	memset(rd_page_va, 0, rd_num_pages * sizeof(char*));
+	if (rd_phys != 0) {
+		/* Image; this is already in memory, so we need only map it */
+		auto va = static_cast<char*>(kmem_map(rd_phys, rd_length, VM_FLAG_READ | VM_FLAG_WRITE));
+		for (unsigned int n = 0; n < rd_num_pages; n++)
+			rd_page_va[n] = va + n * PAGE_SIZE;
+	} else {
+		rd_page = new struct PAGE*[rd_num_pages];
+		memset(rd_page, 0, rd_num_pages * sizeof(struct PAGE*));
+	}
+
+	Printf("%u KB%s", (unsigned int)(rd_length / 1024), rd_phys != 0 ? " (boot image)" : "");
+
+	/* Images may well hold partitions; this is crude and does not really belong here */
+	if (rd_phys != 0) {
+		struct BIO* bio = bio_read(this, 0, BIO_SECTOR_SIZE);
+		if (!BIO_IS_ERROR(bio))
+			mbr_process(this, bio);
+		bio_free(bio);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+RAMDisk::Detach()
+{
+	if (rd_page != nullptr) {
+		for (unsigned int n = 0; n < rd_num_pages; n++) {
+			if (rd_page[n] == nullptr)
+				continue;
+			kmem_unmap(rd_page_va[n], PAGE_SIZE);
+			page_free(rd_page[n]);
+		}
+		delete[] rd_page;
+	} else if (rd_page_va != nullptr) {
+		kmem_unmap(rd_page_va[0], rd_length);
+	}
+	delete[] rd_page_va;
+	return ananas_success();
+}
+
+/* Returns page n, or nullptr if it was never written and we do not intend to */
+char*
+RAMDisk::GetPage(unsigned int n, bool write)
+{
+	char* va = rd_page_va[n];
+	if (va != nullptr || !write)
+		return va;
+
+	mutex_lock(&rd_mtx);
+	if (rd_page_va[n] == nullptr) {
+		struct PAGE* page = page_alloc_zeroed();
+		rd_page[n] = page;
+		rd_page_va[n] = static_cast<char*>(kmem_map(page_get_paddr(page), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+	}
+	va = rd_page_va[n];
+	mutex_unlock(&rd_mtx);
+	return va;
+}
+
+/* Called from the timer interrupt; completes the request */
+void
+RAMDisk::OnDelayExpired(void* context)
+{
+	auto dr = static_cast<struct DelayedRequest*>(context);
+	for (struct BIO* b = dr->dr_bio; b != NULL; /* nothing */) {
+		struct BIO* next = b->io_next;
+		bio_set_available(b);
+		b = next;
+	}
+	__atomic_store_n(&dr->dr_busy, false, __ATOMIC_RELEASE);
+}
+
+void
+RAMDisk::Delay(struct BIO& bio)
+{
+	/* The request queue never hands us more than RAMDISK_MAX_REQUESTS at once */
+	for (auto& dr: rd_delayed) {
+		if (__atomic_exchange_n(&dr.dr_busy, true, __ATOMIC_ACQUIRE))
+			continue;
+		dr.dr_bio = &bio;
+		timer_start(&dr.dr_timer, timer_get_ns() + ramdisk_latency_ns);
+		return;
+	}
+	panic("ramdisk: more than %d requests in flight", RAMDISK_MAX_REQUESTS);
+}
+
+errorcode_t
+RAMDisk::Transfer(struct BIO& bio, bool write)
+{
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next) {
+		if (b->io_block * BIO_SECTOR_SIZE + b->length > rd_length)
+			return ANANAS_ERROR(BAD_RANGE);
+	}
+
+	uint64_t latency_ns = ramdisk_latency_ns;
+	for (struct BIO* b = &bio; b != NULL; /* nothing */) {
+		struct BIO* next = b->io_next; /* bio may be reused once available */
+
+		/* A bio can straddle a page boundary, so copy page by page */
+		size_t offset = b->io_block * BIO_SECTOR_SIZE;
+		auto data = static_cast<char*>(BIO_DATA(b));
+		for (size_t left = b->length; left > 0; /* nothing */) {
+			size_t page_offset = offset % PAGE_SIZE;
+			size_t chunk = PAGE_SIZE - page_offset;
+			if (chunk > left)
+				chunk = left;
+
+			char* va = GetPage(offset / PAGE_SIZE, write);
+			if (write)
+				memcpy(va + page_offset, data, chunk);
+			else if (va != nullptr)
+				memcpy(data, va + page_offset, chunk);
+			else
+				memset(data, 0, chunk);
+
+			offset += chunk;
+			data += chunk;
+			left -= chunk;
+		}
+
+		if (latency_ns == 0)
+			bio_set_available(b);
+		b = next;
+	}
+	if (latency_ns != 0)
+		Delay(bio);
+	return ananas_success();
+}
+
+errorcode_t
+RAMDisk::ReadBIO(struct BIO& bio)
+{
+	return Transfer(bio, false);
+}
+
+errorcode_t
+RAMDisk::WriteBIO(struct BIO& bio)
+{
+	return Transfer(bio, true);
+}
+
+unsigned int
+RAMDisk::GetMaxBIORequests()
+{
+	return RAMDISK_MAX_REQUESTS; /* without latency, this only limits the dispatching */
+}
+
+unsigned int
+RAMDisk::GetMaxBIOsPerRequest()
+{
+	return RAMDISK_MAX_BIOS;
+}
+
+struct RAMDisk_Driver : public Ananas::Driver
+{
+	RAMDisk_Driver()
+	 : Driver("ramdisk")
+	{
+	}
+
+	const char* GetBussesToProbeOn() const override
+	{
+		return nullptr; // instantiated by ramdisk_create()
+	}
+
+	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
+	{
+		return new RAMDisk(cdp);
+	}
+};
+
+errorcode_t
+ramdisk_attach(addr_t phys, size_t length, Ananas::Device*& device)
+{
+	auto rd = static_cast<RAMDisk*>(Ananas::DeviceManager::CreateDevice("ramdisk", Ananas::CreateDeviceProperties(Ananas::ResourceSet())));
+	if (rd == nullptr)
+		return ANANAS_ERROR(NO_DEVICE);
+	rd->SetBacking(phys, length);
+
+	errorcode_t err = Ananas::DeviceManager::AttachSingle(*rd);
+	if (ananas_is_failure(err)) {
+		delete rd;
+		return err;
+	}
+	device = rd;
+	return ananas_success();
+}
+
+errorcode_t
+ramdisk_init()
+{
+	const char* latency_arg = cmdline_get_string("ramdisk_latency");
+	if (latency_arg != nullptr)
+		ramdisk_latency_ns = strtoul(latency_arg, NULL, 10) * 1000;
+
+	Ananas::Device* dev;
+	for (unsigned int n = 0; n < ramdisk_num_boot_images; n++) {
+		struct BootImage& bi = ramdisk_boot_image[n];
+		errorcode_t err = ramdisk_attach(bi.bi_phys, bi.bi_length, dev);
+		if (ananas_is_failure(err))
+			kprintf("ramdisk: unable to attach boot image at %p, %d\n", bi.bi_phys, err);
+	}
+
+	const char* size_arg = cmdline_get_string("ramdisk");
+	if (size_arg != nullptr) {
+		size_t length = strtoul(size_arg, NULL, 10) * 1024;
+		errorcode_t err = ramdisk_create(length, dev);
+		if (ananas_is_failure(err))
+			kprintf("ramdisk: unable to create ramdisk of %s KB, %d\n", size_arg, err);
+	}
+	return ananas_success();
+}
+
+/* Runs once all drivers are registered */
+INIT_FUNCTION(ramdisk_init, SUBSYSTEM_DEVICE, ORDER_MIDDLE);
+
+} // unnamed namespace
+
+REGISTER_DRIVER(RAMDisk_Driver)
+
+void
+ramdisk_add_boot_image(addr_t phys, size_t length)
+{
+	if (ramdisk_num_boot_images == RAMDISK_MAX_BOOT_IMAGES)
+		return; /* can't report this; there is no console yet */
+
+	/* Images need not be a multiple of sectors; round down as the rest is useless anyway */
+	struct BootImage& bi = ramdisk_boot_image[ramdisk_num_boot_images++];
+	bi.bi_phys = phys;
+	bi.bi_length = length & ~(BIO_SECTOR_SIZE - 1);
+}
+
+errorcode_t
+ramdisk_create(size_t length, Ananas::Device*& device)
+{
+	return ramdisk_attach(0, ROUND_UP(length, BIO_SECTOR_SIZE), device);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,168 @@
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/device.h>
+#include <ananas/driver.h>
+#include <ananas/error.h>
+#include <ananas/trace.h>
+#include <ananas/lib.h>
+#include <mbr.h>
+#include "nvme.h"
+
+TRACE_SETUP;
+
+/* Largest chain of bio's we take in a single request */
+#define NVMEDISK_MAX_BIOS	256
+
+namespace {
+
+class NVMeDisk : public Ananas::Device, private Ananas::IDeviceOperations, private Ananas::IBIODeviceOperations
+{
+public:
+	using Device::Device;
+	virtual ~NVMeDisk() = default;
+
+	IDeviceOperations& GetDeviceOperations() override
+	{
+		return *this;
+	}
+
+	IBIODeviceOperations* GetBIODeviceOperations() override
+	{
+		return this;
+	}
+
+	errorcode_t Attach() override;
+	errorcode_t Detach() override;
+
+	errorcode_t ReadBIO(struct BIO& bio) override;
+	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
+	unsigned int GetMaxBIOsPerRequest() override;
+	errorcode_t FlushCache() override;
+
+private:
+	Ananas::NVMe::NVMeDevice& GetController()
+	{
+		return *static_cast<Ananas::NVMe::NVMeDevice*>(d_Parent);
+	}
+
+	errorcode_t Submit(struct BIO& bio, bool write);
+
+	uint32_t nd_nsid;
+	uint64_t nd_size;	/* in blocks */
+	unsigned int nd_lba_shift;	/* log2 of the block size */
+};
+
+errorcode_t
+NVMeDisk::Attach()
+{
+	auto res = d_ResourceSet.GetResource(Ananas::Resource::RT_ChildNum, 0);
+	if (res == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	nd_nsid = res->r_Base;
+
+	auto ns = new Ananas::NVMe::NVME_IDENTIFY_NAMESPACE;
+	errorcode_t err = GetController().Identify(nd_nsid, NVME_IDENTIFY_CNS_NAMESPACE, ns);
+	nd_size = ns->in_nsze;
+	nd_lba_shift = NVME_LBAF_LBADS(ns->in_lbaf[NVME_FLBAS_FORMAT(ns->in_flbas)]);
+	delete ns;
+	ANANAS_ERROR_RETURN(err);
+	if (nd_size == 0)
+		return ANANAS_ERROR(NO_DEVICE); /* namespace is not active */
+
+	/* Blocks must be at least a sector and fit in a page */
+	if (nd_lba_shift < 9 || nd_lba_shift > 12) {
+		Printf("namespace %u: unsupported block size %u", nd_nsid, 1 << nd_lba_shift);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+
+	Printf("namespace %u - %u MB, %u byte blocks", nd_nsid,
+	 (uint32_t)((nd_size << nd_lba_shift) / (1024UL * 1024UL)), 1 << nd_lba_shift);
+
+	/*
+	 * Read the first block and pass it to the MBR code; this is crude
+	 * and does not really belong here.
+	 */
+	struct BIO* bio = bio_read(this, 0, 1 << nd_lba_shift);
+	if (BIO_IS_ERROR(bio))
+		return ANANAS_ERROR(IO); /* XXX should get error from bio */
+
+	mbr_process(this, bio);
+	bio_free(bio);
+	return ananas_success();
+}
+
+errorcode_t
+NVMeDisk::Detach()
+{
+	return ananas_success();
+}
+
+errorcode_t
+NVMeDisk::Submit(struct BIO& bio, bool write)
+{
+	/* Every bio must cover whole blocks of the namespace */
+	uint32_t block_mask = (1 << nd_lba_shift) - 1;
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next) {
+		KASSERT(b->length > 0, "invalid length");
+		if (((b->io_block * BIO_SECTOR_SIZE) & block_mask) != 0 || (b->length & block_mask) != 0)
+			return ANANAS_ERROR(BAD_RANGE);
+	}
+
+	GetController().SubmitIO(nd_nsid, nd_lba_shift, bio, write);
+	return ananas_success();
+}
+
+errorcode_t
+NVMeDisk::ReadBIO(struct BIO& bio)
+{
+	return Submit(bio, false);
+}
+
+errorcode_t
+NVMeDisk::WriteBIO(struct BIO& bio)
+{
+	return Submit(bio, true);
+}
+
+unsigned int
+NVMeDisk::GetMaxBIORequests()
+{
+	return GetController().GetMaxRequests();
+}
+
+unsigned int
+NVMeDisk::GetMaxBIOsPerRequest()
+{
+	return NVMEDISK_MAX_BIOS;
+}
+
+errorcode_t
+NVMeDisk::FlushCache()
+{
+	return GetController().Flush(nd_nsid);
+}
+
+struct NVMeDisk_Driver : public Ananas::Driver
+{
+	NVMeDisk_Driver()
+	 : Driver("nvmedisk")
+	{
+	}
+
+	const char* GetBussesToProbeOn() const override
+	{
+		return nullptr; // instantiated by nvme
+	}
+
+	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
+	{
+		return new NVMeDisk(cdp);
+	}
+};
+
+} // unnamed namespace
+
+REGISTER_DRIVER(NVMeDisk_Driver)
+
+/* vim:set ts=2 sw=2: */
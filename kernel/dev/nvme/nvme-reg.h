@@ -0,0 +1,144 @@
+#ifndef __ANANAS_NVME_REG_H__
+#define __ANANAS_NVME_REG_H__
+
+#include <ananas/types.h>
+
+namespace Ananas {
+namespace NVMe {
+
+/* Controller registers */
+#define NVME_REG_CAP		0x00		/* Controller Capabilities (64-bit) */
+#define  NVME_CAP_MQES(x)	((x) & 0xffff)			/* Maximum Queue Entries Supported */
+#define  NVME_CAP_CQR		(1ULL << 16)			/* Contiguous Queues Required */
+#define  NVME_CAP_TO(x)		(((x) >> 24) & 0xff)		/* Timeout, in 500ms units */
+#define  NVME_CAP_DSTRD(x)	(((x) >> 32) & 0xf)		/* Doorbell Stride */
+#define  NVME_CAP_CSS_NVM	(1ULL << 37)			/* NVM command set supported */
+#define  NVME_CAP_MPSMIN(x)	(((x) >> 48) & 0xf)		/* Memory Page Size Minimum */
+#define  NVME_CAP_MPSMAX(x)	(((x) >> 52) & 0xf)		/* Memory Page Size Maximum */
+#define NVME_REG_VS		0x08		/* Version */
+#define  NVME_VS_MJR(x)		((x) >> 16)
+#define  NVME_VS_MNR(x)		(((x) >> 8) & 0xff)
+#define NVME_REG_INTMS		0x0c		/* Interrupt Mask Set */
+#define NVME_REG_INTMC		0x10		/* Interrupt Mask Clear */
+#define NVME_REG_CC		0x14		/* Controller Configuration */
+#define  NVME_CC_EN		(1 << 0)			/* Enable */
+#define  NVME_CC_CSS_NVM	(0 << 4)			/* I/O Command Set: NVM */
+#define  NVME_CC_MPS(x)		((x) << 7)			/* Memory Page Size (2 ^ (12 + x)) */
+#define  NVME_CC_AMS_RR		(0 << 11)			/* Arbitration: round robin */
+#define  NVME_CC_SHN_NORMAL	(1 << 14)			/* Shutdown Notification */
+#define  NVME_CC_IOSQES(x)	((x) << 16)			/* I/O Submission Queue Entry Size (2 ^ x) */
+#define  NVME_CC_IOCQES(x)	((x) << 20)			/* I/O Completion Queue Entry Size (2 ^ x) */
+#define NVME_REG_CSTS		0x1c		/* Controller Status */
+#define  NVME_CSTS_RDY		(1 << 0)			/* Ready */
+#define  NVME_CSTS_CFS		(1 << 1)			/* Controller Fatal Status */
+#define NVME_REG_AQA		0x24		/* Admin Queue Attributes */
+#define  NVME_AQA_ACQS(x)	((x) << 16)			/* Admin Completion Queue Size (0-based) */
+#define  NVME_AQA_ASQS(x)	(x)				/* Admin Submission Queue Size (0-based) */
+#define NVME_REG_ASQ		0x28		/* Admin Submission Queue Base Address (64-bit) */
+#define NVME_REG_ACQ		0x30		/* Admin Completion Queue Base Address (64-bit) */
+#define NVME_REG_DOORBELL	0x1000		/* First doorbell register */
+#define NVME_REG_SQTDBL(q, dstrd)	(NVME_REG_DOORBELL + (2 * (q)) * (4 << (dstrd)))	/* Submission Queue Tail */
+#define NVME_REG_CQHDBL(q, dstrd)	(NVME_REG_DOORBELL + (2 * (q) + 1) * (4 << (dstrd)))	/* Completion Queue Head */
+
+/* Submission queue entry */
+struct NVME_SQE {
+	uint32_t	sqe_cdw0;
+#define NVME_SQE_CDW0_OPC(x)	(x)				/* Opcode */
+#define NVME_SQE_CDW0_CID(x)	((x) << 16)			/* Command Identifier */
+	uint32_t	sqe_nsid;
+	uint32_t	sqe_cdw2;
+	uint32_t	sqe_cdw3;
+	uint64_t	sqe_mptr;
+	uint64_t	sqe_prp1;
+	uint64_t	sqe_prp2;
+	uint32_t	sqe_cdw10;
+	uint32_t	sqe_cdw11;
+	uint32_t	sqe_cdw12;
+	uint32_t	sqe_cdw13;
+	uint32_t	sqe_cdw14;
+	uint32_t	sqe_cdw15;
+} __attribute__((packed));
+
+/* Completion queue entry */
+struct NVME_CQE {
+	uint32_t	cqe_dw0;
+	uint32_t	cqe_dw1;
+	uint16_t	cqe_sqhd;
+	uint16_t	cqe_sqid;
+	uint16_t	cqe_cid;
+	uint16_t	cqe_status;
+#define NVME_CQE_STATUS_P	(1 << 0)			/* Phase Tag */
+#define NVME_CQE_STATUS_SC(x)	(((x) >> 1) & 0xff)		/* Status Code */
+#define NVME_CQE_STATUS_SCT(x)	(((x) >> 9) & 0x7)		/* Status Code Type */
+#define NVME_CQE_STATUS_OK(x)	(((x) & 0xfffe) == 0)
+} __attribute__((packed));
+
+#define NVME_SQE_SIZE_LOG2	6
+#define NVME_CQE_SIZE_LOG2	4
+
+/* Admin commands */
+#define NVME_ADMIN_DELETE_SQ	0x00
+#define NVME_ADMIN_CREATE_SQ	0x01
+#define NVME_ADMIN_DELETE_CQ	0x04
+#define NVME_ADMIN_CREATE_CQ	0x05
+#define NVME_ADMIN_IDENTIFY	0x06
+#define NVME_ADMIN_SET_FEATURES	0x09
+
+/* Create I/O Completion/Submission Queue */
+#define NVME_CREATE_Q_CDW10(qid, size)	(((size) - 1) << 16 | (qid))
+#define NVME_CREATE_CQ_CDW11_PC		(1 << 0)		/* Physically Contiguous */
+#define NVME_CREATE_CQ_CDW11_IEN	(1 << 1)		/* Interrupts Enabled */
+#define NVME_CREATE_CQ_CDW11_IV(x)	((x) << 16)		/* Interrupt Vector */
+#define NVME_CREATE_SQ_CDW11_PC		(1 << 0)		/* Physically Contiguous */
+#define NVME_CREATE_SQ_CDW11_CQID(x)	((x) << 16)		/* Completion Queue Identifier */
+
+/* Identify */
+#define NVME_IDENTIFY_CNS_NAMESPACE	0x00
+#define NVME_IDENTIFY_CNS_CONTROLLER	0x01
+#define NVME_IDENTIFY_LENGTH		4096
+
+struct NVME_IDENTIFY_CONTROLLER {
+	uint16_t	ic_vid;			/* PCI Vendor ID */
+	uint16_t	ic_ssvid;		/* PCI Subsystem Vendor ID */
+	char		ic_sn[20];		/* Serial Number */
+	char		ic_mn[40];		/* Model Number */
+	char		ic_fr[8];		/* Firmware Revision */
+	uint8_t		ic_rab;			/* Recommended Arbitration Burst */
+	uint8_t		ic_ieee[3];		/* IEEE OUI Identifier */
+	uint8_t		ic_cmic;		/* Controller Multi-Path I/O and Namespace Sharing */
+	uint8_t		ic_mdts;		/* Maximum Data Transfer Size */
+	uint8_t		_reserved0[516 - 78];
+	uint32_t	ic_nn;			/* Number of Namespaces */
+	uint8_t		_reserved1[4096 - 520];
+} __attribute__((packed));
+
+struct NVME_IDENTIFY_NAMESPACE {
+	uint64_t	in_nsze;		/* Namespace Size */
+	uint64_t	in_ncap;		/* Namespace Capacity */
+	uint64_t	in_nuse;		/* Namespace Utilization */
+	uint8_t		in_nsfeat;		/* Namespace Features */
+	uint8_t		in_nlbaf;		/* Number of LBA Formats */
+	uint8_t		in_flbas;		/* Formatted LBA Size */
+#define NVME_FLBAS_FORMAT(x)	((x) & 0xf)
+	uint8_t		_reserved0[128 - 27];
+	uint32_t	in_lbaf[16];		/* LBA Format Support */
+#define NVME_LBAF_LBADS(x)	(((x) >> 16) & 0xff)		/* LBA Data Size (2 ^ x) */
+	uint8_t		_reserved1[4096 - 192];
+} __attribute__((packed));
+
+/* Set Features */
+#define NVME_FEATURE_NUM_QUEUES		0x07
+#define NVME_NUM_QUEUES(nsq, ncq)	(((ncq) - 1) << 16 | ((nsq) - 1))
+#define NVME_NUM_QUEUES_NSQA(x)		(((x) & 0xffff) + 1)
+#define NVME_NUM_QUEUES_NCQA(x)		(((x) >> 16) + 1)
+
+/* NVM commands */
+#define NVME_CMD_FLUSH		0x00
+#define NVME_CMD_WRITE		0x01
+#define NVME_CMD_READ		0x02
+#define NVME_RW_CDW12_NLB(x)	((x) - 1)		/* Number of Logical Blocks (0-based) */
+
+} // namespace NVMe
+} // namespace Ananas
+
+#endif /* __ANANAS_NVME_REG_H__ */
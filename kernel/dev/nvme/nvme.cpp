@@ -0,0 +1,620 @@
+/*
+ * NVMe controller driver; every namespace is attached as a 'nvmedisk' child.
+ *
+ * Next to the admin queue pair, we create an I/O queue pair for every CPU
+ * (or as many as the controller will give us), each with an interrupt vector
+ * of its own which is delivered to that CPU. Requests are submitted to the
+ * queue of the CPU they are issued on, so the queue locks are only contended
+ * if a thread migrates while submitting.
+ */
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/bus/pci.h>
+#include <ananas/device.h>
+#include <ananas/driver.h>
+#include <ananas/dma.h>
+#include <ananas/error.h>
+#include <ananas/irq.h>
+#include <ananas/lib.h>
+#include <ananas/mm.h>
+#include <ananas/pcpu.h>
+#include <ananas/time.h>
+#include <ananas/trace.h>
+#include <machine/param.h>
+#include "nvme.h"
+
+TRACE_SETUP;
+
+/* Register space we map; this holds the doorbells of at least 256 queue pairs */
+#define NVME_REG_SIZE		0x2000
+
+/* Namespaces we look for */
+#define NVME_MAX_NAMESPACES	16
+
+namespace Ananas {
+namespace NVMe {
+
+namespace {
+
+/* Collects the PRP entries of the bio's that make up a single command */
+struct PRP_LOAD {
+	uint64_t	pl_prp[NVME_MAX_PRPS];
+	unsigned int	pl_num;
+	uint64_t	pl_end;		/* physical end of the previous segment */
+	uint32_t	pl_len;
+	uint32_t	pl_max_len;
+	uint32_t	pl_seg_len;	/* length of the segment being loaded */
+	bool		pl_fits;	/* set if the segment was added */
+};
+
+/*
+ * Adds a segment to the command, if it fits. Only the first entry may start
+ * within a page, and every entry but the last must end at a page boundary -
+ * physically contiguous segments are merged before this is checked.
+ */
+errorcode_t
+nvme_prp_load(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs)
+{
+	auto pl = static_cast<struct PRP_LOAD*>(ctx);
+	KASSERT(num_segs == 1, "unsupported number of segments %d", num_segs);
+
+	uint64_t phys = s->s_phys;
+	uint64_t end = phys + pl->pl_seg_len;
+	uint64_t first_page; /* first page needing an entry of its own */
+	unsigned int needed = 0;
+	if (pl->pl_num == 0) {
+		first_page = (phys & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+		needed++;
+	} else if (phys == pl->pl_end) {
+		first_page = ((phys - 1) & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+	} else {
+		if ((phys & (PAGE_SIZE - 1)) != 0 || (pl->pl_end & (PAGE_SIZE - 1)) != 0)
+			return ananas_success(); /* needs a command of its own */
+		first_page = phys;
+	}
+	for (uint64_t page = first_page; page < end; page += PAGE_SIZE)
+		needed++;
+	if (pl->pl_num + needed > NVME_MAX_PRPS || pl->pl_len + pl->pl_seg_len > pl->pl_max_len)
+		return ananas_success();
+
+	if (pl->pl_num == 0)
+		pl->pl_prp[pl->pl_num++] = phys;
+	for (uint64_t page = first_page; page < end; page += PAGE_SIZE)
+		pl->pl_prp[pl->pl_num++] = page;
+	pl->pl_end = end;
+	pl->pl_len += pl->pl_seg_len;
+	pl->pl_fits = true;
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+errorcode_t
+NVMeDevice::WaitReady(bool ready)
+{
+	for (unsigned int n = 0; n < nv_timeout; n++) {
+		uint32_t csts = Read(NVME_REG_CSTS);
+		if (ready && (csts & NVME_CSTS_CFS)) {
+			Printf("controller reports fatal status");
+			return ANANAS_ERROR(IO);
+		}
+		if (((csts & NVME_CSTS_RDY) != 0) == ready)
+			return ananas_success();
+		delay(1);
+	}
+	Printf("timeout waiting for the controller to %s", ready ? "become ready" : "disable");
+	return ANANAS_ERROR(NO_DEVICE);
+}
+
+errorcode_t
+NVMeDevice::SetupQueue(Queue& q, unsigned int id, unsigned int entries)
+{
+	q.q_id = id;
+	q.q_vector = (nv_num_vectors > 1) ? id % nv_num_vectors : 0;
+	q.q_entries = entries;
+	spinlock_init(&q.q_lock);
+	sem_init(&q.q_slot_sem, entries - 1); /* a full queue would look empty */
+
+	errorcode_t err = dma_buf_alloc(d_DMA_tag, entries * sizeof(struct NVME_SQE), &q.q_dmabuf_sq);
+	ANANAS_ERROR_RETURN(err);
+	err = dma_buf_alloc(d_DMA_tag, entries * sizeof(struct NVME_CQE), &q.q_dmabuf_cq);
+	ANANAS_ERROR_RETURN(err);
+	err = dma_buf_alloc(d_DMA_tag, entries * NVME_PRP_LIST_ENTRIES * sizeof(uint64_t), &q.q_dmabuf_prp);
+	ANANAS_ERROR_RETURN(err);
+
+	q.q_sq = static_cast<volatile struct NVME_SQE*>(dma_buf_get_segment(q.q_dmabuf_sq, 0)->s_virt);
+	q.q_cq = static_cast<volatile struct NVME_CQE*>(dma_buf_get_segment(q.q_dmabuf_cq, 0)->s_virt);
+	q.q_prp = static_cast<uint64_t*>(dma_buf_get_segment(q.q_dmabuf_prp, 0)->s_virt);
+	q.q_prp_phys = dma_buf_get_segment(q.q_dmabuf_prp, 0)->s_phys;
+	memset(const_cast<struct NVME_SQE*>(q.q_sq), 0, entries * sizeof(struct NVME_SQE));
+	memset(const_cast<struct NVME_CQE*>(q.q_cq), 0, entries * sizeof(struct NVME_CQE));
+
+	q.q_sq_tail = 0;
+	q.q_cq_head = 0;
+	q.q_phase = 1;
+	q.q_cid_in_use = 0;
+	memset(q.q_cmd, 0, sizeof(q.q_cmd));
+	return ananas_success();
+}
+
+/* Must be called with q_lock held and a slot obtained from q_slot_sem */
+uint16_t
+NVMeDevice::AllocateCommand(Queue& q)
+{
+	uint16_t cid = 0;
+	while (cid < q.q_entries && (q.q_cid_in_use & (1ULL << cid)) != 0)
+		cid++;
+	KASSERT(cid < q.q_entries, "no free command on queue %u", q.q_id);
+
+	q.q_cid_in_use |= 1ULL << cid;
+	memset(&q.q_cmd[cid], 0, sizeof(struct Command));
+	q.q_cmd[cid].c_head = cid;
+	return cid;
+}
+
+/* Must be called with q_lock held */
+void
+NVMeDevice::FreeCommand(Queue& q, uint16_t cid)
+{
+	q.q_cid_in_use &= ~(1ULL << cid);
+	sem_signal(&q.q_slot_sem);
+}
+
+/* Must be called with q_lock held */
+void
+NVMeDevice::Post(Queue& q, struct NVME_SQE& sqe, uint16_t cid)
+{
+	sqe.sqe_cdw0 |= NVME_SQE_CDW0_CID(cid);
+	memcpy(const_cast<struct NVME_SQE*>(&q.q_sq[q.q_sq_tail]), &sqe, sizeof(sqe));
+	q.q_sq_tail = (q.q_sq_tail + 1) % q.q_entries;
+	Write(NVME_REG_SQTDBL(q.q_id, nv_dstrd), q.q_sq_tail);
+}
+
+/* Executes a command on queue q and waits for it to complete */
+errorcode_t
+NVMeDevice::Execute(Queue& q, struct NVME_SQE& sqe, struct NVME_CQE* result)
+{
+	semaphore_t sem;
+	sem_init(&sem, 0);
+	struct NVME_CQE cqe;
+
+	sem_wait(&q.q_slot_sem);
+	spinlock_lock(&q.q_lock);
+	uint16_t cid = AllocateCommand(q);
+	q.q_cmd[cid].c_semaphore = &sem;
+	q.q_cmd[cid].c_result = &cqe;
+	Post(q, sqe, cid);
+	spinlock_unlock(&q.q_lock);
+
+	sem_wait(&sem);
+	if (result != NULL)
+		*result = cqe;
+	if (!NVME_CQE_STATUS_OK(cqe.cqe_status)) {
+		Printf("%s command %x failed, status code type %u code %u", (&q == &nv_admin_queue) ? "admin" : "I/O",
+		 sqe.sqe_cdw0 & 0xff, NVME_CQE_STATUS_SCT(cqe.cqe_status), NVME_CQE_STATUS_SC(cqe.cqe_status));
+		return ANANAS_ERROR(IO);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+NVMeDevice::ExecuteAdmin(struct NVME_SQE& sqe, struct NVME_CQE* result)
+{
+	return Execute(nv_admin_queue, sqe, result);
+}
+
+errorcode_t
+NVMeDevice::Flush(uint32_t nsid)
+{
+	struct NVME_SQE sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.sqe_cdw0 = NVME_SQE_CDW0_OPC(NVME_CMD_FLUSH);
+	sqe.sqe_nsid = nsid;
+	return Execute(*nv_io_queue[PCPU_GET(cpuid) % nv_num_io_queues], sqe, NULL);
+}
+
+errorcode_t
+NVMeDevice::Identify(uint32_t nsid, unsigned int cns, void* buffer)
+{
+	dma_buf_t buf;
+	errorcode_t err = dma_buf_alloc(d_DMA_tag, NVME_IDENTIFY_LENGTH, &buf);
+	ANANAS_ERROR_RETURN(err);
+
+	struct NVME_SQE sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.sqe_cdw0 = NVME_SQE_CDW0_OPC(NVME_ADMIN_IDENTIFY);
+	sqe.sqe_nsid = nsid;
+	sqe.sqe_prp1 = dma_buf_get_segment(buf, 0)->s_phys;
+	sqe.sqe_cdw10 = cns;
+	err = ExecuteAdmin(sqe, NULL);
+	if (ananas_is_success(err))
+		memcpy(buffer, dma_buf_get_segment(buf, 0)->s_virt, NVME_IDENTIFY_LENGTH);
+	dma_buf_free(buf);
+	return err;
+}
+
+/* Must be called with q_lock held; completes all bio's of the request, in order */
+void
+NVMeDevice::CompleteRequest(Queue& q, uint16_t head)
+{
+	struct Command& cmd = q.q_cmd[head];
+	for (struct BIO* bio = cmd.c_bio; bio != NULL; /* nothing */) {
+		struct BIO* next = bio->io_next; /* bio may be reused once available */
+		dma_buf_unload_bio(q.q_dmabuf_prp, bio);
+		if (cmd.c_error)
+			bio_set_error(bio);
+		else
+			bio_set_available(bio);
+		bio = next;
+	}
+	FreeCommand(q, head);
+}
+
+void
+NVMeDevice::ProcessCompletions(Queue& q)
+{
+	spinlock_lock(&q.q_lock);
+	unsigned int num_done = 0;
+	while(1) {
+		volatile struct NVME_CQE* entry = &q.q_cq[q.q_cq_head];
+		if ((entry->cqe_status & NVME_CQE_STATUS_P) != q.q_phase)
+			break; /* not yet posted by the controller */
+		struct NVME_CQE cqe;
+		memcpy(&cqe, const_cast<struct NVME_CQE*>(entry), sizeof(cqe));
+		if (++q.q_cq_head == q.q_entries) {
+			q.q_cq_head = 0;
+			q.q_phase ^= 1;
+		}
+		num_done++;
+
+		uint16_t cid = cqe.cqe_cid;
+		if (cid >= q.q_entries || (q.q_cid_in_use & (1ULL << cid)) == 0) {
+			Printf("completion for inactive command %u on queue %u", cid, q.q_id);
+			continue;
+		}
+
+		struct Command& cmd = q.q_cmd[cid];
+		if (cmd.c_semaphore != NULL) {
+			/* Admin command or flush; our caller is waiting for it */
+			semaphore_t* sem = cmd.c_semaphore;
+			*cmd.c_result = cqe;
+			FreeCommand(q, cid);
+			sem_signal(sem);
+			continue;
+		}
+
+		uint16_t head = cmd.c_head;
+		if (!NVME_CQE_STATUS_OK(cqe.cqe_status)) {
+			Printf("command %u on queue %u failed, status code type %u code %u", cid, q.q_id,
+			 NVME_CQE_STATUS_SCT(cqe.cqe_status), NVME_CQE_STATUS_SC(cqe.cqe_status));
+			q.q_cmd[head].c_error = true;
+		}
+		if (cid != head)
+			FreeCommand(q, cid);
+		if (--q.q_cmd[head].c_pending == 0)
+			CompleteRequest(q, head);
+	}
+	if (num_done > 0)
+		Write(NVME_REG_CQHDBL(q.q_id, nv_dstrd), q.q_cq_head);
+	spinlock_unlock(&q.q_lock);
+}
+
+void
+NVMeDevice::OnIRQ(unsigned int vector)
+{
+	if (nv_admin_queue.q_vector == vector)
+		ProcessCompletions(nv_admin_queue);
+	for (unsigned int n = 0; n < nv_num_io_queues; n++) {
+		Queue& q = *nv_io_queue[n];
+		if (q.q_vector == vector)
+			ProcessCompletions(q);
+	}
+}
+
+void
+NVMeDevice::SubmitIO(uint32_t nsid, unsigned int lba_shift, struct BIO& bio, bool write)
+{
+	Queue& q = *nv_io_queue[PCPU_GET(cpuid) % nv_num_io_queues];
+
+	uint16_t head = NVME_CID_NONE;
+	for (struct BIO* b = &bio; b != NULL; /* nothing */) {
+		/* Gather as many bio's as a single command can describe */
+		struct PRP_LOAD pl;
+		pl.pl_num = 0;
+		pl.pl_len = 0;
+		pl.pl_max_len = nv_max_transfer;
+		struct BIO* first = b;
+		for (/* nothing */; b != NULL; b = b->io_next) {
+			pl.pl_seg_len = b->length;
+			pl.pl_fits = false;
+			errorcode_t err = dma_buf_load_bio(q.q_dmabuf_prp, b, nvme_prp_load, &pl, write ? DMA_LOAD_FLAG_WRITE : DMA_LOAD_FLAG_READ);
+			KASSERT(ananas_is_success(err), "unable to load bio %p, %d", b, err);
+			if (!pl.pl_fits)
+				break;
+		}
+		KASSERT(b != first, "bio %p does not fit in a command", first);
+
+		uint64_t lba = (first->io_block * BIO_SECTOR_SIZE) >> lba_shift;
+		struct NVME_SQE sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.sqe_cdw0 = NVME_SQE_CDW0_OPC(write ? NVME_CMD_WRITE : NVME_CMD_READ);
+		sqe.sqe_nsid = nsid;
+		sqe.sqe_prp1 = pl.pl_prp[0];
+		sqe.sqe_cdw10 = lba & 0xffffffff;
+		sqe.sqe_cdw11 = lba >> 32;
+		sqe.sqe_cdw12 = NVME_RW_CDW12_NLB(pl.pl_len >> lba_shift);
+
+		sem_wait(&q.q_slot_sem);
+		spinlock_lock(&q.q_lock);
+		uint16_t cid = AllocateCommand(q);
+		if (head == NVME_CID_NONE) {
+			head = cid;
+			q.q_cmd[head].c_bio = &bio;
+			q.q_cmd[head].c_pending = 1; /* dropped once everything is submitted */
+		}
+		q.q_cmd[cid].c_head = head;
+		q.q_cmd[head].c_pending++;
+
+		if (pl.pl_num == 2) {
+			sqe.sqe_prp2 = pl.pl_prp[1];
+		} else if (pl.pl_num > 2) {
+			memcpy(&q.q_prp[cid * NVME_PRP_LIST_ENTRIES], &pl.pl_prp[1], (pl.pl_num - 1) * sizeof(uint64_t));
+			sqe.sqe_prp2 = q.q_prp_phys + cid * NVME_PRP_LIST_ENTRIES * sizeof(uint64_t);
+		}
+		Post(q, sqe, cid);
+		spinlock_unlock(&q.q_lock);
+	}
+
+	spinlock_lock(&q.q_lock);
+	if (--q.q_cmd[head].c_pending == 0)
+		CompleteRequest(q, head);
+	spinlock_unlock(&q.q_lock);
+}
+
+unsigned int
+NVMeDevice::GetMaxRequests() const
+{
+	return nv_num_io_queues * (nv_queue_entries - 1);
+}
+
+/*
+ * Hooks up our interrupts: vector 0 is used by the admin queue, vector n by
+ * the n-th I/O queue, which is delivered to the CPU that uses the queue. If
+ * we get fewer vectors, queues share them; without any, all queues use the
+ * interrupt line.
+ */
+errorcode_t
+NVMeDevice::SetupIRQ(void* res_irq, unsigned int num_queues)
+{
+	unsigned int num_vectors = num_queues + 1;
+	nv_msi_enabled = ananas_is_success(pci_msi_alloc(*this, nv_msi, &num_vectors));
+	if (nv_msi_enabled) {
+		unsigned int n = 0;
+		for (/* nothing */; n < num_vectors; n++) {
+			int cpu = (n == 0) ? 0 : (n - 1) % pcpu_get_count();
+			errorcode_t err = pci_msi_register(*this, nv_msi, n, cpu, IRQWrapper, IRQ_TYPE_DEFAULT, (void*)(uintptr_t)n);
+			if (ananas_is_failure(err))
+				break;
+		}
+		if (n == num_vectors) {
+			nv_num_vectors = num_vectors;
+			return ananas_success();
+		}
+
+		while (n-- > 0)
+			irq_unregister(nv_msi.msi_irq[n], this, IRQWrapper, (void*)(uintptr_t)n);
+		pci_msi_free(*this, nv_msi);
+		nv_msi_enabled = false;
+	}
+
+	if (res_irq == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	nv_num_vectors = 1;
+	return irq_register((int)(uintptr_t)res_irq, this, IRQWrapper, IRQ_TYPE_DEFAULT, (void*)(uintptr_t)0);
+}
+
+errorcode_t
+NVMeDevice::CreateIOQueues(unsigned int num_queues)
+{
+	/* Ask for a queue pair per CPU; the controller may give us fewer */
+	struct NVME_SQE sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.sqe_cdw0 = NVME_SQE_CDW0_OPC(NVME_ADMIN_SET_FEATURES);
+	sqe.sqe_cdw10 = NVME_FEATURE_NUM_QUEUES;
+	sqe.sqe_cdw11 = NVME_NUM_QUEUES(num_queues, num_queues);
+	struct NVME_CQE cqe;
+	errorcode_t err = ExecuteAdmin(sqe, &cqe);
+	ANANAS_ERROR_RETURN(err);
+	if (NVME_NUM_QUEUES_NSQA(cqe.cqe_dw0) < num_queues)
+		num_queues = NVME_NUM_QUEUES_NSQA(cqe.cqe_dw0);
+	if (NVME_NUM_QUEUES_NCQA(cqe.cqe_dw0) < num_queues)
+		num_queues = NVME_NUM_QUEUES_NCQA(cqe.cqe_dw0);
+
+	for (unsigned int n = 0; n < num_queues; n++) {
+		Queue* q = new Queue;
+		err = SetupQueue(*q, n + 1, nv_queue_entries);
+		ANANAS_ERROR_RETURN(err);
+
+		/* The completion queue must exist before the submission queue using it */
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.sqe_cdw0 = NVME_SQE_CDW0_OPC(NVME_ADMIN_CREATE_CQ);
+		sqe.sqe_prp1 = dma_buf_get_segment(q->q_dmabuf_cq, 0)->s_phys;
+		sqe.sqe_cdw10 = NVME_CREATE_Q_CDW10(q->q_id, q->q_entries);
+		sqe.sqe_cdw11 = NVME_CREATE_CQ_CDW11_PC | NVME_CREATE_CQ_CDW11_IEN | NVME_CREATE_CQ_CDW11_IV(q->q_vector);
+		err = ExecuteAdmin(sqe, NULL);
+		ANANAS_ERROR_RETURN(err);
+
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.sqe_cdw0 = NVME_SQE_CDW0_OPC(NVME_ADMIN_CREATE_SQ);
+		sqe.sqe_prp1 = dma_buf_get_segment(q->q_dmabuf_sq, 0)->s_phys;
+		sqe.sqe_cdw10 = NVME_CREATE_Q_CDW10(q->q_id, q->q_entries);
+		sqe.sqe_cdw11 = NVME_CREATE_SQ_CDW11_PC | NVME_CREATE_SQ_CDW11_CQID(q->q_id);
+		err = ExecuteAdmin(sqe, NULL);
+		ANANAS_ERROR_RETURN(err);
+
+		nv_io_queue[n] = q;
+		nv_num_io_queues = n + 1;
+	}
+	return ananas_success();
+}
+
+errorcode_t
+NVMeDevice::Attach()
+{
+	void* res_mem = d_ResourceSet.AllocateResource(Ananas::Resource::RT_Memory, NVME_REG_SIZE);
+	void* res_irq = d_ResourceSet.AllocateResource(Ananas::Resource::RT_IRQ, 0);
+	if (res_mem == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	nv_addr = (addr_t)res_mem;
+	nv_num_vectors = 0;
+	nv_num_io_queues = 0;
+
+	/* Enable busmastering; all communication is done by DMA */
+	pci_enable_busmaster(*this, 1);
+
+	/* We need the NVM command set and must be able to use our own page size */
+	nv_cap = Read64(NVME_REG_CAP);
+	nv_dstrd = NVME_CAP_DSTRD(nv_cap);
+	nv_timeout = (NVME_CAP_TO(nv_cap) + 1) * 500;
+	if ((nv_cap & NVME_CAP_CSS_NVM) == 0 || NVME_CAP_MPSMIN(nv_cap) > 0 /* 4KB */) {
+		Printf("unsupported controller (cap %x:%x)", (uint32_t)(nv_cap >> 32), (uint32_t)nv_cap);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	nv_queue_entries = NVME_CAP_MQES(nv_cap) + 1;
+	if (nv_queue_entries > NVME_QUEUE_ENTRIES)
+		nv_queue_entries = NVME_QUEUE_ENTRIES;
+
+	errorcode_t err = dma_tag_create(d_Parent->d_DMA_tag, *this, &d_DMA_tag, 1, 0, DMA_ADDR_MAX_ANY, DMA_SEGS_MAX_ANY, DMA_SEGS_MAX_SIZE);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Disable the controller so that we can program the admin queues */
+	Write(NVME_REG_CC, 0);
+	err = WaitReady(false);
+	ANANAS_ERROR_RETURN(err);
+
+	err = SetupQueue(nv_admin_queue, 0, nv_queue_entries);
+	ANANAS_ERROR_RETURN(err);
+	Write(NVME_REG_AQA, NVME_AQA_ACQS(nv_queue_entries - 1) | NVME_AQA_ASQS(nv_queue_entries - 1));
+	Write64(NVME_REG_ASQ, dma_buf_get_segment(nv_admin_queue.q_dmabuf_sq, 0)->s_phys);
+	Write64(NVME_REG_ACQ, dma_buf_get_segment(nv_admin_queue.q_dmabuf_cq, 0)->s_phys);
+
+	Write(NVME_REG_CC, NVME_CC_IOCQES(NVME_CQE_SIZE_LOG2) | NVME_CC_IOSQES(NVME_SQE_SIZE_LOG2) |
+	 NVME_CC_MPS(0) | NVME_CC_AMS_RR | NVME_CC_CSS_NVM | NVME_CC_EN);
+	err = WaitReady(true);
+	ANANAS_ERROR_RETURN(err);
+
+	/* One I/O queue pair per CPU, as far as our doorbell mapping can hold them */
+	unsigned int num_queues = pcpu_get_count();
+	unsigned int max_queues = (NVME_REG_SIZE - NVME_REG_DOORBELL) / (2 * (4 << nv_dstrd)) - 1;
+	if (num_queues > max_queues)
+		num_queues = max_queues;
+	if (num_queues > NVME_MAX_IO_QUEUES)
+		num_queues = NVME_MAX_IO_QUEUES;
+	if (num_queues == 0) {
+		Printf("doorbell stride %u too large", nv_dstrd);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	err = SetupIRQ(res_irq, num_queues);
+	ANANAS_ERROR_RETURN(err);
+
+	auto ic = new NVME_IDENTIFY_CONTROLLER;
+	err = Identify(0, NVME_IDENTIFY_CNS_CONTROLLER, ic);
+	if (ananas_is_failure(err)) {
+		delete ic;
+		return err;
+	}
+
+	/* The first PRP entry may start anywhere in a page; the others can't */
+	nv_max_transfer = (NVME_MAX_PRPS - 1) * PAGE_SIZE;
+	if (ic->ic_mdts != 0 && (PAGE_SIZE << ic->ic_mdts) < nv_max_transfer)
+		nv_max_transfer = PAGE_SIZE << ic->ic_mdts;
+	uint32_t num_namespaces = ic->ic_nn;
+	if (num_namespaces > NVME_MAX_NAMESPACES)
+		num_namespaces = NVME_MAX_NAMESPACES;
+
+	char model[sizeof(ic->ic_mn) + 1];
+	memcpy(model, ic->ic_mn, sizeof(ic->ic_mn));
+	int n = sizeof(ic->ic_mn);
+	while (n > 0 && (model[n - 1] == ' ' || model[n - 1] == '\0'))
+		n--;
+	model[n] = '\0';
+	delete ic;
+
+	err = CreateIOQueues(num_queues);
+	if (ananas_is_success(err) && nv_num_io_queues == 0)
+		err = ANANAS_ERROR(NO_DEVICE);
+	ANANAS_ERROR_RETURN(err);
+
+	uint32_t vs = Read(NVME_REG_VS);
+	Printf("<%s> NVMe %u.%u, %u I/O queues, %u %s vectors", model, NVME_VS_MJR(vs), NVME_VS_MNR(vs),
+	 nv_num_io_queues, nv_num_vectors, !nv_msi_enabled ? "legacy" : (nv_msi.msi_flags & PCI_MSI_FLAG_MSIX) ? "MSI-X" : "MSI");
+
+	/* Attach a disk for every namespace; inactive ones will fail to attach */
+	for (uint32_t nsid = 1; nsid <= num_namespaces; nsid++) {
+		Ananas::ResourceSet resourceSet;
+		resourceSet.AddResource(Ananas::Resource(Ananas::Resource::RT_ChildNum, nsid, 0));
+		Ananas::Device* disk = Ananas::DeviceManager::CreateDevice("nvmedisk", Ananas::CreateDeviceProperties(*this, resourceSet));
+		if (disk != nullptr)
+			Ananas::DeviceManager::AttachSingle(*disk);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+NVMeDevice::Detach()
+{
+	/* Tell the controller we are going away, so that it can flush its caches */
+	Write(NVME_REG_CC, Read(NVME_REG_CC) | NVME_CC_SHN_NORMAL);
+	return ananas_success();
+}
+
+} // namespace NVMe
+} // namespace Ananas
+
+namespace {
+
+struct NVMe_Driver : public Ananas::Driver
+{
+	NVMe_Driver()
+	 : Driver("nvme")
+	{
+	}
+
+	const char* GetBussesToProbeOn() const override
+	{
+		return "pcibus";
+	}
+
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_ClassRev, PCI_CLASSREV(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM, PCI_PROGINT_NVME, 0), 0xffffff00 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	bool CanAttachAsynchronously() const override
+	{
+		return true;
+	}
+
+	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
+	{
+		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_ClassRev, 0);
+		if (res == NULL)
+			return nullptr;
+		uint32_t classrev = res->r_Base;
+
+		if (PCI_CLASS(classrev) == PCI_CLASS_STORAGE && PCI_SUBCLASS(classrev) == PCI_SUBCLASS_NVM &&
+				PCI_PROGINT(classrev) == PCI_PROGINT_NVME)
+			return new Ananas::NVMe::NVMeDevice(cdp);
+		return nullptr;
+	}
+};
+
+} // unnamed namespace
+
+REGISTER_DRIVER(NVMe_Driver)
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,150 @@
+#ifndef __ANANAS_NVME_H__
+#define __ANANAS_NVME_H__
+
+#include <ananas/bus/pci.h>
+#include <ananas/device.h>
+#include <ananas/dma.h>
+#include <ananas/irq.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+#include "nvme-reg.h"
+
+struct BIO;
+
+namespace Ananas {
+namespace NVMe {
+
+/* Number of entries of every queue; a submission queue fills a single page */
+#define NVME_QUEUE_ENTRIES	64
+
+/*
+ * Number of PRP entries a command may use: one in the command itself and a
+ * list of the remaining ones, which never crosses a page.
+ */
+#define NVME_PRP_LIST_ENTRIES	32
+#define NVME_MAX_PRPS		(1 + NVME_PRP_LIST_ENTRIES)
+
+/* We want a queue pair per CPU, next to the admin queues */
+#define NVME_MAX_IO_QUEUES	PCPU_MAX_CPUS
+
+#define NVME_CID_NONE		0xffff
+
+/*
+ * A command in flight. A request (a chain of bio's) may need more than one
+ * command; its first command (the head) keeps track of the request and holds
+ * on to its slot until every command of the request is done, so that the
+ * bio's can be completed in order.
+ */
+struct Command {
+	struct BIO*	c_bio;		/* head: first bio of the request */
+	semaphore_t*	c_semaphore;	/* admin, flush: signalled on completion */
+	struct NVME_CQE* c_result;	/* admin, flush: receives the completion */
+	uint16_t	c_head;		/* cid of the head command */
+	unsigned int	c_pending;	/* head: commands not yet done, plus one while submitting */
+	bool		c_error;	/* head: any command failed */
+};
+
+/* A submission/completion queue pair */
+struct Queue {
+	unsigned int	q_id;
+	unsigned int	q_vector;	/* index of the interrupt vector */
+	unsigned int	q_entries;
+	spinlock_t	q_lock;		/* protects the fields below */
+	semaphore_t	q_slot_sem;	/* free command identifiers */
+	dma_buf_t	q_dmabuf_sq;
+	dma_buf_t	q_dmabuf_cq;
+	dma_buf_t	q_dmabuf_prp;
+	volatile struct NVME_SQE* q_sq;
+	volatile struct NVME_CQE* q_cq;
+	uint64_t*	q_prp;		/* PRP lists, NVME_PRP_LIST_ENTRIES per command */
+	dma_addr_t	q_prp_phys;
+	unsigned int	q_sq_tail;
+	unsigned int	q_cq_head;
+	unsigned int	q_phase;	/* phase tag of new completions */
+	uint64_t	q_cid_in_use;
+	struct Command	q_cmd[NVME_QUEUE_ENTRIES];
+};
+
+class NVMeDevice : public Ananas::Device, private Ananas::IDeviceOperations
+{
+public:
+	using Device::Device;
+	virtual ~NVMeDevice() = default;
+
+	IDeviceOperations& GetDeviceOperations() override
+	{
+		return *this;
+	}
+
+	errorcode_t Attach() override;
+	errorcode_t Detach() override;
+
+	/* Reads or writes the chain of bio's starting at bio; lba_shift is log2 of the namespace's block size */
+	void SubmitIO(uint32_t nsid, unsigned int lba_shift, struct BIO& bio, bool write);
+	/* Commits everything written to the namespace to stable storage */
+	errorcode_t Flush(uint32_t nsid);
+	errorcode_t Identify(uint32_t nsid, unsigned int cns, void* buffer);
+	unsigned int GetMaxRequests() const;
+
+protected:
+	inline void Write(unsigned int reg, uint32_t val)
+	{
+		*(volatile uint32_t*)(nv_addr + reg) = val;
+	}
+
+	inline uint32_t Read(unsigned int reg)
+	{
+		return *(volatile uint32_t*)(nv_addr + reg);
+	}
+
+	inline void Write64(unsigned int reg, uint64_t val)
+	{
+		Write(reg, val & 0xffffffff);
+		Write(reg + 4, val >> 32);
+	}
+
+	inline uint64_t Read64(unsigned int reg)
+	{
+		return (uint64_t)Read(reg + 4) << 32 | Read(reg);
+	}
+
+	void OnIRQ(unsigned int vector);
+
+	static irqresult_t IRQWrapper(Ananas::Device* device, void* context)
+	{
+		auto nvme = static_cast<NVMeDevice*>(device);
+		nvme->OnIRQ((unsigned int)(uintptr_t)context);
+		return IRQ_RESULT_PROCESSED;
+	}
+
+private:
+	errorcode_t WaitReady(bool ready);
+	errorcode_t SetupIRQ(void* res_irq, unsigned int num_queues);
+	errorcode_t SetupQueue(Queue& q, unsigned int id, unsigned int entries);
+	errorcode_t CreateIOQueues(unsigned int num_queues);
+	errorcode_t Execute(Queue& q, struct NVME_SQE& sqe, struct NVME_CQE* result);
+	errorcode_t ExecuteAdmin(struct NVME_SQE& sqe, struct NVME_CQE* result);
+	uint16_t AllocateCommand(Queue& q);
+	void Post(Queue& q, struct NVME_SQE& sqe, uint16_t cid);
+	void ProcessCompletions(Queue& q);
+	void CompleteRequest(Queue& q, uint16_t head);
+	void FreeCommand(Queue& q, uint16_t cid);
+
+	addr_t nv_addr;
+	uint64_t nv_cap;
+	unsigned int nv_dstrd;
+	unsigned int nv_timeout;	/* in ms */
+	uint32_t nv_max_transfer;	/* in bytes */
+	unsigned int nv_num_vectors;
+	struct PCI_MSI nv_msi;
+	bool nv_msi_enabled;
+	Queue nv_admin_queue;
+	unsigned int nv_num_io_queues;
+	unsigned int nv_queue_entries;
+	Queue* nv_io_queue[NVME_MAX_IO_QUEUES];
+};
+
+} // namespace NVMe
+} // namespace Ananas
+
+#endif /* __ANANAS_NVME_H__ */
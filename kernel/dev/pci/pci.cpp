@@ -3,9 +3,14 @@
 #include <ananas/device.h>
 #include <ananas/driver.h>
 #include <ananas/error.h>
+#include <ananas/kmem.h>
 #include <ananas/lib.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
 #include <machine/pcihb.h>
 
+TRACE_SETUP;
+
 namespace {
 
 class PCI : public Ananas::Device, private Ananas::IDeviceOperations
@@ -110,4 +115,220 @@ pci_enable_busmaster(Ananas::Device& device, bool on)
 	pci_write_cfg(device, PCI_REG_STATUSCOMMAND, cmd, 32);
 }
 
+/*
+ * Returns the offset of the capability with the given ID, or 0 if the device
+ * doesn't have it. If after is set, the search continues after that
+ * capability; devices may have several with the same ID.
+ */
+unsigned int
+pci_find_capability(Ananas::Device& device, unsigned int id, unsigned int after)
+{
+	if ((pci_read_cfg(device, PCI_REG_STATUSCOMMAND, 32) & PCI_STAT_CL) == 0)
+		return 0;
+
+	/* Don't trust the list too much; there can't be more than 48 capabilities */
+	unsigned int cap;
+	if (after != 0)
+		cap = PCI_CAP_NEXT(pci_read_cfg(device, after, 32));
+	else
+		cap = pci_read_cfg(device, PCI_REG_CAPABILITIES, 32) & 0xfc;
+	for (unsigned int n = 0; cap != 0 && n < 48; n++) {
+		uint32_t hdr = pci_read_cfg(device, cap, 32);
+		if (PCI_CAP_ID(hdr) == id)
+			return cap;
+		cap = PCI_CAP_NEXT(hdr);
+	}
+	return 0;
+}
+
+/*
+ * Maps length bytes at offset within memory BAR bar (0-5); returns NULL if
+ * the BAR isn't in memory space or is unassigned.
+ */
+void*
+pci_map_bar(Ananas::Device& device, unsigned int bar, uint64_t offset, size_t length)
+{
+	unsigned int bar_reg = PCI_REG_BAR0 + bar * 4;
+	if (bar_reg > PCI_REG_BAR5)
+		return NULL;
+
+	uint32_t val = pci_read_cfg(device, bar_reg, 32);
+	if (val & PCI_BAR_MMIO)
+		return NULL;
+	uint64_t addr = val & 0xfffffff0;
+	if ((val & 6) == 4 && bar_reg < PCI_REG_BAR5)
+		addr |= (uint64_t)pci_read_cfg(device, bar_reg + 4, 32) << 32; /* 64-bit BAR */
+	if (addr == 0)
+		return NULL;
+	return kmem_map(addr + offset, length, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
+}
+
+namespace {
+
+/* Maps the MSI-X table, which lives in one of the device's memory BARs */
+errorcode_t
+pci_msix_map_table(Ananas::Device& device, struct PCI_MSI& msi, unsigned int num_entries)
+{
+	uint32_t table = pci_read_cfg(device, msi.msi_cap + PCI_MSIX_REG_TABLE, 32);
+	msi.msi_table = static_cast<volatile uint32_t*>(pci_map_bar(device, PCI_MSIX_BIR(table), PCI_MSIX_OFFSET(table), num_entries * PCI_MSIX_ENTRY_SIZE));
+	if (msi.msi_table == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	return ananas_success();
+}
+
+inline volatile uint32_t*
+pci_msix_entry(struct PCI_MSI& msi, unsigned int index, unsigned int reg)
+{
+	return msi.msi_table + (index * PCI_MSIX_ENTRY_SIZE + reg) / sizeof(uint32_t);
+}
+
+errorcode_t
+pci_msix_alloc(Ananas::Device& device, struct PCI_MSI& msi, unsigned int num)
+{
+	uint32_t ctrl = pci_read_cfg(device, msi.msi_cap, 32);
+	unsigned int table_size = PCI_MSIX_CTRL_SIZE(ctrl);
+	if (num > table_size)
+		num = table_size;
+
+	errorcode_t err = pci_msix_map_table(device, msi, table_size);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Every entry gets a vector of its own; they needn't be related */
+	for (msi.msi_count = 0; msi.msi_count < num; msi.msi_count++) {
+		if (ananas_is_failure(irq_alloc(1, &msi.msi_irq[msi.msi_count])))
+			break;
+		*pci_msix_entry(msi, msi.msi_count, PCI_MSIX_ENTRY_CTRL) |= PCI_MSIX_ENTRY_MASKED;
+	}
+	if (msi.msi_count == 0) {
+		kmem_unmap(const_cast<uint32_t*>(msi.msi_table), table_size * PCI_MSIX_ENTRY_SIZE);
+		return ANANAS_ERROR(NO_RESOURCE);
+	}
+
+	/* Enable MSI-X; the entries remain masked until they are registered */
+	pci_write_cfg(device, msi.msi_cap, (ctrl & ~PCI_MSIX_CTRL_FM) | PCI_MSIX_CTRL_EN, 32);
+	return ananas_success();
+}
+
+errorcode_t
+pci_msi_alloc_msi(Ananas::Device& device, struct PCI_MSI& msi, unsigned int num)
+{
+	/* The vectors must be a contiguous, aligned power-of-two block */
+	uint32_t ctrl = pci_read_cfg(device, msi.msi_cap, 32);
+	unsigned int log2 = 0;
+	while (log2 < PCI_MSI_CTRL_MMC(ctrl) && (1U << log2) < num)
+		log2++;
+
+	unsigned int first;
+	while (ananas_is_failure(irq_alloc(1 << log2, &first))) {
+		if (log2 == 0)
+			return ANANAS_ERROR(NO_RESOURCE);
+		log2--;
+	}
+
+	msi.msi_count = 1 << log2;
+	for (unsigned int n = 0; n < msi.msi_count; n++)
+		msi.msi_irq[n] = first + n;
+
+	/* Only enable the vectors once the first handler is registered */
+	ctrl = (ctrl & ~(PCI_MSI_CTRL_EN | PCI_MSI_CTRL_MME_MASK)) | PCI_MSI_CTRL_MME(log2);
+	pci_write_cfg(device, msi.msi_cap, ctrl, 32);
+	return ananas_success();
+}
+
+inline void
+pci_disable_intx(Ananas::Device& device, bool on)
+{
+	uint32_t cmd = pci_read_cfg(device, PCI_REG_STATUSCOMMAND, 32);
+	if (on)
+		cmd |= PCI_CMD_ID;
+	else
+		cmd &= ~PCI_CMD_ID;
+	pci_write_cfg(device, PCI_REG_STATUSCOMMAND, cmd, 32);
+}
+
+} // unnamed namespace
+
+errorcode_t
+pci_msi_alloc(Ananas::Device& device, struct PCI_MSI& msi, unsigned int* num)
+{
+	memset(&msi, 0, sizeof(msi));
+	unsigned int want = *num;
+	if (want == 0)
+		return ANANAS_ERROR(BAD_RANGE);
+	if (want > PCI_MSI_MAX_VECTORS)
+		want = PCI_MSI_MAX_VECTORS;
+
+	errorcode_t err = ANANAS_ERROR(NO_RESOURCE);
+	msi.msi_cap = pci_find_capability(device, PCI_CAP_ID_MSIX);
+	if (msi.msi_cap != 0) {
+		msi.msi_flags = PCI_MSI_FLAG_MSIX;
+		err = pci_msix_alloc(device, msi, want);
+	}
+	if (ananas_is_failure(err)) {
+		msi.msi_flags = 0;
+		msi.msi_cap = pci_find_capability(device, PCI_CAP_ID_MSI);
+		if (msi.msi_cap == 0)
+			return ANANAS_ERROR(NO_DEVICE);
+		err = pci_msi_alloc_msi(device, msi, want);
+	}
+	ANANAS_ERROR_RETURN(err);
+
+	*num = (msi.msi_count < want) ? msi.msi_count : want;
+	return ananas_success();
+}
+
+errorcode_t
+pci_msi_register(Ananas::Device& device, struct PCI_MSI& msi, unsigned int index, int cpu, irqfunc_t func, int type, void* context)
+{
+	if (index >= msi.msi_count)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/* With plain MSI, the device sets the lower bits of the data to the vector it raises */
+	unsigned int irq = (msi.msi_flags & PCI_MSI_FLAG_MSIX) ? msi.msi_irq[index] : msi.msi_irq[0];
+	uint64_t addr;
+	uint32_t data;
+	errorcode_t err = pcihb_msi_message(irq, cpu, &addr, &data);
+	ANANAS_ERROR_RETURN(err);
+	err = irq_register_cpu(msi.msi_irq[index], &device, func, type, context, cpu);
+	ANANAS_ERROR_RETURN(err);
+
+	if (msi.msi_flags & PCI_MSI_FLAG_MSIX) {
+		*pci_msix_entry(msi, index, PCI_MSIX_ENTRY_ADDR) = addr & 0xffffffff;
+		*pci_msix_entry(msi, index, PCI_MSIX_ENTRY_ADDR_HI) = addr >> 32;
+		*pci_msix_entry(msi, index, PCI_MSIX_ENTRY_DATA) = data;
+		*pci_msix_entry(msi, index, PCI_MSIX_ENTRY_CTRL) &= ~PCI_MSIX_ENTRY_MASKED;
+	} else {
+		uint32_t ctrl = pci_read_cfg(device, msi.msi_cap, 32);
+		pci_write_cfg(device, msi.msi_cap + PCI_MSI_REG_ADDR, addr & 0xffffffff, 32);
+		if (ctrl & PCI_MSI_CTRL_64) {
+			pci_write_cfg(device, msi.msi_cap + PCI_MSI_REG_ADDR_HI, addr >> 32, 32);
+			pci_write_cfg(device, msi.msi_cap + PCI_MSI_REG_DATA_64, data, 32);
+		} else {
+			pci_write_cfg(device, msi.msi_cap + PCI_MSI_REG_DATA_32, data, 32);
+		}
+		pci_write_cfg(device, msi.msi_cap, ctrl | PCI_MSI_CTRL_EN, 32);
+	}
+
+	/* Messages replace the interrupt line */
+	pci_disable_intx(device, true);
+	return ananas_success();
+}
+
+void
+pci_msi_free(Ananas::Device& device, struct PCI_MSI& msi)
+{
+	uint32_t ctrl = pci_read_cfg(device, msi.msi_cap, 32);
+	if (msi.msi_flags & PCI_MSI_FLAG_MSIX) {
+		pci_write_cfg(device, msi.msi_cap, ctrl & ~PCI_MSIX_CTRL_EN, 32);
+		for (unsigned int n = 0; n < msi.msi_count; n++)
+			irq_free(msi.msi_irq[n], 1);
+		kmem_unmap(const_cast<uint32_t*>(msi.msi_table), PCI_MSIX_CTRL_SIZE(ctrl) * PCI_MSIX_ENTRY_SIZE);
+	} else {
+		pci_write_cfg(device, msi.msi_cap, ctrl & ~PCI_MSI_CTRL_EN, 32);
+		irq_free(msi.msi_irq[0], msi.msi_count);
+	}
+	pci_disable_intx(device, false);
+	msi.msi_count = 0;
+}
+
 /* vim:set ts=2 sw=2: */
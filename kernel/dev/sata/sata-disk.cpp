@@ -38,8 +38,11 @@ public:
 
 	errorcode_t ReadBIO(struct BIO& bio) override;
 	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
+	unsigned int GetMaxBIOsPerRequest() override;
 
 	void Execute(struct SATA_REQUEST& sr);
+	void MakeRequest(struct SATA_REQUEST& sr, struct BIO& bio, bool write);
 
 
 private:
@@ -47,6 +50,8 @@ private:
 	uint64_t sd_size;	/* in sectors */
 	uint32_t sd_flags;
 #define SATADISK_FLAGS_LBA48 1
+#define SATADISK_FLAGS_NCQ 2
+	unsigned int sd_queue_depth;	/* Native queued commands the disk takes */
 };
 
 void
@@ -98,6 +103,13 @@ SATADisk::Attach()
 		sd_flags |= SATADISK_FLAGS_LBA48;
 	}
 
+	/* Use native command queueing if both the disk and controller can */
+	auto port = static_cast<Ananas::AHCI::Port*>(d_Parent); // XXX see Execute()
+	if ((ATA_GET_WORD(sd_identify.sata_capabilities) & ATA_SATACAP_NCQ) && port->SupportsNCQ()) {
+		sd_flags |= SATADISK_FLAGS_NCQ;
+		sd_queue_depth = (ATA_GET_WORD(sd_identify.queue_depth) & 0x1f) + 1;
+	}
+
 	/* Terminate the model name */
 	for(int n = sizeof(sd_identify.model) - 1; n > 0 && sd_identify.model[n] == ' '; n--)
 		sd_identify.model[n] = '\0';
@@ -105,6 +117,8 @@ SATADisk::Attach()
 	Printf("<%s> - %u MB",
 	 sd_identify.model,
  	 sd_size / ((1024UL * 1024UL) / 512UL));
+	if (sd_flags & SATADISK_FLAGS_NCQ)
+		Printf("using NCQ, queue depth %u", sd_queue_depth);
 
 	/*
 	 * Read the first sector and pass it to the MBR code; this is crude
@@ -125,20 +139,43 @@ SATADisk::Detach()
 	return ananas_success();
 }
 
-errorcode_t
-SATADisk::ReadBIO(struct BIO& bio)
+/* Returns the total length of the request starting at bio, in bytes */
+static uint32_t
+sata_request_length(struct BIO& bio)
 {
-	KASSERT(bio.length > 0, "invalid length");
-	KASSERT(bio.length % 512 == 0, "invalid length"); /* XXX */
+	uint32_t len = 0;
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next) {
+		KASSERT(b->length > 0, "invalid length");
+		KASSERT(b->length % BIO_SECTOR_SIZE == 0, "invalid length"); /* XXX */
+		len += b->length;
+	}
+	return len;
+}
 
-	struct SATA_REQUEST sr;
+/* Sets up a read or write request for the chain of bio's starting at bio */
+void
+SATADisk::MakeRequest(struct SATA_REQUEST& sr, struct BIO& bio, bool write)
+{
 	memset(&sr, 0, sizeof(sr));
-	/* XXX  we shouldn't always use lba-48 */
-	sata_fis_h2d_make_cmd_lba48(&sr.sr_fis.fis_h2d, ATA_CMD_DMA_READ_EXT, bio.io_block, bio.length / BIO_SECTOR_SIZE);
+	uint32_t len = sata_request_length(bio);
+	if (sd_flags & SATADISK_FLAGS_NCQ) {
+		sata_fis_h2d_make_cmd_fpdma(&sr.sr_fis.fis_h2d, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED, bio.io_block, len / BIO_SECTOR_SIZE);
+		sr.sr_flags = SATA_REQUEST_FLAG_NCQ;
+	} else {
+		/* XXX  we shouldn't always use lba-48 */
+		sata_fis_h2d_make_cmd_lba48(&sr.sr_fis.fis_h2d, write ? ATA_CMD_DMA_WRITE_EXT : ATA_CMD_DMA_READ_EXT, bio.io_block, len / BIO_SECTOR_SIZE);
+	}
 	sr.sr_fis_length = 20;
-	sr.sr_count = bio.length;
+	sr.sr_count = len;
 	sr.sr_bio = &bio;
-	sr.sr_flags = SATA_REQUEST_FLAG_READ;
+	sr.sr_flags |= write ? SATA_REQUEST_FLAG_WRITE : SATA_REQUEST_FLAG_READ;
+}
+
+errorcode_t
+SATADisk::ReadBIO(struct BIO& bio)
+{
+	struct SATA_REQUEST sr;
+	MakeRequest(sr, bio, false);
 	Execute(sr);
 	return ananas_success();
 }
@@ -147,17 +184,28 @@ errorcode_t
 SATADisk::WriteBIO(struct BIO& bio)
 {
 	struct SATA_REQUEST sr;
-	memset(&sr, 0, sizeof(sr));
-	/* XXX  we shouldn't always use lba-48 */
-	sata_fis_h2d_make_cmd_lba48(&sr.sr_fis.fis_h2d, ATA_CMD_DMA_WRITE_EXT, bio.io_block, bio.length / BIO_SECTOR_SIZE);
-	sr.sr_fis_length = 20;
-	sr.sr_count = bio.length;
-	sr.sr_bio = &bio;
-	sr.sr_flags = SATA_REQUEST_FLAG_WRITE;
+	MakeRequest(sr, bio, true);
 	Execute(sr);
 	return ananas_success();
 }
 
+unsigned int
+SATADisk::GetMaxBIORequests()
+{
+	// XXX this is a hack, see Execute()
+	auto p = static_cast<Ananas::AHCI::Port*>(d_Parent);
+	unsigned int num_slots = p->GetNumberOfSlots();
+	if ((sd_flags & SATADISK_FLAGS_NCQ) && sd_queue_depth < num_slots)
+		return sd_queue_depth;
+	return num_slots;
+}
+
+unsigned int
+SATADisk::GetMaxBIOsPerRequest()
+{
+	return SATA_REQUEST_MAX_BIOS;
+}
+
 struct SATADisk_Driver : public Ananas::Driver
 {
 	SATADisk_Driver()
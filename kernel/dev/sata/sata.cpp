@@ -27,4 +27,17 @@ sata_fis_h2d_make_cmd_lba48(struct SATA_FIS_H2D* h2d, uint8_t cmd, uint64_t lba,
 	h2d->h2d_dw2_cyl_hi_exp = (lba >> 40) & 0xff;
 }
 
+/*
+ * Native queued commands carry the sector count in the feature fields, as the
+ * count field holds the tag; this is filled out once a slot is assigned.
+ */
+void
+sata_fis_h2d_make_cmd_fpdma(struct SATA_FIS_H2D* h2d, uint8_t cmd, uint64_t lba, uint32_t count)
+{
+	sata_fis_h2d_make_cmd_lba48(h2d, cmd, lba, 0);
+	h2d->h2d_dw0_feat = count & 0xff;
+	h2d->h2d_dw2_feat = (count >> 8) & 0xff;
+	h2d->h2d_dw1_dev_head = (1 << 6); /* LBA addr */
+}
+
 /* vim:set ts=2 sw=2: */
@@ -6,6 +6,7 @@
 #include <ananas/error.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/mm.h>
 #include <mbr.h>
 #include "scsi.h"
@@ -52,6 +53,9 @@ DumpSenseData(const struct SCSI_FIXED_SENSE_DATA& sd)
 	 sd.sd_field_replace_code);
 }
 
+/* Requests we keep outstanding at most, if the transport takes that many */
+#define SCSIDISK_MAX_REQUESTS	4
+
 class SCSIDisk : public Ananas::Device, private Ananas::IDeviceOperations, private Ananas::IBIODeviceOperations
 {
 public:
@@ -68,32 +72,123 @@ public:
 		return this;
 	}
 
-	errorcode_t HandleRequest(int lun, Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len);
-
 	errorcode_t Attach() override;
 	errorcode_t Detach() override;
 
 	errorcode_t ReadBIO(struct BIO& bio) override;
 	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
+	unsigned int GetMaxBIOsPerRequest() override;
+
+private:
+	/* A read or write in flight */
+	struct Request {
+		Ananas::SCSIRequest r_scsi;
+		SCSIDisk* r_disk = nullptr;
+		struct BIO* r_bio = nullptr;	/* chain being transferred; nullptr if free */
+		bool r_write = false;
+		void* r_buffer = nullptr;	/* gathers requests of more than one bio */
+	};
+
+	Ananas::ISCSIDeviceOperations& GetTransport()
+	{
+		return *d_Parent->GetSCSIDeviceOperations();
+	}
+
+	errorcode_t HandleRequest(Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len);
+	errorcode_t ReadCapacity(uint32_t& block_len);
+	size_t BuildTransferCommand(uint8_t* cdb, bool write, blocknr_t lba, uint32_t num_blocks);
+	errorcode_t Transfer(struct BIO& bio, bool write);
+	void CompleteTransfer(Request& req);
+	static void OnTransferDone(Ananas::SCSIRequest& sr);
+
+	int sd_lun = 0;
+	uint64_t sd_num_blocks = 0;
+	unsigned int sd_max_transfer = 0;	/* in bytes */
+	semaphore_t sd_sync_sem;	/* signalled when a synchronous request is done */
+
+	spinlock_t sd_lock;	/* protects r_bio of sd_request[] */
+	unsigned int sd_num_requests = 0;
+	Request sd_request[SCSIDISK_MAX_REQUESTS];
 };
 
+/* Performs a request and waits for it; only used while attaching */
+errorcode_t
+SCSIDisk::HandleRequest(Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len)
+{
+	KASSERT(cb_len <= sizeof(Ananas::SCSIRequest::sr_cdb), "command too long");
+	Ananas::SCSIRequest sr;
+	sr.sr_lun = sd_lun;
+	sr.sr_dir = dir;
+	memcpy(sr.sr_cdb, cb, cb_len);
+	sr.sr_cdb_len = cb_len;
+	sr.sr_data = result;
+	sr.sr_data_len = (result_len != nullptr) ? *result_len : 0;
+	sr.sr_callback = [](Ananas::SCSIRequest& sr) {
+		sem_signal(static_cast<semaphore_t*>(sr.sr_context));
+	};
+	sr.sr_context = &sd_sync_sem;
+	errorcode_t err = GetTransport().QueueSCSIRequest(sr);
+	ANANAS_ERROR_RETURN(err);
+
+	sem_wait(&sd_sync_sem);
+	if (result_len != nullptr)
+		*result_len = sr.sr_data_done;
+	return sr.sr_result;
+}
+
+/*
+ * Fetches the size of the disk; READ CAPACITY (10) cannot describe more than
+ * 2^32 blocks, in which case we have to ask again using the 16-byte variant.
+ */
 errorcode_t
-SCSIDisk::HandleRequest(int lun, Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len)
+SCSIDisk::ReadCapacity(uint32_t& block_len)
 {
-	return d_Parent->GetSCSIDeviceOperations()->PerformSCSIRequest(lun, dir, cb, cb_len, result, result_len);
+	struct SCSI_READ_CAPACITY_10_CMD cap_cmd;
+	memset(&cap_cmd, 0, sizeof cap_cmd);
+	cap_cmd.c_code = SCSI_CMD_READ_CAPACITY_10;
+	struct SCSI_READ_CAPACITY_10_REPLY cap_reply;
+	size_t reply_len = sizeof(cap_reply);
+	errorcode_t err = HandleRequest(Direction::D_In, &cap_cmd, sizeof(cap_cmd), &cap_reply, &reply_len);
+	ANANAS_ERROR_RETURN(err);
+	block_len = betoh32(cap_reply.r_block_length);
+	if (betoh32(cap_reply.r_lba) != 0xffffffff) {
+		sd_num_blocks = (uint64_t)betoh32(cap_reply.r_lba) + 1;
+		return ananas_success();
+	}
+
+	struct SCSI_READ_CAPACITY_16_CMD cap16_cmd;
+	memset(&cap16_cmd, 0, sizeof cap16_cmd);
+	cap16_cmd.c_code = SCSI_CMD_SERVICE_ACTION_IN_16;
+	cap16_cmd.c_service_action = SCSI_SA_READ_CAPACITY_16;
+	cap16_cmd.c_alloc_len = htobe32(sizeof(struct SCSI_READ_CAPACITY_16_REPLY));
+	struct SCSI_READ_CAPACITY_16_REPLY cap16_reply;
+	reply_len = sizeof(cap16_reply);
+	err = HandleRequest(Direction::D_In, &cap16_cmd, sizeof(cap16_cmd), &cap16_reply, &reply_len);
+	ANANAS_ERROR_RETURN(err);
+	block_len = betoh32(cap16_reply.r_block_length);
+	sd_num_blocks = betoh64(cap16_reply.r_lba) + 1;
+	return ananas_success();
 }
 
 errorcode_t
 SCSIDisk::Attach()
 {
+	auto res = d_ResourceSet.GetResource(Ananas::Resource::RT_ChildNum, 0);
+	if (res != nullptr)
+		sd_lun = res->r_Base;
+	sem_init(&sd_sync_sem, 0);
+	spinlock_init(&sd_lock);
+
 	/* Do a SCSI INQUIRY command; we only use the vendor/product ID for now */
 	struct SCSI_INQUIRY_6_REPLY inq_reply;
 	struct SCSI_INQUIRY_6_CMD inq_cmd;
 	memset(&inq_cmd, 0, sizeof inq_cmd);
 	inq_cmd.c_code = SCSI_CMD_INQUIRY_6;
+	inq_cmd.c_alloc_len = htobe16(sizeof(inq_reply));
 
 	size_t reply_len = sizeof(inq_reply);
-	errorcode_t err = HandleRequest(0, Direction::D_In, &inq_cmd, sizeof(inq_cmd), &inq_reply, &reply_len);
+	errorcode_t err = HandleRequest(Direction::D_In, &inq_cmd, sizeof(inq_cmd), &inq_reply, &reply_len);
 	ANANAS_ERROR_RETURN(err);
 
 	/*
@@ -104,15 +199,16 @@ SCSIDisk::Attach()
 	struct SCSI_TEST_UNIT_READY_CMD tur_cmd;
 	memset(&tur_cmd, 0, sizeof tur_cmd);
 	tur_cmd.c_code = SCSI_CMD_TEST_UNIT_READY;
-	err = HandleRequest(0, Direction::D_In, &tur_cmd, sizeof(tur_cmd), NULL, NULL);
+	err = HandleRequest(Direction::D_In, &tur_cmd, sizeof(tur_cmd), NULL, NULL);
 	if (ananas_is_failure(err)) {
 		/* This is expected; issue 'REQUEST SENSE' to reset the status */
 		struct SCSI_REQUEST_SENSE_CMD rs_cmd;
 		struct SCSI_FIXED_SENSE_DATA sd;
 		memset(&rs_cmd, 0, sizeof rs_cmd);
 		rs_cmd.c_code = SCSI_CMD_REQUEST_SENSE;
+		rs_cmd.c_alloc_len = sizeof(sd);
 		reply_len = sizeof(sd);
-		err = HandleRequest(0, Direction::D_In, &rs_cmd, sizeof(rs_cmd), &sd, &reply_len);
+		err = HandleRequest(Direction::D_In, &rs_cmd, sizeof(rs_cmd), &sd, &reply_len);
 		if (ananas_is_failure(err)) {
 			Printf("handle_req: err=%d len %d", err, reply_len);
 			DumpSenseData(sd);
@@ -120,22 +216,35 @@ SCSIDisk::Attach()
 	}
 
 	/* Now fetch the capacity */
-	struct SCSI_READ_CAPACITY_10_CMD cap_cmd;
-	memset(&cap_cmd, 0, sizeof cap_cmd);
-	cap_cmd.c_code = SCSI_CMD_READ_CAPACITY_10;
-	struct SCSI_READ_CAPACITY_10_REPLY cap_reply;
-	reply_len = sizeof(cap_reply);
-	err = HandleRequest(0, Direction::D_In, &cap_cmd, sizeof(cap_cmd), &cap_reply, &reply_len);
+	uint32_t block_len;
+	err = ReadCapacity(block_len);
 	ANANAS_ERROR_RETURN(err);
-	uint32_t num_lba = betoh32(cap_reply.r_lba);
-	uint32_t block_len = betoh32(cap_reply.r_block_length);
 
 	/* Now print some nice information */
 	char vid[9], pid[17];
 	copy_string(vid, sizeof(vid), inq_reply.r_vendor_id, sizeof(inq_reply.r_vendor_id));
 	copy_string(pid, sizeof(pid), inq_reply.r_product_id, sizeof(inq_reply.r_product_id));
-	Printf("vendor <%s> product <%s> size %d MB", vid, pid,
-	 num_lba / ((1024 * 1024) / block_len));
+	Printf("vendor <%s> product <%s> size %u MB", vid, pid,
+	 (unsigned int)(sd_num_blocks / ((1024 * 1024) / block_len)));
+
+	/*
+	 * Requests may chain as many bio's as fit in a single transfer; unless the
+	 * disk is large enough to need 16-byte commands, keep it within what
+	 * READ (10) and WRITE (10) can express.
+	 */
+	sd_max_transfer = GetTransport().GetMaxTransferLength();
+	if (sd_num_blocks <= (1ULL << 32) && sd_max_transfer > 0xffff * BIO_SECTOR_SIZE)
+		sd_max_transfer = 0xffff * BIO_SECTOR_SIZE;
+	sd_num_requests = GetTransport().GetMaxSCSIRequests();
+	if (sd_num_requests > SCSIDISK_MAX_REQUESTS)
+		sd_num_requests = SCSIDISK_MAX_REQUESTS;
+	KASSERT(sd_num_requests > 0, "transport takes no requests");
+	for (unsigned int n = 0; n < sd_num_requests; n++) {
+		Request& req = sd_request[n];
+		req.r_disk = this;
+		if (sd_max_transfer > PAGE_SIZE)
+			req.r_buffer = kmalloc(sd_max_transfer);
+	}
 
 	struct BIO* bio = bio_read(this, 0, BIO_SECTOR_SIZE);
 	if (BIO_IS_ERROR(bio))
@@ -150,36 +259,164 @@ SCSIDisk::Attach()
 errorcode_t
 SCSIDisk::Detach()
 {
+	for (unsigned int n = 0; n < sd_num_requests; n++) {
+		Request& req = sd_request[n];
+		KASSERT(req.r_bio == nullptr, "detaching with requests in flight");
+		kfree(req.r_buffer);
+		req.r_buffer = nullptr;
+	}
 	return ananas_success();
 }
 
+/*
+ * Fills out the command to transfer num_blocks starting at lba, and returns
+ * its length. The 10-byte commands are used where they suffice, as not every
+ * device knows about the 16-byte ones.
+ */
+size_t
+SCSIDisk::BuildTransferCommand(uint8_t* cdb, bool write, blocknr_t lba, uint32_t num_blocks)
+{
+	if (lba + num_blocks <= (1ULL << 32) && num_blocks <= 0xffff) {
+		/* SCSI_READ_10_CMD and SCSI_WRITE_10_CMD only differ in their code */
+		auto cmd = reinterpret_cast<struct SCSI_READ_10_CMD*>(cdb);
+		memset(cmd, 0, sizeof *cmd);
+		cmd->c_code = write ? SCSI_CMD_WRITE_10 : SCSI_CMD_READ_10;
+		cmd->c_lba = htobe32(lba);
+		cmd->c_transfer_len = htobe16(num_blocks);
+		return sizeof(*cmd);
+	}
+
+	/* Likewise for SCSI_READ_16_CMD and SCSI_WRITE_16_CMD */
+	auto cmd = reinterpret_cast<struct SCSI_READ_16_CMD*>(cdb);
+	memset(cmd, 0, sizeof *cmd);
+	cmd->c_code = write ? SCSI_CMD_WRITE_16 : SCSI_CMD_READ_16;
+	cmd->c_lba = htobe64(lba);
+	cmd->c_transfer_len = htobe32(num_blocks);
+	return sizeof(*cmd);
+}
+
+/*
+ * Queues a read or write of the chain of bio's starting at bio using a single
+ * command; the bio's are signed off once it completes. A lone bio is
+ * transferred in place; chains go by the buffer of the request.
+ */
 errorcode_t
-SCSIDisk::ReadBIO(struct BIO& bio)
+SCSIDisk::Transfer(struct BIO& bio, bool write)
 {
-	KASSERT(bio.length > 0, "invalid length");
-	KASSERT(bio.length % 512 == 0, "invalid length"); /* XXX */
+	uint32_t len = 0;
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next) {
+		KASSERT(b->length > 0, "invalid length");
+		KASSERT(b->length % 512 == 0, "invalid length"); /* XXX */
+		len += b->length;
+	}
+	KASSERT(len <= sd_max_transfer || bio.io_next == NULL, "request too large (%u bytes)", len);
+	uint32_t num_blocks = len / BIO_SECTOR_SIZE;
+	if (bio.io_block + num_blocks > sd_num_blocks)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/* The bio queue never hands us more than GetMaxBIORequests() at once */
+	Request* req = nullptr;
+	register_t state = spinlock_lock_unpremptible(&sd_lock);
+	for (unsigned int n = 0; n < sd_num_requests; n++) {
+		if (sd_request[n].r_bio != nullptr)
+			continue;
+		req = &sd_request[n];
+		req->r_bio = &bio;
+		break;
+	}
+	spinlock_unlock_unpremptible(&sd_lock, state);
+	KASSERT(req != nullptr, "no request available");
+	req->r_write = write;
+
+	void* data = BIO_DATA(&bio);
+	if (bio.io_next != NULL) {
+		data = req->r_buffer;
+		if (write) {
+			auto p = static_cast<char*>(data);
+			for (struct BIO* b = &bio; b != NULL; p += b->length, b = b->io_next)
+				memcpy(p, BIO_DATA(b), b->length);
+		}
+	}
 
- // XXX we could schedule things here, but seeing that this is only for USB
- // there is no real benefit right now
+	Ananas::SCSIRequest& sr = req->r_scsi;
+	sr.sr_lun = sd_lun;
+	sr.sr_dir = write ? Direction::D_Out : Direction::D_In;
+	sr.sr_cdb_len = BuildTransferCommand(sr.sr_cdb, write, bio.io_block, num_blocks);
+	sr.sr_data = data;
+	sr.sr_data_len = len;
+	sr.sr_callback = &OnTransferDone;
+	sr.sr_context = req;
+	errorcode_t err = GetTransport().QueueSCSIRequest(sr);
+	if (ananas_is_failure(err)) {
+		state = spinlock_lock_unpremptible(&sd_lock);
+		req->r_bio = nullptr;
+		spinlock_unlock_unpremptible(&sd_lock, state);
+	}
+	return err;
+}
 
-	struct SCSI_READ_10_CMD r_cmd;
-	memset(&r_cmd, 0, sizeof r_cmd);
-	r_cmd.c_code = SCSI_CMD_READ_10;
-	r_cmd.c_lba = htobe32(bio.io_block);
-	r_cmd.c_transfer_len = htobe16(bio.length / 512);
-	size_t reply_len = bio.length;
-	errorcode_t err = HandleRequest(0, Direction::D_In, &r_cmd, sizeof(r_cmd), BIO_DATA(&bio), &reply_len);
-	ANANAS_ERROR_RETURN(err);
+void
+SCSIDisk::OnTransferDone(Ananas::SCSIRequest& sr)
+{
+	auto& req = *static_cast<Request*>(sr.sr_context);
+	req.r_disk->CompleteTransfer(req);
+}
 
-	bio_set_available(&bio);
-	return ananas_success();
+/* Hands the data out and signs off every bio of the request, in order */
+void
+SCSIDisk::CompleteTransfer(Request& req)
+{
+	Ananas::SCSIRequest& sr = req.r_scsi;
+	bool ok = ananas_is_success(sr.sr_result) && sr.sr_data_done == sr.sr_data_len;
+	struct BIO* bio = req.r_bio;
+	bool write = req.r_write;
+	if (!ok)
+		Printf("%s of block %u failed", write ? "write" : "read", (unsigned int)bio->io_block);
+	else if (!write && sr.sr_data == req.r_buffer) {
+		auto p = static_cast<const char*>(sr.sr_data);
+		for (struct BIO* b = bio; b != NULL; p += b->length, b = b->io_next)
+			memcpy(BIO_DATA(b), p, b->length);
+	}
+
+	/* Completing the bio's may get us a new request right away, so free ours first */
+	register_t state = spinlock_lock_unpremptible(&sd_lock);
+	req.r_bio = nullptr;
+	spinlock_unlock_unpremptible(&sd_lock, state);
+	while (bio != NULL) {
+		struct BIO* next = bio->io_next; /* bio may be reused once available */
+		if (ok)
+			bio_set_available(bio);
+		else
+			bio_set_error(bio);
+		bio = next;
+	}
+}
+
+errorcode_t
+SCSIDisk::ReadBIO(struct BIO& bio)
+{
+	return Transfer(bio, false);
 }
 
 errorcode_t
 SCSIDisk::WriteBIO(struct BIO& bio)
 {
-	// XXX Not yet implemented
-	return ANANAS_ERROR(READ_ONLY);
+	return Transfer(bio, true);
+}
+
+unsigned int
+SCSIDisk::GetMaxBIORequests()
+{
+	return sd_num_requests;
+}
+
+unsigned int
+SCSIDisk::GetMaxBIOsPerRequest()
+{
+	/* Bio's never exceed a page */
+	if (sd_request[0].r_buffer == nullptr)
+		return 1;
+	return sd_max_transfer / PAGE_SIZE;
 }
 
 struct SCSIDisk_Driver : public Ananas::Driver
@@ -6,6 +6,11 @@
 #define SCSI_CMD_INQUIRY_6 0x12
 #define SCSI_CMD_READ_CAPACITY_10	0x25
 #define SCSI_CMD_READ_10 0x28
+#define SCSI_CMD_WRITE_10 0x2a
+#define SCSI_CMD_READ_16 0x88
+#define SCSI_CMD_WRITE_16 0x8a
+#define SCSI_CMD_SERVICE_ACTION_IN_16 0x9e
+#define  SCSI_SA_READ_CAPACITY_16 0x10
 
 struct SCSI_CDB_6 {
 	/* 00 */    uint8_t  c_code;
@@ -70,6 +75,36 @@ struct SCSI_READ_10_CMD {
 	/* 09 */    uint8_t   c_control;
 } __attribute__((packed));
 
+struct SCSI_WRITE_10_CMD {
+	/* 00 */    uint8_t  c_code;
+	/* 01 */    uint8_t  c_flags;
+#define SCSI_WRITE_10_FLAG_DPO (1 << 4)
+#define SCSI_WRITE_10_FLAG_FUA (1 << 3)
+#define SCSI_WRITE_10_FLAG_FUA_NV (1 << 1)
+	/* 02-05 */ uint32_t  c_lba;
+	/* 06 */    uint8_t   c_group_number;
+	/* 07-08 */ uint16_t  c_transfer_len;
+	/* 09 */    uint8_t   c_control;
+} __attribute__((packed));
+
+struct SCSI_READ_16_CMD {
+	/* 00 */    uint8_t  c_code;
+	/* 01 */    uint8_t  c_flags;	/* as SCSI_READ_10_FLAG_... */
+	/* 02-09 */ uint64_t c_lba;
+	/* 0a-0d */ uint32_t c_transfer_len;
+	/* 0e */    uint8_t  c_group_number;
+	/* 0f */    uint8_t  c_control;
+} __attribute__((packed));
+
+struct SCSI_WRITE_16_CMD {
+	/* 00 */    uint8_t  c_code;
+	/* 01 */    uint8_t  c_flags;	/* as SCSI_WRITE_10_FLAG_... */
+	/* 02-09 */ uint64_t c_lba;
+	/* 0a-0d */ uint32_t c_transfer_len;
+	/* 0e */    uint8_t  c_group_number;
+	/* 0f */    uint8_t  c_control;
+} __attribute__((packed));
+
 struct SCSI_INQUIRY_6_CMD {
 	/* 00 */    uint8_t  c_code;
 	/* 01 */    uint8_t  c_evpd;
@@ -108,4 +143,19 @@ struct SCSI_READ_CAPACITY_10_REPLY {
 	/* 04-07 */ uint32_t r_block_length;
 } __attribute__((packed));
 
+struct SCSI_READ_CAPACITY_16_CMD {
+	/* 00 */    uint8_t  c_code;
+	/* 01 */    uint8_t  c_service_action;
+	/* 02-09 */ uint64_t c_lba;
+	/* 0a-0d */ uint32_t c_alloc_len;
+	/* 0e */    uint8_t  c_pmi;
+	/* 0f */    uint8_t  c_control;
+} __attribute__((packed));
+
+struct SCSI_READ_CAPACITY_16_REPLY {
+	/* 00-07 */ uint64_t r_lba;
+	/* 08-0b */ uint32_t r_block_length;
+	/* 0c-1f */ uint8_t  r_reserved[20];
+} __attribute__((packed));
+
 #endif // ANANAS_SCSI_H
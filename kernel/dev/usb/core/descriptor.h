@@ -130,6 +130,7 @@ struct USB_HUB_PORTSTATUS {
 #define USB_HUB_PS_PORT_RESET			(1 << 4)
 #define USB_HUB_PS_PORT_POWER			(1 << 8)
 #define USB_HUB_PS_PORT_LOW_SPEED		(1 << 9)
+#define USB_HUB_PS_PORT_HIGH_SPEED		(1 << 10)
 	uint16_t ps_portchange;
 #define USB_HUB_PC_C_PORT_CONNECTION		(1 << 0)
 #define USB_HUB_PC_C_PORT_ENABLE		(1 << 1)
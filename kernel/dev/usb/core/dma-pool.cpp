@@ -0,0 +1,88 @@
+#include <ananas/types.h>
+#include <ananas/dma.h>
+#include <ananas/error.h>
+#include <ananas/lib.h>
+#include <ananas/trace.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include "dma-pool.h"
+
+TRACE_SETUP;
+
+namespace Ananas {
+namespace USB {
+
+errorcode_t
+DMAPool::Initialize(dma_tag_t tag, const char* name, size_t item_size, unsigned int initial_items)
+{
+	KASSERT(item_size >= sizeof(FreeItem), "item size %d too small", item_size);
+	dp_tag = tag;
+	dp_item_size = (item_size + DMA_POOL_ALIGN - 1) & ~(DMA_POOL_ALIGN - 1);
+	KASSERT(dp_item_size <= PAGE_SIZE, "item size %d too large", dp_item_size);
+	mutex_init(&dp_mtx, name);
+
+	unsigned int items_per_chunk = PAGE_SIZE / dp_item_size;
+	errorcode_t err = ananas_success();
+	mutex_lock(&dp_mtx);
+	for (unsigned int n = 0; n < initial_items && ananas_is_success(err); n += items_per_chunk)
+		err = Grow_Locked();
+	mutex_unlock(&dp_mtx);
+	return err;
+}
+
+errorcode_t
+DMAPool::Grow_Locked()
+{
+	mutex_assert(&dp_mtx, MTX_LOCKED);
+	if (dp_num_chunks == DMA_POOL_MAX_CHUNKS)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+
+	dma_buf_t buf;
+	errorcode_t err = dma_buf_alloc(dp_tag, PAGE_SIZE, &buf);
+	ANANAS_ERROR_RETURN(err);
+	dp_chunk[dp_num_chunks++] = buf;
+
+	/* Chop the page into items and place them on the free list */
+	auto seg = dma_buf_get_segment(buf, 0);
+	auto virt = static_cast<char*>(seg->s_virt);
+	for (unsigned int offs = 0; offs + dp_item_size <= PAGE_SIZE; offs += dp_item_size) {
+		auto fi = reinterpret_cast<FreeItem*>(virt + offs);
+		fi->fi_phys = seg->s_phys + offs;
+		fi->fi_next = dp_free;
+		dp_free = fi;
+	}
+	return ananas_success();
+}
+
+void*
+DMAPool::Allocate(uint32_t& phys)
+{
+	mutex_lock(&dp_mtx);
+	if (dp_free == nullptr && ananas_is_failure(Grow_Locked())) {
+		mutex_unlock(&dp_mtx);
+		return nullptr;
+	}
+	FreeItem* fi = dp_free;
+	dp_free = fi->fi_next;
+	mutex_unlock(&dp_mtx);
+
+	phys = fi->fi_phys;
+	memset(fi, 0, dp_item_size);
+	return fi;
+}
+
+void
+DMAPool::Free(void* item, uint32_t phys)
+{
+	auto fi = static_cast<FreeItem*>(item);
+	fi->fi_phys = phys;
+
+	mutex_lock(&dp_mtx);
+	fi->fi_next = dp_free;
+	dp_free = fi;
+	mutex_unlock(&dp_mtx);
+}
+
+} // namespace USB
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
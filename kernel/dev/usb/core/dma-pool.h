@@ -0,0 +1,61 @@
+#ifndef __ANANAS_USB_DMA_POOL_H__
+#define __ANANAS_USB_DMA_POOL_H__
+
+#include <ananas/types.h>
+#include <ananas/dma.h>
+#include <ananas/lock.h>
+
+/* Maximum number of pages a pool can consist of */
+#define DMA_POOL_MAX_CHUNKS	16
+
+/* Items are aligned to this many bytes; EHCI needs this for its qTD's/QH's */
+#define DMA_POOL_ALIGN		32
+
+namespace Ananas {
+namespace USB {
+
+/*
+ * Pool of fixed-size items that the host controller can access; this is used
+ * by the HCD's for their transfer descriptors and friends, which are small and
+ * constantly allocated and freed.
+ *
+ * Items are carved from page-sized DMA buffers, which are allocated as needed
+ * and never returned. Freed items are kept on a free list, along with their
+ * physical address, so that allocating an item does not involve the DMA code.
+ */
+class DMAPool
+{
+public:
+	DMAPool() = default;
+	DMAPool(const DMAPool&) = delete;
+	DMAPool& operator=(const DMAPool&) = delete;
+
+	/* Sets up the pool and pre-allocates at least 'initial_items' items */
+	errorcode_t Initialize(dma_tag_t tag, const char* name, size_t item_size, unsigned int initial_items);
+
+	/* Returns a zeroed item and its physical address, or nullptr if we ran out */
+	void* Allocate(uint32_t& phys);
+
+	/* Returns an item to the pool; phys must be the address Allocate() returned */
+	void Free(void* item, uint32_t phys);
+
+private:
+	struct FreeItem {
+		FreeItem* fi_next;
+		uint32_t fi_phys;
+	};
+
+	errorcode_t Grow_Locked();
+
+	dma_tag_t dp_tag;
+	mutex_t dp_mtx;
+	size_t dp_item_size = 0;
+	FreeItem* dp_free = nullptr;		/* [M] */
+	unsigned int dp_num_chunks = 0;		/* [M] */
+	dma_buf_t dp_chunk[DMA_POOL_MAX_CHUNKS];	/* [M] */
+};
+
+} // namespace USB
+} // namespace Ananas
+
+#endif /* __ANANAS_USB_DMA_POOL_H__ */
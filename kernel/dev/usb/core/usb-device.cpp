@@ -1,4 +1,5 @@
 #include <ananas/types.h>
+#include <ananas/boottime.h>
 #include <ananas/device.h>
 #include <ananas/error.h>
 #include <ananas/device.h>
@@ -7,6 +8,7 @@
 #include <ananas/thread.h>
 #include <ananas/pcpu.h>
 #include <ananas/schedule.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
 #include <machine/param.h> /* for PAGE_SIZE XXX */
@@ -51,6 +53,8 @@ USBDevice::~USBDevice()
 errorcode_t
 USBDevice::Attach()
 {
+	uint64_t enumerate_start = md_timer_get_ns();
+
 	/*
 	 * First step is to reset the port - we do this here to prevent multiple ports from being
 	 * reset.
@@ -189,9 +193,15 @@ USBDevice::Attach()
 		ud_cur_interface = 0;
 	}
 
+	/* Enumeration is done; the driver attach below is recorded by itself */
+	boottime_record(BOOTTIME_TYPE_ENUMERATE, enumerate_start, ananas_success(), "usb address %d on %s%u",
+	 ud_address, ud_bus.d_Name, ud_bus.d_Unit);
+
 	/* Now, we'll have to hook up some driver... */
 	Ananas::ResourceSet resourceSet;
 	resourceSet.AddResource(Ananas::Resource(Ananas::Resource::RT_USB_Device, reinterpret_cast<Ananas::Resource::Base>(this), 0));
+	Interface& iface = ud_interface[ud_cur_interface];
+	resourceSet.AddResource(Ananas::Resource(Ananas::Resource::RT_USB_Interface, (iface.if_class << 16) | (iface.if_subclass << 8) | iface.if_protocol, 0));
 	ud_device = Ananas::DeviceManager::AttachChild(ud_bus, resourceSet);
 	KASSERT(ud_device != nullptr, "unable to find USB device to attach?");
 
@@ -112,6 +112,7 @@ private:
 };
 
 #define USB_DEVICE_FLAG_LOW_SPEED (1 << 0)
+#define USB_DEVICE_FLAG_HIGH_SPEED (1 << 1)
 #define USB_DEVICE_FLAG_ROOT_HUB (1 << 31)
 
 } // namespace USB
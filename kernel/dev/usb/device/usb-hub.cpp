@@ -117,6 +117,16 @@ Hub::ResetPort(int n)
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 
+	/* The speed of the device is only known once the port is enabled */
+	USBDevice* usb_dev = h_Port[n - 1]->p_device;
+	if (usb_dev != nullptr) {
+		usb_dev->ud_flags &= ~(USB_DEVICE_FLAG_LOW_SPEED | USB_DEVICE_FLAG_HIGH_SPEED);
+		if (ps.ps_portstatus & USB_HUB_PS_PORT_HIGH_SPEED)
+			usb_dev->ud_flags |= USB_DEVICE_FLAG_HIGH_SPEED;
+		else if (ps.ps_portstatus & USB_HUB_PS_PORT_LOW_SPEED)
+			usb_dev->ud_flags |= USB_DEVICE_FLAG_LOW_SPEED;
+	}
+
 	DPRINTF("%s: port %d: reset completed; clearing c_reset", __func__, n);
 	err = h_Device->PerformControlTransfer(USB_CONTROL_REQUEST_CLEAR_FEATURE, USB_CONTROL_RECIPIENT_OTHER, USB_CONTROL_TYPE_CLASS, HUB_FEATURE_C_PORT_RESET, n, NULL, NULL, true);
 	if (ananas_is_failure(err)) {
@@ -289,6 +299,15 @@ struct USBHub_Driver : public Ananas::Driver
 		return "usbbus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_USB_Interface, USB_IF_CLASS_HUB << 16, 0xff0000 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_USB_Device, 0);
@@ -13,6 +13,7 @@ struct HUB_PORT_STATUS {
 #define HUB_PORTSTATUS_RESET		(1 << 4)		/* Port is resetting */
 #define HUB_PORTSTATUS_POWERED		(1 << 8)		/* Port is powered */
 #define HUB_PORTSTATUS_LOWSPEED		(1 << 9)		/* Low speed device attached */
+#define HUB_PORTSTATUS_HIGHSPEED	(1 << 10)		/* High speed device attached */
 	uint16_t	ps_portchange;
 #define HUB_PORTCHANGE_CONNECT		(1 << 0)		/* Connection state has changed */
 #define HUB_PORTCHANGE_ENABLE		(1 << 1)		/* Enable state has changed */
@@ -43,6 +44,11 @@ public:
 	errorcode_t ResetPort(int n);
 	void HandleExplore() override;
 
+	USBDevice& GetUSBDevice()
+	{
+		return *h_Device;
+	}
+
 protected:
 	void OnPipeCallback(Pipe& pipe) override;
 
@@ -148,6 +148,15 @@ struct USBKeyboard_Driver : public Ananas::Driver
 		return "usbbus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_USB_Interface, (USB_IF_CLASS_HID << 16) | (1 << 8) | 1, 0xffffff }, /* boot interface, keyboard */
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_USB_Device, 0);
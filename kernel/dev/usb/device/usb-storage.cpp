@@ -14,7 +14,6 @@
 #include "../core/usb-device.h"
 #include "../core/usb-transfer.h"
 #include "../core/config.h"
-#include "../../scsi/scsi.h" // XXX kludge
 
 TRACE_SETUP;
 
@@ -24,8 +23,22 @@ TRACE_SETUP;
 #define DPRINTF(...)
 #endif
 
+/*
+ * Largest request we take; the data phase is split into transfers of
+ * USB_MAX_DATALEN bytes, so this only limits how much a single command does.
+ */
+#define USBSTORAGE_MAX_TRANSFER	65536
+
+/*
+ * Bulk-only transport runs a single command at a time; having the next one
+ * queued lets us start it as soon as the previous one completes.
+ */
+#define USBSTORAGE_MAX_REQUESTS	2
+
 namespace {
 
+LIST_DEFINE(SCSIRequestList, Ananas::SCSIRequest);
+
 struct USBSTORAGE_CBW {
 	/* 00-03 */ uint32_t d_cbw_signature;
 #define USBSTORAGE_CBW_SIGNATURE 0x43425355
@@ -109,7 +122,9 @@ public:
 	void OnPipeInCallback();
 	void OnPipeOutCallback();
 
-	errorcode_t PerformSCSIRequest(int lun, ISCSIDeviceOperations::Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len) override;
+	errorcode_t QueueSCSIRequest(Ananas::SCSIRequest& req) override;
+	unsigned int GetMaxSCSIRequests() override;
+	unsigned int GetMaxTransferLength() override;
 
 protected:
 	errorcode_t Attach() override;
@@ -126,6 +141,13 @@ private:
 		mutex_unlock(&us_mutex);
 	}
 
+	void StartRequest_Locked();
+	void StartDataOut_Locked();
+	void StartIn_Locked(size_t len);
+	void StartStatus_Locked();
+	Ananas::SCSIRequest* CompleteRequest_Locked(errorcode_t err);
+	errorcode_t CheckCSW(const struct USBSTORAGE_CSW& csw);
+
 	Ananas::USB::USBDevice* us_Device = nullptr;
 	Ananas::USB::Pipe* us_BulkIn = nullptr;
 	Ananas::USB::Pipe* us_BulkOut = nullptr;
@@ -133,18 +155,23 @@ private:
 	StorageDevice_PipeInCallbackWrapper us_PipeInCallback;
 	StorageDevice_PipeOutCallbackWrapper us_PipeOutCallback;
 
-	mutex_t us_mutex;
+	mutex_t us_mutex;	/* Protects everything below */
 	unsigned int us_max_lun = 0;
-	/* Output buffer */
-	void* us_output_buffer = nullptr;
-	size_t us_output_filled = 0;
-	size_t us_output_len = 0;
-	/* Most recent CSW received */
-	errorcode_t* us_result_ptr = nullptr;
-	struct USBSTORAGE_CSW* us_csw_ptr = nullptr;
-
-	/* Signalled when the CSW is received */
-	semaphore_t us_signal_sem;
+	uint32_t us_tag = 0;
+	/*
+	 * Requests are handled in order; the head of the queue is the current one,
+	 * which the bulk pipes take through the command, data and status phases
+	 * from their callbacks.
+	 */
+	struct SCSIRequestList us_queue;
+	enum class Phase {
+		P_Idle,
+		P_Command,
+		P_DataIn,
+		P_DataOut,
+		P_Status
+	} us_phase = Phase::P_Idle;
+	size_t us_chunk_len = 0;	/* data transfer in progress */
 };
 
 void StorageDevice_PipeInCallbackWrapper::OnPipeCallback(Ananas::USB::Pipe& pipe)
@@ -163,70 +190,125 @@ USBStorage::USBStorage(const Ananas::CreateDeviceProperties& cdp)
 }
 
 errorcode_t
-USBStorage::PerformSCSIRequest(int lun, Direction dir, const void* cb, size_t cb_len, void* result, size_t* result_len)
+USBStorage::QueueSCSIRequest(Ananas::SCSIRequest& req)
+{
+	KASSERT(req.sr_data_len == 0 || req.sr_data != nullptr, "data length without data?");
+	DPRINTF("lun %d dir %d cdb_len %d data_len %d", req.sr_lun, req.sr_dir, req.sr_cdb_len, req.sr_data_len);
+	if (req.sr_cdb_len == 0 || req.sr_cdb_len > sizeof(USBSTORAGE_CBW::d_cbw_cb))
+		return ANANAS_ERROR(BAD_LENGTH);
+	if (req.sr_lun < 0 || static_cast<unsigned int>(req.sr_lun) > us_max_lun)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	Lock();
+	LIST_APPEND(&us_queue, &req);
+	if (us_phase == Phase::P_Idle)
+		StartRequest_Locked();
+	Unlock();
+	return ananas_success();
+}
+
+unsigned int
+USBStorage::GetMaxSCSIRequests()
 {
-	KASSERT(result_len == nullptr || result != nullptr, "result_len without result?");
-	DPRINTF("dir %d len %d cb_len %d result_len %d", dir, lun, cb_len, result_len ? *result_len : -1);
+	return USBSTORAGE_MAX_REQUESTS;
+}
 
-	struct USBSTORAGE_CSW csw;
-	errorcode_t err = ANANAS_ERROR(UNKNOWN);
+unsigned int
+USBStorage::GetMaxTransferLength()
+{
+	return USBSTORAGE_MAX_TRANSFER;
+}
+
+/* Sends the command-block-wrapper of the next request, if there is one */
+void
+USBStorage::StartRequest_Locked()
+{
+	KASSERT(us_phase == Phase::P_Idle, "starting request while busy");
+	if (LIST_EMPTY(&us_queue))
+		return;
+	Ananas::SCSIRequest& req = *LIST_HEAD(&us_queue);
+	req.sr_tag = ++us_tag;
+	req.sr_data_done = 0;
 
-	/* Create the command-block-wrapper */
 	struct USBSTORAGE_CBW cbw;
 	memset(&cbw, 0, sizeof cbw);
 	cbw.d_cbw_signature = USBSTORAGE_CBW_SIGNATURE;
-	cbw.d_cbw_data_transferlength = (result_len != NULL) ? *result_len : 0;
-	cbw.d_bm_cbwflags = (dir == Direction::D_In) ? USBSTORAGE_CBW_FLAG_DATA_IN : USBSTORAGE_CBW_FLAG_DATA_OUT;
-	cbw.d_cbw_lun = lun;
-	cbw.d_cbw_cblength = cb_len;
-	memcpy(&cbw.d_cbw_cb[0], cb, cb_len);
-
-	/* All SCSI CDB's follow a standard format; fill out those fields here XXX This is not the correct place */
-	switch(cb_len) {
-		case 6: {
-			struct SCSI_CDB_6* cdb = (struct SCSI_CDB_6*)&cbw.d_cbw_cb[0];
-			cdb->c_alloc_len = (result_len != nullptr) ? *result_len : 0;
-			break;
-		}
-		case 10: {
-			struct SCSI_CDB_10* cdb = (struct SCSI_CDB_10*)&cbw.d_cbw_cb[0];
-			uint16_t v = (result_len != nullptr) ? *result_len : 0;
-			if (cdb->c_code != SCSI_CMD_READ_10) /* XXX */
-				cdb->c_alloc_len = htobe16(v);
-			break;
-		}
-		default:
-			panic("invalid cb_len %d", cb_len);
-	}
-
-	Lock();
-	/* Ensure our output is at a sensible location */
-	us_output_buffer = result;
-	us_output_filled = 0;
-	us_output_len = (result_len != NULL) ? *result_len : 0;
-	us_result_ptr = &err;
-	us_csw_ptr = &csw;
-	/* Now, submit the request */
+	cbw.d_cbw_tag = req.sr_tag;
+	cbw.d_cbw_data_transferlength = req.sr_data_len;
+	cbw.d_bm_cbwflags = (req.sr_dir == Direction::D_In) ? USBSTORAGE_CBW_FLAG_DATA_IN : USBSTORAGE_CBW_FLAG_DATA_OUT;
+	cbw.d_cbw_lun = req.sr_lun;
+	cbw.d_cbw_cblength = req.sr_cdb_len;
+	memcpy(&cbw.d_cbw_cb[0], req.sr_cdb, req.sr_cdb_len);
+
+	us_phase = Phase::P_Command;
 	us_BulkOut->p_xfer.t_length = sizeof(cbw);
 	memcpy(&us_BulkOut->p_xfer.t_data[0], &cbw, us_BulkOut->p_xfer.t_length);
+	us_BulkOut->Start();
+}
 
+/* Sends as much of the outgoing data as a single transfer takes */
+void
+USBStorage::StartDataOut_Locked()
+{
+	Ananas::SCSIRequest& req = *LIST_HEAD(&us_queue);
+	Ananas::USB::Transfer& xfer = us_BulkOut->p_xfer;
+	us_chunk_len = req.sr_data_len - req.sr_data_done;
+	if (us_chunk_len > sizeof(xfer.t_data))
+		us_chunk_len = sizeof(xfer.t_data);
+	memcpy(&xfer.t_data[0], static_cast<const char*>(req.sr_data) + req.sr_data_done, us_chunk_len);
+	xfer.t_length = us_chunk_len;
 	us_BulkOut->Start();
-	Unlock();
+}
 
-	/* Now we wait for the signal ... */
-	sem_wait_and_drain(&us_signal_sem);
-	ANANAS_ERROR_RETURN(err);
+/* Receives up to len bytes; the device may send less */
+void
+USBStorage::StartIn_Locked(size_t len)
+{
+	Ananas::USB::Transfer& xfer = us_BulkIn->p_xfer;
+	if (len > sizeof(xfer.t_data))
+		len = sizeof(xfer.t_data);
+	us_chunk_len = len;
+	xfer.t_length = len;
+	us_BulkIn->Start();
+}
+
+void
+USBStorage::StartStatus_Locked()
+{
+	us_phase = Phase::P_Status;
+	StartIn_Locked(us_BulkIn->p_ep.ep_maxpacketsize);
+}
+
+/*
+ * Finishes the current request and moves on to the next one. The finished
+ * request is returned; its callback must be invoked once we are unlocked, as
+ * it may well queue a new request.
+ */
+Ananas::SCSIRequest*
+USBStorage::CompleteRequest_Locked(errorcode_t err)
+{
+	Ananas::SCSIRequest* req = LIST_HEAD(&us_queue);
+	KASSERT(req != nullptr, "completing without request");
+	LIST_POP_HEAD(&us_queue);
+	req->sr_result = err;
+	us_phase = Phase::P_Idle;
+	StartRequest_Locked();
+	return req;
+}
 
-	/* See if the CSW makes sense */
+/* See if the CSW makes sense and matches the current request */
+errorcode_t
+USBStorage::CheckCSW(const struct USBSTORAGE_CSW& csw)
+{
+	Ananas::SCSIRequest& req = *LIST_HEAD(&us_queue);
 	if (csw.d_csw_signature != USBSTORAGE_CSW_SIGNATURE)
 		return ANANAS_ERROR(IO);
-	if (csw.d_csw_tag != cbw.d_cbw_tag)
+	if (csw.d_csw_tag != req.sr_tag)
 		return ANANAS_ERROR(IO);
 	if (csw.d_csw_status != USBSTORAGE_CSW_STATUS_GOOD) {
 		DPRINTF("device rejected request: %d", csw.d_csw_status);
 		return ANANAS_ERROR(IO);
 	}
-
 	return ananas_success();
 }
 
@@ -239,54 +321,87 @@ USBStorage::OnPipeInCallback()
 	DPRINTF("usbstorage_in_callback! -> flags %x len %d", xfer.t_flags, xfer.t_result_length);
 
 	/*
-	 * We'll have one or two responses now: the first will be the resulting data,
-	 * and the second will be the CSW.
+	 * We'll have one or more responses now: the first ones will be the
+	 * resulting data, and the final one will be the CSW.
 	 */
-	bool need_schedule = false;
+	Ananas::SCSIRequest* done = nullptr;
 	Lock();
-	int len = xfer.t_result_length;
-	if (us_output_buffer != nullptr) {
-		size_t left = us_output_len - us_output_filled;
+	Ananas::SCSIRequest* req = LIST_HEAD(&us_queue);
+	size_t len = xfer.t_result_length;
+	if (xfer.t_flags & TRANSFER_FLAG_ERROR) {
+		xfer.t_flags &= ~TRANSFER_FLAG_ERROR;
+		Printf("bulk/in transfer failed");
+		if (req != nullptr)
+			done = CompleteRequest_Locked(ANANAS_ERROR(IO));
+	} else if (us_phase == Phase::P_DataIn) {
+		size_t left = req->sr_data_len - req->sr_data_done;
 		if (len > left)
 			len = left;
 
-		memcpy((char*)us_output_buffer + us_output_filled, &xfer.t_data[0], len);
-		us_output_filled += len;
-		left -= len;
-		if (left == 0) {
-			us_output_len = len;
-			us_output_buffer = nullptr;
-		}
-		need_schedule = true; /* as more data will arrive */
-	} else if (us_csw_ptr != nullptr && us_result_ptr != nullptr) {
+		memcpy(static_cast<char*>(req->sr_data) + req->sr_data_done, &xfer.t_data[0], len);
+		req->sr_data_done += len;
+
+		/* A short transfer ends the data phase early */
+		if (len == us_chunk_len && req->sr_data_done < req->sr_data_len)
+			StartIn_Locked(req->sr_data_len - req->sr_data_done);
+		else
+			StartStatus_Locked();
+	} else if (us_phase == Phase::P_Status) {
 		if (len != sizeof(struct USBSTORAGE_CSW)) {
 			Printf("invalid csw length (expected %d got %d)", sizeof(struct USBSTORAGE_CSW), len);
-			*us_result_ptr = ANANAS_ERROR(BAD_LENGTH);
+			done = CompleteRequest_Locked(ANANAS_ERROR(BAD_LENGTH));
 		} else {
-			memcpy(us_csw_ptr, &xfer.t_data[0], len);
-			*us_result_ptr = ananas_success();
+			struct USBSTORAGE_CSW csw;
+			memcpy(&csw, &xfer.t_data[0], len);
+			done = CompleteRequest_Locked(CheckCSW(csw));
 		}
-		us_result_ptr = nullptr;
-		us_csw_ptr = nullptr;
-		sem_signal(&us_signal_sem);
 	} else {
 		Printf("received %d bytes but no sink?", len);
 	}
 	Unlock();
 
-	if (need_schedule)
-		us_BulkIn->Start();
+	if (done != nullptr)
+		done->sr_callback(*done);
 }
 
+/* Called when data flows from us -> the device */
 void
 USBStorage::OnPipeOutCallback()
 {
 	Ananas::USB::Transfer& xfer = us_BulkOut->p_xfer;
-	(void)xfer;
 
 	DPRINTF("usbstorage_out_callback! -> len %d", xfer.t_result_length);
 
-	us_BulkIn->Start();
+	Ananas::SCSIRequest* done = nullptr;
+	Lock();
+	Ananas::SCSIRequest* req = LIST_HEAD(&us_queue);
+	if (xfer.t_flags & TRANSFER_FLAG_ERROR) {
+		xfer.t_flags &= ~TRANSFER_FLAG_ERROR;
+		Printf("bulk/out transfer failed");
+		if (req != nullptr)
+			done = CompleteRequest_Locked(ANANAS_ERROR(IO));
+	} else if (us_phase == Phase::P_Command) {
+		/* CBW is out; move on to the data phase, if there is one */
+		if (req->sr_data_len > 0 && req->sr_dir == Direction::D_Out) {
+			us_phase = Phase::P_DataOut;
+			StartDataOut_Locked();
+		} else if (req->sr_data_len > 0) {
+			us_phase = Phase::P_DataIn;
+			StartIn_Locked(req->sr_data_len);
+		} else {
+			StartStatus_Locked();
+		}
+	} else if (us_phase == Phase::P_DataOut) {
+		req->sr_data_done += us_chunk_len;
+		if (req->sr_data_done < req->sr_data_len)
+			StartDataOut_Locked();
+		else
+			StartStatus_Locked();
+	}
+	Unlock();
+
+	if (done != nullptr)
+		done->sr_callback(*done);
 }
 
 errorcode_t
@@ -295,7 +410,7 @@ USBStorage::Attach()
 	us_Device = static_cast<Ananas::USB::USBDevice*>(d_ResourceSet.AllocateResource(Ananas::Resource::RT_USB_Device, 0));
 
 	mutex_init(&us_mutex, "usbstorage");
-	sem_init(&us_signal_sem, 0);
+	LIST_INIT(&us_queue);
 
 	/*
 	 * Determine the max LUN of the device - note that devices do not have to support this,
@@ -356,6 +471,19 @@ USBStorage::Detach()
 	if (us_BulkOut != nullptr)
 		us_Device->FreePipe(*us_BulkOut);
 	us_BulkOut = nullptr;
+
+	/* Nothing will complete anymore; fail whatever is still queued */
+	Lock();
+	struct SCSIRequestList queue = us_queue;
+	LIST_INIT(&us_queue);
+	us_phase = Phase::P_Idle;
+	Unlock();
+	while (!LIST_EMPTY(&queue)) {
+		Ananas::SCSIRequest* req = LIST_HEAD(&queue);
+		LIST_POP_HEAD(&queue);
+		req->sr_result = ANANAS_ERROR(NO_DEVICE);
+		req->sr_callback(*req);
+	}
 	return ananas_success();
 }
 
@@ -371,6 +499,15 @@ struct USBStorage_Driver : public Ananas::Driver
 		return "usbbus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_USB_Interface, (USB_IF_CLASS_STORAGE << 16) | USB_IF_PROTOCOL_BULKONLY, 0xff00ff },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_USB_Device, 0);
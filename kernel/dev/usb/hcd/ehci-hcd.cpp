@@ -0,0 +1,821 @@
+/*
+ * EHCI
+ *
+ * EHCI only handles high-speed devices directly: when a full- or low-speed
+ * device is connected to one of the root hub ports, the port is handed over to
+ * one of the companion controllers (OHCI or UHCI), which will see the device
+ * appear. Full- and low-speed devices behind a high-speed hub are handled by
+ * us using split transactions, which are taken care of by the hub's
+ * transaction translator.
+ *
+ * Every transfer gets a queue head (QH) of its own, which holds the endpoint
+ * characteristics; the queue element transfer descriptors (qTD's) are only
+ * created once the transfer is scheduled. Control and bulk QH's are placed in
+ * the asynchronous schedule, which is a circular list starting at a dummy QH.
+ *
+ * Periodic transfers
+ * ------------------
+ * Like OHCI, we use the naive approach: every entry of the frame list points
+ * to a single dummy QH, after which all interrupt QH's are chained. These are
+ * executed in the first micro-frame of every frame, regardless of the interval
+ * the endpoint asked for.
+ */
+#include <ananas/types.h>
+#include <ananas/bus/pci.h>
+#include <ananas/driver.h>
+#include <ananas/error.h>
+#include <ananas/dma.h>
+#include <ananas/irq.h>
+#include <ananas/mm.h>
+#include <ananas/lib.h>
+#include <ananas/time.h>
+#include <ananas/trace.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include "../core/usb-core.h"
+#include "../core/usb-device.h"
+#include "../core/usb-transfer.h"
+#include "../device/usb-hub.h"
+#include "ehci-reg.h"
+#include "ehci-roothub.h"
+#include "ehci-hcd.h"
+
+#include <machine/vm.h> /* for KVTOP, which must go */
+
+TRACE_SETUP;
+
+namespace Ananas {
+namespace USB {
+
+namespace EHCI {
+
+inline uint32_t
+GetPhysicalAddress(HCD_TD& td)
+{
+	return td.td_phys;
+}
+
+inline uint32_t
+GetPhysicalAddress(HCD_QH& qh)
+{
+	return qh.qh_phys;
+}
+
+void
+DumpTD(HCD_TD& td)
+{
+	uint32_t token = td.td_qtd.qtd_token;
+	kprintf("td %x -> next %x altnext %x token %x (%c%c pid %d bytes %d dt %d) buffer %x\n",
+	 GetPhysicalAddress(td),
+	 td.td_qtd.qtd_next,
+	 td.td_qtd.qtd_altnext,
+	 token,
+	 (token & EHCI_QTD_STATUS_ACTIVE) ? 'A' : '.',
+	 (token & EHCI_QTD_STATUS_HALTED) ? 'H' : '.',
+	 (token >> 8) & 3,
+	 EHCI_QTD_GET_BYTES(token),
+	 (token & EHCI_QTD_DT) ? 1 : 0,
+	 td.td_qtd.qtd_buffer[0]);
+}
+
+void
+DumpQH(HCD_QH& qh)
+{
+	kprintf(" qh %x -> link %x endp %x caps %x current %x | next %x token %x\n",
+	 GetPhysicalAddress(qh),
+	 qh.qh_qh.qh_link,
+	 qh.qh_qh.qh_endp,
+	 qh.qh_qh.qh_caps,
+	 qh.qh_qh.qh_current,
+	 qh.qh_qh.qh_overlay.qtd_next,
+	 qh.qh_qh.qh_overlay.qtd_token);
+
+	for (HCD_TD* td = qh.qh_firsttd; td != nullptr; td = td->li_next) {
+		kprintf("  ");
+		DumpTD(*td);
+	}
+}
+
+/* Enqueues 'qh' *after* 'parent' */
+void
+EnqueueQH(HCD_QH& parent, HCD_QH& qh)
+{
+	/* Virtual addresses part */
+	if (parent.qh_nextqh != nullptr)
+		parent.qh_nextqh->qh_prevqh = &qh;
+	qh.qh_nextqh = parent.qh_nextqh;
+	parent.qh_nextqh = &qh;
+	qh.qh_prevqh = &parent;
+
+	/* EHCI part; the QH must be complete before the HC can see it */
+	qh.qh_qh.qh_link = parent.qh_qh.qh_link;
+	parent.qh_qh.qh_link = GetPhysicalAddress(qh) | EHCI_LINK_TYPE_QH;
+}
+
+void
+DequeueQH(HCD_QH& qh)
+{
+	KASSERT(qh.qh_prevqh != nullptr, "removing head qh %p", &qh);
+	qh.qh_prevqh->qh_qh.qh_link = qh.qh_qh.qh_link;
+	qh.qh_prevqh->qh_nextqh = qh.qh_nextqh;
+	if (qh.qh_nextqh != nullptr)
+		qh.qh_nextqh->qh_prevqh = qh.qh_prevqh;
+	qh.qh_prevqh = nullptr;
+	qh.qh_nextqh = nullptr;
+}
+
+int
+GetMaxPacketSize(Transfer& xfer)
+{
+	USBDevice& usb_dev = xfer.t_device;
+	if (xfer.t_type == TRANSFER_TYPE_CONTROL || usb_dev.ud_cur_interface < 0)
+		return usb_dev.ud_max_packet_sz0;
+
+	int dir = (xfer.t_flags & TRANSFER_FLAG_READ) ? EP_DIR_IN : EP_DIR_OUT;
+	Interface& uif = usb_dev.ud_interface[usb_dev.ud_cur_interface];
+	for (int n = 0; n < uif.if_num_endpoints; n++) {
+		Endpoint& ep = uif.if_endpoint[n];
+		if (ep.ep_address == xfer.t_endpoint && ep.ep_dir == dir)
+			return ep.ep_maxpacketsize & 0x7ff; /* strip the high-bandwidth bits */
+	}
+	return usb_dev.ud_max_packet_sz0;
+}
+
+} // namespace EHCI
+
+void
+EHCI_HCD::Dump()
+{
+	Printf("cmd %x sts %x intr %x frindex %x periodic %x async %x configflag %x",
+	 ehci_Resources.Read4(EHCI_USBCMD),
+	 ehci_Resources.Read4(EHCI_USBSTS),
+	 ehci_Resources.Read4(EHCI_USBINTR),
+	 ehci_Resources.Read4(EHCI_FRINDEX),
+	 ehci_Resources.Read4(EHCI_PERIODICLISTBASE),
+	 ehci_Resources.Read4(EHCI_ASYNCLISTADDR),
+	 ehci_Resources.Read4(EHCI_CONFIGFLAG));
+	for (unsigned int n = 0; n < ehci_numports; n++)
+		Printf("portsc[%d] %x", n, ehci_Resources.Read4(EHCI_PORTSCx + n * 4));
+
+	kprintf("** dumping async schedule\n");
+	for (EHCI::HCD_QH* qh = ehci_async_qh; qh != nullptr; qh = qh->qh_nextqh)
+		EHCI::DumpQH(*qh);
+
+	kprintf("** dumping periodic schedule\n");
+	for (EHCI::HCD_QH* qh = ehci_periodic_qh; qh != nullptr; qh = qh->qh_nextqh)
+		EHCI::DumpQH(*qh);
+}
+
+void
+EHCI_HCD::OnIRQ()
+{
+	uint32_t sts = ehci_Resources.Read4(EHCI_USBSTS) & EHCI_STS_INTMASK;
+	if (sts == 0) {
+		/* Not my interrupt; ignore */
+		return; // XXX we should return that we ignored it
+	}
+	ehci_Resources.Write4(EHCI_USBSTS, sts); /* acknowledge */
+
+	if (sts & (EHCI_STS_USBINT | EHCI_STS_USBERRINT)) {
+		/*
+		 * A transfer completed, or failed; we have to walk through everything
+		 * scheduled to find out which. Everything that is done is completed once
+		 * our lock is released, as completing involves the device lock.
+		 */
+		TransferQueue done;
+		LIST_INIT(&done);
+		Lock();
+		LIST_FOREACH_IP(&ehci_active_qhs, active, qh, struct EHCI::HCD_QH) {
+			if (!qh->qh_scheduled)
+				continue;
+
+			/*
+			 * The transfer is done once the HC has nothing left to do for the QH: the
+			 * overlay is inactive and either ends the chain (we stop at the dead TD on
+			 * short packets) or is halted because something went wrong.
+			 */
+			uint32_t token = qh->qh_qh.qh_overlay.qtd_token;
+			if (token & EHCI_QTD_STATUS_ACTIVE)
+				continue;
+			if ((token & EHCI_QTD_STATUS_HALTED) == 0 && (qh->qh_qh.qh_overlay.qtd_next & EHCI_LINK_T) == 0)
+				continue;
+
+			/* Walk through all qTD's and determine the length plus the status */
+			size_t transferred = 0;
+			bool error = (token & EHCI_QTD_STATUS_HALTED) != 0;
+			for (struct EHCI::HCD_TD* td = qh->qh_firsttd; td != nullptr; td = td->li_next) {
+				uint32_t td_token = td->td_qtd.qtd_token;
+				if (td_token & EHCI_QTD_STATUS_ACTIVE)
+					continue; /* skipped due to a short packet */
+				if (td_token & EHCI_QTD_STATUS_HALTED)
+					error = true;
+				if (td->td_length > 0)
+					transferred += td->td_length - EHCI_QTD_GET_BYTES(td_token);
+			}
+
+			Transfer& xfer = *qh->qh_xfer;
+			xfer.t_result_length = transferred;
+			if (error)
+				xfer.t_flags |= TRANSFER_FLAG_ERROR;
+
+			qh->qh_scheduled = false;
+			LIST_APPEND_IP(&done, completed, &xfer);
+		}
+		Unlock();
+
+		/*
+		 * Hand all finished transfers back; we borrow the completed-list fields,
+		 * which are unused until the transfer is actually completed.
+		 */
+		while (!LIST_EMPTY(&done)) {
+			Transfer* xfer = LIST_HEAD(&done);
+			LIST_POP_HEAD_IP(&done, completed);
+			xfer->Complete();
+		}
+	}
+
+	if (sts & EHCI_STS_PCD) {
+		if (ehci_RootHub != nullptr)
+			ehci_RootHub->OnIRQ();
+	}
+
+	if (sts & EHCI_STS_IAA)
+		sem_signal(&ehci_doorbell_sem);
+
+	if (sts & EHCI_STS_HSE) {
+		Printf("host system error!");
+		Dump();
+	}
+}
+
+EHCI::HCD_TD*
+EHCI_HCD::AllocateTD()
+{
+	uint32_t phys;
+	auto td = static_cast<struct EHCI::HCD_TD*>(ehci_td_pool.Allocate(phys));
+	if (td == nullptr)
+		return nullptr;
+
+	td->td_phys = phys;
+	td->td_qtd.qtd_next = EHCI_LINK_T;
+	td->td_qtd.qtd_altnext = EHCI_LINK_T;
+	return td;
+}
+
+EHCI::HCD_QH*
+EHCI_HCD::AllocateQH()
+{
+	uint32_t phys;
+	auto qh = static_cast<struct EHCI::HCD_QH*>(ehci_qh_pool.Allocate(phys));
+	if (qh == nullptr)
+		return nullptr;
+
+	qh->qh_phys = phys;
+	qh->qh_qh.qh_link = EHCI_LINK_T;
+	qh->qh_qh.qh_overlay.qtd_next = EHCI_LINK_T;
+	qh->qh_qh.qh_overlay.qtd_altnext = EHCI_LINK_T;
+	return qh;
+}
+
+void
+EHCI_HCD::FreeTD(EHCI::HCD_TD* td)
+{
+	ehci_td_pool.Free(td, td->td_phys);
+}
+
+void
+EHCI_HCD::FreeQH(EHCI::HCD_QH* qh)
+{
+	ehci_qh_pool.Free(qh, qh->qh_phys);
+}
+
+void
+EHCI_HCD::FreeTDsFromTransfer(Transfer& xfer)
+{
+	auto qh = static_cast<struct EHCI::HCD_QH*>(xfer.t_hcd);
+	if (qh == nullptr)
+		return; /* nothing to free */
+
+	for (EHCI::HCD_TD* td = qh->qh_firsttd; td != nullptr; /* nothing */) {
+		EHCI::HCD_TD* next_td = td->li_next;
+		FreeTD(td);
+		td = next_td;
+	}
+	qh->qh_firsttd = nullptr;
+}
+
+/*
+ * Waits until the HC no longer uses anything we removed from the asynchronous
+ * schedule; it will signal this by the 'async advance' interrupt.
+ */
+void
+EHCI_HCD::WaitForAsyncAdvance()
+{
+	mutex_lock(&ehci_doorbell_mtx);
+	ehci_Resources.Write4(EHCI_USBCMD, ehci_Resources.Read4(EHCI_USBCMD) | EHCI_CMD_IAAD);
+	int n = 100;
+	while (n > 0 && !sem_trywait(&ehci_doorbell_sem)) {
+		delay(1);
+		n--;
+	}
+	if (n == 0)
+		Printf("timeout waiting for async advance");
+	mutex_unlock(&ehci_doorbell_mtx);
+}
+
+/* Fills out the endpoint characteristics of the QH; the QH must not be in use */
+void
+EHCI_HCD::SetupEndpoint(Transfer& xfer, EHCI::HCD_QH& qh)
+{
+	USBDevice& usb_dev = xfer.t_device;
+	int speed = EHCI_EPS_FULL;
+	if (usb_dev.ud_flags & USB_DEVICE_FLAG_HIGH_SPEED)
+		speed = EHCI_EPS_HIGH;
+	else if (usb_dev.ud_flags & USB_DEVICE_FLAG_LOW_SPEED)
+		speed = EHCI_EPS_LOW;
+
+	uint32_t endp =
+	 EHCI_QH_ENDP_DEVADDR(xfer.t_address) |
+	 EHCI_QH_ENDP_ENDPT(xfer.t_endpoint) |
+	 EHCI_QH_ENDP_EPS(speed) |
+	 EHCI_QH_ENDP_MPL(EHCI::GetMaxPacketSize(xfer));
+	if (xfer.t_type == TRANSFER_TYPE_CONTROL) {
+		/* Control transfers have fixed DATA0/1 types, which we set in the qTD's */
+		endp |= EHCI_QH_ENDP_DTC;
+		if (speed != EHCI_EPS_HIGH)
+			endp |= EHCI_QH_ENDP_C;
+	}
+	if (speed == EHCI_EPS_HIGH && xfer.t_type != TRANSFER_TYPE_INTERRUPT)
+		endp |= EHCI_QH_ENDP_RL(4); /* NAK count reload; must be zero for periodic QH's */
+
+	uint32_t caps = EHCI_QH_CAPS_MULT(1);
+	if (speed != EHCI_EPS_HIGH) {
+		/* Split transaction; locate the high-speed hub whose transaction translator we use */
+		for (USBDevice* dev = &usb_dev; dev->ud_hub != nullptr; /* nothing */) {
+			USBDevice& hub_dev = dev->ud_hub->GetUSBDevice();
+			if (hub_dev.ud_flags & USB_DEVICE_FLAG_HIGH_SPEED) {
+				caps |= EHCI_QH_CAPS_HUBADDR(hub_dev.ud_address) | EHCI_QH_CAPS_PORT(dev->ud_port);
+				break;
+			}
+			dev = &hub_dev;
+		}
+	}
+	if (xfer.t_type == TRANSFER_TYPE_INTERRUPT) {
+		/* Start in the first micro-frame; complete splits in the ones after that */
+		caps |= EHCI_QH_CAPS_SMASK(0x01);
+		if (speed != EHCI_EPS_HIGH)
+			caps |= EHCI_QH_CAPS_CMASK(0x1c);
+	}
+
+	qh.qh_qh.qh_endp = endp;
+	qh.qh_qh.qh_caps = caps;
+}
+
+errorcode_t
+EHCI_HCD::SetupTransfer(Transfer& xfer)
+{
+	auto& usb_dev = xfer.t_device;
+
+	/* If this is the root hub, there's nothing to set up */
+	if (usb_dev.ud_flags & USB_DEVICE_FLAG_ROOT_HUB)
+		return ananas_success();
+
+	/*
+	 * Create the queue head; we'll hook the qTD's to it once the transfer is
+	 * scheduled. It won't do anything until then, as the overlay is inactive
+	 * and has no next qTD.
+	 */
+	EHCI::HCD_QH* qh = AllocateQH();
+	if (qh == nullptr)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	qh->qh_xfer = &xfer;
+	SetupEndpoint(xfer, *qh);
+	xfer.t_hcd = qh;
+
+	Lock();
+	switch(xfer.t_type) {
+		case TRANSFER_TYPE_CONTROL:
+		case TRANSFER_TYPE_BULK:
+			EHCI::EnqueueQH(*ehci_async_qh, *qh);
+			break;
+		case TRANSFER_TYPE_INTERRUPT:
+			EHCI::EnqueueQH(*ehci_periodic_qh, *qh);
+			break;
+		default:
+			panic("implement type %d", xfer.t_type);
+	}
+	LIST_APPEND_IP(&ehci_active_qhs, active, qh);
+	Unlock();
+	return ananas_success();
+}
+
+errorcode_t
+EHCI_HCD::TearDownTransfer(Transfer& xfer)
+{
+	auto& usb_dev = xfer.t_device;
+	usb_dev.AssertLocked();
+
+	auto qh = static_cast<EHCI::HCD_QH*>(xfer.t_hcd);
+	if (qh == nullptr)
+		return ananas_success();
+
+	/* Remove ourselves from the schedule and our own administration */
+	Lock();
+	EHCI::DequeueQH(*qh);
+	qh->qh_scheduled = false;
+	LIST_REMOVE_IP(&ehci_active_qhs, active, qh);
+	Unlock();
+
+	/* Ensure the HC is done with the QH before we kill it */
+	if (xfer.t_type == TRANSFER_TYPE_INTERRUPT)
+		delay(2); /* the periodic schedule is re-read every frame */
+	else
+		WaitForAsyncAdvance();
+
+	FreeTDsFromTransfer(xfer);
+	FreeQH(qh);
+	xfer.t_hcd = nullptr;
+	return ananas_success();
+}
+
+/*
+ * Creates the qTD's that move the transfer data, linked to one-another; td_alt
+ * is where the HC continues on a short packet. Every qTD but the last has a
+ * length that is an even number of packets, so the data toggle of each one
+ * starts at the same value.
+ */
+EHCI::HCD_TD*
+EHCI_HCD::CreateDataTDs(Transfer& xfer, int pid, EHCI::HCD_TD* td_alt, EHCI::HCD_TD*& td_last)
+{
+	addr_t va = (addr_t)&xfer.t_data[0];
+	size_t left = xfer.t_length;
+	EHCI::HCD_TD* td_first = nullptr;
+	td_last = nullptr;
+	do {
+		size_t len = (left < EHCI_QTD_MAX_LENGTH) ? left : EHCI_QTD_MAX_LENGTH;
+
+		EHCI::HCD_TD* td = AllocateTD();
+		KASSERT(td != nullptr, "out of tds");
+		td->td_length = len;
+		td->td_qtd.qtd_token =
+		 EHCI_QTD_STATUS_ACTIVE |
+		 EHCI_QTD_CERR(3) |
+		 EHCI_QTD_PID(pid) |
+		 EHCI_QTD_BYTES(len) |
+		 EHCI_QTD_DT; /* only used by control transfers, where data starts at DATA1 */
+		td->td_qtd.qtd_altnext = (td_alt != nullptr) ? EHCI::GetPhysicalAddress(*td_alt) : EHCI_LINK_T;
+
+		/* The first buffer pointer may have an offset; the others must be page-aligned */
+		addr_t page = va & ~(PAGE_SIZE - 1);
+		td->td_qtd.qtd_buffer[0] = KVTOP(va); /* XXX64 */
+		for (unsigned int n = 1; n < EHCI_QTD_NUM_BUFFERS && page + n * PAGE_SIZE < va + len; n++)
+			td->td_qtd.qtd_buffer[n] = KVTOP(page + n * PAGE_SIZE); /* XXX64 */
+
+		if (td_last != nullptr) {
+			td_last->td_qtd.qtd_next = EHCI::GetPhysicalAddress(*td);
+			td_last->li_next = td;
+		} else
+			td_first = td;
+		td_last = td;
+
+		va += len;
+		left -= len;
+	} while (left > 0);
+	return td_first;
+}
+
+void
+EHCI_HCD::CreateTDs(Transfer& xfer)
+{
+	auto qh = static_cast<struct EHCI::HCD_QH*>(xfer.t_hcd);
+	bool is_read = (xfer.t_flags & TRANSFER_FLAG_READ) != 0;
+
+	KASSERT(qh != nullptr, "CreateTDs() without qh?");
+	KASSERT(qh->qh_firsttd == nullptr, "CreateTDs() with TD's");
+
+	/* The address and control packet size change during attachment */
+	SetupEndpoint(xfer, *qh);
+
+	EHCI::HCD_TD* td_head;
+	if (xfer.t_type == TRANSFER_TYPE_CONTROL) {
+		/* Control transfer: setup -> (data) -> status */
+		EHCI::HCD_TD* td_status = AllocateTD();
+		td_status->td_qtd.qtd_token =
+		 EHCI_QTD_STATUS_ACTIVE |
+		 EHCI_QTD_CERR(3) |
+		 EHCI_QTD_PID(is_read ? EHCI_PID_OUT : EHCI_PID_IN) |
+		 EHCI_QTD_IOC |
+		 EHCI_QTD_DT /* DATA1 */;
+
+		EHCI::HCD_TD* td_next = td_status;
+		if (xfer.t_flags & TRANSFER_FLAG_DATA) {
+			EHCI::HCD_TD* td_last;
+			td_next = CreateDataTDs(xfer, is_read ? EHCI_PID_IN : EHCI_PID_OUT, td_status, td_last);
+			td_last->td_qtd.qtd_next = EHCI::GetPhysicalAddress(*td_status);
+			td_last->li_next = td_status;
+		}
+
+		EHCI::HCD_TD* td_setup = AllocateTD();
+		td_setup->td_qtd.qtd_token =
+		 EHCI_QTD_STATUS_ACTIVE |
+		 EHCI_QTD_CERR(3) |
+		 EHCI_QTD_PID(EHCI_PID_SETUP) |
+		 EHCI_QTD_BYTES(sizeof(struct USB_CONTROL_REQUEST)) /* DATA0 */;
+		td_setup->td_qtd.qtd_buffer[0] = KVTOP((addr_t)&xfer.t_control_req); /* XXX64 */
+		td_setup->td_qtd.qtd_next = EHCI::GetPhysicalAddress(*td_next);
+		td_setup->li_next = td_next;
+		td_head = td_setup;
+	} else {
+		/* Bulk/interrupt transfer: data; the QH keeps track of the data toggle */
+		EHCI::HCD_TD* td_last;
+		td_head = CreateDataTDs(xfer, is_read ? EHCI_PID_IN : EHCI_PID_OUT, ehci_dead_td, td_last);
+		td_last->td_qtd.qtd_token |= EHCI_QTD_IOC;
+	}
+
+	/*
+	 * Now hook our transfer to the QH; the HC picks up the first qTD as soon as
+	 * it sees the overlay is inactive with a valid next pointer. We keep the
+	 * data toggle unless the endpoint halted, as clearing that resets it.
+	 */
+	Lock();
+	qh->qh_firsttd = td_head;
+	uint32_t token = qh->qh_qh.qh_overlay.qtd_token;
+	qh->qh_qh.qh_overlay.qtd_next = EHCI::GetPhysicalAddress(*td_head);
+	qh->qh_qh.qh_overlay.qtd_altnext = EHCI_LINK_T;
+	qh->qh_qh.qh_overlay.qtd_token = (token & EHCI_QTD_STATUS_HALTED) ? 0 : (token & EHCI_QTD_DT);
+	qh->qh_scheduled = true;
+	Unlock();
+}
+
+/* We assume the USB device and transfer are locked here */
+errorcode_t
+EHCI_HCD::ScheduleTransfer(Transfer& xfer)
+{
+	auto& usb_dev = xfer.t_device;
+	usb_dev.AssertLocked();
+
+	/*
+	 * Add the transfer to our pending list; this is done so we can cancel any
+	 * pending transfers when a device is removed, for example.
+	 */
+	KASSERT((xfer.t_flags & TRANSFER_FLAG_PENDING) == 0, "scheduling transfer that is already pending (%x)", xfer.t_flags);
+	xfer.t_flags |= TRANSFER_FLAG_PENDING;
+	LIST_APPEND_IP(&usb_dev.ud_transfers, pending, &xfer);
+
+	/* If this is the root hub, immediately transfer the request to it */
+	if (usb_dev.ud_flags & USB_DEVICE_FLAG_ROOT_HUB)
+		return ehci_RootHub->HandleTransfer(xfer);
+
+	/* Get rid of the previous run's qTD's; the HC is done with them */
+	FreeTDsFromTransfer(xfer);
+	CreateTDs(xfer);
+	return ananas_success();
+}
+
+/* We assume the USB device and transfer are locked here */
+errorcode_t
+EHCI_HCD::CancelTransfer(Transfer& xfer)
+{
+	auto& usb_dev = xfer.t_device;
+	usb_dev.AssertLocked();
+
+	if (xfer.t_flags & TRANSFER_FLAG_PENDING) {
+		xfer.t_flags &= ~TRANSFER_FLAG_PENDING;
+		LIST_REMOVE_IP(&usb_dev.ud_transfers, pending, &xfer);
+	}
+
+	/*
+	 * Deactivate whatever is left of the transfer; we can't free the qTD's as
+	 * the HC may still be working on the current one - we'll do that once the
+	 * transfer is scheduled again or torn down. XXX the current qTD may still
+	 * complete.
+	 */
+	auto qh = static_cast<EHCI::HCD_QH*>(xfer.t_hcd);
+	if (qh != nullptr) {
+		Lock();
+		qh->qh_scheduled = false;
+		for (EHCI::HCD_TD* td = qh->qh_firsttd; td != nullptr; td = td->li_next)
+			td->td_qtd.qtd_token &= ~EHCI_QTD_STATUS_ACTIVE;
+		Unlock();
+	}
+
+	return ananas_success();
+}
+
+/* Asks the BIOS to release the controller, if it claims it */
+void
+EHCI_HCD::TakeOwnership(uint32_t hccparams)
+{
+	for (unsigned int eecp = EHCI_HCCPARAMS_EECP(hccparams); eecp >= 0x40; /* nothing */) {
+		uint32_t legsup = pci_read_cfg(*this, eecp + EHCI_PCI_USBLEGSUP, 32);
+		if (EHCI_LEGSUP_CAPID(legsup) != EHCI_LEGSUP_CAPID_LEGACY) {
+			eecp = EHCI_LEGSUP_NEXT(legsup);
+			continue;
+		}
+
+		if (legsup & EHCI_LEGSUP_BIOSOWNED) {
+			pci_write_cfg(*this, eecp + EHCI_PCI_USBLEGSUP + 3, 1, 8); /* OS owned semaphore */
+			int n = 100;
+			while (n > 0 && (pci_read_cfg(*this, eecp + EHCI_PCI_USBLEGSUP, 32) & EHCI_LEGSUP_BIOSOWNED)) {
+				delay(10);
+				n--;
+			}
+			if (n == 0)
+				Printf("bios does not release controller, continuing anyway");
+		}
+
+		/* We do not want any SMI's */
+		pci_write_cfg(*this, eecp + EHCI_PCI_USBLEGCTLSTS, 0, 32);
+		break;
+	}
+}
+
+errorcode_t
+EHCI_HCD::Setup()
+{
+	/* Create the pools our qTD's and QH's come from */
+	errorcode_t err = ehci_td_pool.Initialize(d_DMA_tag, "ehci-td", sizeof(struct EHCI::HCD_TD), EHCI_NUM_INITIAL_TDS);
+	ANANAS_ERROR_RETURN(err);
+	err = ehci_qh_pool.Initialize(d_DMA_tag, "ehci-qh", sizeof(struct EHCI::HCD_QH), EHCI_NUM_INITIAL_QHS);
+	ANANAS_ERROR_RETURN(err);
+
+	/* The dead TD is never active and ends the chain */
+	ehci_dead_td = AllocateTD();
+	KASSERT(ehci_dead_td != nullptr, "out of tds");
+
+	/*
+	 * Create the head of the asynchronous schedule; it links to itself and is
+	 * never executed as its overlay is halted.
+	 */
+	ehci_async_qh = AllocateQH();
+	KASSERT(ehci_async_qh != nullptr, "out of qhs");
+	ehci_async_qh->qh_qh.qh_link = EHCI::GetPhysicalAddress(*ehci_async_qh) | EHCI_LINK_TYPE_QH;
+	ehci_async_qh->qh_qh.qh_endp = EHCI_QH_ENDP_H | EHCI_QH_ENDP_EPS(EHCI_EPS_HIGH);
+	ehci_async_qh->qh_qh.qh_overlay.qtd_token = EHCI_QTD_STATUS_HALTED;
+
+	/* Create the periodic list; every frame visits the same QH, which does nothing itself */
+	ehci_periodic_qh = AllocateQH();
+	KASSERT(ehci_periodic_qh != nullptr, "out of qhs");
+	ehci_periodic_qh->qh_qh.qh_endp = EHCI_QH_ENDP_EPS(EHCI_EPS_HIGH);
+	ehci_periodic_qh->qh_qh.qh_overlay.qtd_token = EHCI_QTD_STATUS_HALTED;
+
+	err = dma_buf_alloc(d_DMA_tag, EHCI_FRAMELIST_LEN * sizeof(uint32_t), &ehci_framelist_buf);
+	ANANAS_ERROR_RETURN(err);
+	ehci_framelist = static_cast<uint32_t*>(dma_buf_get_segment(ehci_framelist_buf, 0)->s_virt);
+	KASSERT((((addr_t)ehci_framelist) & (PAGE_SIZE - 1)) == 0, "framelist misaligned");
+	for (unsigned int n = 0; n < EHCI_FRAMELIST_LEN; n++)
+		ehci_framelist[n] = EHCI::GetPhysicalAddress(*ehci_periodic_qh) | EHCI_LINK_TYPE_QH;
+	return ananas_success();
+}
+
+errorcode_t
+EHCI_HCD::Attach()
+{
+	void* res_mem = d_ResourceSet.AllocateResource(Ananas::Resource::RT_Memory, 4096);
+	void* res_irq = d_ResourceSet.AllocateResource(Ananas::Resource::RT_IRQ, 0);
+	if (res_mem == nullptr || res_irq == nullptr)
+		return ANANAS_ERROR(NO_RESOURCE);
+	pci_enable_busmaster(*this, 1);
+
+	auto capbase = static_cast<uint8_t*>(res_mem);
+	uint8_t caplength = *(volatile uint8_t*)(capbase + EHCI_CAPLENGTH);
+	uint32_t hcsparams = *(volatile uint32_t*)(capbase + EHCI_HCSPARAMS);
+	uint32_t hccparams = *(volatile uint32_t*)(capbase + EHCI_HCCPARAMS);
+	ehci_numports = EHCI_HCSPARAMS_N_PORTS(hcsparams);
+	ehci_port_power = (hcsparams & EHCI_HCSPARAMS_PPC) != 0;
+	if (ehci_numports < 1 || ehci_numports > 15) {
+		Printf("invalid number of %d port(s) present", ehci_numports);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+
+	/* Allocate DMA tags; we do not use the 64-bit extensions */
+	errorcode_t err = dma_tag_create(d_Parent->d_DMA_tag, *this, &d_DMA_tag, 1, 0, DMA_ADDR_MAX_32BIT, 1, DMA_SEGS_MAX_SIZE);
+	ANANAS_ERROR_RETURN(err);
+
+	ehci_Resources = EHCI::HCD_Resources(capbase + caplength);
+	mutex_init(&ehci_mtx, "ehci");
+	mutex_init(&ehci_doorbell_mtx, "ehcidb");
+	sem_init(&ehci_doorbell_sem, 0);
+	LIST_INIT(&ehci_active_qhs);
+
+	TakeOwnership(hccparams);
+
+	/* Stop the controller, if it's running, and reset it */
+	ehci_Resources.Write4(EHCI_USBINTR, 0);
+	ehci_Resources.Write4(EHCI_USBCMD, ehci_Resources.Read4(EHCI_USBCMD) & ~EHCI_CMD_RS);
+	int n = 20;
+	while (n > 0 && (ehci_Resources.Read4(EHCI_USBSTS) & EHCI_STS_HCHALTED) == 0) {
+		delay(1);
+		n--;
+	}
+	ehci_Resources.Write4(EHCI_USBCMD, EHCI_CMD_HCRESET);
+	n = 100;
+	while (n > 0 && (ehci_Resources.Read4(EHCI_USBCMD) & EHCI_CMD_HCRESET) != 0) {
+		delay(1);
+		n--;
+	}
+	if (n == 0) {
+		Printf("stuck in reset, giving up");
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+
+	/* Initialize the structures */
+	err = Setup();
+	ANANAS_ERROR_RETURN(err);
+
+	/* Set up the interrupt handler */
+	err = irq_register((uintptr_t)res_irq, this, &IRQWrapper, IRQ_TYPE_DEFAULT, NULL);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Hand the schedules to the HC and start it */
+	if (hccparams & EHCI_HCCPARAMS_64BIT)
+		ehci_Resources.Write4(EHCI_CTRLDSSEGMENT, 0);
+	ehci_Resources.Write4(EHCI_PERIODICLISTBASE, dma_buf_get_segment(ehci_framelist_buf, 0)->s_phys);
+	ehci_Resources.Write4(EHCI_ASYNCLISTADDR, EHCI::GetPhysicalAddress(*ehci_async_qh));
+	ehci_Resources.Write4(EHCI_USBINTR,
+	 EHCI_INTR_USBINT | EHCI_INTR_USBERRINT | EHCI_INTR_PCD | EHCI_INTR_HSE | EHCI_INTR_IAA);
+	ehci_Resources.Write4(EHCI_USBCMD,
+	 EHCI_CMD_ITC(1) /* interrupt at the end of every micro-frame */ |
+	 EHCI_CMD_FLS(EHCI_FLS_1024) | EHCI_CMD_PSE | EHCI_CMD_ASE | EHCI_CMD_RS);
+
+	/* Route all ports to us; anything that isn't high speed will be given away */
+	ehci_Resources.Write4(EHCI_CONFIGFLAG, EHCI_CONFIGFLAG_CF);
+	delay(5);
+
+	/* Power all ports, if we are to do that */
+	if (ehci_port_power) {
+		for (unsigned int port = 0; port < ehci_numports; port++) {
+			uint32_t portsc = ehci_Resources.Read4(EHCI_PORTSCx + port * 4) & ~EHCI_PORTSC_CHANGE;
+			ehci_Resources.Write4(EHCI_PORTSCx + port * 4, portsc | EHCI_PORTSC_PP);
+		}
+		delay(20);
+	}
+
+	return ananas_success();
+}
+
+errorcode_t
+EHCI_HCD::Detach()
+{
+	panic("Detach");
+	return ananas_success();
+}
+
+void
+EHCI_HCD::SetRootHub(USB::USBDevice& dev)
+{
+	KASSERT(ehci_RootHub == nullptr, "roothub is already set");
+	ehci_RootHub = new EHCI::RootHub(ehci_Resources, dev, ehci_numports, ehci_port_power);
+	errorcode_t err = ehci_RootHub->Initialize();
+	(void)err; // XXX check error
+}
+
+namespace {
+
+struct EHCI_Driver : public Ananas::Driver
+{
+	EHCI_Driver()
+	 : Driver("ehci")
+	{
+	}
+
+	const char* GetBussesToProbeOn() const override
+	{
+		return "pcibus";
+	}
+
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_ClassRev, PCI_CLASSREV(PCI_CLASS_SERIAL, PCI_SUBCLASS_USB, 0x20, 0), 0xffffff00 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	bool CanAttachAsynchronously() const override
+	{
+		return true;
+	}
+
+	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
+	{
+		auto class_res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_ClassRev, 0);
+		if (class_res == nullptr) /* XXX it's a bug if this happens */
+			return nullptr;
+		uint32_t classrev = class_res->r_Base;
+
+		/* Generic EHCI USB device */
+		if (PCI_CLASS(classrev) == PCI_CLASS_SERIAL && PCI_SUBCLASS(classrev) == PCI_SUBCLASS_USB && PCI_PROGINT(classrev) == 0x20)
+			return new EHCI_HCD(cdp);
+		return nullptr;
+	}
+};
+
+} // unnamed namespace
+
+REGISTER_DRIVER(EHCI_Driver)
+
+} // namespace USB
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,166 @@
+#ifndef __ANANAS_EHCI_HCD_H__
+#define __ANANAS_EHCI_HCD_H__
+
+#include <ananas/types.h>
+#include <ananas/irq.h>
+#include <ananas/thread.h>
+#include <ananas/dma.h>
+#include "../core/dma-pool.h"
+
+/* Number of qTD's/QH's we allocate up front */
+#define EHCI_NUM_INITIAL_TDS 64
+#define EHCI_NUM_INITIAL_QHS 32
+
+/* Largest amount of data a single qTD moves; it must not cross more than 4 page boundaries */
+#define EHCI_QTD_MAX_LENGTH (16 * 1024)
+
+namespace Ananas {
+namespace USB {
+
+class Transfer;
+class USBDevice;
+
+namespace EHCI {
+
+struct HCD_TD {
+	struct EHCI_QTD td_qtd;
+	uint32_t td_phys;
+	uint32_t td_length; /* data bytes, or 0 for SETUP/status stages */
+	LIST_FIELDS(struct HCD_TD);
+};
+
+struct HCD_QH {
+	struct EHCI_QH qh_qh;
+	uint32_t qh_phys;
+	/* Virtual addresses of the qTD chain */
+	struct HCD_TD* qh_firsttd;
+	/* Virtual addresses of the QH chain */
+	struct HCD_QH* qh_prevqh;
+	struct HCD_QH* qh_nextqh;
+	Transfer* qh_xfer;
+	bool qh_scheduled; /* transfer is in progress */
+	/* Active queue fields; used by OnIRQ() to check all active transfers */
+	LIST_FIELDS_IT(struct HCD_QH, active);
+};
+
+LIST_DEFINE(HCD_QH_QUEUE, struct HCD_QH);
+
+class HCD_Resources
+{
+public:
+	HCD_Resources()
+	 : ehci_opbase(nullptr)
+	{
+	}
+
+	HCD_Resources(uint8_t* opbase)
+	 : ehci_opbase(opbase)
+	{
+	}
+
+	inline void Write4(unsigned int reg, uint32_t value)
+	{
+		*(volatile uint32_t*)(ehci_opbase + reg) = value;
+	}
+
+	inline uint32_t Read4(unsigned int reg)
+	{
+		return *(volatile uint32_t*)(ehci_opbase + reg);
+	}
+
+private:
+	/* Operational registers */
+	volatile uint8_t* ehci_opbase;
+};
+
+class RootHub;
+
+} // namespace EHCI
+
+class EHCI_HCD : public Ananas::Device, private Ananas::IDeviceOperations, private Ananas::IUSBDeviceOperations
+{
+public:
+	using Device::Device;
+	virtual ~EHCI_HCD() = default;
+
+	IDeviceOperations& GetDeviceOperations() override
+	{
+		return *this;
+	}
+
+	IUSBDeviceOperations* GetUSBDeviceOperations() override
+	{
+		return this;
+	}
+
+	errorcode_t Attach() override;
+	errorcode_t Detach() override;
+	void DebugDump() override
+	{
+		Dump();
+	}
+
+	errorcode_t SetupTransfer(Transfer& xfer) override;
+	errorcode_t TearDownTransfer(Transfer& xfer) override;
+	errorcode_t ScheduleTransfer(Transfer& xfer) override;
+	errorcode_t CancelTransfer(Transfer& xfer) override;
+	void SetRootHub(USB::USBDevice& dev) override;
+
+protected:
+	void Dump();
+	errorcode_t Setup();
+	void TakeOwnership(uint32_t hccparams);
+
+	void CreateTDs(Transfer& xfer);
+
+private:
+	void Lock()
+	{
+		mutex_lock(&ehci_mtx);
+	}
+
+	void Unlock()
+	{
+		mutex_unlock(&ehci_mtx);
+	}
+
+	EHCI::HCD_TD* AllocateTD();
+	EHCI::HCD_QH* AllocateQH();
+	void FreeTD(EHCI::HCD_TD* td);
+	void FreeQH(EHCI::HCD_QH* qh);
+	void FreeTDsFromTransfer(Transfer& xfer);
+	EHCI::HCD_TD* CreateDataTDs(Transfer& xfer, int pid, EHCI::HCD_TD* td_alt, EHCI::HCD_TD*& td_last);
+	void SetupEndpoint(Transfer& xfer, EHCI::HCD_QH& qh);
+	void WaitForAsyncAdvance();
+
+	void OnIRQ();
+
+	static irqresult_t IRQWrapper(Ananas::Device* device, void* context)
+	{
+		auto ehci = static_cast<EHCI_HCD*>(device);
+		ehci->OnIRQ();
+		return IRQ_RESULT_PROCESSED;
+	}
+
+	dma_buf_t ehci_framelist_buf;
+	uint32_t* ehci_framelist = nullptr;
+	struct EHCI::HCD_QH* ehci_async_qh = nullptr;	/* head of the asynchronous schedule */
+	struct EHCI::HCD_QH* ehci_periodic_qh = nullptr;	/* every frame list entry points here */
+	struct EHCI::HCD_TD* ehci_dead_td = nullptr;	/* inactive qTD to stop at on short packets */
+	struct EHCI::HCD_QH_QUEUE ehci_active_qhs;
+	mutex_t ehci_mtx;
+	mutex_t ehci_doorbell_mtx;
+	semaphore_t ehci_doorbell_sem;
+	DMAPool ehci_td_pool;
+	DMAPool ehci_qh_pool;
+
+	unsigned int ehci_numports = 0;
+	bool ehci_port_power = false;
+	EHCI::HCD_Resources ehci_Resources;
+	EHCI::RootHub* ehci_RootHub = nullptr;
+};
+
+} // namespace USB
+} // namespace Ananas
+
+#endif /* __ANANAS_EHCI_HCD_H__ */
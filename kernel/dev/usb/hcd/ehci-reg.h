@@ -0,0 +1,128 @@
+#ifndef __EHCI_REG_H__
+#define __EHCI_REG_H__
+
+/* PCI configuration space */
+#define EHCI_PCI_USBLEGSUP	0x00	/* relative to EECP */
+# define EHCI_LEGSUP_CAPID(x)	((x) & 0xff)
+#  define EHCI_LEGSUP_CAPID_LEGACY	1
+# define EHCI_LEGSUP_NEXT(x)	(((x) >> 8) & 0xff)
+# define EHCI_LEGSUP_BIOSOWNED	(1 << 16)
+# define EHCI_LEGSUP_OSOWNED	(1 << 24)
+#define EHCI_PCI_USBLEGCTLSTS	0x04	/* relative to EECP */
+
+/* Capability registers */
+#define EHCI_CAPLENGTH		0x00
+#define EHCI_HCIVERSION		0x02
+#define EHCI_HCSPARAMS		0x04
+# define EHCI_HCSPARAMS_N_PORTS(x)	((x) & 0xf)
+# define EHCI_HCSPARAMS_PPC		(1 << 4)
+#define EHCI_HCCPARAMS		0x08
+# define EHCI_HCCPARAMS_64BIT		(1 << 0)
+# define EHCI_HCCPARAMS_EECP(x)		(((x) >> 8) & 0xff)
+
+/* Operational registers; relative to the capability length */
+#define EHCI_USBCMD		0x00
+# define EHCI_CMD_RS		(1 << 0)	/* Run/Stop */
+# define EHCI_CMD_HCRESET	(1 << 1)	/* Host Controller Reset */
+# define EHCI_CMD_FLS(x)	((x) << 2)	/* Frame List Size */
+#  define EHCI_FLS_1024		0
+# define EHCI_CMD_PSE		(1 << 4)	/* Periodic Schedule Enable */
+# define EHCI_CMD_ASE		(1 << 5)	/* Asynchronous Schedule Enable */
+# define EHCI_CMD_IAAD		(1 << 6)	/* Interrupt on Async Advance Doorbell */
+# define EHCI_CMD_ITC(x)	((x) << 16)	/* Interrupt Threshold Control, in micro-frames */
+#define EHCI_USBSTS		0x04
+# define EHCI_STS_USBINT	(1 << 0)
+# define EHCI_STS_USBERRINT	(1 << 1)
+# define EHCI_STS_PCD		(1 << 2)	/* Port Change Detect */
+# define EHCI_STS_FLR		(1 << 3)	/* Frame List Rollover */
+# define EHCI_STS_HSE		(1 << 4)	/* Host System Error */
+# define EHCI_STS_IAA		(1 << 5)	/* Interrupt on Async Advance */
+# define EHCI_STS_HCHALTED	(1 << 12)
+# define EHCI_STS_INTMASK	0x3f
+#define EHCI_USBINTR		0x08
+# define EHCI_INTR_USBINT	(1 << 0)
+# define EHCI_INTR_USBERRINT	(1 << 1)
+# define EHCI_INTR_PCD		(1 << 2)
+# define EHCI_INTR_FLR		(1 << 3)
+# define EHCI_INTR_HSE		(1 << 4)
+# define EHCI_INTR_IAA		(1 << 5)
+#define EHCI_FRINDEX		0x0c
+#define EHCI_CTRLDSSEGMENT	0x10
+#define EHCI_PERIODICLISTBASE	0x14
+#define EHCI_ASYNCLISTADDR	0x18
+#define EHCI_CONFIGFLAG		0x40
+# define EHCI_CONFIGFLAG_CF	(1 << 0)	/* Route all ports to us */
+#define EHCI_PORTSCx		0x44
+# define EHCI_PORTSC_CCS	(1 << 0)	/* Current Connect Status */
+# define EHCI_PORTSC_CSC	(1 << 1)	/* Connect Status Change */
+# define EHCI_PORTSC_PE		(1 << 2)	/* Port Enabled */
+# define EHCI_PORTSC_PEC	(1 << 3)	/* Port Enable Change */
+# define EHCI_PORTSC_OCA	(1 << 4)	/* Over-current Active */
+# define EHCI_PORTSC_OCC	(1 << 5)	/* Over-current Change */
+# define EHCI_PORTSC_FPR	(1 << 6)	/* Force Port Resume */
+# define EHCI_PORTSC_SUSP	(1 << 7)	/* Suspend */
+# define EHCI_PORTSC_PR		(1 << 8)	/* Port Reset */
+# define EHCI_PORTSC_LS(x)	(((x) >> 10) & 3)	/* Line Status */
+#  define EHCI_LS_KSTATE	1		/* low-speed device */
+# define EHCI_PORTSC_PP		(1 << 12)	/* Port Power */
+# define EHCI_PORTSC_PO		(1 << 13)	/* Port Owner; set hands the port to a companion */
+# define EHCI_PORTSC_CHANGE	(EHCI_PORTSC_CSC | EHCI_PORTSC_PEC | EHCI_PORTSC_OCC) /* write-to-clear */
+
+#define EHCI_FRAMELIST_LEN	1024
+
+/* Link pointers */
+#define EHCI_LINK_T		(1 << 0)	/* Terminate */
+#define EHCI_LINK_TYPE_QH	(1 << 1)
+
+/* Queue element transfer descriptor */
+struct EHCI_QTD {
+	uint32_t	qtd_next;
+	uint32_t	qtd_altnext;
+	uint32_t	qtd_token;
+#define EHCI_QTD_STATUS_PING		(1 << 0)
+#define EHCI_QTD_STATUS_XACTERR		(1 << 3)
+#define EHCI_QTD_STATUS_BABBLE		(1 << 4)
+#define EHCI_QTD_STATUS_BUFERR		(1 << 5)
+#define EHCI_QTD_STATUS_HALTED		(1 << 6)
+#define EHCI_QTD_STATUS_ACTIVE		(1 << 7)
+#define EHCI_QTD_STATUS_ERRMASK		(EHCI_QTD_STATUS_XACTERR | EHCI_QTD_STATUS_BABBLE | EHCI_QTD_STATUS_BUFERR | EHCI_QTD_STATUS_HALTED)
+#define EHCI_QTD_PID(x)			((x) << 8)
+# define EHCI_PID_OUT			0
+# define EHCI_PID_IN			1
+# define EHCI_PID_SETUP			2
+#define EHCI_QTD_CERR(x)		((x) << 10)
+#define EHCI_QTD_IOC			(1 << 15)
+#define EHCI_QTD_BYTES(x)		((x) << 16)
+#define EHCI_QTD_GET_BYTES(x)		(((x) >> 16) & 0x7fff)
+#define EHCI_QTD_DT			(1U << 31)
+	uint32_t	qtd_buffer[5];
+#define EHCI_QTD_NUM_BUFFERS		5
+	uint32_t	qtd_buffer_hi[5];
+} __attribute__((packed));
+
+/* Queue head */
+struct EHCI_QH {
+	uint32_t	qh_link;
+	uint32_t	qh_endp;
+#define EHCI_QH_ENDP_DEVADDR(x)		(x)
+#define EHCI_QH_ENDP_ENDPT(x)		((x) << 8)
+#define EHCI_QH_ENDP_EPS(x)		((x) << 12)
+# define EHCI_EPS_FULL			0
+# define EHCI_EPS_LOW			1
+# define EHCI_EPS_HIGH			2
+#define EHCI_QH_ENDP_DTC		(1 << 14)	/* Data toggle comes from the qTD */
+#define EHCI_QH_ENDP_H			(1 << 15)	/* Head of reclamation list */
+#define EHCI_QH_ENDP_MPL(x)		((x) << 16)
+#define EHCI_QH_ENDP_C			(1 << 27)	/* Control endpoint, not high speed */
+#define EHCI_QH_ENDP_RL(x)		((x) << 28)
+	uint32_t	qh_caps;
+#define EHCI_QH_CAPS_SMASK(x)		(x)
+#define EHCI_QH_CAPS_CMASK(x)		((x) << 8)
+#define EHCI_QH_CAPS_HUBADDR(x)		((x) << 16)
+#define EHCI_QH_CAPS_PORT(x)		((x) << 23)
+#define EHCI_QH_CAPS_MULT(x)		((x) << 30)
+	uint32_t	qh_current;
+	struct EHCI_QTD	qh_overlay;
+} __attribute__((packed));
+
+#endif /* __EHCI_REG_H__ */
@@ -0,0 +1,467 @@
+/*
+ * EHCI root hub
+ *
+ * The EHCI root hub has no descriptors of its own, so we make them up. Ports
+ * which turn out not to have a high-speed device are handed to the companion
+ * controller while resetting them; as far as we are concerned, the device is
+ * gone then.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/trace.h>
+#include <ananas/thread.h>
+#include <ananas/schedule.h>
+#include <ananas/time.h>
+#include <ananas/lib.h>
+#include <ananas/mm.h>
+#include "../core/descriptor.h"
+#include "../core/usb-core.h"
+#include "../core/usb-bus.h"
+#include "../core/usb-device.h"
+#include "../core/usb-transfer.h"
+#include "ehci-reg.h"
+#include "ehci-hcd.h"
+#include "ehci-roothub.h"
+
+TRACE_SETUP;
+
+namespace Ananas {
+namespace USB {
+namespace EHCI {
+namespace {
+
+#if 0
+# define DPRINTF(s,...) kprintf(s"\n", __VA_ARGS__)
+#else
+# define DPRINTF(...)
+#endif
+
+const struct USB_DESCR_DEVICE ehci_rh_device = {
+	.dev_length = sizeof(struct USB_DESCR_DEVICE),
+	.dev_type = 0,
+	.dev_version = 0x200,
+	.dev_class = USB_DESCR_CLASS_HUB,
+	.dev_subclass = 0,
+	.dev_protocol = 1, /* single TT */
+	.dev_maxsize0 = 64,
+	.dev_vendor = 0,
+	.dev_product = 0,
+	.dev_release = 0,
+	.dev_manufactureridx = 2,
+	.dev_productidx = 1,
+	.dev_serialidx = 0,
+	.dev_num_configs = 1,
+};
+
+const struct ehci_rh_string {
+	uint8_t s_len, s_type;
+	uint16_t s_string[13];
+} ehci_rh_strings[] = {
+	/* supported languages */
+	{
+		.s_len = 4,
+		.s_type = USB_DESCR_TYPE_STRING,
+		.s_string = {
+			1033
+		}
+	},
+	/* Product ID */
+	{
+		.s_len = 28,
+		.s_type = USB_DESCR_TYPE_STRING,
+		.s_string = {
+			'E', 'H', 'C', 'I', ' ',
+			'r', 'o', 'o', 't', ' ',
+			'h', 'u', 'b'
+		}
+	},
+	/* Vendor ID */
+	{
+		.s_len = 14,
+		.s_type = USB_DESCR_TYPE_STRING,
+		.s_string = {
+			'A', 'n', 'a', 'n', 'a', 's'
+		}
+	},
+};
+
+struct {
+	struct USB_DESCR_CONFIG d_config;
+	struct USB_DESCR_INTERFACE d_interface;
+	struct USB_DESCR_ENDPOINT d_endpoint;
+} __attribute__((packed)) const ehci_rh_config = {
+	/* Configuration */
+	{
+		.cfg_length = sizeof(struct USB_DESCR_CONFIG),
+		.cfg_type = USB_DESCR_TYPE_CONFIG,
+		.cfg_totallen = sizeof(ehci_rh_config),
+		.cfg_numinterfaces = 1,
+		.cfg_identifier = 0,
+		.cfg_stringidx = 0,
+		.cfg_attrs = 0x40, /* self-powered */
+		.cfg_maxpower = 0,
+	},
+	/* Interface */
+	{
+		.if_length = sizeof(struct USB_DESCR_INTERFACE),
+		.if_type = USB_DESCR_TYPE_INTERFACE,
+		.if_number = 1,
+		.if_altsetting = 0,
+		.if_numendpoints = 1,
+		.if_class = USB_IF_CLASS_HUB,
+		.if_subclass = 0,
+		.if_protocol = 0,
+		.if_interfaceidx = 0,
+	},
+	/* Endpoint */
+	{
+		.ep_length = sizeof(struct USB_DESCR_ENDPOINT),
+		.ep_type = USB_DESCR_TYPE_ENDPOINT,
+		.ep_addr = USB_EP_ADDR_IN | USB_EP_ADDR(1),
+		.ep_attr = USB_PE_ATTR_TYPE_INTERRUPT,
+		.ep_maxpacketsz = 8,
+		.ep_interval = 12, /* 2^(12-1) micro-frames = 256ms */
+	}
+};
+
+inline unsigned int
+GetPortRegister(unsigned int port)
+{
+	return EHCI_PORTSCx + (port - 1) * 4;
+}
+
+} // unnamed namespace
+
+RootHub::RootHub(HCD_Resources& hcdResources, USBDevice& device, unsigned int numports, bool port_power)
+	: rh_Resources(hcdResources), rh_Device(device), rh_numports(numports), rh_port_power(port_power)
+{
+	sem_init(&rh_semaphore, 0);
+}
+
+errorcode_t
+RootHub::ResetPort(unsigned int port)
+{
+	unsigned int reg = GetPortRegister(port);
+	uint32_t portsc = rh_Resources.Read4(reg) & ~EHCI_PORTSC_CHANGE;
+
+	/* Low-speed devices can be recognized before the reset; those aren't ours */
+	if ((portsc & EHCI_PORTSC_PE) == 0 && EHCI_PORTSC_LS(portsc) == EHCI_LS_KSTATE) {
+		DPRINTF("port %d: low speed device, releasing", port);
+		rh_Resources.Write4(reg, portsc | EHCI_PORTSC_PO);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+
+	/* Reset the port; we must deassert the reset ourselves after 50ms */
+	rh_Resources.Write4(reg, (portsc & ~EHCI_PORTSC_PE) | EHCI_PORTSC_PR);
+	delay(50);
+	rh_Resources.Write4(reg, rh_Resources.Read4(reg) & ~(EHCI_PORTSC_CHANGE | EHCI_PORTSC_PR));
+	int n = 10;
+	while (n > 0 && (rh_Resources.Read4(reg) & EHCI_PORTSC_PR) != 0) {
+		delay(1);
+		n--;
+	}
+	if (n == 0) {
+		kprintf("ehci roothub: port %u not responding to reset\n", port);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	rh_c_port_reset |= 1 << port;
+
+	/* If the port isn't enabled now, it's a full-speed device which we do not handle */
+	delay(2);
+	portsc = rh_Resources.Read4(reg) & ~EHCI_PORTSC_CHANGE;
+	if ((portsc & EHCI_PORTSC_PE) == 0) {
+		DPRINTF("port %d: full speed device, releasing", port);
+		rh_Resources.Write4(reg, portsc | EHCI_PORTSC_PO);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+RootHub::ControlTransfer(Transfer& xfer)
+{
+	struct USB_CONTROL_REQUEST* req = &xfer.t_control_req;
+	errorcode_t err = ANANAS_ERROR(BAD_OPERATION);
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+	switch(USB_REQUEST_MAKE(req->req_type, req->req_request)) {
+		case USB_REQUEST_STANDARD_GET_DESCRIPTOR:
+			switch(req->req_value >> 8) {
+				case USB_DESCR_TYPE_DEVICE: {
+					int amount = MIN(ehci_rh_device.dev_length, req->req_length);
+					memcpy(xfer.t_data, &ehci_rh_device, amount);
+					xfer.t_result_length = amount;
+					err = ananas_success();
+					break;
+				}
+				case USB_DESCR_TYPE_STRING: {
+					int string_id = req->req_value & 0xff;
+					if (string_id >= 0 && string_id < sizeof(ehci_rh_strings) / sizeof(ehci_rh_strings[0])) {
+						int amount = MIN(ehci_rh_strings[string_id].s_len, req->req_length);
+						memcpy(xfer.t_data, &ehci_rh_strings[string_id], amount);
+						xfer.t_result_length = amount;
+						err = ananas_success();
+					}
+					break;
+				}
+				case USB_DESCR_TYPE_CONFIG: {
+					int amount = MIN(ehci_rh_config.d_config.cfg_totallen, req->req_length);
+					memcpy(xfer.t_data, &ehci_rh_config, amount);
+					xfer.t_result_length = amount;
+					err = ananas_success();
+					break;
+				}
+			}
+			break;
+		case USB_REQUEST_STANDARD_SET_ADDRESS:
+			DPRINTF("set address: %d", req->req_value);
+			err = ananas_success();
+			break;
+		case USB_REQUEST_STANDARD_SET_CONFIGURATION:
+			DPRINTF("set config: %d", req->req_value);
+			err = ananas_success();
+			break;
+		case USB_REQUEST_CLEAR_HUB_FEATURE:
+			break;
+		case USB_REQUEST_SET_HUB_FEATURE:
+			break;
+		case USB_REQUEST_GET_BUS_STATE:
+			break;
+		case USB_REQUEST_GET_HUB_DESCRIPTOR: {
+			int port_len = (rh_numports + 7) / 8;
+			struct USB_DESCR_HUB hd;
+			memset(&hd, 0, sizeof(hd));
+			hd.hd_length = sizeof(hd) - (HUB_MAX_PORTS + 7) / 8 + port_len;
+			hd.hd_type = USB_DESCR_TYPE_HUB;
+			hd.hd_numports = rh_numports;
+			hd.hd_max_current = 0;
+			hd.hd_flags = USB_HD_FLAG_OC_INDIVIDUAL;
+			if (rh_port_power)
+				hd.hd_flags |= USB_HD_FLAG_PS_INDIVIDUAL;
+			hd.hd_poweron2good = 10; /* 20ms */
+
+			/* Copy the descriptor we just created */
+			int amount = MIN(hd.hd_length, req->req_length);
+			memcpy(xfer.t_data, &hd, amount);
+			xfer.t_result_length = amount;
+			err = ananas_success();
+			break;
+		}
+		case USB_REQUEST_GET_HUB_STATUS: {
+			if (req->req_value == 0 && req->req_index == 0 && req->req_length == 4) {
+				uint32_t hs = 0;
+				memcpy(xfer.t_data, &hs, sizeof(hs));
+				xfer.t_result_length = sizeof(hs);
+				err = ananas_success();
+			}
+			break;
+		}
+		case USB_REQUEST_GET_PORT_STATUS: {
+			if (req->req_value == 0 && req->req_index >= 1 && req->req_index <= rh_numports && req->req_length == 4) {
+				uint32_t portsc = rh_Resources.Read4(GetPortRegister(req->req_index));
+
+				struct USB_HUB_PORTSTATUS ps;
+				memset(&ps, 0, sizeof(ps));
+				/* Ports that belong to the companion controller are not connected as far as we care */
+				if ((portsc & (EHCI_PORTSC_CCS | EHCI_PORTSC_PO)) == EHCI_PORTSC_CCS)
+					ps.ps_portstatus |= USB_HUB_PS_PORT_CONNECTION;
+				if (portsc & EHCI_PORTSC_PE)
+					ps.ps_portstatus |= USB_HUB_PS_PORT_ENABLE | USB_HUB_PS_PORT_HIGH_SPEED; /* only high speed devices are enabled */
+				if (portsc & EHCI_PORTSC_SUSP)
+					ps.ps_portstatus |= USB_HUB_PS_PORT_SUSPEND;
+				if (portsc & EHCI_PORTSC_OCA)
+					ps.ps_portstatus |= USB_HUB_PS_PORT_OVER_CURRENT;
+				if (portsc & EHCI_PORTSC_PR)
+					ps.ps_portstatus |= USB_HUB_PS_PORT_RESET;
+				if ((portsc & EHCI_PORTSC_PP) || !rh_port_power)
+					ps.ps_portstatus |= USB_HUB_PS_PORT_POWER;
+				if (portsc & EHCI_PORTSC_CSC)
+					ps.ps_portchange |= USB_HUB_PC_C_PORT_CONNECTION;
+				if (portsc & EHCI_PORTSC_PEC)
+					ps.ps_portchange |= USB_HUB_PC_C_PORT_ENABLE;
+				if (portsc & EHCI_PORTSC_OCC)
+					ps.ps_portchange |= USB_HUB_PC_C_PORT_OVER_CURRENT;
+				if (rh_c_port_reset & (1 << req->req_index))
+					ps.ps_portchange |= USB_HUB_PC_C_PORT_RESET;
+				memcpy(xfer.t_data, &ps, sizeof(ps));
+				xfer.t_result_length = sizeof(ps);
+				err = ananas_success();
+			}
+			break;
+		}
+		case USB_REQUEST_SET_PORT_FEATURE: {
+			unsigned int port = req->req_index;
+			if (port >= 1 && port <= rh_numports) {
+				unsigned int reg = GetPortRegister(port);
+				uint32_t portsc = rh_Resources.Read4(reg) & ~EHCI_PORTSC_CHANGE;
+				err = ananas_success();
+				switch(req->req_value) {
+					case HUB_FEATURE_PORT_RESET:
+						DPRINTF("set port reset, port %d", port);
+						err = ResetPort(port);
+						break;
+					case HUB_FEATURE_PORT_SUSPEND:
+						DPRINTF("set port suspend, port %d", port);
+						rh_Resources.Write4(reg, portsc | EHCI_PORTSC_SUSP);
+						break;
+					case HUB_FEATURE_PORT_POWER:
+						DPRINTF("set port power, port %d", port);
+						if (rh_port_power)
+							rh_Resources.Write4(reg, portsc | EHCI_PORTSC_PP);
+						break;
+					default:
+						err = ANANAS_ERROR(BAD_OPERATION);
+						break;
+				}
+			}
+			break;
+		}
+		case USB_REQUEST_CLEAR_PORT_FEATURE: {
+			unsigned int port = req->req_index;
+			if (port >= 1 && port <= rh_numports) {
+				unsigned int reg = GetPortRegister(port);
+				uint32_t portsc = rh_Resources.Read4(reg) & ~EHCI_PORTSC_CHANGE;
+				err = ananas_success();
+				switch(req->req_value) {
+					case HUB_FEATURE_PORT_ENABLE:
+						DPRINTF("HUB_FEATURE_PORT_ENABLE: port %d", port);
+						rh_Resources.Write4(reg, portsc & ~EHCI_PORTSC_PE);
+						break;
+					case HUB_FEATURE_PORT_SUSPEND:
+						DPRINTF("HUB_FEATURE_PORT_SUSPEND: port %d", port);
+						if (portsc & EHCI_PORTSC_SUSP)
+							rh_Resources.Write4(reg, portsc | EHCI_PORTSC_FPR);
+						break;
+					case HUB_FEATURE_PORT_POWER:
+						DPRINTF("HUB_FEATURE_PORT_POWER: port %d", port);
+						if (rh_port_power)
+							rh_Resources.Write4(reg, portsc & ~EHCI_PORTSC_PP);
+						break;
+					case HUB_FEATURE_C_PORT_CONNECTION:
+						DPRINTF("HUB_FEATURE_C_PORT_CONNECTION: port %d", port);
+						rh_Resources.Write4(reg, portsc | EHCI_PORTSC_CSC);
+						break;
+					case HUB_FEATURE_C_PORT_RESET:
+						DPRINTF("HUB_FEATURE_C_PORT_RESET: port %d", port);
+						rh_c_port_reset &= ~(1 << port);
+						break;
+					case HUB_FEATURE_C_PORT_ENABLE:
+						DPRINTF("HUB_FEATURE_C_PORT_ENABLE: port %d", port);
+						rh_Resources.Write4(reg, portsc | EHCI_PORTSC_PEC);
+						break;
+					case HUB_FEATURE_C_PORT_SUSPEND:
+						break;
+					case HUB_FEATURE_C_PORT_OVER_CURRENT:
+						DPRINTF("HUB_FEATURE_C_PORT_OVER_CURRENT: port %d", port);
+						rh_Resources.Write4(reg, portsc | EHCI_PORTSC_OCC);
+						break;
+					default:
+						err = ANANAS_ERROR(BAD_OPERATION);
+						break;
+				}
+			}
+			break;
+		}
+		default:
+			err = ANANAS_ERROR(BAD_TYPE);
+			break;
+	}
+
+#undef MIN
+
+	if (ananas_is_failure(err)) {
+		kprintf("ehci roothub: error %d\n", err);
+		xfer.t_flags |= TRANSFER_FLAG_ERROR;
+	}
+
+	/* Immediately mark the transfer as completed */
+	xfer.Complete_Locked();
+	return err;
+}
+
+void
+RootHub::ProcessInterruptTransfers()
+{
+	/* Walk through every port, hungry for updates... */
+	uint8_t hub_update[2] = { 0, 0 }; /* max 15 ports + hub status itself = 16 bits */
+	int num_updates = 0;
+	for (unsigned int n = 1; n <= rh_numports; n++) {
+		uint32_t portsc = rh_Resources.Read4(GetPortRegister(n));
+		if ((portsc & EHCI_PORTSC_CHANGE) != 0 || (rh_c_port_reset & (1 << n)) != 0) {
+			/* A changed event was triggered - need to report this */
+			hub_update[n / 8] |= 1 << (n % 8);
+			num_updates++;
+		}
+	}
+
+	if (num_updates == 0)
+		return;
+	int update_len = (rh_numports + 1 /* hub */ + 7 /* round up */) / 8;
+
+	/* Alter all entries in the transfer queue */
+	LIST_FOREACH_IP(&rh_Device.ud_transfers, pending, xfer, Transfer) {
+		if (xfer->t_type != TRANSFER_TYPE_INTERRUPT)
+			continue;
+		memcpy(&xfer->t_data, hub_update, update_len);
+		xfer->t_result_length = update_len;
+		xfer->Complete_Locked();
+	}
+
+	rh_pending_changes = false;
+}
+
+void
+RootHub::Thread()
+{
+	while(1) {
+		/* Wait until we get a port change interrupt; that should signal something happened */
+		sem_wait_and_drain(&rh_semaphore);
+
+		rh_Device.Lock();
+		ProcessInterruptTransfers();
+		rh_Device.Unlock();
+	}
+}
+
+errorcode_t
+RootHub::HandleTransfer(Transfer& xfer)
+{
+	switch(xfer.t_type) {
+		case TRANSFER_TYPE_CONTROL:
+			return ControlTransfer(xfer);
+		case TRANSFER_TYPE_INTERRUPT:
+			/*
+			 * As with OHCI, interrupt transfers are only honored once something
+			 * changes; force processing if we already know there are changes.
+			 */
+			if (rh_pending_changes)
+				ProcessInterruptTransfers();
+			return ananas_success();
+	}
+	panic("unsupported transfer type %d", xfer.t_type);
+}
+
+void
+RootHub::OnIRQ()
+{
+	sem_signal(&rh_semaphore);
+}
+
+errorcode_t
+RootHub::Initialize()
+{
+	/*
+	 * Launch the poll thread to handle the interrupt pipe requests; we can't do
+	 * that from the HCD's Attach() because the usbbus doesn't exist at that
+	 * point and we don't know the USB device either.
+	 */
+	kthread_init(&rh_pollthread, "ehciroothub", &ThreadWrapper, this);
+	thread_resume(&rh_pollthread);
+	return ananas_success();
+}
+
+} // namespace EHCI
+} // namespace USB
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,51 @@
+#ifndef __EHCI_ROOTHUB_H__
+#define __EHCI_ROOTHUB_H__
+
+#include <ananas/device.h>
+
+namespace Ananas {
+namespace USB {
+
+class Transfer;
+class USBDevice;
+
+namespace EHCI {
+
+class HCD_Resources;
+
+class RootHub {
+public:
+	RootHub(HCD_Resources& hcdResources, USBDevice& usbDevice, unsigned int numports, bool port_power);
+	errorcode_t Initialize();
+
+	errorcode_t HandleTransfer(Transfer& xfer);
+	void OnIRQ();
+
+protected:
+	errorcode_t ControlTransfer(Transfer& xfer);
+	errorcode_t ResetPort(unsigned int port);
+	void ProcessInterruptTransfers();
+	static void ThreadWrapper(void* context)
+	{
+		(static_cast<RootHub*>(context))->Thread();
+	}
+	void Thread();
+
+private:
+	HCD_Resources& rh_Resources;
+	USBDevice& rh_Device;
+
+	unsigned int rh_numports;
+	bool rh_port_power;
+	/* EHCI has no reset change bit, so we keep track of those ourselves */
+	uint32_t rh_c_port_reset = 0;
+	semaphore_t rh_semaphore;
+	thread_t rh_pollthread;
+	bool rh_pending_changes = true;
+};
+
+} // namespace EHCI
+} // namespace USB
+} // namespace Ananas
+
+#endif /* __EHCI_ROOTHUB_H__ */
@@ -50,13 +50,13 @@ namespace OHCI {
 inline uint32_t
 GetPhysicalAddress(HCD_TD& td)
 {
-	return dma_buf_get_segment(td.td_buf, 0)->s_phys;
+	return td.td_phys;
 }
 
 inline uint32_t
 GetPhysicalAddress(HCD_ED& ed)
 {
-	return dma_buf_get_segment(ed.ed_buf, 0)->s_phys;
+	return ed.ed_phys;
 }
 
 void
@@ -111,24 +111,6 @@ DumpEDChain(HCD_ED* ed)
 	}
 }
 
-void
-FreeTD(HCD_TD* td)
-{
-	dma_buf_free(td->td_buf);
-}
-
-void
-FreeED(HCD_ED* ed)
-{
-	for (HCD_TD* td = ed->ed_headtd; td != nullptr; /* nothing */) {
-		OHCI::HCD_TD* next_td = td->li_next;
-		FreeTD(td);
-		td = next_td;
-	}
-
-	dma_buf_free(ed->ed_buf);
-}
-
 void
 SetTDNext(HCD_TD& td, HCD_TD& next)
 {
@@ -154,8 +136,30 @@ EnqueueED(HCD_ED& parent, HCD_ED& ed)
 	parent.ed_ed.ed_nexted = GetPhysicalAddress(ed);
 }
 
+} // namespace OHCI
+
 void
-FreeTDsFromTransfer(Transfer& xfer)
+OHCI_HCD::FreeTD(OHCI::HCD_TD* td)
+{
+	ohci_td_pool.Free(td, td->td_phys);
+}
+
+void
+OHCI_HCD::FreeED(OHCI::HCD_ED* ed)
+{
+	/* Note that the TD chain always ends with the tail TD, so this frees it as well */
+	OHCI::HCD_TD* td = (ed->ed_headtd != nullptr) ? ed->ed_headtd : ed->ed_tailtd;
+	while (td != nullptr) {
+		OHCI::HCD_TD* next_td = td->li_next;
+		FreeTD(td);
+		td = next_td;
+	}
+
+	ohci_ed_pool.Free(ed, ed->ed_phys);
+}
+
+void
+OHCI_HCD::FreeTDsFromTransfer(Transfer& xfer)
 {
 	auto ed = static_cast<struct OHCI::HCD_ED*>(xfer.t_hcd);
 	if (ed == nullptr)
@@ -163,18 +167,16 @@ FreeTDsFromTransfer(Transfer& xfer)
 
 	/*
 	 * We'll free all TD's here except the tail one; this basically undoes the work done by
-	 * ohci_create_tds().
+	 * CreateTDs().
 	 */
-	for (HCD_TD* td = ed->ed_headtd; td != nullptr && td != ed->ed_tailtd; /* nothing */) {
-		HCD_TD* next_td = td->li_next;
+	for (OHCI::HCD_TD* td = ed->ed_headtd; td != nullptr && td != ed->ed_tailtd; /* nothing */) {
+		OHCI::HCD_TD* next_td = td->li_next;
 		FreeTD(td);
 		td = next_td;
 	}
 	ed->ed_headtd = nullptr;
 }
 
-} // namespace OHCI
-
 void
 OHCI_HCD::Dump()
 {
@@ -249,7 +251,12 @@ OHCI_HCD::OnIRQ()
 	if (is & OHCI_IS_WDH) {
 		/*
 		 * Done queue has been updated; need to walk through all our scheduled items.
+		 * We gather everything that is finished and complete it all once we have
+		 * released our lock; completing involves the device lock, which we can't
+		 * acquire while holding ours.
 		 */
+		TransferQueue done;
+		LIST_INIT(&done);
 		Lock();
 		if (!LIST_EMPTY(&ohci_active_eds)) {
 			LIST_FOREACH_IP(&ohci_active_eds, active, ed, struct OHCI::HCD_ED) {
@@ -273,8 +280,8 @@ OHCI_HCD::OnIRQ()
 						transferred += td->td_length; /* full TD */
 					else
 						transferred += td->td_length - (td->td_td.td_be - td->td_td.td_cbp + 1); /* partial TD */
-					if (status != OHCI_TD_CC_NOERROR)
-						status = OHCI_TD_CC(td->td_td.td_flags);
+					if (status == OHCI_TD_CC_NOERROR)
+						status = (td->td_td.td_flags >> 28) & 0xf; /* CC field */
 				}
 
 				Transfer& xfer = *ed->ed_xfer;
@@ -282,10 +289,13 @@ OHCI_HCD::OnIRQ()
 				xfer.t_result_length = transferred;
 				if (status != OHCI_TD_CC_NOERROR)
 					xfer.t_flags |= TRANSFER_FLAG_ERROR;
-				xfer.Complete();
 
-				/* Skip ED now, it's processed */
+				/*
+				 * Skip ED now, it's processed - this must be done before completing, as
+				 * the transfer may be re-scheduled by then.
+				 */
 				ed->ed_ed.ed_flags |= OHCI_ED_K;
+				LIST_APPEND_IP(&done, completed, &xfer);
 			}
 		} else {
 			kprintf("WDH without eds?!\n");
@@ -293,6 +303,16 @@ OHCI_HCD::OnIRQ()
 		}
 		Unlock();
 
+		/*
+		 * Hand all finished transfers back; we borrow the completed-list fields,
+		 * which are unused until the transfer is actually completed.
+		 */
+		while (!LIST_EMPTY(&done)) {
+			Transfer* xfer = LIST_HEAD(&done);
+			LIST_POP_HEAD_IP(&done, completed);
+			xfer->Complete();
+		}
+
 		ohci_hcca->hcca_donehead = 0; /* acknowledge donehead */
 		ohci_Resources.Write4(OHCI_HCINTERRUPTSTATUS, OHCI_IS_WDH);
 	}
@@ -327,28 +347,24 @@ OHCI_HCD::OnIRQ()
 OHCI::HCD_TD*
 OHCI_HCD::AllocateTD()
 {
-	dma_buf_t buf;
-	errorcode_t err = dma_buf_alloc(d_DMA_tag, sizeof(struct OHCI::HCD_TD), &buf);
-	if (ananas_is_failure(err))
+	uint32_t phys;
+	auto td = static_cast<struct OHCI::HCD_TD*>(ohci_td_pool.Allocate(phys));
+	if (td == nullptr)
 		return nullptr;
 
-	auto td = static_cast<struct OHCI::HCD_TD*>(dma_buf_get_segment(buf, 0)->s_virt);
-	memset(td, 0, sizeof(struct OHCI::HCD_TD));
-	td->td_buf = buf;
+	td->td_phys = phys;
 	return td;
 }
 
 OHCI::HCD_ED*
 OHCI_HCD::AllocateED()
 {
-	dma_buf_t buf;
-	errorcode_t err = dma_buf_alloc(d_DMA_tag, sizeof(struct OHCI::HCD_ED), &buf);
-	if (ananas_is_failure(err))
+	uint32_t phys;
+	auto ed = static_cast<struct OHCI::HCD_ED*>(ohci_ed_pool.Allocate(phys));
+	if (ed == nullptr)
 		return nullptr;
 
-	auto ed = static_cast<struct OHCI::HCD_ED*>(dma_buf_get_segment(buf, 0)->s_virt);
-	memset(ed, 0, sizeof(struct OHCI::HCD_ED));
-	ed->ed_buf = buf;
+	ed->ed_phys = phys;
 	return ed;
 }
 
@@ -459,8 +475,12 @@ OHCI_HCD::TearDownTransfer(Transfer& xfer)
 	return ananas_success();
 }
 
+/*
+ * Creates the TD's for the transfer; td_reuse, if not null, is the data TD of
+ * the previous run of this transfer which is to be used again.
+ */
 void
-OHCI_HCD::CreateTDs(Transfer& xfer)
+OHCI_HCD::CreateTDs(Transfer& xfer, OHCI::HCD_TD* td_reuse)
 {
 	auto ed = static_cast<struct OHCI::HCD_ED*>(xfer.t_hcd);
 	bool is_read = (xfer.t_flags & TRANSFER_FLAG_READ) != 0;
@@ -491,7 +511,7 @@ OHCI_HCD::CreateTDs(Transfer& xfer)
 	/* Construct the DATA transfer descriptor */
 	OHCI::HCD_TD* td_data = nullptr;
 	if (xfer.t_flags & TRANSFER_FLAG_DATA) {
-		td_data = AllocateTD();
+		td_data = (td_reuse != nullptr) ? td_reuse : AllocateTD();
 		/*
 		 * Note that we don't use OHCI_TD_T() here; default is to invert the parent
 		 * and for non-control transfers this will be td_head which we override
@@ -582,14 +602,25 @@ OHCI_HCD::ScheduleTransfer(Transfer& xfer)
 	if (usb_dev.ud_flags & USB_DEVICE_FLAG_ROOT_HUB)
 		return ohci_RootHub->HandleTransfer(xfer);
 
-	/* XXX We should re-cycle them instead... */
-	OHCI::FreeTDsFromTransfer(xfer);
+	/*
+	 * Bulk and interrupt transfers consist of a single data TD, which the
+	 * previous run of this transfer has left us: just fill it again. Anything
+	 * else goes back to the pool.
+	 */
+	auto ed = static_cast<struct OHCI::HCD_ED*>(xfer.t_hcd);
+	OHCI::HCD_TD* td_reuse = nullptr;
+	if (xfer.t_type != TRANSFER_TYPE_CONTROL && (xfer.t_flags & TRANSFER_FLAG_DATA) &&
+	    ed->ed_headtd != nullptr && ed->ed_headtd != ed->ed_tailtd && ed->ed_headtd->li_next == ed->ed_tailtd) {
+		td_reuse = ed->ed_headtd;
+		ed->ed_headtd = nullptr;
+	}
+	FreeTDsFromTransfer(xfer);
 
 	/*
 	 * Create the TD's that make up this transfer - this'll hook them to the ED
-	 * we created in ohci_setup_transfer().
+	 * we created in SetupTransfer().
 	 */
-	CreateTDs(xfer);
+	CreateTDs(xfer, td_reuse);
 
 	/* Kick the appropriate queue, if needed */
 	switch(xfer.t_type) {
@@ -621,7 +652,7 @@ OHCI_HCD::CancelTransfer(Transfer& xfer)
 	}
 
 	/* XXX we should see if we're still running it */
-	OHCI::FreeTDsFromTransfer(xfer);
+	FreeTDsFromTransfer(xfer);
 
 	return ananas_success();
 }
@@ -629,8 +660,14 @@ OHCI_HCD::CancelTransfer(Transfer& xfer)
 errorcode_t
 OHCI_HCD::Setup()
 {
+	/* Create the pools our TD's and ED's come from */
+	errorcode_t err = ohci_td_pool.Initialize(d_DMA_tag, "ohci-td", sizeof(struct OHCI::HCD_TD), OHCI_NUM_INITIAL_TDS);
+	ANANAS_ERROR_RETURN(err);
+	err = ohci_ed_pool.Initialize(d_DMA_tag, "ohci-ed", sizeof(struct OHCI::HCD_ED), OHCI_NUM_INITIAL_EDS);
+	ANANAS_ERROR_RETURN(err);
+
 	/* Allocate and initialize the HCCA structure */
-	errorcode_t err = dma_buf_alloc(d_DMA_tag, sizeof(struct OHCI_HCCA), &ohci_hcca_buf);
+	err = dma_buf_alloc(d_DMA_tag, sizeof(struct OHCI_HCCA), &ohci_hcca_buf);
 	ANANAS_ERROR_RETURN(err);
 	ohci_hcca = static_cast<struct OHCI_HCCA*>(dma_buf_get_segment(ohci_hcca_buf, 0)->s_virt);
 	memset(ohci_hcca, 0, sizeof(struct OHCI_HCCA));
@@ -646,7 +683,7 @@ OHCI_HCD::Setup()
 		ohci_interrupt_ed[n] = ed;
 		ed->ed_ed.ed_flags = OHCI_ED_K;
 		if (n > 0)
-			ed->ed_ed.ed_nexted = dma_buf_get_segment(ohci_interrupt_ed[n - 1]->ed_buf, 0)->s_phys;
+			ed->ed_ed.ed_nexted = OHCI::GetPhysicalAddress(*ohci_interrupt_ed[n - 1]);
 		else
 			ed->ed_ed.ed_nexted = 0;
 	}
@@ -657,7 +694,7 @@ OHCI_HCD::Setup()
 		0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5
 	};
 	for (unsigned int n = 0; n < 32; n++) {
-		ohci_hcca->hcca_inttable[n] = dma_buf_get_segment(ohci_interrupt_ed[tables[n]]->ed_buf, 0)->s_phys;
+		ohci_hcca->hcca_inttable[n] = OHCI::GetPhysicalAddress(*ohci_interrupt_ed[tables[n]]);
 	}
 
 	/* Allocate a control/bulk transfer ED */
@@ -803,6 +840,21 @@ struct OHCI_Driver : public Ananas::Driver
 		return "pcibus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_ClassRev, PCI_CLASSREV(PCI_CLASS_SERIAL, PCI_SUBCLASS_USB, 0x10, 0), 0xffffff00 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	const char* GetAttachDependencies() const override
+	{
+		/* EHCI must claim the ports first; whatever it does not want, it hands to us */
+		return "ehci";
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto class_res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_ClassRev, 0);
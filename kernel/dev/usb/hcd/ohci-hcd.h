@@ -5,9 +5,14 @@
 #include <ananas/irq.h>
 #include <ananas/thread.h>
 #include <ananas/dma.h>
+#include "../core/dma-pool.h"
 
 #define OHCI_NUM_ED_LISTS 6 /* 1, 2, 4, 8, 16 and 32ms list */
 
+/* Number of TD's/ED's we allocate up front */
+#define OHCI_NUM_INITIAL_TDS 64
+#define OHCI_NUM_INITIAL_EDS 32
+
 namespace Ananas {
 namespace USB {
 
@@ -18,7 +23,7 @@ namespace OHCI {
 
 struct HCD_TD {
 	struct OHCI_TD td_td;
-	dma_buf_t td_buf;
+	uint32_t td_phys;
 	uint32_t td_length;
 	LIST_FIELDS(struct HCD_TD);
 };
@@ -31,7 +36,7 @@ struct HCD_ED {
 	/* Virtual addresses of the ED chain */
 	struct HCD_ED* ed_preved;
 	struct HCD_ED* ed_nexted;
-	dma_buf_t ed_buf;
+	uint32_t ed_phys;
 	Transfer* ed_xfer;
 	/* Active queue fields; used by ohci_irq() to check all active transfers */
 	LIST_FIELDS_IT(struct HCD_ED, active);
@@ -113,7 +118,7 @@ protected:
 	void Dump();
 	errorcode_t Setup();
 
-	void CreateTDs(Transfer& xfer);
+	void CreateTDs(Transfer& xfer, OHCI::HCD_TD* td_reuse);
 
 private:
 	void Lock()
@@ -128,6 +133,9 @@ private:
 
 	OHCI::HCD_TD* AllocateTD();
 	OHCI::HCD_ED* AllocateED();
+	void FreeTD(OHCI::HCD_TD* td);
+	void FreeED(OHCI::HCD_ED* ed);
+	void FreeTDsFromTransfer(Transfer& xfer);
 	OHCI::HCD_ED* SetupED(Transfer& xfer);
 
 	void OnIRQ();
@@ -146,6 +154,8 @@ private:
 	struct OHCI::HCD_ED* ohci_bulk_ed = nullptr;
 	struct OHCI::HCD_ED_QUEUE ohci_active_eds;
 	mutex_t ohci_mtx;
+	DMAPool ohci_td_pool;
+	DMAPool ohci_ed_pool;
 
 	OHCI::HCD_Resources ohci_Resources;
 	OHCI::RootHub* ohci_RootHub = nullptr;
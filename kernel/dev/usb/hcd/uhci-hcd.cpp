@@ -47,7 +47,7 @@ namespace UHCI {
 
 struct HCD_TD {
 	struct UHCI_TD td_td;
-	dma_buf_t td_buf;
+	uint32_t td_phys;
 	LIST_FIELDS(struct HCD_TD);
 };
 
@@ -55,12 +55,13 @@ struct HCD_QH {
 	struct UHCI_QH qh_qh;
 	struct HCD_TD* qh_first_td;
 	struct HCD_QH* qh_next_qh;
-	dma_buf_t qh_buf;
+	uint32_t qh_phys;
 	LIST_FIELDS(struct HCD_QH);
 };
 
 struct HCD_ScheduledItem {
 	struct HCD_TD* si_td;
+	struct HCD_QH* si_qh;
 	Transfer* si_xfer;
 	LIST_FIELDS(struct HCD_ScheduledItem);
 };
@@ -72,13 +73,13 @@ GetPhysicalAddress(HCD_TD* td)
 {
 	if (td == nullptr)
 		return TD_LINKPTR_T;
-	return dma_buf_get_segment(td->td_buf, 0)->s_phys;
+	return td->td_phys;
 }
 
 addr_t
 GetPhysicalAddress(HCD_QH* qh)
 {
-	return dma_buf_get_segment(qh->qh_buf, 0)->s_phys;
+	return qh->qh_phys;
 }
 
 void
@@ -194,49 +195,43 @@ CreateDataTDs(UHCI_HCD& hcd, addr_t data, size_t size, int max_packet_size, int
 UHCI::HCD_TD*
 UHCI_HCD::AllocateTD()
 {
-	dma_buf_t buf;
-	errorcode_t err = dma_buf_alloc(d_DMA_tag, sizeof(struct UHCI::HCD_TD), &buf);
-	if (ananas_is_failure(err))
+	uint32_t phys;
+	auto td = static_cast<struct UHCI::HCD_TD*>(uhci_td_pool.Allocate(phys));
+	if (td == nullptr)
 		return nullptr;
 
-	auto td = static_cast<struct UHCI::HCD_TD*>(dma_buf_get_segment(buf, 0)->s_virt);
-	memset(td, 0, sizeof(struct UHCI::HCD_TD));
-	td->td_buf = buf;
+	td->td_phys = phys;
 	return td;
 }
 
+void
+UHCI_HCD::FreeTD(UHCI::HCD_TD* td)
+{
+	uhci_td_pool.Free(td, td->td_phys);
+}
+
 UHCI::HCD_QH*
 UHCI_HCD::AllocateQH()
 {
-	dma_buf_t buf;
-	errorcode_t err = dma_buf_alloc(d_DMA_tag, sizeof(struct UHCI::HCD_QH), &buf);
-	if (ananas_is_failure(err))
+	uint32_t phys;
+	auto qh = static_cast<struct UHCI::HCD_QH*>(uhci_qh_pool.Allocate(phys));
+	if (qh == nullptr)
 		return NULL;
 
-	auto qh = static_cast<struct UHCI::HCD_QH*>(dma_buf_get_segment(buf, 0)->s_virt);
-	qh->qh_buf = buf;
+	qh->qh_phys = phys;
 	qh->qh_first_td = NULL;
 	qh->qh_next_qh = NULL;
 
 	/* Initialize the QH; we'll clear all links */
-	memset(&qh->qh_qh, 0, sizeof(struct UHCI_QH));
 	qh->qh_qh.qh_headptr = TO_REG32(QH_PTR_T);
 	qh->qh_qh.qh_elementptr = TO_REG32(QH_PTR_T);
 	return qh;
 }
 
-#if 0
-static void	
-uhci_free_td(device_t dev, struct HCD_TD* td)
-{
-	dma_buf_free(td->td_buf);
-}
-#endif
-
 void
 UHCI_HCD::FreeQH(UHCI::HCD_QH* qh)
 {
-	dma_buf_free(qh->qh_buf);
+	uhci_qh_pool.Free(qh, qh->qh_phys);
 }
 
 void
@@ -289,8 +284,12 @@ UHCI_HCD::OnIRQ()
 		/*
 		 * We got an interrupt because something was completed; but we have no idea
 		 * what it was. We'll have to traverse the scheduled items and wake anything
-		 * up that finished.
+		 * up that finished. Everything that is done is gathered and completed once
+		 * our lock is released, as completing involves the device lock.
 		 */
+		UHCI::HCD_ScheduledItemQueue done;
+		LIST_INIT(&done);
+		mutex_lock(&uhci_mtx);
 		LIST_FOREACH_SAFE(&uhci_scheduled_items, si, UHCI::HCD_ScheduledItem) {
 			/*
 			 * Transfers are scheduled in such a way that we can use the first TD to
@@ -307,9 +306,33 @@ UHCI_HCD::OnIRQ()
 			if (!UHCI::VerifyChainAndCalculateLength(si->si_td, &si->si_xfer->t_result_length))
 				si->si_xfer->t_flags |= TRANSFER_FLAG_ERROR;
 
+			/*
+			 * If the chain is still hooked to its QH (as it will be if a TD failed),
+			 * unhook it so that the HC won't look at the TD's once they are re-used.
+			 */
+			UHCI::HCD_QH* qh = si->si_qh;
+			if (qh->qh_first_td == si->si_td) {
+				qh->qh_qh.qh_elementptr = TO_REG32(QH_PTR_T);
+				qh->qh_first_td = nullptr;
+			}
+			LIST_APPEND(&done, si);
+		}
+		mutex_unlock(&uhci_mtx);
+
+		while (!LIST_EMPTY(&done)) {
+			UHCI::HCD_ScheduledItem* si = LIST_HEAD(&done);
+			LIST_POP_HEAD(&done);
+
+			/* The TD's are no longer referenced; return them to the pool */
+			for (UHCI::HCD_TD* td = si->si_td; td != nullptr; /* nothing */) {
+				UHCI::HCD_TD* next_td = LIST_NEXT(td);
+				FreeTD(td);
+				td = next_td;
+			}
+
 			/* Finally, give hand the transfer back to the USB stack */
 			si->si_xfer->Complete();
-			// XXX Where will will we free si ?
+			delete si;
 		}
 	}
 }
@@ -401,17 +424,20 @@ UHCI_HCD::ScheduleControlTransfer(Transfer& xfer)
 	td_setup->td_td.td_buffer = KVTOP((addr_t)&xfer.t_control_req); /* XXX64 TODO */
 	LIST_NEXT(td_setup) = next_setup_ptr;
 
-	/* Schedule an item; this will cause the IRQ to handle our request - XXX needs lock */
+	/* Schedule an item; this will cause the IRQ to handle our request */
 	auto si = new UHCI::HCD_ScheduledItem;
 	si->si_td = td_setup;
+	si->si_qh = uhci_qh_ls_control;
 	si->si_xfer = &xfer;
-	LIST_APPEND(&uhci_scheduled_items, si);
 
 	/* Finally, hand the chain to the HD; it's ready to be transmitted */
 	/* XXX we should add to the chain not overwrite !!! */
 	/* XXX Is this even safe? */
+	mutex_lock(&uhci_mtx);
+	LIST_APPEND(&uhci_scheduled_items, si);
 	uhci_qh_ls_control->qh_first_td = td_setup;
 	uhci_qh_ls_control->qh_qh.qh_elementptr = TO_REG32(UHCI::GetPhysicalAddress(td_setup));
+	mutex_unlock(&uhci_mtx);
 
 	//uhci_dump(dev);
 	return ananas_success();
@@ -431,17 +457,20 @@ UHCI_HCD::ScheduleInterruptTransfer(Transfer& xfer)
 	last_td->td_td.td_status |= TD_STATUS_IOC;
 	td_chain->td_td.td_token &= ~TD_TOKEN_DATA; /* XXX */
 
-	/* Schedule an item; this will cause the IRQ to handle our request - XXX needs lock */
+	/* Schedule an item; this will cause the IRQ to handle our request */
+	int index = 0;
 	auto si = new UHCI::HCD_ScheduledItem;
 	si->si_td = td_chain;
+	si->si_qh = uhci_qh_interrupt[index];
 	si->si_xfer = &xfer;
-	LIST_APPEND(&uhci_scheduled_items, si);
 
 	/* Finally, hand the chain to the HD; it's ready to be transmitted */
 	/* XXX we should add to the chain not overwrite !!! */
-	int index = 0;
+	mutex_lock(&uhci_mtx);
+	LIST_APPEND(&uhci_scheduled_items, si);
 	uhci_qh_interrupt[index]->qh_first_td = td_chain;
 	uhci_qh_interrupt[index]->qh_qh.qh_elementptr = TO_REG32(UHCI::GetPhysicalAddress(td_chain));
+	mutex_unlock(&uhci_mtx);
 
 	return ananas_success();
 }
@@ -508,6 +537,14 @@ UHCI_HCD::Attach()
 	uhci_framelist = static_cast<uint32_t*>(dma_buf_get_segment(uhci_framelist_buf, 0)->s_virt);
 	KASSERT((((addr_t)uhci_framelist) & 0x3ff) == 0, "framelist misaligned");
 
+	/* Create the pools our TD's and QH's are taken from */
+	err = uhci_td_pool.Initialize(d_DMA_tag, "uhci-td", sizeof(struct UHCI::HCD_TD), UHCI_NUM_INITIAL_TDS);
+	if (ananas_is_failure(err))
+		goto fail;
+	err = uhci_qh_pool.Initialize(d_DMA_tag, "uhci-qh", sizeof(struct UHCI::HCD_QH), UHCI_NUM_INITIAL_QHS);
+	if (ananas_is_failure(err))
+		goto fail;
+
 	/* Disable interrupts; we don't want the messing along */
 	uhci_Resources.Write2(UHCI_REG_USBINTR, 0);
 
@@ -636,6 +673,21 @@ struct UHCI_Driver : public Ananas::Driver
 		return "pcibus";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_ClassRev, PCI_CLASSREV(PCI_CLASS_SERIAL, PCI_SUBCLASS_USB, 0, 0), 0xffffff00 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	const char* GetAttachDependencies() const override
+	{
+		/* EHCI must claim the ports first; whatever it does not want, it hands to us */
+		return "ehci";
+	}
+
 	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
 	{
 		auto class_res = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_ClassRev, 0);
@@ -2,9 +2,12 @@
 #define __UHCI_HCD_H__
 
 #include <ananas/irq.h>
+#include "../core/dma-pool.h"
 
 #define UHCI_FRAMELIST_LEN	(4096 / 4)
 #define UHCI_NUM_INTERRUPT_QH	6 /* 1, 2, 4, 8, 16, 32ms queues */
+#define UHCI_NUM_INITIAL_TDS	128 /* TD's allocated up front */
+#define UHCI_NUM_INITIAL_QHS	32 /* QH's allocated up front */
 
 namespace Ananas {
 namespace USB {
@@ -79,6 +82,7 @@ public:
 	errorcode_t Detach() override;
 
 	UHCI::HCD_TD* AllocateTD();
+	void FreeTD(UHCI::HCD_TD* td);
 	UHCI::HCD_QH* AllocateQH();
 	void FreeQH(UHCI::HCD_QH* qh);
 
@@ -109,6 +113,10 @@ private:
 	dma_buf_t uhci_framelist_buf;
 	uint32_t* uhci_framelist;
 
+	/* Pools our TD's and QH's come from */
+	DMAPool uhci_td_pool;
+	DMAPool uhci_qh_pool;
+
 	UHCI::HCD_Resources uhci_Resources;
 	UHCI::RootHub* uhci_RootHub = nullptr;
 
@@ -120,7 +128,7 @@ private:
 	struct UHCI::HCD_QH* uhci_qh_fs_control;
 	struct UHCI::HCD_QH* uhci_qh_bulk;
 	/* Currently scheduled queue items */
-	struct UHCI::HCD_ScheduledItemQueue uhci_scheduled_items;
+	struct UHCI::HCD_ScheduledItemQueue uhci_scheduled_items; /* [M] */
 };
 
 } // namespace USB
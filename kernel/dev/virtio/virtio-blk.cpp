@@ -0,0 +1,769 @@
+/*
+ * Virtio block device driver, for disks provided by a hypervisor.
+ *
+ * Like the nvme driver, we use a virtqueue per CPU (as far as the device
+ * offers them) with an MSI-X vector of its own that is delivered to that CPU;
+ * requests are submitted to the queue of the CPU they are issued on.
+ *
+ * Every request takes a single ring descriptor, which refers to an indirect
+ * table holding the header, a descriptor per bio and the status byte; this
+ * means a queue of n entries always has room for n requests, no matter how
+ * many bio's they have. With event indices, we only kick the device if it
+ * asked for it and it only interrupts us once it got past what we've seen.
+ */
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/bus/pci.h>
+#include <ananas/device.h>
+#include <ananas/driver.h>
+#include <ananas/dma.h>
+#include <ananas/error.h>
+#include <ananas/irq.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+#include <ananas/time.h>
+#include <ananas/trace.h>
+#include <machine/param.h>
+#include <mbr.h>
+#include "virtio-reg.h"
+
+TRACE_SETUP;
+
+/* Number of entries we use per virtqueue; slots are tracked in a 64-bit mask */
+#define VIRTIOBLK_QUEUE_SIZE	64
+
+/* Number of bio's a single request may hold */
+#define VIRTIOBLK_MAX_SEGS	32
+
+#define VIRTIOBLK_MAX_QUEUES	PCPU_MAX_CPUS
+
+/* Time to wait for the device to reset, in ms */
+#define VIRTIOBLK_RESET_TIMEOUT	1000
+
+namespace {
+
+/*
+ * Memory every request slot owns: the header and status byte the device
+ * accesses, and the indirect descriptor table that refers to them.
+ */
+struct REQUEST_AREA {
+	struct VIRTIO_BLK_REQ ra_hdr;
+	uint8_t		ra_status;
+	uint8_t		ra_pad[15];
+	struct VRING_DESC ra_desc[VIRTIOBLK_MAX_SEGS + 2];
+};
+
+struct Request {
+	struct BIO*	r_bio;		/* first bio of the request */
+	semaphore_t*	r_done;		/* flush: signalled on completion */
+	uint8_t*	r_status;	/* flush: receives the status */
+};
+
+struct Queue {
+	unsigned int	q_index;
+	unsigned int	q_vector;	/* index of the interrupt vector */
+	unsigned int	q_size;
+	spinlock_t	q_lock;		/* protects the fields below */
+	semaphore_t	q_slot_sem;	/* free request slots */
+	dma_buf_t	q_dmabuf_ring;
+	dma_buf_t	q_dmabuf_req;
+	volatile struct VRING_DESC* q_desc;
+	volatile struct VRING_AVAIL* q_avail;
+	volatile struct VRING_USED* q_used;
+	volatile uint16_t* q_used_event;	/* in the avail ring; written by us */
+	volatile uint16_t* q_avail_event;	/* in the used ring; written by the device */
+	volatile uint16_t* q_notify;
+	struct REQUEST_AREA* q_req;
+	dma_addr_t	q_req_phys;
+	uint16_t	q_avail_idx;	/* next avail ring index */
+	uint16_t	q_used_idx;	/* next used ring index to process */
+	uint64_t	q_slot_in_use;
+	struct Request	q_request[VIRTIOBLK_QUEUE_SIZE];
+};
+
+/* Fills a descriptor with the bio being loaded */
+struct SEGMENT_LOAD {
+	struct VRING_DESC* sl_desc;
+	uint32_t	sl_len;
+};
+
+errorcode_t
+virtioblk_load(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs)
+{
+	auto sl = static_cast<struct SEGMENT_LOAD*>(ctx);
+	KASSERT(num_segs == 1, "unsupported number of segments %d", num_segs);
+	sl->sl_desc->d_addr = s->s_phys;
+	sl->sl_desc->d_len = sl->sl_len;
+	return ananas_success();
+}
+
+class VirtioBlkDevice : public Ananas::Device, private Ananas::IDeviceOperations, private Ananas::IBIODeviceOperations
+{
+public:
+	using Device::Device;
+	virtual ~VirtioBlkDevice() = default;
+
+	IDeviceOperations& GetDeviceOperations() override
+	{
+		return *this;
+	}
+
+	IBIODeviceOperations* GetBIODeviceOperations() override
+	{
+		return this;
+	}
+
+	errorcode_t Attach() override;
+	errorcode_t Detach() override;
+
+	errorcode_t ReadBIO(struct BIO& bio) override;
+	errorcode_t WriteBIO(struct BIO& bio) override;
+	unsigned int GetMaxBIORequests() override;
+	unsigned int GetMaxBIOsPerRequest() override;
+	errorcode_t FlushCache() override;
+
+protected:
+	template<typename T> T ReadCommon(unsigned int reg)
+	{
+		return *(volatile T*)(vb_common + reg);
+	}
+
+	template<typename T> void WriteCommon(unsigned int reg, T val)
+	{
+		*(volatile T*)(vb_common + reg) = val;
+	}
+
+	template<typename T> T ReadConfig(unsigned int reg)
+	{
+		return *(volatile T*)(vb_devcfg + reg);
+	}
+
+	void OnIRQ(unsigned int vector);
+
+	static irqresult_t IRQWrapper(Ananas::Device* device, void* context)
+	{
+		auto vb = static_cast<VirtioBlkDevice*>(device);
+		if (!vb->vb_msi_enabled && (*vb->vb_isr & VIRTIO_ISR_QUEUE) == 0)
+			return IRQ_RESULT_IGNORED; /* reading the ISR acknowledged the interrupt */
+		vb->OnIRQ((unsigned int)(uintptr_t)context);
+		return IRQ_RESULT_PROCESSED;
+	}
+
+private:
+	bool HasFeature(unsigned int bit) const
+	{
+		return (vb_features & (1ULL << bit)) != 0;
+	}
+
+	errorcode_t MapCapabilities();
+	errorcode_t Reset();
+	errorcode_t NegotiateFeatures();
+	errorcode_t SetupIRQ(void* res_irq, unsigned int num_queues);
+	errorcode_t SetupQueue(Queue& q, unsigned int index);
+	errorcode_t Submit(struct BIO& bio, bool write);
+	uint16_t AllocateSlot(Queue& q);
+	void FreeSlot(Queue& q, uint16_t slot);
+	void Post(Queue& q, uint16_t slot, unsigned int num_desc);
+	void ProcessCompletions(Queue& q);
+	void CompleteRequest(Queue& q, uint16_t slot);
+
+	volatile uint8_t* vb_common;
+	volatile uint8_t* vb_notify;
+	volatile uint8_t* vb_isr;
+	volatile uint8_t* vb_devcfg;
+	uint32_t vb_notify_mult;
+	uint64_t vb_features;
+	uint64_t vb_capacity;		/* in VIRTIO_BLK_SECTOR_SIZE sectors */
+	uint32_t vb_block_size;
+	uint32_t vb_size_max;		/* largest bio, in bytes */
+	unsigned int vb_max_segs;
+	unsigned int vb_num_vectors;
+	struct PCI_MSI vb_msi;
+	bool vb_msi_enabled;
+	unsigned int vb_num_queues;
+	Queue* vb_queue[VIRTIOBLK_MAX_QUEUES];
+};
+
+/* Locates the configuration structures; we use the first of every type, as the spec prefers */
+errorcode_t
+VirtioBlkDevice::MapCapabilities()
+{
+	vb_common = NULL;
+	vb_notify = NULL;
+	vb_isr = NULL;
+	vb_devcfg = NULL;
+	for (unsigned int cap = pci_find_capability(*this, PCI_CAP_ID_VENDOR); cap != 0; cap = pci_find_capability(*this, PCI_CAP_ID_VENDOR, cap)) {
+		unsigned int type = pci_read_cfg(*this, cap + VIRTIO_PCI_CAP_CFG_TYPE, 8);
+		volatile uint8_t** ptr;
+		switch(type) {
+			case VIRTIO_PCI_CAP_COMMON_CFG: ptr = &vb_common; break;
+			case VIRTIO_PCI_CAP_NOTIFY_CFG: ptr = &vb_notify; break;
+			case VIRTIO_PCI_CAP_ISR_CFG: ptr = &vb_isr; break;
+			case VIRTIO_PCI_CAP_DEVICE_CFG: ptr = &vb_devcfg; break;
+			default: continue;
+		}
+		if (*ptr != NULL)
+			continue;
+
+		unsigned int bar = pci_read_cfg(*this, cap + VIRTIO_PCI_CAP_BAR, 8);
+		uint32_t offset = pci_read_cfg(*this, cap + VIRTIO_PCI_CAP_OFFSET, 32);
+		uint32_t length = pci_read_cfg(*this, cap + VIRTIO_PCI_CAP_LENGTH, 32);
+		*ptr = static_cast<volatile uint8_t*>(pci_map_bar(*this, bar, offset, length));
+		if (type == VIRTIO_PCI_CAP_NOTIFY_CFG)
+			vb_notify_mult = pci_read_cfg(*this, cap + VIRTIO_PCI_CAP_NOTIFY_MULT, 32);
+	}
+
+	if (vb_common == NULL || vb_notify == NULL || vb_isr == NULL || vb_devcfg == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	return ananas_success();
+}
+
+errorcode_t
+VirtioBlkDevice::Reset()
+{
+	/* The device is reset once the status reads back as zero */
+	WriteCommon<uint8_t>(VIRTIO_COMMON_STATUS, 0);
+	for (unsigned int n = 0; n < VIRTIOBLK_RESET_TIMEOUT; n++) {
+		if (ReadCommon<uint8_t>(VIRTIO_COMMON_STATUS) == 0)
+			return ananas_success();
+		delay(1);
+	}
+	Printf("timeout waiting for the device to reset");
+	return ANANAS_ERROR(NO_DEVICE);
+}
+
+errorcode_t
+VirtioBlkDevice::NegotiateFeatures()
+{
+	WriteCommon<uint32_t>(VIRTIO_COMMON_DFSELECT, 0);
+	uint64_t features = ReadCommon<uint32_t>(VIRTIO_COMMON_DF);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_DFSELECT, 1);
+	features |= (uint64_t)ReadCommon<uint32_t>(VIRTIO_COMMON_DF) << 32;
+
+	/* We rely on indirect descriptors to make every request fit in a single ring entry */
+	const uint64_t required = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_F_RING_INDIRECT_DESC);
+	if ((features & required) != required) {
+		Printf("unsupported device (features %x:%x)", (uint32_t)(features >> 32), (uint32_t)features);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	vb_features = features & (required | (1ULL << VIRTIO_F_RING_EVENT_IDX) |
+	 (1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_RO) |
+	 (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_MQ) | (1ULL << VIRTIO_BLK_F_FLUSH));
+
+	WriteCommon<uint32_t>(VIRTIO_COMMON_GFSELECT, 0);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_GF, vb_features & 0xffffffff);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_GFSELECT, 1);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_GF, vb_features >> 32);
+
+	/* The device only accepts our selection if FEATURES_OK sticks */
+	uint8_t status = ReadCommon<uint8_t>(VIRTIO_COMMON_STATUS) | VIRTIO_STATUS_FEATURES_OK;
+	WriteCommon<uint8_t>(VIRTIO_COMMON_STATUS, status);
+	if ((ReadCommon<uint8_t>(VIRTIO_COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK) == 0) {
+		Printf("device rejected our features");
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	return ananas_success();
+}
+
+/*
+ * Hooks up our interrupts: vector n is used by the n-th queue and delivered
+ * to the CPU that uses it. Virtio needs MSI-X to tell the vectors apart; with
+ * plain MSI or none at all, all queues use the interrupt line.
+ */
+errorcode_t
+VirtioBlkDevice::SetupIRQ(void* res_irq, unsigned int num_queues)
+{
+	unsigned int num_vectors = num_queues;
+	vb_msi_enabled = ananas_is_success(pci_msi_alloc(*this, vb_msi, &num_vectors));
+	if (vb_msi_enabled && (vb_msi.msi_flags & PCI_MSI_FLAG_MSIX) == 0) {
+		pci_msi_free(*this, vb_msi);
+		vb_msi_enabled = false;
+	}
+	if (vb_msi_enabled) {
+		unsigned int n = 0;
+		for (/* nothing */; n < num_vectors; n++) {
+			errorcode_t err = pci_msi_register(*this, vb_msi, n, n % pcpu_get_count(), IRQWrapper, IRQ_TYPE_DEFAULT, (void*)(uintptr_t)n);
+			if (ananas_is_failure(err))
+				break;
+		}
+		if (n == num_vectors) {
+			vb_num_vectors = num_vectors;
+			return ananas_success();
+		}
+
+		while (n-- > 0)
+			irq_unregister(vb_msi.msi_irq[n], this, IRQWrapper, (void*)(uintptr_t)n);
+		pci_msi_free(*this, vb_msi);
+		vb_msi_enabled = false;
+	}
+
+	if (res_irq == NULL)
+		return ANANAS_ERROR(NO_RESOURCE);
+	vb_num_vectors = 1;
+	return irq_register((int)(uintptr_t)res_irq, this, IRQWrapper, IRQ_TYPE_DEFAULT, (void*)(uintptr_t)0);
+}
+
+errorcode_t
+VirtioBlkDevice::SetupQueue(Queue& q, unsigned int index)
+{
+	WriteCommon<uint16_t>(VIRTIO_COMMON_Q_SELECT, index);
+	unsigned int size = ReadCommon<uint16_t>(VIRTIO_COMMON_Q_SIZE);
+	if (size == 0)
+		return ANANAS_ERROR(NO_RESOURCE);
+	if (size > VIRTIOBLK_QUEUE_SIZE)
+		size = VIRTIOBLK_QUEUE_SIZE; /* both are powers of two */
+
+	q.q_index = index;
+	q.q_vector = index % vb_num_vectors;
+	q.q_size = size;
+	spinlock_init(&q.q_lock);
+	sem_init(&q.q_slot_sem, size);
+
+	errorcode_t err = dma_buf_alloc(d_DMA_tag, VRING_SIZE(size), &q.q_dmabuf_ring);
+	ANANAS_ERROR_RETURN(err);
+	err = dma_buf_alloc(d_DMA_tag, size * sizeof(struct REQUEST_AREA), &q.q_dmabuf_req);
+	ANANAS_ERROR_RETURN(err);
+
+	auto ring = static_cast<char*>(dma_buf_get_segment(q.q_dmabuf_ring, 0)->s_virt);
+	dma_addr_t ring_phys = dma_buf_get_segment(q.q_dmabuf_ring, 0)->s_phys;
+	memset(ring, 0, VRING_SIZE(size));
+	q.q_desc = reinterpret_cast<volatile struct VRING_DESC*>(ring);
+	q.q_avail = reinterpret_cast<volatile struct VRING_AVAIL*>(ring + VRING_DESC_SIZE(size));
+	q.q_used = reinterpret_cast<volatile struct VRING_USED*>(ring + VRING_USED_OFFSET(size));
+	q.q_used_event = &q.q_avail->a_ring[size];
+	q.q_avail_event = reinterpret_cast<volatile uint16_t*>(&q.q_used->u_ring[size]);
+	q.q_req = static_cast<struct REQUEST_AREA*>(dma_buf_get_segment(q.q_dmabuf_req, 0)->s_virt);
+	q.q_req_phys = dma_buf_get_segment(q.q_dmabuf_req, 0)->s_phys;
+	q.q_avail_idx = 0;
+	q.q_used_idx = 0;
+	q.q_slot_in_use = 0;
+	memset(q.q_request, 0, sizeof(q.q_request));
+
+	/* Every slot has a fixed ring descriptor, pointing to its indirect table */
+	for (unsigned int n = 0; n < size; n++) {
+		q.q_desc[n].d_addr = q.q_req_phys + n * sizeof(struct REQUEST_AREA) + ((char*)&q.q_req[n].ra_desc[0] - (char*)&q.q_req[n]);
+		q.q_desc[n].d_flags = VRING_DESC_F_INDIRECT;
+	}
+
+	WriteCommon<uint16_t>(VIRTIO_COMMON_Q_SIZE, size);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_Q_DESC, ring_phys & 0xffffffff);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_Q_DESC + 4, ring_phys >> 32);
+	uint64_t avail_phys = ring_phys + VRING_DESC_SIZE(size);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_Q_AVAIL, avail_phys & 0xffffffff);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_Q_AVAIL + 4, avail_phys >> 32);
+	uint64_t used_phys = ring_phys + VRING_USED_OFFSET(size);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_Q_USED, used_phys & 0xffffffff);
+	WriteCommon<uint32_t>(VIRTIO_COMMON_Q_USED + 4, used_phys >> 32);
+	if (vb_msi_enabled) {
+		/* The device reads back VIRTIO_MSI_NO_VECTOR if it couldn't hook the vector up */
+		WriteCommon<uint16_t>(VIRTIO_COMMON_Q_MSIX, q.q_vector);
+		if (ReadCommon<uint16_t>(VIRTIO_COMMON_Q_MSIX) != q.q_vector)
+			return ANANAS_ERROR(NO_RESOURCE);
+	}
+	q.q_notify = reinterpret_cast<volatile uint16_t*>(vb_notify + ReadCommon<uint16_t>(VIRTIO_COMMON_Q_NOFF) * vb_notify_mult);
+	WriteCommon<uint16_t>(VIRTIO_COMMON_Q_ENABLE, 1);
+	return ananas_success();
+}
+
+/* Must be called with q_lock held and a slot obtained from q_slot_sem */
+uint16_t
+VirtioBlkDevice::AllocateSlot(Queue& q)
+{
+	uint16_t slot = 0;
+	while (slot < q.q_size && (q.q_slot_in_use & (1ULL << slot)) != 0)
+		slot++;
+	KASSERT(slot < q.q_size, "no free slot on queue %u", q.q_index);
+
+	q.q_slot_in_use |= 1ULL << slot;
+	return slot;
+}
+
+/* Must be called with q_lock held */
+void
+VirtioBlkDevice::FreeSlot(Queue& q, uint16_t slot)
+{
+	q.q_slot_in_use &= ~(1ULL << slot);
+	sem_signal(&q.q_slot_sem);
+}
+
+/* Must be called with q_lock held; hands the slot's request to the device */
+void
+VirtioBlkDevice::Post(Queue& q, uint16_t slot, unsigned int num_desc)
+{
+	q.q_desc[slot].d_len = num_desc * sizeof(struct VRING_DESC);
+	q.q_avail->a_ring[q.q_avail_idx % q.q_size] = slot;
+
+	/* The entry must be visible before the index that publishes it */
+	__sync_synchronize();
+	uint16_t old_idx = q.q_avail_idx++;
+	q.q_avail->a_idx = q.q_avail_idx;
+
+	/* And the index before we look whether the device wants to hear about it */
+	__sync_synchronize();
+	bool notify;
+	if (HasFeature(VIRTIO_F_RING_EVENT_IDX))
+		notify = vring_need_event(*q.q_avail_event, q.q_avail_idx, old_idx);
+	else
+		notify = (q.q_used->u_flags & VRING_USED_F_NO_NOTIFY) == 0;
+	if (notify)
+		*q.q_notify = q.q_index;
+}
+
+/* Must be called with q_lock held; completes all bio's of the request, in order */
+void
+VirtioBlkDevice::CompleteRequest(Queue& q, uint16_t slot)
+{
+	struct Request& req = q.q_request[slot];
+	uint8_t status = *(volatile uint8_t*)&q.q_req[slot].ra_status;
+	if (status != VIRTIO_BLK_S_OK)
+		Printf("request on queue %u failed, status %u", q.q_index, status);
+
+	for (struct BIO* bio = req.r_bio; bio != NULL; /* nothing */) {
+		struct BIO* next = bio->io_next; /* bio may be reused once available */
+		dma_buf_unload_bio(q.q_dmabuf_req, bio);
+		if (status != VIRTIO_BLK_S_OK)
+			bio_set_error(bio);
+		else
+			bio_set_available(bio);
+		bio = next;
+	}
+	req.r_bio = NULL;
+
+	/* Someone may be waiting for a flush; they can go once we're done with the slot */
+	semaphore_t* done = req.r_done;
+	if (done != NULL)
+		*req.r_status = status;
+	req.r_done = NULL;
+	FreeSlot(q, slot);
+	if (done != NULL)
+		sem_signal(done);
+}
+
+void
+VirtioBlkDevice::ProcessCompletions(Queue& q)
+{
+	spinlock_lock(&q.q_lock);
+	while(1) {
+		while (q.q_used_idx != q.q_used->u_idx) {
+			/* Don't look at the entry before the index that published it */
+			__sync_synchronize();
+			uint32_t slot = q.q_used->u_ring[q.q_used_idx % q.q_size].ue_id;
+			q.q_used_idx++;
+			if (slot >= q.q_size || (q.q_slot_in_use & (1ULL << slot)) == 0) {
+				Printf("completion for inactive slot %u on queue %u", slot, q.q_index);
+				continue;
+			}
+			CompleteRequest(q, slot);
+		}
+		if (!HasFeature(VIRTIO_F_RING_EVENT_IDX))
+			break;
+
+		/*
+		 * Ask for an interrupt once the device gets past what we've seen; it may
+		 * have done so before noticing, so check once more afterwards.
+		 */
+		*q.q_used_event = q.q_used_idx;
+		__sync_synchronize();
+		if (q.q_used_idx == q.q_used->u_idx)
+			break;
+	}
+	spinlock_unlock(&q.q_lock);
+}
+
+void
+VirtioBlkDevice::OnIRQ(unsigned int vector)
+{
+	for (unsigned int n = 0; n < vb_num_queues; n++) {
+		Queue& q = *vb_queue[n];
+		if (q.q_vector == vector)
+			ProcessCompletions(q);
+	}
+}
+
+errorcode_t
+VirtioBlkDevice::Submit(struct BIO& bio, bool write)
+{
+	if (write && HasFeature(VIRTIO_BLK_F_RO))
+		return ANANAS_ERROR(READ_ONLY);
+
+	/* Every bio must cover whole blocks, and each takes a descriptor */
+	uint32_t block_mask = vb_block_size - 1;
+	unsigned int num_bios = 0;
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next) {
+		KASSERT(b->length > 0, "invalid length");
+		if (((b->io_block * BIO_SECTOR_SIZE) & block_mask) != 0 || (b->length & block_mask) != 0)
+			return ANANAS_ERROR(BAD_RANGE);
+		if (b->length > vb_size_max)
+			return ANANAS_ERROR(BAD_LENGTH);
+		num_bios++;
+	}
+	if (num_bios > vb_max_segs)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	Queue& q = *vb_queue[PCPU_GET(cpuid) % vb_num_queues];
+	sem_wait(&q.q_slot_sem);
+	spinlock_lock(&q.q_lock);
+	uint16_t slot = AllocateSlot(q);
+	spinlock_unlock(&q.q_lock);
+
+	/* The slot is ours, so we can fill its area without holding the lock */
+	struct REQUEST_AREA& ra = q.q_req[slot];
+	dma_addr_t ra_phys = q.q_req_phys + slot * sizeof(struct REQUEST_AREA);
+	ra.ra_hdr.r_type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	ra.ra_hdr.r_reserved = 0;
+	ra.ra_hdr.r_sector = (bio.io_block * BIO_SECTOR_SIZE) / VIRTIO_BLK_SECTOR_SIZE;
+	ra.ra_status = 0xff;
+	ra.ra_desc[0].d_addr = ra_phys + ((char*)&ra.ra_hdr - (char*)&ra);
+	ra.ra_desc[0].d_len = sizeof(struct VIRTIO_BLK_REQ);
+	ra.ra_desc[0].d_flags = 0; /* header is only read */
+
+	unsigned int n = 1;
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next, n++) {
+		struct SEGMENT_LOAD sl;
+		sl.sl_desc = &ra.ra_desc[n];
+		sl.sl_len = b->length;
+		errorcode_t err = dma_buf_load_bio(q.q_dmabuf_req, b, virtioblk_load, &sl, write ? DMA_LOAD_FLAG_WRITE : DMA_LOAD_FLAG_READ);
+		KASSERT(ananas_is_success(err), "unable to load bio %p, %d", b, err);
+		ra.ra_desc[n].d_flags = write ? 0 : VRING_DESC_F_WRITE;
+	}
+	ra.ra_desc[n].d_addr = ra_phys + ((char*)&ra.ra_status - (char*)&ra);
+	ra.ra_desc[n].d_len = sizeof(uint8_t);
+	ra.ra_desc[n].d_flags = VRING_DESC_F_WRITE;
+	ra.ra_desc[n].d_next = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		ra.ra_desc[i].d_flags |= VRING_DESC_F_NEXT;
+		ra.ra_desc[i].d_next = i + 1;
+	}
+
+	spinlock_lock(&q.q_lock);
+	q.q_request[slot].r_bio = &bio;
+	q.q_request[slot].r_done = NULL;
+	Post(q, slot, n + 1);
+	spinlock_unlock(&q.q_lock);
+	return ananas_success();
+}
+
+errorcode_t
+VirtioBlkDevice::ReadBIO(struct BIO& bio)
+{
+	return Submit(bio, false);
+}
+
+errorcode_t
+VirtioBlkDevice::WriteBIO(struct BIO& bio)
+{
+	return Submit(bio, true);
+}
+
+errorcode_t
+VirtioBlkDevice::FlushCache()
+{
+	/* Without the feature, the device has no cache to flush (it writes through) */
+	if (!HasFeature(VIRTIO_BLK_F_FLUSH))
+		return ananas_success();
+
+	semaphore_t sem;
+	sem_init(&sem, 0);
+	uint8_t status = 0xff;
+
+	Queue& q = *vb_queue[PCPU_GET(cpuid) % vb_num_queues];
+	sem_wait(&q.q_slot_sem);
+	spinlock_lock(&q.q_lock);
+	uint16_t slot = AllocateSlot(q);
+	spinlock_unlock(&q.q_lock);
+
+	/* A flush is just the header and the status byte */
+	struct REQUEST_AREA& ra = q.q_req[slot];
+	dma_addr_t ra_phys = q.q_req_phys + slot * sizeof(struct REQUEST_AREA);
+	ra.ra_hdr.r_type = VIRTIO_BLK_T_FLUSH;
+	ra.ra_hdr.r_reserved = 0;
+	ra.ra_hdr.r_sector = 0;
+	ra.ra_status = 0xff;
+	ra.ra_desc[0].d_addr = ra_phys + ((char*)&ra.ra_hdr - (char*)&ra);
+	ra.ra_desc[0].d_len = sizeof(struct VIRTIO_BLK_REQ);
+	ra.ra_desc[0].d_flags = VRING_DESC_F_NEXT;
+	ra.ra_desc[0].d_next = 1;
+	ra.ra_desc[1].d_addr = ra_phys + ((char*)&ra.ra_status - (char*)&ra);
+	ra.ra_desc[1].d_len = sizeof(uint8_t);
+	ra.ra_desc[1].d_flags = VRING_DESC_F_WRITE;
+	ra.ra_desc[1].d_next = 0;
+
+	spinlock_lock(&q.q_lock);
+	q.q_request[slot].r_bio = NULL;
+	q.q_request[slot].r_done = &sem;
+	q.q_request[slot].r_status = &status;
+	Post(q, slot, 2);
+	spinlock_unlock(&q.q_lock);
+
+	sem_wait(&sem);
+	return (status == VIRTIO_BLK_S_OK) ? ananas_success() : ANANAS_ERROR(IO);
+}
+
+unsigned int
+VirtioBlkDevice::GetMaxBIORequests()
+{
+	unsigned int num = 0;
+	for (unsigned int n = 0; n < vb_num_queues; n++)
+		num += vb_queue[n]->q_size;
+	return num;
+}
+
+unsigned int
+VirtioBlkDevice::GetMaxBIOsPerRequest()
+{
+	return vb_max_segs;
+}
+
+errorcode_t
+VirtioBlkDevice::Attach()
+{
+	void* res_irq = d_ResourceSet.AllocateResource(Ananas::Resource::RT_IRQ, 0);
+	vb_num_vectors = 0;
+	vb_num_queues = 0;
+	vb_msi_enabled = false;
+
+	/* Enable busmastering; all communication is done by DMA */
+	pci_enable_busmaster(*this, 1);
+
+	errorcode_t err = MapCapabilities();
+	if (ananas_is_failure(err)) {
+		Printf("no modern virtio interface; legacy devices are not supported");
+		return err;
+	}
+
+	err = Reset();
+	ANANAS_ERROR_RETURN(err);
+	WriteCommon<uint8_t>(VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	err = NegotiateFeatures();
+	if (ananas_is_failure(err)) {
+		WriteCommon<uint8_t>(VIRTIO_COMMON_STATUS, ReadCommon<uint8_t>(VIRTIO_COMMON_STATUS) | VIRTIO_STATUS_FAILED);
+		return err;
+	}
+
+	/* The configuration may change while we read it; retry if the generation moved */
+	unsigned int num_queues = 1;
+	uint8_t generation;
+	do {
+		generation = ReadCommon<uint8_t>(VIRTIO_COMMON_CFGGEN);
+		vb_capacity = (uint64_t)ReadConfig<uint32_t>(VIRTIO_BLK_CFG_CAPACITY + 4) << 32 | ReadConfig<uint32_t>(VIRTIO_BLK_CFG_CAPACITY);
+		vb_block_size = HasFeature(VIRTIO_BLK_F_BLK_SIZE) ? ReadConfig<uint32_t>(VIRTIO_BLK_CFG_BLK_SIZE) : VIRTIO_BLK_SECTOR_SIZE;
+		vb_size_max = HasFeature(VIRTIO_BLK_F_SIZE_MAX) ? ReadConfig<uint32_t>(VIRTIO_BLK_CFG_SIZE_MAX) : 0;
+		vb_max_segs = HasFeature(VIRTIO_BLK_F_SEG_MAX) ? ReadConfig<uint32_t>(VIRTIO_BLK_CFG_SEG_MAX) : 0;
+		if (HasFeature(VIRTIO_BLK_F_MQ))
+			num_queues = ReadConfig<uint16_t>(VIRTIO_BLK_CFG_NUM_QUEUES);
+	} while (generation != ReadCommon<uint8_t>(VIRTIO_COMMON_CFGGEN));
+
+	/* Blocks must be at least a sector and fit in a page */
+	if (vb_block_size < VIRTIO_BLK_SECTOR_SIZE || vb_block_size > PAGE_SIZE || (vb_block_size & (vb_block_size - 1)) != 0) {
+		Printf("unsupported block size %u", vb_block_size);
+		return ANANAS_ERROR(NO_DEVICE);
+	}
+	if (vb_size_max == 0)
+		vb_size_max = 0xffffffff;
+	if (vb_max_segs == 0 || vb_max_segs > VIRTIOBLK_MAX_SEGS)
+		vb_max_segs = VIRTIOBLK_MAX_SEGS;
+
+	/* One queue per CPU, as far as the device has them */
+	if (num_queues > pcpu_get_count())
+		num_queues = pcpu_get_count();
+	if (num_queues > ReadCommon<uint16_t>(VIRTIO_COMMON_NUMQ))
+		num_queues = ReadCommon<uint16_t>(VIRTIO_COMMON_NUMQ);
+	if (num_queues > VIRTIOBLK_MAX_QUEUES)
+		num_queues = VIRTIOBLK_MAX_QUEUES;
+	if (num_queues == 0)
+		return ANANAS_ERROR(NO_DEVICE);
+
+	err = dma_tag_create(d_Parent->d_DMA_tag, *this, &d_DMA_tag, 1, 0, DMA_ADDR_MAX_ANY, DMA_SEGS_MAX_ANY, DMA_SEGS_MAX_SIZE);
+	ANANAS_ERROR_RETURN(err);
+	err = SetupIRQ(res_irq, num_queues);
+	ANANAS_ERROR_RETURN(err);
+	if (vb_msi_enabled)
+		WriteCommon<uint16_t>(VIRTIO_COMMON_MSIX, VIRTIO_MSI_NO_VECTOR); /* we don't care about configuration changes */
+
+	for (unsigned int n = 0; n < num_queues; n++) {
+		Queue* q = new Queue;
+		err = SetupQueue(*q, n);
+		if (ananas_is_failure(err)) {
+			delete q;
+			break;
+		}
+		vb_queue[n] = q;
+		vb_num_queues = n + 1;
+	}
+	if (vb_num_queues == 0) {
+		WriteCommon<uint8_t>(VIRTIO_COMMON_STATUS, ReadCommon<uint8_t>(VIRTIO_COMMON_STATUS) | VIRTIO_STATUS_FAILED);
+		return ananas_is_failure(err) ? err : ANANAS_ERROR(NO_DEVICE);
+	}
+	WriteCommon<uint8_t>(VIRTIO_COMMON_STATUS, ReadCommon<uint8_t>(VIRTIO_COMMON_STATUS) | VIRTIO_STATUS_DRIVER_OK);
+
+	Printf("%u MB, %u byte blocks%s, %u queues, %u %s vectors%s",
+	 (uint32_t)(vb_capacity * VIRTIO_BLK_SECTOR_SIZE / (1024UL * 1024UL)), vb_block_size,
+	 HasFeature(VIRTIO_BLK_F_RO) ? " (read-only)" : "", vb_num_queues, vb_num_vectors,
+	 vb_msi_enabled ? "MSI-X" : "legacy", HasFeature(VIRTIO_F_RING_EVENT_IDX) ? ", event index" : "");
+
+	/*
+	 * Read the first block and pass it to the MBR code; this is crude
+	 * and does not really belong here.
+	 */
+	struct BIO* bio = bio_read(this, 0, vb_block_size);
+	if (BIO_IS_ERROR(bio))
+		return ANANAS_ERROR(IO); /* XXX should get error from bio */
+
+	mbr_process(this, bio);
+	bio_free(bio);
+	return ananas_success();
+}
+
+errorcode_t
+VirtioBlkDevice::Detach()
+{
+	/* A reset stops all DMA; everything the device wrote is already on disk */
+	return Reset();
+}
+
+struct VirtioBlk_Driver : public Ananas::Driver
+{
+	VirtioBlk_Driver()
+	 : Driver("virtioblk")
+	{
+	}
+
+	const char* GetBussesToProbeOn() const override
+	{
+		return "pcibus";
+	}
+
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PCI_VendorID, VIRTIO_PCI_VENDOR, 0xffff },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
+	bool CanAttachAsynchronously() const override
+	{
+		return true;
+	}
+
+	Ananas::Device* CreateDevice(const Ananas::CreateDeviceProperties& cdp) override
+	{
+		auto res_vendor = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_VendorID, 0);
+		auto res_device = cdp.cdp_ResourceSet.GetResource(Ananas::Resource::RT_PCI_DeviceID, 0);
+		if (res_vendor == NULL || res_device == NULL || res_vendor->r_Base != VIRTIO_PCI_VENDOR)
+			return nullptr;
+
+		/* Transitional devices may offer the modern interface as well; Attach() checks */
+		if (res_device->r_Base == VIRTIO_PCI_DEVICE_BLK || res_device->r_Base == VIRTIO_PCI_DEVICE_BLK_LEGACY)
+			return new VirtioBlkDevice(cdp);
+		return nullptr;
+	}
+};
+
+} // unnamed namespace
+
+REGISTER_DRIVER(VirtioBlk_Driver)
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,139 @@
+#ifndef __ANANAS_VIRTIO_REG_H__
+#define __ANANAS_VIRTIO_REG_H__
+
+#include <ananas/types.h>
+
+/*
+ * Virtio 1.0 over PCI ("modern" devices); all fields are little endian, as
+ * are we. Legacy devices use an I/O port interface which we don't support.
+ */
+#define VIRTIO_PCI_VENDOR		0x1af4
+#define VIRTIO_PCI_DEVICE_BLK_LEGACY	0x1001	/* transitional; may also do modern */
+#define VIRTIO_PCI_DEVICE_BLK		0x1042	/* 0x1040 + device type 2 */
+
+/* Vendor-specific capabilities describe where the structures live */
+#define VIRTIO_PCI_CAP_CFG_TYPE		0x03		/* u8 */
+#define  VIRTIO_PCI_CAP_COMMON_CFG	1
+#define  VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define  VIRTIO_PCI_CAP_ISR_CFG		3
+#define  VIRTIO_PCI_CAP_DEVICE_CFG	4
+#define VIRTIO_PCI_CAP_BAR		0x04		/* u8 */
+#define VIRTIO_PCI_CAP_OFFSET		0x08		/* le32 */
+#define VIRTIO_PCI_CAP_LENGTH		0x0c		/* le32 */
+#define VIRTIO_PCI_CAP_NOTIFY_MULT	0x10		/* le32, notify capability only */
+
+/* Common configuration structure */
+#define VIRTIO_COMMON_DFSELECT		0x00		/* le32 Device Feature Select */
+#define VIRTIO_COMMON_DF		0x04		/* le32 Device Feature */
+#define VIRTIO_COMMON_GFSELECT		0x08		/* le32 Driver (Guest) Feature Select */
+#define VIRTIO_COMMON_GF		0x0c		/* le32 Driver (Guest) Feature */
+#define VIRTIO_COMMON_MSIX		0x10		/* le16 Configuration MSI-X Vector */
+#define VIRTIO_COMMON_NUMQ		0x12		/* le16 Number of Queues */
+#define VIRTIO_COMMON_STATUS		0x14		/* u8 Device Status */
+#define  VIRTIO_STATUS_ACKNOWLEDGE	(1 << 0)
+#define  VIRTIO_STATUS_DRIVER		(1 << 1)
+#define  VIRTIO_STATUS_DRIVER_OK	(1 << 2)
+#define  VIRTIO_STATUS_FEATURES_OK	(1 << 3)
+#define  VIRTIO_STATUS_NEEDS_RESET	(1 << 6)
+#define  VIRTIO_STATUS_FAILED		(1 << 7)
+#define VIRTIO_COMMON_CFGGEN		0x15		/* u8 Configuration Generation */
+#define VIRTIO_COMMON_Q_SELECT		0x16		/* le16 Queue Select */
+#define VIRTIO_COMMON_Q_SIZE		0x18		/* le16 Queue Size */
+#define VIRTIO_COMMON_Q_MSIX		0x1a		/* le16 Queue MSI-X Vector */
+#define VIRTIO_COMMON_Q_ENABLE		0x1c		/* le16 Queue Enable */
+#define VIRTIO_COMMON_Q_NOFF		0x1e		/* le16 Queue Notify Offset */
+#define VIRTIO_COMMON_Q_DESC		0x20		/* le64 Descriptor Table address */
+#define VIRTIO_COMMON_Q_AVAIL		0x28		/* le64 Available Ring address */
+#define VIRTIO_COMMON_Q_USED		0x30		/* le64 Used Ring address */
+#define VIRTIO_MSI_NO_VECTOR		0xffff
+
+/* ISR status; reading clears it. Only used without MSI-X */
+#define VIRTIO_ISR_QUEUE		(1 << 0)
+#define VIRTIO_ISR_CONFIG		(1 << 1)
+
+/* Feature bits */
+#define VIRTIO_F_RING_INDIRECT_DESC	28
+#define VIRTIO_F_RING_EVENT_IDX		29
+#define VIRTIO_F_VERSION_1		32
+
+/* Split virtqueues */
+struct VRING_DESC {
+	uint64_t	d_addr;
+	uint32_t	d_len;
+	uint16_t	d_flags;
+#define VRING_DESC_F_NEXT		(1 << 0)	/* d_next is valid */
+#define VRING_DESC_F_WRITE		(1 << 1)	/* device writes */
+#define VRING_DESC_F_INDIRECT		(1 << 2)	/* d_addr is a table of descriptors */
+	uint16_t	d_next;
+};
+
+/* Followed by a le16 used_event, if VIRTIO_F_RING_EVENT_IDX is negotiated */
+struct VRING_AVAIL {
+	uint16_t	a_flags;
+#define VRING_AVAIL_F_NO_INTERRUPT	(1 << 0)
+	uint16_t	a_idx;
+	uint16_t	a_ring[];
+};
+
+struct VRING_USED_ELEM {
+	uint32_t	ue_id;		/* head of the descriptor chain */
+	uint32_t	ue_len;		/* bytes written by the device */
+};
+
+/* Followed by a le16 avail_event, if VIRTIO_F_RING_EVENT_IDX is negotiated */
+struct VRING_USED {
+	uint16_t	u_flags;
+#define VRING_USED_F_NO_NOTIFY		(1 << 0)
+	uint16_t	u_idx;
+	struct VRING_USED_ELEM u_ring[];
+};
+
+/* Queue memory layout; the descriptors, avail and used ring must be aligned to 16, 2 and 4 bytes */
+#define VRING_DESC_SIZE(n)		((n) * sizeof(struct VRING_DESC))
+#define VRING_AVAIL_SIZE(n)		(sizeof(struct VRING_AVAIL) + ((n) + 1) * sizeof(uint16_t))
+#define VRING_USED_SIZE(n)		(sizeof(struct VRING_USED) + (n) * sizeof(struct VRING_USED_ELEM) + sizeof(uint16_t))
+#define VRING_USED_OFFSET(n)		((VRING_DESC_SIZE(n) + VRING_AVAIL_SIZE(n) + 3) & ~3)
+#define VRING_SIZE(n)			(VRING_USED_OFFSET(n) + VRING_USED_SIZE(n))
+
+/*
+ * With event indices, the other side wants to be told once the index passes
+ * event; returns whether moving from old to new_idx did that.
+ */
+static inline bool
+vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old)
+{
+	return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+/* Block device */
+#define VIRTIO_BLK_F_SIZE_MAX		1	/* blk_size_max is valid */
+#define VIRTIO_BLK_F_SEG_MAX		2	/* blk_seg_max is valid */
+#define VIRTIO_BLK_F_RO			5	/* device is read-only */
+#define VIRTIO_BLK_F_BLK_SIZE		6	/* blk_blk_size is valid */
+#define VIRTIO_BLK_F_FLUSH		9	/* device has a write cache; VIRTIO_BLK_T_FLUSH works */
+#define VIRTIO_BLK_F_MQ			12	/* blk_num_queues is valid */
+
+/* Device configuration structure */
+#define VIRTIO_BLK_CFG_CAPACITY		0x00		/* le64, in 512 byte sectors */
+#define VIRTIO_BLK_CFG_SIZE_MAX		0x08		/* le32 */
+#define VIRTIO_BLK_CFG_SEG_MAX		0x0c		/* le32 */
+#define VIRTIO_BLK_CFG_BLK_SIZE		0x14		/* le32 */
+#define VIRTIO_BLK_CFG_NUM_QUEUES	0x22		/* le16 */
+
+#define VIRTIO_BLK_SECTOR_SIZE		512
+
+/* Every request is a header, the data and a status byte written by the device */
+struct VIRTIO_BLK_REQ {
+	uint32_t	r_type;
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+	uint32_t	r_reserved;
+	uint64_t	r_sector;
+};
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#endif /* __ANANAS_VIRTIO_REG_H__ */
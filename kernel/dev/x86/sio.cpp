@@ -1,16 +1,21 @@
 #include <ananas/x86/io.h>
+#include <ananas/cmdline.h>
 #include <ananas/console.h>
 #include <ananas/device.h>
 #include <ananas/driver.h>
 #include <ananas/error.h>
 #include <ananas/irq.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <ananas/tty.h>
 #include <ananas/mm.h>
 #include <ananas/x86/sio.h>
+#include <machine/interrupts.h>
 
 #define SIO_BUFFER_SIZE	16
+#define SIO_TX_BUFFER_SIZE	4096	/* Must be a power of two */
+#define SIO_DEFAULT_BAUD	115200
 
 TRACE_SETUP;
 
@@ -40,6 +45,8 @@ public:
 
 private:
 	void OnIRQ();
+	void WritePolled(const char* data, size_t len);
+	void FillTransmitFIFO();
 
 	static irqresult_t IRQWrapper(Ananas::Device* device, void* context)
 	{
@@ -53,17 +60,80 @@ private:
 	uint8_t sio_buffer[SIO_BUFFER_SIZE];
 	uint8_t sio_buffer_readpos;
 	uint8_t sio_buffer_writepos;
+
+	/*
+	 * Outgoing data buffer; filled by Write() and drained by the transmit
+	 * interrupt. The read and write positions are free-running counters.
+	 */
+	spinlock_t sio_tx_lock;
+	char sio_tx_buffer[SIO_TX_BUFFER_SIZE];
+	unsigned int sio_tx_readpos;
+	unsigned int sio_tx_writepos;
+	unsigned int sio_tx_fifo_size;	/* Bytes we may write per THRE condition */
+	bool sio_tx_irq;	/* Transmit interrupt is usable */
 };
 
+/* Must be called with sio_tx_lock held and the transmit holding register empty */
+void
+SIO::FillTransmitFIFO()
+{
+	for (unsigned int n = 0; n < sio_tx_fifo_size && sio_tx_readpos != sio_tx_writepos; n++) {
+		outb(sio_port + SIO_REG_DATA, sio_tx_buffer[sio_tx_readpos % SIO_TX_BUFFER_SIZE]);
+		sio_tx_readpos++;
+	}
+
+	/* Only ask for the interrupt if there is something left to send */
+	uint8_t ier = SIO_IER_RDA;
+	if (sio_tx_readpos != sio_tx_writepos)
+		ier |= SIO_IER_THRE;
+	outb(sio_port + SIO_REG_IER, ier);
+}
+
+/*
+ * Writes directly to the port, without taking any locks; this is used when
+ * interrupts are disabled, i.e. by panic() and the kernel debugger, which
+ * must be able to print no matter what state the transmit buffer is in.
+ */
+void
+SIO::WritePolled(const char* data, size_t len)
+{
+	while (len > 0) {
+		while ((inb(sio_port + SIO_REG_LSR) & SIO_LSR_THRE) == 0)
+			/* nothing */;
+		for (unsigned int n = 0; n < sio_tx_fifo_size && len > 0; n++, len--)
+			outb(sio_port + SIO_REG_DATA, *data++);
+	}
+}
+
 void
 SIO::OnIRQ()
 {
-	uint8_t ch = inb(sio_port + SIO_REG_DATA);
-	sio_buffer[sio_buffer_writepos] = ch;
-	sio_buffer_writepos = (sio_buffer_writepos + 1) % SIO_BUFFER_SIZE;
+	bool got_data = false;
+	while (true) {
+		uint8_t iir = inb(sio_port + SIO_REG_IIR);
+		if (iir & SIO_IIR_NONE)
+			break;
+
+		if ((iir & SIO_IIR_ID_MASK) == SIO_IIR_THRE) {
+			register_t state = spinlock_lock_unpremptible(&sio_tx_lock);
+			FillTransmitFIFO();
+			spinlock_unlock_unpremptible(&sio_tx_lock, state);
+			continue;
+		}
+
+		/* Receive data (or a line status change); drain whatever is there */
+		while (inb(sio_port + SIO_REG_LSR) & SIO_LSR_DR) {
+			uint8_t ch = inb(sio_port + SIO_REG_DATA);
+			sio_buffer[sio_buffer_writepos] = ch;
+			sio_buffer_writepos = (sio_buffer_writepos + 1) % SIO_BUFFER_SIZE;
+			got_data = true;
+		}
+		if ((iir & SIO_IIR_ID_MASK) == 0)
+			(void)inb(sio_port + SIO_REG_MSR); /* Modem status; acknowledge it */
+	}
 
 	/* XXX signal consumers - this is a hack */
-	if (console_tty != NULL && tty_get_inputdev(console_tty) == this)
+	if (got_data && console_tty != NULL && tty_get_inputdev(console_tty) == this)
 		tty_signal_data();
 }
 
@@ -76,21 +146,47 @@ SIO::Attach()
 		return ANANAS_ERROR(NO_RESOURCE);
 
 	sio_port = (uint32_t)(uintptr_t)res_io;
+	spinlock_init(&sio_tx_lock);
+	sio_tx_readpos = 0;
+	sio_tx_writepos = 0;
+	sio_tx_fifo_size = 1;
+	sio_tx_irq = false;
 
-	/* SIO is so simple that a plain ISR will do */
-	errorcode_t err = irq_register((uintptr_t)res_irq, this, &IRQWrapper, IRQ_TYPE_ISR, NULL);
-	ANANAS_ERROR_RETURN(err);
+	/*
+	 * The baud rate can be set using 'sio_baud=rate' on the command line; the
+	 * UART clock only allows rates that divide 115200.
+	 */
+	unsigned int baud = SIO_DEFAULT_BAUD;
+	const char* baud_arg = cmdline_get_string("sio_baud");
+	if (baud_arg != NULL && strtoul(baud_arg, NULL, 10) > 0)
+		baud = strtoul(baud_arg, NULL, 10);
+	unsigned int divisor = SIO_CLOCK_BAUD / baud;
+	if (divisor == 0)
+		divisor = 1;
+	if (divisor > 0xffff)
+		divisor = 0xffff;
 
 	/*
 	 * Wire up the serial port for sensible defaults.
 	 */
 	outb(sio_port + SIO_REG_IER, 0);			/* Disables interrupts */
 	outb(sio_port + SIO_REG_LCR, 0x80);	/* Enable DLAB */
-	outb(sio_port + SIO_REG_DATA, 0xc);	/* Divisor low byte (9600 baud) */
-	outb(sio_port + SIO_REG_IER,  0);		/* Divisor hi byte */
+	outb(sio_port + SIO_REG_DATA, divisor & 0xff);	/* Divisor low byte */
+	outb(sio_port + SIO_REG_IER, divisor >> 8);	/* Divisor hi byte */
 	outb(sio_port + SIO_REG_LCR, 3);			/* 8N1 */
 	outb(sio_port + SIO_REG_FIFO, 0xc7);	/* Enable/clear FIFO (14 bytes) */
-	outb(sio_port + SIO_REG_IER, 0x01);	/* Enable interrupts (recv only) */
+	outb(sio_port + SIO_REG_MCR, SIO_MCR_DTR | SIO_MCR_RTS | SIO_MCR_OUT2);
+
+	/* Only a 16550A has a working FIFO; older parts can take a single byte */
+	if ((inb(sio_port + SIO_REG_IIR) & SIO_IIR_FIFO) == SIO_IIR_FIFO)
+		sio_tx_fifo_size = SIO_FIFO_SIZE;
+
+	/* SIO is so simple that a plain ISR will do */
+	errorcode_t err = irq_register((uintptr_t)res_irq, this, &IRQWrapper, IRQ_TYPE_ISR, NULL);
+	ANANAS_ERROR_RETURN(err);
+
+	outb(sio_port + SIO_REG_IER, SIO_IER_RDA);	/* Enable interrupts (recv only until we transmit) */
+	sio_tx_irq = true;
 	return ananas_success();
 }
 
@@ -106,11 +202,33 @@ SIO::Write(const void* data, size_t& len, off_t offset)
 {
 	const char* ch = (const char*)data;
 
+	/*
+	 * With interrupts disabled, we'd never see the transmit interrupt and
+	 * may even hold the lock ourselves (panic, kdb) - just poll the port.
+	 */
+	if (!sio_tx_irq || !md_interrupts_save()) {
+		WritePolled(ch, len);
+		return ananas_success();
+	}
+
+	register_t state = spinlock_lock_unpremptible(&sio_tx_lock);
 	for (size_t n = 0; n < len; n++, ch++) {
-		while ((inb(sio_port + SIO_REG_LSR) & 0x20) == 0)
-			/* nothing */;
-		outb(sio_port + SIO_REG_DATA, *ch);
+		if (sio_tx_writepos - sio_tx_readpos == SIO_TX_BUFFER_SIZE) {
+			/* Buffer is full; make room by waiting for the hardware */
+			while ((inb(sio_port + SIO_REG_LSR) & SIO_LSR_THRE) == 0)
+				/* nothing */;
+			FillTransmitFIFO();
+		}
+		sio_tx_buffer[sio_tx_writepos % SIO_TX_BUFFER_SIZE] = *ch;
+		sio_tx_writepos++;
 	}
+
+	/* Get things going if the transmitter is idle; the interrupt does the rest */
+	if (inb(sio_port + SIO_REG_LSR) & SIO_LSR_THRE)
+		FillTransmitFIFO();
+	else
+		outb(sio_port + SIO_REG_IER, SIO_IER_RDA | SIO_IER_THRE);
+	spinlock_unlock_unpremptible(&sio_tx_lock, state);
 	return ananas_success();
 }
 
@@ -143,6 +261,15 @@ struct SIO_Driver : public Ananas::ConsoleDriver
 		return "acpi";
 	}
 
+	const Ananas::DriverMatch* GetMatchTable() const override
+	{
+		static const Ananas::DriverMatch match[] = {
+			{ Ananas::Resource::RT_PNP_ID, 0x0501, ~(Ananas::Resource::Base)0 },
+			{ Ananas::Resource::RT_Unused }
+		};
+		return match;
+	}
+
 	Ananas::Device* ProbeDevice() override
 	{
 		// XXX NOTYET - how do you probe SIO anyway?
@@ -37,28 +37,25 @@ struct VGA : public Ananas::Device, private Ananas::IDeviceOperations, private A
 		return this;
 	}
 
-	struct Pixel {
-		Pixel()
-		 : p_c(0), p_a({ 0, 0, 0 })
-		{
-		}
-
-		Pixel(teken_char_t c, teken_attr_t a)
-		 : p_c(c), p_a(a)
-		{
-		}
-
-		teken_char_t p_c;
-		teken_attr_t p_a;
-	};
-
 	void WriteCRTC(uint8_t reg, uint8_t val);
-	void PutPixel(int x, int y, const Pixel& pixel);
 	void SetCursor(int x, int y);
+	void Flush();
+
+	static uint16_t MakeCell(teken_char_t c, const teken_attr_t& a)
+	{
+		/* XXX little endian */
+		return (uint16_t)(teken_256to8(a.ta_fgcolor) + 8 * teken_256to8(a.ta_bgcolor)) << 8 | c;
+	}
 
-	Pixel& PixelAt(int x, int y)
+	uint16_t* CellAt(int x, int y)
 	{
-		return vga_buffer[(y) * VGA_WIDTH + (x)];
+		return &vga_shadow[y * VGA_WIDTH + x];
+	}
+
+	void MarkDirty(int first_row, int end_row)
+	{
+		for (int y = first_row; y < end_row; y++)
+			vga_dirty |= 1 << y;
 	}
 
 	errorcode_t Attach() override;
@@ -67,12 +64,25 @@ struct VGA : public Ananas::Device, private Ananas::IDeviceOperations, private A
 
 	uint32_t vga_io;
 	uint16_t* vga_video_mem;
-	Pixel* vga_buffer;
 	uint8_t vga_attr;
 	teken_t vga_teken;
 	mutex_t vga_mtx_teken;
+
+	/*
+	 * Teken draws into the shadow buffer, which lives in normal cached
+	 * memory; Flush() copies the rows that changed to video memory, so that
+	 * scrolling is a memmove() here and a single pass over the screen there.
+	 * The cursor is only moved there as well.
+	 */
+	uint16_t* vga_shadow;
+	uint32_t vga_dirty;	/* Bit n set if row n needs to be written */
+	int vga_cursor_x, vga_cursor_y;
+	bool vga_cursor_dirty;
 };
 
+static_assert(VGA_HEIGHT <= 32, "dirty row mask too small");
+static_assert(((VGA_WIDTH * sizeof(uint16_t)) % sizeof(uint64_t)) == 0, "rows must be a multiple of 8 bytes");
+
 /* XXX this doesn't really belong here */
 static tf_bell_t		term_bell;
 static tf_cursor_t	term_cursor;
@@ -102,98 +112,54 @@ static void
 term_cursor(void* s, const teken_pos_t* p)
 {
 	auto vga = static_cast<VGA*>(s);
-	vga->SetCursor(p->tp_col, p->tp_row);
+	vga->vga_cursor_x = p->tp_col;
+	vga->vga_cursor_y = p->tp_row;
+	vga->vga_cursor_dirty = true;
 }
 	
 static void
 term_putchar(void *s, const teken_pos_t* p, teken_char_t c, const teken_attr_t* a)
 {
 	auto vga = static_cast<VGA*>(s);
-	auto& pixel = vga->PixelAt(p->tp_col, p->tp_row);
-	pixel = VGA::Pixel(c, *a);
-	vga->PutPixel(p->tp_col, p->tp_row, pixel);
+	*vga->CellAt(p->tp_col, p->tp_row) = VGA::MakeCell(c, *a);
+	vga->MarkDirty(p->tp_row, p->tp_row + 1);
 }
 
 static void
 term_fill(void* s, const teken_rect_t* r, teken_char_t c, const teken_attr_t* a)
 {
-	teken_pos_t p;
+	auto vga = static_cast<VGA*>(s);
+	uint16_t cell = VGA::MakeCell(c, *a);
+	int ncol = r->tr_end.tp_col - r->tr_begin.tp_col;
 
-	/* Braindead implementation of fill() - just call putchar(). */
-	for (p.tp_row = r->tr_begin.tp_row; p.tp_row < r->tr_end.tp_row; p.tp_row++)
-		for (p.tp_col = r->tr_begin.tp_col; p.tp_col < r->tr_end.tp_col; p.tp_col++)
-			term_putchar(s, &p, c, a);
+	for (unsigned int row = r->tr_begin.tp_row; row < r->tr_end.tp_row; row++) {
+		uint16_t* dst = vga->CellAt(r->tr_begin.tp_col, row);
+		for (int x = 0; x < ncol; x++)
+			dst[x] = cell;
+	}
+	vga->MarkDirty(r->tr_begin.tp_row, r->tr_end.tp_row);
 }
 
 static void
 term_copy(void* s, const teken_rect_t* r, const teken_pos_t* p)
 {
 	auto vga = static_cast<VGA*>(s);
-	int nrow, ncol, x, y; /* has to be signed - >= 0 comparison */
-	teken_pos_t d;
-
-	#define VGA_PLACE_PIXEL \
-		vga->PutPixel(d.tp_col, d.tp_row, vga->PixelAt(d.tp_col, d.tp_row))
-
-	/*
-	* copying is a little tricky. we must make sure we do it in
-	* correct order, to make sure we don't overwrite our own data.
-	*/
-
-	nrow = r->tr_end.tp_row - r->tr_begin.tp_row;
-	ncol = r->tr_end.tp_col - r->tr_begin.tp_col;
-
-	if (p->tp_row < r->tr_begin.tp_row) {
-		/* copy from top to bottom. */
-		if (p->tp_col < r->tr_begin.tp_col) {
-			/* copy from left to right. */
-			for (y = 0; y < nrow; y++) {
-				d.tp_row = p->tp_row + y;
-				for (x = 0; x < ncol; x++) {
-					d.tp_col = p->tp_col + x;
-					vga->PixelAt(d.tp_col, d.tp_row) =
-					 vga->PixelAt(r->tr_begin.tp_col + x, r->tr_begin.tp_row + y);
-					VGA_PLACE_PIXEL;
-				}
-			}
-		} else {
-			/* copy from right to left. */
-			for (y = 0; y < nrow; y++) {
-				d.tp_row = p->tp_row + y;
-				for (x = ncol - 1; x >= 0; x--) {
-					d.tp_col = p->tp_col + x;
-					vga->PixelAt(d.tp_col, d.tp_row) =
-					 vga->PixelAt(r->tr_begin.tp_col + x, r->tr_begin.tp_row + y);
-					VGA_PLACE_PIXEL;
-				}
-			}
-		}
+	int nrow = r->tr_end.tp_row - r->tr_begin.tp_row;
+	int ncol = r->tr_end.tp_col - r->tr_begin.tp_col;
+
+	if (ncol == VGA_WIDTH) {
+		/* Whole rows (i.e. scrolling); they are contiguous */
+		memmove(vga->CellAt(0, p->tp_row), vga->CellAt(0, r->tr_begin.tp_row), nrow * VGA_WIDTH * sizeof(uint16_t));
+	} else if (p->tp_row < r->tr_begin.tp_row) {
+		/* Copy from top to bottom; memmove() takes care of overlap within a row */
+		for (int y = 0; y < nrow; y++)
+			memmove(vga->CellAt(p->tp_col, p->tp_row + y), vga->CellAt(r->tr_begin.tp_col, r->tr_begin.tp_row + y), ncol * sizeof(uint16_t));
 	} else {
-		/* copy from bottom to top. */
-		if (p->tp_col < r->tr_begin.tp_col) {
-			/* copy from left to right. */
-			for (y = nrow - 1; y >= 0; y--) {
-				d.tp_row = p->tp_row + y;
-				for (x = 0; x < ncol; x++) {
-					d.tp_col = p->tp_col + x;
-					vga->PixelAt(d.tp_col, d.tp_row) =
-					 vga->PixelAt(r->tr_begin.tp_col + x, r->tr_begin.tp_row + y);
-					VGA_PLACE_PIXEL;
-				}
-			}
-		} else {
-			/* copy from right to left. */
-			for (y = nrow - 1; y >= 0; y--) {
-				d.tp_row = p->tp_row + y;
-				for (x = ncol - 1; x >= 0; x--) {
-					d.tp_col = p->tp_col + x;
-					vga->PixelAt(d.tp_col, d.tp_row) =
-					 vga->PixelAt(r->tr_begin.tp_col + x, r->tr_begin.tp_row + y);
-					VGA_PLACE_PIXEL;
-				}
-			}
-		}
+		/* Copy from bottom to top */
+		for (int y = nrow - 1; y >= 0; y--)
+			memmove(vga->CellAt(p->tp_col, p->tp_row + y), vga->CellAt(r->tr_begin.tp_col, r->tr_begin.tp_row + y), ncol * sizeof(uint16_t));
 	}
+	vga->MarkDirty(p->tp_row, p->tp_row + nrow);
 }
 
 static void
@@ -215,15 +181,6 @@ VGA::WriteCRTC(uint8_t reg, uint8_t val)
 	outb(vga_io + 0x15, val);
 }
 
-void
-VGA::PutPixel(int x, int y, const Pixel& px)
-{
-	/* XXX little endian */
-	*(uint16_t*)(vga_video_mem + y * VGA_WIDTH + x) =
-	 (uint16_t)(teken_256to8(px.p_a.ta_fgcolor) + 8 * teken_256to8(px.p_a.ta_bgcolor)) << 8 |
-	 px.p_c;
-}
-
 void
 VGA::SetCursor(int x, int y)
 {
@@ -232,6 +189,25 @@ VGA::SetCursor(int x, int y)
 	WriteCRTC(0xf, offs & 0xff);
 }
 
+/* Copies all dirty rows to video memory; must be called with vga_mtx_teken held */
+void
+VGA::Flush()
+{
+	for (uint32_t dirty = vga_dirty; dirty != 0; dirty &= dirty - 1) {
+		int y = __builtin_ctz(dirty);
+		auto src = reinterpret_cast<const uint64_t*>(CellAt(0, y));
+		auto dst = reinterpret_cast<volatile uint64_t*>(vga_video_mem + y * VGA_WIDTH);
+		for (unsigned int n = 0; n < (VGA_WIDTH * sizeof(uint16_t)) / sizeof(uint64_t); n++)
+			dst[n] = src[n];
+	}
+	vga_dirty = 0;
+
+	if (vga_cursor_dirty) {
+		SetCursor(vga_cursor_x, vga_cursor_y);
+		vga_cursor_dirty = false;
+	}
+}
+
 errorcode_t
 VGA::Attach()
 {
@@ -243,14 +219,20 @@ VGA::Attach()
 	vga_io        = (uintptr_t)res;
 	vga_video_mem = static_cast<uint16_t*>(mem);
 	vga_attr      = 0xf;
-	vga_buffer    = new Pixel[VGA_HEIGHT * VGA_WIDTH];
+	vga_shadow    = new uint16_t[VGA_HEIGHT * VGA_WIDTH];
+	vga_cursor_x  = 0;
+	vga_cursor_y  = 0;
+	vga_cursor_dirty = false;
+	vga_dirty     = 0;
 
 	// Clear the display; we must set the attribute everywhere for the cursor XXX little endian
-	uint16_t* ptr = vga_video_mem;
+	uint16_t* ptr = vga_shadow;
 	int size = VGA_HEIGHT * VGA_WIDTH;
 	while(size--) {
 		*ptr++ = (vga_attr << 8) | ' ';
 	}
+	MarkDirty(0, VGA_HEIGHT);
+	Flush();
 
 	// Set cursor shape
 	WriteCRTC(0xa, 14);
@@ -276,15 +258,10 @@ errorcode_t
 VGA::Write(const void* buffer, size_t& len, off_t offset)
 {
 	auto ptr = static_cast<const uint8_t*>(buffer);
-	size_t left = len;
 	mutex_lock(&vga_mtx_teken);
-	while(left--) {
-		/* XXX this is a hack which should be performed in a TTY layer, once we have one */
-		if(*ptr == '\n')
-			teken_input(&vga_teken, "\r", 1);
-		teken_input(&vga_teken, ptr, 1);
-		ptr++;
-	}
+	/* Newline translation is up to the TTY layer */
+	teken_input(&vga_teken, ptr, len);
+	Flush();
 	mutex_unlock(&vga_mtx_teken);
 	return ananas_success();
 }
@@ -1,10 +1,12 @@
 #include <ananas/types.h>
+#include <ananas/bio.h>
 #include <ananas/error.h>
 #include <ananas/vfs.h>
 #include <ananas/vfs/core.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/driver.h>
 #include <ananas/device.h>
+#include <ananas/irq.h>
 #include <ananas/vmspace.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
@@ -79,6 +81,7 @@ public:
 					return ananas_success();
 				case Devices::subDevices:
 				case Devices::subDrivers:
+				case Devices::subInterrupts:
 					inode->i_sb.st_mode |= S_IFREG;
 					return ananas_success();
 			}
@@ -132,12 +135,42 @@ public:
 					}
 					break;
 				}
+				case Devices::subInterrupts: {
+					// irq cpu flags count stray devices
+					irq_get_status(result, sizeof(result));
+					break;
+				}
 			}
 			return AnkhFS::HandleRead(file, buf, len, result);
 		}
 
-		// TODO
-		return ANANAS_ERROR(IO);
+		Device* device = DeviceManager::FindDevice(devno);
+		if (device == nullptr || device->GetBIODeviceOperations() == nullptr)
+			return ANANAS_ERROR(IO);
+
+		// Block devices describe their I/O statistics
+		struct BIO_STATS stats;
+		if (!bio_queue_get_stats(device, &stats))
+			memset(&stats, 0, sizeof(stats));
+
+		char result[1024];
+		snprintf(result, sizeof(result),
+		 "reads %u\nread_kb %u\nwrites %u\nwrite_kb %u\ncache_hits %u\ncache_misses %u\nqueue_depth %u\nqueue_depth_max %u\n",
+		 (unsigned int)stats.bs_requests[0], (unsigned int)(stats.bs_bytes[0] / 1024),
+		 (unsigned int)stats.bs_requests[1], (unsigned int)(stats.bs_bytes[1] / 1024),
+		 (unsigned int)stats.bs_cache_hits, (unsigned int)stats.bs_cache_misses,
+		 stats.bs_queue_depth, stats.bs_queue_depth_max);
+		// Latency histograms; bucket n holds requests that took less than 2^n us
+		for (unsigned int dir = 0; dir < 2; dir++) {
+			char* r = result + strlen(result);
+			snprintf(r, sizeof(result) - (r - result), "%s_latency_log2_us", dir == 0 ? "read" : "write");
+			for (unsigned int n = 0; n < BIO_STATS_LATENCY_BUCKETS; n++) {
+				r += strlen(r);
+				snprintf(r, sizeof(result) - (r - result), " %u", (unsigned int)stats.bs_latency[dir][n]);
+			}
+			strcat(r, "\n");
+		}
+		return AnkhFS::HandleRead(file, buf, len, result);
 	}
 };
 
@@ -0,0 +1,156 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/bio.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/process.h>
+#include <ananas/slab.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/core.h>
+#include <ananas/vfs/dentry.h>
+#include <ananas/vfs/generic.h>
+#include <ananas/vfs/icache.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
+#include <ananas/trace.h>
+#include <ananas/lib.h>
+#include "memory.h"
+#include "support.h"
+
+TRACE_SETUP;
+
+/*
+ * /ankh/memory describes where memory went:
+ *
+ * - 'pages' lists every zone with its free blocks per order.
+ * - 'slabs' lists every slab cache with its object size and usage.
+ * - 'kmalloc' lists the kmalloc() arena of every CPU.
+ * - 'caches' lists the memory held by the buffer, inode and dentry caches.
+ * - 'processes' lists the number of pages mapped by every process.
+ */
+namespace Ananas {
+namespace Process {
+
+extern mutex_t process_mtx;
+extern struct PROCESS_QUEUE process_all;
+
+} // namespace Process
+
+namespace AnkhFS {
+namespace {
+
+constexpr unsigned int subPages = 1;
+constexpr unsigned int subSlabs = 2;
+constexpr unsigned int subKmalloc = 3;
+constexpr unsigned int subCaches = 4;
+constexpr unsigned int subProcesses = 5;
+
+struct DirectoryEntry memory_entries[] = {
+	{ "pages", make_inum(SS_Memory, 0, subPages) },
+	{ "slabs", make_inum(SS_Memory, 0, subSlabs) },
+	{ "kmalloc", make_inum(SS_Memory, 0, subKmalloc) },
+	{ "caches", make_inum(SS_Memory, 0, subCaches) },
+	{ "processes", make_inum(SS_Memory, 0, subProcesses) },
+	{ NULL, 0 }
+};
+
+constexpr size_t memoryResultLength = 8192;
+
+void
+GetCacheStatus(char* buf, size_t len)
+{
+	bio_get_status(buf, len);
+	size_t used = strlen(buf);
+	icache_get_status(buf + used, len - used);
+	used += strlen(buf + used);
+	dcache_get_status(buf + used, len - used);
+}
+
+void
+GetProcessStatus(char* buf, size_t len)
+{
+	char* r = buf;
+	*r = '\0';
+	mutex_lock(&Process::process_mtx);
+	LIST_FOREACH_IP(&Process::process_all, all, p, process_t) {
+		if (p->p_vmspace == nullptr)
+			continue;
+
+		// Pages which link to another page are shared with it, and counted as such
+		unsigned int num_pages = 0, num_shared = 0;
+		vmspace_lock_read(p->p_vmspace);
+		LIST_FOREACH(&p->p_vmspace->vs_areas, va, vmarea_t) {
+			vmarea_lock(va);
+			LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
+				num_pages++;
+				if (vp->vp_flags & (VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_LENT))
+					num_shared++;
+			}
+			vmarea_unlock(va);
+		}
+		vmspace_unlock_read(p->p_vmspace);
+
+		snprintf(r, len - (r - buf), "%d pages %u shared %u\n", (int)p->p_pid, num_pages, num_shared);
+		r += strlen(r);
+	}
+	mutex_unlock(&Process::process_mtx);
+}
+
+class MemorySubSystem : public IAnkhSubSystem
+{
+public:
+	errorcode_t HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len) override
+	{
+		return AnkhFS::HandleReadDir(file, dirents, len, memory_entries[0]);
+	}
+
+	errorcode_t FillInode(struct VFS_INODE* inode, ino_t inum) override
+	{
+		if (inum_to_sub(inum) == 0)
+			inode->i_sb.st_mode |= S_IFDIR;
+		else
+			inode->i_sb.st_mode |= S_IFREG;
+		return ananas_success();
+	}
+
+	errorcode_t HandleRead(struct VFS_FILE* file, void* buf, size_t* len) override
+	{
+		auto result = static_cast<char*>(kmalloc(memoryResultLength));
+		switch(inum_to_sub(file->f_dentry->d_inode->i_inum)) {
+			case subPages:
+				page_get_status(result, memoryResultLength);
+				break;
+			case subSlabs:
+				slab_get_status(result, memoryResultLength);
+				break;
+			case subKmalloc:
+				mm_get_status(result, memoryResultLength);
+				break;
+			case subCaches:
+				GetCacheStatus(result, memoryResultLength);
+				break;
+			case subProcesses:
+				GetProcessStatus(result, memoryResultLength);
+				break;
+			default:
+				kfree(result);
+				return ANANAS_ERROR(IO);
+		}
+		errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+		kfree(result);
+		return err;
+	}
+};
+
+} // unnamed namespace
+
+IAnkhSubSystem& GetMemorySubSystem()
+{
+	static MemorySubSystem memorySubSystem;
+	return memorySubSystem;
+}
+
+} // namespace AnkhFS
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
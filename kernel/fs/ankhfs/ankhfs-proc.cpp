@@ -1,10 +1,15 @@
 #include <ananas/types.h>
+#include <ananas/cpupower.h>
 #include <ananas/error.h>
+#include <ananas/mm.h>
+#include <ananas/pcpu.h>
+#include <ananas/thread.h>
 #include <ananas/vfs.h>
 #include <ananas/vfs/core.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/process.h>
 #include <ananas/procinfo.h>
+#include <ananas/taskstats.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
 #include <ananas/trace.h>
@@ -28,18 +33,84 @@ namespace {
 
 constexpr unsigned int subName = 1;
 constexpr unsigned int subVmSpace = 2;
+constexpr unsigned int subSched = 3;
+constexpr unsigned int subStats = 4;
+constexpr unsigned int subPower = 5;
+constexpr unsigned int subPerfCtr = 6;
 
 struct DirectoryEntry proc_entries[] = {
 	{ "name", make_inum(SS_Proc, 0, subName) },
 	{ "vmspace", make_inum(SS_Proc, 0, subVmSpace) },
+	{ "sched", make_inum(SS_Proc, 0, subSched) },
+	{ "stats", make_inum(SS_Proc, 0, subStats) },
+	{ "perfctr", make_inum(SS_Proc, 0, subPerfCtr) },
 	{ NULL, 0 }
 };
 
+constexpr size_t cpuLineLength = 96 + SCHED_LATENCY_BUCKETS * 12;
+constexpr size_t statsLength = 128 + TASKSTATS_MAX_SYSCALLS * 64;
+constexpr size_t powerLineLength = 160;
+
+// System-wide scheduler statistics, one line per CPU
+errorcode_t
+HandleRead_Sched(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	unsigned int num_cpus = pcpu_get_count();
+	auto result = static_cast<char*>(kmalloc(num_cpus * cpuLineLength + 1));
+	char* r = result;
+	*r = '\0';
+	for (unsigned int n = 0; n < num_cpus; n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu == NULL)
+			continue;
+		// Idle time is the time the idle thread ran; latency bucket n holds waits below 2^n us
+		snprintf(r, cpuLineLength, "cpu%u switches %u idle_ms %u rt_throttled %u latency_log2_us", n,
+		 (unsigned int)pcpu->sched_switches, (unsigned int)(pcpu->idlethread->t_sched_priv.sp_run_ns / 1000000),
+		 pcpu->sched_rt_throttle_count);
+		for (unsigned int b = 0; b < SCHED_LATENCY_BUCKETS; b++) {
+			r += strlen(r);
+			snprintf(r, cpuLineLength, " %u", (unsigned int)pcpu->sched_latency[b]);
+		}
+		strcat(r, "\n");
+		r += strlen(r);
+	}
+	errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+	kfree(result);
+	return err;
+}
+
+// Power state of every CPU, one line per CPU; see cpupower_format()
+errorcode_t
+HandleRead_Power(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	unsigned int num_cpus = pcpu_get_count();
+	auto result = static_cast<char*>(kmalloc(num_cpus * powerLineLength + 1));
+	char* r = result;
+	*r = '\0';
+	for (unsigned int n = 0; n < num_cpus && cpupower_format(n, r, powerLineLength); n++)
+		r += strlen(r);
+	errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+	kfree(result);
+	return err;
+}
+
 errorcode_t
 HandleReadDir_Proc_Root(struct VFS_FILE* file, void* dirents, size_t* len)
 {
 	struct FetchEntry : IReadDirCallback {
 		bool FetchNextEntry(char* entry, size_t maxLength, ino_t& inum) override {
+			if (!doneSched) {
+				strncpy(entry, "sched", maxLength);
+				inum = make_inum(SS_Proc, 0, subSched);
+				doneSched = true;
+				return true;
+			}
+			if (!donePower) {
+				strncpy(entry, "power", maxLength);
+				inum = make_inum(SS_Proc, 0, subPower);
+				donePower = true;
+				return true;
+			}
 			if (currentProcess == nullptr)
 				return false;
 
@@ -50,6 +121,8 @@ HandleReadDir_Proc_Root(struct VFS_FILE* file, void* dirents, size_t* len)
 			return true;
 		}
 
+		bool doneSched = false;
+		bool donePower = false;
 		process_t* currentProcess = LIST_HEAD(&Process::process_all);
 	};
 
@@ -90,10 +163,24 @@ public:
 		ino_t inum = file->f_dentry->d_inode->i_inum;
 
 		pid_t pid = static_cast<pid_t>(inum_to_id(inum));
+		if (pid == 0 && inum_to_sub(inum) == subSched)
+			return HandleRead_Sched(file, buf, len);
+		if (pid == 0 && inum_to_sub(inum) == subPower)
+			return HandleRead_Power(file, buf, len);
 		process_t* p = process_lookup_by_id_and_ref(pid);
 		if (p == nullptr)
 			return ANANAS_ERROR(IO);
 
+		if (inum_to_sub(inum) == subStats) {
+			// Statistics of all threads, including those which are gone
+			auto result = static_cast<char*>(kmalloc(statsLength));
+			taskstats_format(&p->p_stats, result, statsLength);
+			process_deref(p);
+			errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+			kfree(result);
+			return err;
+		}
+
 		char result[256]; // XXX
 		strcpy(result, "???");
 		switch(inum_to_sub(inum)) {
@@ -104,8 +191,8 @@ public:
 			}
 			case subVmSpace: {
 				if (p->p_vmspace != nullptr) {
-					// XXX shouldn't we lock something here?'
 					char* r = result;
+					vmspace_lock_read(p->p_vmspace);
 					LIST_FOREACH(&p->p_vmspace->vs_areas, va, vmarea_t) {
 						snprintf(r, sizeof(result) - (r - result), "%p %p %c%c%c\n",
 						 reinterpret_cast<void*>(va->va_virt), reinterpret_cast<void*>(va->va_len),
@@ -114,9 +201,28 @@ public:
 						 (va->va_flags & VM_FLAG_EXECUTE) ? 'x' : '-');
 						r += strlen(r);
 					}
+					vmspace_unlock_read(p->p_vmspace);
 				}
 				break;
 			}
+			case subSched: {
+				// Only the main thread; the current timeslice is not included
+				thread_t* t = p->p_mainthread;
+				if (t != nullptr) {
+					const struct SCHED_PRIV& sp = t->t_sched_priv;
+					snprintf(result, sizeof(result), "run_ms %u\nwait_ms %u\nvoluntary %u\ninvoluntary %u\n",
+					 (unsigned int)(sp.sp_run_ns / 1000000), (unsigned int)(sp.sp_wait_ns / 1000000),
+					 sp.sp_voluntary, sp.sp_involuntary);
+				}
+				break;
+			}
+			case subPerfCtr: {
+				// All threads, excluding the slices of those running right now
+				struct PERFCTR_COUNTS counts;
+				perfctr_get_process(p, &counts);
+				perfctr_format(&counts, result, sizeof(result));
+				break;
+			}
 		}
 		result[sizeof(result) - 1] = '\0';
 		process_deref(p);
@@ -20,6 +20,10 @@ struct DirectoryEntry root_entries[] = {
 	{ "dev", make_inum(SS_Device, 0, Devices::subRoot) },
 	{ "devices", make_inum(SS_Device, 0, Devices::subDevices) },
 	{ "drivers", make_inum(SS_Device, 0, Devices::subDrivers) },
+	{ "interrupts", make_inum(SS_Device, 0, Devices::subInterrupts) },
+	{ "trace", make_inum(SS_Trace, 0, 0) },
+	{ "memory", make_inum(SS_Memory, 0, 0) },
+	{ "sys", make_inum(SS_Sys, 0, 0) },
 	{ NULL,  0 }
 };
 
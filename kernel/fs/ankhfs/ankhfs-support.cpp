@@ -4,11 +4,21 @@
 #include <ananas/vfs/core.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/lib.h>
+#include <ananas/trace.h>
 #include "support.h"
 
+TRACE_SETUP;
+
 namespace Ananas {
 namespace AnkhFS {
 
+errorcode_t
+IAnkhSubSystem::HandleWrite(struct VFS_FILE* file, const void* buf, size_t* len)
+{
+	// Most entries cannot be written to
+	return ANANAS_ERROR(BAD_OPERATION);
+}
+
 errorcode_t
 HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len, IReadDirCallback& callback)
 {
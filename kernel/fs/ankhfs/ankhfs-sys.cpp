@@ -0,0 +1,97 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/core.h>
+#include <ananas/vfs/generic.h>
+#include <ananas/lib.h>
+#include <ananas/trace.h>
+#include <ananas/tunable.h>
+#include "support.h"
+#include "sys.h"
+
+TRACE_SETUP;
+
+/*
+ * /ankh/sys contains a file per tunable, named after it; reading yields the
+ * value and writing a new value changes it, see <ananas/tunable.h>.
+ */
+namespace Ananas {
+namespace AnkhFS {
+namespace {
+
+// Tunable n has id n + 1; id 0 is the directory itself
+struct TUNABLE* GetTunable(struct VFS_FILE* file)
+{
+	unsigned int id = inum_to_id(file->f_dentry->d_inode->i_inum);
+	return (id > 0) ? tunable_get(id - 1) : nullptr;
+}
+
+class SysSubSystem : public IAnkhSubSystem
+{
+public:
+	errorcode_t HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len) override
+	{
+		struct FetchEntry : IReadDirCallback {
+			bool FetchNextEntry(char* entry, size_t maxLength, ino_t& inum) override {
+				struct TUNABLE* t = tunable_get(currentTunable);
+				if (t == nullptr)
+					return false;
+				strncpy(entry, t->t_name, maxLength);
+				inum = make_inum(SS_Sys, ++currentTunable, 0);
+				return true;
+			}
+
+			unsigned int currentTunable = 0;
+		};
+
+		FetchEntry entryFetcher;
+		return AnkhFS::HandleReadDir(file, dirents, len, entryFetcher);
+	}
+
+	errorcode_t FillInode(struct VFS_INODE* inode, ino_t inum) override
+	{
+		if (inum_to_id(inum) == 0)
+			inode->i_sb.st_mode |= S_IFDIR;
+		else
+			inode->i_sb.st_mode |= S_IFREG | 0200;
+		return ananas_success();
+	}
+
+	errorcode_t HandleRead(struct VFS_FILE* file, void* buf, size_t* len) override
+	{
+		struct TUNABLE* t = GetTunable(file);
+		if (t == nullptr)
+			return ANANAS_ERROR(IO);
+
+		char result[16];
+		tunable_format(t, result, sizeof(result));
+		return AnkhFS::HandleRead(file, buf, len, result);
+	}
+
+	errorcode_t HandleWrite(struct VFS_FILE* file, const void* buf, size_t* len) override
+	{
+		struct TUNABLE* t = GetTunable(file);
+		if (t == nullptr)
+			return ANANAS_ERROR(BAD_OPERATION);
+
+		char value[16];
+		if (*len >= sizeof(value))
+			return ANANAS_ERROR(BAD_RANGE);
+		memcpy(value, buf, *len);
+		value[*len] = '\0';
+		return tunable_set(t, value);
+	}
+};
+
+} // unnamed namespace
+
+IAnkhSubSystem& GetSysSubSystem()
+{
+	static SysSubSystem sysSubSystem;
+	return sysSubSystem;
+}
+
+} // namespace AnkhFS
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,255 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/core.h>
+#include <ananas/vfs/generic.h>
+#include <ananas/bench.h>
+#include <ananas/boottime.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/profile.h>
+#include <ananas/trace.h>
+#include "options.h"
+#include "support.h"
+#include "trace.h"
+
+TRACE_SETUP;
+
+/*
+ * /ankh/trace allows tracepoints to be controlled while the system runs:
+ *
+ * - Every subsystem has a file containing the mask of levels traced;
+ *   writing a new mask enables or disables all its tracepoints.
+ * - 'points' lists every tracepoint by id; writing '<id> <0|1>' disables or
+ *   enables an individual tracepoint.
+ * - 'profile' contains the sampling rate of the profiler in Hz; writing a
+ *   rate starts it, writing 0 stops it. 'samples' lists the samples taken,
+ *   see profile_read().
+ * - 'locks' lists the lock statistics, see lockstat_format().
+ * - 'boot' lists the boot timeline, see boottime_format().
+ * - 'bench' lists the benchmarks; writing '<name> [iterations [cpus]]' runs
+ *   one, after which reading yields its results. Zero cpus runs it on every
+ *   number of CPUs in turn, see bench_scale().
+ */
+namespace Ananas {
+namespace AnkhFS {
+namespace {
+
+constexpr unsigned int subPoints = 1;
+constexpr unsigned int subProfile = 2;
+constexpr unsigned int subSamples = 3;
+constexpr unsigned int subLocks = 4;
+constexpr unsigned int subBoot = 5;
+constexpr unsigned int subBench = 6;
+constexpr unsigned int subSubsystemBase = 7;
+
+constexpr ino_t make_subsystem_inum(int subsystem)
+{
+	return make_inum(SS_Trace, 0, subSubsystemBase + subsystem);
+}
+
+struct DirectoryEntry trace_entries[] = {
+	{ "points", make_inum(SS_Trace, 0, subPoints) },
+	{ "boot", make_inum(SS_Trace, 0, subBoot) },
+	{ "debug", make_subsystem_inum(TRACE_SUBSYSTEM_DEBUG) },
+	{ "vfs", make_subsystem_inum(TRACE_SUBSYSTEM_VFS) },
+	{ "thread", make_subsystem_inum(TRACE_SUBSYSTEM_THREAD) },
+	{ "exec", make_subsystem_inum(TRACE_SUBSYSTEM_EXEC) },
+	{ "bio", make_subsystem_inum(TRACE_SUBSYSTEM_BIO) },
+	{ "handle", make_subsystem_inum(TRACE_SUBSYSTEM_HANDLE) },
+	{ "syscall", make_subsystem_inum(TRACE_SUBSYSTEM_SYSCALL) },
+	{ "machdep", make_subsystem_inum(TRACE_SUBSYSTEM_MACHDEP) },
+	{ "usb", make_subsystem_inum(TRACE_SUBSYSTEM_USB) },
+	{ "vm", make_subsystem_inum(TRACE_SUBSYSTEM_VM) },
+#ifdef OPTION_PROFILE
+	{ "profile", make_inum(SS_Trace, 0, subProfile) },
+	{ "samples", make_inum(SS_Trace, 0, subSamples) },
+#endif
+#ifdef OPTION_LOCK_STATS
+	{ "locks", make_inum(SS_Trace, 0, subLocks) },
+#endif
+#ifdef OPTION_BENCHMARK
+	{ "bench", make_inum(SS_Trace, 0, subBench) },
+#endif
+	{ NULL, 0 }
+};
+
+constexpr size_t pointLineLength = 128;
+constexpr size_t lockLineLength = 128;
+constexpr size_t bootLineLength = 128;
+constexpr size_t benchResultLength = 4096;
+
+#ifdef OPTION_BENCHMARK
+char* benchResult; // Outcome of the most recent run, if any
+#endif
+
+// Reads a file consisting of lines produced by format(n, line, len) for n = 0, 1, ... until it fails
+template<size_t lineLength, typename Format> errorcode_t
+HandleReadLines(struct VFS_FILE* file, void* buf, size_t* len, Format format)
+{
+	char line[lineLength];
+	unsigned int num_lines = 0;
+	while (format(num_lines, line, lineLength))
+		num_lines++;
+
+	auto result = static_cast<char*>(kmalloc(num_lines * lineLength + 1));
+	char* r = result;
+	*r = '\0';
+	for (unsigned int n = 0; n < num_lines && format(n, r, lineLength); n++)
+		r += strlen(r);
+	errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+	kfree(result);
+	return err;
+}
+
+#ifdef OPTION_BENCHMARK
+// Runs the benchmark described by '<name> [iterations [cpus]]'
+errorcode_t
+RunBenchmark(char* command)
+{
+	char* ptr = strchr(command, '\n');
+	if (ptr != nullptr)
+		*ptr = '\0';
+
+	unsigned int iterations = 0, num_cpus = 1;
+	ptr = strchr(command, ' ');
+	if (ptr != nullptr) {
+		*ptr++ = '\0';
+		iterations = strtoul(ptr, &ptr, 0);
+		if (*ptr == ' ')
+			num_cpus = strtoul(ptr + 1, NULL, 0);
+	}
+
+	struct BENCHMARK* b = bench_find(command);
+	if (b == nullptr)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	if (benchResult == nullptr)
+		benchResult = static_cast<char*>(kmalloc(benchResultLength));
+	if (num_cpus == 0)
+		return bench_scale(b, iterations, benchResult, benchResultLength);
+	return bench_run(b, iterations, num_cpus, benchResult, benchResultLength);
+}
+#endif
+
+class TraceSubSystem : public IAnkhSubSystem
+{
+public:
+	errorcode_t HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len) override
+	{
+		return AnkhFS::HandleReadDir(file, dirents, len, trace_entries[0]);
+	}
+
+	errorcode_t FillInode(struct VFS_INODE* inode, ino_t inum) override
+	{
+		if (inum_to_sub(inum) == 0)
+			inode->i_sb.st_mode |= S_IFDIR;
+		else
+			inode->i_sb.st_mode |= S_IFREG | 0200;
+		return ananas_success();
+	}
+
+	errorcode_t HandleRead(struct VFS_FILE* file, void* buf, size_t* len) override
+	{
+		unsigned int sub = inum_to_sub(file->f_dentry->d_inode->i_inum);
+		if (sub >= subSubsystemBase) {
+			char result[16];
+			snprintf(result, sizeof(result), "0x%x\n", trace_subsystem_mask[sub - subSubsystemBase]);
+			return AnkhFS::HandleRead(file, buf, len, result);
+		}
+#ifdef OPTION_PROFILE
+		if (sub == subProfile) {
+			char result[16];
+			snprintf(result, sizeof(result), "%u\n", profile_get_rate());
+			return AnkhFS::HandleRead(file, buf, len, result);
+		}
+		if (sub == subSamples) {
+			/* Too much to put in a single string, so it is formatted piece by piece */
+			*len = profile_read(file->f_offset, static_cast<char*>(buf), *len);
+			file->f_offset += *len;
+			return ananas_success();
+		}
+#endif
+#ifdef OPTION_LOCK_STATS
+		if (sub == subLocks)
+			return HandleReadLines<lockLineLength>(file, buf, len, lockstat_format);
+#endif
+		if (sub == subBoot)
+			return HandleReadLines<bootLineLength>(file, buf, len, boottime_format);
+#ifdef OPTION_BENCHMARK
+		if (sub == subBench) {
+			if (benchResult != nullptr)
+				return AnkhFS::HandleRead(file, buf, len, benchResult);
+			auto result = static_cast<char*>(kmalloc(benchResultLength));
+			bench_list(result, benchResultLength);
+			errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+			kfree(result);
+			return err;
+		}
+#endif
+		if (sub != subPoints)
+			return ANANAS_ERROR(IO);
+
+		unsigned int num_points = trace_get_num_points();
+		auto result = static_cast<char*>(kmalloc(num_points * pointLineLength + 1));
+		char* r = result;
+		*r = '\0';
+		for (unsigned int n = 0; n < num_points; n++) {
+			struct TRACEPOINT* tp = trace_get_point(n);
+			snprintf(r, pointLineLength, "%u %u %s 0x%x %s:%u %s\n", n, tp->tp_enabled,
+			 trace_subsystem_name(tp->tp_subsystem), tp->tp_level, tp->tp_file, tp->tp_line, tp->tp_func);
+			r += strlen(r);
+		}
+		errorcode_t err = AnkhFS::HandleRead(file, buf, len, result);
+		kfree(result);
+		return err;
+	}
+
+	errorcode_t HandleWrite(struct VFS_FILE* file, const void* buf, size_t* len) override
+	{
+		char command[32];
+		size_t command_len = (*len < sizeof(command) - 1) ? *len : sizeof(command) - 1;
+		memcpy(command, buf, command_len);
+		command[command_len] = '\0';
+
+		unsigned int sub = inum_to_sub(file->f_dentry->d_inode->i_inum);
+		if (sub >= subSubsystemBase) {
+			trace_set_subsystem(sub - subSubsystemBase, strtoul(command, NULL, 0));
+			return ananas_success();
+		}
+#ifdef OPTION_PROFILE
+		if (sub == subProfile)
+			return profile_set_rate(strtoul(command, NULL, 0));
+#endif
+#ifdef OPTION_BENCHMARK
+		if (sub == subBench)
+			return RunBenchmark(command);
+#endif
+		if (sub != subPoints)
+			return ANANAS_ERROR(BAD_OPERATION);
+
+		char* ptr;
+		unsigned int id = strtoul(command, &ptr, 0);
+		if (ptr == command || *ptr != ' ')
+			return ANANAS_ERROR(BAD_RANGE);
+		struct TRACEPOINT* tp = trace_get_point(id);
+		if (tp == nullptr)
+			return ANANAS_ERROR(BAD_RANGE);
+		trace_set_point(tp, strtoul(ptr + 1, NULL, 0) != 0);
+		return ananas_success();
+	}
+};
+
+} // unnamed namespace
+
+IAnkhSubSystem& GetTraceSubSystem()
+{
+	static TraceSubSystem traceSubSystem;
+	return traceSubSystem;
+}
+
+} // namespace AnkhFS
+} // namespace Ananas
+
+/* vim:set ts=2 sw=2: */
@@ -9,8 +9,11 @@
 #include <ananas/lib.h>
 #include "device.h"
 #include "filesystem.h"
+#include "memory.h"
 #include "proc.h"
 #include "root.h"
+#include "sys.h"
+#include "trace.h"
 #include "support.h"
 
 TRACE_SETUP;
@@ -38,6 +41,15 @@ ankhfs_read(struct VFS_FILE* file, void* buf, size_t* len)
 	return subSystem->HandleRead(file, buf, len);
 }
 
+errorcode_t
+ankhfs_write(struct VFS_FILE* file, const void* buf, size_t* len)
+{
+	auto subSystem = GetSubSystemFromInode(file->f_dentry->d_inode);
+	if (subSystem == nullptr)
+		return ANANAS_ERROR(IO);
+	return subSystem->HandleWrite(file, buf, len);
+}
+
 errorcode_t
 ankhfs_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 {
@@ -51,7 +63,8 @@ struct VFS_INODE_OPS ankhfs_no_ops = {
 };
 
 struct VFS_INODE_OPS ankhfs_file_ops = {
-	.read = ankhfs_read
+	.read = ankhfs_read,
+	.write = ankhfs_write
 };
 
 struct VFS_INODE_OPS ankhfs_dev_ops = {
@@ -73,6 +86,9 @@ ankhfs_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 	subSystems[static_cast<size_t>(SubSystem::SS_Proc)] = &GetProcSubSystem();
 	subSystems[static_cast<size_t>(SubSystem::SS_FileSystem)] = &GetFileSystemSubSystem();
 	subSystems[static_cast<size_t>(SubSystem::SS_Device)] = &GetDeviceSubSystem();
+	subSystems[static_cast<size_t>(SubSystem::SS_Trace)] = &GetTraceSubSystem();
+	subSystems[static_cast<size_t>(SubSystem::SS_Memory)] = &GetMemorySubSystem();
+	subSystems[static_cast<size_t>(SubSystem::SS_Sys)] = &GetSysSubSystem();
 
 	errorcode_t err = vfs_get_inode(fs, make_inum(SS_Root, 0, 0), root_inode);
 	KASSERT(ananas_is_success(err), "cannot get root inode of synthetic filesystem (%d)", err);
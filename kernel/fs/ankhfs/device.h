@@ -9,6 +9,7 @@ namespace Devices {
 constexpr int subRoot = 0;
 constexpr int subDevices = 1;
 constexpr int subDrivers = 2;
+constexpr int subInterrupts = 3;
 } // namespace Devices
 
 class IAnkhSubSystem;
@@ -11,6 +11,9 @@ enum SubSystem {
 	SS_Proc,
 	SS_FileSystem,
 	SS_Device,
+	SS_Trace,
+	SS_Memory,
+	SS_Sys,
 	SS_Last // do not use
 };
 
@@ -53,6 +56,8 @@ public:
 	virtual errorcode_t HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len) = 0;
 	virtual errorcode_t HandleRead(struct VFS_FILE* file, void* buf, size_t* len) = 0;
 	virtual errorcode_t FillInode(struct VFS_INODE* inode, ino_t inum) = 0;
+
+	virtual errorcode_t HandleWrite(struct VFS_FILE* file, const void* buf, size_t* len);
 };
 
 errorcode_t HandleReadDir(struct VFS_FILE* file, void* dirents, size_t* len, IReadDirCallback& callback);
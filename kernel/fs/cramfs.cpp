@@ -26,10 +26,16 @@
  * Before the compressed data begins, there is 'numchunks' times a 32-bit
  * value which contains the offset of the next chunk's compressed data
  * (this makes sense, as the first chunk is always right after this list)
+ *
+ * Decompressed chunks are kept in the page cache, so every chunk only needs
+ * to be inflated once as long as it is cached. Every CPU has its own inflate
+ * state, so that chunks can be decompressed in parallel.
  */
 #include <ananas/types.h>
 #include <ananas/bio.h>
 #include <ananas/error.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
 #include <ananas/vfs.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
@@ -38,6 +44,7 @@
 #include <ananas/mm.h>
 #include <ananas/trace.h>
 #include <ananas/zlib.h>
+#include <machine/param.h> /* for PAGE_SIZE */
 #include <cramfs.h>
 
 TRACE_SETUP;
@@ -49,90 +56,123 @@ TRACE_SETUP;
 #define CRAMFS_TO_LE16(x) (x)
 #define CRAMFS_TO_LE32(x) (x)
 
-static z_stream cramfs_zstream;
-
 struct CRAMFS_INODE_PRIVDATA {
 	uint32_t offset;
 };
 
-struct CRAMFS_PRIVDATA {
-	unsigned char temp_buf[CRAMFS_PAGE_SIZE * 2];
-	unsigned char decompress_buf[CRAMFS_PAGE_SIZE + 4];
+/*
+ * Inflate state; one per CPU. Note that we may be moved to a different CPU
+ * while using it; that is fine as each has its own lock - we just prefer the
+ * local one.
+ */
+struct CRAMFS_INFLATER {
+	mutex_t ci_mtx;			/* Protects everything below */
+	int ci_initialized;
+	z_stream ci_zstream;
+	unsigned char ci_temp_buf[CRAMFS_PAGE_SIZE * 2];
+	unsigned char ci_decompress_buf[CRAMFS_PAGE_SIZE + 4];
 };
 
+static struct CRAMFS_INFLATER cramfs_inflater[PCPU_MAX_CPUS];
+
+/* Fetches the 32-bit value at the given offset of the filesystem */
 static errorcode_t
-cramfs_read(struct VFS_FILE* file, void* buf, size_t* len)
+cramfs_read_u32(struct VFS_MOUNTED_FS* fs, uint32_t offset, uint32_t* val)
+{
+	struct BIO* bio;
+	errorcode_t err = vfs_bread(fs, offset / fs->fs_block_size, &bio);
+	ANANAS_ERROR_RETURN(err);
+	*val = CRAMFS_TO_LE32(*(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + offset % fs->fs_block_size));
+	bio_free(bio);
+	return ananas_success();
+}
+
+/*
+ * Decompresses chunk page_index of the inode to dest, which must hold
+ * CRAMFS_PAGE_SIZE bytes; the length of the chunk is stored in out_len.
+ */
+static errorcode_t
+cramfs_inflate_chunk(struct VFS_INODE* inode, uint32_t page_index, char* dest, size_t* out_len)
 {
-	struct VFS_INODE* inode = file->f_dentry->d_inode;
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	struct CRAMFS_PRIVDATA* fs_privdata = (struct CRAMFS_PRIVDATA*)fs->fs_privdata;
 	struct CRAMFS_INODE_PRIVDATA* i_privdata = (struct CRAMFS_INODE_PRIVDATA*)inode->i_privdata;
 
-	size_t total = 0, toread = *len;
-	while (toread > 0) {
-		uint32_t page_index = file->f_offset / CRAMFS_PAGE_SIZE;
-		int cur_block = -1;
-		struct BIO* bio;
+	/* Calculate the compressed data offset of this page */
+	uint32_t next_offset;
+	errorcode_t err = cramfs_read_u32(fs, i_privdata->offset + page_index * sizeof(uint32_t), &next_offset);
+	ANANAS_ERROR_RETURN(err);
 
-		/* Calculate the compressed data offset of this page */
-		cur_block = (i_privdata->offset + page_index * sizeof(uint32_t)) / fs->fs_block_size;
-		errorcode_t err = vfs_bread(fs, cur_block, &bio);
+	uint32_t start_offset = 0;
+	if (page_index > 0) {
+		/* Now, fetch the offset of the previous page; this gives us the length of the compressed chunk */
+		err = cramfs_read_u32(fs, i_privdata->offset + (page_index - 1) * sizeof(uint32_t), &start_offset);
 		ANANAS_ERROR_RETURN(err);
-		uint32_t next_offset = *(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + (i_privdata->offset + page_index * sizeof(uint32_t)) % fs->fs_block_size);
-		bio_free(bio);
+	} else {
+		/* In case of the first page, we have to set the offset ourselves as there is no index we can use */
+		start_offset  = i_privdata->offset;
+		start_offset += (((inode->i_sb.st_size - 1) / CRAMFS_PAGE_SIZE) + 1) * sizeof(uint32_t);
+	}
 
-		uint32_t start_offset = 0;
-		if (page_index > 0) {
-			/* Now, fetch the offset of the previous page; this gives us the length of the compressed chunk */
-			int prev_block = (i_privdata->offset + (page_index - 1) * sizeof(uint32_t)) / fs->fs_block_size;
-			if (cur_block != prev_block) {
-				errorcode_t err = vfs_bread(fs, prev_block, &bio);
-				ANANAS_ERROR_RETURN(err);
-			}
-			start_offset = *(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + (i_privdata->offset + (page_index - 1) * sizeof(uint32_t)) % fs->fs_block_size);
-		} else {
-			/* In case of the first page, we have to set the offset ourselves as there is no index we can use */
-			start_offset  = i_privdata->offset;
-			start_offset += (((inode->i_sb.st_size - 1) / CRAMFS_PAGE_SIZE) + 1) * sizeof(uint32_t);
-		}
+	struct CRAMFS_INFLATER* ci = &cramfs_inflater[PCPU_GET(cpuid)];
+	mutex_lock(&ci->ci_mtx);
+	if (!ci->ci_initialized) {
+		ci->ci_zstream.next_in = NULL;
+		ci->ci_zstream.avail_in = 0;
+		inflateInit(&ci->ci_zstream);
+		ci->ci_initialized++;
+	}
 
-		uint32_t left = next_offset - start_offset;
-		KASSERT(left < sizeof(fs_privdata->temp_buf), "chunk too large");
+	uint32_t left = next_offset - start_offset;
+	KASSERT(left < sizeof(ci->ci_temp_buf), "chunk too large");
 
-		uint32_t buf_pos = 0;
-		while(buf_pos < left) {
-			cur_block = (start_offset + buf_pos) / fs->fs_block_size;
-			err = vfs_bread(fs, cur_block, &bio);
-			ANANAS_ERROR_RETURN(err);
-			int piece_len = fs->fs_block_size - ((start_offset + buf_pos) % fs->fs_block_size);
-			if (piece_len > left)
-				piece_len = left;
-			memcpy(fs_privdata->temp_buf + buf_pos, static_cast<void*>(static_cast<char*>(BIO_DATA(bio)) + ((start_offset + buf_pos) % fs->fs_block_size)), piece_len);
-			buf_pos += piece_len;
+	uint32_t buf_pos = 0;
+	while(buf_pos < left) {
+		struct BIO* bio;
+		err = vfs_bread(fs, (start_offset + buf_pos) / fs->fs_block_size, &bio);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&ci->ci_mtx);
+			return err;
 		}
+		uint32_t piece_len = fs->fs_block_size - ((start_offset + buf_pos) % fs->fs_block_size);
+		if (piece_len > left - buf_pos)
+			piece_len = left - buf_pos;
+		memcpy(ci->ci_temp_buf + buf_pos, static_cast<void*>(static_cast<char*>(BIO_DATA(bio)) + ((start_offset + buf_pos) % fs->fs_block_size)), piece_len);
+		bio_free(bio);
+		buf_pos += piece_len;
+	}
 
-		cramfs_zstream.next_in = fs_privdata->temp_buf;
-		cramfs_zstream.avail_in = left;
+	ci->ci_zstream.next_in = ci->ci_temp_buf;
+	ci->ci_zstream.avail_in = left;
 
-		cramfs_zstream.next_out = fs_privdata->decompress_buf;
-		cramfs_zstream.avail_out = sizeof(fs_privdata->decompress_buf);
+	ci->ci_zstream.next_out = ci->ci_decompress_buf;
+	ci->ci_zstream.avail_out = sizeof(ci->ci_decompress_buf);
 
-		int zerr = inflateReset(&cramfs_zstream);
-		KASSERT(zerr == Z_OK, "inflateReset() error %d", zerr);
-		zerr = inflate(&cramfs_zstream, Z_FINISH);
-		KASSERT(zerr == Z_STREAM_END, "inflate() error %d", zerr);
-		KASSERT(cramfs_zstream.total_out <= CRAMFS_PAGE_SIZE, "inflate() gave more data than a page");
+	int zerr = inflateReset(&ci->ci_zstream);
+	KASSERT(zerr == Z_OK, "inflateReset() error %d", zerr);
+	zerr = inflate(&ci->ci_zstream, Z_FINISH);
+	KASSERT(zerr == Z_STREAM_END, "inflate() error %d", zerr);
+	KASSERT(ci->ci_zstream.total_out <= CRAMFS_PAGE_SIZE, "inflate() gave more data than a page");
 
-		int copy_chunk = (cramfs_zstream.total_out > toread) ? toread :  cramfs_zstream.total_out;
-		memcpy(buf, &fs_privdata->decompress_buf[file->f_offset % CRAMFS_PAGE_SIZE], copy_chunk);
+	*out_len = ci->ci_zstream.total_out;
+	memcpy(dest, ci->ci_decompress_buf, *out_len);
+	mutex_unlock(&ci->ci_mtx);
+	return ananas_success();
+}
 
-		file->f_offset += copy_chunk;
-		buf = static_cast<void*>(static_cast<char*>(buf) + copy_chunk);
-		total += copy_chunk;
-		toread -= copy_chunk;
-	}
+static errorcode_t
+cramfs_fill_page(struct VFS_INODE* inode, off_t offset, void* page)
+{
+	char* dest = static_cast<char*>(page);
+	for (unsigned int pos = 0; pos < PAGE_SIZE; pos += CRAMFS_PAGE_SIZE) {
+		size_t chunk_len = 0;
+		if (offset + pos < inode->i_sb.st_size) {
+			errorcode_t err = cramfs_inflate_chunk(inode, (offset + pos) / CRAMFS_PAGE_SIZE, dest + pos, &chunk_len);
+			ANANAS_ERROR_RETURN(err);
+		}
 
-	*len = total;
+		/* Anything not covered by the chunk is beyond the end of the file */
+		memset(dest + pos + chunk_len, 0, CRAMFS_PAGE_SIZE - chunk_len);
+	}
 	return ananas_success();
 }
 
@@ -229,7 +269,8 @@ cramfs_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 }
 
 static struct VFS_INODE_OPS cramfs_file_ops = {
-	.read = cramfs_read
+	.fill_page = cramfs_fill_page,
+	.read = vfs_generic_read
 };
 
 static struct VFS_INODE_OPS cramfs_dir_ops = {
@@ -285,20 +326,12 @@ cramfs_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 
-	fs->fs_privdata = new CRAMFS_PRIVDATA;
+	bio_free(bio);
 
 	/* Everything is ok; fill out the filesystem details */
 	err = vfs_get_inode(fs, __builtin_offsetof(struct CRAMFS_SUPERBLOCK, c_rootinode), root_inode);
-	if (ananas_is_failure(err)) {
-		kfree(fs->fs_privdata);
-		bio_free(bio);
+	if (ananas_is_failure(err))
 		return ANANAS_ERROR(NO_DEVICE);
-	}
-
-	/* Initialize our deflater */
-	cramfs_zstream.next_in = NULL;
-	cramfs_zstream.avail_in = 0;
-	inflateInit(&cramfs_zstream);
 
 	return ananas_success();
 }
@@ -352,6 +385,10 @@ static struct VFS_FILESYSTEM fs_cramfs = {
 errorcode_t
 cramfs_init()
 {
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+		mutex_init(&cramfs_inflater[n].ci_mtx, "cramfs");
+		cramfs_inflater[n].ci_initialized = 0;
+	}
 	return vfs_register_filesystem(&fs_cramfs);
 }
 
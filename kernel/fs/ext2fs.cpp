@@ -16,8 +16,10 @@
  * 2, 3, 5 or 7. They are always present if the flag is absent.
  *
  * The location of the first superblock is always fixed, at byte offset 1024.
- * The superblock 'sb' at this location will be used by ext2_mount(), where we
- * read all blockgroups. This allows us to locate any inode on the disk.
+ * The superblock 'sb' at this location will be used by ext2_mount(). The
+ * block group descriptors, which allow us to locate any inode on the disk,
+ * are only read once they are first needed; they are copied to memory of our
+ * own, so they do not take up space in the buffer cache.
  *
  * The main reference material used is "The Second Extended File System:
  * Internal Layout" by Dave Poirier.
@@ -30,6 +32,7 @@
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
 #include <ext2.h>
@@ -43,11 +46,32 @@ struct EXT2_FS_PRIVDATA {
 	struct EXT2_SUPERBLOCK sb;
 
 	unsigned int num_blockgroups;
-	struct EXT2_BLOCKGROUP* blockgroup;
+	struct EXT2_BLOCKGROUP* blockgroup;	/* Valid once its descriptor block is loaded */
+
+	/* Blocks of the block group descriptor table copied to blockgroup */
+	mutex_t mtx_blockgroup;
+	unsigned int num_desc_blocks;
+	unsigned int num_desc_loaded;
+	uint32_t* desc_loaded; /* bitmap */
+};
+
+#define EXT2_INDIRECT_LEVELS	3	/* Single, double and triple indirect */
+
+/*
+ * Copy of an indirect block; a file is usually read sequentially, so the same
+ * indirect blocks are needed over and over again.
+ */
+struct EXT2_INDIRECT_CACHE {
+	blocknr_t ic_block;		/* Block cached, if ic_data is set */
+	uint32_t* ic_data;
 };
 
 struct EXT2_INODE_PRIVDATA {
 	blocknr_t block[EXT2_INODE_BLOCKS];
+
+	/* Last indirect block used at each distance from the data blocks */
+	mutex_t mtx_indirect;
+	struct EXT2_INDIRECT_CACHE indirect[EXT2_INDIRECT_LEVELS];
 };
 
 static void
@@ -62,6 +86,7 @@ ext2_prepare_inode(struct VFS_INODE* inode)
 {
 	auto privdata = new EXT2_INODE_PRIVDATA;
 	memset(privdata, 0, sizeof(struct EXT2_INODE_PRIVDATA));
+	mutex_init(&privdata->mtx_indirect, "ext2ind");
 	inode->i_privdata = privdata;
 	return ananas_success();
 }
@@ -69,7 +94,10 @@ ext2_prepare_inode(struct VFS_INODE* inode)
 static void
 ext2_discard_inode(struct VFS_INODE* inode)
 {
-	kfree(inode->i_privdata);
+	auto privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+	for (unsigned int n = 0; n < EXT2_INDIRECT_LEVELS; n++)
+		kfree(privdata->indirect[n].ic_data);
+	kfree(privdata);
 }
 
 #if 0
@@ -87,6 +115,72 @@ ext2_dump_inode(struct EXT2_INODE* inode)
 }
 #endif
 
+/*
+ * Returns the contents of indirect block 'block', which is level blocks away
+ * from the data blocks; must be called with mtx_indirect held, and the result
+ * is only valid while it is.
+ */
+static errorcode_t
+ext2_get_indirect(struct VFS_INODE* inode, unsigned int level, blocknr_t block, const uint32_t** list)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+	struct EXT2_INDIRECT_CACHE* ic = &in_privdata->indirect[level];
+	if (ic->ic_data == NULL || ic->ic_block != block) {
+		struct BIO* bio;
+		errorcode_t err = vfs_bread(fs, block, &bio);
+		ANANAS_ERROR_RETURN(err);
+		if (ic->ic_data == NULL)
+			ic->ic_data = static_cast<uint32_t*>(kmalloc(fs->fs_block_size));
+		memcpy(ic->ic_data, BIO_DATA(bio), fs->fs_block_size);
+		bio_free(bio);
+		ic->ic_block = block;
+	}
+	*list = ic->ic_data;
+	return ananas_success();
+}
+
+/*
+ * Finds the list of block pointers containing block_in, which must not be a
+ * direct block; the pointer is list[*index]. list is set to NULL if the
+ * block is within a hole. Must be called with mtx_indirect held; the list is
+ * only valid while it is.
+ */
+static errorcode_t
+ext2_find_indirect(struct VFS_INODE* inode, blocknr_t block_in, const uint32_t** list, unsigned int* index)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+	const blocknr_t per_block = fs->fs_block_size / sizeof(uint32_t);
+
+	/* Figure out which indirect block tree holds the block, and where it is in there */
+	blocknr_t b = block_in - 12;
+	unsigned int depth = 1;
+	blocknr_t span = per_block; /* Blocks covered by the tree at this depth */
+	while (b >= span) {
+		b -= span;
+		if (++depth > EXT2_INDIRECT_LEVELS)
+			return ANANAS_ERROR(BAD_RANGE);
+		span *= per_block;
+	}
+
+	blocknr_t block = in_privdata->block[12 + depth - 1];
+	for (unsigned int level = depth; level > 0; level--) {
+		if (block == 0) {
+			*list = NULL; /* sparse */
+			return ananas_success();
+		}
+		errorcode_t err = ext2_get_indirect(inode, level - 1, block, list);
+		ANANAS_ERROR_RETURN(err);
+
+		span /= per_block;
+		*index = b / span;
+		b %= span;
+		block = EXT2_TO_LE32((*list)[*index]);
+	}
+	return ananas_success();
+}
+
 /*
  * Retrieves the disk block for a given file block. In ext2, the first 12 blocks
  * are direct blocks. Block 13 is the first indirect block and contains pointers to
@@ -105,40 +199,66 @@ ext2_dump_inode(struct EXT2_INODE* inode)
 static errorcode_t
 ext2_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create)
 {
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
 
-	/*
-	 * We need to figure out whether we have to look up the block in the single,
-	 * double or triply-linked block. From the comments above, we know that:
-	 *
-	 * (a) The first 12 blocks (0 .. 11) can directly be accessed.
-	 * (a) The first indirect block contains blocks 12 .. 12 + block_size / 4.
-	 * (b) The double-indirect block contains blocks 12 + block_size / 4 to
-	 *     13 + (block_size / 4)^2
-	 * (c) The triple-indirect block contains everything else.
-	 */
-
 	/* (a) Direct blocks are easy */
 	if (block_in < 12) {
 		*block_out = in_privdata->block[block_in];
 		return ananas_success();
 	}
 
-	if (block_in < 12 + fs->fs_block_size / 4) {
-		/*
-		 * (b) Need to look up the block the first indirect block, 13.
-		 */
-		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, in_privdata->block[12], &bio);
-		ANANAS_ERROR_RETURN(err);
-		*block_out = EXT2_TO_LE32(*(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + (block_in - 12) * sizeof(uint32_t)));
-		bio_free(bio);
+	/* (b) Anything else needs one or more indirect blocks */
+	mutex_lock(&in_privdata->mtx_indirect);
+	const uint32_t* list;
+	unsigned int index;
+	errorcode_t err = ext2_find_indirect(inode, block_in, &list, &index);
+	if (ananas_is_success(err))
+		*block_out = (list != NULL) ? EXT2_TO_LE32(list[index]) : 0;
+	mutex_unlock(&in_privdata->mtx_indirect);
+	return err;
+}
+
+/*
+ * Maps a run of blocks; this only looks at a single block list (the direct
+ * blocks or a single indirect block), so a run never crosses from one to the
+ * next.
+ */
+static errorcode_t
+ext2_block_map_range(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+
+	/* (a) Direct blocks */
+	if (block_in < 12) {
+		unsigned int n = 1;
+		while (n < *num_blocks && block_in + n < 12 && in_privdata->block[block_in + n] == in_privdata->block[block_in] + n)
+			n++;
+		*block_out = in_privdata->block[block_in];
+		*num_blocks = n;
 		return ananas_success();
 	}
 
-	panic("ext2_block_map() needs support for doubly/triple indirect blocks!");
-	return ANANAS_ERROR(BAD_RANGE);
+	/* (b) Blocks within an indirect block; we only need to look it up once */
+	mutex_lock(&in_privdata->mtx_indirect);
+	const uint32_t* list;
+	unsigned int index;
+	errorcode_t err = ext2_find_indirect(inode, block_in, &list, &index);
+	if (ananas_is_success(err)) {
+		unsigned int n = 1;
+		if (list != NULL) {
+			const unsigned int per_block = fs->fs_block_size / sizeof(uint32_t);
+			blocknr_t first = EXT2_TO_LE32(list[index]);
+			while (n < *num_blocks && index + n < per_block && EXT2_TO_LE32(list[index + n]) == first + n)
+				n++;
+			*block_out = first;
+		} else {
+			*block_out = 0;
+		}
+		*num_blocks = n;
+	}
+	mutex_unlock(&in_privdata->mtx_indirect);
+	return err;
 }
 
 static errorcode_t
@@ -210,7 +330,8 @@ ext2_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 
 static struct VFS_INODE_OPS ext2_file_ops = {
 	.read = vfs_generic_read,
-	.block_map = ext2_block_map
+	.block_map = ext2_block_map,
+	.block_map_range = ext2_block_map_range
 };
 
 static struct VFS_INODE_OPS ext2_dir_ops = {
@@ -221,11 +342,69 @@ static struct VFS_INODE_OPS ext2_dir_ops = {
 /*
  * Reads a filesystem inode and fills a corresponding inode structure.
  */
+/* Returns the device block holding the given block of the group descriptor table */
+static inline blocknr_t
+ext2_desc_block(struct EXT2_FS_PRIVDATA* privdata, unsigned int desc_block)
+{
+	/*
+	 * The table always exists at the very first block group, and it will always
+	 * appear at the first data block. The +1 is because we need to skip the
+	 * superblock, and the s_first_data_block increment is because we need to
+	 * count from the superblock onwards...
+	 */
+	return privdata->sb.s_first_data_block + 1 + desc_block;
+}
+
+static inline bool
+ext2_desc_is_loaded(struct EXT2_FS_PRIVDATA* privdata, unsigned int desc_block)
+{
+	mutex_lock(&privdata->mtx_blockgroup);
+	bool loaded = (privdata->desc_loaded[desc_block / 32] & (1U << (desc_block % 32))) != 0;
+	mutex_unlock(&privdata->mtx_blockgroup);
+	return loaded;
+}
+
+/* Obtains the descriptor of block group bgroup, reading it if needed */
 static errorcode_t
-ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
+ext2_get_blockgroup(struct VFS_MOUNTED_FS* fs, uint32_t bgroup, struct EXT2_BLOCKGROUP** bg)
 {
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)inode->i_fs->fs_privdata;
+	struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)fs->fs_privdata;
+	KASSERT(bgroup < privdata->num_blockgroups, "block group %u out of range", bgroup);
+
+	unsigned int descs_per_block = fs->fs_block_size / sizeof(struct EXT2_BLOCKGROUP);
+	unsigned int desc_block = bgroup / descs_per_block;
+	if (!ext2_desc_is_loaded(privdata, desc_block)) {
+		/* Copy every descriptor in the block; the others will be needed eventually */
+		struct BIO* bio;
+		errorcode_t err = vfs_bread(fs, ext2_desc_block(privdata, desc_block), &bio);
+		ANANAS_ERROR_RETURN(err);
+
+		unsigned int first = desc_block * descs_per_block;
+		unsigned int count = privdata->num_blockgroups - first;
+		if (count > descs_per_block)
+			count = descs_per_block;
+		mutex_lock(&privdata->mtx_blockgroup);
+		if ((privdata->desc_loaded[desc_block / 32] & (1U << (desc_block % 32))) == 0) {
+			memcpy(&privdata->blockgroup[first], BIO_DATA(bio), count * sizeof(struct EXT2_BLOCKGROUP));
+			privdata->desc_loaded[desc_block / 32] |= 1U << (desc_block % 32);
+			privdata->num_desc_loaded++;
+		}
+		mutex_unlock(&privdata->mtx_blockgroup);
+		bio_free(bio);
+	}
+
+	*bg = &privdata->blockgroup[bgroup];
+	return ananas_success();
+}
+
+/*
+ * Finds the block holding on-disk inode inum, and the offset of the inode
+ * within that block.
+ */
+static errorcode_t
+ext2_locate_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, blocknr_t* block, unsigned int* idx)
+{
+	struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)fs->fs_privdata;
 
 	/*
 	 * Inode number zero does not exists within ext2 (or Linux for that matter),
@@ -243,17 +422,22 @@ ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
 	 */
 	uint32_t bgroup = inum / privdata->sb.s_inodes_per_group;
 	uint32_t iindex = inum % privdata->sb.s_inodes_per_group;
-	blocknr_t block = privdata->blockgroup[bgroup].bg_inode_table + (iindex * privdata->sb.s_inode_size) / fs->fs_block_size;
-
-	/* Fetch the block and make a pointer to the inode */
-	struct BIO* bio;
-	errorcode_t err = vfs_bread(fs, block, &bio);
+	struct EXT2_BLOCKGROUP* bg;
+	errorcode_t err = ext2_get_blockgroup(fs, bgroup, &bg);
 	ANANAS_ERROR_RETURN(err);
-	unsigned int idx = (iindex * privdata->sb.s_inode_size) % fs->fs_block_size;
-	auto ext2inode = reinterpret_cast<struct EXT2_INODE*>(static_cast<char*>(BIO_DATA(bio)) + idx);
+	*block = bg->bg_inode_table + (iindex * privdata->sb.s_inode_size) / fs->fs_block_size;
+	*idx = (iindex * privdata->sb.s_inode_size) % fs->fs_block_size;
+	return ananas_success();
+}
+
+/* Fills inode inum using the on-disk inode, which is passed as data */
+static errorcode_t
+ext2_fill_inode(struct VFS_INODE* inode, ino_t inum, const void* data)
+{
+	auto ext2inode = static_cast<const struct EXT2_INODE*>(data);
 
 	/* Fill the stat buffer with date */
-	inode->i_sb.st_ino    = inum;
+	inode->i_sb.st_ino    = inum - 1;
 	inode->i_sb.st_mode   = EXT2_TO_LE16(ext2inode->i_mode);
 	inode->i_sb.st_nlink  = EXT2_TO_LE16(ext2inode->i_links_count);
 	inode->i_sb.st_uid    = EXT2_TO_LE16(ext2inode->i_uid);
@@ -282,11 +466,58 @@ ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
 			inode->i_iops = &ext2_dir_ops;
 			break;
 	}
-	bio_free(bio);
-
 	return ananas_success();
 }
 
+/*
+ * Adds the other inodes sharing the inode table block of inum to the inode
+ * cache; whoever reads a directory tends to look at all its inodes, and these
+ * usually live close together.
+ */
+static void
+ext2_fill_neighbour_inodes(struct VFS_MOUNTED_FS* fs, ino_t inum, const char* data, unsigned int idx)
+{
+	struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)fs->fs_privdata;
+	unsigned int inode_size = privdata->sb.s_inode_size;
+	ino_t first_inum = inum - idx / inode_size;
+	for (unsigned int offset = 0; offset + inode_size <= fs->fs_block_size; offset += inode_size) {
+		ino_t cur_inum = first_inum + offset / inode_size;
+		if (cur_inum == inum || cur_inum == 0 || cur_inum > privdata->sb.s_inodes_count)
+			continue;
+
+		/* Skip anything that is not, or no longer, in use */
+		auto ext2inode = reinterpret_cast<const struct EXT2_INODE*>(data + offset);
+		if (EXT2_TO_LE16(ext2inode->i_mode) == 0 || EXT2_TO_LE16(ext2inode->i_links_count) == 0 || EXT2_TO_LE32(ext2inode->i_dtime) != 0)
+			continue;
+
+		/* Give up once the inode cache has no room to spare */
+		if (!vfs_add_speculative_inode(fs, cur_inum, ext2_fill_inode, ext2inode))
+			break;
+	}
+}
+
+static errorcode_t
+ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+
+	/* Fetch the block and make a pointer to the inode */
+	blocknr_t block;
+	unsigned int idx;
+	errorcode_t err = ext2_locate_inode(fs, inum, &block, &idx);
+	ANANAS_ERROR_RETURN(err);
+	struct BIO* bio;
+	err = vfs_bread(fs, block, &bio);
+	ANANAS_ERROR_RETURN(err);
+	auto data = static_cast<const char*>(BIO_DATA(bio));
+
+	err = ext2_fill_inode(inode, inum, data + idx);
+	if (ananas_is_success(err))
+		ext2_fill_neighbour_inodes(fs, inum, data, idx);
+	bio_free(bio);
+	return err;
+}
+
 static errorcode_t
 ext2_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 {
@@ -323,53 +554,59 @@ ext2_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 	/* Free the superblock */
 	bio_free(bio);
 
-	/*
-	 * Read the block group descriptor table; we use the fact that this table
-	 * will always exist at the very first block group, and it will always appear
-	 * at the first data block.
-	 */
-	for (unsigned int n = 0; n < privdata->num_blockgroups; n++) {
-		/*
-		 * The +1 is because we need to skip the superblock, and the s_first_data_block
-	 	 * increment is because we need to count from the superblock onwards...
-		 */
-		blocknr_t blocknum = 1 + (n * sizeof(struct EXT2_BLOCKGROUP)) / fs->fs_block_size;
-		blocknum += privdata->sb.s_first_data_block;
-		err = vfs_bread(fs, blocknum, &bio);
-		if (ananas_is_failure(err)) {
-			kfree(privdata);
-			return err;
-		}
-		memcpy((void*)(privdata->blockgroup + n),
-		       (void*)(static_cast<char*>(BIO_DATA(bio)) + ((n * sizeof(struct EXT2_BLOCKGROUP)) % fs->fs_block_size)),
-		       sizeof(struct EXT2_BLOCKGROUP));
-		bio_free(bio);
-	}
-
-#if 0
-	//for (unsigned int n = 0; n < privdata->num_blockgroups; n++) {
-	for (unsigned int n = 19; n < 21; n++) {
-		struct EXT2_BLOCKGROUP* bg = &privdata->blockgroup[n];
-		kprintf("blockgroup %u: block=%u,inode=%u,table=%u,free_blocks=%u,free_inodes=%u,used_dirs=%u\n",
-			n, bg->bg_block_bitmap, bg->bg_inode_bitmap, bg->bg_inode_table,
-			bg->bg_free_blocks_count, bg->bg_free_inodes_count, bg->bg_used_dirs_count);
-	}
-#endif
+	/* Block group descriptors are read as needed; see ext2_get_blockgroup() */
+	unsigned int descs_per_block = fs->fs_block_size / sizeof(struct EXT2_BLOCKGROUP);
+	mutex_init(&privdata->mtx_blockgroup, "ext2bg");
+	privdata->num_desc_blocks = (privdata->num_blockgroups + descs_per_block - 1) / descs_per_block;
+	privdata->num_desc_loaded = 0;
+	privdata->desc_loaded = new uint32_t[(privdata->num_desc_blocks + 31) / 32];
+	memset(privdata->desc_loaded, 0, ((privdata->num_desc_blocks + 31) / 32) * sizeof(uint32_t));
 
 	/* Read the root inode */
 	err = vfs_get_inode(fs, EXT2_ROOT_INO, root_inode);
 	if (ananas_is_failure(err)) {
+		kfree(privdata->desc_loaded);
+		kfree(privdata->blockgroup);
 		kfree(privdata);
 		return err;
 	}
+
+	kprintf("ext2: %u block groups, block size %u, %u/%u descriptor blocks read at mount\n",
+	 privdata->num_blockgroups, fs->fs_block_size, privdata->num_desc_loaded, privdata->num_desc_blocks);
 	return ananas_success();
 }
 
+static void
+ext2_prefetch_inode(struct VFS_MOUNTED_FS* fs, ino_t inum)
+{
+	struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)fs->fs_privdata;
+	if (inum == 0 || inum > privdata->sb.s_inodes_count)
+		return;
+
+	/*
+	 * If we do not know where the inode lives yet, get the descriptor block
+	 * underway instead; it is needed first.
+	 */
+	unsigned int descs_per_block = fs->fs_block_size / sizeof(struct EXT2_BLOCKGROUP);
+	unsigned int desc_block = ((inum - 1) / privdata->sb.s_inodes_per_group) / descs_per_block;
+	blocknr_t block;
+	if (ext2_desc_is_loaded(privdata, desc_block)) {
+		unsigned int idx;
+		if (ananas_is_failure(ext2_locate_inode(fs, inum, &block, &idx)))
+			return;
+	} else
+		block = ext2_desc_block(privdata, desc_block);
+	struct BIO* bio;
+	if (ananas_is_success(vfs_bget(fs, block, &bio, BIO_READ_ASYNC | BIO_READ_AHEAD)))
+		bio_free(bio);
+}
+
 static struct VFS_FILESYSTEM_OPS fsops_ext2 = {
 	.mount = ext2_mount,
 	.prepare_inode = ext2_prepare_inode,
 	.discard_inode = ext2_discard_inode,
-	.read_inode = ext2_read_inode
+	.read_inode = ext2_read_inode,
+	.prefetch_inode = ext2_prefetch_inode
 };
 
 static struct VFS_FILESYSTEM fs_ext2 = {
@@ -9,6 +9,7 @@
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/mm.h>
 #include "fatfs.h"
 #include "block.h"
 
@@ -47,138 +48,170 @@ fat_make_cluster_block_offset(struct VFS_MOUNTED_FS* fs, uint32_t cluster, block
 }
 
 /*
- * Used to obtain the clusternum'th cluster of a file starting at
- * first_cluster. Returns BAD_RANGE error if end-of-file was found (but
- * cluster_out will be set to the final cluster found_
+ * Reads the FAT entry of cluster, and stores the next cluster of the chain in
+ * next (0 if this is the final cluster); bio is used to keep FAT sector
+ * bio_sector around between calls, and must be freed by the caller if not
+ * NULL.
  */
 static errorcode_t
-fat_get_cluster(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster, uint32_t clusternum, uint32_t* cluster_out)
+fat_read_fat_entry(struct VFS_MOUNTED_FS* fs, uint32_t cluster, struct BIO** bio, blocknr_t* bio_sector, uint32_t* next)
 {
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
-	uint32_t cur_cluster = first_cluster;
 
-	/*
-	 * First of all, look through our cache. XXX linear search.
-	 *
-	 * We assume the cache items will never be removed while we are working with
-	 * the file because it will remain referenced - we throw away the cache items
-	 * when the inode is freed.
-	 *
-	 * Note that we explicitely _do not_ cache cluster -1; it is used to find the
-	 * final cluster of the FAT chain.
-	 */
-try_cache: ; /* dummy ; to keep gcc happy */
-	int create = 0, found = 0;
-	struct FAT_CLUSTER_CACHEITEM* ci = NULL;
-	struct FAT_CLUSTER_CACHEITEM* ci_closest = NULL;
-	if (clusternum != -1) {
-		spinlock_lock(&fs_privdata->spl_cache);
-		for(int cache_item = 0; cache_item < FAT_NUM_CACHEITEMS; cache_item++) {
-			ci = &fs_privdata->cluster_cache[cache_item];
-			if (ci->f_clusterno == 0) {
-				/* Found empty item - use it (we assume this always occurs at the end of the items) */
-				create++;
-				ci->f_clusterno = first_cluster;
-				ci->f_index = clusternum;
-				ci->f_nextcluster = 0;
-				break;
-			}
-			if (ci->f_clusterno == first_cluster) {
-				if (ci->f_index == clusternum) {
-					/* Got it */
-					found++;
-					break;
-				}
-
-				/*
-				 * Cluster is fine, but index isn't. Attempt to use this item as a base;
-				 * the less items we'll have to walk through, the better.
-				 */
-				if (ci->f_index < clusternum && (ci_closest == NULL || ci->f_index > ci_closest->f_index))
-					ci_closest = ci;
-			}
-		}
-		/*
-		 * If we need to do a lookup, use the closest item as base; we do this
-		 * while holding the lock to ensure the item won't vanish.
-		 */
-		if (create && !found && ci_closest != NULL) {
-			cur_cluster = ci_closest->f_nextcluster;
-			clusternum -= ci_closest->f_index;
-		}
-		spinlock_unlock(&fs_privdata->spl_cache);
-
-		if (create == 0 && found == 0) {
-			/*
-			 * Out of cache items; we'll just throw away all cached clusters of this
-			 * item. If this doesn't work, we'll just overwrite the first item XXX
-			 */
-			if (fat_clear_cache(fs, first_cluster))
-				goto try_cache;
-			ci = &fs_privdata->cluster_cache[0];
-			ci->f_clusterno = first_cluster;
-			ci->f_index = clusternum;
-			ci->f_nextcluster = 0;
-			create++;
-			kprintf("fat_get_cluster(): sacrificed first cache block\n");
+	blocknr_t sector_num;
+	uint32_t offset;
+	fat_make_cluster_block_offset(fs, cluster, &sector_num, &offset);
+	if (*bio == NULL || *bio_sector != sector_num) {
+		if (*bio != NULL)
+			bio_free(*bio);
+		*bio = NULL;
+		errorcode_t err = vfs_bread(fs, sector_num, bio);
+		ANANAS_ERROR_RETURN(err);
+		*bio_sector = sector_num;
+	}
+
+	/* Grab the value from the FAT */
+	uint32_t val = 0;
+	switch (fs_privdata->fat_type) {
+		case 16:
+			val = FAT_FROM_LE16((char*)(static_cast<char*>(BIO_DATA(*bio)) + offset));
+			if (val >= 0xfff8)
+				val = 0;
+			break;
+		case 32: /* actually FAT-28... */
+			val = FAT_FROM_LE32((char*)(static_cast<char*>(BIO_DATA(*bio)) + offset)) & 0xfffffff;
+			if (val >= 0xffffff8)
+				val = 0;
+			break;
+	}
+	*next = val;
+	return ananas_success();
+}
+
+/*
+ * Adds cluster as the next cluster of the inode's cluster map; it is merged
+ * with the final extent if it directly follows it on disk. Must be called with
+ * mtx_map held.
+ */
+static errorcode_t
+fat_cluster_map_append(struct FAT_INODE_PRIVDATA* privdata, uint32_t cluster)
+{
+	if (privdata->map_len > 0) {
+		struct FAT_CLUSTER_EXTENT* ce = &privdata->map[privdata->map_len - 1];
+		if (ce->ce_cluster + ce->ce_count == cluster) {
+			ce->ce_count++;
+			return ananas_success();
 		}
 	}
 
-	/*
-	 * If we are not creating, yet the next cluster value is zero, someone else is
-	 * looking up the item, we need to spin.
-	 */
-	if (ci != NULL && create == 0) {
-		while (ci->f_nextcluster == 0) {
-			kprintf("fat_get_cluster(): pending cluster found, waiting...\n");
-			reschedule();
+	if (privdata->map_len == privdata->map_size) {
+		unsigned int new_size = (privdata->map_size > 0) ? privdata->map_size * 2 : 8;
+		auto new_map = static_cast<struct FAT_CLUSTER_EXTENT*>(kmalloc(new_size * sizeof(struct FAT_CLUSTER_EXTENT)));
+		if (new_map == NULL)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		if (privdata->map != NULL) {
+			memcpy(new_map, privdata->map, privdata->map_len * sizeof(struct FAT_CLUSTER_EXTENT));
+			kfree(privdata->map);
 		}
-		if (ci->f_nextcluster == -1)
-			return ANANAS_ERROR(BAD_RANGE);
-		*cluster_out = ci->f_nextcluster;
-		return ananas_success();
+		privdata->map = new_map;
+		privdata->map_size = new_size;
 	}
 
-	/* Not in the cache; we'll need to traverse the disk */
-	*cluster_out = first_cluster;
-	while (cur_cluster != 0 && clusternum-- > 0) {
-		blocknr_t sector_num;
-		uint32_t offset;
-		fat_make_cluster_block_offset(fs, cur_cluster, &sector_num, &offset);
-		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, sector_num, &bio);
-		ANANAS_ERROR_RETURN(err);
+	struct FAT_CLUSTER_EXTENT* ce = &privdata->map[privdata->map_len++];
+	ce->ce_index = (ce == privdata->map) ? 0 : ce[-1].ce_index + ce[-1].ce_count;
+	ce->ce_cluster = cluster;
+	ce->ce_count = 1;
+	return ananas_success();
+}
 
-		/* Grab the value from the FAT */
-		switch (fs_privdata->fat_type) {
-			case 16:
-				cur_cluster = FAT_FROM_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset));
-				if (cur_cluster >= 0xfff8)
-					cur_cluster = 0;
-				break;
-			case 32: /* actually FAT-28... */
-				cur_cluster = FAT_FROM_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset)) & 0xfffffff;
-				if (cur_cluster >= 0xffffff8)
-					cur_cluster = 0;
-				break;
+/*
+ * Walks the entire FAT chain of the inode once to build its cluster map. Must
+ * be called with mtx_map held.
+ */
+static errorcode_t
+fat_cluster_map_build(struct VFS_INODE* inode)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+
+	privdata->map_len = 0;
+	struct BIO* bio = NULL;
+	blocknr_t bio_sector = 0;
+	errorcode_t err = ananas_success();
+	uint32_t num_clusters = 0;
+	for (uint32_t cluster = privdata->first_cluster; cluster != 0; ) {
+		/* A chain longer than the filesystem must loop somewhere */
+		if (cluster < 2 || num_clusters++ > fs_privdata->total_clusters) {
+			err = ANANAS_ERROR(IO);
+			break;
 		}
+		err = fat_cluster_map_append(privdata, cluster);
+		if (ananas_is_failure(err))
+			break;
+		err = fat_read_fat_entry(fs, cluster, &bio, &bio_sector, &cluster);
+		if (ananas_is_failure(err))
+			break;
+	}
+	if (bio != NULL)
 		bio_free(bio);
-		if (cur_cluster != 0)
-			*cluster_out = cur_cluster;
+	ANANAS_ERROR_RETURN(err);
+
+	privdata->map_valid++;
+	return ananas_success();
+}
+
+/*
+ * Used to obtain the clusternum'th cluster of a file. Returns BAD_RANGE
+ * error if end-of-file was found (but cluster_out will be set to the final
+ * cluster found, or zero if there is none); passing -1 as clusternum thus
+ * yields the final cluster of the chain.
+ */
+static errorcode_t
+fat_get_cluster(struct VFS_INODE* inode, uint32_t clusternum, uint32_t* cluster_out)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+
+	mutex_lock(&privdata->mtx_map);
+	if (!privdata->map_valid) {
+		errorcode_t err = fat_cluster_map_build(inode);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&privdata->mtx_map);
+			return err;
+		}
 	}
-	if (cur_cluster != 0) {
-		if (ci != NULL)
-			ci->f_nextcluster = *cluster_out;
-		return ananas_success();
+
+	/* Binary search for the extent holding the cluster */
+	unsigned int lo = 0, hi = privdata->map_len;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		struct FAT_CLUSTER_EXTENT* ce = &privdata->map[mid];
+		if (clusternum < ce->ce_index) {
+			hi = mid;
+		} else if (clusternum >= ce->ce_index + ce->ce_count) {
+			lo = mid + 1;
+		} else {
+			*cluster_out = ce->ce_cluster + (clusternum - ce->ce_index);
+			mutex_unlock(&privdata->mtx_map);
+			return ananas_success();
+		}
+	}
+
+	/* Beyond the end of the chain */
+	if (privdata->map_len > 0) {
+		struct FAT_CLUSTER_EXTENT* ce = &privdata->map[privdata->map_len - 1];
+		*cluster_out = ce->ce_cluster + ce->ce_count - 1;
 	} else {
-		if (ci != NULL)
-			ci->f_nextcluster = -1;
-		return ANANAS_ERROR(BAD_RANGE);
+		*cluster_out = 0;
 	}
+	mutex_unlock(&privdata->mtx_map);
+	return ANANAS_ERROR(BAD_RANGE);
 }
 
 /*
- * Sets a cluster value to a given value.
+ * Sets a cluster value to a given value. Only the first FAT is changed; the
+ * sector is remembered and copied to the other FATs by fat_flush_metadata(),
+ * so that a whole run of changes costs a single write per FAT copy.
  */
 static errorcode_t
 fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluster_val)
@@ -195,6 +228,7 @@ fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluste
 	errorcode_t err = vfs_bread(fs, sector_num, &bio);
 	ANANAS_ERROR_RETURN(err);
 
+	mutex_lock(&fs_privdata->mtx_fat);
 	switch (fs_privdata->fat_type) {
 		case 16:
 			FAT_TO_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), cluster_val);
@@ -206,83 +240,183 @@ fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluste
 			panic("unsuported fat type");
 	}
 
-	bio_set_dirty(bio);
-
-	/* Sync all other FAT tables as well */
-	for (int i = 1; i < fs_privdata->num_fats; i++) {
-		sector_num += fs_privdata->num_fat_sectors;
-		struct BIO* bio2;
-		err = vfs_bread(fs, sector_num, &bio2);
-		if (ananas_is_failure(err)) {
-			/* XXX we should free the cluster */
-			bio_free(bio);
-			kprintf("fat_set_cluster(): XXX leaking cluster %u\n", sector_num);
-			return err;
+	if (fs_privdata->num_fats > 1) {
+		uint32_t n = sector_num - fs_privdata->reserved_sectors;
+		if ((fs_privdata->fat_dirty_map[n / 32] & (1U << (n % 32))) == 0) {
+			fs_privdata->fat_dirty_map[n / 32] |= 1U << (n % 32);
+			fs_privdata->fat_num_dirty++;
 		}
-		memcpy(BIO_DATA(bio2), static_cast<char*>(BIO_DATA(bio)), fs_privdata->sector_size);
-		bio_set_dirty(bio2);
-		bio_free(bio2);
 	}
-	bio_free(bio);
+	mutex_unlock(&fs_privdata->mtx_fat);
 
+	/* The first FAT is written back like any other buffer */
+	bio_set_dirty(bio);
+	bio_free(bio);
 	return ananas_success();
 }
 
+/* Valid cluster numbers are 2 ... total_clusters + 1 */
+static inline uint32_t
+fat_cluster_limit(struct FAT_FS_PRIVDATA* fs_privdata)
+{
+	return fs_privdata->total_clusters + 2;
+}
+
+static inline int
+fat_cluster_is_free(struct FAT_FS_PRIVDATA* fs_privdata, uint32_t cluster)
+{
+	return (fs_privdata->free_map[cluster / 32] & (1U << (cluster % 32))) != 0;
+}
+
+static inline void
+fat_cluster_set_free(struct FAT_FS_PRIVDATA* fs_privdata, uint32_t cluster, int free)
+{
+	if (free)
+		fs_privdata->free_map[cluster / 32] |= 1U << (cluster % 32);
+	else
+		fs_privdata->free_map[cluster / 32] &= ~(1U << (cluster % 32));
+}
+
 /*
- * Obtains the first available cluster and marks it as being used.
+ * Finds the first available cluster in [from, to); returns 0 if there is none.
  */
-static errorcode_t
-fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t* cluster_out)
+static uint32_t
+fat_find_free_cluster(struct FAT_FS_PRIVDATA* fs_privdata, uint32_t from, uint32_t to)
+{
+	uint32_t cluster = from;
+	while (cluster < to) {
+		/* Skip words without any available clusters at once */
+		if ((cluster % 32) == 0 && fs_privdata->free_map[cluster / 32] == 0) {
+			cluster += 32;
+			continue;
+		}
+		if (fat_cluster_is_free(fs_privdata, cluster))
+			return cluster;
+		cluster++;
+	}
+	return 0;
+}
+
+errorcode_t
+fat_build_free_map(struct VFS_MOUNTED_FS* fs)
 {
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+	uint32_t limit = fat_cluster_limit(fs_privdata);
 
-	/* XXX We do a dumb find-first on the filesystem for now */
-	blocknr_t cur_block = (blocknr_t)-1;
+	size_t map_len = ((limit + 31) / 32) * sizeof(uint32_t);
+	fs_privdata->free_map = static_cast<uint32_t*>(kmalloc(map_len));
+	if (fs_privdata->free_map == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	memset(fs_privdata->free_map, 0, map_len);
+
+	/* Walk through the first FAT; every zero entry is an available cluster */
 	struct BIO* bio = NULL;
-	for (uint32_t clusterno = fs_privdata->next_avail_cluster; clusterno < fs_privdata->total_clusters; clusterno++) {
-		/* Obtain the FAT block, if necessary */
+	blocknr_t cur_block = (blocknr_t)-1;
+	uint32_t num_free = 0;
+	for (uint32_t clusterno = 2; clusterno < limit; clusterno++) {
 		uint32_t offset;
 		blocknr_t want_block;
 		fat_make_cluster_block_offset(fs, clusterno, &want_block, &offset);
 		if (want_block != cur_block || bio == NULL) {
-			if (bio != NULL) bio_free(bio);
+			if (bio != NULL)
+				bio_free(bio);
 			errorcode_t err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
+			if (ananas_is_failure(err)) {
+				kfree(fs_privdata->free_map);
+				fs_privdata->free_map = NULL;
+				return err;
+			}
 			cur_block = want_block;
 		}
 
-		/* Obtain the cluster value */
-		uint32_t val = -1;
+		uint32_t val = 0;
 		switch (fs_privdata->fat_type) {
 			case 16:
 				val = FAT_FROM_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset));
-				if (val == 0) { /* available cluster? */
-					/* Yes; claim it */
-					FAT_TO_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), 0xfff8);
-				}
 				break;
 			case 32: /* actually FAT-28... */
 				val = FAT_FROM_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset)) & 0xfffffff;
-				if (val == 0) { /* available cluster? */
-					/* Yes; claim it */
-					FAT_TO_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), 0xffffff8);
-				}
 				break;
 		}
-		if (val != 0)
-			continue;
-
-		/* OK; this one is available (and we just claimed it) - flush the FAT entry */
-		bio_set_dirty(bio);
+		if (val == 0) {
+			fat_cluster_set_free(fs_privdata, clusterno, 1);
+			num_free++;
+		}
+	}
+	if (bio != NULL)
 		bio_free(bio);
 
-		/* XXX should update second fat */
-		*cluster_out = clusterno;
-		return ananas_success();
+	/* Now we know exactly how much is available; correct the info sector if needed */
+	if (fs_privdata->num_avail_clusters != num_free)
+		fs_privdata->infosector_dirty++;
+	fs_privdata->num_avail_clusters = num_free;
+	if (fs_privdata->next_avail_cluster < 2 || fs_privdata->next_avail_cluster >= limit)
+		fs_privdata->next_avail_cluster = 2;
+	return ananas_success();
+}
+
+/*
+ * Obtains an available cluster and marks it as being used; hint is tried
+ * first, so that files become contiguous if it follows their last cluster.
+ */
+static errorcode_t
+fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t hint, uint32_t* cluster_out)
+{
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+	uint32_t limit = fat_cluster_limit(fs_privdata);
+
+	mutex_lock(&fs_privdata->mtx_alloc);
+	uint32_t cluster = 0;
+	if (hint >= 2 && hint < limit && fat_cluster_is_free(fs_privdata, hint))
+		cluster = hint;
+	if (cluster == 0)
+		cluster = fat_find_free_cluster(fs_privdata, fs_privdata->next_avail_cluster, limit);
+	if (cluster == 0)
+		cluster = fat_find_free_cluster(fs_privdata, 2, fs_privdata->next_avail_cluster);
+	if (cluster == 0) {
+		/* Out of available clusters */
+		mutex_unlock(&fs_privdata->mtx_alloc);
+		return ANANAS_ERROR(NO_SPACE);
+	}
+	fat_cluster_set_free(fs_privdata, cluster, 0);
+	fs_privdata->num_avail_clusters--;
+	fs_privdata->next_avail_cluster = (cluster + 1 < limit) ? cluster + 1 : 2;
+	fs_privdata->infosector_dirty++;
+	mutex_unlock(&fs_privdata->mtx_alloc);
+
+	/* Mark the cluster as end-of-chain in all FATs; it is written back later */
+	errorcode_t err = fat_set_cluster(fs, cluster, (fs_privdata->fat_type == 16) ? 0xfff8 : 0xffffff8);
+	if (ananas_is_failure(err)) {
+		mutex_lock(&fs_privdata->mtx_alloc);
+		fat_cluster_set_free(fs_privdata, cluster, 1);
+		fs_privdata->num_avail_clusters++;
+		mutex_unlock(&fs_privdata->mtx_alloc);
+		return err;
 	}
 
-	/* Out of available clusters */
-	return ANANAS_ERROR(NO_SPACE);
+	*cluster_out = cluster;
+	return ananas_success();
+}
+
+/*
+ * Marks a cluster as available again.
+ */
+static errorcode_t
+fat_release_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster)
+{
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+
+	errorcode_t err = fat_set_cluster(fs, cluster, 0);
+	ANANAS_ERROR_RETURN(err);
+
+	mutex_lock(&fs_privdata->mtx_alloc);
+	if (cluster >= 2 && cluster < fat_cluster_limit(fs_privdata) && !fat_cluster_is_free(fs_privdata, cluster)) {
+		fat_cluster_set_free(fs_privdata, cluster, 1);
+		fs_privdata->num_avail_clusters++;
+		fs_privdata->infosector_dirty++;
+	}
+	mutex_unlock(&fs_privdata->mtx_alloc);
+	return ananas_success();
 }
 
 /*
@@ -295,14 +429,10 @@ fat_append_cluster(struct VFS_INODE* inode, uint32_t* cluster_out)
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
 
-	/*
-	 * Figure out the last cluster of the file; we cache this per inode as we don't
-	 * want to clutter the cluster-cache with it (these entries need to be updated
-	 * if we append a cluster)
-	 */
+	/* Figure out the last cluster of the file; we cache this per inode */
 	uint32_t last_cluster = privdata->last_cluster;
 	if (last_cluster == 0) {
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, (uint32_t)-1, &last_cluster);
+		errorcode_t err = fat_get_cluster(inode, (uint32_t)-1, &last_cluster);
 		if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_RANGE) {
 			KASSERT(ananas_is_failure(err), "able to obtain impossible cluster");
 			return err;
@@ -310,15 +440,17 @@ fat_append_cluster(struct VFS_INODE* inode, uint32_t* cluster_out)
 		privdata->last_cluster = last_cluster;
 	}
 
-	/* Obtain the next cluster - this will also mark it as being in use */
+	/*
+	 * Obtain the next cluster - this will also mark it as being in use; we'd
+	 * like the one directly following the current last cluster.
+	 */
 	uint32_t new_cluster = 0;
-	errorcode_t err = fat_claim_avail_cluster(fs, &new_cluster);
+	errorcode_t err = fat_claim_avail_cluster(fs, (last_cluster != 0) ? last_cluster + 1 : 0, &new_cluster);
 	ANANAS_ERROR_RETURN(err);
 
 	/* If the file didn't have any clusters before, it sure does now */
 	if (privdata->first_cluster == 0) {
 		privdata->first_cluster = new_cluster;
-		vfs_set_inode_dirty(inode);
 	} else {
 		/* Append this cluster to the file chain */
 		err = fat_set_cluster(fs, last_cluster, new_cluster);
@@ -326,32 +458,29 @@ fat_append_cluster(struct VFS_INODE* inode, uint32_t* cluster_out)
 	}
 	*cluster_out = new_cluster;
 
-	/*
-	 * Update the cache; if there is an entry for our inode which is marked as
-	 * nonexistent, we expect it to be the last one and overwrite it.
-	 */
-	spinlock_lock(&fs_privdata->spl_cache);
-	for(int cache_item = 0; cache_item < FAT_NUM_CACHEITEMS; cache_item++) {
-		struct FAT_CLUSTER_CACHEITEM* ci = &fs_privdata->cluster_cache[cache_item];
-		if (ci->f_clusterno == privdata->first_cluster && ci->f_nextcluster == -1) {
-			/* Found empty item - use it (we assume this always occurs at the end of the items) */
-			KASSERT(ci->f_index == (inode->i_sb.st_size + ((fs_privdata->sector_size * fs_privdata->sectors_per_cluster) - 1)) / (fs_privdata->sector_size * fs_privdata->sectors_per_cluster), "empty cache item isn't final item?");
-			ci->f_nextcluster = new_cluster;
-			break;
-		}
-	}
-	spinlock_unlock(&fs_privdata->spl_cache);
+	/* Update the cluster map; if this fails, it will just be rebuilt */
+	mutex_lock(&privdata->mtx_map);
+	if (privdata->map_valid && ananas_is_failure(fat_cluster_map_append(privdata, new_cluster)))
+		privdata->map_valid = 0;
+	mutex_unlock(&privdata->mtx_map);
 
 	/* Update the block count of the inode */
 	privdata->last_cluster = new_cluster;
 	inode->i_sb.st_blocks += fs_privdata->sectors_per_cluster;
+
+	/*
+	 * Writing the inode also flushes the FAT changes made on its behalf; the
+	 * root inode is never written, so it must do so itself.
+	 */
+	if (privdata->root_inode)
+		return fat_flush_metadata(fs);
+	vfs_set_inode_dirty(inode);
 	return ananas_success();
 }
 
 errorcode_t
 fat_truncate_clusterchain(struct VFS_INODE* inode)
 {
-	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
 
@@ -365,16 +494,18 @@ fat_truncate_clusterchain(struct VFS_INODE* inode)
 	errorcode_t err = ananas_success();
 	uint32_t cluster = 0;
 	for (int num = num_clusters - 1; num >= 0; num--) {
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, num, &cluster);
-		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE)
+		err = fat_get_cluster(inode, num, &cluster);
+		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
+			err = ananas_success();
 			break; /* end of the run */
+		}
 		ANANAS_ERROR_RETURN(err); /* anything else is bad */
 
 		/*
-		 * Throw away this cluster; note that fat_set_cluster() will not update the
-		 * cluster map, which is fine as we'll just flush the cache soon.
+		 * Throw away this cluster; note that this will not update the cluster
+		 * map, which is fine as we'll just throw it away soon.
 		 */
-		err = fat_set_cluster(fs, cluster, 0);
+		err = fat_release_cluster(fs, cluster);
 		if (ananas_is_failure(err))
 			break;
 	}
@@ -383,8 +514,7 @@ fat_truncate_clusterchain(struct VFS_INODE* inode)
 	 * Throw away the cluster map of this inode - we clean up everything even in
 	 * case of an error as it won't hurt to do so (and we expect little failure)
 	 */
-	if (privdata->first_cluster > 0)
-		fat_clear_cache(fs, privdata->first_cluster);
+	fat_clear_cluster_map(inode);
 	return err;
 }
 
@@ -413,7 +543,7 @@ fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out,
 			return ANANAS_ERROR(BAD_RANGE);
 	} else {
 		uint32_t cluster;
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, block_in / fs_privdata->sectors_per_cluster, &cluster);
+		errorcode_t err = fat_get_cluster(inode, block_in / fs_privdata->sectors_per_cluster, &cluster);
 		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
 			/* end of the chain */
 			if (!create) {
@@ -435,75 +565,89 @@ fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out,
 	return ananas_success();
 }
 
-int
-fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster)
+/*
+ * Maps a run of blocks; the sectors of a cluster are always contiguous, and so
+ * are clusters the FAT chains to their direct successor.
+ */
+errorcode_t
+fat_block_map_range(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks)
 {
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
 
-	/*
-	 * Throw away al inode's cluster items; this works by searching for the last
-	 * item in the cluster cache and copying it over our removed blocks - this
-	 * works because the cache isn't sorted.
-	 */
-	spinlock_lock(&fs_privdata->spl_cache);
-	unsigned int last_index = 0;
-	while (last_index < FAT_NUM_CACHEITEMS && fs_privdata->cluster_cache[last_index].f_clusterno != 0)
-		last_index++;
-	/* Cacheitems 0 ... i, for all i < last_index are in use */
-
-	/* Throw away all inode's cluster items in the cache */
-	int num_removed = 0;
-	struct FAT_CLUSTER_CACHEITEM* ci = fs_privdata->cluster_cache;
-	for(unsigned int n = 0; n < FAT_NUM_CACHEITEMS; n++, ci++) {
-		if (ci->f_clusterno != first_cluster)
-			continue;
+	errorcode_t err = fat_block_map(inode, block_in, block_out, 0);
+	ANANAS_ERROR_RETURN(err);
 
-		/*
-		 * OK, this is an item we'll have to destroy - copy the last entry over it and remove that one.
-		 * If this is the final entry, we skip the copying.
-			*/
-		KASSERT(last_index >= 0 && last_index <= FAT_NUM_CACHEITEMS, "last index %u invalid", last_index);
-		KASSERT(n <= last_index, "item to remove %u is beyond last index %i", n, last_index);
-		if (n != (last_index - 1)) {
-			/* Need to overwrite this item with the final cache item */
-			memcpy(ci, &fs_privdata->cluster_cache[last_index - 1], sizeof(*ci));
-			memset(&fs_privdata->cluster_cache[last_index - 1], 0, sizeof(*ci));
-			last_index--;
-		} else {
-			memset(ci, 0, sizeof(*ci));
-		}
-		num_removed++;
+	/* FAT16 root inodes are contiguous by definition */
+	if (privdata->root_inode && fs_privdata->fat_type != 32) {
+		if (block_in + *num_blocks > fs_privdata->num_rootdir_sectors)
+			*num_blocks = (block_in < fs_privdata->num_rootdir_sectors) ? fs_privdata->num_rootdir_sectors - block_in : 1;
+		return ananas_success();
+	}
+
+	unsigned int n = fs_privdata->sectors_per_cluster - block_in % fs_privdata->sectors_per_cluster;
+	uint32_t clusternum = block_in / fs_privdata->sectors_per_cluster + 1;
+	while (n < *num_blocks) {
+		uint32_t cluster;
+		if (ananas_is_failure(fat_get_cluster(inode, clusternum, &cluster)) ||
+		    fat_cluster_to_sector(fs, cluster) != *block_out + n)
+			break;
+		n += fs_privdata->sectors_per_cluster;
+		clusternum++;
 	}
-	spinlock_unlock(&fs_privdata->spl_cache);
-	return num_removed;
+	if (n < *num_blocks)
+		*num_blocks = n;
+	return ananas_success();
 }
 
 void
-fat_dump_cache(struct VFS_MOUNTED_FS* fs)
+fat_clear_cluster_map(struct VFS_INODE* inode)
 {
-	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
-	struct FAT_CLUSTER_CACHEITEM* ci = fs_privdata->cluster_cache;
-	for(unsigned int n = 0; n < FAT_NUM_CACHEITEMS; n++, ci++) {
-		kprintf("ci[%i]: clusterno=%i, index=%i, nextcl=%u\n",
-		 n, ci->f_clusterno, ci->f_index, ci->f_nextcluster);
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+
+	mutex_lock(&privdata->mtx_map);
+	privdata->map_valid = 0;
+	privdata->map_len = 0;
+	mutex_unlock(&privdata->mtx_map);
+}
+
+void
+fat_dump_cluster_map(struct VFS_INODE* inode)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	for(unsigned int n = 0; n < privdata->map_len; n++) {
+		struct FAT_CLUSTER_EXTENT* ce = &privdata->map[n];
+		kprintf("ce[%u]: index=%u, cluster=%u, count=%u\n",
+		 n, ce->ce_index, ce->ce_cluster, ce->ce_count);
 	}
 }
 
-errorcode_t
+static errorcode_t
 fat_update_infosector(struct VFS_MOUNTED_FS* fs)
 {
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
 	if (fs_privdata->infosector_num == 0)
 		return ananas_success(); /* no info sector; nothing to do */
 
-	/* If we have nothing sensible to store, don't bother */
-	if (fs_privdata->next_avail_cluster < 2 ||
-	    fs_privdata->num_avail_clusters == (uint32_t)-1)
+	/* If nothing changed or we have nothing sensible to store, don't bother */
+	mutex_lock(&fs_privdata->mtx_alloc);
+	uint32_t next_avail = fs_privdata->next_avail_cluster;
+	uint32_t num_avail = fs_privdata->num_avail_clusters;
+	int dirty = fs_privdata->infosector_dirty;
+	fs_privdata->infosector_dirty = 0;
+	mutex_unlock(&fs_privdata->mtx_alloc);
+	if (!dirty || next_avail < 2 || num_avail == (uint32_t)-1)
 		return ananas_success();
 
 	struct BIO* bio;
 	errorcode_t err = vfs_bread(fs, fs_privdata->infosector_num, &bio);
-	ANANAS_ERROR_RETURN(err);
+	if (ananas_is_failure(err)) {
+		mutex_lock(&fs_privdata->mtx_alloc);
+		fs_privdata->infosector_dirty++; /* try again next time */
+		mutex_unlock(&fs_privdata->mtx_alloc);
+		return err;
+	}
 
 	/*
 	 * We don't do any verification (this should have been done upon mount time)
@@ -511,12 +655,64 @@ fat_update_infosector(struct VFS_MOUNTED_FS* fs)
 	 * valid.
 	 */
 	struct FAT_FAT32_FSINFO* fsi = (struct FAT_FAT32_FSINFO*)static_cast<char*>(BIO_DATA(bio));
-	FAT_TO_LE32(fsi->fsi_next_free, fs_privdata->next_avail_cluster);
-	FAT_TO_LE32(fsi->fsi_free_count, fs_privdata->num_avail_clusters);
-	bio_set_dirty(bio); /* XXX even if we updated nothing? */
+	FAT_TO_LE32(fsi->fsi_next_free, next_avail);
+	FAT_TO_LE32(fsi->fsi_free_count, num_avail);
+	bio_set_dirty(bio);
 	bio_free(bio);
 
 	return ananas_success();
 }
 
+/*
+ * Copies every FAT sector changed since the previous call to the other FATs
+ * and updates the info sector; this is done as inodes are written, so that
+ * the metadata of an entire transaction (a file being appended to, say) is
+ * only written once.
+ */
+errorcode_t
+fat_flush_metadata(struct VFS_MOUNTED_FS* fs)
+{
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+
+	errorcode_t err = ananas_success();
+	mutex_lock(&fs_privdata->mtx_fat);
+	for (uint32_t n = 0; fs_privdata->fat_num_dirty > 0 && n < fs_privdata->num_fat_sectors; n++) {
+		/* Skip words without any dirty sectors at once */
+		if ((n % 32) == 0 && fs_privdata->fat_dirty_map[n / 32] == 0) {
+			n += 31;
+			continue;
+		}
+		if ((fs_privdata->fat_dirty_map[n / 32] & (1U << (n % 32))) == 0)
+			continue;
+
+		blocknr_t sector_num = fs_privdata->reserved_sectors + n;
+		struct BIO* bio;
+		err = vfs_bread(fs, sector_num, &bio);
+		if (ananas_is_failure(err))
+			break; /* keep it dirty; we'll try again next time */
+
+		int num_copied = 1;
+		for (; num_copied < fs_privdata->num_fats; num_copied++) {
+			/* The copy is overwritten entirely, so there's no need to read it */
+			struct BIO* bio2;
+			err = vfs_bget(fs, sector_num + num_copied * fs_privdata->num_fat_sectors, &bio2, BIO_READ_NODATA);
+			if (ananas_is_failure(err))
+				break;
+			memcpy(BIO_DATA(bio2), BIO_DATA(bio), fs_privdata->sector_size);
+			bio_set_dirty(bio2);
+			bio_free(bio2);
+		}
+		bio_free(bio);
+		if (num_copied < fs_privdata->num_fats)
+			break;
+
+		fs_privdata->fat_dirty_map[n / 32] &= ~(1U << (n % 32));
+		fs_privdata->fat_num_dirty--;
+	}
+	mutex_unlock(&fs_privdata->mtx_fat);
+	ANANAS_ERROR_RETURN(err);
+
+	return fat_update_infosector(fs);
+}
+
 /* vim:set ts=2 sw=2: */
@@ -6,10 +6,12 @@
 struct VFS_INODE;
 
 errorcode_t fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create);
-void fat_dump_cache(struct VFS_MOUNTED_FS* fs);
-int fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster);
+errorcode_t fat_block_map_range(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks);
+void fat_dump_cluster_map(struct VFS_INODE* inode);
+void fat_clear_cluster_map(struct VFS_INODE* inode);
 errorcode_t fat_truncate_clusterchain(struct VFS_INODE* inode);
-errorcode_t fat_update_infosector(struct VFS_MOUNTED_FS* fs);
+errorcode_t fat_flush_metadata(struct VFS_MOUNTED_FS* fs);
+errorcode_t fat_build_free_map(struct VFS_MOUNTED_FS* fs);
 
 extern struct VFS_INODE_OPS fat_inode_ops;
 
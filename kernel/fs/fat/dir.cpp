@@ -4,6 +4,8 @@
 #include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/list.h>
+#include <ananas/mm.h>
 #include <ananas/vfs/types.h>
 #include <ananas/vfs/core.h>
 #include <ananas/vfs/generic.h>
@@ -14,6 +16,40 @@
 
 TRACE_SETUP;
 
+#define FAT_DIRINDEX_BUCKETS	256
+
+/*
+ * The directory index keeps track of where every name is stored in the
+ * directory and which entries are available, so that adding and removing names
+ * needn't scan the directory; it is built by a single scan the first time the
+ * directory is changed, and kept up-to-date from then on. It is protected by
+ * the directory's mtx_dir.
+ */
+struct FAT_DIRINDEX_NAME {
+	LIST_FIELDS(struct FAT_DIRINDEX_NAME);
+	uint32_t dn_hash;
+	uint32_t dn_offset;		/* Offset of the first entry (LFN or 8.3) */
+	unsigned int dn_length;		/* Number of entries used */
+	char dn_name[1];		/* NUL-terminated */
+};
+
+LIST_DEFINE(FAT_DIRINDEX_BUCKET, struct FAT_DIRINDEX_NAME);
+
+/* A run of consecutive deleted entries */
+struct FAT_DIRINDEX_FREE {
+	LIST_FIELDS(struct FAT_DIRINDEX_FREE);
+	uint32_t df_offset;
+	unsigned int df_count;
+};
+
+LIST_DEFINE(FAT_DIRINDEX_FREELIST, struct FAT_DIRINDEX_FREE);
+
+struct FAT_DIRINDEX {
+	uint32_t di_end;		/* Offset of the end-of-directory entry */
+	struct FAT_DIRINDEX_FREELIST di_free;	/* Sorted by offset */
+	struct FAT_DIRINDEX_BUCKET di_bucket[FAT_DIRINDEX_BUCKETS];
+};
+
 #if 0
 static void
 fat_dump_entry(struct FAT_ENTRY* fentry)
@@ -209,92 +245,285 @@ fat_sanitize_83_name(const char* fname, char* shortname)
 	return a;
 }
 
+/* FNV-1a */
+static inline uint32_t
+fat_dirindex_hash(const char* name)
+{
+	uint32_t hash = 2166136261U;
+	for (/* nothing */; *name != '\0'; name++)
+		hash = (hash ^ static_cast<uint8_t>(*name)) * 16777619U;
+	return hash;
+}
+
+static struct FAT_DIRINDEX_NAME*
+fat_dirindex_find(struct FAT_DIRINDEX* di, const char* name)
+{
+	uint32_t hash = fat_dirindex_hash(name);
+	LIST_FOREACH(&di->di_bucket[hash % FAT_DIRINDEX_BUCKETS], dn, struct FAT_DIRINDEX_NAME) {
+		if (dn->dn_hash == hash && strcmp(dn->dn_name, name) == 0)
+			return dn;
+	}
+	return NULL;
+}
+
+static void
+fat_dirindex_add_name(struct FAT_DIRINDEX* di, const char* name, uint32_t offset, unsigned int length)
+{
+	size_t name_len = strlen(name);
+	auto dn = static_cast<struct FAT_DIRINDEX_NAME*>(kmalloc(sizeof(struct FAT_DIRINDEX_NAME) + name_len));
+	dn->dn_hash = fat_dirindex_hash(name);
+	dn->dn_offset = offset;
+	dn->dn_length = length;
+	memcpy(dn->dn_name, name, name_len + 1);
+	LIST_APPEND(&di->di_bucket[dn->dn_hash % FAT_DIRINDEX_BUCKETS], dn);
+}
+
+/* Adds count available entries at offset, merging them with adjacent runs */
+static void
+fat_dirindex_add_free(struct FAT_DIRINDEX* di, uint32_t offset, unsigned int count)
+{
+	struct FAT_DIRINDEX_FREE* next = NULL;
+	LIST_FOREACH(&di->di_free, df, struct FAT_DIRINDEX_FREE) {
+		if (df->df_offset > offset) {
+			next = df;
+			break;
+		}
+	}
+	struct FAT_DIRINDEX_FREE* prev = (next != NULL) ? LIST_PREV(next) : LIST_TAIL(&di->di_free);
+
+	uint32_t end = offset + count * sizeof(struct FAT_ENTRY);
+	if (prev != NULL && prev->df_offset + prev->df_count * sizeof(struct FAT_ENTRY) == offset) {
+		prev->df_count += count;
+		if (next != NULL && next->df_offset == end) {
+			prev->df_count += next->df_count;
+			LIST_REMOVE(&di->di_free, next);
+			kfree(next);
+		}
+		return;
+	}
+	if (next != NULL && next->df_offset == end) {
+		next->df_offset = offset;
+		next->df_count += count;
+		return;
+	}
+
+	auto df = static_cast<struct FAT_DIRINDEX_FREE*>(kmalloc(sizeof(struct FAT_DIRINDEX_FREE)));
+	df->df_offset = offset;
+	df->df_count = count;
+	if (next != NULL) {
+		LIST_INSERT_BEFORE(&di->di_free, next, df);
+	} else {
+		LIST_APPEND(&di->di_free, df);
+	}
+}
+
 /*
- * Adds a given FAT entry to a directory.
- *
- * This will update the name of the entry given. If dentry is NULL, no LFN name
- * will be generated.
- *
- * Note that we use uint32_t's because these are quicker to use and a directory
- * size cannot be >4GB anyway (MS docs claim most implementations use an
- * uint16_t!) - so relying on large FAT directories would be most unwise anyway.
+ * Picks the offset to store count consecutive entries; this is the first run
+ * of deleted entries large enough, or the end of the directory otherwise.
+ */
+static uint32_t
+fat_dirindex_claim(struct FAT_DIRINDEX* di, unsigned int count)
+{
+	LIST_FOREACH(&di->di_free, df, struct FAT_DIRINDEX_FREE) {
+		if (df->df_count < count)
+			continue;
+		uint32_t offset = df->df_offset;
+		df->df_offset += count * sizeof(struct FAT_ENTRY);
+		df->df_count -= count;
+		if (df->df_count == 0) {
+			LIST_REMOVE(&di->di_free, df);
+			kfree(df);
+		}
+		return offset;
+	}
+
+	uint32_t offset = di->di_end;
+	di->di_end += count * sizeof(struct FAT_ENTRY);
+	return offset;
+}
+
+void
+fat_dirindex_free(struct FAT_DIRINDEX* di)
+{
+	for (unsigned int n = 0; n < FAT_DIRINDEX_BUCKETS; n++) {
+		LIST_FOREACH_SAFE(&di->di_bucket[n], dn, struct FAT_DIRINDEX_NAME) {
+			kfree(dn);
+		}
+	}
+	LIST_FOREACH_SAFE(&di->di_free, df, struct FAT_DIRINDEX_FREE) {
+		kfree(df);
+	}
+	kfree(di);
+}
+
+/*
+ * Scans the entire directory to build its index.
  */
 static errorcode_t
-fat_add_directory_entry(struct VFS_INODE* dir, const char* dentry, struct FAT_ENTRY* fentry, ino_t* inum)
+fat_dirindex_build(struct VFS_INODE* dir, struct FAT_DIRINDEX** out)
 {
 	struct VFS_MOUNTED_FS* fs = dir->i_fs;
-	struct BIO* bio = NULL;
+	auto di = static_cast<struct FAT_DIRINDEX*>(kmalloc(sizeof(struct FAT_DIRINDEX)));
+	if (di == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	di->di_end = 0;
+	LIST_INIT(&di->di_free);
+	for (unsigned int n = 0; n < FAT_DIRINDEX_BUCKETS; n++)
+		LIST_INIT(&di->di_bucket[n]);
 
-	/*
-	 * Calculate the number of entries we need; each LFN entry stores 13 characters,
-	 * and we'll need an entry for the file itself too. Note that we ALWAYS store
-	 * a LFN name if a name is given, even if the 8.3 name would be sufficient.
-	 */
-	int chain_needed = 1;
-	if (dentry != NULL)
-		chain_needed += (strlen(dentry) + 12) / 13;
+	char cur_filename[128]; /* currently assembled filename */
+	memset(cur_filename, 0, sizeof(cur_filename));
 
+	struct BIO* bio = NULL;
 	blocknr_t cur_block = (blocknr_t)-1;
-	uint32_t current_filename_offset = (uint32_t)-1;
-	int	cur_lfn_chain = 0;
 	uint32_t cur_dir_offset = 0;
+	uint32_t chain_offset = (uint32_t)-1;
+	errorcode_t err = ananas_success();
 	while(1) {
 		/* Obtain the current directory block data */
 		blocknr_t want_block;
-		errorcode_t err = fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
+		err = fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
 		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
-			/* We've hit an end-of-file - this means we'll have to enlarge the directory */
-			cur_lfn_chain = -1;
+			/* Directory is full; it will have to be enlarged */
+			err = ananas_success();
 			break;
 		}
-		ANANAS_ERROR_RETURN(err);
+		if (ananas_is_failure(err))
+			break;
 		if (want_block != cur_block || bio == NULL) {
 			if (bio != NULL) bio_free(bio);
+			bio = NULL;
 			err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
+			if (ananas_is_failure(err))
+				break;
 			cur_block = want_block;
 		}
 
-		/* See what this block's entry is all about */
 		uint32_t cur_offs = cur_dir_offset % fs->fs_block_size;
 		auto fentry = reinterpret_cast<struct FAT_ENTRY*>(static_cast<char*>(BIO_DATA(bio)) + cur_offs);
-		if (fentry->fe_filename[0] == '\0') {
-			/*
-			 * First charachter is nul - this means there are no more entries to come
-			 * and we can just write our entry here. Note that we assume there are no
-			 * orphanaged LFN entries before here, which is conform the VFAT spec.
-		 	 */
-			current_filename_offset = cur_dir_offset;
-			cur_lfn_chain = 0;
-			break;
-		}
+		if (fentry->fe_filename[0] == '\0')
+			break; /* end of the directory */
 
-		if (fentry->fe_attributes == FAT_ATTRIBUTE_LFN) {
-			/*
-			 * This entry is part of the LFN chain; store the offset if it's the
-			 * first one as we may chose to re-use the entire chain.
-			 */
-			if (cur_lfn_chain++ == 0)
-				current_filename_offset = cur_dir_offset;
-			cur_dir_offset += sizeof(struct FAT_ENTRY);
+		uint32_t entry_offset = cur_dir_offset;
+		cur_dir_offset += sizeof(struct FAT_ENTRY);
+		if (fentry->fe_filename[0] == 0xe5) {
+			/* Deleted entry; this includes any LFN entries that belonged to it */
+			fat_dirindex_add_free(di, entry_offset, 1);
+			chain_offset = (uint32_t)-1;
+			memset(cur_filename, 0, sizeof(cur_filename));
 			continue;
 		}
 
-		if (fentry->fe_filename[0] == 0xe5 && cur_lfn_chain >= chain_needed) {
-			/*
-			 * Entry here is deleted; this should come at the end of a LFN chain. If there
-			 * is no chain, the check above will fail regardless and we skip this entry.
-			  */
-			break;
+		if (chain_offset == (uint32_t)-1)
+			chain_offset = entry_offset;
+		if (!fat_construct_filename(fentry, cur_filename))
+			continue; /* part of a long file name */
+
+		/* Volume labels have no name we can look up, but do take up space */
+		if ((fentry->fe_attributes & FAT_ATTRIBUTE_VOLUMEID) == 0)
+			fat_dirindex_add_name(di, cur_filename, chain_offset, (cur_dir_offset - chain_offset) / sizeof(struct FAT_ENTRY));
+		chain_offset = (uint32_t)-1;
+		memset(cur_filename, 0, sizeof(cur_filename));
+	}
+	if (bio != NULL)
+		bio_free(bio);
+	if (ananas_is_failure(err)) {
+		fat_dirindex_free(di);
+		return err;
+	}
+
+	di->di_end = cur_dir_offset;
+	*out = di;
+	return ananas_success();
+}
+
+/*
+ * Returns the index of directory dir, building it if needed; must be called
+ * with mtx_dir held.
+ */
+static errorcode_t
+fat_dirindex_get(struct VFS_INODE* dir, struct FAT_DIRINDEX** di)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(dir->i_privdata);
+	if (privdata->dir_index == NULL) {
+		errorcode_t err = fat_dirindex_build(dir, &privdata->dir_index);
+		ANANAS_ERROR_RETURN(err);
+	}
+	*di = privdata->dir_index;
+	return ananas_success();
+}
+
+/*
+ * Obtains the directory block holding offset; if the directory ends before
+ * the offset, a cluster is added to it. New clusters are cleared, so that they
+ * contain no entries.
+ */
+static errorcode_t
+fat_dir_get_block(struct VFS_INODE* dir, uint32_t offset, blocknr_t* block_out, struct BIO** bio)
+{
+	struct VFS_MOUNTED_FS* fs = dir->i_fs;
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+	blocknr_t logical_block = offset / (blocknr_t)fs->fs_block_size;
+
+	errorcode_t err = fat_block_map(dir, logical_block, block_out, 0);
+	if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
+		err = fat_block_map(dir, logical_block, block_out, 1);
+		ANANAS_ERROR_RETURN(err);
+
+		blocknr_t first_block = logical_block - logical_block % fs_privdata->sectors_per_cluster;
+		for (unsigned int n = 0; n < fs_privdata->sectors_per_cluster; n++) {
+			blocknr_t block;
+			err = fat_block_map(dir, first_block + n, &block, 0);
+			ANANAS_ERROR_RETURN(err);
+			struct BIO* new_bio;
+			err = vfs_bget(fs, block, &new_bio, BIO_READ_NODATA);
+			ANANAS_ERROR_RETURN(err);
+			memset(BIO_DATA(new_bio), 0, fs->fs_block_size);
+			bio_set_dirty(new_bio);
+			bio_free(new_bio);
 		}
+	}
+	ANANAS_ERROR_RETURN(err);
 
-		/*
-		 * This isn't a LFN entry, nor is it a removed entry; we must skip over it.
-		 */
-		current_filename_offset = cur_dir_offset;
-		cur_lfn_chain = 0;
-		cur_dir_offset += sizeof(struct FAT_ENTRY);
+	return vfs_bread(fs, *block_out, bio);
+}
+
+/*
+ * Adds a given FAT entry to a directory.
+ *
+ * This will update the name of the entry given. If dentry is NULL, no LFN name
+ * will be generated.
+ *
+ * Note that we use uint32_t's because these are quicker to use and a directory
+ * size cannot be >4GB anyway (MS docs claim most implementations use an
+ * uint16_t!) - so relying on large FAT directories would be most unwise anyway.
+ */
+static errorcode_t
+fat_add_directory_entry(struct VFS_INODE* dir, const char* dentry, struct FAT_ENTRY* fentry, ino_t* inum)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(dir->i_privdata);
+	struct VFS_MOUNTED_FS* fs = dir->i_fs;
+	struct BIO* bio = NULL;
+
+	/*
+	 * Calculate the number of entries we need; each LFN entry stores 13 characters,
+	 * and we'll need an entry for the file itself too. Note that we ALWAYS store
+	 * a LFN name if a name is given, even if the 8.3 name would be sufficient.
+	 */
+	int chain_needed = 1;
+	if (dentry != NULL)
+		chain_needed += (strlen(dentry) + 12) / 13;
+
+	/* Ask the index where the entries can go */
+	mutex_lock(&privdata->mtx_dir);
+	struct FAT_DIRINDEX* di;
+	errorcode_t err = fat_dirindex_get(dir, &di);
+	if (ananas_is_failure(err)) {
+		mutex_unlock(&privdata->mtx_dir);
+		return err;
 	}
+	uint32_t first_offset = fat_dirindex_claim(di, chain_needed);
+	uint32_t current_filename_offset = first_offset;
 
 	/*
 	 * With LFN, shortnames are actually not used so we can stash whatever we
@@ -311,26 +540,21 @@ fat_add_directory_entry(struct VFS_INODE* dir, const char* dentry, struct FAT_EN
 	} /* else if (dentry == NULL) ... nothing to do, cur_entry_idx cannot be != chain_needed-1 */
 
 	/*
-	 * We've fallen out of our loop; there are three possible conditions (errors
-	 * are handled directly and will not cause us to end up here):
-	 *
-	 * 1) cur_lfn_chain < 0  => Out of directory entries
-	 *    The directory is to be enlarged and we can use its first entry.
-	 * 2) cur_lfn_chain == 0 => End of directory
-	 *    We can add the entry at cur_dir_offset
-	 * 3) cur_lfn_chain > 0  => We've found entries we can overwrite
-	 *    If this condition hits, there is enough space to place our entries.
+	 * Write the entries; the directory is enlarged as needed if they are to go
+	 * at the end of it.
 	 */
-	int filename_len = strlen(dentry);
+	int filename_len = (dentry != NULL) ? strlen(dentry) : 0;
+	blocknr_t cur_block = (blocknr_t)-1;
 	for(int cur_entry_idx = 0; cur_entry_idx < chain_needed; cur_entry_idx++) {
 		/* Fetch/allocate the desired block */
 		blocknr_t want_block;
-		errorcode_t err = fat_block_map(dir, (current_filename_offset / (blocknr_t)fs->fs_block_size), &want_block, (cur_lfn_chain < 0));
-		ANANAS_ERROR_RETURN(err);
-		if (want_block != cur_block) {
-			bio_free(bio);
-			err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
+		if (bio == NULL || current_filename_offset % fs->fs_block_size == 0) {
+			if (bio != NULL)
+				bio_free(bio);
+			bio = NULL;
+			err = fat_dir_get_block(dir, current_filename_offset, &want_block, &bio);
+			if (ananas_is_failure(err))
+				break;
 			cur_block = want_block;
 		}
 
@@ -365,108 +589,85 @@ fat_add_directory_entry(struct VFS_INODE* dir, const char* dentry, struct FAT_EN
 		bio_set_dirty(bio);
 		current_filename_offset += sizeof(struct FAT_ENTRY);
 	}
+	if (bio != NULL)
+		bio_free(bio);
 
-	bio_free(bio);
-	return ananas_success();
+	/*
+	 * If we could not write everything, forget the index; it is rebuilt from
+	 * whatever made it to the directory next time.
+	 */
+	if (ananas_is_failure(err)) {
+		fat_dirindex_free(di);
+		privdata->dir_index = NULL;
+	} else if (dentry != NULL)
+		fat_dirindex_add_name(di, dentry, first_offset, chain_needed);
+	mutex_unlock(&privdata->mtx_dir);
+	return err;
 }
 
 static errorcode_t
 fat_remove_directory_entry(struct VFS_INODE* dir, const char* dentry)
 {
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(dir->i_privdata);
 	struct VFS_MOUNTED_FS* fs = dir->i_fs;
-	struct BIO* bio = NULL;
 
-	char cur_filename[128]; /* currently assembled filename */
-	memset(cur_filename, 0, sizeof(cur_filename));
+	mutex_lock(&privdata->mtx_dir);
+	struct FAT_DIRINDEX* di;
+	errorcode_t err = fat_dirindex_get(dir, &di);
+	if (ananas_is_failure(err)) {
+		mutex_unlock(&privdata->mtx_dir);
+		return err;
+	}
+	struct FAT_DIRINDEX_NAME* dn = fat_dirindex_find(di, dentry);
+	if (dn == NULL) {
+		mutex_unlock(&privdata->mtx_dir);
+		return ANANAS_ERROR(NO_FILE);
+	}
 
-	errorcode_t errorcode = ANANAS_ERROR(NO_FILE);
+	/*
+	 * Entry is found; we need to remove it. As we know where its chain of LFN
+	 * pieces starts, we throw them all away along with it.
+	 */
+	struct BIO* bio = NULL;
 	blocknr_t cur_block = (blocknr_t)-1;
-	uint32_t cur_dir_offset = 0;
-	int chain_length = 0;
-	while(1) {
+	uint32_t cur_dir_offset = dn->dn_offset;
+	for(unsigned int n = 0; n < dn->dn_length; n++) {
 		/* Obtain the current directory block data */
 		blocknr_t want_block;
-		errorcode_t err = fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
-		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
-			/* We've hit an end-of-file */
+		err = fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
+		if (ananas_is_failure(err))
 			break;
-		}
-		ANANAS_ERROR_RETURN(err);
 		if (want_block != cur_block || bio == NULL) {
 			if (bio != NULL) bio_free(bio);
+			bio = NULL;
 			err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
+			if (ananas_is_failure(err))
+				break;
 			cur_block = want_block;
 		}
 
-		/* See what this block's entry is all about */
+		/* Update the FAT entry here; the file name is removed */
 		uint32_t cur_offs = cur_dir_offset % fs->fs_block_size;
 		cur_dir_offset += sizeof(struct FAT_ENTRY);
 		auto fentry = reinterpret_cast<struct FAT_ENTRY*>(static_cast<char*>(BIO_DATA(bio)) + cur_offs);
-		if (fentry->fe_filename[0] == '\0')
-			break; /* final entry; bail out */
-		if (fentry->fe_filename[0] == 0xe5) {
-			chain_length = 0;
-			continue; /* no entry or unused entry; skip it */
-		}
-
-		/* Convert the filename bits */
-		chain_length++;
-		if (!fat_construct_filename(fentry, cur_filename)) {
-			/* This is part of a long file entry name - get more */
-			continue;
-		}
-
-		/* XXX skip a volume label; we'll assume it cannot be removed */
-		if (fentry->fe_attributes & FAT_ATTRIBUTE_VOLUMEID)
-			continue;
-
-		/* Okay, if the file matches what we intended to remove, we have a winner */
-		if (strcmp(cur_filename, dentry) != 0) {
-			/* Not a match; skip it */
-			memset(cur_filename, 0, sizeof(cur_filename));
-			chain_length = 0;
-			continue;
-		}
+		fentry->fe_filename[0] = 0xe5; /* deleted */
 
-		/*
-		 * Entry is found; we need to remove it. As we know the chain length of LFN pieces, we have to
-		 * rewind to the first one and throw them all away.
-		 */
-		KASSERT(chain_length > 0, "found '%s' without sensible chain length (got %d)", cur_filename, chain_length);
-		cur_dir_offset -= sizeof(struct FAT_ENTRY) * chain_length;
-
-		for(/* nothing */; chain_length > 0; chain_length--) {
-			/* Obtain the current directory block data */
-			blocknr_t want_block;
-			errorcode_t err = fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
-			if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
-				/* We've hit an end-of-file */
-				break;
-			}
-			ANANAS_ERROR_RETURN(err);
-			if (want_block != cur_block || bio == NULL) {
-				if (bio != NULL) bio_free(bio);
-				err = vfs_bread(fs, want_block, &bio);
-				ANANAS_ERROR_RETURN(err);
-				cur_block = want_block;
-			}
-
-			/* Update the FAT entry here; the file name is removed */
-			uint32_t cur_offs = cur_dir_offset % fs->fs_block_size;
-			cur_dir_offset += sizeof(struct FAT_ENTRY);
-			auto fentry = reinterpret_cast<struct FAT_ENTRY*>(static_cast<char*>(BIO_DATA(bio)) + cur_offs);
-			fentry->fe_filename[0] = 0xe5; /* deleted */
-
-			bio_set_dirty(bio);
-		}
-		errorcode = ananas_success();
-		break;
+		bio_set_dirty(bio);
 	}
-
 	if (bio != NULL)
 		bio_free(bio);
-	return errorcode;
+
+	/* Update the index; if something went wrong, we'll just rebuild it */
+	if (ananas_is_success(err)) {
+		fat_dirindex_add_free(di, dn->dn_offset, dn->dn_length);
+		LIST_REMOVE(&di->di_bucket[dn->dn_hash % FAT_DIRINDEX_BUCKETS], dn);
+		kfree(dn);
+	} else {
+		fat_dirindex_free(di);
+		privdata->dir_index = NULL;
+	}
+	mutex_unlock(&privdata->mtx_dir);
+	return err;
 }
 
 static errorcode_t
@@ -557,7 +758,12 @@ fat_rename(struct VFS_INODE* old_dir, struct DENTRY* old_dentry, struct VFS_INOD
 	 */
 	struct VFS_INODE* old_inode = old_dentry->d_inode;
 	inode->i_sb.st_size = old_inode->i_sb.st_size;
-	memcpy(inode->i_privdata, old_inode->i_privdata, sizeof(struct FAT_INODE_PRIVDATA));
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	auto old_privdata = static_cast<struct FAT_INODE_PRIVDATA*>(old_inode->i_privdata);
+	privdata->root_inode = old_privdata->root_inode;
+	privdata->first_cluster = old_privdata->first_cluster;
+	privdata->last_cluster = old_privdata->last_cluster;
+	fat_clear_cluster_map(inode); /* rebuilt on demand from the new chain */
 	vfs_set_inode_dirty(inode);
 
 	/*
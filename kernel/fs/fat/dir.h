@@ -4,8 +4,10 @@
 #include <ananas/types.h>
 
 struct VFS_FILE;
+struct FAT_DIRINDEX;
 
 errorcode_t fat_readdir(struct VFS_FILE* file, void* dirents, size_t* len);
+void fat_dirindex_free(struct FAT_DIRINDEX* di);
 extern struct VFS_INODE_OPS fat_dir_ops;
 
 #endif /* __FATFS_DIR_H__ */
@@ -66,11 +66,12 @@ fat_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 	struct FAT_BPB* bpb = (struct FAT_BPB*)BIO_DATA(bio);
 	auto privdata = new FAT_FS_PRIVDATA;
 	memset(privdata, 0, sizeof(struct FAT_FS_PRIVDATA));
-	spinlock_init(&privdata->spl_cache);
+	mutex_init(&privdata->mtx_alloc, "fatalloc");
 	fs->fs_privdata = privdata; /* immediately, this is used by other functions */
 
 #define FAT_ABORT(x...) \
 	do { \
+		bio_free(bio); \
 		kfree(privdata); \
 		kprintf(x); \
 		return ANANAS_ERROR(NO_DEVICE); \
@@ -158,9 +159,30 @@ fat_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 			}
 		}
 	}
+	bio_free(bio);
+
+	/* Find out which clusters are available; allocation uses this from now on */
+	err = fat_build_free_map(fs);
+	if (ananas_is_failure(err)) {
+		kfree(privdata);
+		return err;
+	}
+
+	/* Changed FAT sectors are tracked so that they can be mirrored in one go */
+	mutex_init(&privdata->mtx_fat, "fatfat");
+	size_t dirty_map_len = ((privdata->num_fat_sectors + 31) / 32) * sizeof(uint32_t);
+	privdata->fat_dirty_map = static_cast<uint32_t*>(kmalloc(dirty_map_len));
+	if (privdata->fat_dirty_map == NULL) {
+		kfree(privdata->free_map);
+		kfree(privdata);
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	memset(privdata->fat_dirty_map, 0, dirty_map_len);
 
 	err = vfs_get_inode(fs, FAT_ROOTINODE_INUM, root_inode);
 	if (ananas_is_failure(err)) {
+		kfree(privdata->fat_dirty_map);
+		kfree(privdata->free_map);
 		kfree(privdata);
 		return err;
 	}
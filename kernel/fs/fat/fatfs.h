@@ -2,6 +2,7 @@
 #define __FATFS_H__
 
 #include <ananas/types.h>
+#include <ananas/lock.h>
 
 /*
  * Used to uniquely identify a FAT16 root inode; it appears on a
@@ -29,13 +30,15 @@
 		((uint8_t*)(x))[3] = ((y) >> 24) & 0xff; \
 	} while(0)
 
-/* Number of cache items per filesystem */
-#define FAT_NUM_CACHEITEMS	1000
-
-struct FAT_CLUSTER_CACHEITEM {
-	uint32_t	f_clusterno;
-	uint32_t	f_index;
-	uint32_t	f_nextcluster;
+/*
+ * A run of clusters of a file which follow each other on disk; the cluster map
+ * of a file is a sorted array of these, so that any cluster can be located
+ * without walking the FAT chain.
+ */
+struct FAT_CLUSTER_EXTENT {
+	uint32_t	ce_index;		/* First cluster index within the file */
+	uint32_t	ce_cluster;		/* Cluster on disk */
+	uint32_t	ce_count;		/* Number of clusters in the run */
 };
 
 struct FAT_FS_PRIVDATA {
@@ -52,14 +55,31 @@ struct FAT_FS_PRIVDATA {
 	uint32_t next_avail_cluster;		/* Next available cluster */
 	uint32_t num_avail_clusters;		/* Number of available clusters */
 	uint32_t infosector_num;		/* Info sector, or 0 if not present */
-	spinlock_t spl_cache;
-	struct FAT_CLUSTER_CACHEITEM cluster_cache[FAT_NUM_CACHEITEMS];
+	int      infosector_dirty;		/* Info sector needs to be updated */
+	mutex_t  mtx_alloc;			/* Protects the fields below and the counts above */
+	uint32_t* free_map;			/* Bit set for every available cluster */
+	mutex_t  mtx_fat;			/* Protects the fields below */
+	uint32_t* fat_dirty_map;		/* Bit set for every FAT sector not yet mirrored */
+	uint32_t fat_num_dirty;			/* Number of bits set in fat_dirty_map */
 };
 
+struct FAT_DIRINDEX;
+
 struct FAT_INODE_PRIVDATA {
 	int      root_inode;
 	uint32_t first_cluster;
 	uint32_t last_cluster;
+
+	/* Cluster map, built when the chain is first needed */
+	mutex_t  mtx_map;
+	int      map_valid;
+	unsigned int map_len;			/* Number of extents in use */
+	unsigned int map_size;			/* Number of extents allocated */
+	struct FAT_CLUSTER_EXTENT* map;
+
+	/* Directory index, built when the directory is first changed */
+	mutex_t  mtx_dir;
+	struct FAT_DIRINDEX* dir_index;
 };
 
 #endif /* __FATFS_H__ */
@@ -16,8 +16,11 @@
 errorcode_t
 fat_prepare_inode(struct VFS_INODE* inode)
 {
-	inode->i_privdata = new FAT_INODE_PRIVDATA;
-	memset(inode->i_privdata, 0, sizeof(struct FAT_INODE_PRIVDATA));
+	auto privdata = new FAT_INODE_PRIVDATA;
+	memset(privdata, 0, sizeof(struct FAT_INODE_PRIVDATA));
+	mutex_init(&privdata->mtx_map, "fatmap");
+	mutex_init(&privdata->mtx_dir, "fatdir");
+	inode->i_privdata = privdata;
 	return ananas_success();
 }
 
@@ -26,14 +29,11 @@ fat_discard_inode(struct VFS_INODE* inode)
 {
 	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
 
-	/*
-	 * If the file has backing storage, we need to throw away all inode's cluster
-	 * items in the cache.
-	 */
-	if (privdata->first_cluster != 0)
-		fat_clear_cache(inode->i_fs, privdata->first_cluster);
-
-	kfree(inode->i_privdata);
+	/* Throw away the cluster map and directory index, if we have them */
+	kfree(privdata->map);
+	if (privdata->dir_index != NULL)
+		fat_dirindex_free(privdata->dir_index);
+	kfree(privdata);
 }
 
 static void
@@ -145,13 +145,17 @@ fat_write_inode(struct VFS_INODE* inode)
 	/* And off it goes */
 	bio_set_dirty(bio);
 	bio_free(bio);
+
+	/* Clusters may have been claimed or freed; mirror the FAT and update the info sector */
+	fat_flush_metadata(fs);
 	return ananas_success(); /* XXX How should we deal with errors? */
 }
 
 struct VFS_INODE_OPS fat_inode_ops = {
 	.read = vfs_generic_read,
 	.write = vfs_generic_write,
-	.block_map = fat_block_map
+	.block_map = fat_block_map,
+	.block_map_range = fat_block_map_range
 };
 
 /* vim:set ts=2 sw=2: */
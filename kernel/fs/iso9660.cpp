@@ -6,6 +6,13 @@
  * and walk through the records sequentially. This is slower, but it works on
  * any filesystem (and if we cache enough, speed loss shouldn't be that
  * noticable)
+ *
+ * To keep this cheap, each directory is parsed only once: the first readdir
+ * reads the entire directory extent, using as few requests as possible, and
+ * keeps the resulting names around for as long as the inode lives. Files are
+ * always stored as a single contiguous extent, so they are simply mapped onto
+ * the device and read through the page cache; this allows large requests and
+ * readahead.
  */
 #include <ananas/types.h>
 #include <ananas/bio.h>
@@ -15,6 +22,7 @@
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
 #include <iso9660.h>
@@ -24,8 +32,24 @@ TRACE_SETUP;
 #define ISO9660_GET_WORD(x) (((uint16_t)(x)[0]) | ((uint16_t)(x)[1] << 8))
 #define ISO9660_GET_DWORD(x) (((uint32_t)(x)[0]) | ((uint32_t)(x)[1] << 8) | ((uint32_t)(x)[2] << 16) | ((uint32_t)(x)[3] << 24))
 
+/* Number of directory blocks read at once */
+#define ISO9660_DIR_READ_BLOCKS	16
+
+/* A directory entry as it is kept in the directory cache */
+struct ISO9660_DIRCACHE_ENTRY {
+	uint32_t dce_offset;		/* Offset of the entry within the directory */
+	ino_t dce_inum;
+	uint32_t dce_name;		/* Offset of the name in dir_names */
+	unsigned int dce_namelen;
+};
+
 struct ISO9660_INODE_PRIVDATA {
 	uint32_t lba;
+	mutex_t mtx_dir;		/* Protects the directory cache */
+	bool dir_cached;
+	unsigned int dir_num_entries;
+	struct ISO9660_DIRCACHE_ENTRY* dir_entries;
+	char* dir_names;
 };
 
 namespace {	
@@ -152,6 +176,7 @@ iso9660_prepare_inode(struct VFS_INODE* inode)
 {
 	auto privdata = new ISO9660_INODE_PRIVDATA;
 	memset(privdata, 0, sizeof(struct ISO9660_INODE_PRIVDATA));
+	mutex_init(&privdata->mtx_dir, "isodir");
 	inode->i_privdata = privdata;
 	return ananas_success();
 }
@@ -159,127 +184,223 @@ iso9660_prepare_inode(struct VFS_INODE* inode)
 static void
 iso9660_discard_inode(struct VFS_INODE* inode)
 {
-	kfree(inode->i_privdata);
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
+	kfree(privdata->dir_entries);
+	kfree(privdata->dir_names);
+	kfree(privdata);
 }
 
+/* Storage for the directory cache while it is being constructed */
+struct ISO9660_DIRCACHE_BUILD {
+	unsigned int db_num_entries, db_max_entries;
+	struct ISO9660_DIRCACHE_ENTRY* db_entries;
+	size_t db_names_len, db_max_names;
+	char* db_names;
+};
+
+/* Makes room for another entry with a name of namelen bytes */
 static errorcode_t
-iso9660_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
+iso9660_dircache_grow(struct ISO9660_DIRCACHE_BUILD* db, unsigned int namelen)
 {
-	struct VFS_INODE* inode = file->f_dentry->d_inode;
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
-	blocknr_t block = privdata->lba + file->f_offset / fs->fs_block_size;
-	uint32_t offset = file->f_offset % fs->fs_block_size;
-	size_t written = 0, left = *len;
+	if (db->db_num_entries == db->db_max_entries) {
+		unsigned int max_entries = (db->db_max_entries > 0) ? db->db_max_entries * 2 : 32;
+		auto entries = static_cast<struct ISO9660_DIRCACHE_ENTRY*>(kmalloc(max_entries * sizeof(struct ISO9660_DIRCACHE_ENTRY)));
+		if (entries == NULL)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		memcpy(entries, db->db_entries, db->db_num_entries * sizeof(struct ISO9660_DIRCACHE_ENTRY));
+		kfree(db->db_entries);
+		db->db_entries = entries;
+		db->db_max_entries = max_entries;
+	}
+	if (db->db_names_len + namelen > db->db_max_names) {
+		size_t max_names = (db->db_max_names > 0) ? db->db_max_names * 2 : 512;
+		while (db->db_names_len + namelen > max_names)
+			max_names *= 2;
+		auto names = static_cast<char*>(kmalloc(max_names));
+		if (names == NULL)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		memcpy(names, db->db_names, db->db_names_len);
+		kfree(db->db_names);
+		db->db_names = names;
+		db->db_max_names = max_names;
+	}
+	return ananas_success();
+}
 
-	struct BIO* bio = NULL;
-	blocknr_t curblock = 0;
-	while(left > 0) {
-		if (block > privdata->lba + inode->i_sb.st_size / fs->fs_block_size) {
-			/*
-			 * We've run out of blocks. Need to stop here.
-			 */
-			break;
-		}
-		if(curblock != block) {
-			if (bio != NULL) bio_free(bio);
-			errorcode_t err = vfs_bread(fs, block, &bio);
-			ANANAS_ERROR_RETURN(err);
-			curblock = block;
+/* Adds a single directory entry stored at offset of the directory to the cache */
+static errorcode_t
+iso9660_dircache_add(struct ISO9660_DIRCACHE_BUILD* db, const struct ISO9660_DIRECTORY_ENTRY* iso9660de, uint32_t offset, ino_t inum)
+{
+	unsigned int namelen = iso9660de->de_filename_len;
+	errorcode_t err = iso9660_dircache_grow(db, namelen);
+	ANANAS_ERROR_RETURN(err);
+
+	char* name = db->db_names + db->db_names_len;
+	memcpy(name, iso9660de->de_filename, namelen);
+
+	/*
+	 * ISO9660 stores ';file ID' (;1) after each entry; we just chop it off. It
+	 * also likes to use uppercase, which we trim off here as well.
+	 */
+	if (namelen > 2) {
+		if (name[namelen - 2] == ';' && name[namelen - 1] == '1')
+			namelen -= 2;
+		for (unsigned int i = 0; i < namelen; i++) {
+			if (name[i] >= 'A' && name[i] <= 'Z')
+				name[i] += 'a' - 'A';
 		}
 
-		/*
-		 * Take the directory entry. Note that entries are not allowed to cross
-		 * multiple sectors.
-		 */
-		auto iso9660de = reinterpret_cast<struct ISO9660_DIRECTORY_ENTRY*>(static_cast<char*>(BIO_DATA(bio)) + offset);
-		if (iso9660de->de_length == 0)
+		/* If the final charachter is only a '.', kill it */
+		if (namelen > 0 && name[namelen - 1] == '.')
+			namelen--;
+	}
+
+	struct ISO9660_DIRCACHE_ENTRY* dce = &db->db_entries[db->db_num_entries++];
+	dce->dce_offset = offset;
+	dce->dce_inum = inum;
+	dce->dce_name = db->db_names_len;
+	dce->dce_namelen = namelen;
+	db->db_names_len += namelen;
+	return ananas_success();
+}
+
+/*
+ * Parses the entire directory into the directory cache; the directory extent
+ * is read ISO9660_DIR_READ_BLOCKS at a time. Must be called with mtx_dir held.
+ */
+static errorcode_t
+iso9660_dircache_build(struct VFS_INODE* inode)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
+	blocknr_t num_blocks = (inode->i_sb.st_size + fs->fs_block_size - 1) / fs->fs_block_size;
+
+	struct ISO9660_DIRCACHE_BUILD db;
+	memset(&db, 0, sizeof(db));
+	errorcode_t err = ananas_success();
+	for (blocknr_t cur = 0; cur < num_blocks && ananas_is_success(err); /* nothing */) {
+		unsigned int run = (num_blocks - cur < ISO9660_DIR_READ_BLOCKS) ? num_blocks - cur : ISO9660_DIR_READ_BLOCKS;
+		struct BIO* bios[ISO9660_DIR_READ_BLOCKS];
+		err = vfs_bread_range(fs, privdata->lba + cur, run, bios);
+		if (ananas_is_failure(err))
 			break;
 
-		/* Only process entries that must not be hidden */
-		if ((iso9660de->de_flags & DE_FLAG_HIDDEN) == 0) {
+		for (unsigned int n = 0; n < run; n++) {
+			struct BIO* bio = bios[n];
+			if (ananas_is_success(err) && BIO_IS_ERROR(bio))
+				err = ANANAS_ERROR(IO);
+
 			/*
-			 * ISO9660 stores ';file ID' (;1) after each entry; we just chop it off. It
-			 * also likes to use uppercase, which we trim off here as well.
+			 * Entries are not allowed to cross multiple sectors; the remainder of a
+			 * sector that cannot hold the next entry is zero-filled.
 			 */
-			if (iso9660de->de_filename_len > 2) {
-				if (iso9660de->de_filename[iso9660de->de_filename_len - 2] == ';' &&
-						iso9660de->de_filename[iso9660de->de_filename_len - 1] == '1')
-					iso9660de->de_filename_len -= 2;
-				for (int i = 0; i <  iso9660de->de_filename_len; i++) {
-					if (iso9660de->de_filename[i] >= 'A' && iso9660de->de_filename[i] <= 'Z')
-						iso9660de->de_filename[i] += 'a' - 'A';
+			blocknr_t block = privdata->lba + cur + n;
+			for (uint32_t offset = 0; ananas_is_success(err) && offset < fs->fs_block_size; /* nothing */) {
+				auto iso9660de = reinterpret_cast<const struct ISO9660_DIRECTORY_ENTRY*>(static_cast<char*>(BIO_DATA(bio)) + offset);
+				if (iso9660de->de_length == 0)
+					break;
+				if (offset + iso9660de->de_length > fs->fs_block_size ||
+				    iso9660de->de_length < sizeof(struct ISO9660_DIRECTORY_ENTRY) - 1 + iso9660de->de_filename_len) {
+					kprintf("iso9660: corrupt directory entry in block %u\n", (int)block);
+					err = ANANAS_ERROR(IO);
+					break;
 				}
 
-				/* If the final charachter is only a '.', kill it */
-				if (iso9660de->de_filename_len > 0 && iso9660de->de_filename[iso9660de->de_filename_len - 1] == '.')
-					iso9660de->de_filename_len--;
+				/* Only process entries that must not be hidden */
+				if ((iso9660de->de_flags & DE_FLAG_HIDDEN) == 0)
+					err = iso9660_dircache_add(&db, iso9660de, (cur + n) * fs->fs_block_size + offset, (ino_t)block << 16 | offset);
+				offset += iso9660de->de_length;
 			}
+			bio_free(bio);
+		}
+		cur += run;
+	}
+	if (ananas_is_failure(err)) {
+		kfree(db.db_entries);
+		kfree(db.db_names);
+		return err;
+	}
 
-			ino_t inum = (ino_t)curblock << 16 | offset;
-			int filled = vfs_filldirent(&dirents, &left, inum, (const char*)iso9660de->de_filename, iso9660de->de_filename_len);
-			if (!filled) {
-				/* out of space! */
-				break;
-			}
-			written += filled;
+	privdata->dir_num_entries = db.db_num_entries;
+	privdata->dir_entries = db.db_entries;
+	privdata->dir_names = db.db_names;
+	privdata->dir_cached = true;
+	return ananas_success();
+}
+
+static errorcode_t
+iso9660_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
+	size_t written = 0, left = *len;
+
+	mutex_lock(&privdata->mtx_dir);
+	if (!privdata->dir_cached) {
+		errorcode_t err = iso9660_dircache_build(inode);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&privdata->mtx_dir);
+			return err;
 		}
+	}
+
+	/* Locate the first entry at or beyond our offset; entries are sorted by offset */
+	unsigned int lo = 0, hi = privdata->dir_num_entries;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (privdata->dir_entries[mid].dce_offset < file->f_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-		/*
-		 * Update the offsets; this ensures we will read the correct block next
-		 * time.
-		 */
-		file->f_offset += iso9660de->de_length;
-		offset += iso9660de->de_length;
-		if (offset >= fs->fs_block_size) {
-			offset -= fs->fs_block_size;
-			block++;
+	for (unsigned int n = lo; n < privdata->dir_num_entries; n++) {
+		const struct ISO9660_DIRCACHE_ENTRY* dce = &privdata->dir_entries[n];
+		int filled = vfs_filldirent(&dirents, &left, dce->dce_inum, privdata->dir_names + dce->dce_name, dce->dce_namelen);
+		if (!filled) {
+			/* out of space! */
+			break;
 		}
+		written += filled;
+
+		/* Continue after this entry next time */
+		file->f_offset = dce->dce_offset + 1;
 	}
-	if (bio != NULL) bio_free(bio);
+	mutex_unlock(&privdata->mtx_dir);
+
 	*len = written;
 	return ananas_success();
 }
 
+/*
+ * Files are a single extent, so mapping them is trivial; any number of blocks
+ * can be handed out at once.
+ */
 static errorcode_t
-iso9660_read(struct VFS_FILE* file, void* buf, size_t* len)
+iso9660_block_map_range(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks)
 {
-	struct VFS_INODE* inode = file->f_dentry->d_inode;
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
-	blocknr_t blocknum = (blocknr_t)file->f_offset / fs->fs_block_size;
-	uint32_t offset = file->f_offset % fs->fs_block_size;
-	size_t numread = 0, left = *len;
-
-	/* Normalize len so that it cannot expand beyond the file size */
-	if (file->f_offset + left > inode->i_sb.st_size)
-		left = inode->i_sb.st_size - file->f_offset;
-
-	while(left > 0) {
-		/* Fetch the block */
-		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, privdata->lba + blocknum, &bio);
-		ANANAS_ERROR_RETURN(err);
-
-		/* Copy what we can so far */
-		size_t chunklen = (fs->fs_block_size < left ? fs->fs_block_size : left);
-		if (chunklen + offset > fs->fs_block_size)
-			chunklen = fs->fs_block_size - offset;
-		memcpy(buf, reinterpret_cast<void*>(static_cast<char*>(BIO_DATA(bio)) + offset), chunklen);
-		buf = reinterpret_cast<void*>(static_cast<char*>(buf) + chunklen);
-		numread += chunklen; left -= chunklen;
-		bio_free(bio);
-
-		/* Update pointers */
-		offset = (offset + chunklen) % fs->fs_block_size;
-		file->f_offset += chunklen;
-		blocknum++;
-	}
+	blocknr_t file_blocks = (inode->i_sb.st_size + fs->fs_block_size - 1) / fs->fs_block_size;
+	if (block_in >= file_blocks)
+		return ANANAS_ERROR(BAD_RANGE);
 
-	*len = numread;
+	if (*num_blocks > file_blocks - block_in)
+		*num_blocks = file_blocks - block_in;
+	*block_out = privdata->lba + block_in;
 	return ananas_success();
 }
 
+static errorcode_t
+iso9660_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create)
+{
+	if (create)
+		return ANANAS_ERROR(READ_ONLY);
+
+	unsigned int num_blocks = 1;
+	return iso9660_block_map_range(inode, block_in, block_out, &num_blocks);
+}
+
 namespace {
 struct VFS_INODE_OPS iso9660_dir_ops = {
 	.readdir = iso9660_readdir,
@@ -287,7 +408,9 @@ struct VFS_INODE_OPS iso9660_dir_ops = {
 };
 
 struct VFS_INODE_OPS iso9660_file_ops = {
-	.read = iso9660_read,
+	.block_map = iso9660_block_map,
+	.block_map_range = iso9660_block_map_range,
+	.read = vfs_generic_read
 };
 
 struct VFS_FILESYSTEM_OPS fsops_iso9660 = {
@@ -0,0 +1,497 @@
+/*
+ * tmpfs; a filesystem which only lives in memory.
+ *
+ * File data is kept in the page cache and nowhere else: the pages hooked to
+ * the inode are the only copy, so read() lends them out and mappings share
+ * them just like with any other filesystem - but nothing ever needs to be
+ * written back. Pages are created zeroed as they are first needed.
+ *
+ * Directories are lists of names. As the inode cache would throw away an
+ * unused inode along with its pages, every inode holds a reference to itself
+ * for as long as it is linked in a directory; once its final link is gone,
+ * it is up to the cache to get rid of it.
+ *
+ * The amount of pages in use is limited to 'tmpfs_size' KB, as given on the
+ * command line, or to a quarter of the memory otherwise. Pages of removed
+ * files no longer count, even if they linger until the inode is evicted.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <ananas/cmdline.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/radix.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/core.h>
+#include <ananas/vfs/generic.h>
+#include <ananas/vfs/mount.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+
+TRACE_SETUP;
+
+#define TMPFS_ROOT_INUM		1
+#define TMPFS_DEFAULT_SHARE	4	/* Without tmpfs_size, use 1/TMPFS_DEFAULT_SHARE of memory */
+
+struct TMPFS_NODE;
+
+struct TMPFS_DIRENT {
+	char* td_name;
+	struct TMPFS_NODE* td_node;
+	LIST_FIELDS(struct TMPFS_DIRENT);
+};
+
+LIST_DEFINE(TMPFS_DIRENT_LIST, struct TMPFS_DIRENT);
+
+struct TMPFS_NODE {
+	ino_t tn_inum;
+	int tn_mode;
+	bool tn_linked;				/* Holds a reference to tn_inode */
+	struct VFS_INODE* tn_inode;
+	mutex_t tn_mtx;				/* Serializes writes */
+	unsigned int tn_pages;			/* Pages counted against the limit */
+	struct TMPFS_NODE* tn_parent;		/* Directories only */
+	struct TMPFS_DIRENT_LIST tn_entries;	/* Directories only */
+};
+
+/* Per mounted filesystem; fields are protected by tm_mtx, as are all directories */
+struct TMPFS_MOUNT {
+	mutex_t tm_mtx;
+	ino_t tm_next_inum;
+	unsigned int tm_pages;			/* Pages in use */
+	unsigned int tm_max_pages;
+	struct RADIX_TREE tm_nodes;		/* By inum */
+};
+
+static inline struct TMPFS_MOUNT*
+tmpfs_get_mount(struct VFS_INODE* inode)
+{
+	return static_cast<struct TMPFS_MOUNT*>(inode->i_fs->fs_privdata);
+}
+
+static inline struct TMPFS_NODE*
+tmpfs_get_node(struct VFS_INODE* inode)
+{
+	return static_cast<struct TMPFS_NODE*>(inode->i_privdata);
+}
+
+static struct TMPFS_DIRENT*
+tmpfs_find_entry(struct TMPFS_NODE* dir, const char* name)
+{
+	LIST_FOREACH(&dir->tn_entries, td, struct TMPFS_DIRENT) {
+		if (strcmp(td->td_name, name) == 0)
+			return td;
+	}
+	return nullptr;
+}
+
+static struct TMPFS_NODE*
+tmpfs_alloc_node(struct TMPFS_MOUNT* tm, int mode, struct TMPFS_NODE* parent)
+{
+	mutex_assert(&tm->tm_mtx, MTX_LOCKED);
+
+	auto node = new TMPFS_NODE;
+	memset(node, 0, sizeof(*node));
+	node->tn_inum = tm->tm_next_inum++;
+	node->tn_mode = mode;
+	node->tn_parent = parent;
+	mutex_init(&node->tn_mtx, "tmpfsnode");
+	LIST_INIT(&node->tn_entries);
+	radix_insert(&tm->tm_nodes, node->tn_inum, node);
+	return node;
+}
+
+static void
+tmpfs_free_node(struct TMPFS_MOUNT* tm, struct TMPFS_NODE* node)
+{
+	mutex_assert(&tm->tm_mtx, MTX_LOCKED);
+
+	if (radix_lookup(&tm->tm_nodes, node->tn_inum) == node)
+		radix_remove(&tm->tm_nodes, node->tn_inum);
+	delete node;
+}
+
+static errorcode_t
+tmpfs_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(inode);
+	struct TMPFS_NODE* dir = tmpfs_get_node(inode);
+	size_t left = *len, written = 0;
+
+	/* The offset is the number of entries already read; '.' and '..' come first */
+	mutex_lock(&tm->tm_mtx);
+	struct TMPFS_NODE* parent = (dir->tn_parent != nullptr) ? dir->tn_parent : dir;
+	off_t n = 0;
+	if (file->f_offset == n) {
+		size_t filled = vfs_filldirent(&dirents, &left, dir->tn_inum, ".", 1);
+		written += filled;
+		file->f_offset += (filled > 0) ? 1 : 0;
+	}
+	n++;
+	if (file->f_offset == n) {
+		size_t filled = vfs_filldirent(&dirents, &left, parent->tn_inum, "..", 2);
+		written += filled;
+		file->f_offset += (filled > 0) ? 1 : 0;
+	}
+	n++;
+	LIST_FOREACH(&dir->tn_entries, td, struct TMPFS_DIRENT) {
+		if (n++ < file->f_offset)
+			continue;
+		size_t filled = vfs_filldirent(&dirents, &left, td->td_node->tn_inum, td->td_name, strlen(td->td_name));
+		if (filled == 0)
+			break;
+		written += filled;
+		file->f_offset++;
+	}
+	mutex_unlock(&tm->tm_mtx);
+	*len = written;
+	return ananas_success();
+}
+
+static errorcode_t
+tmpfs_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	struct VFS_INODE* dir_inode = parent->d_inode;
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(dir_inode);
+	struct TMPFS_NODE* dir = tmpfs_get_node(dir_inode);
+
+	mutex_lock(&tm->tm_mtx);
+	ino_t inum;
+	if (strcmp(dentry, "..") == 0) {
+		inum = (dir->tn_parent != nullptr) ? dir->tn_parent->tn_inum : dir->tn_inum;
+	} else {
+		struct TMPFS_DIRENT* td = tmpfs_find_entry(dir, dentry);
+		if (td == nullptr) {
+			mutex_unlock(&tm->tm_mtx);
+			return ANANAS_ERROR(NO_FILE);
+		}
+		inum = td->td_node->tn_inum;
+	}
+	mutex_unlock(&tm->tm_mtx);
+
+	/* Linked inodes are always in the cache, so this will not call read_inode */
+	return vfs_get_inode(dir_inode->i_fs, inum, destinode);
+}
+
+static errorcode_t
+tmpfs_fill_page(struct VFS_INODE* inode, off_t offset, void* page)
+{
+	/* There is nothing to read; the page is new, so it is charged against the limit */
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(inode);
+	struct TMPFS_NODE* node = tmpfs_get_node(inode);
+	mutex_lock(&tm->tm_mtx);
+	if (node->tn_linked) {
+		if (tm->tm_pages >= tm->tm_max_pages) {
+			mutex_unlock(&tm->tm_mtx);
+			return ANANAS_ERROR(NO_SPACE);
+		}
+		tm->tm_pages++;
+		node->tn_pages++;
+	}
+	inode->i_sb.st_blocks += PAGE_SIZE / 512;
+	mutex_unlock(&tm->tm_mtx);
+
+	memset(page, 0, PAGE_SIZE);
+	return ananas_success();
+}
+
+static errorcode_t
+tmpfs_write(struct VFS_FILE* file, const void* buf, size_t* len)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct TMPFS_NODE* node = tmpfs_get_node(inode);
+	size_t written = 0;
+	size_t left = *len;
+
+	errorcode_t err = ananas_success();
+	mutex_lock(&node->tn_mtx);
+	while (left > 0) {
+		off_t page_offset = ROUND_DOWN(file->f_offset, PAGE_SIZE);
+		struct VM_PAGE* vp;
+		err = vfs_pagecache_get(file->f_dentry, page_offset, &vp);
+		if (ananas_is_failure(err))
+			break;
+
+		/* Pages handed out by read() must keep their contents; give the file a copy instead */
+		if (vp->vp_flags & VM_PAGE_FLAG_LENT) {
+			vp = vmpage_unlend(inode, vp);
+			if (vp == nullptr)
+				continue; // replaced meanwhile; look it up again
+		}
+
+		/* As in vfs_generic_read(), buf may be a mapping of this very page */
+		vmpage_ref(vp);
+		vmpage_unlock(vp);
+
+		off_t cur_offset = file->f_offset - page_offset;
+		size_t chunk_len = PAGE_SIZE - cur_offset;
+		if (chunk_len > left)
+			chunk_len = left;
+		struct PAGE* p = vmpage_get_page(vp);
+		void* data = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+		memcpy(static_cast<char*>(data) + cur_offset, buf, chunk_len);
+		kmem_unmap(data, PAGE_SIZE);
+		vmpage_deref(vp);
+
+		written += chunk_len;
+		buf = static_cast<const void*>(static_cast<const char*>(buf) + chunk_len);
+		left -= chunk_len;
+		file->f_offset += chunk_len;
+		if (file->f_offset > inode->i_sb.st_size)
+			inode->i_sb.st_size = file->f_offset;
+	}
+	mutex_unlock(&node->tn_mtx);
+
+	/* Report what did fit; the next write will run into the error */
+	if (written == 0)
+		return err;
+	*len = written;
+	return ananas_success();
+}
+
+static errorcode_t
+tmpfs_create(struct VFS_INODE* dir_inode, struct DENTRY* de, int mode)
+{
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(dir_inode);
+	struct TMPFS_NODE* dir = tmpfs_get_node(dir_inode);
+	if ((mode & S_IFMT) == 0)
+		mode |= S_IFREG;
+	if (!S_ISREG(mode) && !S_ISDIR(mode))
+		return ANANAS_ERROR(UNSUPPORTED);
+
+	mutex_lock(&tm->tm_mtx);
+	if (tmpfs_find_entry(dir, de->d_entry) != nullptr) {
+		mutex_unlock(&tm->tm_mtx);
+		return ANANAS_ERROR(FILE_EXISTS);
+	}
+	struct TMPFS_NODE* node = tmpfs_alloc_node(tm, mode, S_ISDIR(mode) ? dir : nullptr);
+	auto td = new TMPFS_DIRENT;
+	td->td_name = strdup(de->d_entry);
+	td->td_node = node;
+	LIST_APPEND(&dir->tn_entries, td);
+	node->tn_linked = true;
+	mutex_unlock(&tm->tm_mtx);
+
+	/* Our reference is the one the node holds while it is linked */
+	struct VFS_INODE* inode;
+	errorcode_t err = vfs_get_inode(dir_inode->i_fs, node->tn_inum, &inode);
+	if (ananas_is_failure(err)) {
+		mutex_lock(&tm->tm_mtx);
+		LIST_REMOVE(&dir->tn_entries, td);
+		tmpfs_free_node(tm, node);
+		mutex_unlock(&tm->tm_mtx);
+		kfree(td->td_name);
+		delete td;
+		return err;
+	}
+
+	dcache_set_inode(de, inode);
+	return ananas_success();
+}
+
+static errorcode_t
+tmpfs_unlink(struct VFS_INODE* dir_inode, struct DENTRY* de)
+{
+	if (de->d_inode == NULL || de->d_flags & DENTRY_FLAG_NEGATIVE)
+		return ANANAS_ERROR(BAD_OPERATION);
+
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(dir_inode);
+	struct TMPFS_NODE* dir = tmpfs_get_node(dir_inode);
+	mutex_lock(&tm->tm_mtx);
+	struct TMPFS_DIRENT* td = tmpfs_find_entry(dir, de->d_entry);
+	if (td == nullptr) {
+		mutex_unlock(&tm->tm_mtx);
+		return ANANAS_ERROR(NO_FILE);
+	}
+	struct TMPFS_NODE* node = td->td_node;
+	if (!LIST_EMPTY(&node->tn_entries)) {
+		mutex_unlock(&tm->tm_mtx);
+		return ANANAS_ERROR(BAD_OPERATION);
+	}
+
+	/*
+	 * The inode number is gone as well; the pages are released once the inode
+	 * is evicted, which is up to whoever still has the file open.
+	 */
+	LIST_REMOVE(&dir->tn_entries, td);
+	radix_remove(&tm->tm_nodes, node->tn_inum);
+	tm->tm_pages -= node->tn_pages;
+	node->tn_pages = 0;
+	node->tn_linked = false;
+	node->tn_parent = nullptr;
+	struct VFS_INODE* inode = node->tn_inode;
+	inode->i_sb.st_nlink = 0;
+	mutex_unlock(&tm->tm_mtx);
+
+	kfree(td->td_name);
+	delete td;
+	vfs_deref_inode(inode);
+	return ananas_success();
+}
+
+static errorcode_t
+tmpfs_rename(struct VFS_INODE* old_dir_inode, struct DENTRY* old_dentry, struct VFS_INODE* new_dir_inode, struct DENTRY* new_dentry)
+{
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(old_dir_inode);
+	struct TMPFS_NODE* old_dir = tmpfs_get_node(old_dir_inode);
+	struct TMPFS_NODE* new_dir = tmpfs_get_node(new_dir_inode);
+
+	mutex_lock(&tm->tm_mtx);
+	struct TMPFS_DIRENT* td = tmpfs_find_entry(old_dir, old_dentry->d_entry);
+	errorcode_t err = ananas_success();
+	if (td == nullptr)
+		err = ANANAS_ERROR(NO_FILE);
+	else if (tmpfs_find_entry(new_dir, new_dentry->d_entry) != nullptr)
+		err = ANANAS_ERROR(FILE_EXISTS);
+	else {
+		/* A directory cannot be moved into itself */
+		for (struct TMPFS_NODE* n = new_dir; n != nullptr; n = n->tn_parent)
+			if (n == td->td_node)
+				err = ANANAS_ERROR(BAD_OPERATION);
+	}
+	if (ananas_is_failure(err)) {
+		mutex_unlock(&tm->tm_mtx);
+		return err;
+	}
+
+	char* old_name = td->td_name;
+	td->td_name = strdup(new_dentry->d_entry);
+	LIST_REMOVE(&old_dir->tn_entries, td);
+	LIST_APPEND(&new_dir->tn_entries, td);
+	if (td->td_node->tn_parent != nullptr)
+		td->td_node->tn_parent = new_dir;
+	mutex_unlock(&tm->tm_mtx);
+	kfree(old_name);
+
+	dcache_set_inode(new_dentry, old_dentry->d_inode);
+	return ananas_success();
+}
+
+static struct VFS_INODE_OPS tmpfs_file_ops = {
+	.fill_page = tmpfs_fill_page,
+	.read = vfs_generic_read,
+	.write = tmpfs_write
+};
+
+static struct VFS_INODE_OPS tmpfs_dir_ops = {
+	.readdir = tmpfs_readdir,
+	.lookup = tmpfs_lookup,
+	.create = tmpfs_create,
+	.unlink = tmpfs_unlink,
+	.rename = tmpfs_rename
+};
+
+static errorcode_t
+tmpfs_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
+{
+	fs->fs_block_size = PAGE_SIZE;
+
+	auto tm = new TMPFS_MOUNT;
+	memset(tm, 0, sizeof(*tm));
+	mutex_init(&tm->tm_mtx, "tmpfs");
+	radix_init(&tm->tm_nodes);
+	tm->tm_next_inum = TMPFS_ROOT_INUM;
+
+	const char* size_arg = cmdline_get_string("tmpfs_size");
+	if (size_arg != nullptr) {
+		tm->tm_max_pages = strtoul(size_arg, NULL, 10) * 1024 / PAGE_SIZE;
+	} else {
+		unsigned int total_pages, avail_pages;
+		page_get_stats(&total_pages, &avail_pages);
+		tm->tm_max_pages = total_pages / TMPFS_DEFAULT_SHARE;
+	}
+	fs->fs_privdata = tm;
+
+	/* The root directory is held by the root dentry, so it needs no reference of its own */
+	mutex_lock(&tm->tm_mtx);
+	tmpfs_alloc_node(tm, S_IFDIR | 01777, nullptr);
+	mutex_unlock(&tm->tm_mtx);
+	errorcode_t err = vfs_get_inode(fs, TMPFS_ROOT_INUM, root_inode);
+	if (ananas_is_failure(err)) {
+		mutex_lock(&tm->tm_mtx);
+		tmpfs_free_node(tm, static_cast<struct TMPFS_NODE*>(radix_lookup(&tm->tm_nodes, TMPFS_ROOT_INUM)));
+		mutex_unlock(&tm->tm_mtx);
+		radix_clear(&tm->tm_nodes);
+		delete tm;
+		return err;
+	}
+
+	TRACE(VFS, INFO, "tmpfs mounted, limit %u pages", tm->tm_max_pages);
+	return ananas_success();
+}
+
+static errorcode_t
+tmpfs_read_inode(struct VFS_INODE* inode, ino_t inum)
+{
+	auto tm = static_cast<struct TMPFS_MOUNT*>(inode->i_fs->fs_privdata);
+	mutex_lock(&tm->tm_mtx);
+	auto node = static_cast<struct TMPFS_NODE*>(radix_lookup(&tm->tm_nodes, inum));
+	if (node == nullptr) {
+		/* Unlinked; a stale directory entry must not bring it back */
+		mutex_unlock(&tm->tm_mtx);
+		return ANANAS_ERROR(NO_FILE);
+	}
+	node->tn_inode = inode;
+	mutex_unlock(&tm->tm_mtx);
+
+	inode->i_privdata = node;
+	inode->i_sb.st_ino    = inum;
+	inode->i_sb.st_mode   = node->tn_mode;
+	inode->i_sb.st_nlink  = S_ISDIR(node->tn_mode) ? 2 : 1;
+	inode->i_sb.st_uid    = 0;
+	inode->i_sb.st_gid    = 0;
+	inode->i_sb.st_atime  = 0; /* XXX */
+	inode->i_sb.st_mtime  = 0;
+	inode->i_sb.st_ctime  = 0;
+	inode->i_sb.st_blocks = 0;
+	inode->i_sb.st_size   = 0;
+	inode->i_iops = S_ISDIR(node->tn_mode) ? &tmpfs_dir_ops : &tmpfs_file_ops;
+	return ananas_success();
+}
+
+static void
+tmpfs_discard_inode(struct VFS_INODE* inode)
+{
+	/* Only unlinked inodes go; their pages have already been purged */
+	struct TMPFS_MOUNT* tm = tmpfs_get_mount(inode);
+	struct TMPFS_NODE* node = tmpfs_get_node(inode);
+	KASSERT(!node->tn_linked, "discarding linked tmpfs inode %p", inode);
+	mutex_lock(&tm->tm_mtx);
+	tmpfs_free_node(tm, node);
+	mutex_unlock(&tm->tm_mtx);
+}
+
+static struct VFS_FILESYSTEM_OPS fsops_tmpfs = {
+	.mount = tmpfs_mount,
+	.discard_inode = tmpfs_discard_inode,
+	.read_inode = tmpfs_read_inode
+};
+
+static struct VFS_FILESYSTEM fs_tmpfs = {
+	.fs_name = "tmpfs",
+	.fs_fsops = &fsops_tmpfs
+};
+
+errorcode_t
+tmpfs_init()
+{
+	return vfs_register_filesystem(&fs_tmpfs);
+}
+
+static errorcode_t
+tmpfs_exit()
+{
+	return vfs_unregister_filesystem(&fs_tmpfs);
+}
+
+INIT_FUNCTION(tmpfs_init, SUBSYSTEM_VFS, ORDER_MIDDLE);
+EXIT_FUNCTION(tmpfs_exit);
+
+/* vim:set ts=2 sw=2: */
@@ -200,6 +200,9 @@ kdb_enter(const char* why)
 	smp_panic_others();
 #endif
 
+	/* Write output directly, as nothing else is to run while we are here */
+	console_enter_synchronous();
+
 	/* Redirect console to ourselves */
 	Ananas::Device* old_console_tty = console_tty;
 	console_tty = NULL;
@@ -345,6 +348,7 @@ kdb_enter(const char* why)
 
 	/* Stop console redirection and restore interrupts */
 	console_tty = old_console_tty;
+	console_leave_synchronous();
 	md_interrupts_restore(ints);
 }
 
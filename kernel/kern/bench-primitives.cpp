@@ -0,0 +1,292 @@
+/*
+ * Microbenchmarks of kernel primitives; see bench.cpp for the runner.
+ */
+#include <ananas/types.h>
+#include <ananas/bench.h>
+#include <ananas/bio.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/process.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/vfs/mount.h>
+#include <ananas/vfs/types.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+#define BENCH_COPY_SIZE	65536
+
+namespace {
+
+spinlock_t bench_spl = SPINLOCK_DEFAULT_INIT;
+mutex_t bench_mtx;
+semaphore_t bench_sem;
+int bench_owner; /* CPU inside the critical section of the lock benchmarks */
+char bench_copy_src[BENCH_COPY_SIZE];
+char bench_copy_dst[BENCH_COPY_SIZE];
+
+/*
+ * The thread switch benchmark bounces between the benchmark thread and a
+ * partner thread on the same CPU; every CPU gets its own partner.
+ */
+struct BENCH_PARTNER {
+	thread_t	bp_thread;
+	semaphore_t	bp_ping;
+	semaphore_t	bp_pong;
+	bool		bp_started;
+};
+
+struct BENCH_PARTNER bench_partner[PCPU_MAX_CPUS];
+
+void
+bench_partner_func(void* context)
+{
+	auto bp = static_cast<struct BENCH_PARTNER*>(context);
+	while(1) {
+		sem_wait(&bp->bp_ping);
+		sem_signal(&bp->bp_pong);
+	}
+}
+
+errorcode_t
+bench_kmalloc(unsigned int iterations, size_t len)
+{
+	for (unsigned int n = 0; n < iterations; n++) {
+		void* p = kmalloc(len);
+		kfree(p);
+	}
+	return ananas_success();
+}
+
+/*
+ * Performs a tiny critical section, which verifies that no other CPU entered
+ * it while we were in it; this turns the lock benchmarks into stress tests.
+ */
+inline bool
+bench_critical_section(int cpu)
+{
+	__atomic_store_n(&bench_owner, cpu, __ATOMIC_RELAXED);
+	for (int n = 0; n < 8; n++)
+		md_cpu_pause();
+	return __atomic_load_n(&bench_owner, __ATOMIC_RELAXED) == cpu;
+}
+
+#ifdef OPTION_VFS
+/*
+ * The handle benchmarks need a process to hold the handles; they share one,
+ * which is created on first use and stays around.
+ */
+mutex_t bench_process_mtx;
+process_t* bench_process;
+
+errorcode_t
+bench_get_process(process_t** proc)
+{
+	mutex_lock(&bench_process_mtx);
+	errorcode_t err = ananas_success();
+	if (bench_process == nullptr)
+		err = process_alloc(nullptr, &bench_process);
+	*proc = bench_process;
+	mutex_unlock(&bench_process_mtx);
+	return err;
+}
+#endif
+
+} // unnamed namespace
+
+BENCHMARK(spinlock, 0, 0, 1000000, "Lock and unlock a spinlock shared by all CPUs")
+{
+	for (unsigned int n = 0; n < iterations; n++) {
+		spinlock_lock(&bench_spl);
+		spinlock_unlock(&bench_spl);
+	}
+	return ananas_success();
+}
+
+BENCHMARK(spinlock_verify, 0, 0, 1000000, "Like spinlock, but verify mutual exclusion in a short critical section")
+{
+	int cpu = PCPU_GET(cpuid);
+	for (unsigned int n = 0; n < iterations; n++) {
+		spinlock_lock(&bench_spl);
+		bool ok = bench_critical_section(cpu);
+		spinlock_unlock(&bench_spl);
+		if (!ok)
+			return ANANAS_ERROR(UNKNOWN);
+	}
+	return ananas_success();
+}
+
+BENCHMARK(mutex, BENCH_FLAG_SLEEPS, 0, 100000, "Lock and unlock a mutex shared by all CPUs, verifying mutual exclusion")
+{
+	int cpu = PCPU_GET(cpuid);
+	for (unsigned int n = 0; n < iterations; n++) {
+		mutex_lock(&bench_mtx);
+		bool ok = bench_critical_section(cpu);
+		mutex_unlock(&bench_mtx);
+		if (!ok)
+			return ANANAS_ERROR(UNKNOWN);
+	}
+	return ananas_success();
+}
+
+BENCHMARK(semaphore, BENCH_FLAG_SLEEPS, 0, 100000, "Wait for and signal a semaphore shared by all CPUs, verifying mutual exclusion")
+{
+	int cpu = PCPU_GET(cpuid);
+	for (unsigned int n = 0; n < iterations; n++) {
+		sem_wait(&bench_sem);
+		bool ok = bench_critical_section(cpu);
+		sem_signal(&bench_sem);
+		if (!ok)
+			return ANANAS_ERROR(UNKNOWN);
+	}
+	return ananas_success();
+}
+
+BENCHMARK(page_alloc, 0, 0, 100000, "Allocate and free a single page")
+{
+	for (unsigned int n = 0; n < iterations; n++) {
+		struct PAGE* p = page_alloc_order(0);
+		if (p == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		page_free(p);
+	}
+	return ananas_success();
+}
+
+BENCHMARK(page_alloc_order4, 0, 0, 10000, "Allocate and free 16 contiguous pages")
+{
+	for (unsigned int n = 0; n < iterations; n++) {
+		struct PAGE* p = page_alloc_order(4);
+		if (p == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		page_free(p);
+	}
+	return ananas_success();
+}
+
+/* kmalloc() has no size classes of its own, so we try a few typical sizes */
+BENCHMARK(kmalloc_32, BENCH_FLAG_SLEEPS, 0, 100000, "kmalloc() and kfree() 32 bytes")
+{
+	return bench_kmalloc(iterations, 32);
+}
+
+BENCHMARK(kmalloc_256, BENCH_FLAG_SLEEPS, 0, 100000, "kmalloc() and kfree() 256 bytes")
+{
+	return bench_kmalloc(iterations, 256);
+}
+
+BENCHMARK(kmalloc_4096, BENCH_FLAG_SLEEPS, 0, 100000, "kmalloc() and kfree() 4096 bytes")
+{
+	return bench_kmalloc(iterations, 4096);
+}
+
+BENCHMARK(memcpy, 0, BENCH_COPY_SIZE, 10000, "Copy 64KB")
+{
+	for (unsigned int n = 0; n < iterations; n++)
+		memcpy(bench_copy_dst, bench_copy_src, BENCH_COPY_SIZE);
+	return ananas_success();
+}
+
+BENCHMARK(thread_switch, BENCH_FLAG_SLEEPS, 0, 100000, "Bounce between two threads on a CPU (two switches each)")
+{
+	struct BENCH_PARTNER* bp = &bench_partner[PCPU_GET(cpuid)];
+	if (!bp->bp_started) {
+		sem_init(&bp->bp_ping, 0);
+		sem_init(&bp->bp_pong, 0);
+		kthread_init(&bp->bp_thread, "bench:partner", &bench_partner_func, bp);
+		bp->bp_thread.t_affinity = THREAD_AFFINITY_CPU(PCPU_GET(cpuid));
+		thread_resume(&bp->bp_thread);
+		bp->bp_started = true;
+	}
+
+	for (unsigned int n = 0; n < iterations; n++) {
+		sem_signal(&bp->bp_ping);
+		sem_wait(&bp->bp_pong);
+	}
+	return ananas_success();
+}
+
+#ifdef OPTION_VFS
+BENCHMARK(handle_alloc, BENCH_FLAG_SLEEPS, 0, 100000, "Allocate and free a handle in a process shared by all CPUs")
+{
+	process_t* proc;
+	errorcode_t err = bench_get_process(&proc);
+	ANANAS_ERROR_RETURN(err);
+
+	for (unsigned int n = 0; n < iterations; n++) {
+		struct HANDLE* handle;
+		handleindex_t index;
+		err = handle_alloc(HANDLE_TYPE_FILE, proc, 0, &handle, &index);
+		ANANAS_ERROR_RETURN(err);
+		err = handle_free(handle);
+		ANANAS_ERROR_RETURN(err);
+	}
+	return ananas_success();
+}
+
+BENCHMARK(handle_lookup, BENCH_FLAG_SLEEPS, 0, 1000000, "Look up a handle in a process shared by all CPUs")
+{
+	process_t* proc;
+	errorcode_t err = bench_get_process(&proc);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Every CPU looks up a handle of its own, so only the table is shared */
+	struct HANDLE* handle;
+	handleindex_t index;
+	err = handle_alloc(HANDLE_TYPE_FILE, proc, 0, &handle, &index);
+	ANANAS_ERROR_RETURN(err);
+
+	for (unsigned int n = 0; ananas_is_success(err) && n < iterations; n++) {
+		struct HANDLE* h;
+		err = handle_lookup(proc, index, HANDLE_TYPE_FILE, &h);
+		if (ananas_is_success(err))
+			handle_deref(h);
+	}
+	handle_free(handle);
+	return err;
+}
+#endif
+
+#ifdef OPTION_BIO
+BENCHMARK(bio_get, BENCH_FLAG_SLEEPS, 0, 100000, "Look up a cached block of the root filesystem")
+{
+	struct VFS_MOUNTED_FS* fs = vfs_get_rootfs();
+	if (fs == nullptr || fs->fs_device == nullptr)
+		return ANANAS_ERROR(NO_DEVICE);
+
+	/* Make sure the block is cached; from then on, every lookup is a hit */
+	struct BIO* bio = bio_read(fs->fs_device, 0, fs->fs_block_size);
+	if (BIO_IS_ERROR(bio)) {
+		bio_free(bio);
+		return ANANAS_ERROR(IO);
+	}
+	bio_free(bio);
+
+	for (unsigned int n = 0; n < iterations; n++) {
+		bio = bio_read(fs->fs_device, 0, fs->fs_block_size);
+		bio_free(bio);
+	}
+	return ananas_success();
+}
+#endif
+
+static errorcode_t
+bench_primitives_init()
+{
+	mutex_init(&bench_mtx, "bench");
+	sem_init(&bench_sem, 1);
+#ifdef OPTION_VFS
+	mutex_init(&bench_process_mtx, "benchproc");
+#endif
+	return ananas_success();
+}
+
+INIT_FUNCTION(bench_primitives_init, SUBSYSTEM_KDB, ORDER_FIRST);
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,231 @@
+/*
+ * VFS workload benchmarks; see bench.cpp for the runner. These replay typical
+ * filesystem use within the directory given by 'bench_vfs=path' on the
+ * commandline (BENCH_VFS_DEFAULT_DIR if not given), which should hold:
+ *
+ * - 'large', a file of a few megabytes for the read benchmarks;
+ * - 'many', a directory with a few hundred entries to list;
+ * - 'd/d/d/d/d/d/d/d/file', for the lookups.
+ *
+ * doc/scripts/make-bench-images.sh creates ext2, FAT and cramfs images with
+ * this content. Creating files needs a writable filesystem; the benchmark
+ * fails on others. Besides the time taken, every benchmark reports the block
+ * I/O its run caused, so boot with 'ramdisk_latency' and the image on a
+ * ramdisk to see how the caches cope with a slow device.
+ */
+#include <ananas/types.h>
+#include <ananas/bench.h>
+#include <ananas/bio.h>
+#include <ananas/cmdline.h>
+#include <ananas/error.h>
+#include <ananas/lib.h>
+#include <ananas/mm.h>
+#include <ananas/pcpu.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/dentry.h>
+#include <ananas/vfs/types.h>
+#include "options.h"
+
+#if defined(OPTION_VFS) && defined(OPTION_BIO)
+
+#define BENCH_VFS_DEFAULT_DIR	"/bench"
+#define BENCH_VFS_LARGE		"large"
+#define BENCH_VFS_MANY		"many"
+#define BENCH_VFS_DEEP		"d/d/d/d/d/d/d/d/file"
+
+#define BENCH_VFS_SEQ_CHUNK	65536
+#define BENCH_VFS_RANDOM_CHUNK	4096
+#define BENCH_VFS_SMALL_FILE	512
+
+namespace {
+
+/* Block I/O statistics of the device, before and after the most recent run */
+Ananas::Device* bench_vfs_device;
+struct BIO_STATS bench_vfs_before;
+struct BIO_STATS bench_vfs_after;
+unsigned int bench_vfs_active;
+
+const char*
+bench_vfs_dir()
+{
+	const char* dir = cmdline_get_string("bench_vfs");
+	return dir != nullptr ? dir : BENCH_VFS_DEFAULT_DIR;
+}
+
+errorcode_t
+bench_vfs_open(const char* path, struct VFS_FILE* file)
+{
+	char fullpath[128];
+	snprintf(fullpath, sizeof(fullpath), "%s/%s", bench_vfs_dir(), path);
+	return vfs_open(fullpath, nullptr, file);
+}
+
+/*
+ * Opens the path for the benchmark run; the first CPU to start records the
+ * statistics of the device the file lives on.
+ */
+errorcode_t
+bench_vfs_begin(const char* path, struct VFS_FILE* file)
+{
+	errorcode_t err = bench_vfs_open(path, file);
+	ANANAS_ERROR_RETURN(err);
+
+	if (__atomic_fetch_add(&bench_vfs_active, 1, __ATOMIC_ACQ_REL) == 0) {
+		bench_vfs_device = file->f_dentry->d_inode->i_fs->fs_device;
+		memset(&bench_vfs_before, 0, sizeof(bench_vfs_before));
+		if (bench_vfs_device != nullptr)
+			bio_queue_get_stats(bench_vfs_device, &bench_vfs_before);
+	}
+	return ananas_success();
+}
+
+/* Closes the file; the last CPU to finish records the statistics again */
+void
+bench_vfs_end(struct VFS_FILE* file)
+{
+	vfs_close(file);
+
+	if (__atomic_sub_fetch(&bench_vfs_active, 1, __ATOMIC_ACQ_REL) == 0) {
+		memcpy(&bench_vfs_after, &bench_vfs_before, sizeof(bench_vfs_after));
+		if (bench_vfs_device != nullptr)
+			bio_queue_get_stats(bench_vfs_device, &bench_vfs_after);
+	}
+}
+
+void
+bench_vfs_report(char* buf, size_t len)
+{
+	const struct BIO_STATS& a = bench_vfs_after;
+	const struct BIO_STATS& b = bench_vfs_before;
+	snprintf(buf, len, "block i/o: %u reads (%u KB), %u writes (%u KB), %u cache hits, %u misses\n",
+	 (unsigned int)(a.bs_requests[0] - b.bs_requests[0]), (unsigned int)((a.bs_bytes[0] - b.bs_bytes[0]) / 1024),
+	 (unsigned int)(a.bs_requests[1] - b.bs_requests[1]), (unsigned int)((a.bs_bytes[1] - b.bs_bytes[1]) / 1024),
+	 (unsigned int)(a.bs_cache_hits - b.bs_cache_hits), (unsigned int)(a.bs_cache_misses - b.bs_cache_misses));
+}
+
+} // unnamed namespace
+
+BENCHMARK_REPORTING(vfs_read_seq, BENCH_FLAG_SLEEPS, BENCH_VFS_SEQ_CHUNK, 1024, "Read 'large' sequentially, 64KB at a time", &bench_vfs_report)
+{
+	struct VFS_FILE file;
+	errorcode_t err = bench_vfs_begin(BENCH_VFS_LARGE, &file);
+	ANANAS_ERROR_RETURN(err);
+
+	auto buf = static_cast<char*>(kmalloc(BENCH_VFS_SEQ_CHUNK));
+	for (unsigned int n = 0; ananas_is_success(err) && n < iterations; n++) {
+		size_t len = BENCH_VFS_SEQ_CHUNK;
+		err = vfs_read(&file, buf, &len);
+		if (ananas_is_success(err) && len < BENCH_VFS_SEQ_CHUNK)
+			err = vfs_seek(&file, 0); /* start over once we hit the end */
+	}
+	kfree(buf);
+	bench_vfs_end(&file);
+	return err;
+}
+
+BENCHMARK_REPORTING(vfs_read_random, BENCH_FLAG_SLEEPS, BENCH_VFS_RANDOM_CHUNK, 10000, "Read 4KB of 'large' at random offsets", &bench_vfs_report)
+{
+	struct VFS_FILE file;
+	errorcode_t err = bench_vfs_begin(BENCH_VFS_LARGE, &file);
+	ANANAS_ERROR_RETURN(err);
+
+	auto buf = static_cast<char*>(kmalloc(BENCH_VFS_SEQ_CHUNK));
+	unsigned int num_chunks = file.f_dentry->d_inode->i_sb.st_size / BENCH_VFS_RANDOM_CHUNK;
+	uint32_t seed = 0x12345678 + PCPU_GET(cpuid);
+	for (unsigned int n = 0; ananas_is_success(err) && num_chunks > 0 && n < iterations; n++) {
+		seed = seed * 1103515245 + 12345;
+		err = vfs_seek(&file, (off_t)((seed >> 8) % num_chunks) * BENCH_VFS_RANDOM_CHUNK);
+		if (ananas_is_failure(err))
+			break;
+		size_t len = BENCH_VFS_RANDOM_CHUNK;
+		err = vfs_read(&file, buf, &len);
+	}
+	kfree(buf);
+	bench_vfs_end(&file);
+	return err;
+}
+
+BENCHMARK_REPORTING(vfs_create_unlink, BENCH_FLAG_SLEEPS, 0, 500, "Create small files, then remove them all", &bench_vfs_report)
+{
+	struct VFS_FILE dir;
+	errorcode_t err = bench_vfs_begin(".", &dir);
+	ANANAS_ERROR_RETURN(err);
+
+	int cpu = PCPU_GET(cpuid);
+	auto buf = static_cast<char*>(kmalloc(BENCH_VFS_SEQ_CHUNK));
+	memset(buf, 0x5a, BENCH_VFS_SMALL_FILE);
+	char name[32];
+	unsigned int num_created = 0;
+	for (/* nothing */; num_created < iterations; num_created++) {
+		struct VFS_FILE file;
+		snprintf(name, sizeof(name), "bench.%u.%u", cpu, num_created);
+		err = vfs_create(dir.f_dentry, &file, name, 0644);
+		if (ananas_is_failure(err))
+			break;
+		size_t len = BENCH_VFS_SMALL_FILE;
+		err = vfs_write(&file, buf, &len);
+		vfs_close(&file);
+		if (ananas_is_failure(err))
+			break;
+	}
+
+	/* Remove whatever we created, even if we failed halfway */
+	for (unsigned int n = 0; n < num_created; n++) {
+		struct VFS_FILE file;
+		snprintf(name, sizeof(name), "bench.%u.%u", cpu, n);
+		errorcode_t err2 = bench_vfs_open(name, &file);
+		if (ananas_is_success(err2)) {
+			err2 = vfs_unlink(&file);
+			vfs_close(&file);
+		}
+		if (ananas_is_success(err))
+			err = err2;
+	}
+	kfree(buf);
+	bench_vfs_end(&dir);
+	return err;
+}
+
+BENCHMARK_REPORTING(vfs_lookup_deep, BENCH_FLAG_SLEEPS, 0, 100000, "Look up a path nine levels deep", &bench_vfs_report)
+{
+	struct VFS_FILE dir;
+	errorcode_t err = bench_vfs_begin(".", &dir);
+	ANANAS_ERROR_RETURN(err);
+
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", bench_vfs_dir(), BENCH_VFS_DEEP);
+	for (unsigned int n = 0; n < iterations; n++) {
+		struct DENTRY* dentry;
+		err = vfs_lookup(nullptr, &dentry, path);
+		if (ananas_is_failure(err))
+			break;
+		dentry_deref(dentry);
+	}
+	bench_vfs_end(&dir);
+	return err;
+}
+
+BENCHMARK_REPORTING(vfs_readdir, BENCH_FLAG_SLEEPS, 0, 1000, "List all entries of 'many'", &bench_vfs_report)
+{
+	struct VFS_FILE dir;
+	errorcode_t err = bench_vfs_begin(BENCH_VFS_MANY, &dir);
+	ANANAS_ERROR_RETURN(err);
+
+	auto buf = static_cast<char*>(kmalloc(BENCH_VFS_SEQ_CHUNK));
+	for (unsigned int n = 0; ananas_is_success(err) && n < iterations; n++) {
+		err = vfs_seek(&dir, 0);
+		while (ananas_is_success(err)) {
+			size_t len = BENCH_VFS_SEQ_CHUNK;
+			err = vfs_read(&dir, buf, &len);
+			if (len == 0)
+				break;
+		}
+	}
+	kfree(buf);
+	bench_vfs_end(&dir);
+	return err;
+}
+
+#endif /* OPTION_VFS && OPTION_BIO */
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,323 @@
+/*
+ * Runner for the in-kernel microbenchmarks. Runs on several CPUs are done by
+ * a worker thread per CPU, which are created once they are first needed; a
+ * barrier ensures they all start at the same time. Only a single run can be
+ * in progress at any time.
+ *
+ * As every CPU performs the same number of iterations, the spread between
+ * their finishing times shows how fairly a contended resource is shared; we
+ * summarize it using Jain's fairness index over the per-CPU throughput, which
+ * is 1 if all CPUs were served equally and 1/n if a single one got it all.
+ */
+#include <ananas/types.h>
+#include <ananas/bench.h>
+#include <ananas/error.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+LIST_DEFINE(BENCHMARKS, struct BENCHMARK);
+
+namespace {
+
+struct BENCH_WORKER {
+	thread_t	bw_thread;
+	semaphore_t	bw_start;
+	errorcode_t	bw_result;
+	uint64_t	bw_ns;
+};
+
+struct BENCHMARKS bench_list_all;
+struct BENCH_WORKER bench_worker[PCPU_MAX_CPUS];
+bool bench_workers_started;
+
+mutex_t bench_mtx; /* Serializes runs; protects everything below */
+semaphore_t bench_done;
+struct BENCHMARK* bench_current;
+unsigned int bench_iterations;
+unsigned int bench_num_cpus;
+unsigned int bench_arrived;
+
+void
+bench_worker_func(void* context)
+{
+	auto bw = static_cast<struct BENCH_WORKER*>(context);
+	while(1) {
+		sem_wait(&bw->bw_start);
+
+		/* Wait until every CPU is here, so that they all start at once */
+		__atomic_add_fetch(&bench_arrived, 1, __ATOMIC_ACQ_REL);
+		while (__atomic_load_n(&bench_arrived, __ATOMIC_ACQUIRE) < bench_num_cpus)
+			md_cpu_pause();
+
+		uint64_t start = md_timer_get_ns();
+		bw->bw_result = bench_current->b_func(bench_iterations);
+		bw->bw_ns = md_timer_get_ns() - start;
+		sem_signal(&bench_done);
+	}
+}
+
+void
+bench_start_workers()
+{
+	for (unsigned int cpu = 0; cpu < pcpu_get_count(); cpu++) {
+		auto& bw = bench_worker[cpu];
+		sem_init(&bw.bw_start, 0);
+
+		char name[32];
+		snprintf(name, sizeof(name), "bench:cpu%u", cpu);
+		kthread_init(&bw.bw_thread, name, &bench_worker_func, &bw);
+		bw.bw_thread.t_affinity = THREAD_AFFINITY_CPU(cpu);
+		thread_resume(&bw.bw_thread);
+	}
+	bench_workers_started = true;
+}
+
+void
+bench_format(char* buf, size_t len, const char* what, const struct BENCHMARK* b, uint64_t iterations, uint64_t ns)
+{
+	if (ns == 0)
+		ns = 1;
+	uint64_t ps = (ns * 1000) / iterations;
+	snprintf(buf, len, "%s: %u iterations in %u us, %u.%03u ns each", what,
+	 (unsigned int)iterations, (unsigned int)(ns / 1000), (unsigned int)(ps / 1000), (unsigned int)(ps % 1000));
+	if (b->b_bytes > 0) {
+		size_t used = strlen(buf);
+		snprintf(buf + used, len - used, ", %u MB/s", (unsigned int)((b->b_bytes * iterations * 1000) / ns));
+	}
+	size_t used = strlen(buf);
+	snprintf(buf + used, len - used, "\n");
+}
+
+/* Appends whatever else the benchmark has to say about its run */
+void
+bench_report(char* buf, size_t len, const struct BENCHMARK* b)
+{
+	if (b->b_report == nullptr)
+		return;
+	size_t used = strlen(buf);
+	b->b_report(buf + used, len - used);
+}
+
+/* Runs the benchmark on the calling thread */
+errorcode_t
+bench_run_local(struct BENCHMARK* b, unsigned int iterations, char* buf, size_t len)
+{
+	if (iterations == 0)
+		iterations = b->b_iterations;
+	uint64_t start = md_timer_get_ns();
+	errorcode_t err = b->b_func(iterations);
+	uint64_t ns = md_timer_get_ns() - start;
+	ANANAS_ERROR_RETURN(err);
+	bench_format(buf, len, b->b_name, b, iterations, ns);
+	bench_report(buf, len, b);
+	return ananas_success();
+}
+
+/*
+ * Runs the benchmark on the first num_cpus CPUs at once; the outcome of every
+ * CPU ends up in its worker. Must be called with bench_mtx held.
+ */
+errorcode_t
+bench_run_workers(struct BENCHMARK* b, unsigned int iterations, unsigned int num_cpus)
+{
+	if (!bench_workers_started)
+		bench_start_workers();
+
+	bench_current = b;
+	bench_iterations = iterations;
+	bench_num_cpus = num_cpus;
+	bench_arrived = 0;
+	for (unsigned int cpu = 0; cpu < num_cpus; cpu++)
+		sem_signal(&bench_worker[cpu].bw_start);
+	for (unsigned int cpu = 0; cpu < num_cpus; cpu++)
+		sem_wait(&bench_done);
+
+	errorcode_t err = ananas_success();
+	for (unsigned int cpu = 0; cpu < num_cpus; cpu++) {
+		if (ananas_is_failure(bench_worker[cpu].bw_result))
+			err = bench_worker[cpu].bw_result;
+	}
+	return err;
+}
+
+struct BENCH_SUMMARY {
+	uint64_t	bs_max_ns;	/* Time taken by the slowest CPU */
+	unsigned int	bs_fairness;	/* Jain's fairness index, in thousandths */
+	unsigned int	bs_spread;	/* Slowest time / fastest time, in hundredths */
+};
+
+/* Summarizes the most recent run of the workers */
+void
+bench_summarize(unsigned int num_cpus, struct BENCH_SUMMARY* bs)
+{
+	uint64_t min_ns = ~(uint64_t)0;
+	bs->bs_max_ns = 0;
+	for (unsigned int cpu = 0; cpu < num_cpus; cpu++) {
+		uint64_t ns = bench_worker[cpu].bw_ns + 1;
+		if (ns < min_ns)
+			min_ns = ns;
+		if (ns > bs->bs_max_ns)
+			bs->bs_max_ns = ns;
+	}
+
+	/*
+	 * Every CPU did the same work, so its throughput is proportional to 1/ns;
+	 * we use it relative to the fastest CPU so the sums cannot overflow.
+	 */
+	uint64_t sum = 0, sum_sq = 0;
+	for (unsigned int cpu = 0; cpu < num_cpus; cpu++) {
+		uint64_t x = (min_ns * 1000) / (bench_worker[cpu].bw_ns + 1);
+		sum += x;
+		sum_sq += x * x;
+	}
+	bs->bs_fairness = (sum_sq > 0) ? (unsigned int)((sum * sum * 1000) / (num_cpus * sum_sq)) : 1000;
+	bs->bs_spread = (unsigned int)((bs->bs_max_ns * 100) / min_ns);
+}
+
+} // unnamed namespace
+
+errorcode_t
+bench_register(struct BENCHMARK* b)
+{
+	LIST_APPEND(&bench_list_all, b);
+	return ananas_success();
+}
+
+struct BENCHMARK*
+bench_find(const char* name)
+{
+	LIST_FOREACH(&bench_list_all, b, struct BENCHMARK) {
+		if (strcmp(b->b_name, name) == 0)
+			return b;
+	}
+	return nullptr;
+}
+
+void
+bench_list(char* buf, size_t len)
+{
+	char* r = buf;
+	*r = '\0';
+	LIST_FOREACH(&bench_list_all, b, struct BENCHMARK) {
+		snprintf(r, len - (r - buf), "%s%s: %s\n", b->b_name, (b->b_flags & BENCH_FLAG_SLEEPS) ? " (sleeps)" : "", b->b_help);
+		r += strlen(r);
+	}
+}
+
+errorcode_t
+bench_run(struct BENCHMARK* b, unsigned int iterations, unsigned int num_cpus, char* buf, size_t len)
+{
+	if (iterations == 0)
+		iterations = b->b_iterations;
+	if (num_cpus == 0 || num_cpus > pcpu_get_count())
+		return ANANAS_ERROR(BAD_RANGE);
+
+	mutex_lock(&bench_mtx);
+	if (num_cpus == 1) {
+		errorcode_t err = bench_run_local(b, iterations, buf, len);
+		mutex_unlock(&bench_mtx);
+		return err;
+	}
+
+	errorcode_t err = bench_run_workers(b, iterations, num_cpus);
+
+	/* Report every CPU, and the combined throughput (which is limited by the slowest CPU) */
+	char* r = buf;
+	*r = '\0';
+	for (unsigned int cpu = 0; cpu < num_cpus; cpu++) {
+		char what[16];
+		snprintf(what, sizeof(what), "cpu%u", cpu);
+		bench_format(r, len - (r - buf), what, b, iterations, bench_worker[cpu].bw_ns);
+		r += strlen(r);
+	}
+	struct BENCH_SUMMARY bs;
+	bench_summarize(num_cpus, &bs);
+	bench_format(r, len - (r - buf), "total", b, (uint64_t)iterations * num_cpus, bs.bs_max_ns);
+	r += strlen(r);
+	snprintf(r, len - (r - buf), "fairness: index %u.%03u, slowest cpu took %u.%02u times as long as the fastest\n",
+	 bs.bs_fairness / 1000, bs.bs_fairness % 1000, bs.bs_spread / 100, bs.bs_spread % 100);
+	bench_report(buf, len, b);
+	mutex_unlock(&bench_mtx);
+	return err;
+}
+
+errorcode_t
+bench_scale(struct BENCHMARK* b, unsigned int iterations, char* buf, size_t len)
+{
+	if (iterations == 0)
+		iterations = b->b_iterations;
+
+	mutex_lock(&bench_mtx);
+	errorcode_t err = ananas_success();
+	uint64_t base_rate = 0;
+	char* r = buf;
+	*r = '\0';
+	snprintf(r, len, "cpus     ops/s  speedup  fairness  spread\n");
+	r += strlen(r);
+	for (unsigned int num_cpus = 1; ananas_is_success(err) && num_cpus <= pcpu_get_count(); num_cpus++) {
+		err = bench_run_workers(b, iterations, num_cpus);
+
+		struct BENCH_SUMMARY bs;
+		bench_summarize(num_cpus, &bs);
+		uint64_t rate = ((uint64_t)iterations * num_cpus * 1000000) / (bs.bs_max_ns / 1000 + 1);
+		if (num_cpus == 1)
+			base_rate = rate;
+		unsigned int speedup = (unsigned int)((rate * 100) / (base_rate + 1));
+		snprintf(r, len - (r - buf), "%4u %9u %5u.%02u %5u.%03u %4u.%02u\n",
+		 num_cpus, (unsigned int)rate, speedup / 100, speedup % 100,
+		 bs.bs_fairness / 1000, bs.bs_fairness % 1000, bs.bs_spread / 100, bs.bs_spread % 100);
+		r += strlen(r);
+	}
+	mutex_unlock(&bench_mtx);
+	return err;
+}
+
+static errorcode_t
+bench_init()
+{
+	mutex_init(&bench_mtx, "bench");
+	sem_init(&bench_done, 0);
+	return ananas_success();
+}
+
+INIT_FUNCTION(bench_init, SUBSYSTEM_KDB, ORDER_FIRST);
+
+#ifdef OPTION_KDB
+KDB_COMMAND(bench, "[s:name] [i:iterations]", "Runs a benchmark on this CPU, or lists them")
+{
+	static char buf[4096];
+	if (num_args == 1) {
+		bench_list(buf, sizeof(buf));
+		kprintf("%s", buf);
+		return;
+	}
+
+	/* Other CPUs are stopped and we cannot switch threads, so only a single CPU is supported */
+	struct BENCHMARK* b = bench_find(arg[1].a_u.u_string);
+	if (b == nullptr) {
+		kprintf("no such benchmark\n");
+		return;
+	}
+	if (b->b_flags & BENCH_FLAG_SLEEPS) {
+		kprintf("benchmark may sleep; run it using /ankh/trace/bench instead\n");
+		return;
+	}
+
+	errorcode_t err = bench_run_local(b, (num_args > 2) ? arg[2].a_u.u_value : 0, buf, sizeof(buf));
+	if (ananas_is_failure(err)) {
+		kprintf("benchmark failed, error %u\n", ANANAS_ERROR_CODE(err));
+		return;
+	}
+	kprintf("%s", buf);
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
@@ -1,172 +1,544 @@
+/*
+ * Block I/O buffer cache. Buffers are hashed on their device and block number;
+ * their data is carved from pages taken from the page allocator, which are
+ * shared by buffers of the same size.
+ *
+ * The cache grows as long as there is plenty of free memory; beyond that, it
+ * recycles its least recently used buffers instead. Should the page allocator
+ * run out of memory, it will ask us to give back any clean buffers which are
+ * not in use.
+ *
+ * Replacement is 2Q-like, so that a large sequential read cannot push out
+ * frequently used blocks such as metadata. Buffers start out on the probation
+ * list, and only move to the protected list once they are used again; victims
+ * are taken from the probation list first. Both lists are in least recently
+ * used order, and the protected list may hold at most BIO_PROTECTED_SHARE of
+ * all buffers. Readahead does not count as use.
+ *
+ * Writes are delayed: dirty buffers are queued, oldest first, and written
+ * back by the 'bioflush' thread once the system is otherwise idle. As a busy
+ * system may never be idle, the 'bioexpire' thread writes back whatever has
+ * been queued for longer than bio_dirty_age_ms. Anyone dirtying buffers while
+ * too many are queued has to help write them back, as does anyone needing
+ * memory while only dirty buffers remain; bio_sync() is the barrier which
+ * forces them all out, and bio_commit() also makes sure the device does not
+ * keep them in its cache.
+ */
 #include <ananas/mm.h>
 #include <ananas/bio.h>
 #include <ananas/error.h>
+#include <ananas/hashtable.h>
+#include <ananas/init.h>
 #include <ananas/kdb.h>
+#include <ananas/kmem.h>
 #include <ananas/lib.h>
 #include <ananas/lock.h>
+#include <ananas/page.h>
 #include <ananas/pcpu.h>
 #include <ananas/schedule.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
+#include <ananas/tunable.h>
+#include <ananas/vm.h>
 #include "options.h"
 
 TRACE_SETUP;
 
-LIST_DEFINE_BEGIN(BIO_BUCKET, struct BIO)
-	spinlock_t spl_bucket;
-LIST_DEFINE_END
+#define BIO_NUM_SIZES		4	/* Data slot sizes: BIO_SECTOR_SIZE .. PAGE_SIZE */
+#define BIO_MIN_HASH_BITS	6	/* Initial hash table size, in bits */
+#define BIO_MAX_HASH_BITS	20
+#define BIO_HASH_LOAD		2	/* Grow the hash table beyond this many buffers per bucket */
+#define BIO_FLUSH_BATCH		32	/* Number of buffers written back at once */
+#define BIO_EXPIRE_CHECKS	4	/* Times per bio_dirty_age_ms we look for expired buffers */
+#define BIO_PROTECTED_SHARE(n)	((n) * 3 / 4)	/* Maximum number of protected buffers */
+
+/* Replacement lists */
+#define BIO_LRU_PROBATION	0
+#define BIO_LRU_PROTECTED	1
+#define BIO_LRU_NUM		2
+
+/* A page holding the data of one or more buffers, all of the same size */
+struct BIO_PAGE {
+	struct PAGE* bp_page;
+	char* bp_data;
+	unsigned int bp_size;		/* Size class; slots are BIO_SECTOR_SIZE << bp_size bytes */
+	unsigned int bp_used;		/* Bitmap of slots in use */
+	LIST_FIELDS(struct BIO_PAGE);
+};
+
+LIST_DEFINE(BIO_BUCKET, struct BIO);
 LIST_DEFINE(BIO_CHAIN, struct BIO);
+LIST_DEFINE(BIO_DIRTY_LIST, struct BIO);
+LIST_DEFINE(BIO_PAGE_LIST, struct BIO_PAGE);
+
+static SLAB_CACHE_DEFINE(bio_cache, struct BIO, NULL);
+static SLAB_CACHE_DEFINE(bio_page_cache, struct BIO_PAGE, NULL);
+
+static spinlock_t spl_bio = SPINLOCK_DEFAULT_INIT; /* Protects everything below */
+static struct BIO_CHAIN bio_lru[BIO_LRU_NUM];	/* Cached buffers, most recently used first */
+static unsigned int bio_num_lru[BIO_LRU_NUM];
+static struct BIO_BUCKET* bio_bucket;
+static unsigned int bio_hash_bits;	/* Hash table has 2^bio_hash_bits buckets */
+static struct BIO_PAGE_LIST bio_partial[BIO_NUM_SIZES];	/* Data pages with free slots */
+static unsigned int bio_num_bios;
+static unsigned int bio_num_pages;
+static struct BIO_DIRTY_LIST bio_dirtylist;	/* Buffers to write back, oldest first */
+static unsigned int bio_num_dirty;
+static bool bio_flush_wakeup;
+
+static mutex_t mtx_bio_writeback;	/* Serializes write-back */
+static semaphore_t bio_flush_sem;
+static thread_t bio_flush_thread;
+static thread_t bio_expire_thread;
+
+static struct PAGE_RECLAIMER bio_reclaimer;
+
+/* Tunables; see /ankh/sys */
+static unsigned int bio_min_pages = 128;	/* Number of data pages we may always use */
+static unsigned int bio_free_reserve = 8;	/* Stop growing if less than 1/bio_free_reserve of memory is available */
+static unsigned int bio_dirty_max = 256;	/* Writers must help flushing beyond this many dirty buffers */
+static unsigned int bio_dirty_age_ms = 30000;	/* Buffers are written back once dirty for this long */
+
+static unsigned int bio_reclaim(unsigned int num_pages);
+
+/*
+ * Hashes a buffer to one of 2^bits buckets; the device is mixed in so that the
+ * same block of different disks or slices ends up in different buckets.
+ */
+static inline unsigned int
+bio_hash(Ananas::Device* device, blocknr_t block, unsigned int bits)
+{
+	uint64_t key = static_cast<uint64_t>(block) ^ (static_cast<uint64_t>(reinterpret_cast<addr_t>(device)) * HASH_GOLDEN_RATIO_64);
+	return Ananas::HashInteger(key, bits);
+}
 
-static struct BIO_CHAIN bio_freelist;
-static struct BIO_CHAIN bio_usedlist;
-static struct BIO_BUCKET bio_bucket[BIO_BUCKET_SIZE];
-static unsigned int bio_bitmap_size;
-static uint8_t* bio_bitmap = NULL;
-static uint8_t* bio_data = NULL;
+/*
+ * Resolves device and block to the device that actually holds the block; the
+ * cache and the request queues only ever see the latter.
+ */
+static Ananas::Device*
+bio_resolve(Ananas::Device* device, blocknr_t& block)
+{
+	while (true) {
+		Ananas::IBIODeviceOperations* bdo = device->GetBIODeviceOperations();
+		Ananas::Device* parent = bdo != nullptr ? bdo->ResolveBIOBlock(block) : nullptr;
+		if (parent == nullptr)
+			return device;
+		device = parent;
+	}
+}
 
-static spinlock_t spl_bio_lists;
-static spinlock_t spl_bio_bitmap;
+static inline struct BIO_BUCKET*
+bio_bucket_for(Ananas::Device* device, blocknr_t block)
+{
+	return &bio_bucket[bio_hash(device, block, bio_hash_bits)];
+}
+
+/* Returns the smallest size class holding len bytes; len must be 1 .. PAGE_SIZE */
+static inline unsigned int
+bio_size_class(size_t len)
+{
+	unsigned int sectors = (len + BIO_SECTOR_SIZE - 1) / BIO_SECTOR_SIZE;
+	if (sectors <= 1)
+		return 0;
+	return 32 - __builtin_clz(sectors - 1); /* ceil(log2(sectors)) */
+}
+
+static inline unsigned int
+bio_slots_full(unsigned int c)
+{
+	return (1U << ((PAGE_SIZE / BIO_SECTOR_SIZE) >> c)) - 1;
+}
 
 static errorcode_t
 bio_init()
 {
-	/*
-	 * Allocate the BIO data buffers. Note that we allocate a BIO_SECTOR_SIZE - 1
-	 * more than needed if necessary - this is because we want to keep the data
-	 * bitmap at the beginning to prevent it from being messed with by faulty
-	 * drivers; and this will ensure it to be adequately aligned as a nice bonus.
-	 */
-	bio_bitmap_size = ((BIO_DATA_SIZE / BIO_SECTOR_SIZE) + 7) / 8; /* in bytes */
-	int bio_bitmap_slack = 0;
-	if ((bio_bitmap_size & (BIO_SECTOR_SIZE - 1)) > 0)
-		bio_bitmap_slack = BIO_SECTOR_SIZE - (bio_bitmap_size % BIO_SECTOR_SIZE);
-	bio_bitmap = new uint8_t[BIO_DATA_SIZE + bio_bitmap_size + bio_bitmap_slack];
-	bio_data = bio_bitmap + bio_bitmap_size + bio_bitmap_slack;
-
-	/* Clear the BIO bucket chain */
-	for (unsigned int i = 0; i < BIO_BUCKET_SIZE; i++) {
+	KASSERT((BIO_SECTOR_SIZE << (BIO_NUM_SIZES - 1)) == PAGE_SIZE, "size classes do not cover a page");
+
+	/* Start with a small hash table; it grows along with the cache */
+	bio_hash_bits = BIO_MIN_HASH_BITS;
+	bio_bucket = new BIO_BUCKET[1 << bio_hash_bits];
+	for (unsigned int i = 0; i < (1U << bio_hash_bits); i++)
 		LIST_INIT(&bio_bucket[i]);
-		spinlock_init(&bio_bucket[i].spl_bucket);
+
+	for (unsigned int l = 0; l < BIO_LRU_NUM; l++)
+		LIST_INIT(&bio_lru[l]);
+	LIST_INIT(&bio_dirtylist);
+	mutex_init(&mtx_bio_writeback, "biowriteback");
+	for (unsigned int c = 0; c < BIO_NUM_SIZES; c++)
+		LIST_INIT(&bio_partial[c]);
+
+	bio_reclaimer.pr_name = "bio";
+	bio_reclaimer.pr_func = bio_reclaim;
+	page_register_reclaimer(&bio_reclaimer);
+	return ananas_success();
+}
+
+INIT_FUNCTION(bio_init, SUBSYSTEM_BIO, ORDER_FIRST);
+
+/* Grabs a free data slot of size class c, if any; must be called with spl_bio held */
+static void*
+bio_data_alloc_locked(unsigned int c, struct BIO_PAGE** bp_out)
+{
+	if (LIST_EMPTY(&bio_partial[c]))
+		return NULL;
+
+	/* Pages on the partial list always have a free slot; take the first one */
+	struct BIO_PAGE* bp = LIST_HEAD(&bio_partial[c]);
+	unsigned int slot = __builtin_ctz(~bp->bp_used);
+	bp->bp_used |= 1 << slot;
+	if (bp->bp_used == bio_slots_full(c))
+		LIST_REMOVE(&bio_partial[c], bp);
+
+	*bp_out = bp;
+	return bp->bp_data + slot * (BIO_SECTOR_SIZE << c);
+}
+
+/*
+ * Releases a data slot; if this leaves the page unused, it is returned so that
+ * the caller can free it once spl_bio is released. Must be called with spl_bio
+ * held.
+ */
+static struct BIO_PAGE*
+bio_data_free_locked(struct BIO_PAGE* bp, void* data)
+{
+	unsigned int c = bp->bp_size;
+	unsigned int slot = (static_cast<char*>(data) - bp->bp_data) / (BIO_SECTOR_SIZE << c);
+	KASSERT((bp->bp_used & (1 << slot)) != 0, "data slot %u of page %p not in use", slot, bp);
+	if (bp->bp_used == bio_slots_full(c))
+		LIST_PREPEND(&bio_partial[c], bp); /* was full, but won't be anymore */
+	bp->bp_used &= ~(1 << slot);
+	if (bp->bp_used != 0)
+		return NULL;
+
+	LIST_REMOVE(&bio_partial[c], bp);
+	bio_num_pages--;
+	return bp;
+}
+
+static void
+bio_page_destroy(struct BIO_PAGE* bp)
+{
+	kmem_unmap(bp->bp_data, PAGE_SIZE);
+	page_free(bp->bp_page);
+	slab_free(&bio_page_cache, bp);
+}
+
+/* Adds a new data page of size class c */
+static void
+bio_data_grow(unsigned int c)
+{
+	struct PAGE* p;
+	char* data = static_cast<char*>(page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE));
+	KASSERT(data != NULL, "out of memory");
+
+	auto bp = static_cast<struct BIO_PAGE*>(slab_alloc(&bio_page_cache));
+	bp->bp_page = p;
+	bp->bp_data = data;
+	bp->bp_size = c;
+	bp->bp_used = 0;
+
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	LIST_APPEND(&bio_partial[c], bp);
+	bio_num_pages++;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+}
+
+/* Returns whether the cache may take more pages from the page allocator */
+static bool
+bio_may_grow()
+{
+	if (bio_num_pages < bio_min_pages)
+		return true;
+
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	return avail_pages > total_pages / bio_free_reserve;
+}
+
+/*
+ * Takes an unused buffer out of the cache; returns its data page if that is
+ * no longer needed. The buffer and page must be freed once spl_bio is
+ * released; must be called with spl_bio held.
+ */
+static struct BIO_PAGE*
+bio_evict_locked(struct BIO* bio)
+{
+	KASSERT(bio->refcount == 0, "evicting bio %p in use", bio);
+	LIST_REMOVE_IP(&bio_lru[bio->lru_list], chain, bio);
+	bio_num_lru[bio->lru_list]--;
+	LIST_REMOVE_IP(bio_bucket_for(bio->device, bio->block), bucket, bio);
+	bio_num_bios--;
+	return bio_data_free_locked(bio->data_page, bio->data);
+}
+
+/* Looks up a cached buffer; must be called with spl_bio held */
+static struct BIO*
+bio_lookup_locked(Ananas::Device* device, blocknr_t block)
+{
+	LIST_FOREACH_IP(bio_bucket_for(device, block), bucket, bio, struct BIO) {
+		if (bio->device == device && bio->block == block)
+			return bio;
 	}
+	return NULL;
+}
 
-	/* Initialize bio buffers and hook them up to the freelist */
-	struct BIO* bios = new BIO[BIO_NUM_BUFFERS];
-	LIST_INIT(&bio_freelist);
-	for (unsigned int i = 0; i < BIO_NUM_BUFFERS; i++, bios++) {
-		sem_init(&bios->sem, 1);
-		LIST_APPEND_IP(&bio_freelist, chain, bios);
+/*
+ * Doubles the hash table; called once the chains get too long. The table is
+ * allocated without spl_bio held, so someone may have beaten us to it.
+ */
+static void
+bio_hash_grow(unsigned int cur_bits)
+{
+	unsigned int new_bits = cur_bits + 1;
+	auto new_bucket = new BIO_BUCKET[1 << new_bits];
+	for (unsigned int i = 0; i < (1U << new_bits); i++)
+		LIST_INIT(&new_bucket[i]);
+
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	if (bio_hash_bits != cur_bits) {
+		spinlock_unlock_unpremptible(&spl_bio, state);
+		delete[] new_bucket;
+		return;
 	}
 
-	/*
-	 * Construct the BIO bitmap; we need to mark all items as clear except those
-	 * in the slack section, they cannot be used.
-	 */
-	memset(bio_bitmap, 0, bio_bitmap_size);
-	if (((BIO_DATA_SIZE / BIO_SECTOR_SIZE) & 7) != 0) {
-		/*
-	 	 * This means the bitmap size is not a multiple of a byte; we need to set
-		 * the trailing bits to prevent buffers from being allocated that do not
-		 * exist.
-	 	 */
-		for (int n = (BIO_DATA_SIZE / BIO_SECTOR_SIZE) & 7; n < 8; n++)
-			bio_bitmap[bio_bitmap_size] |= (1 << n);
+	struct BIO_BUCKET* old_bucket = bio_bucket;
+	for (unsigned int i = 0; i < (1U << cur_bits); i++) {
+		LIST_FOREACH_SAFE_IP(&old_bucket[i], bucket, bio, struct BIO) {
+			LIST_APPEND_IP(&new_bucket[bio_hash(bio->device, bio->block, new_bits)], bucket, bio);
+		}
 	}
-	spinlock_init(&spl_bio_lists);
-	spinlock_init(&spl_bio_bitmap);
-	return ananas_success();
+	bio_bucket = new_bucket;
+	bio_hash_bits = new_bits;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+
+	delete[] old_bucket;
+	TRACE(BIO, INFO, "hash table grown to %u buckets", 1 << new_bits);
 }
 
-INIT_FUNCTION(bio_init, SUBSYSTEM_BIO, ORDER_FIRST);
+/* Places a buffer at the front of replacement list l; must be called with spl_bio held */
+static void
+bio_lru_insert_locked(struct BIO* bio, unsigned int l)
+{
+	bio->lru_list = l;
+	LIST_PREPEND_IP(&bio_lru[l], chain, bio);
+	bio_num_lru[l]++;
+}
+
+/*
+ * Takes a reference to a cached buffer; if this is a use of the buffer (as
+ * opposed to readahead), it is moved towards the protected list. Must be
+ * called with spl_bio held.
+ */
+static void
+bio_ref_locked(struct BIO* bio, bool is_use)
+{
+	bio->refcount++;
+	if (!is_use)
+		return;
+
+	/* A buffer is promoted to the protected list once it is used for the second time */
+	unsigned int l = bio->lru_list;
+	if (l == BIO_LRU_PROBATION && bio->lru_used)
+		l = BIO_LRU_PROTECTED;
+	bio->lru_used = 1;
+
+	/* Move it to the front of its list so that it is the last to be recycled */
+	LIST_REMOVE_IP(&bio_lru[bio->lru_list], chain, bio);
+	bio_num_lru[bio->lru_list]--;
+	bio_lru_insert_locked(bio, l);
+
+	/* Keep room for newcomers to prove themselves */
+	if (bio_num_lru[BIO_LRU_PROTECTED] > BIO_PROTECTED_SHARE(bio_num_bios)) {
+		struct BIO* demoted = LIST_TAIL(&bio_lru[BIO_LRU_PROTECTED]);
+		LIST_REMOVE_IP(&bio_lru[BIO_LRU_PROTECTED], chain, demoted);
+		bio_num_lru[BIO_LRU_PROTECTED]--;
+		bio_lru_insert_locked(demoted, BIO_LRU_PROBATION);
+	}
+}
 
 static void
 bio_waitcomplete(struct BIO* bio)
 {	
 	TRACE(BIO, FUNC, "bio=%p", bio);
+	if ((bio->flags & BIO_FLAG_PENDING) == 0)
+		return;
 	while((bio->flags & BIO_FLAG_PENDING) != 0) {
 		sem_wait(&bio->sem);
 	}
+	/* Completion only signals once; pass it on to anyone else waiting */
+	sem_signal(&bio->sem);
 }
 
 static void
 bio_waitdirty(struct BIO* bio)
 {	
 	TRACE(BIO, FUNC, "bio=%p", bio);
-	while((bio->flags & BIO_FLAG_DIRTY) != 0) {
+	if ((bio->flags & BIO_FLAG_DIRTY) == 0 || BIO_IS_ERROR(bio))
+		return;
+	while((bio->flags & BIO_FLAG_DIRTY) != 0 && !BIO_IS_ERROR(bio)) {
 		sem_wait(&bio->sem);
 	}
+	/* Completion only signals once; pass it on to anyone else waiting */
+	sem_signal(&bio->sem);
 }
 
 /*
- * Called to queue a bio to storage; called with list lock held.
+ * Writes back up to BIO_FLUSH_BATCH of the oldest dirty buffers of device (or
+ * of any device if NULL); all writes are submitted before waiting for any of
+ * them. Returns the number of buffers written; must be called with
+ * mtx_bio_writeback held.
+ *
+ * The dirty flag is only used to track the write itself; it is cleared upon
+ * completion, once the data is on disk. If the buffer is dirtied again in the meantime, it
+ * will simply be queued once more.
  */
-static void
-bio_flush(struct BIO* bio)
+static unsigned int
+bio_writeback_batch(Ananas::Device* device)
 {
-	TRACE(BIO, FUNC, "bio=%p", bio);
-
-	/* If the bio isn't dirty, we needn't write it so just return */
-	if ((bio->flags & BIO_FLAG_DIRTY) == 0)
-		return;
+	struct BIO* bios[BIO_FLUSH_BATCH];
+	unsigned int num_bios = 0;
 
-	TRACE(BIO, INFO, "bio %p (lba %u) is dirty, flushing", bio, (uint32_t)bio->io_block);
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	LIST_FOREACH_SAFE_IP(&bio_dirtylist, dirty, bio, struct BIO) {
+		if (num_bios == BIO_FLUSH_BATCH)
+			break;
+		if (device != NULL && bio->device != device)
+			continue;
+		/* We take over the reference held by the dirty list */
+		LIST_REMOVE_IP(&bio_dirtylist, dirty, bio);
+		bio->dirty_queued = 0;
+		bio_num_dirty--;
+		bios[num_bios++] = bio;
+	}
+	spinlock_unlock_unpremptible(&spl_bio, state);
+
+	/* Submit the writes per device, so that the request queue can merge them */
+	for (unsigned int n = 0; n < num_bios; /* nothing */) {
+		unsigned int num_device = 0;
+		while (n + num_device < num_bios && bios[n + num_device]->device == bios[n]->device) {
+			struct BIO* bio = bios[n + num_device];
+			TRACE(BIO, INFO, "bio %p (lba %u) is dirty, flushing", bio, (uint32_t)bio->io_block);
+			bio->flags |= BIO_FLAG_DIRTY;
+			num_device++;
+		}
+		bio_queue_submit(&bios[n], num_device, true);
+		n += num_device;
+	}
 
-	errorcode_t err = bio->device->GetBIODeviceOperations()->WriteBIO(*bio);
-	if (ananas_is_failure(err)) {
-		kprintf("bio_flush(): device_write() failed, %i\n", err);
-		bio_set_error(bio);
-	} else {
-		/* Wait until we have something to report... */
-		bio_waitdirty(bio);
-		/*
-		 * We're all set - the block I/O driver is responsible for clearing the dirty flag if
-		 * necessary
-		 */
+	for (unsigned int n = 0; n < num_bios; n++) {
+		bio_waitdirty(bios[n]);
+		bio_free(bios[n]);
 	}
+	return num_bios;
 }
 
-static void
-bio_cleanup()
+/*
+ * Recycles the least recently used buffer which is not in use; if there is
+ * none but some are dirty, writes a batch of those back instead. Returns false
+ * if there is nothing to recycle. page_freed is set if this gave a data page
+ * back to the page allocator.
+ */
+static bool
+bio_recycle(bool* page_freed)
 {
 	TRACE(BIO, FUNC, "called");
 
-	spinlock_lock(&spl_bio_lists);
-	KASSERT(!LIST_EMPTY(&bio_usedlist), "usedlist is empty");
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	for (unsigned int l = 0; l < BIO_LRU_NUM; l++) {
+		LIST_FOREACH_REVERSE_IP(&bio_lru[l], chain, bio, struct BIO) {
+			if (bio->refcount > 0 || BIO_IS_PENDING(bio) || (bio->flags & BIO_FLAG_QUEUED))
+				continue; /* in use, being read, written or completed */
+
+			struct BIO_PAGE* bp = bio_evict_locked(bio);
+			spinlock_unlock_unpremptible(&spl_bio, state);
+			slab_free(&bio_cache, bio);
+			if (bp != NULL) {
+				bio_page_destroy(bp);
+				*page_freed = true;
+			}
+			return true;
+		}
+	}
+	bool have_dirty = bio_num_dirty > 0;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+	if (!have_dirty)
+		return false;
+
+	/* Everything unused is dirty; write some back so that we can recycle them */
+	mutex_lock(&mtx_bio_writeback);
+	bio_writeback_batch(NULL);
+	mutex_unlock(&mtx_bio_writeback);
+	return true;
+}
 
-	/* Grab the final entry and remove it from the list */
-	struct BIO* bio = LIST_TAIL(&bio_usedlist);
-	LIST_POP_TAIL_IP(&bio_usedlist, chain);
+/*
+ * Page allocator callback; gives back clean buffers nobody uses until
+ * num_pages pages are freed. This cannot write dirty buffers back, as we may
+ * be called from any context.
+ */
+static unsigned int
+bio_reclaim(unsigned int num_pages)
+{
+	struct BIO_CHAIN dead_bios;
+	struct BIO_PAGE_LIST dead_pages;
+	LIST_INIT(&dead_bios);
+	LIST_INIT(&dead_pages);
+
+	unsigned int num_freed = 0;
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	for (unsigned int l = 0; l < BIO_LRU_NUM && num_freed < num_pages; l++) {
+		LIST_FOREACH_REVERSE_SAFE_IP(&bio_lru[l], chain, bio, struct BIO) {
+			if (num_freed >= num_pages)
+				break;
+			if (bio->refcount > 0 || BIO_IS_PENDING(bio) || (bio->flags & BIO_FLAG_QUEUED))
+				continue; /* in use, being read, written or completed */
+
+			struct BIO_PAGE* bp = bio_evict_locked(bio);
+			LIST_APPEND_IP(&dead_bios, chain, bio);
+			if (bp != NULL) {
+				LIST_APPEND(&dead_pages, bp);
+				num_freed++;
+			}
+		}
+	}
+	spinlock_unlock_unpremptible(&spl_bio, state);
 
-	bio_flush(bio);
+	LIST_FOREACH_SAFE_IP(&dead_bios, chain, bio, struct BIO) {
+		slab_free(&bio_cache, bio);
+	}
+	LIST_FOREACH_SAFE(&dead_pages, bp, struct BIO_PAGE) {
+		bio_page_destroy(bp);
+	}
+	TRACE(BIO, INFO, "reclaimed %u page(s)", num_freed);
+	return num_freed;
+}
 
-	/* Add it to the freelist */
-	LIST_APPEND_IP(&bio_freelist, chain, bio);
+/* Returns a data slot for len bytes, growing or recycling the cache as needed */
+static void*
+bio_data_alloc(size_t len, struct BIO_PAGE** bp)
+{
+	unsigned int c = bio_size_class(len);
+	while (1) {
+		register_t state = spinlock_lock_unpremptible(&spl_bio);
+		void* data = bio_data_alloc_locked(c, bp);
+		spinlock_unlock_unpremptible(&spl_bio, state);
+		if (data != NULL)
+			return data;
 
-	KASSERT(bio->data != NULL, "to-remove bio %p has no data (fl %x, block %x, len %x)",
-	 bio, bio->flags, (int)bio->block, bio->length);
-	/*
-	 * OK, now we need to nuke the data bio points to; this must be done within
-	 * the lists spinlock because it must not be allocated by someone else.
-	 */
-	spinlock_lock(&spl_bio_bitmap);
-	unsigned int bio_data_block = (static_cast<uint8_t*>(bio->data) - static_cast<uint8_t*>(bio_data)) / BIO_SECTOR_SIZE;
-	for (unsigned int n = bio_data_block; n < bio_data_block + (bio->length / BIO_SECTOR_SIZE); n++) {
-		KASSERT((bio_bitmap[n / 8] & (1 << (n % 8))) != 0, "data block %u not assigned", n);
-		bio_bitmap[n / 8] &= ~(1 << (n % 8));
+		/*
+		 * No slots available; we need a new page if we are allowed to grow. If
+		 * not, we recycle something; only if that frees up a page (or there is
+		 * nothing to recycle) do we take another.
+		 */
+		bool page_freed = false;
+		if (bio_may_grow() || !bio_recycle(&page_freed) || page_freed)
+			bio_data_grow(c);
 	}
-	/* Finally, remove the block from the bucket chain */
-	unsigned int bucket_num = bio->block % BIO_BUCKET_SIZE;
-	spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-	KASSERT(!LIST_EMPTY(&bio_bucket[bucket_num]), "bio bucket %u is empty", bucket_num);
-	LIST_REMOVE_IP(&bio_bucket[bucket_num], bucket, bio);
 
-	/*
-	 * Clear the bio info; it's available again for use (but set it as pending as
-	 * the data it's not yet available)
-	 */
-	bio->flags = BIO_FLAG_PENDING;
-	bio->data = NULL;
-	spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-	spinlock_unlock(&spl_bio_bitmap);
-	spinlock_unlock(&spl_bio_lists);
+	/* NOTREACHED */
 }
 
 /*
@@ -174,176 +546,269 @@ bio_cleanup()
  * allocate a new one as required.
  */
 static struct BIO*
-bio_get_buffer(Ananas::Device* device, blocknr_t block, size_t len)
+bio_get_buffer(Ananas::Device* device, blocknr_t block, size_t len, bool is_use, bool* is_new)
 {
 	TRACE(BIO, FUNC, "dev=%p, block=%u, len=%u", device, (int)block, len);
 	KASSERT((len % BIO_SECTOR_SIZE) == 0, "length %u not a multiple of bio sector size", len);
+	KASSERT(len > 0 && len <= PAGE_SIZE, "invalid length %u", len);
 
-	/* First of all, lock the corresponding queue */
-	unsigned int bucket_num = block % BIO_BUCKET_SIZE;
-bio_restart:
-	spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-
-	/* See if we can find the block in the bucket queue; if so, we can just return it */
-	LIST_FOREACH_IP(&bio_bucket[bucket_num], bucket, bio, struct BIO) {
-		if (bio->device != device || bio->block != block)
-			continue;
-
+	/* See if we can find the block in the cache; if so, we can just return it */
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	struct BIO* bio = bio_lookup_locked(device, block);
+	if (bio == NULL) {
 		/*
-	 	 * This is the block we need; we must move it in front of the used queue to
-		 * prevent it from being nuked.
+		 * Not there. Set up a new buffer; this may block, so we can't hold the
+		 * lock - which means someone may have added the block by the time we are
+		 * done.
 		 */
-		spinlock_lock(&spl_bio_lists);
-		KASSERT(!LIST_EMPTY(&bio_usedlist), "usedlist is empty");
-		/* Remove ourselves from the chain... */
-		LIST_REMOVE_IP(&bio_usedlist, chain, bio);
-		/* ...and prepend us at the beginning */
-		LIST_PREPEND_IP(&bio_usedlist, chain, bio);
-		spinlock_unlock(&spl_bio_lists);
-
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		KASSERT(bio->length == len, "bio item found with length %u, requested length %u", bio->length, len); /* XXX should avoid... somehow */
+		spinlock_unlock_unpremptible(&spl_bio, state);
+
+		struct BIO_PAGE* bp;
+		void* data = bio_data_alloc(len, &bp);
+		auto new_bio = static_cast<struct BIO*>(slab_alloc(&bio_cache));
+		sem_init(&new_bio->sem, 1);
+		new_bio->flags = BIO_FLAG_PENDING; /* data isn't there yet */
+		new_bio->device = device;
+		new_bio->block = block;
+		new_bio->io_block = block;
+		new_bio->length = len;
+		new_bio->data = data;
+		new_bio->data_page = bp;
+		new_bio->refcount = 1;
+		new_bio->dirty_queued = 0;
+		new_bio->lru_used = is_use;
+
+		state = spinlock_lock_unpremptible(&spl_bio);
+		bio = bio_lookup_locked(device, block);
+		if (bio == NULL) {
+			LIST_PREPEND_IP(bio_bucket_for(device, block), bucket, new_bio);
+			bio_lru_insert_locked(new_bio, BIO_LRU_PROBATION);
+			bio_num_bios++;
+			unsigned int hash_bits = bio_hash_bits;
+			bool need_grow = hash_bits < BIO_MAX_HASH_BITS && bio_num_bios > (BIO_HASH_LOAD << hash_bits);
+			spinlock_unlock_unpremptible(&spl_bio, state);
+
+			if (need_grow)
+				bio_hash_grow(hash_bits);
+			bio_queue_account_lookup(device, false);
+			TRACE(BIO, INFO, "returning new bio=%p", new_bio);
+			*is_new = true;
+			return new_bio;
+		}
 
-		/*
-		 * We have already found the I/O buffer in the cache; however, if two
-		 * threads request the same block at roughly the same time, one will
-		 * be stuck waiting for it to be read and the other will end up here.
-		 *
-		 * To prevent this, we'll have to wait until the BIO buffer is no
-		 * longer pending, as this ensures it will have been read.
-		 *
-		 * XXX What about the NODATA flag?
-		 */
-		bio_waitcomplete(bio);
-		TRACE(BIO, INFO, "returning cached bio=%p", bio);
-		return bio;
-	}
-	
-	/* Grab a bio from the head of the freelist */
-	spinlock_lock(&spl_bio_lists);
-	struct BIO* bio = NULL;
-	if (!LIST_EMPTY(&bio_freelist)) {
-		bio = LIST_HEAD(&bio_freelist);
-		LIST_POP_HEAD_IP(&bio_freelist, chain);
+		/* Lost the race; use the cached one instead */
+		bp = bio_data_free_locked(bp, data);
+		bio_ref_locked(bio, is_use);
+		spinlock_unlock_unpremptible(&spl_bio, state);
+		slab_free(&bio_cache, new_bio);
+		if (bp != NULL)
+			bio_page_destroy(bp);
+	} else {
+		bio_ref_locked(bio, is_use);
+		spinlock_unlock_unpremptible(&spl_bio, state);
 	}
+	KASSERT(bio->length == len, "bio item found with length %u, requested length %u", bio->length, len); /* XXX should avoid... somehow */
+	bio_queue_account_lookup(device, true);
+	TRACE(BIO, INFO, "returning cached bio=%p", bio);
+	*is_new = false;
+	return bio;
+}
 
-	if (bio == NULL) {
-		/* No bio's available; clean up some */
-		spinlock_unlock(&spl_bio_lists);
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		bio_cleanup();
-		goto bio_restart;
-	}
+/*
+ * Called by BIO consumers when they are done with a bio buffer; it stays
+ * cached, but can be recycled once nobody is using it.
+ */
+void
+bio_free(struct BIO* bio)
+{
+	TRACE(BIO, FUNC, "bio=%p", bio);
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	KASSERT(bio->refcount > 0, "freeing unreferenced bio %p", bio);
+	bio->refcount--;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+}
+
+void
+bio_get_range(Ananas::Device* device, blocknr_t block, unsigned int num_blocks, size_t len, int flags, struct BIO** bios)
+{
+	TRACE(BIO, FUNC, "dev=%p, block=%u, num_blocks=%u, len=%u", device, (int)block, num_blocks, len);
+	device = bio_resolve(device, block);
+	blocknr_t block_step = len / BIO_SECTOR_SIZE;
 
-	/* And add it to the used list */
-	LIST_PREPEND_IP(&bio_usedlist, chain, bio);
-	spinlock_unlock(&spl_bio_lists);
-
-	/* Find available data blocks in the bio data pool */
-bio_restartdata:
-	spinlock_lock(&spl_bio_bitmap);
-	unsigned int chain_length = 0, cur_data_block = 0;
-	unsigned int num_blocks = len / BIO_SECTOR_SIZE;
-	for (; cur_data_block < bio_bitmap_size * 8; cur_data_block++) {
-		if(bio_bitmap[cur_data_block / 8] & (1 << (cur_data_block % 8))) {
-			/* Data block isn't available - try again */
-			chain_length = 0;
+	/*
+	 * New buffers must be read; we submit them in runs, so that the request
+	 * queue can merge each run into a single request.
+	 */
+	unsigned int run_start = 0, run_length = 0;
+	for (unsigned int n = 0; n < num_blocks; n++) {
+		bool is_new;
+		bios[n] = bio_get_buffer(device, block + n * block_step, len, (flags & BIO_READ_AHEAD) == 0, &is_new);
+		if (!is_new) {
+			/*
+			 * We have found the I/O buffer in the cache; however, if two threads
+			 * request the same block at roughly the same time, one will still be
+			 * reading it when the other ends up here. Whoever created the buffer
+			 * takes care of the read, so all we need to do is wait until it is no
+			 * longer pending.
+			 *
+			 * XXX What about the NODATA flag?
+			 */
+			TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> cached block %p", device, (int)(block + n * block_step), len, bios[n]);
+		} else if (flags & BIO_READ_NODATA) {
+			/*
+			 * The requester doesn't want the actual data; this means we needn't
+			 * schedule the read; we just mark the bio constructed above as no longer
+			 * pending - caller is likely to destroy any data in it either way.
+			 */
+			bio_set_available(bios[n]);
+		} else {
+			TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> new block %p", device, (int)(block + n * block_step), len, bios[n]);
+			if (run_length == 0)
+				run_start = n;
+			run_length++;
 			continue;
 		}
 
-		if (chain_length == num_blocks)
-			break;
-		chain_length++;
+		/* This block needs no read, so any run ends here */
+		bio_queue_submit(&bios[run_start], run_length, false);
+		run_length = 0;
 	}
-	if (chain_length != num_blocks) {
-		/* No bio data available; clean up some */
-		spinlock_unlock(&spl_bio_bitmap);
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		bio_cleanup();
-		spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-		goto bio_restartdata;
-	}
-	/* Walk back the number of blocks we need to allocate, we know they are free */
-	cur_data_block -= chain_length;
+	bio_queue_submit(&bios[run_start], run_length, false);
 
-	/* Mark the blocks as in use */
-	for (unsigned int n = cur_data_block; n <  cur_data_block + num_blocks; n++) {
-		bio_bitmap[n / 8] |= (1 << (n % 8));
-	}
-	spinlock_unlock(&spl_bio_bitmap);
-
-	/* Hook the request to the corresponding bucket */
-	LIST_PREPEND_IP(&bio_bucket[bucket_num], bucket, bio);
-	spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
+	/* Wait until we have something to report, unless the caller will */
+	if ((flags & BIO_READ_ASYNC) == 0)
+		bio_wait_all(bios, num_blocks);
+}
 
-	/*
-	 * Throw away any flags the buffer has (as this is a new request, we can't
-	 * anything more sensible yet) - note that we need to set the pending flag
-	 * because the data isn't ready yet.
-	 */
-	bio->flags = BIO_FLAG_PENDING;
-	bio->device = device;
-	bio->block = block;
-	bio->io_block = block;
-	bio->length = len;
-	bio->data = bio_data + (cur_data_block * BIO_SECTOR_SIZE);
-	TRACE(BIO, INFO, "returning new bio=%p", bio);
+struct BIO*
+bio_get(Ananas::Device* device, blocknr_t block, size_t len, int flags)
+{
+	struct BIO* bio;
+	bio_get_range(device, block, 1, len, flags, &bio);
 	return bio;
 }
 
+void
+bio_wait(struct BIO* bio)
+{
+	bio_waitcomplete(bio);
+}
+
+void
+bio_wait_all(struct BIO** bios, unsigned int num_bios)
+{
+	/* All requests are already in flight, so this takes as long as the slowest one */
+	for (unsigned int n = 0; n < num_bios; n++)
+		if (bios[n] != NULL)
+			bio_waitcomplete(bios[n]);
+}
+
 /*
- * Called by BIO consumers when they are done with a bio buffer.
+ * Obtains a reference to the cached buffer of block, if there is one; its data
+ * is available once this returns.
  */
-void
-bio_free(struct BIO* bio)
+static struct BIO*
+bio_lookup_cached(Ananas::Device* device, blocknr_t block)
 {
-	TRACE(BIO, FUNC, "bio=%p", bio);
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	struct BIO* bio = bio_lookup_locked(device, block);
+	if (bio != NULL)
+		bio_ref_locked(bio, false);
+	spinlock_unlock_unpremptible(&spl_bio, state);
+	if (bio != NULL)
+		bio_waitcomplete(bio);
+	return bio;
 }
 
-struct BIO*
-bio_get(Ananas::Device* device, blocknr_t block, size_t len, int flags)
+errorcode_t
+bio_transfer_direct(Ananas::Device* device, blocknr_t block, unsigned int num_blocks, size_t len, void* const* data, bool write)
 {
-	struct BIO* bio = bio_get_buffer(device, block, len);
-	if (flags & BIO_READ_NODATA) {
-		/*
-		 * The requester doesn't want the actual data; this means we needn't
-	 	 * schedule the read or even bother to check whether it's pending
-	 	 * or not; we just return the bio constructed above without it
-		 * being pending - caller is likely to destroy any data in it
-		 * either way.
-		 */
-		bio->flags &= ~BIO_FLAG_PENDING;
-		return bio;
-	}
+	TRACE(BIO, FUNC, "dev=%p, block=%u, num_blocks=%u, len=%u, write=%d", device, (int)block, num_blocks, len, write);
+	KASSERT(num_blocks <= BIO_DIRECT_MAX_BLOCKS, "too many blocks (%u)", num_blocks);
+	KASSERT((len % BIO_SECTOR_SIZE) == 0 && len > 0 && len <= PAGE_SIZE, "invalid length %u", len);
+	device = bio_resolve(device, block);
+	blocknr_t block_step = len / BIO_SECTOR_SIZE;
+
+	errorcode_t err = ananas_success();
+	struct BIO* bios[BIO_DIRECT_MAX_BLOCKS];
+	unsigned int num_bios = 0;
+	for (unsigned int n = 0; n < num_blocks; n++) {
+		struct BIO* cached = bio_lookup_cached(device, block + n * block_step);
+		if (cached != NULL) {
+			KASSERT(cached->length == len, "bio %p has length %u, requested length %u", cached, cached->length, len);
+			if (BIO_IS_ERROR(cached)) {
+				err = ANANAS_ERROR(IO);
+			} else if (write) {
+				memcpy(BIO_DATA(cached), data[n], len);
+				bio_set_dirty(cached);
+			} else {
+				memcpy(data[n], BIO_DATA(cached), len);
+			}
+			bio_free(cached);
+			continue;
+		}
 
-	/*
-	 * If we have a block that is not pending, we can just return it. Note that
-	 * dirty blocks are never pending.
-	 */
-	if ((bio->flags & BIO_FLAG_PENDING) == 0) {
-		TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> cached block %p", device, (int)block, len, bio);
-		return bio;
+		/* Not cached; set up a buffer of our own, which is never hashed */
+		auto bio = static_cast<struct BIO*>(slab_alloc(&bio_cache));
+		memset(bio, 0, sizeof(*bio));
+		sem_init(&bio->sem, 0);
+		bio->flags = write ? BIO_FLAG_DIRTY : BIO_FLAG_PENDING;
+		bio->device = device;
+		bio->block = block + n * block_step;
+		bio->io_block = bio->block;
+		bio->length = len;
+		bio->data = data[n];
+		bio->refcount = 1;
+		bios[num_bios++] = bio;
 	}
 
-	/* kick the device; we want it to read */
-	errorcode_t err = device->GetBIODeviceOperations()->ReadBIO(*bio);
-	if (ananas_is_failure(err)) {
-		kprintf("bio_read(): device_read() failed, %i\n", err);
-		bio_set_error(bio);
-		return bio;
+	bio_queue_submit(bios, num_bios, write);
+	for (unsigned int n = 0; n < num_bios; n++) {
+		struct BIO* bio = bios[n];
+		/*
+		 * We are the only waiter, and signalling us is the last thing completion
+		 * does with the bio - so it is ours to free once we get the unit.
+		 */
+		sem_wait(&bio->sem);
+		if (BIO_IS_ERROR(bio))
+			err = ANANAS_ERROR(IO);
+
+		/*
+		 * Someone may have read the block into the cache while we were writing
+		 * it; make sure they have what is on disk now.
+		 */
+		if (write) {
+			struct BIO* cached = bio_lookup_cached(device, bio->block);
+			if (cached != NULL) {
+				if (!BIO_IS_ERROR(cached) && !BIO_IS_ERROR(bio))
+					memcpy(BIO_DATA(cached), BIO_DATA(bio), len);
+				bio_free(cached);
+			}
+		}
+		slab_free(&bio_cache, bio);
 	}
+	return err;
+}
 
-	/* ... and wait until we have something to report... */
-	bio_waitcomplete(bio);
-	TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> new block %p", device, (int)block, len, bio);
-	return bio;
+void
+bio_get_status(char* buf, size_t len)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	unsigned int num_bios = bio_num_bios, num_pages = bio_num_pages, num_dirty = bio_num_dirty;
+	unsigned int num_probation = bio_num_lru[BIO_LRU_PROBATION], num_protected = bio_num_lru[BIO_LRU_PROTECTED];
+	spinlock_unlock_unpremptible(&spl_bio, state);
+
+	snprintf(buf, len, "bio buffers %u data_pages %u dirty %u probation %u protected %u bytes %u\n",
+	 num_bios, num_pages, num_dirty, num_probation, num_protected,
+	 (unsigned int)(num_bios * sizeof(struct BIO) + num_pages * PAGE_SIZE));
 }
 
 void
 bio_set_error(struct BIO* bio)
 {
 	TRACE(BIO, FUNC, "bio=%p", bio);
-	bio->flags = (bio->flags & ~BIO_FLAG_PENDING) | BIO_FLAG_ERROR;
+	bio_queue_complete(bio);
+	bio->flags = (bio->flags & ~(BIO_FLAG_PENDING | BIO_FLAG_DIRTY)) | BIO_FLAG_ERROR;
 	sem_signal(&bio->sem);
 }
 
@@ -351,7 +816,12 @@ void
 bio_set_available(struct BIO* bio)
 {
 	TRACE(BIO, FUNC, "bio=%p", bio);
-	bio->flags &= ~BIO_FLAG_PENDING;
+	/*
+	 * Waiters may free the bio as soon as they see it completed, so the flags
+	 * must not change until the request queue is done with it.
+	 */
+	bio_queue_complete(bio);
+	bio->flags &= ~(BIO_FLAG_PENDING | BIO_FLAG_DIRTY);
 	sem_signal(&bio->sem);
 }
 
@@ -359,68 +829,192 @@ void
 bio_set_dirty(struct BIO* bio)
 {
 	TRACE(BIO, FUNC, "bio=%p", bio);
-	bio->flags |= BIO_FLAG_DIRTY;
-	bio_flush(bio); /* XXX debug aid so that the image can be inspected */
+
+	/* Queue the buffer for write-back; the dirty list holds a reference of its own */
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	if (!bio->dirty_queued) {
+		bio->dirty_queued = 1;
+		bio->dirty_since = timer_get_ns();
+		bio->refcount++;
+		LIST_APPEND_IP(&bio_dirtylist, dirty, bio);
+		bio_num_dirty++;
+	}
+	bool throttle = bio_num_dirty >= bio_dirty_max;
+	bool wakeup = !bio_flush_wakeup;
+	bio_flush_wakeup = true;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+
+	if (wakeup)
+		sem_signal(&bio_flush_sem);
+	if (throttle) {
+		/* Too much is waiting to be written; help out rather than piling up more */
+		mutex_lock(&mtx_bio_writeback);
+		bio_writeback_batch(NULL);
+		mutex_unlock(&mtx_bio_writeback);
+	}
+}
+
+void
+bio_sync(Ananas::Device* device)
+{
+	TRACE(BIO, FUNC, "device=%p", device);
+	if (device != NULL) {
+		blocknr_t block = 0;
+		device = bio_resolve(device, block);
+	}
+
+	/* Holding the lock also ensures any write-back in progress has completed */
+	mutex_lock(&mtx_bio_writeback);
+	while (bio_writeback_batch(device) > 0)
+		/* keep going */ ;
+	mutex_unlock(&mtx_bio_writeback);
+}
+
+errorcode_t
+bio_commit(Ananas::Device* device)
+{
+	TRACE(BIO, FUNC, "device=%p", device);
+	blocknr_t block = 0;
+	device = bio_resolve(device, block);
+
+	bio_sync(device);
+	return bio_queue_flush(device);
+}
+
+static void
+bio_flush_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&bio_flush_sem);
+
+		/* Anything dirtied from here on will wake us up again */
+		register_t state = spinlock_lock_unpremptible(&spl_bio);
+		bio_flush_wakeup = false;
+		spinlock_unlock_unpremptible(&spl_bio, state);
+
+		unsigned int num_written;
+		do {
+			mutex_lock(&mtx_bio_writeback);
+			num_written = bio_writeback_batch(NULL);
+			mutex_unlock(&mtx_bio_writeback);
+		} while (num_written > 0);
+	}
 }
 
+/*
+ * Writes back whatever has been dirty for longer than bio_dirty_age_ms; the
+ * dirty list is oldest first, so only its head needs to be looked at.
+ */
+static void
+bio_expire_thread_func(void* context)
+{
+	while(1) {
+		uint64_t max_age = static_cast<uint64_t>(__atomic_load_n(&bio_dirty_age_ms, __ATOMIC_RELAXED)) * 1000000;
+		thread_sleep_ns(max_age / BIO_EXPIRE_CHECKS);
+
+		while(1) {
+			register_t state = spinlock_lock_unpremptible(&spl_bio);
+			bool expired = !LIST_EMPTY(&bio_dirtylist) && timer_get_ns() - LIST_HEAD(&bio_dirtylist)->dirty_since >= max_age;
+			spinlock_unlock_unpremptible(&spl_bio, state);
+			if (!expired)
+				break;
+
+			mutex_lock(&mtx_bio_writeback);
+			bio_writeback_batch(NULL);
+			mutex_unlock(&mtx_bio_writeback);
+		}
+	}
+}
+
+static errorcode_t
+bio_flush_init()
+{
+	sem_init(&bio_flush_sem, 0);
+
+	/*
+	 * Writing back only when there is nothing better to do lets writes pile up
+	 * (and be combined) while the system is busy; run just above the idle
+	 * threads. Writers are throttled if this gets out of hand.
+	 */
+	kthread_init(&bio_flush_thread, "bioflush", &bio_flush_thread_func, NULL);
+	bio_flush_thread.t_priority = THREAD_PRIORITY_IDLE - 1;
+	thread_resume(&bio_flush_thread);
+
+	/* This one must run even if the system is never idle */
+	kthread_init(&bio_expire_thread, "bioexpire", &bio_expire_thread_func, NULL);
+	thread_resume(&bio_expire_thread);
+	return ananas_success();
+}
+
+INIT_FUNCTION(bio_flush_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+/* Lowering the limit may mean there is more to write back than we allow */
+static void
+bio_dirty_max_changed(struct TUNABLE* t)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	bool wakeup = bio_num_dirty >= bio_dirty_max && !bio_flush_wakeup;
+	if (wakeup)
+		bio_flush_wakeup = true;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+	if (wakeup)
+		sem_signal(&bio_flush_sem);
+}
+
+TUNABLE_UINT("bio.min_pages", bio_min_pages, 0, 0x7fffffff, nullptr, "Data pages the buffer cache may always use");
+TUNABLE_UINT("bio.free_reserve", bio_free_reserve, 1, 1024, nullptr, "Buffer cache stops growing below 1/n of memory free");
+TUNABLE_UINT("bio.dirty_max", bio_dirty_max, 1, 0x7fffffff, bio_dirty_max_changed, "Dirty buffers before writers must help flushing");
+TUNABLE_UINT("bio.dirty_age_ms", bio_dirty_age_ms, 100, 3600000, nullptr, "Milliseconds a buffer may stay dirty before it is written back");
+
 #ifdef OPTION_KDB
 KDB_COMMAND(bio, NULL, "Display I/O buffers")
 {
 	kprintf("bio dump\n");
 
-	unsigned int freelist_avail = 0, usedlist_used = 0;
-	spinlock_lock(&spl_bio_lists);
-	if(!LIST_EMPTY(&bio_freelist))
-		LIST_FOREACH_IP(&bio_freelist, chain, bio, struct BIO) {
-			freelist_avail++;
+	unsigned int num_used = 0, num_bios = 0;
+	register_t state = spinlock_lock_unpremptible(&spl_bio);
+	for (unsigned int l = 0; l < BIO_LRU_NUM; l++) {
+		unsigned int num_lru = 0;
+		LIST_FOREACH_IP(&bio_lru[l], chain, bio, struct BIO) {
+			num_lru++;
+			if (bio->refcount > 0)
+				num_used++;
 		}
-	if(!LIST_EMPTY(&bio_usedlist))
-		LIST_FOREACH_IP(&bio_usedlist, chain, bio, struct BIO) {
-			usedlist_used++;
-		}
-	spinlock_unlock(&spl_bio_lists);
-	kprintf("lists: %u bio's used, %u bio's free, %u total\n", usedlist_used, freelist_avail, BIO_NUM_BUFFERS);
-	KASSERT(freelist_avail + usedlist_used == BIO_NUM_BUFFERS, "chain length does not add up");
-
-	kprintf("buckets:");
-	for (unsigned int bucket_num = 0; bucket_num < BIO_BUCKET_SIZE; bucket_num++) {
-		kprintf("%u =>", bucket_num);
-		spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-		if(!LIST_EMPTY(&bio_bucket[bucket_num])) {
-			LIST_FOREACH_IP(&bio_bucket[bucket_num], bucket, bio, struct BIO) {
-				kprintf(" 0x%p (%u)", bio, bio->block);
-			}
-		} else {
-			kprintf(" (empty)");
+		KASSERT(num_lru == bio_num_lru[l], "list length does not add up");
+		num_bios += num_lru;
+	}
+	KASSERT(num_bios == bio_num_bios, "chain length does not add up");
+	unsigned int num_protected = bio_num_lru[BIO_LRU_PROTECTED];
+
+	unsigned int num_buckets_used = 0, longest_chain = 0;
+	unsigned int num_buckets = 1U << bio_hash_bits;
+	for (unsigned int bucket_num = 0; bucket_num < num_buckets; bucket_num++) {
+		unsigned int chain_length = 0;
+		LIST_FOREACH_IP(&bio_bucket[bucket_num], bucket, bio, struct BIO) {
+			chain_length++;
 		}
-		kprintf("\n");
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
+		if (chain_length > 0)
+			num_buckets_used++;
+		if (chain_length > longest_chain)
+			longest_chain = chain_length;
 	}
 
-	unsigned int databuf_avail = 0;
-	kprintf("data buffers:");
-	spinlock_lock(&spl_bio_bitmap);
-	int current = -1;
-	for (unsigned int i = 0; i < bio_bitmap_size * 8; i++) {
-		if((bio_bitmap[i / 8] & (1 << (i % 8))) != 0) {
-			/* This entry is used; need to show it */
-			if (current == -1)
-				kprintf(" %u", i);
-			current = i;
-			continue;
-		}
-		if (current != -1) {
-			kprintf("-%u", i);
-			current = -1;
+	unsigned int num_partial[BIO_NUM_SIZES];
+	for (unsigned int c = 0; c < BIO_NUM_SIZES; c++) {
+		num_partial[c] = 0;
+		LIST_FOREACH(&bio_partial[c], bp, struct BIO_PAGE) {
+			num_partial[c]++;
 		}
-		databuf_avail++;
 	}
-	if (current != -1)
-		kprintf("-%u\n", bio_bitmap_size * 8);
-	spinlock_unlock(&spl_bio_bitmap);
-	kprintf(" %u available (%u total)\n", databuf_avail, BIO_DATA_SIZE / BIO_SECTOR_SIZE);
-
-	KASSERT(databuf_avail <= (BIO_DATA_SIZE / BIO_SECTOR_SIZE), "more bio data available than total");
+	unsigned int num_pages = bio_num_pages;
+	unsigned int num_dirty = bio_num_dirty;
+	spinlock_unlock_unpremptible(&spl_bio, state);
+
+	kprintf("buffers: %u cached, %u in use, %u dirty, %u protected\n", num_bios, num_used, num_dirty, num_protected);
+	kprintf("buckets: %u of %u used, longest chain %u\n", num_buckets_used, num_buckets, longest_chain);
+	kprintf("data pages: %u (%u KB)\n", num_pages, num_pages * (PAGE_SIZE / 1024));
+	for (unsigned int c = 0; c < BIO_NUM_SIZES; c++)
+		kprintf("  %u byte slots: %u partially used page(s)\n", BIO_SECTOR_SIZE << c, num_partial[c]);
 }
 #endif /* KDB */
 
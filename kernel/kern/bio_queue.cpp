@@ -0,0 +1,387 @@
+/*
+ * Per-device request queues; these sit between the buffer cache and the
+ * device drivers.
+ *
+ * Reads and writes are queued separately, each sorted by block number, and
+ * handed to the device in ascending block order (wrapping back to the lowest
+ * block once the end is reached). Adjacent blocks going the same way are
+ * merged into a single request, as far as the driver can take them. Reads
+ * are preferred as someone is usually waiting for them, but this is bounded:
+ * writes get their turn after a number of read requests, and requests which
+ * have seen too many others go by are handled first regardless of position.
+ *
+ * We have no clock to speak of, so 'age' is measured in requests dispatched
+ * to the device since the request was queued.
+ *
+ * Only a limited number of requests is handed to the device at once; the
+ * remainder waits here, where it can still be sorted and merged. Completions
+ * wake up the 'bioqueue' thread, which takes care of dispatching more.
+ *
+ * As everything a device does passes through here, this is also where the
+ * per-device statistics are kept.
+ *
+ * Cache flushes are expensive and cover everything the device completed
+ * before they started, so they are shared: whoever asks for one while a
+ * flush is in progress waits for it, after which the first of the waiters
+ * issues a single flush on behalf of all of them (group commit).
+ */
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/device.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+#define BIO_QUEUE_READ		0
+#define BIO_QUEUE_WRITE		1
+
+#define BIO_DEADLINE_READ	16	/* Requests that may overtake a read */
+#define BIO_DEADLINE_WRITE	64	/* Requests that may overtake a write */
+#define BIO_READS_PER_WRITE	4	/* Read requests before waiting writes get a turn */
+
+LIST_DEFINE(BIO_QUEUE_LIST, struct BIO);
+
+struct BIO_QUEUE {
+	Ananas::Device* bq_device;
+	unsigned int bq_max_requests;	/* [RO] Requests the device takes at once */
+	unsigned int bq_max_bios;	/* [RO] Bio's the device takes per request */
+
+	spinlock_t bq_lock;		/* Protects everything below */
+	struct BIO_QUEUE_LIST bq_sorted[2];	/* Waiting bio's, by block */
+	struct BIO_QUEUE_LIST bq_fifo[2];	/* Waiting bio's, oldest first */
+	unsigned int bq_num_waiting;
+	unsigned int bq_in_flight;	/* Requests handed to the device */
+	unsigned int bq_clock;		/* Requests dispatched so far */
+	unsigned int bq_reads_in_row;	/* Read requests since the last write */
+	blocknr_t bq_position;		/* Block following the last request */
+	struct BIO_STATS bq_stats;	/* Cache hits/misses and queue depth are updated atomically */
+
+	mutex_t bq_flush_mtx;		/* Held while flushing; protects the fields below */
+	unsigned int bq_flush_gen;	/* Flushes started; read without the lock */
+	errorcode_t bq_flush_result;	/* Outcome of the most recent flush */
+
+	LIST_FIELDS(struct BIO_QUEUE);
+};
+
+LIST_DEFINE(BIO_QUEUES, struct BIO_QUEUE);
+
+static spinlock_t spl_bio_queues = SPINLOCK_DEFAULT_INIT;
+static struct BIO_QUEUES bio_queues;
+static mutex_t mtx_bio_queues_walk;	/* Keeps queues from being removed while the thread walks them */
+static semaphore_t bio_queue_sem;
+static thread_t bio_queue_thread;
+
+static struct BIO_QUEUE*
+bio_queue_get(Ananas::Device* device)
+{
+	struct BIO_QUEUE* bq = device->d_BIOQueue;
+	if (bq != NULL)
+		return bq;
+
+	auto ops = device->GetBIODeviceOperations();
+	auto new_bq = new BIO_QUEUE;
+	memset(new_bq, 0, sizeof(*new_bq));
+	new_bq->bq_device = device;
+	new_bq->bq_max_requests = ops->GetMaxBIORequests();
+	new_bq->bq_max_bios = ops->GetMaxBIOsPerRequest();
+	KASSERT(new_bq->bq_max_requests > 0 && new_bq->bq_max_bios > 0, "device %p takes no requests", device);
+	spinlock_init(&new_bq->bq_lock);
+	mutex_init(&new_bq->bq_flush_mtx, "bioflush");
+	for (unsigned int dir = BIO_QUEUE_READ; dir <= BIO_QUEUE_WRITE; dir++) {
+		LIST_INIT(&new_bq->bq_sorted[dir]);
+		LIST_INIT(&new_bq->bq_fifo[dir]);
+	}
+
+	spinlock_lock(&spl_bio_queues);
+	bq = device->d_BIOQueue;
+	if (bq == NULL) {
+		LIST_APPEND(&bio_queues, new_bq);
+		device->d_BIOQueue = new_bq;
+		bq = new_bq;
+		new_bq = NULL;
+	}
+	spinlock_unlock(&spl_bio_queues);
+	delete new_bq; /* lost the race, if non-NULL */
+	return bq;
+}
+
+static void
+bio_queue_insert_locked(struct BIO_QUEUE* bq, struct BIO* bio, unsigned int dir)
+{
+	/* Usually the blocks come in ascending order, so look from the end */
+	struct BIO* next = NULL;
+	LIST_FOREACH_REVERSE_IP(&bq->bq_sorted[dir], queue, it, struct BIO) {
+		if (it->block <= bio->block)
+			break;
+		next = it;
+	}
+	if (next != NULL) {
+		LIST_INSERT_BEFORE_IP(&bq->bq_sorted[dir], queue, next, bio);
+	} else {
+		LIST_APPEND_IP(&bq->bq_sorted[dir], queue, bio);
+	}
+	LIST_APPEND_IP(&bq->bq_fifo[dir], fifo, bio);
+	bio->io_seq = bq->bq_clock;
+	bio->io_next = NULL;
+	bq->bq_num_waiting++;
+
+	unsigned int depth = __atomic_add_fetch(&bq->bq_stats.bs_queue_depth, 1, __ATOMIC_RELAXED);
+	if (depth > bq->bq_stats.bs_queue_depth_max)
+		bq->bq_stats.bs_queue_depth_max = depth;
+}
+
+static inline bool
+bio_queue_expired(struct BIO_QUEUE* bq, unsigned int dir)
+{
+	struct BIO* bio = LIST_HEAD(&bq->bq_fifo[dir]);
+	unsigned int deadline = (dir == BIO_QUEUE_READ) ? BIO_DEADLINE_READ : BIO_DEADLINE_WRITE;
+	return bio != NULL && bq->bq_clock - bio->io_seq >= deadline;
+}
+
+/*
+ * Takes the next request off the queue; this is a chain of bio's of adjacent
+ * blocks, linked using io_next. Returns NULL if nothing is waiting.
+ */
+static struct BIO*
+bio_queue_next_locked(struct BIO_QUEUE* bq, unsigned int* dir_out)
+{
+	bool have_reads = !LIST_EMPTY(&bq->bq_sorted[BIO_QUEUE_READ]);
+	bool have_writes = !LIST_EMPTY(&bq->bq_sorted[BIO_QUEUE_WRITE]);
+	if (!have_reads && !have_writes)
+		return NULL;
+
+	unsigned int dir = BIO_QUEUE_READ;
+	if (!have_reads || (have_writes && (bq->bq_reads_in_row >= BIO_READS_PER_WRITE || bio_queue_expired(bq, BIO_QUEUE_WRITE))))
+		dir = BIO_QUEUE_WRITE;
+
+	/* Continue where the previous request left off, unless someone waited too long */
+	struct BIO* first;
+	if (bio_queue_expired(bq, dir)) {
+		first = LIST_HEAD(&bq->bq_fifo[dir]);
+	} else {
+		first = NULL;
+		LIST_FOREACH_IP(&bq->bq_sorted[dir], queue, it, struct BIO) {
+			if (it->block >= bq->bq_position) {
+				first = it;
+				break;
+			}
+		}
+		if (first == NULL)
+			first = LIST_HEAD(&bq->bq_sorted[dir]); /* wrap around */
+	}
+
+	/* Merge whatever follows directly */
+	struct BIO* last = first;
+	for (unsigned int num_bios = 1; num_bios < bq->bq_max_bios; num_bios++) {
+		struct BIO* next = LIST_NEXT_IP(last, queue);
+		if (next == NULL || next->block != last->block + last->length / BIO_SECTOR_SIZE)
+			break;
+		last->io_next = next;
+		last = next;
+	}
+	last->io_next = NULL;
+
+	uint64_t now = timer_get_ns();
+	for (struct BIO* bio = first; bio != NULL; bio = bio->io_next) {
+		LIST_REMOVE_IP(&bq->bq_sorted[dir], queue, bio);
+		LIST_REMOVE_IP(&bq->bq_fifo[dir], fifo, bio);
+		bio->flags |= BIO_FLAG_QUEUED | (dir == BIO_QUEUE_WRITE ? BIO_FLAG_QUEUED_WRITE : 0);
+		bio->io_start = now;
+		bq->bq_num_waiting--;
+		bq->bq_stats.bs_bytes[dir] += bio->length;
+	}
+	bq->bq_stats.bs_requests[dir]++;
+
+	bq->bq_position = last->block + last->length / BIO_SECTOR_SIZE;
+	bq->bq_clock++;
+	if (dir == BIO_QUEUE_READ)
+		bq->bq_reads_in_row++;
+	else
+		bq->bq_reads_in_row = 0;
+	bq->bq_in_flight++;
+	*dir_out = dir;
+	return first;
+}
+
+/* Hands requests to the device until it has enough of them */
+static void
+bio_queue_run(struct BIO_QUEUE* bq)
+{
+	auto ops = bq->bq_device->GetBIODeviceOperations();
+	while(1) {
+		unsigned int dir;
+		register_t state = spinlock_lock_unpremptible(&bq->bq_lock);
+		struct BIO* bio = NULL;
+		if (bq->bq_in_flight < bq->bq_max_requests)
+			bio = bio_queue_next_locked(bq, &dir);
+		spinlock_unlock_unpremptible(&bq->bq_lock, state);
+		if (bio == NULL)
+			break;
+
+		TRACE(BIO, INFO, "dev=%p, block=%u, dir=%u ==> dispatching", bq->bq_device, (int)bio->block, dir);
+		errorcode_t err = (dir == BIO_QUEUE_READ) ? ops->ReadBIO(*bio) : ops->WriteBIO(*bio);
+		if (ananas_is_success(err))
+			continue;
+
+		kprintf("bio_queue_run(): %s failed, %i\n", (dir == BIO_QUEUE_READ) ? "ReadBIO" : "WriteBIO", err);
+		while (bio != NULL) {
+			struct BIO* next = bio->io_next;
+			bio_set_error(bio);
+			bio = next;
+		}
+	}
+}
+
+void
+bio_queue_submit(struct BIO** bios, unsigned int num_bios, bool write)
+{
+	if (num_bios == 0)
+		return;
+	struct BIO_QUEUE* bq = bio_queue_get(bios[0]->device);
+
+	register_t state = spinlock_lock_unpremptible(&bq->bq_lock);
+	for (unsigned int n = 0; n < num_bios; n++) {
+		KASSERT(bios[n]->device == bq->bq_device, "bio %p for a different device", bios[n]);
+		bio_queue_insert_locked(bq, bios[n], write ? BIO_QUEUE_WRITE : BIO_QUEUE_READ);
+	}
+	spinlock_unlock_unpremptible(&bq->bq_lock, state);
+
+	bio_queue_run(bq);
+}
+
+void
+bio_queue_complete(struct BIO* bio)
+{
+	if ((bio->flags & BIO_FLAG_QUEUED) == 0)
+		return;
+	unsigned int dir = (bio->flags & BIO_FLAG_QUEUED_WRITE) ? BIO_QUEUE_WRITE : BIO_QUEUE_READ;
+	bio->flags &= ~(BIO_FLAG_QUEUED | BIO_FLAG_QUEUED_WRITE);
+	struct BIO_QUEUE* bq = bio->device->d_BIOQueue;
+	__atomic_sub_fetch(&bq->bq_stats.bs_queue_depth, 1, __ATOMIC_RELAXED);
+	if (bio->io_next != NULL)
+		return; /* the request isn't done until its final bio is */
+
+	/* Bucket n holds everything below 2^n microseconds */
+	uint64_t latency_us = (timer_get_ns() - bio->io_start) / 1000;
+	unsigned int bucket = 0;
+	while (bucket < BIO_STATS_LATENCY_BUCKETS - 1 && latency_us >= (1ULL << bucket))
+		bucket++;
+
+	/* This may be called from interrupt context; leave the dispatching to our thread */
+	register_t state = spinlock_lock_unpremptible(&bq->bq_lock);
+	KASSERT(bq->bq_in_flight > 0, "completing bio %p without requests in flight", bio);
+	bq->bq_in_flight--;
+	bq->bq_stats.bs_latency[dir][bucket]++;
+	bool wakeup = bq->bq_num_waiting > 0;
+	spinlock_unlock_unpremptible(&bq->bq_lock, state);
+	if (wakeup)
+		sem_signal(&bio_queue_sem);
+}
+
+errorcode_t
+bio_queue_flush(Ananas::Device* device)
+{
+	struct BIO_QUEUE* bq = bio_queue_get(device);
+
+	/*
+	 * A flush which starts after we got here covers all we wrote; if someone
+	 * else started one while we waited for the lock, it has completed by now.
+	 */
+	unsigned int gen = __atomic_load_n(&bq->bq_flush_gen, __ATOMIC_ACQUIRE);
+	mutex_lock(&bq->bq_flush_mtx);
+	if (bq->bq_flush_gen != gen) {
+		errorcode_t err = bq->bq_flush_result;
+		mutex_unlock(&bq->bq_flush_mtx);
+		return err;
+	}
+
+	__atomic_store_n(&bq->bq_flush_gen, gen + 1, __ATOMIC_RELEASE);
+	TRACE(BIO, INFO, "dev=%p ==> flushing cache", device);
+	errorcode_t err = device->GetBIODeviceOperations()->FlushCache();
+	if (ananas_is_failure(err))
+		kprintf("bio_queue_flush(): FlushCache failed, %i\n", err);
+	bq->bq_flush_result = err;
+	mutex_unlock(&bq->bq_flush_mtx);
+	return err;
+}
+
+void
+bio_queue_account_lookup(Ananas::Device* device, bool hit)
+{
+	struct BIO_QUEUE* bq = bio_queue_get(device);
+	__atomic_fetch_add(hit ? &bq->bq_stats.bs_cache_hits : &bq->bq_stats.bs_cache_misses, 1, __ATOMIC_RELAXED);
+}
+
+void
+bio_queue_destroy(Ananas::Device* device)
+{
+	struct BIO_QUEUE* bq = device->d_BIOQueue;
+	if (bq == NULL)
+		return;
+	KASSERT(bq->bq_num_waiting == 0 && bq->bq_in_flight == 0, "destroying queue of device %p with requests", device);
+
+	mutex_lock(&mtx_bio_queues_walk);
+	spinlock_lock(&spl_bio_queues);
+	LIST_REMOVE(&bio_queues, bq);
+	device->d_BIOQueue = NULL;
+	spinlock_unlock(&spl_bio_queues);
+	mutex_unlock(&mtx_bio_queues_walk);
+	delete bq;
+}
+
+bool
+bio_queue_get_stats(Ananas::Device* device, struct BIO_STATS* stats)
+{
+	struct BIO_QUEUE* bq = device->d_BIOQueue;
+	if (bq == NULL)
+		return false;
+
+	register_t state = spinlock_lock_unpremptible(&bq->bq_lock);
+	memcpy(stats, &bq->bq_stats, sizeof(*stats));
+	spinlock_unlock_unpremptible(&bq->bq_lock, state);
+	return true;
+}
+
+static void
+bio_queue_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&bio_queue_sem);
+
+		/*
+		 * Queues are only removed with mtx_bio_queues_walk held, so we can walk
+		 * the list without holding the spinlock - dispatching may sleep.
+		 */
+		mutex_lock(&mtx_bio_queues_walk);
+		spinlock_lock(&spl_bio_queues);
+		struct BIO_QUEUE* bq = LIST_HEAD(&bio_queues);
+		spinlock_unlock(&spl_bio_queues);
+		for (/* nothing */; bq != NULL; bq = LIST_NEXT(bq))
+			bio_queue_run(bq);
+		mutex_unlock(&mtx_bio_queues_walk);
+	}
+}
+
+static errorcode_t
+bio_queue_init()
+{
+	LIST_INIT(&bio_queues);
+	mutex_init(&mtx_bio_queues_walk, "bioqueues");
+	sem_init(&bio_queue_sem, 0);
+
+	/* Dispatching is what keeps the devices busy, so do not let it wait behind others */
+	kthread_init(&bio_queue_thread, "bioqueue", &bio_queue_thread_func, NULL);
+	bio_queue_thread.t_priority = THREAD_PRIORITY_DEFAULT - 1;
+	thread_resume(&bio_queue_thread);
+	return ananas_success();
+}
+
+INIT_FUNCTION(bio_queue_init, SUBSYSTEM_BIO, ORDER_MIDDLE);
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,89 @@
+/*
+ * Boot timeline; every event is written once into its own slot, so only
+ * claiming a slot needs to be atomic. Events are never removed.
+ */
+#include <ananas/types.h>
+#include <ananas/boottime.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/timer.h>
+#include "options.h"
+
+namespace {
+
+struct BOOTTIME_EVENT boottime_event[BOOTTIME_MAX_EVENTS];
+atomic_t boottime_next_event;
+
+unsigned int
+boottime_get_num_events()
+{
+	unsigned int num_events = atomic_read(&boottime_next_event);
+	return num_events < BOOTTIME_MAX_EVENTS ? num_events : BOOTTIME_MAX_EVENTS;
+}
+
+} // unnamed namespace
+
+void
+boottime_record(int type, uint64_t start_ns, errorcode_t err, const char* fmt, ...)
+{
+	uint64_t now = md_timer_get_ns();
+	int n = atomic_add(&boottime_next_event, 1);
+	if (n >= BOOTTIME_MAX_EVENTS)
+		return; /* timeline is full */
+
+	struct BOOTTIME_EVENT* be = &boottime_event[n];
+	be->be_error = err;
+	be->be_start = start_ns;
+	be->be_duration = now - start_ns;
+
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(be->be_name, sizeof(be->be_name), fmt, va);
+	va_end(va);
+
+	/* Setting the type last marks the event as complete */
+	__atomic_store_n(&be->be_type, type, __ATOMIC_RELEASE);
+}
+
+bool
+boottime_format(unsigned int n, char* line, size_t len)
+{
+	if (n >= boottime_get_num_events())
+		return false;
+
+	static const char* type_names[] = { "?", "init", "attach", "enumerate" };
+	const struct BOOTTIME_EVENT* be = &boottime_event[n];
+	int type = __atomic_load_n(&be->be_type, __ATOMIC_ACQUIRE);
+	if (type < 0 || type > BOOTTIME_TYPE_ENUMERATE)
+		type = 0;
+
+	uint64_t start_us = be->be_start / 1000;
+	snprintf(line, len, "%6u.%06u %10u %-9s %s", (unsigned int)(start_us / 1000000), (unsigned int)(start_us % 1000000),
+	 (unsigned int)(be->be_duration / 1000), type_names[type], type != 0 ? be->be_name : "");
+	size_t used = strlen(line);
+	if (ananas_is_failure(be->be_error))
+		snprintf(line + used, len - used, " (error %u)\n", ANANAS_ERROR_CODE(be->be_error));
+	else
+		snprintf(line + used, len - used, "\n");
+	return true;
+}
+
+void
+boottime_print()
+{
+	kprintf("boot timeline: start (s) / duration (us) / event\n");
+	char line[128];
+	for (unsigned int n = 0; boottime_format(n, line, sizeof(line)); n++)
+		kprintf("%s", line);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(boottime, NULL, "Display the boot timeline")
+{
+	boottime_print();
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
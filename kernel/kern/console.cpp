@@ -1,11 +1,14 @@
 #include <ananas/console.h>
 #include <ananas/device.h>
 #include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/thread.h>
 #include <ananas/tty.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 #include <ananas/lock.h>
 #include <ananas/debug-console.h>
+#include <machine/interrupts.h>
 #include "options.h"
 
 namespace Ananas {
@@ -32,6 +35,37 @@ static int console_backlog_pos = 0;
 static int console_backlog_overrun = 0;
 static mutex_t mtx_console;
 
+/*
+ * Once the console thread runs, output is not written to the devices by
+ * whoever prints it; instead, it is appended to a ring buffer which the
+ * console thread drains in large chunks. This keeps printing (and tracing)
+ * from stalling on the speed of the console devices.
+ *
+ * The ring holds records of a 32-bit header followed by the text, padded to
+ * a multiple of 4 bytes. Producers reserve space by advancing the head with
+ * a compare-and-swap, copy their text and then set the header's ready bit;
+ * nobody waits for anyone else. The consumer stops at the first record that
+ * is not ready yet, and zeroes everything it consumes so that a header
+ * which is not yet written always reads as 'not ready'.
+ */
+#define CONSOLE_RING_SIZE	16384	/* Must be a power of two */
+#define CONSOLE_RECORD_MAX	1024	/* Longer strings are split */
+#define CONSOLE_HDR_READY	0x80000000
+#define CONSOLE_HDR_LEN_MASK	0x0000ffff
+#define CONSOLE_DRAIN_CHUNK	512
+#define CONSOLE_POLL_INTERVAL	(100 * 1000000)	/* ns */
+
+static uint32_t console_ring[CONSOLE_RING_SIZE / sizeof(uint32_t)];
+static unsigned int console_ring_head;	/* Next byte to reserve */
+static unsigned int console_ring_tail;	/* Next byte to consume */
+static unsigned int console_ring_overrun;
+static int console_draining;	/* Set by whoever consumes the ring */
+static bool console_async = false;	/* Set once the console thread runs */
+static int console_sync_depth;	/* Nonzero in panic/kdb */
+static bool console_signalled = false;
+static semaphore_t console_sem;
+static thread_t console_thread;
+
 /* If set, display the driver list before attaching */
 #define VERBOSE_LIST 0
 
@@ -91,30 +125,184 @@ console_init()
 
 INIT_FUNCTION(console_init, SUBSYSTEM_CONSOLE, ORDER_MIDDLE);
 
-void
-console_putchar(int c)
+/* Writes straight to all console devices */
+static void
+console_output(const char* s, size_t len)
 {
 #ifdef OPTION_DEBUG_CONSOLE
-	debugcon_putch(c);
+	for (size_t n = 0; n < len; n++)
+		debugcon_putch(s[n]);
 #endif /* OPTION_DEBUG_CONSOLE */
 	if (console_tty == NULL)
 		return;
-	uint8_t ch = c; // cannot cast due to endianness!
-	size_t len = sizeof(ch);
+	console_tty->GetCharDeviceOperations()->Write((const void*)s, len, 0);
+}
 
-	console_tty->GetCharDeviceOperations()->Write((const void*)&ch, len, 0);
+static inline char*
+console_ring_byte(unsigned int pos)
+{
+	return reinterpret_cast<char*>(console_ring) + (pos % CONSOLE_RING_SIZE);
+}
+
+static inline uint32_t*
+console_ring_header(unsigned int pos)
+{
+	return &console_ring[(pos % CONSOLE_RING_SIZE) / sizeof(uint32_t)];
+}
+
+/* Appends a record to the ring; returns false if there was no room */
+static bool
+console_ring_put(const char* s, size_t len)
+{
+	unsigned int need = sizeof(uint32_t) + ((len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1));
+	unsigned int head = __atomic_load_n(&console_ring_head, __ATOMIC_RELAXED);
+	do {
+		unsigned int tail = __atomic_load_n(&console_ring_tail, __ATOMIC_ACQUIRE);
+		if (head - tail + need > CONSOLE_RING_SIZE) {
+			__atomic_add_fetch(&console_ring_overrun, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&console_ring_head, &head, head + need, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	for (size_t n = 0; n < len; n++)
+		*console_ring_byte(head + sizeof(uint32_t) + n) = s[n];
+	__atomic_store_n(console_ring_header(head), CONSOLE_HDR_READY | len, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Writes everything that is ready to the console devices. Only one consumer
+ * may be active; returns false if someone else already is.
+ */
+static bool
+console_ring_drain()
+{
+	if (__atomic_exchange_n(&console_draining, 1, __ATOMIC_ACQUIRE))
+		return false;
+
+	char chunk[CONSOLE_DRAIN_CHUNK];
+	size_t chunk_len = 0;
+	unsigned int tail = __atomic_load_n(&console_ring_tail, __ATOMIC_RELAXED);
+	while (tail != __atomic_load_n(&console_ring_head, __ATOMIC_ACQUIRE)) {
+		uint32_t hdr = __atomic_load_n(console_ring_header(tail), __ATOMIC_ACQUIRE);
+		if ((hdr & CONSOLE_HDR_READY) == 0)
+			break; /* still being written; its producer will signal us */
+
+		size_t len = hdr & CONSOLE_HDR_LEN_MASK;
+		if (chunk_len + len > sizeof(chunk)) {
+			console_output(chunk, chunk_len);
+			chunk_len = 0;
+		}
+		for (size_t n = 0; n < len; n++)
+			chunk[chunk_len++] = *console_ring_byte(tail + sizeof(uint32_t) + n);
+
+		/* Hand the space back, cleared */
+		unsigned int total = sizeof(uint32_t) + ((len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1));
+		for (unsigned int n = 0; n < total; n += sizeof(uint32_t))
+			*console_ring_header(tail + n) = 0;
+		tail += total;
+		__atomic_store_n(&console_ring_tail, tail, __ATOMIC_RELEASE);
+	}
+	if (chunk_len > 0)
+		console_output(chunk, chunk_len);
+
+	unsigned int overrun = __atomic_exchange_n(&console_ring_overrun, 0, __ATOMIC_RELAXED);
+	if (overrun > 0) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "[***OVERRUN: %u messages lost***]\n", overrun);
+		console_output(msg, strlen(msg));
+	}
+
+	__atomic_store_n(&console_draining, 0, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void
+console_wakeup()
+{
+	/*
+	 * Waking the thread involves the scheduler, which may well be what is
+	 * printing with its lock held; if interrupts are disabled, don't bother
+	 * and let the console thread pick things up when it polls.
+	 */
+	if (!md_interrupts_save())
+		return;
+	if (!__atomic_exchange_n(&console_signalled, true, __ATOMIC_ACQ_REL))
+		sem_signal(&console_sem);
+}
+
+static void
+console_enqueue(const char* s, size_t len)
+{
+	while (len > 0) {
+		size_t chunk = (len > CONSOLE_RECORD_MAX) ? CONSOLE_RECORD_MAX : len;
+		if (!console_ring_put(s, chunk))
+			break;
+		s += chunk;
+		len -= chunk;
+	}
+	console_wakeup();
+}
+
+static inline bool
+console_is_async()
+{
+	return __atomic_load_n(&console_async, __ATOMIC_ACQUIRE) &&
+	 __atomic_load_n(&console_sync_depth, __ATOMIC_ACQUIRE) == 0;
+}
+
+void
+console_enter_synchronous()
+{
+	__atomic_add_fetch(&console_sync_depth, 1, __ATOMIC_ACQ_REL);
+
+	/*
+	 * Get whatever is still queued out first, so that it appears before what
+	 * follows; if the console thread was interrupted while draining, we
+	 * can't and the text will have to wait until we leave.
+	 */
+	console_ring_drain();
+}
+
+void
+console_leave_synchronous()
+{
+	__atomic_sub_fetch(&console_sync_depth, 1, __ATOMIC_ACQ_REL);
+	if (console_is_async())
+		console_wakeup();
+}
+
+void
+console_putchar(int c)
+{
+	char ch = c;
+	if (console_is_async()) {
+		console_enqueue(&ch, sizeof(ch));
+		return;
+	}
+	console_output(&ch, sizeof(ch));
 }
 
 static void
 console_puts(const char* s)
 {
-	for (int c = *s++; c != 0; c = *s++)
-		console_putchar(c);
+	console_output(s, strlen(s));
 }
 
 void
 console_putstring(const char* s)
 {
+	if (console_is_async()) {
+		console_enqueue(s, strlen(s));
+		return;
+	}
+
+	/* In panic and kdb, everything else is stopped; just write it */
+	if (__atomic_load_n(&console_sync_depth, __ATOMIC_ACQUIRE) > 0) {
+		console_puts(s);
+		return;
+	}
+
 	if (console_mutex_inuse && !mutex_trylock(&mtx_console)) {
 		/*
 		 * Couldn't obtain the console mutex; we should put our message in the
@@ -139,8 +327,7 @@ console_putstring(const char* s)
 	/* See if there's anything in the backlog that we can print */
 	if (console_backlog_pos > 0) {
 		register_t state = spinlock_lock_unpremptible(&console_backlog_lock);
-		for (int n = 0; n < console_backlog_pos; n++)
-			console_putchar(console_backlog[n]);
+		console_output(console_backlog, console_backlog_pos);
 		console_backlog_pos = 0;
 
 		if (console_backlog_overrun)
@@ -153,6 +340,30 @@ console_putstring(const char* s)
 		mutex_unlock(&mtx_console);
 }
 
+static void
+console_thread_func(void* context)
+{
+	while(1) {
+		sem_wait_timeout(&console_sem, CONSOLE_POLL_INTERVAL);
+		__atomic_store_n(&console_signalled, false, __ATOMIC_RELEASE);
+		console_ring_drain();
+	}
+}
+
+static errorcode_t
+start_console_thread()
+{
+	sem_init(&console_sem, 0);
+	kthread_init(&console_thread, "console", &console_thread_func, NULL);
+	thread_resume(&console_thread);
+
+	/* Anything printed from now on goes through the ring */
+	__atomic_store_n(&console_async, true, __ATOMIC_RELEASE);
+	return ananas_success();
+}
+
+INIT_FUNCTION(start_console_thread, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
 uint8_t
 console_getchar()
 {
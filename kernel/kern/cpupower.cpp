@@ -0,0 +1,117 @@
+/*
+ * CPU power management policy; see <ananas/cpupower.h>. The machine-dependant
+ * code knows how to enter the idle states and how to steer the frequency; we
+ * decide which to use.
+ *
+ * Changing the mode bumps a generation number; every CPU compares it to the
+ * one it applied as it goes idle, so the frequency policy is only ever set up
+ * by the CPU itself. Idle CPUs are kicked so that they do so right away; busy
+ * ones pick it up once they run out of work.
+ */
+#include <ananas/types.h>
+#include <ananas/cpupower.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/pcpu.h>
+#include <ananas/tunable.h>
+
+namespace {
+
+const char* const cpupower_mode_name[] = { "performance", "balanced", "powersave" };
+
+unsigned int cpupower_mode = CPUPOWER_MODE_BALANCED;
+unsigned int cpupower_generation = 1;
+unsigned int cpupower_num_idle_states; /* 0 until probed */
+
+/* Returns whether all CPUs sharing a physical core with pcpu are idle */
+bool
+cpupower_core_is_idle(struct PCPU* pcpu)
+{
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* sibling = pcpu_get(n);
+		if (sibling == nullptr || sibling == pcpu || sibling->sched_core != pcpu->sched_core)
+			continue;
+		if (!sibling->power_idle)
+			return false;
+	}
+	return true;
+}
+
+void
+cpupower_mode_changed(struct TUNABLE* t)
+{
+	__atomic_add_fetch(&cpupower_generation, 1, __ATOMIC_RELEASE);
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu != nullptr && pcpu->power_idle)
+			md_pcpu_reschedule(pcpu);
+	}
+}
+
+errorcode_t
+cpupower_init()
+{
+	unsigned int num_states = md_cpupower_probe();
+	KASSERT(num_states >= 1, "no idle states?");
+	if (num_states > CPUPOWER_MAX_IDLE_STATES)
+		num_states = CPUPOWER_MAX_IDLE_STATES;
+	__atomic_store_n(&cpupower_num_idle_states, num_states, __ATOMIC_RELEASE);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+void
+cpupower_idle(struct PCPU* pcpu)
+{
+	unsigned int num_states = __atomic_load_n(&cpupower_num_idle_states, __ATOMIC_ACQUIRE);
+	if (num_states == 0) {
+		/* Not set up yet; plain C1 will do */
+		md_cpu_idle();
+		return;
+	}
+
+	unsigned int mode = __atomic_load_n(&cpupower_mode, __ATOMIC_RELAXED);
+	unsigned int generation = __atomic_load_n(&cpupower_generation, __ATOMIC_ACQUIRE);
+	if (pcpu->power_generation != generation) {
+		md_cpupower_apply(mode, pcpu->power_descr, sizeof(pcpu->power_descr));
+		pcpu->power_generation = generation;
+	}
+
+	/*
+	 * Our siblings look at power_idle to see if they may go into a deep state,
+	 * so it must be visible before we decide based on theirs.
+	 */
+	__atomic_store_n(&pcpu->power_idle, 1, __ATOMIC_SEQ_CST);
+	unsigned int state = 0;
+	if (mode != CPUPOWER_MODE_PERFORMANCE && num_states > 1 && cpupower_core_is_idle(pcpu))
+		state = num_states - 1;
+	pcpu->power_idle_count[state]++;
+	md_cpu_idle_state(pcpu, state);
+	__atomic_store_n(&pcpu->power_idle, 0, __ATOMIC_RELAXED);
+}
+
+bool
+cpupower_format(unsigned int n, char* line, size_t len)
+{
+	struct PCPU* pcpu = pcpu_get(n);
+	if (pcpu == nullptr)
+		return false;
+
+	unsigned int num_states = __atomic_load_n(&cpupower_num_idle_states, __ATOMIC_ACQUIRE);
+	snprintf(line, len, "cpu%u mode %s core %u %s", n, cpupower_mode_name[cpupower_mode], pcpu->sched_core,
+	 pcpu->power_idle ? "idle" : "busy");
+	for (unsigned int s = 0; s < num_states; s++) {
+		size_t l = strlen(line);
+		snprintf(line + l, len - l, " %s %u", md_cpupower_idle_state_name(s), (unsigned int)pcpu->power_idle_count[s]);
+	}
+	size_t l = strlen(line);
+	snprintf(line + l, len - l, " %s\n", (pcpu->power_descr[0] != '\0') ? pcpu->power_descr : "-");
+	return true;
+}
+
+INIT_FUNCTION(cpupower_init, SUBSYSTEM_SCHEDULER, ORDER_FIRST);
+TUNABLE_UINT("cpu.power_mode", cpupower_mode, CPUPOWER_MODE_PERFORMANCE, CPUPOWER_MODE_POWERSAVE, cpupower_mode_changed, "0 = performance, 1 = balanced, 2 = powersave");
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,175 @@
+/*
+ * Per-CPU deferred work queues.
+ *
+ * Every CPU has two FIFO's: one with work that can run at interrupt exit and
+ * one with work for the worker thread of the CPU. Both are only touched by
+ * their own CPU with interrupts disabled, so they need no lock. The worker is
+ * signalled at most once until it has run, so a burst of queued work costs a
+ * single wakeup.
+ */
+#include <ananas/types.h>
+#include <machine/interrupts.h>
+#include <ananas/deferred.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+#include <ananas/thread.h>
+
+/* Maximum number of items run at interrupt exit; the worker gets the rest */
+#define DEFERRED_IRQ_BATCH	16
+
+namespace {
+
+struct DEFERRED_LIST {
+	struct DEFERRED_WORK* dl_head;
+	struct DEFERRED_WORK* dl_tail;
+};
+
+struct DEFERRED_QUEUE {
+	struct DEFERRED_LIST dq_irq;		/* may run at interrupt exit */
+	struct DEFERRED_LIST dq_thread;		/* needs the worker */
+	bool dq_wakeup;				/* worker signalled but not yet running */
+	bool dq_ready;				/* worker exists */
+	thread_t dq_worker;
+	semaphore_t dq_sem;
+} __attribute__((aligned(64)));
+
+struct DEFERRED_QUEUE deferred_cpu[PCPU_MAX_CPUS];
+
+inline void
+deferred_append(struct DEFERRED_LIST& dl, struct DEFERRED_WORK* dw)
+{
+	dw->dw_next = nullptr;
+	if (dl.dl_tail != nullptr)
+		dl.dl_tail->dw_next = dw;
+	else
+		dl.dl_head = dw;
+	dl.dl_tail = dw;
+}
+
+inline struct DEFERRED_WORK*
+deferred_pop(struct DEFERRED_LIST& dl)
+{
+	struct DEFERRED_WORK* dw = dl.dl_head;
+	if (dw == nullptr)
+		return nullptr;
+	dl.dl_head = dw->dw_next;
+	if (dl.dl_head == nullptr)
+		dl.dl_tail = nullptr;
+
+	/* From here on, it can be queued again */
+	__atomic_and_fetch(&dw->dw_flags, ~DEFERRED_FLAG_QUEUED, __ATOMIC_ACQ_REL);
+	return dw;
+}
+
+/* Must be called with interrupts disabled */
+inline void
+deferred_wakeup(struct DEFERRED_QUEUE& dq)
+{
+	if (dq.dq_wakeup || !__atomic_load_n(&dq.dq_ready, __ATOMIC_ACQUIRE))
+		return;
+	dq.dq_wakeup = true;
+	sem_signal(&dq.dq_sem);
+}
+
+void
+deferred_worker(void* context)
+{
+	auto& dq = *static_cast<struct DEFERRED_QUEUE*>(context);
+
+	while (1) {
+		sem_wait(&dq.dq_sem);
+
+		int state = md_interrupts_save_and_disable();
+		dq.dq_wakeup = false;
+		while (1) {
+			struct DEFERRED_WORK* dw = deferred_pop(dq.dq_thread);
+			if (dw == nullptr)
+				dw = deferred_pop(dq.dq_irq);
+			if (dw == nullptr)
+				break;
+
+			md_interrupts_restore(state);
+			dw->dw_func(dw->dw_context);
+			state = md_interrupts_save_and_disable();
+		}
+		md_interrupts_restore(state);
+	}
+}
+
+errorcode_t
+deferred_start()
+{
+	for (unsigned int cpu = 0; cpu < pcpu_get_count(); cpu++) {
+		auto& dq = deferred_cpu[cpu];
+		sem_init(&dq.dq_sem, 0);
+
+		char name[32];
+		snprintf(name, sizeof(name), "deferred:cpu%u", cpu);
+		kthread_init(&dq.dq_worker, name, &deferred_worker, &dq);
+		dq.dq_worker.t_affinity = THREAD_AFFINITY_CPU(cpu);
+		dq.dq_worker.t_priority = THREAD_PRIORITY_INTERRUPT;
+		thread_resume(&dq.dq_worker);
+
+		/* Anything queued so far is waiting for the worker; get it going */
+		__atomic_store_n(&dq.dq_ready, true, __ATOMIC_SEQ_CST);
+		sem_signal(&dq.dq_sem);
+	}
+	return ananas_success();
+}
+
+INIT_FUNCTION(deferred_start, SUBSYSTEM_THREAD, ORDER_MIDDLE);
+
+} // unnamed namespace
+
+void
+deferred_init(struct DEFERRED_WORK* dw, deferred_func_t func, void* context, unsigned int flags)
+{
+	KASSERT((flags & ~DEFERRED_FLAG_THREAD) == 0, "invalid flags %x", flags);
+	dw->dw_func = func;
+	dw->dw_context = context;
+	dw->dw_flags = flags;
+	dw->dw_next = nullptr;
+}
+
+bool
+deferred_queue(struct DEFERRED_WORK* dw)
+{
+	unsigned int flags = __atomic_fetch_or(&dw->dw_flags, DEFERRED_FLAG_QUEUED, __ATOMIC_ACQ_REL);
+	if (flags & DEFERRED_FLAG_QUEUED)
+		return false;
+
+	int state = md_interrupts_save_and_disable();
+	auto& dq = deferred_cpu[PCPU_GET(cpuid)];
+	bool in_irq = PCPU_GET(nested_irq) > 0;
+	if (flags & DEFERRED_FLAG_THREAD)
+		deferred_append(dq.dq_thread, dw);
+	else
+		deferred_append(dq.dq_irq, dw);
+
+	/* Outside of an interrupt, nothing else is going to pick it up */
+	if ((flags & DEFERRED_FLAG_THREAD) || !in_irq)
+		deferred_wakeup(dq);
+	md_interrupts_restore(state);
+	return true;
+}
+
+void
+deferred_run_irq()
+{
+	auto& dq = deferred_cpu[PCPU_GET(cpuid)];
+	for (unsigned int n = 0; n < DEFERRED_IRQ_BATCH; n++) {
+		struct DEFERRED_WORK* dw = deferred_pop(dq.dq_irq);
+		if (dw == nullptr)
+			return;
+		dw->dw_func(dw->dw_context);
+	}
+
+	/* Don't hold up whoever we interrupted any longer */
+	if (dq.dq_irq.dl_head != nullptr)
+		deferred_wakeup(dq);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -1,6 +1,8 @@
+#include <ananas/bio.h>
 #include <ananas/console.h>
 #include <ananas/device.h>
 #include <ananas/lib.h>
+#include "options.h"
 
 namespace Ananas {
 
@@ -16,6 +18,7 @@ Device::Device()
 	all_next = NULL; all_prev = NULL;
 	children_next = NULL; children_prev = NULL;
 	sem_init(&d_Waiters, 1);
+	event_source_init(&d_Events);
 	LIST_INIT(&d_Children);
 }
 
@@ -26,11 +29,15 @@ Device::Device(const CreateDeviceProperties& cdp)
 	all_next = NULL; all_prev = NULL;
 	children_next = NULL; children_prev = NULL;
 	sem_init(&d_Waiters, 1);
+	event_source_init(&d_Events);
 	LIST_INIT(&d_Children);
 }
 
 Device::~Device()
 {
+#ifdef OPTION_BIO
+	bio_queue_destroy(this);
+#endif
 	DeviceManager::internal::OnDeviceDestruction(*this);
 }
 
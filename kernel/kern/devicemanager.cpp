@@ -1,13 +1,17 @@
+#include <ananas/boottime.h>
+#include <ananas/cmdline.h>
 #include <ananas/console.h>
 #include <ananas/device.h>
 #include <ananas/driver.h>
 #include <ananas/error.h>
+#include <ananas/init.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 #include <ananas/kmem.h>
 #include <ananas/tty.h>
 #include <ananas/thread.h>
+#include <ananas/timer.h>
 #include <ananas/vfs/mount.h>
 #include <ananas/vm.h>
 #include "options.h"
@@ -17,14 +21,47 @@ namespace Ananas {
 namespace DriverManager {
 namespace internal {
 Ananas::DriverList& GetDriverList();
+size_t GetCandidateDrivers(const Device& bus, const ResourceSet* resourceSet, Driver** candidates, size_t max);
 } // namespace internal
 } // namespace DriverManager
 
 namespace DeviceManager {
 
+namespace internal {
+void DeinstantiateDevice(Device& device);
+} // namespace internal
+
 namespace {
 
 int currentMajor = 1;
+spinlock_t spl_instantiate = SPINLOCK_DEFAULT_INIT; /* Protects major/unit assignment */
+
+/*
+ * Devices whose driver allows it are attached by a pool of worker threads,
+ * so that slow attaches (controllers which have to reset and identify what
+ * is connected to them) overlap. Every device that is being attached, by a
+ * worker or directly, is on the 'running' list; a queued device whose driver
+ * declares dependencies is only picked up once no device of those drivers
+ * is queued or being attached, and its parent bus is done.
+ */
+#define ATTACH_WORKERS 4
+
+struct AttachJob {
+	Device* aj_device;
+	Driver* aj_driver;	/* nullptr for devices attached directly */
+	LIST_FIELDS(AttachJob);
+};
+LIST_DEFINE(AttachJobList, AttachJob);
+
+spinlock_t spl_attach = SPINLOCK_DEFAULT_INIT;
+AttachJobList attachQueue;
+AttachJobList attachRunning;
+unsigned int attachPending = 0;	/* Queued and being attached by a worker */
+unsigned int attachIdleWaiters = 0;
+semaphore_t attachQueueSem;
+semaphore_t attachIdleSem;
+bool attachWorkersStarted = false;
+thread_t attachWorkers[ATTACH_WORKERS];
 
 void PrintAttachment(Device& device)
 {
@@ -34,6 +71,109 @@ void PrintAttachment(Device& device)
 	kprintf("\n");
 }
 
+/* Must be called with spl_attach held */
+bool CanAttachNow(const AttachJob& job)
+{
+	const Driver& driver = *job.aj_driver;
+	if (driver.GetAttachDependencies() == nullptr)
+		return true;
+
+	LIST_FOREACH(&attachRunning, aj, AttachJob) {
+		if (aj->aj_device == job.aj_device->d_Parent || driver.MustAttachAfter(aj->aj_device->d_Name))
+			return false;
+	}
+	LIST_FOREACH(&attachQueue, aj, AttachJob) {
+		if (aj != &job && driver.MustAttachAfter(aj->aj_device->d_Name))
+			return false;
+	}
+	return true;
+}
+
+void AttachWorker(void*)
+{
+	while (true) {
+		sem_wait(&attachQueueSem);
+
+		spinlock_lock(&spl_attach);
+		AttachJob* job = nullptr;
+		LIST_FOREACH(&attachQueue, aj, AttachJob) {
+			if (CanAttachNow(*aj)) {
+				job = aj;
+				break;
+			}
+		}
+		if (job == nullptr) {
+			/* Everything is waiting for something; we'll be woken up when that's done */
+			spinlock_unlock(&spl_attach);
+			continue;
+		}
+		LIST_REMOVE(&attachQueue, job);
+		LIST_APPEND(&attachRunning, job);
+		spinlock_unlock(&spl_attach);
+
+		if (ananas_is_failure(AttachSingle(*job->aj_device)))
+			internal::DeinstantiateDevice(*job->aj_device);
+
+		spinlock_lock(&spl_attach);
+		LIST_REMOVE(&attachRunning, job);
+		unsigned int waiters = 0;
+		if (--attachPending == 0) {
+			waiters = attachIdleWaiters;
+			attachIdleWaiters = 0;
+		}
+		spinlock_unlock(&spl_attach);
+		delete job;
+
+		/* Queued devices may have been waiting for this one */
+		sem_signal(&attachQueueSem);
+		while (waiters-- > 0)
+			sem_signal(&attachIdleSem);
+	}
+}
+
+/*
+ * Attaches the device, either by queueing it for the workers or directly;
+ * returns false only if a direct attach failed, in which case the device is
+ * gone.
+ */
+bool AttachOrQueue(Device& device, Driver& driver)
+{
+	if (attachWorkersStarted && (driver.CanAttachAsynchronously() || driver.GetAttachDependencies() != nullptr)) {
+		auto job = new AttachJob;
+		job->aj_device = &device;
+		job->aj_driver = &driver;
+
+		spinlock_lock(&spl_attach);
+		LIST_APPEND(&attachQueue, job);
+		attachPending++;
+		spinlock_unlock(&spl_attach);
+		sem_signal(&attachQueueSem);
+		return true;
+	}
+
+	if (ananas_is_success(AttachSingle(device)))
+		return true;
+
+	internal::DeinstantiateDevice(device);
+	return false;
+}
+
+errorcode_t StartAttachWorkers()
+{
+	/* 'attach_sync' on the command line attaches everything in probe order */
+	if (cmdline_get_string("attach_sync") != nullptr)
+		return ananas_success();
+
+	sem_init(&attachQueueSem, 0);
+	sem_init(&attachIdleSem, 0);
+	for (unsigned int n = 0; n < ATTACH_WORKERS; n++) {
+		kthread_init(&attachWorkers[n], "attach", &AttachWorker, nullptr);
+		thread_resume(&attachWorkers[n]);
+	}
+	attachWorkersStarted = true;
+	return ananas_success();
+}
+
 } // unnamed namespace
 
 namespace internal {
@@ -69,15 +209,15 @@ void Unregister(Device& device)
 
 Device* InstantiateDevice(Driver& driver, const CreateDeviceProperties& cdp)
 {
-	// XXX we need locking for currentunit / major / currentMajor
-	if (driver.d_Major == 0)
-		driver.d_Major = currentMajor++;
-
 	Device* device = driver.CreateDevice(cdp);
 	if (device != nullptr) {
 		strcpy(device->d_Name, driver.d_Name);
+		spinlock_lock(&spl_instantiate);
+		if (driver.d_Major == 0)
+			driver.d_Major = currentMajor++;
 		device->d_Major = driver.d_Major;
 		device->d_Unit = driver.d_CurrentUnit++;
+		spinlock_unlock(&spl_instantiate);
 	}
 	return device;
 }
@@ -88,12 +228,14 @@ Device* ProbeConsole(ConsoleDriver& driver)
 	if (device == nullptr)
 		return nullptr;
 
-	// XXX duplication, locking etc
+	// XXX duplication
+	strcpy(device->d_Name, driver.d_Name);
+	spinlock_lock(&spl_instantiate);
 	if (driver.d_Major == 0)
 		driver.d_Major = currentMajor++;
-	strcpy(device->d_Name, driver.d_Name);
 	device->d_Major = driver.d_Major;
 	device->d_Unit = driver.d_CurrentUnit++;
+	spinlock_unlock(&spl_instantiate);
 	return device;
 }
 
@@ -115,18 +257,42 @@ AttachSingle(Device& device)
 	if (device.d_Parent != nullptr)
 		PrintAttachment(device);
 
-	errorcode_t err = device.GetDeviceOperations().Attach();
-	ANANAS_ERROR_RETURN(err);
+	/* Make sure anything that must wait for us, does */
+	AttachJob inProgress;
+	inProgress.aj_device = &device;
+	inProgress.aj_driver = nullptr;
+	spinlock_lock(&spl_attach);
+	LIST_APPEND(&attachRunning, &inProgress);
+	spinlock_unlock(&spl_attach);
 
-	/* Hook the device up to the tree */
-	internal::Register(device);
+	/* Children are attached below, so this only covers the device itself */
+	uint64_t start = md_timer_get_ns();
+	errorcode_t err = device.GetDeviceOperations().Attach();
 	if (device.d_Parent != nullptr)
-		LIST_APPEND_IP(&device.d_Parent->d_Children, children, &device);
+		boottime_record(BOOTTIME_TYPE_ATTACH, start, err, "%s%u on %s%u", device.d_Name, device.d_Unit, device.d_Parent->d_Name, device.d_Parent->d_Unit);
+	else
+		boottime_record(BOOTTIME_TYPE_ATTACH, start, err, "%s%u", device.d_Name, device.d_Unit);
+
+	if (ananas_is_success(err)) {
+		/* Hook the device up to the tree */
+		internal::Register(device);
+		if (device.d_Parent != nullptr) {
+			spinlock_lock(&internal::spl_devicequeue);
+			LIST_APPEND_IP(&device.d_Parent->d_Children, children, &device);
+			spinlock_unlock(&internal::spl_devicequeue);
+		}
 
-	/* Attempt to attach child devices, if any */
-	AttachBus(device);
+		/* Attempt to attach child devices, if any */
+		AttachBus(device);
+	}
 
-	return ananas_success();
+	spinlock_lock(&spl_attach);
+	LIST_REMOVE(&attachRunning, &inProgress);
+	bool queued = !LIST_EMPTY(&attachQueue);
+	spinlock_unlock(&spl_attach);
+	if (queued)
+		sem_signal(&attachQueueSem); /* someone may have waited for us */
+	return err;
 }
 
 errorcode_t
@@ -167,20 +333,22 @@ AttachChild(Device& bus, const Ananas::ResourceSet& resourceSet)
 	if (LIST_EMPTY(&driverList))
 		return nullptr;
 
+	/* Only bother the drivers which may be interested in this device */
+	Driver* candidates[DRIVER_MAX_CANDIDATES];
+	size_t num_candidates = Ananas::DriverManager::internal::GetCandidateDrivers(bus, &resourceSet, candidates, DRIVER_MAX_CANDIDATES);
+
 	CreateDeviceProperties cdp(bus, resourceSet);
-	LIST_FOREACH_SAFE(&driverList, d, Driver) {
-		if (!d->MustProbeOnBus(bus))
-			continue; /* bus cannot contain this device */
+	for (size_t n = 0; n < num_candidates; n++) {
+		Driver* d = candidates[n];
 
 		/* Hook the device to this driver and try to attach it */
 		Device* device = internal::InstantiateDevice(*d, cdp);
 		if (device == nullptr)
 			continue;
-		if (ananas_is_success(AttachSingle(*device)))
+		if (AttachOrQueue(*device, *d))
 			return device;
 
-		// Attach failed - get rid of the device
-		internal::DeinstantiateDevice(*device);
+		// Attach failed - the device is already gone
 	}
 
 	return nullptr;
@@ -206,9 +374,10 @@ AttachBus(Device& bus)
 	 */
 	Ananas::Device* input_dev = tty_get_inputdev(console_tty);
 	Ananas::Device* output_dev = tty_get_outputdev(console_tty);
-	LIST_FOREACH_SAFE(&driverList, d, Driver) {
-		if (!d->MustProbeOnBus(bus))
-			continue; /* bus cannot contain this device */
+	Driver* candidates[DRIVER_MAX_CANDIDATES];
+	size_t num_candidates = Ananas::DriverManager::internal::GetCandidateDrivers(bus, nullptr, candidates, DRIVER_MAX_CANDIDATES);
+	for (size_t n = 0; n < num_candidates; n++) {
+		Driver* d = candidates[n];
 
 		/*
 		 * If we found the driver for the in- or output driver, display it (they are
@@ -234,12 +403,27 @@ AttachBus(Device& bus)
 		if (device == nullptr)
 			continue;
 
-		if (ananas_is_failure(AttachSingle(*device))) {
-			internal::DeinstantiateDevice(*device); // attach failed; discard the device
-		}
+		AttachOrQueue(*device, *d); // discards the device if the attach fails
 	}
 }
 
+/*
+ * Waits until all queued device attaches are done; this must not be called
+ * from anything that is attached by a worker.
+ */
+void
+WaitForAttach()
+{
+	spinlock_lock(&spl_attach);
+	if (attachPending == 0) {
+		spinlock_unlock(&spl_attach);
+		return;
+	}
+	attachIdleWaiters++;
+	spinlock_unlock(&spl_attach);
+	sem_wait(&attachIdleSem);
+}
+
 Device*
 FindDevice(const char* name)
 {
@@ -289,6 +473,14 @@ CreateDevice(const char* driver, const Ananas::CreateDeviceProperties& cdp)
 
 } // namespace Ananas
 
+static errorcode_t
+start_attach_workers()
+{
+	return Ananas::DeviceManager::StartAttachWorkers();
+}
+
+INIT_FUNCTION(start_attach_workers, SUBSYSTEM_DEVICE, ORDER_FIRST);
+
 #ifdef OPTION_KDB
 static int
 print_devices(Ananas::Device* parent, int indent)
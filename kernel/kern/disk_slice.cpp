@@ -49,22 +49,47 @@ public:
 	errorcode_t ReadBIO(struct BIO& bio) override;
 	errorcode_t WriteBIO(struct BIO& bio) override;
 
+	unsigned int GetMaxBIORequests() override
+	{
+		return d_Parent->GetBIODeviceOperations()->GetMaxBIORequests();
+	}
+
+	unsigned int GetMaxBIOsPerRequest() override
+	{
+		return d_Parent->GetBIODeviceOperations()->GetMaxBIOsPerRequest();
+	}
+
+	Ananas::Device* ResolveBIOBlock(blocknr_t& block) override
+	{
+		block += slice_first_block;
+		return d_Parent;
+	}
+
 private:
+	void TranslateBIO(struct BIO& bio);
+
 	blocknr_t	slice_first_block = 0;
 	blocknr_t slice_length = 0;
 };
 
+void
+Slice::TranslateBIO(struct BIO& bio)
+{
+	for (struct BIO* b = &bio; b != NULL; b = b->io_next)
+		b->io_block = b->block + slice_first_block;
+}
+
 errorcode_t
 Slice::ReadBIO(struct BIO& bio)
 {
-	bio.io_block = bio.block + slice_first_block;
+	TranslateBIO(bio);
 	return d_Parent->GetBIODeviceOperations()->ReadBIO(bio);
 }
 
 errorcode_t
 Slice::WriteBIO(struct BIO& bio)
 {
-	bio.io_block = bio.block + slice_first_block;
+	TranslateBIO(bio);
 	return d_Parent->GetBIODeviceOperations()->WriteBIO(bio);
 }
 
@@ -551,6 +551,13 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define LACKS_TIME_H
 #define LACKS_UNISTD_H
 
+/*
+ * Ananas: kmalloc() uses one mspace per CPU; footers are needed so that
+ * kfree() can figure out which mspace owns a given chunk.
+ */
+#define ONLY_MSPACES 1
+#define FOOTERS 1
+
 #define MALLOC_FAILURE_ACTION panic("out of memory")
 #define ABORT panic("abort")
 #define USE_DL_PREFIX
@@ -558,8 +565,13 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 # define CORRUPTION_ERROR_ACTION(m) panic("corruption detected, m=%p", m)
 # define USAGE_ERROR_ACTION(m,p) panic("bad usage detect, m=%p, p=%p", m, p)
 
-/* Extra sanity checks; these help catching memory overwrite bugs */
+/*
+ * Extra sanity checks; these help catching memory overwrite bugs, but walk
+ * chunks and bins on every call - so they are left out of PERFORMANCE kernels.
+ */
+#ifndef OPTION_PERFORMANCE
 #define DEBUG 1
+#endif
 
 #define EINVAL -1
 #define ENOMEM -2
@@ -1374,6 +1386,14 @@ DLMALLOC_EXPORT void* mspace_malloc(mspace msp, size_t bytes);
 */
 DLMALLOC_EXPORT void mspace_free(mspace msp, void* mem);
 
+#ifdef __Ananas__
+/*
+  Ananas: mspace_owner returns the space from which mem was allocated.
+  This requires FOOTERS.
+*/
+DLMALLOC_EXPORT mspace mspace_owner(void* mem);
+#endif /* __Ananas__ */
+
 /*
   mspace_realloc behaves as realloc, but operates within
   the given space.
@@ -5772,6 +5792,12 @@ void mspace_free(mspace msp, void* mem) {
   }
 }
 
+#ifdef __Ananas__
+mspace mspace_owner(void* mem) {
+  return (mspace)get_mstate_for(mem2chunk(mem));
+}
+#endif /* __Ananas__ */
+
 void* mspace_calloc(mspace msp, size_t n_elements, size_t elem_size) {
   void* mem;
   size_t req = 0;
@@ -6,6 +6,8 @@
 #include <ananas/error.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/list.h>
+#include <ananas/lock.h>
 #include <ananas/kmem.h>
 #include <ananas/mm.h>
 #include <ananas/page.h>
@@ -15,6 +17,30 @@
 
 TRACE_SETUP;
 
+/* Number of freed buffers a tag keeps around for reuse */
+#define DMA_TAG_CACHE_MAX 8
+
+struct DMA_BUFFER;
+LIST_DEFINE(dma_buffer_list, struct DMA_BUFFER);
+
+/*
+ * Bounce page; used to load data the device cannot reach by itself. These are
+ * kept on the tag while free and on the buffer while loaded.
+ */
+struct DMA_BOUNCE {
+	struct PAGE* b_page;
+	void* b_virt;
+	dma_addr_t b_phys;
+
+	/* Data bounced and how, if loaded */
+	void* b_data;
+	dma_size_t b_size;
+	int b_flags;
+
+	LIST_FIELDS(struct DMA_BOUNCE);
+};
+LIST_DEFINE(dma_bounce_list, struct DMA_BOUNCE);
+
 struct DMA_TAG {
 	/* Parent tag, if any */
 	struct DMA_TAG* t_parent;
@@ -36,6 +62,16 @@ struct DMA_TAG {
 
 	/* Maximum size per segment */
 	dma_size_t t_max_seg_size;
+
+	/* Protects the lists below and the bounce pages of our buffers */
+	spinlock_t t_lock;
+
+	/* Freed buffers, ready to be handed out again */
+	struct dma_buffer_list t_cache;
+	unsigned int t_cache_count;
+
+	/* Bounce pages not in use */
+	struct dma_bounce_list t_bounce_free;
 };
 
 /*
@@ -46,9 +82,61 @@ struct DMA_BUFFER {
 	dma_size_t db_size;
 	dma_size_t db_seg_size;
 	unsigned int db_num_segs;
+	struct dma_bounce_list db_bounce;	/* bounce pages in use by loads */
+	LIST_FIELDS(struct DMA_BUFFER);
 	struct DMA_BUFFER_SEGMENT db_seg[0];
 };
 
+namespace {
+
+void*
+dma_alloc_pages(dma_tag_t tag, dma_size_t size, struct PAGE** page)
+{
+	int vm_flags = VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE;
+	if (tag->t_min_addr == 0 && tag->t_max_addr == DMA_ADDR_MAX_ANY)
+		return page_alloc_length_mapped(size, page, vm_flags);
+	return page_alloc_length_mapped_range(size, tag->t_min_addr, tag->t_max_addr, page, vm_flags);
+}
+
+/* Releases the buffer and the memory backing it; the tag reference is left alone */
+void
+dma_buf_release(dma_buf_t buf)
+{
+	/*
+	 * We need to be vigilant when freeing stuff; it may be that the buffer was
+	 * partially initialized (as dma_buf_alloc() can call us)
+	 */
+	for (unsigned int n = 0; n < buf->db_num_segs; n++) {
+		struct DMA_BUFFER_SEGMENT* s = &buf->db_seg[n];
+		if (s->s_virt != NULL)
+			kmem_unmap(s->s_virt, buf->db_seg_size);
+		if (s->s_page != NULL)
+			page_free(s->s_page);
+	}
+	kfree(buf);
+}
+
+bool
+dma_is_reachable(dma_tag_t tag, void* data, dma_size_t size, dma_addr_t* phys)
+{
+	*phys = kmem_get_phys(data);
+	if (*phys < tag->t_min_addr || *phys + size - 1 > tag->t_max_addr)
+		return false;
+	if (size > tag->t_max_seg_size)
+		return false;
+	if (tag->t_alignment > 1 && (*phys & (tag->t_alignment - 1)) != 0)
+		return false;
+
+	/* Data spanning multiple pages must be physically contiguous, as we pass a single segment */
+	addr_t va = reinterpret_cast<addr_t>(data);
+	for (addr_t page = ROUND_DOWN(va, PAGE_SIZE) + PAGE_SIZE; page < va + size; page += PAGE_SIZE)
+		if (kmem_get_phys(reinterpret_cast<void*>(page)) != *phys + (page - va))
+			return false;
+	return true;
+}
+
+} // unnamed namespace
+
 errorcode_t
 dma_tag_create(dma_tag_t parent, Ananas::Device& dev, dma_tag_t* tag, int alignment, dma_addr_t min_addr, dma_addr_t max_addr, unsigned int max_segs, dma_size_t max_seg_size)
 {
@@ -83,6 +171,9 @@ dma_tag_create(dma_tag_t parent, Ananas::Device& dev, dma_tag_t* tag, int alignm
 	t->t_max_addr = max_addr;
 	t->t_max_segs = max_segs;
 	t->t_max_seg_size = max_seg_size;
+	spinlock_init(&t->t_lock);
+	LIST_INIT(&t->t_cache);
+	LIST_INIT(&t->t_bounce_free);
 	*tag = t;
 	return ananas_success();
 }
@@ -90,12 +181,28 @@ dma_tag_create(dma_tag_t parent, Ananas::Device& dev, dma_tag_t* tag, int alignm
 errorcode_t
 dma_tag_destroy(dma_tag_t tag)
 {
+	if (tag == NULL)
+		return ananas_success();
 	struct DMA_TAG* parent = tag->t_parent;
 
 	/* Remove a reference; if we still have more, we do nothing */
 	if (--tag->t_refcount > 0)
 		return ananas_success();
 
+	/* Nothing can use the tag anymore, so its cached buffers and bounce pages can go */
+	while (!LIST_EMPTY(&tag->t_cache)) {
+		struct DMA_BUFFER* b = LIST_HEAD(&tag->t_cache);
+		LIST_POP_HEAD(&tag->t_cache);
+		dma_buf_release(b);
+	}
+	while (!LIST_EMPTY(&tag->t_bounce_free)) {
+		struct DMA_BOUNCE* b = LIST_HEAD(&tag->t_bounce_free);
+		LIST_POP_HEAD(&tag->t_bounce_free);
+		kmem_unmap(b->b_virt, PAGE_SIZE);
+		page_free(b->b_page);
+		delete b;
+	}
+
 	/* Remove our tag and try to kill the parent */
 	kfree(tag);
 	return dma_tag_destroy(parent);
@@ -104,6 +211,20 @@ dma_tag_destroy(dma_tag_t tag)
 errorcode_t
 dma_buf_alloc(dma_tag_t tag, dma_size_t size, dma_buf_t* buf)
 {
+	/* If we have a buffer of this size lying around, just hand it out again */
+	register_t state = spinlock_lock_unpremptible(&tag->t_lock);
+	LIST_FOREACH(&tag->t_cache, b, struct DMA_BUFFER) {
+		if (b->db_size != size)
+			continue;
+		LIST_REMOVE(&tag->t_cache, b);
+		tag->t_cache_count--;
+		tag->t_refcount++;
+		spinlock_unlock_unpremptible(&tag->t_lock, state);
+		*buf = b;
+		return ananas_success();
+	}
+	spinlock_unlock_unpremptible(&tag->t_lock, state);
+
 	/* First step is to see how many segments we need */
 	unsigned int num_segs = 1;
 	dma_size_t seg_size = size;
@@ -123,13 +244,13 @@ dma_buf_alloc(dma_tag_t tag, dma_size_t size, dma_buf_t* buf)
 	b->db_size = size;
 	b->db_seg_size = seg_size;
 	b->db_num_segs = num_segs;
-	tag->t_refcount++;
+	LIST_INIT(&b->db_bounce);
 
 	/* ...and any memory backed by it */
 	errorcode_t err = ananas_success();
 	for (unsigned int n = 0; ananas_is_success(err) && n < num_segs; n++) {
 		struct DMA_BUFFER_SEGMENT* s = &b->db_seg[n];
-		s->s_virt = page_alloc_length_mapped(seg_size, &s->s_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE);
+		s->s_virt = dma_alloc_pages(tag, seg_size, &s->s_page);
 		if (s->s_virt == NULL) {
 			err = ANANAS_ERROR(OUT_OF_MEMORY);
 			break;
@@ -137,10 +258,13 @@ dma_buf_alloc(dma_tag_t tag, dma_size_t size, dma_buf_t* buf)
 		s->s_phys = page_get_paddr(s->s_page);
 	}
 
-	if (ananas_is_success(err))
-		*buf = b;
-	else
-		dma_buf_free(b);
+	if (ananas_is_failure(err)) {
+		dma_buf_release(b);
+		return err;
+	}
+
+	tag->t_refcount++;
+	*buf = b;
 	return err;
 }
 
@@ -148,20 +272,19 @@ void
 dma_buf_free(dma_buf_t buf)
 {
 	dma_tag_t tag = buf->db_tag;
-
-	/*
-	 * We need to be vigilant when freeing stuff; it may be that the buffer was
-	 * partially initialized (as dma_buf_alloc() can call us)
-	 */
-	for (unsigned int n = 0; n < buf->db_num_segs; n++) {
-		struct DMA_BUFFER_SEGMENT* s = &buf->db_seg[n];
-		if (s->s_virt != NULL)
-			kmem_unmap(s->s_virt, buf->db_seg_size);
-		if (s->s_page != NULL)
-			page_free(s->s_page);
+	KASSERT(LIST_EMPTY(&buf->db_bounce), "freeing buffer %p with bounced data", buf);
+
+	/* Keep the buffer around if we can; the next allocation of this size gets it */
+	register_t state = spinlock_lock_unpremptible(&tag->t_lock);
+	bool cached = tag->t_cache_count < DMA_TAG_CACHE_MAX;
+	if (cached) {
+		LIST_PREPEND(&tag->t_cache, buf);
+		tag->t_cache_count++;
 	}
-	kfree(buf);
+	spinlock_unlock_unpremptible(&tag->t_lock, state);
 
+	if (!cached)
+		dma_buf_release(buf);
 	dma_tag_destroy(tag);
 }
 
@@ -194,20 +317,57 @@ dma_buf_load(dma_buf_t buf, void* data, dma_size_t size, dma_load_func_t load, v
 {
 	dma_tag_t tag = buf->db_tag;
 
-	addr_t phys = kmem_get_phys(data);
-	if (phys >= tag->t_min_addr && phys + size <= tag->t_max_addr &&
-	    size < tag->t_max_seg_size &&
-	    (phys & tag->t_alignment) == 0) {
+	struct DMA_BUFFER_SEGMENT bs;
+	bs.s_page = NULL;
+	bs.s_virt = data;
+	if (dma_is_reachable(tag, data, size, &bs.s_phys)) {
 		/* This is excellent; the device can accept this buffer as-is */
-		struct DMA_BUFFER_SEGMENT bs;
-		bs.s_page = NULL;
-		bs.s_phys = phys;
-		load(load_arg, &bs, 1);
+		return load(load_arg, &bs, 1);
+	}
 
-		return ananas_success();
+	/* The device can't get to the data; we'll have to go by a bounce page */
+	if (size > PAGE_SIZE)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	register_t state = spinlock_lock_unpremptible(&tag->t_lock);
+	struct DMA_BOUNCE* bounce = NULL;
+	LIST_FOREACH(&buf->db_bounce, b, struct DMA_BOUNCE) {
+		if (b->b_data == data) {
+			bounce = b; /* loaded again, i.e. after the previous load was rejected */
+			break;
+		}
 	}
+	if (bounce == NULL && !LIST_EMPTY(&tag->t_bounce_free)) {
+		bounce = LIST_HEAD(&tag->t_bounce_free);
+		LIST_POP_HEAD(&tag->t_bounce_free);
+		LIST_APPEND(&buf->db_bounce, bounce);
+	}
+	spinlock_unlock_unpremptible(&tag->t_lock, state);
+
+	if (bounce == NULL) {
+		/* No bounce pages left; the tag grows a new one, which it keeps once we are done */
+		bounce = new DMA_BOUNCE;
+		bounce->b_virt = dma_alloc_pages(tag, PAGE_SIZE, &bounce->b_page);
+		if (bounce->b_virt == NULL) {
+			delete bounce;
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		}
+		bounce->b_phys = page_get_paddr(bounce->b_page);
+		state = spinlock_lock_unpremptible(&tag->t_lock);
+		LIST_APPEND(&buf->db_bounce, bounce);
+		spinlock_unlock_unpremptible(&tag->t_lock, state);
+	}
+	bounce->b_data = data;
+	bounce->b_size = size;
+	bounce->b_flags = flags;
 
-	panic("dma_buf_load(): phys %p rejected, FIXME", phys);
+	if (flags & DMA_LOAD_FLAG_WRITE)
+		memcpy(bounce->b_virt, data, size);
+
+	bs.s_page = bounce->b_page;
+	bs.s_virt = bounce->b_virt;
+	bs.s_phys = bounce->b_phys;
+	return load(load_arg, &bs, 1);
 }
 
 errorcode_t
@@ -216,4 +376,31 @@ dma_buf_load_bio(dma_buf_t buf, struct BIO* bio, dma_load_func_t load, void* loa
 	return dma_buf_load(buf, BIO_DATA(bio), bio->length, load, load_arg, flags);
 }
 
+void
+dma_buf_unload(dma_buf_t buf, void* data)
+{
+	dma_tag_t tag = buf->db_tag;
+
+	register_t state = spinlock_lock_unpremptible(&tag->t_lock);
+	LIST_FOREACH_SAFE(&buf->db_bounce, b, struct DMA_BOUNCE) {
+		if (b->b_data != data)
+			continue;
+		LIST_REMOVE(&buf->db_bounce, b);
+
+		/* Hand whatever the device wrote to the owner of the data */
+		if (b->b_flags & DMA_LOAD_FLAG_READ)
+			memcpy(data, b->b_virt, b->b_size);
+		b->b_data = NULL;
+		LIST_PREPEND(&tag->t_bounce_free, b);
+		break;
+	}
+	spinlock_unlock_unpremptible(&tag->t_lock, state);
+}
+
+void
+dma_buf_unload_bio(dma_buf_t buf, struct BIO* bio)
+{
+	dma_buf_unload(buf, BIO_DATA(bio));
+}
+
 /* vim:set ts=2 sw=2: */
@@ -7,20 +7,22 @@
 
 namespace Ananas {
 
-bool Driver::MustProbeOnBus(const Device& bus) const
+namespace {
+
+/* Returns true if 'name' is in the comma-separated list 'ptr' */
+bool IsInList(const char* ptr, const char* name)
 {
-	const char* ptr = GetBussesToProbeOn();
 	if (ptr == nullptr)
 		return false;
 
-	size_t bus_name_len = strlen(bus.d_Name);
+	size_t name_len = strlen(name);
 	while(*ptr != '\0') {
 		const char* next = strchr(ptr, ',');
 		if (next == NULL)
 			next = strchr(ptr, '\0');
 
 		size_t len = next - ptr;
-		if (bus_name_len == len && strncmp(ptr, bus.d_Name, len) == 0) {
+		if (name_len == len && strncmp(ptr, name, len) == 0) {
 			return true;
 		}
 
@@ -32,6 +34,18 @@ bool Driver::MustProbeOnBus(const Device& bus) const
 	return false;
 }
 
+} // unnamed namespace
+
+bool Driver::MustProbeOnBus(const Device& bus) const
+{
+	return IsInList(GetBussesToProbeOn(), bus.d_Name);
+}
+
+bool Driver::MustAttachAfter(const char* driver) const
+{
+	return IsInList(GetAttachDependencies(), driver);
+}
+
 } // namespace Ananas
 
 /* vim:set ts=2 sw=2: */
@@ -1,5 +1,8 @@
+#include <ananas/device.h>
 #include <ananas/driver.h>
+#include <ananas/init.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 
 namespace Ananas {
 
@@ -7,6 +10,125 @@ namespace DriverManager {
 
 namespace {
 static Ananas::DriverList driverList; /* XXX not locked yet */
+
+/*
+ * To avoid offering every new device to every driver, we keep an index per
+ * bus type: drivers without a match table are listed as-is, and all entries
+ * of the match tables are sorted on (type, mask, value) so that the drivers
+ * for a given resource value can be found using a binary search. Every
+ * entry has the position of its driver in the driver list, so that the
+ * candidates can be returned in priority order.
+ *
+ * The index is built the first time a bus type is probed, and thrown away
+ * whenever the driver list changes.
+ */
+#define DRIVER_INDEX_BUSSES 16
+
+struct IndexEntry {
+	Resource::Type ie_Type;	/* RT_Unused for drivers without a table */
+	Resource::Base ie_Mask;
+	Resource::Base ie_Value;
+	unsigned int ie_Rank;
+	Driver* ie_Driver;
+};
+
+struct BusIndex {
+	char bi_Bus[64];
+	IndexEntry* bi_Entry;
+	size_t bi_NumEntries;
+};
+
+mutex_t mtx_index;
+BusIndex busIndex[DRIVER_INDEX_BUSSES];
+unsigned int busIndexNext = 0;
+
+bool IndexEntryLess(const IndexEntry& a, const IndexEntry& b)
+{
+	if (a.ie_Type != b.ie_Type)
+		return a.ie_Type < b.ie_Type;
+	if (a.ie_Mask != b.ie_Mask)
+		return a.ie_Mask < b.ie_Mask;
+	return a.ie_Value < b.ie_Value;
+}
+
+void InvalidateIndex()
+{
+	mutex_lock(&mtx_index);
+	for (auto& bi: busIndex) {
+		delete[] bi.bi_Entry;
+		bi.bi_Entry = nullptr;
+		bi.bi_NumEntries = 0;
+		bi.bi_Bus[0] = '\0';
+	}
+	mutex_unlock(&mtx_index);
+}
+
+/* Must be called with mtx_index held */
+BusIndex& BuildIndex(const Device& bus)
+{
+	BusIndex& bi = busIndex[busIndexNext];
+	busIndexNext = (busIndexNext + 1) % DRIVER_INDEX_BUSSES;
+	delete[] bi.bi_Entry;
+
+	size_t num_entries = 0;
+	LIST_FOREACH(&driverList, d, Driver) {
+		if (!d->MustProbeOnBus(bus))
+			continue;
+		const DriverMatch* dm = d->GetMatchTable();
+		if (dm == nullptr) {
+			num_entries++;
+			continue;
+		}
+		for (/* nothing */; dm->dm_Type != Resource::RT_Unused; dm++)
+			num_entries++;
+	}
+
+	bi.bi_Entry = new IndexEntry[num_entries];
+	bi.bi_NumEntries = num_entries;
+	strcpy(bi.bi_Bus, bus.d_Name);
+
+	size_t n = 0;
+	unsigned int rank = 0;
+	LIST_FOREACH(&driverList, d, Driver) {
+		rank++;
+		if (!d->MustProbeOnBus(bus))
+			continue;
+		const DriverMatch* dm = d->GetMatchTable();
+		if (dm == nullptr) {
+			bi.bi_Entry[n++] = { Resource::RT_Unused, 0, 0, rank, d };
+			continue;
+		}
+		for (/* nothing */; dm->dm_Type != Resource::RT_Unused; dm++)
+			bi.bi_Entry[n++] = { dm->dm_Type, dm->dm_Mask, dm->dm_Value & dm->dm_Mask, rank, d };
+	}
+
+	/* Sort the entries; there aren't many, so insertion sort will do */
+	for (size_t i = 1; i < num_entries; i++) {
+		IndexEntry ie = bi.bi_Entry[i];
+		size_t j = i;
+		for (/* nothing */; j > 0 && IndexEntryLess(ie, bi.bi_Entry[j - 1]); j--)
+			bi.bi_Entry[j] = bi.bi_Entry[j - 1];
+		bi.bi_Entry[j] = ie;
+	}
+	return bi;
+}
+
+/* Adds the entry's driver to the candidates, keeping them sorted by rank */
+void AddCandidate(const IndexEntry& ie, const IndexEntry** candidates, size_t& num_candidates, size_t max)
+{
+	size_t n = 0;
+	for (/* nothing */; n < num_candidates && candidates[n]->ie_Rank < ie.ie_Rank; n++)
+		;
+	if (n < num_candidates && candidates[n]->ie_Driver == ie.ie_Driver)
+		return; /* already have this one */
+	if (num_candidates == max)
+		return;
+
+	memmove(&candidates[n + 1], &candidates[n], (num_candidates - n) * sizeof(candidates[0]));
+	candidates[n] = &ie;
+	num_candidates++;
+}
+
 } // unnamed namespace
 
 namespace internal {
@@ -16,10 +138,72 @@ Ananas::DriverList& GetDriverList()
 	return driverList;
 }
 
+/*
+ * Fills 'candidates' with the drivers which may handle a device with the
+ * given resources on 'bus', in priority order; if resourceSet is nullptr,
+ * all drivers for the bus are returned.
+ */
+size_t GetCandidateDrivers(const Device& bus, const ResourceSet* resourceSet, Driver** candidates, size_t max)
+{
+	const IndexEntry* found[DRIVER_MAX_CANDIDATES];
+	size_t num_found = 0;
+	if (max > DRIVER_MAX_CANDIDATES)
+		max = DRIVER_MAX_CANDIDATES;
+
+	mutex_lock(&mtx_index);
+	BusIndex* bi = nullptr;
+	for (auto& b: busIndex) {
+		if (b.bi_Entry != nullptr && strcmp(b.bi_Bus, bus.d_Name) == 0) {
+			bi = &b;
+			break;
+		}
+	}
+	if (bi == nullptr)
+		bi = &BuildIndex(bus);
+
+	size_t n = 0;
+	while (n < bi->bi_NumEntries) {
+		const IndexEntry& first = bi->bi_Entry[n];
+
+		/* Find the range of entries with the same type and mask */
+		size_t end = n + 1;
+		while (end < bi->bi_NumEntries && bi->bi_Entry[end].ie_Type == first.ie_Type && bi->bi_Entry[end].ie_Mask == first.ie_Mask)
+			end++;
+
+		const Resource* res = (resourceSet != nullptr && first.ie_Type != Resource::RT_Unused) ? resourceSet->GetResource(first.ie_Type, 0) : nullptr;
+		if (first.ie_Type == Resource::RT_Unused || resourceSet == nullptr) {
+			/* Generic drivers, or we are asked for everything */
+			for (size_t i = n; i < end; i++)
+				AddCandidate(bi->bi_Entry[i], found, num_found, max);
+		} else if (res != nullptr) {
+			/* Locate the first entry with our value */
+			Resource::Base value = res->r_Base & first.ie_Mask;
+			size_t lo = n, hi = end;
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (bi->bi_Entry[mid].ie_Value < value)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			for (/* nothing */; lo < end && bi->bi_Entry[lo].ie_Value == value; lo++)
+				AddCandidate(bi->bi_Entry[lo], found, num_found, max);
+		}
+		n = end;
+	}
+
+	for (size_t i = 0; i < num_found; i++)
+		candidates[i] = found[i]->ie_Driver;
+	mutex_unlock(&mtx_index);
+	return num_found;
+}
+
 } // namespace internal
 
 errorcode_t Register(Driver& driver)
 {
+	InvalidateIndex();
+
 	// Insert the driver in-place - we want to keep the driver list sorted on
 	// priority as this simplifies things (we can just look for the first driver
 	// that matches)
@@ -36,6 +220,8 @@ errorcode_t Register(Driver& driver)
 
 errorcode_t Unregister(const char* name)
 {
+	InvalidateIndex();
+
 	LIST_FOREACH_SAFE(&driverList, d, Driver) {
 		if (strcmp(d->d_Name, name) != 0)
 			continue;
@@ -49,4 +235,13 @@ errorcode_t Unregister(const char* name)
 } // namespace DriverManager
 } // namespace Ananas
 
+static errorcode_t
+drivermanager_init()
+{
+	mutex_init(&Ananas::DriverManager::mtx_index, "driverindex");
+	return ananas_success();
+}
+
+INIT_FUNCTION(drivermanager_init, SUBSYSTEM_DRIVER, ORDER_FIRST);
+
 /* vim:set ts=2 sw=2: */
@@ -4,9 +4,11 @@
 #include <ananas/lib.h>
 #include <ananas/exec.h>
 #include <ananas/process.h>
+#include <ananas/procinfo.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
 #include <ananas/vm.h>
+#include <ananas/vfs/types.h>
 #include <ananas/vmspace.h>
 #include <elf.h>
 
@@ -33,7 +35,7 @@ read_data(struct DENTRY* dentry, void* buf, off_t offset, size_t len)
 
 #ifdef __amd64__
 static errorcode_t
-elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
+elf64_parse(struct DENTRY* dentry, struct EXEC_IMAGE* image)
 {
 	errorcode_t err;
 	Elf64_Ehdr ehdr;
@@ -49,7 +51,7 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
 		return ANANAS_ERROR(BAD_EXEC);
 	if (ehdr.e_ident[EI_VERSION] != EV_CURRENT)
 		return ANANAS_ERROR(BAD_EXEC);
-	if (ehdr.e_type != ET_EXEC)
+	if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
 		return ANANAS_ERROR(BAD_EXEC);
 
 	/* XXX This specifically checks for amd64 at the moment */
@@ -66,27 +68,63 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
 		return ANANAS_ERROR(BAD_EXEC);
 #endif
 
-	/* We only support static binaries for now, so reject anything without a program table */
+	/* Reject anything without a program table; there would be nothing to load */
 	if (ehdr.e_phnum == 0)
 		return ANANAS_ERROR(BAD_EXEC);
 	if (ehdr.e_phentsize < sizeof(Elf64_Phdr))
 		return ANANAS_ERROR(BAD_EXEC);
 
-	/* Map all program headers one by one */
+	/* Fetch the entire program header table at once */
+	size_t phsize = ehdr.e_phnum * ehdr.e_phentsize;
+	if (phsize > PAGE_SIZE)
+		return ANANAS_ERROR(BAD_EXEC);
+	auto ph = static_cast<char*>(kmalloc(phsize));
+	err = read_data(dentry, ph, ehdr.e_phoff, phsize);
+	if (ananas_is_failure(err)) {
+		kfree(ph);
+		return err;
+	}
+
+	image->ei_entry = ehdr.e_entry;
+	image->ei_relocatable = ehdr.e_type == ET_DYN;
+	image->ei_phdr = 0;
+	image->ei_phnum = ehdr.e_phnum;
+	image->ei_interp[0] = '\0';
+	image->ei_num_segments = 0;
 	for (unsigned int i = 0; i < ehdr.e_phnum; i++) {
-		Elf64_Phdr phdr;
-		err = read_data(dentry, &phdr, ehdr.e_phoff + i * ehdr.e_phentsize, sizeof(phdr));
-		ANANAS_ERROR_RETURN(err);
-		if (phdr.p_type != PT_LOAD)
+		const Elf64_Phdr* phdr = reinterpret_cast<const Elf64_Phdr*>(ph + i * ehdr.e_phentsize);
+		if (phdr->p_type == PT_INTERP) {
+			/* Dynamically linked; the runtime linker is loaded along with us */
+			if (phdr->p_filesz < 2 || phdr->p_filesz > sizeof(image->ei_interp))
+				err = ANANAS_ERROR(BAD_EXEC);
+			else
+				err = read_data(dentry, image->ei_interp, phdr->p_offset, phdr->p_filesz);
+			if (ananas_is_success(err) && image->ei_interp[phdr->p_filesz - 1] != '\0')
+				err = ANANAS_ERROR(BAD_EXEC);
+			if (ananas_is_failure(err)) {
+				kfree(ph);
+				return err;
+			}
+			continue;
+		}
+		if (phdr->p_type != PT_LOAD)
 			continue;
 
+		/* The runtime linker needs the program headers; see which segment holds them */
+		if (ehdr.e_phoff >= phdr->p_offset && ehdr.e_phoff + phsize <= phdr->p_offset + phdr->p_filesz)
+			image->ei_phdr = phdr->p_vaddr + (ehdr.e_phoff - phdr->p_offset);
+		if (image->ei_num_segments == EXEC_IMAGE_MAX_SEGMENTS) {
+			kfree(ph);
+			return ANANAS_ERROR(BAD_EXEC);
+		}
+
 		/* Construct the flags for the actual mapping */
 		unsigned int flags = VM_FLAG_ALLOC | VM_FLAG_LAZY | VM_FLAG_USER;
-		if (phdr.p_flags & PF_R)
+		if (phdr->p_flags & PF_R)
 			flags |= VM_FLAG_READ;
-		if (phdr.p_flags & PF_W)
+		if (phdr->p_flags & PF_W)
 			flags |= VM_FLAG_WRITE;
-		if (phdr.p_flags & PF_X)
+		if (phdr->p_flags & PF_X)
 			flags |= VM_FLAG_EXECUTE;
 
 		// If this mapping is writable, do not share it
@@ -96,16 +134,86 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
 		/*
 		 * The program need not begin at a page-size, so we may need to adjust.
 		 */
-		vmarea_t* va;
-		addr_t virt_begin = ROUND_DOWN(phdr.p_vaddr, PAGE_SIZE);
-		addr_t virt_end   = ROUND_UP((phdr.p_vaddr + phdr.p_memsz), PAGE_SIZE);
-		off_t vskip = phdr.p_vaddr - virt_begin;
-		TRACE(EXEC, INFO, "elf map: vbegin=%p vend=%p vskip=%d offset=%d filesz=%d\n", virt_begin, virt_end, vskip, phdr.p_offset, phdr.p_filesz);
-		err = vmspace_mapto_dentry(vs, virt_begin, vskip, virt_end - virt_begin, dentry, phdr.p_offset, phdr.p_filesz, flags, &va);
-		ANANAS_ERROR_RETURN(err);
+		addr_t virt_begin = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
+		addr_t virt_end   = ROUND_UP((phdr->p_vaddr + phdr->p_memsz), PAGE_SIZE);
+		struct EXEC_SEGMENT* es = &image->ei_segment[image->ei_num_segments++];
+		es->es_virt = virt_begin;
+		es->es_vskip = phdr->p_vaddr - virt_begin;
+		es->es_vlength = virt_end - virt_begin;
+		es->es_doffset = phdr->p_offset;
+		es->es_dlength = phdr->p_filesz;
+		es->es_flags = flags;
 	}
+	kfree(ph);
+	return ananas_success();
+}
+
+/* Returns the parsed image of dentry, parsing it only if we haven't done so since it was last changed */
+static errorcode_t
+elf64_get_image(struct DENTRY* dentry, struct EXEC_IMAGE* image)
+{
+	struct VFS_INODE* inode = dentry->d_inode;
+	if (exec_image_lookup(inode, image))
+		return ananas_success();
+
+	errorcode_t err = elf64_parse(dentry, image);
+	ANANAS_ERROR_RETURN(err);
+	exec_image_store(inode, image);
+	return ananas_success();
+}
 
-	*exec_addr = ehdr.e_entry;
+/*
+ * Loads the runtime linker of a dynamically linked program; it must be
+ * position-independent and cannot have a runtime linker of its own.
+ */
+static errorcode_t
+elf64_load_interp(vmspace_t* vs, const char* path, addr_t* exec_addr)
+{
+	struct DENTRY* dentry;
+	errorcode_t err = vfs_lookup(NULL, &dentry, path);
+	ANANAS_ERROR_RETURN(err);
+
+	struct EXEC_IMAGE image;
+	err = elf64_get_image(dentry, &image);
+	if (ananas_is_success(err) && (!image.ei_relocatable || image.ei_interp[0] != '\0'))
+		err = ANANAS_ERROR(BAD_EXEC);
+	if (ananas_is_success(err))
+		err = exec_image_map(vs, dentry, &image, EXEC_INTERP_BASE, exec_addr);
+	dentry_deref(dentry); /* the mappings hold their own references */
+	return err;
+}
+
+static errorcode_t
+elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, struct PROCINFO* info)
+{
+	struct EXEC_IMAGE image;
+	errorcode_t err = elf64_get_image(dentry, &image);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Position-independent programs are useless without a runtime linker to relocate them */
+	bool dynamic = image.ei_interp[0] != '\0';
+	if (image.ei_relocatable && !dynamic)
+		return ANANAS_ERROR(BAD_EXEC);
+	addr_t base = image.ei_relocatable ? EXEC_DYN_BASE : 0;
+
+	addr_t entry;
+	err = exec_image_map(vs, dentry, &image, base, &entry);
+	ANANAS_ERROR_RETURN(err);
+
+	info->pi_exec_base = base;
+	info->pi_phdr = (image.ei_phdr != 0) ? base + image.ei_phdr : 0;
+	info->pi_phnum = image.ei_phnum;
+	info->pi_entry = entry;
+	info->pi_interp_base = 0;
+	if (!dynamic) {
+		*exec_addr = entry;
+		return ananas_success();
+	}
+
+	/* The runtime linker starts first, and jumps to the program once it is done */
+	err = elf64_load_interp(vs, image.ei_interp, exec_addr);
+	ANANAS_ERROR_RETURN(err);
+	info->pi_interp_base = EXEC_INTERP_BASE;
 	return ananas_success();
 }
 
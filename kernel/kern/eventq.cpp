@@ -0,0 +1,374 @@
+/*
+ * Event queues; see <ananas/eventq.h> for the interface.
+ *
+ * Every registration is an EVENTQ_WATCH, which lives on the list of its
+ * handle, its queue and the event source of whatever the handle refers to.
+ * When a source is notified, its watches are appended to the ready list of
+ * their queue, so that waiting only has to look at what may be ready. A watch
+ * that is still ready after being reported is put back, which makes reporting
+ * level-triggered.
+ *
+ * Adding and removing watches is serialized by eventq_mtx, which also keeps
+ * the handles of the watches alive while a queue polls them. The ready lists
+ * are protected by the queue's spinlock, as they are changed by notifications.
+ * Lock order is eventq_mtx, es_lock, eq_lock.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/eventq.h>
+#include <ananas/handle.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+struct EVENTQ_WATCH {
+	struct EVENTQ*		ew_queue;
+	struct HANDLE*		ew_handle;
+	struct EVENT_SOURCE*	ew_source;	/* NULL if readiness never changes */
+	handleindex_t		ew_index;
+	unsigned int		ew_events;	/* Events we are interested in */
+	uint64_t		ew_user;
+	bool			ew_ready;	/* On eq_ready */
+	LIST_FIELDS_IT(struct EVENTQ_WATCH, source);
+	LIST_FIELDS_IT(struct EVENTQ_WATCH, handle);
+	LIST_FIELDS_IT(struct EVENTQ_WATCH, queue);
+	LIST_FIELDS_IT(struct EVENTQ_WATCH, ready);
+};
+
+struct EVENTQ {
+	spinlock_t			eq_lock;
+	struct EVENTQ_WATCH_LIST	eq_ready;	/* Watches which may be ready */
+	unsigned int			eq_num_ready;
+	struct EVENTQ_WATCH_LIST	eq_watches;	/* All watches */
+	semaphore_t			eq_sem;		/* Signalled when something may be ready */
+};
+
+namespace {
+
+mutex_t eventq_mtx;
+
+struct EVENTQ*
+eventq_create()
+{
+	auto eq = static_cast<struct EVENTQ*>(kmalloc(sizeof(struct EVENTQ)));
+	memset(eq, 0, sizeof(*eq));
+	spinlock_init(&eq->eq_lock);
+	LIST_INIT(&eq->eq_ready);
+	LIST_INIT(&eq->eq_watches);
+	sem_init(&eq->eq_sem, 0);
+	return eq;
+}
+
+void
+eventq_mark_ready(struct EVENTQ_WATCH* ew)
+{
+	struct EVENTQ* eq = ew->ew_queue;
+	spinlock_lock(&eq->eq_lock);
+	bool wakeup = !ew->ew_ready;
+	if (wakeup) {
+		LIST_APPEND_IP(&eq->eq_ready, ready, ew);
+		ew->ew_ready = true;
+		eq->eq_num_ready++;
+	}
+	spinlock_unlock(&eq->eq_lock);
+
+	if (wakeup)
+		sem_signal(&eq->eq_sem);
+}
+
+errorcode_t
+eventq_poll(struct EVENTQ_WATCH* ew, unsigned int* events)
+{
+	struct EVENT_SOURCE* es;
+	struct HANDLE* h = ew->ew_handle;
+	errorcode_t err = h->h_hops->hop_poll(h, events, &es);
+	*events &= ew->ew_events;
+	return err;
+}
+
+/* Must be called with eventq_mtx held */
+void
+eventq_watch_free(struct EVENTQ_WATCH* ew)
+{
+	struct EVENTQ* eq = ew->ew_queue;
+	if (ew->ew_source != nullptr) {
+		spinlock_lock(&ew->ew_source->es_lock);
+		LIST_REMOVE_IP(&ew->ew_source->es_watches, source, ew);
+		spinlock_unlock(&ew->ew_source->es_lock);
+	}
+
+	spinlock_lock(&eq->eq_lock);
+	if (ew->ew_ready) {
+		LIST_REMOVE_IP(&eq->eq_ready, ready, ew);
+		eq->eq_num_ready--;
+	}
+	spinlock_unlock(&eq->eq_lock);
+
+	LIST_REMOVE_IP(&ew->ew_handle->h_watches, handle, ew);
+	LIST_REMOVE_IP(&eq->eq_watches, queue, ew);
+	kfree(ew);
+}
+
+/* Must be called with eventq_mtx held */
+struct EVENTQ_WATCH*
+eventq_find_watch(struct EVENTQ* eq, struct HANDLE* h)
+{
+	/* Handles are seldomly watched by more than a few queues, so this is cheap */
+	LIST_FOREACH_IP(&h->h_watches, handle, ew, struct EVENTQ_WATCH) {
+		if (ew->ew_queue == eq)
+			return ew;
+	}
+	return nullptr;
+}
+
+/* Moves up to max ready watches to out; returns the number stored */
+int
+eventq_collect(struct EVENTQ* eq, struct HANDLE_EVENT* out, int max)
+{
+	mutex_lock(&eventq_mtx);
+
+	/* Only look at what is on the list now; anything we put back is for the next call */
+	spinlock_lock(&eq->eq_lock);
+	unsigned int todo = eq->eq_num_ready;
+	spinlock_unlock(&eq->eq_lock);
+
+	int n = 0;
+	for (/* nothing */; todo > 0 && n < max; todo--) {
+		spinlock_lock(&eq->eq_lock);
+		struct EVENTQ_WATCH* ew = LIST_HEAD(&eq->eq_ready);
+		if (ew != nullptr) {
+			LIST_POP_HEAD_IP(&eq->eq_ready, ready);
+			ew->ew_ready = false;
+			eq->eq_num_ready--;
+		}
+		spinlock_unlock(&eq->eq_lock);
+		if (ew == nullptr)
+			break;
+
+		/* If it isn't ready anymore, its source will tell us once it is again */
+		unsigned int events;
+		if (ananas_is_failure(eventq_poll(ew, &events)) || events == 0)
+			continue;
+
+		out[n].he_handle = ew->ew_index;
+		out[n].he_events = events;
+		out[n].he_user = ew->ew_user;
+		n++;
+
+		/* Still ready, so it must be looked at next time; no need to wake anyone */
+		spinlock_lock(&eq->eq_lock);
+		if (!ew->ew_ready) {
+			LIST_APPEND_IP(&eq->eq_ready, ready, ew);
+			ew->ew_ready = true;
+			eq->eq_num_ready++;
+		}
+		spinlock_unlock(&eq->eq_lock);
+	}
+
+	mutex_unlock(&eventq_mtx);
+	return n;
+}
+
+errorcode_t
+eventq_free(process_t* proc, struct HANDLE* handle)
+{
+	struct EVENTQ* eq = handle->h_data.d_eventq;
+	mutex_lock(&eventq_mtx);
+	while (!LIST_EMPTY(&eq->eq_watches))
+		eventq_watch_free(LIST_HEAD(&eq->eq_watches));
+	mutex_unlock(&eventq_mtx);
+
+	kfree(eq);
+	return ananas_success();
+}
+
+errorcode_t
+eventq_clone(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out)
+{
+	/* Registrations are for the handles of proc_in, so the clone starts out empty */
+	errorcode_t err = handle_alloc(HANDLE_TYPE_EVENTQ, proc_out, index_out_min, handle_out, index_out);
+	ANANAS_ERROR_RETURN(err);
+
+	(*handle_out)->h_data.d_eventq = eventq_create();
+	return ananas_success();
+}
+
+struct HANDLE_OPS eventq_hops = {
+	.hop_free = eventq_free,
+	.hop_clone = eventq_clone,
+};
+
+errorcode_t
+eventq_init()
+{
+	mutex_init(&eventq_mtx, "eventq");
+	return ananas_success();
+}
+
+INIT_FUNCTION(eventq_init, SUBSYSTEM_HANDLE, ORDER_FIRST);
+
+} // unnamed namespace
+
+HANDLE_TYPE(HANDLE_TYPE_EVENTQ, "eventq", eventq_hops);
+
+void
+event_source_init(struct EVENT_SOURCE* es)
+{
+	spinlock_init(&es->es_lock);
+	LIST_INIT(&es->es_watches);
+}
+
+void
+event_source_notify(struct EVENT_SOURCE* es, unsigned int events)
+{
+	spinlock_lock(&es->es_lock);
+	LIST_FOREACH_IP(&es->es_watches, source, ew, struct EVENTQ_WATCH) {
+		if (ew->ew_events & events)
+			eventq_mark_ready(ew);
+	}
+	spinlock_unlock(&es->es_lock);
+}
+
+errorcode_t
+eventq_alloc(process_t* p, handleindex_t* out)
+{
+	struct HANDLE* handle;
+	errorcode_t err = handle_alloc(HANDLE_TYPE_EVENTQ, p, 0, &handle, out);
+	ANANAS_ERROR_RETURN(err);
+
+	handle->h_data.d_eventq = eventq_create();
+	return ananas_success();
+}
+
+errorcode_t
+eventq_control(struct HANDLE* queue, int op, struct HANDLE* handle, handleindex_t index, const struct HANDLE_EVENT* ev)
+{
+	TRACE(HANDLE, FUNC, "queue=%p, op=%d, handle=%p", queue, op, handle);
+	if (queue->h_type != HANDLE_TYPE_EVENTQ)
+		return ANANAS_ERROR(BAD_HANDLE);
+	if (handle->h_hops->hop_poll == nullptr)
+		return ANANAS_ERROR(BAD_OPERATION);
+	if (op != EVQ_CTL_DELETE && (ev == nullptr || (ev->he_events & ~(HANDLE_EVENT_READ | HANDLE_EVENT_WRITE)) != 0))
+		return ANANAS_ERROR(BAD_FLAG);
+	struct EVENTQ* eq = queue->h_data.d_eventq;
+
+	mutex_lock(&eventq_mtx);
+	errorcode_t err = ananas_success();
+	struct EVENTQ_WATCH* ew = eventq_find_watch(eq, handle);
+	switch(op) {
+		case EVQ_CTL_ADD: {
+			if (ew != nullptr) {
+				err = ANANAS_ERROR(FILE_EXISTS);
+				break;
+			}
+
+			ew = static_cast<struct EVENTQ_WATCH*>(kmalloc(sizeof(struct EVENTQ_WATCH)));
+			memset(ew, 0, sizeof(*ew));
+			ew->ew_queue = eq;
+			ew->ew_handle = handle;
+			ew->ew_index = index;
+			ew->ew_events = ev->he_events;
+			ew->ew_user = ev->he_user;
+
+			unsigned int events;
+			err = handle->h_hops->hop_poll(handle, &events, &ew->ew_source);
+			if (ananas_is_failure(err)) {
+				kfree(ew);
+				break;
+			}
+
+			LIST_APPEND_IP(&handle->h_watches, handle, ew);
+			LIST_APPEND_IP(&eq->eq_watches, queue, ew);
+			if (ew->ew_source != nullptr) {
+				spinlock_lock(&ew->ew_source->es_lock);
+				LIST_APPEND_IP(&ew->ew_source->es_watches, source, ew);
+				spinlock_unlock(&ew->ew_source->es_lock);
+			}
+			if (events & ew->ew_events)
+				eventq_mark_ready(ew);
+			break;
+		}
+		case EVQ_CTL_MODIFY: {
+			if (ew == nullptr) {
+				err = ANANAS_ERROR(NO_RESOURCE);
+				break;
+			}
+
+			if (ew->ew_source != nullptr)
+				spinlock_lock(&ew->ew_source->es_lock);
+			ew->ew_events = ev->he_events;
+			ew->ew_user = ev->he_user;
+			if (ew->ew_source != nullptr)
+				spinlock_unlock(&ew->ew_source->es_lock);
+
+			unsigned int events;
+			if (ananas_is_success(eventq_poll(ew, &events)) && events != 0)
+				eventq_mark_ready(ew);
+			break;
+		}
+		case EVQ_CTL_DELETE:
+			if (ew == nullptr)
+				err = ANANAS_ERROR(NO_RESOURCE);
+			else
+				eventq_watch_free(ew);
+			break;
+		default:
+			err = ANANAS_ERROR(BAD_OPERATION);
+			break;
+	}
+	mutex_unlock(&eventq_mtx);
+	return err;
+}
+
+errorcode_t
+eventq_wait(struct HANDLE* queue, struct HANDLE_EVENT* out, int* count, int timeout)
+{
+	if (queue->h_type != HANDLE_TYPE_EVENTQ)
+		return ANANAS_ERROR(BAD_HANDLE);
+	if (*count <= 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	struct EVENTQ* eq = queue->h_data.d_eventq;
+
+	uint64_t deadline = timer_get_ns() + (uint64_t)timeout * 1000000;
+	while (1) {
+		int n = eventq_collect(eq, out, *count);
+		if (n > 0) {
+			*count = n;
+			return ananas_success();
+		}
+
+		if (timeout < 0) {
+			sem_wait(&eq->eq_sem);
+			continue;
+		}
+
+		uint64_t now = timer_get_ns();
+		if (timeout == 0 || now >= deadline ||
+		    ananas_is_failure(sem_wait_timeout(&eq->eq_sem, deadline - now))) {
+			*count = 0;
+			return ananas_success();
+		}
+	}
+
+	/* NOTREACHED */
+}
+
+void
+eventq_handle_free(struct HANDLE* handle)
+{
+	/* Most handles are never watched; don't bother them with our lock */
+	if (LIST_EMPTY(&handle->h_watches))
+		return;
+
+	mutex_lock(&eventq_mtx);
+	while (!LIST_EMPTY(&handle->h_watches))
+		eventq_watch_free(LIST_HEAD(&handle->h_watches));
+	mutex_unlock(&eventq_mtx);
+}
+
+/* vim:set ts=2 sw=2: */
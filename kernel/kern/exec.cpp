@@ -1,12 +1,21 @@
+#include <machine/param.h>
 #include <ananas/exec.h>
 #include <ananas/lib.h>
 #include <ananas/init.h>
+#include <ananas/mm.h>
 #include <ananas/process.h>
+#include <ananas/procinfo.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
+#include <ananas/vfs/types.h>
+#include <ananas/vm.h>
+#include <ananas/vmspace.h>
 
 TRACE_SETUP;
 
+#define EXEC_PREFAULT_DATA_PAGES	4	/* Initial pages of data/bss to populate */
+#define EXEC_PREFAULT_STACK_PAGES	4	/* Final pages of the stack to populate */
+
 static struct EXEC_FORMATS exec_formats; /* XXX do we need to lock this? */
 
 static errorcode_t
@@ -17,7 +26,7 @@ exec_init()
 }
 
 errorcode_t
-exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
+exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, struct PROCINFO* info)
 {
 	// Start by taking an extra ref to the dentry; this is the ref which we'll hand over
 	// to the handler, if all goes well
@@ -25,7 +34,7 @@ exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
 
 	LIST_FOREACH(&exec_formats, ef, struct EXEC_FORMAT) {
 		/* See if we can execute this... */
-		errorcode_t err = ef->ef_handler(vs, dentry, exec_addr);
+		errorcode_t err = ef->ef_handler(vs, dentry, exec_addr, info);
 		if (ananas_is_failure(err)) {
 			/* Execute failed; try the next one */
 			continue;
@@ -41,6 +50,130 @@ exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr)
 
 INIT_FUNCTION(exec_init, SUBSYSTEM_THREAD, ORDER_FIRST);
 
+void
+exec_prefault(vmspace_t* vs)
+{
+	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
+		if (va->va_flags & VM_FLAG_STACK) {
+			size_t len = EXEC_PREFAULT_STACK_PAGES * PAGE_SIZE;
+			if (len > va->va_len)
+				len = va->va_len;
+			vmspace_prefault(vs, va->va_virt + va->va_len - len, len, VM_FLAG_READ | VM_FLAG_WRITE);
+		} else if (va->va_dentry != nullptr && (va->va_flags & VM_FLAG_WRITE)) {
+			// Data and bss; these will be written to, so they need their own pages
+			size_t len = EXEC_PREFAULT_DATA_PAGES * PAGE_SIZE;
+			if (len > va->va_len)
+				len = va->va_len;
+			vmspace_prefault(vs, va->va_virt, len, VM_FLAG_READ | VM_FLAG_WRITE);
+		}
+	}
+}
+
+bool
+exec_image_lookup(struct VFS_INODE* inode, struct EXEC_IMAGE* image)
+{
+	INODE_LOCK(inode);
+	bool found = inode->i_exec_image != nullptr;
+	if (found) {
+		memcpy(image, inode->i_exec_image, sizeof(*image));
+		inode->i_flags |= INODE_FLAG_EXEC_RECENT;
+	}
+	INODE_UNLOCK(inode);
+	return found;
+}
+
+void
+exec_image_store(struct VFS_INODE* inode, const struct EXEC_IMAGE* image)
+{
+	auto ei = static_cast<struct EXEC_IMAGE*>(kmalloc(sizeof(struct EXEC_IMAGE)));
+	memcpy(ei, image, sizeof(*ei));
+
+	INODE_LOCK(inode);
+	if (inode->i_exec_image == nullptr) {
+		inode->i_exec_image = ei;
+		ei = nullptr;
+	}
+	inode->i_flags |= INODE_FLAG_EXEC_RECENT;
+	INODE_UNLOCK(inode);
+	if (ei != nullptr)
+		kfree(ei); // someone beat us to it
+}
+
+void
+exec_image_purge(struct VFS_INODE* inode)
+{
+	if (inode->i_exec_image != nullptr)
+		kfree(inode->i_exec_image);
+	inode->i_exec_image = nullptr;
+	inode->i_flags &= ~INODE_FLAG_EXEC_RECENT;
+}
+
+errorcode_t
+exec_image_map(vmspace_t* vs, struct DENTRY* dentry, const struct EXEC_IMAGE* image, addr_t base, addr_t* exec_addr)
+{
+	for (unsigned int n = 0; n < image->ei_num_segments; n++) {
+		const struct EXEC_SEGMENT* es = &image->ei_segment[n];
+		TRACE(EXEC, INFO, "map: virt=%p len=%d vskip=%d offset=%d length=%d", base + es->es_virt, es->es_vlength, es->es_vskip, es->es_doffset, es->es_dlength);
+
+		vmarea_t* va;
+		errorcode_t err = vmspace_mapto_dentry(vs, base + es->es_virt, es->es_vskip, es->es_vlength, dentry, es->es_doffset, es->es_dlength, es->es_flags, &va);
+		ANANAS_ERROR_RETURN(err);
+
+		// Text which is still in the page cache can be mapped right away
+		vmspace_map_resident(vs, va);
+	}
+
+	*exec_addr = base + image->ei_entry;
+	return ananas_success();
+}
+
+enum SET_PROC_ATTR {
+	A_Args,
+	A_Env
+};
+
+static errorcode_t
+exec_set_attribute(process_t* process, enum SET_PROC_ATTR attr, const char** list)
+{
+	char buf[PROCINFO_ENV_LENGTH];
+
+	/* Convert list to a \0-separated string, \0\0-terminated */
+	int arg_len = 2; /* \0\0-terminator */
+	for (const char** p = list; *p != NULL; p++) {
+		arg_len += strlen(*p) + 1; /* \0 */
+	}
+	KASSERT(arg_len < sizeof(buf), "buffer too large (calculated %d, have %d)", arg_len, sizeof(buf));
+
+	/* Copy the items over */
+	int pos = 0;
+	memset(buf, 0, sizeof(buf));
+	for (const char** p = list; *p != NULL; p++) {
+		strcpy(&buf[pos], *p);
+		pos += strlen(*p) + 1;
+	}
+
+	switch(attr) {
+		case A_Args:
+			return process_set_args(process, buf, pos);
+		case A_Env:
+			return process_set_environment(process, buf, pos);
+		default:
+			panic("unexpected attribute %d", attr);
+	}
+}
+
+errorcode_t
+exec_set_args(process_t* p, const char** argv)
+{
+	return exec_set_attribute(p, A_Args, argv);
+}
+
+errorcode_t
+exec_set_environment(process_t* p, const char** envp)
+{
+	return exec_set_attribute(p, A_Env, envp);
+}
+
 errorcode_t
 exec_register_format(struct EXEC_FORMAT* ef)
 {
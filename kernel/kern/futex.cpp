@@ -0,0 +1,129 @@
+/*
+ * Futexes; see <ananas/futex.h> for the interface.
+ *
+ * Sleeping threads are kept in a hash table keyed by the vmspace and address
+ * of the futex. The bucket mutex is held while checking the value and queueing
+ * the waiter, so that a wakeup issued after the value is changed cannot be
+ * missed. A mutex is used as reading the value may fault.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/futex.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/list.h>
+#include <ananas/lock.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+#define FUTEX_HASH_SIZE	64
+
+struct FUTEX_WAITER {
+	struct VM_SPACE*	fw_vs;
+	int*			fw_addr;
+	semaphore_t		fw_sem;
+	bool			fw_woken;
+	LIST_FIELDS(struct FUTEX_WAITER);
+};
+LIST_DEFINE(FUTEX_WAITERS, struct FUTEX_WAITER);
+
+struct FUTEX_BUCKET {
+	mutex_t			fb_mtx;
+	struct FUTEX_WAITERS	fb_waiters;
+} __attribute__((aligned(64)));
+
+namespace {
+
+struct FUTEX_BUCKET futex_bucket[FUTEX_HASH_SIZE];
+
+struct FUTEX_BUCKET*
+futex_get_bucket(struct VM_SPACE* vs, int* addr)
+{
+	addr_t key = (addr_t)addr / sizeof(int) ^ (addr_t)vs / 64;
+	return &futex_bucket[key % FUTEX_HASH_SIZE];
+}
+
+errorcode_t
+futex_init()
+{
+	for (unsigned int n = 0; n < FUTEX_HASH_SIZE; n++) {
+		mutex_init(&futex_bucket[n].fb_mtx, "futex");
+		LIST_INIT(&futex_bucket[n].fb_waiters);
+	}
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+errorcode_t
+futex_wait(struct VM_SPACE* vs, int* addr, int value, int timeout)
+{
+	if (((addr_t)addr & (sizeof(int) - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+
+	struct FUTEX_BUCKET* fb = futex_get_bucket(vs, addr);
+	struct FUTEX_WAITER fw;
+	fw.fw_vs = vs;
+	fw.fw_addr = addr;
+	fw.fw_woken = false;
+	sem_init(&fw.fw_sem, 0);
+
+	mutex_lock(&fb->fb_mtx);
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != value) {
+		mutex_unlock(&fb->fb_mtx);
+		return ANANAS_ERROR(TRY_AGAIN);
+	}
+	LIST_APPEND(&fb->fb_waiters, &fw);
+	mutex_unlock(&fb->fb_mtx);
+
+	if (timeout < 0) {
+		sem_wait(&fw.fw_sem);
+		return ananas_success();
+	}
+
+	errorcode_t err = ANANAS_ERROR(TIMEOUT);
+	if (timeout > 0)
+		err = sem_wait_timeout(&fw.fw_sem, (uint64_t)timeout * 1000000);
+	if (ananas_is_success(err))
+		return err;
+
+	/* Timed out; we may have been woken up in the meantime, which is fine too */
+	mutex_lock(&fb->fb_mtx);
+	if (fw.fw_woken)
+		err = ananas_success();
+	else
+		LIST_REMOVE(&fb->fb_waiters, &fw);
+	mutex_unlock(&fb->fb_mtx);
+	return err;
+}
+
+errorcode_t
+futex_wake(struct VM_SPACE* vs, int* addr, int count, int* woken)
+{
+	if (((addr_t)addr & (sizeof(int) - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+
+	struct FUTEX_BUCKET* fb = futex_get_bucket(vs, addr);
+	int num = 0;
+	mutex_lock(&fb->fb_mtx);
+	LIST_FOREACH_SAFE(&fb->fb_waiters, fw, struct FUTEX_WAITER) {
+		if (num >= count)
+			break;
+		if (fw->fw_vs != vs || fw->fw_addr != addr)
+			continue;
+		LIST_REMOVE(&fb->fb_waiters, fw);
+		fw->fw_woken = true;
+		sem_signal(&fw->fw_sem);
+		num++;
+	}
+	mutex_unlock(&fb->fb_mtx);
+
+	*woken = num;
+	return ananas_success();
+}
+
+INIT_FUNCTION(futex_init, SUBSYSTEM_THREAD, ORDER_FIRST);
+
+/* vim:set ts=2 sw=2: */
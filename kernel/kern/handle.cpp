@@ -7,86 +7,232 @@
 #include <ananas/mm.h>
 #include <ananas/process.h>
 #include <ananas/schedule.h>
+#include <ananas/slab.h>
 #include <ananas/trace.h>
 #include <ananas/thread.h>
 #include "options.h"
 
 TRACE_SETUP;
 
-#define NUM_HANDLES 500 /* XXX shouldn't be static */
-
-static struct HANDLE_QUEUE handle_freelist;
-static spinlock_t spl_handlequeue;
-static struct HANDLE_TYPES handle_types;
+/*
+ * Handles are allocated on demand from handle_cache. Every process has a table
+ * mapping handle indices to handles; it starts out with HANDLE_TABLE_INITIAL
+ * entries and is replaced by one twice the size whenever it is full, up to
+ * PROCESS_MAX_HANDLES.
+ *
+ * The lowest free index is found using two levels of bitmaps: htab_inuse has a
+ * bit for every entry, and htab_full has a bit for every word of htab_inuse
+ * which is completely in use. As PROCESS_MAX_HANDLES is 64 * 64, finding a
+ * free entry takes at most two bit scans.
+ *
+ * Changes to the table are made with the process lock held, but lookups take
+ * no lock at all: they read the table in an RCU read section and take a
+ * reference to the handle they find. The table holds a reference to each of
+ * its handles; a handle is destroyed once it is removed from the table and the
+ * final lookup reference is gone. As handle_cache never gives memory back, a
+ * handle found this way may be freed and reused at any time until it is
+ * referenced, so lookups check that they got what they were after afterwards.
+ */
+#define HANDLE_TABLE_INITIAL 64
+#define HANDLE_BITS_PER_WORD 64
+
+static_assert(PROCESS_MAX_HANDLES <= HANDLE_BITS_PER_WORD * HANDLE_BITS_PER_WORD, "handle bitmap too small");
+
+static SLAB_CACHE_DEFINE(handle_cache, struct HANDLE, NULL);
+/*
+ * Registered handle types, by id; only changes to this are locked, as
+ * handle_alloc() merely needs to see a type once it is registered.
+ */
+static struct HANDLE_TYPE* handle_types[HANDLE_TYPE_MAX];
 static spinlock_t spl_handletypes;
 
 void
 handle_init()
 {
-	spinlock_init(&spl_handlequeue);
 	spinlock_init(&spl_handletypes);
-	LIST_INIT(&handle_types);
+}
+
+/*
+ * Replaces the handle table of proc by one holding at least min_size entries;
+ * the old table is stored in old_htab, and must be freed using
+ * handle_table_free() once proc is unlocked. proc must be locked.
+ */
+static errorcode_t
+handle_table_grow(process_t* proc, int min_size, struct HANDLE_TABLE** old_htab)
+{
+	struct HANDLE_TABLE* htab = proc->p_handles;
+	int cur_size = (htab != NULL) ? htab->htab_size : 0;
+	int size = (cur_size > 0) ? cur_size : HANDLE_TABLE_INITIAL;
+	while (size < min_size)
+		size *= 2;
+	if (size > PROCESS_MAX_HANDLES)
+		size = PROCESS_MAX_HANDLES;
+	if (size <= cur_size || size < min_size)
+		return ANANAS_ERROR(OUT_OF_HANDLES);
+
+	/* Table, entries and bitmap are allocated in one go */
+	int num_words = size / HANDLE_BITS_PER_WORD;
+	size_t len = sizeof(struct HANDLE_TABLE) + size * sizeof(struct HANDLE*) + num_words * sizeof(uint64_t);
+	auto new_htab = static_cast<struct HANDLE_TABLE*>(kmalloc(len));
+	if (new_htab == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	memset(new_htab, 0, len);
+	new_htab->htab_size = size;
+	new_htab->htab_handle = reinterpret_cast<struct HANDLE**>(new_htab + 1);
+	new_htab->htab_inuse = reinterpret_cast<uint64_t*>(new_htab->htab_handle + size);
+
+	if (htab != NULL) {
+		memcpy(new_htab->htab_handle, htab->htab_handle, cur_size * sizeof(struct HANDLE*));
+		memcpy(new_htab->htab_inuse, htab->htab_inuse, (cur_size / HANDLE_BITS_PER_WORD) * sizeof(uint64_t));
+		new_htab->htab_full = htab->htab_full;
+	}
+	__atomic_store_n(&proc->p_handles, new_htab, __ATOMIC_RELEASE);
+	*old_htab = htab;
+	return ananas_success();
+}
 
-	auto pool = new HANDLE[NUM_HANDLES];
-	memset(pool, 0, sizeof(struct HANDLE) * NUM_HANDLES);
+/* Frees a table replaced by handle_table_grow(); lookups may still be using it */
+static void
+handle_table_free(struct HANDLE_TABLE* htab)
+{
+	if (htab == NULL)
+		return;
+	rcu_synchronize();
+	kfree(htab);
+}
 
-	/* Add all handles to the queue one by one */
-	LIST_INIT(&handle_freelist);
-	for (unsigned int i = 0; i < NUM_HANDLES; i++) {
-		struct HANDLE* h = &pool[i];
-		LIST_APPEND(&handle_freelist, h);
+/* Returns the lowest free index >= index_from, or -1 if there is none; proc must be locked */
+static handleindex_t
+handle_table_find_free(process_t* proc, handleindex_t index_from)
+{
+	struct HANDLE_TABLE* htab = proc->p_handles;
+	if (htab == NULL)
+		return -1;
+	int num_words = htab->htab_size / HANDLE_BITS_PER_WORD;
+	int w = index_from / HANDLE_BITS_PER_WORD;
+	if (w >= num_words)
+		return -1;
+
+	/* First try the word index_from is in ... */
+	uint64_t avail = ~htab->htab_inuse[w] & (~0ULL << (index_from % HANDLE_BITS_PER_WORD));
+	if (avail != 0)
+		return w * HANDLE_BITS_PER_WORD + __builtin_ctzll(avail);
+
+	/* ... and otherwise, the first word after it which isn't full */
+	if (w + 1 >= num_words)
+		return -1;
+	uint64_t words = ~htab->htab_full & (~0ULL << (w + 1));
+	if (num_words < HANDLE_BITS_PER_WORD)
+		words &= (1ULL << num_words) - 1;
+	if (words == 0)
+		return -1;
+	w = __builtin_ctzll(words);
+	return w * HANDLE_BITS_PER_WORD + __builtin_ctzll(~htab->htab_inuse[w]);
+}
+
+/* Stores handle at index n, or clears it if handle is NULL; proc must be locked */
+static void
+handle_table_set(process_t* proc, handleindex_t n, struct HANDLE* handle)
+{
+	struct HANDLE_TABLE* htab = proc->p_handles;
+	int w = n / HANDLE_BITS_PER_WORD;
+	uint64_t bit = 1ULL << (n % HANDLE_BITS_PER_WORD);
+	__atomic_store_n(&htab->htab_handle[n], handle, __ATOMIC_RELEASE);
+	if (handle != NULL) {
+		htab->htab_inuse[w] |= bit;
+		if (htab->htab_inuse[w] == ~0ULL)
+			htab->htab_full |= 1ULL << w;
+	} else {
+		htab->htab_inuse[w] &= ~bit;
+		htab->htab_full &= ~(1ULL << w);
 	}
 }
 
+/* Takes a reference to the handle, unless it is already being destroyed */
+static inline bool
+handle_tryref(struct HANDLE* handle)
+{
+	refcount_t n = __atomic_load_n(&handle->h_refcount, __ATOMIC_RELAXED);
+	do {
+		if (n == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&handle->h_refcount, &n, n + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
+
+static void
+handle_destroy(struct HANDLE* handle)
+{
+	process_t* proc = handle->h_process;
+
+	/* Event queues watching the handle must forget about it */
+	eventq_handle_free(handle);
+
+	/*
+	 * If the handle has a specific free function, call it - otherwise assume
+	 * no special action is needed.
+	 */
+	if (handle->h_hops->hop_free != NULL)
+		handle->h_hops->hop_free(proc, handle);
+
+	/* Clear the handle and hand it back to the cache */
+	memset(&handle->h_data, 0, sizeof(handle->h_data));
+	handle->h_type = HANDLE_TYPE_UNUSED; /* just to ensure the value matches */
+	handle->h_process = NULL;
+	slab_free(&handle_cache, handle);
+}
+
 errorcode_t
 handle_alloc(int type, process_t* proc, handleindex_t index_from, struct HANDLE** handle_out, handleindex_t* index_out)
 {
 	KASSERT(proc != NULL, "handle_alloc() without process");
+	if (index_from < 0 || index_from >= PROCESS_MAX_HANDLES)
+		return ANANAS_ERROR(BAD_HANDLE);
 
-	/* Look up the handle type XXX O(n) */
-	struct HANDLE_TYPE* htype = NULL;
-	spinlock_lock(&spl_handletypes);
-	LIST_FOREACH(&handle_types, ht, struct HANDLE_TYPE) {
-		if (ht->ht_id != type)
-			continue;
-		htype = ht;
-		break;
-	}
-	spinlock_unlock(&spl_handletypes);
+	/* Look up the handle type */
+	if (type <= HANDLE_TYPE_UNUSED || type >= HANDLE_TYPE_MAX)
+		return ANANAS_ERROR(BAD_TYPE);
+	struct HANDLE_TYPE* htype = __atomic_load_n(&handle_types[type], __ATOMIC_ACQUIRE);
 	if (htype == NULL)
 		return ANANAS_ERROR(BAD_TYPE);
 
-	/* Grab a handle from the pool */
-	spinlock_lock(&spl_handlequeue);
-	if (LIST_EMPTY(&handle_freelist)) {
-		/* XXX should we wait for a new handle, or just give an error? */
-		panic("out of handles");
-	}
-	struct HANDLE* handle = LIST_HEAD(&handle_freelist);
-	LIST_POP_HEAD(&handle_freelist);
-	spinlock_unlock(&spl_handlequeue);
-
-	/* Sanity checks */
-	KASSERT(handle->h_type == HANDLE_TYPE_UNUSED, "handle from pool must be unused");
-
-	/* Initialize the handle */
+	/*
+	 * Initialize the handle; a lookup may still be looking at its previous
+	 * incarnation, so everything must be set before the reference count is.
+	 */
+	auto handle = static_cast<struct HANDLE*>(slab_alloc(&handle_cache));
+	memset(&handle->h_data, 0, sizeof(handle->h_data));
 	mutex_init(&handle->h_mutex, "handle");
 	handle->h_type = type;
 	handle->h_process = proc;
 	handle->h_hops = htype->ht_hops;
 	handle->h_flags = 0;
+	LIST_INIT(&handle->h_watches);
 
-	/* Hook the handle to the process */
+	/* Hook the handle to the process, growing its table if we have to */
+	struct HANDLE_TABLE* old_htab = NULL;
 	process_lock(proc);
-	handleindex_t n = index_from;
-	while(n < PROCESS_MAX_HANDLES && proc->p_handle[n] != NULL)
-		n++;
-	if (n < PROCESS_MAX_HANDLES)
-		proc->p_handle[n] = handle;
+	errorcode_t err = ananas_success();
+	handleindex_t n = handle_table_find_free(proc, index_from);
+	if (n < 0) {
+		int cur_size = (proc->p_handles != NULL) ? proc->p_handles->htab_size : 0;
+		int min_size = (index_from >= cur_size) ? index_from + 1 : cur_size + 1;
+		err = handle_table_grow(proc, min_size, &old_htab);
+		if (ananas_is_success(err))
+			n = handle_table_find_free(proc, index_from);
+	}
+	if (ananas_is_success(err)) {
+		KASSERT(n >= index_from, "no free handle after growing table");
+		handle->h_index = n;
+		__atomic_store_n(&handle->h_refcount, 1, __ATOMIC_RELEASE); /* table */
+		handle_table_set(proc, n, handle);
+	}
 	process_unlock(proc);
-
-	if (n == PROCESS_MAX_HANDLES)
-		panic("out of handles"); // XXX FIX ME
+	handle_table_free(old_htab);
+	if (ananas_is_failure(err)) {
+		slab_free(&handle_cache, handle);
+		return err;
+	}
 
 	*handle_out = handle;
 	*index_out = n;
@@ -98,72 +244,71 @@ errorcode_t
 handle_lookup(process_t* proc, handleindex_t index, int type, struct HANDLE** handle_out)
 {
 	KASSERT(proc != NULL, "handle_lookup() without process");
-	if(index < 0 || index >= PROCESS_MAX_HANDLES)
+	if(index < 0)
 		return ANANAS_ERROR(BAD_HANDLE);
 
-	/* Obtain the handle XXX How do we ensure it won't get freed after this? Should we ref it? */
-	process_lock(proc);
-	struct HANDLE* handle = proc->p_handle[index];
-	process_unlock(proc);
-
-	/* ensure handle exists - we don't verify ownership: it _is_ in the thread's handle table... */
+	/* Obtain the handle; this can't sleep, so it need not be a mutex */
+	register_t state = rcu_read_lock();
+	struct HANDLE_TABLE* htab = __atomic_load_n(&proc->p_handles, __ATOMIC_ACQUIRE);
+	struct HANDLE* handle = NULL;
+	if (htab != NULL && index < htab->htab_size) {
+		handle = __atomic_load_n(&htab->htab_handle[index], __ATOMIC_ACQUIRE);
+		if (handle != NULL && !handle_tryref(handle))
+			handle = NULL; /* being destroyed */
+	}
+	rcu_read_unlock(state);
 	if (handle == NULL)
 		return ANANAS_ERROR(BAD_HANDLE);
-	/* if this is a handle reference, check the type of the handle we are refering to */
-	if (type != HANDLE_TYPE_ANY && handle->h_type != type)
-		return ANANAS_ERROR(BAD_HANDLE);
-	/* ... yet unused handles are never valid */
-	if (handle->h_type == HANDLE_TYPE_UNUSED)
+
+	/*
+	 * We hold a reference now, so the handle can't change identity anymore -
+	 * but it may have been reused since we found it.
+	 */
+	if (handle->h_process != proc || handle->h_index != index ||
+	    (type != HANDLE_TYPE_ANY && handle->h_type != type)) {
+		handle_deref(handle);
 		return ANANAS_ERROR(BAD_HANDLE);
+	}
 	*handle_out = handle;
 	return ananas_success();
 }
 
+void
+handle_ref(struct HANDLE* handle)
+{
+	KASSERT(handle->h_refcount > 0, "reffing handle %p with invalid refcount %d", handle, handle->h_refcount);
+	__atomic_add_fetch(&handle->h_refcount, 1, __ATOMIC_RELAXED);
+}
+
+void
+handle_deref(struct HANDLE* handle)
+{
+	KASSERT(handle->h_refcount > 0, "dereffing handle %p with invalid refcount %d", handle, handle->h_refcount);
+	if (__atomic_sub_fetch(&handle->h_refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		handle_destroy(handle);
+}
+
 errorcode_t
 handle_free(struct HANDLE* handle)
 {
 	/*
-	 * Lock the handle so that no-one else can touch it, mark the handle as being
-	 * torn-down and see if we actually have to destroy it at this point.
+	 * Remove us from the process' handle table; if someone beat us to it, the
+	 * table's reference is already gone.
 	 */
-	mutex_lock(&handle->h_mutex);
-
-	/* Remove us from the thread handle queue, if necessary */
 	process_t* proc = handle->h_process;
-	if (proc != NULL) {
-		process_lock(proc);
-		for (handleindex_t n = 0; n < PROCESS_MAX_HANDLES; n++) {
-			if (proc->p_handle[n] == handle)
-				proc->p_handle[n] = NULL;
-		}
-		process_unlock(proc);
-	}
-
-	/*
-	 * If the handle has a specific free function, call it - otherwise assume
-	 * no special action is needed.
-	 */
-	if (handle->h_hops->hop_free != NULL) {
-		errorcode_t err = handle->h_hops->hop_free(proc, handle);
-		ANANAS_ERROR_RETURN(err);
+	bool removed = false;
+	process_lock(proc);
+	struct HANDLE_TABLE* htab = proc->p_handles;
+	if (htab != NULL && htab->htab_handle[handle->h_index] == handle) {
+		handle_table_set(proc, handle->h_index, NULL);
+		removed = true;
 	}
+	process_unlock(proc);
+	if (!removed)
+		return ANANAS_ERROR(BAD_HANDLE);
 
-	/* Clear the handle */
-	memset(&handle->h_data, 0, sizeof(handle->h_data));
-	handle->h_type = HANDLE_TYPE_UNUSED; /* just to ensure the value matches */
-	handle->h_process = NULL;
-
-	/*	
-	 * Let go of the handle lock - if someone tries to use it, they'll lock it
-	 * before looking at the flags field and this will cause a deadlock.  Better
-	 * safe than sorry.
-	 */
-	mutex_unlock(&handle->h_mutex);
-
-	/* Hand it back to the the pool */
-	spinlock_lock(&spl_handlequeue);
-	LIST_APPEND(&handle_freelist, handle);
-	spinlock_unlock(&spl_handlequeue);
+	/* Drop the table's reference; this destroys the handle unless someone is still using it */
+	handle_deref(handle);
 	return ananas_success();
 }
 
@@ -175,7 +320,25 @@ handle_free_byindex(process_t* proc, handleindex_t index)
 	errorcode_t err = handle_lookup(proc, index, HANDLE_TYPE_ANY, &handle);
 	ANANAS_ERROR_RETURN(err);
 
-	return handle_free(handle);
+	err = handle_free(handle);
+	handle_deref(handle);
+	return err;
+}
+
+void
+handle_free_all(process_t* proc)
+{
+	struct HANDLE_TABLE* htab = proc->p_handles;
+	if (htab == NULL)
+		return;
+	for (handleindex_t n = 0; n < htab->htab_size; n++)
+		handle_free_byindex(proc, n);
+
+	/* No one can look up handles of a process that is being destroyed */
+	process_lock(proc);
+	proc->p_handles = NULL;
+	process_unlock(proc);
+	kfree(htab);
 }
 
 errorcode_t
@@ -201,25 +364,58 @@ handle_clone(process_t* proc_in, handleindex_t index, struct CLONE_OPTIONS* opts
 		err = ANANAS_ERROR(BAD_OPERATION);
 	}
 	mutex_unlock(&handle->h_mutex);
+	handle_deref(handle);
 	return err;
 }
 
+errorcode_t
+handle_clone_all(process_t* proc_in, process_t* proc_out)
+{
+	/* The table may be replaced while we go, but only by a larger one */
+	struct HANDLE_TABLE* htab = __atomic_load_n(&proc_in->p_handles, __ATOMIC_ACQUIRE);
+	int size = (htab != NULL) ? htab->htab_size : 0;
+	for (handleindex_t n = 0; n < size; n++) {
+		struct HANDLE* handle;
+		handleindex_t out;
+		errorcode_t err = handle_clone(proc_in, n, NULL, proc_out, &handle, n, &out);
+		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_HANDLE)
+			continue; /* unused index */
+		ANANAS_ERROR_RETURN(err);
+		KASSERT(n == out, "cloned handle %d to new handle %d", n, out);
+	}
+	return ananas_success();
+}
+
 errorcode_t
 handle_register_type(struct HANDLE_TYPE* ht)
 {
+	if (ht->ht_id <= HANDLE_TYPE_UNUSED || ht->ht_id >= HANDLE_TYPE_MAX)
+		return ANANAS_ERROR(BAD_TYPE);
+
+	errorcode_t err = ananas_success();
 	spinlock_lock(&spl_handletypes);
-	LIST_APPEND(&handle_types, ht);
+	if (handle_types[ht->ht_id] == NULL)
+		__atomic_store_n(&handle_types[ht->ht_id], ht, __ATOMIC_RELEASE);
+	else
+		err = ANANAS_ERROR(FILE_EXISTS);
 	spinlock_unlock(&spl_handletypes);
-	return ananas_success();
+	return err;
 }
 
 errorcode_t
 handle_unregister_type(struct HANDLE_TYPE* ht)
 {
+	if (ht->ht_id <= HANDLE_TYPE_UNUSED || ht->ht_id >= HANDLE_TYPE_MAX)
+		return ANANAS_ERROR(BAD_TYPE);
+
+	errorcode_t err = ananas_success();
 	spinlock_lock(&spl_handletypes);
-	LIST_REMOVE(&handle_types, ht);
+	if (handle_types[ht->ht_id] == ht)
+		__atomic_store_n(&handle_types[ht->ht_id], (struct HANDLE_TYPE*)NULL, __ATOMIC_RELEASE);
+	else
+		err = ANANAS_ERROR(BAD_TYPE);
 	spinlock_unlock(&spl_handletypes);
-	return ananas_success();
+	return err;
 }
 
 #ifdef OPTION_KDB
@@ -229,6 +425,7 @@ KDB_COMMAND(handle, "i:handle", "Display handle information")
 	kprintf("type          : %u\n", handle->h_type);
 	kprintf("flags         : %u\n", handle->h_flags);
 	kprintf("owner process : 0x%p\n", handle->h_process);
+	kprintf("refcount      : %u\n", handle->h_refcount);
 	switch(handle->h_type) {
 		case HANDLE_TYPE_FILE: {
 			kprintf("file handle specifics:\n");
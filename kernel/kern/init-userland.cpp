@@ -1,9 +1,11 @@
 #include <ananas/cmdline.h>
+#include <ananas/device.h>
 #include <ananas/error.h>
 #include <ananas/exec.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
 #include <ananas/process.h>
+#include <ananas/swap.h>
 #include <ananas/thread.h>
 #include <ananas/time.h>
 #include <ananas/vfs.h>
@@ -11,6 +13,54 @@
 
 namespace {
 
+/*
+ * Splits 'type:device' in arg; type is stored in type, and the remainder is
+ * returned - or nullptr if arg cannot be parsed.
+ */
+const char*
+parse_filesystem(const char* arg, char* type, size_t type_len)
+{
+	const char* p = strchr(arg, ':');
+	if (p == NULL || (size_t)(p - arg) >= type_len)
+		return NULL;
+
+	memcpy(type, arg, p - arg);
+	type[p - arg] = '\0';
+	return p + 1;
+}
+
+/*
+ * Mounts 'mount=type:device:path' from the commandline, if given. This is
+ * done once init is running: it is meant for slow storage, which need not hold
+ * us up if root is an image the loader has already placed in memory.
+ */
+void
+mount_late()
+{
+	const char* mount_arg = cmdline_get_string("mount");
+	if (mount_arg == NULL)
+		return;
+
+	char type[64], device[64];
+	const char* dev = parse_filesystem(mount_arg, type, sizeof(type));
+	const char* path = (dev != NULL) ? strchr(dev, ':') : NULL;
+	if (path == NULL || (size_t)(path - dev) >= sizeof(device)) {
+		kprintf("cannot parse 'mount' - expected type:device:path\n");
+		return;
+	}
+	memcpy(device, dev, path - dev);
+	device[path - dev] = '\0';
+	path++;
+
+	Ananas::DeviceManager::WaitForAttach();
+
+	errorcode_t err = vfs_mount(device, path, type, NULL);
+	if (ananas_is_failure(err))
+		kprintf("- Mounting %s (type %s) from %s failed, error %d\n", path, type, device, err);
+	else
+		kprintf("- Mounted %s (type %s) from %s\n", path, type, device);
+}
+
 void
 userinit_func(void*)
 {
@@ -24,15 +74,19 @@ userinit_func(void*)
 	}
 
 	char rootfs_type[64];
-	const char* p = strchr(rootfs_arg, ':');
-	if (p == NULL) {
+	const char* rootfs = parse_filesystem(rootfs_arg, rootfs_type, sizeof(rootfs_type));
+	if (rootfs == NULL) {
 		kprintf("cannot parse 'root' - expected type:device\n");
 		thread_exit(0);
 	}
 
-	memcpy(rootfs_type, rootfs_arg, p - rootfs_arg);
-	rootfs_type[p - rootfs_arg] = '\0';
-	const char* rootfs = p + 1;
+	/*
+	 * The root device may still be attaching; if it is already there (a
+	 * ramdisk holding an image the loader left for us), don't wait for the
+	 * rest of the devices.
+	 */
+	if (Ananas::DeviceManager::FindDevice(rootfs) == nullptr)
+		Ananas::DeviceManager::WaitForAttach();
 
 	kprintf("- Mounting / (type %s) from %s...", rootfs_type, rootfs);
 	while(true) {
@@ -53,6 +107,17 @@ userinit_func(void*)
 		kprintf(" success\n", err);
 #endif
 
+#ifdef OPTION_TMPFS
+	kprintf("- Mounting /tmp...");
+	err = vfs_mount(nullptr, "/tmp", "tmpfs", nullptr);
+	if (ananas_is_failure(err))
+		kprintf(" error %d\n", err);
+	else
+		kprintf(" success\n");
+#endif
+
+	swap_init();
+
 	// Now it makes sense to try to load init
 	const char* init_path = cmdline_get_string("init");
 	if (init_path == NULL || init_path[0] == '\0') {
@@ -89,7 +154,7 @@ userinit_func(void*)
 	process_set_environment(proc, env, sizeof(env));
 
 	addr_t exec_addr;
-	err = exec_load(proc->p_vmspace, file.f_dentry, &exec_addr);
+	err = exec_load(proc->p_vmspace, file.f_dentry, &exec_addr, proc->p_info);
 	if (ananas_is_success(err)) {
 		kprintf(" ok\n");
 		md_setup_post_exec(t, exec_addr);
@@ -98,6 +163,8 @@ userinit_func(void*)
 		kprintf(" fail - error %i\n", err);
 	}
 	vfs_close(&file);
+
+	mount_late();
 	thread_exit(0);
 }
 
@@ -1,3 +1,5 @@
+#include <ananas/boottime.h>
+#include <ananas/cmdline.h>
 #include <ananas/device.h>
 #include <ananas/console.h>
 #include <ananas/error.h>
@@ -6,6 +8,7 @@
 #include <ananas/init.h>
 #include <ananas/thread.h>
 #include <ananas/pcpu.h>
+#include <ananas/timer.h>
 #include <ananas/tty.h>
 #include <machine/vm.h>
 #include <machine/param.h> /* for PAGE_SIZE */
@@ -55,8 +58,15 @@ run_init()
 	
 	/* Execute all init functions in order except the final one */
 	struct INIT_FUNC** ifn = (struct INIT_FUNC**)ifn_chain;
-	for (int i = 0; i < num_init_funcs - 1; i++, ifn++)
-		(*ifn)->if_func();
+	for (int i = 0; i < num_init_funcs - 1; i++, ifn++) {
+		uint64_t start = md_timer_get_ns();
+		errorcode_t err = (*ifn)->if_func();
+		boottime_record(BOOTTIME_TYPE_INIT, start, err, "%s", (*ifn)->if_name);
+	}
+
+	/* If requested, show where the time went; the final function is not included as it never returns */
+	if (cmdline_get_string("boottime") != NULL)
+		boottime_print();
 
 	/* Throw away the init function chain; it served its purpose */
 	struct INIT_FUNC* ifunc = *ifn;
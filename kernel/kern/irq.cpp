@@ -1,11 +1,29 @@
+/*
+ * Interrupt dispatching: handlers registered as IRQ_TYPE_ISR run directly from
+ * the interrupt, everything else from the interrupt thread (IST) of the CPU
+ * that took the interrupt - which keeps the work on the CPU the interrupt is
+ * routed to. Ithreads run at THREAD_PRIORITY_INTERRUPT, so they preempt any
+ * ordinary thread.
+ *
+ * Walking the handlers takes no lock: a slot is only used once its
+ * IRQ_HANDLER_FLAG_SKIP flag is cleared, and irq_unregister() sets that flag
+ * and waits until nobody can be looking at the slot anymore before clearing
+ * it. Interrupt handlers are RCU read sections, and every ithread advertises
+ * the interrupt whose handlers it is running for the IST handlers, which may
+ * sleep.
+ */
 #include <machine/interrupts.h>
 #include <ananas/types.h>
+#include <ananas/deferred.h>
 #include <ananas/error.h>
 #include <ananas/pcpu.h>
+#include <ananas/preempt.h>
 #include <ananas/trace.h>
 #include <ananas/irq.h>
 #include <ananas/lib.h>
 #include <ananas/kdb.h>
+#include <ananas/schedule.h>
+#include <ananas/thread.h>
 #include <machine/param.h> /* PAGE_SIZE */
 #include "options.h"
 
@@ -18,6 +36,9 @@ static spinlock_t spl_irq = SPINLOCK_DEFAULT_INIT;
 /* Number of stray IRQ's that occur before reporting stops */
 #define IRQ_MAX_STRAY_COUNT 10
 
+/* Set by irq_balance() once every CPU can take interrupts */
+static bool irq_balancing = false;
+
 void
 irqsource_register(struct IRQ_SOURCE* source)
 {
@@ -37,8 +58,9 @@ irqsource_register(struct IRQ_SOURCE* source)
 	for(unsigned int n = 0; n < source->is_count; n++) {
 		struct IRQ* i = &irq[source->is_first + n];
 		i->i_source = source;
-		/* Also a good time to initialize the semaphore */
-		sem_init(&i->i_semaphore, 0);
+		i->i_cpu = 0; /* everything starts out on the boot CPU */
+		if (i->i_count.pc_slot == 0)
+			pcpu_counter_init(&i->i_count);
 	}
 
 	spinlock_unlock_unpremptible(&spl_irq, state);
@@ -72,31 +94,91 @@ irqsource_unregister(struct IRQ_SOURCE* source)
 	spinlock_unlock_unpremptible(&spl_irq, state);
 }
 
+/* Interrupt thread of a CPU */
+struct ITHREAD {
+	thread_t	it_thread;
+	semaphore_t	it_sem;
+	uint64_t	it_pending[MAX_IRQS / 64];	/* interrupts waiting for us */
+	int		it_irq;		/* interrupt being handled, -1 if none */
+};
+
+static struct ITHREAD ithread[PCPU_MAX_CPUS];
+
+/* State of the ithreads; they are created on demand */
+static int ithread_state = 0;
+#define ITHREAD_STATE_NONE	0
+#define ITHREAD_STATE_CREATING	1
+#define ITHREAD_STATE_READY	2
+
 static void
-ithread(void* context)
+ithread_func(void* context)
 {
-	unsigned int no = (unsigned int)(uintptr_t)context;
-	KASSERT(no < MAX_IRQS, "ithread for impossible irq %u", no);
-
-	struct IRQ* i = &irq[no];
-	struct IRQ_SOURCE* is = i->i_source;
-	KASSERT(is != NULL, "ithread for irq %u without source fired", no);
+	struct ITHREAD* it = static_cast<struct ITHREAD*>(context);
 
 	while(1) {
-		sem_wait(&i->i_semaphore);
-
-		/* XXX We do need a lock here */
-		struct IRQ_HANDLER* handler = &i->i_handler[0];
-		for (unsigned int slot = 0; slot < IRQ_MAX_HANDLERS; slot++, handler++) {
-			if (handler->h_func == NULL || (handler->h_flags & IRQ_HANDLER_FLAG_SKIP))
-				continue;
-			if (handler->h_flags & IRQ_HANDLER_FLAG_THREAD)
-				handler->h_func(handler->h_device, handler->h_context);
+		sem_wait(&it->it_sem);
+
+		for (unsigned int w = 0; w < MAX_IRQS / 64; w++) {
+			uint64_t pending = __atomic_exchange_n(&it->it_pending[w], 0, __ATOMIC_ACQ_REL);
+			while (pending != 0) {
+				unsigned int bit = __builtin_ctzll(pending);
+				pending &= pending - 1;
+				unsigned int no = w * 64 + bit;
+				struct IRQ* i = &irq[no];
+				struct IRQ_SOURCE* is = i->i_source;
+				KASSERT(is != NULL, "ithread for irq %u without source fired", no);
+
+				/* Announce ourselves before looking at the handlers; see irq_unregister() */
+				__atomic_store_n(&it->it_irq, no, __ATOMIC_SEQ_CST);
+				struct IRQ_HANDLER* handler = &i->i_handler[0];
+				for (unsigned int slot = 0; slot < IRQ_MAX_HANDLERS; slot++, handler++) {
+					unsigned int flags = __atomic_load_n(&handler->h_flags, __ATOMIC_SEQ_CST);
+					if (handler->h_func == NULL || (flags & IRQ_HANDLER_FLAG_SKIP))
+						continue;
+					if (flags & IRQ_HANDLER_FLAG_THREAD)
+						handler->h_func(handler->h_device, handler->h_context);
+				}
+				__atomic_store_n(&it->it_irq, -1, __ATOMIC_RELEASE);
+
+				/* Unmask the IRQ, we can handle it again now that the IST is done */
+				is->is_unmask(is, no - is->is_first);
+			}
 		}
+	}
+}
+
+/*
+ * Creates the interrupt thread of every CPU, unless this was already done;
+ * this happens once the first IST handler is registered, by which time all
+ * CPU's are known.
+ */
+static void
+ithread_init()
+{
+	if (__atomic_load_n(&ithread_state, __ATOMIC_ACQUIRE) == ITHREAD_STATE_READY)
+		return;
+
+	int expected = ITHREAD_STATE_NONE;
+	if (!__atomic_compare_exchange_n(&ithread_state, &expected, ITHREAD_STATE_CREATING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Someone else is creating them; they'll be done shortly */
+		while (__atomic_load_n(&ithread_state, __ATOMIC_ACQUIRE) != ITHREAD_STATE_READY)
+			schedule();
+		return;
+	}
 
-		/* Unmask the IRQ, we can handle it again now that the IST is done */
-		is->is_unmask(is, no - is->is_first);
+	for (unsigned int cpu = 0; cpu < pcpu_get_count(); cpu++) {
+		struct ITHREAD* it = &ithread[cpu];
+		sem_init(&it->it_sem, 0);
+		it->it_irq = -1;
+
+		char name[32];
+		snprintf(name, sizeof(name), "irq:cpu%u", cpu);
+		kthread_init(&it->it_thread, name, &ithread_func, it);
+		it->it_thread.t_affinity = THREAD_AFFINITY_CPU(cpu);
+		it->it_thread.t_priority = THREAD_PRIORITY_INTERRUPT;
+		thread_resume(&it->it_thread);
 	}
+	__atomic_store_n(&ithread_state, ITHREAD_STATE_READY, __ATOMIC_RELEASE);
 }
 
 /* Must be called with spl_irq held */
@@ -111,11 +193,75 @@ irqsource_find(unsigned int num)
 	return NULL;
 }
 
+/* Must be called with spl_irq held */
+static bool
+irq_is_routable(struct IRQ* i)
+{
+	if (i->i_source == NULL || i->i_source->is_set_cpu == NULL)
+		return false;
+	for (int slot = 0; slot < IRQ_MAX_HANDLERS; slot++)
+		if (i->i_handler[slot].h_func != NULL)
+			return true;
+	return false;
+}
+
+/*
+ * Picks the CPU which has the fewest interrupts routed to it, not counting
+ * the one we are picking for. Must be called with spl_irq held.
+ */
+static int
+irq_pick_cpu(struct IRQ* self)
+{
+	unsigned int num_cpus = pcpu_get_count();
+	unsigned int load[PCPU_MAX_CPUS];
+	memset(load, 0, sizeof(load));
+	for (unsigned int no = 0; no < MAX_IRQS; no++) {
+		struct IRQ* i = &irq[no];
+		if (i == self || !irq_is_routable(i))
+			continue;
+		if (i->i_cpu >= 0 && i->i_cpu < (int)num_cpus)
+			load[i->i_cpu]++;
+	}
+
+	int cpu = 0;
+	for (unsigned int n = 1; n < num_cpus; n++)
+		if (load[n] < load[cpu])
+			cpu = n;
+	return cpu;
+}
+
+/*
+ * Delivers the interrupt to the given CPU; before irq_balance(), we only
+ * remember the choice. Must be called with spl_irq held.
+ */
+static errorcode_t
+irq_route(unsigned int no, int cpu)
+{
+	struct IRQ* i = &irq[no];
+	struct IRQ_SOURCE* is = i->i_source;
+	if (irq_balancing && is->is_set_cpu != NULL) {
+		errorcode_t err = is->is_set_cpu(is, no - is->is_first, cpu);
+		ANANAS_ERROR_RETURN(err);
+	}
+	i->i_cpu = cpu;
+	return ananas_success();
+}
+
 errorcode_t
 irq_register(unsigned int no, Ananas::Device* dev, irqfunc_t func, int type, void* context)
+{
+	return irq_register_cpu(no, dev, func, type, context, IRQ_CPU_ANY);
+}
+
+errorcode_t
+irq_register_cpu(unsigned int no, Ananas::Device* dev, irqfunc_t func, int type, void* context, int cpu)
 {
 	if (no >= MAX_IRQS)
 		return ANANAS_ERROR(BAD_RANGE);
+	if (cpu != IRQ_CPU_ANY && (cpu < 0 || cpu >= (int)pcpu_get_count()))
+		return ANANAS_ERROR(BAD_RANGE);
+	if (type != IRQ_TYPE_ISR)
+		ithread_init();
 
 	register_t state = spinlock_lock_unpremptible(&spl_irq);
 
@@ -134,55 +280,44 @@ irq_register(unsigned int no, Ananas::Device* dev, irqfunc_t func, int type, voi
 
 	/* Locate a free slot for the handler */
 	int slot = 0;
-	for (/* nothing */; i->i_handler[slot].h_func != NULL && slot < IRQ_MAX_HANDLERS; slot++)
+	for (/* nothing */; slot < IRQ_MAX_HANDLERS && i->i_handler[slot].h_func != NULL; slot++)
 		/* nothing */;
 	if (slot == IRQ_MAX_HANDLERS) {
 		spinlock_unlock_unpremptible(&spl_irq, state);
 		return ANANAS_ERROR(FILE_EXISTS); /* XXX maybe make the error more generic? */
 	}
 
-	/* Found one, hook it up */
+	/*
+	 * An explicit CPU always wins; otherwise, the first handler of an interrupt
+	 * decides where it goes. Note that sources which can't route (such as
+	 * messages, which the device itself sends to a CPU) just record the CPU.
+	 */
+	if (cpu != IRQ_CPU_ANY) {
+		errorcode_t err = irq_route(no, cpu);
+		if (ananas_is_failure(err)) {
+			spinlock_unlock_unpremptible(&spl_irq, state);
+			return err;
+		}
+		i->i_flags |= IRQ_FLAG_AFFINITY;
+	} else if (irq_balancing && !irq_is_routable(i) && is->is_set_cpu != NULL && (i->i_flags & IRQ_FLAG_AFFINITY) == 0) {
+		(void)irq_route(no, irq_pick_cpu(i));
+	}
+
+	/*
+	 * Found one, hook it up; nothing looks at the slot until IRQ_HANDLER_FLAG_SKIP
+	 * is gone, so that must be the final store.
+	 */
 	struct IRQ_HANDLER* handler = &i->i_handler[slot];
+	handler->h_flags = IRQ_HANDLER_FLAG_SKIP;
 	handler->h_device = dev;
 	handler->h_func = func;
 	handler->h_context = context;
-	handler->h_flags = 0;
-	if (type != IRQ_TYPE_ISR)
-		handler->h_flags |= IRQ_FLAG_THREAD;
-
-	/*
-	 * See if we need to create an IST; we can't call kthread_init() in a
-	 * spinlock because it allocates memory. To cope, we do the following:
-	 *
-	 *  (1) Register the handler, but mark it as IRQ_HANDLER_FLAG_SKIP to avoid calling it
-	 *  (2) Release the lock
-	 *  (3) Create the IST
-	 *  (4) Acquire the lock
-	 *  (5)d Ad IRQ_FLAG_THREAD to the IRQ, and remove IRQ_HANDLER_FLAG_SKIP from the handler
-	 */
-	int create_thread = (i->i_flags & IRQ_HANDLER_FLAG_THREAD) == 0 && (handler->h_flags & IRQ_FLAG_THREAD);
-	if (create_thread)
-		handler->h_flags |= IRQ_HANDLER_FLAG_SKIP; /* (1) */
-
-	if (create_thread) {
-		spinlock_unlock_unpremptible(&spl_irq, state); /* (2) */
-
-		/* (3) Create the thread */
-		char thread_name[PAGE_SIZE];
-		snprintf(thread_name, sizeof(thread_name) - 1, "irq-%d", no);
-		thread_name[sizeof(thread_name) - 1] = '\0';
-		kthread_init(&i->i_thread, thread_name, &ithread, (void*)(uintptr_t)no);
-		thread_resume(&i->i_thread);
-
-		/* XXX we should set a decent priority here */
-
-		/* (4) Re-acquire the lock */
-		state = spinlock_lock_unpremptible(&spl_irq);
-
-		/* (5) Remove the IRQ_SKIP flag, add IRQ_FLAG_THREAD  */
-		handler->h_flags &= ~IRQ_HANDLER_FLAG_SKIP;
+	unsigned int flags = 0;
+	if (type != IRQ_TYPE_ISR) {
+		flags |= IRQ_HANDLER_FLAG_THREAD;
 		i->i_flags |= IRQ_FLAG_THREAD;
 	}
+	__atomic_store_n(&handler->h_flags, flags, __ATOMIC_RELEASE);
 
 	spinlock_unlock_unpremptible(&spl_irq, state);
 	return ananas_success();
@@ -197,22 +332,208 @@ irq_unregister(unsigned int no, Ananas::Device* dev, irqfunc_t func, void* conte
 	struct IRQ* i = &irq[no];
 	KASSERT(i->i_source != NULL, "interrupt %u has no source", no);
 
-	int matches = 0;
+	unsigned int slots = 0;
 	for (int slot = 0; slot < IRQ_MAX_HANDLERS; slot++) {
 		struct IRQ_HANDLER* handler = &i->i_handler[slot];
 		if (handler->h_device != dev || handler->h_func != func || handler->h_context != context)
 			continue;
+		if (handler->h_flags & IRQ_HANDLER_FLAG_SKIP)
+			continue; /* already being unregistered */
 
-		/* Found a match; unregister it */
-		handler->h_device = NULL;
-		handler->h_func = NULL;
-		handler->h_context = NULL;
-		handler->h_flags = 0;
-		matches++;
+		/* Found a match; hide it, but keep the slot until it's unused */
+		__atomic_or_fetch(&handler->h_flags, IRQ_HANDLER_FLAG_SKIP, __ATOMIC_SEQ_CST);
+		slots |= 1 << slot;
+	}
+	spinlock_unlock_unpremptible(&spl_irq, state);
+
+	KASSERT(slots != 0, "interrupt %u not registered", no);
+
+	/*
+	 * The handler may still be running on another CPU, as irq_handler() does
+	 * not lock; wait until it is done so that our caller can safely get rid of
+	 * the device and context. ISR's are covered by RCU, but handlers in an
+	 * ithread may sleep so we have to wait for those separately.
+	 */
+	rcu_synchronize();
+	if (__atomic_load_n(&ithread_state, __ATOMIC_ACQUIRE) == ITHREAD_STATE_READY) {
+		for (unsigned int cpu = 0; cpu < pcpu_get_count(); cpu++) {
+			while (__atomic_load_n(&ithread[cpu].it_irq, __ATOMIC_SEQ_CST) == (int)no)
+				schedule();
+		}
+	}
+
+	state = spinlock_lock_unpremptible(&spl_irq);
+	bool have_thread = false;
+	for (int slot = 0; slot < IRQ_MAX_HANDLERS; slot++) {
+		struct IRQ_HANDLER* handler = &i->i_handler[slot];
+		if (slots & (1 << slot)) {
+			handler->h_device = NULL;
+			handler->h_context = NULL;
+			handler->h_func = NULL;
+			handler->h_flags = 0;
+		} else if (handler->h_func != NULL && (handler->h_flags & IRQ_HANDLER_FLAG_THREAD)) {
+			have_thread = true;
+		}
+	}
+	if (!have_thread)
+		i->i_flags &= ~IRQ_FLAG_THREAD;
+	spinlock_unlock_unpremptible(&spl_irq, state);
+}
+
+errorcode_t
+irq_alloc(unsigned int count, unsigned int* first)
+{
+	KASSERT(count > 0 && (count & (count - 1)) == 0, "count %u not a power of two", count);
+
+	register_t state = spinlock_lock_unpremptible(&spl_irq);
+	LIST_FOREACH(&irq_sources, is, struct IRQ_SOURCE) {
+		if ((is->is_flags & IRQ_SOURCE_FLAG_DYNAMIC) == 0)
+			continue;
+
+		/* Walk all aligned blocks of this source until we find one that is entirely free */
+		unsigned int no = (is->is_first + count - 1) & ~(count - 1);
+		for (/* nothing */; no + count <= is->is_first + is->is_count; no += count) {
+			unsigned int n = 0;
+			for (/* nothing */; n < count; n++)
+				if (irq[no + n].i_flags & IRQ_FLAG_ALLOCATED)
+					break;
+			if (n < count)
+				continue;
+
+			for (n = 0; n < count; n++)
+				irq[no + n].i_flags |= IRQ_FLAG_ALLOCATED;
+			spinlock_unlock_unpremptible(&spl_irq, state);
+			*first = no;
+			return ananas_success();
+		}
+	}
+	spinlock_unlock_unpremptible(&spl_irq, state);
+	return ANANAS_ERROR(NO_RESOURCE);
+}
+
+void
+irq_free(unsigned int first, unsigned int count)
+{
+	KASSERT(first + count <= MAX_IRQS, "interrupts %u..%u out of range", first, first + count);
+
+	register_t state = spinlock_lock_unpremptible(&spl_irq);
+	for (unsigned int no = first; no < first + count; no++) {
+		struct IRQ* i = &irq[no];
+		KASSERT(i->i_flags & IRQ_FLAG_ALLOCATED, "interrupt %u not allocated", no);
+		for (int slot = 0; slot < IRQ_MAX_HANDLERS; slot++)
+			KASSERT(i->i_handler[slot].h_func == NULL, "interrupt %u still registered", no);
+		i->i_flags &= ~IRQ_FLAG_ALLOCATED;
+	}
+	spinlock_unlock_unpremptible(&spl_irq, state);
+}
+
+errorcode_t
+irq_set_cpu(unsigned int no, int cpu)
+{
+	if (no >= MAX_IRQS)
+		return ANANAS_ERROR(BAD_RANGE);
+	if (cpu != IRQ_CPU_ANY && (cpu < 0 || cpu >= (int)pcpu_get_count()))
+		return ANANAS_ERROR(BAD_RANGE);
+
+	register_t state = spinlock_lock_unpremptible(&spl_irq);
+	struct IRQ* i = &irq[no];
+	if (i->i_source == NULL || i->i_source->is_set_cpu == NULL) {
+		spinlock_unlock_unpremptible(&spl_irq, state);
+		return ANANAS_ERROR(UNSUPPORTED);
+	}
+
+	int flags = i->i_flags;
+	if (cpu == IRQ_CPU_ANY) {
+		flags &= ~IRQ_FLAG_AFFINITY;
+		cpu = irq_balancing ? irq_pick_cpu(i) : 0;
+	} else {
+		flags |= IRQ_FLAG_AFFINITY;
 	}
+	errorcode_t err = irq_route(no, cpu);
+	if (ananas_is_success(err))
+		i->i_flags = flags;
 	spinlock_unlock_unpremptible(&spl_irq, state);
+	return err;
+}
 
-	KASSERT(matches > 0, "interrupt %u not registered", no);
+int
+irq_get_cpu(unsigned int no)
+{
+	KASSERT(no < MAX_IRQS, "interrupt %u out of range", no);
+	return irq[no].i_cpu;
+}
+
+void
+irq_balance()
+{
+	register_t state = spinlock_lock_unpremptible(&spl_irq);
+	irq_balancing = true;
+
+	/*
+	 * Apply the explicit choices first, so that the rest is spread around
+	 * them; forget where the others were meant to go so they won't count
+	 * while picking.
+	 */
+	for (unsigned int no = 0; no < MAX_IRQS; no++) {
+		struct IRQ* i = &irq[no];
+		if (!irq_is_routable(i))
+			continue;
+		if ((i->i_flags & IRQ_FLAG_AFFINITY) == 0) {
+			i->i_cpu = IRQ_CPU_ANY;
+			continue;
+		}
+		errorcode_t err = irq_route(no, i->i_cpu);
+		if (ananas_is_failure(err)) {
+			kprintf("irq_balance(): cannot deliver irq %u to cpu %d, %d\n", no, i->i_cpu, err);
+			i->i_cpu = IRQ_CPU_ANY;
+			i->i_flags &= ~IRQ_FLAG_AFFINITY;
+		}
+	}
+
+	for (unsigned int no = 0; no < MAX_IRQS; no++) {
+		struct IRQ* i = &irq[no];
+		if (!irq_is_routable(i) || i->i_cpu != IRQ_CPU_ANY)
+			continue;
+		if (ananas_is_failure(irq_route(no, irq_pick_cpu(i))))
+			i->i_cpu = 0; /* still on the boot CPU */
+	}
+	spinlock_unlock_unpremptible(&spl_irq, state);
+}
+
+void
+irq_get_status(char* buf, size_t len)
+{
+	KASSERT(len > 0, "no space");
+	*buf = '\0';
+
+	register_t state = spinlock_lock_unpremptible(&spl_irq);
+	char* r = buf;
+	for (unsigned int no = 0; no < MAX_IRQS; no++) {
+		struct IRQ* i = &irq[no];
+		bool banner = false;
+		for (int slot = 0; slot < IRQ_MAX_HANDLERS; slot++) {
+			struct IRQ_HANDLER* handler = &i->i_handler[slot];
+			if (handler->h_func == NULL)
+				continue;
+			size_t left = len - (r - buf);
+			if (!banner) {
+				snprintf(r, left, "%u %d %c %u %u", no, i->i_cpu, (i->i_flags & IRQ_FLAG_AFFINITY) ? 'f' : '.', (unsigned int)pcpu_counter_read(&i->i_count), i->i_straycount);
+				banner = true;
+			} else {
+				snprintf(r, left, ",");
+			}
+			r += strlen(r);
+			if (handler->h_device != NULL) {
+				snprintf(r, len - (r - buf), " %s%d", handler->h_device->d_Name, handler->h_device->d_Unit);
+				r += strlen(r);
+			}
+		}
+		if (banner) {
+			snprintf(r, len - (r - buf), "\n");
+			r += strlen(r);
+		}
+	}
+	spinlock_unlock_unpremptible(&spl_irq, state);
 }
 
 void
@@ -220,7 +541,7 @@ irq_handler(unsigned int no)
 {
 	int cpuid = PCPU_GET(cpuid);
 	struct IRQ* i = &irq[no];
-	i->i_count++;
+	pcpu_counter_inc(&i->i_count);
 
 	KASSERT(no < MAX_IRQS, "irq_handler: (CPU %u) impossible irq %u fired", cpuid, no);
 	struct IRQ_SOURCE* is = i->i_source;
@@ -233,9 +554,10 @@ irq_handler(unsigned int no)
 	int awake_thread = 0, handled = 0;
 	struct IRQ_HANDLER* handler = &i->i_handler[0];
 	for (unsigned int slot = 0; slot < IRQ_MAX_HANDLERS; slot++, handler++) {
-		if (handler->h_func == NULL || (handler->h_flags & IRQ_HANDLER_FLAG_SKIP))
+		unsigned int flags = __atomic_load_n(&handler->h_flags, __ATOMIC_ACQUIRE);
+		if (handler->h_func == NULL || (flags & IRQ_HANDLER_FLAG_SKIP))
 			continue;
-		if ((handler->h_flags & IRQ_HANDLER_FLAG_THREAD) == 0) {
+		if ((flags & IRQ_HANDLER_FLAG_THREAD) == 0) {
 			/* plain old ISR */
 			if (handler->h_func(handler->h_device, handler->h_context) == IRQ_RESULT_PROCESSED)
 				handled++;
@@ -248,8 +570,10 @@ irq_handler(unsigned int no)
 		/* Mask the interrupt source; the ithread will unmask it once done */
 		is->is_mask(is, no - is->is_first);
 
-		/* Awake the interrupt thread */
-		sem_signal(&i->i_semaphore);
+		/* Awake the interrupt thread of this CPU; it's wherever the interrupt is routed to */
+		struct ITHREAD* it = &ithread[cpuid];
+		__atomic_or_fetch(&it->it_pending[no / 64], 1ULL << (no % 64), __ATOMIC_RELEASE);
+		sem_signal(&it->it_sem);
 	} else if (!handled && i->i_straycount < IRQ_MAX_STRAY_COUNT) {
 		/* If they IRQ wasn't handled, it is stray */
 		kprintf("irq_handler(): (CPU %u) stray irq %u, ignored\n", cpuid, no);
@@ -278,9 +602,17 @@ irq_handler(unsigned int no)
 	irq_nestcount--;
 	PCPU_SET(nested_irq, irq_nestcount);
 
-	/* If the IRQ handler resulted in a reschedule of the current thread, handle it */
+	/* Leaving the outermost interrupt; run whatever the handlers deferred */
+	if (irq_nestcount == 0)
+		deferred_run_irq();
+
+	/*
+	 * If the IRQ handler resulted in a reschedule of the current thread, handle
+	 * it - unless we interrupted a section which must not be preempted; the
+	 * flag stays set, so that the section's preempt_enable() will do it.
+	 */
 	thread_t* curthread = PCPU_GET(curthread);
-	if (irq_nestcount == 0 && THREAD_WANT_RESCHEDULE(curthread))
+	if (irq_nestcount == 0 && THREAD_WANT_RESCHEDULE(curthread) && !preempt_disabled())
 		schedule();
 }
 
@@ -302,15 +634,25 @@ KDB_COMMAND(irq, NULL, "Display IRQ status")
 			if (handler->h_func == NULL)
 				continue;
 			if (!banner) {
-				kprintf(" IRQ %d flags %x count %u stray %d\n", no, i->i_flags, i->i_count, i->i_straycount);
+				kprintf(" IRQ %d flags %x cpu %d count %u stray %d\n", no, i->i_flags, i->i_cpu, (unsigned int)pcpu_counter_read(&i->i_count), i->i_straycount);
 				banner = 1;
 			}
 			kprintf("  device '%s' handler %p flags %x\n", (handler->h_device != NULL) ? handler->h_device->d_Name : "<none>", handler->h_func, handler->h_flags);
 		}
-		if (!banner && (i->i_flags != 0 || i->i_count > 0 || i->i_straycount > 0))
-			kprintf(" IRQ %d flags %x count %u stray %d\n", no, i->i_flags, i->i_count, i->i_straycount);
+		unsigned int count = pcpu_counter_read(&i->i_count);
+		if (!banner && (i->i_flags != 0 || count > 0 || i->i_straycount > 0))
+			kprintf(" IRQ %d flags %x count %u stray %d\n", no, i->i_flags, count, i->i_straycount);
 	}
 }
+
+KDB_COMMAND(irqcpu, "i:irq i:cpu", "Deliver an IRQ to a CPU")
+{
+	unsigned int no = arg[1].a_u.u_value;
+	int cpu = arg[2].a_u.u_value;
+	errorcode_t err = irq_set_cpu(no, cpu);
+	if (ananas_is_failure(err))
+		kprintf("cannot deliver irq %u to cpu %d, %d\n", no, cpu, err);
+}
 #endif
 
 /* vim:set ts=2 sw=2: */
@@ -22,27 +22,355 @@
  * - (2) Addresses outside (1) are dynamically mapped using by finding an
  *       appropriate va which satisfies KMEM_DYNAMIC_VA_START <= va <=
  *       KMEM_DYNAMIC_VA_END
- * 
+ *
+ * The dynamic range is handed out by an arena allocator in the style of
+ * vmem: every piece of the range, free or in use, is described by a boundary
+ * tag (KMEM_SEGMENT) on an address-ordered list, so that neighbours can be
+ * coalesced when a piece is freed. Free segments are kept on power-of-two
+ * size class lists with a bitmap of the non-empty ones, which lets us find a
+ * segment that is certain to fit in constant time. Segments in use are
+ * hashed by their address, which is all kmem_unmap() needs.
+ *
+ * Most dynamic mappings are a few pages at most; those sizes are cached per
+ * CPU (the 'quantum caches'), so that they need not touch the arena at all.
  */
 #include <ananas/kmem.h>
 #include <ananas/lock.h>
 #include <ananas/init.h>
 #include <ananas/page.h>
+#include <ananas/pcpu.h>
 #include <ananas/vm.h>
 #include <ananas/mm.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
+#include <machine/interrupts.h>
 #include <machine/param.h>
 #include <machine/vm.h>
 #include "options.h"
 
 #define KMEM_DEBUG(...) (void)0
 
-static spinlock_t kmem_lock = SPINLOCK_DEFAULT_INIT;
-static struct PAGE* kmem_page;
-static struct KMEM_MAPPING* kmem_mappings = NULL;
+#define KMEM_NUM_FREELISTS	32	/* Size classes: [2^n, 2^(n+1)) pages */
+#define KMEM_HASH_SIZE		256	/* Buckets to hash segments in use */
+#define KMEM_BOOT_TAGS		64	/* Tags available before we can allocate pages */
+#define KMEM_TAG_RESERVE	32	/* Refill the tags once fewer than this are left */
+#define KMEM_QCACHE_MAX_PAGES	4	/* Largest mapping size cached per CPU */
+#define KMEM_QCACHE_SIZE	8	/* Segments cached per size and CPU */
+
+namespace {
+
+/* Boundary tag; describes a piece of the dynamic KVA range */
+struct KMEM_SEGMENT {
+	addr_t			ks_virt;
+	size_t			ks_pages;
+	addr_t			ks_phys;	/* In use only */
+	int			ks_flags;	/* In use only */
+	int			ks_free;
+	struct KMEM_SEGMENT*	ks_prev;	/* Address-ordered list of all segments */
+	struct KMEM_SEGMENT*	ks_next;
+	struct KMEM_SEGMENT*	ks_link_prev;	/* Free list; unused when hashed */
+	struct KMEM_SEGMENT*	ks_link_next;	/* Free list, hash chain or unused tags */
+};
+
+/* Everything in the arena is protected by kmem_lock */
+spinlock_t kmem_lock = SPINLOCK_DEFAULT_INIT;
+struct KMEM_SEGMENT* kmem_segments;	/* Address-ordered */
+struct KMEM_SEGMENT* kmem_freelist[KMEM_NUM_FREELISTS];
+uint32_t kmem_freelist_map;		/* Bit n is set if kmem_freelist[n] is non-empty */
+struct KMEM_SEGMENT* kmem_free_tags;
+unsigned int kmem_num_free_tags;
+struct KMEM_SEGMENT kmem_boot_tags[KMEM_BOOT_TAGS];
+
+struct KMEM_HASH_BUCKET {
+	spinlock_t		kh_lock;
+	struct KMEM_SEGMENT*	kh_first;
+} kmem_hash[KMEM_HASH_SIZE];
+
+/* Per-CPU caches of unmapped segments; only touched with interrupts disabled */
+struct KMEM_QCACHE {
+	unsigned int		kq_count[KMEM_QCACHE_MAX_PAGES];
+	struct KMEM_SEGMENT*	kq_segment[KMEM_QCACHE_MAX_PAGES][KMEM_QCACHE_SIZE];
+} __attribute__((aligned(64)));
+
+struct KMEM_QCACHE kmem_qcache[PCPU_MAX_CPUS];
+
+inline unsigned int
+kmem_log2(size_t n)
+{
+	return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(n);
+}
+
+inline unsigned int
+kmem_freelist_index(size_t pages)
+{
+	unsigned int n = kmem_log2(pages);
+	return (n < KMEM_NUM_FREELISTS) ? n : KMEM_NUM_FREELISTS - 1;
+}
+
+void
+kmem_freelist_insert(struct KMEM_SEGMENT* ks)
+{
+	unsigned int n = kmem_freelist_index(ks->ks_pages);
+	ks->ks_free = 1;
+	ks->ks_link_prev = nullptr;
+	ks->ks_link_next = kmem_freelist[n];
+	if (ks->ks_link_next != nullptr)
+		ks->ks_link_next->ks_link_prev = ks;
+	kmem_freelist[n] = ks;
+	kmem_freelist_map |= 1 << n;
+}
+
+void
+kmem_freelist_remove(struct KMEM_SEGMENT* ks)
+{
+	unsigned int n = kmem_freelist_index(ks->ks_pages);
+	if (ks->ks_link_prev != nullptr)
+		ks->ks_link_prev->ks_link_next = ks->ks_link_next;
+	else
+		kmem_freelist[n] = ks->ks_link_next;
+	if (ks->ks_link_next != nullptr)
+		ks->ks_link_next->ks_link_prev = ks->ks_link_prev;
+	if (kmem_freelist[n] == nullptr)
+		kmem_freelist_map &= ~(1 << n);
+	ks->ks_free = 0;
+}
+
+void
+kmem_tag_add(struct KMEM_SEGMENT* ks)
+{
+	ks->ks_link_next = kmem_free_tags;
+	kmem_free_tags = ks;
+	kmem_num_free_tags++;
+}
+
+struct KMEM_SEGMENT*
+kmem_tag_get()
+{
+	struct KMEM_SEGMENT* ks = kmem_free_tags;
+	if (ks == nullptr)
+		panic("kmem: out of boundary tags");
+	kmem_free_tags = ks->ks_link_next;
+	kmem_num_free_tags--;
+	return ks;
+}
+
+/*
+ * Ensures that there are enough tags for the next few splits; allocating a
+ * page may need a mapping, so this must be called without kmem_lock. Tag
+ * pages are never given back. Until the arena is set up, the boot tags will
+ * do; this means we need no pages to map the first few things.
+ */
+void
+kmem_tag_reserve()
+{
+	if (__atomic_load_n(&kmem_segments, __ATOMIC_RELAXED) == nullptr ||
+	    __atomic_load_n(&kmem_num_free_tags, __ATOMIC_RELAXED) >= KMEM_TAG_RESERVE)
+		return;
+
+	struct PAGE* p;
+	auto tags = static_cast<struct KMEM_SEGMENT*>(page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (tags == nullptr)
+		return; /* we'll have to make do with the reserve */
+
+	spinlock_lock(&kmem_lock);
+	for (unsigned int n = 0; n < PAGE_SIZE / sizeof(struct KMEM_SEGMENT); n++)
+		kmem_tag_add(&tags[n]);
+	spinlock_unlock(&kmem_lock);
+}
+
+/* Sets up the arena as a single free segment; must be called with kmem_lock held */
+void
+kmem_arena_init()
+{
+	for (unsigned int n = 0; n < KMEM_BOOT_TAGS; n++)
+		kmem_tag_add(&kmem_boot_tags[n]);
+
+	struct KMEM_SEGMENT* ks = kmem_tag_get();
+	ks->ks_virt = KMEM_DYNAMIC_VA_START;
+	ks->ks_pages = (KMEM_DYNAMIC_VA_END + 1 - KMEM_DYNAMIC_VA_START) / PAGE_SIZE;
+	ks->ks_prev = nullptr;
+	ks->ks_next = nullptr;
+	kmem_segments = ks;
+	kmem_freelist_insert(ks);
+}
+
+/* Allocates a segment of the given size from the arena; must be called with kmem_lock held */
+struct KMEM_SEGMENT*
+kmem_arena_alloc(size_t pages)
+{
+	if (kmem_segments == nullptr)
+		kmem_arena_init();
+
+	/*
+	 * Any segment on a list of a larger size class than ours fits; take the
+	 * smallest such class. Only if there is none do we look through the list
+	 * of our own class, as it may hold segments that are just too small.
+	 */
+	struct KMEM_SEGMENT* ks = nullptr;
+	unsigned int n = kmem_freelist_index(pages);
+	if ((size_t)1 << n == pages || n == KMEM_NUM_FREELISTS - 1) {
+		uint32_t map = kmem_freelist_map & ~((1U << n) - 1);
+		if (map != 0)
+			ks = kmem_freelist[__builtin_ctz(map)];
+	} else {
+		uint32_t map = kmem_freelist_map & ~((2U << n) - 1);
+		if (map != 0)
+			ks = kmem_freelist[__builtin_ctz(map)];
+		for (struct KMEM_SEGMENT* fs = kmem_freelist[n]; ks == nullptr && fs != nullptr; fs = fs->ks_link_next)
+			if (fs->ks_pages >= pages)
+				ks = fs;
+	}
+	if (ks == nullptr || ks->ks_pages < pages)
+		return nullptr;
+	kmem_freelist_remove(ks);
+
+	/* Hand the remainder back as a new segment */
+	if (ks->ks_pages > pages) {
+		struct KMEM_SEGMENT* rest = kmem_tag_get();
+		rest->ks_virt = ks->ks_virt + pages * PAGE_SIZE;
+		rest->ks_pages = ks->ks_pages - pages;
+		rest->ks_prev = ks;
+		rest->ks_next = ks->ks_next;
+		if (rest->ks_next != nullptr)
+			rest->ks_next->ks_prev = rest;
+		ks->ks_next = rest;
+		ks->ks_pages = pages;
+		kmem_freelist_insert(rest);
+	}
+	return ks;
+}
+
+/* Gives a segment back to the arena, merging it with its neighbours; must be called with kmem_lock held */
+void
+kmem_arena_free(struct KMEM_SEGMENT* ks)
+{
+	struct KMEM_SEGMENT* next = ks->ks_next;
+	if (next != nullptr && next->ks_free) {
+		kmem_freelist_remove(next);
+		ks->ks_pages += next->ks_pages;
+		ks->ks_next = next->ks_next;
+		if (ks->ks_next != nullptr)
+			ks->ks_next->ks_prev = ks;
+		kmem_tag_add(next);
+	}
+
+	struct KMEM_SEGMENT* prev = ks->ks_prev;
+	if (prev != nullptr && prev->ks_free) {
+		kmem_freelist_remove(prev);
+		prev->ks_pages += ks->ks_pages;
+		prev->ks_next = ks->ks_next;
+		if (prev->ks_next != nullptr)
+			prev->ks_next->ks_prev = prev;
+		kmem_tag_add(ks);
+		ks = prev;
+	}
+	kmem_freelist_insert(ks);
+}
+
+inline struct KMEM_HASH_BUCKET*
+kmem_hash_bucket(addr_t virt)
+{
+	return &kmem_hash[(virt / PAGE_SIZE) % KMEM_HASH_SIZE];
+}
+
+void
+kmem_hash_insert(struct KMEM_SEGMENT* ks)
+{
+	struct KMEM_HASH_BUCKET* kh = kmem_hash_bucket(ks->ks_virt);
+	spinlock_lock(&kh->kh_lock);
+	ks->ks_link_next = kh->kh_first;
+	kh->kh_first = ks;
+	spinlock_unlock(&kh->kh_lock);
+}
+
+/* Removes the segment which starts at virt from the hash; returns nullptr if there is none */
+struct KMEM_SEGMENT*
+kmem_hash_remove(addr_t virt)
+{
+	struct KMEM_HASH_BUCKET* kh = kmem_hash_bucket(virt);
+	spinlock_lock(&kh->kh_lock);
+	struct KMEM_SEGMENT* prev = nullptr;
+	struct KMEM_SEGMENT* ks = kh->kh_first;
+	for (/* nothing */; ks != nullptr; prev = ks, ks = ks->ks_link_next) {
+		if (ks->ks_virt != virt)
+			continue;
+		if (prev != nullptr)
+			prev->ks_link_next = ks->ks_link_next;
+		else
+			kh->kh_first = ks->ks_link_next;
+		break;
+	}
+	spinlock_unlock(&kh->kh_lock);
+	return ks;
+}
+
+/* Obtains a segment of the given size from this CPU's cache, if it has one */
+struct KMEM_SEGMENT*
+kmem_qcache_get(size_t pages)
+{
+	if (pages > KMEM_QCACHE_MAX_PAGES)
+		return nullptr;
+
+	struct KMEM_SEGMENT* ks = nullptr;
+	register_t state = md_interrupts_save_and_disable();
+	struct KMEM_QCACHE* kq = &kmem_qcache[PCPU_GET(cpuid)];
+	if (kq->kq_count[pages - 1] > 0)
+		ks = kq->kq_segment[pages - 1][--kq->kq_count[pages - 1]];
+	md_interrupts_restore(state);
+	return ks;
+}
 
-#define KMEM_NUM_MAPPINGS (PAGE_SIZE / sizeof(struct KMEM_MAPPING))
+/* Places an unmapped segment in this CPU's cache; returns false if it is full */
+bool
+kmem_qcache_put(struct KMEM_SEGMENT* ks)
+{
+	if (ks->ks_pages > KMEM_QCACHE_MAX_PAGES)
+		return false;
+
+	bool cached = false;
+	register_t state = md_interrupts_save_and_disable();
+	struct KMEM_QCACHE* kq = &kmem_qcache[PCPU_GET(cpuid)];
+	unsigned int& count = kq->kq_count[ks->ks_pages - 1];
+	if (count < KMEM_QCACHE_SIZE) {
+		kq->kq_segment[ks->ks_pages - 1][count++] = ks;
+		cached = true;
+	}
+	md_interrupts_restore(state);
+	return cached;
+}
+
+/* Returns an unmapped segment to where it came from */
+void
+kmem_release(struct KMEM_SEGMENT* ks)
+{
+	if (kmem_qcache_put(ks))
+		return;
+
+	spinlock_lock(&kmem_lock);
+	kmem_arena_free(ks);
+	spinlock_unlock(&kmem_lock);
+}
+
+inline bool
+kmem_is_direct(addr_t va)
+{
+	return va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END);
+}
+
+/*
+ * Removes the dynamic mapping of size pages at va from the administration,
+ * but not from the page tables.
+ */
+struct KMEM_SEGMENT*
+kmem_forget(addr_t va, size_t size)
+{
+	struct KMEM_SEGMENT* ks = kmem_hash_remove(va);
+	if (ks == nullptr || ks->ks_pages != size)
+		panic("kmem_unmap(): virt=%p pages=%d not mapped", va, size);
+	return ks;
+}
+
+} // unnamed namespace
 
 void*
 kmem_map(addr_t phys, size_t length, int flags)
@@ -65,84 +393,24 @@ kmem_map(addr_t phys, size_t length, int flags)
 		return (void*)(va + offset);
 	}
 
-	if (kmem_mappings == NULL) {
-		/*
-		 * Chicken-and-egg problem here: we need a page to store our administration,
-		 * but allocating one could invoke kmem_map() to allocate a mapping.
-		 *
-		 * XXX We just hope that this won't happen for now
-		 */
-		kmem_mappings = static_cast<struct KMEM_MAPPING*>(page_alloc_single_mapped(&kmem_page, VM_FLAG_READ | VM_FLAG_WRITE));
-		memset(kmem_mappings, 0, PAGE_SIZE);
-	}
-
-	/*
-	 * Try to locate a sensible location for this mapping; we keep kmem_mappings sorted so we can
-	 * easily reclaim virtual space in between.
-	 */
-	spinlock_lock(&kmem_lock);
-	addr_t virt = KMEM_DYNAMIC_VA_START;
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	unsigned int n = 0;
-	for (/* nothing */; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break; /* end of the line */
-		if (virt + size <= kmm->kmm_virt)
-			break; /* fits here */
-
-		/*
-		 * Only reject exact mappings; it's not up to us to determine how the
-		 * caller should behave.
-		 */
-		if (pa == kmm->kmm_phys && size == kmm->kmm_size) {
-			/* Already mapped */
-			spinlock_unlock(&kmem_lock);
-
-			panic("XXX range %p-%p already mapped (%p-%p) -> %p",
-			 pa, pa + size, kmm->kmm_phys, kmm->kmm_phys + size, kmm->kmm_virt);
-			return NULL;
-		}
-
-		/*
-		 * No fit here; try to place it after this mapping (this is an attempt to
-		 * fill up holes)
-		 */
-		virt = kmm->kmm_virt + kmm->kmm_size * PAGE_SIZE;
-	}
-
-	if (virt + size >= KMEM_DYNAMIC_VA_END) {
-		/* Out of KVA! XXX This shouldn't panic, but it's weird all-right */
+	/* Small sizes are usually cached; only go to the arena if they aren't */
+	struct KMEM_SEGMENT* ks = kmem_qcache_get(size);
+	if (ks == nullptr) {
+		kmem_tag_reserve();
+		spinlock_lock(&kmem_lock);
+		ks = kmem_arena_alloc(size);
 		spinlock_unlock(&kmem_lock);
-		panic("out of kva (%p + %x >= %p)", virt, size, KMEM_DYNAMIC_VA_END);
-		return NULL;
+		if (ks == nullptr)
+			panic("out of kva (%d pages requested)", size);
 	}
-
-	/*
-	 * XXX I wonder how realistic this is and whether it's worth bothering to come up with
-	 *     something more clever (there is no reason we couldn't move kmem_mappings)
-	 */
-	if (n == KMEM_NUM_MAPPINGS) {
-		spinlock_unlock(&kmem_lock);
-		/* XXX This shouldn't panic either */
-		panic("out of kva mappings!!");
-		return NULL;
-	}
-
-	/*
-	 * Need to insert the mapping at position n.
-	 */
-	memmove(&kmem_mappings[n + 1], &kmem_mappings[n], KMEM_NUM_MAPPINGS - n);
-	kmm->kmm_phys = pa;
-	kmm->kmm_size = size;
-	kmm->kmm_flags = flags;
-	kmm->kmm_virt = virt;
-	spinlock_unlock(&kmem_lock);
+	ks->ks_phys = pa;
+	ks->ks_flags = flags;
+	kmem_hash_insert(ks);
 
 	/* Now perform the actual mapping and we're set */
-	KMEM_DEBUG(">>> DID outside kmem map: pa=%p virt=%p size=%d\n", pa, virt, size);
-
-	md_kmap(pa, virt, size, flags);
-	return (void*)(virt + offset);
+	KMEM_DEBUG(">>> DID outside kmem map: pa=%p virt=%p size=%d\n", pa, ks->ks_virt, size);
+	md_kmap(pa, ks->ks_virt, size, flags);
+	return (void*)(ks->ks_virt + offset);
 }
 
 void
@@ -154,7 +422,7 @@ kmem_unmap(void* virt, size_t length)
 	KMEM_DEBUG("kmem_unmap(): virt=%p len=%d\n", virt, length);
 
 	/* If this is a direct mapping, we can just as easily undo it */
-	if (va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END)) {
+	if (kmem_is_direct(va)) {
 		KMEM_DEBUG("kmem_unmap(): direct removed: virt=%p len=%d (range %p-%p)\n", virt, length,
 		 PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START), PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END));
 
@@ -163,33 +431,42 @@ kmem_unmap(void* virt, size_t length)
 	}
 
 	/* We only allow exact mappings to be unmapped */
-	spinlock_lock(&kmem_lock);
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	for (unsigned int n = 0; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break; /* end of the line */
-		if (va != kmm->kmm_virt || size != kmm->kmm_size)
-			continue;
-	
-		KMEM_DEBUG("kmem_unmap(): unmapping: virt=%p len=%d\n", virt, length);
-
-		memmove(&kmem_mappings[n], &kmem_mappings[n + 1], KMEM_NUM_MAPPINGS - n);
-		/* And free the final one... */
-		for (unsigned int m = KMEM_NUM_MAPPINGS - 1; m > n; m--) {
-			struct KMEM_MAPPING* kmm = &kmem_mappings[m];
-			if (kmm->kmm_size == 0)
-				continue;
-			memset(kmm, 0, sizeof(*kmm));
-			break;
-		}
-		spinlock_unlock(&kmem_lock);
+	struct KMEM_SEGMENT* ks = kmem_forget(va, size);
+	md_kunmap(va, size);
+	kmem_release(ks);
+}
 
-		md_kunmap(va, size);
+void
+kmem_unmap_many(void* const* virt, size_t length, unsigned int count)
+{
+	/* Without a thread, we cannot batch the invalidations */
+	if (PCPU_GET(curthread) == nullptr) {
+		for (unsigned int n = 0; n < count; n++)
+			kmem_unmap(virt[n], length);
 		return;
 	}
-	spinlock_unlock(&kmem_lock);
 
-	panic("kmem_unmap(): virt=%p length=%d not mapped", virt, length);
+	/*
+	 * The addresses may only be reused once every CPU has forgotten about
+	 * them, so we hold on to them until the batch is done.
+	 */
+	constexpr unsigned int batchSize = 16;
+	while (count > 0) {
+		struct KMEM_SEGMENT* released[batchSize];
+		unsigned int num_released = 0;
+		md_tlb_batch_begin(nullptr);
+		for (/* nothing */; count > 0 && num_released < batchSize; virt++, count--) {
+			addr_t va = (addr_t)*virt & ~(PAGE_SIZE - 1);
+			size_t size = (length + ((addr_t)*virt & (PAGE_SIZE - 1)) + PAGE_SIZE - 1) / PAGE_SIZE;
+			if (!kmem_is_direct(va))
+				released[num_released++] = kmem_forget(va, size);
+			md_kunmap(va, size);
+		}
+		md_tlb_batch_end();
+
+		for (unsigned int n = 0; n < num_released; n++)
+			kmem_release(released[n]);
+	}
 }
 
 addr_t
@@ -199,22 +476,28 @@ kmem_get_phys(void* virt)
 	addr_t offset = (addr_t)virt & (PAGE_SIZE - 1);
 
 	/* If this is a direct mapping, we needn't look it up at all */
-	if (va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END))
+	if (kmem_is_direct(va))
 		return (va - PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START)) + offset;
 
-	/* Walk through the mappings */
-	spinlock_lock(&kmem_lock);
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	for (unsigned int n = 0; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break; /* end of the line */
-
-		if (va < kmm->kmm_virt)
+	/* Usually, we are given the start of a mapping; the hash will know it */
+	struct KMEM_HASH_BUCKET* kh = kmem_hash_bucket(va);
+	spinlock_lock(&kh->kh_lock);
+	for (struct KMEM_SEGMENT* ks = kh->kh_first; ks != nullptr; ks = ks->ks_link_next) {
+		if (ks->ks_virt != va)
 			continue;
-		if (va > kmm->kmm_virt + kmm->kmm_size * PAGE_SIZE)
+		addr_t phys = ks->ks_phys + offset;
+		spinlock_unlock(&kh->kh_lock);
+		return phys;
+	}
+	spinlock_unlock(&kh->kh_lock);
+
+	/* Not the start; walk through all segments to find the one containing it */
+	spinlock_lock(&kmem_lock);
+	for (struct KMEM_SEGMENT* ks = kmem_segments; ks != nullptr; ks = ks->ks_next) {
+		if (ks->ks_free || va < ks->ks_virt || va >= ks->ks_virt + ks->ks_pages * PAGE_SIZE)
 			continue;
 
-		addr_t phys = kmm->kmm_phys + ((addr_t)virt - (addr_t)kmm->kmm_virt);
+		addr_t phys = ks->ks_phys + ((addr_t)virt - ks->ks_virt);
 		spinlock_unlock(&kmem_lock);
 		return phys;
 	}
@@ -227,17 +510,17 @@ kmem_get_phys(void* virt)
 #ifdef OPTION_KDB
 KDB_COMMAND(kmappings, NULL, "Display kernel memory mappings")
 {
-	if (kmem_mappings == NULL)
-		return;
-
-	struct KMEM_MAPPING* kmm = kmem_mappings;
-	for (unsigned int n = 0; n < KMEM_NUM_MAPPINGS; n++, kmm++) {
-		if (kmm->kmm_size == 0)
-			break;
-		size_t len = kmm->kmm_size * PAGE_SIZE;
+	/* Mappings in the per-CPU caches are listed as in use, but have no physical address */
+	for (struct KMEM_SEGMENT* ks = kmem_segments; ks != nullptr; ks = ks->ks_next) {
+		size_t len = ks->ks_pages * PAGE_SIZE;
+		if (ks->ks_free) {
+			kprintf("free:    va %p-%p\n", ks->ks_virt, ks->ks_virt + len - 1);
+			continue;
+		}
 		kprintf("mapping: va %p-%p pa %p-%p\n",
-		 kmm->kmm_virt, kmm->kmm_virt + len - 1, kmm->kmm_phys, kmm->kmm_phys + len - 1);
+		 ks->ks_virt, ks->ks_virt + len - 1, ks->ks_phys, ks->ks_phys + len - 1);
 	}
+	kprintf("%u unused boundary tags\n", kmem_num_free_tags);
 }
 #endif
 
@@ -1,10 +1,84 @@
 #include <ananas/types.h>
 #include <ananas/lock.h>
+#include <ananas/error.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
 #include <ananas/pcpu.h>
+#include <ananas/preempt.h>
 #include <ananas/schedule.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
 #include <machine/interrupts.h>
+#include <machine/thread.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+namespace {
+
+/*
+ * Waits until we own the spinlock; interrupts must be disabled, as we would
+ * otherwise hold up everyone queued after us if we got preempted here.
+ */
+inline void
+spinlock_acquire(spinlock_t* s, void* caller)
+{
+	int ticket = atomic_add(&s->sl_next, 1);
+	if (atomic_read(&s->sl_serving) == ticket) {
+#ifdef OPTION_LOCK_STATS
+		if (s->sl_stats != NULL) {
+			lockstat_acquired(s->sl_stats, false, 0);
+			s->sl_stats->ls_hold_start = md_timer_get_ns();
+		}
+#endif
+		return;
+	}
+
+	/* Contended; wait for our turn */
+#ifdef OPTION_LOCK_STATS
+	uint64_t start = md_timer_get_ns();
+#endif
+	while (atomic_read(&s->sl_serving) != ticket)
+		md_cpu_pause();
+#ifdef OPTION_LOCK_STATS
+	if (s->sl_stats == NULL)
+		s->sl_stats = lockstat_alloc(LOCKSTAT_TYPE_SPINLOCK, s, caller);
+	if (s->sl_stats != NULL) {
+		uint64_t now = md_timer_get_ns();
+		lockstat_acquired(s->sl_stats, true, now - start);
+		s->sl_stats->ls_hold_start = now;
+	}
+#endif
+}
+
+#ifdef OPTION_LOCK_STATS
+inline void
+mutex_stats_acquired(mutex_t* mtx, bool contended, uint64_t start)
+{
+	mtx->mtx_acquired = md_timer_get_ns();
+	if (mtx->mtx_stats != NULL)
+		lockstat_acquired(mtx->mtx_stats, contended, mtx->mtx_acquired - start);
+}
+#endif
+
+inline void
+spinlock_release(spinlock_t* s)
+{
+	int serving = atomic_read(&s->sl_serving);
+	if (atomic_read(&s->sl_next) == serving)
+		panic("spinlock %p was not locked", s);
+
+#ifdef OPTION_LOCK_STATS
+	if (s->sl_stats != NULL)
+		lockstat_held(s->sl_stats, md_timer_get_ns() - s->sl_stats->ls_hold_start);
+#endif
+
+	/* Only the owner touches sl_serving, but all our stores must be visible first */
+	__asm __volatile("" : : : "memory");
+	atomic_set(&s->sl_serving, (int)((unsigned int)serving + 1));
+}
+
+} // unnamed namespace
 
 void
 spinlock_lock(spinlock_t* s)
@@ -12,49 +86,47 @@ spinlock_lock(spinlock_t* s)
 	if (scheduler_activated())
 		KASSERT(md_interrupts_save(), "interrups must be enabled");
 
-	for(;;) {
-		while(atomic_read(&s->sl_var) != 0)
-			/* spin */ ;
-		if (atomic_xchg(&s->sl_var, 1) == 0)
-			break;
-	}
+	/*
+	 * We must not be preempted while holding the lock, as everyone waiting for
+	 * it would spin until we are scheduled again; interrupts are enabled again
+	 * once we own it, so that we remain responsive.
+	 */
+	preempt_disable();
+	register_t state = md_interrupts_save_and_disable();
+	spinlock_acquire(s, __builtin_return_address(0));
+	md_interrupts_restore(state);
 }
 
 void
 spinlock_unlock(spinlock_t* s)
 {
-	if (atomic_xchg(&s->sl_var, 0) == 0)
-		panic("spinlock %p was not locked", s);
+	spinlock_release(s);
+	preempt_enable();
 }
 
 void
 spinlock_init(spinlock_t* s)
 {
-	atomic_set(&s->sl_var, 0);
+	atomic_set(&s->sl_next, 0);
+	atomic_set(&s->sl_serving, 0);
+	s->sl_stats = NULL;
 }
 
 register_t
 spinlock_lock_unpremptible(spinlock_t* s)
 {
-	register_t state = md_interrupts_save();
-
-	for(;;) {
-		while(atomic_read(&s->sl_var) != 0)
-			/* spin */ ;
-		md_interrupts_disable();
-		if (atomic_xchg(&s->sl_var, 1) == 0)
-			break;
-		/* Lock failed; restore interrupts and try again */
-		md_interrupts_restore(state);
-	}
+	preempt_disable();
+	register_t state = md_interrupts_save_and_disable();
+	spinlock_acquire(s, __builtin_return_address(0));
 	return state;
 }
 
 void
 spinlock_unlock_unpremptible(spinlock_t* s, register_t state)
 {
-	spinlock_unlock(s);
+	spinlock_release(s);
 	md_interrupts_restore(state);
+	preempt_enable();
 }
 
 void
@@ -62,20 +134,243 @@ mutex_init(mutex_t* mtx, const char* name)
 {
 	mtx->mtx_name = name;
 	mtx->mtx_owner = NULL;
+	mtx->mtx_owner_cpu = 0;
 	mtx->mtx_fname = NULL;
 	mtx->mtx_line = 0;
 	sem_init(&mtx->mtx_sem, 1);
+#ifdef OPTION_LOCK_STATS
+	mtx->mtx_stats = lockstat_get_class(name);
+#else
+	mtx->mtx_stats = NULL;
+#endif
+	mtx->mtx_acquired = 0;
+	mtx->mtx_pi_thread = NULL;
+	mtx->mtx_pi_next = NULL;
+	mtx->mtx_pi_priority = THREAD_PRIORITY_IDLE;
+}
+
+/*
+ * Priority inheritance: a thread which has to sleep for a mutex lends its
+ * priority to the owner, and on to whatever mutex the owner is sleeping for
+ * in turn - otherwise, a low-priority owner could be kept from the CPU by
+ * medium-priority threads whilst something important waits for it. Owners
+ * keep the contended mutexes they hold on their t_pi_mutexes list, along with
+ * the best priority lent through each, so that they can drop back to whatever
+ * is still lent to them as they unlock.
+ *
+ * spl_pi protects all of this; it is taken after sem_lock and before any
+ * scheduler lock.
+ */
+static spinlock_t spl_pi = SPINLOCK_DEFAULT_INIT;
+
+/* Maximum number of owners we will follow; a longer chain is likely a deadlock */
+#define MUTEX_PI_MAX_DEPTH 8
+
+/* Puts mtx on the t_pi_mutexes list of t, if it isn't already */
+static void
+mutex_pi_link(mutex_t* mtx, thread_t* t)
+{
+	if (mtx->mtx_pi_thread == t)
+		return;
+	KASSERT(mtx->mtx_pi_thread == NULL, "mutex '%s' still lends to %p", mtx->mtx_name, mtx->mtx_pi_thread);
+	mtx->mtx_pi_thread = t;
+	mtx->mtx_pi_priority = THREAD_PRIORITY_IDLE;
+	mtx->mtx_pi_next = t->t_pi_mutexes;
+	t->t_pi_mutexes = mtx;
+}
+
+/* Raises the priority of t to prio, remembering what it was */
+static void
+mutex_pi_boost(thread_t* t, int prio)
+{
+	if (t->t_priority <= prio)
+		return;
+	if (!t->t_pi_boosted) {
+		t->t_base_priority = t->t_priority;
+		t->t_pi_boosted = 1;
+	}
+	scheduler_set_priority(t, prio);
+}
+
+/*
+ * Lends the priority of t, which is about to sleep for mtx, to the owner of
+ * mtx and onwards. Must be called with spl_pi held.
+ */
+static void
+mutex_pi_lend(mutex_t* mtx, thread_t* t)
+{
+	int prio = t->t_priority;
+	t->t_pi_blocked_on = mtx;
+	for (int depth = 0; mtx != NULL && depth < MUTEX_PI_MAX_DEPTH; depth++) {
+		/*
+		 * The owner may not have filled out mtx_owner yet; it won't be boosted
+		 * then, which only lasts until the mutex changes hands again.
+		 */
+		thread_t* owner = *(thread_t* volatile*)&mtx->mtx_owner;
+		if (owner == NULL || owner == t)
+			break;
+		mutex_pi_link(mtx, owner);
+		if (prio < mtx->mtx_pi_priority)
+			mtx->mtx_pi_priority = prio;
+
+		/* If the owner is at least as important, it has lent itself onwards already */
+		if (owner->t_priority <= prio)
+			break;
+		mutex_pi_boost(owner, prio);
+		mtx = owner->t_pi_blocked_on;
+	}
+}
+
+/*
+ * Called by t, which slept for mtx and now owns it; the best thread still
+ * sleeping for mtx, if any, lends its priority to us. Must be called with
+ * spl_pi held.
+ */
+static void
+mutex_pi_acquired(mutex_t* mtx, thread_t* t, thread_t* next_waiter)
+{
+	t->t_pi_blocked_on = NULL;
+	if (next_waiter == NULL)
+		return;
+	mutex_pi_link(mtx, t);
+	mtx->mtx_pi_priority = next_waiter->t_priority;
+	mutex_pi_boost(t, next_waiter->t_priority);
+}
+
+/* Returns the best of our own priority and whatever is lent to us */
+static int
+mutex_pi_effective_priority(thread_t* t)
+{
+	int prio = t->t_base_priority;
+	for (mutex_t* m = t->t_pi_mutexes; m != NULL; m = m->mtx_pi_next)
+		if (m->mtx_pi_priority < prio)
+			prio = m->mtx_pi_priority;
+	return prio;
+}
+
+/*
+ * Called by t as it releases mtx; drops back to the best priority still lent
+ * to us through other mutexes, or our own if there is nothing left. Must be
+ * called with spl_pi held.
+ */
+static void
+mutex_pi_release(mutex_t* mtx, thread_t* t)
+{
+	if (mtx->mtx_pi_thread == t) {
+		for (mutex_t** m = &t->t_pi_mutexes; *m != NULL; m = &(*m)->mtx_pi_next) {
+			if (*m != mtx)
+				continue;
+			*m = mtx->mtx_pi_next;
+			break;
+		}
+		mtx->mtx_pi_thread = NULL;
+		mtx->mtx_pi_next = NULL;
+	}
+	if (!t->t_pi_boosted)
+		return;
+
+	int prio = mutex_pi_effective_priority(t);
+	if (t->t_pi_mutexes == NULL)
+		t->t_pi_boosted = 0;
+	if (t->t_priority != prio)
+		scheduler_set_priority(t, prio);
 }
 
+void
+mutex_pi_set_priority(thread_t* t, int prio)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_pi);
+	if (t->t_pi_boosted) {
+		t->t_base_priority = prio;
+		prio = mutex_pi_effective_priority(t);
+	}
+	if (t->t_priority != prio)
+		scheduler_set_priority(t, prio);
+	spinlock_unlock_unpremptible(&spl_pi, state);
+}
+
+static void sem_wait_common(semaphore_t* sem, void* caller, mutex_t* pi_mutex);
+
+/*
+ * Maximum number of times we'll poll a mutex whose owner is running before we
+ * give up and go to sleep.
+ */
+#define MUTEX_SPIN_LIMIT 1000
+
 void
 mutex_lock_(mutex_t* mtx, const char* fname, int line)
 {
-	sem_wait(&mtx->mtx_sem);
+	/*
+	 * If the owner is running on another CPU, it's likely to release the mutex
+	 * soon - spinning for a while is much cheaper than sleeping and being woken
+	 * up again. Once the owner is no longer running, it may be a while so we
+	 * just go to sleep.
+	 *
+	 * Note that we peek at the owner without any locks; the worst that can
+	 * happen is that we spin a bit too long or go to sleep a bit too soon. We
+	 * must never dereference the owner, as it may exit and be freed while we
+	 * spin: instead, we check whether it is still the current thread of the CPU
+	 * it took the mutex on, as per-CPU data is never freed. An owner which has
+	 * since moved to another CPU just makes us go to sleep.
+	 */
+	thread_t* curthread = PCPU_GET(curthread);
+#ifdef OPTION_LOCK_STATS
+	uint64_t start = md_timer_get_ns();
+	bool contended = true;
+#endif
+	for (int n = 0; n < MUTEX_SPIN_LIMIT; n++) {
+		if (*(volatile unsigned int*)&mtx->mtx_sem.sem_count > 0 && sem_trywait(&mtx->mtx_sem)) {
+#ifdef OPTION_LOCK_STATS
+			contended = n > 0;
+#endif
+			goto got_mutex;
+		}
+
+		thread_t* owner = *(thread_t* volatile*)&mtx->mtx_owner;
+		if (owner == curthread)
+			break;
+		if (owner != NULL) {
+			struct PCPU* pcpu = pcpu_get(*(volatile unsigned int*)&mtx->mtx_owner_cpu);
+			if (pcpu == NULL || *(thread_t* volatile*)&pcpu->curthread != owner)
+				break;
+		}
+		md_cpu_pause();
+	}
+
+	/* Not sem_wait(), as that would account for the semaphore as well */
+	sem_wait_common(&mtx->mtx_sem, NULL, mtx);
+
+got_mutex:
 
 	/* We got the mutex */
 	mtx->mtx_owner = PCPU_GET(curthread);
+	mtx->mtx_owner_cpu = PCPU_GET(cpuid);
 	mtx->mtx_fname = fname;
 	mtx->mtx_line = line;
+#ifdef OPTION_LOCK_STATS
+	mutex_stats_acquired(mtx, contended, start);
+#endif
+}
+
+errorcode_t
+mutex_lock_timeout_(mutex_t* mtx, uint64_t timeout, const char* fname, int line)
+{
+#ifdef OPTION_LOCK_STATS
+	uint64_t start = md_timer_get_ns();
+	bool contended = *(volatile unsigned int*)&mtx->mtx_sem.sem_count == 0;
+#endif
+	errorcode_t err = sem_wait_timeout(&mtx->mtx_sem, timeout);
+	ANANAS_ERROR_RETURN(err);
+
+	/* We got the mutex */
+	mtx->mtx_owner = PCPU_GET(curthread);
+	mtx->mtx_owner_cpu = PCPU_GET(cpuid);
+	mtx->mtx_fname = fname;
+	mtx->mtx_line = line;
+#ifdef OPTION_LOCK_STATS
+	mutex_stats_acquired(mtx, contended, start);
+#endif
+	return ananas_success();
 }
 
 int
@@ -86,8 +381,12 @@ mutex_trylock_(mutex_t* mtx, const char* fname, int line)
 
 	/* We got the mutex */
 	mtx->mtx_owner = PCPU_GET(curthread);
+	mtx->mtx_owner_cpu = PCPU_GET(cpuid);
 	mtx->mtx_fname = fname;
 	mtx->mtx_line = line;
+#ifdef OPTION_LOCK_STATS
+	mutex_stats_acquired(mtx, false, md_timer_get_ns());
+#endif
 	return 1;
 }
 
@@ -95,9 +394,27 @@ void
 mutex_unlock(mutex_t* mtx)
 {
 	KASSERT(mtx->mtx_owner == PCPU_GET(curthread), "unlocking mutex %p which isn't owned", mtx);
+#ifdef OPTION_LOCK_STATS
+	if (mtx->mtx_stats != NULL)
+		lockstat_held(mtx->mtx_stats, md_timer_get_ns() - mtx->mtx_acquired);
+#endif
 	mtx->mtx_owner = NULL;
 	mtx->mtx_fname = NULL;
 	mtx->mtx_line = 0;
+
+	/*
+	 * Anyone lending us priority through this mutex has queued itself before
+	 * looking at mtx_owner; the fence ensures that we either see them here, or
+	 * that they see the mutex as unowned.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	thread_t* curthread = PCPU_GET(curthread);
+	if (curthread != NULL && (curthread->t_pi_boosted || mtx->mtx_pi_thread != NULL ||
+	    __atomic_load_n(&mtx->mtx_sem.sem_wq.l_head, __ATOMIC_RELAXED) != NULL)) {
+		register_t state = spinlock_lock_unpremptible(&spl_pi);
+		mutex_pi_release(mtx, curthread);
+		spinlock_unlock_unpremptible(&spl_pi, state);
+	}
 	sem_signal(&mtx->mtx_sem);
 }
 
@@ -126,6 +443,156 @@ mutex_assert(mutex_t* mtx, int what)
 	}
 }
 
+/* Placeholder writer used while the lock is being handed to a waiting writer */
+#define RWLOCK_WRITER_HANDOFF reinterpret_cast<thread_t*>(1)
+
+void
+rwlock_init(rwlock_t* rw, const char* name)
+{
+	rw->rw_name = name;
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writer = NULL;
+	rw->rw_waiting_readers = 0;
+	rw->rw_waiting_writers = 0;
+	sem_init(&rw->rw_read_sem, 0);
+	sem_init(&rw->rw_write_sem, 0);
+}
+
+void
+rwlock_lock_read(rwlock_t* rw)
+{
+	spinlock_lock(&rw->rw_lock);
+	if (rw->rw_writer == NULL && rw->rw_waiting_writers == 0) {
+		rw->rw_readers++;
+		spinlock_unlock(&rw->rw_lock);
+		return;
+	}
+
+	/* We have to wait; whoever lets us in will bump rw_readers for us */
+	rw->rw_waiting_readers++;
+	spinlock_unlock(&rw->rw_lock);
+	sem_wait(&rw->rw_read_sem);
+}
+
+int
+rwlock_trylock_read(rwlock_t* rw)
+{
+	spinlock_lock(&rw->rw_lock);
+	int ok = rw->rw_writer == NULL && rw->rw_waiting_writers == 0;
+	if (ok)
+		rw->rw_readers++;
+	spinlock_unlock(&rw->rw_lock);
+	return ok;
+}
+
+void
+rwlock_unlock_read(rwlock_t* rw)
+{
+	spinlock_lock(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0, "unlocking rwlock '%s' without readers", rw->rw_name);
+	if (--rw->rw_readers == 0 && rw->rw_waiting_writers > 0) {
+		/* Last reader out; hand the lock to a writer */
+		rw->rw_waiting_writers--;
+		rw->rw_writer = RWLOCK_WRITER_HANDOFF;
+		sem_signal(&rw->rw_write_sem);
+	}
+	spinlock_unlock(&rw->rw_lock);
+}
+
+void
+rwlock_lock_write(rwlock_t* rw)
+{
+	thread_t* curthread = PCPU_GET(curthread);
+
+	spinlock_lock(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread, "rwlock '%s' already write-locked by us", rw->rw_name);
+	if (rw->rw_writer == NULL && rw->rw_readers == 0) {
+		rw->rw_writer = curthread;
+		spinlock_unlock(&rw->rw_lock);
+		return;
+	}
+
+	rw->rw_waiting_writers++;
+	spinlock_unlock(&rw->rw_lock);
+	sem_wait(&rw->rw_write_sem);
+
+	/* The lock was handed to us, we need only claim it */
+	spinlock_lock(&rw->rw_lock);
+	rw->rw_writer = curthread;
+	spinlock_unlock(&rw->rw_lock);
+}
+
+void
+rwlock_unlock_write(rwlock_t* rw)
+{
+	spinlock_lock(&rw->rw_lock);
+	KASSERT(rw->rw_writer == PCPU_GET(curthread), "unlocking rwlock '%s' which isn't owned", rw->rw_name);
+	rw->rw_writer = NULL;
+	if (rw->rw_waiting_readers > 0) {
+		/* Let all waiting readers in, so that they cannot be starved by writers */
+		rw->rw_readers += rw->rw_waiting_readers;
+		for (/* nothing */; rw->rw_waiting_readers > 0; rw->rw_waiting_readers--)
+			sem_signal(&rw->rw_read_sem);
+	} else if (rw->rw_waiting_writers > 0) {
+		rw->rw_waiting_writers--;
+		rw->rw_writer = RWLOCK_WRITER_HANDOFF;
+		sem_signal(&rw->rw_write_sem);
+	}
+	spinlock_unlock(&rw->rw_lock);
+}
+
+void
+rwlock_assert(rwlock_t* rw, int what)
+{
+	/* Like mutex_assert(), this peeks without locking and isn't 100% accurate */
+	switch(what) {
+		case RWLOCK_WRITE_LOCKED:
+			if (rw->rw_writer != PCPU_GET(curthread))
+				panic("rwlock '%s' not write-locked by current thread", rw->rw_name);
+			break;
+		case RWLOCK_LOCKED:
+			if (rw->rw_readers == 0 && rw->rw_writer != PCPU_GET(curthread))
+				panic("rwlock '%s' not locked", rw->rw_name);
+			break;
+		default:
+			panic("unknown condition %d", what);
+	}
+}
+
+/*
+ * Waits until every CPU has passed a quiescent state, i.e. it has left any RCU
+ * read section it may have been in when we were called. A CPU passes through
+ * a quiescent state whenever it reschedules; CPU's which are idling without a
+ * tick and aren't handling an interrupt are quiescent as well.
+ */
+void
+rcu_synchronize()
+{
+	KASSERT(PCPU_GET(nested_irq) == 0, "rcu_synchronize() in irq");
+
+	unsigned int snapshot[PCPU_MAX_CPUS];
+	unsigned int num_cpus = pcpu_get_count();
+	for (unsigned int n = 0; n < num_cpus; n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		snapshot[n] = (pcpu != NULL) ? pcpu->rcu_qs_count : 0;
+	}
+
+	/* Our current CPU isn't in a read section, as we are here */
+	unsigned int cpuid = PCPU_GET(cpuid);
+	for (unsigned int n = 0; n < num_cpus; n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu == NULL || n == cpuid)
+			continue;
+		while (pcpu->rcu_qs_count == snapshot[n] &&
+		       !(pcpu->sched_tickless && *(volatile int*)&pcpu->nested_irq == 0)) {
+			/* Give others a chance to run; this includes whoever is holding us up */
+			schedule();
+			md_cpu_pause();
+		}
+	}
+}
+
 void
 sem_init(semaphore_t* sem, int count)
 {
@@ -134,50 +601,100 @@ sem_init(semaphore_t* sem, int count)
 	spinlock_init(&sem->sem_lock);
 	sem->sem_count = count;
 	LIST_INIT(&sem->sem_wq);
+	sem->sem_stats = NULL;
+}
+
+/*
+ * sem_count is only ever changed atomically, so units can be taken and
+ * returned without the lock; the lock protects the list of waiters. A
+ * signaller adds its unit before looking for waiters, and a waiter looks for
+ * units after queueing itself - the fences ensure at least one of them sees
+ * the other, so no wakeup can get lost.
+ */
+static inline bool
+sem_take_unit(semaphore_t* sem)
+{
+	unsigned int count = __atomic_load_n(&sem->sem_count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&sem->sem_count, &count, count - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Queues a waiter behind all waiters of the same or higher priority; returns
+ * false if a unit was taken instead, in which case we need not wait at all.
+ * Must be called with sem_lock held.
+ */
+static bool
+sem_enqueue_waiter(semaphore_t* sem, struct SEMAPHORE_WAITER* sw)
+{
+	bool queued = false;
+	LIST_FOREACH(&sem->sem_wq, w, struct SEMAPHORE_WAITER) {
+		if (w->sw_thread->t_priority <= sw->sw_thread->t_priority)
+			continue;
+		LIST_INSERT_BEFORE(&sem->sem_wq, w, sw);
+		queued = true;
+		break;
+	}
+	if (!queued)
+		LIST_APPEND(&sem->sem_wq, sw);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!sem_take_unit(sem))
+		return true;
+	LIST_REMOVE(&sem->sem_wq, sw);
+	return false;
 }
 
 void
 sem_signal(semaphore_t* sem)
 {
+	/* Happy flow first: if no one is waiting, the unit we add is all there is to it */
+	__atomic_add_fetch(&sem->sem_count, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sem->sem_wq.l_head, __ATOMIC_RELAXED) == NULL)
+		return;
+
 	/*
-	 * It is possible that we are run when curthread == NULL; we have to skip the entire
-	 * wake-up thing in such a case
+	 * We have waiters; hand our unit directly to the most important one, unless
+	 * someone took it in the meantime. It is possible that we are run when
+	 * curthread == NULL; we have to skip the rescheduling in such a case.
 	 */
 	register_t state = spinlock_lock_unpremptible(&sem->sem_lock);
 	thread_t* curthread = PCPU_GET(curthread);
-	int wokeup_priority = (curthread != NULL) ? curthread->t_priority : 0;
-
-	if (!LIST_EMPTY(&sem->sem_wq)) {
-		/* We have waiters; wake up the first one */
+	if (!LIST_EMPTY(&sem->sem_wq) && sem_take_unit(sem)) {
 		struct SEMAPHORE_WAITER* sw = LIST_HEAD(&sem->sem_wq);
 		LIST_POP_HEAD(&sem->sem_wq);
 		sw->sw_signalled = 1;
 		thread_resume(sw->sw_thread);
-		wokeup_priority = sw->sw_thread->t_priority;
-		/* No need to adjust sem_count since the unblocked waiter won't touch it */
-	} else {
-		/* No waiters; increment the number of units left */
-		sem->sem_count++;
-	}
-
-	/*
-	 * If we woke up something more important than us, mark us as
-	 * reschedule.
-	 */
-	if (curthread != NULL && wokeup_priority < curthread->t_priority)
-		curthread->t_flags |= THREAD_FLAG_RESCHEDULE;
 
+		/*
+		 * If we woke up something more important than us, mark us as
+		 * reschedule.
+		 */
+		if (curthread != NULL && sw->sw_thread->t_priority < curthread->t_priority)
+			curthread->t_flags |= THREAD_FLAG_RESCHEDULE;
+	}
 	spinlock_unlock_unpremptible(&sem->sem_lock, state);
 }	
 
-/* Waits for a semaphore to be signalled, but holds it locked */
+/*
+ * Waits for a semaphore to be signalled; if caller is not NULL, statistics
+ * are kept for the semaphore and it is named by caller. If pi_mutex is not
+ * NULL, the semaphore belongs to it and we lend our priority to its owner
+ * whilst sleeping.
+ */
 static void
-sem_wait_and_lock(semaphore_t* sem, register_t* state)
+sem_wait_common(semaphore_t* sem, void* caller, mutex_t* pi_mutex)
 {
 	/* Happy flow first: if there are units left, we are done */
-	*state = spinlock_lock_unpremptible(&sem->sem_lock);
-	if (sem->sem_count > 0) {
-		sem->sem_count--;
+	if (sem_take_unit(sem)) {
+#ifdef OPTION_LOCK_STATS
+		if (caller != NULL && sem->sem_stats != NULL)
+			lockstat_acquired(sem->sem_stats, false, 0);
+#endif
 		return;
 	}
 
@@ -187,18 +704,44 @@ sem_wait_and_lock(semaphore_t* sem, register_t* state)
 	 * dies in thread_suspend() if we do.
 	 */
 	thread_t* curthread = PCPU_GET(curthread);
+#ifdef OPTION_LOCK_STATS
+	uint64_t start = md_timer_get_ns();
+#endif
 
 	struct SEMAPHORE_WAITER sw;
 	sw.sw_thread = curthread;
 	sw.sw_signalled = 0;
-	LIST_APPEND(&sem->sem_wq, &sw);
-	do {
-		thread_suspend(curthread);
-		/* Let go of the lock, but keep interrupts disabled */
-		spinlock_unlock(&sem->sem_lock);
-		schedule();
-		spinlock_lock_unpremptible(&sem->sem_lock);
-	} while (sw.sw_signalled == 0);
+	register_t state = spinlock_lock_unpremptible(&sem->sem_lock);
+	if (sem_enqueue_waiter(sem, &sw)) {
+		if (pi_mutex != NULL) {
+			spinlock_acquire(&spl_pi, __builtin_return_address(0));
+			mutex_pi_lend(pi_mutex, curthread);
+			spinlock_release(&spl_pi);
+		}
+		do {
+			thread_suspend(curthread);
+			/* Let go of the lock, but keep interrupts disabled */
+			spinlock_unlock(&sem->sem_lock);
+			schedule();
+			spinlock_lock_unpremptible(&sem->sem_lock);
+		} while (sw.sw_signalled == 0);
+		if (pi_mutex != NULL) {
+			struct SEMAPHORE_WAITER* next = LIST_EMPTY(&sem->sem_wq) ? NULL : LIST_HEAD(&sem->sem_wq);
+			spinlock_acquire(&spl_pi, __builtin_return_address(0));
+			mutex_pi_acquired(pi_mutex, curthread, next != NULL ? next->sw_thread : NULL);
+			spinlock_release(&spl_pi);
+		}
+	}
+	spinlock_unlock_unpremptible(&sem->sem_lock, state);
+
+#ifdef OPTION_LOCK_STATS
+	if (caller != NULL) {
+		if (sem->sem_stats == NULL)
+			sem->sem_stats = lockstat_alloc(LOCKSTAT_TYPE_SEMAPHORE, sem, caller);
+		if (sem->sem_stats != NULL)
+			lockstat_acquired(sem->sem_stats, true, md_timer_get_ns() - start);
+	}
+#endif
 }
 
 void
@@ -206,9 +749,7 @@ sem_wait(semaphore_t* sem)
 {
 	KASSERT(PCPU_GET(nested_irq) == 0, "sem_wait() in irq");
 
-	register_t state;
-	sem_wait_and_lock(sem, &state);
-	spinlock_unlock_unpremptible(&sem->sem_lock, state);
+	sem_wait_common(sem, __builtin_return_address(0), NULL);
 }
 
 void
@@ -216,25 +757,78 @@ sem_wait_and_drain(semaphore_t* sem)
 {
 	KASSERT(PCPU_GET(nested_irq) == 0, "sem_wait_and_drain() in irq");
 
-	register_t state;
-	sem_wait_and_lock(sem, &state);
-	sem->sem_count = 0; /* drain all remaining units */
+	sem_wait_common(sem, __builtin_return_address(0), NULL);
+	__atomic_store_n(&sem->sem_count, 0, __ATOMIC_RELAXED); /* drain all remaining units */
+}
+
+namespace {
+
+struct SEMAPHORE_TIMEOUT {
+	semaphore_t*			st_sem;
+	struct SEMAPHORE_WAITER*	st_waiter;
+	bool				st_expired;
+};
+
+void
+sem_timeout(void* context)
+{
+	auto st = static_cast<struct SEMAPHORE_TIMEOUT*>(context);
+	semaphore_t* sem = st->st_sem;
+
+	/* If we weren't signalled in the meantime, give up waiting */
+	register_t state = spinlock_lock_unpremptible(&sem->sem_lock);
+	struct SEMAPHORE_WAITER* sw = st->st_waiter;
+	if (sw->sw_signalled == 0) {
+		LIST_REMOVE(&sem->sem_wq, sw);
+		st->st_expired = true;
+		thread_resume(sw->sw_thread);
+	}
 	spinlock_unlock_unpremptible(&sem->sem_lock, state);
 }
 
-int
-sem_trywait(semaphore_t* sem)
+} // unnamed namespace
+
+errorcode_t
+sem_wait_timeout(semaphore_t* sem, uint64_t timeout)
 {
-	int result = 0;
+	KASSERT(PCPU_GET(nested_irq) == 0, "sem_wait_timeout() in irq");
+
+	if (sem_take_unit(sem))
+		return ananas_success();
 
+	/* Like sem_wait_common(), but the timer may take us off the waiters list */
+	thread_t* curthread = PCPU_GET(curthread);
+	struct SEMAPHORE_WAITER sw;
+	sw.sw_thread = curthread;
+	sw.sw_signalled = 0;
 	register_t state = spinlock_lock_unpremptible(&sem->sem_lock);
-	if (sem->sem_count > 0) {
-		sem->sem_count--;
-		result++;
+	if (!sem_enqueue_waiter(sem, &sw)) {
+		spinlock_unlock_unpremptible(&sem->sem_lock, state);
+		return ananas_success();
+	}
+
+	struct SEMAPHORE_TIMEOUT st = { sem, &sw, false };
+	struct TIMER tm;
+	timer_init(&tm, sem_timeout, &st);
+	timer_start(&tm, timer_get_ns() + timeout);
+	while (sw.sw_signalled == 0 && !st.st_expired) {
+		thread_suspend(curthread);
+		/* Let go of the lock, but keep interrupts disabled */
+		spinlock_unlock(&sem->sem_lock);
+		schedule();
+		spinlock_lock_unpremptible(&sem->sem_lock);
 	}
 	spinlock_unlock_unpremptible(&sem->sem_lock, state);
 
-	return result;
+	/* Waits for sem_timeout() if it is running; it must be done with our stack */
+	timer_cancel(&tm);
+	return sw.sw_signalled ? ananas_success() : ANANAS_ERROR(TIMEOUT);
+}
+
+int
+sem_trywait(semaphore_t* sem)
+{
+	return sem_take_unit(sem) ? 1 : 0;
 }
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,126 @@
+/*
+ * Lock statistics; every spinlock or semaphore which sees contention is given
+ * an entry here, as is every distinct mutex name. Entries keep track of how
+ * often the lock is acquired, how often we had to wait and for how long, and
+ * the longest time it was held. Entries are never freed, so locks which are
+ * gone will keep their final statistics.
+ */
+#include <ananas/types.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include "options.h"
+
+#define LOCKSTAT_MAX_ENTRIES 256
+
+namespace {
+
+struct LOCK_STATS lockstat_entry[LOCKSTAT_MAX_ENTRIES];
+atomic_t lockstat_next_entry;
+spinlock_t lockstat_class_lock; /* Serializes creating mutex classes */
+
+unsigned int
+lockstat_get_num_entries()
+{
+	unsigned int num_entries = atomic_read(&lockstat_next_entry);
+	return num_entries < LOCKSTAT_MAX_ENTRIES ? num_entries : LOCKSTAT_MAX_ENTRIES;
+}
+
+} // unnamed namespace
+
+struct LOCK_STATS*
+lockstat_alloc(int type, const void* lock, void* caller)
+{
+	/* Note that we are called with the lock held, so we need not worry about it */
+	int n = atomic_add(&lockstat_next_entry, 1);
+	if (n >= LOCKSTAT_MAX_ENTRIES)
+		return NULL;
+
+	struct LOCK_STATS* ls = &lockstat_entry[n];
+	ls->ls_type = type;
+	ls->ls_lock = lock;
+	ls->ls_caller = caller;
+	return ls;
+}
+
+struct LOCK_STATS*
+lockstat_get_class(const char* name)
+{
+	register_t state = spinlock_lock_unpremptible(&lockstat_class_lock);
+	struct LOCK_STATS* ls = NULL;
+	unsigned int num_entries = lockstat_get_num_entries();
+	for (unsigned int n = 0; n < num_entries; n++) {
+		struct LOCK_STATS* entry = &lockstat_entry[n];
+		if (entry->ls_type == LOCKSTAT_TYPE_MUTEX && strcmp(entry->ls_name, name) == 0) {
+			ls = entry;
+			break;
+		}
+	}
+	if (ls == NULL) {
+		ls = lockstat_alloc(LOCKSTAT_TYPE_MUTEX, NULL, NULL);
+		if (ls != NULL)
+			ls->ls_name = name;
+	}
+	spinlock_unlock_unpremptible(&lockstat_class_lock, state);
+	return ls;
+}
+
+/*
+ * Mutex classes are shared by locks which may be held concurrently, so we
+ * update everything atomically.
+ */
+void
+lockstat_acquired(struct LOCK_STATS* ls, bool contended, uint64_t wait_ns)
+{
+	__atomic_fetch_add(&ls->ls_acquisitions, 1, __ATOMIC_RELAXED);
+	if (!contended)
+		return;
+	__atomic_fetch_add(&ls->ls_contentions, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ls->ls_wait_ns, wait_ns, __ATOMIC_RELAXED);
+}
+
+void
+lockstat_held(struct LOCK_STATS* ls, uint64_t hold_ns)
+{
+	uint64_t cur_max = __atomic_load_n(&ls->ls_hold_max_ns, __ATOMIC_RELAXED);
+	while (hold_ns > cur_max &&
+	       !__atomic_compare_exchange_n(&ls->ls_hold_max_ns, &cur_max, hold_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		/* try again; cur_max has been updated */ ;
+}
+
+bool
+lockstat_format(unsigned int n, char* line, size_t len)
+{
+	if (n >= lockstat_get_num_entries())
+		return false;
+
+	static const char* type_names[] = { "?", "spinlock", "mutex", "sem" };
+	const struct LOCK_STATS* ls = &lockstat_entry[n];
+	char name[32];
+	if (ls->ls_type == LOCKSTAT_TYPE_MUTEX && ls->ls_name != NULL)
+		strncpy(name, ls->ls_name, sizeof(name) - 1);
+	else
+		snprintf(name, sizeof(name), "%p", ls->ls_lock);
+	name[sizeof(name) - 1] = '\0';
+
+	snprintf(line, len, "%-8s %-20s %p %10u %10u %10u %10u\n",
+	 type_names[ls->ls_type <= LOCKSTAT_TYPE_SEMAPHORE ? ls->ls_type : 0], name, ls->ls_caller,
+	 (unsigned int)ls->ls_acquisitions, (unsigned int)ls->ls_contentions,
+	 (unsigned int)(ls->ls_wait_ns / 1000), (unsigned int)(ls->ls_hold_max_ns / 1000));
+	return true;
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(lockstat, NULL, "Display lock statistics")
+{
+	kprintf("type     lock                 caller             acquired  contended    wait us max hold us\n");
+	char line[128];
+	for (unsigned int n = 0; lockstat_format(n, line, sizeof(line)); n++)
+		kprintf("%s", line);
+	if (atomic_read(&lockstat_next_entry) >= LOCKSTAT_MAX_ENTRIES)
+		kprintf("(out of entries; further locks are not tracked)\n");
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
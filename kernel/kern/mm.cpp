@@ -5,36 +5,161 @@
 #include <ananas/mm.h>
 #include <ananas/vm.h>
 #include <ananas/lib.h>
+#include <ananas/pcpu.h>
 
-static mutex_t mtx_mm;
+/*
+ * Every CPU has its own dlmalloc arena (mspace), so that kmalloc() on
+ * different CPUs does not contend for a single lock. Memory freed on a CPU
+ * other than the one that allocated it is queued on the owning arena, which
+ * releases it in batches the next time it is used by its own CPU.
+ */
+#define MM_REMOTE_BATCH	32	/* Release queued frees once there are this many */
+
+typedef void* mspace;
 
 extern "C" {
-void* dlmalloc(size_t);
-void dlfree(void*);
+mspace create_mspace(size_t capacity, int locked);
+void* mspace_malloc(mspace msp, size_t bytes);
+void mspace_free(mspace msp, void* mem);
+mspace mspace_owner(void* mem);
+size_t mspace_footprint(mspace msp);
+struct mallinfo mspace_mallinfo(mspace msp);
 }
 
+/* Must match the definition in dlmalloc.cpp */
+struct mallinfo {
+	size_t arena;
+	size_t ordblks;
+	size_t smblks;
+	size_t hblks;
+	size_t hblkhd;
+	size_t usmblks;
+	size_t fsmblks;
+	size_t uordblks;	/* Total allocated space */
+	size_t fordblks;	/* Total free space */
+	size_t keepcost;
+};
+
+struct MM_REMOTE_FREE {
+	struct MM_REMOTE_FREE* rf_next;
+};
+
+struct MM_ARENA {
+	mutex_t a_mtx;				/* Protects a_mspace */
+	mspace a_mspace;
+	spinlock_t a_remote_lock;		/* Protects the remote queue */
+	struct MM_REMOTE_FREE* a_remote;
+	unsigned int a_remote_count;
+};
+
+static struct MM_ARENA mm_arena[PCPU_MAX_CPUS];
+
 void
 mm_init()
 {
-	mutex_init(&mtx_mm, "mm");
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+		struct MM_ARENA* a = &mm_arena[n];
+		mutex_init(&a->a_mtx, "mm");
+		spinlock_init(&a->a_remote_lock);
+		a->a_mspace = NULL;
+		a->a_remote = NULL;
+		a->a_remote_count = 0;
+	}
+}
+
+static inline struct MM_ARENA*
+mm_arena_current()
+{
+	/*
+	 * Note that we may be moved to a different CPU after this; that is fine as
+	 * the arena has its own lock - we just prefer the local one.
+	 */
+	return &mm_arena[PCPU_GET(cpuid)];
+}
+
+static struct MM_ARENA*
+mm_arena_find(void* addr)
+{
+	mspace msp = mspace_owner(addr);
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++)
+		if (mm_arena[n].a_mspace == msp)
+			return &mm_arena[n];
+	panic("kfree(): %p not owned by any arena", addr);
 }
 
+/* Releases all frees queued by other CPUs; must be called with a_mtx held */
+static void
+mm_arena_drain_locked(struct MM_ARENA* a)
+{
+	spinlock_lock(&a->a_remote_lock);
+	struct MM_REMOTE_FREE* rf = a->a_remote;
+	a->a_remote = NULL;
+	a->a_remote_count = 0;
+	spinlock_unlock(&a->a_remote_lock);
+
+	while (rf != NULL) {
+		struct MM_REMOTE_FREE* next = rf->rf_next;
+		mspace_free(a->a_mspace, rf);
+		rf = next;
+	}
+}
 
 void*
 kmalloc(size_t len)
 {
-	mutex_lock(&mtx_mm);
-	void* ptr = dlmalloc(len);
-	mutex_unlock(&mtx_mm);
+	struct MM_ARENA* a = mm_arena_current();
+	mutex_lock(&a->a_mtx);
+	if (a->a_mspace == NULL)
+		a->a_mspace = create_mspace(0, 0);
+	if (a->a_remote_count >= MM_REMOTE_BATCH)
+		mm_arena_drain_locked(a);
+	void* ptr = mspace_malloc(a->a_mspace, len);
+	mutex_unlock(&a->a_mtx);
 	return ptr;
 }
 
 void
 kfree(void* addr)
 {
-	mutex_lock(&mtx_mm);
-	dlfree(addr);
-	mutex_unlock(&mtx_mm);
+	if (addr == NULL)
+		return;
+
+	struct MM_ARENA* a = mm_arena_find(addr);
+	if (a != mm_arena_current()) {
+		/* Not ours; queue it so that the owner can free it later */
+		auto rf = static_cast<struct MM_REMOTE_FREE*>(addr);
+		spinlock_lock(&a->a_remote_lock);
+		rf->rf_next = a->a_remote;
+		a->a_remote = rf;
+		a->a_remote_count++;
+		spinlock_unlock(&a->a_remote_lock);
+		return;
+	}
+
+	mutex_lock(&a->a_mtx);
+	mspace_free(a->a_mspace, addr);
+	if (a->a_remote_count >= MM_REMOTE_BATCH)
+		mm_arena_drain_locked(a);
+	mutex_unlock(&a->a_mtx);
+}
+
+void
+mm_get_status(char* buf, size_t len)
+{
+	char* r = buf;
+	*r = '\0';
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+		struct MM_ARENA* a = &mm_arena[n];
+		mutex_lock(&a->a_mtx);
+		if (a->a_mspace != NULL) {
+			struct mallinfo mi = mspace_mallinfo(a->a_mspace);
+			snprintf(r, len - (r - buf), "cpu%u footprint_kb %u used_kb %u free_kb %u remote_frees %u\n", n,
+			 (unsigned int)(mspace_footprint(a->a_mspace) / 1024), (unsigned int)(mi.uordblks / 1024),
+			 (unsigned int)(mi.fordblks / 1024), a->a_remote_count);
+			r += strlen(r);
+		}
+		mutex_unlock(&a->a_mtx);
+	}
 }
 
 void*
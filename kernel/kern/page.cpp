@@ -1,15 +1,72 @@
 #include <ananas/page.h>
 #include <machine/param.h>
+#include <ananas/error.h>
 #include <ananas/init.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
 #include <ananas/list.h>
 #include <ananas/vm.h>
+#include <ananas/vmpage.h>
 #include <ananas/kmem.h>
+#include <ananas/pcpu.h>
+#include <machine/interrupts.h>
 #include "options.h"
 
 #undef PAGE_DEBUG
 
+/*
+ * Every CPU keeps a cache of order-0 pages; allocating and freeing these will
+ * only touch the zones once per PAGE_CACHE_BATCH pages. Pages in these caches
+ * are considered to be allocated as far as the zones are concerned.
+ */
+#define PAGE_CACHE_BATCH	16	/* Pages moved between zone and cache at once */
+#define PAGE_CACHE_MAX		64	/* Drain the cache once it has this many pages */
+
+/*
+ * Blocks of the largest order all have a mobility (PAGE_MOBILITY_...); their
+ * pages are allocated by that kind first. Once one kind runs out, it takes
+ * the largest free blocks of the other kind; an entirely free block changes
+ * hands, so that later allocations are grouped with it.
+ */
+#define PAGE_BLOCK_ORDER	(PAGE_NUM_ORDERS - 1)
+#define PAGE_BLOCK_DEFERRED	0xff	/* Mobility of blocks which are not set up yet */
+
+/*
+ * Setting up the administration of every page takes a while on machines with
+ * lots of memory. At boot, only the first PAGE_DEFER_BOOT pages are set up;
+ * the rest is done by a thread per CPU once all CPUs are up, in chunks of
+ * PAGE_DEFER_CHUNK blocks which are handed to the allocator as they are done.
+ * Should memory run out before then, the allocator sets up a chunk itself.
+ */
+#define PAGE_DEFER_BOOT		((256 * 1024 * 1024) / PAGE_SIZE)
+#define PAGE_DEFER_CHUNK	64
+
+/*
+ * If no free block of some order is left, compaction looks for the aligned
+ * range of that size with the fewest pages in use, all of which must be
+ * movable, and moves those elsewhere so that the range coalesces.
+ */
+#define PAGE_COMPACT_TRIES	3	/* Compaction passes per allocation, at most */
+
+/*
+ * We keep a pool of pages which are known to be filled with zeroes, so that
+ * anyone needing a cleared page need not clear it on the spot; the pool is
+ * refilled by the 'pagezero' thread, which only runs when the CPU would
+ * otherwise be idle. Pages in the pool are allocated as far as the zones are
+ * concerned.
+ */
+#define PAGE_ZERO_LOW		32	/* Wake the zeroing thread below this many pages */
+#define PAGE_ZERO_TARGET	128	/* Stop zeroing once this many pages are pooled */
+#define PAGE_ZERO_RESERVE	8	/* Never zero if less than 1/PAGE_ZERO_RESERVE of memory is available */
+
+/*
+ * The 'pagedaemon' thread is woken once less than 1/PAGE_DAEMON_LOW of memory
+ * is available, and calls the reclaimers until twice that is available again.
+ * Allocations which may sleep wait for it rather than panic if they fail.
+ */
+#define PAGE_DAEMON_LOW		64
+#define PAGE_DAEMON_MIN		32	/* Low watermark never goes below this many pages */
+
 #ifdef PAGE_DEBUG
 # define DPRINTF(fmt,...) kprintf(fmt, __VA_ARGS__)
 #else
@@ -18,6 +75,49 @@
 
 static struct zone_list zones;
 
+/*
+ * Node preference order: page_node_order[n] lists all nodes, nearest to node
+ * n first. Allocations which cannot be satisfied by the current CPU's node
+ * count as remote.
+ */
+static unsigned int page_num_nodes = 1;
+static uint8_t page_node_order[PAGE_MAX_NODES][PAGE_MAX_NODES];
+
+struct PAGE_NODE_STATS {
+	pcpu_counter_t ns_local;	/* Allocations from the CPU's own node */
+	pcpu_counter_t ns_remote;	/* Allocations which had to use another node */
+};
+static struct PAGE_NODE_STATS page_node_stats[PAGE_MAX_NODES];
+
+static unsigned int page_boot_pages; /* pages set up by page_zone_add() */
+static spinlock_t spl_deferred = SPINLOCK_DEFAULT_INIT;
+static unsigned int page_deferred_threads; /* still running */
+static thread_t page_deferred_thread[PCPU_MAX_CPUS];
+
+static unsigned int page_compact_count; /* compaction passes which made a block */
+static unsigned int page_compact_moved; /* pages moved by compaction */
+
+static spinlock_t spl_reclaimers = SPINLOCK_DEFAULT_INIT;
+static struct page_reclaimer_list page_reclaimers;
+
+static spinlock_t spl_zero = SPINLOCK_DEFAULT_INIT;
+static struct page_list page_zero_list;
+static unsigned int page_zero_count;
+static bool page_zero_wakeup; /* protected by spl_zero */
+static bool page_zero_running;
+static semaphore_t page_zero_sem;
+static thread_t page_zero_thread;
+
+static spinlock_t spl_daemon = SPINLOCK_DEFAULT_INIT;
+static unsigned int page_daemon_low, page_daemon_high;
+static bool page_daemon_wakeup; /* protected by spl_daemon */
+static bool page_daemon_running;
+static unsigned int page_daemon_num_waiters; /* protected by spl_daemon */
+static bool page_daemon_progress; /* whether the last pass freed anything, protected by spl_daemon */
+static semaphore_t page_daemon_sem;
+static semaphore_t page_daemon_done_sem;
+static thread_t page_daemon_thread;
+
 static inline int
 get_bit(const char* map, int bit)
 {
@@ -52,20 +152,25 @@ bytes2order(size_t length)
 	return order;
 }
 
-void
-page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
+static inline unsigned int
+page_block_mobility(struct PAGE_ZONE* z, unsigned int index)
+{
+	return z->z_block_mobility[index >> PAGE_BLOCK_ORDER];
+}
+
+static void
+page_free_index_locked(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 {
 	struct PAGE* p = &z->z_base[index];
 	DPRINTF("page_free_index(): order=%u index=%u -> p=%p\n", order, index, p);
 
-	spinlock_lock(&z->z_lock);
-
 	/* Clear the current index; it is available */
 	clear_bit(z->z_bitmap, index);
 	z->z_avail_pages += 1 << order;
 
-	/* Add this buddy to the freelist */
-	LIST_APPEND(&z->z_free[order], p);
+	/* Add this buddy to the freelist; buddies are always within the same block */
+	struct page_list* free = z->z_free[page_block_mobility(z, index)];
+	LIST_APPEND(&free[order], p);
 
 	/* Now, attempt to merge the available pages */
 	while (order < PAGE_NUM_ORDERS - 1) {
@@ -83,51 +188,64 @@ page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 		 * Now, we should combine the two buddies to one; first of all, remove them
 		 * both.
 		 */
-		LIST_REMOVE(&z->z_free[order], &z->z_base[index]);
-		LIST_REMOVE(&z->z_free[order], &z->z_base[buddy_index]);
+		LIST_REMOVE(&free[order], &z->z_base[index]);
+		LIST_REMOVE(&free[order], &z->z_base[buddy_index]);
 
 		/* And add a single entry to the freelist one order above us */
 		order++;
 		index &= ~((1 << order) - 1);
-		LIST_APPEND(&z->z_free[order], &z->z_base[index]);
+		LIST_APPEND(&free[order], &z->z_base[index]);
 		z->z_base[index].p_order = order;
 	}
-
-	spinlock_unlock(&z->z_lock);
 }
 
 void
-page_free(struct PAGE* p)
+page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 {
-	struct PAGE_ZONE* z = p->p_zone;
-	page_free_index(z, p->p_order, p - z->z_base);
+	spinlock_lock(&z->z_lock);
+	page_free_index_locked(z, order, index);
+	spinlock_unlock(&z->z_lock);
 }
 
-struct PAGE*
-page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
+static struct PAGE*
+page_alloc_zone_locked(struct PAGE_ZONE* z, unsigned int order, unsigned int mobility)
 {
-	DPRINTF("page_alloc_zone(): z=%p, order=%u\n", z, order);
-
-	spinlock_lock(&z->z_lock);
+	DPRINTF("page_alloc_zone(): z=%p, order=%u, mobility=%u\n", z, order, mobility);
 
 	/* First step is to figure out the initial order we need to use */
 	unsigned int alloc_order = order;
-	while (alloc_order < PAGE_NUM_ORDERS && LIST_EMPTY(&z->z_free[alloc_order]))
+	while (alloc_order < PAGE_NUM_ORDERS && LIST_EMPTY(&z->z_free[mobility][alloc_order]))
 		alloc_order++; /* nothing free here */
-	DPRINTF("page_alloc_zone(): z=%p, order=%u -> alloc_order=%u\n", z, order, alloc_order);
+	struct page_list* free = z->z_free[mobility];
 	if (alloc_order == PAGE_NUM_ORDERS) {
-		spinlock_unlock(&z->z_lock);
-		return NULL;
+		/* Nothing of our kind; fall back to the largest block of the other kind */
+		free = z->z_free[PAGE_NUM_MOBILITIES - 1 - mobility];
+		alloc_order = PAGE_NUM_ORDERS - 1;
+		while (LIST_EMPTY(&free[alloc_order])) {
+			if (alloc_order == order)
+				return NULL;
+			alloc_order--;
+		}
+
+		/* If the entire block is free, it becomes ours */
+		if (alloc_order == PAGE_BLOCK_ORDER) {
+			struct PAGE* p = LIST_HEAD(&free[alloc_order]);
+			LIST_POP_HEAD(&free[alloc_order]);
+			z->z_block_mobility[(p - z->z_base) >> PAGE_BLOCK_ORDER] = mobility;
+			free = z->z_free[mobility];
+			LIST_APPEND(&free[alloc_order], p);
+		}
 	}
+	DPRINTF("page_alloc_zone(): z=%p, order=%u -> alloc_order=%u\n", z, order, alloc_order);
 
 	/* Now we need to keep splitting each block from alloc_order .. order */
 	for (unsigned int n = alloc_order; n >= order; n--) {
 		DPRINTF("page_alloc_zone(): loop, n=%u\n", n);
-		KASSERT(!LIST_EMPTY(&z->z_free[n]), "freelist of order %u can't be empty", n);
+		KASSERT(!LIST_EMPTY(&free[n]), "freelist of order %u can't be empty", n);
 
 		/* Grab the first block we see */
-		struct PAGE* p = LIST_HEAD(&z->z_free[n]);
-		LIST_POP_HEAD(&z->z_free[n]);
+		struct PAGE* p = LIST_HEAD(&free[n]);
+		LIST_POP_HEAD(&free[n]);
 
 		/* And allocate it in the bitmap */
 		unsigned int index = p - z->z_base;
@@ -142,7 +260,6 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 			set_bit(z->z_bitmap, index);
 			DPRINTF("page_alloc_zone(): got page=%p, index %u\n", p, index);
 			z->z_avail_pages -= 1 << order;
-			spinlock_unlock(&z->z_lock);
 			return p;
 		}
 
@@ -150,8 +267,8 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 		unsigned int buddy_index = index ^ (1 << (n - 1));
 		DPRINTF("page_alloc_zone(): n=%u, splitting index %u -> %u, %u\n", n, index, index, buddy_index);
 		DPRINTF("split page0=%p, page1=%p\n", &z->z_base[index], &z->z_base[buddy_index]);
-		LIST_APPEND(&z->z_free[n - 1], &z->z_base[index]);
-		LIST_APPEND(&z->z_free[n - 1], &z->z_base[buddy_index]);
+		LIST_APPEND(&free[n - 1], &z->z_base[index]);
+		LIST_APPEND(&free[n - 1], &z->z_base[buddy_index]);
 		z->z_base[index].p_order = n - 1;
 		z->z_base[buddy_index].p_order = n - 1;
 	}
@@ -161,6 +278,128 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 	return NULL;
 }
 
+struct PAGE*
+page_alloc_zone(struct PAGE_ZONE* z, unsigned int order, unsigned int mobility)
+{
+	spinlock_lock(&z->z_lock);
+	struct PAGE* p = page_alloc_zone_locked(z, order, mobility);
+	spinlock_unlock(&z->z_lock);
+	return p;
+}
+
+/*
+ * Returns the page cache of the current CPU, or NULL if there is none yet;
+ * must be called with interrupts disabled.
+ */
+static inline struct PCPU*
+page_cache_get()
+{
+	return pcpu_get(PCPU_GET(cpuid));
+}
+
+/*
+ * Calls func(z) for every zone, those of the nodes nearest to the current
+ * CPU first, until it returns true; returns whether it did.
+ */
+template<typename Func> static bool
+page_foreach_zone_nearest(Func func)
+{
+	unsigned int cpu_node = PCPU_GET(page_node);
+	for (unsigned int n = 0; n < page_num_nodes; n++) {
+		unsigned int node = page_node_order[cpu_node][n];
+		LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+			if (z->z_node != node || !func(z))
+				continue;
+			struct PAGE_NODE_STATS& ns = page_node_stats[node];
+			pcpu_counter_inc(node == cpu_node ? &ns.ns_local : &ns.ns_remote);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Fills the page cache of the given mobility with a batch of pages from the zones */
+static void
+page_cache_refill(struct PCPU* pcpu, unsigned int mobility)
+{
+	page_foreach_zone_nearest([&](struct PAGE_ZONE* z) {
+		spinlock_lock_unpremptible(&z->z_lock);
+		while (pcpu->page_cache_count[mobility] < PAGE_CACHE_BATCH) {
+			struct PAGE* p = page_alloc_zone_locked(z, 0, mobility);
+			if (p == NULL)
+				break;
+			LIST_PREPEND(&pcpu->page_cache[mobility], p);
+			pcpu->page_cache_count[mobility]++;
+		}
+		spinlock_unlock(&z->z_lock);
+		return pcpu->page_cache_count[mobility] == PAGE_CACHE_BATCH;
+	});
+}
+
+/* Returns a batch of pages from a page cache to their zones */
+static void
+page_cache_drain(struct PCPU* pcpu, unsigned int mobility, unsigned int count)
+{
+	struct page_list* cache = &pcpu->page_cache[mobility];
+	struct PAGE_ZONE* locked_z = NULL;
+	for (/* nothing */; count > 0 && !LIST_EMPTY(cache); count--) {
+		/* Take the coldest pages; we hand out pages from the head */
+		struct PAGE* p = LIST_TAIL(cache);
+		LIST_REMOVE(cache, p);
+		pcpu->page_cache_count[mobility]--;
+
+		struct PAGE_ZONE* z = p->p_zone;
+		if (z != locked_z) {
+			if (locked_z != NULL)
+				spinlock_unlock(&locked_z->z_lock);
+			spinlock_lock_unpremptible(&z->z_lock);
+			locked_z = z;
+		}
+		page_free_index_locked(z, 0, p - z->z_base);
+	}
+	if (locked_z != NULL)
+		spinlock_unlock(&locked_z->z_lock);
+}
+
+/* Returns all cached pages of the CPU to their zones; must be called with interrupts disabled */
+static void
+page_cache_drain_all(struct PCPU* pcpu)
+{
+	for (unsigned int m = 0; m < PAGE_NUM_MOBILITIES; m++)
+		page_cache_drain(pcpu, m, pcpu->page_cache_count[m]);
+}
+
+static unsigned int
+page_cache_total(struct PCPU* pcpu)
+{
+	unsigned int count = 0;
+	for (unsigned int m = 0; m < PAGE_NUM_MOBILITIES; m++)
+		count += pcpu->page_cache_count[m];
+	return count;
+}
+
+void
+page_free(struct PAGE* p)
+{
+	struct PAGE_ZONE* z = p->p_zone;
+	if (p->p_order == 0) {
+		register_t state = md_interrupts_save_and_disable();
+		struct PCPU* pcpu = page_cache_get();
+		/* Pages of other nodes go straight back, as we'd only hand them out locally */
+		if (pcpu != NULL && pcpu->page_node == z->z_node) {
+			/* Whatever we were used for, we'll be handed out to the kind our block is for */
+			unsigned int m = page_block_mobility(z, p - z->z_base);
+			LIST_PREPEND(&pcpu->page_cache[m], p);
+			if (++pcpu->page_cache_count[m] >= PAGE_CACHE_MAX)
+				page_cache_drain(pcpu, m, PAGE_CACHE_BATCH);
+			md_interrupts_restore(state);
+			return;
+		}
+		md_interrupts_restore(state);
+	}
+	page_free_index(z, p->p_order, p - z->z_base);
+}
+
 void
 page_zone_add(addr_t base, size_t length)
 {
@@ -170,46 +409,188 @@ page_zone_add(addr_t base, size_t length)
 	 * - struct PAGE_ZONE with information regarding this zone
 	 * - [num_pages] bits, to see whether a page is used
 	 * - [num_pages] x (struct PAGE) to contain information for a given memory page
+	 * - a byte per block of the largest order, holding its mobility
 	 *
-	 * 
+	 * The first page index is aligned to the largest order in physical memory,
+	 * so that every block is aligned to its own size; this allows blocks to be
+	 * mapped using large pages. Indices before the start of the zone are never
+	 * freed, so they need nothing but their administration.
 	 */
-	unsigned int num_pages = length / PAGE_SIZE;
+	unsigned int max_reserved = (1 << (PAGE_NUM_ORDERS - 1)) - 1;
+	unsigned int num_pages = length / PAGE_SIZE + max_reserved;
 	unsigned int bitmap_size = (num_pages + 7) / 8;
-	unsigned int num_admin_pages = (sizeof(struct PAGE_ZONE) + bitmap_size + (num_pages * sizeof(struct PAGE)) + PAGE_SIZE - 1) / PAGE_SIZE;
+	unsigned int num_blocks = (num_pages + (1 << PAGE_BLOCK_ORDER) - 1) >> PAGE_BLOCK_ORDER;
+	unsigned int num_admin_pages = (sizeof(struct PAGE_ZONE) + bitmap_size + (num_pages * sizeof(struct PAGE)) + num_blocks + PAGE_SIZE - 1) / PAGE_SIZE;
 	DPRINTF("%s: base=%p length=%u -> num_pages=%u, num_admin_pages=%u\n", __func__, base, length, num_pages, num_admin_pages);
+	if (num_admin_pages >= length / PAGE_SIZE)
+		return; /* too small to be of any use */
 
 	char* mem = static_cast<char*>(kmem_map(base, num_admin_pages * PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
 
 	/* Initialize the page zone; initially, we'll just mark everything as allocated */	
+	addr_t first_addr = base + num_admin_pages * PAGE_SIZE;
 	struct PAGE_ZONE* z = (struct PAGE_ZONE*)mem;
 	spinlock_init(&z->z_lock);
 	z->z_bitmap = mem + sizeof(*z);
-	for (int n = 0; n < PAGE_NUM_ORDERS; n++)
-		LIST_INIT(&z->z_free[n]);
+	for (int m = 0; m < PAGE_NUM_MOBILITIES; m++)
+		for (int n = 0; n < PAGE_NUM_ORDERS; n++)
+			LIST_INIT(&z->z_free[m][n]);
 	memset(z->z_bitmap, 0xff, bitmap_size);
 	z->z_base = (struct PAGE*)(mem + bitmap_size + sizeof(*z));
-	z->z_num_pages = num_pages - num_admin_pages;
+	/* Everything starts out movable; kernel allocations take blocks as they need them */
+	z->z_block_mobility = (uint8_t*)(z->z_base + num_pages);
+	memset(z->z_block_mobility, PAGE_MOBILITY_MOVABLE, num_blocks);
+	z->z_phys_addr = ROUND_DOWN(first_addr, PAGE_SIZE << (PAGE_NUM_ORDERS - 1));
+	z->z_reserved_pages = (first_addr - z->z_phys_addr) / PAGE_SIZE;
+	z->z_num_pages = z->z_reserved_pages + length / PAGE_SIZE - num_admin_pages;
 	z->z_avail_pages = 0;
-	z->z_phys_addr = base + num_admin_pages * PAGE_SIZE;
+	z->z_node = 0;
+
+	/*
+	 * Only set up what we need to boot; the remaining blocks are left to
+	 * page_deferred_chunk(). All their pages are marked as in use, so nothing
+	 * looks at them until then.
+	 */
+	unsigned int init_pages = z->z_num_pages;
+	if (page_boot_pages + z->z_num_pages - z->z_reserved_pages > PAGE_DEFER_BOOT) {
+		unsigned int boot_pages = page_boot_pages < PAGE_DEFER_BOOT ? PAGE_DEFER_BOOT - page_boot_pages : 0;
+		init_pages = ROUND_UP(z->z_reserved_pages + boot_pages, 1 << PAGE_BLOCK_ORDER);
+		if (init_pages > z->z_num_pages)
+			init_pages = z->z_num_pages;
+	}
+	z->z_deferred_pages = z->z_num_pages - init_pages;
+	z->z_deferred_next = init_pages;
+	page_boot_pages += init_pages - z->z_reserved_pages;
+	if (z->z_deferred_pages > 0)
+		memset(&z->z_block_mobility[init_pages >> PAGE_BLOCK_ORDER], PAGE_BLOCK_DEFERRED, num_blocks - (init_pages >> PAGE_BLOCK_ORDER));
 
 	/* Create the page structures; we mark everything as a order 0 page */
 	struct PAGE* p = z->z_base;
-	for (unsigned int n = 0; n < z->z_num_pages; n++, p++) {
+	for (unsigned int n = 0; n < init_pages; n++, p++) {
 		p->p_zone = z;
 		p->p_order = 0;
+		p->p_vmpage = NULL;
 	}
 
 	/*
 	 * Now, free all chunks of memory. This is slow, we could do better but for
 	 * now it'll help guarantee that the implementation is correct.
 	 */
-	for (int n = 0; n < z->z_num_pages; n++)
+	for (int n = z->z_reserved_pages; n < init_pages; n++)
 		page_free_index(z, 0, n);
 
+	/* Nothing is allocated before the first zone is there; set up our statistics then */
+	if (LIST_EMPTY(&zones)) {
+		for (unsigned int n = 0; n < PAGE_MAX_NODES; n++) {
+			pcpu_counter_init(&page_node_stats[n].ns_local);
+			pcpu_counter_init(&page_node_stats[n].ns_remote);
+		}
+	}
+
 	/* Add the zone to the list XXX there should be some lock on zones */
 	LIST_APPEND(&zones, z);
 }
 
+void
+page_set_node(addr_t base, size_t length, unsigned int node)
+{
+	KASSERT(node < PAGE_MAX_NODES, "node %u out of range", node);
+
+	/* Zones are only ever added at startup; the zone's first page determines its node */
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		addr_t first = z->z_phys_addr + (addr_t)z->z_reserved_pages * PAGE_SIZE;
+		if (first >= base && first - base < length)
+			z->z_node = node;
+	}
+}
+
+void
+page_set_cpu_node(struct PCPU* pcpu, unsigned int node)
+{
+	KASSERT(node < PAGE_MAX_NODES, "node %u out of range", node);
+
+	/* Hand back cached pages, as they may be of the previous node */
+	register_t state = md_interrupts_save_and_disable();
+	page_cache_drain_all(pcpu);
+	pcpu->page_node = node;
+	md_interrupts_restore(state);
+}
+
+void
+page_set_node_distances(unsigned int num_nodes, const uint8_t* distance)
+{
+	KASSERT(num_nodes > 0 && num_nodes <= PAGE_MAX_NODES, "invalid number of nodes %u", num_nodes);
+
+	/* Sort the nodes by distance for every node; there are few, so insertion sort will do */
+	for (unsigned int from = 0; from < num_nodes; from++) {
+		auto dist = [&](unsigned int to) -> unsigned int {
+			if (distance != NULL)
+				return distance[from * num_nodes + to];
+			return from == to ? 10 : 20;
+		};
+		uint8_t* order = page_node_order[from];
+		for (unsigned int n = 0; n < num_nodes; n++) {
+			unsigned int m = n;
+			for (/* nothing */; m > 0 && dist(order[m - 1]) > dist(n); m--)
+				order[m] = order[m - 1];
+			order[m] = n;
+		}
+	}
+	page_num_nodes = num_nodes;
+}
+
+/*
+ * Sets up the next chunk of pages left by page_zone_add() and hands them to
+ * the allocator; returns false if there is nothing left to do.
+ */
+static bool
+page_deferred_chunk()
+{
+	struct PAGE_ZONE* z = NULL;
+	unsigned int first = 0, last = 0;
+	spinlock_lock(&spl_deferred);
+	LIST_FOREACH(&zones, cur_z, struct PAGE_ZONE) {
+		if (cur_z->z_deferred_next == cur_z->z_num_pages)
+			continue;
+		z = cur_z;
+		first = z->z_deferred_next;
+		last = first + (PAGE_DEFER_CHUNK << PAGE_BLOCK_ORDER);
+		if (last > z->z_num_pages)
+			last = z->z_num_pages;
+		z->z_deferred_next = last;
+		break;
+	}
+	spinlock_unlock(&spl_deferred);
+	if (z == NULL)
+		return false;
+
+	/* Nobody looks at these pages until they are free, so no locks are needed here */
+	struct PAGE* p = &z->z_base[first];
+	for (unsigned int n = first; n < last; n++, p++) {
+		p->p_zone = z;
+		p->p_order = 0;
+		p->p_vmpage = NULL;
+	}
+
+	/* Free whole blocks at once; only the final block of the zone may not be complete */
+	spinlock_lock(&z->z_lock);
+	for (unsigned int index = first; index < last; index += 1 << PAGE_BLOCK_ORDER) {
+		z->z_block_mobility[index >> PAGE_BLOCK_ORDER] = PAGE_MOBILITY_MOVABLE;
+		if (index + (1 << PAGE_BLOCK_ORDER) <= last) {
+			/* Only the first page of a block has a bit in use, so clear the rest */
+			memset(&z->z_bitmap[index / 8], 0, (1 << PAGE_BLOCK_ORDER) / 8);
+			z->z_base[index].p_order = PAGE_BLOCK_ORDER;
+			page_free_index_locked(z, PAGE_BLOCK_ORDER, index);
+		} else {
+			for (unsigned int n = index; n < last; n++)
+				page_free_index_locked(z, 0, n);
+		}
+	}
+	z->z_deferred_pages -= last - first;
+	spinlock_unlock(&z->z_lock);
+	return true;
+}
+
 addr_t
 page_get_paddr(struct PAGE* p)
 {
@@ -218,21 +599,394 @@ page_get_paddr(struct PAGE* p)
 	return z->z_phys_addr + index * PAGE_SIZE;
 }
 
-struct PAGE*
-page_alloc_order(int order)
+/*
+ * Asks the reclaimers to free num_pages pages; returns the number actually
+ * freed. Note that these need not make up a block of the order we want, but
+ * the pages may coalesce with their free buddies. Only the page daemon passes
+ * may_sleep.
+ */
+static unsigned int
+page_reclaim(unsigned int num_pages, bool may_sleep)
+{
+	/* Reclaimers are only ever added, so we needn't hold the lock while calling them */
+	spinlock_lock(&spl_reclaimers);
+	struct PAGE_RECLAIMER* pr = LIST_EMPTY(&page_reclaimers) ? NULL : LIST_HEAD(&page_reclaimers);
+	spinlock_unlock(&spl_reclaimers);
+
+	unsigned int num_freed = 0;
+	for (/* nothing */; pr != NULL && num_freed < num_pages; pr = LIST_NEXT(pr)) {
+		if ((pr->pr_flags & PAGE_RECLAIMER_F_DAEMON) && !may_sleep)
+			continue;
+		num_freed += pr->pr_func(num_pages - num_freed);
+	}
+
+	/* Freed order-0 pages end up in our page cache; hand them to the zones so they can coalesce */
+	if (num_freed > 0) {
+		register_t state = md_interrupts_save_and_disable();
+		struct PCPU* pcpu = page_cache_get();
+		if (pcpu != NULL)
+			page_cache_drain_all(pcpu);
+		md_interrupts_restore(state);
+	}
+	return num_freed;
+}
+
+void
+page_register_reclaimer(struct PAGE_RECLAIMER* pr)
+{
+	spinlock_lock(&spl_reclaimers);
+	LIST_APPEND(&page_reclaimers, pr);
+	spinlock_unlock(&spl_reclaimers);
+}
+
+/* Wakes up the page daemon if we are running low; this is only a hint, so no locks are taken */
+static void
+page_daemon_check()
+{
+	if (!page_daemon_running)
+		return;
+
+	unsigned int avail_pages = 0;
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		avail_pages += z->z_avail_pages;
+	}
+	if (avail_pages >= page_daemon_low)
+		return;
+
+	bool wakeup = false;
+	register_t state = spinlock_lock_unpremptible(&spl_daemon);
+	if (!page_daemon_wakeup) {
+		page_daemon_wakeup = true;
+		wakeup = true;
+	}
+	spinlock_unlock_unpremptible(&spl_daemon, state);
+	if (wakeup)
+		sem_signal(&page_daemon_sem);
+}
+
+/*
+ * Has the page daemon make a pass and waits until it is done; returns false if
+ * it could not free anything, in which case waiting again is pointless.
+ */
+static bool
+page_daemon_wait()
+{
+	if (!page_daemon_running || PCPU_GET(curthread) == &page_daemon_thread)
+		return false;
+
+	bool wakeup = false;
+	register_t state = spinlock_lock_unpremptible(&spl_daemon);
+	page_daemon_num_waiters++;
+	if (!page_daemon_wakeup) {
+		page_daemon_wakeup = true;
+		wakeup = true;
+	}
+	spinlock_unlock_unpremptible(&spl_daemon, state);
+	if (wakeup)
+		sem_signal(&page_daemon_sem);
+
+	sem_wait(&page_daemon_done_sem);
+	state = spinlock_lock_unpremptible(&spl_daemon);
+	bool progress = page_daemon_progress;
+	spinlock_unlock_unpremptible(&spl_daemon, state);
+	return progress;
+}
+
+/* Allocates 2^order pages from the zones nearest to us, bypassing the caches */
+static struct PAGE*
+page_alloc_nearest(unsigned int order, unsigned int mobility)
+{
+	struct PAGE* page = NULL;
+	page_foreach_zone_nearest([&](struct PAGE_ZONE* z) {
+		page = page_alloc_zone(z, order, mobility);
+		return page != NULL;
+	});
+	return page;
+}
+
+/* Allocates 2^order pages, or returns NULL if even the reclaimers cannot help */
+static struct PAGE*
+page_alloc_order_try(int order, unsigned int mobility)
 {
 	/* XXX this function has no lock on zones */
 
 	KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
 	KASSERT(!LIST_EMPTY(&zones), "no zones");
 
-	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
-		struct PAGE* page = page_alloc_zone(z, order);
+	if (order == 0) {
+		register_t state = md_interrupts_save_and_disable();
+		struct PCPU* pcpu = page_cache_get();
+		if (pcpu != NULL) {
+			struct page_list* cache = &pcpu->page_cache[mobility];
+			bool refilled = false;
+			if (pcpu->page_cache_count[mobility] == 0) {
+				page_cache_refill(pcpu, mobility);
+				refilled = true;
+			}
+			if (pcpu->page_cache_count[mobility] > 0) {
+				struct PAGE* page = LIST_HEAD(cache);
+				LIST_POP_HEAD(cache);
+				pcpu->page_cache_count[mobility]--;
+				md_interrupts_restore(state);
+				if (refilled)
+					page_daemon_check();
+				return page;
+			}
+		}
+		md_interrupts_restore(state);
+	}
+
+	page_daemon_check();
+	unsigned int compact_tries = 0;
+	while(true) {
+		struct PAGE* page = page_alloc_nearest(order, mobility);
+		if (page != NULL)
+			return page;
+		/* Out of pages; memory which is not set up yet is the cheapest to come by */
+		if (page_deferred_chunk())
+			continue;
+		/* See if anyone can give some back and try again */
+		if (page_reclaim(1 << order, false) > 0)
+			continue;
+		/* There may be enough memory, just not in one piece; see if moving pages helps */
+		if (order > 0 && compact_tries++ < PAGE_COMPACT_TRIES && page_compact(order))
+			continue;
+		return NULL;
+	}
+}
+
+struct PAGE*
+page_alloc_order(int order)
+{
+	struct PAGE* page = page_alloc_order_try(order, PAGE_MOBILITY_UNMOVABLE);
+	if (page == NULL)
+		panic("page_alloc(): failed for order %d", order);
+	return page;
+}
+
+struct PAGE*
+page_alloc_order_try_wait(int order)
+{
+	while(true) {
+		struct PAGE* page = page_alloc_order_try(order, PAGE_MOBILITY_MOVABLE);
 		if (page != NULL)
 			return page;
+		if (!page_daemon_wait())
+			return NULL;
 	}
+}
 
-	panic("page_alloc(): failed for order %d", order);
+struct PAGE*
+page_alloc_order_wait(int order)
+{
+	struct PAGE* page = page_alloc_order_try_wait(order);
+	if (page == NULL)
+		panic("page_alloc(): out of memory for order %d", order);
+	return page;
+}
+
+struct PAGE*
+page_alloc_order_split(int order)
+{
+	KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
+
+	struct PAGE* p = NULL;
+	page_foreach_zone_nearest([&](struct PAGE_ZONE* z) {
+		spinlock_lock(&z->z_lock);
+		p = page_alloc_zone_locked(z, order, PAGE_MOBILITY_MOVABLE);
+		if (p != NULL) {
+			/* Turn the block into individually allocated pages */
+			unsigned int index = p - z->z_base;
+			for (unsigned int n = 0; n < (1 << order); n++) {
+				set_bit(z->z_bitmap, index + n);
+				p[n].p_order = 0;
+			}
+		}
+		spinlock_unlock(&z->z_lock);
+		return p != NULL;
+	});
+	return p;
+}
+
+struct PAGE*
+page_alloc_order_range(int order, addr_t min_addr, addr_t max_addr)
+{
+	KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
+
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		addr_t z_end = z->z_phys_addr + (addr_t)z->z_num_pages * PAGE_SIZE - 1;
+		if (z_end < min_addr || z->z_phys_addr + (addr_t)z->z_reserved_pages * PAGE_SIZE > max_addr)
+			continue; /* zone is entirely out of range */
+
+		/*
+		 * If the zone straddles the range, the block we get may not fit; give it
+		 * back and move on, as the next block from this zone is likely no better.
+		 */
+		struct PAGE* p = page_alloc_zone(z, order, PAGE_MOBILITY_UNMOVABLE);
+		if (p == NULL)
+			continue;
+		addr_t phys = page_get_paddr(p);
+		if (phys >= min_addr && phys + (PAGE_SIZE << order) - 1 <= max_addr)
+			return p;
+		page_free_index(z, order, p - z->z_base);
+	}
+	return NULL;
+}
+
+/*
+ * Looks at the 2^order pages at index, which must be aligned to that; returns
+ * how many of them are in use, or -1 if any of those cannot be moved. Must be
+ * called with the zone locked.
+ */
+static int
+page_compact_cost_locked(struct PAGE_ZONE* z, unsigned int index, int order)
+{
+	if (z->z_block_mobility[index >> PAGE_BLOCK_ORDER] == PAGE_BLOCK_DEFERRED)
+		return -1;
+
+	/* A larger block around the range is in use as a whole, or entirely free */
+	for (int o = order + 1; o < PAGE_NUM_ORDERS; o++) {
+		unsigned int head = index & ~((1 << o) - 1);
+		if (get_bit(z->z_bitmap, head) && z->z_base[head].p_order >= o)
+			return -1;
+	}
+
+	/* Walk the blocks in the range; only the first page of a block in use has its bit set */
+	int used = 0;
+	for (unsigned int n = index; n < index + (1 << order); /* nothing */) {
+		struct PAGE* p = &z->z_base[n];
+		if (!get_bit(z->z_bitmap, n)) {
+			n += 1 << p->p_order;
+			continue;
+		}
+		if (p->p_order != 0 || p->p_vmpage == NULL)
+			return -1;
+		used++;
+		n++;
+	}
+	return used;
+}
+
+static int
+page_compact_cost(struct PAGE_ZONE* z, unsigned int index, int order)
+{
+	spinlock_lock(&z->z_lock);
+	int used = page_compact_cost_locked(z, index, order);
+	spinlock_unlock(&z->z_lock);
+	return used;
+}
+
+bool
+page_compact(int order)
+{
+	KASSERT(order > 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
+
+	/* Find the range which needs the fewest moves; this walks all memory, but we are out of options */
+	struct PAGE_ZONE* z = NULL;
+	unsigned int index = 0;
+	int used = -1;
+	LIST_FOREACH(&zones, cur_z, struct PAGE_ZONE) {
+		unsigned int first = ROUND_UP(cur_z->z_reserved_pages, 1 << order);
+		for (unsigned int n = first; n + (1 << order) <= cur_z->z_num_pages && used != 1; n += 1 << order) {
+			int cost = page_compact_cost(cur_z, n, order);
+			if (cost < 0 || (used >= 0 && cost >= used))
+				continue;
+			z = cur_z;
+			index = n;
+			used = cost;
+		}
+	}
+	if (z == NULL)
+		return false;
+
+	/*
+	 * Move everything in use out of the range; pages we are given that lie in
+	 * the range are kept aside until we are done, and everything is freed to
+	 * the zone directly so that it can coalesce right away.
+	 */
+	unsigned int end = index + (1 << order);
+	struct page_list captured;
+	LIST_INIT(&captured);
+	for (unsigned int n = index; n < end; n++) {
+		struct PAGE* p = &z->z_base[n];
+		spinlock_lock(&z->z_lock);
+		bool movable = get_bit(z->z_bitmap, n) && p->p_order == 0 && p->p_vmpage != NULL;
+		spinlock_unlock(&z->z_lock);
+		if (!movable)
+			continue;
+
+		struct PAGE* p_new;
+		while(true) {
+			p_new = page_alloc_nearest(0, PAGE_MOBILITY_MOVABLE);
+			if (p_new == NULL || p_new->p_zone != z || p_new < &z->z_base[index] || p_new >= &z->z_base[end])
+				break;
+			LIST_APPEND(&captured, p_new);
+		}
+		if (p_new == NULL)
+			break;
+		if (!vmpage_migrate(p, p_new)) {
+			page_free_index(p_new->p_zone, 0, p_new - p_new->p_zone->z_base);
+			break;
+		}
+		page_free_index(z, 0, n);
+		__atomic_add_fetch(&page_compact_moved, 1, __ATOMIC_RELAXED);
+	}
+	while (!LIST_EMPTY(&captured)) {
+		struct PAGE* p = LIST_HEAD(&captured);
+		LIST_POP_HEAD(&captured);
+		page_free_index(z, 0, p - z->z_base);
+	}
+
+	if (page_compact_cost(z, index, order) != 0)
+		return false;
+	__atomic_add_fetch(&page_compact_count, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static void
+page_zero(struct PAGE* p, int flags)
+{
+	void* va = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	memzero_pages(va, PAGE_SIZE, flags);
+	kmem_unmap(va, PAGE_SIZE);
+}
+
+struct PAGE*
+page_alloc_zeroed()
+{
+	/* The pool holds movable pages, so we have to clear one ourselves */
+	struct PAGE* p = page_alloc_single();
+	page_zero(p, 0);
+	return p;
+}
+
+struct PAGE*
+page_alloc_zeroed_wait()
+{
+	struct PAGE* p = NULL;
+	bool wakeup = false;
+
+	register_t state = spinlock_lock_unpremptible(&spl_zero);
+	if (!LIST_EMPTY(&page_zero_list)) {
+		p = LIST_HEAD(&page_zero_list);
+		LIST_POP_HEAD(&page_zero_list);
+		page_zero_count--;
+	}
+	if (page_zero_running && !page_zero_wakeup && page_zero_count < PAGE_ZERO_LOW) {
+		page_zero_wakeup = true;
+		wakeup = true;
+	}
+	spinlock_unlock_unpremptible(&spl_zero, state);
+
+	if (wakeup)
+		sem_signal(&page_zero_sem);
+	if (p != NULL)
+		return p;
+
+	/* Pool is empty; we'll have to clear one ourselves - the caller is about to use it */
+	p = page_alloc_order_wait(0);
+	page_zero(p, 0);
+	return p;
 }
 
 void*
@@ -256,6 +1010,16 @@ page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags)
 	return page_alloc_order_mapped(bytes2order(length), p, vm_flags);
 }
 
+void*
+page_alloc_length_mapped_range(size_t length, addr_t min_addr, addr_t max_addr, struct PAGE** p, int vm_flags)
+{
+	unsigned int order = bytes2order(length);
+	*p = page_alloc_order_range(order, min_addr, max_addr);
+	if (*p == NULL)
+		return NULL;
+	return kmem_map(page_get_paddr(*p), PAGE_SIZE << order, vm_flags);
+}
+
 void
 page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
 {
@@ -265,27 +1029,257 @@ page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
 	*total_pages = 0; *avail_pages = 0;
 	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
 		spinlock_lock(&z->z_lock);
-		*total_pages += z->z_num_pages;
+		*total_pages += z->z_num_pages - z->z_reserved_pages - z->z_deferred_pages;
 		*avail_pages += z->z_avail_pages;
 		spinlock_unlock(&z->z_lock);
 	}
+
+	/* Pages in the per-CPU caches are available as well */
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu != NULL)
+			*avail_pages += page_cache_total(pcpu);
+	}
+
+	/* And so are the pre-zeroed pages */
+	*avail_pages += page_zero_count;
+}
+
+void
+page_get_status(char* buf, size_t len)
+{
+	/* XXX we need some lock on zones */
+	char* r = buf;
+	*r = '\0';
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		/* Walking the free lists is slow, but this is only done on request */
+		unsigned int num_free[PAGE_NUM_ORDERS];
+		spinlock_lock(&z->z_lock);
+		unsigned int total = z->z_num_pages - z->z_reserved_pages - z->z_deferred_pages, avail = z->z_avail_pages;
+		unsigned int deferred = z->z_deferred_pages;
+		for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++) {
+			num_free[order] = 0;
+			for (unsigned int m = 0; m < PAGE_NUM_MOBILITIES; m++) {
+				LIST_FOREACH(&z->z_free[m][order], p, struct PAGE) {
+					num_free[order]++;
+				}
+			}
+		}
+		unsigned int num_blocks = (z->z_num_pages + (1 << PAGE_BLOCK_ORDER) - 1) >> PAGE_BLOCK_ORDER, num_movable = 0;
+		for (unsigned int n = 0; n < num_blocks; n++)
+			if (z->z_block_mobility[n] == PAGE_MOBILITY_MOVABLE)
+				num_movable++;
+		spinlock_unlock(&z->z_lock);
+
+		snprintf(r, len - (r - buf), "zone %p node %u pages %u avail %u deferred %u blocks %u movable %u free_by_order", (void*)z->z_phys_addr, z->z_node, total, avail, deferred, num_blocks, num_movable);
+		for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++) {
+			r += strlen(r);
+			snprintf(r, len - (r - buf), " %u", num_free[order]);
+		}
+		r += strlen(r);
+		snprintf(r, len - (r - buf), "\n");
+		r += strlen(r);
+	}
+
+	unsigned int cached = 0;
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu != NULL)
+			cached += page_cache_total(pcpu);
+	}
+	snprintf(r, len - (r - buf), "percpu_cached %u\nzeroed %u\ncompacted %u moved %u\n", cached, page_zero_count, page_compact_count, page_compact_moved);
+	r += strlen(r);
+
+	for (unsigned int node = 0; node < page_num_nodes; node++) {
+		unsigned int total = 0, avail = 0;
+		LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+			if (z->z_node != node)
+				continue;
+			total += z->z_num_pages - z->z_reserved_pages - z->z_deferred_pages;
+			avail += z->z_avail_pages;
+		}
+		const struct PAGE_NODE_STATS& ns = page_node_stats[node];
+		snprintf(r, len - (r - buf), "node %u pages %u avail %u local_allocs %u remote_allocs %u\n",
+		 node, total, avail, (unsigned int)pcpu_counter_read(&ns.ns_local), (unsigned int)pcpu_counter_read(&ns.ns_remote));
+		r += strlen(r);
+	}
+}
+
+static void
+page_zero_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&page_zero_sem);
+
+		while (page_zero_count < PAGE_ZERO_TARGET) {
+			/* Do not eat into the final bit of available memory */
+			unsigned int total_pages, avail_pages;
+			page_get_stats(&total_pages, &avail_pages);
+			if (avail_pages - page_zero_count < total_pages / PAGE_ZERO_RESERVE)
+				break;
+
+			/* The pool is for anonymous memory, so these are movable */
+			struct PAGE* p = page_alloc_order_try(0, PAGE_MOBILITY_MOVABLE);
+			if (p == NULL)
+				break;
+			/* Pages may sit in the pool for a while; keep them out of the cache */
+			page_zero(p, PAGEMEM_NONTEMPORAL);
+
+			register_t state = spinlock_lock_unpremptible(&spl_zero);
+			LIST_APPEND(&page_zero_list, p);
+			page_zero_count++;
+			spinlock_unlock_unpremptible(&spl_zero, state);
+		}
+
+		register_t state = spinlock_lock_unpremptible(&spl_zero);
+		page_zero_wakeup = false;
+		spinlock_unlock_unpremptible(&spl_zero, state);
+	}
+}
+
+static errorcode_t
+page_zero_init()
+{
+	sem_init(&page_zero_sem, 1); /* fill the pool right away */
+	page_zero_wakeup = true;
+	page_zero_running = true;
+
+	/*
+	 * Clearing pages is only worthwhile if there is nothing better to do; run
+	 * just above the idle threads so that anything else will preempt us.
+	 */
+	kthread_init(&page_zero_thread, "pagezero", &page_zero_thread_func, NULL);
+	page_zero_thread.t_priority = THREAD_PRIORITY_IDLE - 1;
+	thread_resume(&page_zero_thread);
+	return ananas_success();
+}
+
+INIT_FUNCTION(page_zero_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+static void
+page_daemon_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&page_daemon_sem);
+
+		/* Keep going until we are above the high watermark, or nobody can give back anything */
+		unsigned int num_freed = 0;
+		unsigned int total_pages, avail_pages;
+		while(1) {
+			page_get_stats(&total_pages, &avail_pages);
+			if (avail_pages >= page_daemon_high)
+				break;
+			unsigned int n = page_reclaim(page_daemon_high - avail_pages, true);
+			if (n == 0)
+				break;
+			num_freed += n;
+		}
+
+		register_t state = spinlock_lock_unpremptible(&spl_daemon);
+		page_daemon_wakeup = false;
+		page_daemon_progress = num_freed > 0 || avail_pages >= page_daemon_low;
+		unsigned int num_waiters = page_daemon_num_waiters;
+		page_daemon_num_waiters = 0;
+		spinlock_unlock_unpremptible(&spl_daemon, state);
+
+		for (unsigned int n = 0; n < num_waiters; n++)
+			sem_signal(&page_daemon_done_sem);
+	}
+}
+
+/* Derives the watermarks from the amount of memory we have */
+static void
+page_daemon_set_watermarks()
+{
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	unsigned int low = total_pages / PAGE_DAEMON_LOW;
+	if (low < PAGE_DAEMON_MIN)
+		low = PAGE_DAEMON_MIN;
+	page_daemon_high = low * 2;
+	page_daemon_low = low;
+}
+
+static errorcode_t
+page_daemon_init()
+{
+	page_daemon_set_watermarks();
+
+	sem_init(&page_daemon_sem, 0);
+	sem_init(&page_daemon_done_sem, 0);
+	kthread_init(&page_daemon_thread, "pagedaemon", &page_daemon_thread_func, NULL);
+	thread_resume(&page_daemon_thread);
+	page_daemon_running = true;
+	return ananas_success();
+}
+
+INIT_FUNCTION(page_daemon_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+static void
+page_deferred_thread_func(void* context)
+{
+	while (page_deferred_chunk())
+		/* keep going */ ;
+
+	/* The final thread to finish has the page daemon take all memory into account */
+	if (__atomic_sub_fetch(&page_deferred_threads, 1, __ATOMIC_ACQ_REL) == 0) {
+		page_daemon_set_watermarks();
+		unsigned int total_pages, avail_pages;
+		page_get_stats(&total_pages, &avail_pages);
+		kprintf("page: all memory is set up, %u KB in total\n", total_pages * (PAGE_SIZE / 1024));
+	}
+	thread_exit(0);
+	/* NOTREACHED */
+}
+
+/* Runs once all CPUs are up, so that every one of them can help */
+static errorcode_t
+page_deferred_init()
+{
+	unsigned int deferred_pages = 0;
+	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+		deferred_pages += z->z_deferred_pages;
+	}
+	if (deferred_pages == 0)
+		return ananas_success();
+
+	for (unsigned int cpu = 0; cpu < pcpu_get_count(); cpu++)
+		if (pcpu_get(cpu) != NULL)
+			page_deferred_threads++;
+	for (unsigned int cpu = 0; cpu < pcpu_get_count(); cpu++) {
+		if (pcpu_get(cpu) == NULL)
+			continue;
+		thread_t* t = &page_deferred_thread[cpu];
+		char name[32];
+		snprintf(name, sizeof(name), "pageinit:cpu%u", cpu);
+		kthread_init(t, name, &page_deferred_thread_func, NULL);
+		t->t_affinity = THREAD_AFFINITY_CPU(cpu);
+		thread_resume(t);
+	}
+	return ananas_success();
 }
 
+INIT_FUNCTION(page_deferred_init, SUBSYSTEM_SCHEDULER, ORDER_ANY);
+
 #ifdef OPTION_KDB
 static void
 page_dump(struct PAGE_ZONE* z)
 {
-	kprintf("page_dump: zone=%p total=%u avail=%u (%u KB of %u KB in use)\n",
-	 z, z->z_num_pages, z->z_avail_pages,
-	 (z->z_num_pages - z->z_avail_pages) * (PAGE_SIZE / 1024),
-	 z->z_num_pages * (PAGE_SIZE / 1024));
+	unsigned int num_pages = z->z_num_pages - z->z_reserved_pages - z->z_deferred_pages;
+	kprintf("page_dump: zone=%p node=%u total=%u avail=%u deferred=%u (%u KB of %u KB in use)\n",
+	 z, z->z_node, num_pages, z->z_avail_pages, z->z_deferred_pages,
+	 (num_pages - z->z_avail_pages) * (PAGE_SIZE / 1024),
+	 num_pages * (PAGE_SIZE / 1024));
 	for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++) {
-		kprintf(" order %u: ", order);
-		int n = 0;
-		LIST_FOREACH(&z->z_free[order], f, struct PAGE) {
-			n++;
+		kprintf(" order %u:", order);
+		for (unsigned int m = 0; m < PAGE_NUM_MOBILITIES; m++) {
+			int n = 0;
+			LIST_FOREACH(&z->z_free[m][order], f, struct PAGE) {
+				n++;
+			}
+			kprintf(" %d %s", n, m == PAGE_MOBILITY_MOVABLE ? "movable" : "unmovable");
 		}
-		kprintf("%d\n", n);
+		kprintf("\n");
 	}
 
 #if 0
@@ -302,6 +1296,13 @@ KDB_COMMAND(pages, NULL, "Display page zones")
 	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
 		page_dump(z);
 	}
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu != NULL)
+			kprintf("cpu %u: %u unmovable, %u movable page(s) cached\n", n,
+			 pcpu->page_cache_count[PAGE_MOBILITY_UNMOVABLE], pcpu->page_cache_count[PAGE_MOBILITY_MOVABLE]);
+	}
+	kprintf("%u pre-zeroed page(s)\n", page_zero_count);
 }
 #endif
 
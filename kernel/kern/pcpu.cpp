@@ -3,11 +3,31 @@
 #include <ananas/lib.h>
 #include <ananas/pcpu.h>
 #include <ananas/thread.h>
+#include <ananas/schedule.h>
 #include <machine/param.h> /* for PAGE_SIZE */
 
+namespace {
+
+struct PCPU* pcpu_list[PCPU_MAX_CPUS];
+unsigned int pcpu_count = 0;
+unsigned int pcpu_counter_last = 0; /* slot 0 is for counters not set up yet */
+
+} // unnamed namespace
+
 void
 pcpu_init(struct PCPU* pcpu)
 {
+	KASSERT(pcpu->cpuid < PCPU_MAX_CPUS, "cpu %u exceeds PCPU_MAX_CPUS", pcpu->cpuid);
+	KASSERT(pcpu_list[pcpu->cpuid] == NULL, "cpu %u already registered", pcpu->cpuid);
+	scheduler_init_pcpu(pcpu);
+	for (unsigned int m = 0; m < PAGE_NUM_MOBILITIES; m++) {
+		LIST_INIT(&pcpu->page_cache[m]);
+		pcpu->page_cache_count[m] = 0;
+	}
+	pcpu_list[pcpu->cpuid] = pcpu;
+	if (pcpu->cpuid >= pcpu_count)
+		pcpu_count = pcpu->cpuid + 1;
+
 	pcpu->idlethread = new THREAD;
 	KASSERT(pcpu->idlethread != NULL, "out of memory for idle thread");
 
@@ -16,13 +36,50 @@ pcpu_init(struct PCPU* pcpu)
 	name[sizeof(name) - 1] = '\0';
 	kthread_init(pcpu->idlethread, name, &idle_thread, NULL);
 	pcpu->nested_irq = 0;
+	pcpu->preempt_count = 0;
 
 	/*
 	 * Hook the idle thread to its specific CPU and set the appropriate priority;
 	 * it must only be run as a last-resort.
 	 */
-	pcpu->idlethread->t_affinity = pcpu->cpuid;
+	pcpu->idlethread->t_affinity = THREAD_AFFINITY_CPU(pcpu->cpuid);
 	pcpu->idlethread->t_priority = THREAD_PRIORITY_IDLE;
 }
 
+struct PCPU*
+pcpu_get(unsigned int cpuid)
+{
+	if (cpuid >= pcpu_count)
+		return NULL;
+	return pcpu_list[cpuid];
+}
+
+unsigned int
+pcpu_get_count()
+{
+	return pcpu_count;
+}
+
+void
+pcpu_counter_init(pcpu_counter_t* pc)
+{
+	/* Slots are never reused, so they are still zero on every CPU */
+	unsigned int slot = __atomic_add_fetch(&pcpu_counter_last, 1, __ATOMIC_RELAXED);
+	if (slot >= PCPU_NUM_COUNTERS)
+		panic("out of per-CPU counters");
+	pc->pc_slot = slot;
+}
+
+uint64_t
+pcpu_counter_read(const pcpu_counter_t* pc)
+{
+	uint64_t value = 0;
+	for (unsigned int n = 0; n < pcpu_count; n++) {
+		struct PCPU* pcpu = pcpu_list[n];
+		if (pcpu != NULL)
+			value += __atomic_load_n(&pcpu->counters[pc->pc_slot], __ATOMIC_RELAXED);
+	}
+	return value;
+}
+
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,138 @@
+/*
+ * Per-thread hardware performance counts; see <ananas/perfctr.h>. Rather than
+ * saving and restoring the counters of every thread, the counters of each CPU
+ * run freely and we attribute whatever they counted since the previous switch
+ * to the thread switched away from; this needs only reads on the switch path.
+ *
+ * Enabling or disabling is picked up by every CPU as it next switches threads,
+ * so the first slice after enabling goes uncounted.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/pcpu.h>
+#include <ananas/perfctr.h>
+#include <ananas/process.h>
+#include <ananas/thread.h>
+#include <ananas/tunable.h>
+#include <machine/interrupts.h>
+
+namespace {
+
+const char* const perfctr_name[PERFCTR_NUM] = { "cycles", "instructions", "llc_misses", "branch_misses" };
+
+bool perfctr_enabled = false;
+unsigned int perfctr_valid; /* PERFCTR_* counters available as a mask; 0 until probed */
+uint64_t perfctr_mask; /* Counter values wrap at this */
+
+/* Stores what the counters of the current CPU counted since the last switch in delta */
+void
+perfctr_elapsed(struct PCPU* pcpu, uint64_t* delta, bool update)
+{
+	uint64_t now[PERFCTR_NUM];
+	md_perfctr_read(now);
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++) {
+		delta[n] = (now[n] - pcpu->perfctr_last[n]) & perfctr_mask;
+		if (update)
+			pcpu->perfctr_last[n] = now[n];
+	}
+}
+
+void
+perfctr_add(thread_t* t, const uint64_t* delta)
+{
+	/* Only the CPU running the thread updates its counts, but the threads of a process may run concurrently */
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++) {
+		t->t_perfctr.pc_count[n] += delta[n];
+		if (t->t_process != nullptr)
+			__atomic_fetch_add(&t->t_process->p_perfctr.pc_count[n], delta[n], __ATOMIC_RELAXED);
+	}
+}
+
+errorcode_t
+perfctr_init()
+{
+	unsigned int width;
+	unsigned int valid = md_perfctr_probe(&width);
+	perfctr_mask = (width >= 64) ? ~0ULL : (1ULL << width) - 1;
+	__atomic_store_n(&perfctr_valid, valid, __ATOMIC_RELEASE);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+void
+perfctr_thread_switch(thread_t* old_thread)
+{
+	bool enabled = __atomic_load_n(&perfctr_enabled, __ATOMIC_RELAXED) && __atomic_load_n(&perfctr_valid, __ATOMIC_ACQUIRE) != 0;
+	if (!enabled && !PCPU_GET(perfctr_active))
+		return;
+
+	struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+	if (!pcpu->perfctr_active) {
+		md_perfctr_start();
+		md_perfctr_read(pcpu->perfctr_last);
+		pcpu->perfctr_active = 1;
+		return;
+	}
+
+	uint64_t delta[PERFCTR_NUM];
+	perfctr_elapsed(pcpu, delta, true);
+	perfctr_add(old_thread, delta);
+	if (!enabled) {
+		md_perfctr_stop();
+		pcpu->perfctr_active = 0;
+	}
+}
+
+void
+perfctr_get_thread(thread_t* t, struct PERFCTR_COUNTS* counts)
+{
+	/* Keep us from being switched away, which would account our current slice twice */
+	int state = md_interrupts_save_and_disable();
+	*counts = t->t_perfctr;
+	if (t == PCPU_GET(curthread)) {
+		struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+		if (pcpu->perfctr_active) {
+			uint64_t delta[PERFCTR_NUM];
+			perfctr_elapsed(pcpu, delta, false);
+			for (unsigned int n = 0; n < PERFCTR_NUM; n++)
+				counts->pc_count[n] += delta[n];
+		}
+	}
+	md_interrupts_restore(state);
+	counts->pc_valid = perfctr_valid;
+}
+
+void
+perfctr_get_process(process_t* p, struct PERFCTR_COUNTS* counts)
+{
+	/* Slices of threads which are running right now are not included */
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++)
+		counts->pc_count[n] = __atomic_load_n(&p->p_perfctr.pc_count[n], __ATOMIC_RELAXED);
+	counts->pc_valid = perfctr_valid;
+}
+
+void
+perfctr_format(const struct PERFCTR_COUNTS* counts, char* buf, size_t len)
+{
+	/* Our snprintf() has no 64-bit conversions, so print in two parts */
+	*buf = '\0';
+	for (unsigned int n = 0; n < PERFCTR_NUM; n++) {
+		if ((counts->pc_valid & (1 << n)) == 0)
+			continue;
+		uint64_t count = counts->pc_count[n];
+		size_t used = strlen(buf);
+		if (count >= 1000000000ULL)
+			snprintf(buf + used, len - used, "%s %u%09u\n", perfctr_name[n], (unsigned int)(count / 1000000000ULL),
+			 (unsigned int)(count % 1000000000ULL));
+		else
+			snprintf(buf + used, len - used, "%s %u\n", perfctr_name[n], (unsigned int)count);
+	}
+}
+
+INIT_FUNCTION(perfctr_init, SUBSYSTEM_SCHEDULER, ORDER_FIRST);
+TUNABLE_BOOL("cpu.perfctr", perfctr_enabled, nullptr, "Count hardware performance events per thread");
+
+/* vim:set ts=2 sw=2: */
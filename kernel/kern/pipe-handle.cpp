@@ -1,193 +1,415 @@
+/*
+ * Pipes; pipe_alloc() creates a pipe along with a handle to read from it and
+ * a handle to write to it. These can be passed on by cloning them.
+ *
+ * Buffered data is kept in a ring of up to PIPE_MAX_PAGES pages, each of which
+ * holds a single run of data that is copied in and out using memcpy(). Whole
+ * pages of page-aligned buffers are not copied at all: write() takes the
+ * writer's page copy-on-write, and read() maps the pipe's page copy-on-write
+ * in place of the reader's page (see vmspace_borrow_page() and
+ * vmspace_lend_page()).
+ *
+ * To avoid a context switch every few bytes, readers only wake blocked writers
+ * once PIPE_WAKEUP_SPACE bytes are available, and writers wake readers once
+ * per write(), or when they have to wait for the pipe to drain.
+ */
 #include <ananas/types.h>
+#include <machine/param.h>
 #include <ananas/error.h>
+#include <ananas/eventq.h>
 #include <ananas/handle.h>
-#include <ananas/handle-options.h>
-#include <ananas/trace.h>
-#include <ananas/thread.h>
-#include <ananas/mm.h>
+#include <ananas/kmem.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/process.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
 
-#if 0
 TRACE_SETUP;
 
-/* Note that pipehandle_signal() signals everything *except* the hpi passed to it! */
-static void
-pipehandle_signal(struct HANDLE_PIPE_INFO* hpi, handle_event_t event, handle_event_result_t result)
+#define PIPE_MAX_PAGES		16
+#define PIPE_WAKEUP_SPACE	((PIPE_MAX_PAGES / 2) * PAGE_SIZE)
+#define PIPE_ATOMIC_LENGTH	PAGE_SIZE	/* Writes up to this length are not interleaved */
+
+struct PIPE_PAGE {
+	struct VM_PAGE*	pp_vmpage;
+	char*		pp_data;	/* Kernel mapping of the page */
+	uint32_t	pp_offset;	/* First byte to read */
+	uint32_t	pp_length;	/* Bytes left to read */
+	bool		pp_borrowed;	/* Taken from the writer; read-only */
+};
+
+struct PIPE {
+	mutex_t			p_mutex;
+	int			p_readers;	/* Number of read handles */
+	int			p_writers;	/* Number of write handles */
+
+	struct PIPE_PAGE	p_page[PIPE_MAX_PAGES];
+	unsigned int		p_head;		/* First page in use */
+	unsigned int		p_count;	/* Number of pages in use */
+	size_t			p_length;	/* Bytes buffered */
+	struct PIPE_PAGE	p_spare;	/* Drained page kept for reuse */
+
+	unsigned int		p_read_waiters;
+	unsigned int		p_write_waiters;
+	semaphore_t		p_read_sem;
+	semaphore_t		p_write_sem;
+
+	struct EVENT_SOURCE	p_events;
+	unsigned int		p_events_pending; /* To notify once unlocked */
+};
+
+namespace {
+
+inline struct PIPE_PAGE*
+pipe_tail(struct PIPE* p)
+{
+	return &p->p_page[(p->p_head + p->p_count - 1) % PIPE_MAX_PAGES];
+}
+
+/* Returns the number of bytes which can be written without blocking */
+size_t
+pipe_space(struct PIPE* p)
+{
+	size_t space = (PIPE_MAX_PAGES - p->p_count) * PAGE_SIZE;
+	if (p->p_count > 0) {
+		struct PIPE_PAGE* pp = pipe_tail(p);
+		if (!pp->pp_borrowed)
+			space += PAGE_SIZE - (pp->pp_offset + pp->pp_length);
+	}
+	return space;
+}
+
+void
+pipe_page_free(struct PIPE_PAGE* pp)
+{
+	kmem_unmap(pp->pp_data, PAGE_SIZE);
+	vmpage_deref(pp->pp_vmpage);
+	pp->pp_vmpage = nullptr;
+}
+
+/* Appends an empty page to the pipe to write to; there must be room for it */
+struct PIPE_PAGE*
+pipe_append_page(struct PIPE* p)
 {
-	struct HANDLE_PIPE_INFO* cur_hpi = hpi->hpi_next;
-	for (/* nothing */; cur_hpi != hpi; cur_hpi = cur_hpi->hpi_next) {
-		handle_signal(cur_hpi->hpi_handle, event, result);
+	KASSERT(p->p_count < PIPE_MAX_PAGES, "pipe %p full", p);
+	p->p_count++;
+	struct PIPE_PAGE* pp = pipe_tail(p);
+	if (p->p_spare.pp_vmpage != nullptr) {
+		*pp = p->p_spare;
+		p->p_spare.pp_vmpage = nullptr;
+	} else {
+		pp->pp_vmpage = vmpage_create_private(VM_PAGE_FLAG_PRIVATE);
+		pp->pp_data = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(pp->pp_vmpage)), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
 	}
+	pp->pp_offset = 0;
+	pp->pp_length = 0;
+	pp->pp_borrowed = false;
+	return pp;
 }
 
-static errorcode_t
-pipehandle_create(thread_t* thread, handleindex_t index, struct HANDLE* handle, struct CREATE_OPTIONS* opts)
+/* Removes the drained first page; it is kept for reuse if it is still ours */
+void
+pipe_remove_head(struct PIPE* p, bool reuse)
 {
-	if (opts->cr_flags != CREATE_PIPE_FLAG_MASK )
-		return ANANAS_ERROR(BAD_FLAG);
-	if (opts->cr_length <= 0 || opts->cr_length > CREATE_PIPE_MAX_LENGTH)
-		return ANANAS_ERROR(BAD_LENGTH);
+	struct PIPE_PAGE* pp = &p->p_page[p->p_head];
+	KASSERT(pp->pp_length == 0, "removing page with data");
+	if (reuse && !pp->pp_borrowed && p->p_spare.pp_vmpage == nullptr)
+		p->p_spare = *pp;
+	else
+		pipe_page_free(pp);
+	pp->pp_vmpage = nullptr;
+	p->p_head = (p->p_head + 1) % PIPE_MAX_PAGES;
+	p->p_count--;
+}
 
-	/* Create a new pipe */
-	struct HANDLE_PIPE_BUFFER* hpb = kmalloc(sizeof(struct HANDLE_PIPE_BUFFER) + opts->cr_length);
-	/* XXX check error on hpb == NULL */
-	mutex_init(&hpb->hpb_mutex, "pipe");
-	hpb->hpb_read_count = 1;
-	hpb->hpb_write_count = 1;
-	memset(hpb->hpb_buffer, 0, opts->cr_length); /* prevent information leakage */
-	CBUFFER_INIT(hpb, hpb->hpb_buffer, opts->cr_length);
+void
+pipe_wakeup(unsigned int* waiters, semaphore_t* sem)
+{
+	for (/* nothing */; *waiters > 0; (*waiters)--)
+		sem_signal(sem);
+}
 
-	/* Hook the pipe buffer to the pipe handle */
-	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
-	hpi->hpi_flags = HPI_FLAG_READ | HPI_FLAG_WRITE;
-	hpi->hpi_buffer = hpb;
-	hpi->hpi_next = hpi;
-	hpi->hpi_handle = handle;
-	return ananas_success();
+/* Unlocks the pipe and tells event queues about changes; they poll us, so we mustn't hold the lock */
+void
+pipe_unlock(struct PIPE* p)
+{
+	unsigned int events = p->p_events_pending;
+	p->p_events_pending = 0;
+	mutex_unlock(&p->p_mutex);
+	if (events != 0)
+		event_source_notify(&p->p_events, events);
 }
 
-static errorcode_t
-pipehandle_free(thread_t* thread, struct HANDLE* handle)
+void
+pipe_wait(struct PIPE* p, unsigned int* waiters, semaphore_t* sem)
 {
-	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
-	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
-	mutex_lock(&hpb->hpb_mutex);
-	if (hpi->hpi_flags & HPI_FLAG_READ)
-		hpb->hpb_read_count--;
-	KASSERT(hpb->hpb_read_count >= 0, "read_count < 0");
-	if (hpi->hpi_flags & HPI_FLAG_WRITE)
-		hpb->hpb_write_count--;
-	KASSERT(hpb->hpb_write_count >= 0, "write_count < 0");
-	if (hpb->hpb_read_count != 0 || hpb->hpb_write_count != 0) {
-		/*
-		 * Still readers or writers available; don't free the pipe. If we just
-		 * freed a final reader of writer, signal accordingly.
-		 */
-		if (hpb->hpb_read_count == 0) {
-			pipehandle_signal(hpi, HANDLE_EVENT_READ, 0);
-		} else if (hpb->hpb_write_count == 0) {
-			pipehandle_signal(hpi, HANDLE_EVENT_WRITE, 0);
-		}
+	(*waiters)++;
+	pipe_unlock(p);
+	sem_wait(sem);
+	mutex_lock(&p->p_mutex);
+}
 
-		/*
-	 	 * Remove ourselves from the linked list; this works by finding our parent
-		 * (i.e. the one who has our hpi in their hpi_next field) and replacing it
-		 * with our hpi_next.
-		 */
-		struct HANDLE_PIPE_INFO* parent_hpi = hpi->hpi_next;
-		while (parent_hpi->hpi_next != hpi)
-			parent_hpi = parent_hpi->hpi_next;
-		parent_hpi->hpi_next = hpi->hpi_next;
-
-		mutex_unlock(&hpb->hpb_mutex);
-		return ananas_success();
+void
+pipe_destroy(struct PIPE* p)
+{
+	while (p->p_count > 0) {
+		p->p_page[p->p_head].pp_length = 0;
+		pipe_remove_head(p, false);
 	}
-	
-	/* OK, we can free the buffer */
-	mutex_unlock(&hpb->hpb_mutex);
-	hpi->hpi_buffer = NULL;
-	kfree(hpb);
-	return ananas_success();
+	if (p->p_spare.pp_vmpage != nullptr)
+		pipe_page_free(&p->p_spare);
+	kfree(p);
 }
 
-static errorcode_t
-pipehandle_read(thread_t* thread, handleindex_t index, struct HANDLE* handle, void* buf, size_t* len)
+/* Returns the vmspace which buffers given to the pipe belong to, if any */
+inline vmspace_t*
+pipe_get_vmspace(thread_t* t)
+{
+	if (t == nullptr || t->t_process == nullptr)
+		return nullptr;
+	return t->t_process->p_vmspace;
+}
+
+errorcode_t
+pipehandle_read(thread_t* t, handleindex_t index, struct HANDLE* handle, void* buf, size_t* len)
 {
 	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
 	if ((hpi->hpi_flags & HPI_FLAG_READ) == 0)
 		return ANANAS_ERROR(BAD_OPERATION);
 
-	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
-	mutex_lock(&hpb->hpb_mutex);
-	size_t n = CBUFFER_READ(hpb, buf, *len);
-	if (n > 0) {
-		/* Something was read; we should signal the read */
-		pipehandle_signal(hpi, HANDLE_EVENT_READ, n);
+	struct PIPE* p = hpi->hpi_pipe;
+	mutex_lock(&p->p_mutex);
+	while (*len > 0 && p->p_length == 0 && p->p_writers > 0)
+		pipe_wait(p, &p->p_read_waiters, &p->p_read_sem);
+
+	vmspace_t* vs = pipe_get_vmspace(t);
+	size_t space_before = pipe_space(p);
+	char* dest = static_cast<char*>(buf);
+	size_t left = *len;
+	while (left > 0 && p->p_count > 0) {
+		struct PIPE_PAGE* pp = &p->p_page[p->p_head];
+		size_t chunk = pp->pp_length;
+		if (chunk > left)
+			chunk = left;
+
+		/* If the reader wants this entire page, just give it away */
+		bool lent = false;
+		if (vs != nullptr && chunk == PAGE_SIZE && (reinterpret_cast<addr_t>(dest) & (PAGE_SIZE - 1)) == 0) {
+			vmpage_lock(pp->pp_vmpage);
+			lent = vmspace_lend_page(vs, reinterpret_cast<addr_t>(dest), pp->pp_vmpage);
+			vmpage_unlock(pp->pp_vmpage);
+		}
+		if (!lent)
+			memcpy(dest, pp->pp_data + pp->pp_offset, chunk);
+
+		pp->pp_offset += chunk;
+		pp->pp_length -= chunk;
+		p->p_length -= chunk;
+		dest += chunk;
+		left -= chunk;
+		if (pp->pp_length == 0)
+			pipe_remove_head(p, !lent);
+	}
+	*len -= left;
+
+	/* Only bother writers once there is a decent amount of room */
+	size_t space = pipe_space(p);
+	if (space >= PIPE_WAKEUP_SPACE) {
+		pipe_wakeup(&p->p_write_waiters, &p->p_write_sem);
+		if (space_before < PIPE_WAKEUP_SPACE)
+			p->p_events_pending |= HANDLE_EVENT_WRITE;
 	}
-	mutex_unlock(&hpb->hpb_mutex);
-	*len = n;
+	pipe_unlock(p);
 	return ananas_success();
 }
 
-static errorcode_t
-pipehandle_write(thread_t* thread, handleindex_t index, struct HANDLE* handle, const void* buf, size_t* len)
+errorcode_t
+pipehandle_write(thread_t* t, handleindex_t index, struct HANDLE* handle, const void* buf, size_t* len)
 {
 	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
 	if ((hpi->hpi_flags & HPI_FLAG_WRITE) == 0)
 		return ANANAS_ERROR(BAD_OPERATION);
 
-	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
-	mutex_lock(&hpb->hpb_mutex);
-	size_t n = CBUFFER_WRITE(hpb, buf, *len);
-	if (n > 0) {
-		/* Something was written; we should signal the write */
-		pipehandle_signal(hpi, HANDLE_EVENT_WRITE, n);
+	struct PIPE* p = hpi->hpi_pipe;
+	mutex_lock(&p->p_mutex);
+
+	/* Small writes must go in one piece */
+	if (*len <= PIPE_ATOMIC_LENGTH) {
+		while (p->p_readers > 0 && pipe_space(p) < *len) {
+			pipe_wakeup(&p->p_read_waiters, &p->p_read_sem);
+			pipe_wait(p, &p->p_write_waiters, &p->p_write_sem);
+		}
 	}
-	mutex_unlock(&hpb->hpb_mutex);
-	*len = n;
-	return ananas_success();
+
+	vmspace_t* vs = pipe_get_vmspace(t);
+	const char* src = static_cast<const char*>(buf);
+	size_t left = *len;
+	while (left > 0 && p->p_readers > 0) {
+		if (pipe_space(p) == 0) {
+			/* Full; let the readers drain it all in one go */
+			pipe_wakeup(&p->p_read_waiters, &p->p_read_sem);
+			pipe_wait(p, &p->p_write_waiters, &p->p_write_sem);
+			continue;
+		}
+
+		if (p->p_length == 0)
+			p->p_events_pending |= HANDLE_EVENT_READ;
+
+		/* Take whole pages from the writer if we can */
+		struct VM_PAGE* vp = nullptr;
+		if (vs != nullptr && left >= PAGE_SIZE && p->p_count < PIPE_MAX_PAGES && (reinterpret_cast<addr_t>(src) & (PAGE_SIZE - 1)) == 0)
+			vp = vmspace_borrow_page(vs, reinterpret_cast<addr_t>(src));
+		if (vp != nullptr) {
+			p->p_count++;
+			struct PIPE_PAGE* pp = pipe_tail(p);
+			pp->pp_vmpage = vp;
+			pp->pp_data = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), PAGE_SIZE, VM_FLAG_READ));
+			pp->pp_offset = 0;
+			pp->pp_length = PAGE_SIZE;
+			pp->pp_borrowed = true;
+			p->p_length += PAGE_SIZE;
+			src += PAGE_SIZE;
+			left -= PAGE_SIZE;
+			continue;
+		}
+
+		/* Copy as much as fits in the final page, or a new one */
+		struct PIPE_PAGE* pp = (p->p_count > 0) ? pipe_tail(p) : nullptr;
+		if (pp == nullptr || pp->pp_borrowed || pp->pp_offset + pp->pp_length == PAGE_SIZE)
+			pp = pipe_append_page(p);
+		size_t chunk = PAGE_SIZE - (pp->pp_offset + pp->pp_length);
+		if (chunk > left)
+			chunk = left;
+		memcpy(pp->pp_data + pp->pp_offset + pp->pp_length, src, chunk);
+		pp->pp_length += chunk;
+		p->p_length += chunk;
+		src += chunk;
+		left -= chunk;
+	}
+	*len -= left;
+
+	pipe_wakeup(&p->p_read_waiters, &p->p_read_sem);
+	bool broken = *len == 0 && left > 0;
+	pipe_unlock(p);
+	return broken ? ANANAS_ERROR(BROKEN_PIPE) : ananas_success();
 }
 
-static errorcode_t
-pipehandle_clone(thread_t* thread_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, thread_t* thread_out, struct HANDLE** handle_out, handleindex_t* index_out)
-{
-	/*
- 	 * Inspect the flags; if the verdict is an unusable handle, refuse to create
-	 * it.
-	 *
-	 * XXX Should we disallow a readonly handle to be cloned writeonly?
-	 */
-	struct HANDLE_PIPE_INFO* parent_hpi = &handle->h_data.d_pipe;
-	int flags = 0;
-	if (opts != NULL) {
-		if (opts->cl_flags & CLONE_FLAG_READONLY)
-			flags |= HPI_FLAG_READ;
-		if (opts->cl_flags & CLONE_FLAG_WRITEONLY)
-			flags |= HPI_FLAG_WRITE;
-	} else {
-		/* Default to read/write clone if no flags are present */
-		flags = HPI_FLAG_READ | HPI_FLAG_WRITE;
+errorcode_t
+pipehandle_free(process_t* proc, struct HANDLE* handle)
+{
+	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
+	struct PIPE* p = hpi->hpi_pipe;
+
+	mutex_lock(&p->p_mutex);
+	if (hpi->hpi_flags & HPI_FLAG_READ)
+		p->p_readers--;
+	if (hpi->hpi_flags & HPI_FLAG_WRITE)
+		p->p_writers--;
+	KASSERT(p->p_readers >= 0 && p->p_writers >= 0, "pipe %p refcount underflow", p);
+	if (p->p_readers == 0 && p->p_writers == 0) {
+		mutex_unlock(&p->p_mutex);
+		pipe_destroy(p);
+		return ananas_success();
+	}
+
+	/* Anyone waiting for the other side must notice that it is gone */
+	if (p->p_readers == 0) {
+		pipe_wakeup(&p->p_write_waiters, &p->p_write_sem);
+		p->p_events_pending |= HANDLE_EVENT_WRITE;
 	}
-	if (flags == 0) {
-		/* No flags given; recycle what the original handle had */
-		flags = parent_hpi->hpi_flags;
+	if (p->p_writers == 0) {
+		pipe_wakeup(&p->p_read_waiters, &p->p_read_sem);
+		p->p_events_pending |= HANDLE_EVENT_READ;
 	}
+	pipe_unlock(p);
+	return ananas_success();
+}
 
-	/* Allocate a brand new handle for the thread */
-	errorcode_t err = handle_alloc(HANDLE_TYPE_PIPE, thread_out, 0, handle_out, index_out);
+errorcode_t
+pipehandle_clone(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out)
+{
+	/* The handle is locked, so the pipe can't go away while we clone it */
+	errorcode_t err = handle_clone_generic(handle, proc_out, handle_out, index_out_min, index_out);
 	ANANAS_ERROR_RETURN(err);
 
-	/* Lock the pipe; we don't want anyone throwing it away while we hook it */
-	struct HANDLE_PIPE_BUFFER* hpb = parent_hpi->hpi_buffer;
-	mutex_lock(&hpb->hpb_mutex);
+	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
+	struct PIPE* p = hpi->hpi_pipe;
+	mutex_lock(&p->p_mutex);
+	if (hpi->hpi_flags & HPI_FLAG_READ)
+		p->p_readers++;
+	if (hpi->hpi_flags & HPI_FLAG_WRITE)
+		p->p_writers++;
+	mutex_unlock(&p->p_mutex);
+	return ananas_success();
+}
 
-	/* Hook the pipe to the new handle */
-	struct HANDLE_PIPE_INFO* hpi = &(*handle_out)->h_data.d_pipe;
-	hpi->hpi_flags = flags;
-	hpi->hpi_buffer = hpb;
-	hpi->hpi_handle = *handle_out;
-	if (flags & HPI_FLAG_READ)
-		hpb->hpb_read_count++;
-	if (flags & HPI_FLAG_WRITE)
-		hpb->hpb_write_count++;
+errorcode_t
+pipehandle_poll(struct HANDLE* handle, unsigned int* events, struct EVENT_SOURCE** source)
+{
+	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
+	struct PIPE* p = hpi->hpi_pipe;
 
-	/* Hook our handle to the handle chain */
-	hpi->hpi_next = parent_hpi->hpi_next;
-	parent_hpi->hpi_next = hpi;
+	/* A missing other side doesn't block either; the operation will just fail */
+	mutex_lock(&p->p_mutex);
+	*events = 0;
+	if ((hpi->hpi_flags & HPI_FLAG_READ) && (p->p_length > 0 || p->p_writers == 0))
+		*events |= HANDLE_EVENT_READ;
+	if ((hpi->hpi_flags & HPI_FLAG_WRITE) && (pipe_space(p) > 0 || p->p_readers == 0))
+		*events |= HANDLE_EVENT_WRITE;
+	mutex_unlock(&p->p_mutex);
 
-	/* All done */
-	mutex_unlock(&hpb->hpb_mutex);
-	return err;
+	*source = &p->p_events;
+	return ananas_success();
 }
 
-static struct HANDLE_OPS pipe_hops = {
-	.hop_create = pipehandle_create,
-	.hop_free = pipehandle_free,
+struct HANDLE_OPS pipe_hops = {
 	.hop_read = pipehandle_read,
 	.hop_write = pipehandle_write,
+	.hop_free = pipehandle_free,
 	.hop_clone = pipehandle_clone,
+	.hop_poll = pipehandle_poll,
 };
+
+} // unnamed namespace
+
 HANDLE_TYPE(HANDLE_TYPE_PIPE, "pipe", pipe_hops);
-#endif
+
+errorcode_t
+pipe_alloc(process_t* proc, handleindex_t* read_out, handleindex_t* write_out)
+{
+	auto p = static_cast<struct PIPE*>(kmalloc(sizeof(struct PIPE)));
+	memset(p, 0, sizeof(*p));
+	mutex_init(&p->p_mutex, "pipe");
+	sem_init(&p->p_read_sem, 0);
+	sem_init(&p->p_write_sem, 0);
+	event_source_init(&p->p_events);
+
+	struct HANDLE* h_read;
+	errorcode_t err = handle_alloc(HANDLE_TYPE_PIPE, proc, 0, &h_read, read_out);
+	if (ananas_is_failure(err)) {
+		kfree(p);
+		return err;
+	}
+	h_read->h_data.d_pipe.hpi_flags = HPI_FLAG_READ;
+	h_read->h_data.d_pipe.hpi_pipe = p;
+	p->p_readers = 1;
+
+	struct HANDLE* h_write;
+	err = handle_alloc(HANDLE_TYPE_PIPE, proc, 0, &h_write, write_out);
+	if (ananas_is_failure(err)) {
+		handle_free(h_read); /* frees the pipe as well */
+		return err;
+	}
+	h_write->h_data.d_pipe.hpi_flags = HPI_FLAG_WRITE;
+	h_write->h_data.d_pipe.hpi_pipe = p;
+	p->p_writers = 1;
+	return ananas_success();
+}
 
 /* vim:set ts=2 sw=2: */
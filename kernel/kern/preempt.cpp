@@ -0,0 +1,100 @@
+/*
+ * Kernel preemption; see ananas/preempt.h. With OPTION_PREEMPT_STATS, every
+ * CPU keeps track of the longest time preemption was disabled and who did so,
+ * which is what bounds the latency of the threads waiting to run there.
+ */
+#include <ananas/types.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/pcpu.h>
+#include <ananas/preempt.h>
+#include <ananas/schedule.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <machine/interrupts.h>
+#include "options.h"
+
+#ifdef OPTION_PREEMPT_STATS
+void
+preempt_stats_begin(void* caller)
+{
+	/* Preemption is disabled, so we cannot change CPU's here */
+	PCPU_SET(preempt_start, md_timer_get_ns());
+	PCPU_SET(preempt_caller, caller);
+}
+
+static void
+preempt_stats_end()
+{
+	struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+	uint64_t duration = md_timer_get_ns() - pcpu->preempt_start;
+	if (duration > pcpu->preempt_max_ns) {
+		pcpu->preempt_max_ns = duration;
+		pcpu->preempt_max_caller = pcpu->preempt_caller;
+	}
+}
+#endif
+
+void
+preempt_enable()
+{
+#ifdef OPTION_PREEMPT_STATS
+	if (PCPU_GET(preempt_count) == 1)
+		preempt_stats_end();
+#endif
+	PCPU_ADD(preempt_count, -1);
+	KASSERT(PCPU_GET(preempt_count) >= 0, "preempt_enable() without preempt_disable()");
+
+	/*
+	 * If an interrupt wanted us to reschedule while preemption was disabled, it
+	 * has left THREAD_FLAG_RESCHEDULE set for us to handle here; this is only
+	 * safe if interrupts are enabled, as we may be in a section which disabled
+	 * them (interrupt handlers always do)
+	 */
+	if (PCPU_GET(preempt_count) != 0 || !THREAD_WANT_RESCHEDULE(PCPU_GET(curthread)))
+		return;
+	if (!md_interrupts_save() || PCPU_GET(nested_irq) != 0 || !scheduler_activated())
+		return;
+	schedule();
+}
+
+void
+preempt_resume(thread_t* t)
+{
+	PCPU_SET(preempt_count, t->t_preempt_count);
+#ifdef OPTION_PREEMPT_STATS
+	/* Whatever the previous thread was doing has ended as far as we are concerned */
+	if (t->t_preempt_count > 0)
+		PCPU_SET(preempt_start, md_timer_get_ns());
+#endif
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(preempt, "[s:reset]", "Display the longest non-preemptible section per CPU")
+{
+#ifdef OPTION_PREEMPT_STATS
+	bool reset = num_args > 1 && strcmp(arg[1].a_u.u_string, "reset") == 0;
+	kprintf("cpu count max us caller\n");
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu == NULL)
+			continue;
+		kprintf("%3u %5d %6u %p\n", n, pcpu->preempt_count,
+		 (unsigned int)(pcpu->preempt_max_ns / 1000), pcpu->preempt_max_caller);
+		if (reset) {
+			pcpu->preempt_max_ns = 0;
+			pcpu->preempt_max_caller = NULL;
+		}
+	}
+#else
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu != NULL)
+			kprintf("cpu %u: preempt_count %d\n", n, pcpu->preempt_count);
+	}
+	kprintf("(section lengths are only recorded with OPTION_PREEMPT_STATS)\n");
+#endif
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
@@ -8,6 +8,7 @@
 #include <ananas/handle.h>
 #include <ananas/process.h>
 #include <ananas/procinfo.h>
+#include <ananas/syscall-ring.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
 #include <machine/param.h> /* for PAGE_SIZE */
@@ -19,6 +20,19 @@ TRACE_SETUP;
 static struct PROCESS_CALLBACKS process_callbacks_init;
 static struct PROCESS_CALLBACKS process_callbacks_exit;
 
+/*
+ * Processes can be looked up by PID using a hash table. Changes to it are
+ * protected by process_mtx, but lookups only need an RCU read section: they
+ * merely take a reference if the process hasn't reached zero references yet.
+ * Chains are only ever changed by single pointer stores, and a removed process
+ * keeps its p_hash_next so that lookups currently there can continue.
+ *
+ * PID's are allocated from a bitmap, continuing after the most recently
+ * allocated one and wrapping around once PROCESS_MAX_PID is reached.
+ */
+#define PROCESS_HASH_SIZE 256
+#define PROCESS_PID_BITS_PER_WORD 64
+
 namespace Ananas {
 namespace Process {
 
@@ -27,21 +41,77 @@ struct PROCESS_QUEUE process_all;
 
 namespace {
 semaphore_t process_sleep_sem;
-pid_t process_curpid = -1;
+struct PROCESS* process_hash[PROCESS_HASH_SIZE];
+uint64_t process_pidmap[PROCESS_MAX_PID / PROCESS_PID_BITS_PER_WORD];
+pid_t process_lastpid;
+
+inline struct PROCESS**
+process_hash_chain(pid_t pid)
+{
+	return &process_hash[pid % PROCESS_HASH_SIZE];
+}
+
+/* Finds a free PID after process_lastpid; process_mtx must be held */
+pid_t
+process_find_free_pid()
+{
+	constexpr int num_words = PROCESS_MAX_PID / PROCESS_PID_BITS_PER_WORD;
+	pid_t from = (process_lastpid + 1) % PROCESS_MAX_PID;
+	for (int n = 0; n <= num_words; n++) {
+		int w = (from / PROCESS_PID_BITS_PER_WORD + n) % num_words;
+		uint64_t avail = ~process_pidmap[w];
+		if (n == 0)
+			avail &= ~0ULL << (from % PROCESS_PID_BITS_PER_WORD);
+		if (avail != 0)
+			return w * PROCESS_PID_BITS_PER_WORD + __builtin_ctzll(avail);
+	}
+	return -1;
+}
+
 } // unnamed namespace
 
 } // namespace Process
 } // namespace Ananas
 
-static pid_t
-process_alloc_pid()
+static errorcode_t
+process_alloc_pid(pid_t* pid_out)
 {
-	/* XXX this is a bit of a kludge for now ... */
-	mutex_lock(&Ananas::Process::process_mtx);
-	pid_t pid = Ananas::Process::process_curpid++;
-	mutex_unlock(&Ananas::Process::process_mtx);
+	using namespace Ananas::Process;
+
+	mutex_lock(&process_mtx);
+	pid_t pid = process_find_free_pid();
+	if (pid >= 0) {
+		process_pidmap[pid / PROCESS_PID_BITS_PER_WORD] |= 1ULL << (pid % PROCESS_PID_BITS_PER_WORD);
+		process_lastpid = pid;
+	}
+	mutex_unlock(&process_mtx);
+	if (pid < 0)
+		return ANANAS_ERROR(NO_RESOURCE);
+
+	*pid_out = pid;
+	return ananas_success();
+}
+
+static void
+process_free_pid(pid_t pid)
+{
+	using namespace Ananas::Process;
+
+	mutex_lock(&process_mtx);
+	process_pidmap[pid / PROCESS_PID_BITS_PER_WORD] &= ~(1ULL << (pid % PROCESS_PID_BITS_PER_WORD));
+	mutex_unlock(&process_mtx);
+}
 
-	return pid;
+/* Takes a reference to the process, unless it is already being destroyed */
+static inline bool
+process_tryref(process_t* p)
+{
+	refcount_t n = __atomic_load_n(&p->p_refcount, __ATOMIC_RELAXED);
+	do {
+		if (n == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&p->p_refcount, &n, n + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
 }
 
 static errorcode_t
@@ -51,10 +121,14 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 
 	auto p = new PROCESS;
 	memset(p, 0, sizeof(*p));
+	err = process_alloc_pid(&p->p_pid);
+	if (ananas_is_failure(err)) {
+		kfree(p);
+		return err;
+	}
 	p->p_parent = parent; /* XXX should we take a ref here? */
 	p->p_refcount = 1; /* caller */
 	p->p_state = PROCESS_STATE_ACTIVE;
-	p->p_pid = process_alloc_pid();
 	mutex_init(&p->p_lock, "plock");
 	LIST_INIT(&p->p_children);
 
@@ -84,19 +158,11 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 	if (parent != NULL)
 		process_set_environment(p, parent->p_info->pi_env, PROCINFO_ENV_LENGTH - 1);
 
-	/* Clone the parent's handles - we skip the thread handle */
+	/* Clone the parent's handles */
 	if (parent != NULL) {
-		for (unsigned int n = 0; n < PROCESS_MAX_HANDLES; n++) {
-			if (parent->p_handle[n] == NULL)
-				continue;
-
-			struct HANDLE* handle;
-			handleindex_t out;
-			err = handle_clone(parent, n, NULL, p, &handle, n, &out);
-			if (ananas_is_failure(err))
-				goto fail;
-			KASSERT(n == out, "cloned handle %d to new handle %d", n, out);
-		}
+		err = handle_clone_all(parent, p);
+		if (ananas_is_failure(err))
+			goto fail;
 	}
 	/* Run all process initialization callbacks */
 	LIST_FOREACH(&process_callbacks_init, pc, struct PROCESS_CALLBACK) {
@@ -112,19 +178,27 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 		process_unlock(parent);
 	}
 
-	/* Finally, add the process to all processes */
+	/* Finally, add the process to all processes and make it possible to look it up */
 	mutex_lock(&Ananas::Process::process_mtx);
 	LIST_APPEND_IP(&Ananas::Process::process_all, all, p);
+	{
+		struct PROCESS** chain = Ananas::Process::process_hash_chain(p->p_pid);
+		p->p_hash_next = *chain;
+		__atomic_store_n(chain, p, __ATOMIC_RELEASE);
+	}
 	mutex_unlock(&Ananas::Process::process_mtx);
 
 	*dest = p;
 	return ananas_success();
 
 fail:
+	if (p->p_handles != NULL)
+		handle_free_all(p);
 	if (p->p_info != NULL)
 		page_free(p->p_info_page);
 	if (p->p_vmspace != NULL)
 		vmspace_destroy(p->p_vmspace);
+	process_free_pid(p->p_pid);
 	kfree(p);
 	return err;
 }
@@ -165,16 +239,28 @@ process_destroy(process_t* p)
 	}
 
 	/* Free all handles */
-	for(unsigned int n = 0; n < PROCESS_MAX_HANDLES; n++)
-		handle_free_byindex(p, n);
-
-	/* Clean the thread's vmspace up - this will remove all non-essential mappings */
-	vmspace_cleanup(p->p_vmspace);
+	handle_free_all(p);
 
-	/* Remove the process from the all-process list */
+	/*
+	 * Remove the process from the all-process list and the PID hash; note that
+	 * lookups may still be looking at it, which is fine as process structures
+	 * are never freed - process_tryref() won't succeed anymore.
+	 */
 	mutex_lock(&Ananas::Process::process_mtx);
 	LIST_REMOVE_IP(&Ananas::Process::process_all, all, p);
+	for (struct PROCESS** pp = Ananas::Process::process_hash_chain(p->p_pid); *pp != NULL; pp = &(*pp)->p_hash_next) {
+		if (*pp != p)
+			continue;
+		__atomic_store_n(pp, p->p_hash_next, __ATOMIC_RELEASE);
+		break;
+	}
 	mutex_unlock(&Ananas::Process::process_mtx);
+	process_free_pid(p->p_pid);
+	taskstats_process_exit(p);
+
+	/* No thread runs in the vmspace anymore, so it can go in one go */
+	vmspace_destroy(p->p_vmspace);
+	p->p_vmspace = NULL;
 
 	/*
 	 * Clear the process information; no one can query it at this point as the
@@ -187,7 +273,7 @@ void
 process_ref(process_t* p)
 {
 	KASSERT(p->p_refcount > 0, "reffing process with invalid refcount %d", p->p_refcount);
-	++p->p_refcount;
+	__atomic_add_fetch(&p->p_refcount, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -195,13 +281,16 @@ process_deref(process_t* p)
 {
 	KASSERT(p->p_refcount > 0, "dereffing process with invalid refcount %d", p->p_refcount);
 
-	if (--p->p_refcount == 0)
+	if (__atomic_sub_fetch(&p->p_refcount, 1, __ATOMIC_ACQ_REL) == 0)
 		process_destroy(p);
 }
 
 void
 process_exit(process_t* p, int status)
 {
+	/* Our ring worker has nothing to do anymore */
+	syscall_ring_stop(p, false);
+
 	process_lock(p);
 	p->p_state = PROCESS_STATE_ZOMBIE;
 	p->p_exit_status = status;
@@ -273,22 +362,18 @@ process_set_environment(process_t* p, const char* env, size_t env_len)
 process_t*
 process_lookup_by_id_and_ref(pid_t pid)
 {
-	mutex_lock(&Ananas::Process::process_mtx);
-	LIST_FOREACH_IP(&Ananas::Process::process_all, all, p, struct PROCESS) {
-		process_lock(p);
-		if (p->p_pid != pid) {
-			process_unlock(p);
-			continue;
-		}
-
-		// Process found; get a ref and return it
-		process_ref(p);
-		process_unlock(p);
-		mutex_unlock(&Ananas::Process::process_mtx);
-		return p;
+	if (pid < 0 || pid >= PROCESS_MAX_PID)
+		return nullptr;
+
+	register_t state = rcu_read_lock();
+	struct PROCESS* p = __atomic_load_n(Ananas::Process::process_hash_chain(pid), __ATOMIC_ACQUIRE);
+	for (/* nothing */; p != nullptr; p = __atomic_load_n(&p->p_hash_next, __ATOMIC_ACQUIRE)) {
+		// Skip processes that are on their way out; the PID may be in use again
+		if (p->p_pid == pid && process_tryref(p))
+			break;
 	}
-	mutex_unlock(&Ananas::Process::process_mtx);
-	return nullptr;
+	rcu_read_unlock(state);
+	return p;
 }
 
 errorcode_t
@@ -325,7 +410,10 @@ process_init()
 	mutex_init(&Ananas::Process::process_mtx, "proc");
 	sem_init(&Ananas::Process::process_sleep_sem, 0);
 	LIST_INIT(&Ananas::Process::process_all);
-	Ananas::Process::process_curpid = 1;
+
+	/* PID 0 is never handed out; the first process gets PID 1 */
+	Ananas::Process::process_pidmap[0] = 1;
+	Ananas::Process::process_lastpid = 0;
 
 	return ananas_success();
 }
@@ -0,0 +1,123 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/lib.h>
+#include <ananas/pcpu.h>
+#include <ananas/process.h>
+#include <ananas/profile.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+#define PROFILE_LINE_LENGTH (32 + PROFILE_MAX_DEPTH * 20)
+
+/*
+ * Every CPU has its own sampling timer, which only ever writes to the ring of
+ * that CPU from its timer interrupt; so no locks are needed.
+ */
+struct PROFILE_CPU {
+	struct TIMER		pc_timer;
+	uint64_t		pc_next;	/* Total number of samples taken */
+	struct PROFILE_SAMPLE	pc_sample[PROFILE_RING_SIZE];
+};
+
+static unsigned int profile_hz;
+static struct PROFILE_CPU profile_cpu[PCPU_MAX_CPUS];
+
+static void
+profile_sample(void* context)
+{
+	auto pc = static_cast<struct PROFILE_CPU*>(context);
+	unsigned int hz = __atomic_load_n(&profile_hz, __ATOMIC_RELAXED);
+	if (hz == 0)
+		return; /* stopped; by not restarting the timer, we stop sampling */
+
+	struct PROFILE_SAMPLE* ps = &pc->pc_sample[pc->pc_next % PROFILE_RING_SIZE];
+	thread_t* curthread = PCPU_GET(curthread);
+	bool user = false;
+	ps->ps_timestamp = timer_get_ns();
+	ps->ps_pid = (curthread != NULL && curthread->t_process != NULL) ? curthread->t_process->p_pid : -1;
+	ps->ps_depth = md_profile_callchain(ps->ps_pc, PROFILE_MAX_DEPTH, user);
+	ps->ps_flags = user ? PROFILE_FLAG_USER : 0;
+	if (ps->ps_depth > 0)
+		pc->pc_next++;
+
+	timer_start(&pc->pc_timer, ps->ps_timestamp + 1000000000ULL / hz);
+}
+
+void
+profile_interrupt()
+{
+	unsigned int hz = __atomic_load_n(&profile_hz, __ATOMIC_RELAXED);
+	if (hz == 0)
+		return;
+
+	/* Start sampling on this CPU if we aren't already; from then on, the timer keeps itself going */
+	struct PROFILE_CPU* pc = &profile_cpu[PCPU_GET(cpuid)];
+	if (pc->pc_timer.tm_func == NULL)
+		timer_init(&pc->pc_timer, profile_sample, pc);
+	if (pc->pc_timer.tm_cpu < 0)
+		timer_start(&pc->pc_timer, timer_get_ns() + 1000000000ULL / hz);
+}
+
+errorcode_t
+profile_set_rate(unsigned int hz)
+{
+	if (hz > PROFILE_MAX_HZ)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/*
+	 * A new run throws away the previous samples; no CPU is adding any as
+	 * we were stopped, so this is safe.
+	 */
+	if (hz > 0 && __atomic_load_n(&profile_hz, __ATOMIC_RELAXED) == 0) {
+		for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++)
+			profile_cpu[n].pc_next = 0;
+	}
+
+	/* CPUs pick this up on their next timer interrupt */
+	__atomic_store_n(&profile_hz, hz, __ATOMIC_RELAXED);
+	TRACE(MACHDEP, INFO, "sampling at %u Hz", hz);
+	return ananas_success();
+}
+
+unsigned int
+profile_get_rate()
+{
+	return __atomic_load_n(&profile_hz, __ATOMIC_RELAXED);
+}
+
+size_t
+profile_read(off_t offset, char* buf, size_t len)
+{
+	/* Produce the lines one by one, only copying what lies within [offset, offset + len) */
+	size_t copied = 0;
+	off_t cur_offset = 0;
+	char line[PROFILE_LINE_LENGTH];
+	for (unsigned int cpu = 0; cpu < PCPU_MAX_CPUS; cpu++) {
+		struct PROFILE_CPU* pc = &profile_cpu[cpu];
+		uint64_t end = pc->pc_next;
+		uint64_t pos = (end > PROFILE_RING_SIZE) ? end - PROFILE_RING_SIZE : 0;
+		for (/* nothing */; pos < end && copied < len; pos++) {
+			const struct PROFILE_SAMPLE* ps = &pc->pc_sample[pos % PROFILE_RING_SIZE];
+			snprintf(line, sizeof(line), "%u %d %c", cpu, (int)ps->ps_pid, (ps->ps_flags & PROFILE_FLAG_USER) ? 'u' : 'k');
+			for (unsigned int n = 0; n < ps->ps_depth && n < PROFILE_MAX_DEPTH; n++)
+				snprintf(line + strlen(line), sizeof(line) - strlen(line), " %p", (void*)ps->ps_pc[n]);
+			strcat(line, "\n");
+
+			size_t line_len = strlen(line);
+			if (cur_offset + (off_t)line_len > offset) {
+				size_t skip = (offset > cur_offset) ? offset - cur_offset : 0;
+				size_t chunk = line_len - skip;
+				if (chunk > len - copied)
+					chunk = len - copied;
+				memcpy(buf + copied, line + skip, chunk);
+				copied += chunk;
+			}
+			cur_offset += line_len;
+		}
+	}
+	return copied;
+}
+
+/* vim:set ts=2 sw=2: */
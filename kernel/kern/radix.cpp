@@ -0,0 +1,144 @@
+#include <ananas/types.h>
+#include <ananas/lib.h>
+#include <ananas/radix.h>
+#include <ananas/slab.h>
+
+#define RADIX_MAX_LEVELS	((64 + RADIX_BITS_PER_LEVEL - 1) / RADIX_BITS_PER_LEVEL)
+
+static SLAB_CACHE_DEFINE(radix_node_cache, struct RADIX_NODE, NULL);
+
+static struct RADIX_NODE*
+radix_node_alloc()
+{
+	auto rn = static_cast<struct RADIX_NODE*>(slab_alloc(&radix_node_cache));
+	memset(rn, 0, sizeof(*rn));
+	return rn;
+}
+
+static inline unsigned int
+radix_slot(uint64_t index, unsigned int level)
+{
+	return (index >> (level * RADIX_BITS_PER_LEVEL)) & (RADIX_SLOTS - 1);
+}
+
+/* Returns whether a tree of the given height can hold index */
+static inline bool
+radix_fits(unsigned int height, uint64_t index)
+{
+	if (height * RADIX_BITS_PER_LEVEL >= 64)
+		return true;
+	return index < (1ULL << (height * RADIX_BITS_PER_LEVEL));
+}
+
+void
+radix_init(struct RADIX_TREE* rt)
+{
+	rt->rt_root = NULL;
+	rt->rt_height = 0;
+}
+
+void*
+radix_lookup(struct RADIX_TREE* rt, uint64_t index)
+{
+	if (rt->rt_root == NULL || !radix_fits(rt->rt_height, index))
+		return NULL;
+
+	struct RADIX_NODE* rn = rt->rt_root;
+	for (unsigned int level = rt->rt_height - 1; level > 0; level--) {
+		rn = static_cast<struct RADIX_NODE*>(rn->rn_slot[radix_slot(index, level)]);
+		if (rn == NULL)
+			return NULL;
+	}
+	return rn->rn_slot[radix_slot(index, 0)];
+}
+
+void
+radix_insert(struct RADIX_TREE* rt, uint64_t index, void* item)
+{
+	KASSERT(item != NULL, "inserting NULL item");
+	if (rt->rt_root == NULL) {
+		rt->rt_root = radix_node_alloc();
+		rt->rt_height = 1;
+	}
+
+	/* Grow the tree until the index fits; the current root becomes the first child */
+	while (!radix_fits(rt->rt_height, index)) {
+		struct RADIX_NODE* rn = radix_node_alloc();
+		rn->rn_slot[0] = rt->rt_root;
+		rn->rn_count = 1;
+		rt->rt_root = rn;
+		rt->rt_height++;
+	}
+
+	struct RADIX_NODE* rn = rt->rt_root;
+	for (unsigned int level = rt->rt_height - 1; level > 0; level--) {
+		void** slot = &rn->rn_slot[radix_slot(index, level)];
+		if (*slot == NULL) {
+			*slot = radix_node_alloc();
+			rn->rn_count++;
+		}
+		rn = static_cast<struct RADIX_NODE*>(*slot);
+	}
+
+	void** slot = &rn->rn_slot[radix_slot(index, 0)];
+	if (*slot == NULL)
+		rn->rn_count++;
+	*slot = item;
+}
+
+void*
+radix_remove(struct RADIX_TREE* rt, uint64_t index)
+{
+	if (rt->rt_root == NULL || !radix_fits(rt->rt_height, index))
+		return NULL;
+
+	/* Walk down, remembering the path so that we can free empty nodes */
+	struct RADIX_NODE* path[RADIX_MAX_LEVELS];
+	struct RADIX_NODE* rn = rt->rt_root;
+	for (unsigned int level = rt->rt_height - 1; level > 0; level--) {
+		path[level] = rn;
+		rn = static_cast<struct RADIX_NODE*>(rn->rn_slot[radix_slot(index, level)]);
+		if (rn == NULL)
+			return NULL;
+	}
+
+	void* item = rn->rn_slot[radix_slot(index, 0)];
+	if (item == NULL)
+		return NULL;
+	rn->rn_slot[radix_slot(index, 0)] = NULL;
+	rn->rn_count--;
+
+	for (unsigned int level = 0; rn->rn_count == 0; level++) {
+		slab_free(&radix_node_cache, rn);
+		if (level == rt->rt_height - 1) {
+			/* That was the root; the tree is now empty */
+			radix_init(rt);
+			break;
+		}
+		rn = path[level + 1];
+		rn->rn_slot[radix_slot(index, level + 1)] = NULL;
+		rn->rn_count--;
+	}
+	return item;
+}
+
+static void
+radix_free_node(struct RADIX_NODE* rn, unsigned int level)
+{
+	if (level > 0) {
+		for (unsigned int n = 0; n < RADIX_SLOTS; n++)
+			if (rn->rn_slot[n] != NULL)
+				radix_free_node(static_cast<struct RADIX_NODE*>(rn->rn_slot[n]), level - 1);
+	}
+	slab_free(&radix_node_cache, rn);
+}
+
+void
+radix_clear(struct RADIX_TREE* rt)
+{
+	if (rt->rt_root != NULL)
+		radix_free_node(rt->rt_root, rt->rt_height - 1);
+	radix_init(rt);
+}
+
+/* vim:set ts=2 sw=2: */
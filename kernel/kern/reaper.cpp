@@ -10,21 +10,35 @@
 #include <ananas/error.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
+#include <ananas/pcpu.h>
 #include <ananas/thread.h>
 
-static spinlock_t spl_reaper = SPINLOCK_DEFAULT_INIT;
-static struct THREAD_QUEUE reaper_queue;
+/*
+ * Exiting threads are queued on the CPU they exit on, so that a burst of
+ * exits does not contend on a single lock; the reaper empties all queues
+ * in one go whenever it wakes up.
+ */
+struct REAPER_QUEUE {
+	spinlock_t		rq_lock;
+	struct THREAD_QUEUE	rq_queue;
+};
+
+static struct REAPER_QUEUE reaper_queue[PCPU_MAX_CPUS];
+static bool reaper_signalled = false;
 static semaphore_t reaper_sem;
 static thread_t reaper_thread;
 
 void
 reaper_enqueue(thread_t* t)
 {
-	spinlock_lock(&spl_reaper);
-	LIST_APPEND(&reaper_queue, t);
-	spinlock_unlock(&spl_reaper);
+	struct REAPER_QUEUE* rq = &reaper_queue[PCPU_GET(cpuid)];
+	spinlock_lock(&rq->rq_lock);
+	LIST_APPEND(&rq->rq_queue, t);
+	spinlock_unlock(&rq->rq_lock);
 
-	sem_signal(&reaper_sem);
+	/* Only wake the reaper if nobody else did since it last looked */
+	if (!__atomic_exchange_n(&reaper_signalled, true, __ATOMIC_ACQ_REL))
+		sem_signal(&reaper_sem);
 }
 
 static void
@@ -32,15 +46,23 @@ reaper_reap(void* context)
 {
 	while(1) {
 		sem_wait(&reaper_sem);
+		__atomic_store_n(&reaper_signalled, false, __ATOMIC_RELEASE);
+
+		for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+			struct REAPER_QUEUE* rq = &reaper_queue[n];
+			if (LIST_EMPTY(&rq->rq_queue))
+				continue;
 
-		/* Fetch the item to reap from the queue */
-		spinlock_lock(&spl_reaper);
-		KASSERT(!LIST_EMPTY(&reaper_queue), "reaper woke up with empty queue?");
-		thread_t* t = LIST_HEAD(&reaper_queue);
-		LIST_POP_HEAD(&reaper_queue);
-		spinlock_unlock(&spl_reaper);
+			/* Take the entire queue at once */
+			spinlock_lock(&rq->rq_lock);
+			struct THREAD_QUEUE batch = rq->rq_queue;
+			LIST_INIT(&rq->rq_queue);
+			spinlock_unlock(&rq->rq_lock);
 
-		thread_deref(t);
+			LIST_FOREACH_SAFE(&batch, t, thread_t) {
+				thread_deref(t);
+			}
+		}
 	}
 }
 
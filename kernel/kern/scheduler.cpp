@@ -1,43 +1,75 @@
 /*
- * This contains the scheduler; it has two queues: a runqueue (containing all
- * threads that can run) and a sleepqueue (threads which cannot run). The
- * current thread is never on either of these queues; the reason is that the
- * administration of threads is distinct from the scheduler, and having the
- * scheduler re-add a thread that has expired its timeslice back to the
- * runqueue avoids nasty races (as well as being much easier to follow)
+ * This contains the scheduler; every CPU has its own runqueue (containing all
+ * threads that can run on that CPU) and there is a global sleepqueue (threads
+ * which cannot run). Each runqueue is protected by the sched_lock of the CPU
+ * it belongs to, so that CPUs do not contend with each other when picking a
+ * new thread.
+ *
+ * Work is distributed by pulling only: a CPU which has nothing but its idle
+ * thread to run will steal a thread from the busiest CPU, and every
+ * SCHED_BALANCE_INTERVAL invocations of schedule() a CPU will pull a thread
+ * if it is significantly less loaded than the busiest CPU. Threads are never
+ * placed on a CPU outside their affinity mask.
+ *
+ * The topology is taken into account: threads are preferably pulled from and
+ * woken up onto CPUs sharing the same last-level cache, so that they find
+ * their data still cached, and CPUs whose physical core is entirely idle are
+ * preferred over hardware threads whose sibling is busy.
+ *
+ * Real-time (SCHED_FIFO and SCHED_RR) threads live on the priority levels
+ * above the time-sharing ones. A preempted SCHED_FIFO thread stays at the
+ * head of its level, as does a SCHED_RR thread until its quantum is used up.
+ * Each CPU keeps track of the time spent on real-time threads; once they have
+ * used SCHED_RT_RUNTIME_NS of a SCHED_RT_PERIOD_NS period, all other runnable
+ * threads go first for the rest of the period.
+ *
+ * Lock order: a runqueue lock may be held while acquiring the sleepqueue
+ * lock, never the other way around. When two runqueue locks are needed, the
+ * one of the lowest CPU ID must be acquired first.
  */
 #include <machine/thread.h>
 #include <machine/interrupts.h>
+#include <ananas/cpupower.h>
 #include <ananas/error.h>
 #include <ananas/kdb.h>
 #include <ananas/pcpu.h>
-#include <ananas/pcpu.h>
+#include <ananas/preempt.h>
 #include <ananas/lock.h>
 #include <ananas/lib.h>
 #include <ananas/init.h>
 #include <ananas/pcpu.h>
 #include <ananas/schedule.h>
 #include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
 #include "options.h"
 
 #include <machine/vm.h>
 #include <machine/param.h>
 
-/*
- * The next define adds specific debugger assertions that may incur a
- * significant performance penalty - these assertions are named
- * SCHED_ASSERT.
- */
-#define DEBUG_SCHEDULER
+TRACE_SETUP;
+
 #define SCHED_KPRINTF(...)
 
 static int scheduler_active = 0;
 
-static spinlock_t spl_scheduler = SPINLOCK_DEFAULT_INIT;
-static struct SCHEDULER_QUEUE sched_runqueue;
+/* Number of schedule() calls between load balancing attempts */
+#define SCHED_BALANCE_INTERVAL 16
+
+/* Extra imbalance needed to pull a thread from outside our last-level cache */
+#define SCHED_REMOTE_LLC_IMBALANCE 1
+
+/* Time a SCHED_RR thread may run before others of its priority get a turn */
+#define SCHED_RR_QUANTUM_NS	(100ULL * 1000000)
+
+/* Real-time threads may use SCHED_RT_RUNTIME_NS of every SCHED_RT_PERIOD_NS */
+#define SCHED_RT_PERIOD_NS	(1000ULL * 1000000)
+#define SCHED_RT_RUNTIME_NS	(950ULL * 1000000)
+
+static spinlock_t spl_sleepqueue = SPINLOCK_DEFAULT_INIT;
 static struct SCHEDULER_QUEUE sched_sleepqueue;
 
-#ifdef DEBUG_SCHEDULER
+/* Only used to verify invariants, using KASSERT_EXPENSIVE() */
 static int
 scheduler_is_on_queue(struct SCHEDULER_QUEUE* q, thread_t* t)
 {
@@ -48,92 +80,427 @@ scheduler_is_on_queue(struct SCHEDULER_QUEUE* q, thread_t* t)
 	}
 	return n;
 }
-#define SCHED_ASSERT(x,...) KASSERT((x), __VA_ARGS__)
-#else
-#define SCHED_ASSERT(x,...)
-#endif
+
+/*
+ * Returns the first non-empty priority level of a runqueue which is at least
+ * 'prio', or -1 if there is none.
+ */
+static inline int
+scheduler_rq_next_level(struct SCHED_RUNQUEUE* rq, int prio)
+{
+	for (int w = prio / 64; w < SCHED_PRIOMAP_WORDS; w++) {
+		uint64_t bits = rq->rq_priomap[w];
+		if (w == prio / 64)
+			bits &= ~0ULL << (prio % 64);
+		if (bits != 0)
+			return w * 64 + __builtin_ctzll(bits);
+	}
+	return -1;
+}
+
+/*
+ * Returns the highest priority thread of a runqueue which is not running on
+ * another CPU; if 'migrate_to' is not -1, threads which may not run on that
+ * CPU are skipped as well. Only non-empty levels in [first, last] are
+ * visited, and nearly always the first entry of the first level is the one
+ * we are looking for.
+ */
+static thread_t*
+scheduler_rq_pick_range(struct SCHED_RUNQUEUE* rq, thread_t* curthread, int migrate_to, int first, int last)
+{
+	for (int prio = scheduler_rq_next_level(rq, first); prio >= 0 && prio <= last; prio = scheduler_rq_next_level(rq, prio + 1)) {
+		LIST_FOREACH(&rq->rq_level[prio], sp, struct SCHED_PRIV) {
+			thread_t* t = sp->sp_thread;
+			if (THREAD_IS_ACTIVE(t) && t != curthread)
+				continue;
+			if (migrate_to >= 0 && !THREAD_MAY_RUN_ON(t, migrate_to))
+				continue;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static inline thread_t*
+scheduler_rq_pick(struct SCHED_RUNQUEUE* rq, thread_t* curthread, int migrate_to)
+{
+	return scheduler_rq_pick_range(rq, curthread, migrate_to, 0, SCHED_NUM_PRIORITIES - 1);
+}
+
+void
+scheduler_init_pcpu(struct PCPU* pcpu)
+{
+	spinlock_init(&pcpu->sched_lock);
+	struct SCHED_RUNQUEUE* rq = &pcpu->sched_runqueue;
+	for (unsigned int n = 0; n < SCHED_PRIOMAP_WORDS; n++)
+		rq->rq_priomap[n] = 0;
+	for (unsigned int n = 0; n < SCHED_NUM_PRIORITIES; n++)
+		LIST_INIT(&rq->rq_level[n]);
+	pcpu->sched_runqueue_len = 0;
+	pcpu->sched_balance_ticks = 0;
+	pcpu->sched_migrations = 0;
+	pcpu->sched_core = pcpu->cpuid;
+	pcpu->sched_llc = 0;
+	pcpu->sched_switches = 0;
+	for (unsigned int n = 0; n < SCHED_LATENCY_BUCKETS; n++)
+		pcpu->sched_latency[n] = 0;
+	pcpu->sched_rt_period_start = 0;
+	pcpu->sched_rt_ns = 0;
+	pcpu->sched_rt_last = 0;
+	pcpu->sched_rt_throttled = 0;
+	pcpu->sched_rt_throttle_count = 0;
+}
+
+void
+scheduler_set_topology(struct PCPU* pcpu, unsigned int core, unsigned int llc)
+{
+	pcpu->sched_core = core;
+	pcpu->sched_llc = llc;
+}
 
 void
 scheduler_init_thread(thread_t* t)
 {
 	/* Hook up our private scheduling entity */
 	t->t_sched_priv.sp_thread = t;
+	t->t_sched_priv.sp_cpu = -1;
+	t->t_sched_priv.sp_lastcpu = -1;
+	t->t_sched_priv.sp_run_ns = 0;
+	t->t_sched_priv.sp_wait_ns = 0;
+	t->t_sched_priv.sp_last_switch = 0;
+	t->t_sched_priv.sp_voluntary = 0;
+	t->t_sched_priv.sp_involuntary = 0;
+	t->t_sched_priv.sp_slice_ns = 0;
 
 	/* Mark the thread as suspened - the scheduler is responsible for this */
 	t->t_flags |= THREAD_FLAG_SUSPENDED;
 
 	/* Hook the thread to our sleepqueue */
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
-	KASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 0, "new thread is already on runq?");
-	KASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "new thread is already on sleepq?");
+	register_t state = spinlock_lock_unpremptible(&spl_sleepqueue);
+	KASSERT_EXPENSIVE(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "new thread is already on sleepq?");
 	LIST_APPEND(&sched_sleepqueue, &t->t_sched_priv);
-	spinlock_unlock_unpremptible(&spl_scheduler, state);
+	spinlock_unlock_unpremptible(&spl_sleepqueue, state);
 }
 
+/*
+ * Inserts a thread to the runqueue of a given CPU; the sched_lock of that CPU
+ * must be held. The thread is placed at the tail of its priority level, in
+ * order to obtain round-robin scheduling within each level, unless at_head
+ * is set.
+ */
+static void
+scheduler_add_thread_locked(struct PCPU* pcpu, thread_t* t, bool at_head = false)
+{
+	struct SCHED_RUNQUEUE* rq = &pcpu->sched_runqueue;
+	int prio = t->t_priority;
+	KASSERT(prio >= 0 && prio < SCHED_NUM_PRIORITIES, "thread %p has invalid priority %d", t, prio);
+	KASSERT_EXPENSIVE(scheduler_is_on_queue(&rq->rq_level[prio], t) == 0, "adding thread on runq?");
+	KASSERT(THREAD_MAY_RUN_ON(t, pcpu->cpuid), "adding thread %p to cpu %u outside affinity", t, pcpu->cpuid);
+
+	if (at_head)
+		LIST_PREPEND(&rq->rq_level[prio], &t->t_sched_priv);
+	else
+		LIST_APPEND(&rq->rq_level[prio], &t->t_sched_priv);
+	rq->rq_priomap[prio / 64] |= 1ULL << (prio % 64);
+	t->t_sched_priv.sp_priority = prio;
+	t->t_sched_priv.sp_cpu = pcpu->cpuid;
+	pcpu->sched_runqueue_len++;
+}
+
+/*
+ * Removes a thread from the runqueue of a given CPU; the sched_lock of that
+ * CPU must be held.
+ */
 static void
-scheduler_add_thread_locked(thread_t* t)
+scheduler_remove_thread_locked(struct PCPU* pcpu, thread_t* t)
 {
-	KASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 0, "adding thread on runq?");
-	KASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "adding thread on sleepq?");
+	struct SCHED_RUNQUEUE* rq = &pcpu->sched_runqueue;
+	int prio = t->t_sched_priv.sp_priority;
+	KASSERT(t->t_sched_priv.sp_cpu == (int)pcpu->cpuid, "thread %p not on cpu %u", t, pcpu->cpuid);
+	KASSERT_EXPENSIVE(scheduler_is_on_queue(&rq->rq_level[prio], t) == 1, "removing thread not on runqueue");
+
+	LIST_REMOVE(&rq->rq_level[prio], &t->t_sched_priv);
+	if (LIST_EMPTY(&rq->rq_level[prio]))
+		rq->rq_priomap[prio / 64] &= ~(1ULL << (prio % 64));
+	t->t_sched_priv.sp_cpu = -1;
+	pcpu->sched_runqueue_len--;
+}
+
+/*
+ * Locks the runqueue holding a given thread and returns the corresponding CPU;
+ * as the thread may be migrated while we are waiting for the lock, we have to
+ * verify it is still there once we have it. Interrupts will be disabled.
+ */
+static struct PCPU*
+scheduler_lock_thread_runqueue(thread_t* t, register_t* state)
+{
+	for (;;) {
+		int cpu = t->t_sched_priv.sp_cpu;
+		KASSERT(cpu >= 0, "thread %p not on any runqueue", t);
+		struct PCPU* pcpu = pcpu_get(cpu);
+		*state = spinlock_lock_unpremptible(&pcpu->sched_lock);
+		if (t->t_sched_priv.sp_cpu == cpu)
+			return pcpu;
+		spinlock_unlock_unpremptible(&pcpu->sched_lock, *state);
+	}
+}
+
+void
+scheduler_set_priority(thread_t* t, int prio)
+{
+	KASSERT(prio >= 0 && prio < SCHED_NUM_PRIORITIES, "invalid priority %d", prio);
+
+	register_t state = md_interrupts_save_and_disable();
+	for (;;) {
+		int cpu = t->t_sched_priv.sp_cpu;
+		if (cpu < 0) {
+			/* Not on any runqueue; it will be queued using the new priority */
+			t->t_priority = prio;
+			break;
+		}
+
+		struct PCPU* pcpu = pcpu_get(cpu);
+		spinlock_lock_unpremptible(&pcpu->sched_lock);
+		if (t->t_sched_priv.sp_cpu != cpu) {
+			/* Migrated while we were waiting for the lock; try again */
+			spinlock_unlock(&pcpu->sched_lock);
+			continue;
+		}
+		scheduler_remove_thread_locked(pcpu, t);
+		t->t_priority = prio;
+		scheduler_add_thread_locked(pcpu, t);
+
+		/* Like scheduler_add_thread(), kick the CPU if we should preempt it */
+		thread_t* remote_curthread = pcpu->curthread;
+		bool kick = cpu != (int)PCPU_GET(cpuid) && scheduler_active &&
+		 remote_curthread != NULL && remote_curthread->t_priority > prio;
+		spinlock_unlock(&pcpu->sched_lock);
+		if (kick)
+			md_pcpu_reschedule(pcpu);
+		break;
+	}
+	md_interrupts_restore(state);
+}
+
+/* Whether the CPU has nothing but its idle thread to run */
+static inline bool
+scheduler_cpu_is_idle(struct PCPU* pcpu)
+{
+	return pcpu->sched_runqueue_len <= 1;
+}
+
+/* Whether all hardware threads of the CPU's physical core are idle */
+static bool
+scheduler_core_is_idle(struct PCPU* pcpu)
+{
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* p = pcpu_get(n);
+		if (p != NULL && p->sched_core == pcpu->sched_core && !scheduler_cpu_is_idle(p))
+			return false;
+	}
+	return true;
+}
+
+/* Returns the first existing CPU in a mask, or -1 if there is none */
+static int
+scheduler_first_cpu(cpumask_t mask)
+{
+	for (unsigned int n = 0; n < pcpu_get_count(); n++)
+		if ((mask & THREAD_AFFINITY_CPU(n)) != 0 && pcpu_get(n) != NULL)
+			return n;
+	return -1;
+}
+
+/*
+ * Determines the CPU whose runqueue a thread should be placed on; we prefer
+ * the CPU it last ran on, as its caches are likely still warm.
+ */
+static struct PCPU*
+scheduler_pick_cpu(thread_t* t)
+{
+	cpumask_t affinity = __atomic_load_n(&t->t_affinity, __ATOMIC_RELAXED);
+	int cpu = t->t_sched_priv.sp_lastcpu;
+	if (cpu < 0 || (affinity & THREAD_AFFINITY_CPU(cpu)) == 0)
+		cpu = PCPU_GET(cpuid);
+	if ((affinity & THREAD_AFFINITY_CPU(cpu)) == 0)
+		cpu = scheduler_first_cpu(affinity);
+	struct PCPU* pcpu = pcpu_get(cpu);
+	KASSERT(pcpu != NULL, "thread %p wants nonexistent cpu %d", t, cpu);
+	bool single_cpu = (affinity & (affinity - 1)) == 0;
+	if (single_cpu || !scheduler_active || scheduler_cpu_is_idle(pcpu))
+		return pcpu;
 
 	/*
-	 * Add it to the runqueue - note that we must preserve order here
-	 * because the threads must be sorted in order of priority
-	 * XXX Note that this is O(n) - we can do better
+	 * The CPU is busy; an idle one sharing its cache is just as good, and one
+	 * on an idle core even better. This is all unlocked, so merely a hint.
 	 */
-	int inserted = 0;
-	LIST_FOREACH(&sched_runqueue, s, struct SCHED_PRIV) {
-		KASSERT(s->sp_thread != t, "thread %p already in runqueue", t);
-		if (s->sp_thread->t_priority <= t->t_priority)
+	struct PCPU* idle_cpu = NULL;
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* p = pcpu_get(n);
+		if (p == NULL || (affinity & THREAD_AFFINITY_CPU(n)) == 0)
 			continue;
-
-		/* Found a thread with a lower priority; we can insert it here */
-		LIST_INSERT_BEFORE(&sched_runqueue, s, &t->t_sched_priv);
-		inserted++;
-		break;
+		if (p->sched_llc != pcpu->sched_llc || !scheduler_cpu_is_idle(p))
+			continue;
+		if (scheduler_core_is_idle(p))
+			return p;
+		if (idle_cpu == NULL)
+			idle_cpu = p;
 	}
-	if (!inserted)
-		LIST_APPEND(&sched_runqueue, &t->t_sched_priv);
+	return idle_cpu != NULL ? idle_cpu : pcpu;
 }
 
 void
 scheduler_add_thread(thread_t* t)
 {
 	SCHED_KPRINTF("%s: t=%p\n", __func__, t);
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
-	KASSERT(THREAD_IS_SUSPENDED(t), "adding non-suspended thread %p", t);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 0, "adding thread %p already on runqueue", t);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 1, "adding thread %p not on sleepqueue", t);
+
 	/* Remove the thread from the sleepqueue ... */
+	register_t state = spinlock_lock_unpremptible(&spl_sleepqueue);
+	KASSERT(THREAD_IS_SUSPENDED(t), "adding non-suspended thread %p", t);
+	KASSERT_EXPENSIVE(scheduler_is_on_queue(&sched_sleepqueue, t) == 1, "adding thread %p not on sleepqueue", t);
 	LIST_REMOVE(&sched_sleepqueue, &t->t_sched_priv);
-	/* ... and add it to the runqueue ... */
-	scheduler_add_thread_locked(t);
+	spinlock_unlock(&spl_sleepqueue);
+
+	/*
+	 * ... and add it to the runqueue; if its affinity changed while we were
+	 * at it, we have to try again - see scheduler_set_affinity() ...
+	 */
+	struct PCPU* pcpu;
+	for (;;) {
+		pcpu = scheduler_pick_cpu(t);
+		spinlock_lock_unpremptible(&pcpu->sched_lock);
+		scheduler_add_thread_locked(pcpu, t);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (THREAD_MAY_RUN_ON(t, pcpu->cpuid))
+			break;
+		scheduler_remove_thread_locked(pcpu, t);
+		spinlock_unlock(&pcpu->sched_lock);
+	}
+	t->t_sched_priv.sp_last_switch = timer_get_ns(); /* from now on, it is waiting for a CPU */
 	/*
 	 * ... and finally, update the flags: we must do this in the scheduler lock because
 	 *     no one else is allowed to touch the thread while we're moving it
 	 */
 	t->t_flags &= ~THREAD_FLAG_SUSPENDED;
-	spinlock_unlock_unpremptible(&spl_scheduler, state);
+
+	/*
+	 * If the thread went to another CPU and it should preempt whatever is
+	 * running there, kick that CPU - otherwise it'll notice once its current
+	 * timeslice is up.
+	 */
+	bool kick = false;
+	if (pcpu->cpuid != PCPU_GET(cpuid) && scheduler_active) {
+		thread_t* remote_curthread = pcpu->curthread;
+		kick = remote_curthread != NULL && remote_curthread->t_priority > t->t_priority;
+	}
+	spinlock_unlock_unpremptible(&pcpu->sched_lock, state);
+
+	if (kick) {
+		md_pcpu_reschedule(pcpu);
+		return;
+	}
+
+	/*
+	 * The thread has to wait for a CPU; if some other CPU is idling without a
+	 * tick, wake it up so that it can steal the thread. We only need one, and
+	 * prefer one sharing our cache on an idle core.
+	 */
+	if (pcpu->sched_runqueue_len <= 2 || !scheduler_active)
+		return;
+	struct PCPU* target = NULL;
+	unsigned int target_score = 0;
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* p = pcpu_get(n);
+		if (p == NULL || p == pcpu || !p->sched_tickless)
+			continue;
+		unsigned int score = 1;
+		if (p->sched_llc == pcpu->sched_llc)
+			score += 2;
+		if (scheduler_core_is_idle(p))
+			score++;
+		if (score > target_score) {
+			target = p;
+			target_score = score;
+		}
+	}
+	if (target != NULL)
+		md_pcpu_reschedule(target);
 }
 
 void
 scheduler_remove_thread(thread_t* t)
 {
 	SCHED_KPRINTF("%s: t=%p\n", __func__, t);
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
 	KASSERT(!THREAD_IS_SUSPENDED(t), "removing suspended thread %p", t);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "removing thread already on sleepqueue");
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 1, "removing thread not on runqueue");
+
 	/* Remove the thread from the runqueue ... */
-	LIST_REMOVE(&sched_runqueue, &t->t_sched_priv);
+	register_t state;
+	struct PCPU* pcpu = scheduler_lock_thread_runqueue(t, &state);
+	scheduler_remove_thread_locked(pcpu, t);
+
 	/* ... add it to the sleepqueue ... */
+	spinlock_lock_unpremptible(&spl_sleepqueue);
+	KASSERT_EXPENSIVE(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "removing thread already on sleepqueue");
 	LIST_APPEND(&sched_sleepqueue, &t->t_sched_priv);
 	/*
 	 * ... and finally, update the flags: we must do this in the scheduler lock because
 	 *     no one else is allowed to touch the thread while we're moving it
 	 */
 	t->t_flags |= THREAD_FLAG_SUSPENDED;
-	spinlock_unlock_unpremptible(&spl_scheduler, state);
+	spinlock_unlock(&spl_sleepqueue);
+	spinlock_unlock_unpremptible(&pcpu->sched_lock, state);
+}
+
+errorcode_t
+scheduler_set_affinity(thread_t* t, cpumask_t affinity)
+{
+	if (scheduler_first_cpu(affinity) < 0)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/*
+	 * Once the new mask is visible, anyone putting the thread on a runqueue
+	 * honours it (see scheduler_add_thread()) - but if it is on a runqueue
+	 * already, it may have to be moved elsewhere.
+	 */
+	__atomic_store_n(&t->t_affinity, affinity, __ATOMIC_SEQ_CST);
+	register_t state = md_interrupts_save_and_disable();
+	bool reschedule_self = false;
+	for (;;) {
+		int cpu = __atomic_load_n(&t->t_sched_priv.sp_cpu, __ATOMIC_SEQ_CST);
+		if (cpu < 0 || (affinity & THREAD_AFFINITY_CPU(cpu)) != 0)
+			break;
+
+		/* Lock both runqueues in order of CPU ID, like scheduler_pull() */
+		struct PCPU* from = pcpu_get(cpu);
+		struct PCPU* to = scheduler_pick_cpu(t);
+		struct PCPU* first = (from->cpuid < to->cpuid) ? from : to;
+		struct PCPU* second = (from->cpuid < to->cpuid) ? to : from;
+		spinlock_lock_unpremptible(&first->sched_lock);
+		spinlock_lock_unpremptible(&second->sched_lock);
+		bool moved = t->t_sched_priv.sp_cpu == cpu;
+		if (moved) {
+			scheduler_remove_thread_locked(from, t);
+			scheduler_add_thread_locked(to, t);
+		}
+		spinlock_unlock(&second->sched_lock);
+		spinlock_unlock(&first->sched_lock);
+		if (!moved)
+			continue;
+
+		/* If it is still running where it was, that CPU must switch away from it */
+		if (THREAD_IS_ACTIVE(t)) {
+			if (cpu == (int)PCPU_GET(cpuid))
+				reschedule_self = true;
+			else
+				md_pcpu_reschedule(from);
+		}
+		break;
+	}
+	md_interrupts_restore(state);
+
+	if (reschedule_self)
+		schedule();
+	return ananas_success();
 }
 
 void
@@ -144,11 +511,10 @@ scheduler_exit_thread(thread_t* t)
 	 * remove the thread from the schedulers runqueue, and it will not be re-added again.
 	 * Thus, if a context switch would occur, the final exiting code will not be run.
 	 */
-	spinlock_lock_unpremptible(&spl_scheduler);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 1, "exiting thread already not on sleepqueue");
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "exiting thread on runqueue");
+	register_t state;
+	struct PCPU* pcpu = scheduler_lock_thread_runqueue(t, &state);
 	/* Thread seems sane; remove it from the runqueue */
-	LIST_REMOVE(&sched_runqueue, &t->t_sched_priv);
+	scheduler_remove_thread_locked(pcpu, t);
 	/*
 	 * Turn the thread into a zombie; we'll soon be letting go of the scheduler lock, but all
 	 * resources are gone and the thread can be destroyed from now on - interrupts are disabled,
@@ -158,7 +524,7 @@ scheduler_exit_thread(thread_t* t)
 	 */
 	t->t_flags |= THREAD_FLAG_ZOMBIE;
 	/* Let go of the scheduler lock but leave interrupts disabled */
-	spinlock_unlock(&spl_scheduler);
+	spinlock_unlock(&pcpu->sched_lock);
 
 	/* Force a reschedule - won't return */
 	schedule();
@@ -170,6 +536,209 @@ scheduler_release(thread_t* old)
 	/* Release the old thread; it is now safe to schedule it elsewhere */
 	SCHED_KPRINTF("old[%p] -active\n", old);
 	old->t_flags &= ~THREAD_FLAG_ACTIVE;
+	preempt_resume(PCPU_GET(curthread));
+}
+
+/*
+ * Attempts to pull a single thread from the busiest CPU to 'pcpu', provided
+ * the busiest CPU has at least 'min_imbalance' more threads queued. Must be
+ * called with interrupts disabled and without holding any runqueue lock.
+ */
+static void
+scheduler_pull(struct PCPU* pcpu, unsigned int min_imbalance)
+{
+	/*
+	 * If our core's other hardware threads are busy, leave the work to a CPU
+	 * on an idle core if there is one; we'll only pull if it's much needed.
+	 */
+	if (scheduler_cpu_is_idle(pcpu) && !scheduler_core_is_idle(pcpu)) {
+		for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+			struct PCPU* p = pcpu_get(n);
+			if (p == NULL || p->sched_core == pcpu->sched_core || !scheduler_core_is_idle(p))
+				continue;
+			min_imbalance++;
+			break;
+		}
+	}
+
+	/*
+	 * Locate the busiest CPU, counting those outside our last-level cache as
+	 * less busy than they are, as migrating there means losing the cache
+	 * contents; this is unlocked, so it is merely a hint.
+	 */
+	struct PCPU* busiest = NULL;
+	unsigned int busiest_len = 0;
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* p = pcpu_get(n);
+		if (p == NULL || p == pcpu)
+			continue;
+		unsigned int len = p->sched_runqueue_len;
+		if (p->sched_llc != pcpu->sched_llc)
+			len = (len > SCHED_REMOTE_LLC_IMBALANCE) ? len - SCHED_REMOTE_LLC_IMBALANCE : 0;
+		if (busiest == NULL || len > busiest_len) {
+			busiest = p;
+			busiest_len = len;
+		}
+	}
+	if (busiest == NULL || busiest_len < pcpu->sched_runqueue_len + min_imbalance)
+		return;
+	if (busiest->sched_llc != pcpu->sched_llc)
+		min_imbalance += SCHED_REMOTE_LLC_IMBALANCE;
+
+	/* Lock both runqueues in order of CPU ID to prevent deadlocks */
+	struct PCPU* first = (busiest->cpuid < pcpu->cpuid) ? busiest : pcpu;
+	struct PCPU* second = (busiest->cpuid < pcpu->cpuid) ? pcpu : busiest;
+	spinlock_lock_unpremptible(&first->sched_lock);
+	spinlock_lock_unpremptible(&second->sched_lock);
+
+	/*
+	 * Only steal threads which are not running anywhere and can run on any CPU;
+	 * we'll take the highest priority one, as that is the one which has been
+	 * waiting for a CPU the longest.
+	 */
+	if (busiest->sched_runqueue_len >= pcpu->sched_runqueue_len + min_imbalance) {
+		thread_t* victim = scheduler_rq_pick(&busiest->sched_runqueue, NULL, pcpu->cpuid);
+		if (victim != NULL) {
+			SCHED_KPRINTF("%s: pulling t=%p from cpu %u to %u\n", __func__, victim, busiest->cpuid, pcpu->cpuid);
+			scheduler_remove_thread_locked(busiest, victim);
+			scheduler_add_thread_locked(pcpu, victim);
+			pcpu->sched_migrations++;
+		}
+	}
+
+	spinlock_unlock(&second->sched_lock);
+	spinlock_unlock(&first->sched_lock);
+}
+
+/*
+ * Accounts for switching from curthread to newthread; the runqueue lock of
+ * pcpu must be held. Note that if curthread was woken up on another CPU
+ * before we got to switch away from it, it is considered waiting from then on.
+ */
+static void
+scheduler_account_switch(struct PCPU* pcpu, thread_t* curthread, thread_t* newthread, bool preempted)
+{
+	uint64_t now = timer_get_ns();
+	struct SCHED_PRIV* cur = &curthread->t_sched_priv;
+	if (now > cur->sp_last_switch)
+		cur->sp_run_ns += now - cur->sp_last_switch;
+	if (preempted) {
+		cur->sp_involuntary++;
+		cur->sp_last_switch = now;
+	} else {
+		cur->sp_voluntary++;
+	}
+
+	struct SCHED_PRIV* next = &newthread->t_sched_priv;
+	uint64_t wait_ns = (now > next->sp_last_switch) ? now - next->sp_last_switch : 0;
+	next->sp_wait_ns += wait_ns;
+	next->sp_last_switch = now;
+
+	/* The idle thread just soaks up time nobody wants; its latency means nothing */
+	pcpu->sched_switches++;
+	if (newthread != pcpu->idlethread) {
+		uint64_t wait_us = wait_ns / 1000;
+		unsigned int bucket = 0;
+		while (bucket < SCHED_LATENCY_BUCKETS - 1 && wait_us >= (1ULL << bucket))
+			bucket++;
+		pcpu->sched_latency[bucket]++;
+	}
+}
+
+/*
+ * Charges the time since we last got here to the real-time budget if
+ * curthread is a real-time thread, and throttles or unthrottles the
+ * real-time threads as needed. The runqueue lock of pcpu must be held.
+ */
+static void
+scheduler_account_rt(struct PCPU* pcpu, thread_t* curthread)
+{
+	uint64_t now = timer_get_ns();
+	uint64_t delta = (now > pcpu->sched_rt_last) ? now - pcpu->sched_rt_last : 0;
+	pcpu->sched_rt_last = now;
+	if (curthread->t_sched_policy != SCHED_OTHER) {
+		pcpu->sched_rt_ns += delta;
+		curthread->t_sched_priv.sp_slice_ns += delta;
+	}
+
+	if (now - pcpu->sched_rt_period_start >= SCHED_RT_PERIOD_NS) {
+		pcpu->sched_rt_period_start = now;
+		pcpu->sched_rt_ns = 0;
+		pcpu->sched_rt_throttled = 0;
+	} else if (!pcpu->sched_rt_throttled && pcpu->sched_rt_ns >= SCHED_RT_RUNTIME_NS) {
+		pcpu->sched_rt_throttled = 1;
+		pcpu->sched_rt_throttle_count++;
+	}
+}
+
+/*
+ * Whether a thread which got preempted may stay at the head of its level; a
+ * SCHED_RR thread which may not starts its next quantum.
+ */
+static inline bool
+scheduler_keeps_turn(thread_t* t)
+{
+	switch(t->t_sched_policy) {
+		case SCHED_FIFO:
+			return true;
+		case SCHED_RR:
+			if (t->t_sched_priv.sp_slice_ns < SCHED_RR_QUANTUM_NS)
+				return true;
+			t->t_sched_priv.sp_slice_ns = 0;
+			return false;
+		default:
+			return false;
+	}
+}
+
+errorcode_t
+scheduler_set_policy(thread_t* t, int policy, int rt_priority)
+{
+	int prio;
+	switch(policy) {
+		case SCHED_OTHER:
+			if (rt_priority != 0)
+				return ANANAS_ERROR(BAD_RANGE);
+			prio = THREAD_PRIORITY_DEFAULT + t->t_nice;
+			break;
+		case SCHED_FIFO:
+		case SCHED_RR:
+			if (rt_priority < SCHED_RT_PRIORITY_MIN || rt_priority > SCHED_RT_PRIORITY_MAX)
+				return ANANAS_ERROR(BAD_RANGE);
+			prio = THREAD_PRIORITY_RT_FIRST + SCHED_RT_PRIORITY_MAX - rt_priority;
+			break;
+		default:
+			return ANANAS_ERROR(BAD_TYPE);
+	}
+
+	t->t_sched_policy = policy;
+	t->t_sched_priv.sp_slice_ns = 0;
+	mutex_pi_set_priority(t, prio);
+	return ananas_success();
+}
+
+errorcode_t
+scheduler_set_nice(thread_t* t, int nice)
+{
+	if (nice < SCHED_NICE_MIN || nice > SCHED_NICE_MAX)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/* Real-time threads remember it for when they go back to time-sharing */
+	t->t_nice = nice;
+	if (t->t_sched_policy == SCHED_OTHER)
+		mutex_pi_set_priority(t, THREAD_PRIORITY_DEFAULT + nice);
+	return ananas_success();
+}
+
+void
+scheduler_get_policy(thread_t* t, int* policy, int* rt_priority)
+{
+	*policy = t->t_sched_policy;
+	*rt_priority = 0;
+	if (t->t_sched_policy != SCHED_OTHER) {
+		int prio = t->t_pi_boosted ? t->t_base_priority : t->t_priority;
+		*rt_priority = THREAD_PRIORITY_RT_FIRST + SCHED_RT_PRIORITY_MAX - prio;
+	}
 }
 
 void
@@ -179,68 +748,104 @@ schedule()
 	int cpuid = PCPU_GET(cpuid);
 	KASSERT(curthread != NULL, "no current thread active");
 	SCHED_KPRINTF("schedule(): cpu=%u curthread=%p\n", cpuid, curthread);
+	struct PCPU* pcpu = pcpu_get(cpuid);
 
 	/*
-	 * Grab the scheduler lock and disable interrupts; note that they need not be
-	 * enabled - this happens in interrupt context, which needs to clean up
-	 * before another interrupt can be handled.
+	 * Disable interrupts; note that they need not be enabled - this happens in
+	 * interrupt context, which needs to clean up before another interrupt can
+	 * be handled.
 	 */
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
+	register_t state = md_interrupts_save_and_disable();
+
+	/* Rescheduling means we cannot be within a RCU read section */
+	pcpu->rcu_qs_count++;
+
+	/*
+	 * If we have nothing but our idle thread left, try to steal work from
+	 * someone else; otherwise, periodically see if we should take some load off
+	 * the busiest CPU. Note that the idle thread and a runnable current thread
+	 * are both on our runqueue.
+	 */
+	if (pcpu->sched_runqueue_len <= 1) {
+		scheduler_pull(pcpu, 2);
+	} else if (++pcpu->sched_balance_ticks >= SCHED_BALANCE_INTERVAL) {
+		pcpu->sched_balance_ticks = 0;
+		scheduler_pull(pcpu, 2);
+	}
+
+	/* Grab our runqueue lock; interrupts are already disabled */
+	spinlock_lock_unpremptible(&pcpu->sched_lock);
 
 	/* Cancel any rescheduling as we are about to schedule here */
 	curthread->t_flags &= ~THREAD_FLAG_RESCHEDULE;
+	scheduler_account_rt(pcpu, curthread);
 
-	/* Pick the next thread to schedule */
-	KASSERT(!LIST_EMPTY(&sched_runqueue), "runqueue cannot be empty");
-	struct SCHED_PRIV* next_sched = NULL;
-	LIST_FOREACH(&sched_runqueue, sp, struct SCHED_PRIV) {
-		/* Skip the thread if we can't schedule it here */
-		if (sp->sp_thread->t_affinity != THREAD_AFFINITY_ANY &&
-			  sp->sp_thread->t_affinity != cpuid)
-			continue;
-		if (THREAD_IS_ACTIVE(sp->sp_thread) && sp->sp_thread != curthread)
-			continue;
-		next_sched = sp;
-		break;
+	/*
+	 * Pick the next thread to schedule; threads still running elsewhere are
+	 * skipped - this happens if they were woken up before their CPU switched
+	 * away from them. If the real-time threads are throttled, anything else
+	 * but the idle thread goes first.
+	 */
+	KASSERT(pcpu->sched_runqueue_len > 0, "runqueue cannot be empty");
+	struct SCHED_RUNQUEUE* rq = &pcpu->sched_runqueue;
+	thread_t* newthread = NULL;
+	if (pcpu->sched_rt_throttled) {
+		newthread = scheduler_rq_pick_range(rq, curthread, -1, 0, THREAD_PRIORITY_RT_FIRST - 1);
+		if (newthread == NULL)
+			newthread = scheduler_rq_pick_range(rq, curthread, -1, THREAD_PRIORITY_RT_LAST + 1, THREAD_PRIORITY_IDLE - 1);
 	}
-	KASSERT(next_sched != NULL, "nothing on the runqueue for cpu %u", cpuid);
+	if (newthread == NULL)
+		newthread = scheduler_rq_pick(rq, curthread, -1);
+	KASSERT(newthread != NULL, "nothing on the runqueue for cpu %u", cpuid);
 
 	/* Sanity checks */
-	thread_t* newthread = next_sched->sp_thread;
 	KASSERT(!THREAD_IS_SUSPENDED(newthread), "activating suspended thread %p", newthread);
 	KASSERT(newthread == curthread || !THREAD_IS_ACTIVE(newthread), "activating active thread %p", newthread);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, newthread) == 1, "scheduling thread not on runqueue (?)");
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, newthread) == 0, "scheduling thread on sleepqueue");
+	KASSERT(THREAD_MAY_RUN_ON(newthread, cpuid), "activating thread %p outside affinity", newthread);
 
 	SCHED_KPRINTF("%s[%d]: newthread=%p curthread=%p\n", __func__, cpuid, newthread, curthread);
 
 	/*
-	 * If the current thread is not suspended, this means it got interrupted
-	 * involuntary and must be placed back on the running queue; otherwise it
-	 * must have been placed on the runqueue already. We'll add it to the back,
-	 * in order to obtain round-robin scheduling within each priority level.
+	 * If the current thread is still on our runqueue, this means it got
+	 * interrupted involuntary and must be placed back on the runqueue; we'll
+	 * add it to the back, in order to obtain round-robin scheduling within each
+	 * priority level - unless it is a real-time thread which keeps its turn.
 	 *
-	 * We must also take care not to re-add zombie threads; these must not be
-	 * re-added to either scheduler queue.
+	 * If it is not on our runqueue, it is either suspended, a zombie (neither
+	 * of which must be re-added) or it has been woken up onto another CPU's
+	 * runqueue while it was still running here - that CPU can pick it up once
+	 * we've switched away from it.
 	 */
-	if (!THREAD_IS_SUSPENDED(curthread) && !THREAD_IS_ZOMBIE(curthread)) {
-		SCHED_KPRINTF("%s[%d]: removing t=%p from runqueue\n", __func__, cpuid, curthread);
-		LIST_REMOVE(&sched_runqueue, &curthread->t_sched_priv);
+	bool preempted = curthread->t_sched_priv.sp_cpu == cpuid;
+	if (preempted) {
 		SCHED_KPRINTF("%s[%d]: re-adding t=%p\n", __func__, cpuid, curthread);
-		scheduler_add_thread_locked(curthread);
+		scheduler_remove_thread_locked(pcpu, curthread);
+		scheduler_add_thread_locked(pcpu, curthread, scheduler_keeps_turn(curthread));
 	}
 
+	if (curthread != newthread)
+		scheduler_account_switch(pcpu, curthread, newthread, preempted);
+
 	/*
 	 * Schedule our new thread; by marking it as active, it will not be picked up by another
 	 * CPU.
 	 */
 	newthread->t_flags |= THREAD_FLAG_ACTIVE;
+	newthread->t_sched_priv.sp_lastcpu = cpuid;
 	PCPU_SET(curthread, newthread);
 
-	/* Now unlock the scheduler lock but do _not_ enable interrupts */
-	spinlock_unlock(&spl_scheduler);
+	/* If we were idling without a tick, we need it back to preempt this thread */
+	if (pcpu->sched_tickless && newthread != pcpu->idlethread) {
+		pcpu->sched_tickless = 0;
+		md_pcpu_tick_start();
+	}
+
+	/* Now unlock the runqueue lock but do _not_ enable interrupts */
+	spinlock_unlock(&pcpu->sched_lock);
 
 	if (curthread != newthread) {
+		/* Whoever resumes here gets their own preempt_count back, see scheduler_release() */
+		curthread->t_preempt_count = PCPU_GET(preempt_count);
 		thread_t* prev = md_thread_switch(newthread, curthread);
 		scheduler_release(prev);
 	}
@@ -249,6 +854,38 @@ schedule()
 	md_interrupts_restore(state);
 }
 
+void
+scheduler_idle()
+{
+	struct PCPU* pcpu = pcpu_get(PCPU_GET(cpuid));
+	KASSERT(PCPU_GET(curthread) == pcpu->idlethread, "idling with non-idle thread");
+
+	/*
+	 * See if there is anything to do, stealing work from another CPU if needed;
+	 * interrupts must be disabled from here on to ensure no wakeup is lost.
+	 */
+	md_interrupts_disable();
+	pcpu->rcu_qs_count++;
+	scheduler_pull(pcpu, 2);
+	if (pcpu->sched_runqueue_len > 1) {
+		md_interrupts_enable();
+		schedule();
+		return;
+	}
+
+	/*
+	 * Nothing to do; there is no point in a periodic tick, as anything that
+	 * makes a thread runnable on this CPU will send us a reschedule IPI. Note
+	 * that this will not return until after the next interrupt is handled, which
+	 * may well have switched to another thread and back.
+	 */
+	if (!pcpu->sched_tickless) {
+		pcpu->sched_tickless = 1;
+		md_pcpu_tick_stop();
+	}
+	cpupower_idle(pcpu);
+}
+
 void
 scheduler_launch()
 {
@@ -262,6 +899,7 @@ scheduler_launch()
 	 */
 	md_interrupts_disable();
 	PCPU_SET(curthread, idlethread);
+	idlethread->t_sched_priv.sp_last_switch = timer_get_ns();
 
 	/* Run it */
 	scheduler_active++;
@@ -290,13 +928,23 @@ scheduler_activated()
 #ifdef OPTION_KDB
 KDB_COMMAND(scheduler, NULL, "Display scheduler status")
 {
-	kprintf("runqueue\n");
-	if (!LIST_EMPTY(&sched_runqueue)) {
-		LIST_FOREACH(&sched_runqueue, s, struct SCHED_PRIV) {
-			kprintf("  thread %p\n", s->sp_thread);
+	for (unsigned int n = 0; n < pcpu_get_count(); n++) {
+		struct PCPU* pcpu = pcpu_get(n);
+		if (pcpu == NULL)
+			continue;
+		kprintf("cpu %u runqueue (%u threads, %u migrated here, %u switches, real-time throttled %u times%s)\n",
+		 n, pcpu->sched_runqueue_len, pcpu->sched_migrations, (unsigned int)pcpu->sched_switches,
+		 pcpu->sched_rt_throttle_count, pcpu->sched_rt_throttled ? ", now" : "");
+		struct SCHED_RUNQUEUE* rq = &pcpu->sched_runqueue;
+		if (scheduler_rq_next_level(rq, 0) < 0) {
+			kprintf("(empty)\n");
+			continue;
+		}
+		for (int prio = scheduler_rq_next_level(rq, 0); prio >= 0; prio = scheduler_rq_next_level(rq, prio + 1)) {
+			LIST_FOREACH(&rq->rq_level[prio], s, struct SCHED_PRIV) {
+				kprintf("  thread %p (priority %d)\n", s->sp_thread, prio);
+			}
 		}
-	} else {
-		kprintf("(empty)\n");
 	}
 	kprintf("sleepqueue\n");
 	if (!LIST_EMPTY(&sched_sleepqueue)) {
@@ -0,0 +1,55 @@
+/*
+ * The page shared with all of userland; see <ananas/shared-page.h>.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/shared-page.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+namespace {
+
+struct PAGE* shared_page_page = NULL;
+struct SHARED_PAGE* shared_page = NULL;
+
+errorcode_t
+shared_page_init()
+{
+	shared_page = static_cast<struct SHARED_PAGE*>(page_alloc_single_mapped(&shared_page_page, VM_FLAG_READ | VM_FLAG_WRITE));
+	if (shared_page == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	memset(shared_page, 0, PAGE_SIZE);
+
+	md_shared_page_init(*shared_page);
+	return ananas_success();
+}
+
+/* Must be done before the first process is created, as its vmspace needs us */
+INIT_FUNCTION(shared_page_init, SUBSYSTEM_PROCESS, ORDER_FIRST);
+
+} // unnamed namespace
+
+addr_t
+shared_page_get_phys()
+{
+	return (shared_page_page != NULL) ? page_get_paddr(shared_page_page) : 0;
+}
+
+void
+shared_page_set_time(uint32_t tsc_mhz, uint64_t tsc_boot, uint64_t boot_time)
+{
+	/* Writers are rare, so we need no lock; readers only need the sequence */
+	__atomic_add_fetch(&shared_page->sp_time_seq, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shared_page->sp_tsc_mhz = tsc_mhz;
+	shared_page->sp_tsc_boot = tsc_boot;
+	shared_page->sp_boot_time = boot_time;
+	__atomic_add_fetch(&shared_page->sp_time_seq, 1, __ATOMIC_RELEASE);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,297 @@
+/*
+ * Object caches; see <ananas/slab.h> for the general idea.
+ *
+ * Every object is preceded by a SLAB_OBJECT, which is used to chain it on a
+ * free list; this means the object itself is never touched while it is free,
+ * and thus stays in whatever state the constructor left it.
+ *
+ * Each slab starts with a SLAB header, which counts how many of its objects
+ * are on the cache-wide free list; once that is all of them, nothing uses the
+ * slab and our reclaimer can give its pages back. Objects on the per-CPU
+ * lists keep their slab alive, as only the owning CPU may touch those.
+ */
+#include <ananas/types.h>
+#include <machine/param.h>
+#include <machine/interrupts.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/slab.h>
+#include <ananas/vm.h>
+#include "options.h"
+
+#define SLAB_BATCH		16	/* Objects moved between a CPU and the cache at once */
+#define SLAB_CPU_MAX		48	/* Give objects back once a CPU has this many */
+#define SLAB_MIN_OBJECTS	8	/* Minimum number of objects per slab */
+
+static spinlock_t spl_slab_caches = SPINLOCK_DEFAULT_INIT;
+static struct slab_cache_list slab_caches;
+static struct PAGE_RECLAIMER slab_reclaimer;
+
+static inline size_t
+slab_slot_size(struct SLAB_CACHE* sc)
+{
+	size_t size = (sc->sc_size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+	return sizeof(struct SLAB_OBJECT) + size;
+}
+
+/* Size of the SLAB header at the start of every slab, keeping the objects aligned */
+static inline size_t
+slab_header_size()
+{
+	return (sizeof(struct SLAB) + sizeof(long) - 1) & ~(sizeof(long) - 1);
+}
+
+static inline void*
+slab_object_to_ptr(struct SLAB_OBJECT* so)
+{
+	return so + 1;
+}
+
+static inline struct SLAB_OBJECT*
+slab_ptr_to_object(void* obj)
+{
+	return static_cast<struct SLAB_OBJECT*>(obj) - 1;
+}
+
+/*
+ * Allocates a new slab and constructs all objects within; these are added to
+ * the cache-wide free list.
+ */
+static void
+slab_grow(struct SLAB_CACHE* sc)
+{
+	size_t slot_size = slab_slot_size(sc);
+	int order = 0;
+	while (((PAGE_SIZE << order) - slab_header_size()) / slot_size < SLAB_MIN_OBJECTS && order < PAGE_NUM_ORDERS - 1)
+		order++;
+	unsigned int num_objects = ((PAGE_SIZE << order) - slab_header_size()) / slot_size;
+
+	struct PAGE* p;
+	char* mem = static_cast<char*>(page_alloc_order_mapped(order, &p, VM_FLAG_READ | VM_FLAG_WRITE));
+	KASSERT(mem != NULL, "out of memory growing cache '%s'", sc->sc_name);
+
+	auto sl = reinterpret_cast<struct SLAB*>(mem);
+	sl->sl_page = p;
+	sl->sl_order = order;
+	sl->sl_num_objects = num_objects;
+	sl->sl_free = num_objects;
+	sl->sl_dying = 0;
+	sl->sl_next = NULL;
+
+	/* Chain the objects together; we'll hook them to the cache in one go */
+	struct SLAB_OBJECT* first = NULL;
+	struct SLAB_OBJECT* last = NULL;
+	for (unsigned int n = 0; n < num_objects; n++) {
+		auto so = reinterpret_cast<struct SLAB_OBJECT*>(mem + slab_header_size() + n * slot_size);
+		so->so_slab = sl;
+		if (sc->sc_ctor != NULL)
+			sc->sc_ctor(slab_object_to_ptr(so));
+		so->so_next = first;
+		first = so;
+		if (last == NULL)
+			last = so;
+	}
+
+	register_t state = spinlock_lock_unpremptible(&sc->sc_lock);
+	last->so_next = sc->sc_free;
+	sc->sc_free = first;
+	sc->sc_free_count += num_objects;
+	sc->sc_num_objects += num_objects;
+	sc->sc_num_pages += 1 << order;
+	bool need_register = !sc->sc_registered;
+	sc->sc_registered = 1;
+	spinlock_unlock_unpremptible(&sc->sc_lock, state);
+
+	if (need_register) {
+		spinlock_lock(&spl_slab_caches);
+		LIST_APPEND(&slab_caches, sc);
+		spinlock_unlock(&spl_slab_caches);
+	}
+}
+
+void*
+slab_alloc(struct SLAB_CACHE* sc)
+{
+	while (1) {
+		register_t state = md_interrupts_save_and_disable();
+		struct SLAB_CPU* cpu = &sc->sc_cpu[PCPU_GET(cpuid)];
+		if (cpu->sc_free == NULL) {
+			/* Nothing available on this CPU; grab a batch from the cache */
+			spinlock_lock_unpremptible(&sc->sc_lock);
+			for (unsigned int n = 0; n < SLAB_BATCH && sc->sc_free != NULL; n++) {
+				struct SLAB_OBJECT* so = sc->sc_free;
+				sc->sc_free = so->so_next;
+				sc->sc_free_count--;
+				so->so_slab->sl_free--;
+				so->so_next = cpu->sc_free;
+				cpu->sc_free = so;
+				cpu->sc_count++;
+			}
+			spinlock_unlock(&sc->sc_lock);
+		}
+
+		struct SLAB_OBJECT* so = cpu->sc_free;
+		if (so != NULL) {
+			cpu->sc_free = so->so_next;
+			cpu->sc_count--;
+			md_interrupts_restore(state);
+			return slab_object_to_ptr(so);
+		}
+		md_interrupts_restore(state);
+
+		/* The cache is empty as well; add some objects and try again */
+		slab_grow(sc);
+	}
+
+	/* NOTREACHED */
+}
+
+void
+slab_free(struct SLAB_CACHE* sc, void* obj)
+{
+	if (obj == NULL)
+		return;
+
+	struct SLAB_OBJECT* so = slab_ptr_to_object(obj);
+	register_t state = md_interrupts_save_and_disable();
+	struct SLAB_CPU* cpu = &sc->sc_cpu[PCPU_GET(cpuid)];
+	so->so_next = cpu->sc_free;
+	cpu->sc_free = so;
+	if (++cpu->sc_count >= SLAB_CPU_MAX) {
+		/* Too many objects here; hand a batch back to the cache */
+		spinlock_lock_unpremptible(&sc->sc_lock);
+		for (unsigned int n = 0; n < SLAB_BATCH; n++) {
+			so = cpu->sc_free;
+			cpu->sc_free = so->so_next;
+			cpu->sc_count--;
+			so->so_next = sc->sc_free;
+			sc->sc_free = so;
+			sc->sc_free_count++;
+			so->so_slab->sl_free++;
+		}
+		spinlock_unlock(&sc->sc_lock);
+	}
+	md_interrupts_restore(state);
+}
+
+/*
+ * Takes slabs of which every object is on the cache-wide free list out of sc,
+ * until about num_pages pages are gathered; these are chained on 'dead' for
+ * the caller to free. Returns the number of pages gathered.
+ */
+static unsigned int
+slab_reclaim_cache(struct SLAB_CACHE* sc, unsigned int num_pages, struct SLAB** dead)
+{
+	unsigned int num_freed = 0;
+	register_t state = spinlock_lock_unpremptible(&sc->sc_lock);
+	if (sc->sc_free_count == 0) {
+		spinlock_unlock_unpremptible(&sc->sc_lock, state);
+		return 0;
+	}
+
+	/*
+	 * The objects of a slab are scattered over the free list, so we mark it as
+	 * dying when we first come across it and unchain its objects as we go; a
+	 * slab which is marked has to be taken apart entirely, so this needs a
+	 * single complete walk.
+	 */
+	for (struct SLAB_OBJECT** so = &sc->sc_free; *so != NULL; /* nothing */) {
+		struct SLAB* sl = (*so)->so_slab;
+		if (!sl->sl_dying) {
+			if (num_freed >= num_pages || sl->sl_free != sl->sl_num_objects) {
+				so = &(*so)->so_next;
+				continue;
+			}
+			sl->sl_dying = 1;
+			num_freed += 1 << sl->sl_order;
+		}
+
+		*so = (*so)->so_next;
+		sc->sc_free_count--;
+		if (--sl->sl_free > 0)
+			continue;
+		sc->sc_num_objects -= sl->sl_num_objects;
+		sc->sc_num_pages -= 1 << sl->sl_order;
+		sl->sl_next = *dead;
+		*dead = sl;
+	}
+	spinlock_unlock_unpremptible(&sc->sc_lock, state);
+	return num_freed;
+}
+
+/* Page allocator callback; gives back slabs nobody uses until num_pages pages are freed */
+static unsigned int
+slab_reclaim(unsigned int num_pages)
+{
+	struct SLAB* dead = NULL;
+	unsigned int num_freed = 0;
+	spinlock_lock(&spl_slab_caches);
+	LIST_FOREACH(&slab_caches, sc, struct SLAB_CACHE) {
+		if (num_freed >= num_pages)
+			break;
+		num_freed += slab_reclaim_cache(sc, num_pages - num_freed, &dead);
+	}
+	spinlock_unlock(&spl_slab_caches);
+
+	/* Nothing refers to the dead slabs anymore; the header goes along with the pages */
+	while (dead != NULL) {
+		struct SLAB* sl = dead;
+		dead = sl->sl_next;
+		struct PAGE* p = sl->sl_page;
+		kmem_unmap(sl, PAGE_SIZE << sl->sl_order);
+		page_free(p);
+	}
+	return num_freed;
+}
+
+static errorcode_t
+slab_init()
+{
+	slab_reclaimer.pr_name = "slab";
+	slab_reclaimer.pr_func = slab_reclaim;
+	page_register_reclaimer(&slab_reclaimer);
+	return ananas_success();
+}
+
+/* Returns the number of free objects; this is a snapshot, as the per-CPU lists are not locked */
+static unsigned int
+slab_count_free(struct SLAB_CACHE* sc)
+{
+	unsigned int num_free = sc->sc_free_count;
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++)
+		num_free += sc->sc_cpu[n].sc_count;
+	return num_free;
+}
+
+void
+slab_get_status(char* buf, size_t len)
+{
+	char* r = buf;
+	*r = '\0';
+	spinlock_lock(&spl_slab_caches);
+	LIST_FOREACH(&slab_caches, sc, struct SLAB_CACHE) {
+		snprintf(r, len - (r - buf), "%s size %u objects %u free %u pages %u\n",
+		 sc->sc_name, (unsigned int)sc->sc_size, sc->sc_num_objects, slab_count_free(sc), sc->sc_num_pages);
+		r += strlen(r);
+	}
+	spinlock_unlock(&spl_slab_caches);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(slabs, NULL, "Display object caches")
+{
+	LIST_FOREACH(&slab_caches, sc, struct SLAB_CACHE) {
+		kprintf("%s: size %u, %u object(s) of which %u free, %u page(s)\n",
+		 sc->sc_name, (unsigned int)sc->sc_size, sc->sc_num_objects, slab_count_free(sc), sc->sc_num_pages);
+	}
+}
+#endif
+
+/* Go after the caches which free objects to us first, so that their slabs may have emptied */
+INIT_FUNCTION(slab_init, SUBSYSTEM_VFS, ORDER_LAST);
+
+/* vim:set ts=2 sw=2: */
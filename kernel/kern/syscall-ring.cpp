@@ -0,0 +1,311 @@
+/*
+ * Submission/completion rings let a process queue many handle operations
+ * using a single system call; see <ananas/syscall-ring.h> for the layout.
+ *
+ * Every ring has a kernel worker thread which runs in the process' vmspace,
+ * so that it can use the ordinary sys_...() functions on the process' handles
+ * and memory. The ring itself is mapped like any other anonymous memory; the
+ * kernel keeps its own copy of everything it needs to trust and only reads
+ * the indices the process is allowed to update.
+ *
+ * The ring is referenced by the process and by its worker, and temporarily by
+ * anyone submitting or waiting; it is freed once the last of these is gone.
+ */
+#include <ananas/types.h>
+#include <machine/param.h>
+#include <ananas/error.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/pcpu.h>
+#include <ananas/process.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/syscall-ring.h>
+#include <ananas/syscall-vmops.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+#include <ananas/vmspace.h>
+
+TRACE_SETUP;
+
+struct SYSCALL_RING {
+	refcount_t		rg_refcount;
+	bool			rg_stop;		/* worker must stop */
+	semaphore_t*		rg_done;		/* signalled once the worker stopped */
+
+	vmarea_t*		rg_area;		/* mapping of the ring */
+	struct RING_HEADER*	rg_header;
+	struct RING_SQE*	rg_sqe;
+	struct RING_CQE*	rg_cqe;
+	uint32_t		rg_mask;		/* entries - 1 */
+	uint32_t		rg_sq_head;
+	uint32_t		rg_cq_tail;
+
+	semaphore_t		rg_work_sem;		/* signalled on submit */
+	semaphore_t		rg_cq_sem;		/* signalled on completions */
+	thread_t*		rg_worker;
+};
+
+namespace {
+
+inline void
+ring_ref(struct SYSCALL_RING* rg)
+{
+	__atomic_add_fetch(&rg->rg_refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+inline void
+ring_deref(struct SYSCALL_RING* rg)
+{
+	if (__atomic_sub_fetch(&rg->rg_refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		kfree(rg);
+}
+
+struct SYSCALL_RING*
+ring_lookup_and_ref(process_t* p)
+{
+	process_lock(p);
+	struct SYSCALL_RING* rg = p->p_ring;
+	if (rg != nullptr)
+		ring_ref(rg);
+	process_unlock(p);
+	return rg;
+}
+
+inline bool
+ring_stopping(struct SYSCALL_RING* rg)
+{
+	return __atomic_load_n(&rg->rg_stop, __ATOMIC_ACQUIRE);
+}
+
+inline uint32_t
+ring_cq_pending(struct SYSCALL_RING* rg)
+{
+	uint32_t head = __atomic_load_n(&rg->rg_header->rh_cq_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = __atomic_load_n(&rg->rg_cq_tail, __ATOMIC_ACQUIRE);
+	return tail - head;
+}
+
+errorcode_t
+ring_perform(thread_t* t, const struct RING_SQE& sqe, struct RING_CQE& cqe)
+{
+	errorcode_t err;
+	switch(sqe.sqe_op) {
+		case RING_OP_NOP:
+			return ananas_success();
+		case RING_OP_READ: {
+			size_t len = sqe.sqe_len;
+			err = sys_read(t, sqe.sqe_handle, sqe.sqe_buf, &len);
+			cqe.cqe_len = len;
+			return err;
+		}
+		case RING_OP_WRITE: {
+			size_t len = sqe.sqe_len;
+			err = sys_write(t, sqe.sqe_handle, sqe.sqe_buf, &len);
+			cqe.cqe_len = len;
+			return err;
+		}
+		case RING_OP_OPEN: {
+			handleindex_t index;
+			err = sys_open(t, sqe.sqe_path, sqe.sqe_flags, sqe.sqe_mode, &index);
+			if (ananas_is_success(err))
+				cqe.cqe_handle = index;
+			return err;
+		}
+		case RING_OP_STAT:
+			return sys_stat(t, sqe.sqe_path, sqe.sqe_stat);
+		case RING_OP_CLOSE:
+			return sys_close(t, sqe.sqe_handle);
+		default:
+			return ANANAS_ERROR(BAD_OPERATION);
+	}
+}
+
+/* Performs submissions until there are none left or the completion ring is full */
+void
+ring_run(struct SYSCALL_RING* rg, thread_t* curthread)
+{
+	struct RING_HEADER* rh = rg->rg_header;
+	bool completed = false;
+	while (!ring_stopping(rg)) {
+		uint32_t sq_tail = __atomic_load_n(&rh->rh_sq_tail, __ATOMIC_ACQUIRE);
+		if (sq_tail == rg->rg_sq_head || sq_tail - rg->rg_sq_head > rg->rg_mask + 1)
+			break; /* nothing submitted, or nonsense we'll ignore */
+		if (ring_cq_pending(rg) > rg->rg_mask)
+			break; /* no room for the completion */
+
+		/* Take a copy so the process can't change the entry while we use it */
+		struct RING_SQE sqe = rg->rg_sqe[rg->rg_sq_head & rg->rg_mask];
+		struct RING_CQE cqe;
+		memset(&cqe, 0, sizeof(cqe));
+		cqe.cqe_user = sqe.sqe_user;
+		cqe.cqe_handle = -1;
+		cqe.cqe_result = ring_perform(curthread, sqe, cqe);
+
+		rg->rg_cqe[rg->rg_cq_tail & rg->rg_mask] = cqe;
+		rg->rg_sq_head++;
+		__atomic_store_n(&rh->rh_sq_head, rg->rg_sq_head, __ATOMIC_RELEASE);
+		__atomic_store_n(&rg->rg_cq_tail, rg->rg_cq_tail + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&rh->rh_cq_tail, rg->rg_cq_tail, __ATOMIC_RELEASE);
+		completed = true;
+	}
+
+	if (completed)
+		sem_signal(&rg->rg_cq_sem);
+}
+
+void
+ring_worker(void* context)
+{
+	auto rg = static_cast<struct SYSCALL_RING*>(context);
+	thread_t* curthread = PCPU_GET(curthread);
+
+	while (1) {
+		/* A burst of submits only needs a single pass */
+		sem_wait_and_drain(&rg->rg_work_sem);
+		if (ring_stopping(rg))
+			break;
+		ring_run(rg, curthread);
+	}
+
+	/* Release any waiters; they'll notice we are gone */
+	semaphore_t* done = rg->rg_done;
+	sem_signal(&rg->rg_cq_sem);
+	ring_deref(rg);
+	if (done != nullptr)
+		sem_signal(done);
+	thread_exit(0);
+}
+
+} // unnamed namespace
+
+errorcode_t
+syscall_ring_setup(thread_t* t, struct VMOP_OPTIONS* vo)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, entries=%u", t, vo->vo_len);
+	size_t entries = vo->vo_len;
+	if (entries == 0 || entries > RING_MAX_ENTRIES || (entries & (entries - 1)) != 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	size_t sq_offset = ROUND_UP(sizeof(struct RING_HEADER), 64);
+	size_t cq_offset = ROUND_UP(sq_offset + entries * sizeof(struct RING_SQE), 64);
+	size_t len = ROUND_UP(cq_offset + entries * sizeof(struct RING_CQE), PAGE_SIZE);
+
+	auto rg = static_cast<struct SYSCALL_RING*>(kmalloc(sizeof(struct SYSCALL_RING)));
+	memset(rg, 0, sizeof(*rg));
+	rg->rg_refcount = 2; /* process, worker */
+	rg->rg_mask = entries - 1;
+	sem_init(&rg->rg_work_sem, 0);
+	sem_init(&rg->rg_cq_sem, 0);
+
+	process_t* p = t->t_process;
+	process_lock(p);
+	errorcode_t err;
+	if (p->p_ring != nullptr)
+		err = ANANAS_ERROR(FILE_EXISTS);
+	else
+		err = vmspace_map(p->p_vmspace, 0, len, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_ALLOC | VM_FLAG_NO_CLONE | VM_FLAG_PINNED, &rg->rg_area);
+	if (ananas_is_failure(err)) {
+		process_unlock(p);
+		kfree(rg);
+		return err;
+	}
+
+	/* We run in the process' vmspace, so we can fill the header directly */
+	addr_t base = rg->rg_area->va_virt;
+	rg->rg_header = reinterpret_cast<struct RING_HEADER*>(base);
+	rg->rg_sqe = reinterpret_cast<struct RING_SQE*>(base + sq_offset);
+	rg->rg_cqe = reinterpret_cast<struct RING_CQE*>(base + cq_offset);
+	rg->rg_header->rh_entries = entries;
+	rg->rg_header->rh_sq_offset = sq_offset;
+	rg->rg_header->rh_cq_offset = cq_offset;
+
+	char name[THREAD_MAX_NAME_LEN];
+	snprintf(name, sizeof(name), "ring:%d", p->p_pid);
+	err = kthread_alloc(p, &rg->rg_worker, name, &ring_worker, rg);
+	if (ananas_is_failure(err)) {
+		vmspace_area_free(p->p_vmspace, rg->rg_area);
+		process_unlock(p);
+		kfree(rg);
+		return err;
+	}
+	p->p_ring = rg;
+	process_unlock(p);
+
+	thread_resume(rg->rg_worker);
+
+	vo->vo_addr = reinterpret_cast<void*>(base);
+	vo->vo_len = len;
+	return ananas_success();
+}
+
+errorcode_t
+syscall_ring_submit(thread_t* t)
+{
+	struct SYSCALL_RING* rg = ring_lookup_and_ref(t->t_process);
+	if (rg == nullptr)
+		return ANANAS_ERROR(BAD_OPERATION);
+
+	sem_signal(&rg->rg_work_sem);
+	ring_deref(rg);
+	return ananas_success();
+}
+
+errorcode_t
+syscall_ring_wait(thread_t* t, unsigned int min_complete)
+{
+	struct SYSCALL_RING* rg = ring_lookup_and_ref(t->t_process);
+	if (rg == nullptr)
+		return ANANAS_ERROR(BAD_OPERATION);
+
+	errorcode_t err = ananas_success();
+	if (min_complete > rg->rg_mask + 1)
+		err = ANANAS_ERROR(BAD_LENGTH);
+	while (ananas_is_success(err) && ring_cq_pending(rg) < min_complete) {
+		if (ring_stopping(rg)) {
+			sem_signal(&rg->rg_cq_sem); /* pass it on to other waiters */
+			err = ANANAS_ERROR(BAD_OPERATION);
+			break;
+		}
+
+		/* The worker may be held up by a full completion ring; kick it */
+		sem_signal(&rg->rg_work_sem);
+		sem_wait(&rg->rg_cq_sem);
+	}
+
+	ring_deref(rg);
+	return err;
+}
+
+void
+syscall_ring_stop(process_t* p, bool wait)
+{
+	process_lock(p);
+	struct SYSCALL_RING* rg = p->p_ring;
+	p->p_ring = nullptr;
+	process_unlock(p);
+	if (rg == nullptr)
+		return;
+
+	/*
+	 * Note that the worker only notices once its current operation is done;
+	 * this could take a while if it is waiting for input.
+	 */
+	semaphore_t done;
+	sem_init(&done, 0);
+	vmarea_t* va = rg->rg_area;
+	if (wait)
+		rg->rg_done = &done;
+	__atomic_store_n(&rg->rg_stop, true, __ATOMIC_RELEASE);
+	sem_signal(&rg->rg_work_sem);
+	ring_deref(rg);
+	if (!wait)
+		return;
+
+	sem_wait(&done);
+	vmspace_area_free(p->p_vmspace, va);
+}
+
+/* vim:set ts=2 sw=2: */
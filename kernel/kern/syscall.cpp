@@ -3,37 +3,48 @@
 #include <ananas/stat.h>
 #include <ananas/handle.h>
 #include <ananas/lib.h>
-#include <ananas/pcpu.h>
 #include <ananas/syscalls.h>
+#include <ananas/taskstats.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
 
 TRACE_SETUP;
 
-static register_t
-perform_syscall(thread_t* curthread, struct SYSCALL_ARGS* a)
+register_t
+syscall_unsupported(thread_t* curthread, register_t, register_t, register_t, register_t, register_t)
 {
-	switch(a->number) {
-#include "syscalls.inc.cpp"
-		case 0x42:
-			kprintf("[%u]", PCPU_GET(cpuid));
-			reschedule();
-			return ANANAS_ERROR(BAD_SYSCALL);
-		default:
-			kprintf("warning: unsupported syscall %u\n", a->number);
-			return ANANAS_ERROR(BAD_SYSCALL);
-	}
+	kprintf("warning: unsupported syscall by thread %p\n", curthread);
+	return ANANAS_ERROR(BAD_SYSCALL);
 }
 
-register_t
-syscall(struct SYSCALL_ARGS* a)
+namespace {
+
+/* Accounts a syscall to the calling thread; the time spent is added when it returns */
+class SyscallAccounting
 {
-	thread_t* curthread = PCPU_GET(curthread);
+public:
+	SyscallAccounting(thread_t* t, unsigned int nr)
+		: sa_thread(t), sa_nr(nr), sa_start(md_timer_get_ns())
+	{
+		taskstats_syscall_enter(sa_thread, sa_nr);
+	}
 
-	errorcode_t err = perform_syscall(curthread, a);
+	~SyscallAccounting()
+	{
+		taskstats_syscall_leave(sa_thread, sa_nr, md_timer_get_ns() - sa_start);
+	}
 
-	if (ananas_is_failure(err))
-		TRACE(SYSCALL, WARN, "err=%u", err);
-	return err;
-}
+private:
+	thread_t* sa_thread;
+	unsigned int sa_nr;
+	uint64_t sa_start;
+};
+
+} // unnamed namespace
+
+#define SYSCALL_ACCOUNT(t, nr) SyscallAccounting syscall_accounting((t), (nr))
+
+#include "syscalls.inc.cpp"
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,117 @@
+#include <ananas/types.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+#include <ananas/process.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/taskstats.h>
+#include <ananas/thread.h>
+#include "options.h"
+
+static_assert(SYSCALL_COUNT <= TASKSTATS_MAX_SYSCALLS, "increase TASKSTATS_MAX_SYSCALLS");
+
+namespace Ananas {
+namespace Process {
+
+extern struct PROCESS_QUEUE process_all;
+
+} // namespace Process
+} // namespace Ananas
+
+namespace {
+
+spinlock_t taskstats_exited_lock;
+struct TASK_STATS taskstats_exited; /* Processes which are gone */
+
+/*
+ * Threads only ever update their own statistics, but the threads of a process
+ * may run concurrently; hence the process' statistics are updated atomically.
+ */
+inline void
+taskstats_add_process(uint64_t& value, uint64_t amount)
+{
+	__atomic_fetch_add(&value, amount, __ATOMIC_RELAXED);
+}
+
+void
+taskstats_sum(struct TASK_STATS& dest, const struct TASK_STATS& src)
+{
+	for (unsigned int n = 0; n < TASKSTATS_NUM_FAULTS; n++)
+		dest.ts_faults[n] += src.ts_faults[n];
+	for (unsigned int n = 0; n < TASKSTATS_MAX_SYSCALLS; n++) {
+		dest.ts_syscalls[n] += src.ts_syscalls[n];
+		dest.ts_syscall_ns[n] += src.ts_syscall_ns[n];
+	}
+}
+
+} // unnamed namespace
+
+void
+taskstats_fault(int type)
+{
+	thread_t* t = PCPU_GET(curthread);
+	if (t == nullptr)
+		return;
+	t->t_stats.ts_faults[type]++;
+	if (t->t_process != nullptr)
+		taskstats_add_process(t->t_process->p_stats.ts_faults[type], 1);
+}
+
+void
+taskstats_syscall_enter(thread_t* t, unsigned int nr)
+{
+	t->t_stats.ts_syscalls[nr]++;
+	if (t->t_process != nullptr)
+		taskstats_add_process(t->t_process->p_stats.ts_syscalls[nr], 1);
+}
+
+void
+taskstats_syscall_leave(thread_t* t, unsigned int nr, uint64_t ns)
+{
+	t->t_stats.ts_syscall_ns[nr] += ns;
+	if (t->t_process != nullptr)
+		taskstats_add_process(t->t_process->p_stats.ts_syscall_ns[nr], ns);
+}
+
+void
+taskstats_process_exit(process_t* p)
+{
+	spinlock_lock(&taskstats_exited_lock);
+	taskstats_sum(taskstats_exited, p->p_stats);
+	spinlock_unlock(&taskstats_exited_lock);
+}
+
+void
+taskstats_format(const struct TASK_STATS* ts, char* buf, size_t len)
+{
+	snprintf(buf, len, "minor_faults %u\nmajor_faults %u\ncow_faults %u\n",
+	 (unsigned int)ts->ts_faults[TASKSTATS_FAULT_MINOR], (unsigned int)ts->ts_faults[TASKSTATS_FAULT_MAJOR],
+	 (unsigned int)ts->ts_faults[TASKSTATS_FAULT_COW]);
+	for (unsigned int n = 0; n < SYSCALL_COUNT; n++) {
+		if (ts->ts_syscalls[n] == 0)
+			continue;
+		size_t used = strlen(buf);
+		snprintf(buf + used, len - used, "syscall %s calls %u time_us %u\n", syscall_name[n],
+		 (unsigned int)ts->ts_syscalls[n], (unsigned int)(ts->ts_syscall_ns[n] / 1000));
+	}
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(taskstats, NULL, "Display system-wide fault and syscall statistics")
+{
+	/* Everything that exited plus everything still around */
+	struct TASK_STATS total = taskstats_exited;
+	LIST_FOREACH_IP(&Ananas::Process::process_all, all, p, process_t) {
+		taskstats_sum(total, p->p_stats);
+	}
+
+	static char buf[2048];
+	taskstats_format(&total, buf, sizeof(buf));
+	kprintf("%s", buf);
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
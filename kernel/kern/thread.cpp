@@ -33,19 +33,75 @@
 #include <ananas/vm.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
+#include <ananas/slab.h>
 #include <ananas/vmspace.h>
 #include "options.h"
 
 TRACE_SETUP;
 
-static spinlock_t spl_threadqueue = SPINLOCK_DEFAULT_INIT;
-static struct THREAD_QUEUE thread_queue;
+/*
+ * All threads are kept on one of a number of queues, chosen by address, so
+ * that creating and destroying many threads at once does not serialize on a
+ * single lock. These are used before any init functions run; zeroed locks
+ * and queues are valid.
+ */
+#define THREAD_QUEUE_SHARDS	16
+
+struct THREAD_SHARD {
+	spinlock_t		ts_lock;
+	struct THREAD_QUEUE	ts_queue;
+};
+
+static struct THREAD_SHARD thread_shard[THREAD_QUEUE_SHARDS];
+static SLAB_CACHE_DEFINE(thread_cache, struct THREAD, NULL);
+
+static inline struct THREAD_SHARD*
+thread_shard_for(thread_t* t)
+{
+	return &thread_shard[((addr_t)t / sizeof(struct THREAD)) % THREAD_QUEUE_SHARDS];
+}
+
+static void
+thread_queue_add(thread_t* t)
+{
+	struct THREAD_SHARD* ts = thread_shard_for(t);
+	spinlock_lock(&ts->ts_lock);
+	LIST_APPEND(&ts->ts_queue, t);
+	spinlock_unlock(&ts->ts_lock);
+}
+
+static void
+thread_queue_remove(thread_t* t)
+{
+	struct THREAD_SHARD* ts = thread_shard_for(t);
+	spinlock_lock(&ts->ts_lock);
+	LIST_REMOVE(&ts->ts_queue, t);
+	spinlock_unlock(&ts->ts_lock);
+}
+
+#ifdef OPTION_KDB
+/*
+ * Walks all threads without taking the shard locks; the debugger may have
+ * interrupted a CPU which holds one, so waiting for it would hang. This is
+ * only safe as long as nothing is creating or destroying threads.
+ */
+static void
+thread_foreach_unlocked(void (*func)(thread_t* t, void* arg), void* arg)
+{
+	for (unsigned int s = 0; s < THREAD_QUEUE_SHARDS; s++) {
+		struct THREAD_SHARD* ts = &thread_shard[s];
+		LIST_FOREACH(&ts->ts_queue, t, struct THREAD) {
+			func(t, arg);
+		}
+	}
+}
+#endif
 
 errorcode_t
 thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 {
 	/* First off, allocate the thread itself */
-	auto t = new THREAD;
+	auto t = static_cast<thread_t*>(slab_alloc(&thread_cache));
 	memset(t, 0, sizeof(struct THREAD));
 	process_ref(p);
 	t->t_process = p;
@@ -57,6 +113,15 @@ thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 	t->t_priority = THREAD_PRIORITY_DEFAULT;
 	t->t_affinity = THREAD_AFFINITY_ANY;
 
+	/* Userland threads inherit the scheduling settings of whoever creates them */
+	thread_t* curthread = PCPU_GET(curthread);
+	if (curthread != NULL && !THREAD_IS_KTHREAD(curthread)) {
+		t->t_sched_policy = curthread->t_sched_policy;
+		t->t_nice = curthread->t_nice;
+		t->t_priority = curthread->t_pi_boosted ? curthread->t_base_priority : curthread->t_priority;
+		t->t_affinity = curthread->t_affinity;
+	}
+
 	/* Ask machine-dependant bits to initialize our thread data */
 	md_thread_init(t, flags);
 	md_thread_set_argument(t, p->p_info_va);
@@ -69,9 +134,7 @@ thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 	scheduler_init_thread(t);
 
 	/* Add the thread to the thread queue */
-	spinlock_lock(&spl_threadqueue);
-	LIST_APPEND(&thread_queue, t);
-	spinlock_unlock(&spl_threadqueue);
+	thread_queue_add(t);
 
 	*dest = t;
 	return ananas_success();
@@ -98,9 +161,30 @@ kthread_init(thread_t* t, const char* name, kthread_func_t func, void* arg)
 	scheduler_init_thread(t);
 
 	/* Add the thread to the thread queue */
-	spinlock_lock(&spl_threadqueue);
-	LIST_APPEND(&thread_queue, t);
-	spinlock_unlock(&spl_threadqueue);
+	thread_queue_add(t);
+	return ananas_success();
+}
+
+errorcode_t
+kthread_alloc(process_t* p, thread_t** dest, const char* name, kthread_func_t func, void* arg)
+{
+	/*
+	 * These are ordinary kernel threads, except that they use the process'
+	 * vmspace so that they can access its memory on its behalf.
+	 */
+	auto t = static_cast<thread_t*>(slab_alloc(&thread_cache));
+	errorcode_t err = kthread_init(t, name, func, arg);
+	if (ananas_is_failure(err)) {
+		slab_free(&thread_cache, t);
+		return err;
+	}
+
+	process_ref(p);
+	t->t_process = p;
+	t->t_flags |= THREAD_FLAG_MALLOC;
+	md_kthread_set_vmspace(t, p->p_vmspace);
+
+	*dest = t;
 	return ananas_success();
 }
 
@@ -144,13 +228,11 @@ thread_destroy(thread_t* t)
 
 	/* If we aren't reaping the thread, remove it from our thread queue; it'll be gone soon */
 	if ((t->t_flags & THREAD_FLAG_REAPING) == 0) {
-		spinlock_lock(&spl_threadqueue);
-		LIST_REMOVE(&thread_queue, t);
-		spinlock_unlock(&spl_threadqueue);
+		thread_queue_remove(t);
 	}
 
 	if (t->t_flags & THREAD_FLAG_MALLOC)
-		kfree(t);
+		slab_free(&thread_cache, t);
 	else
 		memset(t, 0, sizeof(*t));
 }
@@ -199,9 +281,7 @@ thread_deref(thread_t* t)
 		t->t_refcount++;
 
 		/* Assign the thread to the reaper queue */
-		spinlock_lock(&spl_threadqueue);
-		LIST_REMOVE(&thread_queue, t);
-		spinlock_unlock(&spl_threadqueue);
+		thread_queue_remove(t);
 		reaper_enqueue(t);
 		return;
 	}
@@ -329,50 +409,33 @@ void
 idle_thread(void*)
 {
 	while(1) {
-		md_cpu_relax();
+		scheduler_idle();
 	}
 }
 
-#if 0
-extern struct THREAD* kdb_curthread;
-
-KDB_COMMAND(threads, "[s:flags]", "Displays current threads")
+#ifdef OPTION_KDB
+static void
+kdb_print_thread(thread_t* t, void* arg)
 {
-	int flags = 0;
-
-#define FLAG_HANDLE 1
-
-	/* we use arguments as a mask to determine which information is to be dumped */
-	for (int i = 1; i < num_args; i++) {
-		for (const char* ptr = arg[i].a_u.u_string; *ptr != '\0'; ptr++)
-			switch(*ptr) {
-				case 'h': flags |= FLAG_HANDLE; break;
-				default:
-					kprintf("unknown modifier '%c', ignored\n", *ptr);
-					break;
-			}
-	}
+	thread_t* cur = static_cast<thread_t*>(arg);
+	kprintf("thread %p (hindex %d, pid %d, cpus %x, priority %d): %s: flags [", t, t->t_hidx_thread,
+	 t->t_process != NULL ? (int)t->t_process->p_pid : -1, (unsigned int)t->t_affinity, t->t_priority, t->t_name);
+	if (THREAD_IS_ACTIVE(t))      kprintf(" active");
+	if (THREAD_IS_SUSPENDED(t))   kprintf(" suspended");
+	if (THREAD_IS_ZOMBIE(t))      kprintf(" zombie");
+	if (t->t_flags & THREAD_FLAG_KTHREAD) kprintf(" kthread");
+	kprintf(" ]%s\n", (t == cur) ? " <- current" : "");
+}
 
-	struct THREAD* cur = PCPU_CURTHREAD();
-	spinlock_lock(&spl_threadqueue);
+KDB_COMMAND(threads, NULL, "Displays current threads")
+{
 	kprintf("thread dump\n");
-	LIST_FOREACH(&thread_queue, t, struct THREAD) {
-		kprintf ("thread %p (hindex %d): %s: flags [", t, t->t_hidx_thread, t->t_threadinfo->ti_args);
-		if (THREAD_IS_ACTIVE(t))      kprintf(" active");
-		if (THREAD_IS_SUSPENDED(t))   kprintf(" suspended");
-		if (THREAD_IS_ZOMBIE(t))      kprintf(" zombie");
-		kprintf(" ]%s\n", (t == cur) ? " <- current" : "");
-		if (flags & FLAG_HANDLE) {
-			kprintf("handles\n");
-			for (unsigned int n = 0; n < THREAD_MAX_HANDLES; n++) {
-				if (t->t_handle[n] == NULL)
-					continue;
-				kprintf(" %d: handle %p, type %u\n", n, t->t_handle[n], t->t_handle[n]->h_type);
-			}
-		}
-	}
-	spinlock_unlock(&spl_threadqueue);
+	thread_foreach_unlocked(kdb_print_thread, PCPU_CURTHREAD());
 }
+#endif /* OPTION_KDB */
+
+#if 0
+extern struct THREAD* kdb_curthread;
 
 KDB_COMMAND(thread, NULL, "Shows current thread information")
 {
@@ -0,0 +1,385 @@
+/*
+ * High-resolution timers, kept in a hierarchical timer wheel per CPU.
+ *
+ * Every wheel has TIMER_LEVELS levels of TIMER_SLOTS slots; a slot on level 0
+ * covers 2^TIMER_LEVEL0_SHIFT nanoseconds and every next level covers
+ * TIMER_SLOTS times more. A timer goes in the lowest level which can hold its
+ * expiry time, so starting and cancelling timers are O(1). Once time reaches
+ * a slot on a higher level, its timers are cascaded to the lower levels;
+ * timers on level 0 expire once their exact expiry time has passed.
+ *
+ * Rather than ticking, the hardware is programmed for the first event of the
+ * wheel - be it an expiring level 0 timer or a cascade - which makes an idle
+ * CPU without timers truly idle. The occupancy bitmaps make finding that
+ * event cheap.
+ *
+ * Timer functions are called without the wheel lock held; while a function
+ * runs, the timer is marked TIMER_SLOT_RUNNING so that timer_cancel() can wait
+ * for it to finish.
+ */
+#include <ananas/types.h>
+#include <machine/interrupts.h>
+#include <machine/param.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+#include <ananas/profile.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include "options.h"
+
+#define TIMER_LEVELS		5
+#define TIMER_SLOT_BITS		6
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define TIMER_LEVEL0_SHIFT	16	/* 65.5us per level 0 slot */
+
+/* Special tm_slot values */
+#define TIMER_SLOT_EXPIRED	-1	/* on tw_expired, function not yet called */
+#define TIMER_SLOT_RUNNING	-2	/* function being called */
+
+namespace {
+
+struct TIMER_WHEEL {
+	spinlock_t tw_lock;
+	uint64_t tw_now;			/* time the wheel is advanced to */
+	uint64_t tw_deadline;			/* programmed event, 0 if none */
+	uint64_t tw_occupied[TIMER_LEVELS];	/* bit set if the slot has timers */
+	struct TIMER_LIST tw_slot[TIMER_LEVELS][TIMER_SLOTS];
+	struct TIMER_LIST tw_expired;
+	struct TIMER tw_tick;			/* timeslice tick */
+} __attribute__((aligned(64)));
+
+struct TIMER_WHEEL timer_wheel[PCPU_MAX_CPUS];
+
+inline unsigned int
+timer_level_shift(int level)
+{
+	return TIMER_LEVEL0_SHIFT + level * TIMER_SLOT_BITS;
+}
+
+void
+timer_insert(struct TIMER_WHEEL* tw, struct TIMER* tm)
+{
+	uint64_t expires = tm->tm_expires;
+	if (expires < tw->tw_now)
+		expires = tw->tw_now; /* overdue; goes in the current slot */
+
+	int level;
+	uint64_t slot;
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		unsigned int shift = timer_level_shift(level);
+		slot = expires >> shift;
+		if (slot - (tw->tw_now >> shift) < TIMER_SLOTS)
+			break;
+	}
+	if (level == TIMER_LEVELS) {
+		/* Beyond the reach of the wheel; park it in the last slot, it'll be re-cascaded */
+		level = TIMER_LEVELS - 1;
+		slot = (tw->tw_now >> timer_level_shift(level)) + TIMER_SLOTS - 1;
+	}
+
+	unsigned int idx = slot & (TIMER_SLOTS - 1);
+	LIST_APPEND(&tw->tw_slot[level][idx], tm);
+	tw->tw_occupied[level] |= 1ULL << idx;
+	tm->tm_slot = level * TIMER_SLOTS + idx;
+}
+
+void
+timer_remove(struct TIMER_WHEEL* tw, struct TIMER* tm)
+{
+	if (tm->tm_slot == TIMER_SLOT_EXPIRED) {
+		LIST_REMOVE(&tw->tw_expired, tm);
+		return;
+	}
+
+	int level = tm->tm_slot / TIMER_SLOTS;
+	unsigned int idx = tm->tm_slot % TIMER_SLOTS;
+	struct TIMER_LIST& tl = tw->tw_slot[level][idx];
+	LIST_REMOVE(&tl, tm);
+	if (LIST_EMPTY(&tl))
+		tw->tw_occupied[level] &= ~(1ULL << idx);
+}
+
+/*
+ * Returns the time of the first event in the wheel, or ~0 if there is none;
+ * this is the earliest expiry time for level 0 and the start of the slot for
+ * the other levels, as that is when it must be cascaded.
+ */
+uint64_t
+timer_next_event(struct TIMER_WHEEL* tw, int& event_level, unsigned int& event_idx)
+{
+	uint64_t next = ~0ULL;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		uint64_t occupied = tw->tw_occupied[level];
+		if (occupied == 0)
+			continue;
+
+		/* Look for the first occupied slot from the current one onwards, wrapping around */
+		unsigned int shift = timer_level_shift(level);
+		uint64_t cur = tw->tw_now >> shift;
+		unsigned int cur_idx = cur & (TIMER_SLOTS - 1);
+		uint64_t rotated = (occupied >> cur_idx) | (cur_idx != 0 ? occupied << (TIMER_SLOTS - cur_idx) : 0);
+		unsigned int dist = __builtin_ctzll(rotated);
+		unsigned int idx = (cur_idx + dist) & (TIMER_SLOTS - 1);
+
+		uint64_t t;
+		if (level == 0) {
+			t = ~0ULL;
+			LIST_FOREACH(&tw->tw_slot[0][idx], tm, struct TIMER) {
+				if (tm->tm_expires < t)
+					t = tm->tm_expires;
+			}
+		} else {
+			t = (cur + dist) << shift;
+		}
+		if (t < next) {
+			next = t;
+			event_level = level;
+			event_idx = idx;
+		}
+	}
+	return next;
+}
+
+/* Moves everything due at 'now' to tw_expired, cascading as needed */
+void
+timer_advance(struct TIMER_WHEEL* tw, uint64_t now)
+{
+	for (;;) {
+		int level;
+		unsigned int idx;
+		uint64_t t = timer_next_event(tw, level, idx);
+		if (t > now)
+			break;
+
+		struct TIMER_LIST& tl = tw->tw_slot[level][idx];
+		if (level == 0) {
+			LIST_FOREACH_SAFE(&tl, tm, struct TIMER) {
+				if (tm->tm_expires > now)
+					continue;
+				LIST_REMOVE(&tl, tm);
+				LIST_APPEND(&tw->tw_expired, tm);
+				tm->tm_slot = TIMER_SLOT_EXPIRED;
+			}
+			if (LIST_EMPTY(&tl))
+				tw->tw_occupied[0] &= ~(1ULL << idx);
+			continue;
+		}
+
+		/* Reached a slot on a higher level; spread its timers over the lower levels */
+		if (t > tw->tw_now)
+			tw->tw_now = t;
+		struct TIMER_LIST cascade = tl;
+		LIST_INIT(&tl);
+		tw->tw_occupied[level] &= ~(1ULL << idx);
+		while (!LIST_EMPTY(&cascade)) {
+			struct TIMER* tm = LIST_HEAD(&cascade);
+			LIST_POP_HEAD(&cascade);
+			timer_insert(tw, tm);
+		}
+	}
+
+	/* Nothing else is due before 'now', so we can skip ahead */
+	if (now > tw->tw_now)
+		tw->tw_now = now;
+}
+
+/* Programs the hardware for the first event, unless something as early is programmed */
+void
+timer_program(struct TIMER_WHEEL* tw)
+{
+	int level;
+	unsigned int idx;
+	uint64_t next = timer_next_event(tw, level, idx);
+	if (next == ~0ULL || (tw->tw_deadline != 0 && tw->tw_deadline <= next))
+		return;
+	if (md_timer_program(next))
+		tw->tw_deadline = next;
+}
+
+/*
+ * Takes the timer off whatever wheel it is on; returns false if it was not
+ * pending. Interrupts must be disabled.
+ */
+bool
+timer_detach(struct TIMER* tm, bool wait_running)
+{
+	for (;;) {
+		int cpu = *(volatile int*)&tm->tm_cpu;
+		if (cpu < 0)
+			return false;
+
+		struct TIMER_WHEEL* tw = &timer_wheel[cpu];
+		spinlock_lock_unpremptible(&tw->tw_lock);
+		if (tm->tm_cpu != cpu) {
+			/* Moved while we were getting the lock; try again */
+			spinlock_unlock(&tw->tw_lock);
+			continue;
+		}
+		if (tm->tm_slot == TIMER_SLOT_RUNNING) {
+			if (!wait_running) {
+				/* Restarting; claim it so timer_interrupt() leaves it alone */
+				tm->tm_cpu = -1;
+				spinlock_unlock(&tw->tw_lock);
+				return false;
+			}
+			spinlock_unlock(&tw->tw_lock);
+			md_cpu_pause();
+			continue;
+		}
+
+		timer_remove(tw, tm);
+		tm->tm_cpu = -1;
+		spinlock_unlock(&tw->tw_lock);
+		return true;
+	}
+}
+
+void
+timer_tick(void* context)
+{
+	auto tw = static_cast<struct TIMER_WHEEL*>(context);
+
+	/* Timeslice is up; have the IRQ code reschedule us */
+	thread_t* curthread = PCPU_GET(curthread);
+	curthread->t_flags |= THREAD_FLAG_RESCHEDULE;
+
+	/* Keep the ticks evenly spaced, unless we fell behind */
+	uint64_t next = tw->tw_tick.tm_expires + TIMER_TICK_NS;
+	uint64_t now = timer_get_ns();
+	if (next <= now)
+		next = now + TIMER_TICK_NS;
+	timer_start(&tw->tw_tick, next);
+}
+
+void
+timer_sleep_wakeup(void* context)
+{
+	sem_signal(static_cast<semaphore_t*>(context));
+}
+
+} // unnamed namespace
+
+void
+timer_init(struct TIMER* tm, timer_func_t func, void* context)
+{
+	tm->tm_expires = 0;
+	tm->tm_func = func;
+	tm->tm_context = context;
+	tm->tm_cpu = -1;
+	tm->tm_slot = 0;
+}
+
+void
+timer_start(struct TIMER* tm, uint64_t expires)
+{
+	register_t state = md_interrupts_save_and_disable();
+	timer_detach(tm, false);
+
+	int cpu = PCPU_GET(cpuid);
+	struct TIMER_WHEEL* tw = &timer_wheel[cpu];
+	spinlock_lock_unpremptible(&tw->tw_lock);
+
+	/*
+	 * If the wheel lagged behind (it is only advanced by events), catch up
+	 * first; there is nothing due in between, so this is just bookkeeping but
+	 * it keeps the timer on the lowest level it can be on.
+	 */
+	uint64_t now = timer_get_ns();
+	int level;
+	unsigned int idx;
+	if (now > tw->tw_now && timer_next_event(tw, level, idx) > now)
+		tw->tw_now = now;
+
+	tm->tm_expires = expires;
+	tm->tm_cpu = cpu;
+	timer_insert(tw, tm);
+	timer_program(tw);
+	spinlock_unlock_unpremptible(&tw->tw_lock, state);
+}
+
+bool
+timer_cancel(struct TIMER* tm)
+{
+	register_t state = md_interrupts_save_and_disable();
+	bool pending = timer_detach(tm, true);
+	md_interrupts_restore(state);
+	return pending;
+}
+
+uint64_t
+timer_get_ns()
+{
+	return md_timer_get_ns();
+}
+
+void
+timer_interrupt()
+{
+#ifdef OPTION_PROFILE
+	profile_interrupt();
+#endif
+
+	int cpu = PCPU_GET(cpuid);
+	struct TIMER_WHEEL* tw = &timer_wheel[cpu];
+
+	register_t state = spinlock_lock_unpremptible(&tw->tw_lock);
+	tw->tw_deadline = 0; /* whatever was programmed has fired */
+	timer_advance(tw, timer_get_ns());
+	while (!LIST_EMPTY(&tw->tw_expired)) {
+		struct TIMER* tm = LIST_HEAD(&tw->tw_expired);
+		LIST_POP_HEAD(&tw->tw_expired);
+		tm->tm_slot = TIMER_SLOT_RUNNING;
+		spinlock_unlock(&tw->tw_lock);
+
+		tm->tm_func(tm->tm_context);
+
+		/*
+		 * Unless the function restarted the timer, it is no longer pending; we
+		 * must not touch it once that is visible, as it may be freed right away.
+		 */
+		spinlock_lock_unpremptible(&tw->tw_lock);
+		if (tm->tm_cpu == cpu && tm->tm_slot == TIMER_SLOT_RUNNING)
+			tm->tm_cpu = -1;
+	}
+	timer_program(tw);
+	spinlock_unlock_unpremptible(&tw->tw_lock, state);
+}
+
+void
+timer_tick_start()
+{
+	register_t state = md_interrupts_save_and_disable();
+	struct TIMER_WHEEL* tw = &timer_wheel[PCPU_GET(cpuid)];
+	if (tw->tw_tick.tm_func == NULL)
+		timer_init(&tw->tw_tick, timer_tick, tw);
+	if (tw->tw_tick.tm_cpu < 0)
+		timer_start(&tw->tw_tick, timer_get_ns() + TIMER_TICK_NS);
+	md_interrupts_restore(state);
+}
+
+void
+timer_tick_stop()
+{
+	register_t state = md_interrupts_save_and_disable();
+	struct TIMER_WHEEL* tw = &timer_wheel[PCPU_GET(cpuid)];
+	if (tw->tw_tick.tm_func != NULL)
+		timer_detach(&tw->tw_tick, false);
+	md_interrupts_restore(state);
+}
+
+void
+thread_sleep_ns(uint64_t ns)
+{
+	KASSERT(PCPU_GET(nested_irq) == 0, "thread_sleep_ns() in irq");
+
+	semaphore_t sem;
+	sem_init(&sem, 0);
+	struct TIMER tm;
+	timer_init(&tm, timer_sleep_wakeup, &sem);
+	timer_start(&tm, timer_get_ns() + ns);
+	sem_wait(&sem);
+	timer_cancel(&tm); /* ensures the timer is done with our semaphore */
+}
+
+/* vim:set ts=2 sw=2: */
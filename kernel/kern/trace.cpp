@@ -1,40 +1,241 @@
 #include <ananas/types.h>
 #include <ananas/console.h>
+#include <ananas/kdb.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/pcpu.h>
 #include <ananas/process.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
+#include "options.h"
 
 #define TRACE_PRINTF_BUFSIZE 256
+#define TRACE_RING_SIZE 256	/* Records per CPU; must be a power of two */
 
 uint32_t trace_subsystem_mask[TRACE_SUBSYSTEM_LAST];
 
+extern struct TRACEPOINT __tracepoints_begin, __tracepoints_end;
+
+static const char* trace_subsystem_names[TRACE_SUBSYSTEM_LAST] = {
+	"debug", "vfs", "thread", "exec", "bio", "handle", "syscall", "machdep", "usb", "vm"
+};
+
+const char*
+trace_subsystem_name(int subsystem)
+{
+	if (subsystem < 0 || subsystem >= TRACE_SUBSYSTEM_LAST)
+		return "?";
+	return trace_subsystem_names[subsystem];
+}
+
+unsigned int
+trace_get_num_points()
+{
+	return &__tracepoints_end - &__tracepoints_begin;
+}
+
+struct TRACEPOINT*
+trace_get_point(unsigned int id)
+{
+	if (id >= trace_get_num_points())
+		return nullptr;
+	return &__tracepoints_begin + id;
+}
+
 void
-tracef(int fileid, const char* func, const char* fmt, ...)
+trace_set_point(struct TRACEPOINT* tp, bool enabled)
 {
-	uint32_t timestamp = 0;
-#if defined(__amd64__)
-	/* XXX This should be generic somehow */
-	extern uint32_t x86_get_ms_since_boot();
-	timestamp = x86_get_ms_since_boot();
-#endif
+	__atomic_store_n(&tp->tp_enabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
 
-	char buf[TRACE_PRINTF_BUFSIZE];
+/* Sets the levels to trace for an entire subsystem; this overrides individual tracepoints */
+void
+trace_set_subsystem(int subsystem, uint32_t mask)
+{
+	if (subsystem < 0 || subsystem >= TRACE_SUBSYSTEM_LAST)
+		return;
+	trace_subsystem_mask[subsystem] = mask;
+	for (struct TRACEPOINT* tp = &__tracepoints_begin; tp < &__tracepoints_end; tp++) {
+		if (tp->tp_subsystem == subsystem)
+			trace_set_point(tp, (tp->tp_level & mask) != 0);
+	}
+}
+
+/*
+ * Every CPU only ever writes to its own ring, with interrupts disabled, so no
+ * locks are needed; the oldest records are overwritten once the ring is full.
+ */
+struct TRACE_RING {
+	uint64_t		tr_next;	/* Total number of records written */
+	struct TRACE_RECORD	tr_record[TRACE_RING_SIZE];
+};
+
+static struct TRACE_RING trace_ring[PCPU_MAX_CPUS];
+
+static const char*
+trace_skip_spec(const char* fmt)
+{
+	/* Skips the flag, width and precision; this mirrors vapprintf() */
+	if (*fmt == '#' || *fmt == '0' || *fmt == '-' || *fmt == ' ' || *fmt == '+' || *fmt == '\'')
+		fmt++;
+	while (*fmt >= '0' && *fmt <= '9')
+		fmt++;
+	if (*fmt == '.') {
+		fmt++;
+		while (*fmt >= '0' && *fmt <= '9')
+			fmt++;
+	}
+	return fmt;
+}
+
+/* Stores the arguments described by fmt in the record */
+static void
+trace_store_args(struct TRACE_RECORD* tr, const char* fmt, va_list va)
+{
+	unsigned int num_args = 0;
+	size_t str_used = 0;
+	for (/* nothing */; *fmt != '\0'; fmt++) {
+		if (*fmt != '%')
+			continue;
+		fmt = trace_skip_spec(fmt + 1);
+		if (*fmt == '\0')
+			break;
+		if (num_args == TRACE_RECORD_ARGS)
+			break;
 
+		switch(*fmt) {
+			case 's': {
+				/* Copy as much of the string as fits; it is referred to by the record */
+				const char* s = va_arg(va, const char*);
+				if (s == NULL)
+					s = "(null)";
+				char* dest = &tr->tr_str[str_used];
+				size_t n = 0;
+				while (s[n] != '\0' && str_used + n + 1 < TRACE_RECORD_STRLEN) {
+					dest[n] = s[n];
+					n++;
+				}
+				dest[n] = '\0';
+				str_used += (str_used + n + 1 < TRACE_RECORD_STRLEN) ? n + 1 : n;
+				tr->tr_arg[num_args++] = (uint64_t)(addr_t)dest;
+				break;
+			}
+			case 'p':
+				tr->tr_arg[num_args++] = (uint64_t)(addr_t)va_arg(va, void*);
+				break;
+			case 'c':
+			case 'x':
+			case 'X':
+			case 'u':
+			case 'o':
+			case 'd':
+			case 'i':
+				tr->tr_arg[num_args++] = va_arg(va, unsigned int);
+				break;
+			default: /* no argument */
+				break;
+		}
+	}
+}
+
+void
+trace_format(const struct TRACE_RECORD* tr, char* buf, size_t len)
+{
+	uint64_t ms = tr->tr_timestamp / 1000000;
+	snprintf(buf, len, "[%4u.%03u] (%d) %s: ", (unsigned int)(ms / 1000), (unsigned int)(ms % 1000), (int)tr->tr_pid, tr->tr_func);
+
+	/*
+	 * Every variadic argument takes up a full 64-bit slot, so passing all of
+	 * them along makes vapprintf() fetch each the way the caller passed it.
+	 * Strings have been copied into the record, which we can refer to.
+	 */
+	size_t used = strlen(buf);
+	snprintf(buf + used, len - used, tr->tr_fmt,
+	 tr->tr_arg[0], tr->tr_arg[1], tr->tr_arg[2], tr->tr_arg[3], tr->tr_arg[4], tr->tr_arg[5]);
+}
+
+void
+tracef(int fileid, int subsystem, int level, const char* func, const char* fmt, ...)
+{
 	thread_t* curthread = PCPU_GET(curthread);
-	const char* tname = curthread->t_name;
-	pid_t pid = curthread->t_process != NULL ? curthread->t_process->p_pid : -1;
 
-	snprintf(buf, sizeof(buf), "[%4u.%03u] (%d:%s) %s: ", timestamp / 1000, timestamp % 1000, (int)pid, tname, func);
+	int state = md_interrupts_save_and_disable();
+	struct TRACE_RING* ring = &trace_ring[PCPU_GET(cpuid)];
+	struct TRACE_RECORD* tr = &ring->tr_record[ring->tr_next % TRACE_RING_SIZE];
+	tr->tr_timestamp = md_timer_get_ns();
+	tr->tr_func = func;
+	tr->tr_fmt = fmt;
+	tr->tr_pid = curthread->t_process != NULL ? curthread->t_process->p_pid : -1;
+	tr->tr_fileid = fileid;
+	tr->tr_subsystem = subsystem;
+	tr->tr_level = level;
 
 	va_list va;
 	va_start(va, fmt);
-	vsnprintf(buf + strlen(buf), sizeof(buf) - strlen(buf) - 2, fmt, va);
-	buf[sizeof(buf) - 2] = '\0';
-	strcat(buf, "\n");
+	trace_store_args(tr, fmt, va);
 	va_end(va);
+	ring->tr_next++;
 
+#ifdef OPTION_TRACE_CONSOLE
+	/* Synchronous output; this is slow, but nothing gets lost */
+	char buf[TRACE_PRINTF_BUFSIZE];
+	trace_format(tr, buf, sizeof(buf) - 2);
+	strcat(buf, "\n");
+	md_interrupts_restore(state);
 	console_putstring(buf);
+#else
+	md_interrupts_restore(state);
+#endif
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(trace, "[i:count]", "Displays the most recent trace records")
+{
+	unsigned int count = TRACE_RING_SIZE;
+	if (num_args > 1)
+		count = arg[1].a_u.u_value;
+
+	/* Find the oldest record we still have, and the one we stop at, per CPU */
+	uint64_t pos[PCPU_MAX_CPUS], end[PCPU_MAX_CPUS];
+	unsigned int total = 0;
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+		end[n] = trace_ring[n].tr_next;
+		pos[n] = (end[n] > TRACE_RING_SIZE) ? end[n] - TRACE_RING_SIZE : 0;
+		total += end[n] - pos[n];
+	}
+
+	/* Merge the rings by timestamp, skipping all but the final count records */
+	unsigned int skip = (total > count) ? total - count : 0;
+	char buf[TRACE_PRINTF_BUFSIZE];
+	while(1) {
+		int cpu = -1;
+		for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+			if (pos[n] == end[n])
+				continue;
+			if (cpu < 0 || trace_ring[n].tr_record[pos[n] % TRACE_RING_SIZE].tr_timestamp < trace_ring[cpu].tr_record[pos[cpu] % TRACE_RING_SIZE].tr_timestamp)
+				cpu = n;
+		}
+		if (cpu < 0)
+			break;
+
+		const struct TRACE_RECORD* tr = &trace_ring[cpu].tr_record[pos[cpu] % TRACE_RING_SIZE];
+		pos[cpu]++;
+		if (skip > 0) {
+			skip--;
+			continue;
+		}
+		trace_format(tr, buf, sizeof(buf));
+		kprintf("cpu%d %s/%u: %s\n", cpu, trace_subsystem_name(tr->tr_subsystem), tr->tr_fileid, buf);
+	}
+}
+
+KDB_COMMAND(tracepoints, NULL, "Displays all tracepoints")
+{
+	for (unsigned int n = 0; n < trace_get_num_points(); n++) {
+		struct TRACEPOINT* tp = trace_get_point(n);
+		kprintf("%u %c %s/%x %s:%u %s\n", n, tp->tp_enabled ? '+' : '-', trace_subsystem_name(tp->tp_subsystem), tp->tp_level, tp->tp_file, tp->tp_line, tp->tp_func);
+	}
 }
+#endif
 
 /* vim:set ts=2 sw=2: */
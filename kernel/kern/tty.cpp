@@ -2,12 +2,13 @@
  * Implementation of our TTY device; this multiplexes input/output devices to a
  * single device, and handles the TTY magic.
  *
- * Actual processing of data is handled by the 'tty' kernel thread; this is done
- * because we cannot do so from interrupt context, which is typically the point
- * where data enters the TTY device. Instead of creating one thread per device,
- * we spawn a generic thread which takes care of all of them.
+ * Actual processing of data is handled by deferred work in the worker thread
+ * of the CPU that received it; this is done because we cannot do so from
+ * interrupt context, which is typically the point where data enters the TTY
+ * device. A single work item takes care of all devices.
  */
 #include <ananas/types.h>
+#include <ananas/deferred.h>
 #include <ananas/device.h>
 #include <ananas/driver.h>
 #include <ananas/error.h>
@@ -26,8 +27,62 @@ TRACE_SETUP;
 #define NL '\n'
 #define CR 0xd
 
+/* Amount of input we fetch from the input device in one go */
+#define TTY_INPUT_CHUNK 64
+
+/* Size of the buffer in which output is processed before it is written */
+#define TTY_OUTPUT_CHUNK 256
+
 namespace {
 
+/*
+ * Collects output so that it can be handed to the output device in as few
+ * writes as possible; this lives on the stack of the writer, so that
+ * concurrent writers (and panic) need no lock here.
+ */
+class OutputBuffer
+{
+public:
+	OutputBuffer(Ananas::Device* dev)
+	 : ob_dev(dev)
+	{
+	}
+
+	~OutputBuffer()
+	{
+		Flush();
+	}
+
+	void Put(const char* data, size_t len)
+	{
+		while (len > 0) {
+			size_t chunk = sizeof(ob_buf) - ob_len;
+			if (chunk > len)
+				chunk = len;
+			memcpy(&ob_buf[ob_len], data, chunk);
+			ob_len += chunk;
+			data += chunk;
+			len -= chunk;
+			if (ob_len == sizeof(ob_buf))
+				Flush();
+		}
+	}
+
+	void Flush()
+	{
+		if (ob_len == 0 || ob_dev == nullptr)
+			return;
+		size_t len = ob_len;
+		ob_dev->GetCharDeviceOperations()->Write(ob_buf, len, 0);
+		ob_len = 0;
+	}
+
+private:
+	Ananas::Device* ob_dev;
+	char ob_buf[TTY_OUTPUT_CHUNK];
+	size_t ob_len = 0;
+};
+
 class TTY : public Ananas::Device, private Ananas::IDeviceOperations, private Ananas::ICharDeviceOperations
 {
 public:
@@ -49,6 +104,7 @@ public:
 
 	errorcode_t	Write(const void* data, size_t& len, off_t offset) override;
 	errorcode_t Read(void* buf, size_t& len, off_t offset) override;
+	unsigned int GetReadyEvents() override;
 
 	/*
 	 * This is crude, but we'll need a queue for all TTY devices so that
@@ -71,8 +127,11 @@ public:
 	Ananas::Device* tty_output_dev = nullptr;
 
 private:
-	void PutChar(unsigned char ch);
-	void HandleEcho(unsigned char byte);
+	void PutOutput(OutputBuffer& ob, const char* data, size_t len);
+	void HandleEcho(OutputBuffer& ob, unsigned char byte);
+	void HandleInput(OutputBuffer& ob, unsigned char byte);
+	unsigned int GetQueuedLength() const;
+	unsigned int GetInputLength();
 
 	struct termios	tty_termios;
 	char						tty_input_queue[MAX_INPUT];
@@ -84,9 +143,8 @@ QUEUE_DEFINE_BEGIN(TTY_QUEUE, TTY)
 	spinlock_t tq_lock;
 QUEUE_DEFINE_END
 
-static thread_t tty_thread;
 static struct TTY_QUEUE tty_queue;
-static semaphore_t tty_sem;
+static struct DEFERRED_WORK tty_work;
 
 TTY::TTY(const Ananas::CreateDeviceProperties& cdp)
 	: Device(cdp)
@@ -124,12 +182,92 @@ TTY::Detach()
 	return ananas_success();
 }
 
+/*
+ * Performs output processing and queues the result; runs of characters that
+ * need no processing are copied as a whole.
+ */
+void
+TTY::PutOutput(OutputBuffer& ob, const char* data, size_t len)
+{
+	if ((tty_termios.c_oflag & (OPOST | ONLCR)) != (OPOST | ONLCR)) {
+		ob.Put(data, len);
+		return;
+	}
+
+	while (len > 0) {
+		size_t run = 0;
+		while (run < len && data[run] != NL)
+			run++;
+		ob.Put(data, run);
+		if (run == len)
+			break;
+		ob.Put("\r\n", 2);
+		data += run + 1;
+		len -= run + 1;
+	}
+}
+
 errorcode_t
 TTY::Write(const void* data, size_t& len, off_t offset)
 {
 	if (tty_output_dev == NULL)
 		return ANANAS_ERROR(NO_DEVICE);
-	return tty_output_dev->GetCharDeviceOperations()->Write(data, len, offset);
+
+	OutputBuffer ob(tty_output_dev);
+	PutOutput(ob, static_cast<const char*>(data), len);
+	return ananas_success();
+}
+
+/* Returns the number of bytes in the input queue */
+unsigned int
+TTY::GetQueuedLength() const
+{
+	return (tty_in_writepos + MAX_INPUT - tty_in_readpos) % MAX_INPUT;
+}
+
+/*
+ * Returns the number of bytes that may be read: in canonical mode, this is
+ * 0 if they do not hold a complete line yet.
+ */
+unsigned int
+TTY::GetInputLength()
+{
+	unsigned int in_len = GetQueuedLength();
+	if ((tty_termios.c_iflag & ICANON) == 0 || in_len == 0) {
+		/* Canonical input is off - everything we have is available */
+		return in_len;
+	}
+
+	/*
+	 * A line is delimited by a newline NL, end-of-file char EOF or end-of-line
+	 * EOL char. We will have to scan our input buffer for any of these.
+	 */
+
+	/* See if we can find a delimiter here */
+#define CHAR_AT(i) (tty_input_queue[(tty_in_readpos + i) % MAX_INPUT])
+	unsigned int n = 0;
+	while (n < in_len) {
+		if (CHAR_AT(n) == NL)
+			break;
+		if (tty_termios.c_cc[VEOF] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOF])
+			break;
+		if (tty_termios.c_cc[VEOL] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOL])
+			break;
+		n++;
+	}
+#undef CHAR_AT
+	return n < in_len ? in_len : 0;
+}
+
+unsigned int
+TTY::GetReadyEvents()
+{
+	unsigned int events = 0;
+	if (GetInputLength() > 0)
+		events |= HANDLE_EVENT_READ;
+	if (tty_output_dev != nullptr)
+		events |= HANDLE_EVENT_WRITE;
+	return events;
 }
 
 errorcode_t
@@ -141,58 +279,29 @@ TTY::Read(void* buf, size_t& len, off_t offset)
 	 * We must read from a tty. XXX We assume blocking does not apply.
 	 */
 	while (1) {
-		if ((tty_termios.c_iflag & ICANON) == 0) {
-			/* Canonical input is off - handle requests immediately */
-			panic("XXX implement me: icanon off!");
-		}
-
-		if (tty_in_readpos == tty_in_writepos) {
+		unsigned int in_len = GetInputLength();
+		if (in_len == 0) {
 			/*
-			 * Buffer is empty - schedule the thread for a wakeup once we have data.
-			  */
+			 * No complete line yet - schedule the thread for a wakeup once we have
+			 * more data.
+			 */
 			sem_wait(&d_Waiters);
 			continue;
 		}
 
 		/*
-		 * A line is delimited by a newline NL, end-of-file char EOF or end-of-line
-		 * EOL char. We will have to scan our input buffer for any of these.
+		 * A full line (or, in raw mode, whatever we have) is available - copy
+		 * it over; this takes at most two copies as the queue may wrap.
 		 */
-		int in_len;
-		if (tty_in_readpos < tty_in_writepos) {
-			in_len = tty_in_writepos - tty_in_readpos;
-		} else /* if (tty_in_readpos > tty_in_writepos) */ {
-			in_len = (MAX_INPUT - tty_in_writepos) + tty_in_readpos;
-		}
-
-		/* See if we can find a delimiter here */
-#define CHAR_AT(i) (tty_input_queue[(tty_in_readpos + i) % MAX_INPUT])
-		unsigned int n = 0;
-		while (n < in_len) {
-			if (CHAR_AT(n) == NL)
-				break;
-			if (tty_termios.c_cc[VEOF] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOF])
-				break;
-			if (tty_termios.c_cc[VEOL] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOL])
-				break;
-			n++;
-		}
-#undef CHAR_AT
-		if (n == in_len) {
-			/* Line is not complete - try again later */
-			sem_wait(&d_Waiters);
-			continue;
-		}
-
-		/* A full line is available - copy the data over */
-		size_t num_read = 0, num_left = len;
-		if (num_left > in_len)
-			num_left = in_len;
-		while (num_left > 0) {
-			data[num_read] = tty_input_queue[tty_in_readpos];
-			tty_in_readpos = (tty_in_readpos + 1) % MAX_INPUT;
-			num_read++; num_left--;
-		}
+		size_t num_read = len;
+		if (num_read > in_len)
+			num_read = in_len;
+		size_t first = MAX_INPUT - tty_in_readpos;
+		if (first > num_read)
+			first = num_read;
+		memcpy(data, &tty_input_queue[tty_in_readpos], first);
+		memcpy(data + first, &tty_input_queue[0], num_read - first);
+		tty_in_readpos = (tty_in_readpos + num_read) % MAX_INPUT;
 		len = num_read;
 		return ananas_success();
 	}
@@ -201,35 +310,55 @@ TTY::Read(void* buf, size_t& len, off_t offset)
 }
 
 void
-TTY::PutChar(unsigned char ch)
-{
-	size_t len = 1;
-	if (tty_termios.c_oflag & OPOST) {
-		if ((tty_termios.c_oflag & ONLCR) && ch == NL) {
-			tty_output_dev->GetCharDeviceOperations()->Write("\r", len, 0);
-			len = 1;
-		}
-	}
-
-	tty_output_dev->GetCharDeviceOperations()->Write((const char*)&ch, len, 0);
-}
-
-void
-TTY::HandleEcho(unsigned char byte)
+TTY::HandleEcho(OutputBuffer& ob, unsigned char byte)
 {
 	if ((tty_termios.c_iflag & ICANON) && (tty_termios.c_oflag & ECHOE) && byte == tty_termios.c_cc[VERASE]) {
 		/* Need to echo erase char */
 		char erase_seq[] = { 8, ' ', 8 };
-		size_t erase_len = sizeof(erase_seq);
-		tty_output_dev->GetCharDeviceOperations()->Write(erase_seq, erase_len, 0);
+		ob.Put(erase_seq, sizeof(erase_seq));
 		return;
 	}
 	if ((tty_termios.c_lflag & (ICANON | ECHONL)) && byte == NL) {
-		PutChar(byte);
+		PutOutput(ob, (const char*)&byte, 1);
 		return;
 	}
 	if (tty_termios.c_lflag & ECHO)
-		PutChar(byte);
+		PutOutput(ob, (const char*)&byte, 1);
+}
+
+void
+TTY::HandleInput(OutputBuffer& ob, unsigned char byte)
+{
+	/* If we are out of buffer space, just eat the charachter XXX possibly unnecessary for VERASE */
+	if ((tty_in_writepos + 1) % MAX_INPUT == tty_in_readpos)
+		return;
+
+	/* Handle CR/NL transformations */
+	if ((tty_termios.c_iflag & INLCR) && byte == NL)
+		byte = CR;
+	else if ((tty_termios.c_iflag & IGNCR) && byte == CR)
+		return;
+	else if ((tty_termios.c_iflag & ICRNL) && byte == CR)
+		byte = NL;
+
+	/* Handle backspace */
+	if ((tty_termios.c_iflag & ICANON) && byte == tty_termios.c_cc[VERASE]) {
+		if (tty_in_readpos != tty_in_writepos) {
+			/* Still a charachter available which wasn't read. Nuke it */
+			if (tty_in_writepos > 0)
+				tty_in_writepos--;
+			else
+				tty_in_writepos = MAX_INPUT - 1;
+		}
+	} else {
+		/* Store the charachter! */
+		tty_input_queue[tty_in_writepos] = byte;
+		tty_in_writepos = (tty_in_writepos + 1) % MAX_INPUT;
+	}
+
+	/* Handle writing the charachter, if needed (and we can do so) */
+	if (tty_output_dev != NULL)
+		HandleEcho(ob, byte);
 }
 
 void
@@ -237,66 +366,37 @@ TTY::ProcessInput()
 {
 	/*
 	 * This will be called once data is available from our input device; we need
-	 * to queue it up.
+	 * to queue it up. Input is fetched in chunks, and all echoes it causes are
+	 * written in one go.
 	 */
+	KASSERT(tty_input_dev != NULL, "woke up without input device?");
+	OutputBuffer ob(tty_output_dev);
 	while (1) {
-		KASSERT(tty_input_dev != NULL, "woke up without input device?");
-
-		unsigned char byte;
-		size_t len = sizeof(byte);
-		errorcode_t err = tty_input_dev->GetCharDeviceOperations()->Read(static_cast<void*>(&byte), len, 0);
+		unsigned char input[TTY_INPUT_CHUNK];
+		size_t len = sizeof(input);
+		errorcode_t err = tty_input_dev->GetCharDeviceOperations()->Read(static_cast<void*>(input), len, 0);
 		if (ananas_is_failure(err) || len == 0)
 			break;
 
-		/* If we are out of buffer space, just eat the charachter XXX possibly unnecessary for VERASE */
-		if ((tty_in_writepos + 1) % MAX_INPUT == tty_in_readpos)
-			continue;
-
-		/* Handle CR/NL transformations */
-		if ((tty_termios.c_iflag & INLCR) && byte == NL)
-			byte = CR;
-		else if ((tty_termios.c_iflag & IGNCR) && byte == CR)
-			continue;
-		else if ((tty_termios.c_iflag & ICRNL) && byte == CR)
-			byte = NL;
-
-		/* Handle backspace */
-		if ((tty_termios.c_iflag & ICANON) && byte == tty_termios.c_cc[VERASE]) {
-			if (tty_in_readpos != tty_in_writepos) {
-				/* Still a charachter available which wasn't read. Nuke it */
-				if (tty_in_writepos > 0)
-					tty_in_writepos--;
-				else
-					tty_in_writepos = MAX_INPUT - 1;
-			}
-		} else {
-			/* Store the charachter! */
-			tty_input_queue[tty_in_writepos] = byte;
-			tty_in_writepos = (tty_in_writepos + 1) % MAX_INPUT;
-		}
-
-		/* Handle writing the charachter, if needed (and we can do so) */
-		if (tty_output_dev != NULL)
-			HandleEcho(byte);
+		for (size_t n = 0; n < len; n++)
+			HandleInput(ob, input[n]);
 	}
+	ob.Flush();
 
 	/* If we have waiters, awaken them */
 	sem_signal(&d_Waiters);
+	event_source_notify(&d_Events, HANDLE_EVENT_READ);
 }
 
 static void
-tty_thread_func(void* ptr)
+tty_process_input(void* context)
 {
-	while(1) {
-		sem_wait(&tty_sem);
-
-		spinlock_lock(&tty_queue.tq_lock);
-		KASSERT(!QUEUE_EMPTY(&tty_queue), "woken up without tty's?");
-		QUEUE_FOREACH(&tty_queue, tty, TTY) {
-			tty->ProcessInput();
-		}
-		spinlock_unlock(&tty_queue.tq_lock);
+	spinlock_lock(&tty_queue.tq_lock);
+	KASSERT(!QUEUE_EMPTY(&tty_queue), "woken up without tty's?");
+	QUEUE_FOREACH(&tty_queue, tty, TTY) {
+		tty->ProcessInput();
 	}
+	spinlock_unlock(&tty_queue.tq_lock);
 }
 
 struct TTY_Driver : public Ananas::Driver
@@ -351,7 +451,7 @@ tty_get_outputdev(Ananas::Device* dev)
 void
 tty_signal_data()
 {
-	sem_signal(&tty_sem);
+	deferred_queue(&tty_work);
 }
 
 static errorcode_t
@@ -360,21 +460,10 @@ tty_preinit()
 	/* Initialize the queue of all tty's */
 	QUEUE_INIT(&tty_queue);
 	spinlock_init(&tty_queue.tq_lock);
-	sem_init(&tty_sem, 0);
+	deferred_init(&tty_work, tty_process_input, NULL, DEFERRED_FLAG_THREAD);
 	return ananas_success();
 }
 
 INIT_FUNCTION(tty_preinit, SUBSYSTEM_CONSOLE, ORDER_SECOND);
 
-static errorcode_t
-tty_init()
-{
-	/* Launch our kernel thread */
-	kthread_init(&tty_thread, "tty", tty_thread_func, NULL);
-	thread_resume(&tty_thread);
-	return ananas_success();
-}
-
-INIT_FUNCTION(tty_init, SUBSYSTEM_TTY, ORDER_ANY);
-
 /* vim:set ts=2 sw=2: */
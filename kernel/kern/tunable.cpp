@@ -0,0 +1,117 @@
+/*
+ * Registry of runtime tunables; see <ananas/tunable.h>. Tunables are only
+ * registered during initialization, so the list needs no locking; changes
+ * are serialized so that notify functions never run concurrently.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/trace.h>
+#include <ananas/tunable.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+LIST_DEFINE(TUNABLES, struct TUNABLE);
+
+namespace {
+
+struct TUNABLES tunable_list;
+mutex_t tunable_mtx;
+
+} // unnamed namespace
+
+errorcode_t
+tunable_register(struct TUNABLE* t)
+{
+	KASSERT(t->t_min <= t->t_max, "tunable '%s' has no valid values", t->t_name);
+	LIST_APPEND(&tunable_list, t);
+	return ananas_success();
+}
+
+struct TUNABLE*
+tunable_get(unsigned int n)
+{
+	LIST_FOREACH(&tunable_list, t, struct TUNABLE) {
+		if (n-- == 0)
+			return t;
+	}
+	return nullptr;
+}
+
+struct TUNABLE*
+tunable_find(const char* name)
+{
+	LIST_FOREACH(&tunable_list, t, struct TUNABLE) {
+		if (strcmp(t->t_name, name) == 0)
+			return t;
+	}
+	return nullptr;
+}
+
+errorcode_t
+tunable_set(struct TUNABLE* t, const char* value)
+{
+	char* ptr;
+	unsigned long v = strtoul(value, &ptr, 0);
+	if (ptr == value || (*ptr != '\0' && *ptr != '\n'))
+		return ANANAS_ERROR(BAD_RANGE);
+	if (v < t->t_min || v > t->t_max)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	mutex_lock(&tunable_mtx);
+	switch(t->t_type) {
+		case TUNABLE_TYPE_UINT:
+			__atomic_store_n(t->t_value.u_uint, static_cast<unsigned int>(v), __ATOMIC_RELAXED);
+			break;
+		case TUNABLE_TYPE_BOOL:
+			__atomic_store_n(t->t_value.u_bool, v != 0, __ATOMIC_RELAXED);
+			break;
+	}
+	if (t->t_notify != nullptr)
+		t->t_notify(t);
+	mutex_unlock(&tunable_mtx);
+	TRACE(MACHDEP, INFO, "tunable '%s' set to %u", t->t_name, (unsigned int)v);
+	return ananas_success();
+}
+
+void
+tunable_format(struct TUNABLE* t, char* buf, size_t len)
+{
+	switch(t->t_type) {
+		case TUNABLE_TYPE_UINT:
+			snprintf(buf, len, "%u\n", *t->t_value.u_uint);
+			break;
+		case TUNABLE_TYPE_BOOL:
+			snprintf(buf, len, "%u\n", *t->t_value.u_bool ? 1 : 0);
+			break;
+	}
+}
+
+static errorcode_t
+tunable_init()
+{
+	mutex_init(&tunable_mtx, "tunable");
+	return ananas_success();
+}
+
+INIT_FUNCTION(tunable_init, SUBSYSTEM_KDB, ORDER_FIRST);
+
+#ifdef OPTION_KDB
+KDB_COMMAND(tunables, NULL, "Display tunables")
+{
+	LIST_FOREACH(&tunable_list, t, struct TUNABLE) {
+		char value[16];
+		tunable_format(t, value, sizeof(value));
+		kprintf("%s = %s", t->t_name, value);
+		if (t->t_type == TUNABLE_TYPE_UINT)
+			kprintf("  %s (%u .. %u)\n", t->t_help, t->t_min, t->t_max);
+		else
+			kprintf("  %s\n", t->t_help);
+	}
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
@@ -1,4 +1,5 @@
 #include "options.h"
+#include <ananas/console.h>
 #include <ananas/lib.h>
 #include <ananas/schedule.h>
 #include <ananas/kdb.h>
@@ -40,6 +41,9 @@ _panic(const char* file, const char* func, int line, const char* fmt, ...)
 	/* disable the scheduler - this ensures any extra BSP's will not run threads either */
 	scheduler_deactivate();
 
+	/* Nobody will be draining the console queue anymore */
+	console_enter_synchronous();
+
 	kprintf("panic in %s:%u (%s): ", file, line, func);
 
 	va_start(ap, fmt);
@@ -0,0 +1,75 @@
+#include <ananas/types.h>
+#include <ananas/lib.h>
+
+/*
+ * Copying and clearing of whole pages. As these are always aligned and a
+ * multiple of 64 bytes, we can skip all of memcpy()'s alignment handling and
+ * do an entire cache line per iteration.
+ *
+ * With PAGEMEM_NONTEMPORAL, the stores bypass the cache (using 'movnti', which
+ * works on general purpose registers so we need not touch the FPU state);
+ * this is what you want if the memory will not be used any time soon, as it
+ * keeps the caches filled with things that are.
+ */
+
+#ifdef __amd64__
+static inline void
+store_nt(uint64_t* p, uint64_t v)
+{
+	__asm __volatile("movnti %1, %0" : "=m" (*p) : "r" (v));
+}
+#endif
+
+void
+memcpy_pages(void* dst, const void* src, size_t len, int flags)
+{
+	auto d = static_cast<uint64_t*>(dst);
+	auto s = static_cast<const uint64_t*>(src);
+	KASSERT(((addr_t)d & 63) == 0 && ((addr_t)s & 63) == 0 && (len & 63) == 0, "unaligned page copy");
+
+#ifdef __amd64__
+	if (flags & PAGEMEM_NONTEMPORAL) {
+		for (/* nothing */; len > 0; len -= 64, d += 8, s += 8) {
+			uint64_t a = s[0], b = s[1], c = s[2], e = s[3];
+			store_nt(&d[0], a); store_nt(&d[1], b); store_nt(&d[2], c); store_nt(&d[3], e);
+			a = s[4]; b = s[5]; c = s[6]; e = s[7];
+			store_nt(&d[4], a); store_nt(&d[5], b); store_nt(&d[6], c); store_nt(&d[7], e);
+		}
+		/* Non-temporal stores are weakly ordered; make them visible before we return */
+		__asm __volatile("sfence" : : : "memory");
+		return;
+	}
+#endif
+
+	for (/* nothing */; len > 0; len -= 64, d += 8, s += 8) {
+		uint64_t a = s[0], b = s[1], c = s[2], e = s[3];
+		d[0] = a; d[1] = b; d[2] = c; d[3] = e;
+		a = s[4]; b = s[5]; c = s[6]; e = s[7];
+		d[4] = a; d[5] = b; d[6] = c; d[7] = e;
+	}
+}
+
+void
+memzero_pages(void* dst, size_t len, int flags)
+{
+	auto d = static_cast<uint64_t*>(dst);
+	KASSERT(((addr_t)d & 63) == 0 && (len & 63) == 0, "unaligned page clear");
+
+#ifdef __amd64__
+	if (flags & PAGEMEM_NONTEMPORAL) {
+		for (/* nothing */; len > 0; len -= 64, d += 8) {
+			store_nt(&d[0], 0); store_nt(&d[1], 0); store_nt(&d[2], 0); store_nt(&d[3], 0);
+			store_nt(&d[4], 0); store_nt(&d[5], 0); store_nt(&d[6], 0); store_nt(&d[7], 0);
+		}
+		__asm __volatile("sfence" : : : "memory");
+		return;
+	}
+#endif
+
+	for (/* nothing */; len > 0; len -= 64, d += 8) {
+		d[0] = 0; d[1] = 0; d[2] = 0; d[3] = 0;
+		d[4] = 0; d[5] = 0; d[6] = 0; d[7] = 0;
+	}
+}
+
+/* vim:set ts=2 sw=2: */
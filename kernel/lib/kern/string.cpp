@@ -1,6 +1,24 @@
+#include <ananas/types.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 
+/*
+ * Most routines here work a word at a time: an aligned word never crosses a
+ * page boundary, so we can safely read past the terminating nul byte as long
+ * as we never read a word that starts beyond it.
+ */
+typedef unsigned long word_t __attribute__((__may_alias__));
+#define WORD_ONES	((word_t)-1 / 0xff)	/* 0x0101...01 */
+#define WORD_HIGHS	(WORD_ONES * 0x80)	/* 0x8080...80 */
+#define WORD_ALIGNED(p) (((addr_t)(p) & (sizeof(word_t) - 1)) == 0)
+
+/* Non-zero if any byte of w is zero */
+static inline word_t
+word_has_zero(word_t w)
+{
+	return (w - WORD_ONES) & ~w & WORD_HIGHS;
+}
+
 char*
 strcpy(char* dst, const char* src)
 {
@@ -16,10 +34,25 @@ strcpy(char* dst, const char* src)
 int
 strcmp(const char* s1, const char* s2)
 {
-	while (*s1 != '\0' && *s2 != '\0' && *s1 == *s2) {
+	/* If both strings are equally aligned, we can compare words once we've aligned them */
+	if ((((addr_t)s1 ^ (addr_t)s2) & (sizeof(word_t) - 1)) == 0) {
+		for (/* nothing */; !WORD_ALIGNED(s1); s1++, s2++)
+			if (*s1 == '\0' || *s1 != *s2)
+				return (unsigned char)*s1 - (unsigned char)*s2;
+		auto w1 = reinterpret_cast<const word_t*>(s1);
+		auto w2 = reinterpret_cast<const word_t*>(s2);
+		while (*w1 == *w2 && !word_has_zero(*w1)) {
+			w1++; w2++;
+		}
+		/* The difference or the end is within this word; let the byte loop find it */
+		s1 = reinterpret_cast<const char*>(w1);
+		s2 = reinterpret_cast<const char*>(w2);
+	}
+
+	while (*s1 != '\0' && *s1 == *s2) {
 		s1++; s2++;
 	}
-	return *s1 - *s2;
+	return (unsigned char)*s1 - (unsigned char)*s2;
 }
 
 int
@@ -34,23 +67,35 @@ strncmp(const char* s1, const char* s2, size_t n)
 char*
 strchr(const char* s, int c)
 {
-	while(1) {
-		if (*s == c)
+	c = (unsigned char)c;
+	for (/* nothing */; !WORD_ALIGNED(s); s++) {
+		if ((unsigned char)*s == c)
 			return (char*)s;
 		if (*s == '\0')
-			break;
-		s++;
+			return NULL;
+	}
+
+	/* Skip words that contain neither c nor the end of the string */
+	word_t mask = WORD_ONES * c;
+	auto w = reinterpret_cast<const word_t*>(s);
+	while (!word_has_zero(*w) && !word_has_zero(*w ^ mask))
+		w++;
+
+	for (s = reinterpret_cast<const char*>(w); /* nothing */; s++) {
+		if ((unsigned char)*s == c)
+			return (char*)s;
+		if (*s == '\0')
+			return NULL;
 	}
-	return NULL;
 }
 
 char*
 strrchr(const char* s, int c)
 {
-	char* ptr = (char*)(s + strlen(s) - 1);
+	const char* ptr = s + strlen(s) - 1;
 	while (ptr >= s) {
 		if (*ptr == c)
-			return (char*)s;
+			return (char*)ptr;
 		ptr--;
 	}
 	return NULL;
@@ -59,17 +104,30 @@ strrchr(const char* s, int c)
 size_t
 strlen(const char* s)
 {
-	size_t len = 0;
-
-	for (; *s != '\0'; s++, len++);
-	return len;
+	const char* p = s;
+	for (/* nothing */; !WORD_ALIGNED(p); p++)
+		if (*p == '\0')
+			return p - s;
+
+	auto w = reinterpret_cast<const word_t*>(p);
+	while (!word_has_zero(*w))
+		w++;
+
+	for (p = reinterpret_cast<const char*>(w); *p != '\0'; p++)
+		/* nothing */ ;
+	return p - s;
 }
 
 int
 memcmp(const void* s1, const void* s2, size_t len)
 {
-	auto c1 = static_cast<const char*>(s1);
-	auto c2 = static_cast<const char*>(s2);
+	auto c1 = static_cast<const unsigned char*>(s1);
+	auto c2 = static_cast<const unsigned char*>(s2);
+
+	/* Skip all equal words; we need never read beyond len, so alignment does not matter here */
+	while (len >= sizeof(word_t) && *(const word_t*)c1 == *(const word_t*)c2) {
+		len -= sizeof(word_t); c1 += sizeof(word_t); c2 += sizeof(word_t);
+	}
 
 	while (len > 0 && *c1 == *c2) {
 		len--; c1++; c2++;
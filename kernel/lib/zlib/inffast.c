@@ -29,6 +29,58 @@
 #  define PUP(a) *++(a)
 #endif
 
+/*
+   On x86-64, the bit accumulator is refilled using a single unaligned 64-bit
+   load where enough input is available, and matches which do not overlap
+   within a word are copied eight bytes at a time.  Both only use integer
+   registers: the kernel does not preserve vector state for its own use.
+
+   A wide refill leaves the bytes it did not account for above 'bits' in
+   'hold'; these are the next input bytes, so the byte-wise refills below or
+   them in (rather than adding), which is harmless if they are already there.
+ */
+#if defined(__x86_64__)
+#  define INFLATE_FAST_WIDE
+
+static __inline__ unsigned long inflate_load64(const unsigned char FAR *p)
+{
+    unsigned long v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static __inline__ void inflate_copy64(unsigned char FAR *dst,
+                                      const unsigned char FAR *src)
+{
+    unsigned long v;
+    __builtin_memcpy(&v, src, sizeof(v));
+    __builtin_memcpy(dst, &v, sizeof(v));
+}
+
+#  define REFILL() \
+    do { \
+        if (in < lastwide) { \
+            hold |= inflate_load64(in + OFF) << bits; \
+            in += (63 - bits) >> 3; \
+            bits |= 56; \
+        } \
+        else { \
+            hold |= (unsigned long)(PUP(in)) << bits; \
+            bits += 8; \
+            hold |= (unsigned long)(PUP(in)) << bits; \
+            bits += 8; \
+        } \
+    } while (0)
+#else
+#  define REFILL() \
+    do { \
+        hold |= (unsigned long)(PUP(in)) << bits; \
+        bits += 8; \
+        hold |= (unsigned long)(PUP(in)) << bits; \
+        bits += 8; \
+    } while (0)
+#endif
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -93,6 +145,10 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     unsigned len;               /* match length, unused bytes */
     unsigned dist;              /* match distance */
     unsigned char FAR *from;    /* where to copy match from */
+#ifdef INFLATE_FAST_WIDE
+    unsigned char FAR *lastwide; /* while in < lastwide, 8 bytes can be loaded */
+    unsigned char FAR *limit;   /* end of the output space */
+#endif
 
     /* copy state to local variables */
     state = (struct inflate_state FAR *)strm->state;
@@ -101,6 +157,10 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     out = strm->next_out - OFF;
     beg = out - (start - strm->avail_out);
     end = out + (strm->avail_out - 257);
+#ifdef INFLATE_FAST_WIDE
+    lastwide = in + (strm->avail_in >= 8 ? strm->avail_in - 7 : 0);
+    limit = out + strm->avail_out;
+#endif
 #ifdef INFLATE_STRICT
     dmax = state->dmax;
 #endif
@@ -118,12 +178,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     /* decode literals and length/distances until end-of-block or not enough
        input data or output space */
     do {
-        if (bits < 15) {
-            hold += (unsigned long)(PUP(in)) << bits;
-            bits += 8;
-            hold += (unsigned long)(PUP(in)) << bits;
-            bits += 8;
-        }
+        if (bits < 15)
+            REFILL();
         here = lcode[hold & lmask];
       dolen:
         op = (unsigned)(here.bits);
@@ -141,7 +197,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
             op &= 15;                           /* number of extra bits */
             if (op) {
                 if (bits < op) {
-                    hold += (unsigned long)(PUP(in)) << bits;
+                    hold |= (unsigned long)(PUP(in)) << bits;
                     bits += 8;
                 }
                 len += (unsigned)hold & ((1U << op) - 1);
@@ -149,12 +205,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 bits -= op;
             }
             Tracevv((stderr, "inflate:         length %u\n", len));
-            if (bits < 15) {
-                hold += (unsigned long)(PUP(in)) << bits;
-                bits += 8;
-                hold += (unsigned long)(PUP(in)) << bits;
-                bits += 8;
-            }
+            if (bits < 15)
+                REFILL();
             here = dcode[hold & dmask];
           dodist:
             op = (unsigned)(here.bits);
@@ -165,10 +217,10 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 dist = (unsigned)(here.val);
                 op &= 15;                       /* number of extra bits */
                 if (bits < op) {
-                    hold += (unsigned long)(PUP(in)) << bits;
+                    hold |= (unsigned long)(PUP(in)) << bits;
                     bits += 8;
                     if (bits < op) {
-                        hold += (unsigned long)(PUP(in)) << bits;
+                        hold |= (unsigned long)(PUP(in)) << bits;
                         bits += 8;
                     }
                 }
@@ -218,9 +270,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         from += wsize - op;
                         if (op < len) {         /* some from window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out + OFF, from + OFF, op);
+                            out += op;
                             from = out - dist;  /* rest from output */
                         }
                     }
@@ -229,16 +280,14 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         op -= wnext;
                         if (op < len) {         /* some from end of window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out + OFF, from + OFF, op);
+                            out += op;
                             from = window - OFF;
                             if (wnext < len) {  /* some from start of window */
                                 op = wnext;
                                 len -= op;
-                                do {
-                                    PUP(out) = PUP(from);
-                                } while (--op);
+                                zmemcpy(out + OFF, from + OFF, op);
+                                out += op;
                                 from = out - dist;      /* rest from output */
                             }
                         }
@@ -247,9 +296,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         from += wnext - op;
                         if (op < len) {         /* some from window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out + OFF, from + OFF, op);
+                            out += op;
                             from = out - dist;  /* rest from output */
                         }
                     }
@@ -267,6 +315,21 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+#ifdef INFLATE_FAST_WIDE
+                    if (dist >= 8 && (unsigned)(limit - out) >= len + 8) {
+                        /* a word never overlaps what it is copied from;
+                           the final one may run past len, which is fine
+                           as there is room and it is overwritten later */
+                        unsigned char FAR *stop = out + len;
+                        do {
+                            inflate_copy64(out + OFF, from + OFF);
+                            out += 8;
+                            from += 8;
+                        } while (out < stop);
+                        out = stop;
+                        continue;
+                    }
+#endif
                     do {                        /* minimum length is three */
                         PUP(out) = PUP(from);
                         PUP(out) = PUP(from);
@@ -15,6 +15,7 @@ sys_close(thread_t* t, handleindex_t hindex)
 	errorcode_t err = syscall_get_handle(t, hindex, &h);
 	ANANAS_ERROR_RETURN(err);
 	err = handle_free(h);
+	handle_deref(h);
 	ANANAS_ERROR_RETURN(err);
 
 	TRACE(SYSCALL, INFO, "t=%p, success", t);
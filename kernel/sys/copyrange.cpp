@@ -0,0 +1,114 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+
+TRACE_SETUP;
+
+/* Looks up a file handle; the reference must be released using handle_deref() */
+static errorcode_t
+sys_copyrange_get_file(thread_t* t, handleindex_t hindex, struct HANDLE** out)
+{
+	struct HANDLE* h;
+	errorcode_t err = handle_lookup(t->t_process, hindex, HANDLE_TYPE_FILE, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	struct VFS_FILE* file = &h->h_data.d_vfs_file;
+	if (file->f_dentry == NULL && file->f_device == NULL) {
+		handle_deref(h);
+		return ANANAS_ERROR(BAD_HANDLE);
+	}
+
+	*out = h;
+	return ananas_success();
+}
+
+/*
+ * Positions file at the offset given by the user, if any; the current offset
+ * is stored in saved_offset so that it can be restored afterwards.
+ */
+static errorcode_t
+sys_copyrange_seek(thread_t* t, struct VFS_FILE* file, const off_t* offset, off_t* saved_offset)
+{
+	*saved_offset = file->f_offset;
+	if (offset == NULL)
+		return ananas_success();
+
+	off_t pos;
+	errorcode_t err = syscall_fetch_offset(t, offset, &pos);
+	ANANAS_ERROR_RETURN(err);
+	return vfs_seek(file, pos);
+}
+
+static errorcode_t
+sys_copyrange_files(thread_t* t, struct VFS_FILE* fin, off_t* in_offset, struct VFS_FILE* fout, off_t* out_offset, size_t* len)
+{
+	errorcode_t err;
+	if (fin == fout)
+		return ANANAS_ERROR(BAD_OPERATION); /* both would share a single position */
+
+	/* Fetch the size operand */
+	size_t size;
+	err = syscall_fetch_size(t, len, &size);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Go to the requested offsets, if any */
+	off_t saved_in, saved_out;
+	err = sys_copyrange_seek(t, fin, in_offset, &saved_in);
+	ANANAS_ERROR_RETURN(err);
+	err = sys_copyrange_seek(t, fout, out_offset, &saved_out);
+	if (ananas_is_failure(err)) {
+		fin->f_offset = saved_in;
+		return err;
+	}
+
+	err = vfs_copy(fin, fout, &size);
+
+	/* Report the new offsets to the user instead of moving the files */
+	if (ananas_is_success(err) && in_offset != NULL)
+		err = syscall_set_offset(t, in_offset, fin->f_offset);
+	if (ananas_is_success(err) && out_offset != NULL)
+		err = syscall_set_offset(t, out_offset, fout->f_offset);
+	if (in_offset != NULL)
+		fin->f_offset = saved_in;
+	if (out_offset != NULL)
+		fout->f_offset = saved_out;
+	ANANAS_ERROR_RETURN(err);
+
+	/* Finally, inform the user of the length copied */
+	err = syscall_set_size(t, len, size);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, size);
+	return err;
+}
+
+/*
+ * Copies data from one file to another within the kernel; offsets which are
+ * given are used and updated instead of the file positions.
+ */
+errorcode_t
+sys_copyrange(thread_t* t, handleindex_t in, off_t* in_offset, handleindex_t out, off_t* out_offset, size_t* len)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, in=%u, in_offset=%p, out=%u, out_offset=%p, len=%p", t, in, in_offset, out, out_offset, len);
+	errorcode_t err;
+
+	/* Get both files */
+	struct HANDLE* hin;
+	err = sys_copyrange_get_file(t, in, &hin);
+	ANANAS_ERROR_RETURN(err);
+	struct HANDLE* hout;
+	err = sys_copyrange_get_file(t, out, &hout);
+	if (ananas_is_failure(err)) {
+		handle_deref(hin);
+		return err;
+	}
+
+	err = sys_copyrange_files(t, &hin->h_data.d_vfs_file, in_offset, &hout->h_data.d_vfs_file, out_offset, len);
+	handle_deref(hout);
+	handle_deref(hin);
+	return err;
+}
+
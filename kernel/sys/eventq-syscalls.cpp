@@ -0,0 +1,84 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/eventq.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/trace.h>
+#include <ananas/usercopy.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+/* Maximum number of events returned by a single evq_wait() */
+#define EVQ_WAIT_MAX	256
+
+errorcode_t
+sys_evq_create(thread_t* t, handleindex_t* out)
+{
+	TRACE(SYSCALL, FUNC, "t=%p", t);
+
+	handleindex_t index;
+	errorcode_t err = eventq_alloc(t->t_process, &index);
+	ANANAS_ERROR_RETURN(err);
+
+	return syscall_set_handleindex(t, out, index);
+}
+
+errorcode_t
+sys_evq_ctl(thread_t* t, handleindex_t index, int op, handleindex_t hindex, const struct HANDLE_EVENT* ev)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, index=%d, op=%d, hindex=%d", t, index, op, hindex);
+	errorcode_t err;
+
+	struct HANDLE* queue;
+	err = syscall_get_handle(t, index, &queue);
+	ANANAS_ERROR_RETURN(err);
+
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	if (ananas_is_failure(err)) {
+		handle_deref(queue);
+		return err;
+	}
+
+	/* The event isn't needed to delete */
+	struct HANDLE_EVENT kev;
+	if (op != EVQ_CTL_DELETE)
+		err = copyin(&kev, ev, sizeof(kev));
+	if (ananas_is_success(err))
+		err = eventq_control(queue, op, h, hindex, (op != EVQ_CTL_DELETE) ? &kev : NULL);
+
+	handle_deref(h);
+	handle_deref(queue);
+	return err;
+}
+
+errorcode_t
+sys_evq_wait(thread_t* t, handleindex_t index, struct HANDLE_EVENT* events, int* count, int timeout)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, index=%d, events=%p, timeout=%d", t, index, events, timeout);
+	errorcode_t err;
+
+	int num;
+	err = copyin(&num, count, sizeof(num));
+	ANANAS_ERROR_RETURN(err);
+	if (num <= 0 || num > EVQ_WAIT_MAX)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	struct HANDLE_EVENT* kevents;
+	err = syscall_map_buffer(t, events, num * sizeof(*kevents), VM_FLAG_WRITE, (void**)&kevents);
+	ANANAS_ERROR_RETURN(err);
+
+	struct HANDLE* queue;
+	err = syscall_get_handle(t, index, &queue);
+	ANANAS_ERROR_RETURN(err);
+
+	err = eventq_wait(queue, kevents, &num, timeout);
+	handle_deref(queue);
+	ANANAS_ERROR_RETURN(err);
+
+	return copyout(count, &num, sizeof(num));
+}
+
+/* vim:set ts=2 sw=2: */
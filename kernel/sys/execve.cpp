@@ -4,6 +4,7 @@
 #include <ananas/lib.h>
 #include <ananas/process.h>
 #include <ananas/procinfo.h>
+#include <ananas/syscall-ring.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
 #include <ananas/vfs.h>
@@ -12,41 +13,6 @@
 
 TRACE_SETUP;
 
-enum SET_PROC_ATTR {
-	A_Args,
-	A_Env
-};
-
-static errorcode_t
-set_proc_attribute(process_t* process, enum SET_PROC_ATTR attr, const char** list)
-{
-	char buf[PROCINFO_ENV_LENGTH];
-
-	/* Convert list to a \0-separated string, \0\0-terminated */
-	int arg_len = 2; /* \0\0-terminator */
-	for (const char** p = list; *p != NULL; p++) {
-		arg_len += strlen(*p) + 1; /* \0 */
-	}
-	KASSERT(arg_len < sizeof(buf), "buffer too large (calculated %d, have %d)", arg_len, sizeof(buf));
-
-	/* Copy the items over */
-	int pos = 0;
-	memset(buf, 0, sizeof(buf));
-	for (const char** p = list; *p != NULL; p++) {
-		strcpy(&buf[pos], *p);
-		pos += strlen(*p) + 1;
-	}
-
-	switch(attr) {
-		case A_Args:
-			return process_set_args(process, buf, pos);
-		case A_Env:
-			return process_set_environment(process, buf, pos);
-		default:
-			panic("unexpected attribute %d", attr);
-	}
-}
-
 errorcode_t
 sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 {
@@ -69,14 +35,14 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 	/* XXX Do we inherit correctly here? */
 	vmspace_t* vmspace = NULL;
 	if (argv != NULL) {
-		err = set_proc_attribute(proc, A_Args, argv);
+		err = exec_set_args(proc, argv);
 		if (ananas_is_failure(err)) {
 			dentry_deref(dentry);
 			goto fail;
 		}
 	}
 	if (envp != NULL) {
-		err = set_proc_attribute(proc, A_Env, envp);
+		err = exec_set_environment(proc, envp);
 		if (ananas_is_failure(err)) {
 			dentry_deref(dentry);
 			goto fail;
@@ -99,7 +65,7 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 	 * exec_load() manages that all by itself.
 	 */
 	addr_t exec_addr;
-	err = exec_load(vmspace, dentry, &exec_addr);
+	err = exec_load(vmspace, dentry, &exec_addr, proc->p_info);
 	dentry_deref(dentry);
 	if (ananas_is_failure(err))
 		goto fail;
@@ -111,10 +77,14 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 	if (argv != NULL && argv[0] != NULL)
 		thread_set_name(t, argv[0]);
 
+	/* Any ring must be gone before the memory it uses is replaced */
+	syscall_ring_stop(proc, true);
+
 	/* Copy the new vmspace to the destination */
 	err = vmspace_clone(vmspace, proc->p_vmspace, VMSPACE_CLONE_EXEC);
 	KASSERT(ananas_is_success(err), "unable to clone exec vmspace: %d", err);
 	vmspace_destroy(vmspace);
+	exec_prefault(proc->p_vmspace);
 
 	/* Now force a full return into the new thread state */
 	md_setup_post_exec(t, exec_addr);
@@ -16,15 +16,13 @@ sys_fchdir(thread_t* t, handleindex_t index)
 
 	/* Get the handle */
 	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, index, &h);
+	errorcode_t err = handle_lookup(proc, index, HANDLE_TYPE_FILE, &h);
 	ANANAS_ERROR_RETURN(err);
 
-	if (h->h_type != HANDLE_TYPE_FILE)
-		return ANANAS_ERROR(BAD_HANDLE);
-
         struct VFS_FILE* file = &h->h_data.d_vfs_file;
 	struct DENTRY* new_cwd = file->f_dentry;
 	dentry_ref(new_cwd);
+	handle_deref(h);
 	proc->p_cwd = new_cwd;
 	dentry_deref(cwd);
 
@@ -16,20 +16,17 @@ sys_fcntl(thread_t* t, handleindex_t hindex, int cmd, const void* in, void* out)
 
 	/* Get the handle */
 	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, hindex, &h);
+	errorcode_t err = handle_lookup(process, hindex, HANDLE_TYPE_FILE, &h);
 	ANANAS_ERROR_RETURN(err);
 
-	if (h->h_type != HANDLE_TYPE_FILE)
-		return ANANAS_ERROR(BAD_HANDLE);
-
 	switch(cmd) {
 		case F_DUPFD: {
 			int min_fd = (int)(uintptr_t)out;
 			struct HANDLE* handle_out;
 			handleindex_t hidx_out;
 			err = handle_clone(process, hindex, NULL, process, &handle_out, min_fd, &hidx_out);
-			ANANAS_ERROR_RETURN(err);
-			*(int*)out = hidx_out;
+			if (ananas_is_success(err))
+				*(int*)out = hidx_out;
 			break;
 		}
 		case F_GETFD:
@@ -53,8 +50,10 @@ sys_fcntl(thread_t* t, handleindex_t hindex, int cmd, const void* in, void* out)
 			break;
 		}
 		default:
-			return ANANAS_ERROR(BAD_OPERATION);
+			err = ANANAS_ERROR(BAD_OPERATION);
+			break;
 	}
 
-	return ananas_success();
+	handle_deref(h);
+	return err;
 }
@@ -4,6 +4,7 @@
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
 #include <ananas/vm.h>
+#include <machine/param.h>
 
 TRACE_SETUP;
 
@@ -12,18 +13,25 @@ sys_fstat(thread_t* t, handleindex_t hindex, struct stat* buf)
 {
 	/* Get the handle */
 	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, hindex, &h);
+	errorcode_t err = handle_lookup(t->t_process, hindex, HANDLE_TYPE_FILE, &h);
 	ANANAS_ERROR_RETURN(err);
 
-	if (h->h_type != HANDLE_TYPE_FILE)
-		return ANANAS_ERROR(BAD_HANDLE);
-
-        struct VFS_FILE* file = &h->h_data.d_vfs_file;
+	struct VFS_FILE* file = &h->h_data.d_vfs_file;
 	if (file->f_dentry != NULL) {
 		memcpy(buf, &file->f_dentry->d_inode->i_sb, sizeof(struct stat));
+	} else if (file->f_device != NULL) {
+		/*
+		 * Devices opened directly have no inode; describe them as character
+		 * devices so that userland can tell them from files (isatty() and
+		 * stdio buffering depend on this)
+		 */
+		memset(buf, 0, sizeof(struct stat));
+		buf->st_mode = S_IFCHR | 0600;
+		buf->st_blksize = PAGE_SIZE;
 	} else {
-		err = ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
+		err = ANANAS_ERROR(BAD_OPERATION);
 	}
+	handle_deref(h);
 
-	return ananas_success();
+	return err;
 }
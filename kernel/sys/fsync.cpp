@@ -0,0 +1,56 @@
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/error.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+static errorcode_t
+sys_fsync_common(thread_t* t, handleindex_t index)
+{
+	/* Get the handle */
+	struct HANDLE* h;
+	errorcode_t err = handle_lookup(t->t_process, index, HANDLE_TYPE_FILE, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	struct VFS_FILE* file = &h->h_data.d_vfs_file;
+	if (file->f_dentry == NULL) {
+		handle_deref(h);
+		return ANANAS_ERROR(BAD_OPERATION);
+	}
+
+	/*
+	 * The inode goes first, as writing it dirties buffers. We do not track
+	 * which buffers belong to which file, so write back everything dirty of
+	 * the device the file lives on - and have the device commit it.
+	 */
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	vfs_sync_inode(inode);
+	if (fs->fs_device != NULL)
+		err = bio_commit(fs->fs_device);
+	handle_deref(h);
+	return err;
+}
+
+errorcode_t
+sys_fsync(thread_t* t, handleindex_t index)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, index=%d", t, index);
+	return sys_fsync_common(t, index);
+}
+
+errorcode_t
+sys_fdatasync(thread_t* t, handleindex_t index)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, index=%d", t, index);
+
+	/*
+	 * Only changes to the size or the blocks of a file dirty its inode, and
+	 * fdatasync() must write those as well - so there is nothing to skip.
+	 */
+	return sys_fsync_common(t, index);
+}
@@ -0,0 +1,51 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/futex.h>
+#include <ananas/process.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_futex_wait(thread_t* t, int* addr, int value, int timeout)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, addr=%p, value=%d, timeout=%d", t, addr, value, timeout);
+	errorcode_t err;
+
+	int* kaddr;
+	err = syscall_map_buffer(t, addr, sizeof(*kaddr), VM_FLAG_READ, (void**)&kaddr);
+	ANANAS_ERROR_RETURN(err);
+
+	return futex_wait(t->t_process->p_vmspace, kaddr, value, timeout);
+}
+
+errorcode_t
+sys_futex_wake(thread_t* t, int* addr, int count, int* woken)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, addr=%p, count=%d", t, addr, count);
+	errorcode_t err;
+
+	if (count <= 0)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	int* kwoken = NULL;
+	if (woken != NULL) {
+		err = syscall_map_buffer(t, woken, sizeof(*kwoken), VM_FLAG_WRITE, (void**)&kwoken);
+		ANANAS_ERROR_RETURN(err);
+	}
+
+	/* The futex itself isn't accessed, so it need not be mapped */
+	int num;
+	err = futex_wake(t->t_process->p_vmspace, addr, count, &num);
+	ANANAS_ERROR_RETURN(err);
+
+	if (kwoken != NULL)
+		*kwoken = num;
+	return ananas_success();
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,32 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/perfctr.h>
+#include <ananas/process.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/usercopy.h>
+
+TRACE_SETUP;
+
+/* A pid of 0 yields the counts of the calling thread, anything else those of all threads of that process */
+errorcode_t
+sys_perfctr_read(thread_t* t, pid_t pid, struct PERFCTR_COUNTS* counts)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d", t, pid);
+
+	struct PERFCTR_COUNTS result;
+	if (pid == 0) {
+		perfctr_get_thread(t, &result);
+	} else {
+		process_t* proc = process_lookup_by_id_and_ref(pid);
+		if (proc == NULL)
+			return ANANAS_ERROR(NO_PROCESS);
+		perfctr_get_process(proc, &result);
+		process_deref(proc);
+	}
+	return copyout(counts, &result, sizeof(result));
+}
+
+/* vim:set ts=2 sw=2: */
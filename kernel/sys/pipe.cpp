@@ -0,0 +1,37 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/trace.h>
+#include <ananas/usercopy.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+errorcode_t
+sys_pipe(thread_t* t, handleindex_t* out)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, out=%p", t, out);
+
+#ifdef OPTION_PIPE
+	/* out[0] is the read handle, out[1] the write handle */
+	handleindex_t kout[2];
+	errorcode_t err = pipe_alloc(t->t_process, &kout[0], &kout[1]);
+	ANANAS_ERROR_RETURN(err);
+
+	err = copyout(out, kout, sizeof(kout));
+	if (ananas_is_failure(err)) {
+		handle_free_byindex(t->t_process, kout[0]);
+		handle_free_byindex(t->t_process, kout[1]);
+		return err;
+	}
+
+	TRACE(SYSCALL, INFO, "success, read=%d write=%d", kout[0], kout[1]);
+	return ananas_success();
+#else
+	return ANANAS_ERROR(UNSUPPORTED);
+#endif
+}
+
+/* vim:set ts=2 sw=2: */
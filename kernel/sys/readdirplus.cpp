@@ -0,0 +1,44 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_readdirplus(thread_t* t, handleindex_t hindex, void* buf, size_t* len)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, buf=%p, len=%p", t, hindex, buf, len);
+	errorcode_t err;
+
+	/* Fetch the size operand */
+	size_t size;
+	err = syscall_fetch_size(t, len, &size);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Attempt to map the buffer write-only */
+	void* buffer;
+	err = syscall_map_buffer(t, buf, size, VM_FLAG_WRITE, &buffer);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Get the handle */
+	struct HANDLE* h;
+	err = handle_lookup(t->t_process, hindex, HANDLE_TYPE_FILE, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Read the entries, along with their attributes */
+	err = vfs_readdir_plus(&h->h_data.d_vfs_file, buffer, &size);
+	handle_deref(h);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Finally, inform the user of the length read - the read went OK */
+	err = syscall_set_size(t, len, size);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, size);
+	return err;
+}
+
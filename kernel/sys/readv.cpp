@@ -0,0 +1,84 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/uio.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+/*
+ * Handles readv() and preadv(); all buffers are passed to the handle in a
+ * single request. offset is NULL to use the current file position.
+ */
+static errorcode_t
+sys_readv_common(thread_t* t, handleindex_t hindex, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len)
+{
+	errorcode_t err;
+
+	/* Fetch the buffers; they will be read to */
+	struct iovec kiov[IOV_MAX];
+	size_t total;
+	err = syscall_map_iovec(t, iov, iovcnt, VM_FLAG_WRITE, kiov, &total);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Fetch the offset operand, if any */
+	off_t pos;
+	const off_t* posp = NULL;
+	if (offset != NULL) {
+		err = syscall_fetch_offset(t, offset, &pos);
+		ANANAS_ERROR_RETURN(err);
+		posp = &pos;
+	}
+
+	/* Get the handle */
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	size_t size = 0;
+	if (h->h_hops->hop_readv != NULL) {
+		err = h->h_hops->hop_readv(t, hindex, h, kiov, iovcnt, posp, &size);
+	} else if (posp == NULL && h->h_hops->hop_read != NULL) {
+		/* No vectored support; do it one buffer at a time */
+		for (int n = 0; n < iovcnt; n++) {
+			size_t amount = kiov[n].iov_len;
+			err = h->h_hops->hop_read(t, hindex, h, kiov[n].iov_base, &amount);
+			if (ananas_is_failure(err))
+				break;
+			size += amount;
+			if (amount < kiov[n].iov_len)
+				break;
+		}
+		if (size > 0)
+			err = ananas_success();
+	} else
+		err = ANANAS_ERROR(BAD_OPERATION);
+	handle_deref(h);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Finally, inform the user of the length transferred */
+	err = syscall_set_size(t, len, size);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u of %u", t, size, total);
+	return err;
+}
+
+errorcode_t
+sys_readv(thread_t* t, handleindex_t hindex, const struct iovec* iov, int iovcnt, size_t* len)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, iov=%p, iovcnt=%d, len=%p", t, hindex, iov, iovcnt, len);
+	return sys_readv_common(t, hindex, iov, iovcnt, NULL, len);
+}
+
+errorcode_t
+sys_preadv(thread_t* t, handleindex_t hindex, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, iov=%p, iovcnt=%d, offset=%p, len=%p", t, hindex, iov, iovcnt, offset, len);
+	if (offset == NULL)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	return sys_readv_common(t, hindex, iov, iovcnt, offset, len);
+}
+
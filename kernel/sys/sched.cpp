@@ -0,0 +1,145 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/process.h>
+#include <ananas/schedule.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/usercopy.h>
+
+TRACE_SETUP;
+
+/*
+ * Obtains the thread a pid refers to; 0 is the calling thread, anything else
+ * the main thread of that process. On success, *proc_out holds a reference
+ * to the process if it isn't our own.
+ */
+static errorcode_t
+sched_lookup_thread(thread_t* t, pid_t pid, thread_t** thread_out, process_t** proc_out)
+{
+	*proc_out = NULL;
+	if (pid == 0 || pid == t->t_process->p_pid) {
+		*thread_out = pid == 0 ? t : t->t_process->p_mainthread;
+		return ananas_success();
+	}
+
+	process_t* proc = process_lookup_by_id_and_ref(pid);
+	if (proc == NULL)
+		return ANANAS_ERROR(NO_PROCESS);
+	if (proc->p_state != PROCESS_STATE_ACTIVE || proc->p_mainthread == NULL) {
+		process_deref(proc);
+		return ANANAS_ERROR(NO_PROCESS);
+	}
+	*thread_out = proc->p_mainthread;
+	*proc_out = proc;
+	return ananas_success();
+}
+
+errorcode_t
+sys_sched_setscheduler(thread_t* t, pid_t pid, int policy, int priority)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d, policy=%d, priority=%d", t, pid, policy, priority);
+	errorcode_t err;
+
+	thread_t* target;
+	process_t* proc;
+	err = sched_lookup_thread(t, pid, &target, &proc);
+	ANANAS_ERROR_RETURN(err);
+
+	err = scheduler_set_policy(target, policy, priority);
+	if (proc != NULL)
+		process_deref(proc);
+	return err;
+}
+
+errorcode_t
+sys_sched_getscheduler(thread_t* t, pid_t pid, int* policy, int* priority)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d", t, pid);
+	errorcode_t err;
+
+	thread_t* target;
+	process_t* proc;
+	err = sched_lookup_thread(t, pid, &target, &proc);
+	ANANAS_ERROR_RETURN(err);
+
+	int kpolicy, kpriority;
+	scheduler_get_policy(target, &kpolicy, &kpriority);
+	if (proc != NULL)
+		process_deref(proc);
+
+	err = copyout(policy, &kpolicy, sizeof(kpolicy));
+	ANANAS_ERROR_RETURN(err);
+	return copyout(priority, &kpriority, sizeof(kpriority));
+}
+
+errorcode_t
+sys_sched_setaffinity(thread_t* t, pid_t pid, cpumask_t mask)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d, mask=%p", t, pid, (void*)mask);
+	errorcode_t err;
+
+	thread_t* target;
+	process_t* proc;
+	err = sched_lookup_thread(t, pid, &target, &proc);
+	ANANAS_ERROR_RETURN(err);
+
+	err = scheduler_set_affinity(target, mask);
+	if (proc != NULL)
+		process_deref(proc);
+	return err;
+}
+
+errorcode_t
+sys_sched_getaffinity(thread_t* t, pid_t pid, cpumask_t* mask)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d", t, pid);
+	errorcode_t err;
+
+	thread_t* target;
+	process_t* proc;
+	err = sched_lookup_thread(t, pid, &target, &proc);
+	ANANAS_ERROR_RETURN(err);
+
+	cpumask_t kmask = target->t_affinity;
+	if (proc != NULL)
+		process_deref(proc);
+	return copyout(mask, &kmask, sizeof(kmask));
+}
+
+errorcode_t
+sys_sched_setnice(thread_t* t, pid_t pid, int nice)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d, nice=%d", t, pid, nice);
+	errorcode_t err;
+
+	thread_t* target;
+	process_t* proc;
+	err = sched_lookup_thread(t, pid, &target, &proc);
+	ANANAS_ERROR_RETURN(err);
+
+	err = scheduler_set_nice(target, nice);
+	if (proc != NULL)
+		process_deref(proc);
+	return err;
+}
+
+errorcode_t
+sys_sched_getnice(thread_t* t, pid_t pid, int* nice)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, pid=%d", t, pid);
+	errorcode_t err;
+
+	thread_t* target;
+	process_t* proc;
+	err = sched_lookup_thread(t, pid, &target, &proc);
+	ANANAS_ERROR_RETURN(err);
+
+	int knice = target->t_nice;
+	if (proc != NULL)
+		process_deref(proc);
+	return copyout(nice, &knice, sizeof(knice));
+}
+
+/* vim:set ts=2 sw=2: */
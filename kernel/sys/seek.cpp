@@ -8,17 +8,9 @@
 
 TRACE_SETUP;
 
-errorcode_t
-sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
+static errorcode_t
+sys_seek_file(struct VFS_FILE* file, off_t* offset, int whence)
 {
-	/* Get the handle */
-	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, hindex, &h);
-	ANANAS_ERROR_RETURN(err);
-
-	if (h->h_type != HANDLE_TYPE_FILE)
-		return ANANAS_ERROR(BAD_HANDLE);
-        struct VFS_FILE* file = &h->h_data.d_vfs_file;
 	if (file->f_dentry == NULL)
 		return ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
 
@@ -41,10 +33,23 @@ sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
 		return ANANAS_ERROR(BAD_RANGE);
 	if (new_offset > file->f_dentry->d_inode->i_sb.st_size) {
 		/* File needs to be grown to accommodate for this offset */
-		err = vfs_grow(file, new_offset);
+		errorcode_t err = vfs_grow(file, new_offset);
 		ANANAS_ERROR_RETURN(err);
 	}
 	file->f_offset = new_offset;
 	*offset = new_offset;
 	return ananas_success();
 }
+
+errorcode_t
+sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
+{
+	/* Get the handle */
+	struct HANDLE* h;
+	errorcode_t err = handle_lookup(t->t_process, hindex, HANDLE_TYPE_FILE, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	err = sys_seek_file(&h->h_data.d_vfs_file, offset, whence);
+	handle_deref(h);
+	return err;
+}
@@ -0,0 +1,22 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/shm.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_shm_create(thread_t* t, size_t size, handleindex_t* out)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, size=%u", t, (unsigned int)size);
+
+	handleindex_t index;
+	errorcode_t err = shm_alloc(t->t_process, size, &index);
+	ANANAS_ERROR_RETURN(err);
+
+	return syscall_set_handleindex(t, out, index);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,170 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/exec.h>
+#include <ananas/handle.h>
+#include <ananas/lib.h>
+#include <ananas/process.h>
+#include <ananas/spawn.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/usercopy.h>
+#include <ananas/vfs.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+/* Ensures index is free in the child; it need not be in use */
+static void
+spawn_free_index(process_t* child, handleindex_t index)
+{
+	errorcode_t err = handle_free_byindex(child, index);
+	(void)err;
+}
+
+/* Applies a single file action to the handles of child */
+static errorcode_t
+spawn_apply_action(thread_t* t, process_t* child, const struct SPAWN_ACTION* sa)
+{
+	errorcode_t err;
+	struct HANDLE* h;
+	handleindex_t index;
+
+	switch(sa->sa_op) {
+		case SPAWN_ACTION_CLOSE:
+			return handle_free_byindex(child, sa->sa_handle);
+		case SPAWN_ACTION_DUP2: {
+			if (sa->sa_handle == sa->sa_newhandle) {
+				/* Nothing to do, but the handle must exist */
+				err = handle_lookup(child, sa->sa_handle, HANDLE_TYPE_ANY, &h);
+				ANANAS_ERROR_RETURN(err);
+				handle_deref(h);
+				return ananas_success();
+			}
+			spawn_free_index(child, sa->sa_newhandle);
+			err = handle_clone(child, sa->sa_handle, NULL, child, &h, sa->sa_newhandle, &index);
+			break;
+		}
+		case SPAWN_ACTION_OPEN: {
+			const char* path;
+			err = syscall_map_string(t, sa->sa_path, &path);
+			ANANAS_ERROR_RETURN(err);
+
+			spawn_free_index(child, sa->sa_newhandle);
+			err = handle_alloc(HANDLE_TYPE_FILE, child, sa->sa_newhandle, &h, &index);
+			ANANAS_ERROR_RETURN(err);
+
+			/* The child shares our current directory, so we can open on its behalf */
+			if (h->h_hops->hop_open != NULL)
+				err = h->h_hops->hop_open(t, index, h, path, sa->sa_flags, sa->sa_mode);
+			else
+				err = ANANAS_ERROR(BAD_OPERATION);
+			if (ananas_is_failure(err))
+				handle_free_byindex(child, index);
+			break;
+		}
+		default:
+			return ANANAS_ERROR(BAD_OPERATION);
+	}
+	ANANAS_ERROR_RETURN(err);
+
+	/* The index was just freed, so nothing else should have ended up there */
+	if (index != sa->sa_newhandle) {
+		handle_free_byindex(child, index);
+		return ANANAS_ERROR(BAD_HANDLE);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+sys_spawn(thread_t* t, const struct SPAWN_OPTIONS* opts, pid_t* out)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, opts=%p", t, opts);
+	process_t* proc = t->t_process;
+	errorcode_t err;
+
+	/* Obtain options; we work on a copy so that userland cannot change them underneath us */
+	struct SPAWN_OPTIONS kso;
+	err = copyin(&kso, opts, sizeof(kso));
+	ANANAS_ERROR_RETURN(err);
+	const struct SPAWN_OPTIONS* so = &kso;
+	if (so->so_size != sizeof(*so))
+		return ANANAS_ERROR(BAD_LENGTH);
+	if (so->so_num_actions < 0 || so->so_num_actions > SPAWN_MAX_ACTIONS)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	pid_t* pid_out;
+	err = syscall_map_buffer(t, out, sizeof(*pid_out), VM_FLAG_WRITE, (void**)&pid_out);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Look up the executable; the dentry ref keeps it around */
+	const char* path;
+	err = syscall_map_string(t, so->so_path, &path);
+	ANANAS_ERROR_RETURN(err);
+	struct VFS_FILE file;
+	err = vfs_open(path, proc->p_cwd, &file);
+	ANANAS_ERROR_RETURN(err);
+	struct DENTRY* dentry = file.f_dentry;
+	dentry_ref(dentry);
+	vfs_close(&file);
+
+	/*
+	 * Create the child; this gives it a fresh vmspace and a copy of our
+	 * handles, but unlike process_clone() it does not copy our memory.
+	 */
+	process_t* child;
+	err = process_alloc(proc, &child);
+	if (ananas_is_failure(err)) {
+		dentry_deref(dentry);
+		return err;
+	}
+
+	thread_t* child_thread;
+	addr_t exec_addr;
+	if (so->so_argv != NULL) {
+		err = exec_set_args(child, so->so_argv);
+		if (ananas_is_failure(err))
+			goto fail;
+	}
+	if (so->so_envp != NULL) {
+		err = exec_set_environment(child, so->so_envp);
+		if (ananas_is_failure(err))
+			goto fail;
+	}
+
+	for (int n = 0; n < so->so_num_actions; n++) {
+		struct SPAWN_ACTION sa;
+		err = copyin(&sa, &so->so_actions[n], sizeof(sa));
+		if (ananas_is_success(err))
+			err = spawn_apply_action(t, child, &sa);
+		if (ananas_is_failure(err))
+			goto fail;
+	}
+
+	/* Load the executable directly into the child's vmspace */
+	err = exec_load(child->p_vmspace, dentry, &exec_addr, child->p_info);
+	if (ananas_is_failure(err))
+		goto fail;
+
+	err = thread_alloc(child, &child_thread, (so->so_argv != NULL && so->so_argv[0] != NULL) ? so->so_argv[0] : path, THREAD_ALLOC_DEFAULT);
+	if (ananas_is_failure(err))
+		goto fail;
+	dentry_deref(dentry);
+	exec_prefault(child->p_vmspace);
+
+	/* All set; note that our ref to the child is the one waitpid() hands back */
+	*pid_out = child->p_pid;
+	md_setup_post_exec(child_thread, exec_addr);
+	thread_resume(child_thread);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success, new pid=%u", t, *pid_out);
+	return ananas_success();
+
+fail:
+	dentry_deref(dentry);
+	process_deref(child);
+	return err;
+}
+
+/* vim:set ts=2 sw=2: */
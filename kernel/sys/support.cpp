@@ -5,31 +5,63 @@
 #include <ananas/handle.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
+#include <ananas/uio.h>
+#include <ananas/usercopy.h>
 #include <ananas/vm.h>
 
 TRACE_SETUP;
 
+namespace {
+
+inline bool
+usercopy_range_ok(const void* ptr, size_t len)
+{
+	addr_t addr = (addr_t)ptr;
+	return addr + len >= addr && addr + len <= USERLAND_END;
+}
+
+} // unnamed namespace
+
 errorcode_t
-syscall_get_handle(thread_t* t, handleindex_t hindex, struct HANDLE** out)
+copyin(void* dst, const void* src, size_t len)
 {
-	return handle_lookup(t->t_process, hindex, HANDLE_TYPE_ANY, out);
+	if (!usercopy_range_ok(src, len) || md_copyin(dst, src, len) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	return ananas_success();
 }
 
 errorcode_t
-syscall_get_file(thread_t* t, handleindex_t hindex, struct VFS_FILE** out)
+copyout(void* dst, const void* src, size_t len)
 {
-	struct HANDLE* handle;
-	errorcode_t err = handle_lookup(t->t_process, hindex, HANDLE_TYPE_ANY, &handle);
-	ANANAS_ERROR_RETURN(err);
+	if (!usercopy_range_ok(dst, len) || md_copyout(dst, src, len) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	return ananas_success();
+}
 
-	struct VFS_FILE* file = &((struct HANDLE*)handle)->h_data.d_vfs_file;
-	if (file->f_dentry == NULL && file->f_device == NULL)
-		return ANANAS_ERROR(BAD_HANDLE);
+errorcode_t
+copyinstr(char* dst, const void* src, size_t len)
+{
+	/* Only what is actually read must be userland memory, so clip the range */
+	addr_t addr = (addr_t)src;
+	if (addr >= USERLAND_END)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (len > USERLAND_END - addr)
+		len = USERLAND_END - addr;
 
-	*out = file;
+	ssize_t n = md_copyinstr(dst, src, len);
+	if (n < 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (n == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
 	return ananas_success();
 }
 
+errorcode_t
+syscall_get_handle(thread_t* t, handleindex_t hindex, struct HANDLE** out)
+{
+	return handle_lookup(t->t_process, hindex, HANDLE_TYPE_ANY, out);
+}
+
 errorcode_t
 syscall_map_string(thread_t* t, const void* ptr, const char** out)
 {
@@ -61,55 +93,58 @@ syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** o
 errorcode_t
 syscall_fetch_size(thread_t* t, const void* ptr, size_t* out)
 {
-	auto s = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_READ));
-	if (s == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = *s;
-	return ananas_success();
+	return copyin(out, ptr, sizeof(size_t));
 }
 
 errorcode_t
 syscall_set_size(thread_t* t, void* ptr, size_t len)
 {
-	auto s = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_WRITE));
-	if (s == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*s = len;
-	return ananas_success();
+	return copyout(ptr, &len, sizeof(size_t));
 }
 
 errorcode_t
 syscall_set_handleindex(thread_t* t, handleindex_t* ptr, handleindex_t index)
 {
-	auto p = static_cast<handleindex_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(handleindex_t), VM_FLAG_WRITE));
-	if (p == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*p = index;
-	return ananas_success();
+	return copyout(ptr, &index, sizeof(handleindex_t));
 }
 
 errorcode_t
 syscall_fetch_offset(thread_t* t, const void* ptr, off_t* out)
 {
-	auto o = static_cast<off_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(off_t), VM_FLAG_READ));
-	if (o == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = *o;
-	return ananas_success();
+	return copyin(out, ptr, sizeof(off_t));
 }
 
 errorcode_t
 syscall_set_offset(thread_t* t, void* ptr, off_t len)
 {
-	auto o = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_WRITE));
-	if (o == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
+	return copyout(ptr, &len, sizeof(off_t));
+}
+
+/*
+ * Fetches the iovec array of a vectored request to out, which must hold
+ * iovcnt entries, and ensures all buffers can be accessed using flags; the
+ * sum of the buffer lengths is stored in total.
+ */
+errorcode_t
+syscall_map_iovec(thread_t* t, const struct iovec* iov, int iovcnt, int flags, struct iovec* out, size_t* total)
+{
+	if (iovcnt <= 0 || iovcnt > IOV_MAX)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	errorcode_t err = copyin(out, iov, iovcnt * sizeof(struct iovec));
+	ANANAS_ERROR_RETURN(err);
 
-	*o = len;
+	*total = 0;
+	for (int n = 0; n < iovcnt; n++) {
+		if (out[n].iov_len == 0)
+			continue;
+		if (*total + out[n].iov_len < *total)
+			return ANANAS_ERROR(BAD_LENGTH); /* overflow */
+		void* buffer;
+		err = syscall_map_buffer(t, out[n].iov_base, out[n].iov_len, flags, &buffer);
+		ANANAS_ERROR_RETURN(err);
+		*total += out[n].iov_len;
+	}
 	return ananas_success();
 }
 
@@ -0,0 +1,15 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/mount.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_sync(thread_t* t)
+{
+	TRACE(SYSCALL, FUNC, "t=%p", t);
+	return vfs_sync_all();
+}
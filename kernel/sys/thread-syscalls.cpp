@@ -0,0 +1,38 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/process.h>
+#include <ananas/syscalls.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+/*
+ * Creates a new thread in the caller's process, which starts by calling
+ * entry(arg) on the given stack; it shares the vmspace and handles with all
+ * other threads and terminates using exit().
+ */
+errorcode_t
+sys_thread_create(thread_t* t, const void* entry, void* stack, void* arg)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, entry=%p, stack=%p, arg=%p", t, entry, stack, arg);
+	errorcode_t err;
+	process_t* proc = t->t_process;
+
+	if (entry == NULL || stack == NULL)
+		return ANANAS_ERROR(BAD_ADDRESS);
+
+	thread_t* new_thread;
+	err = thread_alloc(proc, &new_thread, t->t_name, THREAD_ALLOC_USER_STACK);
+	ANANAS_ERROR_RETURN(err);
+
+	md_thread_set_entrypoint(new_thread, (addr_t)entry);
+	md_thread_set_argument(new_thread, (addr_t)arg);
+	md_thread_set_stack(new_thread, (addr_t)stack);
+
+	/* The reference we got is the thread's own; thread_exit() drops it */
+	thread_resume(new_thread);
+	return ananas_success();
+}
+
+/* vim:set ts=2 sw=2: */
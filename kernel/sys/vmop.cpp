@@ -4,27 +4,35 @@
 #include <ananas/process.h>
 #include <ananas/trace.h>
 #include <ananas/error.h>
+#include <ananas/lib.h>
 #include <ananas/vm.h>
 #include <ananas/syscall-vmops.h>
+#include <ananas/syscall-ring.h>
+#include <ananas/usercopy.h>
+#include <ananas/vfs/types.h>
 #include <ananas/vmspace.h>
+#include <machine/param.h> /* for PAGE_SIZE, SHARED_PAGE_ADDR */
 
 TRACE_SETUP;
 
 static errorcode_t
 sys_vmop_map(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 {
-	/* TODO: support handle-based mappings */
-	if (vo->vo_flags & VMOP_FLAG_HANDLE)
-		return ANANAS_ERROR(BAD_HANDLE);
-
-	/* TODO: support different mappings */
-
-	/* TODO: support fixed mappings? */
-	if (vo->vo_addr != NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
 	if (vo->vo_len == 0)
 		return ANANAS_ERROR(BAD_LENGTH);
 
+	/* Fixed mappings must be page-aligned and stay clear of the shared page */
+	addr_t virt = (addr_t)vo->vo_addr;
+	bool fixed = (vo->vo_flags & VMOP_FLAG_FIXED) != 0;
+	if (fixed) {
+		if ((virt & (PAGE_SIZE - 1)) != 0 || virt < PAGE_SIZE)
+			return ANANAS_ERROR(BAD_ADDRESS);
+		if (virt + vo->vo_len < virt || virt + vo->vo_len > SHARED_PAGE_ADDR)
+			return ANANAS_ERROR(BAD_RANGE);
+	} else if (virt != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	vmspace_t* vs = curthread->t_process->p_vmspace;
+
 	int vm_flags = VM_FLAG_USER | VM_FLAG_ALLOC;
 	if (vo->vo_flags & VMOP_FLAG_READ)
 		vm_flags |= VM_FLAG_READ;
@@ -34,7 +42,47 @@ sys_vmop_map(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 		vm_flags |= VM_FLAG_EXECUTE;
 
 	vmarea_t* va;
-	errorcode_t err = vmspace_map(curthread->t_process->p_vmspace, (addr_t)NULL, vo->vo_len, vm_flags, &va);
+	errorcode_t err;
+	if (vo->vo_flags & VMOP_FLAG_HANDLE) {
+		/* File or shared memory mapping; exactly one of shared/private must be given */
+		int share = vo->vo_flags & (VMOP_FLAG_SHARED | VMOP_FLAG_PRIVATE);
+		if (share != VMOP_FLAG_SHARED && share != VMOP_FLAG_PRIVATE)
+			return ANANAS_ERROR(BAD_FLAG);
+		if (share == VMOP_FLAG_PRIVATE)
+			vm_flags |= VM_FLAG_PRIVATE;
+
+		struct HANDLE* h;
+		err = handle_lookup(curthread->t_process, vo->vo_handle, HANDLE_TYPE_ANY, &h);
+		ANANAS_ERROR_RETURN(err);
+		if (h->h_type == HANDLE_TYPE_SHM) {
+			/* Shared memory; every shared mapping sees the same pages */
+			if (fixed)
+				err = vmspace_mapto_shm(vs, virt, h->h_data.d_shm, vo->vo_offset, vo->vo_len, vm_flags, &va);
+			else
+				err = vmspace_map_shm(vs, h->h_data.d_shm, vo->vo_offset, vo->vo_len, vm_flags, &va);
+		} else if (h->h_type != HANDLE_TYPE_FILE) {
+			err = ANANAS_ERROR(BAD_HANDLE);
+		} else {
+			struct VFS_FILE* file = &h->h_data.d_vfs_file;
+			if (file->f_dentry == NULL || file->f_dentry->d_inode == NULL)
+				err = ANANAS_ERROR(BAD_HANDLE);
+			else if (!S_ISREG(file->f_dentry->d_inode->i_sb.st_mode))
+				err = ANANAS_ERROR(BAD_TYPE);
+			else if (!fixed)
+				err = vmspace_map_dentry(vs, file->f_dentry, vo->vo_offset, vo->vo_len, vm_flags, &va);
+			else if (vo->vo_offset & (PAGE_SIZE - 1))
+				err = ANANAS_ERROR(BAD_RANGE);
+			else {
+				size_t len = ROUND_UP(vo->vo_len, PAGE_SIZE);
+				err = vmspace_mapto_dentry(vs, virt, 0, len, file->f_dentry, vo->vo_offset, len, vm_flags, &va);
+			}
+		}
+		handle_deref(h);
+	} else if (fixed) {
+		err = vmspace_mapto(vs, virt, (addr_t)NULL, ROUND_UP(vo->vo_len, PAGE_SIZE), vm_flags, &va);
+	} else {
+		err = vmspace_map(vs, (addr_t)NULL, vo->vo_len, vm_flags, &va);
+	}
 	ANANAS_ERROR_RETURN(err);
 
 	vo->vo_addr = (void*)va->va_virt;
@@ -45,8 +93,45 @@ sys_vmop_map(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 static errorcode_t
 sys_vmop_unmap(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 {
-	/* XXX implement me */
-	return ANANAS_ERROR(BAD_OPERATION);
+	return vmspace_unmap(curthread->t_process->p_vmspace, (addr_t)vo->vo_addr, vo->vo_len);
+}
+
+static errorcode_t
+sys_vmop_discard(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
+{
+	return vmspace_discard(curthread->t_process->p_vmspace, (addr_t)vo->vo_addr, vo->vo_len);
+}
+
+static errorcode_t
+sys_vmop_sync(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
+{
+	if (vo->vo_len == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	return vmspace_sync(curthread->t_process->p_vmspace, (addr_t)vo->vo_addr, vo->vo_len);
+}
+
+static errorcode_t
+sys_vmop_advise(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
+{
+	vmspace_t* vs = curthread->t_process->p_vmspace;
+	switch(vo->vo_flags) {
+		case VMOP_ADVICE_NORMAL:
+			return vmspace_set_advice(vs, (addr_t)vo->vo_addr, vo->vo_len, VM_ADVICE_NORMAL);
+		case VMOP_ADVICE_RANDOM:
+			return vmspace_set_advice(vs, (addr_t)vo->vo_addr, vo->vo_len, VM_ADVICE_RANDOM);
+		case VMOP_ADVICE_SEQUENTIAL:
+			return vmspace_set_advice(vs, (addr_t)vo->vo_addr, vo->vo_len, VM_ADVICE_SEQUENTIAL);
+		case VMOP_ADVICE_WILLNEED:
+			return vmspace_willneed(vs, (addr_t)vo->vo_addr, vo->vo_len);
+		case VMOP_ADVICE_DONTNEED:
+		case VMOP_ADVICE_FREE:
+			/* We have no cheaper way to release pages lazily; just drop them now */
+			return vmspace_discard(vs, (addr_t)vo->vo_addr, vo->vo_len);
+		default:
+			return ANANAS_ERROR(BAD_FLAG);
+	}
+
+	/* NOTREACHED */
 }
 
 errorcode_t
@@ -55,21 +140,43 @@ sys_vmop(ARG_CURTHREAD struct VMOP_OPTIONS* opts)
 	TRACE(SYSCALL, FUNC, "t=%p, opts=%p", curthread, opts);
 	errorcode_t err;
 
-	/* Opbtain options */
-	struct VMOP_OPTIONS* vmop_opts;
-	err = syscall_map_buffer(curthread, opts, sizeof(*vmop_opts), VM_FLAG_READ | VM_FLAG_WRITE, (void**)&vmop_opts);
+	/* Obtain options; we work on a copy so that userland cannot change them underneath us */
+	struct VMOP_OPTIONS vmop_opts;
+	err = copyin(&vmop_opts, opts, sizeof(vmop_opts));
 	ANANAS_ERROR_RETURN(err);
-	if (vmop_opts->vo_size != sizeof(*vmop_opts))
+	if (vmop_opts.vo_size != sizeof(vmop_opts))
 		return ANANAS_ERROR(BAD_LENGTH);
 
-	switch(vmop_opts->vo_op) {
+	switch(vmop_opts.vo_op) {
 		case OP_MAP:
-			return sys_vmop_map(curthread, vmop_opts);
+			err = sys_vmop_map(curthread, &vmop_opts);
+			break;
 		case OP_UNMAP:
-			return sys_vmop_unmap(curthread, vmop_opts);
+			err = sys_vmop_unmap(curthread, &vmop_opts);
+			break;
+		case OP_SYNC:
+			err = sys_vmop_sync(curthread, &vmop_opts);
+			break;
+		case OP_DISCARD:
+			err = sys_vmop_discard(curthread, &vmop_opts);
+			break;
+		case OP_ADVISE:
+			err = sys_vmop_advise(curthread, &vmop_opts);
+			break;
+		case OP_RING_SETUP:
+			err = syscall_ring_setup(curthread, &vmop_opts);
+			break;
+		case OP_RING_SUBMIT:
+			err = syscall_ring_submit(curthread);
+			break;
+		case OP_RING_WAIT:
+			err = syscall_ring_wait(curthread, vmop_opts.vo_len);
+			break;
 		default:
 			return ANANAS_ERROR(BAD_OPERATION);
 	}
+	ANANAS_ERROR_RETURN(err);
 
-	/* NOTREACHED */
+	/* Hand back whatever the operation filled in */
+	return copyout(opts, &vmop_opts, sizeof(vmop_opts));
 }
@@ -54,6 +54,7 @@ static struct ENTRY_LIST options;
 static struct ENTRY_LIST files;
 static const char* architecture = NULL;
 static const char* ident = NULL;
+static const char* profile = NULL;
 
 static struct ENTRY*
 entry_make(char* value)
@@ -102,8 +103,9 @@ check_entries(struct ENTRY_LIST* list, const char* type)
 static void
 usage()
 {
-	fprintf(stderr, "usage: config [-h?] name\n\n");
+	fprintf(stderr, "usage: config [-h?] [-p profile] name\n\n");
 	fprintf(stderr, "   -h, -?       this help\n");
+	fprintf(stderr, "   -p profile   place the functions listed in profile first\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -230,6 +232,14 @@ parse_devfile(const char* arch)
 			continue;
 		}
 
+		/* 'option' declares an option that only affects compilation, not which files we need */
+		if (strcmp(line, "option") == 0) {
+			struct ENTRY* e = find_entry(&options, opts);
+			if (e != NULL)
+				e->matched = 1;
+			continue;
+		}
+
 		/*
 		 * OK, there are two options: either it's optional, or it's not;
 		 * corner-case the first case to keep the flow understandable.
@@ -490,6 +500,39 @@ create_options()
 	fclose(f);
 }
 
+/*
+ * Creates the linker script fragment which orders the hot functions; the
+ * profile lists a function name per line, hottest first, as produced by
+ * 'profile-symbolize.pl -l'. Without a profile, the fragment is empty.
+ */
+static void
+create_hotfuncs()
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "../compile/%s/hotfuncs.ld", ident);
+	FILE* f = fopen(path, "w");
+	if (f == NULL)
+		err(1, "cannot create %s", path);
+
+	fprintf(f, "/* This file is automatically generated by config - do not edit! */\n");
+	if (profile != NULL) {
+		FILE* f_in = fopen(profile, "rt");
+		if (f_in == NULL)
+			err(1, "cannot open %s", profile);
+
+		char line[1024];
+		while (fgets(line, sizeof(line), f_in) != NULL) {
+			/* Only use the first word, and skip empty lines and comments */
+			line[strcspn(line, " \t\r\n")] = '\0';
+			if (line[0] == '\0' || line[0] == '#')
+				continue;
+			fprintf(f, "*(.text.%s)\n", line);
+		}
+		fclose(f_in);
+	}
+	fclose(f);
+}
+
 static void
 create_symlink()
 {
@@ -507,8 +550,11 @@ main(int argc, char* argv[])
 {
 	int ch;
 
-	while ((ch = getopt(argc, argv, "?h")) != -1) {
+	while ((ch = getopt(argc, argv, "?hp:")) != -1) {
 		switch(ch) {
+			case 'p':
+				profile = optarg;
+				break;
 			case 'h':
 			case '?':
 				usage();
@@ -542,6 +588,7 @@ main(int argc, char* argv[])
 
 	create_makefile();
 	create_options();
+	create_hotfuncs();
 	create_symlink();
 
 	return 0;
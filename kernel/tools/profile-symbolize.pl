@@ -0,0 +1,72 @@
+#!/usr/bin/perl -w
+#
+# Symbolizes the samples of the kernel profiler, as read from
+# /ankh/trace/samples, against the kernel ELF (use kernel.full, which still
+# has its debug information). By default, this prints the functions that were
+# sampled the most; with -f, it prints every call chain in 'folded' format,
+# suitable for flamegraph.pl. With -l, it prints the (mangled) names of the
+# sampled kernel functions, hottest first, which is what 'config -p' expects
+# in order to place them together.
+#
+
+use strict;
+use Getopt::Std;
+
+my %opts;
+getopts('fla:', \%opts);
+my ($KERNEL, $SAMPLES) = @ARGV;
+die "usage: profile-symbolize.pl [-f | -l] [-a addr2line] kernel.full samples" unless defined $SAMPLES;
+my $ADDR2LINE = $opts{'a'} || 'addr2line';
+
+# Read all samples; every line is '<cpu> <pid> <k|u> <pc> <caller> ...'
+my @samples;
+my %addrs;
+open(SAMPLES, "<$SAMPLES") or die "cannot open '$SAMPLES': $!";
+while (<SAMPLES>) {
+	chomp;
+	my ($cpu, $pid, $mode, @pc) = split(/ /);
+	next unless @pc;
+	push @samples, { pid => $pid, mode => $mode, pc => [ @pc ] };
+	next unless $mode eq 'k';
+	$addrs{$_} = undef foreach (@pc);
+}
+close(SAMPLES);
+die "no samples" unless @samples;
+
+# Resolve every kernel address in one go; addr2line prints function and location per address
+my @addrs = keys %addrs;
+if (@addrs) {
+	my $demangle = $opts{'l'} ? '' : '-C';
+	my @lines = split(/\n/, `$ADDR2LINE -f $demangle -e '$KERNEL' @{[ map { "0x$_" } @addrs ]}`);
+	die "addr2line failed" unless scalar(@lines) eq 2 * scalar(@addrs);
+	for my $n (0..$#addrs) {
+		my $func = $lines[2 * $n];
+		$func = "0x$addrs[$n]" if $func eq '??';
+		$addrs{$addrs[$n]} = $func;
+	}
+}
+
+my %count;
+foreach my $s (@samples) {
+	my @chain;
+	if ($s->{mode} eq 'k') {
+		@chain = map { $addrs{$_} } @{$s->{pc}};
+	} elsif ($opts{'l'}) {
+		next;
+	} else {
+		@chain = ("[userland pid $s->{pid}]");
+	}
+	my $key = $opts{'f'} ? join(';', reverse @chain) : $chain[0];
+	$count{$key}++;
+}
+
+my $total = scalar(@samples);
+foreach my $key (sort { $count{$b} <=> $count{$a} } keys %count) {
+	if ($opts{'l'}) {
+		print "$key\n" unless $key =~ /^0x/;
+	} elsif ($opts{'f'}) {
+		print "$key $count{$key}\n";
+	} else {
+		printf("%6d %5.1f%% %s\n", $count{$key}, 100 * $count{$key} / $total, $key);
+	}
+}
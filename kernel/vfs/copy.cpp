@@ -0,0 +1,136 @@
+/*
+ * In-kernel copying between files; see vfs_copy().
+ *
+ * If the source is backed by the page cache, data is written straight from
+ * the cached pages to the destination, which places it in the destination's
+ * buffers; otherwise, a single kernel page is used to bounce the data. Either
+ * way, nothing ever passes through userland.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <ananas/error.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+
+TRACE_SETUP;
+
+namespace {
+
+inline bool
+vfs_copy_is_cached(struct VFS_FILE* file)
+{
+	if (file->f_dentry == NULL)
+		return false;
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	return inode != NULL && inode->i_iops != NULL && inode->i_iops->block_map != NULL && S_ISREG(inode->i_sb.st_mode);
+}
+
+/*
+ * Writes len bytes of the page cache of in at its current offset to out;
+ * these must be within a single page.
+ */
+errorcode_t
+vfs_copy_from_cache(struct VFS_FILE* in, struct VFS_FILE* out, size_t* len)
+{
+	off_t page_offset = ROUND_DOWN(in->f_offset, PAGE_SIZE);
+	struct VM_PAGE* vp;
+	errorcode_t err = vfs_pagecache_get(in->f_dentry, page_offset, &vp);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Writing may need to update this very page, so only keep it referenced */
+	vmpage_ref(vp);
+	vmpage_unlock(vp);
+
+	off_t cur_offset = in->f_offset - page_offset;
+	KASSERT(cur_offset + *len <= PAGE_SIZE, "copy crosses page boundary");
+	struct PAGE* p = vmpage_get_page(vp);
+	void* data = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ);
+	err = vfs_write(out, static_cast<char*>(data) + cur_offset, len);
+	kmem_unmap(data, PAGE_SIZE);
+	vmpage_deref(vp);
+	ANANAS_ERROR_RETURN(err);
+
+	in->f_offset += *len;
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+errorcode_t
+vfs_copy(struct VFS_FILE* in, struct VFS_FILE* out, size_t* len)
+{
+	TRACE(VFS, FUNC, "in=%p, out=%p, len=%u", in, out, *len);
+	size_t left = *len;
+
+	/* Copying a file onto an overlapping part of itself would read what we just wrote */
+	if (in->f_dentry != NULL && out->f_dentry != NULL && in->f_dentry->d_inode == out->f_dentry->d_inode &&
+	    in->f_offset < out->f_offset + (off_t)left && out->f_offset < in->f_offset + (off_t)left)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	bool cached = vfs_copy_is_cached(in);
+	void* bounce = NULL;
+	struct PAGE* bounce_page = NULL;
+	if (cached) {
+		struct VFS_INODE* inode = in->f_dentry->d_inode;
+		if (inode->i_sb.st_size - in->f_offset < (off_t)left)
+			left = (inode->i_sb.st_size > in->f_offset) ? inode->i_sb.st_size - in->f_offset : 0;
+		if (left > 0)
+			vfs_pagecache_readahead(inode, ROUND_DOWN(in->f_offset, PAGE_SIZE), in->f_offset + left);
+	} else {
+		bounce = page_alloc_single_mapped(&bounce_page, VM_FLAG_READ | VM_FLAG_WRITE);
+		if (bounce == NULL)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+
+	size_t copied = 0;
+	errorcode_t err = ananas_success();
+	while (left > 0) {
+		size_t chunk_len = (left < PAGE_SIZE) ? left : PAGE_SIZE;
+		size_t written;
+		if (cached) {
+			size_t page_left = PAGE_SIZE - (in->f_offset & (PAGE_SIZE - 1));
+			if (chunk_len > page_left)
+				chunk_len = page_left;
+			written = chunk_len;
+			err = vfs_copy_from_cache(in, out, &written);
+			if (ananas_is_failure(err))
+				break;
+		} else {
+			size_t wanted = chunk_len;
+			err = vfs_read(in, bounce, &chunk_len);
+			if (ananas_is_failure(err) || chunk_len == 0)
+				break;
+			written = chunk_len;
+			err = vfs_write(out, bounce, &written);
+			if (ananas_is_failure(err))
+				written = 0;
+			if (written < chunk_len && in->f_dentry != NULL)
+				in->f_offset -= chunk_len - written; /* do not skip what was not written */
+			if (chunk_len < wanted)
+				left = written; /* end of the source */
+		}
+
+		copied += written;
+		left -= written;
+		if (ananas_is_failure(err) || written < chunk_len)
+			break;
+	}
+
+	if (bounce != NULL) {
+		kmem_unmap(bounce, PAGE_SIZE);
+		page_free(bounce_page);
+	}
+
+	/* If some data was copied, that is what we report */
+	if (ananas_is_failure(err) && copied == 0)
+		return err;
+	*len = copied;
+	return ananas_success();
+}
+
+/* vim:set ts=2 sw=2: */
@@ -41,6 +41,37 @@ vfs_bget(struct VFS_MOUNTED_FS* fs, blocknr_t block, struct BIO** bio, int flags
 	return ananas_success();
 }
 
+errorcode_t
+vfs_bget_range(struct VFS_MOUNTED_FS* fs, blocknr_t block, unsigned int num_blocks, struct BIO** bios, int flags)
+{
+	if (!vfs_is_filesystem_sane(fs))
+		return ANANAS_ERROR(IO);
+
+	bio_get_range(fs->fs_device, block * (fs->fs_block_size / BIO_SECTOR_SIZE), num_blocks, fs->fs_block_size, flags, bios);
+	return ananas_success();
+}
+
+errorcode_t
+vfs_block_map_range(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, unsigned int* num_blocks)
+{
+	KASSERT(*num_blocks > 0, "mapping empty range");
+	if (inode->i_iops->block_map_range != NULL)
+		return inode->i_iops->block_map_range(inode, block_in, block_out, num_blocks);
+
+	errorcode_t err = inode->i_iops->block_map(inode, block_in, block_out, 0);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Extend the run for as long as the blocks are adjacent */
+	unsigned int n = 1;
+	for (/* nothing */; n < *num_blocks; n++) {
+		blocknr_t block;
+		if (ananas_is_failure(inode->i_iops->block_map(inode, block_in + n, &block, 0)) || block != *block_out + n)
+			break;
+	}
+	*num_blocks = n;
+	return ananas_success();
+}
+
 size_t
 vfs_filldirent(void** dirents, size_t* size, ino_t inum, const char* name, int namelen)
 {
@@ -69,17 +100,4 @@ vfs_filldirent(void** dirents, size_t* size, ino_t inum, const char* name, int n
 	return de_length;
 }
 
-void
-vfs_set_inode_dirty(struct VFS_INODE* inode)
-{
-	/* Ref the inode to prevent it from going away */
-	vfs_ref_inode(inode);
-	
-	/* XXX For now, we just immediately write the inode */
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	fs->fs_fsops->write_inode(inode);
-
-	vfs_deref_inode(inode);
-}
-
 /* vim:set ts=2 sw=2: */
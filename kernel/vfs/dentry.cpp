@@ -6,6 +6,32 @@
  *
  * We try to keep as much entries in memory as possible, only overwriting
  * them if we really need to.
+ *
+ * Entries are hashed on their parent and name; every bucket has a lock of its
+ * own, so lookups which hit the cache only need that lock and can proceed in
+ * parallel. Adding and recycling entries is serialized using the cache's
+ * write lock, which protects the in-use and free lists; the bucket lock must
+ * be held as well to add or remove an entry from its bucket.
+ *
+ * An entry is hashed for as long as it is referenced, apart from root
+ * entries which are never hashed. The final reference is dropped with the
+ * bucket lock held, after the entry is unhashed, so lookups can never find an
+ * entry whose refcount is zero - and such entries can be recycled without
+ * holding any bucket lock.
+ *
+ * As lookups cannot reorder the in-use list, they mark the entry as
+ * referenced instead; entries which are referenced get a second chance when
+ * we need to recycle an entry.
+ *
+ * Negative entries would normally be forgotten as soon as the lookup which
+ * created them is done; to keep failing lookups from going to the filesystem
+ * time and again, the most recent ones are held by the negative entry cache.
+ * These are released once a name is created in or renamed into their parent.
+ *
+ * Entries are allocated as needed while memory is plentiful. Once the page
+ * allocator runs short, our reclaimer wakes the 'dcshrink' thread, which
+ * throws away unreferenced entries - negative ones first - and thus releases
+ * the inodes they hold.
  */
 #include <ananas/types.h>
 #include <ananas/vfs/core.h>
@@ -14,8 +40,12 @@
 #include <ananas/init.h>
 #include <ananas/mm.h>
 #include <ananas/lock.h>
+#include <ananas/page.h>
 #include <ananas/schedule.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
 #include <ananas/trace.h>
+#include <ananas/tunable.h>
 #include <ananas/lib.h>
 #include <ananas/kdb.h>
 #include "options.h"
@@ -24,71 +54,156 @@ TRACE_SETUP;
 
 namespace {
 
-mutex_t dcache_mtx;
+#define DCACHE_SHRINK_BATCH	64	/* Maximum number of entries thrown away per shrink */
+
+LIST_DEFINE(DENTRY_HASH_LIST, struct DENTRY);
+LIST_DEFINE(DENTRY_NEGATIVE_LIST, struct DENTRY);
+
+struct DCACHE_BUCKET {
+	spinlock_t b_lock;
+	struct DENTRY_HASH_LIST b_list;
+};
+
+SLAB_CACHE_DEFINE(dcache_dentry_cache, struct DENTRY, NULL);
+
+rwlock_t dcache_rwlock;
 struct DENTRY_QUEUE	dcache_inuse;
-struct DENTRY_QUEUE	dcache_free;
+unsigned int dcache_num_items;
+
+/* Tunables; see /ankh/sys */
+unsigned int dcache_min_items = 32; /* Number of entries we may always have */
+unsigned int dcache_free_reserve = 8; /* Stop growing if less than 1/dcache_free_reserve of memory is available */
+struct DCACHE_BUCKET dcache_bucket[DCACHE_HASH_SIZE];
+
+mutex_t dcache_negative_mtx; /* Protects the negative entry cache */
+struct DENTRY_NEGATIVE_LIST dcache_negative; /* Oldest first */
+unsigned int dcache_num_negative;
+
+struct PAGE_RECLAIMER dcache_reclaimer;
+semaphore_t dcache_shrink_sem;
+bool dcache_shrink_wakeup;
+thread_t dcache_shrink_thread;
 
 inline void dcache_lock()
 {
-	mutex_lock(&dcache_mtx);
+	rwlock_lock_write(&dcache_rwlock);
 }
 
 inline void dcache_unlock()
 {
-	mutex_unlock(&dcache_mtx);
+	rwlock_unlock_write(&dcache_rwlock);
 }
 
 inline void dcache_assert_locked()
 {
-	mutex_assert(&dcache_mtx, MTX_LOCKED);
+	rwlock_assert(&dcache_rwlock, RWLOCK_WRITE_LOCKED);
 }
 
+/* Atomically adds a reference; readers may do this concurrently */
+inline void dcache_add_ref(struct DENTRY* d)
+{
+	__atomic_fetch_add(&d->d_refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a */
+inline uint32_t dcache_hash_name(const char* name)
+{
+	uint32_t hash = 2166136261U;
+	for (/* nothing */; *name != '\0'; name++)
+		hash = (hash ^ static_cast<uint8_t>(*name)) * 16777619U;
+	return hash;
+}
+
+inline struct DCACHE_BUCKET& dcache_bucket_for(struct DENTRY* parent, uint32_t hash)
+{
+	auto p = reinterpret_cast<addr_t>(parent);
+	return dcache_bucket[(hash ^ (p >> 4) ^ (p >> 12)) & (DCACHE_HASH_SIZE - 1)];
+}
+
+/* Only entries with refcount zero can be recycled; see the comment at the top */
+inline bool dcache_is_unused(struct DENTRY* d)
+{
+	return __atomic_load_n(&d->d_refcount, __ATOMIC_ACQUIRE) == 0 && (d->d_flags & DENTRY_FLAG_ROOT) == 0;
+}
+
+unsigned int dcache_reclaim(unsigned int num_pages);
+
 errorcode_t
 dcache_init()
 {
-	mutex_init(&dcache_mtx, "dcache");
+	rwlock_init(&dcache_rwlock, "dcache");
 	LIST_INIT(&dcache_inuse);
-	LIST_INIT(&dcache_free);
-
-	/*
-	 * Make an empty cache; we allocate one big pool and set up pointers to the
-	 * items as necessary.
-	 */
-	{
-		auto dentry = static_cast<struct DENTRY*>(kmalloc(DCACHE_ITEMS_PER_FS * sizeof(struct DENTRY)));
-		memset(dentry, 0, DCACHE_ITEMS_PER_FS * sizeof(struct DENTRY));
-		for (int i = 0; i < DCACHE_ITEMS_PER_FS; i++, dentry++)
-			LIST_APPEND(&dcache_free, dentry);
+	for (unsigned int n = 0; n < DCACHE_HASH_SIZE; n++) {
+		spinlock_init(&dcache_bucket[n].b_lock);
+		LIST_INIT(&dcache_bucket[n].b_list);
 	}
 
+	mutex_init(&dcache_negative_mtx, "dcacheneg");
+	LIST_INIT(&dcache_negative);
+
+	sem_init(&dcache_shrink_sem, 0);
+	dcache_reclaimer.pr_name = "dcache";
+	dcache_reclaimer.pr_func = dcache_reclaim;
+	page_register_reclaimer(&dcache_reclaimer);
 	return ananas_success();
 }
 
+/* Returns whether the cache may allocate more entries */
+bool
+dcache_may_grow()
+{
+	if (dcache_num_items < dcache_min_items)
+		return true;
+
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	return avail_pages > total_pages / dcache_free_reserve;
+}
+
+/*
+ * Takes an unused entry out of the in-use list and removes any backing inode
+ * it has, as it is going to be overwritten or freed.
+ */
+void
+dcache_evict_locked(struct DENTRY* d)
+{
+	dcache_assert_locked();
+	KASSERT(dcache_is_unused(d), "evicting dentry %p in use", d);
+	if (d->d_inode != NULL) {
+		vfs_deref_inode(d->d_inode);
+		d->d_inode = nullptr;
+	}
+	LIST_REMOVE(&dcache_inuse, d);
+}
+
+/*
+ * Obtains an entry to fill; returns nullptr if we may not grow and every
+ * entry is in use.
+ */
 struct DENTRY*
 dcache_find_entry_to_use()
 {
 	dcache_assert_locked();
 
-	if (!LIST_EMPTY(&dcache_free)) {
-			struct DENTRY* d = LIST_HEAD(&dcache_free);
-			LIST_POP_HEAD(&dcache_free);
-			return d;
+	if (dcache_may_grow()) {
+		dcache_num_items++;
+		return static_cast<struct DENTRY*>(slab_alloc(&dcache_dentry_cache));
 	}
 
 	/*
 	 * Our dcache is ordered from old-to-new, so we'll start at the back and
-	 * take anything which has no refs and isn't a root dentry.
+	 * take anything which has no refs and isn't a root dentry. Entries which
+	 * were referenced since we last looked are moved to the front instead.
 	 */
 	LIST_FOREACH_REVERSE_SAFE(&dcache_inuse, d, struct DENTRY) {
-		if (d->d_refcount == 0 && (d->d_flags & DENTRY_FLAG_ROOT) == 0) {
-			// This dentry should be good to use - remove any backing inode it has,
-			// as we will overwrite it
-			if (d->d_inode != NULL) {
-				vfs_deref_inode(d->d_inode);
-				d->d_inode = nullptr;
-			}
-
+		if (d->d_flags & DENTRY_FLAG_REFERENCED) {
+			d->d_flags &= ~DENTRY_FLAG_REFERENCED;
 			LIST_REMOVE(&dcache_inuse, d);
+			LIST_PREPEND(&dcache_inuse, d);
+			continue;
+		}
+		if (dcache_is_unused(d)) {
+			dcache_evict_locked(d);
 			return d;
 		}
 	}
@@ -96,19 +211,170 @@ dcache_find_entry_to_use()
 	return nullptr;
 }
 
+/*
+ * Frees up to max_items unreferenced entries, starting with the oldest; if
+ * negative_only is set, only negative entries are considered. Returns the
+ * number of entries freed.
+ */
+unsigned int
+dcache_shrink_locked(unsigned int max_items, bool negative_only)
+{
+	dcache_assert_locked();
 
-} // unnamed namespace
+	unsigned int num_freed = 0;
+	LIST_FOREACH_REVERSE_SAFE(&dcache_inuse, d, struct DENTRY) {
+		if (num_freed >= max_items)
+			break;
+		if (!dcache_is_unused(d))
+			continue;
+		if (negative_only && (d->d_flags & DENTRY_FLAG_NEGATIVE) == 0)
+			continue;
+
+		dcache_evict_locked(d);
+		slab_free(&dcache_dentry_cache, d);
+		dcache_num_items--;
+		num_freed++;
+	}
+	return num_freed;
+}
+
+/*
+ * Called by the page allocator when it runs short; we cannot sleep here, so
+ * the actual work is left to our thread. Nothing is freed right away.
+ */
+unsigned int
+dcache_reclaim(unsigned int num_pages)
+{
+	if (!__atomic_exchange_n(&dcache_shrink_wakeup, true, __ATOMIC_ACQ_REL))
+		sem_signal(&dcache_shrink_sem);
+	return 0;
+}
+
+void
+dcache_shrink_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&dcache_shrink_sem);
+		__atomic_store_n(&dcache_shrink_wakeup, false, __ATOMIC_RELEASE);
+
+		dcache_lock();
+		unsigned int num_freed = dcache_shrink_locked(DCACHE_SHRINK_BATCH, true);
+		num_freed += dcache_shrink_locked(DCACHE_SHRINK_BATCH - num_freed, false);
+		dcache_unlock();
+		TRACE(VFS, INFO, "dcache shrink freed %u entries", num_freed);
+	}
+}
+
+errorcode_t
+dcache_shrink_init()
+{
+	kthread_init(&dcache_shrink_thread, "dcshrink", &dcache_shrink_thread_func, NULL);
+	thread_resume(&dcache_shrink_thread);
+	return ananas_success();
+}
+
+/*
+ * Looks up an entry in a bucket, which must be locked. Returns NULL if the
+ * entry isn't there; if it's there but still pending, 'pending' will be set.
+ */
+struct DENTRY*
+dcache_find_bucket_locked(struct DCACHE_BUCKET& bucket, struct DENTRY* parent, const char* entry, uint32_t hash, bool& pending)
+{
+	pending = false;
+	LIST_FOREACH_IP(&bucket.b_list, hash, d, struct DENTRY) {
+		if (d->d_hash != hash || d->d_parent != parent || strcmp(d->d_entry, entry) != 0)
+			continue;
+
+		/*
+		 * It's quite possible that this inode is still pending; if that is the
+		 * case, our caller should sleep and wait for the other caller to finish
+		 * up.
+		 *
+		 * XXX We shouldn't burden the caller with this!
+		 */
+		if (d->d_inode == nullptr && (d->d_flags & DENTRY_FLAG_NEGATIVE) == 0) {
+			pending = true;
+			return nullptr;
+		}
 
-static void dentry_deref_locked(struct DENTRY* de);
+		// Add an extra ref to the dentry; we'll be giving it to the caller
+		dcache_add_ref(d);
+
+		// Ensure the entry won't be the next one to be recycled
+		if ((d->d_flags & DENTRY_FLAG_REFERENCED) == 0)
+			__atomic_fetch_or(&d->d_flags, DENTRY_FLAG_REFERENCED, __ATOMIC_RELAXED);
+		return d;
+	}
+	return nullptr;
+}
+
+/* Looks up an entry in the cache; see dcache_find_bucket_locked() */
+struct DENTRY*
+dcache_find(struct DENTRY* parent, const char* entry, uint32_t hash, bool& pending)
+{
+	struct DCACHE_BUCKET& bucket = dcache_bucket_for(parent, hash);
+	spinlock_lock(&bucket.b_lock);
+	struct DENTRY* d = dcache_find_bucket_locked(bucket, parent, entry, hash, pending);
+	spinlock_unlock(&bucket.b_lock);
+	return d;
+}
+
+/* Adds an entry to its bucket; the entry must have a parent */
+void
+dcache_hash_insert(struct DENTRY* d)
+{
+	struct DCACHE_BUCKET& bucket = dcache_bucket_for(d->d_parent, d->d_hash);
+	spinlock_lock(&bucket.b_lock);
+	LIST_APPEND_IP(&bucket.b_list, hash, d);
+	spinlock_unlock(&bucket.b_lock);
+}
+
+/*
+ * Removes a reference from a dentry; if this was the final one, the dentry is
+ * taken out of its bucket and its parent is returned, which is to be
+ * dereferenced in turn. Returns nullptr otherwise.
+ */
+struct DENTRY*
+dentry_deref_one(struct DENTRY* d)
+{
+	KASSERT(d->d_refcount > 0, "invalid refcount %d", d->d_refcount);
+	if (d->d_parent == nullptr) {
+		// Root entries are not hashed (and never lose their final reference)
+		__atomic_sub_fetch(&d->d_refcount, 1, __ATOMIC_RELEASE);
+		return nullptr;
+	}
+
+	struct DCACHE_BUCKET& bucket = dcache_bucket_for(d->d_parent, d->d_hash);
+	spinlock_lock(&bucket.b_lock);
+	struct DENTRY* parent = nullptr;
+	if (__atomic_load_n(&d->d_refcount, __ATOMIC_RELAXED) == 1) {
+		// This is the final reference; nobody can find it anymore after this
+		LIST_REMOVE_IP(&bucket.b_list, hash, d);
+		parent = d->d_parent;
+		d->d_parent = nullptr;
+	}
+	// This must be our final access; the entry may be recycled once this hits zero
+	__atomic_sub_fetch(&d->d_refcount, 1, __ATOMIC_RELEASE);
+	spinlock_unlock(&bucket.b_lock);
+	return parent;
+}
+
+} // unnamed namespace
 
 struct DENTRY*
 dcache_create_root_dentry(struct VFS_MOUNTED_FS* fs)
 {
 	dcache_lock();
 
-	struct DENTRY* d = dcache_find_entry_to_use();
-	KASSERT(d != nullptr, "out of dentries"); // XXX deal with this
+	struct DENTRY* d;
+	while ((d = dcache_find_entry_to_use()) == nullptr) {
+		/* Everything is in use; wait until someone lets go of an entry */
+		dcache_unlock();
+		reschedule();
+		dcache_lock();
+	}
 
+	memset(d, 0, sizeof *d);
 	d->d_fs = fs;
 	d->d_refcount = 1; /* filesystem itself */
 	d->d_inode = NULL; /* supplied by the file system */
@@ -136,47 +402,34 @@ dcache_lookup(struct DENTRY* parent, const char* entry)
 {
 	TRACE(VFS, FUNC, "parent=%p, entry='%s'", parent, entry);
 
-	dcache_lock();
-
-	/*
-	 * XXX This is just a simple linear search which attempts to avoid
-	 * overhead by moving recent entries to the start.
-	 */
-	LIST_FOREACH(&dcache_inuse, d, struct DENTRY) {
-		if (d->d_parent != parent || strcmp(d->d_entry, entry) != 0)
-			continue;
+	/* Try the common case, a cache hit, using only the bucket lock first */
+	uint32_t hash = dcache_hash_name(entry);
+	bool pending;
+	struct DENTRY* d = dcache_find(parent, entry, hash, pending);
+	if (d != nullptr || pending) {
+		TRACE(VFS, INFO, "cache hit: parent=%p, entry='%s' => d=%p", parent, entry, d);
+		return d;
+	}
 
-		/*
-		 * It's quite possible that this inode is still pending; if that is the
-		 * case, our caller should sleep and wait for the other caller to finish
-		 * up.
-		 *
-		 * XXX We shouldn't burden the caller with this!
-		 */
-		if (d->d_inode == nullptr && (d->d_flags & DENTRY_FLAG_NEGATIVE) == 0) {
+	/* Not found; we need to add it, but someone may have beaten us to it */
+	dcache_lock();
+	while(true) {
+		d = dcache_find(parent, entry, hash, pending);
+		if (d != nullptr || pending) {
 			dcache_unlock();
-			return nullptr;
+			TRACE(VFS, INFO, "cache hit: parent=%p, entry='%s' => d=%p", parent, entry, d);
+			return d;
 		}
 
-		// Add an extra ref to the dentry; we'll be giving it to the caller. Don't use dentry_ref()
-		// here as the original refcount may be zero.
-		++d->d_refcount;
+		// Item was not found; try to get a new one or recycle an old one
+		d = dcache_find_entry_to_use();
+		if (d != nullptr)
+			break;
 
-		// Push the the item to the head of the cache
-		LIST_REMOVE(&dcache_inuse, d);
-		LIST_PREPEND(&dcache_inuse, d);
+		/* Everything is in use; wait until someone lets go of an entry and retry */
 		dcache_unlock();
-		TRACE(VFS, INFO, "cache hit: parent=%p, entry='%s' => d=%p, d.inode=%p", parent, entry, d, d->d_inode);
-		return d;
-	}
-
-	// Item was not found; try to get one from the freelist
-	struct DENTRY* d = nullptr;
-	while(d == nullptr) {
-		/* We are out of dcache entries; we should remove some of the older entries */
-		d = dcache_find_entry_to_use();
-		/* XXX we should be able to cope with the next condition, somehow */
-		KASSERT(d != nullptr, "dcache full");
+		reschedule();
+		dcache_lock();
 	}
 
 	/* Add an explicit ref to the parent dentry; it will be referenced by our new dentry */
@@ -189,8 +442,10 @@ dcache_lookup(struct DENTRY* parent, const char* entry)
 	d->d_parent = parent;
 	d->d_inode = NULL;
 	d->d_flags = 0;
+	d->d_hash = hash;
 	strcpy(d->d_entry, entry);
 	LIST_PREPEND(&dcache_inuse, d);
+	dcache_hash_insert(d);
 	dcache_unlock();
 	TRACE(VFS, INFO, "cache miss: parent=%p, entry='%s' => d=%p", parent, entry, d);
 	return d;
@@ -199,20 +454,9 @@ dcache_lookup(struct DENTRY* parent, const char* entry)
 void
 dcache_purge_old_entries()
 {
+	// Getting rid of backing inodes is why we are called
 	dcache_lock();
-	LIST_FOREACH_SAFE(&dcache_inuse, d, struct DENTRY) {
-		if (d->d_refcount > 0 || (d->d_flags & DENTRY_FLAG_ROOT))
-			continue; // in use or root, skip
-
-		// Get rid of any backing inode; this is why we are called
-		if (d->d_inode != NULL) {
-			vfs_deref_inode(d->d_inode);
-			d->d_inode = nullptr;
-		}
-
-		LIST_REMOVE(&dcache_inuse, d);
-		LIST_PREPEND(&dcache_free, d);
-	}
+	dcache_shrink_locked(dcache_num_items, false);
 	dcache_unlock();
 }
 
@@ -236,48 +480,91 @@ dcache_set_inode(struct DENTRY* de, struct VFS_INODE* inode)
 }
 
 void
-dentry_ref(struct DENTRY* d)
+dcache_cache_negative(struct DENTRY* de)
 {
-	KASSERT(d->d_refcount > 0, "invalid refcount %d", d->d_refcount);
-	d->d_refcount++;
+	KASSERT(de->d_parent != nullptr, "caching negative root entry %p", de);
+
+	struct DENTRY* victim = nullptr;
+	mutex_lock(&dcache_negative_mtx);
+	if (de->d_flags & DENTRY_FLAG_NEGCACHED) {
+		// Already there; just mark it as most recently used
+		LIST_REMOVE_IP(&dcache_negative, negative, de);
+	} else {
+		dentry_ref(de); // the negative cache holds it now
+		__atomic_fetch_or(&de->d_flags, DENTRY_FLAG_NEGCACHED, __ATOMIC_RELAXED);
+		if (++dcache_num_negative > DCACHE_NEGATIVE_MAX) {
+			victim = LIST_HEAD(&dcache_negative);
+			LIST_POP_HEAD_IP(&dcache_negative, negative);
+			__atomic_fetch_and(&victim->d_flags, ~DENTRY_FLAG_NEGCACHED, __ATOMIC_RELAXED);
+			dcache_num_negative--;
+		}
+	}
+	LIST_APPEND_IP(&dcache_negative, negative, de);
+	mutex_unlock(&dcache_negative_mtx);
+
+	if (victim != nullptr)
+		dentry_deref(victim);
 }
 
-static void
-dentry_deref_locked(struct DENTRY* d)
+void
+dcache_purge_negative(struct DENTRY* parent)
 {
-	KASSERT(d->d_refcount > 0, "invalid refcount %d", d->d_refcount);
+	struct DENTRY_NEGATIVE_LIST purged;
+	LIST_INIT(&purged);
 
-	// Remove a reference; if this brings us to zero, we need to remove it
-	if (--d->d_refcount > 0)
-		return;
-
-	// We do not free backing inodes here - the reason is that we don't know
-	// how they are to be re-looked up.
+	mutex_lock(&dcache_negative_mtx);
+	LIST_FOREACH_SAFE_IP(&dcache_negative, negative, d, struct DENTRY) {
+		if (d->d_parent != parent)
+			continue;
+		LIST_REMOVE_IP(&dcache_negative, negative, d);
+		__atomic_fetch_and(&d->d_flags, ~DENTRY_FLAG_NEGCACHED, __ATOMIC_RELAXED);
+		dcache_num_negative--;
+		LIST_APPEND_IP(&purged, negative, d);
+	}
+	mutex_unlock(&dcache_negative_mtx);
 
-	// Free our reference to the parent
-	if (d->d_parent != NULL) {
-		dentry_deref_locked(d->d_parent);
-		d->d_parent = nullptr;
+	// We hold the references, so nobody else can touch the list fields
+	LIST_FOREACH_SAFE_IP(&purged, negative, d, struct DENTRY) {
+		dentry_deref(d);
 	}
 }
 
+void
+dentry_ref(struct DENTRY* d)
+{
+	KASSERT(d->d_refcount > 0, "invalid refcount %d", d->d_refcount);
+	dcache_add_ref(d);
+}
+
 void
 dentry_unlink(struct DENTRY* de)
 {
-	dcache_lock();
-	de->d_flags |= DENTRY_FLAG_NEGATIVE;
-	if (de->d_inode != nullptr)
-		vfs_deref_inode(de->d_inode);
-  de->d_inode = nullptr;
-	dcache_unlock();
+	// Lookups inspect the inode under the bucket lock, so change it there
+	struct VFS_INODE* inode;
+	if (de->d_parent != nullptr) {
+		struct DCACHE_BUCKET& bucket = dcache_bucket_for(de->d_parent, de->d_hash);
+		spinlock_lock(&bucket.b_lock);
+		__atomic_fetch_or(&de->d_flags, DENTRY_FLAG_NEGATIVE, __ATOMIC_RELAXED);
+		inode = de->d_inode;
+		de->d_inode = nullptr;
+		spinlock_unlock(&bucket.b_lock);
+	} else {
+		__atomic_fetch_or(&de->d_flags, DENTRY_FLAG_NEGATIVE, __ATOMIC_RELAXED);
+		inode = de->d_inode;
+		de->d_inode = nullptr;
+	}
+	if (inode != nullptr)
+		vfs_deref_inode(inode);
 }
 
 void
 dentry_deref(struct DENTRY* de)
 {
-	dcache_lock();
-	dentry_deref_locked(de);
-	dcache_unlock();
+	// We do not free backing inodes here - the reason is that we don't know
+	// how they are to be re-looked up. Dropping the final reference does drop
+	// the one to the parent, though.
+	while (de != nullptr)
+		de = dentry_deref_one(de);
 }
 
 void
@@ -287,6 +574,14 @@ dcache_purge()
 	dcache_unlock();
 }
 
+void
+dcache_get_status(char* buf, size_t len)
+{
+	unsigned int num_items = dcache_num_items, num_negative = dcache_num_negative;
+	snprintf(buf, len, "dcache dentries %u negative %u bytes %u\n",
+	 num_items, num_negative, (unsigned int)(num_items * sizeof(struct DENTRY)));
+}
+
 #ifdef OPTION_KDB
 KDB_COMMAND(dcache, NULL, "Show dentry cache")
 {
@@ -301,10 +596,13 @@ KDB_COMMAND(dcache, NULL, "Show dentry cache")
 		 d->d_flags, d->d_refcount);
 		n++;
 	}
-	kprintf("dentry cache contains %u entries\n", n);
+	kprintf("dentry cache contains %u in-use entries, %u allocated, %u negative cached\n", n, dcache_num_items, dcache_num_negative);
 }
 #endif
 
 INIT_FUNCTION(dcache_init, SUBSYSTEM_VFS, ORDER_FIRST);
+INIT_FUNCTION(dcache_shrink_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+TUNABLE_UINT("dcache.min_items", dcache_min_items, 0, 0x7fffffff, nullptr, "Directory entries the cache may always have");
+TUNABLE_UINT("dcache.free_reserve", dcache_free_reserve, 1, 1024, nullptr, "Directory entry cache stops growing below 1/n of memory free");
 
 /* vim:set ts=2 sw=2: */
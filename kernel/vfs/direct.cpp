@@ -0,0 +1,238 @@
+/*
+ * Direct I/O; see <ananas/vfs/direct.h>.
+ *
+ * The pages of the caller's buffer are made resident and referenced, mapped
+ * into kernel space and handed to the device as uncached bio's; the buffer
+ * cache takes care of blocks that it happens to hold. Writes keep the page
+ * cache current, but reads do not look at it: data that is only written to a
+ * shared mapping is not seen until it is synced.
+ *
+ * Writes only overwrite blocks the file already has; anything beyond that is
+ * passed on to the filesystem's ordinary write function.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <ananas/bio.h>
+#include <ananas/error.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/process.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/direct.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
+
+TRACE_SETUP;
+
+namespace {
+
+/* The pages of the caller's buffer used by a single transfer */
+struct DIRECT_PAGES {
+	unsigned int dp_num_pages;
+	addr_t dp_virt[BIO_DIRECT_MAX_BLOCKS];
+	struct VM_PAGE* dp_vmpage[BIO_DIRECT_MAX_BLOCKS];
+	char* dp_data[BIO_DIRECT_MAX_BLOCKS];
+};
+
+inline vmspace_t*
+direct_get_vmspace()
+{
+	thread_t* curthread = PCPU_GET(curthread);
+	if (curthread == nullptr || curthread->t_process == nullptr)
+		return nullptr;
+	return curthread->t_process->p_vmspace;
+}
+
+void
+direct_release_pages(struct DIRECT_PAGES* dp)
+{
+	kmem_unmap_many(reinterpret_cast<void* const*>(dp->dp_data), PAGE_SIZE, dp->dp_num_pages);
+	for (unsigned int n = 0; n < dp->dp_num_pages; n++)
+		vmpage_deref(dp->dp_vmpage[n]);
+	dp->dp_num_pages = 0;
+}
+
+/*
+ * Returns a kernel mapping of the caller's buffer at virt, which must not
+ * cross a page; the page is made resident and referenced, so that it stays
+ * around while the device uses it. to_buffer is set if the device will write
+ * to the buffer.
+ */
+errorcode_t
+direct_map_buffer(vmspace_t* vs, struct DIRECT_PAGES* dp, addr_t virt, bool to_buffer, void** data)
+{
+	addr_t v_page = virt & ~(PAGE_SIZE - 1);
+	if (dp->dp_num_pages == 0 || dp->dp_virt[dp->dp_num_pages - 1] != v_page) {
+		KASSERT(dp->dp_num_pages < BIO_DIRECT_MAX_BLOCKS, "too many pages");
+
+		/* Ensure the page is there, and that it is our own if we are to write to it */
+		errorcode_t err = vmspace_handle_fault(vs, v_page, to_buffer ? VM_FLAG_WRITE : VM_FLAG_READ);
+		ANANAS_ERROR_RETURN(err);
+		vmspace_lock_read(vs);
+		vmarea_t* va = vmspace_find_area(vs, v_page);
+		struct VM_PAGE* vp = nullptr;
+		if (va != nullptr) {
+			vmarea_lock(va);
+			vp = vmarea_lookup_page(va, v_page);
+			if (vp != nullptr)
+				vmpage_ref(vp);
+			vmarea_unlock(va);
+		}
+		vmspace_unlock_read(vs);
+		if (vp == nullptr)
+			return ANANAS_ERROR(BAD_ADDRESS);
+
+		unsigned int n = dp->dp_num_pages++;
+		dp->dp_virt[n] = v_page;
+		dp->dp_vmpage[n] = vp;
+		dp->dp_data[n] = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+	}
+	*data = dp->dp_data[dp->dp_num_pages - 1] + (virt - v_page);
+	return ananas_success();
+}
+
+/*
+ * Transfers the blocks at the file offset directly; stops once the blocks of
+ * the file run out when writing. Any part of len not handled is left to the
+ * caller.
+ */
+errorcode_t
+direct_transfer(struct VFS_FILE* file, addr_t buf, size_t* len, bool write)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	vmspace_t* vs = direct_get_vmspace();
+	size_t block_size = fs->fs_block_size;
+	size_t done = 0;
+	size_t left = *len;
+	if (!write && inode->i_sb.st_size - file->f_offset < (off_t)left)
+		left = (inode->i_sb.st_size > file->f_offset) ? inode->i_sb.st_size - file->f_offset : 0;
+
+	errorcode_t err = ananas_success();
+	int inode_dirty = 0;
+	while (left > 0) {
+		if (!vfs_is_filesystem_sane(fs)) {
+			err = ANANAS_ERROR(IO);
+			break;
+		}
+
+		/* Map as many blocks as we can; when writing, only the ones the file has */
+		blocknr_t logical_block = file->f_offset / block_size;
+		unsigned int num_blocks = (left + block_size - 1) / block_size;
+		if (num_blocks > BIO_DIRECT_MAX_BLOCKS)
+			num_blocks = BIO_DIRECT_MAX_BLOCKS;
+		if (write) {
+			blocknr_t file_blocks = (inode->i_sb.st_size + block_size - 1) / block_size;
+			if (logical_block >= file_blocks)
+				break;
+			if (logical_block + num_blocks > file_blocks)
+				num_blocks = file_blocks - logical_block;
+		}
+		blocknr_t first_block;
+		err = vfs_block_map_range(inode, logical_block, &first_block, &num_blocks);
+		if (ananas_is_failure(err))
+			break;
+
+		struct DIRECT_PAGES dp;
+		dp.dp_num_pages = 0;
+		void* data[BIO_DIRECT_MAX_BLOCKS];
+		for (unsigned int n = 0; n < num_blocks && ananas_is_success(err); n++)
+			err = direct_map_buffer(vs, &dp, buf + n * block_size, !write, &data[n]);
+		if (ananas_is_success(err))
+			err = bio_transfer_direct(fs->fs_device, first_block * (block_size / BIO_SECTOR_SIZE), num_blocks, block_size, data, write);
+
+		size_t chunk_len = num_blocks * block_size;
+		if (chunk_len > left)
+			chunk_len = left;
+		if (ananas_is_success(err) && write) {
+			/* Keep the page cache in sync; blocks never cross a page */
+			for (unsigned int n = 0; n < num_blocks; n++)
+				vfs_pagecache_update(inode, file->f_offset + n * block_size, data[n], block_size);
+		}
+		direct_release_pages(&dp);
+		if (ananas_is_failure(err))
+			break;
+
+		done += chunk_len;
+		buf += chunk_len;
+		left -= chunk_len;
+		file->f_offset += chunk_len;
+		if (write && file->f_offset > inode->i_sb.st_size) {
+			inode->i_sb.st_size = file->f_offset;
+			inode_dirty++;
+		}
+	}
+
+	if (inode_dirty)
+		vfs_set_inode_dirty(inode);
+
+	/* If some data was transferred, that is what we report */
+	if (ananas_is_failure(err) && done == 0)
+		return err;
+	*len = done;
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+bool
+vfs_direct_possible(struct VFS_FILE* file, const void* buf, size_t len)
+{
+	if (file->f_dentry == NULL || len == 0)
+		return false;
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	if (inode->i_iops->block_map == NULL || fs->fs_device == NULL || fs->fs_block_size > PAGE_SIZE)
+		return false;
+
+	/* Everything must be block-aligned, so that a block never crosses a page */
+	size_t block_size = fs->fs_block_size;
+	addr_t virt = reinterpret_cast<addr_t>(buf);
+	if ((virt % block_size) != 0 || (file->f_offset % block_size) != 0 || (len % block_size) != 0)
+		return false;
+
+	/* The buffer must be ordinary userland memory */
+	vmspace_t* vs = direct_get_vmspace();
+	if (vs == nullptr)
+		return false;
+	vmspace_lock_read(vs);
+	vmarea_t* va = vmspace_find_area(vs, virt);
+	bool ok = va != nullptr && (va->va_flags & VM_FLAG_USER) && (va->va_flags & VM_FLAG_DEVICE) == 0 &&
+	 virt + len <= va->va_virt + va->va_len;
+	vmspace_unlock_read(vs);
+	return ok;
+}
+
+errorcode_t
+vfs_direct_read(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	TRACE(VFS, FUNC, "file=%p, buf=%p, len=%u", file, buf, *len);
+	return direct_transfer(file, reinterpret_cast<addr_t>(buf), len, false);
+}
+
+errorcode_t
+vfs_direct_write(struct VFS_FILE* file, const void* buf, size_t* len)
+{
+	TRACE(VFS, FUNC, "file=%p, buf=%p, len=%u", file, buf, *len);
+	size_t amount = *len;
+	errorcode_t err = direct_transfer(file, reinterpret_cast<addr_t>(buf), &amount, true);
+	ANANAS_ERROR_RETURN(err);
+	if (amount == *len)
+		return ananas_success();
+
+	/* Whatever lies beyond the blocks of the file needs new blocks; leave that to the filesystem */
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	size_t rest = *len - amount;
+	err = inode->i_iops->write(file, static_cast<const char*>(buf) + amount, &rest);
+	if (ananas_is_failure(err) && amount == 0)
+		return err;
+	*len = amount + (ananas_is_success(err) ? rest : 0);
+	return ananas_success();
+}
+
+/* vim:set ts=2 sw=2: */
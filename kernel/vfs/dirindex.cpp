@@ -0,0 +1,234 @@
+/*
+ * Directory indices; see <ananas/vfs/dirindex.h>.
+ *
+ * An index is a hash table of all names in the directory, protected by the
+ * directory's inode lock. Every change to a directory bumps the inode's
+ * i_dirgen, so that an index built by a scan which overlapped a change is
+ * thrown away instead of hooked up.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/lib.h>
+#include <ananas/list.h>
+#include <ananas/mm.h>
+#include <ananas/trace.h>
+#include <ananas/vfs/dirindex.h>
+#include <ananas/vfs/types.h>
+
+TRACE_SETUP;
+
+#define VFS_DIRINDEX_LOAD		2	/* Grow the hash table beyond this many entries per bucket */
+
+struct VFS_DIRINDEX_ENTRY {
+	LIST_FIELDS(struct VFS_DIRINDEX_ENTRY);
+	uint32_t die_hash;
+	ino_t die_inum;
+	char die_name[1];		/* NUL-terminated */
+};
+
+LIST_DEFINE(VFS_DIRINDEX_BUCKET, struct VFS_DIRINDEX_ENTRY);
+
+struct VFS_DIRINDEX {
+	unsigned int di_gen;		/* i_dirgen when the scan was started */
+	unsigned int di_num_entries;
+	unsigned int di_hash_bits;	/* Hash table has 2^di_hash_bits buckets, or none while building */
+	struct VFS_DIRINDEX_BUCKET* di_bucket;
+	struct VFS_DIRINDEX_BUCKET di_building;	/* Entries collected so far, while building */
+};
+
+namespace {
+
+/* FNV-1a */
+inline uint32_t
+dirindex_hash(const char* name, unsigned int name_len)
+{
+	uint32_t hash = 2166136261U;
+	for (unsigned int n = 0; n < name_len; n++)
+		hash = (hash ^ static_cast<uint8_t>(name[n])) * 16777619U;
+	return hash;
+}
+
+inline struct VFS_DIRINDEX_BUCKET*
+dirindex_bucket_for(struct VFS_DIRINDEX* di, uint32_t hash)
+{
+	return &di->di_bucket[hash & ((1U << di->di_hash_bits) - 1)];
+}
+
+struct VFS_DIRINDEX_ENTRY*
+dirindex_make_entry(const char* name, unsigned int name_len, ino_t inum)
+{
+	auto die = static_cast<struct VFS_DIRINDEX_ENTRY*>(kmalloc(sizeof(struct VFS_DIRINDEX_ENTRY) + name_len));
+	die->die_hash = dirindex_hash(name, name_len);
+	die->die_inum = inum;
+	memcpy(die->die_name, name, name_len);
+	die->die_name[name_len] = '\0';
+	return die;
+}
+
+struct VFS_DIRINDEX_ENTRY*
+dirindex_find(struct VFS_DIRINDEX* di, const char* name)
+{
+	uint32_t hash = dirindex_hash(name, strlen(name));
+	LIST_FOREACH(dirindex_bucket_for(di, hash), die, struct VFS_DIRINDEX_ENTRY) {
+		if (die->die_hash == hash && strcmp(die->die_name, name) == 0)
+			return die;
+	}
+	return nullptr;
+}
+
+/* (Re)distributes all entries of di over 2^bits buckets */
+void
+dirindex_rehash(struct VFS_DIRINDEX* di, unsigned int bits)
+{
+	auto new_bucket = new VFS_DIRINDEX_BUCKET[1 << bits];
+	for (unsigned int i = 0; i < (1U << bits); i++)
+		LIST_INIT(&new_bucket[i]);
+
+	struct VFS_DIRINDEX_BUCKET* old_bucket = di->di_bucket;
+	unsigned int old_buckets = (old_bucket != nullptr) ? 1U << di->di_hash_bits : 0;
+	di->di_bucket = new_bucket;
+	di->di_hash_bits = bits;
+	for (unsigned int i = 0; i < old_buckets; i++) {
+		LIST_FOREACH_SAFE(&old_bucket[i], die, struct VFS_DIRINDEX_ENTRY) {
+			LIST_APPEND(dirindex_bucket_for(di, die->die_hash), die);
+		}
+	}
+	LIST_FOREACH_SAFE(&di->di_building, die, struct VFS_DIRINDEX_ENTRY) {
+		LIST_APPEND(dirindex_bucket_for(di, die->die_hash), die);
+	}
+	LIST_INIT(&di->di_building);
+	delete[] old_bucket;
+}
+
+void
+dirindex_free(struct VFS_DIRINDEX* di)
+{
+	unsigned int num_buckets = (di->di_bucket != nullptr) ? 1U << di->di_hash_bits : 0;
+	for (unsigned int i = 0; i < num_buckets; i++) {
+		LIST_FOREACH_SAFE(&di->di_bucket[i], die, struct VFS_DIRINDEX_ENTRY) {
+			kfree(die);
+		}
+	}
+	LIST_FOREACH_SAFE(&di->di_building, die, struct VFS_DIRINDEX_ENTRY) {
+		kfree(die);
+	}
+	delete[] di->di_bucket;
+	delete di;
+}
+
+} // unnamed namespace
+
+errorcode_t
+vfs_dirindex_lookup(struct VFS_INODE* inode, const char* name, ino_t* inum)
+{
+	INODE_LOCK(inode);
+	struct VFS_DIRINDEX* di = inode->i_dirindex;
+	if (di == nullptr) {
+		INODE_UNLOCK(inode);
+		return ANANAS_ERROR(NO_RESOURCE);
+	}
+
+	struct VFS_DIRINDEX_ENTRY* die = dirindex_find(di, name);
+	if (die != nullptr)
+		*inum = die->die_inum;
+	INODE_UNLOCK(inode);
+	return (die != nullptr) ? ananas_success() : ANANAS_ERROR(NO_FILE);
+}
+
+struct VFS_DIRINDEX*
+vfs_dirindex_begin(struct VFS_INODE* inode)
+{
+	auto di = new VFS_DIRINDEX;
+	memset(di, 0, sizeof(*di));
+	LIST_INIT(&di->di_building);
+
+	INODE_LOCK(inode);
+	di->di_gen = inode->i_dirgen;
+	INODE_UNLOCK(inode);
+	return di;
+}
+
+unsigned int
+vfs_dirindex_collect(struct VFS_DIRINDEX* di, const char* name, unsigned int name_len, ino_t inum)
+{
+	LIST_APPEND(&di->di_building, dirindex_make_entry(name, name_len, inum));
+	return ++di->di_num_entries;
+}
+
+void
+vfs_dirindex_finish(struct VFS_INODE* inode, struct VFS_DIRINDEX* di, bool complete)
+{
+	if (complete && di->di_num_entries >= VFS_DIRINDEX_MIN_ENTRIES) {
+		/* Size the table for what we have; it'll grow if many names are added */
+		unsigned int bits = 1;
+		while (bits < 16 && (VFS_DIRINDEX_LOAD << bits) < di->di_num_entries)
+			bits++;
+		dirindex_rehash(di, bits);
+
+		INODE_LOCK(inode);
+		if (inode->i_dirindex == nullptr && inode->i_dirgen == di->di_gen) {
+			inode->i_dirindex = di;
+			di = nullptr;
+		}
+		INODE_UNLOCK(inode);
+		if (di == nullptr) {
+			TRACE(VFS, INFO, "inode=%p: indexed directory", inode);
+			return;
+		}
+	}
+	dirindex_free(di);
+}
+
+void
+vfs_dirindex_add(struct VFS_INODE* inode, const char* name, ino_t inum)
+{
+	struct VFS_DIRINDEX_ENTRY* die = dirindex_make_entry(name, strlen(name), inum);
+
+	INODE_LOCK(inode);
+	inode->i_dirgen++;
+	struct VFS_DIRINDEX* di = inode->i_dirindex;
+	if (di != nullptr) {
+		struct VFS_DIRINDEX_ENTRY* old_die = dirindex_find(di, name);
+		if (old_die != nullptr) {
+			old_die->die_inum = inum;
+		} else {
+			LIST_APPEND(dirindex_bucket_for(di, die->die_hash), die);
+			die = nullptr;
+			if (++di->di_num_entries > (VFS_DIRINDEX_LOAD << di->di_hash_bits) && di->di_hash_bits < 16)
+				dirindex_rehash(di, di->di_hash_bits + 1);
+		}
+	}
+	INODE_UNLOCK(inode);
+	if (die != nullptr)
+		kfree(die);
+}
+
+void
+vfs_dirindex_remove(struct VFS_INODE* inode, const char* name)
+{
+	INODE_LOCK(inode);
+	inode->i_dirgen++;
+	struct VFS_DIRINDEX_ENTRY* die = nullptr;
+	struct VFS_DIRINDEX* di = inode->i_dirindex;
+	if (di != nullptr) {
+		die = dirindex_find(di, name);
+		if (die != nullptr) {
+			LIST_REMOVE(dirindex_bucket_for(di, die->die_hash), die);
+			di->di_num_entries--;
+		}
+	}
+	INODE_UNLOCK(inode);
+	if (die != nullptr)
+		kfree(die);
+}
+
+void
+vfs_dirindex_purge(struct VFS_INODE* inode)
+{
+	inode->i_dirgen++;
+	if (inode->i_dirindex != nullptr)
+		dirindex_free(inode->i_dirindex);
+	inode->i_dirindex = nullptr;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -1,16 +1,41 @@
 #include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
 #include <ananas/bio.h>
 #include <ananas/device.h>
 #include <ananas/error.h>
+#include <ananas/kmem.h>
 #include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/process.h>
+#include <ananas/thread.h>
 #include <ananas/trace.h>
+#include <ananas/tunable.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
 
 TRACE_SETUP;
 
 #define VFS_DEBUG_LOOKUP 0
 
+/*
+ * Reads of at least this size hand out page cache pages to userland instead of
+ * copying them; smaller reads are likely to have their buffer modified, which
+ * would just cause the copy to be made on the write fault instead.
+ */
+#define VFS_READ_LEND_MIN	(4 * PAGE_SIZE)
+
+#define VFS_RA_MIN_PAGES	4	/* Initial readahead window */
+
+static unsigned int vfs_ra_max_pages = 64;	/* Readahead window limit */
+TUNABLE_UINT("vfs.readahead_max_pages", vfs_ra_max_pages, VFS_RA_MIN_PAGES, 4096, nullptr, "Readahead window limit for file reads");
+
+#define VFS_WRITE_MAX_BLOCKS	16	/* Blocks written using a single request */
+
 errorcode_t
 vfs_generic_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
 {
@@ -21,99 +46,221 @@ vfs_generic_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const ch
 	kprintf("vfs_generic_lookup(); parent=%p dentry='%s'\n", parent, dentry);
 #endif
 
-	/*
-	 * XXX This is a very naive implementation which does not use the
-	 * possible directory index.
-	 */
 	struct VFS_INODE* parent_inode = parent->d_inode;
 	KASSERT(S_ISDIR(parent_inode->i_sb.st_mode), "supplied inode is not a directory");
 
-	/* Rewind the directory back; we'll be traversing it from front to back */
+	/* If the directory was indexed, this settles it */
+	ino_t inum;
+	errorcode_t err = vfs_dirindex_lookup(parent_inode, dentry, &inum);
+	if (ananas_is_success(err))
+		return vfs_get_inode(parent_inode->i_fs, inum, destinode);
+	if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_NO_FILE)
+		return err;
+
+	/*
+	 * Scan the directory; we collect the entries as we go so that large
+	 * directories are indexed the first time they are scanned completely.
+	 * Rewind the directory back; we'll be traversing it from front to back.
+	 */
+	struct VFS_DIRINDEX* di = vfs_dirindex_begin(parent_inode);
+	bool found = false;
 	struct VFS_FILE dirf;
 	memset(&dirf, 0, sizeof(dirf));
 	dirf.f_offset = 0;
 	dirf.f_dentry = parent;
 	while (1) {
-		if (!vfs_is_filesystem_sane(parent_inode->i_fs))
+		if (!vfs_is_filesystem_sane(parent_inode->i_fs)) {
+			vfs_dirindex_finish(parent_inode, di, false);
 			return ANANAS_ERROR(IO);
+		}
 
 		size_t buf_len = sizeof(buf);
-		errorcode_t err = vfs_read(&dirf, buf, &buf_len);
-		if (ananas_is_failure(err))
+		err = vfs_read(&dirf, buf, &buf_len);
+		if (ananas_is_failure(err)) {
+			vfs_dirindex_finish(parent_inode, di, false);
 			return err;
+		}
 		if (buf_len == 0)
-			return ANANAS_ERROR(NO_FILE);
+			break;
 
+		unsigned int num_entries = 0;
 		char* cur_ptr = buf;
 		while (buf_len > 0) {
 			struct VFS_DIRENT* de = (struct VFS_DIRENT*)cur_ptr;
 			buf_len -= DE_LENGTH(de); cur_ptr += DE_LENGTH(de);
+			num_entries = vfs_dirindex_collect(di, de->de_name, de->de_name_length, de->de_inum);
 
 #ifdef DEBUG_VFS_LOOKUP
 			kprintf("vfs_generic_lookup('%s'): comparing with '%s'\n", dentry, de->de_name);
 #endif
 	
-			if (strcmp(de->de_name, dentry) != 0)
+			if (found || strcmp(de->de_name, dentry) != 0)
 				continue;
 
 			/* Found it! */
-			return vfs_get_inode(parent_inode->i_fs, de->de_inum, destinode);
+			found = true;
+			inum = de->de_inum;
 		}
+
+		/* Small directories aren't worth indexing; stop scanning once we have the entry */
+		if (found && num_entries < VFS_DIRINDEX_MIN_ENTRIES) {
+			vfs_dirindex_finish(parent_inode, di, false);
+			return vfs_get_inode(parent_inode->i_fs, inum, destinode);
+		}
+	}
+
+	vfs_dirindex_finish(parent_inode, di, true);
+	if (!found)
+		return ANANAS_ERROR(NO_FILE);
+	return vfs_get_inode(parent_inode->i_fs, inum, destinode);
+}
+
+/*
+ * Updates the readahead state of file for a read of len bytes at the current
+ * offset; as long as reads are sequential, the window doubles and is kept
+ * ahead of the reader. Reads are only started once half of the window has
+ * been consumed, so that they are issued in batches.
+ */
+static void
+vfs_generic_readahead(struct VFS_FILE* file, size_t len)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	off_t offset = file->f_offset;
+	off_t read_end = offset + len;
+	bool sequential = offset == file->f_ra_next;
+	file->f_ra_next = read_end;
+	if (!sequential) {
+		/* Random access; just read what is asked for */
+		file->f_ra_pages = 0;
+		file->f_ra_end = 0;
+		return;
 	}
+
+	if (file->f_ra_pages == 0)
+		file->f_ra_pages = VFS_RA_MIN_PAGES;
+	else if (file->f_ra_pages < vfs_ra_max_pages)
+		file->f_ra_pages *= 2;
+	if (file->f_ra_pages > vfs_ra_max_pages)
+		file->f_ra_pages = vfs_ra_max_pages;
+
+	off_t window = (off_t)file->f_ra_pages * PAGE_SIZE;
+	if (file->f_ra_end - read_end >= window / 2)
+		return; /* still plenty underway */
+
+	off_t ra_start = ROUND_DOWN(offset, PAGE_SIZE);
+	if (ra_start < file->f_ra_end)
+		ra_start = file->f_ra_end;
+	off_t ra_end = ROUND_DOWN(read_end, PAGE_SIZE) + window;
+	vfs_pagecache_readahead(inode, ra_start, ra_end);
+	file->f_ra_end = ra_end;
 }
 
 errorcode_t
 vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
 {
 	struct VFS_INODE* inode = file->f_dentry->d_inode;
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	size_t read = 0;
 	size_t left = *len;
-	struct BIO* bio = NULL;
 
-	KASSERT(inode->i_iops->block_map != NULL, "called without block_map implementation");
+	KASSERT(inode->i_iops->block_map != NULL || inode->i_iops->fill_page != NULL, "called without block_map or fill_page implementation");
 
 	/* Adjust left so that we don't attempt to read beyond the end of the file */
 	if ((inode->i_sb.st_size - file->f_offset) < left) {
 		left = inode->i_sb.st_size - file->f_offset;
 	}
+	if (left > 0)
+		vfs_generic_readahead(file, left);
+
+	/* See if we can map whole pages into the caller's address space */
+	vmspace_t* vs = nullptr;
+	thread_t* curthread = PCPU_GET(curthread);
+	if (left >= VFS_READ_LEND_MIN && curthread != nullptr && curthread->t_process != nullptr)
+		vs = curthread->t_process->p_vmspace;
 
-	blocknr_t cur_block = 0;
 	while(left > 0) {
 		if (!vfs_is_filesystem_sane(inode->i_fs))
 			return ANANAS_ERROR(IO);
 
-		/* Figure out which block to use next */
-		blocknr_t want_block;
-		errorcode_t err = inode->i_iops->block_map(inode, (file->f_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
+		/* Fetch the page holding the data; this is shared with any mappings of the file */
+		off_t page_offset = ROUND_DOWN(file->f_offset, PAGE_SIZE);
+		struct VM_PAGE* vp;
+		errorcode_t err = vfs_pagecache_get(file->f_dentry, page_offset, &vp);
 		ANANAS_ERROR_RETURN(err);
 
-		/* Grab the next block if necessary */
-		if (cur_block != want_block || bio == NULL) {
-			if (bio != NULL) bio_free(bio);
-			err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
-			cur_block = want_block;
+		addr_t dest = reinterpret_cast<addr_t>(buf);
+		if (vs != nullptr && file->f_offset == page_offset && left >= PAGE_SIZE &&
+		    (dest & (PAGE_SIZE - 1)) == 0 && vmspace_lend_page(vs, dest, vp)) {
+			vmpage_unlock(vp);
+			read += PAGE_SIZE;
+			buf = static_cast<void*>(static_cast<char*>(buf) + PAGE_SIZE);
+			left -= PAGE_SIZE;
+			file->f_offset += PAGE_SIZE;
+			continue;
 		}
 
-		/* Copy as much from the current entry as we can */
-		off_t cur_offset = file->f_offset % (blocknr_t)fs->fs_block_size;
-		int chunk_len = fs->fs_block_size - cur_offset;
+		/*
+		 * Do not hold the page lock while copying; buf may be a mapping of this
+		 * very page, and faulting it in needs the lock. Our reference keeps the
+		 * page around.
+		 */
+		vmpage_ref(vp);
+		vmpage_unlock(vp);
+
+		/* Copy as much from the current page as we can */
+		off_t cur_offset = file->f_offset - page_offset;
+		size_t chunk_len = PAGE_SIZE - cur_offset;
 		if (chunk_len > left)
 			chunk_len = left;
 		KASSERT(chunk_len > 0, "attempt to handle empty chunk");
-		memcpy(buf, (void*)(static_cast<char*>(BIO_DATA(bio)) + cur_offset), chunk_len);
+		struct PAGE* p = vmpage_get_page(vp);
+		void* data = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ);
+		memcpy(buf, static_cast<char*>(data) + cur_offset, chunk_len);
+		kmem_unmap(data, PAGE_SIZE);
+		vmpage_deref(vp);
 
 		read += chunk_len;
 		buf = static_cast<void*>(static_cast<char*>(buf) + chunk_len);
 		left -= chunk_len;
 		file->f_offset += chunk_len;
 	}
-	if (bio != NULL) bio_free(bio);
 	*len = read;
 	return ananas_success();
 }
 
+/*
+ * Returns whether block n of a write of len bytes, starting at cur_offset in
+ * block 0, replaces the entire block; only the first and last may not.
+ */
+static inline bool
+vfs_generic_write_is_whole(struct VFS_MOUNTED_FS* fs, unsigned int n, off_t cur_offset, size_t len)
+{
+	return (n > 0 || cur_offset == 0) && (n + 1) * (off_t)fs->fs_block_size - cur_offset <= (off_t)len;
+}
+
+/*
+ * Obtains the bio's of num_blocks blocks starting at first_block, to write
+ * len bytes to; blocks which are to be replaced completely are not read.
+ */
+static errorcode_t
+vfs_generic_write_get_blocks(struct VFS_MOUNTED_FS* fs, blocknr_t first_block, unsigned int num_blocks, off_t cur_offset, size_t len, bool create, struct BIO** bios)
+{
+	for (unsigned int n = 0; n < num_blocks; /* nothing */) {
+		bool whole = create || vfs_generic_write_is_whole(fs, n, cur_offset, len);
+		unsigned int run = 1;
+		while (n + run < num_blocks && (create || vfs_generic_write_is_whole(fs, n + run, cur_offset, len)) == whole)
+			run++;
+
+		errorcode_t err = vfs_bget_range(fs, first_block + n, run, &bios[n], whole ? BIO_READ_NODATA : 0);
+		if (ananas_is_failure(err)) {
+			while (n > 0)
+				bio_free(bios[--n]);
+			return err;
+		}
+		n += run;
+	}
+	return ananas_success();
+}
+
 errorcode_t
 vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t* len)
 {
@@ -121,62 +268,84 @@ vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t* len)
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	size_t written = 0;
 	size_t left = *len;
-	struct BIO* bio = NULL;
 
 	KASSERT(inode->i_iops->block_map != NULL, "called without block_map implementation");
 
 	int inode_dirty = 0;
-	blocknr_t cur_block = 0;
 	while(left > 0) {
-		int create = 0;
-		blocknr_t logical_block = file->f_offset / (blocknr_t)fs->fs_block_size;
-		if (logical_block >= inode->i_sb.st_blocks /* XXX is this correct with sparse files? */)
-			create++;
-
 		if (!vfs_is_filesystem_sane(inode->i_fs))
 			return ANANAS_ERROR(IO);
 
-		/* Figure out which block to use next */
-		blocknr_t want_block;
-		errorcode_t err = inode->i_iops->block_map(inode, logical_block, &want_block, create);
+		/* Figure out which blocks to use next */
+		blocknr_t logical_block = file->f_offset / (blocknr_t)fs->fs_block_size;
+		off_t cur_offset = file->f_offset % (blocknr_t)fs->fs_block_size;
+		blocknr_t first_block;
+		unsigned int num_blocks = 1;
+		int create = 0;
+		errorcode_t err;
+		if (logical_block >= inode->i_sb.st_blocks /* XXX is this correct with sparse files? */) {
+			/* New blocks are allocated one at a time */
+			create++;
+			err = inode->i_iops->block_map(inode, logical_block, &first_block, create);
+		} else {
+			/* Existing blocks; take as many as we can, as long as they are adjacent */
+			blocknr_t file_blocks = (inode->i_sb.st_size + fs->fs_block_size - 1) / (blocknr_t)fs->fs_block_size;
+			num_blocks = (cur_offset + left + fs->fs_block_size - 1) / fs->fs_block_size;
+			if (num_blocks > VFS_WRITE_MAX_BLOCKS)
+				num_blocks = VFS_WRITE_MAX_BLOCKS;
+			if (logical_block + num_blocks > file_blocks)
+				num_blocks = (logical_block < file_blocks) ? file_blocks - logical_block : 1;
+			err = vfs_block_map_range(inode, logical_block, &first_block, &num_blocks);
+		}
+		ANANAS_ERROR_RETURN(err);
+
+		struct BIO* bios[VFS_WRITE_MAX_BLOCKS];
+		err = vfs_generic_write_get_blocks(fs, first_block, num_blocks, cur_offset, left, create, bios);
 		ANANAS_ERROR_RETURN(err);
 
-		/* Calculate how much we have to put in the block */
-		off_t cur_offset = file->f_offset % (blocknr_t)fs->fs_block_size;
-		int chunk_len = fs->fs_block_size - cur_offset;
-		if (chunk_len > left)
-			chunk_len = left;
+		for (unsigned int n = 0; n < num_blocks; n++) {
+			/* Calculate how much we have to put in the block */
+			off_t block_offset = (n == 0) ? cur_offset : 0;
+			off_t chunk_len = fs->fs_block_size - block_offset;
+			if (chunk_len > left)
+				chunk_len = left;
 
-		/* Grab the next block if necessary */
-		if (cur_block != want_block || bio == NULL) {
-			if (bio != NULL) bio_free(bio);
-			/* Only read the block if it's a new one or we're not replacing everything */
-			err = vfs_bget(fs, want_block, &bio, (create || chunk_len == fs->fs_block_size) ? BIO_READ_NODATA : 0);
-			ANANAS_ERROR_RETURN(err);
-			cur_block = want_block;
-		}
+			/* Copy as much to the block as we can */
+			KASSERT(chunk_len > 0, "attempt to handle empty chunk");
+			char* data = static_cast<char*>(BIO_DATA(bios[n])) + block_offset;
+			memcpy(data, buf, chunk_len);
+			bio_set_dirty(bios[n]);
 
-		/* Copy as much to the block as we can */
-		KASSERT(chunk_len > 0, "attempt to handle empty chunk");
-		memcpy((void*)(static_cast<char*>(BIO_DATA(bio)) + cur_offset), buf, chunk_len);
-		bio_set_dirty(bio);
+			/*
+			 * Keep the page cache in sync; we copy from the block as buf may be
+			 * backed by the very page we are updating.
+			 */
+			for (off_t done = 0; done < chunk_len; ) {
+				off_t offset = file->f_offset + done;
+				off_t page_len = ROUND_DOWN(offset, PAGE_SIZE) + PAGE_SIZE - offset;
+				if (page_len > chunk_len - done)
+					page_len = chunk_len - done;
+				vfs_pagecache_update(inode, offset, data + done, page_len);
+				done += page_len;
+			}
+			bio_free(bios[n]);
 
-		/* Update the offsets and sizes */
-		written += chunk_len;
-		buf = static_cast<const void*>(static_cast<const char*>(buf) + chunk_len);
-		left -= chunk_len;
-		file->f_offset += chunk_len;
+			/* Update the offsets and sizes */
+			written += chunk_len;
+			buf = static_cast<const void*>(static_cast<const char*>(buf) + chunk_len);
+			left -= chunk_len;
+			file->f_offset += chunk_len;
 
-		/*
-		 * If we had to create a new block or we'd have to write beyond the current
-		 * inode's size, enlarge the inode and mark it as dirty.
-		 */
-		if (create || file->f_offset > inode->i_sb.st_size) {
-			inode->i_sb.st_size = file->f_offset;
-			inode_dirty++;
+			/*
+			 * If we had to create a new block or we'd have to write beyond the current
+			 * inode's size, enlarge the inode and mark it as dirty.
+			 */
+			if (create || file->f_offset > inode->i_sb.st_size) {
+				inode->i_sb.st_size = file->f_offset;
+				inode_dirty++;
+			}
 		}
 	}
-	if (bio != NULL) bio_free(bio);
 	*len = written;
 
 	if (inode_dirty)
@@ -1,6 +1,9 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/exec.h>
+#include <ananas/hashtable.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/icache.h>
 #include <ananas/mm.h>
 #include <ananas/kdb.h>
@@ -8,8 +11,12 @@
 #include <ananas/lock.h>
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
+#include <ananas/tunable.h>
 #include <ananas/vmpage.h>
 #include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
 #include "options.h"
 
 TRACE_SETUP;
@@ -20,13 +27,50 @@ TRACE_SETUP;
 
 namespace {
 
-#define ICACHE_ITEMS 32
+#define ICACHE_MIN_HASH_BITS	6	/* Initial hash table size, in bits */
+#define ICACHE_MAX_HASH_BITS	16
+#define ICACHE_HASH_LOAD	2	/* Grow the hash table beyond this many inodes per bucket */
+#define ICACHE_RECLAIM_BATCH	64	/* Inodes evicted per call by the page daemon at most */
 
 LIST_DEFINE(INODE_LIST, struct VFS_INODE);
+LIST_DEFINE(INODE_BUCKET, struct VFS_INODE);
+LIST_DEFINE(INODE_DIRTY_LIST, struct VFS_INODE);
 
-mutex_t icache_mtx;
-struct INODE_LIST icache_inuse;
+void icache_inode_ctor(void* obj)
+{
+	auto inode = static_cast<struct VFS_INODE*>(obj);
+	memset(inode, 0, sizeof(*inode));
+	mutex_init(&inode->i_mutex, "inode");
+}
+
+SLAB_CACHE_DEFINE(icache_inode_cache, struct VFS_INODE, icache_inode_ctor);
+
+mutex_t icache_mtx; /* Protects everything below */
+struct INODE_LIST icache_inuse; /* Cached inodes, most recently used first */
 struct INODE_LIST icache_free;
+struct INODE_BUCKET* icache_bucket;
+unsigned int icache_hash_bits; /* Hash table has 2^icache_hash_bits buckets */
+unsigned int icache_num_items; /* Number of inodes allocated */
+
+/* Tunables; see /ankh/sys */
+unsigned int icache_min_items = 32; /* Number of inodes we may always have */
+unsigned int icache_free_reserve = 8; /* Stop growing if less than 1/icache_free_reserve of memory is available */
+
+/*
+ * Dirty inodes are queued, oldest first, and written back by the 'inodeflush'
+ * thread; the queue holds a reference to each of them, so they cannot be
+ * evicted until written. The dirty flag of an inode is only changed while
+ * holding both icache_dirty_mtx and the inode lock, in that order.
+ */
+mutex_t icache_dirty_mtx; /* Protects the fields below */
+struct INODE_DIRTY_LIST icache_dirty;
+bool icache_flush_wakeup;
+mutex_t icache_writeback_mtx; /* Serializes write-back */
+semaphore_t icache_flush_sem;
+thread_t icache_flush_thread;
+
+struct PAGE_RECLAIMER icache_reclaimer;
+unsigned int icache_reclaim(unsigned int num_pages);
 
 inline void icache_lock()
 {
@@ -43,6 +87,20 @@ inline void icache_assert_locked()
 	mutex_assert(&icache_mtx, MTX_LOCKED);
 }
 
+/* Hashes an inode to one of 2^bits buckets; see bio_hash() */
+inline unsigned int
+icache_hash(struct VFS_MOUNTED_FS* fs, ino_t inum, unsigned int bits)
+{
+	uint64_t key = static_cast<uint64_t>(inum) ^ (static_cast<uint64_t>(reinterpret_cast<addr_t>(fs)) * HASH_GOLDEN_RATIO_64);
+	return Ananas::HashInteger(key, bits);
+}
+
+inline struct INODE_BUCKET*
+icache_bucket_for(struct VFS_MOUNTED_FS* fs, ino_t inum)
+{
+	return &icache_bucket[icache_hash(fs, inum, icache_hash_bits)];
+}
+
 errorcode_t
 icache_init()
 {
@@ -50,34 +108,67 @@ icache_init()
 	LIST_INIT(&icache_inuse);
 	LIST_INIT(&icache_free);
 
-	// Allocate inodes - we can set up some basic information here
-	// XXX we could use a slab allocator for this
-	{
-		auto inode = static_cast<struct VFS_INODE*>(kmalloc(ICACHE_ITEMS * sizeof(struct VFS_INODE)));
-		memset(inode, 0, ICACHE_ITEMS * sizeof(struct VFS_INODE));
-		for (int i = 0; i < ICACHE_ITEMS; i++, inode++) {
-			mutex_init(&inode->i_mutex, "inode");
-			LIST_APPEND(&icache_free, inode);
-		}
-	}
-
+	/* Start with a small hash table; it grows along with the cache */
+	icache_hash_bits = ICACHE_MIN_HASH_BITS;
+	icache_bucket = new INODE_BUCKET[1 << icache_hash_bits];
+	for (unsigned int i = 0; i < (1U << icache_hash_bits); i++)
+		LIST_INIT(&icache_bucket[i]);
+
+	mutex_init(&icache_dirty_mtx, "icachedirty");
+	mutex_init(&icache_writeback_mtx, "icachewriteback");
+	LIST_INIT(&icache_dirty);
+	sem_init(&icache_flush_sem, 0);
+
+	/* Evicting inodes needs their locks, so only the page daemon may do it */
+	icache_reclaimer.pr_name = "icache";
+	icache_reclaimer.pr_func = icache_reclaim;
+	icache_reclaimer.pr_flags = PAGE_RECLAIMER_F_DAEMON;
+	page_register_reclaimer(&icache_reclaimer);
 	return ananas_success();
 }
 
+/* Doubles the hash table; called once the chains get too long */
 void
-icache_purge_old_entries()
+icache_hash_grow()
 {
 	icache_assert_locked();
-	icache_unlock();
 
-	/*
-	 * Remove any stale entries from the dentry cache - this will release their
-	 * inodes, which means we will be able to purge them from the icache.
-	 */
-	dcache_purge_old_entries();
+	unsigned int new_bits = icache_hash_bits + 1;
+	auto new_bucket = new INODE_BUCKET[1 << new_bits];
+	for (unsigned int i = 0; i < (1U << new_bits); i++)
+		LIST_INIT(&new_bucket[i]);
 
-	icache_lock();
-	LIST_FOREACH_REVERSE_SAFE(&icache_inuse, inode, struct VFS_INODE) {
+	LIST_FOREACH(&icache_inuse, inode, struct VFS_INODE) {
+		LIST_APPEND_IP(&new_bucket[icache_hash(inode->i_fs, inode->i_inum, new_bits)], hash, inode);
+	}
+	delete[] icache_bucket;
+	icache_bucket = new_bucket;
+	icache_hash_bits = new_bits;
+	TRACE(VFS, INFO, "inode hash table grown to %u buckets", 1 << new_bits);
+}
+
+/* Returns whether the cache may allocate more inodes */
+bool
+icache_may_grow()
+{
+	if (icache_num_items < icache_min_items)
+		return true;
+
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	return avail_pages > total_pages / icache_free_reserve;
+}
+
+/*
+ * Throws away the least recently used inode which has no references left and
+ * returns it, or NULL if there is no such inode.
+ */
+struct VFS_INODE*
+icache_evict_locked()
+{
+	icache_assert_locked();
+
+	LIST_FOREACH_REVERSE(&icache_inuse, inode, struct VFS_INODE) {
 		/*
 		 * Skip any pending items (we are not responsible for their cleanup (and
 		 * to do so would be to introduce a race in vfs_read_inode()) and anything
@@ -89,7 +180,21 @@ icache_purge_old_entries()
 			continue;
 		}
 
-		// Throw the actual inode away
+		/*
+		 * Recently executed files get a second chance, so that binaries which are
+		 * run over and over keep their parsed image and text pages cached.
+		 */
+		if (inode->i_flags & INODE_FLAG_EXEC_RECENT) {
+			inode->i_flags &= ~INODE_FLAG_EXEC_RECENT;
+			INODE_UNLOCK(inode);
+			continue;
+		}
+
+		// Throw the actual inode away, along with any cached pages: they belong to
+		// this file, not to whatever the inode will be used for next
+		vfs_pagecache_purge(inode);
+		vfs_dirindex_purge(inode);
+		exec_image_purge(inode);
 		struct VFS_MOUNTED_FS* fs = inode->i_fs;
 		if (fs->fs_fsops->discard_inode != NULL)
 			fs->fs_fsops->discard_inode(inode);
@@ -99,12 +204,18 @@ icache_purge_old_entries()
 		inode->i_flags |= INODE_FLAG_GONE;
 		INODE_UNLOCK(inode);
 
-		// Move the inode to the freelist as we can re-use it again
 		LIST_REMOVE(&icache_inuse, inode);
-		LIST_APPEND(&icache_free, inode);
+		LIST_REMOVE_IP(icache_bucket_for(inode->i_fs, inode->i_inum), hash, inode);
+		return inode;
 	}
+	return nullptr;
 }
 
+/*
+ * Obtains an inode to fill; this may need to drop the icache lock, so the
+ * caller must check whether someone else added the inode in the meantime.
+ * Waits until an inode becomes available if every inode is in use.
+ */
 struct VFS_INODE*
 icache_find_item_to_use()
 {
@@ -118,21 +229,242 @@ icache_find_item_to_use()
 			return inode;
 		}
 
-		/* Freelist is empty; we need to sacrifice an item from the cache */
-		icache_purge_old_entries();
+		if (icache_may_grow()) {
+			auto inode = static_cast<struct VFS_INODE*>(slab_alloc(&icache_inode_cache));
+			icache_num_items++;
+			if (icache_hash_bits < ICACHE_MAX_HASH_BITS && icache_num_items > (ICACHE_HASH_LOAD << icache_hash_bits))
+				icache_hash_grow();
+			return inode;
+		}
+
+		/* We may not grow anymore; we need to sacrifice an item from the cache */
+		struct VFS_INODE* inode = icache_evict_locked();
+		if (inode != nullptr)
+			return inode;
+
+		/*
+		 * Remove any stale entries from the dentry cache - this will release their
+		 * inodes, which means we will be able to evict them from the icache.
+		 */
+		icache_unlock();
+		dcache_purge_old_entries();
+		icache_lock();
+		inode = icache_evict_locked();
+		if (inode != nullptr)
+			return inode;
 
 		/*
-		 * XXX next condition is too harsh - we should wait until we have an
-		 *     available inode here...
+		 * Everything is in use; wait until someone lets go of an inode. Their
+		 * references are often held by dentries, which only let go once they
+		 * are purged, so there is nothing to wake us up - just try again later.
 		 */
-		KASSERT(!LIST_EMPTY(&icache_free), "icache still full after purge??");
+		TRACE(VFS, WARN, "all %u inodes in use, waiting", icache_num_items);
+		icache_unlock();
+		reschedule();
+		icache_lock();
 	}
 
 	// NOTREACHED
 }
 
+/*
+ * Called by the page daemon: evicts unused inodes, least recently used first,
+ * which throws away the pages they have cached. Any inodes beyond the ones we
+ * may always have are freed as well.
+ */
+unsigned int
+icache_reclaim(unsigned int num_pages)
+{
+	unsigned int total_pages, avail_before, avail_pages;
+	page_get_stats(&total_pages, &avail_before);
+	avail_pages = avail_before;
+
+	icache_lock();
+	for (unsigned int n = 0; n < ICACHE_RECLAIM_BATCH && avail_pages < avail_before + num_pages; n++) {
+		struct VFS_INODE* inode = icache_evict_locked();
+		if (inode == nullptr)
+			break;
+		if (icache_num_items > icache_min_items) {
+			slab_free(&icache_inode_cache, inode);
+			icache_num_items--;
+		} else
+			LIST_APPEND(&icache_free, inode);
+		page_get_stats(&total_pages, &avail_pages);
+	}
+	icache_unlock();
+	return (avail_pages > avail_before) ? avail_pages - avail_before : 0;
+}
+
+/*
+ * Removes a pending inode which could not be filled from the cache; it must
+ * not be locked and the caller's reference is dropped.
+ */
+void
+icache_discard_pending(struct VFS_INODE* inode)
+{
+	icache_lock();
+	KASSERT(inode->i_refcount == 1 && (inode->i_flags & INODE_FLAG_PENDING), "discarding inode %p in use", inode);
+	LIST_REMOVE(&icache_inuse, inode);
+	LIST_REMOVE_IP(icache_bucket_for(inode->i_fs, inode->i_inum), hash, inode);
+	inode->i_refcount = -1;
+	inode->i_privdata = nullptr;
+	inode->i_flags |= INODE_FLAG_GONE;
+	LIST_APPEND(&icache_free, inode);
+	icache_unlock();
+}
+
+/* Looks up an inode in the cache; must be called with the icache lock held */
+struct VFS_INODE*
+icache_find_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
+{
+	icache_assert_locked();
+	LIST_FOREACH_IP(icache_bucket_for(fs, inum), hash, inode, struct VFS_INODE) {
+		if (inode->i_fs == fs && inode->i_inum == inum)
+			return inode;
+	}
+	return nullptr;
+}
+
+/*
+ * Takes inode off the dirty queue, if it is there; returns whether it was, in
+ * which case the caller gets the queue's reference. Must be called with
+ * icache_dirty_mtx held.
+ */
+bool
+icache_undirty_locked(struct VFS_INODE* inode)
+{
+	mutex_assert(&icache_dirty_mtx, MTX_LOCKED);
+	INODE_LOCK(inode);
+	bool dirty = (inode->i_flags & INODE_FLAG_DIRTY) != 0;
+	inode->i_flags &= ~INODE_FLAG_DIRTY;
+	INODE_UNLOCK(inode);
+	if (dirty)
+		LIST_REMOVE_IP(&icache_dirty, dirty, inode);
+	return dirty;
+}
+
+/*
+ * Writes an inode taken off the dirty queue and drops the queue's reference.
+ * The flag is already cleared, so any change made while we are writing will
+ * queue the inode once more. Must be called with icache_writeback_mtx held.
+ */
+void
+icache_write_inode(struct VFS_INODE* inode)
+{
+	mutex_assert(&icache_writeback_mtx, MTX_LOCKED);
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	TRACE(VFS, INFO, "writing dirty inode %p (inum %lx)", inode, inode->i_inum);
+	if (vfs_is_filesystem_sane(fs))
+		fs->fs_fsops->write_inode(inode);
+	vfs_deref_inode(inode);
+}
+
+/*
+ * Writes back dirty inodes of fs (of any filesystem if NULL) until none are
+ * left; returns the number of inodes written.
+ */
+unsigned int
+icache_writeback(struct VFS_MOUNTED_FS* fs)
+{
+	mutex_lock(&icache_writeback_mtx);
+	unsigned int num_written = 0;
+	while(true) {
+		struct VFS_INODE* inode = nullptr;
+		mutex_lock(&icache_dirty_mtx);
+		LIST_FOREACH_IP(&icache_dirty, dirty, it, struct VFS_INODE) {
+			if (fs == nullptr || it->i_fs == fs) {
+				inode = it;
+				break;
+			}
+		}
+		if (inode != nullptr)
+			icache_undirty_locked(inode);
+		mutex_unlock(&icache_dirty_mtx);
+		if (inode == nullptr)
+			break;
+
+		icache_write_inode(inode);
+		num_written++;
+	}
+	mutex_unlock(&icache_writeback_mtx);
+	return num_written;
+}
+
+void
+icache_flush_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&icache_flush_sem);
+
+		/* Anything dirtied from here on will wake us up again */
+		mutex_lock(&icache_dirty_mtx);
+		icache_flush_wakeup = false;
+		mutex_unlock(&icache_dirty_mtx);
+
+		icache_writeback(nullptr);
+	}
+}
+
+errorcode_t
+icache_flush_init()
+{
+	/*
+	 * As with bioflush, running only when there is nothing else to do lets
+	 * changes to the same inode pile up and be written just once.
+	 */
+	kthread_init(&icache_flush_thread, "inodeflush", &icache_flush_thread_func, NULL);
+	icache_flush_thread.t_priority = THREAD_PRIORITY_IDLE - 1;
+	thread_resume(&icache_flush_thread);
+	return ananas_success();
+}
+
 } // unnamed namespace
 
+void
+vfs_set_inode_dirty(struct VFS_INODE* inode)
+{
+	KASSERT(inode->i_fs->fs_fsops->write_inode != NULL, "dirtying inode %p without write_inode", inode);
+
+	mutex_lock(&icache_dirty_mtx);
+	INODE_LOCK(inode);
+	INODE_ASSERT_SANE(inode);
+	bool queue = (inode->i_flags & INODE_FLAG_DIRTY) == 0;
+	if (queue) {
+		/* The queue holds a reference, so the inode will stay around until written */
+		inode->i_flags |= INODE_FLAG_DIRTY;
+		++inode->i_refcount;
+	}
+	INODE_UNLOCK(inode);
+	if (queue)
+		LIST_APPEND_IP(&icache_dirty, dirty, inode);
+	bool wakeup = queue && !icache_flush_wakeup;
+	if (wakeup)
+		icache_flush_wakeup = true;
+	mutex_unlock(&icache_dirty_mtx);
+
+	if (wakeup)
+		sem_signal(&icache_flush_sem);
+}
+
+void
+vfs_sync_inode(struct VFS_INODE* inode)
+{
+	/* Waiting for the write-back lock also waits for any write of this inode in progress */
+	mutex_lock(&icache_writeback_mtx);
+	mutex_lock(&icache_dirty_mtx);
+	bool dirty = icache_undirty_locked(inode);
+	mutex_unlock(&icache_dirty_mtx);
+	if (dirty)
+		icache_write_inode(inode);
+	mutex_unlock(&icache_writeback_mtx);
+}
+
+void
+vfs_sync_inodes(struct VFS_MOUNTED_FS* fs)
+{
+	icache_writeback(fs);
+}
+
 void
 vfs_deref_inode(struct VFS_INODE* inode)
 {
@@ -175,14 +507,8 @@ icache_lookup_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
 {
 	icache_lock();
 
-	/*
-	 * XXX This is just a simple linear search which attempts to avoid
-	 * overhead by moving recent entries to the start
-	 */
-	LIST_FOREACH(&icache_inuse, inode, struct VFS_INODE) {
-		if (inode->i_fs != fs || inode->i_inum != inum)
-			continue;
-
+	struct VFS_INODE* inode = icache_find_locked(fs, inum);
+	if (inode != nullptr) {
 		// We found the inode - lock it so that it won't go
 		INODE_LOCK(inode);
 
@@ -194,7 +520,6 @@ icache_lookup_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
 		if (inode->i_flags & INODE_FLAG_PENDING) {
 			INODE_UNLOCK(inode);
 			icache_unlock();
-			kprintf("icache_lookup(): pending item, waiting\n");
 			return NULL;
 		}
 
@@ -221,8 +546,15 @@ icache_lookup_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
 		return inode;
 	}
 
-	/* Fetch a new item and place it at the head; it's most recently used after all */
-	struct VFS_INODE* inode = icache_find_item_to_use();
+	/* Fetch a new item; this may drop the lock, so someone may have beaten us to it */
+	inode = icache_find_item_to_use();
+	if (icache_find_locked(fs, inum) != nullptr) {
+		LIST_APPEND(&icache_free, inode);
+		icache_unlock();
+		return NULL; /* caller will retry and find it */
+	}
+
+	/* Place the item at the head; it's most recently used after all */
 	TRACE(VFS, INFO, "cache miss: fs=%p, inum=%lx => inode=%p", fs, inum, inode);
 	LIST_PREPEND(&icache_inuse, inode);
 
@@ -235,6 +567,7 @@ icache_lookup_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
 	inode->i_sb.st_dev = (dev_t)(uintptr_t)fs->fs_device;
 	inode->i_sb.st_rdev = (dev_t)(uintptr_t)fs->fs_device;
 	inode->i_sb.st_blksize = fs->fs_block_size;
+	LIST_PREPEND_IP(icache_bucket_for(fs, inum), hash, inode);
 	icache_unlock();
 	return inode;
 }
@@ -279,7 +612,7 @@ vfs_get_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, struct VFS_INODE** destinod
 		result = fs->fs_fsops->prepare_inode(inode);
 	if (ananas_is_failure(result)) {
 		INODE_UNLOCK(inode);
-		vfs_deref_inode(inode); /* throws it away */
+		icache_discard_pending(inode);
 		return result;
 	}
 
@@ -290,7 +623,7 @@ vfs_get_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, struct VFS_INODE** destinod
 	result = fs->fs_fsops->read_inode(inode, inum);
 	if (ananas_is_failure(result)) {
 		INODE_UNLOCK(inode);
-		vfs_deref_inode(inode); /* throws it away */
+		icache_discard_pending(inode);
 		return result;
 	}
 
@@ -303,6 +636,77 @@ vfs_get_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, struct VFS_INODE** destinod
 	return ananas_success();
 }
 
+bool
+vfs_add_speculative_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, icache_fill_func_t fill, const void* data)
+{
+	TRACE(VFS, FUNC, "fs=%p, inum=%lx", fs, inum);
+
+	/*
+	 * Our caller may hold an inode lock, which someone holding the icache lock
+	 * could be waiting for; so we must not wait, and hold on to the icache lock
+	 * until we are done as we cannot take it again.
+	 */
+	if (!mutex_trylock(&icache_mtx))
+		return false;
+	if (icache_find_locked(fs, inum) != nullptr) {
+		icache_unlock();
+		return false;
+	}
+
+	/* Only use inodes which are up for grabs; this must not push anything out */
+	struct VFS_INODE* inode = nullptr;
+	if (!LIST_EMPTY(&icache_free)) {
+		inode = LIST_HEAD(&icache_free);
+		LIST_POP_HEAD(&icache_free);
+	} else if (icache_may_grow()) {
+		inode = static_cast<struct VFS_INODE*>(slab_alloc(&icache_inode_cache));
+		icache_num_items++;
+		if (icache_hash_bits < ICACHE_MAX_HASH_BITS && icache_num_items > (ICACHE_HASH_LOAD << icache_hash_bits))
+			icache_hash_grow();
+	}
+	if (inode == nullptr) {
+		icache_unlock();
+		return false;
+	}
+
+	/* Nobody else can know about this inode yet, so this will not block */
+	INODE_LOCK(inode);
+	inode->i_refcount = 0;
+	inode->i_flags = INODE_FLAG_PENDING;
+	inode->i_fs = fs;
+	inode->i_inum = inum;
+	inode->i_sb.st_dev = (dev_t)(uintptr_t)fs->fs_device;
+	inode->i_sb.st_rdev = (dev_t)(uintptr_t)fs->fs_device;
+	inode->i_sb.st_blksize = fs->fs_block_size;
+
+	errorcode_t err = ananas_success();
+	if (fs->fs_fsops->prepare_inode != NULL)
+		err = fs->fs_fsops->prepare_inode(inode);
+	if (ananas_is_success(err)) {
+		err = fill(inode, inum, data);
+		if (ananas_is_failure(err) && fs->fs_fsops->discard_inode != NULL)
+			fs->fs_fsops->discard_inode(inode);
+	}
+	if (ananas_is_failure(err)) {
+		inode->i_refcount = -1;
+		inode->i_privdata = nullptr;
+		inode->i_flags = INODE_FLAG_GONE;
+		INODE_UNLOCK(inode);
+		LIST_APPEND(&icache_free, inode);
+		icache_unlock();
+		return false;
+	}
+
+	/* Nobody asked for this inode, so it is the first to go if the space is needed */
+	inode->i_flags &= ~INODE_FLAG_PENDING;
+	INODE_UNLOCK(inode);
+	LIST_APPEND(&icache_inuse, inode);
+	LIST_PREPEND_IP(icache_bucket_for(fs, inum), hash, inode);
+	icache_unlock();
+	TRACE(VFS, INFO, "speculative: fs=%p, inum=%lx => inode=%p", fs, inum, inode);
+	return true;
+}
+
 void
 vfs_dump_inode(struct VFS_INODE* inode)
 {
@@ -318,6 +722,14 @@ vfs_dump_inode(struct VFS_INODE* inode)
 	}
 }
 
+void
+icache_get_status(char* buf, size_t len)
+{
+	unsigned int num_items = icache_num_items;
+	snprintf(buf, len, "icache inodes %u bytes %u\n",
+	 num_items, (unsigned int)(num_items * sizeof(struct VFS_INODE)));
+}
+
 #ifdef OPTION_KDB
 KDB_COMMAND(icache, NULL, "Show inode cache")
 {
@@ -328,10 +740,13 @@ KDB_COMMAND(icache, NULL, "Show inode cache")
 			vfs_dump_inode(inode);
 		n++;
 	}               
-	kprintf("Inode cache contains %u entries\n", n);
+	kprintf("Inode cache contains %u entries (%u allocated, %u hash buckets)\n", n, icache_num_items, 1U << icache_hash_bits);
 }
 #endif
 
 INIT_FUNCTION(icache_init, SUBSYSTEM_VFS, ORDER_FIRST);
+INIT_FUNCTION(icache_flush_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+TUNABLE_UINT("icache.min_items", icache_min_items, 0, 0x7fffffff, nullptr, "Inodes the cache may always have");
+TUNABLE_UINT("icache.free_reserve", icache_free_reserve, 1, 1024, nullptr, "Inode cache stops growing below 1/n of memory free");
 
 /* vim:set ts=2 sw=2: */
@@ -167,6 +167,8 @@ vfs_unmount(const char* path)
 			fs->fs_mountpoint = NULL;
 			spinlock_unlock(&Ananas::VFS::spl_mountedfs);
 			/* XXX Ask filesystem politely to unmount */
+			vfs_sync_inodes(fs);
+			bio_sync(fs->fs_device);
 			fs->fs_flags = 0; /* Available */
 			return ananas_success();
 		}
@@ -175,6 +177,33 @@ vfs_unmount(const char* path)
 	return ANANAS_ERROR(BAD_HANDLE); /* XXX */
 }
 
+errorcode_t
+vfs_sync_all()
+{
+	/* Writing the inodes dirties buffers, so these go first */
+	vfs_sync_inodes(nullptr);
+
+	/* Committing may sleep, so figure out which devices to commit beforehand */
+	Ananas::Device* devices[Ananas::VFS::Max_Mounted_FS];
+	unsigned int num_devices = 0;
+	spinlock_lock(&Ananas::VFS::spl_mountedfs);
+	for (unsigned int n = 0; n < Ananas::VFS::Max_Mounted_FS; n++) {
+		struct VFS_MOUNTED_FS* fs = &Ananas::VFS::mountedfs[n];
+		if ((fs->fs_flags & VFS_FLAG_INUSE) == 0 || (fs->fs_flags & VFS_FLAG_ABANDONED) || fs->fs_device == nullptr)
+			continue;
+		devices[num_devices++] = fs->fs_device;
+	}
+	spinlock_unlock(&Ananas::VFS::spl_mountedfs);
+
+	errorcode_t result = ananas_success();
+	for (unsigned int n = 0; n < num_devices; n++) {
+		errorcode_t err = bio_commit(devices[n]);
+		if (ananas_is_failure(err))
+			result = err;
+	}
+	return result;
+}
+
 struct VFS_MOUNTED_FS*
 vfs_get_rootfs()
 {
@@ -0,0 +1,464 @@
+/*
+ * Page cache; file data is cached a page at a time as VM pages hooked to the
+ * inode. Both read()/write() and mappings of the file use these pages, so
+ * that there is only a single copy of the data in memory.
+ *
+ * BIO buffers are only used to transfer the blocks making up the page.
+ *
+ * Filesystems which fill pages themselves, for example by decompressing them,
+ * do not benefit from issuing the block reads early; their readahead pages are
+ * filled by a pool of fill threads instead, so that this work is spread over
+ * the available CPUs.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <ananas/bio.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/radix.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/core.h>
+#include <ananas/vfs/icache.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+
+TRACE_SETUP;
+
+namespace {
+
+#define PAGECACHE_MAX_BLOCKS	(PAGE_SIZE / BIO_SECTOR_SIZE)
+#define PAGECACHE_FILL_MAX_THREADS	8	/* Never start more fill threads than this */
+#define PAGECACHE_FILL_MAX_QUEUED	64	/* Readahead is skipped beyond this many queued pages */
+
+/* A page to be filled by a fill thread */
+struct PAGECACHE_FILL {
+	struct VFS_INODE* pf_inode;
+	off_t pf_offset;
+	LIST_FIELDS(struct PAGECACHE_FILL);
+};
+
+LIST_DEFINE(PAGECACHE_FILL_QUEUE, struct PAGECACHE_FILL);
+
+spinlock_t spl_fill = SPINLOCK_DEFAULT_INIT;
+struct PAGECACHE_FILL_QUEUE fill_queue;
+unsigned int fill_queue_len = 0;
+semaphore_t fill_sem;
+thread_t fill_thread[PAGECACHE_FILL_MAX_THREADS];
+bool fill_running = false;
+SLAB_CACHE_DEFINE(fill_cache, struct PAGECACHE_FILL, nullptr);
+
+/*
+ * Obtains the bio's of the file blocks covering [offset, end), which must be
+ * within a single page; contiguous runs of blocks are fetched using a single
+ * request each. Does not wait for the reads to complete; flags are passed on
+ * to vfs_bget_range().
+ */
+errorcode_t
+pagecache_get_blocks(struct VFS_INODE* inode, off_t offset, off_t end, struct BIO** bios, unsigned int* num_bios, int flags)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	blocknr_t blocks[PAGECACHE_MAX_BLOCKS];
+	unsigned int num_blocks = 0;
+	for (off_t pos = offset; pos < end; /* nothing */) {
+		blocknr_t logical_block = pos / (blocknr_t)fs->fs_block_size;
+		unsigned int run = (end - 1) / (blocknr_t)fs->fs_block_size - logical_block + 1;
+		errorcode_t err = vfs_block_map_range(inode, logical_block, &blocks[num_blocks], &run);
+		ANANAS_ERROR_RETURN(err);
+		for (unsigned int n = 1; n < run; n++)
+			blocks[num_blocks + n] = blocks[num_blocks] + n;
+		num_blocks += run;
+		pos = (logical_block + run) * (blocknr_t)fs->fs_block_size;
+	}
+
+	*num_bios = 0;
+	for (unsigned int n = 0; n < num_blocks; /* nothing */) {
+		unsigned int run = 1;
+		while (n + run < num_blocks && blocks[n + run] == blocks[n] + run)
+			run++;
+		errorcode_t err = vfs_bget_range(fs, blocks[n], run, &bios[n], BIO_READ_ASYNC | flags);
+		ANANAS_ERROR_RETURN(err);
+		n += run;
+		*num_bios = n;
+	}
+	return ananas_success();
+}
+
+/*
+ * Reads the page at offset using the filesystem's block mapping; the reads of
+ * all blocks making up the page are submitted before waiting for any of them.
+ */
+errorcode_t
+pagecache_read_blocks(struct VFS_INODE* inode, char* page, off_t offset)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	off_t end = offset + PAGE_SIZE;
+	if (end > inode->i_sb.st_size)
+		end = inode->i_sb.st_size;
+
+	struct BIO* bios[PAGECACHE_MAX_BLOCKS];
+	unsigned int num_bios = 0;
+	errorcode_t err = pagecache_get_blocks(inode, offset, end, bios, &num_bios, 0);
+	bio_wait_all(bios, num_bios);
+
+	off_t pos = offset;
+	for (unsigned int n = 0; n < num_bios; n++) {
+		struct BIO* bio = bios[n];
+		if (ananas_is_success(err) && BIO_IS_ERROR(bio))
+			err = ANANAS_ERROR(IO);
+		if (ananas_is_success(err)) {
+			off_t cur_offset = pos % (blocknr_t)fs->fs_block_size;
+			off_t chunk_len = fs->fs_block_size - cur_offset;
+			if (chunk_len > end - pos)
+				chunk_len = end - pos;
+			memcpy(page + (pos - offset), static_cast<char*>(BIO_DATA(bio)) + cur_offset, chunk_len);
+			pos += chunk_len;
+		}
+		bio_free(bio);
+	}
+	ANANAS_ERROR_RETURN(err);
+
+	/* Beyond the end of the file; this part of the page is always zero */
+	memset(page + (pos - offset), 0, offset + PAGE_SIZE - pos);
+	return ananas_success();
+}
+
+/*
+ * Maps block logical_block of the inode, allocating it if the file has none
+ * there yet; filesystems only allocate at the end of the file, so this may
+ * take several rounds if the file was extended without writing to it.
+ */
+errorcode_t
+pagecache_map_block_create(struct VFS_INODE* inode, blocknr_t logical_block, blocknr_t* block_out)
+{
+	while(true) {
+		errorcode_t err = inode->i_iops->block_map(inode, logical_block, block_out, 0);
+		if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_RANGE)
+			return err;
+
+		blocknr_t new_block;
+		err = inode->i_iops->block_map(inode, logical_block, &new_block, 1);
+		ANANAS_ERROR_RETURN(err);
+	}
+}
+
+/*
+ * Writes the page at offset back using the filesystem's block mapping; pages
+ * written through a shared mapping may cover blocks which do not exist yet,
+ * these are allocated here.
+ */
+errorcode_t
+pagecache_write_blocks(struct VFS_INODE* inode, const char* page, off_t offset)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	off_t end = offset + PAGE_SIZE;
+	if (end > inode->i_sb.st_size)
+		end = inode->i_sb.st_size;
+	blocknr_t want_block = 0;
+	unsigned int run = 0;
+	bool created = false;
+	for (off_t pos = offset; pos < end; ) {
+		if (run == 0) {
+			blocknr_t logical_block = pos / (blocknr_t)fs->fs_block_size;
+			run = (end - 1) / (blocknr_t)fs->fs_block_size - logical_block + 1;
+			errorcode_t err = vfs_block_map_range(inode, logical_block, &want_block, &run);
+			created = ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE;
+			if (created) {
+				err = pagecache_map_block_create(inode, logical_block, &want_block);
+				run = 1;
+			}
+			ANANAS_ERROR_RETURN(err);
+		}
+
+		off_t cur_offset = pos % (blocknr_t)fs->fs_block_size;
+		off_t chunk_len = fs->fs_block_size - cur_offset;
+		if (chunk_len > end - pos)
+			chunk_len = end - pos;
+
+		/* Only read the block if we're not replacing everything; new blocks hold nothing yet */
+		struct BIO* bio;
+		errorcode_t err = vfs_bget(fs, want_block, &bio, (created || chunk_len == fs->fs_block_size) ? BIO_READ_NODATA : 0);
+		ANANAS_ERROR_RETURN(err);
+		if (created && chunk_len != fs->fs_block_size)
+			memset(BIO_DATA(bio), 0, fs->fs_block_size);
+		memcpy(static_cast<char*>(BIO_DATA(bio)) + cur_offset, page + (pos - offset), chunk_len);
+		bio_set_dirty(bio);
+		bio_free(bio);
+		pos += chunk_len;
+		want_block++;
+		run--;
+	}
+	return ananas_success();
+}
+
+/* Reads the page at offset using the filesystem's read function */
+errorcode_t
+pagecache_read_file(struct DENTRY* dentry, char* page, off_t offset)
+{
+	struct VFS_FILE f;
+	memset(&f, 0, sizeof(f));
+	f.f_dentry = dentry;
+
+	errorcode_t err = vfs_seek(&f, offset);
+	ANANAS_ERROR_RETURN(err);
+
+	size_t amount = PAGE_SIZE;
+	err = vfs_read(&f, page, &amount);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Anything beyond the end of the file reads as zero */
+	memset(page + amount, 0, PAGE_SIZE - amount);
+	return ananas_success();
+}
+
+/*
+ * Fills a pending page; the vmpage must be locked. dentry is only needed if
+ * the filesystem has neither fill_page nor block_map.
+ */
+errorcode_t
+pagecache_fill(struct VFS_INODE* inode, struct DENTRY* dentry, struct VM_PAGE* vmpage, off_t offset)
+{
+	KASSERT(vmpage->vp_flags & VM_PAGE_FLAG_PENDING, "filling non-pending page %p", vmpage);
+
+	struct PAGE* p;
+	char* page = static_cast<char*>(page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE));
+	KASSERT(p != nullptr, "out of memory"); // XXX handle this
+
+	errorcode_t err;
+	if (inode->i_iops->fill_page != nullptr)
+		err = inode->i_iops->fill_page(inode, offset, page);
+	else if (inode->i_iops->block_map != nullptr)
+		err = pagecache_read_blocks(inode, page, offset);
+	else {
+		KASSERT(dentry != nullptr, "reading page of inode %p without dentry", inode);
+		err = pagecache_read_file(dentry, page, offset);
+	}
+	kmem_unmap(page, PAGE_SIZE);
+	if (ananas_is_failure(err)) {
+		page_free(p);
+		return err;
+	}
+
+	vmpage->vp_page = p;
+	vmpage->vp_flags &= ~VM_PAGE_FLAG_PENDING;
+	return ananas_success();
+}
+
+/* Queues the page at offset of the inode for a fill thread; returns false if the queue is full */
+bool
+pagecache_queue_fill(struct VFS_INODE* inode, off_t offset)
+{
+	spinlock_lock(&spl_fill);
+	bool full = fill_queue_len >= PAGECACHE_FILL_MAX_QUEUED;
+	if (!full)
+		fill_queue_len++;
+	spinlock_unlock(&spl_fill);
+	if (full)
+		return false;
+
+	auto pf = static_cast<struct PAGECACHE_FILL*>(slab_alloc(&fill_cache));
+	vfs_ref_inode(inode);
+	pf->pf_inode = inode;
+	pf->pf_offset = offset;
+
+	spinlock_lock(&spl_fill);
+	LIST_APPEND(&fill_queue, pf);
+	spinlock_unlock(&spl_fill);
+	sem_signal(&fill_sem);
+	return true;
+}
+
+void
+pagecache_fill_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&fill_sem);
+
+		spinlock_lock(&spl_fill);
+		KASSERT(!LIST_EMPTY(&fill_queue), "fill thread woke up with empty queue?");
+		struct PAGECACHE_FILL* pf = LIST_HEAD(&fill_queue);
+		LIST_POP_HEAD(&fill_queue);
+		fill_queue_len--;
+		spinlock_unlock(&spl_fill);
+
+		/*
+		 * If the reader got here first, the page is either there or being filled
+		 * (in which case we'll wait for the lock); otherwise, we fill it. A
+		 * failure is left for the reader to run into.
+		 */
+		struct VFS_INODE* inode = pf->pf_inode;
+		struct VM_PAGE* vmpage = vmpage_create_shared(nullptr, inode, pf->pf_offset, VM_PAGE_FLAG_PENDING);
+		if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING)
+			pagecache_fill(inode, nullptr, vmpage, pf->pf_offset);
+		vmpage_unlock(vmpage);
+
+		vfs_deref_inode(inode);
+		slab_free(&fill_cache, pf);
+	}
+}
+
+errorcode_t
+pagecache_fill_init()
+{
+	LIST_INIT(&fill_queue);
+	sem_init(&fill_sem, 0);
+
+	/* One thread per CPU; they can be scheduled wherever there is time */
+	unsigned int num_threads = pcpu_get_count();
+	if (num_threads > PAGECACHE_FILL_MAX_THREADS)
+		num_threads = PAGECACHE_FILL_MAX_THREADS;
+	if (num_threads == 0)
+		num_threads = 1;
+	for (unsigned int n = 0; n < num_threads; n++) {
+		kthread_init(&fill_thread[n], "pcfill", &pagecache_fill_thread_func, nullptr);
+		thread_resume(&fill_thread[n]);
+	}
+	fill_running = true;
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+INIT_FUNCTION(pagecache_fill_init, SUBSYSTEM_SCHEDULER, ORDER_LAST);
+
+errorcode_t
+vfs_pagecache_get_ex(struct DENTRY* dentry, off_t offset, struct VM_PAGE** vp_out, bool* was_read)
+{
+	KASSERT((offset & (PAGE_SIZE - 1)) == 0, "offset %d not page-aligned", (int)offset);
+	TRACE(VFS, FUNC, "dentry=%p, offset=%d", dentry, (int)offset);
+
+	struct VM_PAGE* vmpage = vmpage_create_shared(nullptr, dentry->d_inode, offset, VM_PAGE_FLAG_PENDING);
+	*was_read = (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) != 0;
+	if (*was_read) {
+		// We hold the page lock while reading, so anyone else will wait for us
+		errorcode_t err = pagecache_fill(dentry->d_inode, dentry, vmpage, offset);
+		if (ananas_is_failure(err)) {
+			vmpage_unlock(vmpage);
+			return err;
+		}
+	}
+
+	*vp_out = vmpage;
+	return ananas_success();
+}
+
+errorcode_t
+vfs_pagecache_get(struct DENTRY* dentry, off_t offset, struct VM_PAGE** vp_out)
+{
+	bool was_read;
+	return vfs_pagecache_get_ex(dentry, offset, vp_out, &was_read);
+}
+
+void
+vfs_pagecache_update(struct VFS_INODE* inode, off_t offset, const void* buf, size_t len)
+{
+	off_t page_offset = ROUND_DOWN(offset, PAGE_SIZE);
+	KASSERT(offset + len <= page_offset + PAGE_SIZE, "update crosses page boundary");
+
+	struct VM_PAGE* vmpage = vmpage_lookup_inode_locked(inode, page_offset);
+	if (vmpage == nullptr)
+		return; // not cached; nothing to do
+
+	if (vmpage->vp_flags & VM_PAGE_FLAG_LENT) {
+		/*
+		 * The page was handed out by read() and must keep the data as it was; take
+		 * it out of the cache instead, it will be read again with the new data.
+		 */
+		vmpage_unlock(vmpage);
+		vmpage_detach_inode(inode, vmpage);
+		return;
+	}
+
+	// If the page is still pending, reading it failed - it'll be re-read in full
+	if ((vmpage->vp_flags & VM_PAGE_FLAG_PENDING) == 0) {
+		struct PAGE* p = vmpage_get_page(vmpage);
+		char* page = static_cast<char*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+		memcpy(page + (offset - page_offset), buf, len);
+		kmem_unmap(page, PAGE_SIZE);
+	}
+	vmpage_unlock(vmpage);
+}
+
+errorcode_t
+vfs_pagecache_write(struct DENTRY* dentry, struct VM_PAGE* vmpage)
+{
+	struct VFS_INODE* inode = dentry->d_inode;
+	KASSERT(vmpage->vp_inode == inode, "page %p does not belong to inode %p", vmpage, inode);
+	if (inode->i_iops->block_map == nullptr || inode->i_iops->write == nullptr)
+		return ANANAS_ERROR(READ_ONLY);
+
+	vmpage_lock(vmpage);
+	if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) {
+		vmpage_unlock(vmpage);
+		return ananas_success(); // never read, so nothing to write
+	}
+	struct PAGE* p = vmpage_get_page(vmpage);
+	char* page = static_cast<char*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ));
+	errorcode_t err = pagecache_write_blocks(inode, page, vmpage->vp_offset);
+	kmem_unmap(page, PAGE_SIZE);
+	vmpage_unlock(vmpage);
+	return err;
+}
+
+void
+vfs_pagecache_readahead(struct VFS_INODE* inode, off_t offset, off_t end)
+{
+	KASSERT((offset & (PAGE_SIZE - 1)) == 0, "offset %d not page-aligned", (int)offset);
+	TRACE(VFS, FUNC, "inode=%p, offset=%d, end=%d", inode, (int)offset, (int)end);
+	bool use_fill = inode->i_iops->fill_page != nullptr;
+	if (use_fill && !fill_running)
+		return;
+	if (!use_fill && inode->i_iops->block_map == nullptr)
+		return;
+	if (end > inode->i_sb.st_size)
+		end = inode->i_sb.st_size;
+
+	for (off_t page_offset = offset; page_offset < end; page_offset += PAGE_SIZE) {
+		INODE_LOCK(inode);
+		bool cached = radix_lookup(&inode->i_page_index, page_offset / PAGE_SIZE) != nullptr;
+		INODE_UNLOCK(inode);
+		if (cached)
+			continue;
+
+		/* Pages the filesystem fills itself are handed to the fill threads as a whole */
+		if (use_fill) {
+			if (!pagecache_queue_fill(inode, page_offset))
+				return;
+			continue;
+		}
+
+		/*
+		 * Only get the blocks into the buffer cache; filling the page will find
+		 * them there, or still underway, once it is needed.
+		 */
+		off_t page_end = page_offset + PAGE_SIZE;
+		if (page_end > end)
+			page_end = end;
+		struct BIO* bios[PAGECACHE_MAX_BLOCKS];
+		unsigned int num_bios = 0;
+		errorcode_t err = pagecache_get_blocks(inode, page_offset, page_end, bios, &num_bios, BIO_READ_AHEAD);
+		for (unsigned int n = 0; n < num_bios; n++)
+			bio_free(bios[n]);
+		if (ananas_is_failure(err))
+			return;
+	}
+}
+
+void
+vfs_pagecache_purge(struct VFS_INODE* inode)
+{
+	// Mappings hold a reference to the pages they use, so this won't free those
+	LIST_FOREACH_SAFE(&inode->i_pages, vp, struct VM_PAGE) {
+		vmpage_deref(vp);
+	}
+	LIST_INIT(&inode->i_pages);
+	radix_clear(&inode->i_page_index);
+}
+
+/* vim:set ts=2 sw=2: */
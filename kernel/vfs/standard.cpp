@@ -2,11 +2,14 @@
 #include <ananas/bio.h>
 #include <ananas/device.h>
 #include <ananas/error.h>
+#include <ananas/exec.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/direct.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
 
@@ -26,6 +29,23 @@ vfs_make_file(struct VFS_FILE* file, struct DENTRY* dentry)
 		inode->i_iops->fill_file(inode, file);
 }
 
+/*
+ * Adds the name of dentry, which now exists in directory dir_inode, to the
+ * directory's index; if we do not know what it refers to, it must be rebuilt.
+ */
+static void
+vfs_dirindex_update(struct VFS_INODE* dir_inode, struct DENTRY* dentry)
+{
+	if (dentry->d_inode != nullptr) {
+		vfs_dirindex_add(dir_inode, dentry->d_entry, dentry->d_inode->i_inum);
+		return;
+	}
+
+	INODE_LOCK(dir_inode);
+	vfs_dirindex_purge(dir_inode);
+	INODE_UNLOCK(dir_inode);
+}
+
 errorcode_t
 vfs_open(const char* fname, struct DENTRY* cwd, struct VFS_FILE* out)
 {
@@ -40,8 +60,16 @@ vfs_open(const char* fname, struct DENTRY* cwd, struct VFS_FILE* out)
 errorcode_t
 vfs_close(struct VFS_FILE* file)
 {
-	if(file->f_dentry != NULL)
+	if(file->f_dentry != NULL) {
+		/*
+		 * Whatever changed while the file was open is written once it is closed,
+		 * so that the on-disk inode does not lag behind for long.
+		 */
+		struct VFS_INODE* inode = file->f_dentry->d_inode;
+		if (inode != NULL && (inode->i_flags & INODE_FLAG_DIRTY))
+			vfs_sync_inode(inode);
 		dentry_deref(file->f_dentry);
+	}
 	file->f_dentry = NULL; file->f_device = NULL;
 	return ananas_success();
 }
@@ -70,6 +98,8 @@ vfs_read(struct VFS_FILE* file, void* buf, size_t* len)
 		/* Regular file */
 		if (inode->i_iops->read == NULL)
 			return ANANAS_ERROR(BAD_OPERATION);
+		if ((file->f_flags & VFS_FILE_FLAG_DIRECT) && vfs_direct_possible(file, buf, *len))
+			return vfs_direct_read(file, buf, len);
 		return inode->i_iops->read(file, buf, len);
 	}
 
@@ -79,6 +109,67 @@ vfs_read(struct VFS_FILE* file, void* buf, size_t* len)
 	return inode->i_iops->readdir(file, buf, len);
 }
 
+errorcode_t
+vfs_readdir_plus(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	if (file->f_dentry == NULL)
+		return ANANAS_ERROR(BAD_OPERATION);
+	struct VFS_INODE* dir_inode = file->f_dentry->d_inode;
+	if (dir_inode == NULL || dir_inode->i_iops == NULL)
+		return ANANAS_ERROR(BAD_OPERATION);
+	if (!S_ISDIR(dir_inode->i_sb.st_mode))
+		return ANANAS_ERROR(NOT_A_DIRECTORY);
+
+	/*
+	 * Every entry grows by the attributes, and the smallest entries grow the
+	 * most; read only as much as is guaranteed to fit in buf once extended.
+	 */
+	const size_t extra = __builtin_offsetof(struct VFS_DIRENT_PLUS, dp_dirent);
+	size_t plain_len = *len * sizeof(struct VFS_DIRENT) / (sizeof(struct VFS_DIRENT) + extra);
+	if (plain_len < sizeof(struct VFS_DIRENT) + VFS_MAX_NAME_LEN)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	auto plain = static_cast<char*>(kmalloc(plain_len));
+	errorcode_t err = vfs_read(file, plain, &plain_len);
+	if (ananas_is_failure(err)) {
+		kfree(plain);
+		return err;
+	}
+
+	/* Get all inodes underway first, so that the disk can work on them together */
+	struct VFS_MOUNTED_FS* fs = dir_inode->i_fs;
+	if (fs->fs_fsops->prefetch_inode != NULL) {
+		for (size_t pos = 0; pos < plain_len; /* nothing */) {
+			auto de = reinterpret_cast<struct VFS_DIRENT*>(plain + pos);
+			if (de->de_name_length > 0)
+				fs->fs_fsops->prefetch_inode(fs, de->de_inum);
+			pos += DE_LENGTH(de);
+		}
+	}
+
+	/* Extend the entries with the attributes, which also places the inodes in the cache */
+	size_t filled = 0;
+	for (size_t pos = 0; pos < plain_len; /* nothing */) {
+		auto de = reinterpret_cast<struct VFS_DIRENT*>(plain + pos);
+		auto dp = reinterpret_cast<struct VFS_DIRENT_PLUS*>(static_cast<char*>(buf) + filled);
+		memset(&dp->dp_stat, 0, sizeof(dp->dp_stat));
+		memcpy(&dp->dp_dirent, de, DE_LENGTH(de));
+
+		struct VFS_INODE* inode;
+		if (de->de_name_length > 0 && ananas_is_success(vfs_get_inode(fs, de->de_inum, &inode))) {
+			memcpy(&dp->dp_stat, &inode->i_sb, sizeof(dp->dp_stat));
+			vfs_deref_inode(inode);
+		}
+		pos += DE_LENGTH(de);
+		filled += DP_LENGTH(dp);
+		KASSERT(filled <= *len, "overflow; filled %u of %u", filled, *len);
+	}
+
+	kfree(plain);
+	*len = filled;
+	return ananas_success();
+}
+
 errorcode_t
 vfs_write(struct VFS_FILE* file, const void* buf, size_t* len)
 {
@@ -106,6 +197,15 @@ vfs_write(struct VFS_FILE* file, const void* buf, size_t* len)
 	/* Regular file */
 	if (inode->i_iops->write == NULL)
 		return ANANAS_ERROR(BAD_OPERATION);
+
+	/* Any cached executable layout may no longer be accurate */
+	if (inode->i_exec_image != NULL) {
+		INODE_LOCK(inode);
+		exec_image_purge(inode);
+		INODE_UNLOCK(inode);
+	}
+	if ((file->f_flags & VFS_FILE_FLAG_DIRECT) && vfs_direct_possible(file, buf, *len))
+		return vfs_direct_write(file, buf, len);
 	return inode->i_iops->write(file, buf, len);
 }
 
@@ -242,6 +342,7 @@ vfs_lookup_internal(struct DENTRY* curdentry, const char* name, struct DENTRY**
 
 		if (dentry->d_flags & DENTRY_FLAG_NEGATIVE) {
 			/* Entry is in the cache as a negative entry; this means we can't find it */
+			dcache_cache_negative(dentry); /* keep it around, it's popular */
 			dentry_deref(curdentry); /* release parent, we are done with it */
 			KASSERT(dentry->d_inode == NULL, "negative lookup with inode?");
 			TRACE(VFS, INFO, "bailing, found negative dentry for '%s', curdentry %p -> %p", next_lookup, curdentry, dentry);
@@ -273,6 +374,8 @@ vfs_lookup_internal(struct DENTRY* curdentry, const char* name, struct DENTRY**
 			/* Lookup failed; make the entry cache negative */
 			TRACE(VFS, INFO, "making negative dentry for %p:%s\n", curdentry, next_lookup);
 			dentry->d_flags |= DENTRY_FLAG_NEGATIVE;
+			if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_NO_FILE)
+				dcache_cache_negative(dentry);
 			/* No need to touch ditem; it'll be set already to the new dentry (and we can get to the parent from there) */
 			return err;
 		}
@@ -363,6 +466,10 @@ vfs_create(struct DENTRY* parent, struct VFS_FILE* file, const char* dentry, int
 	} else {
 		/* Success; report the inode we created */
 		vfs_make_file(file, de);
+		vfs_dirindex_update(de->d_parent->d_inode, de);
+
+		/* Negative entries may be stale now (the filesystem may consider other names equal) */
+		dcache_purge_negative(de->d_parent);
 	}
 	return err;
 }
@@ -415,12 +522,14 @@ vfs_unlink(struct VFS_FILE* file)
 
 	errorcode_t err = inode->i_iops->unlink(inode, file->f_dentry);
 	ANANAS_ERROR_RETURN(err);
+	vfs_dirindex_remove(inode, file->f_dentry->d_entry);
 
 	/*
 	 * Inform the dentry cache; the unlink operation should have removed it
 	 * from storage, but we need to make sure it cannot be found anymore.
 	 */
 	dentry_unlink(file->f_dentry);
+	dcache_cache_negative(file->f_dentry);
 	return err;
 }
 
@@ -496,7 +605,10 @@ vfs_rename(struct VFS_FILE* file, struct DENTRY* parent, const char* dest)
 	 * the file.
 	 */
 	struct DENTRY* old_dentry = file->f_dentry;
+	vfs_dirindex_remove(parent_inode, old_dentry->d_entry);
+	vfs_dirindex_update(dest_inode, de);
 	file->f_dentry = de;
+	dcache_purge_negative(de->d_parent);
 	dentry_deref(old_dentry);
 	return ananas_success();
 }
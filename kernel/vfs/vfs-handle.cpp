@@ -1,12 +1,14 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
 #include <ananas/bio.h>
+#include <ananas/device.h>
 #include <ananas/flags.h>
 #include <ananas/handle.h>
 #include <ananas/handle-options.h>
 #include <ananas/process.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
+#include <ananas/uio.h>
 #include <ananas/vfs.h>
 #include <ananas/vm.h>
 #include <ananas/lib.h>
@@ -47,6 +49,69 @@ vfshandle_write(thread_t* t, handleindex_t index, struct HANDLE* handle, const v
 	return vfs_write(file, buffer, size);
 }
 
+/*
+ * Reads or writes all buffers of iov in a single go; positional requests do
+ * not touch the file offset. Stops at the first short transfer, as that means
+ * the end of the file was reached.
+ */
+static errorcode_t
+vfshandle_transfer(struct HANDLE* handle, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len, bool write)
+{
+	struct VFS_FILE* file;
+	errorcode_t err = vfshandle_get_file(handle, &file);
+	ANANAS_ERROR_RETURN(err);
+
+	off_t saved_offset = file->f_offset;
+	if (offset != NULL) {
+		err = vfs_seek(file, *offset);
+		ANANAS_ERROR_RETURN(err);
+	}
+
+	size_t total = 0;
+	for (int n = 0; n < iovcnt; n++) {
+		size_t amount = iov[n].iov_len;
+		if (amount == 0)
+			continue;
+		if (write)
+			err = vfs_write(file, iov[n].iov_base, &amount);
+		else
+			err = vfs_read(file, iov[n].iov_base, &amount);
+		if (ananas_is_failure(err))
+			break;
+		total += amount;
+		if (amount < iov[n].iov_len)
+			break;
+	}
+	if (offset != NULL)
+		file->f_offset = saved_offset;
+
+	/* If some data was transferred, that is what we report */
+	if (ananas_is_failure(err) && total == 0)
+		return err;
+	*len = total;
+	return ananas_success();
+}
+
+static errorcode_t
+vfshandle_readv(thread_t* t, handleindex_t index, struct HANDLE* handle, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len)
+{
+	return vfshandle_transfer(handle, iov, iovcnt, offset, len, false);
+}
+
+static errorcode_t
+vfshandle_writev(thread_t* t, handleindex_t index, struct HANDLE* handle, const struct iovec* iov, int iovcnt, const off_t* offset, size_t* len)
+{
+	return vfshandle_transfer(handle, iov, iovcnt, offset, len, true);
+}
+
+/* Applies the open() flags which affect how the file is accessed */
+static void
+vfshandle_set_flags(struct VFS_FILE* file, int flags)
+{
+	if (flags & O_DIRECT)
+		file->f_flags |= VFS_FILE_FLAG_DIRECT;
+}
+
 static errorcode_t
 vfshandle_open(thread_t* t, handleindex_t index, struct HANDLE* handle, const char* path, int flags, int mode)
 {
@@ -60,8 +125,10 @@ vfshandle_open(thread_t* t, handleindex_t index, struct HANDLE* handle, const ch
 	if (flags & O_CREAT) {
 		/* Attempt to create the new file - if this works, we're all set */
 		errorcode_t err = vfs_create(proc->p_cwd, &handle->h_data.d_vfs_file, path, mode);
-		if (ananas_is_success(err))
+		if (ananas_is_success(err)) {
+			vfshandle_set_flags(&handle->h_data.d_vfs_file, flags);
 			return err;
+		}
 
 		/*
 		 * File could not be created; if we had to create the file, this is an
@@ -78,7 +145,11 @@ vfshandle_open(thread_t* t, handleindex_t index, struct HANDLE* handle, const ch
 
 	/* And open the path */
 	TRACE(SYSCALL, INFO, "opening path '%s'", path);
-	return vfs_open(path, proc->p_cwd, &handle->h_data.d_vfs_file);
+	errorcode_t err = vfs_open(path, proc->p_cwd, &handle->h_data.d_vfs_file);
+	ANANAS_ERROR_RETURN(err);
+
+	vfshandle_set_flags(&handle->h_data.d_vfs_file, flags);
+	return ananas_success();
 }
 
 static errorcode_t
@@ -121,6 +192,27 @@ vfshandle_clone(process_t* p_in, handleindex_t index_in, struct HANDLE* handle_i
 	return handle_clone_generic(handle_in, proc_out, handle_out, index_out_min, index_out);
 }
 
+static errorcode_t
+vfshandle_poll(struct HANDLE* handle, unsigned int* events, struct EVENT_SOURCE** source)
+{
+	struct VFS_FILE* file;
+	errorcode_t err = vfshandle_get_file(handle, &file);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Only character devices can block; anything else is always ready */
+	Ananas::ICharDeviceOperations* cdo = nullptr;
+	if (file->f_device != nullptr)
+		cdo = file->f_device->GetCharDeviceOperations();
+	if (cdo != nullptr) {
+		*events = cdo->GetReadyEvents();
+		*source = &file->f_device->d_Events;
+	} else {
+		*events = HANDLE_EVENT_READ | HANDLE_EVENT_WRITE;
+		*source = nullptr;
+	}
+	return ananas_success();
+}
+
 struct HANDLE_OPS vfs_hops = {
 	.hop_read = vfshandle_read,
 	.hop_write = vfshandle_write,
@@ -128,6 +220,9 @@ struct HANDLE_OPS vfs_hops = {
 	.hop_free = vfshandle_free,
 	.hop_unlink = vfshandle_unlink,
 	.hop_clone = vfshandle_clone,
+	.hop_readv = vfshandle_readv,
+	.hop_writev = vfshandle_writev,
+	.hop_poll = vfshandle_poll,
 };
 HANDLE_TYPE(HANDLE_TYPE_FILE, "file", vfs_hops);
 
@@ -0,0 +1,493 @@
+/*
+ * Page merging: a background thread looks for private pages with identical
+ * contents and has them share a single copy-on-write page, which is broken up
+ * again as soon as anyone writes to it. Hosts running many instances of the
+ * same programs have lots of these, mostly in data and zero-filled memory.
+ *
+ * The thread walks the vmspaces of all processes, vm.merge_pages pages every
+ * vm.merge_interval_ms; it is off until vm.merge is set. Candidates are
+ * private pages on the LRU lists (see swap.cpp) which nobody else references.
+ * Every page visited gets a checksum; a page is only considered once its
+ * checksum is the same as the previous time we came by, as pages which are
+ * still being written to would not stay merged for long anyway. We then look
+ * for a page with the same checksum in two tables:
+ *
+ * - The stable table holds the shared pages we made (VM_PAGE_FLAG_MERGED);
+ *   they cannot change, as everything using them maps them read-only. A page
+ *   leaves the table as it is freed.
+ * - The unstable table holds the candidates seen during the current pass;
+ *   they may change at any time, so we write-protect both pages before
+ *   comparing them. A match becomes a new stable page. As the table holds a
+ *   reference to its pages, it is emptied after every pass.
+ *
+ * Merging a page turns it into a copy-on-write link to the shared page, as if
+ * it were forked off, so the usual fault handling takes care of writes.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <machine/vm.h> /* for md_map_pages() */
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/page.h>
+#include <ananas/process.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <ananas/tunable.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
+#include "options.h"
+
+namespace Ananas {
+namespace Process {
+
+extern mutex_t process_mtx;
+extern struct PROCESS_QUEUE process_all;
+
+} // namespace Process
+} // namespace Ananas
+
+#define MERGE_HASH_SIZE	1024
+
+/* Flags of a page we can merge; anything else is shared already, or not present */
+#define MERGE_PAGE_FLAGS_MASK \
+	(VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_READONLY | VM_PAGE_FLAG_COW | VM_PAGE_FLAG_PENDING | VM_PAGE_FLAG_LINK | \
+	 VM_PAGE_FLAG_LENT | VM_PAGE_FLAG_SWAPPABLE | VM_PAGE_FLAG_SWAPPED | VM_PAGE_FLAG_MERGED)
+#define MERGE_PAGE_FLAGS	(VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_SWAPPABLE)
+
+struct MERGE_ITEM {
+	uint32_t		mi_checksum;
+	struct VM_PAGE*		mi_vp;
+	LIST_FIELDS(struct MERGE_ITEM);
+};
+
+LIST_DEFINE(MERGE_BUCKET, struct MERGE_ITEM);
+
+namespace {
+
+/* Tunables; see /ankh/sys */
+bool merge_enabled = false;
+unsigned int merge_pages = 256; /* Pages looked at per scan */
+unsigned int merge_interval_ms = 100; /* Time between scans */
+
+SLAB_CACHE_DEFINE(merge_item_cache, struct MERGE_ITEM, nullptr);
+
+mutex_t merge_mtx; /* Protects the tables */
+struct MERGE_BUCKET merge_stable[MERGE_HASH_SIZE];
+struct MERGE_BUCKET merge_unstable[MERGE_HASH_SIZE];
+
+thread_t merge_thread;
+
+/* Where the scan continues; only used by the merge thread */
+struct MERGE_CURSOR {
+	pid_t	mc_pid;		/* Process, or the lowest PID after it if it is gone */
+	addr_t	mc_area;	/* Start of the area */
+	unsigned int mc_index;	/* Index in the page list of the area */
+} merge_cursor;
+
+/* Statistics */
+unsigned int merge_num_stable;
+unsigned int merge_num_merged;
+unsigned int merge_num_passes;
+
+inline struct MERGE_BUCKET*
+merge_bucket(struct MERGE_BUCKET* table, uint32_t checksum)
+{
+	return &table[checksum % MERGE_HASH_SIZE];
+}
+
+uint32_t
+merge_checksum(struct PAGE* p)
+{
+	auto data = static_cast<const uint64_t*>(kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ));
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned int n = 0; n < PAGE_SIZE / sizeof(uint64_t); n++)
+		hash = (hash ^ data[n]) * 0x100000001b3ULL;
+	kmem_unmap(const_cast<uint64_t*>(data), PAGE_SIZE);
+	return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+bool
+merge_same(struct PAGE* p1, struct PAGE* p2)
+{
+	void* data1 = kmem_map(page_get_paddr(p1), PAGE_SIZE, VM_FLAG_READ);
+	void* data2 = kmem_map(page_get_paddr(p2), PAGE_SIZE, VM_FLAG_READ);
+	bool same = memcmp(data1, data2, PAGE_SIZE) == 0;
+	kmem_unmap(data2, PAGE_SIZE);
+	kmem_unmap(data1, PAGE_SIZE);
+	return same;
+}
+
+/* Takes a reference to vp unless it is already on its way out */
+bool
+merge_try_ref(struct VM_PAGE* vp)
+{
+	refcount_t refcount = __atomic_load_n(&vp->vp_refcount, __ATOMIC_RELAXED);
+	while (refcount > 0) {
+		if (__atomic_compare_exchange_n(&vp->vp_refcount, &refcount, refcount + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/* Returns a referenced page from table with the given checksum, if any */
+struct VM_PAGE*
+merge_lookup(struct MERGE_BUCKET* table, uint32_t checksum)
+{
+	struct VM_PAGE* vp = nullptr;
+	mutex_lock(&merge_mtx);
+	LIST_FOREACH(merge_bucket(table, checksum), mi, struct MERGE_ITEM) {
+		if (mi->mi_checksum == checksum && merge_try_ref(mi->mi_vp)) {
+			vp = mi->mi_vp;
+			break;
+		}
+	}
+	mutex_unlock(&merge_mtx);
+	return vp;
+}
+
+/* Adds vp to table; the table takes over the caller's reference, if any */
+void
+merge_insert(struct MERGE_BUCKET* table, struct VM_PAGE* vp, uint32_t checksum)
+{
+	auto mi = static_cast<struct MERGE_ITEM*>(slab_alloc(&merge_item_cache));
+	mi->mi_checksum = checksum;
+	mi->mi_vp = vp;
+	mutex_lock(&merge_mtx);
+	LIST_APPEND(merge_bucket(table, checksum), mi);
+	mutex_unlock(&merge_mtx);
+}
+
+/* Write-protects page vp of va, so that we can be sure its contents stay put */
+inline void
+merge_protect(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
+{
+	md_map_pages(vs, vp->vp_vaddr, page_get_paddr(vp->vp_page), 1, va->va_flags & ~VM_FLAG_WRITE);
+}
+
+/*
+ * Has page vp of va use the shared page vp_shared instead of its own; the
+ * caller's reference to vp_shared is taken over.
+ */
+void
+merge_link(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp, struct VM_PAGE* vp_shared)
+{
+	struct PAGE* p = vp->vp_page;
+
+	// Shared pages are never swapped out; it's a copy-on-write link from now on
+	vmpage_deactivate(vp);
+	vp->vp_flags |= VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_COW;
+	vp->vp_link = vp_shared;
+
+	// The old page must not be accessible once freed
+	md_map_pages(vs, vp->vp_vaddr, page_get_paddr(vp_shared->vp_page), 1, va->va_flags & ~VM_FLAG_WRITE);
+	page_free(p);
+	__atomic_add_fetch(&merge_num_merged, 1, __ATOMIC_RELAXED);
+}
+
+/* Tries to merge vp with a stable page with the same contents */
+bool
+merge_with_stable(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp, uint32_t checksum)
+{
+	struct VM_PAGE* vp_shared = merge_lookup(merge_stable, checksum);
+	if (vp_shared == nullptr)
+		return false;
+
+	// As we hold a reference, the page cannot be taken over by a promotion
+	vmpage_lock(vp_shared);
+	bool same = vp_shared->vp_page != nullptr;
+	if (same) {
+		merge_protect(vs, va, vp);
+		same = merge_same(vp->vp_page, vp_shared->vp_page);
+	}
+	vmpage_unlock(vp_shared);
+	if (!same) {
+		vmpage_deref(vp_shared);
+		return false;
+	}
+
+	merge_link(vs, va, vp, vp_shared);
+	return true;
+}
+
+/*
+ * Locks the area mapping vp_other, which is in the unstable table; returns
+ * nullptr if it is busy or vp_other is no longer a candidate. va, which we
+ * already hold, is returned if it maps vp_other too.
+ */
+vmarea_t*
+merge_lock_other(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp_other, vmspace_t** vs_other)
+{
+	// As long as the page is still on the LRU lists, its vmspace is there (see swap.cpp)
+	if (!mutex_trylock(&vp_other->vp_mtx))
+		return nullptr;
+	vmarea_t* va_other = nullptr;
+	*vs_other = vp_other->vp_vmspace;
+	if ((vp_other->vp_flags & MERGE_PAGE_FLAGS_MASK) == MERGE_PAGE_FLAGS) {
+		if (*vs_other == vs && vp_other->vp_vaddr >= va->va_virt && vp_other->vp_vaddr < va->va_virt + va->va_len)
+			va_other = va;
+		else
+			va_other = vmspace_trylock_area(*vs_other, vp_other->vp_vaddr);
+	}
+	vmpage_unlock(vp_other);
+	return va_other;
+}
+
+/*
+ * Tries to merge vp with a candidate seen earlier in this pass; if they are
+ * the same, the candidate's page becomes a new stable page which both use.
+ */
+bool
+merge_with_unstable(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp, uint32_t checksum)
+{
+	struct VM_PAGE* vp_other = merge_lookup(merge_unstable, checksum);
+	if (vp_other == nullptr)
+		return false;
+
+	vmspace_t* vs_other;
+	vmarea_t* va_other = merge_lock_other(vs, va, vp_other, &vs_other);
+	bool merged = false;
+	if (va_other != nullptr) {
+		// Only our references may remain: the owner's, the table's and the one we just took
+		if (vp_other != vp && vp_other->vp_refcount == 3) {
+			merge_protect(vs_other, va_other, vp_other);
+			merge_protect(vs, va, vp);
+			merged = merge_same(vp->vp_page, vp_other->vp_page);
+		}
+		if (merged) {
+			// The other page keeps its mapping, which now refers to the shared page
+			vmpage_make_cow(vp_other);
+			struct VM_PAGE* vp_shared = vp_other->vp_link;
+			vp_shared->vp_flags |= VM_PAGE_FLAG_MERGED;
+			vp_shared->vp_checksum = checksum;
+			merge_insert(merge_stable, vp_shared, checksum);
+			__atomic_add_fetch(&merge_num_stable, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&merge_num_merged, 1, __ATOMIC_RELAXED);
+
+			vmpage_ref(vp_shared);
+			merge_link(vs, va, vp, vp_shared);
+		}
+		if (va_other != va)
+			vmspace_unlock_area(vs_other, va_other);
+	}
+	vmpage_deref(vp_other);
+	return merged;
+}
+
+/* Looks at page vp of va, which is locked */
+void
+merge_page(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
+{
+	// Anyone else holding a reference may be using the backing page directly
+	if ((vp->vp_flags & MERGE_PAGE_FLAGS_MASK) != MERGE_PAGE_FLAGS || vp->vp_refcount != 1)
+		return;
+
+	// Pages which are still changing are not worth the trouble
+	uint32_t checksum = merge_checksum(vp->vp_page);
+	if (checksum != vp->vp_checksum) {
+		vp->vp_checksum = checksum;
+		return;
+	}
+
+	if (merge_with_stable(vs, va, vp, checksum) || merge_with_unstable(vs, va, vp, checksum))
+		return;
+
+	// Nothing to merge with yet; perhaps something later in this pass is
+	vmpage_ref(vp);
+	merge_insert(merge_unstable, vp, checksum);
+}
+
+inline bool
+merge_area_eligible(vmarea_t* va)
+{
+	return (va->va_flags & (VM_FLAG_USER | VM_FLAG_MD | VM_FLAG_PINNED | VM_FLAG_DEVICE)) == VM_FLAG_USER;
+}
+
+/*
+ * Looks at up to num_pages pages of vs from the cursor onwards; returns the
+ * number of pages looked at, which is less than num_pages once vs is done.
+ */
+unsigned int
+merge_scan_vmspace(vmspace_t* vs, unsigned int num_pages)
+{
+	unsigned int num_scanned = 0;
+	vmspace_lock_read(vs);
+	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
+		if (va->va_virt < merge_cursor.mc_area)
+			continue;
+		if (va->va_virt > merge_cursor.mc_area) {
+			merge_cursor.mc_area = va->va_virt;
+			merge_cursor.mc_index = 0;
+		}
+		if (!merge_area_eligible(va))
+			continue;
+
+		// The list may have changed since we were here; we may skip or revisit a few pages
+		vmarea_lock(va);
+		unsigned int index = 0;
+		LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
+			if (index++ < merge_cursor.mc_index)
+				continue;
+			if (num_scanned == num_pages)
+				break;
+			merge_page(vs, va, vp);
+			merge_cursor.mc_index = index;
+			num_scanned++;
+		}
+		vmarea_unlock(va);
+		if (num_scanned == num_pages)
+			break;
+	}
+	vmspace_unlock_read(vs);
+	return num_scanned;
+}
+
+/* Returns the process with the lowest PID at or after pid, referenced */
+process_t*
+merge_next_process(pid_t pid)
+{
+	process_t* next = nullptr;
+	mutex_lock(&Ananas::Process::process_mtx);
+	LIST_FOREACH_IP(&Ananas::Process::process_all, all, p, process_t) {
+		if (p->p_pid >= pid && p->p_vmspace != nullptr && (next == nullptr || p->p_pid < next->p_pid))
+			next = p;
+	}
+	if (next != nullptr)
+		process_ref(next);
+	mutex_unlock(&Ananas::Process::process_mtx);
+	return next;
+}
+
+/* Empties the unstable table; its pages may have changed by the next pass */
+void
+merge_end_pass()
+{
+	struct MERGE_BUCKET items;
+	LIST_INIT(&items);
+	mutex_lock(&merge_mtx);
+	for (unsigned int n = 0; n < MERGE_HASH_SIZE; n++) {
+		while (!LIST_EMPTY(&merge_unstable[n])) {
+			struct MERGE_ITEM* mi = LIST_HEAD(&merge_unstable[n]);
+			LIST_POP_HEAD(&merge_unstable[n]);
+			LIST_APPEND(&items, mi);
+		}
+	}
+	mutex_unlock(&merge_mtx);
+
+	// Dropping the references may free the pages, which needs the lock
+	while (!LIST_EMPTY(&items)) {
+		struct MERGE_ITEM* mi = LIST_HEAD(&items);
+		LIST_POP_HEAD(&items);
+		vmpage_deref(mi->mi_vp);
+		slab_free(&merge_item_cache, mi);
+	}
+}
+
+void
+merge_scan(unsigned int num_pages)
+{
+	while (num_pages > 0) {
+		process_t* p = merge_next_process(merge_cursor.mc_pid);
+		if (p == nullptr) {
+			// Pass complete; we'll start over next time
+			merge_end_pass();
+			merge_cursor.mc_pid = 0;
+			merge_cursor.mc_area = 0;
+			merge_cursor.mc_index = 0;
+			merge_num_passes++;
+			return;
+		}
+		if (p->p_pid != merge_cursor.mc_pid) {
+			merge_cursor.mc_pid = p->p_pid;
+			merge_cursor.mc_area = 0;
+			merge_cursor.mc_index = 0;
+		}
+
+		unsigned int num_scanned = merge_scan_vmspace(p->p_vmspace, num_pages);
+		if (num_scanned < num_pages) {
+			// Done with this one; continue with the next
+			merge_cursor.mc_pid = p->p_pid + 1;
+			merge_cursor.mc_area = 0;
+			merge_cursor.mc_index = 0;
+		}
+		num_pages -= num_scanned;
+		process_deref(p);
+	}
+}
+
+void
+merge_thread_func(void* context)
+{
+	bool active = false;
+	while(1) {
+		thread_sleep_ns(static_cast<uint64_t>(__atomic_load_n(&merge_interval_ms, __ATOMIC_RELAXED)) * 1000000ULL);
+		if (!__atomic_load_n(&merge_enabled, __ATOMIC_RELAXED)) {
+			// Let go of the candidates; they are stale by the time we are enabled again
+			if (active)
+				merge_end_pass();
+			active = false;
+			continue;
+		}
+		active = true;
+		merge_scan(__atomic_load_n(&merge_pages, __ATOMIC_RELAXED));
+	}
+}
+
+errorcode_t
+merge_init()
+{
+	mutex_init(&merge_mtx, "merge");
+	for (unsigned int n = 0; n < MERGE_HASH_SIZE; n++) {
+		LIST_INIT(&merge_stable[n]);
+		LIST_INIT(&merge_unstable[n]);
+	}
+
+	kthread_init(&merge_thread, "merge", &merge_thread_func, nullptr);
+	merge_thread.t_priority = THREAD_PRIORITY_IDLE - 1;
+	thread_resume(&merge_thread);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+void
+vmpage_merge_forget(struct VM_PAGE* vp)
+{
+	struct MERGE_ITEM* item = nullptr;
+	mutex_lock(&merge_mtx);
+	struct MERGE_BUCKET* bucket = merge_bucket(merge_stable, vp->vp_checksum);
+	LIST_FOREACH(bucket, mi, struct MERGE_ITEM) {
+		if (mi->mi_vp == vp) {
+			item = mi;
+			break;
+		}
+	}
+	KASSERT(item != nullptr, "merged page %p not in stable table", vp);
+	LIST_REMOVE(bucket, item);
+	mutex_unlock(&merge_mtx);
+
+	slab_free(&merge_item_cache, item);
+	__atomic_sub_fetch(&merge_num_stable, 1, __ATOMIC_RELAXED);
+}
+
+INIT_FUNCTION(merge_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+TUNABLE_BOOL("vm.merge", merge_enabled, nullptr, "Merge identical private pages in the background");
+TUNABLE_UINT("vm.merge_pages", merge_pages, 1, 65536, nullptr, "Pages looked at per merge scan");
+TUNABLE_UINT("vm.merge_interval_ms", merge_interval_ms, 10, 10000, nullptr, "Time between merge scans");
+
+#ifdef OPTION_KDB
+KDB_COMMAND(merge, NULL, "Display page merging statistics")
+{
+	kprintf("merging %s, %u pages every %u ms\n", merge_enabled ? "enabled" : "disabled", merge_pages, merge_interval_ms);
+	kprintf("stable pages: %u\n", merge_num_stable);
+	kprintf("pages merged: %u\n", merge_num_merged);
+	kprintf("full passes: %u\n", merge_num_passes);
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
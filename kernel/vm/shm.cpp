@@ -0,0 +1,121 @@
+/*
+ * Shared memory objects; see <ananas/shm.h>. The pages are allocated as they
+ * are first faulted on by any mapping, and are kept until the object is gone.
+ * Mappings hold links to them, so they are not on the LRU lists and thus never
+ * swapped out.
+ *
+ * Lock order is the vmspace lock, shm_mtx and then the page locks.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/shm.h>
+#include <ananas/trace.h>
+#include <ananas/vmpage.h>
+
+TRACE_SETUP;
+
+namespace {
+
+errorcode_t
+shmhandle_free(process_t* proc, struct HANDLE* handle)
+{
+	shm_deref(handle->h_data.d_shm);
+	return ananas_success();
+}
+
+errorcode_t
+shmhandle_clone(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out)
+{
+	/* The handle is locked, so the object can't go away while we clone it */
+	errorcode_t err = handle_clone_generic(handle, proc_out, handle_out, index_out_min, index_out);
+	ANANAS_ERROR_RETURN(err);
+
+	shm_ref(handle->h_data.d_shm);
+	return ananas_success();
+}
+
+struct HANDLE_OPS shm_hops = {
+	.hop_free = shmhandle_free,
+	.hop_clone = shmhandle_clone,
+};
+
+} // unnamed namespace
+
+HANDLE_TYPE(HANDLE_TYPE_SHM, "shm", shm_hops);
+
+errorcode_t
+shm_alloc(process_t* p, size_t size, handleindex_t* out)
+{
+	if (size == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	size = ROUND_UP(size, PAGE_SIZE);
+
+	/* Only refuse what could never fit; pages are not allocated until used */
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	if (size / PAGE_SIZE > total_pages)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+
+	struct HANDLE* handle;
+	errorcode_t err = handle_alloc(HANDLE_TYPE_SHM, p, 0, &handle, out);
+	ANANAS_ERROR_RETURN(err);
+
+	auto shm = static_cast<struct SHM*>(kmalloc(sizeof(struct SHM)));
+	memset(shm, 0, sizeof(*shm));
+	mutex_init(&shm->shm_mtx, "shm");
+	shm->shm_refcount = 1; /* the handle */
+	shm->shm_size = size;
+	LIST_INIT(&shm->shm_pages);
+	radix_init(&shm->shm_page_index);
+	handle->h_data.d_shm = shm;
+	TRACE(HANDLE, INFO, "shm=%p, size=%u", shm, (unsigned int)size);
+	return ananas_success();
+}
+
+void
+shm_ref(struct SHM* shm)
+{
+	__atomic_add_fetch(&shm->shm_refcount, 1, __ATOMIC_RELAXED);
+}
+
+void
+shm_deref(struct SHM* shm)
+{
+	KASSERT(shm->shm_refcount > 0, "invalid refcount %d", shm->shm_refcount);
+	if (__atomic_sub_fetch(&shm->shm_refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	/* Pages still linked from somewhere keep their own reference */
+	LIST_FOREACH_SAFE(&shm->shm_pages, vp, struct VM_PAGE) {
+		vmpage_deref(vp);
+	}
+	radix_clear(&shm->shm_page_index);
+	kfree(shm);
+}
+
+struct VM_PAGE*
+shm_link_page(struct SHM* shm, off_t offset)
+{
+	KASSERT(offset >= 0 && offset < shm->shm_size && (offset & (PAGE_SIZE - 1)) == 0, "invalid offset %u", (unsigned int)offset);
+
+	mutex_lock(&shm->shm_mtx);
+	auto vp = static_cast<struct VM_PAGE*>(radix_lookup(&shm->shm_page_index, offset / PAGE_SIZE));
+	if (vp == nullptr) {
+		/* No flags; the page is shared by whoever maps it */
+		vp = vmpage_create_private_zeroed(0);
+		vp->vp_offset = offset;
+		LIST_APPEND(&shm->shm_pages, vp);
+		radix_insert(&shm->shm_page_index, offset / PAGE_SIZE, vp);
+	}
+	struct VM_PAGE* vp_link = vmpage_link(vp);
+	mutex_unlock(&shm->shm_mtx);
+	return vp_link;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,432 @@
+/*
+ * Swapping of anonymous memory; see ananas/swap.h.
+ *
+ * A page is on the LRU lists (VM_PAGE_FLAG_SWAPPABLE) as long as it is a
+ * private page with its own backing page, mapped by the vmspace in its
+ * vp_vmspace. Its flags only change while it is locked; the lists themselves
+ * are protected by spl_lru. Anyone taking a page out of its vmspace must call
+ * vmpage_deactivate() first, which waits for us if we are busy with the page:
+ * this means that once we hold the lock of a page which is still swappable,
+ * its vmspace is guaranteed to stay around.
+ *
+ * Faults are handled with the faulting area locked, so locking the area of
+ * the page as well ensures nobody maps it while we swap it out. As the usual
+ * order is area before page, we only try to lock them; whatever is busy is
+ * skipped.
+ *
+ * With OPTION_ZSWAP, pages are first offered to the compressed cache in
+ * zswap.cpp; only the ones it does not take are written to the swap device.
+ *
+ * The lists are kept even without anywhere to swap to, as they are also how
+ * compaction finds the pages it can move: p_vmpage of the backing page of a
+ * page on the lists refers to it, protected by spl_lru as well.
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <machine/vm.h> /* for md_unmap_pages(), md_clear_accessed() */
+#include <ananas/bio.h>
+#include <ananas/cmdline.h>
+#include <ananas/device.h>
+#include <ananas/error.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/page.h>
+#include <ananas/swap.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+#define SWAP_AGE_BATCH		32	/* Active pages looked at per call, at most */
+#define SWAP_SCAN_BATCH		128	/* Inactive pages looked at per call, at most */
+#define SWAP_INACTIVE_RATIO	2	/* Keep at least 1/SWAP_INACTIVE_RATIO of the pages inactive */
+
+namespace {
+
+spinlock_t spl_lru = SPINLOCK_DEFAULT_INIT;
+struct VM_PAGE_LIST lru_active; /* most recently activated first */
+struct VM_PAGE_LIST lru_inactive; /* most recently deactivated first */
+unsigned int lru_num_active, lru_num_inactive;
+
+Ananas::Device* swap_device;
+spinlock_t spl_swap = SPINLOCK_DEFAULT_INIT;
+uint32_t* swap_map; /* bit set if the slot is in use, protected by spl_swap */
+unsigned int swap_num_slots;
+unsigned int swap_num_free;
+unsigned int swap_next_slot; /* where to start looking for a free slot */
+
+struct PAGE_RECLAIMER swap_reclaimer;
+
+inline blocknr_t
+swap_slot_block(unsigned int slot)
+{
+	return (blocknr_t)slot * (PAGE_SIZE / BIO_SECTOR_SIZE);
+}
+
+bool
+swap_alloc_slot(unsigned int* slot)
+{
+	bool found = false;
+	spinlock_lock(&spl_swap);
+	for (unsigned int n = 0; swap_num_free > 0 && n < swap_num_slots; n++) {
+		unsigned int s = (swap_next_slot + n) % swap_num_slots;
+		if (swap_map[s / 32] & (1U << (s % 32)))
+			continue;
+		swap_map[s / 32] |= 1U << (s % 32);
+		swap_num_free--;
+		swap_next_slot = s + 1;
+		*slot = s;
+		found = true;
+		break;
+	}
+	spinlock_unlock(&spl_swap);
+	return found;
+}
+
+void
+swap_free_slot(unsigned int slot)
+{
+	spinlock_lock(&spl_swap);
+	KASSERT(swap_map[slot / 32] & (1U << (slot % 32)), "freeing free swap slot %u", slot);
+	swap_map[slot / 32] &= ~(1U << (slot % 32));
+	swap_num_free++;
+	spinlock_unlock(&spl_swap);
+}
+
+/* Removes vp from whichever list it is on; must be called with spl_lru held */
+void
+lru_remove_locked(struct VM_PAGE* vp)
+{
+	vp->vp_page->p_vmpage = nullptr;
+	if (vp->vp_flags & VM_PAGE_FLAG_ACTIVE) {
+		LIST_REMOVE_IP(&lru_active, lru, vp);
+		lru_num_active--;
+	} else {
+		LIST_REMOVE_IP(&lru_inactive, lru, vp);
+		lru_num_inactive--;
+	}
+}
+
+/* Moves locked page vp to the head of the active or inactive list */
+void
+lru_move(struct VM_PAGE* vp, bool active)
+{
+	spinlock_lock(&spl_lru);
+	lru_remove_locked(vp);
+	if (active) {
+		vp->vp_flags |= VM_PAGE_FLAG_ACTIVE;
+		LIST_PREPEND_IP(&lru_active, lru, vp);
+		lru_num_active++;
+	} else {
+		vp->vp_flags &= ~VM_PAGE_FLAG_ACTIVE;
+		LIST_PREPEND_IP(&lru_inactive, lru, vp);
+		lru_num_inactive++;
+	}
+	spinlock_unlock(&spl_lru);
+}
+
+/*
+ * Takes the least recently used page from list we can lock, along with the
+ * area mapping it (in *va_out); pages we cannot lock are moved to the head of
+ * the list, so they are looked at last next time. Returns nullptr if nothing
+ * can be locked.
+ */
+struct VM_PAGE*
+lru_grab(struct VM_PAGE_LIST* list, unsigned int max_tries, vmarea_t** va_out)
+{
+	spinlock_lock(&spl_lru);
+	for (unsigned int n = 0; n < max_tries && !LIST_EMPTY(list); n++) {
+		struct VM_PAGE* vp = LIST_TAIL(list);
+		LIST_REMOVE_IP(list, lru, vp);
+		LIST_PREPEND_IP(list, lru, vp);
+		if (!mutex_trylock(&vp->vp_mtx))
+			continue;
+		// The page is still swappable, so its vmspace is still there
+		vmarea_t* va = vmspace_trylock_area(vp->vp_vmspace, vp->vp_vaddr);
+		if (va == nullptr) {
+			vmpage_unlock(vp);
+			continue;
+		}
+		spinlock_unlock(&spl_lru);
+		*va_out = va;
+		return vp;
+	}
+	spinlock_unlock(&spl_lru);
+	return nullptr;
+}
+
+/*
+ * Writes locked page vp to swap and frees its backing page; the area mapping
+ * it must be locked as well. Returns false if the page stays where it is.
+ */
+bool
+swap_out(vmspace_t* vs, struct VM_PAGE* vp)
+{
+	// Anyone else holding a reference may be using the backing page directly
+	if (vp->vp_refcount != 1)
+		return false;
+
+	// Take the page away first, so that it cannot change while we write it
+	md_unmap_pages(vs, vp->vp_vaddr, 1);
+
+	struct PAGE* p = vp->vp_page;
+	void* data = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ);
+	int flags = VM_PAGE_FLAG_SWAPPED;
+	unsigned int slot = 0;
+#ifdef OPTION_ZSWAP
+	struct ZSWAP_ENTRY* ze = zswap_store(data);
+	if (ze != nullptr) {
+		flags |= VM_PAGE_FLAG_ZSWAPPED;
+	} else
+#endif
+	{
+		// The page is still ours if we bail out; the next access will just map it again
+		errorcode_t err = ANANAS_ERROR(NO_SPACE);
+		if (swap_device != nullptr && swap_alloc_slot(&slot)) {
+			err = bio_transfer_direct(swap_device, swap_slot_block(slot), 1, PAGE_SIZE, &data, true);
+			if (ananas_is_failure(err)) {
+				TRACE(VM, WARN, "cannot write swap slot %u, error %d", slot, err);
+				swap_free_slot(slot);
+			}
+		}
+		if (ananas_is_failure(err)) {
+			kmem_unmap(data, PAGE_SIZE);
+			return false;
+		}
+	}
+	kmem_unmap(data, PAGE_SIZE);
+
+	spinlock_lock(&spl_lru);
+	lru_remove_locked(vp);
+	spinlock_unlock(&spl_lru);
+	vp->vp_flags = (vp->vp_flags & ~(VM_PAGE_FLAG_SWAPPABLE | VM_PAGE_FLAG_ACTIVE)) | flags;
+	vp->vp_vmspace = nullptr;
+	vp->vp_page = nullptr;
+#ifdef OPTION_ZSWAP
+	if (flags & VM_PAGE_FLAG_ZSWAPPED)
+		vp->vp_zswap = ze;
+	else
+#endif
+		vp->vp_swap_slot = slot;
+	page_free(p);
+	return true;
+}
+
+/*
+ * Called by the page daemon once the caches are exhausted: ages the active
+ * list until enough pages are inactive, and swaps out inactive pages which
+ * were not used since.
+ */
+unsigned int
+swap_reclaim(unsigned int num_pages)
+{
+	// Pages which were not accessed since we last looked become inactive
+	for (unsigned int n = 0; n < SWAP_AGE_BATCH && lru_num_inactive * SWAP_INACTIVE_RATIO < lru_num_active + lru_num_inactive; n++) {
+		vmarea_t* va;
+		struct VM_PAGE* vp = lru_grab(&lru_active, SWAP_AGE_BATCH - n, &va);
+		if (vp == nullptr)
+			break;
+		vmspace_t* vs = vp->vp_vmspace;
+		if (!md_clear_accessed(vs, vp->vp_vaddr))
+			lru_move(vp, false);
+		vmspace_unlock_area(vs, va);
+		vmpage_unlock(vp);
+	}
+
+	// Inactive pages get a second chance if they were accessed; the rest goes
+	unsigned int num_freed = 0;
+	for (unsigned int n = 0; n < SWAP_SCAN_BATCH && num_freed < num_pages; n++) {
+		vmarea_t* va;
+		struct VM_PAGE* vp = lru_grab(&lru_inactive, SWAP_SCAN_BATCH - n, &va);
+		if (vp == nullptr)
+			break;
+		vmspace_t* vs = vp->vp_vmspace;
+		if (md_clear_accessed(vs, vp->vp_vaddr))
+			lru_move(vp, true);
+		else if (swap_out(vs, vp))
+			num_freed++;
+		vmspace_unlock_area(vs, va);
+		vmpage_unlock(vp);
+	}
+	return num_freed;
+}
+
+} // unnamed namespace
+
+void
+vmpage_activate(vmspace_t* vs, struct VM_PAGE* vp)
+{
+	vmspace_assert_locked(vs);
+
+	vmpage_lock(vp);
+	if ((vp->vp_flags & (VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_SWAPPABLE | VM_PAGE_FLAG_SWAPPED)) == VM_PAGE_FLAG_PRIVATE) {
+		vp->vp_vmspace = vs;
+		vp->vp_flags |= VM_PAGE_FLAG_SWAPPABLE | VM_PAGE_FLAG_ACTIVE;
+		spinlock_lock(&spl_lru);
+		vp->vp_page->p_vmpage = vp;
+		LIST_PREPEND_IP(&lru_active, lru, vp);
+		lru_num_active++;
+		spinlock_unlock(&spl_lru);
+	}
+	vmpage_unlock(vp);
+}
+
+void
+vmpage_deactivate(struct VM_PAGE* vp)
+{
+	// Only our owner makes the page swappable, so this check is safe
+	if ((vp->vp_flags & VM_PAGE_FLAG_SWAPPABLE) == 0)
+		return;
+
+	vmpage_lock(vp);
+	if (vp->vp_flags & VM_PAGE_FLAG_SWAPPABLE) {
+		spinlock_lock(&spl_lru);
+		lru_remove_locked(vp);
+		spinlock_unlock(&spl_lru);
+		vp->vp_flags &= ~(VM_PAGE_FLAG_SWAPPABLE | VM_PAGE_FLAG_ACTIVE);
+		vp->vp_vmspace = nullptr;
+	}
+	vmpage_unlock(vp);
+}
+
+bool
+vmpage_migrate(struct PAGE* p, struct PAGE* p_new)
+{
+	// As in lru_grab(): the page is on the lists, so its vmspace is still there
+	spinlock_lock(&spl_lru);
+	struct VM_PAGE* vp = p->p_vmpage;
+	if (vp == nullptr || !mutex_trylock(&vp->vp_mtx)) {
+		spinlock_unlock(&spl_lru);
+		return false;
+	}
+	vmspace_t* vs = vp->vp_vmspace;
+	vmarea_t* va = vmspace_trylock_area(vs, vp->vp_vaddr);
+	if (va == nullptr) {
+		spinlock_unlock(&spl_lru);
+		vmpage_unlock(vp);
+		return false;
+	}
+	spinlock_unlock(&spl_lru);
+
+	// Anyone else holding a reference may be using the backing page directly
+	bool moved = vp->vp_refcount == 1;
+	if (moved) {
+		md_unmap_pages(vs, vp->vp_vaddr, 1);
+		void* src = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ);
+		void* dst = kmem_map(page_get_paddr(p_new), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+		memcpy_pages(dst, src, PAGE_SIZE, 0);
+		kmem_unmap(dst, PAGE_SIZE);
+		kmem_unmap(src, PAGE_SIZE);
+
+		spinlock_lock(&spl_lru);
+		p->p_vmpage = nullptr;
+		p_new->p_vmpage = vp;
+		spinlock_unlock(&spl_lru);
+		vp->vp_page = p_new;
+	}
+	vmspace_unlock_area(vs, va);
+	vmpage_unlock(vp);
+	return moved;
+}
+
+void
+swap_in(struct VM_PAGE* vp)
+{
+	KASSERT(vp->vp_flags & VM_PAGE_FLAG_SWAPPED, "page %p is not swapped out", vp);
+
+	struct PAGE* p = page_alloc_order_wait(0);
+	void* data = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+#ifdef OPTION_ZSWAP
+	if (vp->vp_flags & VM_PAGE_FLAG_ZSWAPPED) {
+		zswap_load(vp->vp_zswap, data);
+		kmem_unmap(data, PAGE_SIZE);
+		vp->vp_page = p;
+		vp->vp_flags &= ~(VM_PAGE_FLAG_SWAPPED | VM_PAGE_FLAG_ZSWAPPED);
+		return;
+	}
+#endif
+	errorcode_t err = bio_transfer_direct(swap_device, swap_slot_block(vp->vp_swap_slot), 1, PAGE_SIZE, &data, false);
+	kmem_unmap(data, PAGE_SIZE);
+	// The only copy of the data is gone; there is nothing sensible to hand out
+	if (ananas_is_failure(err))
+		panic("cannot read swap slot %u, error %d", vp->vp_swap_slot, err);
+
+	swap_free_slot(vp->vp_swap_slot);
+	vp->vp_page = p;
+	vp->vp_flags &= ~VM_PAGE_FLAG_SWAPPED;
+}
+
+void
+swap_release(struct VM_PAGE* vp)
+{
+	KASSERT(vp->vp_flags & VM_PAGE_FLAG_SWAPPED, "page %p is not swapped out", vp);
+#ifdef OPTION_ZSWAP
+	if (vp->vp_flags & VM_PAGE_FLAG_ZSWAPPED)
+		zswap_free(vp->vp_zswap);
+	else
+#endif
+		swap_free_slot(vp->vp_swap_slot);
+	vp->vp_flags &= ~(VM_PAGE_FLAG_SWAPPED | VM_PAGE_FLAG_ZSWAPPED);
+}
+
+namespace {
+
+void
+swap_init_device(const char* swap_arg)
+{
+	char device[64];
+	const char* size = strchr(swap_arg, ':');
+	if (size == nullptr || (size_t)(size - swap_arg) >= sizeof(device)) {
+		kprintf("cannot parse 'swap' - expected device:size\n");
+		return;
+	}
+	memcpy(device, swap_arg, size - swap_arg);
+	device[size - swap_arg] = '\0';
+	unsigned int num_slots = strtoul(size + 1, NULL, 10) / (PAGE_SIZE / 1024);
+
+	Ananas::Device* dev = Ananas::DeviceManager::FindDevice(device);
+	if (dev == nullptr) {
+		Ananas::DeviceManager::WaitForAttach();
+		dev = Ananas::DeviceManager::FindDevice(device);
+	}
+	if (dev == nullptr || dev->GetBIODeviceOperations() == nullptr || num_slots == 0) {
+		kprintf("- Cannot use %s as swap\n", device);
+		return;
+	}
+
+	swap_map = new uint32_t[(num_slots + 31) / 32];
+	memset(swap_map, 0, ((num_slots + 31) / 32) * sizeof(uint32_t));
+	swap_num_slots = num_slots;
+	swap_num_free = num_slots;
+	swap_device = dev;
+	kprintf("- Swapping to %s, %u KB\n", device, num_slots * (PAGE_SIZE / 1024));
+}
+
+} // unnamed namespace
+
+void
+swap_init()
+{
+	const char* swap_arg = cmdline_get_string("swap");
+	if (swap_arg != nullptr)
+		swap_init_device(swap_arg);
+
+	bool have_zswap = false;
+#ifdef OPTION_ZSWAP
+	have_zswap = zswap_init();
+#endif
+	if (swap_device == nullptr && !have_zswap)
+		return;
+
+	// Swapping is a last resort, so we go after the caches
+	swap_reclaimer.pr_name = "swap";
+	swap_reclaimer.pr_func = swap_reclaim;
+	swap_reclaimer.pr_flags = PAGE_RECLAIMER_F_DAEMON;
+	page_register_reclaimer(&swap_reclaimer);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -2,21 +2,36 @@
 #include <machine/param.h> /* for PAGE_SIZE */
 #include <machine/vm.h> /* for md_{,un}map_pages() */
 #include <ananas/error.h>
+#include <ananas/init.h>
 #include <ananas/lib.h>
 #include <ananas/process.h>
 #include <ananas/trace.h>
 #include <ananas/kmem.h>
 #include <ananas/pcpu.h>
+#include <ananas/shm.h>
+#include <ananas/slab.h>
+#include <ananas/taskstats.h>
+#include <ananas/thread.h>
+#include <ananas/tunable.h>
 #include <ananas/vm.h>
 #include <ananas/lib.h>
 #include <ananas/vmpage.h>
 #include <ananas/vfs/core.h>
+#include <ananas/vfs/dentry.h>
 #include <ananas/vmspace.h>
 
 TRACE_SETUP;
 
+#define VM_FAULT_AROUND_PAGES	8	/* Window of resident pages mapped on a fault */
+#define VM_STACK_CHUNK_PAGES	16	/* Pages backed at once on stack faults (64KB) */
+
 namespace {
 
+/* Tunables; see /ankh/sys */
+unsigned int vm_readahead_pages = 16; /* Pages read ahead on sequential faults */
+unsigned int vm_readahead_sequential_pages = 64; /* Pages read ahead on every fault in a sequential area */
+unsigned int vm_fault_ahead_pages = 16; /* Pages backed ahead on sequential anonymous faults */
+
 errorcode_t
 read_data(struct DENTRY* dentry, void* buf, off_t offset, size_t len)
 {
@@ -46,66 +61,348 @@ vmspace_page_flags_from_va(vmarea_t* va)
 	return flags;
 }
 
+// Reads data which is not page-aligned in the file into a page of its own
+errorcode_t
+vmspace_read_unaligned(struct DENTRY* dentry, struct VM_PAGE* vmpage, off_t offset)
+{
+	struct PAGE* p = vmpage_get_page(vmpage);
+	void* page = kmem_map(page_get_paddr(p), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	errorcode_t err = read_data(dentry, page, offset, PAGE_SIZE);
+	kmem_unmap(page, PAGE_SIZE);
+	return err;
+}
+
+/*
+ * Maps any pages surrounding v_page which are already present in the inode;
+ * this saves us a fault for each of them. This is only possible for shared
+ * mappings as private ones need their own copy of every page.
+ */
+void
+vmspace_fault_around(vmspace_t* vs, vmarea_t* va, addr_t v_page)
+{
+	if ((va->va_flags & VM_FLAG_PRIVATE) || va->va_advice == VM_ADVICE_RANDOM)
+		return;
+
+	addr_t start = ROUND_DOWN(v_page, VM_FAULT_AROUND_PAGES * PAGE_SIZE);
+	if (start < va->va_virt)
+		start = va->va_virt;
+	addr_t end = start + VM_FAULT_AROUND_PAGES * PAGE_SIZE;
+	if (end > va->va_virt + va->va_len)
+		end = va->va_virt + va->va_len;
+
+	for (addr_t v = start; v < end; v += PAGE_SIZE) {
+		off_t offset = v - va->va_virt;
+		if (offset + PAGE_SIZE > va->va_dlength)
+			break; // only whole pages can be shared
+		if (v == v_page || vmarea_lookup_page(va, v) != nullptr)
+			continue;
+
+		struct VM_PAGE* new_vp = vmpage_link_cached(va->va_dentry->d_inode, va->va_doffset + offset);
+		if (new_vp == nullptr)
+			continue;
+
+		new_vp->vp_flags |= vmspace_page_flags_from_va(va);
+		new_vp->vp_vaddr = v;
+		vmarea_add_page(va, new_vp);
+		md_map_pages(vs, v, page_get_paddr(vmpage_get_page(new_vp)), 1, va->va_flags);
+	}
+}
+
+/*
+ * Readahead requests are handled by a separate thread, so that the faulting
+ * thread can continue as soon as its own page is present.
+ */
+struct VM_READAHEAD {
+	struct DENTRY* ra_dentry;
+	off_t ra_offset;
+	unsigned int ra_pages;
+	LIST_FIELDS(struct VM_READAHEAD);
+};
+
+LIST_DEFINE(VM_READAHEAD_QUEUE, struct VM_READAHEAD);
+
+spinlock_t spl_readahead = SPINLOCK_DEFAULT_INIT;
+struct VM_READAHEAD_QUEUE readahead_queue;
+semaphore_t readahead_sem;
+thread_t readahead_thread;
+bool readahead_running = false;
+SLAB_CACHE_DEFINE(readahead_cache, struct VM_READAHEAD, nullptr);
+
+void
+vmspace_readahead(vmarea_t* va, off_t offset, unsigned int num_pages)
+{
+	if (!readahead_running)
+		return;
+
+	// Do not read beyond the final whole page
+	off_t end = va->va_doffset + va->va_dlength;
+	if (offset + num_pages * PAGE_SIZE > end)
+		num_pages = (end > offset) ? (end - offset) / PAGE_SIZE : 0;
+	if (num_pages == 0)
+		return;
+
+	auto ra = static_cast<struct VM_READAHEAD*>(slab_alloc(&readahead_cache));
+	dentry_ref(va->va_dentry);
+	ra->ra_dentry = va->va_dentry;
+	ra->ra_offset = offset;
+	ra->ra_pages = num_pages;
+
+	spinlock_lock(&spl_readahead);
+	LIST_APPEND(&readahead_queue, ra);
+	spinlock_unlock(&spl_readahead);
+	sem_signal(&readahead_sem);
+}
+
+void
+readahead_thread_func(void* context)
+{
+	while(1) {
+		sem_wait(&readahead_sem);
+
+		spinlock_lock(&spl_readahead);
+		KASSERT(!LIST_EMPTY(&readahead_queue), "readahead woke up with empty queue?");
+		struct VM_READAHEAD* ra = LIST_HEAD(&readahead_queue);
+		LIST_POP_HEAD(&readahead_queue);
+		spinlock_unlock(&spl_readahead);
+
+		for (unsigned int n = 0; n < ra->ra_pages; n++) {
+			struct VM_PAGE* vmpage;
+			errorcode_t err = vfs_pagecache_get(ra->ra_dentry, ra->ra_offset + n * PAGE_SIZE, &vmpage);
+			if (ananas_is_failure(err))
+				break; // leave it to the fault handler to try again
+			vmpage_unlock(vmpage);
+		}
+
+		dentry_deref(ra->ra_dentry);
+		slab_free(&readahead_cache, ra);
+	}
+}
+
+errorcode_t
+readahead_init()
+{
+	LIST_INIT(&readahead_queue);
+	sem_init(&readahead_sem, 0);
+	kthread_init(&readahead_thread, "readahead", &readahead_thread_func, nullptr);
+	thread_resume(&readahead_thread);
+	readahead_running = true;
+	return ananas_success();
+}
+
+/*
+ * Backs the chunk of a stack area around v_page with cleared pages; stacks
+ * tend to be used in one direction, so this saves a fault for every page.
+ */
+void
+vmspace_fault_stack(vmspace_t* vs, vmarea_t* va, addr_t v_page)
+{
+	addr_t start = ROUND_DOWN(v_page, VM_STACK_CHUNK_PAGES * PAGE_SIZE);
+	if (start < va->va_virt)
+		start = va->va_virt;
+	addr_t end = start + VM_STACK_CHUNK_PAGES * PAGE_SIZE;
+	if (end > va->va_virt + va->va_len)
+		end = va->va_virt + va->va_len;
+
+	for (addr_t v = start; v < end; v += PAGE_SIZE) {
+		if (vmarea_lookup_page(va, v) != nullptr)
+			continue;
+
+		struct VM_PAGE* new_vp = vmpage_create_private_zeroed(VM_PAGE_FLAG_PRIVATE);
+		new_vp->vp_vaddr = v;
+		vmarea_add_page(va, new_vp);
+		md_map_pages(vs, v, page_get_paddr(vmpage_get_page(new_vp)), 1, va->va_flags);
+		vmpage_activate(vs, new_vp);
+	}
+}
+
+/*
+ * Backs the pages following v_page with cleared pages if the area is being
+ * touched sequentially for the first time, i.e. v_page directly follows the
+ * pages we backed on the previous fault; this is what initializing a large
+ * array or growing the heap looks like, and it saves a fault for every page.
+ */
+void
+vmspace_fault_ahead(vmspace_t* vs, vmarea_t* va, addr_t v_page)
+{
+	addr_t end = v_page + PAGE_SIZE;
+	if (v_page == va->va_anon_next && va->va_advice != VM_ADVICE_RANDOM) {
+		unsigned int num_pages = __atomic_load_n(&vm_fault_ahead_pages, __ATOMIC_RELAXED);
+		addr_t va_end = va->va_virt + va->va_len;
+		struct MD_MAP_CURSOR mc;
+		md_map_cursor_init(&mc, vs);
+		for (unsigned int n = 0; n < num_pages && end < va_end; n++, end += PAGE_SIZE) {
+			// Stop at anything already present; we would only be duplicating work
+			if (vmarea_lookup_page(va, end) != nullptr)
+				break;
+
+			struct VM_PAGE* new_vp = vmpage_create_private_zeroed(VM_PAGE_FLAG_PRIVATE);
+			new_vp->vp_vaddr = end;
+			vmarea_add_page(va, new_vp);
+			md_map_cursor_page(&mc, end, page_get_paddr(vmpage_get_page(new_vp)), va->va_flags);
+			vmpage_activate(vs, new_vp);
+		}
+		md_map_cursor_done(&mc);
+	}
+	va->va_anon_next = end;
+}
+
+#ifdef LARGE_PAGE_SIZE
+/*
+ * Backs the entire large page around v_page in an anonymous area in one go,
+ * if it is completely within the area and nothing in it is in use yet; the
+ * pages are still tracked one by one, so copy-on-write and unmapping parts
+ * work as usual (the large page will be split as needed)
+ */
+bool
+vmspace_fault_large(vmspace_t* vs, vmarea_t* va, addr_t v_page)
+{
+	addr_t v_large = ROUND_DOWN(v_page, LARGE_PAGE_SIZE);
+	if (v_large < va->va_virt || v_large + LARGE_PAGE_SIZE > va->va_virt + va->va_len)
+		return false;
+	for (addr_t v = v_large; v < v_large + LARGE_PAGE_SIZE; v += PAGE_SIZE)
+		if (vmarea_lookup_page(va, v) != nullptr)
+			return false;
+
+	struct PAGE* p = page_alloc_order_split(LARGE_PAGE_ORDER);
+	if (p == nullptr)
+		return false; // too fragmented; fall back to normal pages
+	addr_t phys = page_get_paddr(p);
+	void* mem = kmem_map(phys, LARGE_PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	/* This is far more than the faulting thread will touch soon; don't flush the cache for it */
+	memzero_pages(mem, LARGE_PAGE_SIZE, PAGEMEM_NONTEMPORAL);
+	kmem_unmap(mem, LARGE_PAGE_SIZE);
+
+	for (unsigned int n = 0; n < LARGE_PAGE_SIZE / PAGE_SIZE; n++) {
+		struct VM_PAGE* vp = vmpage_create_private_page(&p[n], VM_PAGE_FLAG_PRIVATE);
+		vp->vp_vaddr = v_large + n * PAGE_SIZE;
+		vmarea_add_page(va, vp);
+		vmpage_activate(vs, vp); // we hold the vmspace, so nobody will look at it before it is mapped
+	}
+	md_map_pages(vs, v_large, phys, LARGE_PAGE_SIZE / PAGE_SIZE, va->va_flags);
+	return true;
+}
+#endif
+
 } // unnamed namespace
 
+INIT_FUNCTION(readahead_init, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+TUNABLE_UINT("vm.readahead_pages", vm_readahead_pages, 1, 1024, nullptr, "Pages read ahead on sequential faults");
+TUNABLE_UINT("vm.readahead_sequential_pages", vm_readahead_sequential_pages, 1, 1024, nullptr, "Pages read ahead on faults in areas advised sequential");
+TUNABLE_UINT("vm.fault_ahead_pages", vm_fault_ahead_pages, 0, 256, nullptr, "Pages backed ahead on sequential first touch of anonymous memory");
+
+/*
+ * Maps every page of a shared dentry-backed area which is already present in
+ * the inode, so that freshly executed programs need not fault in text that
+ * is already resident.
+ */
+void
+vmspace_map_resident(vmspace_t* vs, vmarea_t* va)
+{
+	if (va->va_dentry == nullptr || (va->va_flags & VM_FLAG_PRIVATE))
+		return;
+	if (va->va_doffset & (PAGE_SIZE - 1))
+		return; // cannot share pages with the page cache
+
+	vmspace_lock_read(vs);
+	vmarea_lock(va);
+	for (off_t offset = 0; offset + PAGE_SIZE <= va->va_dlength && offset < va->va_len; offset += PAGE_SIZE) {
+		addr_t v = va->va_virt + offset;
+		if (vmarea_lookup_page(va, v) != nullptr)
+			continue;
+
+		struct VM_PAGE* new_vp = vmpage_link_cached(va->va_dentry->d_inode, va->va_doffset + offset);
+		if (new_vp == nullptr)
+			continue;
+
+		new_vp->vp_flags |= vmspace_page_flags_from_va(va);
+		new_vp->vp_vaddr = v;
+		vmarea_add_page(va, new_vp);
+		md_map_pages(vs, v, page_get_paddr(vmpage_get_page(new_vp)), 1, va->va_flags);
+	}
+	vmarea_unlock(va);
+	vmspace_unlock_read(vs);
+}
+
+namespace {
+
+/*
+ * Resolves a fault at virt within va; the vmspace must be locked and so must
+ * va, which also keeps the page daemon from swapping out anything we are
+ * about to map.
+ */
 errorcode_t
-vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags)
+vmspace_handle_fault_locked(vmspace_t* vs, vmarea_t* va, addr_t virt, int flags)
 {
 	TRACE(VM, INFO, "vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x", vs, virt, flags);
 
-	/* Walk through the areas one by one */
-	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		if (!(virt >= va->va_virt && (virt < (va->va_virt + va->va_len))))
-			continue;
+	/* We should only get faults for lazy areas (filled by a function) or when we have to dynamically allocate things */
+	KASSERT((va->va_flags & (VM_FLAG_ALLOC | VM_FLAG_LAZY)) != 0, "unexpected pagefault in area %p, virt=%p, len=%d, flags 0x%x", va, va->va_virt, va->va_len, va->va_flags);
 
-		/* We should only get faults for lazy areas (filled by a function) or when we have to dynamically allocate things */
-		KASSERT((va->va_flags & (VM_FLAG_ALLOC | VM_FLAG_LAZY)) != 0, "unexpected pagefault in area %p, virt=%p, len=%d, flags 0x%x", va, va->va_virt, va->va_len, va->va_flags);
-
-		// XXX lookup the page here, perhaps we are going from COW a new copy
-		//struct VM_PAGE* vp =
-
-		// XXX we expect va_doffset to be page-aligned here (i.e. we can always use a page directly)
-		// this needs to be enforced when making mappings!
-
-		// If there is a dentry attached here, perhaps we may find what we need in the corresponding inode
-		if (va->va_dentry != nullptr) {
-			addr_t v_page = virt & ~(PAGE_SIZE - 1);
-			off_t read_off = v_page - va->va_virt; // offset in area, still needs va_doffset added
-			if (read_off < va->va_dlength) {
-				// At least (part of) the page is to be read from disk - this means we want
-				// the entire page
-				read_off += va->va_doffset;
-				struct VM_PAGE* vmpage = vmpage_lookup_locked(va, va->va_dentry->d_inode, read_off);
-				if (vmpage == nullptr) {
-					// Page not found - we need to allocate one. This is always a shared mapping, which we'll copy if needed
-					vmpage = vmpage_create_shared(va, va->va_dentry->d_inode, read_off, VM_PAGE_FLAG_PENDING | vmspace_page_flags_from_va(va));
-				}
-				// vmpage will be locked at this point!
+	// See if we already have a page here; if so, this must be a write to a
+	// copy-on-write page, which we'll give its own copy now
+	addr_t v_page = virt & ~(PAGE_SIZE - 1);
+	struct VM_PAGE* vp = vmarea_lookup_page(va, v_page);
+	if (vp != nullptr) {
+		if ((flags & VM_FLAG_WRITE) && (va->va_flags & VM_FLAG_WRITE) == 0)
+			return ANANAS_ERROR(BAD_ADDRESS);
 
-				if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) {
-					// Read the page - note that we hold the vmpage lock while doing this
-					struct PAGE* p;
-					void* page = page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE);
-					KASSERT(p != nullptr, "out of memory"); // XXX handle this
+		// The page may have been swapped out; if so, it is read back here
+		int map_flags = va->va_flags;
+		int fault_type = (vp->vp_flags & VM_PAGE_FLAG_SWAPPED) ? TASKSTATS_FAULT_MAJOR : TASKSTATS_FAULT_MINOR;
+		if (vp->vp_flags & VM_PAGE_FLAG_COW) {
+			if (flags & VM_FLAG_WRITE) {
+				errorcode_t err = vmpage_promote(vp);
+				ANANAS_ERROR_RETURN(err);
+				fault_type = TASKSTATS_FAULT_COW;
+			} else
+				map_flags &= ~VM_FLAG_WRITE;
+		}
+		md_map_pages(vs, v_page, page_get_paddr(vmpage_get_page(vp)), 1, map_flags);
+		vmpage_activate(vs, vp);
+		taskstats_fault(fault_type);
+		return ananas_success();
+	}
+
+	// XXX we expect va_doffset to be page-aligned here (i.e. we can always use a page directly)
+	// this needs to be enforced when making mappings!
 
-					errorcode_t err = read_data(va->va_dentry, page, read_off, PAGE_SIZE);
-					kmem_unmap(page, PAGE_SIZE);
+	// If there is a dentry attached here, perhaps we may find what we need in the corresponding inode
+	if (va->va_dentry != nullptr) {
+		off_t read_off = v_page - va->va_virt; // offset in area, still needs va_doffset added
+		if (read_off < va->va_dlength) {
+			// At least (part of) the page is to be read from disk - this means we want
+			// the entire page
+			read_off += va->va_doffset;
+			bool is_aligned = (read_off & (PAGE_SIZE - 1)) == 0;
+			struct VM_PAGE* new_vp;
+			int map_flags = va->va_flags;
+			bool was_read = true;
+			if (is_aligned) {
+				// Obtain the page from the page cache; this reads it if needed
+				struct VM_PAGE* vmpage = nullptr;
+				while (vmpage == nullptr) {
+					errorcode_t err = vfs_pagecache_get_ex(va->va_dentry, read_off, &vmpage, &was_read);
 					KASSERT(ananas_is_success(err), "cannot deal with error %d", err); // XXX
+					// vmpage will be locked at this point!
 
-					// Update the vm page to contain our new address
-					vmpage->vp_page = p;
-					vmpage->vp_flags &= ~VM_PAGE_FLAG_PENDING;
+					// Pages lent to read() must keep their data, but shared mappings must see
+					// every change to the file (and may make them); give the file a copy
+					if ((va->va_flags & VM_FLAG_PRIVATE) == 0 && (vmpage->vp_flags & VM_PAGE_FLAG_LENT))
+						vmpage = vmpage_unlend(va->va_dentry->d_inode, vmpage);
 				}
 
 				// If the mapping is page-aligned and read-only or shared, we can re-use the
 				// mapping and avoid the entire copy
-				struct VM_PAGE* new_vp;
 				bool is_whole_page = (read_off + PAGE_SIZE) <= (va->va_doffset + va->va_dlength);
-				//is_whole_page = false; // xxx
 				if (is_whole_page && (va->va_flags & VM_FLAG_PRIVATE) == 0) {
 					new_vp = vmpage_link(vmpage);
+					new_vp->vp_flags |= vmspace_page_flags_from_va(va);
+				} else if (is_whole_page && (flags & VM_FLAG_WRITE) == 0) {
+					// Private, but only read so far; share the page until it is written to
+					new_vp = vmpage_link(vmpage);
+					new_vp->vp_flags |= VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_COW;
+					map_flags &= ~VM_FLAG_WRITE;
 				} else {
-					//kprintf("could NOT share %p (%x, %u, %u)\n", v_page, va->va_flags, (int)(read_off + PAGE_SIZE), (int)(va->va_doffset + va->va_dlength));
 					// Cannot re-use; create a new VM page, with appropriate flags based on the va
 					new_vp = vmpage_create_private(VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
 
@@ -113,33 +410,177 @@ vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags)
 					vmpage_copy(vmpage, new_vp);
 				}
 				vmpage_unlock(vmpage);
+			} else {
+				// The data does not start at a page boundary in the file, so it can't be
+				// shared with the page cache; read it into a page of our own
+				new_vp = vmpage_create_private(VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
+				errorcode_t err = vmspace_read_unaligned(va->va_dentry, new_vp, read_off);
+				KASSERT(ananas_is_success(err), "cannot deal with error %d", err); // XXX
+			}
 
-				LIST_APPEND(&va->va_pages, new_vp);
-				new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+			new_vp->vp_vaddr = v_page;
+			vmarea_add_page(va, new_vp);
 
-				// Finally, update the permissions and we are done
-				struct PAGE* new_p = vmpage_get_page(new_vp);
-				md_map_pages(vs, new_vp->vp_vaddr, page_get_paddr(new_p), 1, va->va_flags);
-				return ananas_success();
-			}
+			// Finally, update the permissions
+			struct PAGE* new_p = vmpage_get_page(new_vp);
+			md_map_pages(vs, new_vp->vp_vaddr, page_get_paddr(new_p), 1, map_flags);
+			vmpage_activate(vs, new_vp);
+			taskstats_fault(was_read ? TASKSTATS_FAULT_MAJOR : TASKSTATS_FAULT_MINOR);
+
+			// Map whatever is around us, and read ahead if we are faulting sequentially
+			vmspace_fault_around(vs, va, v_page);
+			bool sequential = is_aligned && va->va_last_fault >= 0 && read_off > va->va_last_fault &&
+			 read_off - va->va_last_fault <= vm_readahead_pages * PAGE_SIZE;
+			va->va_last_fault = read_off;
+			if (is_aligned && va->va_advice == VM_ADVICE_SEQUENTIAL)
+				vmspace_readahead(va, read_off + PAGE_SIZE, vm_readahead_sequential_pages);
+			else if (sequential && va->va_advice != VM_ADVICE_RANDOM)
+				vmspace_readahead(va, read_off + PAGE_SIZE, vm_readahead_pages);
+			return ananas_success();
+		}
+	}
+
+	// Shared memory objects hand the same pages to every mapping
+	if (va->va_shm != nullptr) {
+		struct VM_PAGE* vp_shm = shm_link_page(va->va_shm, va->va_doffset + (v_page - va->va_virt));
+		struct VM_PAGE* new_vp = vp_shm;
+		int map_flags = va->va_flags;
+		if ((va->va_flags & VM_FLAG_PRIVATE) == 0) {
+			new_vp->vp_flags |= vmspace_page_flags_from_va(va);
+		} else if ((flags & VM_FLAG_WRITE) == 0) {
+			// Private, but only read so far; share the page until it is written to
+			new_vp->vp_flags |= VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_COW;
+			map_flags &= ~VM_FLAG_WRITE;
+		} else {
+			new_vp = vmpage_create_private(VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
+			vmpage_copy(vp_shm, new_vp);
+			vmpage_deref(vp_shm);
 		}
 
-		// We need a new VM page here; this is an anonymous mapping which we need to back
-		struct VM_PAGE* new_vp = vmpage_create_private(VM_PAGE_FLAG_PRIVATE);
-		LIST_APPEND(&va->va_pages, new_vp);
-		struct PAGE* new_p = vmpage_get_page(new_vp);
-		new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+		new_vp->vp_vaddr = v_page;
+		vmarea_add_page(va, new_vp);
+		md_map_pages(vs, v_page, page_get_paddr(vmpage_get_page(new_vp)), 1, map_flags);
+		vmpage_activate(vs, new_vp);
+		taskstats_fault(TASKSTATS_FAULT_MINOR);
+		return ananas_success();
+	}
 
-		// Clear the page XXX This is unfortunate, we should have a supply of pre-zeroed pages
-		md_map_pages(vs, new_vp->vp_vaddr, page_get_paddr(new_p), 1, VM_FLAG_READ | VM_FLAG_WRITE);
-		memset((void*)new_vp->vp_vaddr, 0, PAGE_SIZE);
+	// Stacks are backed a chunk at a time
+	if (va->va_dentry == nullptr && (va->va_flags & VM_FLAG_STACK)) {
+		vmspace_fault_stack(vs, va, v_page);
+		taskstats_fault(TASKSTATS_FAULT_MINOR);
+		return ananas_success();
+	}
 
-		// And now (re)map the page for the caller
-		md_map_pages(vs, new_vp->vp_vaddr, page_get_paddr(new_p), 1, va->va_flags);
+#ifdef LARGE_PAGE_SIZE
+	// Purely anonymous areas get a large page at once if they are big enough
+	if (va->va_dentry == nullptr && vmspace_fault_large(vs, va, v_page)) {
+		taskstats_fault(TASKSTATS_FAULT_MINOR);
 		return ananas_success();
 	}
+#endif
+
+	// We need a new VM page here; this is an anonymous mapping which we need to back
+	// with a cleared page - take one from the pre-zeroed supply
+	struct VM_PAGE* new_vp = vmpage_create_private_zeroed(VM_PAGE_FLAG_PRIVATE);
+	new_vp->vp_vaddr = v_page;
+	vmarea_add_page(va, new_vp);
+	struct PAGE* new_p = vmpage_get_page(new_vp);
+
+	// And now map the page for the caller
+	md_map_pages(vs, new_vp->vp_vaddr, page_get_paddr(new_p), 1, va->va_flags);
+	vmpage_activate(vs, new_vp);
+	taskstats_fault(TASKSTATS_FAULT_MINOR);
+
+	// If this continues where the previous fault left off, back what follows as well
+	vmspace_fault_ahead(vs, va, v_page);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+errorcode_t
+vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags)
+{
+	// The areas stay put while we look them up; only the one we fault in is locked
+	vmspace_lock_read(vs);
+
+	/*
+	 * Try the area this thread faulted in last time first; faults tend to be
+	 * clustered. The cached area is only valid if no areas were removed since.
+	 */
+	thread_t* curthread = PCPU_GET(curthread);
+	bool use_hint = curthread != nullptr && curthread->t_process != nullptr && curthread->t_process->p_vmspace == vs;
+	vmarea_t* va = nullptr;
+	if (use_hint && curthread->t_fault_area != nullptr && curthread->t_fault_area_gen == vs->vs_generation) {
+		vmarea_t* hint = curthread->t_fault_area;
+		if (virt >= hint->va_virt && virt < hint->va_virt + hint->va_len)
+			va = hint;
+	}
+	if (va == nullptr) {
+		va = vmspace_find_area(vs, virt);
+		if (va == nullptr) {
+			vmspace_unlock_read(vs);
+			return ANANAS_ERROR(BAD_ADDRESS);
+		}
+		if (use_hint) {
+			curthread->t_fault_area = va;
+			curthread->t_fault_area_gen = vs->vs_generation;
+		}
+	}
 
-	return ANANAS_ERROR(BAD_ADDRESS);
+	vmarea_lock(va);
+	errorcode_t err = vmspace_handle_fault_locked(vs, va, virt, flags);
+	vmarea_unlock(va);
+	vmspace_unlock_read(vs);
+	return err;
+}
+
+/*
+ * Faults in all pages of [virt, virt + len) which are not yet present, as if
+ * they had been accessed using flags; this avoids taking the faults later.
+ */
+void
+vmspace_prefault(vmspace_t* vs, addr_t virt, size_t len, int flags)
+{
+	vmspace_lock_read(vs);
+	for (addr_t v = ROUND_DOWN(virt, PAGE_SIZE); v < virt + len; v += PAGE_SIZE) {
+		vmarea_t* va = vmspace_find_area(vs, v);
+		if (va == nullptr || (va->va_flags & (VM_FLAG_ALLOC | VM_FLAG_LAZY)) == 0)
+			continue;
+		vmarea_lock(va);
+		if (vmarea_lookup_page(va, v) == nullptr) {
+			errorcode_t err = vmspace_handle_fault_locked(vs, va, v, flags);
+			(void)err; // whatever went wrong will happen again on access
+		}
+		vmarea_unlock(va);
+	}
+	vmspace_unlock_read(vs);
+}
+
+errorcode_t
+vmspace_willneed(vmspace_t* vs, addr_t virt, size_t len)
+{
+	addr_t end = ROUND_UP(virt + len, PAGE_SIZE);
+	virt = ROUND_DOWN(virt, PAGE_SIZE);
+	vmspace_lock_read(vs);
+	for (addr_t v = virt; v < end; /* nothing */) {
+		vmarea_t* va = vmspace_find_area(vs, v);
+		if (va == nullptr) {
+			vmspace_unlock_read(vs);
+			return ANANAS_ERROR(BAD_ADDRESS);
+		}
+		addr_t va_end = va->va_virt + va->va_len;
+		if (va_end > end)
+			va_end = end;
+
+		// Only file data can be fetched in advance; it must be page-aligned to be cached
+		if (va->va_dentry != nullptr && (va->va_doffset & (PAGE_SIZE - 1)) == 0)
+			vmspace_readahead(va, va->va_doffset + (v - va->va_virt), (va_end - v) / PAGE_SIZE);
+		v = va_end;
+	}
+	vmspace_unlock_read(vs);
+	return ananas_success();
 }
 
 /* vim:set ts=2 sw=2: */
@@ -4,57 +4,109 @@
 #include <ananas/lock.h>
 #include <ananas/mm.h>
 #include <ananas/lib.h>
+#include <ananas/slab.h>
+#include <ananas/swap.h>
 #include <ananas/vmspace.h>
 #include <ananas/error.h>
 #include <ananas/vfs/types.h>
 #include <ananas/kmem.h>
+#include <ananas/trace.h>
 #include <ananas/vm.h>
 #include <machine/param.h> // for PAGE_SIZE
 #include <machine/vm.h> /* for md_{,un}map_pages() */
 
+TRACE_SETUP;
+
 namespace {
 
+void
+vmpage_ctor(void* obj)
+{
+  auto vp = static_cast<struct VM_PAGE*>(obj);
+  mutex_init(&vp->vp_mtx, "vmpage");
+}
+
+SLAB_CACHE_DEFINE(vmpage_cache, struct VM_PAGE, &vmpage_ctor);
+
 void
 vmpage_free(struct VM_PAGE* vmpage)
 {
   // Note that we do not hold any references to the inode (the inode owns us)
-  if (vmpage->vp_flags & VM_PAGE_FLAG_LINK) {
+  KASSERT((vmpage->vp_flags & VM_PAGE_FLAG_SWAPPABLE) == 0, "freeing page %p which is still on the LRU lists", vmpage);
+  if (vmpage->vp_flags & VM_PAGE_FLAG_MERGED)
+    vmpage_merge_forget(vmpage);
+  if (vmpage->vp_flags & VM_PAGE_FLAG_SWAPPED) {
+    swap_release(vmpage);
+  } else if (vmpage->vp_flags & VM_PAGE_FLAG_LINK) {
     if (vmpage->vp_link != nullptr)
       vmpage_deref(vmpage->vp_link);
   } else {
     if (vmpage->vp_page != nullptr)
       page_free(vmpage->vp_page);
   }
-  kfree(vmpage);
-}
-
-#if 0
-void
-vmpage_promote(struct VM_PAGE* vp)
-{
-  // This promotes a COW page to a new writable page
-  KASSERT((vp->vp_flags & VM_PAGE_FLAG_COW) != 0, "attempt to promote non-COW page");
-
-  panic("todo");
+  slab_free(&vmpage_cache, vmpage);
 }
-#endif
 
 struct VM_PAGE*
 vmpage_alloc(struct VFS_INODE* inode, off_t offset, int flags)
 {
-  auto vp = static_cast<struct VM_PAGE*>(kmalloc(sizeof(struct VM_PAGE)));
-  memset(vp, 0, sizeof(struct VM_PAGE));
-  mutex_init(&vp->vp_mtx, "vmpage");
+  // Note that vp_mtx is set up by the constructor
+  auto vp = static_cast<struct VM_PAGE*>(slab_alloc(&vmpage_cache));
+  vp->li_next = nullptr;
+  vp->li_prev = nullptr;
+  vp->vp_page = nullptr;
+  vp->vp_vaddr = 0;
   vp->vp_inode = inode;
   vp->vp_offset = offset;
+  vp->vp_vmspace = nullptr;
+  vp->lru_next = nullptr;
+  vp->lru_prev = nullptr;
   vp->vp_flags = flags;
   vp->vp_refcount = 1; // caller
+  vp->vp_checksum = 0;
 
   return vp;
 }
 
+void
+page_copy(struct PAGE* p_src, struct PAGE* p_dst)
+{
+  void* src = kmem_map(page_get_paddr(p_src), PAGE_SIZE, VM_FLAG_READ);
+  void* dst = kmem_map(page_get_paddr(p_dst), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+	memcpy_pages(dst, src, PAGE_SIZE, 0);
+  kmem_unmap(dst, PAGE_SIZE);
+  kmem_unmap(src, PAGE_SIZE);
+}
+
+// Looks up the page at offset offs of the inode; the inode must be locked
+struct VM_PAGE*
+vmpage_lookup_inode(struct VFS_INODE* inode, off_t offs)
+{
+  auto vmpage = static_cast<struct VM_PAGE*>(radix_lookup(&inode->i_page_index, offs / PAGE_SIZE));
+  if (vmpage == nullptr || vmpage->vp_offset != offs)
+    return nullptr;
+  return vmpage;
+}
+
 } // unnamed namespace
 
+/*
+ * Turns a private page into a copy-on-write page; its backing page is moved to
+ * a new VM page, which we link to - any clones will link to it as well.
+ */
+void
+vmpage_make_cow(struct VM_PAGE* vp)
+{
+  KASSERT((vp->vp_flags & (VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_COW)) == 0, "page %p already shared", vp);
+
+  // Shared pages are never swapped out; bring it back if it already was
+  vmpage_deactivate(vp);
+  struct VM_PAGE* vp_backing = vmpage_alloc(nullptr, 0, VM_PAGE_FLAG_PRIVATE);
+  vp_backing->vp_page = vmpage_get_page(vp);
+  vp->vp_link = vp_backing;
+  vp->vp_flags |= VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_COW;
+}
+
 struct VM_PAGE*
 vmpage_link(struct VM_PAGE* vp)
 {
@@ -79,69 +131,136 @@ vmpage_link(struct VM_PAGE* vp)
 void
 vmpage_copy(struct VM_PAGE* vp_src, struct VM_PAGE* vp_dst)
 {
-  struct PAGE* p_src = vmpage_get_page(vp_src);
-  struct PAGE* p_dst = vmpage_get_page(vp_dst);
+  page_copy(vmpage_get_page(vp_src), vmpage_get_page(vp_dst));
+}
 
-  void* src = kmem_map(page_get_paddr(p_src), PAGE_SIZE, VM_FLAG_READ);
-  void* dst = kmem_map(page_get_paddr(p_dst), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
-	memcpy(dst, src, PAGE_SIZE);
-  kmem_unmap(dst, PAGE_SIZE);
-  kmem_unmap(src, PAGE_SIZE);
+errorcode_t
+vmpage_promote(struct VM_PAGE* vp)
+{
+  KASSERT((vp->vp_flags & (VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_COW)) == (VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_COW), "attempt to promote non-COW page %p", vp);
+  struct VM_PAGE* vp_backing = vp->vp_link;
+
+  // If we are the final user of the backing page, we can just take it over
+  vmpage_lock(vp_backing);
+  struct PAGE* p;
+  if (vp_backing->vp_refcount == 1) {
+    p = vp_backing->vp_page;
+    vp_backing->vp_page = nullptr;
+  } else {
+    // Running out here is the faulting process' problem, not the kernel's
+    p = page_alloc_order_try_wait(0);
+    if (p == nullptr) {
+      vmpage_unlock(vp_backing);
+      return ANANAS_ERROR(OUT_OF_MEMORY);
+    }
+    page_copy(vp_backing->vp_page, p);
+  }
+  vmpage_unlock(vp_backing);
+  vmpage_deref(vp_backing);
+
+  vp->vp_flags &= ~(VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_COW);
+  vp->vp_page = p;
+  return ananas_success();
 }
 
 void
 vmpage_ref(struct VM_PAGE* vmpage)
 {
-  ++vmpage->vp_refcount;
+  __atomic_add_fetch(&vmpage->vp_refcount, 1, __ATOMIC_RELAXED);
 }
 
 void
 vmpage_deref(struct VM_PAGE* vmpage)
 {
+  // Copy-on-write pages are shared between vmspaces, so this must be atomic
   KASSERT(vmpage->vp_refcount > 0, "invalid refcount %d", vmpage->vp_refcount);
-  if (--vmpage->vp_refcount > 0)
+  if (__atomic_sub_fetch(&vmpage->vp_refcount, 1, __ATOMIC_ACQ_REL) > 0)
     return;
 
   vmpage_free(vmpage);
 }
 
 struct VM_PAGE*
-vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs)
+vmpage_lookup_inode_locked(struct VFS_INODE* inode, off_t offs)
 {
-  /*
-   * First step is to see if we can locate this page for the given vmspace - the private mappings
-   * are stored there and override global ones.
-   */
-  LIST_FOREACH(&va->va_pages, vmpage, struct VM_PAGE) {
-    if (vmpage->vp_inode != inode || vmpage->vp_offset != offs)
-      continue;
+	INODE_LOCK(inode);
+  struct VM_PAGE* vmpage = vmpage_lookup_inode(inode, offs);
+  if (vmpage != nullptr)
+    vmpage_lock(vmpage); // XXX is this order wise?
+	INODE_UNLOCK(inode);
+  return vmpage;
+}
 
-    vmpage_lock(vmpage);
-    return vmpage;
+void
+vmpage_detach_inode(struct VFS_INODE* inode, struct VM_PAGE* vmpage)
+{
+	INODE_LOCK(inode);
+  bool present = vmpage_lookup_inode(inode, vmpage->vp_offset) == vmpage;
+  if (present) {
+    LIST_REMOVE(&inode->i_pages, vmpage);
+    radix_remove(&inode->i_page_index, vmpage->vp_offset / PAGE_SIZE);
   }
+	INODE_UNLOCK(inode);
+  if (present)
+    vmpage_deref(vmpage);
+}
 
-  // Try all inode-private pages
-	INODE_LOCK(inode);
-  LIST_FOREACH(&inode->i_pages, vmpage, struct VM_PAGE) {
-    // We don't check vp_inode here as this is the per-inode list already
-    if (vmpage->vp_offset != offs)
-      continue;
+struct VM_PAGE*
+vmpage_unlend(struct VFS_INODE* inode, struct VM_PAGE* vp)
+{
+  KASSERT((vp->vp_flags & (VM_PAGE_FLAG_LENT | VM_PAGE_FLAG_PENDING)) == VM_PAGE_FLAG_LENT, "page %p is not lent", vp);
 
-    vmpage_lock(vmpage); // XXX is this order wise?
-    INODE_UNLOCK(inode);
-    return vmpage;
+  // Our copy is not visible to anyone until it replaces the original
+  struct VM_PAGE* vp_new = vmpage_alloc(inode, vp->vp_offset, vp->vp_flags & ~VM_PAGE_FLAG_LENT);
+  vp_new->vp_page = page_alloc_order_wait(0);
+  page_copy(vp->vp_page, vp_new->vp_page);
+  vmpage_lock(vp_new);
+
+  // Let go of the original first; the inode lock must be taken before page locks
+  vmpage_unlock(vp);
+	INODE_LOCK(inode);
+  if (vmpage_lookup_inode(inode, vp->vp_offset) != vp) {
+    // Someone else replaced or dropped it meanwhile, so our copy may be stale
+	INODE_UNLOCK(inode);
+    vmpage_unlock(vp_new);
+    vmpage_deref(vp_new);
+    return nullptr;
   }
+  LIST_REMOVE(&inode->i_pages, vp);
+  LIST_APPEND(&inode->i_pages, vp_new);
+  radix_insert(&inode->i_page_index, vp->vp_offset / PAGE_SIZE, vp_new);
 	INODE_UNLOCK(inode);
 
-  // Nothing was found
-  return nullptr;
+  // Drops the inode's reference; whoever borrowed the page keeps theirs
+  vmpage_deref(vp);
+  return vp_new;
+}
+
+struct VM_PAGE*
+vmpage_link_cached(struct VFS_INODE* inode, off_t offs)
+{
+  /*
+   * Only consider pages which are readily available - if a page is locked,
+   * someone is likely reading it and we do not want to wait for that. Lent
+   * pages are left to the fault handler, which gives the file a copy first.
+   */
+  struct VM_PAGE* vp_new = nullptr;
+	INODE_LOCK(inode);
+  struct VM_PAGE* vmpage = vmpage_lookup_inode(inode, offs);
+  if (vmpage != nullptr && mutex_trylock(&vmpage->vp_mtx)) {
+    if ((vmpage->vp_flags & (VM_PAGE_FLAG_PENDING | VM_PAGE_FLAG_LENT)) == 0)
+      vp_new = vmpage_link(vmpage);
+    vmpage_unlock(vmpage);
+  }
+  INODE_UNLOCK(inode);
+  return vp_new;
 }
 
 struct VM_PAGE*
-vmpage_clone(struct VM_PAGE* vp_source)
+vmpage_clone(struct VM_PAGE* vp_orig)
 {
   // Get the virtual address before dereferencing links as the source is never mapped
-  addr_t vaddr = vp_source->vp_vaddr;
+  addr_t vaddr = vp_orig->vp_vaddr;
 
   /*
    * Cloning a page may results in different scenarios:
@@ -149,8 +268,10 @@ vmpage_clone(struct VM_PAGE* vp_source)
    * 1) We can create a link to the source page, using the same access
    * 2) We can create a link to the source page, yet employ COW
    *    This consists of marking the original page as read-only.
-   * 3) We need to duplicate the source page
+   * 3) The page is part of a shared file mapping, so we must link to it
+   * 4) We need to duplicate the source page
    */
+  struct VM_PAGE* vp_source = vp_orig;
   if (vp_source->vp_flags & VM_PAGE_FLAG_LINK) {
     // Linked page - get the reference to the original
     vp_source = vp_source->vp_link;
@@ -158,17 +279,29 @@ vmpage_clone(struct VM_PAGE* vp_source)
   }
   KASSERT((vp_source->vp_flags & VM_PAGE_FLAG_PENDING) == 0, "trying to clone a pending page");
 
-  // (1) If the source is read-only, we can always share it
-  if (vp_source->vp_flags & VM_PAGE_FLAG_READONLY) 
-    return vmpage_link(vp_source);
-  
-  // TODO Implement (2) !
-
-  // (3) Make a copy of the page; it will always become a private page now since it won't
-  //     be shared
-  struct VM_PAGE* vp_dst = vmpage_create_private(vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE /* XXX? is this ok? */);
+  struct VM_PAGE* vp_dst;
+  if (vp_orig->vp_flags & VM_PAGE_FLAG_READONLY) {
+    // (1) If the page is read-only, we can always share it; note that the page
+    //     cache itself is never read-only, only the links to it may be
+    vp_dst = vmpage_link(vp_source);
+    vp_dst->vp_flags |= VM_PAGE_FLAG_READONLY;
+  } else if (vp_orig->vp_flags & (VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_COW)) {
+    // (2) Private pages are shared until either side writes to them; the
+    //     caller must ensure neither side has the page mapped writable
+    if ((vp_orig->vp_flags & VM_PAGE_FLAG_COW) == 0)
+      vmpage_make_cow(vp_orig);
+    vp_dst = vmpage_link(vp_orig);
+    vp_dst->vp_flags |= VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_COW;
+  } else if ((vp_orig->vp_flags & (VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_PRIVATE)) == VM_PAGE_FLAG_LINK) {
+    // (3) Shared mappings link to the page cache; changes must be seen by both sides
+    vp_dst = vmpage_link(vp_source);
+  } else {
+    // (4) Make a copy of the page; it will always become a private page now since it won't
+    //     be shared
+    vp_dst = vmpage_create_private(vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE /* XXX? is this ok? */);
+    vmpage_copy(vp_source, vp_dst);
+  }
   vp_dst->vp_vaddr = vaddr;
-	vmpage_copy(vp_source, vp_dst);
   return vp_dst;
 }
 
@@ -180,33 +313,35 @@ vmpage_get_page(struct VM_PAGE* vp)
     KASSERT((vp->vp_flags & VM_PAGE_FLAG_LINK) == 0, "link to a linked page");
   }
 
+  // The page daemon may be writing the page to swap; wait for it, and read it back if it did
+  if (vp->vp_flags & (VM_PAGE_FLAG_SWAPPABLE | VM_PAGE_FLAG_SWAPPED)) {
+    vmpage_lock(vp);
+    if (vp->vp_flags & VM_PAGE_FLAG_SWAPPED)
+      swap_in(vp);
+    struct PAGE* p = vp->vp_page;
+    vmpage_unlock(vp);
+    return p;
+  }
   return vp->vp_page;
 }
 
 struct VM_PAGE*
 vmpage_create_shared(vmarea_t* va, struct VFS_INODE* inode, off_t offs, int flags)
 {
-  struct VM_PAGE* new_page = vmpage_alloc(inode, offs, flags);
-  vmpage_lock(new_page);
-
-  // Hook the vm page to the inode
   INODE_LOCK(inode);
-  LIST_FOREACH(&inode->i_pages, vmpage, struct VM_PAGE) {
-    if (vmpage->vp_offset != offs)
-      continue;
-
+  struct VM_PAGE* vmpage = vmpage_lookup_inode(inode, offs);
+  if (vmpage != nullptr) {
     // Page is already present - return the one already in use
     vmpage_lock(vmpage); // XXX is this order wise?
     INODE_UNLOCK(inode);
-
-    // And throw the new page away, we won't need it
-    vmpage_unlock(new_page);
-    kfree(new_page);
     return vmpage;
   }
 
-  // Not yet present; add the new page and return it
+  // Not yet present; hook a new page to the inode and return it
+  struct VM_PAGE* new_page = vmpage_alloc(inode, offs, flags);
+  vmpage_lock(new_page);
   LIST_APPEND(&inode->i_pages, new_page);
+  radix_insert(&inode->i_page_index, offs / PAGE_SIZE, new_page);
   INODE_UNLOCK(inode);
   return new_page;
 }
@@ -217,20 +352,40 @@ vmpage_create_private(int flags)
   auto new_page = vmpage_alloc(nullptr, 0, flags);
 
   // Hook a page to here as well, as the caller needs it anyway
-  new_page->vp_page = page_alloc_single();
-	KASSERT(new_page->vp_page != nullptr, "out of pages");
+  new_page->vp_page = page_alloc_order_wait(0);
+  return new_page;
+}
+
+struct VM_PAGE*
+vmpage_create_private_zeroed(int flags)
+{
+  auto new_page = vmpage_alloc(nullptr, 0, flags);
+
+  // As vmpage_create_private(), but the page is known to be cleared
+  new_page->vp_page = page_alloc_zeroed_wait();
+  return new_page;
+}
+
+struct VM_PAGE*
+vmpage_create_private_page(struct PAGE* page, int flags)
+{
+  auto new_page = vmpage_alloc(nullptr, 0, flags);
+  new_page->vp_page = page;
   return new_page;
 }
 
 void vmpage_dump(struct VM_PAGE* vp, const char* prefix)
 {
-  kprintf("%s%p: refcount %d vaddr %p flags %s/%s/%s/%c ",
+  kprintf("%s%p: refcount %d vaddr %p flags %s/%s/%s/%c%c%c%c ",
     prefix, vp, vp->vp_refcount,
     vp->vp_vaddr,
     (vp->vp_flags & VM_PAGE_FLAG_PRIVATE) ? "prv" : "pub",
     (vp->vp_flags & VM_PAGE_FLAG_READONLY) ? "ro" : "rw",
     (vp->vp_flags & VM_PAGE_FLAG_COW) ? "cow" : "---",
-    (vp->vp_flags & VM_PAGE_FLAG_PENDING) ? 'p' : '.');
+    (vp->vp_flags & VM_PAGE_FLAG_PENDING) ? 'p' : '.',
+    (vp->vp_flags & VM_PAGE_FLAG_LENT) ? 'l' : '.',
+    (vp->vp_flags & VM_PAGE_FLAG_SWAPPED) ? 's' : '.',
+    (vp->vp_flags & VM_PAGE_FLAG_MERGED) ? 'm' : '.');
   if (vp->vp_flags & VM_PAGE_FLAG_LINK) {
     vp = vp->vp_link;
     kprintf(" -> ");
@@ -1,10 +1,13 @@
 #include <ananas/types.h>
-#include <machine/param.h> /* for THREAD_INITIAL_MAPPING_ADDR */
+#include <machine/param.h> /* for THREAD_INITIAL_MAPPING_ADDR, SHARED_PAGE_ADDR */
 #include <machine/vm.h> /* for md_{,un}map_pages() */
 #include <ananas/kmem.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 #include <ananas/error.h>
+#include <ananas/shm.h>
+#include <ananas/slab.h>
+#include <ananas/vfs/core.h>
 #include <ananas/vfs/dentry.h>
 #include <ananas/trace.h>
 #include <ananas/vm.h>
@@ -15,69 +18,389 @@ TRACE_SETUP;
 
 #define BYTES_TO_PAGES(len) ((len + PAGE_SIZE - 1) / PAGE_SIZE)
 
+static SLAB_CACHE_DEFINE(vmspace_cache, vmspace_t, NULL);
+static SLAB_CACHE_DEFINE(vmarea_cache, vmarea_t, NULL);
+
 errorcode_t
 vmspace_create(vmspace_t** vmspace)
 {
-	auto vs = new vmspace_t;
+	auto vs = static_cast<vmspace_t*>(slab_alloc(&vmspace_cache));
 	memset(vs, 0, sizeof(*vs));
 	LIST_INIT(&vs->vs_pages);
-	vs->vs_next_mapping = THREAD_INITIAL_MAPPING_ADDR;
 
 	errorcode_t err = md_vmspace_init(vs);
 	ANANAS_ERROR_RETURN(err);
 
-	mutex_init(&vs->vs_mutex, "vmspace");
+	rwlock_init(&vs->vs_lock, "vmspace");
 	*vmspace = vs;
 	return err;
 }
 
+static void vmspace_area_free_locked(vmspace_t* vs, vmarea_t* va);
+static void vmarea_release(vmarea_t* va);
+
 void
 vmspace_cleanup(vmspace_t* vs)
 {
 	/* Cleanup only removes all mapped areas */
+	vmspace_lock_write(vs);
 	while(!LIST_EMPTY(&vs->vs_areas)) {
 		vmarea_t* va = LIST_HEAD(&vs->vs_areas);
-		vmspace_area_free(vs, va);
+		vmspace_area_free_locked(vs, va);
 	}
+	vmspace_unlock_write(vs);
 }
 
 void
 vmspace_destroy(vmspace_t* vs)
 {
-	/* Ensure all mapped areas are gone (can't hurt if this is already done) */
-	vmspace_cleanup(vs);
+	/*
+	 * No one uses the vmspace anymore and its page tables go as a whole, so
+	 * there is no need to unmap anything, nor to keep the area tree intact.
+	 * The page daemon may still hold one of our pages, though; the lock keeps
+	 * it from looking at the areas while we free them.
+	 */
+	vmspace_lock_write(vs);
+	LIST_FOREACH_SAFE(&vs->vs_areas, va, vmarea_t) {
+		vmarea_release(va);
+	}
+	LIST_INIT(&vs->vs_areas);
+	vs->vs_area_root = NULL;
+	vmspace_unlock_write(vs);
 
-	/* Remove the vmspace-specific mappings - these are generally MD */
+	/* The MD code takes the page tables; anything left is ours to free */
+	md_vmspace_destroy(vs);
 	LIST_FOREACH_SAFE(&vs->vs_pages, p, struct PAGE) {
-		/* XXX should we unmap the page here? the vmspace shouldn't be active... */
 		page_free(p);
 	}
-	md_vmspace_destroy(vs);
-	kfree(vs);
+	slab_free(&vmspace_cache, vs);
 }
 
-static int
-vmspace_is_inuse(vmspace_t* vs, addr_t virt, size_t len)
+/*
+ * Areas are kept in a red-black tree ordered by address, as well as in the
+ * address-ordered vs_areas list (which gives us the neighbours of any area).
+ * Every node also stores the largest gap preceding any area in its subtree;
+ * this allows us to locate a sufficiently large free range in logarithmic
+ * time.
+ */
+static inline addr_t
+vmarea_end(vmarea_t* va)
 {
-	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		if ((virt >= va->va_virt && (virt + len) <= (va->va_virt + va->va_len)) ||
-				(va->va_virt >= virt && (va->va_virt + va->va_len) <= (virt + len)))
-			return 1;
+	return ROUND_UP(va->va_virt + va->va_len, PAGE_SIZE);
+}
+
+/* Returns the size of the unused range between va and the area before it */
+static inline size_t
+vmarea_gap_before(vmarea_t* va)
+{
+	vmarea_t* prev = LIST_PREV(va);
+	addr_t start = (prev != NULL) ? vmarea_end(prev) : 0;
+	return (va->va_virt > start) ? va->va_virt - start : 0;
+}
+
+static inline void
+vmarea_rb_update(vmarea_t* va)
+{
+	size_t gap = vmarea_gap_before(va);
+	if (va->va_rb_left != NULL && va->va_rb_left->va_rb_gap > gap)
+		gap = va->va_rb_left->va_rb_gap;
+	if (va->va_rb_right != NULL && va->va_rb_right->va_rb_gap > gap)
+		gap = va->va_rb_right->va_rb_gap;
+	va->va_rb_gap = gap;
+}
+
+static void
+vmarea_rb_propagate(vmarea_t* va)
+{
+	for (/* nothing */; va != NULL; va = va->va_rb_parent)
+		vmarea_rb_update(va);
+}
+
+/* Makes 'new_child' take the place of 'old_child' below old_child's parent */
+static inline void
+vmarea_rb_replace_child(vmspace_t* vs, vmarea_t* old_child, vmarea_t* new_child)
+{
+	vmarea_t* parent = old_child->va_rb_parent;
+	if (parent == NULL)
+		vs->vs_area_root = new_child;
+	else if (parent->va_rb_left == old_child)
+		parent->va_rb_left = new_child;
+	else
+		parent->va_rb_right = new_child;
+}
+
+static void
+vmarea_rb_rotate_left(vmspace_t* vs, vmarea_t* x)
+{
+	vmarea_t* y = x->va_rb_right;
+	x->va_rb_right = y->va_rb_left;
+	if (y->va_rb_left != NULL)
+		y->va_rb_left->va_rb_parent = x;
+	vmarea_rb_replace_child(vs, x, y);
+	y->va_rb_parent = x->va_rb_parent;
+	y->va_rb_left = x;
+	x->va_rb_parent = y;
+	vmarea_rb_update(x);
+	vmarea_rb_update(y);
+}
+
+static void
+vmarea_rb_rotate_right(vmspace_t* vs, vmarea_t* x)
+{
+	vmarea_t* y = x->va_rb_left;
+	x->va_rb_left = y->va_rb_right;
+	if (y->va_rb_right != NULL)
+		y->va_rb_right->va_rb_parent = x;
+	vmarea_rb_replace_child(vs, x, y);
+	y->va_rb_parent = x->va_rb_parent;
+	y->va_rb_right = x;
+	x->va_rb_parent = y;
+	vmarea_rb_update(x);
+	vmarea_rb_update(y);
+}
+
+static inline bool
+vmarea_rb_is_red(vmarea_t* va)
+{
+	return va != NULL && va->va_rb_red;
+}
+
+/* Returns the area with the highest address below addr, or NULL */
+static vmarea_t*
+vmspace_area_before(vmspace_t* vs, addr_t addr)
+{
+	vmarea_t* result = NULL;
+	for (vmarea_t* va = vs->vs_area_root; va != NULL; /* nothing */) {
+		if (va->va_virt < addr) {
+			result = va;
+			va = va->va_rb_right;
+		} else
+			va = va->va_rb_left;
+	}
+	return result;
+}
+
+/* Hooks va to both the area list and the tree */
+static void
+vmspace_area_insert(vmspace_t* vs, vmarea_t* va)
+{
+	vmarea_t* prev = vmspace_area_before(vs, va->va_virt);
+	vmarea_t* next = (prev != NULL) ? LIST_NEXT(prev) : LIST_HEAD(&vs->vs_areas);
+	if (next != NULL) {
+		LIST_INSERT_BEFORE(&vs->vs_areas, next, va);
+	} else {
+		LIST_APPEND(&vs->vs_areas, va);
 	}
 
-	return 0;
+	/* Place the node in the tree */
+	vmarea_t* parent = NULL;
+	vmarea_t** link = &vs->vs_area_root;
+	while (*link != NULL) {
+		parent = *link;
+		link = (va->va_virt < parent->va_virt) ? &parent->va_rb_left : &parent->va_rb_right;
+	}
+	va->va_rb_parent = parent;
+	va->va_rb_left = NULL;
+	va->va_rb_right = NULL;
+	va->va_rb_red = 1;
+	*link = va;
+
+	/* Restore the red-black properties */
+	vmarea_t* x = va;
+	while (vmarea_rb_is_red(x->va_rb_parent)) {
+		vmarea_t* p = x->va_rb_parent;
+		vmarea_t* g = p->va_rb_parent;
+		if (p == g->va_rb_left) {
+			vmarea_t* u = g->va_rb_right;
+			if (vmarea_rb_is_red(u)) {
+				p->va_rb_red = 0; u->va_rb_red = 0; g->va_rb_red = 1;
+				x = g;
+				continue;
+			}
+			if (x == p->va_rb_right) {
+				vmarea_rb_rotate_left(vs, p);
+				x = p; p = x->va_rb_parent;
+			}
+			p->va_rb_red = 0; g->va_rb_red = 1;
+			vmarea_rb_rotate_right(vs, g);
+		} else {
+			vmarea_t* u = g->va_rb_left;
+			if (vmarea_rb_is_red(u)) {
+				p->va_rb_red = 0; u->va_rb_red = 0; g->va_rb_red = 1;
+				x = g;
+				continue;
+			}
+			if (x == p->va_rb_left) {
+				vmarea_rb_rotate_right(vs, p);
+				x = p; p = x->va_rb_parent;
+			}
+			p->va_rb_red = 0; g->va_rb_red = 1;
+			vmarea_rb_rotate_left(vs, g);
+		}
+	}
+	vs->vs_area_root->va_rb_red = 0;
+
+	/* Both our gap and that of the next area have changed */
+	vmarea_rb_propagate(va);
+	if (next != NULL)
+		vmarea_rb_propagate(next);
 }
 
-errorcode_t
-vmspace_mapto(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
+/* Removes va from both the area list and the tree */
+static void
+vmspace_area_remove(vmspace_t* vs, vmarea_t* va)
+{
+	vmarea_t* next = LIST_NEXT(va);
+	LIST_REMOVE(&vs->vs_areas, va);
+
+	vmarea_t* x;
+	vmarea_t* x_parent;
+	bool removed_red;
+	if (va->va_rb_left == NULL || va->va_rb_right == NULL) {
+		/* At most one child; that child can take our place */
+		x = (va->va_rb_left != NULL) ? va->va_rb_left : va->va_rb_right;
+		x_parent = va->va_rb_parent;
+		removed_red = va->va_rb_red;
+		vmarea_rb_replace_child(vs, va, x);
+		if (x != NULL)
+			x->va_rb_parent = x_parent;
+	} else {
+		/* Two children; our in-order successor takes our place */
+		vmarea_t* y = va->va_rb_right;
+		while (y->va_rb_left != NULL)
+			y = y->va_rb_left;
+		removed_red = y->va_rb_red;
+		x = y->va_rb_right;
+		if (y->va_rb_parent == va) {
+			x_parent = y;
+		} else {
+			x_parent = y->va_rb_parent;
+			x_parent->va_rb_left = x;
+			if (x != NULL)
+				x->va_rb_parent = x_parent;
+			y->va_rb_right = va->va_rb_right;
+			y->va_rb_right->va_rb_parent = y;
+		}
+		vmarea_rb_replace_child(vs, va, y);
+		y->va_rb_parent = va->va_rb_parent;
+		y->va_rb_left = va->va_rb_left;
+		y->va_rb_left->va_rb_parent = y;
+		y->va_rb_red = va->va_rb_red;
+	}
+	vmarea_rb_propagate(x_parent);
+
+	/* If we removed a black node, we must restore the red-black properties */
+	while (!removed_red && x != vs->vs_area_root && !vmarea_rb_is_red(x)) {
+		if (x == x_parent->va_rb_left) {
+			vmarea_t* w = x_parent->va_rb_right;
+			if (vmarea_rb_is_red(w)) {
+				w->va_rb_red = 0; x_parent->va_rb_red = 1;
+				vmarea_rb_rotate_left(vs, x_parent);
+				w = x_parent->va_rb_right;
+			}
+			if (!vmarea_rb_is_red(w->va_rb_left) && !vmarea_rb_is_red(w->va_rb_right)) {
+				w->va_rb_red = 1;
+				x = x_parent; x_parent = x->va_rb_parent;
+				continue;
+			}
+			if (!vmarea_rb_is_red(w->va_rb_right)) {
+				w->va_rb_left->va_rb_red = 0; w->va_rb_red = 1;
+				vmarea_rb_rotate_right(vs, w);
+				w = x_parent->va_rb_right;
+			}
+			w->va_rb_red = x_parent->va_rb_red; x_parent->va_rb_red = 0;
+			w->va_rb_right->va_rb_red = 0;
+			vmarea_rb_rotate_left(vs, x_parent);
+		} else {
+			vmarea_t* w = x_parent->va_rb_left;
+			if (vmarea_rb_is_red(w)) {
+				w->va_rb_red = 0; x_parent->va_rb_red = 1;
+				vmarea_rb_rotate_right(vs, x_parent);
+				w = x_parent->va_rb_left;
+			}
+			if (!vmarea_rb_is_red(w->va_rb_left) && !vmarea_rb_is_red(w->va_rb_right)) {
+				w->va_rb_red = 1;
+				x = x_parent; x_parent = x->va_rb_parent;
+				continue;
+			}
+			if (!vmarea_rb_is_red(w->va_rb_left)) {
+				w->va_rb_right->va_rb_red = 0; w->va_rb_red = 1;
+				vmarea_rb_rotate_left(vs, w);
+				w = x_parent->va_rb_left;
+			}
+			w->va_rb_red = x_parent->va_rb_red; x_parent->va_rb_red = 0;
+			w->va_rb_left->va_rb_red = 0;
+			vmarea_rb_rotate_right(vs, x_parent);
+		}
+		x = vs->vs_area_root;
+		break;
+	}
+	if (x != NULL)
+		x->va_rb_red = 0;
+
+	/* The gap in front of the next area has grown */
+	if (next != NULL)
+		vmarea_rb_propagate(next);
+}
+
+/*
+ * Locates the lowest free range of at least len bytes at or above base within
+ * the subtree rooted at va.
+ */
+static bool
+vmspace_find_gap(vmarea_t* va, addr_t base, size_t len, addr_t& out)
+{
+	if (va == NULL || va->va_rb_gap < len)
+		return false;
+
+	/* Anything on our left ends below us, so it is only useful if we are above base */
+	if (va->va_virt > base && vmspace_find_gap(va->va_rb_left, base, len, out))
+		return true;
+
+	vmarea_t* prev = LIST_PREV(va);
+	addr_t start = (prev != NULL) ? vmarea_end(prev) : 0;
+	if (start < base)
+		start = base;
+	if (va->va_virt >= start && va->va_virt - start >= len) {
+		out = start;
+		return true;
+	}
+	return vmspace_find_gap(va->va_rb_right, base, len, out);
+}
+
+vmarea_t*
+vmspace_find_area(vmspace_t* vs, addr_t virt)
+{
+	vmarea_t* va = vmspace_area_before(vs, virt + 1);
+	if (va != NULL && virt < va->va_virt + va->va_len)
+		return va;
+	return NULL;
+}
+
+static int
+vmspace_is_inuse(vmspace_t* vs, addr_t virt, size_t len)
+{
+	/* The range is in use if the final area starting before its end overlaps it */
+	vmarea_t* va = vmspace_area_before(vs, virt + len);
+	return va != NULL && vmarea_end(va) > virt;
+}
+
+/*
+ * Creates an area; the caller must hold vs_lock for writing, so that faults
+ * cannot see the area until it is completely set up.
+ */
+static errorcode_t
+vmspace_mapto_locked(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
 {
 	/* First, ensure the range isn't used and the length is sane */
 	if(vmspace_is_inuse(vs, virt, len))
 		return ANANAS_ERROR(NO_SPACE);
+	if (virt + len > SHARED_PAGE_ADDR && virt < SHARED_PAGE_ADDR + PAGE_SIZE)
+		return ANANAS_ERROR(NO_SPACE); /* mapped by md_vmspace_init() */
 	if (len == 0)
 		return ANANAS_ERROR(BAD_LENGTH);
 
-	auto va = new vmarea_t;
+	auto va = static_cast<vmarea_t*>(slab_alloc(&vmarea_cache));
 	memset(va, 0, sizeof(*va));
 
 	/*
@@ -86,10 +409,12 @@ vmspace_mapto(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, u
 	 * memory is there...
 	 */
 	LIST_INIT(&va->va_pages);
+	mutex_init(&va->va_mutex, "vmarea");
 	va->va_virt = virt;
 	va->va_len = len;
 	va->va_flags = flags;
-	LIST_APPEND(&vs->vs_areas, va);
+	va->va_anon_next = virt; /* touching the start first counts as sequential */
+	vmspace_area_insert(vs, va);
 	TRACE(VM, INFO, "vmspace_mapto(): vs=%p, va=%p, phys=%p, virt=%p, flags=0x%x", vs, va, phys, virt, flags);
 	*va_out = va;
 
@@ -98,10 +423,10 @@ vmspace_mapto(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, u
 	return ananas_success();
 }
 
-errorcode_t
-vmspace_mapto_dentry(vmspace_t* vs, addr_t virt, off_t vskip, size_t vlength, struct DENTRY* dentry, off_t doffset, size_t dlength, int flags, vmarea_t** va_out)
+static errorcode_t
+vmspace_mapto_dentry_locked(vmspace_t* vs, addr_t virt, off_t vskip, size_t vlength, struct DENTRY* dentry, off_t doffset, size_t dlength, int flags, vmarea_t** va_out)
 {
-	errorcode_t err = vmspace_mapto(vs, virt, (addr_t)NULL, vlength, flags | VM_FLAG_LAZY, va_out);
+	errorcode_t err = vmspace_mapto_locked(vs, virt, (addr_t)NULL, vlength, flags | VM_FLAG_LAZY, va_out);
 	ANANAS_ERROR_RETURN(err);
 
 	dentry_ref(dentry);
@@ -109,20 +434,135 @@ vmspace_mapto_dentry(vmspace_t* vs, addr_t virt, off_t vskip, size_t vlength, st
 	(*va_out)->va_dvskip = vskip;
 	(*va_out)->va_doffset = doffset;
 	(*va_out)->va_dlength = dlength;
+	(*va_out)->va_last_fault = -1;
+	return ananas_success();
+}
+
+/* Locates the lowest free range that will hold a mapping of len bytes */
+static addr_t
+vmspace_find_mapping_addr(vmspace_t* vs, size_t len)
+{
+	addr_t virt;
+	if (!vmspace_find_gap(vs->vs_area_root, THREAD_INITIAL_MAPPING_ADDR, len, virt)) {
+		/* No gaps large enough; place it after the final area */
+		vmarea_t* last = LIST_TAIL(&vs->vs_areas);
+		virt = (last != NULL) ? vmarea_end(last) : 0;
+		if (virt < THREAD_INITIAL_MAPPING_ADDR)
+			virt = THREAD_INITIAL_MAPPING_ADDR;
+	}
+	return virt;
+}
+
+static errorcode_t
+vmspace_mapto_shm_locked(vmspace_t* vs, addr_t virt, struct SHM* shm, off_t offset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
+{
+	if (offset & (PAGE_SIZE - 1))
+		return ANANAS_ERROR(BAD_RANGE);
+	len = ROUND_UP(len, PAGE_SIZE);
+	if (offset < 0 || offset + len > shm->shm_size)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	errorcode_t err = vmspace_mapto_locked(vs, virt, (addr_t)NULL, len, flags | VM_FLAG_LAZY, va_out);
+	ANANAS_ERROR_RETURN(err);
+
+	shm_ref(shm);
+	(*va_out)->va_shm = shm;
+	(*va_out)->va_doffset = offset;
 	return ananas_success();
 }
 
+errorcode_t
+vmspace_mapto(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
+{
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_mapto_locked(vs, virt, phys, len, flags, va_out);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+errorcode_t
+vmspace_mapto_dentry(vmspace_t* vs, addr_t virt, off_t vskip, size_t vlength, struct DENTRY* dentry, off_t doffset, size_t dlength, int flags, vmarea_t** va_out)
+{
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_mapto_dentry_locked(vs, virt, vskip, vlength, dentry, doffset, dlength, flags, va_out);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+errorcode_t
+vmspace_mapto_shm(vmspace_t* vs, addr_t virt, struct SHM* shm, off_t offset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
+{
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_mapto_shm_locked(vs, virt, shm, offset, len, flags, va_out);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
 errorcode_t
 vmspace_map(vmspace_t* vs, addr_t phys, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
 {
-	/*
-	 * Locate a new address to map to; we currently never re-use old addresses.
-	 */
-	addr_t virt = vs->vs_next_mapping;
-	vs->vs_next_mapping += len;
-	if ((vs->vs_next_mapping & (PAGE_SIZE - 1)) > 0)
-		vs->vs_next_mapping += PAGE_SIZE - (vs->vs_next_mapping & (PAGE_SIZE - 1));
-	return vmspace_mapto(vs, virt, phys, len, flags, va_out);
+	len = ROUND_UP(len, PAGE_SIZE);
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_mapto_locked(vs, vmspace_find_mapping_addr(vs, len), phys, len, flags, va_out);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+errorcode_t
+vmspace_map_dentry(vmspace_t* vs, struct DENTRY* dentry, off_t doffset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
+{
+	if (doffset & (PAGE_SIZE - 1))
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/* Anything beyond the end of the file is zero-filled by the page cache */
+	len = ROUND_UP(len, PAGE_SIZE);
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_mapto_dentry_locked(vs, vmspace_find_mapping_addr(vs, len), 0, len, dentry, doffset, len, flags, va_out);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+errorcode_t
+vmspace_map_shm(vmspace_t* vs, struct SHM* shm, off_t offset, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out)
+{
+	len = ROUND_UP(len, PAGE_SIZE);
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_mapto_shm_locked(vs, vmspace_find_mapping_addr(vs, len), shm, offset, len, flags, va_out);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+static errorcode_t
+vmspace_sync_locked(vmspace_t* vs, addr_t virt, addr_t end)
+{
+	for (addr_t v = ROUND_DOWN(virt, PAGE_SIZE); v < end; v += PAGE_SIZE) {
+		vmarea_t* va = vmspace_find_area(vs, v);
+		if (va == nullptr)
+			return ANANAS_ERROR(BAD_ADDRESS);
+
+		/* Only shared, file-backed mappings write to the file */
+		if (va->va_dentry == nullptr || (va->va_flags & (VM_FLAG_PRIVATE | VM_FLAG_WRITE)) != VM_FLAG_WRITE)
+			continue;
+
+		/* Pages of shared mappings are links to the page cache */
+		vmarea_lock(va);
+		struct VM_PAGE* vp = vmarea_lookup_page(va, v);
+		errorcode_t err = ananas_success();
+		if (vp != nullptr && (vp->vp_flags & VM_PAGE_FLAG_LINK))
+			err = vfs_pagecache_write(va->va_dentry, vp->vp_link);
+		vmarea_unlock(va);
+		ANANAS_ERROR_RETURN(err);
+	}
+	return ananas_success();
+}
+
+errorcode_t
+vmspace_sync(vmspace_t* vs, addr_t virt, size_t len /* bytes */)
+{
+	vmspace_lock_read(vs);
+	errorcode_t err = vmspace_sync_locked(vs, virt, ROUND_UP(virt + len, PAGE_SIZE));
+	vmspace_unlock_read(vs);
+	return err;
 }
 
 /*
@@ -161,6 +601,10 @@ vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags)
 {
 	TRACE(VM, INFO, "vmspace_clone(): source=%p dest=%p flags=%x", vs_source, vs_dest, flags);
 
+	/* The source pages become copy-on-write, so nothing may fault them meanwhile */
+	vmspace_lock_write(vs_source);
+	vmspace_lock_write(vs_dest);
+
 	/*
 	 * First, clean up the destination area's mappings - this ensures we'll
 	 * overwrite them with our own. Note that we'll leave private mappings alone.
@@ -168,76 +612,399 @@ vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags)
 	LIST_FOREACH_SAFE(&vs_dest->vs_areas, va, vmarea_t) {
 		if (!vmspace_clone_area_must_free(va, flags))
 			continue;
-		vmspace_area_free(vs_dest, va);
+		vmspace_area_free_locked(vs_dest, va);
 	}
 
-	/* Now copy everything over that isn't private */
+	/*
+	 * Now copy everything over that isn't private; making the source pages
+	 * read-only for copy-on-write needs a TLB shootdown, which we do only once.
+	 */
+	md_tlb_batch_begin(vs_source);
+	struct MD_MAP_CURSOR mc_source, mc_dest;
+	md_map_cursor_init(&mc_source, vs_source);
+	md_map_cursor_init(&mc_dest, vs_dest);
+	errorcode_t err = ananas_success();
 	LIST_FOREACH(&vs_source->vs_areas, va_src, vmarea_t) {
 		if (!vmspace_clone_area_must_copy(va_src, flags))
 			continue;
 
 		vmarea_t* va_dst;
-		errorcode_t err = vmspace_mapto(vs_dest, va_src->va_virt, 0, va_src->va_len, VM_FLAG_ALLOC | va_src->va_flags, &va_dst);
-		ANANAS_ERROR_RETURN(err);
+		err = vmspace_mapto_locked(vs_dest, va_src->va_virt, 0, va_src->va_len, VM_FLAG_ALLOC | va_src->va_flags, &va_dst);
+		if (ananas_is_failure(err))
+			break;
 		if (va_src->va_dentry != nullptr) {
 			// Backed by an inode; copy the necessary fields over
 			va_dst->va_doffset = va_src->va_doffset;
 			va_dst->va_dvskip = va_src->va_dvskip;
 			va_dst->va_dlength = va_src->va_dlength;
+			va_dst->va_last_fault = -1;
 			va_dst->va_dentry = va_src->va_dentry;
 			dentry_ref(va_dst->va_dentry);
 		}
+		va_dst->va_advice = va_src->va_advice;
+		if (va_src->va_shm != nullptr) {
+			va_dst->va_doffset = va_src->va_doffset;
+			va_dst->va_shm = va_src->va_shm;
+			shm_ref(va_dst->va_shm);
+		}
 
 		// Copy the area page-wise
 		LIST_FOREACH(&va_src->va_pages, vp, struct VM_PAGE) {
 			KASSERT(vmpage_get_page(vp)->p_order == 0, "unexpected %d order page here", vmpage_get_page(vp)->p_order);
 
-			// Create a clone of the data; it is up to the vmpage how to do this (it may go for COW)
+			// Create a clone of the data; it is up to the vmpage how to do this (private pages go for COW)
 			struct VM_PAGE* new_vp = vmpage_clone(vp);
-			LIST_APPEND(&va_dst->va_pages, new_vp);
+			vmarea_add_page(va_dst, new_vp);
 
-			// Mark the page as present in the cloned vmspace with the correct flags
+			// Mark the page as present in the cloned vmspace with the correct flags;
+			// copy-on-write pages must be read-only on both sides until written to
 			struct PAGE* p = vmpage_get_page(new_vp);
-			md_map_pages(vs_dest, new_vp->vp_vaddr, page_get_paddr(p), 1, va_dst->va_flags);
+			int map_flags = va_dst->va_flags;
+			if (new_vp->vp_flags & VM_PAGE_FLAG_COW) {
+				map_flags &= ~VM_FLAG_WRITE;
+				md_map_cursor_page(&mc_source, vp->vp_vaddr, page_get_paddr(p), va_src->va_flags & ~VM_FLAG_WRITE);
+			}
+			md_map_cursor_page(&mc_dest, new_vp->vp_vaddr, page_get_paddr(p), map_flags);
 		}
 	}
+	md_map_cursor_done(&mc_dest);
+	md_map_cursor_done(&mc_source);
+	md_tlb_batch_end();
+
+	vmspace_unlock_write(vs_dest);
+	vmspace_unlock_write(vs_source);
+	return err;
+}
+
+static void
+vmspace_area_free_locked(vmspace_t* vs, vmarea_t* va)
+{
+	vmspace_area_remove(vs, va);
+	vs->vs_generation++; /* invalidates any cached pointers to va */
 
 	/*
-	 * See where the next mapping can be placed; we should use something more
-	 * clever than vs_next_mapping someday but this will have to suffice for
-	 * now.
+	 * Unmap the pages before freeing them; any CPU may still have them in its
+	 * TLB, so have all of them invalidated in one go before the pages are gone.
 	 */
-	vs_dest->vs_next_mapping = 0;
-	LIST_FOREACH(&vs_dest->vs_areas, va, vmarea_t) {
-		addr_t next = va->va_virt + va->va_len;
-		if (vs_dest->vs_next_mapping < next)
-			vs_dest->vs_next_mapping = next;
+	md_tlb_batch_begin(vs);
+	LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
+		md_unmap_pages(vs, vp->vp_vaddr, 1);
 	}
+	md_tlb_batch_end();
 
-	return ananas_success();
+	vmarea_release(va);
 }
 
 void
 vmspace_area_free(vmspace_t* vs, vmarea_t* va)
 {
-	LIST_REMOVE(&vs->vs_areas, va);
+	vmspace_lock_write(vs);
+	vmspace_area_free_locked(vs, va);
+	vmspace_unlock_write(vs);
+}
 
+/* Frees va and everything it references; it must no longer be mapped anywhere */
+static void
+vmarea_release(vmarea_t* va)
+{
 	/* Free any backing dentry, if we have one */
 	if (va->va_dentry != nullptr)
 		dentry_deref(va->va_dentry);
+	if (va->va_shm != nullptr)
+		shm_deref(va->va_shm);
 
 	/* If the pages were allocated, we need to free them one by one */
 	LIST_FOREACH_SAFE(&va->va_pages, vp, struct VM_PAGE) {
+		vmpage_deactivate(vp);
+		vmpage_deref(vp);
+	}
+	radix_clear(&va->va_page_index);
+	slab_free(&vmarea_cache, va);
+}
+
+/* Unmaps and releases the pages of va within [virt, end) */
+static void
+vmarea_free_range(vmspace_t* vs, vmarea_t* va, addr_t virt, addr_t end)
+{
+	md_tlb_batch_begin(vs);
+	LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
+		if (vp->vp_vaddr >= virt && vp->vp_vaddr < end)
+			md_unmap_pages(vs, vp->vp_vaddr, 1);
+	}
+	md_tlb_batch_end();
+
+	LIST_FOREACH_SAFE(&va->va_pages, vp, struct VM_PAGE) {
+		if (vp->vp_vaddr < virt || vp->vp_vaddr >= end)
+			continue;
+		vmarea_remove_page(va, vp);
 		vmpage_deref(vp);
 	}
-	kfree(va);
+}
+
+/*
+ * Userland may only unmap or discard areas made on its behalf, which are not
+ * machine-dependant or referenced by the kernel, and whose pages we track.
+ */
+static inline bool
+vmarea_user_may_change(vmarea_t* va)
+{
+	if ((va->va_flags & (VM_FLAG_USER | VM_FLAG_MD | VM_FLAG_PINNED)) != VM_FLAG_USER)
+		return false;
+	return (va->va_flags & VM_FLAG_ALLOC) != 0 || va->va_dentry != nullptr || va->va_shm != nullptr;
+}
+
+/* Returns the first area which ends beyond virt, or NULL */
+static vmarea_t*
+vmspace_first_area_from(vmspace_t* vs, addr_t virt)
+{
+	vmarea_t* va = vmspace_area_before(vs, virt + 1);
+	if (va == NULL)
+		return LIST_HEAD(&vs->vs_areas);
+	return vmarea_end(va) > virt ? va : LIST_NEXT(va);
+}
+
+static errorcode_t
+vmspace_unmap_locked(vmspace_t* vs, addr_t virt, size_t len /* bytes */)
+{
+	if ((virt & (PAGE_SIZE - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (len == 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	addr_t end = ROUND_UP(virt + len, PAGE_SIZE);
+
+	/*
+	 * Areas can be removed entirely or lose their final part, but we cannot
+	 * split them; check everything before changing anything.
+	 */
+	vmarea_t* first = vmspace_first_area_from(vs, virt);
+	for (vmarea_t* va = first; va != NULL && va->va_virt < end; va = LIST_NEXT(va)) {
+		if (!vmarea_user_may_change(va))
+			return ANANAS_ERROR(BAD_ADDRESS);
+		if (vmarea_end(va) > end || (va->va_virt < virt && (va->va_dentry != nullptr || va->va_shm != nullptr)))
+			return ANANAS_ERROR(BAD_RANGE);
+	}
+
+	vmarea_t* next;
+	for (vmarea_t* va = first; va != NULL && va->va_virt < end; va = next) {
+		next = LIST_NEXT(va);
+		if (va->va_virt >= virt) {
+			vmspace_area_free_locked(vs, va);
+			continue;
+		}
+
+		/* Only the end goes; this grows the gap before the next area */
+		vmarea_free_range(vs, va, virt, vmarea_end(va));
+		va->va_len = virt - va->va_virt;
+		if (next != NULL)
+			vmarea_rb_propagate(next);
+	}
+	return ananas_success();
+}
+
+static errorcode_t
+vmspace_discard_locked(vmspace_t* vs, addr_t virt, size_t len /* bytes */)
+{
+	if ((virt & (PAGE_SIZE - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	addr_t end = ROUND_UP(virt + len, PAGE_SIZE);
+
+	for (vmarea_t* va = vmspace_first_area_from(vs, virt); va != NULL && va->va_virt < end; va = LIST_NEXT(va)) {
+		if (!vmarea_user_may_change(va))
+			return ANANAS_ERROR(BAD_ADDRESS);
+		/* The mapping stays; the next access faults in a fresh page */
+		vmarea_free_range(vs, va, (va->va_virt > virt) ? va->va_virt : virt, (vmarea_end(va) < end) ? vmarea_end(va) : end);
+	}
+	return ananas_success();
+}
+
+static errorcode_t
+vmspace_set_advice_locked(vmspace_t* vs, addr_t virt, size_t len /* bytes */, int advice)
+{
+	if ((virt & (PAGE_SIZE - 1)) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	addr_t end = ROUND_UP(virt + len, PAGE_SIZE);
+
+	/* Areas cannot be split, so the advice holds for every area touched */
+	for (vmarea_t* va = vmspace_first_area_from(vs, virt); va != NULL && va->va_virt < end; va = LIST_NEXT(va)) {
+		if ((va->va_flags & VM_FLAG_USER) == 0)
+			return ANANAS_ERROR(BAD_ADDRESS);
+		va->va_advice = advice;
+	}
+	return ananas_success();
+}
+
+errorcode_t
+vmspace_unmap(vmspace_t* vs, addr_t virt, size_t len /* bytes */)
+{
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_unmap_locked(vs, virt, len);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+errorcode_t
+vmspace_discard(vmspace_t* vs, addr_t virt, size_t len /* bytes */)
+{
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_discard_locked(vs, virt, len);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+errorcode_t
+vmspace_set_advice(vmspace_t* vs, addr_t virt, size_t len /* bytes */, int advice)
+{
+	vmspace_lock_write(vs);
+	errorcode_t err = vmspace_set_advice_locked(vs, virt, len, advice);
+	vmspace_unlock_write(vs);
+	return err;
+}
+
+vmarea_t*
+vmspace_trylock_area(vmspace_t* vs, addr_t virt)
+{
+	if (!rwlock_trylock_read(&vs->vs_lock))
+		return nullptr;
+	vmarea_t* va = vmspace_find_area(vs, virt);
+	if (va == nullptr || !mutex_trylock(&va->va_mutex)) {
+		vmspace_unlock_read(vs);
+		return nullptr;
+	}
+	return va;
+}
+
+void
+vmspace_unlock_area(vmspace_t* vs, vmarea_t* va)
+{
+	vmarea_unlock(va);
+	vmspace_unlock_read(vs);
+}
+
+static inline uint64_t
+vmarea_page_index(vmarea_t* va, addr_t virt)
+{
+	return (virt - va->va_virt) / PAGE_SIZE;
+}
+
+/* Adds a page to the area; its vp_vaddr must already be set */
+void
+vmarea_add_page(vmarea_t* va, struct VM_PAGE* vp)
+{
+	KASSERT(vp->vp_vaddr >= va->va_virt && vp->vp_vaddr < va->va_virt + va->va_len, "page %p outside of area %p", vp->vp_vaddr, va);
+	LIST_APPEND(&va->va_pages, vp);
+	radix_insert(&va->va_page_index, vmarea_page_index(va, vp->vp_vaddr), vp);
+}
+
+struct VM_PAGE*
+vmarea_lookup_page(vmarea_t* va, addr_t virt)
+{
+	if (virt < va->va_virt || virt >= va->va_virt + va->va_len)
+		return nullptr;
+	return static_cast<struct VM_PAGE*>(radix_lookup(&va->va_page_index, vmarea_page_index(va, virt)));
+}
+
+void
+vmarea_remove_page(vmarea_t* va, struct VM_PAGE* vp)
+{
+	vmpage_deactivate(vp); /* it is no longer mapped by our vmspace */
+	LIST_REMOVE(&va->va_pages, vp);
+	radix_remove(&va->va_page_index, vmarea_page_index(va, vp->vp_vaddr));
+}
+
+/*
+ * Locks the anonymous, writable area holding virt, as needed to lend or
+ * borrow its pages. The callers hold a page lock, which faults take while
+ * holding the area lock; so we must not wait for it, and let the caller copy
+ * the data instead.
+ */
+static vmarea_t*
+vmspace_trylock_anonymous_area(vmspace_t* vs, addr_t virt)
+{
+	vmarea_t* va = vmspace_trylock_area(vs, virt);
+	if (va == nullptr)
+		return nullptr;
+	const unsigned int required = VM_FLAG_ALLOC | VM_FLAG_USER | VM_FLAG_WRITE;
+	if (va->va_dentry != nullptr || va->va_shm != nullptr || (va->va_flags & required) != required) {
+		vmspace_unlock_area(vs, va);
+		return nullptr;
+	}
+	return va;
+}
+
+/*
+ * Maps page cache page vp copy-on-write at virt, in place of whatever anonymous
+ * page is there; this allows read() to hand out pages instead of copying them.
+ * Returns false if virt is not in writable anonymous memory. vp must be locked.
+ */
+bool
+vmspace_lend_page(vmspace_t* vs, addr_t virt, struct VM_PAGE* vp)
+{
+	KASSERT((virt & (PAGE_SIZE - 1)) == 0, "address %p not page-aligned", virt);
+	KASSERT((vp->vp_flags & (VM_PAGE_FLAG_LINK | VM_PAGE_FLAG_PENDING)) == 0, "cannot lend page %p", vp);
+
+	// A page cache page which is already linked may be mapped shared, and changed underneath the reader
+	if (vp->vp_inode != nullptr && (vp->vp_flags & VM_PAGE_FLAG_LENT) == 0 && vp->vp_refcount > 1)
+		return false;
+
+	vmarea_t* va = vmspace_trylock_anonymous_area(vs, virt);
+	if (va == nullptr)
+		return false;
+
+	struct VM_PAGE* vp_old = vmarea_lookup_page(va, virt);
+	struct VM_PAGE* new_vp = vmpage_link(vp);
+	new_vp->vp_flags |= VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_COW;
+	new_vp->vp_vaddr = virt;
+	vp->vp_flags |= VM_PAGE_FLAG_LENT;
+
+	// Replace the mapping before freeing the old page; it must not be accessible once freed
+	if (vp_old != nullptr)
+		vmarea_remove_page(va, vp_old);
+	vmarea_add_page(va, new_vp);
+	md_map_pages(vs, virt, page_get_paddr(vmpage_get_page(new_vp)), 1, va->va_flags & ~VM_FLAG_WRITE);
+	vmspace_unlock_area(vs, va);
+	if (vp_old != nullptr)
+		vmpage_deref(vp_old);
+	return true;
+}
+
+/*
+ * Returns a reference to the page at virt, which becomes copy-on-write so that
+ * the reference keeps the current contents; this allows write() to take pages
+ * instead of copying them. Returns nullptr if virt is not a resident page of
+ * writable anonymous memory.
+ */
+struct VM_PAGE*
+vmspace_borrow_page(vmspace_t* vs, addr_t virt)
+{
+	KASSERT((virt & (PAGE_SIZE - 1)) == 0, "address %p not page-aligned", virt);
+
+	vmarea_t* va = vmspace_trylock_anonymous_area(vs, virt);
+	if (va == nullptr)
+		return nullptr;
+
+	struct VM_PAGE* vp = vmarea_lookup_page(va, virt);
+	if (vp == nullptr || (vp->vp_flags & (VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_COW)) == 0 || (vp->vp_flags & VM_PAGE_FLAG_PENDING)) {
+		vmspace_unlock_area(vs, va);
+		return nullptr;
+	}
+
+	// Share the page as vmspace_clone() would, but keep the backing page itself
+	struct VM_PAGE* vp_link = vmpage_clone(vp);
+	struct VM_PAGE* vp_backing = vp_link->vp_link;
+	vmpage_ref(vp_backing);
+	vmpage_deref(vp_link);
+
+	// Our side must not write to the page anymore; a write fault will copy it
+	md_map_pages(vs, virt, page_get_paddr(vmpage_get_page(vp_backing)), 1, va->va_flags & ~VM_FLAG_WRITE);
+	vmspace_unlock_area(vs, va);
+	return vp_backing;
 }
 
 void
 vmspace_dump(vmspace_t* vs)
 {
 	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		kprintf("  area %p: %p..%p flags %c%c%c%c%c%c%c%c\n",
+		kprintf("  area %p: %p..%p flags %c%c%c%c%c%c%c%c%c\n",
 		 va, va->va_virt, va->va_virt + va->va_len - 1,
 		 (va->va_flags & VM_FLAG_READ) ? 'r' : '.',
 		 (va->va_flags & VM_FLAG_WRITE) ? 'w' : '.',
@@ -246,6 +1013,7 @@ vmspace_dump(vmspace_t* vs)
 		 (va->va_flags & VM_FLAG_USER) ? 'u' : '.',
 		 (va->va_flags & VM_FLAG_PRIVATE) ? 'p' : '.',
 		 (va->va_flags & VM_FLAG_NO_CLONE) ? 'n' : '.',
+		 (va->va_flags & VM_FLAG_STACK) ? 's' : '.',
 		 (va->va_flags & VM_FLAG_MD) ? 'm' : '.');
 		kprintf("    pages:\n");
 		LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
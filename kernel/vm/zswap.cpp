@@ -0,0 +1,151 @@
+/*
+ * Compressed swap cache: pages the page daemon evicts are deflated into
+ * memory if they compress well enough, and inflated again as they are
+ * faulted on. Only pages that do not fit go on to the swap device (if any).
+ * This trades CPU time for memory, which beats waiting for the disk for
+ * anything that is not entirely cold.
+ *
+ * Compressed pages are kept in object caches of ZSWAP_CLASS_SIZE byte size
+ * classes; as caches never hand their pages back, the total stored is capped
+ * at 'zswap_max' percent of memory (ZSWAP_DEFAULT_MAX if not given).
+ */
+#include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include <ananas/cmdline.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/slab.h>
+#include <ananas/swap.h>
+#include <ananas/zlib.h>
+
+#define ZSWAP_CLASS_SIZE	256
+#define ZSWAP_NUM_CLASSES	12	/* Pages must compress to 3/4 or less */
+#define ZSWAP_MAX_LENGTH	(ZSWAP_NUM_CLASSES * ZSWAP_CLASS_SIZE - sizeof(struct ZSWAP_ENTRY))
+#define ZSWAP_DEFAULT_MAX	20	/* Percentage of memory to use at most */
+#define ZSWAP_WINDOW_BITS	12	/* A page is all there is to look back into */
+#define ZSWAP_MEM_LEVEL		5
+
+struct ZSWAP_ENTRY {
+	uint16_t	ze_length;	/* Compressed length */
+	uint16_t	ze_class;
+	char		ze_data[];
+};
+
+namespace {
+
+struct SLAB_CACHE zswap_cache[ZSWAP_NUM_CLASSES];
+char zswap_cache_name[ZSWAP_NUM_CLASSES][16];
+
+/* Compression is only done by the page daemon, so a single stream will do */
+z_stream zswap_deflate;
+char zswap_buf[ZSWAP_MAX_LENGTH];
+
+/* Faults happen everywhere; every CPU has a stream to decompress */
+struct ZSWAP_INFLATER {
+	mutex_t zi_mtx;
+	z_stream zi_zstream;
+	bool zi_initialized;
+} zswap_inflater[PCPU_MAX_CPUS];
+
+size_t zswap_max_bytes;
+size_t zswap_stored_bytes; /* Size of all entries in use */
+
+} // unnamed namespace
+
+bool
+zswap_init()
+{
+	unsigned int max_percent = ZSWAP_DEFAULT_MAX;
+	const char* max_arg = cmdline_get_string("zswap_max");
+	if (max_arg != nullptr)
+		max_percent = strtoul(max_arg, NULL, 10);
+	if (max_percent == 0)
+		return false;
+
+	// Pages barely compress any better with more effort; go for speed
+	memset(&zswap_deflate, 0, sizeof(zswap_deflate));
+	if (deflateInit2(&zswap_deflate, Z_BEST_SPEED, Z_DEFLATED, -ZSWAP_WINDOW_BITS, ZSWAP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	for (unsigned int n = 0; n < ZSWAP_NUM_CLASSES; n++) {
+		struct SLAB_CACHE* sc = &zswap_cache[n];
+		memset(sc, 0, sizeof(*sc));
+		snprintf(zswap_cache_name[n], sizeof(zswap_cache_name[n]), "zswap%u", (n + 1) * ZSWAP_CLASS_SIZE);
+		sc->sc_name = zswap_cache_name[n];
+		sc->sc_size = (n + 1) * ZSWAP_CLASS_SIZE;
+		spinlock_init(&sc->sc_lock);
+	}
+	for (unsigned int n = 0; n < PCPU_MAX_CPUS; n++) {
+		mutex_init(&zswap_inflater[n].zi_mtx, "zswap");
+		zswap_inflater[n].zi_initialized = false;
+	}
+
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	zswap_max_bytes = (size_t)total_pages * PAGE_SIZE / 100 * max_percent;
+	kprintf("- Compressing swapped pages in memory, up to %u KB\n", (unsigned int)(zswap_max_bytes / 1024));
+	return true;
+}
+
+struct ZSWAP_ENTRY*
+zswap_store(const void* data)
+{
+	zswap_deflate.next_in = (Bytef*)data;
+	zswap_deflate.avail_in = PAGE_SIZE;
+	zswap_deflate.next_out = (Bytef*)zswap_buf;
+	zswap_deflate.avail_out = sizeof(zswap_buf);
+	int zerr = deflate(&zswap_deflate, Z_FINISH);
+	size_t length = zswap_deflate.total_out;
+	deflateReset(&zswap_deflate);
+	if (zerr != Z_STREAM_END)
+		return nullptr; // did not fit, so not worth it
+
+	unsigned int c = (sizeof(struct ZSWAP_ENTRY) + length - 1) / ZSWAP_CLASS_SIZE;
+	size_t size = zswap_cache[c].sc_size;
+	if (__atomic_add_fetch(&zswap_stored_bytes, size, __ATOMIC_RELAXED) > zswap_max_bytes) {
+		__atomic_sub_fetch(&zswap_stored_bytes, size, __ATOMIC_RELAXED);
+		return nullptr;
+	}
+
+	auto ze = static_cast<struct ZSWAP_ENTRY*>(slab_alloc(&zswap_cache[c]));
+	ze->ze_length = length;
+	ze->ze_class = c;
+	memcpy(ze->ze_data, zswap_buf, length);
+	return ze;
+}
+
+void
+zswap_load(struct ZSWAP_ENTRY* ze, void* data)
+{
+	struct ZSWAP_INFLATER* zi = &zswap_inflater[PCPU_GET(cpuid)];
+	mutex_lock(&zi->zi_mtx);
+	if (!zi->zi_initialized) {
+		memset(&zi->zi_zstream, 0, sizeof(zi->zi_zstream));
+		int zerr = inflateInit2(&zi->zi_zstream, -ZSWAP_WINDOW_BITS);
+		KASSERT(zerr == Z_OK, "inflateInit2() error %d", zerr);
+		zi->zi_initialized = true;
+	}
+
+	zi->zi_zstream.next_in = (Bytef*)ze->ze_data;
+	zi->zi_zstream.avail_in = ze->ze_length;
+	zi->zi_zstream.next_out = static_cast<Bytef*>(data);
+	zi->zi_zstream.avail_out = PAGE_SIZE;
+	int zerr = inflate(&zi->zi_zstream, Z_FINISH);
+	KASSERT(zerr == Z_STREAM_END && zi->zi_zstream.total_out == PAGE_SIZE, "inflate() error %d, %u bytes", zerr, (unsigned int)zi->zi_zstream.total_out);
+	inflateReset(&zi->zi_zstream);
+	mutex_unlock(&zi->zi_mtx);
+
+	zswap_free(ze);
+}
+
+void
+zswap_free(struct ZSWAP_ENTRY* ze)
+{
+	struct SLAB_CACHE* sc = &zswap_cache[ze->ze_class];
+	__atomic_sub_fetch(&zswap_stored_bytes, sc->sc_size, __ATOMIC_RELAXED);
+	slab_free(sc, ze);
+}
+
+/* vim:set ts=2 sw=2: */
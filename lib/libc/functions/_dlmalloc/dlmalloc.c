@@ -4526,6 +4526,71 @@ static void* tmalloc_small(mstate m, size_t nb) {
 
 #if !ONLY_MSPACES
 
+#if MALLOC_CACHE
+/*
+  Cache of recently freed small chunks, kept per thread. Cached chunks
+  are still in use as far as the rest of malloc is concerned, so they can
+  be handed out again without taking the lock or touching the bins.
+*/
+#define MCACHE_MAX_SIZE     ((size_t)256U)  /* largest chunk size cached */
+#define MCACHE_DEPTH        (16U)           /* chunks cached per size */
+#define MCACHE_BINS         (MCACHE_MAX_SIZE / MALLOC_ALIGNMENT + 1)
+#define mcache_index(S)     ((S) / MALLOC_ALIGNMENT)
+
+struct malloc_cache {
+  void*    head[MCACHE_BINS];
+  unsigned count[MCACHE_BINS];
+};
+static MALLOC_CACHE_TLS struct malloc_cache mcache;
+
+static FORCEINLINE void* mcache_get(size_t bytes) {
+  size_t nb, idx;
+  void* mem;
+  if (bytes > MCACHE_MAX_SIZE)
+    return 0;
+  nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+  if (nb > MCACHE_MAX_SIZE)
+    return 0;
+  idx = mcache_index(nb);
+  mem = mcache.head[idx];
+  if (mem != 0) {
+    mcache.head[idx] = *(void**)mem;
+    mcache.count[idx]--;
+  }
+  return mem;
+}
+
+static FORCEINLINE int mcache_put(void* mem) {
+  mchunkptr p = mem2chunk(mem);
+  size_t sz, idx;
+  if (is_mmapped(p))
+    return 0;
+  sz = chunksize(p);
+  if (sz > MCACHE_MAX_SIZE)
+    return 0;
+  idx = mcache_index(sz);
+  if (mcache.count[idx] >= MCACHE_DEPTH)
+    return 0;
+  *(void**)mem = mcache.head[idx];
+  mcache.head[idx] = mem;
+  mcache.count[idx]++;
+  return 1;
+}
+#endif /* MALLOC_CACHE */
+
+#ifdef DISCARD
+/*
+  Gives the pages inside a large free chunk back to the system, keeping
+  the chunk header, tree links and footer.
+*/
+static void discard_free_chunk(mchunkptr p, size_t psize) {
+  size_t start = page_align((size_t)p + sizeof(struct malloc_tree_chunk));
+  size_t end = ((size_t)p + psize) & ~(mparams.page_size - SIZE_T_ONE);
+  if (end > start)
+    DISCARD((void*)start, end - start);
+}
+#endif /* DISCARD */
+
 void* dlmalloc(size_t bytes) {
   /*
      Basic algorithm:
@@ -4550,6 +4615,14 @@ void* dlmalloc(size_t bytes) {
      The ugly goto's here ensure that postaction occurs along all paths.
   */
 
+#if MALLOC_CACHE
+  {
+    void* cached = mcache_get(bytes);
+    if (cached != 0)
+      return cached;
+  }
+#endif /* MALLOC_CACHE */
+
 #if USE_LOCKS
   ensure_initialization(); /* initialize in sys_alloc if not using locks */
 #endif
@@ -4671,6 +4744,11 @@ void dlfree(void* mem) {
      with special cases for top, dv, mmapped chunks, and usage errors.
   */
 
+#if MALLOC_CACHE
+  if (mem != 0 && mcache_put(mem))
+    return;
+#endif /* MALLOC_CACHE */
+
   if (mem != 0) {
     mchunkptr p  = mem2chunk(mem);
 #if FOOTERS
@@ -4756,6 +4834,10 @@ void dlfree(void* mem) {
             tchunkptr tp = (tchunkptr)p;
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
+#ifdef DISCARD
+            if (psize >= DISCARD_THRESHOLD)
+              discard_free_chunk(p, psize);
+#endif /* DISCARD */
             if (--fm->release_checks == 0)
               release_unused_segments(fm);
           }
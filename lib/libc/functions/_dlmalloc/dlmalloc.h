@@ -26,6 +26,18 @@ static inline void *MMAP( size_t nbytes )
 #define DIRECT_MMAP(s) MMAP(s)
 #define MUNMAP(a, s) ((_PDCLIB_freepages((a), (s)/_PDCLIB_MALLOC_PAGESIZE)), 0)
 #define MREMAP(a, osz, nsz, mv) _PDCLIB_reallocpages((a), (osz)/_PDCLIB_MALLOC_PAGESIZE, (nsz)/_PDCLIB_MALLOC_PAGESIZE, (mv))
+#if defined(_PDCLIB_HAVE_DISCARDPAGES)
+#define DISCARD(a, s) _PDCLIB_discardpages((a), (s)/_PDCLIB_MALLOC_PAGESIZE)
+#define DISCARD_THRESHOLD _PDCLIB_MALLOC_DISCARD_THRESHOLD
+#endif
+
+/* The small chunk cache is only safe if every thread gets its own */
+#if defined(_PDCLIB_THREAD_LOCAL)
+#define MALLOC_CACHE 1
+#define MALLOC_CACHE_TLS _PDCLIB_THREAD_LOCAL
+#else
+#define MALLOC_CACHE 0
+#endif
 
 #undef WIN32
 #undef _WIN32
@@ -103,6 +103,64 @@ int _PDCLIB_flushbuffer( FILE * stream )
     return flushsubbuffer( stream, stream->bufidx );
 }
 
+size_t _PDCLIB_flushwrite( FILE * stream, const char * buf, size_t length )
+{
+    size_t justWrote;
+    size_t written = 0;
+
+    if ( stream->bufidx > 0 && stream->ops->write2 != NULL
+#ifdef _PDCLIB_NEED_EOL_TRANSLATION
+         && ( stream->status & _PDCLIB_FBIN )
+#endif
+       )
+    {
+        /* Hand the buffer and the caller's data over in one go */
+        if ( ! stream->ops->write2( stream->handle, stream->buffer, stream->bufidx,
+                                    buf, length, &justWrote ) )
+        {
+            stream->status |= _PDCLIB_ERRORFLAG;
+            return 0;
+        }
+        stream->pos.offset += justWrote;
+
+        if ( justWrote >= stream->bufidx )
+        {
+            written = justWrote - stream->bufidx;
+            stream->bufidx = 0;
+#ifdef _PDCLIB_NEED_EOL_TRANSLATION
+            stream->bufnlexp = 0;
+#endif
+        }
+        else
+        {
+            /* Short write; whatever is left of the buffer is written below */
+            stream->bufidx -= justWrote;
+#ifdef _PDCLIB_NEED_EOL_TRANSLATION
+            stream->bufnlexp -= justWrote;
+#endif
+            memmove( stream->buffer, stream->buffer + justWrote, stream->bufidx );
+        }
+    }
+
+    if ( _PDCLIB_flushbuffer( stream ) == EOF )
+    {
+        return 0;
+    }
+
+    while ( written != length )
+    {
+        if ( ! stream->ops->write( stream->handle, buf + written,
+                                   length - written, &justWrote ) )
+        {
+            stream->status |= _PDCLIB_ERRORFLAG;
+            break;
+        }
+        written += justWrote;
+        stream->pos.offset += justWrote;
+    }
+    return written;
+}
+
 #endif
 
 
@@ -23,12 +23,25 @@ FILE * _PDCLIB_fvopen(
 )
 {
     size_t filename_len;
+    size_t bufsize = BUFSIZ;
+    _PDCLIB_bool interactive = true;
     FILE * rc;
     if ( mode == NULL )
     {
         /* Mode invalid */
         return NULL;
     }
+    if ( ops->bufsize != NULL )
+    {
+        /* Let the backend tell us how much to buffer, and whether we are
+           looking at an interactive device.
+        */
+        size_t preferred = ops->bufsize( fd, &interactive );
+        if ( preferred != 0 )
+        {
+            bufsize = preferred;
+        }
+    }
     /* To reduce the number of malloc calls, all data fields are concatenated:
        * the FILE structure itself,
        * ungetc buffer,
@@ -37,7 +50,7 @@ FILE * _PDCLIB_fvopen(
        Data buffer comes last because it might change in size ( setvbuf() ).
     */
     filename_len = filename ? strlen( filename ) + 1 : 1;
-    if ( ( rc = calloc( 1, sizeof( FILE ) + _PDCLIB_UNGETCBUFSIZE + filename_len + BUFSIZ ) ) == NULL )
+    if ( ( rc = calloc( 1, sizeof( FILE ) + _PDCLIB_UNGETCBUFSIZE + filename_len + bufsize ) ) == NULL )
     {
         /* no memory */
         return NULL;
@@ -58,17 +71,16 @@ FILE * _PDCLIB_fvopen(
     /* Copying filename to FILE structure */
     if(filename) strcpy( rc->filename, filename );
     /* Initializing the rest of the structure */
-    rc->bufsize = BUFSIZ;
+    rc->bufsize = bufsize;
     rc->bufidx = 0;
 #ifdef _PDCLIB_NEED_EOL_TRANSLATION
     rc->bufnlexp = 0;
 #endif
     rc->ungetidx = 0;
-    /* Setting buffer to _IOLBF because "when opened, a stream is fully
-       buffered if and only if it can be determined not to refer to an
-       interactive device."
+    /* "When opened, a stream is fully buffered if and only if it can be
+       determined not to refer to an interactive device."
     */
-    rc->status |= _IOLBF;
+    rc->status |= interactive ? _IOLBF : _IOFBF;
     /* TODO: Setting mbstate */
     /* Adding to list of open files */
     rc->next = _PDCLIB_filelist;
@@ -24,6 +24,21 @@ size_t _PDCLIB_fwrite_unlocked( const void *restrict vptr,
 
     const char *restrict ptr = vptr;
     size_t nmemb_i;
+
+    /* Copying a request which fills the buffer anyway is a waste of time;
+       write it directly (text streams excepted, if they need translation).
+    */
+    size_t total = size * nmemb;
+    if ( size != 0 && total / size == nmemb && total >= stream->bufsize
+#ifdef _PDCLIB_NEED_EOL_TRANSLATION
+         && ( stream->status & _PDCLIB_FBIN )
+#endif
+       )
+    {
+        /* Returning number of objects completely written */
+        return _PDCLIB_flushwrite( stream, ptr, total ) / size;
+    }
+
     for ( nmemb_i = 0; nmemb_i < nmemb; ++nmemb_i )
     {
         for ( size_t size_i = 0; size_i < size; ++size_i )
@@ -16,28 +16,97 @@
    All code is still Public Domain.
 */
 
-/* Wrapper for _PDCLIB_memswp protects against multiple argument evaluation. */
-static inline void memswp( char * i, char * j, size_t size )
+/* Elements are swapped a word at a time if both their size and the array
+   alignment allow it, which is the usual case (pointers, or structures of
+   integers). Otherwise, fall back to _PDCLIB_memswp.
+*/
+static inline void memswp( char * i, char * j, size_t size, int wordwise )
 {
-    _PDCLIB_memswp( i, j, size );
+    if ( wordwise )
+    {
+        _PDCLIB_word_t * wi = (_PDCLIB_word_t *)i;
+        _PDCLIB_word_t * wj = (_PDCLIB_word_t *)j;
+        _PDCLIB_word_t tmp;
+        size /= sizeof( _PDCLIB_word_t );
+        do
+        {
+            tmp = *wi;
+            *wi++ = *wj;
+            *wj++ = tmp;
+        } while ( --size );
+    }
+    else
+    {
+        _PDCLIB_memswp( i, j, size );
+    }
 }
 
 /* For small sets, insertion sort is faster than quicksort.
    T is the threshold below which insertion sort will be used.
    Must be 3 or larger.
 */
-#define T 7
-
-/* Macros for handling the QSort stack */
-#define PREPARE_STACK char * stack[STACKSIZE]; char * * stackptr = stack
-#define PUSH( base, limit ) stackptr[0] = base; stackptr[1] = limit; stackptr += 2
-#define POP( base, limit ) stackptr -= 2; base = stackptr[0]; limit = stackptr[1]
-/* TODO: Stack usage is log2( nmemb ) (minus what T shaves off the worst case).
-         Worst-case nmemb is platform dependent and should probably be 
-         configured through _PDCLIB_config.h.
+#define T 12
+
+/* Macros for handling the QSort stack. Every entry carries the remaining
+   recursion depth of its partition.
+*/
+#define PREPARE_STACK struct qsort_range stack[STACKSIZE]; struct qsort_range * stackptr = stack
+#define PUSH( base, limit, depth ) stackptr->b = base; stackptr->l = limit; stackptr->d = depth; ++stackptr
+#define POP( base, limit, depth ) --stackptr; base = stackptr->b; limit = stackptr->l; depth = stackptr->d
+/* As the smaller partition is always sorted first, stack usage is at most
+   log2( nmemb ) entries.
 */
 #define STACKSIZE 64
 
+struct qsort_range
+{
+    char * b;
+    char * l;
+    unsigned int d;
+};
+
+/* Restores the heap property for the subtree at root, within the first
+   nmemb elements at base.
+*/
+static void siftdown( char * base, size_t root, size_t nmemb, size_t size, int wordwise, int (*compar)( const void *, const void * ) )
+{
+    for ( ;; )
+    {
+        size_t child = 2 * root + 1;
+        if ( child >= nmemb )
+        {
+            return;
+        }
+        if ( child + 1 < nmemb && compar( base + child * size, base + ( child + 1 ) * size ) < 0 )
+        {
+            ++child;
+        }
+        if ( compar( base + root * size, base + child * size ) >= 0 )
+        {
+            return;
+        }
+        memswp( base + root * size, base + child * size, size, wordwise );
+        root = child;
+    }
+}
+
+/* Heapsort is used for partitions which quicksort fails to split evenly too
+   often (introsort), limiting the worst case to O( n log n ).
+*/
+static void heapsort_range( char * base, size_t nmemb, size_t size, int wordwise, int (*compar)( const void *, const void * ) )
+{
+    size_t n;
+    for ( n = nmemb / 2; n-- > 0; )
+    {
+        siftdown( base, n, nmemb, size, wordwise, compar );
+    }
+    for ( n = nmemb - 1; n > 0; --n )
+    {
+        memswp( base, base + n * size, size, wordwise );
+        siftdown( base, 0, n, size, wordwise, compar );
+    }
+}
+
 void qsort( void * base, size_t nmemb, size_t size, int (*compar)( const void *, const void * ) )
 {
     char * i;
@@ -45,24 +114,49 @@ void qsort( void * base, size_t nmemb, size_t size, int (*compar)( const void *,
     _PDCLIB_size_t thresh = T * size;
     char * base_          = (char *)base;
     char * limit          = base_ + nmemb * size;
+    int wordwise          = _PDCLIB_WORD_ALIGNED( base_ ) && size % sizeof( _PDCLIB_word_t ) == 0;
+    unsigned int depth    = 0;
+    size_t n;
     PREPARE_STACK;
 
+    if ( nmemb < 2 || size == 0 )
+    {
+        return;
+    }
+
+    /* Allow 2 * log2( nmemb ) levels of partitioning before giving up */
+    for ( n = nmemb; n > 1; n >>= 1 )
+    {
+        depth += 2;
+    }
+
     for ( ;; )
     {
-        if ( (size_t)( limit - base_ ) > thresh ) /* QSort for more than T elements. */
+        if ( (size_t)( limit - base_ ) > thresh && depth == 0 )
+        {
+            /* Too many bad pivots; heapsort what remains of this partition. */
+            heapsort_range( base_, (size_t)( limit - base_ ) / size, size, wordwise, compar );
+            if ( stackptr == stack )
+            {
+                break;
+            }
+            POP( base_, limit, depth );
+        }
+        else if ( (size_t)( limit - base_ ) > thresh ) /* QSort for more than T elements. */
         {
+            --depth;
             /* We work from second to last - first will be pivot element. */
             i = base_ + size;
             j = limit - size;
             /* We swap first with middle element, then sort that with second
                and last element so that eventually first element is the median
-               of the three - avoiding pathological pivots.
-               TODO: Instead of middle element, chose one randomly.
+               of the three - avoiding pathological pivots. This also leaves
+               sentinels at both ends, so the scans below need no bounds checks.
             */
-            memswp( ( ( ( (size_t)( limit - base_ ) ) / size ) / 2 ) * size + base_, base_, size );
-            if ( compar( i, j ) > 0 ) memswp( i, j, size );
-            if ( compar( base_, j ) > 0 ) memswp( base_, j, size );
-            if ( compar( i, base_ ) > 0 ) memswp( i, base_, size );
+            memswp( ( ( ( (size_t)( limit - base_ ) ) / size ) / 2 ) * size + base_, base_, size, wordwise );
+            if ( compar( i, j ) > 0 ) memswp( i, j, size, wordwise );
+            if ( compar( base_, j ) > 0 ) memswp( base_, j, size, wordwise );
+            if ( compar( i, base_ ) > 0 ) memswp( i, base_, size, wordwise );
             /* Now we have the median for pivot element, entering main Quicksort. */
             for ( ;; )
             {
@@ -82,21 +176,21 @@ void qsort( void * base, size_t nmemb, size_t size, int (*compar)( const void *,
                     break;
                 }
                 /* else swap elements, keep scanning */
-                memswp( i, j, size );
+                memswp( i, j, size, wordwise );
             }
             /* move pivot into correct place */
-            memswp( base_, j, size );
+            memswp( base_, j, size, wordwise );
             /* larger subfile base / limit to stack, sort smaller */
             if ( j - base_ > limit - i )
             {
                 /* left is larger */
-                PUSH( base_, j );
+                PUSH( base_, j, depth );
                 base_ = i;
             }
             else
             {
                 /* right is larger */
-                PUSH( i, limit );
+                PUSH( i, limit, depth );
                 limit = j;
             }
         }
@@ -106,7 +200,7 @@ void qsort( void * base, size_t nmemb, size_t size, int (*compar)( const void *,
             {
                 for ( ; compar( j, j + size ) > 0; j -= size )
                 {
-                    memswp( j, j + size, size );
+                    memswp( j, j + size, size, wordwise );
                     if ( j == base_ )
                     {
                         break;
@@ -115,7 +209,7 @@ void qsort( void * base, size_t nmemb, size_t size, int (*compar)( const void *,
             }
             if ( stackptr != stack )           /* if any entries on stack  */
             {
-                POP( base_, limit );
+                POP( base_, limit, depth );
             }
             else                       /* else stack empty, done   */
             {
@@ -11,6 +11,23 @@
 void * memchr( const void * s, int c, size_t n )
 {
     const unsigned char * p = (const unsigned char *) s;
+    const _PDCLIB_word_t * w;
+    _PDCLIB_word_t mask = _PDCLIB_WORD_ONES * (unsigned char) c;
+    for ( ; n > 0 && ! _PDCLIB_WORD_ALIGNED( p ); --n, ++p )
+    {
+        if ( *p == (unsigned char) c )
+        {
+            return (void *) p;
+        }
+    }
+    /* Skip whole words not containing c; these never extend beyond n */
+    w = (const _PDCLIB_word_t *) p;
+    while ( n >= sizeof( _PDCLIB_word_t ) && ! _PDCLIB_WORD_HAS_ZERO( *w ^ mask ) )
+    {
+        ++w;
+        n -= sizeof( _PDCLIB_word_t );
+    }
+    p = (const unsigned char *) w;
     while ( n-- )
     {
         if ( *p == (unsigned char) c )
@@ -10,6 +10,28 @@
 
 int strcmp( const char * s1, const char * s2 )
 {
+    /* Equally aligned strings can be compared a word at a time */
+    if ( ( ( (_PDCLIB_uintptr_t) s1 ^ (_PDCLIB_uintptr_t) s2 ) & ( sizeof( _PDCLIB_word_t ) - 1 ) ) == 0 )
+    {
+        const _PDCLIB_word_t * w1;
+        const _PDCLIB_word_t * w2;
+        for ( ; ! _PDCLIB_WORD_ALIGNED( s1 ); ++s1, ++s2 )
+        {
+            if ( ( *s1 == '\0' ) || ( *s1 != *s2 ) )
+            {
+                return ( *(unsigned char *)s1 - *(unsigned char *)s2 );
+            }
+        }
+        w1 = (const _PDCLIB_word_t *) s1;
+        w2 = (const _PDCLIB_word_t *) s2;
+        while ( ( *w1 == *w2 ) && ! _PDCLIB_WORD_HAS_ZERO( *w1 ) )
+        {
+            ++w1;
+            ++w2;
+        }
+        s1 = (const char *) w1;
+        s2 = (const char *) w2;
+    }
     while ( ( *s1 ) && ( *s1 == *s2 ) )
     {
         ++s1;
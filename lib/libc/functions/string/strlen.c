@@ -10,12 +10,25 @@
 
 size_t strlen( const char * s )
 {
-    size_t rc = 0;
-    while ( s[rc] )
+    const char * p = s;
+    const _PDCLIB_word_t * w;
+    for ( ; ! _PDCLIB_WORD_ALIGNED( p ); ++p )
     {
-        ++rc;
+        if ( *p == '\0' )
+        {
+            return p - s;
+        }
     }
-    return rc;
+    w = (const _PDCLIB_word_t *) p;
+    while ( ! _PDCLIB_WORD_HAS_ZERO( *w ) )
+    {
+        ++w;
+    }
+    for ( p = (const char *) w; *p; ++p )
+    {
+        /* EMPTY */
+    }
+    return p - s;
 }
 
 #endif
@@ -260,6 +260,19 @@ typedef unsigned _PDCLIB_intptr _PDCLIB_uintptr_t;
 #define _PDCLIB_INTPTR_MAX  _PDCLIB_concat( _PDCLIB_concat( _PDCLIB_, _PDCLIB_INTPTR ), _MAX )
 #define _PDCLIB_UINTPTR_MAX _PDCLIB_concat( _PDCLIB_concat( _PDCLIB_U, _PDCLIB_INTPTR ), _MAX )
 
+/* Word-at-a-time string scanning. An aligned word never crosses a page
+   boundary, so reading the whole word containing the terminator is safe.
+*/
+#if defined( __GNUC__ )
+typedef _PDCLIB_uintptr_t _PDCLIB_word_t __attribute__(( __may_alias__ ));
+#else
+typedef _PDCLIB_uintptr_t _PDCLIB_word_t;
+#endif
+#define _PDCLIB_WORD_ONES ( (_PDCLIB_word_t)-1 / 0xff )
+#define _PDCLIB_WORD_HIGHS ( _PDCLIB_WORD_ONES * 0x80 )
+#define _PDCLIB_WORD_HAS_ZERO( w ) ( ( ( w ) - _PDCLIB_WORD_ONES ) & ~( w ) & _PDCLIB_WORD_HIGHS )
+#define _PDCLIB_WORD_ALIGNED( p ) ( ( (_PDCLIB_uintptr_t)( p ) & ( sizeof( _PDCLIB_word_t ) - 1 ) ) == 0 )
+
 typedef _PDCLIB_intmax          _PDCLIB_intmax_t;
 typedef unsigned _PDCLIB_intmax _PDCLIB_uintmax_t;
 #define _PDCLIB_INTMAX_MIN  _PDCLIB_concat( _PDCLIB_concat( _PDCLIB_, _PDCLIB_INTMAX ), _MIN )
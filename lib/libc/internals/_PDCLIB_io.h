@@ -96,6 +96,15 @@ void _PDCLIB_closeall( void );
 */
 int _PDCLIB_flushbuffer( _PDCLIB_file_t * stream );
 
+/* Writes a stream's buffer followed by length bytes from buf, without copying
+   the latter into the buffer first. Intended for writes at least as large as
+   the buffer itself.
+   Returns the number of bytes from buf written.
+   Sets stream error flags and errno appropriately on error.
+*/
+_PDCLIB_size_t _PDCLIB_flushwrite( _PDCLIB_file_t * stream, const char * buf,
+                                   _PDCLIB_size_t length );
+
 /* Fills a stream's buffer.
    Returns 0 on success, EOF on read error / EOF.
    Sets stream EOF / error flags and errno appropriately on error.
@@ -168,6 +177,28 @@ struct _PDCLIB_fileops
      */
     _PDCLIB_bool (*wwrite)( _PDCLIB_fd_t self, const _PDCLIB_wchar_t * buf,
                      _PDCLIB_size_t length, _PDCLIB_size_t * numCharsWritten );
+
+    /* Behaves as write does, except that length bytes from buf are followed
+     * by length2 bytes from buf2 in a single operation; *numBytesWritten
+     * covers both.
+     *
+     * This function is optional; if missing, PDCLib will issue a write for
+     * each of the buffers. It allows a stream's buffer and a large request
+     * that bypasses it to be written using a single system call.
+     */
+    _PDCLIB_bool (*write2)( _PDCLIB_fd_t self, const void * buf,
+                     _PDCLIB_size_t length, const void * buf2,
+                     _PDCLIB_size_t length2, _PDCLIB_size_t * numBytesWritten );
+
+    /* Returns the preferred buffer size for the file, or zero if there is no
+     * preference. *interactive is set if the file refers to an interactive
+     * device, in which case the stream will be line buffered rather than
+     * fully buffered.
+     *
+     * This function is optional; if missing, PDCLib will use a buffer of
+     * BUFSIZ bytes and assume every file to be interactive.
+     */
+    _PDCLIB_size_t (*bufsize)( _PDCLIB_fd_t self, _PDCLIB_bool * interactive );
 };
 
 /* struct _PDCLIB_file structure */
@@ -17,6 +17,9 @@ void _PDCLIB_call_once(_PDCLIB_once_flag *flag, void (*func)(void));
 #define _PDCLIB_MTX_T char
 #define _PDCLIB_TSS_T struct _PDCLIB_tss
 
+/* There is only one thread, so ordinary variables are thread-local already */
+#define _PDCLIB_THREAD_LOCAL
+
 struct _PDCLIB_tss {
 	struct _PDCLIB_tss *self;
 	void *value;
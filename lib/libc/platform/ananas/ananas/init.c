@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 struct PROCINFO* ananas_procinfo;
 int    libc_argc = 0;
@@ -58,6 +59,14 @@ libc_init(struct PROCINFO* pi)
 	/* Initialize argument and environment variables */
 	libc_initialize_arg(pi->pi_args, &libc_argv, &libc_argc);
 	libc_reinit_environ();
+
+	/*
+	 * stdout starts out line buffered, which is only useful if someone is
+	 * watching; if it is redirected, flushing every line just means more
+	 * system calls.
+	 */
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
 }
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,21 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <errno.h>
+#include <unistd.h>
+
+ssize_t copy_file_range(int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len, unsigned int flags)
+{
+	if (flags != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	errorcode_t err = sys_copyrange(fd_in, off_in, fd_out, off_out, &len);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return len;
+}
@@ -46,6 +46,14 @@ _posix_map_error(errorcode_t err)
 			SET_ERRNO(ENOSPC);
 		case ANANAS_ERROR_CROSS_DEVICE:
 			SET_ERRNO(EXDEV);
+		case ANANAS_ERROR_TIMEOUT:
+			SET_ERRNO(ETIMEDOUT);
+		case ANANAS_ERROR_BROKEN_PIPE:
+			SET_ERRNO(EPIPE);
+		case ANANAS_ERROR_TRY_AGAIN:
+			SET_ERRNO(EAGAIN);
+		case ANANAS_ERROR_NO_PROCESS:
+			SET_ERRNO(ESRCH);
 		case ANANAS_ERROR_CLONED: /* should never end up here */
 		case ANANAS_ERROR_UNKNOWN:
 		default:
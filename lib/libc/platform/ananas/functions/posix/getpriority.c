@@ -0,0 +1,26 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+/* Only PRIO_PROCESS is supported; a 'who' of 0 is the calling thread */
+int
+getpriority(int which, id_t who)
+{
+	if (which != PRIO_PROCESS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int nice;
+	errorcode_t err = sys_sched_getnice(who, &nice);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return nice;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -1,10 +1,49 @@
+#include <ananas/types.h>
+#include <ananas/shared-page.h>
 #include <sys/time.h>
 #include <time.h>
 
+static inline uint64_t
+read_tsc()
+{
+	uint32_t lo, hi;
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
 int
 gettimeofday(struct timeval* tp, void* tz)
 {
-	tp->tv_sec = time(0);
-	tp->tv_usec = 0;
+	/*
+	 * The kernel publishes everything we need in the shared page; we need not
+	 * enter it, but must retry if it was updating the values as we read them.
+	 */
+	const volatile struct SHARED_PAGE* sp = (const volatile struct SHARED_PAGE*)SHARED_PAGE_ADDR;
+	uint32_t seq, tsc_mhz, pvclock_valid;
+	uint64_t tsc_boot, boot_time, tsc, pvclock_ns = 0;
+	do {
+		seq = sp->sp_time_seq;
+		__asm __volatile("" : : : "memory");
+		tsc_mhz = sp->sp_tsc_mhz;
+		tsc_boot = sp->sp_tsc_boot;
+		boot_time = sp->sp_boot_time;
+		/* The hypervisor's clock survives migration; the raw TSC may not */
+		pvclock_valid = sp->sp_md.msp_pvclock_valid;
+		if (pvclock_valid)
+			pvclock_ns = pvclock_read_ns(&sp->sp_md.msp_pvclock) - sp->sp_md.msp_pvclock_boot;
+		tsc = read_tsc();
+		__asm __volatile("" : : : "memory");
+	} while ((seq & 1) || seq != sp->sp_time_seq);
+
+	if (!pvclock_valid && tsc_mhz == 0) {
+		/* Not calibrated; this shouldn't happen once we are running */
+		tp->tv_sec = time(0);
+		tp->tv_usec = 0;
+		return 0;
+	}
+
+	uint64_t us = pvclock_valid ? pvclock_ns / 1000 : (tsc - tsc_boot) / tsc_mhz;
+	tp->tv_sec = boot_time + us / 1000000;
+	tp->tv_usec = us % 1000000;
 	return 0;
 }
@@ -0,0 +1,20 @@
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * There are no terminal attributes to query, so we consider every character
+ * device to be a terminal; files and pipes never are.
+ */
+int
+isatty(int fildes)
+{
+	struct stat sb;
+	if (fstat(fildes, &sb) < 0)
+		return 0;
+	if (!S_ISCHR(sb.st_mode)) {
+		errno = ENOTTY;
+		return 0;
+	}
+	return 1;
+}
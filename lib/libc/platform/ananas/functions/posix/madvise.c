@@ -0,0 +1,36 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscall-vmops.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+
+int madvise(void* addr, size_t len, int advice)
+{
+	struct VMOP_OPTIONS vo;
+	memset(&vo, 0, sizeof(vo));
+	vo.vo_size = sizeof(vo);
+	vo.vo_op = OP_ADVISE;
+	vo.vo_addr = addr;
+	vo.vo_len = len;
+	switch(advice) {
+		case MADV_NORMAL: vo.vo_flags = VMOP_ADVICE_NORMAL; break;
+		case MADV_RANDOM: vo.vo_flags = VMOP_ADVICE_RANDOM; break;
+		case MADV_SEQUENTIAL: vo.vo_flags = VMOP_ADVICE_SEQUENTIAL; break;
+		case MADV_WILLNEED: vo.vo_flags = VMOP_ADVICE_WILLNEED; break;
+		case MADV_DONTNEED: vo.vo_flags = VMOP_ADVICE_DONTNEED; break;
+		case MADV_FREE: vo.vo_flags = VMOP_ADVICE_FREE; break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	errorcode_t err = sys_vmop(&vo);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,28 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/sched.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <unistd.h>
+
+int
+nice(int incr)
+{
+	int value;
+	errorcode_t err = sys_sched_getnice(0, &value);
+	if (err == ANANAS_ERROR_NONE) {
+		value += incr;
+		if (value < SCHED_NICE_MIN)
+			value = SCHED_NICE_MIN;
+		if (value > SCHED_NICE_MAX)
+			value = SCHED_NICE_MAX;
+		err = sys_sched_setnice(0, value);
+	}
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return value;
+}
+
+/* vim:set ts=2 sw=2: */
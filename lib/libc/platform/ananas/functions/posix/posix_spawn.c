@@ -0,0 +1,159 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/spawn.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+
+int
+posix_spawn(pid_t* pid, const char* path, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[])
+{
+	if (attrp != NULL && attrp->__flags != 0)
+		return EINVAL;
+
+	struct SPAWN_OPTIONS so;
+	memset(&so, 0, sizeof(so));
+	so.so_size = sizeof(so);
+	so.so_path = path;
+	so.so_argv = (const char**)argv;
+	so.so_envp = (const char**)envp;
+	if (file_actions != NULL) {
+		so.so_num_actions = file_actions->__count;
+		so.so_actions = file_actions->__actions;
+	}
+
+	pid_t child;
+	errorcode_t err = sys_spawn(&so, &child);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return errno;
+	}
+
+	if (pid != NULL)
+		*pid = child;
+	return 0;
+}
+
+int
+posix_spawnp(pid_t* pid, const char* file, const posix_spawn_file_actions_t* file_actions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[])
+{
+	/* Like execvp(), we do not search the path yet */
+	return posix_spawn(pid, file, file_actions, attrp, argv, envp);
+}
+
+int
+posix_spawn_file_actions_init(posix_spawn_file_actions_t* file_actions)
+{
+	memset(file_actions, 0, sizeof(*file_actions));
+	return 0;
+}
+
+int
+posix_spawn_file_actions_destroy(posix_spawn_file_actions_t* file_actions)
+{
+	for (int n = 0; n < file_actions->__count; n++)
+		free((void*)file_actions->__actions[n].sa_path);
+	free(file_actions->__actions);
+	memset(file_actions, 0, sizeof(*file_actions));
+	return 0;
+}
+
+static struct SPAWN_ACTION*
+posix_spawn_file_actions_add(posix_spawn_file_actions_t* file_actions, int op)
+{
+	if (file_actions->__count == SPAWN_MAX_ACTIONS)
+		return NULL;
+	if (file_actions->__count == file_actions->__alloc) {
+		int alloc = (file_actions->__alloc > 0) ? file_actions->__alloc * 2 : 4;
+		struct SPAWN_ACTION* actions = realloc(file_actions->__actions, alloc * sizeof(struct SPAWN_ACTION));
+		if (actions == NULL)
+			return NULL;
+		file_actions->__actions = actions;
+		file_actions->__alloc = alloc;
+	}
+
+	struct SPAWN_ACTION* sa = &file_actions->__actions[file_actions->__count];
+	memset(sa, 0, sizeof(*sa));
+	sa->sa_op = op;
+	return sa;
+}
+
+int
+posix_spawn_file_actions_addclose(posix_spawn_file_actions_t* file_actions, int fildes)
+{
+	if (fildes < 0)
+		return EBADF;
+	struct SPAWN_ACTION* sa = posix_spawn_file_actions_add(file_actions, SPAWN_ACTION_CLOSE);
+	if (sa == NULL)
+		return ENOMEM;
+	sa->sa_handle = fildes;
+	file_actions->__count++;
+	return 0;
+}
+
+int
+posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t* file_actions, int fildes, int newfildes)
+{
+	if (fildes < 0 || newfildes < 0)
+		return EBADF;
+	struct SPAWN_ACTION* sa = posix_spawn_file_actions_add(file_actions, SPAWN_ACTION_DUP2);
+	if (sa == NULL)
+		return ENOMEM;
+	sa->sa_handle = fildes;
+	sa->sa_newhandle = newfildes;
+	file_actions->__count++;
+	return 0;
+}
+
+int
+posix_spawn_file_actions_addopen(posix_spawn_file_actions_t* file_actions, int fildes, const char* path, int oflag, mode_t mode)
+{
+	if (fildes < 0)
+		return EBADF;
+	struct SPAWN_ACTION* sa = posix_spawn_file_actions_add(file_actions, SPAWN_ACTION_OPEN);
+	if (sa == NULL)
+		return ENOMEM;
+	/* The path must be copied, the caller may change it before spawning */
+	sa->sa_path = strdup(path);
+	if (sa->sa_path == NULL)
+		return ENOMEM;
+	sa->sa_newhandle = fildes;
+	sa->sa_flags = oflag;
+	sa->sa_mode = mode;
+	file_actions->__count++;
+	return 0;
+}
+
+int
+posix_spawnattr_init(posix_spawnattr_t* attr)
+{
+	attr->__flags = 0;
+	return 0;
+}
+
+int
+posix_spawnattr_destroy(posix_spawnattr_t* attr)
+{
+	return 0;
+}
+
+int
+posix_spawnattr_getflags(const posix_spawnattr_t* attr, short* flags)
+{
+	*flags = attr->__flags;
+	return 0;
+}
+
+int
+posix_spawnattr_setflags(posix_spawnattr_t* attr, short flags)
+{
+	if (flags != 0)
+		return EINVAL; /* none are supported */
+	attr->__flags = flags;
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
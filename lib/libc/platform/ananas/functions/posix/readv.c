@@ -0,0 +1,16 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <sys/uio.h>
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt)
+{
+	size_t len;
+	errorcode_t err = sys_readv(fd, iov, iovcnt, &len);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return len;
+}
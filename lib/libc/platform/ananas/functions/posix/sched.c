@@ -0,0 +1,122 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <sched.h>
+#include <errno.h>
+
+int
+sched_get_priority_min(int policy)
+{
+	switch(policy) {
+		case SCHED_OTHER:
+			return 0;
+		case SCHED_FIFO:
+		case SCHED_RR:
+			return SCHED_RT_PRIORITY_MIN;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+int
+sched_get_priority_max(int policy)
+{
+	switch(policy) {
+		case SCHED_OTHER:
+			return 0;
+		case SCHED_FIFO:
+		case SCHED_RR:
+			return SCHED_RT_PRIORITY_MAX;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+int
+sched_setscheduler(pid_t pid, int policy, const struct sched_param* param)
+{
+	int min = sched_get_priority_min(policy);
+	if (min < 0)
+		return -1;
+	if (param == NULL || param->sched_priority < min || param->sched_priority > sched_get_priority_max(policy)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* We have to return the previous policy */
+	int old_policy, old_priority;
+	errorcode_t err = sys_sched_getscheduler(pid, &old_policy, &old_priority);
+	if (err == ANANAS_ERROR_NONE)
+		err = sys_sched_setscheduler(pid, policy, param->sched_priority);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return old_policy;
+}
+
+int
+sched_getscheduler(pid_t pid)
+{
+	int policy, priority;
+	errorcode_t err = sys_sched_getscheduler(pid, &policy, &priority);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return policy;
+}
+
+int
+sched_setparam(pid_t pid, const struct sched_param* param)
+{
+	int policy = sched_getscheduler(pid);
+	if (policy < 0)
+		return -1;
+	return sched_setscheduler(pid, policy, param) < 0 ? -1 : 0;
+}
+
+int
+sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t* mask)
+{
+	if (cpusetsize < sizeof(cpu_set_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	errorcode_t err = sys_sched_setaffinity(pid, mask->__bits);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return 0;
+}
+
+int
+sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t* mask)
+{
+	if (cpusetsize < sizeof(cpu_set_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	errorcode_t err = sys_sched_getaffinity(pid, &mask->__bits);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return 0;
+}
+
+int
+sched_getparam(pid_t pid, struct sched_param* param)
+{
+	int policy;
+	errorcode_t err = sys_sched_getscheduler(pid, &policy, &param->sched_priority);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
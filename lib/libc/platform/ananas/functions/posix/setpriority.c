@@ -0,0 +1,31 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/sched.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+/* Only PRIO_PROCESS is supported; a 'who' of 0 is the calling thread */
+int
+setpriority(int which, id_t who, int value)
+{
+	if (which != PRIO_PROCESS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Out-of-range values are clipped, as POSIX allows */
+	if (value < SCHED_NICE_MIN)
+		value = SCHED_NICE_MIN;
+	if (value > SCHED_NICE_MAX)
+		value = SCHED_NICE_MAX;
+	errorcode_t err = sys_sched_setnice(who, value);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
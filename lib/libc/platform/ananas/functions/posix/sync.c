@@ -0,0 +1,9 @@
+#include <ananas/types.h>
+#include <ananas/syscalls.h>
+#include <unistd.h>
+
+void sync(void)
+{
+	/* sync() cannot fail; errors are only reported by fsync() */
+	(void)sys_sync();
+}
@@ -0,0 +1,13 @@
+#include <unistd.h>
+
+/*
+ * The child does not share our memory; it gets a copy-on-write clone like
+ * fork() does, which is a valid implementation of vfork(). Callers which just
+ * want to run a program should use posix_spawn(), which copies nothing.
+ */
+pid_t vfork()
+{
+	return fork();
+}
+
+/* vim:set ts=2 sw=2: */
@@ -10,6 +10,8 @@
 #include "_PDCLIB_glue.h"
 #include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 static bool readf( _PDCLIB_fd_t fd, void * buf, size_t length,
                    size_t * numBytesRead )
@@ -35,6 +37,23 @@ static bool writef( _PDCLIB_fd_t fd, const void * buf, size_t length,
     }
 }
 
+static bool write2f( _PDCLIB_fd_t fd, const void * buf, size_t length,
+                     const void * buf2, size_t length2,
+                     size_t * numBytesWritten )
+{
+    struct iovec iov[ 2 ] = {
+        { .iov_base = (void *)buf,  .iov_len = length  },
+        { .iov_base = (void *)buf2, .iov_len = length2 },
+    };
+    ssize_t res = writev(fd.sval, iov, 2);
+    if(res == -1) {
+        return false;
+    } else {
+        *numBytesWritten = res;
+        return true;
+    }
+}
+
 /* Note: Assumes being compiled with an OFF64 programming model */
 
 static bool seekf( _PDCLIB_fd_t fd, int_fast64_t offset, int whence,
@@ -54,11 +73,35 @@ static void closef( _PDCLIB_fd_t self )
     close( self.sval );
 }
 
+/* Regular files are buffered in large chunks; only character devices are
+   considered to be interactive, as everything else (files, pipes) can not be
+   a terminal.
+*/
+static size_t bufsizef( _PDCLIB_fd_t fd, bool * interactive )
+{
+    struct stat sb;
+    int saved_errno = errno;
+    if ( fstat( fd.sval, &sb ) != 0 )
+    {
+        errno = saved_errno;
+        *interactive = false;
+        return 0;
+    }
+    *interactive = S_ISCHR( sb.st_mode );
+    if ( ! S_ISREG( sb.st_mode ) )
+    {
+        return 0;
+    }
+    return sb.st_blksize > _PDCLIB_FILE_BUFSIZ ? sb.st_blksize : _PDCLIB_FILE_BUFSIZ;
+}
+
 const _PDCLIB_fileops_t _PDCLIB_fileops = {
     .read  = readf,
     .write = writef,
     .seek  = seekf,
     .close = closef,
+    .write2 = write2f,
+    .bufsize = bufsizef,
 };
 
 #endif
@@ -1,8 +0,0 @@
-#include <sys/resource.h>
-#include <_posix/todo.h>
-
-int getpriority(int which, id_t who)
-{
-	TODO;
-	return -1;
-}
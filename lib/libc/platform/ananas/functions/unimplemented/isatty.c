@@ -1,9 +0,0 @@
-#include <unistd.h>
-#include <_posix/todo.h>
-
-int
-isatty(int fildes)
-{
-	TODO;
-	return 1;
-}
@@ -1,8 +0,0 @@
-#include <sys/resource.h>
-#include <_posix/todo.h>
-
-int setpriority(int which, id_t who, int value)
-{
-	TODO;
-	return -1;
-}
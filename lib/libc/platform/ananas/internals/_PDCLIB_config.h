@@ -323,11 +323,16 @@ typedef __builtin_va_list _PDCLIB_va_list;
 */
 #define _PDCLIB_MALLOC_PAGESIZE 4096
 #define _PDCLIB_MALLOC_ALIGN 16
-#define _PDCLIB_MALLOC_GRANULARITY 64*1024
+/* Every growth of the heap is a sys_vmop() call; grow in large steps */
+#define _PDCLIB_MALLOC_GRANULARITY 1024*1024
 #define _PDCLIB_MALLOC_TRIM_THRESHOLD 2*1024*1024
 #define _PDCLIB_MALLOC_MMAP_THRESHOLD 256*1024
 #define _PDCLIB_MALLOC_RELEASE_CHECK_RATE 4095
 
+/* Free chunks at least this large give their pages back, see _PDCLIB_discardpages() */
+#define _PDCLIB_HAVE_DISCARDPAGES
+#define _PDCLIB_MALLOC_DISCARD_THRESHOLD 1024*1024
+
 /* TODO: Better document these */
 
 /* Locale --------------------------------------------------------------------*/
@@ -343,7 +348,13 @@ typedef __builtin_va_list _PDCLIB_va_list;
 /* I/O ---------------------------------------------------------------------- */
 
 /* The default size for file buffers. Must be at least 256. */
-#define _PDCLIB_BUFSIZ 1024
+#define _PDCLIB_BUFSIZ 4096
+
+/* The minimum buffer size used for regular files; the filesystem block size
+   is used if it is larger. Reading or writing files in such large chunks
+   keeps the number of system calls down.
+*/
+#define _PDCLIB_FILE_BUFSIZ 65536
 
 /* The minimum number of files the implementation can open simultaneously. Must
    be at least 8. Depends largely on how the bookkeeping is done by fopen() /
@@ -0,0 +1,552 @@
+/*
+ * Runtime linker for dynamically linked programs.
+ *
+ * The kernel maps the program and us, and calls _rtld() via _rtld_start with
+ * the PROCINFO of the new process. We load the libraries the program needs,
+ * bind all symbols right away and return the entry point of the program,
+ * which _rtld_start jumps to as if the kernel had started it directly.
+ *
+ * Libraries are mapped straight from their files: the read-only segments are
+ * shared mappings of the page cache, so their text is in memory only once no
+ * matter how many processes use it. Only the writable segments are private.
+ *
+ * Not supported yet: thread-local storage, fini functions and RELRO.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/flags.h>
+#include <ananas/procinfo.h>
+#include <ananas/syscalls.h>
+#include <machine/param.h>
+#include <elf.h>
+
+#define RTLD_MAX_OBJECTS	32
+#define RTLD_LIBDIR		"/lib/"
+#define RTLD_PATH_LENGTH	128
+
+#define ROUND_DOWN(n, mult)	((n) & ~((mult) - 1))
+#define ROUND_UP(n, mult)	ROUND_DOWN((n) + (mult) - 1, mult)
+
+#define __hidden __attribute__((__visibility__("hidden")))
+
+/* Provided by the linker; our own dynamic section */
+extern const Elf64_Dyn _DYNAMIC[] __hidden;
+
+struct RTLD_OBJECT {
+	const char*		o_name;
+	addr_t			o_base;		/* difference between load and link addresses */
+	const Elf64_Dyn*	o_dynamic;
+	const Elf64_Sym*	o_symtab;
+	const char*		o_strtab;
+	const uint32_t*		o_hash;		/* DT_HASH, or NULL */
+	const uint32_t*		o_gnu_hash;	/* DT_GNU_HASH, or NULL */
+	const Elf64_Rela*	o_rela;
+	size_t			o_relasz;
+	const Elf64_Rela*	o_jmprel;
+	size_t			o_pltrelsz;
+	addr_t			o_init;
+	const addr_t*		o_init_array;
+	size_t			o_init_arraysz;
+};
+
+/* Index 0 is the program; libraries follow in the order they are loaded */
+static struct RTLD_OBJECT rtld_object[RTLD_MAX_OBJECTS];
+static int rtld_num_objects;
+
+void* memcpy(void* dst, const void* src, size_t len);
+void* memset(void* dst, int c, size_t len);
+
+void*
+memcpy(void* dst, const void* src, size_t len)
+{
+	char* d = dst;
+	const char* s = src;
+	while (len-- > 0)
+		*d++ = *s++;
+	return dst;
+}
+
+void*
+memset(void* dst, int c, size_t len)
+{
+	char* d = dst;
+	while (len-- > 0)
+		*d++ = c;
+	return dst;
+}
+
+static size_t
+rtld_strlen(const char* s)
+{
+	size_t len = 0;
+	while (s[len] != '\0')
+		len++;
+	return len;
+}
+
+static int
+rtld_strcmp(const char* a, const char* b)
+{
+	while (*a != '\0' && *a == *b)
+		a++, b++;
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+static void
+rtld_print(const char* s)
+{
+	size_t len = rtld_strlen(s);
+	sys_write(2, s, &len);
+}
+
+static void __attribute__((noreturn))
+rtld_fail(const char* obj, const char* msg, const char* arg)
+{
+	rtld_print("rtld: ");
+	rtld_print(obj);
+	rtld_print(": ");
+	rtld_print(msg);
+	if (arg != NULL) {
+		rtld_print(" ");
+		rtld_print(arg);
+	}
+	rtld_print("\n");
+	sys_exit(127);
+	for(;;);
+}
+
+/*
+ * Applies our own relocations; the linker has turned them all into relative
+ * ones. Nothing that needs relocating may be used before this is done, which
+ * includes any global pointers and string constants stored in them.
+ */
+static void
+rtld_relocate_self(addr_t base)
+{
+	const Elf64_Rela* rela = NULL;
+	size_t relasz = 0;
+	for (const Elf64_Dyn* d = _DYNAMIC; d->d_tag != DT_NULL; d++) {
+		if (d->d_tag == DT_RELA)
+			rela = (const Elf64_Rela*)(base + d->d_un.d_ptr);
+		else if (d->d_tag == DT_RELASZ)
+			relasz = d->d_un.d_val;
+	}
+
+	for (size_t n = 0; n < relasz / sizeof(Elf64_Rela); n++, rela++) {
+		if (ELF64_R_TYPE(rela->r_info) == R_X86_64_RELATIVE)
+			*(addr_t*)(base + rela->r_offset) = base + rela->r_addend;
+	}
+}
+
+static void
+rtld_parse_dynamic(struct RTLD_OBJECT* obj)
+{
+	addr_t base = obj->o_base;
+	int pltrel = DT_RELA;
+	for (const Elf64_Dyn* d = obj->o_dynamic; d->d_tag != DT_NULL; d++) {
+		switch(d->d_tag) {
+			case DT_SYMTAB:
+				obj->o_symtab = (const Elf64_Sym*)(base + d->d_un.d_ptr);
+				break;
+			case DT_STRTAB:
+				obj->o_strtab = (const char*)(base + d->d_un.d_ptr);
+				break;
+			case DT_HASH:
+				obj->o_hash = (const uint32_t*)(base + d->d_un.d_ptr);
+				break;
+			case DT_GNU_HASH:
+				obj->o_gnu_hash = (const uint32_t*)(base + d->d_un.d_ptr);
+				break;
+			case DT_RELA:
+				obj->o_rela = (const Elf64_Rela*)(base + d->d_un.d_ptr);
+				break;
+			case DT_RELASZ:
+				obj->o_relasz = d->d_un.d_val;
+				break;
+			case DT_JMPREL:
+				obj->o_jmprel = (const Elf64_Rela*)(base + d->d_un.d_ptr);
+				break;
+			case DT_PLTRELSZ:
+				obj->o_pltrelsz = d->d_un.d_val;
+				break;
+			case DT_PLTREL:
+				pltrel = d->d_un.d_val;
+				break;
+			case DT_INIT:
+				obj->o_init = base + d->d_un.d_ptr;
+				break;
+			case DT_INIT_ARRAY:
+				obj->o_init_array = (const addr_t*)(base + d->d_un.d_ptr);
+				break;
+			case DT_INIT_ARRAYSZ:
+				obj->o_init_arraysz = d->d_un.d_val;
+				break;
+			case DT_REL:
+			case DT_TEXTREL:
+				/* We only do RELA, and text is shared so it must not be changed */
+				rtld_fail(obj->o_name, "unsupported dynamic tag", NULL);
+		}
+	}
+	if (obj->o_symtab == NULL || obj->o_strtab == NULL)
+		rtld_fail(obj->o_name, "no symbol table", NULL);
+	if (pltrel != DT_RELA)
+		rtld_fail(obj->o_name, "unsupported PLT relocation type", NULL);
+}
+
+static int
+rtld_vmop(int op, addr_t addr, size_t len, int flags, handleindex_t handle, off_t offset, addr_t* out)
+{
+	struct VMOP_OPTIONS vo;
+	memset(&vo, 0, sizeof(vo));
+	vo.vo_size = sizeof(vo);
+	vo.vo_op = op;
+	vo.vo_addr = (void*)addr;
+	vo.vo_len = len;
+	vo.vo_flags = flags;
+	vo.vo_handle = handle;
+	vo.vo_offset = offset;
+	errorcode_t err = sys_vmop(&vo);
+	if (out != NULL)
+		*out = (addr_t)vo.vo_addr;
+	return err == ANANAS_ERROR_NONE;
+}
+
+/* Maps the shared object at fd, which must be position independent */
+static void
+rtld_map_object(struct RTLD_OBJECT* obj, handleindex_t fd)
+{
+	/* We expect the program headers to follow the ELF header */
+	union {
+		Elf64_Ehdr	ehdr;
+		char		data[PAGE_SIZE];
+	} u;
+	size_t len = sizeof(u);
+	if (sys_read(fd, &u, &len) != ANANAS_ERROR_NONE || len < sizeof(Elf64_Ehdr))
+		rtld_fail(obj->o_name, "cannot read header", NULL);
+	const Elf64_Ehdr* ehdr = &u.ehdr;
+	if (ehdr->e_ident[EI_MAG0] != ELFMAG0 || ehdr->e_ident[EI_MAG1] != ELFMAG1 ||
+	    ehdr->e_ident[EI_MAG2] != ELFMAG2 || ehdr->e_ident[EI_MAG3] != ELFMAG3 ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64 ||
+	    ehdr->e_type != ET_DYN || ehdr->e_phentsize != sizeof(Elf64_Phdr))
+		rtld_fail(obj->o_name, "not a shared object", NULL);
+	if (ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > len)
+		rtld_fail(obj->o_name, "program headers not found", NULL);
+	const Elf64_Phdr* phdr = (const Elf64_Phdr*)(u.data + ehdr->e_phoff);
+
+	/* Find the extent of the image */
+	addr_t v_start = (addr_t)-1, v_end = 0;
+	for (int n = 0; n < ehdr->e_phnum; n++) {
+		if (phdr[n].p_type != PT_LOAD)
+			continue;
+		if (phdr[n].p_vaddr < v_start)
+			v_start = phdr[n].p_vaddr;
+		if (phdr[n].p_vaddr + phdr[n].p_memsz > v_end)
+			v_end = phdr[n].p_vaddr + phdr[n].p_memsz;
+	}
+	if (v_start >= v_end)
+		rtld_fail(obj->o_name, "nothing to load", NULL);
+	v_start = ROUND_DOWN(v_start, PAGE_SIZE);
+	v_end = ROUND_UP(v_end, PAGE_SIZE);
+
+	/*
+	 * Let the kernel pick a range large enough for the entire image, and place
+	 * the segments there; nothing else can claim it in between as we are the
+	 * only thread.
+	 */
+	addr_t addr;
+	if (!rtld_vmop(OP_MAP, 0, v_end - v_start, VMOP_FLAG_READ | VMOP_FLAG_PRIVATE, -1, 0, &addr) ||
+	    !rtld_vmop(OP_UNMAP, addr, v_end - v_start, 0, -1, 0, NULL))
+		rtld_fail(obj->o_name, "out of address space", NULL);
+	obj->o_base = addr - v_start;
+
+	for (int n = 0; n < ehdr->e_phnum; n++) {
+		const Elf64_Phdr* ph = &phdr[n];
+		if (ph->p_type == PT_DYNAMIC)
+			obj->o_dynamic = (const Elf64_Dyn*)(obj->o_base + ph->p_vaddr);
+		if (ph->p_type != PT_LOAD)
+			continue;
+
+		int flags = VMOP_FLAG_FIXED;
+		if (ph->p_flags & PF_R)
+			flags |= VMOP_FLAG_READ;
+		if (ph->p_flags & PF_W)
+			flags |= VMOP_FLAG_WRITE;
+		if (ph->p_flags & PF_X)
+			flags |= VMOP_FLAG_EXECUTE;
+
+		addr_t seg_start = obj->o_base + ROUND_DOWN(ph->p_vaddr, PAGE_SIZE);
+		addr_t file_end = obj->o_base + ph->p_vaddr + ph->p_filesz;
+		addr_t mem_end = ROUND_UP(obj->o_base + ph->p_vaddr + ph->p_memsz, PAGE_SIZE);
+		if (ph->p_filesz > 0) {
+			/* Read-only segments are shared; nothing can change them anyway */
+			int share = (ph->p_flags & PF_W) ? VMOP_FLAG_PRIVATE : VMOP_FLAG_SHARED;
+			if (!rtld_vmop(OP_MAP, seg_start, ROUND_UP(file_end, PAGE_SIZE) - seg_start, flags | share | VMOP_FLAG_HANDLE, fd, ROUND_DOWN(ph->p_offset, PAGE_SIZE), NULL))
+				rtld_fail(obj->o_name, "cannot map segment", NULL);
+			seg_start = ROUND_UP(file_end, PAGE_SIZE);
+		}
+		if (ph->p_memsz > ph->p_filesz) {
+			if (!(ph->p_flags & PF_W))
+				rtld_fail(obj->o_name, "read-only bss", NULL);
+			/* The remainder of the last file page is bss; the file may have more there */
+			if (ph->p_filesz > 0)
+				memset((void*)file_end, 0, seg_start - file_end);
+			if (mem_end > seg_start &&
+			    !rtld_vmop(OP_MAP, seg_start, mem_end - seg_start, flags | VMOP_FLAG_PRIVATE, -1, 0, NULL))
+				rtld_fail(obj->o_name, "cannot map bss", NULL);
+		}
+	}
+	if (obj->o_dynamic == NULL)
+		rtld_fail(obj->o_name, "no dynamic section", NULL);
+}
+
+static void
+rtld_load_needed(struct RTLD_OBJECT* obj)
+{
+	for (const Elf64_Dyn* d = obj->o_dynamic; d->d_tag != DT_NULL; d++) {
+		if (d->d_tag != DT_NEEDED)
+			continue;
+		const char* name = obj->o_strtab + d->d_un.d_val;
+
+		int n;
+		for (n = 1; n < rtld_num_objects; n++)
+			if (rtld_strcmp(rtld_object[n].o_name, name) == 0)
+				break;
+		if (n < rtld_num_objects)
+			continue; /* already loaded */
+		if (rtld_num_objects == RTLD_MAX_OBJECTS)
+			rtld_fail(name, "too many shared objects", NULL);
+
+		/* Names without a path are relative to the library directory */
+		char path[RTLD_PATH_LENGTH];
+		size_t prefix_len = 0;
+		const char* p;
+		for (p = name; *p != '\0' && *p != '/'; p++)
+			;
+		if (*p == '\0') {
+			prefix_len = rtld_strlen(RTLD_LIBDIR);
+			memcpy(path, RTLD_LIBDIR, prefix_len);
+		}
+		size_t name_len = rtld_strlen(name);
+		if (prefix_len + name_len >= sizeof(path))
+			rtld_fail(name, "name too long", NULL);
+		memcpy(path + prefix_len, name, name_len + 1);
+
+		handleindex_t fd;
+		if (sys_open(path, O_RDONLY, 0, &fd) != ANANAS_ERROR_NONE)
+			rtld_fail(obj->o_name, "cannot find", path);
+
+		struct RTLD_OBJECT* lib = &rtld_object[rtld_num_objects++];
+		lib->o_name = name;
+		rtld_map_object(lib, fd);
+		sys_close(fd); /* the mappings keep the file */
+		rtld_parse_dynamic(lib);
+	}
+}
+
+static uint32_t
+rtld_elf_hash(const char* name)
+{
+	uint32_t h = 0;
+	for (const unsigned char* p = (const unsigned char*)name; *p != '\0'; p++) {
+		h = (h << 4) + *p;
+		uint32_t g = h & 0xf0000000;
+		h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+static uint32_t
+rtld_gnu_hash(const char* name)
+{
+	uint32_t h = 5381;
+	for (const unsigned char* p = (const unsigned char*)name; *p != '\0'; p++)
+		h = h * 33 + *p;
+	return h;
+}
+
+static const Elf64_Sym*
+rtld_match(const struct RTLD_OBJECT* obj, uint32_t index, const char* name)
+{
+	const Elf64_Sym* sym = &obj->o_symtab[index];
+	if (sym->st_shndx == SHN_UNDEF)
+		return NULL;
+	int bind = ELF64_ST_BIND(sym->st_info);
+	if (bind != STB_GLOBAL && bind != STB_WEAK)
+		return NULL;
+	if (rtld_strcmp(obj->o_strtab + sym->st_name, name) != 0)
+		return NULL;
+	return sym;
+}
+
+/* Looks name up in the symbol table of obj */
+static const Elf64_Sym*
+rtld_lookup_in(const struct RTLD_OBJECT* obj, const char* name, uint32_t elf_hash, uint32_t gnu_hash)
+{
+	if (obj->o_gnu_hash != NULL) {
+		/* nbuckets, symoffset, bloom words, bloom shift, bloom[], buckets[], chain[] */
+		const uint32_t* gh = obj->o_gnu_hash;
+		uint32_t nbuckets = gh[0], symoffset = gh[1], bloom_size = gh[2];
+		const uint32_t* buckets = gh + 4 + bloom_size * (sizeof(Elf64_Addr) / sizeof(uint32_t));
+		const uint32_t* chain = buckets + nbuckets;
+
+		uint32_t index = buckets[gnu_hash % nbuckets];
+		if (index < symoffset)
+			return NULL;
+		for (;; index++) {
+			uint32_t h = chain[index - symoffset];
+			if ((h | 1) == (gnu_hash | 1)) {
+				const Elf64_Sym* sym = rtld_match(obj, index, name);
+				if (sym != NULL)
+					return sym;
+			}
+			if (h & 1)
+				break; /* end of the chain */
+		}
+		return NULL;
+	}
+
+	if (obj->o_hash != NULL) {
+		/* nbucket, nchain, bucket[], chain[] */
+		const uint32_t* h = obj->o_hash;
+		uint32_t nbucket = h[0];
+		const uint32_t* bucket = h + 2;
+		const uint32_t* chain = bucket + nbucket;
+		for (uint32_t index = bucket[elf_hash % nbucket]; index != 0; index = chain[index]) {
+			const Elf64_Sym* sym = rtld_match(obj, index, name);
+			if (sym != NULL)
+				return sym;
+		}
+		return NULL;
+	}
+
+	rtld_fail(obj->o_name, "no symbol hash table", NULL);
+}
+
+/* Finds the first definition of name, in load order; the program comes first unless skipped */
+static const Elf64_Sym*
+rtld_lookup(const char* name, int first, const struct RTLD_OBJECT** def_obj)
+{
+	uint32_t elf_hash = rtld_elf_hash(name);
+	uint32_t gnu_hash = rtld_gnu_hash(name);
+	for (int n = first; n < rtld_num_objects; n++) {
+		const Elf64_Sym* sym = rtld_lookup_in(&rtld_object[n], name, elf_hash, gnu_hash);
+		if (sym != NULL) {
+			*def_obj = &rtld_object[n];
+			return sym;
+		}
+	}
+	return NULL;
+}
+
+static void
+rtld_relocate_one(struct RTLD_OBJECT* obj, const Elf64_Rela* rela)
+{
+	uint32_t type = ELF64_R_TYPE(rela->r_info);
+	uint32_t sym_index = ELF64_R_SYM(rela->r_info);
+	addr_t where = obj->o_base + rela->r_offset;
+
+	if (type == R_X86_64_NONE)
+		return;
+	if (type == R_X86_64_RELATIVE) {
+		*(addr_t*)where = obj->o_base + rela->r_addend;
+		return;
+	}
+
+	/* All other types need the symbol */
+	const Elf64_Sym* ref = &obj->o_symtab[sym_index];
+	const Elf64_Sym* def = ref;
+	const struct RTLD_OBJECT* def_obj = obj;
+	addr_t s = 0;
+	if (ELF64_ST_BIND(ref->st_info) != STB_LOCAL) {
+		/* Copy relocations must find the original, not the copy in the program */
+		const char* name = obj->o_strtab + ref->st_name;
+		def = rtld_lookup(name, (type == R_X86_64_COPY) ? 1 : 0, &def_obj);
+		if (def == NULL && ELF64_ST_BIND(ref->st_info) != STB_WEAK)
+			rtld_fail(obj->o_name, "undefined symbol", name);
+	}
+	if (def != NULL)
+		s = def_obj->o_base + def->st_value;
+
+	switch(type) {
+		case R_X86_64_64:
+			*(addr_t*)where = s + rela->r_addend;
+			break;
+		case R_X86_64_PC32:
+			*(uint32_t*)where = (uint32_t)(s + rela->r_addend - where);
+			break;
+		case R_X86_64_GLOB_DAT:
+		case R_X86_64_JUMP_SLOT:
+			*(addr_t*)where = s;
+			break;
+		case R_X86_64_COPY:
+			if (def != NULL)
+				memcpy((void*)where, (const void*)s, ref->st_size);
+			break;
+		default:
+			rtld_fail(obj->o_name, "unsupported relocation type", NULL);
+	}
+}
+
+static void
+rtld_relocate(struct RTLD_OBJECT* obj)
+{
+	for (size_t n = 0; n < obj->o_relasz / sizeof(Elf64_Rela); n++)
+		rtld_relocate_one(obj, &obj->o_rela[n]);
+	/* All PLT entries are bound now; we do not do lazy binding */
+	for (size_t n = 0; n < obj->o_pltrelsz / sizeof(Elf64_Rela); n++)
+		rtld_relocate_one(obj, &obj->o_jmprel[n]);
+}
+
+static void
+rtld_init(const struct RTLD_OBJECT* obj)
+{
+	if (obj->o_init != 0)
+		((void (*)(void))obj->o_init)();
+	for (size_t n = 0; n < obj->o_init_arraysz / sizeof(addr_t); n++) {
+		addr_t fn = obj->o_init_array[n];
+		if (fn != 0 && fn != (addr_t)-1)
+			((void (*)(void))fn)();
+	}
+}
+
+addr_t _rtld(struct PROCINFO* pi);
+
+addr_t
+_rtld(struct PROCINFO* pi)
+{
+	rtld_relocate_self(pi->pi_interp_base);
+
+	/* The kernel has already mapped the program; find its dynamic section */
+	struct RTLD_OBJECT* prog = &rtld_object[0];
+	prog->o_name = "program";
+	prog->o_base = pi->pi_exec_base;
+	const Elf64_Phdr* phdr = (const Elf64_Phdr*)pi->pi_phdr;
+	if (phdr == NULL)
+		rtld_fail(prog->o_name, "program headers not mapped", NULL);
+	for (unsigned int n = 0; n < pi->pi_phnum; n++) {
+		if (phdr[n].p_type == PT_DYNAMIC)
+			prog->o_dynamic = (const Elf64_Dyn*)(prog->o_base + phdr[n].p_vaddr);
+	}
+	if (prog->o_dynamic == NULL)
+		rtld_fail(prog->o_name, "no dynamic section", NULL);
+	rtld_parse_dynamic(prog);
+	rtld_num_objects = 1;
+
+	/* Load everything needed, breadth-first; this grows as we go */
+	for (int n = 0; n < rtld_num_objects; n++)
+		rtld_load_needed(&rtld_object[n]);
+
+	/*
+	 * Relocate the dependencies before their users, so that copy relocations
+	 * in the program see the initialized data.
+	 */
+	for (int n = rtld_num_objects - 1; n >= 0; n--)
+		rtld_relocate(&rtld_object[n]);
+
+	/* The program runs its own initializers from its startup code */
+	for (int n = rtld_num_objects - 1; n > 0; n--)
+		rtld_init(&rtld_object[n]);
+
+	return pi->pi_entry;
+}
@@ -36,13 +36,29 @@ create_bootinfo(const struct RELOCATE_INFO* ri_kernel, const struct MULTIBOOT* m
 	memset(bootinfo, 0, sizeof(*bootinfo));
 	bootinfo->bi_size = sizeof(*bootinfo);
 
-	/* Create the kernel module; this must be the first one (and currently, the only one) */
+	/* Create the kernel module; this must be the first one */
 	struct LOADER_MODULE* mod_kernel = ALLOC(sizeof *mod_kernel);
 	memset(mod_kernel, 0, sizeof(*mod_kernel));
 	mod_kernel->mod_type = MOD_KERNEL;
 	relocate_info2loader_module(ri_kernel, mod_kernel);
 	bootinfo->bi_modules = (uint32_t)mod_kernel;
 	bootinfo->bi_modules_size = sizeof(struct LOADER_MODULE);
+
+	/* Any multiboot modules are passed as ramdisks; their contents stay where they were loaded */
+	if (mb->mb_flags & MULTIBOOT_FLAG_MODULES) {
+		struct LOADER_MODULE* mod_prev = mod_kernel;
+		struct MULTIBOOT_MODULE* mbm = (void*)mb->mb_mods_addr;
+		for (int n = 0; n < mb->mb_mods_count; n++, mbm++) {
+			struct LOADER_MODULE* mod = ALLOC(sizeof *mod);
+			memset(mod, 0, sizeof(*mod));
+			mod->mod_type = MOD_RAMDISK;
+			mod->mod_phys_start_addr = mbm->mod_start;
+			mod->mod_phys_end_addr = mbm->mod_end;
+			mod_prev->mod_next = (uint32_t)mod;
+			bootinfo->bi_modules_size += sizeof(struct LOADER_MODULE);
+			mod_prev = mod;
+		}
+	}
 	
 	/*
 	 * Create a memory map by traversing the multiboot-provided memory map.
@@ -40,6 +40,13 @@ struct MULTIBOOT {
 	/* 86 */ uint32_t	mb_vbe_interface_len;
 } __attribute__((packed));
 
+struct MULTIBOOT_MODULE {
+	/* 00 */ uint32_t	mod_start;
+	/* 04 */ uint32_t	mod_end;
+	/* 08 */ uint32_t	mod_string;
+	/* 12 */ uint32_t	mod_reserved;
+} __attribute__((packed));
+
 struct MULTIBOOT_MMAP {
 	uint32_t	mm_entry_len;
 	uint32_t	mm_base_lo;
@@ -39,6 +39,13 @@ do_coreutils()
 	make ARCH=${ARCH} ${MAKE_ARGS} MAKEINFO=true
 }
 
+do_bench()
+{
+	cd $R/apps/bench
+	make ARCH=${ARCH} clean
+	make ARCH=${ARCH} ${MAKE_ARGS}
+}
+
 install_includes()
 {
 	cd $R/include
@@ -113,6 +120,7 @@ install_includes
 do_crt
 do_dash
 do_coreutils
+do_bench
 
 install_tree
 install_build
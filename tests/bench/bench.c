@@ -0,0 +1,72 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+
+/* Every benchmark is run this many times; the fastest run is reported */
+#define BENCH_ROUNDS 5
+
+const char* bench_filter = NULL;
+
+static double
+bench_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+void
+bench_run(const char* name, bench_func_t* func, void* arg, unsigned int iterations, size_t bytes)
+{
+	if (bench_filter != NULL && strstr(name, bench_filter) == NULL)
+		return;
+
+	/* Warm up the caches and branch predictors first */
+	func(iterations / 10 + 1, arg);
+
+	double best = 0.0;
+	for (int n = 0; n < BENCH_ROUNDS; n++) {
+		double start = bench_now_ns();
+		func(iterations, arg);
+		double took = bench_now_ns() - start;
+		if (n == 0 || took < best)
+			best = took;
+	}
+
+	double ns_per_op = best / iterations;
+	printf("%-32s %10.1f ns/op %14.0f ops/s", name, ns_per_op, 1e9 / ns_per_op);
+	if (bytes > 0)
+		printf(" %10.1f MB/s", (double)bytes * 1e3 / ns_per_op);
+	printf("\n");
+}
+
+/* Kernel code which asserts needs this; a benchmark tripping it is broken */
+void
+_panic(const char* file, const char* func, int line, const char* fmt, ...)
+{
+	va_list va;
+	fprintf(stderr, "panic: %s:%d (%s): ", file, line, func);
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+void bench_struct();
+void bench_libkern();
+
+int
+main(int argc, char* argv[])
+{
+	if (argc > 1)
+		bench_filter = argv[1];
+
+	bench_struct();
+	bench_libkern();
+	return 0;
+}
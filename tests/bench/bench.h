@@ -0,0 +1,23 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+
+/*
+ * Benchmarks are functions which perform a given number of iterations of
+ * whatever they measure; bench_run() times them and reports the time taken
+ * per iteration, the number of iterations per second and, if the benchmark
+ * processes a known number of bytes per iteration, the bandwidth.
+ */
+typedef void bench_func_t(unsigned int iterations, void* arg);
+
+void bench_run(const char* name, bench_func_t* func, void* arg, unsigned int iterations, size_t bytes);
+
+/* Only benchmarks whose name contains this are run; NULL runs everything */
+extern const char* bench_filter;
+
+/* Keeps the compiler from optimizing away work whose result is never used */
+#define BENCH_USE(x) \
+	__asm __volatile("" : : "g" (x) : "memory")
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "bench.h"
+
+/*
+ * The kernel's string functions are built with a 'k' prefix, so that we
+ * measure them rather than the host's. The kernel picks the 'rep movsb'
+ * variants based on the CPU; we run both, so make sure the host has ERMS
+ * before believing the numbers of the latter.
+ */
+void* kmemcpy(void* dst, const void* src, size_t len);
+void* kmemmove(void* dst, const void* src, size_t len);
+void* kmemset(void* b, int c, size_t len);
+void memcpy_pages(void* dst, const void* src, size_t len, int flags);
+void memzero_pages(void* dst, size_t len, int flags);
+extern int lib_string_flags;
+
+#define LIB_STRING_ERMS		(1 << 0)
+#define PAGEMEM_NONTEMPORAL	(1 << 0)
+
+/* Large enough not to fit in most caches */
+#define BENCH_BUF_SIZE		(8 * 1024 * 1024)
+
+struct LIBKERN_ARG {
+	char*	src;
+	char*	dst;
+	size_t	len;
+	size_t	offset;	/* applied to the source, to measure unaligned copies */
+	int	flags;
+};
+
+static void
+bench_memcpy(unsigned int iterations, void* arg)
+{
+	struct LIBKERN_ARG* la = arg;
+	for (unsigned int n = 0; n < iterations; n++)
+		kmemcpy(la->dst, la->src + la->offset, la->len);
+}
+
+static void
+bench_memmove(unsigned int iterations, void* arg)
+{
+	struct LIBKERN_ARG* la = arg;
+	/* Overlapping with the destination after the source forces a backwards copy */
+	for (unsigned int n = 0; n < iterations; n++)
+		kmemmove(la->dst + 8, la->dst, la->len);
+}
+
+static void
+bench_memset(unsigned int iterations, void* arg)
+{
+	struct LIBKERN_ARG* la = arg;
+	for (unsigned int n = 0; n < iterations; n++)
+		kmemset(la->dst, n, la->len);
+}
+
+static void
+bench_memcpy_pages(unsigned int iterations, void* arg)
+{
+	struct LIBKERN_ARG* la = arg;
+	for (unsigned int n = 0; n < iterations; n++)
+		memcpy_pages(la->dst, la->src, la->len, la->flags);
+}
+
+static void
+bench_memzero_pages(unsigned int iterations, void* arg)
+{
+	struct LIBKERN_ARG* la = arg;
+	for (unsigned int n = 0; n < iterations; n++)
+		memzero_pages(la->dst, la->len, la->flags);
+}
+
+static void
+bench_copy_sizes(const char* prefix, struct LIBKERN_ARG* la)
+{
+	static const size_t sizes[] = { 16, 128, 4096, 65536, BENCH_BUF_SIZE - 64 };
+	char name[64];
+	for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		la->len = sizes[n];
+		unsigned int iterations = (unsigned int)(((size_t)256 * 1024 * 1024) / la->len);
+
+		la->offset = 0;
+		snprintf(name, sizeof(name), "%smemcpy_%zu", prefix, la->len);
+		bench_run(name, bench_memcpy, la, iterations, la->len);
+		la->offset = 3;
+		snprintf(name, sizeof(name), "%smemcpy_%zu_unaligned", prefix, la->len);
+		bench_run(name, bench_memcpy, la, iterations, la->len);
+		snprintf(name, sizeof(name), "%smemset_%zu", prefix, la->len);
+		bench_run(name, bench_memset, la, iterations, la->len);
+	}
+}
+
+void
+bench_libkern()
+{
+	struct LIBKERN_ARG la;
+	int err = posix_memalign((void**)&la.src, 4096, BENCH_BUF_SIZE);
+	err |= posix_memalign((void**)&la.dst, 4096, BENCH_BUF_SIZE);
+	assert(err == 0);
+	memset(la.src, 0x5a, BENCH_BUF_SIZE);
+	memset(la.dst, 0xa5, BENCH_BUF_SIZE);
+
+	lib_string_flags = 0;
+	bench_copy_sizes("", &la);
+	la.len = 4096;
+	bench_run("memmove_4096_backwards", bench_memmove, &la, 100000, la.len);
+
+	lib_string_flags = LIB_STRING_ERMS;
+	bench_copy_sizes("erms_", &la);
+	lib_string_flags = 0;
+
+	/* Page copies are done over the whole buffer, like a fork would */
+	la.len = BENCH_BUF_SIZE;
+	la.flags = 0;
+	bench_run("memcpy_pages_8m", bench_memcpy_pages, &la, 32, la.len);
+	bench_run("memzero_pages_8m", bench_memzero_pages, &la, 32, la.len);
+	la.flags = PAGEMEM_NONTEMPORAL;
+	bench_run("memcpy_pages_8m_nt", bench_memcpy_pages, &la, 32, la.len);
+	bench_run("memzero_pages_8m_nt", bench_memzero_pages, &la, 32, la.len);
+
+	free(la.src);
+	free(la.dst);
+}
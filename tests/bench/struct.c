@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <ananas/cbuffer.h>
+#include <ananas/list.h>
+#include "bench.h"
+
+#define LIST_ITEMS 1024
+
+struct bench_item {
+	int value;
+	LIST_FIELDS(struct bench_item);
+};
+
+LIST_DEFINE(bench_list, struct bench_item);
+
+static struct bench_item list_item[LIST_ITEMS];
+
+static void
+bench_list_append_pop(unsigned int iterations, void* arg)
+{
+	struct bench_list bl;
+	LIST_INIT(&bl);
+	for (unsigned int n = 0; n < iterations; n++) {
+		LIST_APPEND(&bl, &list_item[n % LIST_ITEMS]);
+		struct bench_item* bi = LIST_HEAD(&bl);
+		LIST_POP_HEAD(&bl);
+		BENCH_USE(bi);
+	}
+}
+
+static void
+bench_list_remove_middle(unsigned int iterations, void* arg)
+{
+	struct bench_list bl;
+	LIST_INIT(&bl);
+	for (unsigned int n = 0; n < LIST_ITEMS; n++)
+		LIST_APPEND(&bl, &list_item[n]);
+
+	/* Remove an item from the middle and put it back at the end */
+	for (unsigned int n = 0; n < iterations; n++) {
+		struct bench_item* bi = &list_item[(n * 7) % LIST_ITEMS];
+		LIST_REMOVE(&bl, bi);
+		LIST_APPEND(&bl, bi);
+	}
+}
+
+static void
+bench_list_foreach(unsigned int iterations, void* arg)
+{
+	struct bench_list bl;
+	LIST_INIT(&bl);
+	for (unsigned int n = 0; n < LIST_ITEMS; n++) {
+		list_item[n].value = n;
+		LIST_APPEND(&bl, &list_item[n]);
+	}
+
+	for (unsigned int n = 0; n < iterations; n++) {
+		int sum = 0;
+		LIST_FOREACH(&bl, bi, struct bench_item) {
+			sum += bi->value;
+		}
+		BENCH_USE(sum);
+	}
+}
+
+CBUFFER_DEFINE(bench_cbuffer);
+
+struct CBUFFER_ARG {
+	size_t	len;
+	char*	storage;
+	char	data[256];
+};
+
+static void
+bench_cbuffer_rw(unsigned int iterations, void* arg)
+{
+	struct CBUFFER_ARG* ca = arg;
+	struct bench_cbuffer cb;
+	CBUFFER_INIT(&cb, ca->storage, 4096);
+
+	/* Write and read back, so that the buffer keeps wrapping around */
+	for (unsigned int n = 0; n < iterations; n++) {
+		size_t nw = CBUFFER_WRITE(&cb, ca->data, ca->len);
+		size_t nr = CBUFFER_READ(&cb, ca->data, ca->len);
+		BENCH_USE(nw + nr);
+	}
+}
+
+void
+bench_struct()
+{
+	bench_run("list_append_pop", bench_list_append_pop, NULL, 10000000, 0);
+	bench_run("list_remove_middle", bench_list_remove_middle, NULL, 10000000, 0);
+	bench_run("list_foreach_1024", bench_list_foreach, NULL, 10000, 0);
+
+	struct CBUFFER_ARG ca;
+	ca.storage = malloc(4096);
+	assert(ca.storage != NULL);
+	for (size_t n = 0; n < sizeof(ca.data); n++)
+		ca.data[n] = (char)n;
+
+	ca.len = 1;
+	bench_run("cbuffer_rw_1", bench_cbuffer_rw, &ca, 10000000, 2 * ca.len);
+	ca.len = 64;
+	bench_run("cbuffer_rw_64", bench_cbuffer_rw, &ca, 1000000, 2 * ca.len);
+	ca.len = 256;
+	bench_run("cbuffer_rw_256", bench_cbuffer_rw, &ca, 1000000, 2 * ca.len);
+	free(ca.storage);
+}
@@ -95,4 +95,56 @@ cbuffer_test()
 	free(buf_storage);
 }
 
+void
+spsc_ring_test()
+{
+	char* buf_storage = malloc(TEST_BUF_SIZE);
+	assert(buf_storage != NULL);
+
+	struct SPSC_RING sr;
+	spsc_ring_init(&sr, buf_storage, TEST_BUF_SIZE);
+
+	/* Initially, ring must be empty */
+	EXPECT(spsc_ring_data_left(&sr) == 0);
+	EXPECT(spsc_ring_space_left(&sr) == TEST_BUF_SIZE);
+
+	/* Unlike a cbuffer, the entire ring can be filled */
+	{
+		char testbuf[TEST_BUF_SIZE + 1];
+		for (unsigned int i = 0; i < TEST_BUF_SIZE + 1; i++)
+			testbuf[i] = (char)i;
+		size_t nw = spsc_ring_write(&sr, testbuf, TEST_BUF_SIZE + 1);
+		EXPECT(nw == TEST_BUF_SIZE);
+		EXPECT(spsc_ring_space_left(&sr) == 0);
+
+		char tempbuf[TEST_BUF_SIZE];
+		size_t nr = spsc_ring_read(&sr, tempbuf, TEST_BUF_SIZE);
+		EXPECT(nr == TEST_BUF_SIZE);
+		EXPECT(memcmp(testbuf, tempbuf, TEST_BUF_SIZE) == 0);
+		EXPECT(spsc_ring_data_left(&sr) == 0);
+	}
+
+	/* Writes and reads that wrap around the end of the buffer */
+	{
+		char testbuf[TEST_BUF_SIZE / 2 + 3];
+		char tempbuf[TEST_BUF_SIZE / 2 + 3];
+		for (unsigned int n = 0; n < 10; n++) {
+			for (unsigned int i = 0; i < sizeof(testbuf); i++)
+				testbuf[i] = (char)(n + i);
+			EXPECT(spsc_ring_write(&sr, testbuf, sizeof(testbuf)) == sizeof(testbuf));
+			EXPECT(spsc_ring_data_left(&sr) == sizeof(testbuf));
+			EXPECT(spsc_ring_read(&sr, tempbuf, sizeof(tempbuf)) == sizeof(tempbuf));
+			EXPECT(memcmp(testbuf, tempbuf, sizeof(testbuf)) == 0);
+		}
+	}
+
+	/* Reading from an empty ring yields nothing */
+	{
+		char ch;
+		EXPECT(spsc_ring_read(&sr, &ch, 1) == 0);
+	}
+
+	free(buf_storage);
+}
+
 /* vim:set ts=2 sw=2: */
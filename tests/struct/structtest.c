@@ -3,6 +3,7 @@
 void queue_test();
 void dqueue_test();
 void cbuffer_test();
+void spsc_ring_test();
 
 int
 main()
@@ -11,6 +12,7 @@ main()
 	queue_test();
 	dqueue_test();
 	cbuffer_test();
+	spsc_ring_test();
 	framework_done();
 	return 0;
 }
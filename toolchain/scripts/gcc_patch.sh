@@ -77,8 +77,13 @@ crtbegin.o%s				\
 crtend.o%s crtn.o%s			\
 "
 
+/*
+ * The runtime linker is only used if the program ends up being linked
+ * against shared libraries.
+ */
 #undef LINK_SPEC
 #define LINK_SPEC " \
+%{!shared:%{!static:-dynamic-linker /lib/ld-ananas.so}} \
 "
 
 #undef LIB_SPEC